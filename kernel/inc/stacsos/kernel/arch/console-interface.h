@@ -17,6 +17,11 @@ public:
 
 	virtual void write_char(unsigned char c, u8 attr) = 0;
 
+	/**
+	 * @brief Sends on anything the console has been holding on to, for a console that writes in batches.
+	 */
+	virtual void flush() { }
+
 	void write(const char *text)
 	{
 		while (*text) {
@@ -44,6 +44,7 @@ struct core_enumerator {
 
 		core_iterator &operator++()
 		{
+			off_++;
 			progress();
 			return *this;
 		}
@@ -80,6 +81,7 @@ public:
 
 	core_manager()
 		: nr_cores_(0)
+		, isolated_mask_(0)
 	{
 		for (int i = 0; i < max_cores; i++) {
 			cores_[i] = nullptr;
@@ -97,6 +99,15 @@ public:
 		return *cores_[id];
 	}
 
+	core *try_get_core(int id) const
+	{
+		if (id < 0 || id >= max_cores) {
+			return nullptr;
+		}
+
+		return cores_[id];
+	}
+
 	core &get_boot_core() const { return get_core(0); }
 
 	void register_core(core &c);
@@ -105,8 +116,21 @@ public:
 
 	core_enumerator cores() { return core_enumerator(cores_, max_cores); }
 
+	int nr_cores() const { return nr_cores_; }
+
+	/**
+	 * @brief The cores given in the isolcpus option (e.g. isolcpus=2,3 or isolcpus=2-3), which are kept for threads
+	 * that are pinned to them.  Nothing else is placed there, and they do none of the kernel's housekeeping, such as
+	 * firing timers or running deferred work.  The boot core is never isolated.
+	 */
+	u64 isolated_mask() const { return isolated_mask_; }
+	bool is_isolated(int id) const { return id >= 0 && id < max_cores && (isolated_mask_ & (1ull << id)); }
+
 private:
 	core *cores_[max_cores];
 	int nr_cores_;
+	u64 isolated_mask_;
+
+	void parse_isolated_cores(const char *list);
 };
 } // namespace stacsos::kernel::arch
@@ -8,9 +8,14 @@
 #pragma once
 
 #include <stacsos/kernel/arch/irq-manager.h>
+#include <stacsos/kernel/arch/percpu.h>
 #include <stacsos/kernel/arch/x86/msr.h>
 #include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/alg/cfs.h>
+#include <stacsos/kernel/sched/alg/edf.h>
+#include <stacsos/kernel/sched/alg/pcs.h>
 #include <stacsos/kernel/sched/alg/rr.h>
 #include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
 #include <stacsos/kernel/sched/alg/sfs.h>
@@ -29,7 +34,10 @@ class core {
 	friend class core_manager;
 
 public:
-	static int this_core_id() { return (int)x86::msrs::ia32_tsc_aux; }
+	static const u64 tick_frequency = 100; // Hz
+	static const u64 tickless_idle_poll_ms = 100; // How often an idle tickless core looks for work to steal
+
+	static int this_core_id() { return current_core_id(); }
 
 	static core &this_core();
 
@@ -38,11 +46,31 @@ public:
 		, status_(core_status::offline)
 		, irqs_(*this)
 		, sched_alg_(nullptr)
+		, running_(nullptr)
+		, migrating_(nullptr)
+		, fpu_owner_(nullptr)
+		, wake_list_(nullptr)
+		, quantum_ms_(0)
+		, quantum_ticks_(1)
+		, slice_ticks_(0)
+		, need_resched_(false)
+		, tickless_(false)
+		, quantum_tsc_(0)
+		, slice_end_(0)
+		, isolated_(false)
+		, tick_stopped_(false)
+		, gang_(nullptr)
+		, gang_until_(0)
 		, clock_(0)
 		, last_clock_(0)
+		, last_stolen_(0)
+		, migration_cost_tsc_(0)
 	{
 		idle_thread_.entity = nullptr;
 		idle_thread_.mcontext = nullptr;
+		idle_thread_.fpu_state = nullptr;
+		idle_thread_.perf_state = nullptr;
+		idle_thread_.gang = nullptr;
 
 		//*new alg::simple_fair_scheduler()
 
@@ -55,11 +83,22 @@ public:
 			sched_alg_ = new alg::simple_fair_scheduler();
 		} else if (memops::strcmp(sched_alg_name, "rr") == 0) {
 			sched_alg_ = new alg::round_robin();
+		} else if (memops::strcmp(sched_alg_name, "cfs") == 0) {
+			sched_alg_ = new alg::completely_fair_scheduler();
+		} else if (memops::strcmp(sched_alg_name, "edf") == 0) {
+			sched_alg_ = new alg::earliest_deadline_first();
 		} else {
 			panic("Unsupported scheduling algorithm '%s'", sched_alg_name);
 		}
 
-		dprintf("core: using scheduling algorithm: %s\n", sched_alg_->name());
+		// Real-time tasks are scheduled ahead of the chosen algorithm.
+		sched_alg_ = new alg::priority_class_scheduler(sched_alg_);
+
+		// The quantum is enforced at tick granularity, so it is always at least one tick.
+		quantum_ms_ = config::get().get_option_u64_or_default("quantum", sched_alg_->default_quantum_ms());
+		quantum_ticks_ = max((quantum_ms_ * tick_frequency) / 1000, 1ull);
+
+		dprintf("core: using scheduling algorithm: %s, quantum %llu ms\n", sched_alg_->name(), quantum_ms_);
 	}
 
 	int id() const { return id_; }
@@ -69,18 +108,137 @@ public:
 	virtual bool remote_run() = 0;
 	__noreturn void run();
 
+	/**
+	 * @brief Changes the length of the time slices the core gives tasks, from the next one it starts.
+	 */
+	void set_quantum(u64 ms);
+
+	/**
+	 * @brief Registers the scheduler's runtime tunables, which change every core at once.
+	 */
+	static void add_tunables();
+
 	virtual timer &local_timer() = 0;
+	virtual u64 timestamp_frequency() = 0;
+
+	/**
+	 * @brief Converts timestamp counter ticks to nanoseconds, without overflowing for any plausible length of time.
+	 */
+	u64 timestamp_to_ns(u64 ticks)
+	{
+		u64 freq = timestamp_frequency();
+		return ((ticks / freq) * 1'000'000'000ull) + (((ticks % freq) * 1'000'000'000ull) / freq);
+	}
+
+	/**
+	 * @brief The time (in timestamp counter ticks) that this core has been kept from running by whatever it is
+	 * running on, e.g. the host, when it is a virtual machine.  Only this core may ask.
+	 */
+	virtual u64 stolen_time() = 0;
+
+	/**
+	 * @brief Interrupts this core (from another core), causing it to reschedule.
+	 */
+	virtual void kick() = 0;
+
+	/**
+	 * @brief Called by the core's idle thread, with interrupts enabled, to wait until there may be something to do.
+	 */
+	virtual void idle() = 0;
+
+	/**
+	 * @brief Makes a task runnable on this core.  A task woken up by another core is queued for this core to pick
+	 * up when it is interrupted, rather than the waking core taking the run queue lock, so that wake-ups don't
+	 * contend with this core's own scheduling.
+	 */
+	void add_to_runqueue(tcb &tcb);
 
-	void add_to_runqueue(tcb &tcb) { sched_alg_->add_to_runqueue(tcb); }
-	void remove_from_runqueue(tcb &tcb) { sched_alg_->remove_from_runqueue(tcb); }
+	/**
+	 * @brief Called when this core is interrupted by another, to take in any queued wake-ups, and to reschedule if
+	 * that (or whatever else the other core did) requires it.
+	 */
+	void handle_kick();
+
+	/**
+	 * @brief As handle_kick, but for a kick that reached the core while idle() was waiting, without interrupting it.
+	 * Called from the idle thread, rather than an interrupt handler.
+	 */
+	void handle_idle_kick();
+
+	/**
+	 * @brief Returns true if the task running here should give way: another task has been made runnable here (which
+	 * may not have interrupted it yet), or its time slice is over (even if no tick has been able to say so).  Only
+	 * this core may ask.
+	 */
+	bool resched_due() const
+	{
+		return need_resched_ || __atomic_load_n(&wake_list_, __ATOMIC_RELAXED) || __builtin_ia32_rdtsc() >= slice_end_;
+	}
+
+	bool remove_from_runqueue(tcb &tcb);
+
+	/**
+	 * @brief Called before the TCB of a terminated task is freed, so that another task later given the same memory
+	 * isn't mistaken for it.
+	 */
+	void forget_task(const tcb &t)
+	{
+		tcb *expected = (tcb *)&t;
+		__atomic_compare_exchange_n(&fpu_owner_, &expected, nullptr, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	bool set_priority(tcb &tcb, sched_policy policy, int priority);
+	bool set_reservation(tcb &tcb, u64 runtime, u64 period, bool &admitted);
+
+	/**
+	 * @brief Makes this core reschedule as soon as possible, rather than at the end of the current time slice.
+	 */
+	void request_resched()
+	{
+		unique_irq_lock l(runqueue_lock_);
+		need_resched_ = true;
+
+		if (this_core_id() != id_) {
+			kick();
+		}
+	}
+
+	/**
+	 * @brief Asks this core to run a task of the given gang, which has just been given a time slice on another core,
+	 * until the end of that slice.  The core reschedules straight away, unless it is running a real-time task, or a
+	 * task of a gang of its own.
+	 */
+	void co_schedule(const void *gang, u64 until);
+
+	unsigned int nr_runnable() const { return sched_alg_->nr_runnable(); }
+
+	/**
+	 * @brief Called on this core, with interrupts disabled, when a timer is added that is due before any other, so
+	 * that a tickless core can bring its next timer interrupt forward for it.
+	 */
+	void timer_added();
 
 	void schedule();
+	void tick();
+
+	/**
+	 * @brief Gives up this core, for a task that is blocking (or yielding) in the kernel.  Rather than raising
+	 * an interrupt to get to schedule(), this switches directly to the next task, saving only the registers
+	 * that a function call would preserve.  Must not be called from an interrupt handler.
+	 */
+	void reschedule();
 
 	virtual void set_current_tcb(const tcb *tcb) = 0;
 	virtual tcb *get_current_tcb() = 0;
 
 	core_status status() const { return status_; }
 
+	/**
+	 * @brief Returns true if this core was given in the isolcpus option, in which case it only runs the tasks pinned
+	 * to it, and leaves the kernel's housekeeping to the other cores.
+	 */
+	bool isolated() const { return isolated_; }
+
 	irq_manager &irqs() { return irqs_; }
 	const irq_manager &irqs() const { return irqs_; }
 
@@ -94,7 +252,70 @@ private:
 	tcb idle_thread_;
 	alg::scheduling_algorithm *sched_alg_;
 
+	// Protects the run queue, which other cores manipulate when they wake up threads owned by this core,
+	// or steal work from it.
+	spinlock_irq runqueue_lock_;
+
+	// The task most recently selected by this core, which must not be stolen by another core.
+	tcb *running_;
+
+	// A task that has been taken off the run queue because its affinity no longer allows it here, but
+	// that may still be running on this core, so can't be handed to another core until it has been
+	// switched out.
+	tcb *migrating_;
+
+	// The task whose extended register state was last loaded on this core.  The registers still hold it after the
+	// task is switched out, until another task with an extended state runs here.
+	tcb *fpu_owner_;
+
+	// Tasks woken up by other cores, waiting to be put on the run queue, most recently woken first.
+	tcb *wake_list_;
+
+	void enqueue_task(tcb &tcb);
+	void drain_wake_list();
+
+	// The length of a time slice, the number of ticks remaining in the current one, and whether
+	// the current task must be switched out at the next tick regardless.
+	u64 quantum_ms_;
+	u64 quantum_ticks_;
+	u64 slice_ticks_;
+	bool need_resched_;
+
+	// In tickless mode, the timer is programmed for the end of the current time slice, or the next timer
+	// event, whichever is sooner, instead of ticking periodically.
+	bool tickless_;
+	u64 quantum_tsc_;
+	u64 slice_end_;
+
+	void program_next_event(u64 now);
+
+	// An isolated core stops its timer altogether while it has exactly one task to run, as there's nothing to switch
+	// to, and it doesn't fire timers.  Anything that makes another task runnable here starts it again.
+	bool isolated_;
+	bool tick_stopped_;
+
+	void restart_tick(u64 now);
+
+	// The gang that another core has asked this core to run a task of at its next schedule, and the time at which the
+	// other core's slice for it ends.
+	const void *gang_;
+	u64 gang_until_;
+
 	u64 clock_;
 	u64 last_clock_;
+
+	// The stolen time as of the last schedule, which is taken off the running task's time since then.
+	u64 last_stolen_;
+
+	// A task that ran less than this long ago is left where it is by work stealing, rather than losing what it has in
+	// its core's caches.
+	u64 migration_cost_tsc_;
+
+	core *find_busiest_core();
+	tcb *steal_task(core &victim, tcb *current);
+	void push_migrating(tcb *current);
+
+	tcb *pick_next_task(tcb *current);
+	void activate(tcb *current, tcb *next);
 };
 } // namespace stacsos::kernel::arch
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+namespace stacsos::kernel::arch {
+/**
+ * @brief Returns the ID of the core this is running on.  %gs always points at the control block of the current task,
+ * which is stamped with the ID of the core it is running on as it is switched in, so this is a single load, rather
+ * than an MSR read.
+ *
+ * As with anything per-core, the answer is only good for as long as the caller can't be moved to another core, e.g.
+ * while interrupts are disabled.
+ */
+static inline int current_core_id()
+{
+	u32 id;
+	asm volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(sched::tcb, core_id)));
+	return (int)id;
+}
+
+/**
+ * @brief One T for each core.  Each core's T is on its own cache lines, so cores updating their own never contend
+ * for them.
+ */
+template <class T> class percpu {
+	struct alignas(64) slot {
+		T value;
+	};
+
+public:
+	/**
+	 * @brief The T of the core this is running on.
+	 */
+	T &get() { return slots_[current_core_id()].value; }
+
+	T &operator[](int core_id) { return slots_[core_id].value; }
+	const T &operator[](int core_id) const { return slots_[core_id].value; }
+
+	template <class S> class iterator {
+	public:
+		iterator(S *slot)
+			: slot_(slot)
+		{
+		}
+
+		auto &operator*() const { return slot_->value; }
+
+		void operator++() { slot_++; }
+
+		bool operator!=(const iterator &other) const { return slot_ != other.slot_; }
+
+	private:
+		S *slot_;
+	};
+
+	/**
+	 * @brief Iterates over the T of every core, whether or not the core is online.
+	 */
+	iterator<slot> begin() { return iterator<slot>(slots_); }
+	iterator<slot> end() { return iterator<slot>(slots_ + core_manager::max_cores); }
+	iterator<const slot> begin() const { return iterator<const slot>(slots_); }
+	iterator<const slot> end() const { return iterator<const slot>(slots_ + core_manager::max_cores); }
+
+private:
+	slot slots_[core_manager::max_cores];
+};
+} // namespace stacsos::kernel::arch
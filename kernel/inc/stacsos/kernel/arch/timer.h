@@ -30,6 +30,22 @@ public:
 	virtual void start(u64 period) = 0;
 	virtual void stop() = 0;
 
+	/**
+	 * @brief Returns true if the timer can be programmed to fire once at an absolute timestamp.
+	 */
+	virtual bool supports_deadline() const = 0;
+
+	/**
+	 * @brief Switches the timer into deadline mode, after which it only fires when set_deadline is called.
+	 */
+	virtual void start_deadline() = 0;
+
+	/**
+	 * @brief Arms the timer to fire once the timestamp counter reaches the given value.  A deadline in
+	 * the past fires immediately.
+	 */
+	virtual void set_deadline(u64 deadline) = 0;
+
 private:
 	timer_callback cb_;
 	void *cb_arg_;
@@ -61,6 +61,9 @@ feature(f16c, 1, ecx, 29)
 feature(rdrnd, 1, ecx, 30)
 feature(hypervisor, 1, ecx, 31)
 
+feature(mwait_ext, 5, ecx, 0)
+feature(mwait_irq_break, 5, ecx, 1)
+
 feature2(fsgsbase, 7, 0, ebx, 0)
 feature2(sgx, 7, 0, ebx, 2)
 feature2(bmi1, 7, 0, ebx, 3)
@@ -73,3 +76,5 @@ feature2(invpcid, 7, 0, ebx, 10)
 feature2(rtm, 7, 0, ebx, 11)
 feature2(pqm, 7, 0, ebx, 12)
 feature2(mpx, 7, 0, ebx, 14)
+
+feature2(xsaveopt, 0xd, 1, eax, 0)
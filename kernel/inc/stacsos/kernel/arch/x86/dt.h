@@ -328,6 +328,12 @@ public:
 	bool register_interrupt_gate(int index, uintptr_t addr, u16 seg, descriptor_privilege_level dpl);
 	bool register_trap_gate(int index, uintptr_t addr, u16 seg, descriptor_privilege_level dpl);
 
+	/**
+	 * @brief Makes the gate at the given index switch to one of the TSS's interrupt stacks, or (with zero) stay on
+	 * the current stack.
+	 */
+	void set_interrupt_stack(int index, u8 ist);
+
 	void *ptr() const { return (void *)&idt_[0]; }
 
 private:
@@ -350,6 +356,12 @@ public:
 
 	void set_kernel_stack(uintptr_t stack);
 
+	/**
+	 * @brief Sets one of the interrupt stacks (numbered from 1 to 7), which a gate can switch to regardless of the
+	 * privilege level it was taken at.
+	 */
+	void set_interrupt_stack(int ist, uintptr_t stack);
+
 	void *ptr() const { return (void *)&tss_[0]; }
 
 private:
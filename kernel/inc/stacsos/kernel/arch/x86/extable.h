@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::arch::x86 {
+/**
+ * @brief An instruction that is allowed to fault, and where to carry on if it does.  Entries are emitted into the
+ * __ex_table section, next to the code they cover.
+ */
+struct extable_entry {
+	u64 fault_ip;
+	u64 fixup_ip;
+};
+
+class extable {
+public:
+	/**
+	 * @brief Returns the fixup for a faulting instruction, or zero if the instruction isn't allowed to fault.
+	 */
+	static u64 find_fixup(u64 fault_ip);
+};
+} // namespace stacsos::kernel::arch::x86
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::arch::x86 {
+
+enum class fpu_save_mode { fxsave, xsave, xsaveopt };
+
+/**
+ * @brief Saves and restores the extended (x87, SSE and AVX) register state of user threads.  The kernel itself is
+ * built without any floating-point or SIMD instructions, so the state only changes when a user thread is running,
+ * and only needs to be switched when a different user thread runs.
+ */
+class fpu {
+public:
+	/**
+	 * @brief Enables the extended state on the calling core.  This must be called on every core, and the first call
+	 * also works out the size and layout of the state area from CPUID leaf 0xD.
+	 */
+	static void init_core();
+
+	static fpu_save_mode mode() { return mode_; }
+	static u32 state_size() { return state_size_; }
+
+	/**
+	 * @brief Allocates a state area for a new thread, holding the state that a freshly reset FPU would have.
+	 */
+	static void *create_state();
+	static void destroy_state(void *state);
+
+	static void save(void *state)
+	{
+		switch (mode_) {
+		case fpu_save_mode::xsaveopt:
+			// Only writes out the components that have changed since the area was last restored from.
+			asm volatile("xsaveopt64 (%0)" ::"r"(state), "a"((u32)xcr0_), "d"((u32)(xcr0_ >> 32)) : "memory");
+			break;
+
+		case fpu_save_mode::xsave:
+			asm volatile("xsave64 (%0)" ::"r"(state), "a"((u32)xcr0_), "d"((u32)(xcr0_ >> 32)) : "memory");
+			break;
+
+		case fpu_save_mode::fxsave:
+			asm volatile("fxsave64 (%0)" ::"r"(state) : "memory");
+			break;
+		}
+	}
+
+	static void restore(const void *state)
+	{
+		if (mode_ == fpu_save_mode::fxsave) {
+			asm volatile("fxrstor64 (%0)" ::"r"(state) : "memory");
+		} else {
+			asm volatile("xrstor64 (%0)" ::"r"(state), "a"((u32)xcr0_), "d"((u32)(xcr0_ >> 32)) : "memory");
+		}
+	}
+
+private:
+	static fpu_save_mode mode_;
+	static u64 xcr0_;
+	static u32 state_size_;
+	static void *initial_state_;
+
+	static void benchmark();
+};
+} // namespace stacsos::kernel::arch::x86
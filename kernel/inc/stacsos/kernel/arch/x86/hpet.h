@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::arch::x86 {
+/**
+ * @brief The High Precision Event Timer's main counter, which the TSC is calibrated against when CPUID doesn't say how
+ * fast it runs.  ACPI says where it is.  None of its comparators are used.
+ */
+class hpet {
+	DEFINE_SINGLETON(hpet)
+
+public:
+	/**
+	 * @brief Sets up the HPET whose registers are at the given physical address, and starts its counter if it isn't
+	 * running already.
+	 */
+	void init(u64 base_address);
+
+	bool present() const { return regs_ != nullptr; }
+
+	u64 read() const { return regs_[main_counter_reg]; }
+
+	/**
+	 * @brief How many times a second the main counter ticks.
+	 */
+	u64 frequency() const { return frequency_; }
+
+private:
+	hpet()
+		: regs_(nullptr)
+		, frequency_(0)
+	{
+	}
+
+	// Register indices, in 64-bit words.
+	static const int capabilities_reg = 0x00 / 8;
+	static const int configuration_reg = 0x10 / 8;
+	static const int main_counter_reg = 0xf0 / 8;
+
+	volatile u64 *regs_;
+	u64 frequency_;
+};
+} // namespace stacsos::kernel::arch::x86
@@ -21,7 +21,12 @@ public:
 
 	void initialise();
 
-	void allocate_physical_irq(u32 phys_irq_nr, x86_core &target_core, irq::irq_handler_fn handler_fn, void *handler_fn_arg = nullptr);
+	/**
+	 * @brief Delivers a physical interrupt to a newly allocated vector on the target core, from where it can be moved
+	 * to another core with irq_affinity.
+	 */
+	void allocate_physical_irq(
+		u32 phys_irq_nr, x86_core &target_core, irq::irq_handler_fn handler_fn, void *handler_fn_arg = nullptr, const char *name = nullptr);
 	void map_physical_irq(u32 phys_irq_nr, x86_core &target_core, u8 target_irq_nr);
 
 private:
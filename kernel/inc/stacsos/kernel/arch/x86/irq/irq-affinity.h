@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/x86/irq/irq-manager.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/mutex.h>
+
+namespace stacsos::kernel::arch::x86 {
+class x86_core;
+}
+
+namespace stacsos::kernel::arch::x86::irq {
+/**
+ * @brief A device interrupt that is delivered to a vector on one core, and can be moved to another.  Subclasses know
+ * how to point the interrupt at a vector: through an I/O APIC redirection entry, or a device's MSI registers.
+ */
+class irq_source {
+	friend class irq_affinity;
+
+public:
+	irq_source(const char *name, irq_handler_fn handler, void *arg)
+		: name_(name)
+		, handler_(handler)
+		, arg_(arg)
+		, id_(0)
+		, core_id_(-1)
+		, vector_(0)
+	{
+	}
+
+	virtual ~irq_source() { }
+
+	const char *name() const { return name_; }
+	unsigned int id() const { return id_; }
+	int core_id() const { return __atomic_load_n(&core_id_, __ATOMIC_RELAXED); }
+	u8 vector() const { return __atomic_load_n(&vector_, __ATOMIC_RELAXED); }
+
+protected:
+	/**
+	 * @brief Sends the interrupt to the vector on the target core from now on.
+	 */
+	virtual void route(x86_core &target, u8 vector) = 0;
+
+private:
+	const char *name_;
+	irq_handler_fn handler_;
+	void *arg_;
+	unsigned int id_;
+	int core_id_;
+	u8 vector_;
+};
+
+/**
+ * @brief Keeps track of which core each device interrupt is delivered to, so that interrupts can be moved off cores
+ * that should be left to run latency-sensitive work.  Sources are numbered in the order they are added, and are never
+ * taken away.
+ */
+class irq_affinity {
+	DEFINE_SINGLETON(irq_affinity)
+
+private:
+	irq_affinity()
+		: nr_sources_(0)
+	{
+	}
+
+public:
+	static const unsigned int max_sources = 64;
+
+	/**
+	 * @brief Allocates a vector for the source on the target core, and routes the interrupt to it.  Returns false if
+	 * there are too many sources to keep track of another, in which case the interrupt stays where it is.
+	 */
+	bool add(irq_source &source, x86_core &target);
+
+	/**
+	 * @brief Moves a source's interrupt to another online core.  Returns false if there is no such source or core.
+	 */
+	bool set_affinity(unsigned int source_id, int core_id);
+
+	unsigned int nr_sources() const { return __atomic_load_n(&nr_sources_, __ATOMIC_ACQUIRE); }
+	irq_source *source(unsigned int source_id) const { return source_id < nr_sources() ? sources_[source_id] : nullptr; }
+
+private:
+	// Only ever appended to, with the count published after the entry.
+	irq_source *sources_[max_sources];
+	unsigned int nr_sources_;
+	spinlock_irq add_lock_;
+
+	sched::mutex move_lock_;
+};
+} // namespace stacsos::kernel::arch::x86::irq
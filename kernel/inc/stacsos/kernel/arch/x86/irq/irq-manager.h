@@ -9,6 +9,7 @@
 
 #include <stacsos/bitset.h>
 #include <stacsos/kernel/arch/x86/dt.h>
+#include <stacsos/kernel/lock.h>
 
 namespace stacsos::kernel::arch::x86::irq {
 using irq_handler_fn = void (*)(u8 irq, void *ctx, void *arg);
@@ -22,15 +23,47 @@ public:
 
 	void initialise();
 
-	u8 allocate_irq(irq_handler_fn handler, void *arg);
-	void reserve_irq(u8 irq_number, irq_handler_fn handler, void *arg);
-	void assign_irq(u8 irq_number, irq_handler_fn handler, void *arg);
-	void handle_irq(u8 irq_number, void *mcontext) { handlers_[irq_number](irq_number, mcontext, handler_args_[irq_number]); }
+	u8 allocate_irq(irq_handler_fn handler, void *arg, const char *name = nullptr);
+	void reserve_irq(u8 irq_number, irq_handler_fn handler, void *arg, const char *name = nullptr);
+	void assign_irq(u8 irq_number, irq_handler_fn handler, void *arg, const char *name = nullptr);
+
+	/**
+	 * @brief Reserves a particular vector, if it is free.  Returns false if it isn't.
+	 */
+	bool try_reserve_irq(u8 irq_number, irq_handler_fn handler, void *arg, const char *name = nullptr);
+
+	/**
+	 * @brief Gives back a vector that was allocated or reserved, which raises an unhandled interrupt if it arrives
+	 * again.
+	 */
+	void free_irq(u8 irq_number);
+
+	void handle_irq(u8 irq_number, void *mcontext)
+	{
+		// Only this core writes its counts, so there's no need for a locked increment.
+		__atomic_store_n(&counts_[irq_number], counts_[irq_number] + 1, __ATOMIC_RELAXED);
+		handlers_[irq_number](irq_number, mcontext, handler_args_[irq_number]);
+	}
+
+	/**
+	 * @brief The number of times the vector has been raised on this core.
+	 */
+	u64 count(u8 irq_number) const { return __atomic_load_n(&counts_[irq_number], __ATOMIC_RELAXED); }
+
+	/**
+	 * @brief What the vector was allocated for, or null if it wasn't given a name.
+	 */
+	const char *name(u8 irq_number) const { return names_[irq_number]; }
 
 private:
 	interrupt_descriptor_table<NR_IRQS> &idt_;
+
+	// Devices may be set up on several cores at once, and all of them allocate their vectors from the boot core.
+	spinlock_irq lock_;
 	bitset<NR_IRQS> used_irq_;
 	irq_handler_fn handlers_[NR_IRQS];
 	void *handler_args_[NR_IRQS];
+	const char *names_[NR_IRQS];
+	u64 counts_[NR_IRQS];
 };
 } // namespace stacsos::kernel::arch::x86::irq
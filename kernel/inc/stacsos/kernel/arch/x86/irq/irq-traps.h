@@ -268,4 +268,6 @@ DECLARE_IRQ_TRAP(252);
 DECLARE_IRQ_TRAP(253);
 DECLARE_IRQ_TRAP(254);
 DECLARE_IRQ_TRAP(255);
+
+extern void x86_nmi_entry(void);
 }
@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+
+namespace stacsos::kernel::arch::x86 {
+
+// The time the host publishes for a virtual core (kvmclock): the nanoseconds since the guest started, as of
+// tsc_timestamp, and how to scale TSC ticks since then to nanoseconds.  The version is odd while the host is writing.
+struct pvclock_time_info {
+	u32 version;
+	u32 pad0;
+	u64 tsc_timestamp;
+	u64 system_time;
+	u32 tsc_to_system_mul;
+	s8 tsc_shift;
+	u8 flags;
+	u8 pad[2];
+};
+
+// The time the host has run something else while a virtual core was ready to run, in nanoseconds.
+struct kvm_steal_time {
+	u64 steal;
+	u32 version;
+	u32 flags;
+	u8 preempted;
+	u8 pad0[3];
+	u32 pad1[11];
+};
+
+/**
+ * @brief The paravirtual interfaces KVM offers a guest.  Each core registers its own kvmclock and steal time areas
+ * with the host, which keeps them up to date whenever the core is scheduled back in.
+ *
+ * The kvmclock gives the TSC's frequency exactly (as the host's scaling factor), which is used in place of measuring
+ * it, and the steal time is taken off whatever the scheduler charges the task that was running at the time.
+ */
+class kvm {
+public:
+	/**
+	 * @brief Registers the given core's kvmclock and steal time areas, if running under KVM.  Must be called on every
+	 * core, by the core itself, before its TSC is calibrated.
+	 */
+	static void init_core(int core);
+
+	static bool present() { return base_ != 0; }
+
+	/**
+	 * @brief The TSC's frequency, from the bootstrap core's kvmclock, or zero if there isn't one.
+	 */
+	static u64 tsc_frequency() { return tsc_frequency_; }
+
+	/**
+	 * @brief The nanoseconds the host has stolen from the given core, or zero if the host doesn't say.  Only the core
+	 * itself may ask, as the host only updates the count when it schedules the core back in.
+	 */
+	static u64 steal_ns(int core);
+
+private:
+	// The leaf of the hypervisor's CPUID range with KVM's signature, or zero if there is none.
+	static u32 base_;
+	static u32 features_;
+	static u64 tsc_frequency_;
+
+	struct core_areas {
+		pvclock_time_info clock;
+		u8 pad[32];
+		kvm_steal_time steal;
+	};
+
+	static core_areas *areas_[core_manager::max_cores];
+
+	static void detect();
+};
+} // namespace stacsos::kernel::arch::x86
@@ -23,8 +23,18 @@ enum class msr_indicies : unsigned {
 
 	IA32_APIC_BASE = 0x1b,
 	IA32_FEATURE_CONTROL = 0x3a,
+	IA32_TSC_DEADLINE = 0x6e0,
 	IA32_LOCAL_APIC_ID = 0x802,
 
+	// Architectural performance monitoring
+	IA32_PMC0 = 0xc1,
+	IA32_PERFEVTSEL0 = 0x186,
+	IA32_PERF_GLOBAL_STATUS = 0x38e,
+	IA32_PERF_GLOBAL_CTRL = 0x38f,
+	IA32_PERF_GLOBAL_OVF_CTRL = 0x390,
+	IA32_PERF_CAPABILITIES = 0x345,
+	IA32_A_PMC0 = 0x4c1,
+
 	// VMX Controls
 	IA32_VMX_BASIC = 0x480,
 	IA32_VMX_PINBASED_CTLS = 0x481,
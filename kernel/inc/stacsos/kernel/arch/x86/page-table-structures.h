@@ -29,6 +29,10 @@ struct base_entry {
 	bool size() const { return get_bit(7); }
 	void size(bool v) { update_bit(7, v); }
 
+	// Only meaningful in an entry that maps a page.
+	bool g() const { return get_bit(8); }
+	void g(bool v) { update_bit(8, v); }
+
 	bool xd() const { return get_bit(63); }
 
 	u64 base_address() const { return (bits & base_address_mask); }
@@ -37,7 +41,7 @@ struct base_entry {
 
 	void reset() { bits = 0; }
 
-	void dump() const { dprintf("%016lx", bits); }
+	void dump() const { dprintf("%016llx", bits); }
 
 private:
 	static const u64 base_address_mask = ((1ull << 52) - 1ull) & (~0xfffull);
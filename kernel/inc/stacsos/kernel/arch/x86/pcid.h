@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/bitset.h>
+
+namespace stacsos::kernel::arch::x86 {
+
+/**
+ * @brief Process-context identifiers, which tag TLB entries with the address space they belong to, so that switching
+ * between address spaces doesn't have to flush the TLB.  Each user address space is given its own PCID, and PCID 0
+ * is shared by the kernel's address space, and by any address space created once the PCIDs have run out, which are
+ * always flushed when switched to.
+ *
+ * A core may still hold entries for a PCID that has since been given to a new address space, or for mappings that
+ * have since been removed, so each core keeps a set of the PCIDs that must be flushed the next time they're loaded.
+ */
+class pcid {
+public:
+	static const unsigned int max_pcids = 4096;
+
+	/**
+	 * @brief Enables PCIDs (and global pages) on the calling core, if the processor supports them.  This must be
+	 * called on every core, with PCID 0 loaded.
+	 */
+	static void init_core();
+
+	static bool enabled() { return enabled_; }
+
+	/**
+	 * @brief Allocates a PCID for a new address space, or returns 0 if there are none left (or PCIDs aren't enabled).
+	 */
+	static u16 allocate();
+	static void free(u16 id);
+
+	/**
+	 * @brief Returns the value to load into CR3 for the page table at the given (physical) CR3 value, tagged with its
+	 * PCID.  Unless this core may hold stale entries for the PCID, the no-flush bit is set, so that the entries the
+	 * core already has for it are kept.
+	 */
+	static u64 cr3_for(u64 cr3);
+
+	/**
+	 * @brief Makes the given core flush every entry for the PCID the next time it loads it.
+	 */
+	static void mark_stale_on(int core, u16 id) { __atomic_fetch_or(&stale_[core][id / 64], 1ull << (id % 64), __ATOMIC_SEQ_CST); }
+
+	/**
+	 * @brief Drops every translation the calling core holds for the PCID, or, if that can't be done without loading
+	 * it, makes sure they are dropped when it is next loaded.
+	 */
+	static void flush_local(u16 id);
+
+	/**
+	 * @brief Drops the calling core's translation of a single address for the PCID, falling back to flushing the whole
+	 * PCID when it is next loaded if the PCID isn't the current one and there is no INVPCID.
+	 */
+	static void flush_local_page(u16 id, u64 address);
+
+private:
+	static bool enabled_, has_invpcid_;
+
+	// PCIDs are handed out next-fit, from just after the last one, so that a PCID that has just been freed is the last
+	// to be reused, by which time most cores will have flushed it anyway.
+	static spinlock_irq lock_;
+	static hierarchical_bitset allocated_;
+	static u64 allocated_storage_[hierarchical_bitset::storage_words(max_pcids)];
+	static u16 next_hint_;
+	static u64 stale_[core_manager::max_cores][max_pcids / 64];
+};
+} // namespace stacsos::kernel::arch::x86
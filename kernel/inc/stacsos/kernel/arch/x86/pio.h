@@ -49,6 +49,11 @@ public:
 	{
 		asm volatile("cld\n\trepnz insl" : "=D"(buffer), "=c"(count) : "d"((u16)port), "0"(buffer), "1"(count) : "memory", "cc");
 	}
+
+	static void outsb(int port, uintptr_t buffer, size_t count)
+	{
+		asm volatile("cld\n\trep outsb" : "=S"(buffer), "=c"(count) : "d"((u16)port), "0"(buffer), "1"(count) : "memory", "cc");
+	}
 };
 
 template <u16 port, bool eight_bit> class ioport_impl;
@@ -58,6 +63,7 @@ public:
 	static void write8(u8 b) { pio::outb<port>(b); }
 	static void write16(u16 b) { pio::outw<port>(b); }
 	static void write32(u32 b) { pio::outl<port>(b); }
+	static void write8s(const u8 *b, size_t n) { pio::outsb(port, (uintptr_t)b, n); }
 
 	static u8 read8() { return pio::inb(port); }
 	static u16 read16() { return pio::inw(port); }
@@ -69,6 +75,7 @@ public:
 	static void write8(u8 b) { pio::outb(port, b); }
 	static void write16(u16 b) { pio::outw(port, b); }
 	static void write32(u32 b) { pio::outl(port, b); }
+	static void write8s(const u8 *b, size_t n) { pio::outsb(port, (uintptr_t)b, n); }
 
 	static u8 read8() { return pio::inb(port); }
 	static u16 read16() { return pio::inw(port); }
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/perf.h>
+
+namespace stacsos::kernel::arch::x86 {
+/**
+ * @brief The events a thread is counting for itself, which are switched in and out of the counters with the thread.
+ */
+struct pmu_thread_counters {
+	unsigned int nr_counters;
+	bool user_rdpmc;
+	u64 evtsel[perf_max_events];
+
+	// What each counter held when the thread was last switched out, which is put back when it is switched in.
+	u64 saved[perf_max_events];
+
+	// What the counters had counted when they couldn't be put back in full, and were restarted from zero instead.
+	u64 base[perf_max_events];
+};
+
+/**
+ * @brief The architectural performance monitoring unit.  Every core has its own counters.
+ *
+ * The first general-purpose counter is used for sampling: it counts unhalted core cycles up from minus the sampling
+ * period, and when it overflows the local APIC raises an NMI, so even code that runs with interrupts disabled is
+ * sampled.  The rest are lent to threads that want to count events for themselves, and are saved and restored as the
+ * threads are switched.
+ */
+class pmu {
+public:
+	/**
+	 * @brief Finds out what the PMU can do, and makes the counters that threads use ready to be started.  Called on
+	 * each core as it starts up.
+	 */
+	static void init();
+
+	/**
+	 * @brief Whether the core has an architectural PMU with a general-purpose counter that can count core cycles.
+	 */
+	static bool supported() { return version_ != 0; }
+
+	/**
+	 * @brief Starts raising an NMI on this core after every period unhalted core cycles.
+	 */
+	static void start_sampling(u64 period);
+
+	/**
+	 * @brief Stops the counter on this core.
+	 */
+	static void stop_sampling();
+
+	/**
+	 * @brief Called from the NMI handler.  Returns false if the counter hasn't overflowed, in which case the NMI came
+	 * from somewhere else, and otherwise re-arms the counter for the next period.
+	 */
+	static bool handle_overflow();
+
+	/**
+	 * @brief How many events a thread can count at once.
+	 */
+	static unsigned int thread_counters() { return thread_counters_; }
+
+	/**
+	 * @brief The counter (as given to rdpmc) that counts a thread's nth event.
+	 */
+	static unsigned int thread_counter_index(unsigned int n) { return n + 1; }
+
+	static unsigned int width() { return width_; }
+
+	/**
+	 * @brief Whether a counter can be given back its full value, rather than just the bottom 31 bits.
+	 */
+	static bool full_width_writes() { return full_width_writes_; }
+
+	/**
+	 * @brief Returns the event select value that counts the given event, or zero if the PMU can't count it.
+	 */
+	static u64 event_select(perf_event event, bool user_only);
+
+	/**
+	 * @brief Switches the counters from one thread's events to the next's.  Either may be null, if the thread isn't
+	 * counting anything.  Called with interrupts disabled.
+	 */
+	static void switch_thread_counters(pmu_thread_counters *prev, pmu_thread_counters *next);
+
+	/**
+	 * @brief Returns the count of the running thread's nth event.  Called with interrupts disabled.
+	 */
+	static u64 read_thread_counter(const pmu_thread_counters &c, unsigned int n);
+
+private:
+	// The period each core's sampling counter is counting, or zero if it isn't sampling.
+	static u64 period_[core_manager::max_cores];
+
+	// Whether each core lets user mode use rdpmc.
+	static bool user_rdpmc_[core_manager::max_cores];
+
+	// The PMU's architectural version (zero if there isn't one), and the width of its counters in bits.
+	static unsigned int version_;
+	static unsigned int width_;
+
+	// Bits set for the architectural events that the PMU can count.
+	static u32 events_;
+
+	static unsigned int thread_counters_;
+	static bool full_width_writes_;
+
+	static void arm(u64 period);
+	static void save_thread_counters(pmu_thread_counters &c);
+	static void load_thread_counters(const pmu_thread_counters &c);
+};
+} // namespace stacsos::kernel::arch::x86
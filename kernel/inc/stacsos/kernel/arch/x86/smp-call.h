@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+
+namespace stacsos::kernel::arch::x86 {
+using smp_call_fn = void (*)(void *arg);
+
+/**
+ * @brief A function to be run on a set of cores.  Each core has a queue of the calls sent to it, which is a lock-free
+ * stack: senders push onto it, and the core takes the whole lot at once when it is interrupted, as the TLB shootdown
+ * queues do.  The interrupt is sent to all of the targets with as few ICR writes as possible.
+ */
+class smp_call {
+public:
+	/**
+	 * @brief Runs fn(arg) on every online core in core_mask, with interrupts disabled.  If the calling core is in the
+	 * mask, it runs the function itself, straight away.  If wait is true, this returns once every core has finished
+	 * running it, and otherwise as soon as it has been sent.
+	 *
+	 * While waiting, the calling core runs any calls sent to it, so two cores calling each other don't deadlock, but
+	 * it must not hold a spinlock that a target might be spinning on with interrupts disabled.
+	 */
+	static void call(u64 core_mask, smp_call_fn fn, void *arg, bool wait);
+
+	/**
+	 * @brief Runs every call that has been sent to the calling core.  This is called from the function call interrupt
+	 * handler.
+	 */
+	static void handle_ipi();
+
+private:
+	smp_call(smp_call_fn fn, void *arg, bool owned)
+		: fn_(fn)
+		, arg_(arg)
+		, pending_(0)
+		, owned_(owned)
+	{
+	}
+
+	smp_call_fn fn_;
+	void *arg_;
+
+	// The number of target cores that have yet to run the function.
+	unsigned int pending_;
+
+	// Whether the call was allocated by the sender, which isn't waiting for it, so the last core to run it deletes it.
+	bool owned_;
+
+	// Links the call into the queue of each core it was sent to.
+	smp_call *next_[core_manager::max_cores];
+
+	static smp_call *queues_[core_manager::max_cores];
+
+	void run_here();
+};
+
+static inline void smp_call_function(u64 core_mask, smp_call_fn fn, void *arg, bool wait) { smp_call::call(core_mask, fn, arg, wait); }
+} // namespace stacsos::kernel::arch::x86
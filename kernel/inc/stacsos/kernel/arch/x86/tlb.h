@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/list.h>
+
+namespace stacsos::kernel::mem {
+class page;
+}
+
+namespace stacsos::kernel::arch::x86 {
+
+/**
+ * @brief Gathers up the TLB invalidations needed after removing a set of mappings, so that every other core that may
+ * hold them is sent a single interrupt for the lot, rather than one per page.  The pages that were mapped are only
+ * freed once every one of those cores has dropped its translations, and the whole batch is dealt with asynchronously,
+ * so that the core doing the unmapping never waits for the others (which may themselves be spinning on a lock it
+ * holds, with interrupts disabled).
+ *
+ * A batch for a user address space is only sent to the cores that have it loaded right now.  Any other core that has
+ * run it before is made to flush its PCID the next time it loads it, and without PCIDs, loading it flushes anyway.
+ *
+ * Until a remote core takes the interrupt, it may still reach the old pages through its stale translations, but as
+ * the pages aren't freed until then, the worst that can happen is that it sees memory that has just been unmapped.
+ */
+class tlb_batch {
+public:
+	// Above this many pages, it's cheaper to flush everything.
+	static const unsigned int max_addresses = 32;
+
+	/**
+	 * @brief Starts a batch for mappings in a user address space.
+	 *
+	 * @param cr3 The CR3 value (including the PCID) of the address space.
+	 * @param active_cores The address space's mask of the cores that have run it.
+	 */
+	static tlb_batch *create_user(u64 cr3, const u64 *active_cores) { return new tlb_batch(false, cr3, active_cores); }
+
+	/**
+	 * @brief Starts a batch for global kernel mappings, which any core may hold.
+	 */
+	static tlb_batch *create_kernel() { return new tlb_batch(true, 0, nullptr); }
+
+	/**
+	 * @brief Records a virtual address whose mapping has been removed.  A single address covers the whole of a large
+	 * page.
+	 */
+	void add(u64 virtual_address)
+	{
+		if (nr_addresses_ < max_addresses) {
+			addresses_[nr_addresses_] = virtual_address;
+		}
+
+		nr_addresses_++;
+	}
+
+	/**
+	 * @brief Hands a block of pages to the batch, to be freed once no core can reach it any more.
+	 */
+	void free_after(mem::page &pg, int order) { pages_.append({ &pg, order, deferred_kind::pages }); }
+
+	/**
+	 * @brief Hands an emptied page table to the batch, to be given back to the page table allocator once no core can
+	 * still be walking it.
+	 */
+	void free_table_after(mem::page &pg) { pages_.append({ &pg, 0, deferred_kind::table }); }
+
+	/**
+	 * @brief Drops a reference to a cached page once no core can reach it any more, so that the page cache can't
+	 * reclaim it while it is still in a TLB.
+	 */
+	void release_after(mem::page &pg) { pages_.append({ &pg, 0, deferred_kind::reference }); }
+
+	/**
+	 * @brief Drops a reference to a block of pages shared copy-on-write once no core can reach it any more, and frees
+	 * the block if that was the last one.
+	 */
+	void unshare_after(mem::page &pg, int order) { pages_.append({ &pg, order, deferred_kind::shared }); }
+
+	/**
+	 * @brief Calls a function once the batch is complete, and its pages have been freed, so that the virtual
+	 * addresses it covered can be handed out again.  A batch has room for one such function.
+	 */
+	void call_after(void (*fn)(void *), void *arg)
+	{
+		completion_fn_ = fn;
+		completion_arg_ = arg;
+	}
+
+	/**
+	 * @brief Invalidates the batch on the calling core, and sends it to every other core that needs it.  The batch
+	 * deletes itself once it is complete, so it must not be used afterwards.
+	 */
+	void submit();
+
+	/**
+	 * @brief Processes every batch that has been sent to the calling core.  This is called from the TLB shootdown
+	 * interrupt handler.
+	 */
+	static void handle_ipi();
+
+private:
+	tlb_batch(bool kernel, u64 cr3, const u64 *active_cores)
+		: kernel_(kernel)
+		, cr3_(cr3)
+		, active_cores_(active_cores)
+		, nr_addresses_(0)
+		, pending_(0)
+		, completion_fn_(nullptr)
+		, completion_arg_(nullptr)
+	{
+	}
+
+	enum class deferred_kind { pages, table, reference, shared };
+
+	struct deferred_free {
+		mem::page *pg;
+		int order;
+		deferred_kind kind;
+	};
+
+	bool kernel_;
+	u64 cr3_;
+	const u64 *active_cores_;
+
+	u64 addresses_[max_addresses];
+	unsigned int nr_addresses_;
+
+	list<deferred_free> pages_;
+
+	// The number of cores (including the one that submitted it) that have yet to process the batch.
+	unsigned int pending_;
+
+	void (*completion_fn_)(void *);
+	void *completion_arg_;
+
+	// Links the batch into the queue of each core it was sent to.
+	tlb_batch *next_[core_manager::max_cores];
+
+	static tlb_batch *queues_[core_manager::max_cores];
+
+	void invalidate_here();
+	void complete_one();
+};
+} // namespace stacsos::kernel::arch::x86
@@ -15,8 +15,18 @@ public:
 	{
 	}
 
+	/**
+	 * @brief Works out how fast the TSC runs.  Every core's TSC runs at the same rate, so this is only done for real
+	 * by the bootstrap core, and the other cores take the answer it got.
+	 */
 	void calibrate();
 
+	/**
+	 * @brief How fast the local APIC timer runs, if CPUID says, or zero otherwise.  Only valid once the bootstrap
+	 * core's TSC has been calibrated.
+	 */
+	static u64 reported_apic_frequency() { return reported_apic_frequency_; }
+
 	u64 read()
 	{
 		u32 pid;
@@ -37,5 +47,11 @@ public:
 
 private:
 	u64 timer_frequency_;
+
+	static u64 boot_frequency_;
+	static u64 reported_apic_frequency_;
+
+	static u64 frequency_from_cpuid();
+	u64 measure_frequency();
 };
 } // namespace stacsos::kernel::arch::x86
@@ -16,6 +16,7 @@ class x2apic_timer : public timer {
 public:
 	x2apic_timer(x2apic &lapic)
 		: lapic_(lapic)
+		, supports_deadline_(false)
 	{
 	}
 
@@ -34,8 +35,19 @@ public:
 
 	virtual void stop() { lapic_.mask_interrupts(x2apic_lvts::timer); }
 
+	virtual bool supports_deadline() const override { return supports_deadline_; }
+
+	virtual void start_deadline() override
+	{
+		lapic_.set_timer_tsc_deadline();
+		lapic_.unmask_interrupts(x2apic_lvts::timer);
+	}
+
+	virtual void set_deadline(u64 deadline) override { lapic_.set_tsc_deadline(deadline); }
+
 private:
 	static void timer_irq_handler(u8 irq, void *context, void *arg);
 	x2apic &lapic_;
+	bool supports_deadline_;
 };
 } // namespace stacsos::kernel::arch::x86
@@ -73,6 +73,11 @@ public:
 
 	void eoi() { msrs::x2apic_eoi = 0; }
 
+	/**
+	 * @brief Whether an interrupt on the vector has been accepted by this APIC, but not yet delivered to the core.
+	 */
+	bool is_pending(u8 vector) { return (msr::read((msr_indicies)((u32)msr_indicies::X2APIC_IRR0 + (vector / 32))) >> (vector % 32)) & 1; }
+
 	void set_timer_irq(u8 irq)
 	{
 		u64 lvt = msr::read(msr_indicies::X2APIC_LVT_TIMER);
@@ -95,10 +100,20 @@ public:
 	void set_timer_one_shot()
 	{
 		u64 lvt = msr::read(msr_indicies::X2APIC_LVT_TIMER);
-		lvt &= ~0x00020000;
+		lvt &= ~0x00060000;
 		msr::write(msr_indicies::X2APIC_LVT_TIMER, lvt);
 	}
 
+	void set_timer_tsc_deadline()
+	{
+		u64 lvt = msr::read(msr_indicies::X2APIC_LVT_TIMER);
+		lvt &= ~0x00060000;
+		lvt |= 0x00040000;
+		msr::write(msr_indicies::X2APIC_LVT_TIMER, lvt);
+	}
+
+	void set_tsc_deadline(u64 deadline) { msr::write(msr_indicies::IA32_TSC_DEADLINE, deadline); }
+
 	u32 get_timer_current_count() { return msr::read(msr_indicies::X2APIC_TIMER_CCR); }
 
 	u64 get_timer_frequency() const { return timer_frequency_; }
@@ -138,12 +153,73 @@ public:
 		set_icr(v);
 	}
 
+	void send_ipi(u32 target, u8 vector)
+	{
+		x2apic_icr v;
+
+		v.destination = target;
+		v.vector = vector;
+		v.delivery_mode = icr_delivery_mode::fixed;
+		v.trigger_mode = icr_trigger_mode::edge;
+		v.level = icr_level::assert;
+
+		set_icr(v);
+	}
+
+	/**
+	 * @brief Sends an interrupt to every core in a mask of core IDs (which are the same as their x2APIC IDs), with one
+	 * ICR write for each cluster of sixteen.  In x2APIC logical mode, an APIC's logical ID is its cluster in the top
+	 * half, and a bit for its place in the cluster in the bottom half, so a single write can reach any of the cores
+	 * in a cluster.
+	 */
+	void send_ipi_many(u64 targets, u8 vector)
+	{
+		while (targets) {
+			u32 cluster = __builtin_ctzll(targets) / 16;
+			u64 members = (targets >> (cluster * 16)) & 0xffff;
+
+			x2apic_icr v;
+
+			v.destination = (cluster << 16) | (u32)members;
+			v.dest_mode = (u64)icr_dest_mode::logical;
+			v.vector = vector;
+			v.delivery_mode = icr_delivery_mode::fixed;
+			v.trigger_mode = icr_trigger_mode::edge;
+			v.level = icr_level::assert;
+
+			set_icr(v);
+
+			targets &= ~(0xffffull << (cluster * 16));
+		}
+	}
+
+	/**
+	 * @brief Sends an interrupt to every core but this one, with a single ICR write.
+	 */
+	void send_ipi_all_others(u8 vector)
+	{
+		x2apic_icr v;
+
+		v.vector = vector;
+		v.delivery_mode = icr_delivery_mode::fixed;
+		v.trigger_mode = icr_trigger_mode::edge;
+		v.level = icr_level::assert;
+		v.dest_shorthand = (u64)icr_dest_shorthand::all_excluding_self;
+
+		set_icr(v);
+	}
+
 	x86_core &owner() const { return owner_; }
 
 private:
 	x86_core &owner_;
 	u64 timer_frequency_;
 
+	// Every core's timer runs at the same rate, so it is only calibrated by the bootstrap core.
+	static u64 boot_timer_frequency_;
+
+	u64 measure_timer_frequency();
+
 	void calibrate_timer();
 };
 } // namespace stacsos::kernel::arch::x86
@@ -26,9 +26,20 @@ public:
 		, irqs_(idt_)
 		, lapic_(*this)
 		, timer_(lapic_)
+		, ipis_ready_(false)
+		, use_mwait_(false)
+		, idle_state_(idle_running)
+		, loaded_cr3_(0)
 	{
 	}
 
+	// The vectors of the interrupts that cores send each other.  They are the same on every core, so that one can be
+	// sent to several cores at once.
+	static const u8 yield_vector = 0xff;
+	static const u8 resched_vector = 0xfe;
+	static const u8 tlb_vector = 0xfd;
+	static const u8 call_vector = 0xfc;
+
 	static int this_core_id() { return core::this_core_id(); }
 	static x86_core &this_core() { return (x86_core &)core::this_core(); }
 
@@ -36,12 +47,21 @@ public:
 	virtual bool remote_run() override;
 
 	virtual timer &local_timer() override { return timer_; }
+	virtual u64 timestamp_frequency() override { return tsc_.frequency(); }
+	virtual u64 stolen_time() override;
+	virtual void kick() override;
+	virtual void idle() override;
 
 	tsc &local_tsc() { return tsc_; }
 
 	irq::irq_manager<256> &irqmgr() { return irqs_; }
 	const irq::irq_manager<256> &irqmgr() const { return irqs_; }
 
+	/**
+	 * @brief The CR3 value (without the no-flush bit) of the address space this core has loaded.
+	 */
+	u64 loaded_cr3() const { return __atomic_load_n(&loaded_cr3_, __ATOMIC_SEQ_CST); }
+
 	virtual void set_current_tcb(const tcb *tcb) override;
 	virtual tcb *get_current_tcb() override;
 
@@ -55,16 +75,25 @@ public:
 	void dump_regs();
 
 private:
+	// The order of the stacks that double faults, NMIs and machine checks are taken on.
+	static const int fault_stack_order = 1;
+
+	// The TSS's interrupt stacks.  Each core has its own, as any of these can be raised on every core at once.
+	enum interrupt_stack { double_fault_stack = 1, nmi_stack = 2, machine_check_stack = 3 };
+
+	void allocate_interrupt_stack(interrupt_stack ist, const char *name);
+
 	global_descriptor_table<16> gdt_;
 	interrupt_descriptor_table<256> idt_;
-	task_state_segment tss_;
 
-	struct {
-		u64 task_ptr;
-		u64 context_ptr;
-		u64 cr3;
-		u64 kernel_stack;
-	} temporary_tcb;
+	// The kernel stack pointer in the TSS is rewritten on every task switch, and read by the processor on every entry
+	// from user mode, so it starts a cache line of its own, rather than sharing one with whatever precedes it.
+	alignas(64) task_state_segment tss_;
+
+	// Somewhere for %gs to point while the core is starting up, before it has a task to run.
+	tcb temporary_tcb_;
+
+	void use_temporary_tcb();
 
 	irq::irq_manager<256> irqs_;
 
@@ -72,9 +101,27 @@ private:
 	x2apic_timer timer_;
 	tsc tsc_;
 
+	// Whether the core has set up its handlers for the inter-processor interrupts.  Every core that kicks this one
+	// reads it, and it is only written once, so it is kept away from anything written while the core runs.
+	alignas(64) bool ipis_ready_;
+	bool use_mwait_;
+
+	// Whether the idle thread is waiting in MWAIT, and so can be woken by changing this word rather than with an
+	// interrupt.  It has a cache line of its own, as that is what MONITOR watches, and any other write to the line
+	// would wake the core for nothing.
+	enum idle_state : u64 { idle_running, idle_polling, idle_woken };
+	alignas(64) u64 idle_state_;
+
+	// Written by this core whenever it switches address space, and read by any core shooting down TLB entries.
+	alignas(64) u64 loaded_cr3_;
+
 	static void exception_handler(u8 irq, void *context, void *arg)
 	{
 		switch (irq) {
+		case 0x08:
+			((x86_core *)arg)->handle_double_fault((machine_context *)context);
+			break;
+
 		case 0x0d:
 			((x86_core *)arg)->handle_gpf((machine_context *)context);
 			break;
@@ -90,9 +137,12 @@ private:
 	}
 
 	void populate_dt();
-	// pfn_t prepare_mpstartup_code();
-	// void complete_remote_init();
+	u64 prepare_mpstartup_code();
+	__noreturn void complete_remote_init();
+
+	static __noreturn void mpstartup_entry(x86_core *core);
 
+	__noreturn void handle_double_fault(machine_context *mc);
 	void handle_gpf(machine_context *mc);
 	void handle_page_fault(machine_context *mc);
 };
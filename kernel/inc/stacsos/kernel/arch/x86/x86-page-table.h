@@ -14,8 +14,10 @@ class page_table_allocator;
 }
 
 namespace stacsos::kernel::arch::x86 {
+class tlb_batch;
+
 enum class mapping_size { m4k, m2m, m1g };
-enum class mapping_flags { none, present = 1, writable = 2, user_accessable = 4, write_through = 8, cache_disabled = 16 };
+enum class mapping_flags { none, present = 1, writable = 2, user_accessable = 4, write_through = 8, cache_disabled = 16, global = 32 };
 
 DEFINE_ENUM_FLAG_OPERATIONS(mapping_flags)
 
@@ -24,6 +26,7 @@ enum class mapping_result { ok, unmapped };
 struct mapping {
 	mapping_result result;
 	u64 address;
+	mapping_size size;
 };
 
 class x86_page_table {
@@ -45,6 +48,15 @@ public:
 	 */
 	x86_page_table *create_linked_copy(mem::page_table_allocator &pta);
 
+	/**
+	 * @brief Frees a page table created by create_linked_copy, along with the tables below its lower-half (user)
+	 * pml4 entries.  The upper-half entries are shared with the original page table, so are left alone.  The memory
+	 * that was mapped is not freed, and the page table must no longer be active on any core.
+	 *
+	 * @param pta The allocator that the page tables were allocated from.
+	 */
+	void destroy_linked_copy(mem::page_table_allocator &pta);
+
 	/**
 	 * @brief Retrieves a pointer to the current X86 page table.
 	 *
@@ -93,8 +105,42 @@ public:
 	 *
 	 * @param pta The allocator to use for allocating page tables.
 	 * @param virtual_address The virtual address to remove from the mapping.
+	 * @param batch If given, the invalidation is added to the batch, to be carried out on every core that needs it
+	 * when the batch is submitted.  Otherwise, only the calling core's translation is invalidated, straight away.
+	 */
+	void unmap(mem::page_table_allocator &pta, u64 virtual_address, tlb_batch *batch = nullptr);
+
+	/**
+	 * @brief Maps a physically contiguous range, using the biggest pages that the alignment of both addresses, and
+	 * what is already mapped, allow.
+	 *
+	 * @param pta The allocator to use for allocating page tables.
+	 * @param virtual_address The (page aligned) virtual address of the start of the range.
+	 * @param physical_address The (page aligned) physical address the range is mapped to.
+	 * @param length The (page aligned) length of the range.
+	 * @param flags The flags (i.e. permissions, etc) to use for the mapping.
+	 */
+	void map_range(mem::page_table_allocator &pta, u64 virtual_address, u64 physical_address, u64 length, mapping_flags flags);
+
+	/**
+	 * @brief Removes every mapping in a range, whatever size of page each one is.
+	 */
+	void unmap_range(mem::page_table_allocator &pta, u64 virtual_address, u64 length, tlb_batch *batch = nullptr);
+
+	/**
+	 * @brief Makes sure the PML4 entry covering an address points at a table, so that every linked copy made from now
+	 * on shares it, and sees whatever is mapped under it later.
+	 *
+	 * @param pta The allocator to use for allocating page tables.
+	 * @param virtual_address An address covered by the entry.
+	 */
+	void reserve_pml4_entry(mem::page_table_allocator &pta, u64 virtual_address);
+
+	/**
+	 * @brief Returns true if nothing at all is mapped in the page of the given size containing the address, and no
+	 * page table covers it, so that it can take a single mapping of that size.
 	 */
-	void unmap(mem::page_table_allocator &pta, u64 virtual_address);
+	bool is_unmapped(u64 virtual_address, mapping_size size);
 
 	/**
 	 * @brief Looks up an existing mapping (if it exists) and returns details about it.
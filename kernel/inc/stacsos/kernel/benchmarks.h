@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel {
+typedef void (*benchmark_fn)(u64 iterations);
+
+/**
+ * @brief A microbenchmark of something in the kernel, which runs the code being measured the given number of times.
+ * Every benchmark is put in the __benchmarks section, in the same way as tracepoints, so they can all be found
+ * without registering them.
+ */
+struct benchmark {
+	const char *name;
+	benchmark_fn fn;
+};
+
+/**
+ * @brief Runs the benchmarks whose names match the bench= option, before init is started, and reports how many
+ * timestamp counter cycles one iteration of each took, on the debug console.  These are things that can't be timed
+ * from user space without the cost of getting there swamping them, e.g. a page allocation, or a lock round trip.
+ *
+ * Each sample times a batch of iterations, which is made big enough that reading the timestamp counter is a small
+ * part of it, and the minimum, median and 99th percentile of the samples are reported, so that an interrupt landing
+ * in a few of them doesn't skew the result.
+ */
+class benchmarks {
+	DEFINE_SINGLETON(benchmarks)
+
+private:
+	benchmarks() { }
+
+public:
+	static benchmark *begin();
+	static benchmark *end();
+	static u32 count() { return end() - begin(); }
+
+	/**
+	 * @brief Runs every benchmark that matches the pattern, which is a comma-separated list of names, each of which
+	 * may contain * and ? wildcards, e.g. bench=pgalloc_*,spinlock.  Returns the number that were run.
+	 */
+	unsigned int run(const char *pattern, u64 nr_samples);
+
+	/**
+	 * @brief Stops the compiler from optimising away the computation of a value that a benchmark doesn't otherwise
+	 * use.
+	 */
+	template <typename T> static void keep(const T &value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+private:
+	// A sample is made at least this long, by doubling its batch of iterations, up to max_batch.
+	static const u64 min_sample_cycles = 2000;
+	static const u64 max_batch = 1ull << 16;
+
+	static bool matches(const char *pattern, const char *name);
+	void run_one(const benchmark &b, u64 nr_samples);
+};
+} // namespace stacsos::kernel
+
+/**
+ * Defines a benchmark, followed by its body, which has the number of times to run the code being measured in
+ * iterations, e.g.
+ *
+ *   KERNEL_BENCHMARK(spinlock)
+ *   {
+ *       for (u64 i = 0; i < iterations; i++) { ... }
+ *   }
+ *
+ * Anything set up in the body is timed along with it, so a benchmark that needs something to work on (e.g. a
+ * populated tree) keeps it in a function-local static, which is only made once.
+ */
+#define KERNEL_BENCHMARK(name)                                                                                                                                 \
+	static void __benchmark_fn_##name(u64 iterations);                                                                                                         \
+	::stacsos::kernel::benchmark __benchmark_##name __attribute__((section("__benchmarks"), used, aligned(8))) = { #name, __benchmark_fn_##name };             \
+	static void __benchmark_fn_##name(u64 iterations)
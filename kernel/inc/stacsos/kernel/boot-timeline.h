@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/wait-queue.h>
+
+namespace stacsos::kernel {
+typedef void (*boot_stage_fn)();
+
+/**
+ * @brief A step of bringing the system up, which can be run as soon as the stages it depends on have finished.
+ */
+struct boot_stage {
+	const char *name;
+	boot_stage_fn fn;
+
+	// A bit for each stage (by its index in the list it is run with) that has to finish before this one starts.
+	u32 after;
+};
+
+/**
+ * @brief Times each step of boot with the timestamp counter, and runs the steps that come once there are threads as
+ * dependency-ordered stages, each on a kernel thread of its own, so that stages that don't depend on each other run at
+ * the same time on whichever cores are least loaded.
+ */
+class boot_timeline {
+	DEFINE_SINGLETON(boot_timeline)
+
+private:
+	boot_timeline()
+		: nr_entries_(0)
+		, done_(0)
+		, stages_start_tsc_(0)
+	{
+	}
+
+public:
+	static const unsigned int max_entries = 32;
+	static const unsigned int max_stages = 32;
+
+	/**
+	 * @brief Times a step that ran on the calling core, from a timestamp taken before it to one taken after.
+	 */
+	void record(const char *name, u64 start_tsc, u64 end_tsc);
+
+	/**
+	 * @brief Runs the stages, each once every stage it depends on has finished, and returns when all of them have.
+	 * Must be called from a thread, and a stage may only depend on stages that come before it in the list.
+	 */
+	void run_stages(const boot_stage *stages, unsigned int count);
+
+	/**
+	 * @brief Renders the timeline as text, one step per line.  Returns the number of characters written.
+	 */
+	size_t render(char *buffer, size_t size);
+
+	/**
+	 * @brief Returns a buffer size that is large enough for render().
+	 */
+	size_t render_size_hint() const { return 128 + (max_entries * 96); }
+
+private:
+	struct entry {
+		const char *name;
+		u64 start_tsc;
+		u64 end_tsc;
+
+		// When the stage could have started, because the last of its dependencies had finished (or, for a step that
+		// wasn't a stage, when it did start).
+		u64 ready_tsc;
+		int core;
+	};
+
+	struct stage_context {
+		const boot_stage *stage;
+		unsigned int index;
+	};
+
+	spinlock_irq lock_;
+	entry entries_[max_entries];
+	unsigned int nr_entries_;
+
+	// The stages that have finished, with the queue that their dependants wait on.
+	u32 done_;
+	u64 done_tsc_[max_stages];
+	u64 stages_start_tsc_;
+	sched::wait_queue stage_done_;
+
+	void add_entry(const char *name, u64 ready_tsc, u64 start_tsc, u64 end_tsc);
+
+	static void stage_thread(void *arg);
+};
+} // namespace stacsos::kernel
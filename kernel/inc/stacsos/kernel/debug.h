@@ -14,7 +14,12 @@ namespace arch {
 
 extern void dprintf_init();
 extern void dprintf_set_console(arch::console_interface *iface);
-extern void dprintf(const char *msg, ...);
+
+/**
+ * @brief Starts a kernel thread that writes logged messages out to the console, so that dprintf only has to log them.
+ */
+extern void dprintf_start_async();
+extern void dprintf(const char *msg, ...) __printf_format(1, 2);
 extern void dprint_data(const void *data, size_t length);
 
 class debug_helper {
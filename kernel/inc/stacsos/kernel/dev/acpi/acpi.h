@@ -23,6 +23,13 @@ namespace acpi {
 
 		bool probe();
 
+		/**
+		 * @brief Reads the NUMA topology from the SRAT and SLIT into numa_topology, if there are any.  This is run by
+		 * the memory manager before it sets up the page allocator, so it finds the tables for itself and allocates
+		 * nothing, rather than needing an ACPI object.
+		 */
+		static bool probe_numa();
+
 	private:
 		void initialise();
 
@@ -30,10 +37,10 @@ namespace acpi {
 
 		const rsdp_descriptor *rsdp_;
 
-		const rsdp_descriptor *locate_rsdp();
-		const rsdp_descriptor *scan_for_rsdp(uintptr_t start, uintptr_t end);
+		static const rsdp_descriptor *locate_rsdp();
+		static const rsdp_descriptor *scan_for_rsdp(uintptr_t start, uintptr_t end);
 
-		bool is_structure_valid(const void *structure_base, size_t structure_size);
+		static bool is_structure_valid(const void *structure_base, size_t structure_size);
 
 		bool parse_madt(const madt *madt);
 		bool parse_madt_lapic(const madt_record_lapic *lapic);
@@ -44,6 +51,9 @@ namespace acpi {
 		bool parse_dsdt(const dsdt *fadt);
 		bool parse_hpet(const hpet *fadt);
 		bool parse_mcfg(const mcfg *mcfg);
+
+		static void parse_srat(const srat *srat);
+		static void parse_slit(const slit *slit);
 	};
 } // namespace acpi
 } // namespace stacsos::kernel::dev
@@ -179,4 +179,55 @@ struct mcfg {
 	u64 reserved;
 	configuration_space_base_address_allocation base_addresses[];
 } __packed;
+
+struct srat_record_header {
+	u8 type, length;
+} __packed;
+
+struct srat_record_lapic {
+	srat_record_header header;
+	u8 proximity_domain_lo;
+	u8 apic_id;
+	u32 flags;
+	u8 sapic_eid;
+	u8 proximity_domain_hi[3];
+	u32 clock_domain;
+} __packed;
+
+struct srat_record_memory {
+	srat_record_header header;
+	u32 proximity_domain;
+	u16 reserved0;
+	u64 base_address;
+	u64 length;
+	u32 reserved1;
+	u32 flags;
+	u64 reserved2;
+} __packed;
+
+struct srat_record_x2apic {
+	srat_record_header header;
+	u16 reserved0;
+	u32 proximity_domain;
+	u32 x2apic_id;
+	u32 flags;
+	u32 clock_domain;
+	u32 reserved1;
+} __packed;
+
+// The System Resource Affinity Table, which says which proximity domain (NUMA node) each processor and each range of
+// memory is in.
+struct srat {
+	sdt_header header;
+	u32 reserved0;
+	u64 reserved1;
+	srat_record_header records; // VARIABLE LENGTH
+} __packed;
+
+// The System Locality Information Table, which gives the relative distance between every pair of proximity domains.
+struct slit {
+	sdt_header header;
+	u64 nr_localities;
+	u8 distances[]; // nr_localities * nr_localities
+} __packed;
 } // namespace stacsos::kernel::dev::acpi
@@ -29,6 +29,12 @@ public:
 
 	virtual void probe() = 0;
 
+	/**
+	 * @brief Finishes a probe that was left running in the background, once every bus has been probed.  Only called
+	 * for buses that asked for it with device_manager::finish_probe_later.
+	 */
+	virtual void finish_probe() { }
+
 private:
 	bus()
 		: parent_(nullptr)
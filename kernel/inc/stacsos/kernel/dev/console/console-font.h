@@ -35,6 +35,11 @@ public:
 
 	int get_pixel(int x, int y) { return !!(pixel_data_[y] & (1 << (7 - x))); }
 
+	/**
+	 * @brief The glyph's rows, one byte each, with the leftmost pixel in the top bit.
+	 */
+	const u8 *rows() const { return pixel_data_; }
+
 private:
 	console_font_char_dimensions dim_;
 	const u8 *pixel_data_;
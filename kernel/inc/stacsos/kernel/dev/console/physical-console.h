@@ -10,6 +10,9 @@
 #include <stacsos/kernel/dev/device.h>
 #include <stacsos/kernel/dev/input/keyboard.h>
 #include <stacsos/kernel/dev/input/keys.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/event.h>
+#include <stacsos/kernel/sched/thread.h>
 #include <stacsos/list.h>
 #include <stacsos/memory.h>
 
@@ -30,6 +33,9 @@ public:
 		, saved_vc_buffer_(nullptr)
 		, saved_vc_buffer_size_(0)
 		, gdev_(gdev)
+		, shown_vc_(nullptr)
+		, fb_origin_(0)
+		, fb_lines_(0)
 		, alt_pressed_(false)
 		, ctrl_pressed_(false)
 	{
@@ -68,8 +74,28 @@ private:
 	size_t saved_vc_buffer_size_;
 
 	gfx::graphics &gdev_;
+
+	// Graphics consoles draw into buffers of their own, and the compositor copies what they have damaged onto the
+	// screen, no more than once a frame.  The framebuffer is a few screens tall, and the screen shows the part of it
+	// from line fb_origin_ down, so that a console scrolling can be followed by panning, rather than drawing it all
+	// again.  The display lock is held while anything touches the framebuffer.
+	spinlock_irq display_lock_;
+	virtual_console *shown_vc_;
+	int fb_origin_, fb_lines_;
+	sched::auto_reset_event flush_event_;
+	shared_ptr<sched::thread> compositor_;
+
 	bool alt_pressed_, ctrl_pressed_;
 
 	void on_vc_changed(virtual_console *prev, virtual_console *next);
+
+	static void compositor_thread_proc(void *arg);
+	void composite();
+
+	/**
+	 * @brief Copies the damage of the graphics console on the screen into the framebuffer.  Returns whether the
+	 * console has to be drawn again next frame, whether or not it is damaged again, as a process has it mapped.
+	 */
+	bool flush();
 };
 } // namespace stacsos::kernel::dev::console
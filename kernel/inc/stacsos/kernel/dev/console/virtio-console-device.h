@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/console-interface.h>
+#include <stacsos/kernel/dev/device.h>
+#include <stacsos/kernel/dev/virtio/virtqueue.h>
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel::dev::console {
+/**
+ * @brief A virtio console, e.g. QEMU's virtio-serial-pci, used as somewhere fast to send the kernel log.  Only its
+ * first port's transmit queue is used.
+ *
+ * Characters are gathered into page-sized buffers, and a buffer is only handed to the device when it is full, or when
+ * the console is flushed, so that writing out a few kilobytes of log costs one notification, rather than an exit to
+ * the hypervisor for every byte, as the debug port does.  The device is never asked for an interrupt: buffers it has
+ * finished with are collected when another one is needed.
+ */
+class virtio_console_device : public device, public arch::console_interface {
+public:
+	static device_class virtio_console_device_class;
+
+	virtio_console_device(bus &parent, pci::pci_device &pcidev)
+		: device(virtio_console_device_class, parent)
+		, transport_(pcidev)
+		, tx_(transport_, 1)
+		, ready_(false)
+		, buffers_(nullptr)
+		, buffers_phys_(0)
+		, nr_buffers_(0)
+		, nr_free_buffers_(0)
+		, current_(-1)
+		, fill_(0)
+	{
+	}
+
+	virtual ~virtio_console_device() { }
+
+	/**
+	 * @brief Negotiates with the device, and sets up its transmit queue.  Returns false if the device can't be used,
+	 * in which case it mustn't be registered.
+	 */
+	bool bring_up();
+
+	virtual void configure() override { }
+
+	virtual void write_char(unsigned char c, u8 attr) override;
+	virtual void flush() override;
+
+private:
+	static const unsigned int max_buffers = 8;
+	static const unsigned int buffers_order = 3;
+
+	virtio::virtio_pci_transport transport_;
+	virtio::virtqueue tx_;
+	bool ready_;
+
+	// Protects the queue and the buffers.
+	spinlock_irq lock_;
+
+	// The buffers are a page each, and buffer i is always described by descriptor i.
+	u8 *buffers_;
+	u64 buffers_phys_;
+	unsigned int nr_buffers_;
+	u16 free_buffers_[max_buffers];
+	unsigned int nr_free_buffers_;
+
+	// The buffer being filled, if any, and how much of it has been.
+	int current_;
+	u32 fill_;
+
+	void submit_current();
+	void reclaim();
+};
+} // namespace stacsos::kernel::dev::console
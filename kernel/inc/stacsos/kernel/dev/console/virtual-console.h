@@ -9,10 +9,16 @@
 
 #include <stacsos/kernel/dev/device.h>
 #include <stacsos/kernel/dev/input/keys.h>
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/sched/event.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/list.h>
 #include <stacsos/memops.h>
 
+namespace stacsos::kernel::mem {
+class address_space;
+}
+
 namespace stacsos::kernel::dev::console {
 enum class virtual_console_mode { text, gfx };
 
@@ -41,6 +47,10 @@ public:
 		, mode_(mode)
 		, internal_buffer_(nullptr)
 		, internal_buffer_size_(0)
+		, damage_ { 0, 0, 0, 0, 0 }
+		, flush_event_(nullptr)
+		, palettes_(nullptr)
+		, next_palette_(0)
 		, x_(0)
 		, y_(0)
 		, rows_(0)
@@ -60,12 +70,12 @@ public:
 			break;
 		}
 
-		internal_buffer_ = new u8[internal_buffer_size_];
+		internal_buffer_ = allocate_buffer();
 
 		clear();
 	}
 
-	virtual ~virtual_console() { delete internal_buffer_; }
+	virtual ~virtual_console() { free_buffer(internal_buffer_); }
 
 	virtual void configure() override;
 
@@ -87,16 +97,80 @@ public:
 	}
 
 	void write_char(unsigned char ch, u8 attr);
+
+	/**
+	 * @brief Writes a run of characters in the one attribute, moving the cursor once, at the end.
+	 */
+	void write(const u8 *chars, size_t count, u8 attr);
 	u8 read_char();
 
+	/**
+	 * @brief Whether read_char would return straight away.  If ws is given, it is woken when a key is pressed.
+	 */
+	bool input_ready(sched::wait_set *ws);
+
 	void clear();
 
 	virtual shared_ptr<fs::file> open_as_file() override;
 
 private:
+	/**
+	 * @brief A file onto the console that some address space has mapped, whose mappings have to be dropped whenever
+	 * the buffer behind the console changes.
+	 */
+	struct buffer_mapping {
+		mem::address_space *as;
+		const fs::file *file;
+
+		bool operator==(const buffer_mapping &o) const { return as == o.as && file == o.file; }
+		bool operator!=(const buffer_mapping &o) const { return !(*this == o); }
+	};
+
+	/**
+	 * @brief What has changed in a graphics console's buffer since it was last drawn on the screen: a rectangle of
+	 * pixels, and how many lines everything has scrolled up by.
+	 */
+	struct damage {
+		int x0, y0, x1, y1;
+		int scrolled;
+
+		bool empty() const { return x0 >= x1 || y0 >= y1; }
+	};
+
 	virtual_console_mode mode_;
+
+	// A text console's buffer is the screen itself while the console is active, and a page-aligned buffer of its own
+	// otherwise, so that either can be mapped into a process, one frame at a time.  A graphics console always draws
+	// into a buffer of its own, which the physical console copies the damaged parts of onto the screen.
 	u8 *internal_buffer_;
 	size_t internal_buffer_size_;
+
+	// The damage is kept under its own lock, as text may be written from anywhere.  While the console is on the
+	// screen, the flush event is triggered whenever the console goes from being undamaged to damaged.
+	spinlock_irq damage_lock_;
+	damage damage_;
+	sched::auto_reset_event *flush_event_;
+
+	/**
+	 * @brief Every row of eight pixels that a glyph can have, in one attribute's colours, indexed by the row's bits, so
+	 * that drawing a glyph row is a copy of 32 bytes.
+	 */
+	struct glyph_palette {
+		int attr;
+		u32 rows[256][8];
+	};
+
+	// Only a few attributes are ever in use at once, so the palettes of the last few are kept, and the oldest one is
+	// built again for any other.
+	static const int nr_palettes = 4;
+	glyph_palette *palettes_;
+	int next_palette_;
+
+	const glyph_palette &palette_for(u8 attr);
+
+	spinlock_irq mappings_lock_;
+	list<buffer_mapping> mappings_;
+
 	int x_, y_, rows_, cols_;
 	keyboard_modifiers current_mod_mask_;
 	bool active_;
@@ -109,6 +183,58 @@ private:
 	shared_ptr<sched::thread> cursor_flasher_;
 
 	void render_char(int x, int y, unsigned char ch, u8 attr);
+	void put_char(unsigned char ch, u8 attr);
 	void update_cursor();
+	void scroll_gfx();
+
+	/**
+	 * @brief Adds a rectangle of pixels to what needs drawing again.
+	 */
+	void add_damage(int x0, int y0, int x1, int y1);
+	void add_damage_lines(int y0, int y1) { add_damage(0, y0, GFX_MODE_WIDTH, y1); }
+
+	/**
+	 * @brief Hands the damage over to the physical console, and forgets it.  The whole screen is damaged while a
+	 * process has the buffer mapped, as what it draws can't be tracked.
+	 */
+	damage take_damage();
+
+	/**
+	 * @brief Whether the console has scrolled since its damage was last taken.
+	 */
+	bool has_scrolled()
+	{
+		unique_irq_lock l(damage_lock_);
+		return damage_.scrolled != 0;
+	}
+
+	bool is_mapped()
+	{
+		unique_irq_lock l(mappings_lock_);
+		return !mappings_.empty();
+	}
+
+	/**
+	 * @brief Sets the event to trigger when the console is damaged, or stops triggering one with nullptr.
+	 */
+	void set_flush_event(sched::auto_reset_event *flush_event);
+
+	u8 *allocate_buffer();
+	void free_buffer(u8 *buffer);
+	int buffer_order() const;
+
+	/**
+	 * @brief Switches a text console to a different buffer (when it becomes active, or goes into the background), and
+	 * makes every process that has mapped the console fault its mappings in again, from the new buffer.
+	 */
+	void set_buffer(u8 *buffer);
+
+	/**
+	 * @brief The physical address of the given page of the console's buffer, or zero if it is past the end.
+	 */
+	u64 buffer_frame(u64 index) const;
+
+	void add_mapping(mem::address_space &as, const fs::file &file);
+	void remove_mapping(mem::address_space &as, const fs::file &file);
 };
 } // namespace stacsos::kernel::dev::console
@@ -7,10 +7,13 @@
  */
 #pragma once
 
+#include <stacsos/kernel/dev/device-manager.h>
 #include <stacsos/kernel/dev/device.h>
+#include <stacsos/kernel/fs/child-index.h>
 #include <stacsos/kernel/fs/file.h>
 #include <stacsos/kernel/fs/filesystem.h>
 #include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/lock.h>
 
 namespace stacsos::kernel::dev {
 using namespace stacsos::kernel::fs;
@@ -18,7 +21,12 @@ using namespace stacsos::kernel::fs;
 class devfs_node;
 class device;
 
-class devfs : public filesystem {
+/**
+ * @brief The file system of devices, with a file for every name a device has, e.g. /dev/console.  There is a node for
+ * each name, made once, when the device manager gives a device the name, so looking a device up (or listing them)
+ * never allocates.
+ */
+class devfs : public filesystem, private device_name_listener {
 public:
 	devfs();
 
@@ -27,6 +35,8 @@ public:
 
 private:
 	devfs_node *root_;
+
+	virtual void device_named(const string &name, device &dev) override;
 };
 
 class devfs_node : public fs_node {
@@ -47,12 +57,23 @@ public:
 			return nullptr;
 		}
 	}
-	virtual fs_node *mkdir(const char *name) override { return nullptr; }
+
+	/**
+	 * @brief Makes an empty directory in the root, for another file system to be mounted on (e.g. /dev/tune).
+	 */
+	virtual fs_node *mkdir(const char *name) override;
+
+	virtual fs_node *child_at(u64 index) override;
 
 protected:
-	virtual fs_node *resolve_child(const string &name) override;
+	virtual fs_node *resolve_child(const string_view &name) override;
 
 private:
 	device *dev_;
+
+	// The root's children, one for each name a device has, and any directories made for mounting on.  Devices are
+	// named from several boot stages at once, and at any time after that, so the index is locked.
+	spinlock_irq children_lock_;
+	child_index<devfs_node> children_;
 };
 } // namespace stacsos::kernel::dev
@@ -37,7 +37,7 @@ public:
 		return parent_->is_a(dc);
 	}
 
-	u64 get_next_index() { return index_++; }
+	u64 get_next_index() { return __atomic_fetch_add(&index_, 1, __ATOMIC_RELAXED); }
 
 private:
 	explicit device_class()
@@ -8,21 +8,39 @@
 #pragma once
 
 #include <stacsos/kernel/dev/bus.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/rcu.h>
 #include <stacsos/list.h>
-#include <stacsos/map.h>
+#include <stacsos/hash-map.h>
 #include <stacsos/string.h>
 
 namespace stacsos::kernel::dev {
 class device;
 class device_class;
 
+/**
+ * @brief Something that wants to know every name a device is given (its own, and each alias), as it is given it.
+ */
+class device_name_listener {
+public:
+	virtual ~device_name_listener() { }
+
+	/**
+	 * @brief Called with the device manager's name lock held, so must not block.
+	 */
+	virtual void device_named(const string &name, device &dev) = 0;
+};
+
 class device_manager {
 	friend class device;
 
 public:
 	DEFINE_SINGLETON(device_manager)
 
-	device_manager() { }
+	device_manager()
+		: names_(nullptr)
+	{
+	}
 
 	virtual ~device_manager() { }
 
@@ -31,12 +49,33 @@ public:
 	void register_bus(bus &bus) { buses_.append(&bus); }
 	void probe_buses();
 
+	/**
+	 * @brief Has a bus's finish_probe called once every bus has been probed, so that the slow parts of probing
+	 * several buses (such as waiting for disks) overlap, rather than each waiting for the one before it.
+	 */
+	void finish_probe_later(bus &bus) { late_buses_.append(&bus); }
+
 	string register_device(device &device);
 	void add_device_alias(device &device, const string &name);
 
+	/**
+	 * @brief Tells the listener about every name that devices already have, and then about each new one as it is added.
+	 */
+	void add_name_listener(device_name_listener &listener);
+
 	bool try_get_device_by_class(const device_class &cls, device *&ptr);
 	bool try_get_device_by_name(const string &name, device *&ptr);
 
+	/**
+	 * @brief Calls fn for every registered device, in the order they were registered.
+	 */
+	template <typename F> void for_each_device(F fn)
+	{
+		for (auto *device : registered_devices_) {
+			fn(*device);
+		}
+	}
+
 	template <class T> T &get_device_by_name(const string &name)
 	{
 		device *dp;
@@ -60,8 +99,25 @@ public:
 	bus &sysbus() { return system_bus_; }
 
 private:
-	map<u64, device *> devices_;
+	/**
+	 * @brief A version of the names that devices can be looked up by.  Devices are looked up far more often than they
+	 * are added, so lookups go through RCU, and adding a name publishes a new version with it added.
+	 */
+	struct device_names : sched::rcu_head {
+		hash_map<string, device *> devices;
+	};
+
+	spinlock_irq names_lock_;
+	device_names *names_;
+	list<device_name_listener *> name_listeners_;
+
+	void add_name(const string &name, device &device);
+
+	// Devices are registered from several boot stages at once.
+	spinlock_irq devices_lock_;
+	list<device *> registered_devices_;
 	list<bus *> buses_;
+	list<bus *> late_buses_;
 	system_bus system_bus_;
 };
 } // namespace stacsos::kernel::dev
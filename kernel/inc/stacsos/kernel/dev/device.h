@@ -11,6 +11,7 @@
 #include <stacsos/kernel/dev/device-class.h>
 #include <stacsos/kernel/fs/file.h>
 #include <stacsos/memory.h>
+#include <stacsos/string.h>
 
 namespace stacsos::kernel::fs {
 class file;
@@ -19,6 +20,8 @@ class file;
 namespace stacsos::kernel::dev {
 
 class device {
+	friend class device_manager;
+
 public:
 	device(device_class &devclass, bus &bus)
 		: devclass_(devclass)
@@ -31,6 +34,11 @@ public:
 
 	bus &parent_bus() const { return bus_; }
 
+	/**
+	 * @brief The name the device was registered under, which is empty until it is registered.
+	 */
+	const string &name() const { return name_; }
+
 	virtual void configure() = 0;
 
 	virtual shared_ptr<fs::file> open_as_file() { return nullptr; }
@@ -38,5 +46,6 @@ public:
 private:
 	device_class &devclass_;
 	bus &bus_;
+	string name_;
 };
 } // namespace stacsos::kernel::dev
@@ -26,5 +26,19 @@ public:
 
 	virtual void *fb() const = 0;
 	virtual void blit(const void *src, size_t size) = 0;
+
+	/**
+	 * @brief Copies a rectangle of 32-bit pixels, from an image whose lines are src_pitch bytes apart, to the same
+	 * place in the framebuffer, moved down by y_offset lines.
+	 */
+	virtual void blit_rect(const void *src, size_t src_pitch, int x, int y, int width, int height, int y_offset) = 0;
+
+	/**
+	 * @brief Makes the framebuffer up to the given number of lines tall, of which the screen shows a window, starting
+	 * at the line set with set_y_offset.  Returns the number of lines the device could give, which is never more than
+	 * was asked for, and is just the screen's height if the framebuffer can't be panned.
+	 */
+	virtual int set_virtual_height(int lines) = 0;
+	virtual void set_y_offset(int line) = 0;
 };
 } // namespace stacsos::kernel::dev::gfx
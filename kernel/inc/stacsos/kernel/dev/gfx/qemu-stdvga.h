@@ -20,6 +20,9 @@ public:
 		, pd_(pd)
 		, mmio_(nullptr)
 		, fb_(nullptr)
+		, width_(0)
+		, height_(0)
+		, enabled_(false)
 	{
 	}
 
@@ -30,11 +33,19 @@ public:
 	virtual void reset() override;
 	virtual void *fb() const { return fb_; }
 	virtual void blit(const void *src, size_t size) override;
+	virtual void blit_rect(const void *src, size_t src_pitch, int x, int y, int width, int height, int y_offset) override;
+	virtual int set_virtual_height(int lines) override;
+	virtual void set_y_offset(int line) override;
 
 private:
+	// How much of the framebuffer is cleared between chances for other tasks to run, when the mode is set.
+	static const u64 clear_chunk_pages = 64;
+
 	pci::pci_device &pd_;
 	void *mmio_;
 	void *fb_;
+	int width_, height_;
+	bool enabled_;
 
 	u16 dispi_read(u16 reg)
 	{
@@ -9,7 +9,10 @@
 
 #include <stacsos/kernel/dev/device.h>
 #include <stacsos/kernel/dev/input/keys.h>
+#include <stacsos/kernel/sched/event.h>
+#include <stacsos/kernel/sched/thread.h>
 #include <stacsos/list.h>
+#include <stacsos/spsc-ring.h>
 
 namespace stacsos::kernel::arch {
 class irq;
@@ -45,6 +48,16 @@ private:
 	keyboard_listener *listener_;
 	key_event_state kes_;
 
+	// The interrupt handler only queues up the scancodes, and a thread of its own hands them on to the listener, out
+	// of interrupt context.  The handler is the only producer, and the thread the only consumer, so the queue needs no
+	// lock.  Scancodes arriving while it is full are dropped.
+	spsc_ring<u8, 256> fifo_;
+	sched::auto_reset_event fifo_event_;
+	shared_ptr<sched::thread> bottom_half_;
+
+	static void bottom_half_thread_proc(void *arg);
+	void process_scancodes();
+
 	static void keyboard_irq_handler(u8, void *, void *);
 	void handle_key_event(u8 data);
 	keys scancode_to_key(u8 scancode);
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Exposes how long each step of boot took, when it started, and which core it ran on.  Each open takes a
+ * snapshot, rendered as text.
+ */
+class boot_timeline_device : public device {
+public:
+	static device_class boot_timeline_device_class;
+
+	boot_timeline_device(bus &owner)
+		: device(boot_timeline_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
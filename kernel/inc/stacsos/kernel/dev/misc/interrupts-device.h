@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Exposes how many times each vector has been raised on each core, how often each core has run its bottom
+ * halves, and which core each device interrupt is delivered to.  Each open takes a snapshot, rendered as text, and
+ * device interrupts are moved between cores with an ioctl.
+ */
+class interrupts_device : public device {
+public:
+	static device_class interrupts_device_class;
+
+	interrupts_device(bus &owner)
+		: device(interrupts_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
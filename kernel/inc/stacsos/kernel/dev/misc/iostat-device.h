@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Exposes the I/O statistics of every block device, and of the buffer cache in front of them.  Each open takes
+ * a snapshot, rendered as text.
+ */
+class iostat_device : public device {
+public:
+	static device_class iostat_device_class;
+
+	iostat_device(bus &owner)
+		: device(iostat_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Exposes the longest sections each core has run with interrupts disabled.  Each open takes a snapshot,
+ * rendered as text, and the sections are forgotten with an ioctl.
+ */
+class irq_trace_device : public device {
+public:
+	static device_class irq_trace_device_class;
+
+	irq_trace_device(bus &owner)
+		: device(irq_trace_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Exposes where kernel memory is going: the page allocator's free blocks, the slab caches, the large object
+ * allocator, page tables, the page cache, and the pages resident in each process.  Each open takes a snapshot,
+ * rendered as text.
+ */
+class meminfo_device : public device {
+public:
+	static device_class meminfo_device_class;
+
+	meminfo_device(bus &owner)
+		: device(meminfo_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Lets a thread count hardware events (cycles, instructions, cache misses and branch misses) for itself.  The
+ * counters are configured and read with ioctls, and belong to the calling thread rather than to the open file: they
+ * only count while the thread is running, and are switched out with it.
+ */
+class perf_device : public device {
+public:
+	static device_class perf_device_class;
+
+	perf_device(bus &owner)
+		: device(perf_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Exposes the scheduler trace buffers and histograms.  Each open takes a snapshot, rendered as text.
+ */
+class sched_trace_device : public device {
+public:
+	static device_class sched_trace_device_class;
+
+	sched_trace_device(bus &owner)
+		: device(sched_trace_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
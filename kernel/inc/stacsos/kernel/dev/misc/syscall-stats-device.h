@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Exposes the system call counters and latency histograms.  Each open takes a snapshot, rendered as text, and
+ * the counters are reset, or limited to one process, with ioctls.
+ */
+class syscall_stats_device : public device {
+public:
+	static device_class syscall_stats_device_class;
+
+	syscall_stats_device(bus &owner)
+		: device(syscall_stats_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+
+namespace stacsos::kernel::dev::misc {
+/**
+ * @brief Lists, enables and disables the tracepoints, and drains their rings, with ioctls.  The records taken by the
+ * last drain are read from the file.
+ */
+class tracepoints_device : public device {
+public:
+	static device_class tracepoints_device_class;
+
+	tracepoints_device(bus &owner)
+		: device(tracepoints_device_class, owner)
+	{
+	}
+
+	virtual void configure() override { }
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+};
+} // namespace stacsos::kernel::dev::misc
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/device.h>
+#include <stacsos/kernel/dev/net/packet-ring.h>
+
+namespace stacsos::kernel::dev::net {
+/**
+ * @brief A network device, with one or more pairs of receive and transmit queues, each with a packet ring of its own.
+ * There is no network stack in the kernel: the packets go to and from processes.  Opening the device (e.g. /dev/net0)
+ * claims a queue pair, preferring the one whose interrupts go to the opener's core, and the open file is the pair's
+ * packet ring, which is mapped to get at the packets, and entered (with ioctl) to send them.
+ */
+class net_device : public device {
+public:
+	static device_class net_device_class;
+
+	net_device(device_class &devclass, bus &parent)
+		: device(devclass, parent)
+	{
+	}
+
+	virtual ~net_device() { }
+
+	/**
+	 * @brief Gives the device a name of the form netN, whatever its driver, as well as the name of its own class.
+	 */
+	virtual void configure() override;
+
+	virtual shared_ptr<fs::file> open_as_file() override;
+
+	/**
+	 * @brief Claims a queue pair that nothing else has open, returning its index, or -1 if there isn't one.
+	 */
+	virtual int claim_queue() = 0;
+
+	/**
+	 * @brief Gives a claimed queue pair back, once whatever it had queued to send has gone.
+	 */
+	virtual void release_queue(unsigned int queue) = 0;
+
+	virtual packet_ring &ring(unsigned int queue) = 0;
+
+	/**
+	 * @brief Fills in what a process needs to know to use the queue pair's ring.
+	 */
+	virtual void get_info(unsigned int queue, net_ring_info &info) = 0;
+
+	/**
+	 * @brief Sends what has been queued, hands the finished receive buffers back to the device, and then waits until at
+	 * least min_received received packets are waiting.
+	 */
+	virtual void enter(unsigned int queue, u32 min_received) = 0;
+};
+} // namespace stacsos::kernel::dev::net
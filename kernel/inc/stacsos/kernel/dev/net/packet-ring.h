@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/sched/wait-queue.h>
+#include <stacsos/net-ring.h>
+
+namespace stacsos::kernel::mem {
+class page;
+}
+
+namespace stacsos::kernel::dev::net {
+/**
+ * @brief The memory of one queue pair of a network device, laid out as a packet ring (see stacsos/net-ring.h), which
+ * the process that has the pair open maps.  The receive buffers are posted to the device straight from the ring, and
+ * packets are sent straight from its transmit area, so nothing is copied.  The memory belongs to the device, and
+ * outlives any process that maps it: while nothing has the pair open, received packets go straight back to the device.
+ *
+ * The kernel keeps its own copies of the counters it owns, and of which buffer is behind each receive entry, and only
+ * trusts what the process writes as far as it can check it.  Nothing here is locked: the driver serialises access,
+ * apart from rx_pending and tx_in_flight, which may be called at any time.
+ */
+class packet_ring {
+public:
+	static const u32 rx_buffer_size = 2048;
+	static const u32 max_entries = 256;
+
+	packet_ring()
+		: rx_entries_(0)
+		, tx_entries_(0)
+		, header_(nullptr)
+		, rx_phys_(0)
+		, tx_phys_(0)
+		, rx_area_offset_(0)
+		, tx_area_offset_(0)
+		, tx_area_size_(0)
+		, size_(0)
+		, header_page_(nullptr)
+		, rx_pages_(nullptr)
+		, tx_pages_(nullptr)
+		, attached_(false)
+		, rx_tail_(0)
+		, rx_returned_(0)
+		, tx_head_(0)
+		, tx_done_(0)
+		, rx_buffers_(nullptr)
+		, tx_finished_(nullptr)
+	{
+	}
+
+	/**
+	 * @brief Allocates the ring, with the given number of receive and transmit entries (powers of two, no more than
+	 * max_entries), and a receive buffer for every receive entry.  Returns false if there isn't the memory.
+	 */
+	bool allocate(u32 rx_entries, u32 tx_entries);
+
+	u32 rx_entries() const { return rx_entries_; }
+	u32 tx_entries() const { return tx_entries_; }
+	u64 size() const { return size_; }
+	void fill_info(net_ring_info &info) const;
+
+	/**
+	 * @brief The page at the given index of the mapping, or null if the index is past its end.
+	 */
+	mem::page *own_page(u64 index) const;
+
+	u64 rx_buffer_phys(u32 buffer) const { return rx_phys_ + ((u64)buffer * rx_buffer_size); }
+
+	/**
+	 * @brief Starts the ring afresh, for a process that has just opened the pair.
+	 */
+	void attach();
+
+	/**
+	 * @brief Stops handing packets to the process, and passes every receive buffer it still had to return_buffer.
+	 * Sends must have finished first (see tx_in_flight).
+	 */
+	template <typename F> void detach(F return_buffer)
+	{
+		attached_ = false;
+
+		for (; rx_returned_ != rx_tail_; rx_returned_++) {
+			return_buffer(rx_buffers_[rx_returned_ & (rx_entries_ - 1)]);
+		}
+	}
+
+	/**
+	 * @brief Hands a received packet, in the given buffer, to the process.  Returns false if nothing has the ring open,
+	 * or the receive ring is full, in which case the buffer is still the caller's.
+	 */
+	bool deliver(u32 buffer, u32 length);
+
+	/**
+	 * @brief Passes each receive buffer the process has finished with (by advancing rx_head) to return_buffer.
+	 */
+	template <typename F> void reclaim(F return_buffer)
+	{
+		if (!attached_) {
+			return;
+		}
+
+		// A head past the tail can only be garbage, so it goes no further than the tail.
+		u32 head = __atomic_load_n(&header_->rx_head, __ATOMIC_ACQUIRE);
+		if (head - rx_returned_ > rx_tail_ - rx_returned_) {
+			head = rx_tail_;
+		}
+
+		for (; rx_returned_ != head; rx_returned_++) {
+			return_buffer(rx_buffers_[rx_returned_ & (rx_entries_ - 1)]);
+		}
+	}
+
+	/**
+	 * @brief Takes the packets the process has queued to send, passing the entry, the physical address of each packet
+	 * and its length to send.  An entry that doesn't lie inside the transmit area is finished straight away, without
+	 * being sent.
+	 */
+	template <typename F> void take(F send)
+	{
+		if (!attached_) {
+			return;
+		}
+
+		// No more than a ring's worth can be outstanding, so a tail further ahead than that is garbage.
+		u32 tail = __atomic_load_n(&header_->tx_tail, __ATOMIC_ACQUIRE);
+		if (tail - tx_done_ > tx_entries_) {
+			tail = tx_done_ + tx_entries_;
+		}
+
+		net_ring_entry *entries = net_ring_tx_entries(header_, rx_entries_);
+
+		for (; tx_head_ != tail; tx_head_++) {
+			u32 slot = tx_head_ & (tx_entries_ - 1);
+			net_ring_entry entry = entries[slot];
+
+			if (entry.offset < tx_area_offset_ || entry.length < sizeof(net_packet_header) || entry.length > tx_area_size_
+				|| entry.offset - tx_area_offset_ > tx_area_size_ - entry.length) {
+				tx_finished_[slot] = true;
+				continue;
+			}
+
+			send(slot, tx_phys_ + (entry.offset - tx_area_offset_), entry.length);
+		}
+
+		__atomic_store_n(&header_->tx_head, tx_head_, __ATOMIC_RELEASE);
+		advance_tx_done();
+	}
+
+	/**
+	 * @brief Records that the packet of the given transmit entry has been sent.  The process only sees entries as
+	 * done in order, so it can reuse their memory as if the device sent everything in order.
+	 */
+	void sent(u32 slot)
+	{
+		tx_finished_[slot] = true;
+		advance_tx_done();
+	}
+
+	/**
+	 * @brief The number of received packets the process hasn't finished with yet.
+	 */
+	u32 rx_pending() const
+	{
+		if (!__atomic_load_n(&attached_, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+
+		u32 tail = __atomic_load_n(&rx_tail_, __ATOMIC_ACQUIRE);
+		u32 head = __atomic_load_n(&header_->rx_head, __ATOMIC_ACQUIRE);
+		return tail - head > rx_entries_ ? 0 : tail - head;
+	}
+
+	u32 tx_in_flight() const { return __atomic_load_n(&tx_head_, __ATOMIC_ACQUIRE) - __atomic_load_n(&tx_done_, __ATOMIC_ACQUIRE); }
+
+	/**
+	 * @brief Woken whenever packets are received or sent.
+	 */
+	sched::wait_queue &events() { return events_; }
+
+private:
+	u32 rx_entries_, tx_entries_;
+
+	net_ring_header *header_;
+	u64 rx_phys_, tx_phys_;
+	u64 rx_area_offset_, tx_area_offset_, tx_area_size_, size_;
+
+	mem::page *header_page_;
+	mem::page *rx_pages_;
+	mem::page *tx_pages_;
+
+	bool attached_;
+	u32 rx_tail_, rx_returned_;
+	u32 tx_head_, tx_done_;
+
+	// The buffer behind each receive entry, and whether each transmit entry has been sent.
+	u32 *rx_buffers_;
+	bool *tx_finished_;
+
+	sched::wait_queue events_;
+
+	void advance_tx_done();
+};
+} // namespace stacsos::kernel::dev::net
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/dev/net/net-device.h>
+#include <stacsos/kernel/dev/virtio/virtqueue.h>
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel::dev::net {
+/**
+ * @brief A virtio network device, e.g. QEMU's virtio-net-pci.
+ *
+ * With VIRTIO_NET_F_MQ, there is a queue pair for each core (as far as the device allows), and each pair's interrupts
+ * go to its own core, on an MSI-X vector shared by its receive and transmit queues.  Every receive buffer of a pair's
+ * packet ring is kept posted to its receive queue, so a packet lands straight in memory the process has mapped, and
+ * a packet is sent straight from the ring's transmit area, as a single descriptor.  Each pair has its own lock, which
+ * only its own core and the process that has it open take.
+ *
+ * Checksum offload (both ways) and TSO are negotiated, and left to the process, through the header in front of each
+ * packet.  Without MSI-X, the queues are only looked at when the ring is entered.
+ */
+class virtio_net_device : public net_device {
+public:
+	static device_class virtio_net_device_class;
+
+	virtio_net_device(bus &parent, pci::pci_device &pcidev)
+		: net_device(virtio_net_device_class, parent)
+		, transport_(pcidev)
+		, ctrl_(nullptr)
+		, nr_pairs_(0)
+		, mtu_(1500)
+		, offloads_(0)
+		, polled_(false)
+	{
+		for (auto &pair : pairs_) {
+			pair = nullptr;
+		}
+
+		for (auto &pair : core_pairs_) {
+			pair = 0;
+		}
+
+		for (auto &b : mac_) {
+			b = 0;
+		}
+	}
+
+	virtual ~virtio_net_device() { }
+
+	/**
+	 * @brief Negotiates with the device, sets up its queues and interrupts, and posts every receive buffer.  Returns
+	 * false if the device can't be used, in which case it mustn't be registered.
+	 */
+	bool bring_up();
+
+	virtual int claim_queue() override;
+	virtual void release_queue(unsigned int queue) override;
+	virtual packet_ring &ring(unsigned int queue) override { return pairs_[queue]->ring; }
+	virtual void get_info(unsigned int queue, net_ring_info &info) override;
+	virtual void enter(unsigned int queue, u32 min_received) override;
+
+private:
+	struct queue_pair {
+		queue_pair(virtio::virtio_pci_transport &transport, unsigned int index, virtio_net_device &owner)
+			: index(index)
+			, rx(transport, (u16)(2 * index))
+			, tx(transport, (u16)((2 * index) + 1))
+			, claimed(false)
+			, owner(owner)
+		{
+		}
+
+		unsigned int index;
+
+		// Protects the queues and the ring.
+		spinlock_irq lock;
+		virtio::virtqueue rx, tx;
+		packet_ring ring;
+
+		bool claimed;
+		virtio_net_device &owner;
+	};
+
+	virtio::virtio_pci_transport transport_;
+	virtio::virtqueue *ctrl_;
+
+	queue_pair *pairs_[arch::core_manager::max_cores];
+	unsigned int nr_pairs_;
+
+	// The pair whose interrupts go to each core, by core ID.
+	unsigned int core_pairs_[arch::core_manager::max_cores];
+
+	// Protects which pairs are claimed.
+	spinlock_irq claim_lock_;
+
+	u8 mac_[6];
+	u16 mtu_;
+	u32 offloads_;
+
+	// Whether there are no interrupts, so that the queues are only looked at when a ring is entered.
+	bool polled_;
+
+	bool setup_pair(queue_pair &pair, u16 vector, bool event_idx);
+	bool set_nr_pairs(unsigned int nr_pairs);
+
+	void post_rx(queue_pair &pair, u32 buffer);
+	bool collect(queue_pair &pair);
+
+	static void virtio_net_irq_handler(u8 irq, void *ctx, void *arg);
+};
+} // namespace stacsos::kernel::dev::net
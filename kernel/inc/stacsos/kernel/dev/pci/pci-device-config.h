@@ -111,6 +111,51 @@ private:
 	void *base_;
 };
 
+/**
+ * @brief A copy of the standard part of a function's configuration header, read once, so that enumeration doesn't go
+ * back to the device for every field it looks at.
+ */
+struct pci_config_header {
+	static const unsigned int nr_words = 16;
+
+	u32 words[nr_words];
+
+	/**
+	 * @brief Reads the header, returning false (having read only the first word) if there's no function there.
+	 */
+	bool read(const pci_transport &transport)
+	{
+		words[0] = transport.read_config_word(0);
+		if ((u16)words[0] == 0xffff) {
+			return false;
+		}
+
+		for (unsigned int i = 1; i < nr_words; i++) {
+			words[i] = transport.read_config_word(i * 4);
+		}
+
+		return true;
+	}
+
+	u16 vendor_id() const { return (u16)words[0]; }
+	u16 device_id() const { return (u16)(words[0] >> 16); }
+
+	u8 subclass() const { return (u8)(words[2] >> 16); }
+	pci_native_device_class class_code() const { return (pci_native_device_class)(u8)(words[2] >> 24); }
+
+	u8 header_type() const { return (u8)(words[3] >> 16); }
+	bool is_multifunction() const { return header_type() & 0x80; }
+
+	/**
+	 * @brief Whether the function is a PCI-to-PCI bridge, with a type 1 header.
+	 */
+	bool is_bridge() const { return (header_type() & 0x7f) == 1 && class_code() == pci_native_device_class::BRIDGE && subclass() == 4; }
+
+	// Header 1
+	u8 secondary_bus_number() const { return (u8)(words[6] >> 8); }
+	u8 subordinate_bus_number() const { return (u8)(words[6] >> 16); }
+};
+
 class pci_device_configuration {
 public:
 	pci_device_configuration(pci_transport &transport)
@@ -206,7 +251,7 @@ public:
 		u32 aligned_offset = offset & ~3u;
 		u32 value_word = read_config_word(aligned_offset);
 
-		u32 mask = (1u << (sizeof(T) * 8)) - 1;
+		u32 mask = (u32)((1ull << (sizeof(T) * 8)) - 1);
 		mask <<= (8 * ((u32)offset & 3u));
 		mask = ~mask;
 
@@ -11,6 +11,10 @@
 #include <stacsos/kernel/dev/device.h>
 #include <stacsos/kernel/dev/pci/pci-device-config.h>
 
+namespace stacsos::kernel::arch::x86 {
+class x86_core;
+}
+
 namespace stacsos::kernel::dev::pci {
 class pci_bus;
 
@@ -94,9 +98,80 @@ public:
 
 	pci_device_configuration &config() const { return config_; }
 
-	void register_msi(arch::x86::irq::irq_handler_fn handler, void *arg);
+	/**
+	 * @brief Turns on the device's MSI, delivered to the given core, which runs handler when it arrives.  Returns
+	 * false if the device can't do MSI.
+	 */
+	bool enable_msi(arch::x86::x86_core &target, arch::x86::irq::irq_handler_fn handler, void *arg, const char *name = nullptr);
+
+	/**
+	 * @brief As enable_msi, delivered to the calling core.
+	 */
+	void register_msi(arch::x86::irq::irq_handler_fn handler, void *arg, const char *name = nullptr);
+
+	/**
+	 * @brief The number of vectors in the device's MSI-X table, or zero if it can't do MSI-X.
+	 */
+	unsigned int msix_vector_count();
+
+	/**
+	 * @brief Turns on MSI-X, with every vector masked until it is assigned.  Returns false if the device can't do
+	 * MSI-X.
+	 */
+	bool enable_msix();
+
+	/**
+	 * @brief Delivers one of the device's MSI-X vectors to the given core, which runs handler when it arrives, and
+	 * unmasks it.  MSI-X must have been enabled.
+	 */
+	bool assign_msix_vector(
+		unsigned int index, arch::x86::x86_core &target, arch::x86::irq::irq_handler_fn handler, void *arg, const char *name = nullptr);
+
+	void mask_msix_vector(unsigned int index, bool masked);
+
+	/**
+	 * @brief Sets up an interrupt for each of count queues, spread round-robin over the online cores, so that the
+	 * completions of different queues are handled on different cores.  Queue i's interrupt runs handler with args[i].
+	 * If the device can't do MSI-X with that many vectors, it falls back to a single MSI, delivered to the calling
+	 * core, which runs handler with args[0].
+	 *
+	 * @return The number of interrupts set up: count, one, or zero if the device can't do MSI at all.
+	 */
+	unsigned int request_queue_irqs(unsigned int count, arch::x86::irq::irq_handler_fn handler, void *const *args, const char *name = nullptr);
 
 private:
+	friend class pci_msi_source;
+	friend class pci_msix_source;
+
+	static const u8 capability_msi = 0x05;
+	static const u8 capability_msix = 0x11;
+
 	pci_device_configuration &config_;
+
+	// The MSI-X table, once MSI-X has been enabled.
+	volatile u32 *msix_table_;
+	unsigned int msix_size_;
+
+	/**
+	 * @brief Returns the offset of the capability with the given ID, or zero if the device doesn't have it.
+	 */
+	u8 find_capability(u8 id);
+
+	/**
+	 * @brief Stops the device raising its legacy interrupt, and lets it write to memory, as an MSI is a write.
+	 */
+	void prepare_for_msi();
+
+	/**
+	 * @brief Points the device's MSI at a vector on the target core.  The address and data can't be written at once,
+	 * so the message is masked while they are changed, if the device allows it.
+	 */
+	void route_msi(u8 cap, arch::x86::x86_core &target, u8 vector);
+
+	/**
+	 * @brief Points one of the device's MSI-X vectors at a vector on the target core, leaving it masked or unmasked as
+	 * it was.
+	 */
+	void route_msix(unsigned int index, arch::x86::x86_core &target, u8 vector);
 };
 } // namespace stacsos::kernel::dev::pci
@@ -7,9 +7,17 @@
  */
 #pragma once
 
+#include <stacsos/bitset.h>
 #include <stacsos/kernel/dev/bus.h>
 
 namespace stacsos::kernel::dev::pci {
+struct pci_config_header;
+
+/**
+ * @brief The functions behind a PCIe host bridge, whose configuration space is memory-mapped over a range of bus
+ * numbers.  Only the buses that can be reached are scanned: the root buses of the host bridge, and then the secondary
+ * bus of each PCI-to-PCI bridge found, as the firmware numbered them.
+ */
 class pci_express_bus : public bus {
 public:
 	pci_express_bus(bus &parent, void *base, int first_bus_id, int last_bus_id)
@@ -26,9 +34,14 @@ private:
 	void *base_;
 	int first_, last_;
 
+	// The buses that have been scanned, so that a badly numbered bridge can't cause a loop.
+	bitset<256> scanned_;
+
 	void probe_bus(unsigned int bus);
 	void probe_slot(unsigned int bus, unsigned int slot);
-	void probe_func(unsigned int bus, unsigned int slot, unsigned int func);
+	void probe_func(unsigned int bus, unsigned int slot, unsigned int func, const pci_config_header &header);
+
+	bool read_header(unsigned int bus, unsigned int slot, unsigned int func, pci_config_header &header);
 
 	void *compute_base(unsigned int bus, unsigned int slot, unsigned int func)
 	{
@@ -10,24 +10,71 @@
 #include <stacsos/kernel/dev/bus.h>
 #include <stacsos/kernel/dev/pci/pci-device.h>
 #include <stacsos/kernel/dev/storage/ahci-structures.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/wait-queue.h>
 
 namespace stacsos::kernel::dev::storage {
+class ahci_storage_device;
 
 enum class ahci_port_type { none, sata, other };
 
+/**
+ * @brief The AHCI host bus adapter.  Every port shares the controller's one MSI vector, whose handler passes the
+ * interrupt on to the device on each port that has one pending.
+ *
+ * Each disk is brought up by a thread of its own, so that however many there are, probing takes about as long as
+ * the slowest of them.  The disks are only registered once every controller's threads are done, in port order, so
+ * that they are named the same way on every boot.
+ *
+ * If the controller supports command completion coalescing, it is set up once the disks are up, to raise one
+ * interrupt for every so many completions (the ahci-ccc-count option), or once the oldest of them has waited long
+ * enough (ahci-ccc-timeout-ms), on the ports that are in it.  Each disk joins and leaves it by itself, as its queue
+ * fills and drains.
+ */
 class ahci_controller : public bus {
 public:
 	ahci_controller(bus &parent, pci::pci_device &pcidev)
 		: bus(parent)
 		, pcidev_(pcidev)
+		, abar_(nullptr)
+		, nr_probing_(0)
+		, ccc_ports_(0)
+		, ccc_irq_mask_(0)
 	{
+		for (auto &dev : port_devices_) {
+			dev = nullptr;
+		}
 	}
 
 	virtual void probe() override;
+	virtual void finish_probe() override;
+
+	/**
+	 * @brief Adds the port to the ports whose completions are coalesced, or takes it out.  The port's device turns its
+	 * own completion interrupts off while it is in, and back on before it leaves.
+	 */
+	void set_port_coalesced(volatile hba_port *port, bool coalesced);
 
 private:
 	ahci_port_type detect_port(volatile hba_port *port);
-	void activate_port(volatile hba_port *port, u64 clb, u64 fis);
+	void activate_port(int port_index, volatile hba_port *port, u64 clb, u64 fis);
+	void setup_coalescing();
+
+	static void ahci_irq_handler(u8 irq, void *ctx, void *arg);
+	static void port_probe_thread_proc(void *arg);
+
 	pci::pci_device &pcidev_;
+	volatile hba_mem *abar_;
+	ahci_storage_device *port_devices_[32];
+
+	// The number of ports whose disks are still being brought up, which finish_probe waits to reach zero.
+	unsigned int nr_probing_;
+	sched::wait_queue probe_waiters_;
+
+	// The ports that are in completion coalescing, and the bit in the interrupt status that says the coalescing
+	// threshold or timeout was reached, which is zero if coalescing is off.
+	spinlock_irq ccc_lock_;
+	u32 ccc_ports_;
+	u32 ccc_irq_mask_;
 };
 } // namespace stacsos::kernel::dev::storage
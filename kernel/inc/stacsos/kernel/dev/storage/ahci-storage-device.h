@@ -9,36 +9,122 @@
 
 #include <stacsos/kernel/dev/storage/ahci-structures.h>
 #include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/lock.h>
 
 namespace stacsos::kernel::dev::storage {
+/**
+ * @brief A SATA disk on an AHCI port.  Requests are issued to the disk and completed from the port's interrupt, so
+ * the submitting thread is free to sleep (or do something else) for as long as the disk takes.  Until the scheduler
+ * is running, there's nobody to sleep, so requests are polled for instead.
+ *
+ * If both the controller and the disk support native command queuing, every request is a queued command with the
+ * tag of its command slot, and up to the queue depth of them are outstanding at once, each completing independently
+ * when the disk clears its bit in SActive.  Otherwise, one command is given to the disk at a time.  Either way, a
+ * request that arrives when there is no room waits in a queue, and is issued as soon as a slot is free.
+ *
+ * Reads and writes share the queue, and may overlap.  A flush is never queued: it waits until nothing else is
+ * outstanding, and nothing after it is issued until it is done, so it acts as a barrier.
+ *
+ * If the controller coalesces completions, the disk's completions are left for the controller to gather up while it
+ * has at least twice the threshold outstanding, which saves an interrupt per command when it is busy.  Once it has
+ * fewer than the threshold, it goes back to an interrupt per command, so that a lightly loaded disk never waits for
+ * the timeout.
+ */
 class ahci_storage_device : public block_device {
 public:
 	static device_class ahci_storage_device_class;
 
-	ahci_storage_device(bus &parent, volatile hba_port *port)
+	ahci_storage_device(bus &parent, volatile hba_port *port, u32 host_capabilities)
 		: block_device(ahci_storage_device_class, parent)
 		, port_(port)
+		, host_capabilities_(host_capabilities)
 		, nr_blocks_(0)
+		, ncq_(false)
+		, nr_slots_(HBA_CAP_NCS(host_capabilities))
+		, rotational_(true)
+		, busy_slots_(0)
+		, exclusive_slot_(-1)
+		, coalesce_count_(0)
+		, coalesced_(false)
 	{
+		for (auto &request : slot_requests_) {
+			request = nullptr;
+		}
 	}
 
 	virtual ~ahci_storage_device() { }
 
+	/**
+	 * @brief Starts the port, finds out about the disk, and reads in its partition table.  This is called from a
+	 * thread of the disk's own, before the disk is registered, so that several disks can be brought up at once.
+	 */
+	void bring_up();
+
 	virtual void configure() override;
 
 	virtual u64 nr_blocks() const override { return nr_blocks_; }
 
+	/**
+	 * @brief The number of requests that may be outstanding on the disk at once.
+	 */
+	unsigned int queue_depth() const { return ncq_ ? nr_slots_ : 1; }
+
+	/**
+	 * @brief Completes the requests that the disk has finished with.  This is called from the controller's interrupt
+	 * handler.
+	 */
+	void handle_interrupt() { complete_finished(); }
+
+	/**
+	 * @brief Lets the disk join the controller's completion coalescing, whose threshold is the given number of
+	 * completions, whenever it is busy enough.
+	 */
+	void enable_coalescing(unsigned int count);
+
 protected:
 	virtual void submit_real_io_request(block_io_request &request) override;
 
 private:
 	volatile hba_port *port_;
+	u32 host_capabilities_;
 	u64 nr_blocks_;
 
+	// Whether requests are issued as queued commands, and how many command slots may be used.
+	bool ncq_;
+	unsigned int nr_slots_;
+	bool rotational_;
+
+	// How much the block layer may merge into one command: each request adds at most two PRDT entries more than its
+	// pages need, so these keep a merged command well inside a command table.
+	static const u64 max_merge_blocks = 128;
+	static const unsigned int max_merge_segments = 64;
+
+	// Protects the command slots and the queue of waiting requests.
+	spinlock_irq lock_;
+	block_io_request *slot_requests_[32];
+	u32 busy_slots_;
+
+	// The slot of the non-queued command that is outstanding, if any.  Nothing else may be issued alongside it.
+	int exclusive_slot_;
+	block_request_queue waiting_requests_;
+
+	// The controller's coalescing threshold, which is zero if the disk never coalesces, and whether it is currently
+	// coalescing.
+	unsigned int coalesce_count_;
+	bool coalesced_;
+
 	volatile hba_cmd_header *get_free_cmd_slot(int &slot_index);
 	void identify();
 	void detect_partitions();
 
-	void do_read_block_sync(void *buffer, u64 start, u64 count);
+	bool queued(const block_io_request &request) const { return ncq_ && request.direction != block_io_request_direction::flush; }
+	bool can_issue(const block_io_request &request) const { return !busy_slots_ || (queued(request) && exclusive_slot_ < 0); }
+
+	bool try_issue(block_io_request &request);
+	void issue_request(block_io_request &request, int slot_index);
+	u16 build_prdt(volatile hba_cmd_table *cmdtbl, const block_io_request &request);
+	void set_prdt_entry(volatile hba_cmd_table *cmdtbl, int index, u64 address, u64 size);
+	void complete_finished();
+	void update_coalescing();
 };
 } // namespace stacsos::kernel::dev::storage
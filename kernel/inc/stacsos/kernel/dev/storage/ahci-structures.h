@@ -14,12 +14,27 @@ namespace stacsos::kernel::dev::storage {
 #define HBA_PxCMD_FRE 0x0010
 #define HBA_PxCMD_FR 0x4000
 #define HBA_PxCMD_CR 0x8000
+#define HBA_PxIS_DHRS (1u << 0)
+#define HBA_PxIS_SDBS (1u << 3)
 #define HBA_PxIS_TFES (1u << 30)
+#define HBA_GHC_IE (1u << 1)
+#define HBA_CAP_CCCS (1u << 7)
+#define HBA_CAP_SNCQ (1u << 30)
+#define HBA_CAP_S64A (1u << 31)
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1)
+#define HBA_CCC_CTL_EN (1u << 0)
+#define HBA_CCC_CTL_INT(ctl) (((ctl) >> 3) & 0x1f)
+#define HBA_CCC_CTL_CC(n) (((n) & 0xffu) << 8)
+#define HBA_CCC_CTL_TV(ms) (((ms) & 0xffffu) << 16)
 
 #define ATA_DEV_BUSY 0x80
 #define ATA_DEV_DRQ 0x08
 
 #define ATA_CMD_READ_DMA_EX 0xc8
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_DMA_EX 0x35
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_FLUSH_CACHE_EX 0xea
 #define ATA_CMD_IDENTIFY 0xec
 
 enum class fis_type : u8 {
@@ -147,6 +162,12 @@ struct hba_prdt_entry {
 	u32 i : 1; // Interrupt on completion
 } __packed;
 
+// Each command table has a page to itself, which leaves room for this many PRDT entries after the header.
+#define HBA_MAX_PRDT_ENTRIES ((0x1000 - 0x80) / 16)
+
+// The most a single PRDT entry can describe.
+#define HBA_PRDT_MAX_BYTES 0x400000
+
 struct hba_cmd_table {
 	// 0x00
 	u8 cfis[64]; // Command FIS
@@ -7,10 +7,19 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/percpu.h>
 #include <stacsos/kernel/dev/device.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/list.h>
+#include <stacsos/memops.h>
 
 namespace stacsos::kernel::dev::storage {
-enum class block_io_request_direction { read, write };
+// A flush moves no data: it completes once everything written before it is on stable storage.
+enum class block_io_request_direction { read, write, flush };
+
+// How a request ended.  The buffer of a read that failed holds nothing useful.
+enum class block_io_status { ok, error, read_only };
 
 struct block_io_request;
 typedef void (*io_request_cb)(block_io_request *, void *);
@@ -22,30 +31,218 @@ struct block_io_request {
 	void *buffer;
 	io_request_cb callback;
 	void *cb_state;
+
+	// Filled in by the time the callback runs.
+	block_io_status status = block_io_status::ok;
+
+	// Requests for the blocks straight after this one, that have been merged into it, and go to the driver as part of
+	// it.  Each keeps its own buffer and callback.
+	block_io_request *next_merged = nullptr;
+
+	// Links the request into its device's queue, while it waits to go to the driver.
+	block_io_request *queue_next = nullptr;
+
+	// The page table that the buffer is mapped in.  The request may go to the driver from any context (such as the
+	// interrupt handler of an earlier request), so this is filled in when the request is submitted.
+	mem::page_table *pgtable = nullptr;
+
+	// When the request was submitted to the device, in TSC cycles, for the device's statistics.
+	u64 submit_time = 0;
+
+	u64 total_blocks() const
+	{
+		u64 blocks = 0;
+		for (const block_io_request *r = this; r; r = r->next_merged) {
+			blocks += r->block_count;
+		}
+
+		return blocks;
+	}
+
+	unsigned int nr_segments() const
+	{
+		unsigned int segments = 0;
+		for (const block_io_request *r = this; r; r = r->next_merged) {
+			segments++;
+		}
+
+		return segments;
+	}
 };
 
+/**
+ * @brief The requests that a driver has been given, but has no room for yet, for a driver that can only have so many
+ * outstanding.  Requests are issued in order, so nothing jumps ahead of one that is already waiting.  The driver
+ * protects the queue with its own lock, which it holds for all of these.
+ */
+class block_request_queue {
+public:
+	/**
+	 * @brief Issues a request with try_issue, unless there are requests waiting already, or try_issue has no room
+	 * for it, in which case it waits.  A request that was issued in part waits at the head, and try_issue carries on
+	 * with it next time.  Returns true if it was issued.
+	 */
+	template <typename F> bool issue_or_wait(block_io_request &request, F try_issue)
+	{
+		if (waiting_.empty() && try_issue(request)) {
+			return true;
+		}
+
+		waiting_.append(&request);
+		return false;
+	}
+
+	/**
+	 * @brief Issues as many of the waiting requests as try_issue has room for, in order.
+	 */
+	template <typename F> void issue_waiting(F try_issue)
+	{
+		while (!waiting_.empty() && try_issue(*waiting_.first())) {
+			waiting_.dequeue();
+		}
+	}
+
+	bool empty() const { return waiting_.empty(); }
+
+private:
+	list<block_io_request *> waiting_;
+};
+
+class io_scheduler;
+
+/**
+ * @brief What a block device has been asked to do.  The service time of a request is from when it was submitted to
+ * the device until it completed, in TSC cycles, and the histograms count requests by the power of two below their
+ * service time: bucket i holds those that took at least 2^i cycles (but less than 2^(i+1)).
+ */
+struct block_io_stats {
+	static const unsigned int nr_latency_buckets = 48;
+
+	u64 reads, writes, flushes;
+	u64 blocks_read, blocks_written;
+
+	// The number of requests that were merged into another, and so didn't go to the driver on their own.
+	u64 merges;
+
+	// The number of requests submitted but not yet complete, and the most there have been at once.
+	u64 outstanding, max_outstanding;
+
+	u64 read_cycles, write_cycles;
+	u64 read_latency[nr_latency_buckets];
+	u64 write_latency[nr_latency_buckets];
+};
+
+/**
+ * @brief A device made of fixed size blocks.  A device that sets up an I/O scheduler gets a request queue: requests
+ * wait there (being merged with their neighbours, and sorted) while the driver already has as many as it can take,
+ * or while the queue is plugged, and are passed on as the driver finishes with the ones it has.  Without a
+ * scheduler, requests go straight to the driver, taking no lock that is shared between cores on the way (the
+ * statistics are kept per core), which is what a driver with a queue for each core wants.
+ */
 class block_device : public device {
 public:
 	static device_class block_device_class;
 
 	block_device(device_class &devclass, bus &parent)
 		: device(devclass, parent)
+		, scheduler_(nullptr)
+		, nr_in_flight_(0)
+		, max_in_flight_(1)
+		, plug_count_(0)
+		, barriers_head_(nullptr)
+		, barriers_tail_(nullptr)
+		, outstanding_(0)
+		, max_outstanding_(0)
 	{
+		memops::bzero(&stats_, sizeof(stats_));
 	}
 
 	virtual ~block_device() { }
 
 	virtual u64 nr_blocks() const = 0;
 
+	/**
+	 * @brief Opens the device as a file of all its blocks, read and written through the buffer cache.
+	 */
+	virtual shared_ptr<fs::file> open_as_file() override;
+
+	/**
+	 * @brief Returns the device that actually holds a block of this one, translating the block number to match.  This
+	 * is the device itself, except for a partition, which passes the block on to its disk.
+	 */
+	virtual block_device &backing_device(u64 &block) { return *this; }
+
+	/**
+	 * @brief The alignment, in bytes, that a buffer must have for the device to transfer to or from it directly.
+	 */
+	virtual u64 dma_alignment() const { return 2; }
+
+	/**
+	 * @brief Whether the device can't be written to.  Writes to it fail, without going to the driver.
+	 */
+	virtual bool read_only() const { return false; }
+
 	void submit_io_request(block_io_request &request);
 
-	void read_blocks_sync(void *buffer, u64 start, u64 count);
-	void write_blocks_sync(const void *buffer, u64 start, u64 count);
+	/**
+	 * @brief Reads or writes a run of blocks, waiting for it to finish.  Returns false if the request failed.
+	 */
+	bool read_blocks_sync(void *buffer, u64 start, u64 count);
+	bool write_blocks_sync(const void *buffer, u64 start, u64 count);
+
+	/**
+	 * @brief Waits until every write that has completed so far is durable, i.e. out of the device's write cache.
+	 */
+	bool flush_sync();
+
+	/**
+	 * @brief Holds back queued requests until the matching unplug, so that a burst of them can be merged and sorted
+	 * before any of them go to the driver.  A thread that waits for one of its own requests unplugs the queue first.
+	 */
+	void plug();
+	void unplug();
+
+	const char *scheduler_name() const;
+
+	/**
+	 * @brief Copies out the device's statistics, which are too big to return by value.
+	 */
+	void get_io_stats(block_io_stats &stats);
 
 protected:
 	virtual void submit_real_io_request(block_io_request &request) = 0;
 
+	/**
+	 * @brief Gives the device a request queue, ordered by the given scheduler.
+	 *
+	 * @param max_in_flight The number of requests the driver can take at once.
+	 */
+	void set_scheduler(io_scheduler *scheduler, unsigned int max_in_flight);
+
+	/**
+	 * @brief Called by the driver when a request it was given (along with any merged into it) is done.  This runs
+	 * every callback, and passes the driver another request, if one is waiting.  Every request submitted to the
+	 * device must complete through here, for its statistics to add up, including one that failed.
+	 */
+	void complete_request(block_io_request &request, block_io_status status = block_io_status::ok);
+
 private:
-	void submit_sync_request(block_io_request_direction direction, void *buffer, u64 start, u64 count);
+	spinlock_irq queue_lock_;
+	io_scheduler *scheduler_;
+	unsigned int nr_in_flight_, max_in_flight_;
+	unsigned int plug_count_;
+
+	// A flush, and anything that arrives after it, waits here (in order) until everything before it has gone to the
+	// driver, so that nothing is ever sorted to the other side of one.
+	block_io_request *barriers_head_, *barriers_tail_;
+
+	// Each core counts the requests it submits and completes, and only the number outstanding is shared.
+	arch::percpu<block_io_stats> stats_;
+	u64 outstanding_, max_outstanding_;
+
+	void dispatch(unique_irq_lock &l);
+	void account_submission(block_io_request &request);
+	void account_completion(const block_io_request &request);
+	bool submit_sync_request(block_io_request_direction direction, void *buffer, u64 start, u64 count);
 };
 } // namespace stacsos::kernel::dev::storage
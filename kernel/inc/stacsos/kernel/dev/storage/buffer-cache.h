@@ -0,0 +1,191 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/wait-queue.h>
+
+namespace stacsos::kernel::dev::storage {
+
+/**
+ * @brief A block held by the buffer cache.  A buffer that has been handed out holds a reference, which must be
+ * given back with buffer_cache::release, and until then the buffer stays in the cache, and its data stays valid.
+ */
+struct block_buffer {
+	block_device *dev;
+	u64 block;
+	u8 *data;
+
+	unsigned int refcount;
+	bool valid, dirty, referenced;
+
+	// Set when the buffer couldn't be written back, until it has been.  The idle thread leaves it alone, so that a
+	// failing disk isn't retried forever, but sync tries it again.
+	bool write_failed;
+
+	// Set while the buffer is being read in or written back, which is done with the buffer's own request.
+	bool busy;
+	block_io_request io;
+
+	block_buffer *hash_next;
+};
+
+/**
+ * @brief Keeps recently used blocks of every block device in memory, so that reading the same block twice only goes
+ * to the disk once.  Blocks are cached against the device that holds them, after looking through any partitions,
+ * so a partition and its disk share one copy of each block.
+ *
+ * The cache holds a fixed number of buffers, chosen from the amount of memory that is free when it is first used,
+ * and once they are all in use, the clock algorithm picks an unreferenced buffer to reuse.  Buffers are made a page
+ * at a time, each page split into blocks, so that a buffer is never allocated on its own, and its data can always be
+ * the target of DMA.  Reusing a buffer allocates nothing.  Writes only go to the
+ * cache, and dirty buffers are written back by the idle thread, or by sync, and are never reused until they have
+ * been.  A block that can't be read is left in the cache as not valid, so that the next attempt to use it reads it
+ * again, and whoever asked for it is told that it couldn't be read.  A block that can't be written back stays dirty,
+ * so that its data isn't lost.
+ */
+class buffer_cache {
+	DEFINE_SINGLETON(buffer_cache)
+
+public:
+	static const u64 block_size = 512;
+
+	struct stats {
+		u64 buffers, capacity;
+		u64 hits, misses, evictions, writebacks;
+	};
+
+	/**
+	 * @brief Returns the buffer for a block, reading it in if it isn't cached.  The buffer must be released.
+	 *
+	 * @return The buffer, or nullptr if the block couldn't be read.
+	 */
+	block_buffer *get(block_device &dev, u64 block);
+
+	/**
+	 * @brief Gives back a buffer returned by get.
+	 */
+	void release(block_buffer *buffer);
+
+	/**
+	 * @brief Marks a buffer that is held as having been changed, so that it is written back before it is reused.  A
+	 * buffer of a read-only device is never written back.
+	 */
+	void mark_dirty(block_buffer *buffer);
+
+	/**
+	 * @brief Copies a run of blocks out of the cache.  The blocks that aren't cached are all read in together, so
+	 * that adjacent ones go to the disk as a single request.  Returns false if any of them couldn't be read.
+	 */
+	bool read(block_device &dev, void *buffer, u64 start, u64 count);
+
+	/**
+	 * @brief Starts reading in whichever blocks of a run aren't cached, without waiting for them.
+	 */
+	void prefetch(block_device &dev, u64 start, u64 count);
+
+	/**
+	 * @brief Drops whichever blocks of a run are cached, clean and not held, so that their buffers are reused first.
+	 * Returns the number of blocks dropped.
+	 */
+	u64 discard(block_device &dev, u64 start, u64 count);
+
+	/**
+	 * @brief Reads a run of blocks straight from the device into the given buffer, without going through the cache,
+	 * so that a long read is not copied twice.  A buffer in user memory is pinned first.
+	 *
+	 * @return bool false if the buffer can't be used for DMA, or some of the blocks are already cached (in which case
+	 * copying them is cheaper, and the copy on the device may be out of date), or the device couldn't read them, in
+	 * which case the caller should use read, which tries again through the cache and says if that fails too.
+	 */
+	bool read_direct(block_device &dev, void *buffer, u64 start, u64 count);
+
+	/**
+	 * @brief Copies a run of blocks into the cache, to be written back later.  Returns false, having copied nothing,
+	 * if the device is read-only.
+	 */
+	bool write(block_device &dev, const void *buffer, u64 start, u64 count);
+
+	/**
+	 * @brief Reads a number of bytes from a run of blocks, starting part way into the first one.  Partial blocks at
+	 * either end come from the cache, and the whole blocks in between are read as one run, directly if possible.
+	 * Returns false if any of the blocks couldn't be read.
+	 */
+	bool read_bytes(block_device &dev, void *buffer, u64 start, u64 offset, u64 length);
+
+	/**
+	 * @brief Writes a number of bytes to a run of blocks, starting part way into the first one, through the cache.
+	 * Returns false, having written nothing, if the device is read-only, or if a partial block at either end couldn't
+	 * be read in first (in which case the whole blocks may have been written).
+	 */
+	bool write_bytes(block_device &dev, const void *buffer, u64 start, u64 offset, u64 length);
+
+	/**
+	 * @brief Writes back every dirty block of a device, and waits until they are all durable.  Returns false if any
+	 * of them couldn't be written back, in which case they are still dirty.
+	 */
+	bool sync(block_device &dev);
+
+	/**
+	 * @brief Starts writing back a batch of dirty buffers, without waiting for them.  This is an idle task.
+	 *
+	 * @return bool true if there was anything to write back.
+	 */
+	bool write_back_some();
+
+	stats get_stats();
+
+private:
+	buffer_cache();
+
+	// The most buffers that are read, or written back, in one go.
+	static const unsigned int max_batch = 64;
+
+	// The most blocks read directly by one request, which keeps the PRDT of a buffer made of scattered pages
+	// well within a command table.
+	static const u64 max_direct_blocks = 1024;
+
+	static const u64 buffers_per_page = PAGE_SIZE / block_size;
+
+	spinlock_irq lock_;
+	sched::wait_queue io_waiters_;
+
+	block_buffer **buckets_;
+	u64 bucket_mask_;
+
+	// Every buffer, in the order the clock hand visits them.
+	block_buffer **buffers_;
+	u64 nr_buffers_, slots_, capacity_, hand_;
+	u64 nr_dirty_;
+
+	// Buffers that have been made, but not yet used for a block, linked through hash_next.
+	block_buffer *free_;
+
+	stats counters_;
+
+	block_buffer *lookup(block_device &dev, u64 block);
+	block_buffer *acquire(block_device &dev, u64 block, bool &created);
+	block_buffer *evict_one();
+
+	/**
+	 * @brief Makes a page's worth of buffers, and puts them on the free list.
+	 */
+	void grow();
+	void hash_insert(block_buffer *buffer);
+	void hash_remove(block_buffer *buffer);
+	u64 hash(block_device &dev, u64 block) const;
+
+	bool range_cached(block_device &dev, u64 start, u64 count);
+	unsigned int collect_dirty(block_device *dev, block_buffer **batch, bool hold, bool retry_failed);
+	void start_io(block_buffer **batch, unsigned int count, block_io_request_direction direction);
+	void wait_for(block_buffer *buffer);
+
+	static void io_done(block_io_request *request, void *state);
+};
+} // namespace stacsos::kernel::dev::storage
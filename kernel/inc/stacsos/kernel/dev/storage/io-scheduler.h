@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::dev::storage {
+struct block_io_request;
+
+/**
+ * @brief Decides the order in which a block device's queued requests go to the driver.  Requests are kept on
+ * intrusive lists (threaded through block_io_request::queue_next), so queuing never allocates, and may be done from
+ * an interrupt handler.  A request that carries on from (or leads into) one already queued is merged into it, so that
+ * the driver transfers the two with one command.  Flushes never reach the scheduler.
+ */
+class io_scheduler {
+public:
+	io_scheduler(u64 max_merge_blocks, unsigned int max_merge_segments)
+		: max_merge_blocks_(max_merge_blocks)
+		, max_merge_segments_(max_merge_segments)
+	{
+	}
+
+	virtual ~io_scheduler() { }
+
+	virtual const char *name() const = 0;
+
+	virtual void add(block_io_request &request) = 0;
+	virtual block_io_request *next() = 0;
+	virtual bool empty() const = 0;
+
+	static io_scheduler *create(const char *name, u64 max_merge_blocks, unsigned int max_merge_segments);
+
+protected:
+	block_io_request *try_merge(block_io_request &queued, block_io_request &request);
+
+private:
+	u64 max_merge_blocks_;
+	unsigned int max_merge_segments_;
+};
+
+/**
+ * @brief Issues requests in the order they arrive, only merging each one with the request queued just before it.
+ * This suits devices where seeking costs nothing.
+ */
+class noop_scheduler : public io_scheduler {
+public:
+	noop_scheduler(u64 max_merge_blocks, unsigned int max_merge_segments)
+		: io_scheduler(max_merge_blocks, max_merge_segments)
+		, head_(nullptr)
+		, tail_(nullptr)
+	{
+	}
+
+	virtual const char *name() const override { return "noop"; }
+
+	virtual void add(block_io_request &request) override;
+	virtual block_io_request *next() override;
+	virtual bool empty() const override { return head_ == nullptr; }
+
+private:
+	block_io_request *head_, *tail_;
+};
+
+/**
+ * @brief Keeps requests sorted by block, and issues them in one direction only (C-LOOK): the next request is the
+ * first one at or after where the last one ended, wrapping round to the lowest once there are none left above it.
+ * Any request may be merged with its neighbours in the sorted order.
+ */
+class elevator_scheduler : public io_scheduler {
+public:
+	elevator_scheduler(u64 max_merge_blocks, unsigned int max_merge_segments)
+		: io_scheduler(max_merge_blocks, max_merge_segments)
+		, head_(nullptr)
+		, position_(0)
+	{
+	}
+
+	virtual const char *name() const override { return "elevator"; }
+
+	virtual void add(block_io_request &request) override;
+	virtual block_io_request *next() override;
+	virtual bool empty() const override { return head_ == nullptr; }
+
+private:
+	block_io_request *head_;
+	u64 position_;
+};
+} // namespace stacsos::kernel::dev::storage
@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/dev/pci/pci-device.h>
+#include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/dev/storage/nvme-structures.h>
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel::dev::storage {
+/**
+ * @brief The first namespace of an NVMe controller.
+ *
+ * The controller is given an I/O submission and completion queue pair for each core (or as many as it, and its MSI-X
+ * table, allow), and each queue's completions interrupt the core that owns it.  There is no I/O scheduler: a request
+ * goes straight onto its core's queue, under that queue's lock, which no other core takes unless there are more cores
+ * than queues, so that I/O from different cores doesn't meet until it reaches the device.
+ *
+ * A request bigger than the controller will transfer in one command is split into several, and finishes when all of
+ * them have.  The submission queue's doorbell is written once for every batch of commands issued together, and the
+ * completion queue's once for every batch of completions collected.  The admin queue is only used while the
+ * controller is brought up, and is polled.
+ */
+class nvme_storage_device : public block_device {
+public:
+	static device_class nvme_storage_device_class;
+
+	nvme_storage_device(bus &parent, pci::pci_device &pcidev)
+		: block_device(nvme_storage_device_class, parent)
+		, pcidev_(pcidev)
+		, regs_(nullptr)
+		, doorbell_stride_(0)
+		, admin_(nullptr)
+		, nr_queues_(0)
+		, nr_blocks_(0)
+		, can_flush_(false)
+		, max_command_bytes_(0)
+		, polled_(false)
+	{
+		for (auto &q : queues_) {
+			q = nullptr;
+		}
+
+		for (auto &q : core_queues_) {
+			q = 0;
+		}
+	}
+
+	virtual ~nvme_storage_device() { }
+
+	/**
+	 * @brief Resets and enables the controller, identifies its first namespace, and creates the I/O queues.  Returns
+	 * false if the controller can't be used, in which case it mustn't be registered.
+	 */
+	bool bring_up();
+
+	virtual void configure() override;
+
+	virtual u64 nr_blocks() const override { return nr_blocks_; }
+
+	// PRP entries must be dword aligned.
+	virtual u64 dma_alignment() const override { return 4; }
+
+protected:
+	virtual void submit_real_io_request(block_io_request &request) override;
+
+private:
+	// Each queue is 64 entries, so that a submission queue fills a page, and has a slot for every command that can be
+	// outstanding on it (one fewer than its size, as a full queue can't be told apart from an empty one).
+	static const u16 queue_entries = 64;
+	static const u16 nr_slots = queue_entries - 1;
+	static const u16 no_slot = 0xffff;
+
+	// Each slot has 512 bytes of PRP list, enough for a 256 KiB command at any offset into its first page.
+	static const unsigned int prp_list_entries = 64;
+	static const u64 max_prp_command_bytes = prp_list_entries * PAGE_SIZE;
+
+	struct queue {
+		queue(u16 id)
+			: id(id)
+			, sq(nullptr)
+			, cq(nullptr)
+			, sq_phys(0)
+			, cq_phys(0)
+			, sq_doorbell(nullptr)
+			, cq_doorbell(nullptr)
+			, sq_tail(0)
+			, sq_rung(0)
+			, cq_head(0)
+			, phase(1)
+			, nr_free_slots(0)
+			, prp_lists(nullptr)
+			, prp_lists_phys(0)
+			, head_leader(no_slot)
+			, head_offset(0)
+			, owner(nullptr)
+		{
+		}
+
+		u16 id;
+
+		volatile nvme_command *sq;
+		volatile nvme_completion *cq;
+		u64 sq_phys, cq_phys;
+		volatile u32 *sq_doorbell;
+		volatile u32 *cq_doorbell;
+
+		// Protects everything below.
+		spinlock_irq lock;
+
+		u16 sq_tail, sq_rung;
+		u16 cq_head;
+		u16 phase;
+
+		// Each command's slot (its command identifier) records the slot of the first command of its request, which
+		// holds the request, how many of its commands are still outstanding, and whether any of them failed.
+		block_io_request *slot_requests[nr_slots];
+		u16 leaders[nr_slots];
+		u16 pending[nr_slots];
+		bool failed[nr_slots];
+		u16 free_slots[nr_slots];
+		unsigned int nr_free_slots;
+
+		u64 *prp_lists;
+		u64 prp_lists_phys;
+
+		// Requests waiting for slots.  The one at the head may have been partly issued, as far as head_offset, in which
+		// case head_leader is the slot of its first command.
+		block_request_queue waiting;
+		u16 head_leader;
+		u64 head_offset;
+
+		nvme_storage_device *owner;
+	};
+
+	pci::pci_device &pcidev_;
+	volatile u8 *regs_;
+	u32 doorbell_stride_;
+
+	queue *admin_;
+	queue *queues_[arch::core_manager::max_cores];
+	unsigned int nr_queues_;
+
+	// The queue each core submits to, by core ID.
+	unsigned int core_queues_[arch::core_manager::max_cores];
+
+	u64 nr_blocks_;
+	bool can_flush_;
+	u64 max_command_bytes_;
+
+	// Whether there are no interrupts, so that every request is polled for.
+	bool polled_;
+
+	u32 read_reg32(u32 offset) const { return *(volatile u32 *)(regs_ + offset); }
+	u64 read_reg64(u32 offset) const { return *(volatile u64 *)(regs_ + offset); }
+	void write_reg32(u32 offset, u32 value) { *(volatile u32 *)(regs_ + offset) = value; }
+	void write_reg64(u32 offset, u64 value) { *(volatile u64 *)(regs_ + offset) = value; }
+
+	bool wait_ready(bool ready, u64 timeout_ms);
+	queue *allocate_queue(u16 id);
+	bool admin_command(nvme_command &cmd, u32 &result);
+	bool identify(u32 cns, u32 nsid, u64 buffer);
+	bool create_io_queue(queue &q, u16 vector);
+
+	void detect_partitions();
+
+	bool issue_commands(queue &q, block_io_request &request);
+	void build_command(queue &q, u16 slot, const block_io_request &request, u64 offset, u64 length);
+	void ring_sq(queue &q);
+	void complete_finished(queue &q);
+
+	static void nvme_irq_handler(u8 irq, void *ctx, void *arg);
+};
+} // namespace stacsos::kernel::dev::storage
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::dev::storage {
+// Controller registers, as offsets into BAR0.
+#define NVME_REG_CAP 0x00
+#define NVME_REG_VS 0x08
+#define NVME_REG_INTMS 0x0c
+#define NVME_REG_CC 0x14
+#define NVME_REG_CSTS 0x1c
+#define NVME_REG_AQA 0x24
+#define NVME_REG_ASQ 0x28
+#define NVME_REG_ACQ 0x30
+
+// The doorbells start here, each queue having a submission queue tail doorbell followed by a completion queue head
+// doorbell, spaced apart by the doorbell stride in CAP.
+#define NVME_REG_DOORBELLS 0x1000
+
+#define NVME_CAP_MQES(cap) ((u16)((cap) & 0xffff))
+#define NVME_CAP_TO(cap) ((u8)(((cap) >> 24) & 0xff))
+#define NVME_CAP_DSTRD(cap) ((u8)(((cap) >> 32) & 0xf))
+#define NVME_CAP_MPSMIN(cap) ((u8)(((cap) >> 48) & 0xf))
+
+// Enable, with 64-byte submission and 16-byte completion queue entries, 4 KiB pages and the NVM command set.
+#define NVME_CC_EN (1u << 0)
+#define NVME_CC_IOSQES (6u << 16)
+#define NVME_CC_IOCQES (4u << 20)
+
+#define NVME_CSTS_RDY (1u << 0)
+#define NVME_CSTS_CFS (1u << 1)
+
+// Admin command opcodes.
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_IDENTIFY_NAMESPACE 0
+#define NVME_IDENTIFY_CONTROLLER 1
+
+#define NVME_FEATURE_NUMBER_OF_QUEUES 0x07
+
+// The queue creation flags: physically contiguous, and (for completion queues) interrupts enabled.
+#define NVME_QUEUE_PHYS_CONTIG (1u << 0)
+#define NVME_CQ_IRQ_ENABLED (1u << 1)
+
+// NVM command set opcodes.
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+struct nvme_command {
+	u8 opcode;
+	u8 flags;
+	u16 cid;
+	u32 nsid;
+	u64 reserved;
+	u64 mptr;
+	u64 prp1;
+	u64 prp2;
+	u32 cdw10;
+	u32 cdw11;
+	u32 cdw12;
+	u32 cdw13;
+	u32 cdw14;
+	u32 cdw15;
+} __packed;
+
+// The bottom bit of the status is the phase tag, which the controller inverts each time it wraps around the queue,
+// so an entry is new if its phase is the one the queue is expecting.
+struct nvme_completion {
+	u32 result;
+	u32 reserved;
+	u16 sq_head;
+	u16 sq_id;
+	u16 cid;
+	u16 status;
+} __packed;
+
+// The few fields of the identify structures that are needed, as byte offsets.
+#define NVME_ID_CTRL_MDTS 77
+#define NVME_ID_CTRL_VWC 525
+#define NVME_ID_NS_NSZE 0
+#define NVME_ID_NS_FLBAS 26
+#define NVME_ID_NS_LBAF 128
+} // namespace stacsos::kernel::dev::storage
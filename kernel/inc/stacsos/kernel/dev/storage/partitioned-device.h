@@ -50,6 +50,14 @@ public:
 
 	virtual u64 nr_blocks() const override { return nr_blocks_; }
 
+	virtual block_device &backing_device(u64 &block) override
+	{
+		block += block_offset_;
+		return owner_.backing_device(block);
+	}
+
+	virtual bool read_only() const override { return owner_.read_only(); }
+
 protected:
 	virtual void submit_real_io_request(block_io_request &request) override
 	{
@@ -58,9 +66,11 @@ protected:
 		underlying_request->block_count = request.block_count;
 		underlying_request->start_block = request.start_block + block_offset_;
 		underlying_request->buffer = request.buffer;
+		underlying_request->pgtable = request.pgtable;
 		underlying_request->callback = partition_request_cb;
 
 		callback_state *cb_state = new callback_state();
+		cb_state->owner = this;
 		cb_state->original_request = &request;
 
 		underlying_request->cb_state = cb_state;
@@ -70,6 +80,7 @@ protected:
 
 private:
 	struct callback_state {
+		partition *owner;
 		block_io_request *original_request;
 	};
 
@@ -77,9 +88,7 @@ private:
 	{
 		callback_state *cb_state = (callback_state *)state;
 
-		if (cb_state->original_request->callback) {
-			cb_state->original_request->callback(cb_state->original_request, cb_state->original_request->cb_state);
-		}
+		cb_state->owner->complete_request(*cb_state->original_request, request->status);
 
 		delete cb_state;
 		delete request;
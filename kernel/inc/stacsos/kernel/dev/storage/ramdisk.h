@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/storage/block-device.h>
+
+namespace stacsos::kernel::dev::storage {
+/**
+ * @brief A block device held entirely in memory: either an image loaded by the boot loader (as a multiboot module),
+ * or an empty disk made of pages from the page allocator.  Every request is a copy, done there and then in the
+ * submitting thread, so there is no request queue.
+ *
+ * The image is a filesystem on its own, rather than a partitioned disk, so the ramdisk is never scanned for
+ * partitions.
+ */
+class ramdisk : public block_device {
+public:
+	static device_class ramdisk_device_class;
+
+	/**
+	 * @brief Creates a ramdisk over physically contiguous memory that has already been filled in.
+	 */
+	ramdisk(bus &parent, u64 phys_start, u64 nr_blocks);
+
+	/**
+	 * @brief Creates an empty ramdisk, of zeroed pages from the page allocator.
+	 */
+	ramdisk(bus &parent, u64 nr_blocks);
+
+	virtual ~ramdisk() { delete[] chunks_; }
+
+	virtual void configure() override { }
+
+	virtual u64 nr_blocks() const override { return nr_blocks_; }
+
+	/**
+	 * @brief Records where the boot loader's image is, which the boot code has kept out of the page allocator.  This
+	 * is called before the memory manager is initialised.
+	 */
+	static void set_boot_image(u64 phys_start, u64 length)
+	{
+		boot_image_start_ = phys_start;
+		boot_image_length_ = length;
+	}
+
+	/**
+	 * @brief Creates the ramdisk over the boot image, if there is one, or else an empty one of the size (in MiB)
+	 * given by the "ramdisk" option, if there is one.
+	 *
+	 * @return ramdisk* The new ramdisk, or null if neither was asked for.
+	 */
+	static ramdisk *create_boot_ramdisk(bus &parent);
+
+protected:
+	virtual void submit_real_io_request(block_io_request &request) override;
+
+private:
+	// The disk is kept in chunks of 2 MiB, which need only be contiguous within themselves.
+	static const int chunk_order = 9;
+	static const u64 chunk_size = (1ull << chunk_order) << PAGE_BITS;
+	static const u64 blocks_per_chunk = chunk_size / 512;
+
+	static u64 boot_image_start_, boot_image_length_;
+
+	u8 **chunks_;
+	u64 nr_chunks_;
+	u64 nr_blocks_;
+};
+} // namespace stacsos::kernel::dev::storage
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/dev/virtio/virtqueue.h>
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel::dev::storage {
+/**
+ * @brief A virtio block device, e.g. QEMU's virtio-blk-pci.  Under a hypervisor, this is much cheaper than an emulated
+ * AHCI disk: a request is a few descriptors in memory that the device reads for itself, rather than a series of
+ * register writes that each trap, and a batch of requests costs at most one notification.
+ *
+ * Every request takes one entry of the queue, whatever its size: it is an indirect descriptor, pointing at a table of
+ * its own, with the request header, a descriptor for each physically contiguous piece of the buffers, and the status
+ * byte.  So as many requests may be outstanding as there are tables (or entries in the queue, if fewer), and each
+ * completes from the queue's MSI-X interrupt.  Until the scheduler is running, requests are polled for instead, as they
+ * are for AHCI.
+ */
+class virtio_block_device : public block_device {
+public:
+	static device_class virtio_block_device_class;
+
+	virtio_block_device(bus &parent, pci::pci_device &pcidev)
+		: block_device(virtio_block_device_class, parent)
+		, transport_(pcidev)
+		, queue_(transport_, 0)
+		, nr_blocks_(0)
+		, read_only_(false)
+		, can_flush_(false)
+		, max_segments_(max_table_segments)
+		, max_segment_size_(~0u)
+		, nr_slots_(0)
+		, nr_free_slots_(0)
+		, tables_(nullptr)
+		, headers_(nullptr)
+		, statuses_(nullptr)
+		, tables_phys_(0)
+		, headers_phys_(0)
+		, polled_(false)
+	{
+		for (auto &request : slot_requests_) {
+			request = nullptr;
+		}
+	}
+
+	virtual ~virtio_block_device() { }
+
+	/**
+	 * @brief Negotiates with the device, sets up its queue and interrupt, and reads in its partition table.  Returns
+	 * false if the device can't be used, in which case it mustn't be registered.
+	 */
+	bool bring_up();
+
+	virtual void configure() override;
+
+	virtual u64 nr_blocks() const override { return nr_blocks_; }
+
+	virtual bool read_only() const override { return read_only_; }
+
+protected:
+	virtual void submit_real_io_request(block_io_request &request) override;
+
+private:
+	static const unsigned int max_slots = 128;
+
+	// Each table is 2 KiB: the request header, the status byte, and as many data descriptors as fill the rest.
+	static const unsigned int table_entries = 128;
+	static const unsigned int max_table_segments = table_entries - 2;
+
+	// As for AHCI, how much the block layer may merge into one request.  Every request adds at most one descriptor more
+	// than its pages need, so these keep a merged request well inside a table.
+	static const u64 max_merge_blocks = 128;
+	static const unsigned int max_merge_segments = 64;
+
+	virtio::virtio_pci_transport transport_;
+	virtio::virtqueue queue_;
+
+	u64 nr_blocks_;
+	bool read_only_;
+	bool can_flush_;
+	unsigned int max_segments_;
+	u32 max_segment_size_;
+
+	// Protects the queue, the slots, and the requests waiting for a slot.
+	spinlock_irq lock_;
+	unsigned int nr_slots_;
+	block_io_request *slot_requests_[max_slots];
+	u16 free_slots_[max_slots];
+	unsigned int nr_free_slots_;
+	block_request_queue waiting_requests_;
+
+	// Each slot's indirect table, and its request header and status byte, all in pages of their own.
+	volatile virtio::virtq_desc *tables_;
+	volatile virtio::virtio_blk_req_header *headers_;
+	volatile u8 *statuses_;
+	u64 tables_phys_, headers_phys_;
+
+	// Whether there is no interrupt, so that every request is polled for.
+	bool polled_;
+
+	void detect_partitions();
+
+	bool try_issue(block_io_request &request, block_io_request *&failed);
+	bool issue_request(block_io_request &request, u16 slot);
+	void fail_requests(block_io_request *failed);
+	unsigned int build_table(u16 slot, const block_io_request &request);
+	void complete_finished();
+
+	static void virtio_irq_handler(u8 irq, void *ctx, void *arg);
+};
+} // namespace stacsos::kernel::dev::storage
@@ -9,11 +9,16 @@
 
 #include <stacsos/kernel/arch/console-interface.h>
 #include <stacsos/kernel/dev/device.h>
+#include <stacsos/iovec.h>
 
 namespace stacsos::kernel::dev::console {
 class virtual_console;
 }
 
+namespace stacsos::kernel::sched {
+class wait_set;
+}
+
 namespace stacsos::kernel::dev::tty {
 class terminal : public device, public arch::console_interface {
 public:
@@ -29,7 +34,19 @@ public:
 	virtual void write_char(unsigned char ch, u8 attr) override;
 
 	void write(const void *buffer, size_t size);
+
+	/**
+	 * @brief Writes the buffers in turn, as one stream, so an attribute escape may be split between two of them.
+	 */
+	void writev(const iovec *iov, size_t count);
 	void read(void *buffer, size_t size);
+
+	/**
+	 * @brief Reads a line of input, which can be edited (with backspace) as it is typed, and is echoed.  Returns once
+	 * the line is finished (and includes the newline), or the buffer is full.
+	 */
+	size_t read_line(char *buffer, size_t size);
+	bool input_ready(sched::wait_set *ws);
 	void clear();
 
 	void attach(console::virtual_console &vc) { attached_vc_ = &vc; }
@@ -39,5 +56,7 @@ public:
 private:
 	console::virtual_console *attached_vc_;
 	int current_attr_;
+
+	void write_run(const u8 *run, size_t length);
 };
 } // namespace stacsos::kernel::dev::tty
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/pci/pci-device.h>
+#include <stacsos/kernel/dev/virtio/virtio-structures.h>
+
+namespace stacsos::kernel::dev::virtio {
+/**
+ * @brief The modern (virtio 1.0) interface to a virtio device on PCI.  The device's structures are found through its
+ * vendor-specific capabilities, each of which names a BAR and an offset into it, and are reached through the direct
+ * map, as the MSI-X table is.
+ */
+class virtio_pci_transport {
+public:
+	virtio_pci_transport(pci::pci_device &pcidev)
+		: pcidev_(pcidev)
+		, common_(nullptr)
+		, notify_base_(nullptr)
+		, notify_multiplier_(0)
+		, device_cfg_(nullptr)
+	{
+	}
+
+	pci::pci_device &pcidev() const { return pcidev_; }
+
+	/**
+	 * @brief Finds the device's structures, resets it, and tells it a driver has been found.  Returns false if the
+	 * device doesn't have the modern interface.
+	 */
+	bool probe();
+
+	/**
+	 * @brief Accepts those of the wanted features that the device offers, which are returned.  Returns false if the
+	 * device won't work with them (or doesn't offer VIRTIO_F_VERSION_1, which every modern device must).
+	 */
+	bool negotiate_features(u64 wanted, u64 &accepted);
+
+	/**
+	 * @brief The size of a queue, or zero if the device doesn't have it.
+	 */
+	u16 queue_size(u16 index);
+
+	/**
+	 * @brief Gives the device a queue's rings, and the MSI-X vector its completions are signalled on, and turns it on.
+	 * Returns the address to write the queue's index to when there is something new on it, or null if the device
+	 * didn't take the vector.
+	 */
+	volatile u16 *setup_queue(u16 index, u16 size, u64 desc, u64 avail, u64 used, u16 msix_vector);
+
+	/**
+	 * @brief Lets the device start processing its queues.
+	 */
+	void driver_ok() { add_status(VIRTIO_STATUS_DRIVER_OK); }
+
+	void fail() { add_status(VIRTIO_STATUS_FAILED); }
+
+	volatile void *device_config() const { return device_cfg_; }
+
+private:
+	pci::pci_device &pcidev_;
+
+	volatile virtio_pci_common_cfg *common_;
+	volatile u8 *notify_base_;
+	u32 notify_multiplier_;
+	volatile void *device_cfg_;
+
+	volatile void *map_capability(u8 offset);
+	void add_status(u8 bits) { common_->device_status = common_->device_status | bits; }
+};
+} // namespace stacsos::kernel::dev::virtio
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::dev::virtio {
+// Device status bits, which the driver sets one after another as it brings the device up.
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+// Feature bits common to every device.
+#define VIRTIO_F_RING_INDIRECT_DESC (1ull << 28)
+#define VIRTIO_F_RING_EVENT_IDX (1ull << 29)
+#define VIRTIO_F_VERSION_1 (1ull << 32)
+
+// The types of the vendor-specific PCI capabilities that say where each of the device's structures are.
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+// Block device features, request types and statuses.
+#define VIRTIO_BLK_F_SIZE_MAX (1ull << 1)
+#define VIRTIO_BLK_F_SEG_MAX (1ull << 2)
+#define VIRTIO_BLK_F_RO (1ull << 5)
+#define VIRTIO_BLK_F_FLUSH (1ull << 9)
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+
+// Network device features, and the control queue's multiqueue command.
+#define VIRTIO_NET_F_CSUM (1ull << 0)
+#define VIRTIO_NET_F_GUEST_CSUM (1ull << 1)
+#define VIRTIO_NET_F_MTU (1ull << 3)
+#define VIRTIO_NET_F_MAC (1ull << 5)
+#define VIRTIO_NET_F_HOST_TSO4 (1ull << 11)
+#define VIRTIO_NET_F_HOST_TSO6 (1ull << 12)
+#define VIRTIO_NET_F_CTRL_VQ (1ull << 17)
+#define VIRTIO_NET_F_MQ (1ull << 22)
+
+#define VIRTIO_NET_CTRL_MQ 4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK 0
+
+struct virtio_pci_cap {
+	u8 cap_vndr;
+	u8 cap_next;
+	u8 cap_len;
+	u8 cfg_type;
+	u8 bar;
+	u8 id;
+	u8 padding[2];
+	u32 offset;
+	u32 length;
+} __packed;
+
+struct virtio_pci_common_cfg {
+	// About the whole device.
+	u32 device_feature_select;
+	u32 device_feature;
+	u32 driver_feature_select;
+	u32 driver_feature;
+	u16 msix_config;
+	u16 num_queues;
+	u8 device_status;
+	u8 config_generation;
+
+	// About the queue selected by queue_select.
+	u16 queue_select;
+	u16 queue_size;
+	u16 queue_msix_vector;
+	u16 queue_enable;
+	u16 queue_notify_off;
+	u32 queue_desc_lo, queue_desc_hi;
+	u32 queue_driver_lo, queue_driver_hi;
+	u32 queue_device_lo, queue_device_hi;
+} __packed;
+
+// The rings' fields are all naturally aligned, so none of them are packed.
+struct virtq_desc {
+	u64 addr;
+	u32 len;
+	u16 flags;
+	u16 next;
+};
+
+// The driver (available) ring, followed by used_event, which is where it is placed in memory.
+struct virtq_avail {
+	u16 flags;
+	u16 idx;
+	u16 ring[];
+};
+
+struct virtq_used_elem {
+	u32 id;
+	u32 len;
+};
+
+// The device (used) ring, followed by avail_event.
+struct virtq_used {
+	u16 flags;
+	u16 idx;
+	virtq_used_elem ring[];
+};
+
+struct virtio_blk_config {
+	u64 capacity;
+	u32 size_max;
+	u32 seg_max;
+	u16 cylinders;
+	u8 heads;
+	u8 sectors;
+	u32 blk_size;
+} __packed;
+
+struct virtio_blk_req_header {
+	u32 type;
+	u32 reserved;
+	u64 sector;
+} __packed;
+
+struct virtio_net_config {
+	u8 mac[6];
+	u16 status;
+	u16 max_virtqueue_pairs;
+	u16 mtu;
+} __packed;
+
+struct virtio_net_ctrl_header {
+	u8 cls;
+	u8 cmd;
+} __packed;
+} // namespace stacsos::kernel::dev::virtio
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/dev/virtio/virtio-pci-transport.h>
+
+namespace stacsos::kernel::dev::virtio {
+/**
+ * @brief A split virtqueue.  The caller owns the descriptor table, and decides which descriptors make up each buffer
+ * it hands over: the queue only moves descriptor chains through the available and used rings, and decides when the
+ * device needs telling, and when it should interrupt.
+ *
+ * With VIRTIO_F_RING_EVENT_IDX, each side says how far the other can get before it needs to hear about it.  The device
+ * is only notified when it has asked to be (i.e. not while it is still working through the ring), and only
+ * interrupts once for everything it completes before the driver has caught up.
+ *
+ * Nothing here is locked: the caller serialises access.
+ */
+class virtqueue {
+public:
+	virtqueue(virtio_pci_transport &transport, u16 index)
+		: transport_(transport)
+		, index_(index)
+		, size_(0)
+		, event_idx_(false)
+		, desc_(nullptr)
+		, avail_(nullptr)
+		, used_(nullptr)
+		, notify_(nullptr)
+		, last_used_(0)
+		, last_kicked_(0)
+		, nr_added_(0)
+	{
+	}
+
+	/**
+	 * @brief Allocates the rings, with at most max_size entries, and gives them to the device.  Returns false if the
+	 * queue doesn't exist, or the device wouldn't take the MSI-X vector.  Event indices are used if VIRTIO_F_RING_EVENT_IDX
+	 * was negotiated.
+	 */
+	bool setup(u16 max_size, u16 msix_vector, bool event_idx);
+
+	u16 size() const { return size_; }
+
+	volatile virtq_desc &desc(u16 index) { return desc_[index]; }
+
+	/**
+	 * @brief Adds a descriptor chain to the available ring.  The device doesn't see it until kick is called.
+	 */
+	void add(u16 head) { avail_->ring[(u16)(avail_->idx + nr_added_++) & (size_ - 1)] = head; }
+
+	/**
+	 * @brief Publishes everything added since the last kick, and notifies the device if it needs to know.
+	 */
+	void kick();
+
+	/**
+	 * @brief Takes the next chain the device has finished with, returning false if there isn't one.
+	 */
+	bool next_used(u16 &head, u32 &length);
+
+	/**
+	 * @brief Asks the device to interrupt when it next finishes with a chain.  Returns true if one finished in the
+	 * meantime, in which case it may not interrupt for it, so next_used should be called again.
+	 */
+	bool arm_interrupt();
+
+private:
+	virtio_pci_transport &transport_;
+	u16 index_;
+	u16 size_;
+	bool event_idx_;
+
+	volatile virtq_desc *desc_;
+	volatile virtq_avail *avail_;
+	volatile virtq_used *used_;
+	volatile u16 *notify_;
+
+	u16 last_used_;
+	u16 last_kicked_;
+	u16 nr_added_;
+
+	// Each event index follows the other side's ring.
+	volatile u16 &used_event() { return *(volatile u16 *)((volatile u8 *)avail_ + sizeof(virtq_avail) + (size_ * sizeof(u16))); }
+	volatile u16 &avail_event() { return *(volatile u16 *)((volatile u8 *)used_ + sizeof(virtq_used) + (size_ * sizeof(virtq_used_elem))); }
+};
+} // namespace stacsos::kernel::dev::virtio
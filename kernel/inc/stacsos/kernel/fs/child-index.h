@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/string.h>
+
+namespace stacsos::kernel::fs {
+
+/**
+ * @brief Finds the children of a directory by name.  The children are kept in an open-addressed hash table, along
+ * with the hash of each one's name, so a lookup only compares the names of children whose hashes match, however
+ * many children the directory has.  They are also kept in the order they were added, for listing the directory.
+ *
+ * @tparam T The type of the child nodes, which must have a name() that returns a string.
+ */
+template <typename T> class child_index {
+	DELETE_DEFAULT_COPY_AND_MOVE(child_index)
+
+public:
+	child_index()
+		: slots_(nullptr)
+		, capacity_(0)
+		, order_(nullptr)
+		, order_capacity_(0)
+		, count_(0)
+	{
+	}
+
+	~child_index()
+	{
+		delete[] slots_;
+		delete[] order_;
+	}
+
+	void insert(T *child)
+	{
+		// The table is kept at most half full, so that probe sequences stay short.
+		if ((count_ + 1) * 2 > capacity_) {
+			grow();
+		}
+
+		if (count_ == order_capacity_) {
+			grow_order();
+		}
+
+		place(child->name().get_hash(), child);
+		order_[count_++] = child;
+	}
+
+	T *find(const string_view &name) const
+	{
+		if (!count_) {
+			return nullptr;
+		}
+
+		string::hash_type hash = name.get_hash();
+
+		for (u64 i = hash & (capacity_ - 1);; i = (i + 1) & (capacity_ - 1)) {
+			const slot &s = slots_[i];
+
+			if (!s.child) {
+				return nullptr;
+			}
+
+			if (s.hash == hash && s.child->name() == name) {
+				return s.child;
+			}
+		}
+	}
+
+	u64 count() const { return count_; }
+
+	/**
+	 * @brief The memory the index itself takes up, not counting the children.
+	 */
+	u64 memory_used() const { return (capacity_ * sizeof(slot)) + (order_capacity_ * sizeof(T *)); }
+
+	/**
+	 * @brief Forgets every child, and gives back the memory the index took up.  Freeing the children is up to the
+	 * caller.
+	 */
+	void clear()
+	{
+		delete[] slots_;
+		delete[] order_;
+
+		slots_ = nullptr;
+		order_ = nullptr;
+		capacity_ = order_capacity_ = count_ = 0;
+	}
+
+	/**
+	 * @brief Returns the child that was added index'th, or null past the last child.
+	 */
+	T *at(u64 index) const { return index < count_ ? order_[index] : nullptr; }
+
+private:
+	struct slot {
+		string::hash_type hash;
+		T *child;
+	};
+
+	void place(string::hash_type hash, T *child)
+	{
+		u64 i = hash & (capacity_ - 1);
+		while (slots_[i].child) {
+			i = (i + 1) & (capacity_ - 1);
+		}
+
+		slots_[i] = { hash, child };
+	}
+
+	void grow()
+	{
+		slot *old_slots = slots_;
+		u64 old_capacity = capacity_;
+
+		capacity_ = capacity_ ? capacity_ * 2 : 16;
+		slots_ = new slot[capacity_];
+		for (u64 i = 0; i < capacity_; i++) {
+			slots_[i] = { 0, nullptr };
+		}
+
+		for (u64 i = 0; i < old_capacity; i++) {
+			if (old_slots[i].child) {
+				place(old_slots[i].hash, old_slots[i].child);
+			}
+		}
+
+		delete[] old_slots;
+	}
+
+	void grow_order()
+	{
+		order_capacity_ = order_capacity_ ? order_capacity_ * 2 : 16;
+
+		T **order = new T *[order_capacity_];
+		for (u64 i = 0; i < count_; i++) {
+			order[i] = order_[i];
+		}
+
+		delete[] order_;
+		order_ = order;
+	}
+
+	slot *slots_;
+	u64 capacity_;
+
+	T **order_;
+	u64 order_capacity_;
+
+	u64 count_;
+};
+} // namespace stacsos::kernel::fs
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/reclaimer.h>
+#include <stacsos/string.h>
+
+namespace stacsos::kernel::fs {
+class fs_node;
+
+/**
+ * @brief Remembers what each name in a directory resolved to, so that looking up a path again doesn't need to ask
+ * the file system for each of its components.  A name that didn't resolve to anything is remembered too, as a
+ * negative entry, so that searching for something that isn't there is just as quick.
+ *
+ * Entries are found by their directory and the hash of their name.  There are a fixed number of them, and once they
+ * are all in use, the oldest is reused.  A file system that adds a child must invalidate the name, so that a
+ * negative entry for it is dropped, and every entry is dropped when something is mounted or unmounted.
+ *
+ * When memory is short, the oldest entries are dropped, which frees their names, and lets the nodes they point at be
+ * evicted by their file systems.
+ */
+class dentry_cache : public mem::shrinker {
+	DEFINE_SINGLETON(dentry_cache)
+
+public:
+	/**
+	 * @brief Looks a name up in a directory.
+	 *
+	 * @param child Receives the node the name resolved to, or null for a negative entry.
+	 * @return bool true if the name was in the cache.
+	 */
+	bool lookup(fs_node *parent, const string_view &name, fs_node *&child);
+
+	/**
+	 * @brief Remembers what a name in a directory resolved to, which may be nothing.
+	 */
+	void insert(fs_node *parent, const string_view &name, fs_node *child);
+
+	void invalidate(fs_node *parent, const string_view &name);
+
+	/**
+	 * @brief Drops every entry in a directory, and in each of its children, which must be done before a file system
+	 * evicts the children, as entries point at them, and any entry in a child is found by its address.
+	 */
+	void invalidate_beneath(fs_node *dir);
+
+	void invalidate_all();
+
+	virtual u64 count_objects() override;
+	virtual u64 scan_objects(u64 nr_to_scan) override;
+
+private:
+	dentry_cache();
+
+	static const u64 nr_entries = 4096;
+	static const u64 nr_buckets = 1024;
+
+	struct entry {
+		fs_node *parent;
+		string name;
+		fs_node *child;
+		bool in_use;
+		entry *hash_next;
+	};
+
+	entry *find(fs_node *parent, const string_view &name);
+	void unlink(entry *e);
+	void drop(entry *e);
+	u64 bucket_of(fs_node *parent, const string_view &name) const { return (name.get_hash() ^ ((u64)parent >> 4)) % nr_buckets; }
+
+	// Lookups far outnumber changes, and only take the lock as readers.
+	rwlock lock_;
+
+	entry *entries_;
+	entry **buckets_;
+
+	// The next entry to be reused, which, as entries are reused in turn, is always the oldest.
+	u64 next_entry_;
+	u64 nr_in_use_;
+};
+} // namespace stacsos::kernel::fs
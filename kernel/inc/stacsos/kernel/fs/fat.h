@@ -7,75 +7,206 @@
  */
 #pragma once
 
+#include <stacsos/kernel/fs/child-index.h>
 #include <stacsos/kernel/fs/file.h>
 #include <stacsos/kernel/fs/filesystem.h>
 #include <stacsos/kernel/fs/fs-node.h>
-#include <stacsos/list.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
+#include <stacsos/kernel/mem/reclaimer.h>
+#include <stacsos/kernel/sched/mutex.h>
+#include <stacsos/bitset.h>
+#include <stacsos/intrusive-list.h>
 #include <stacsos/memory.h>
 
 namespace stacsos::kernel::fs {
 class fat_filesystem;
-class fat_file;
+class fat_node;
 
+/**
+ * @brief An open FAT file.  The file's data, and its size, belong to its node, which every open handle shares, and
+ * which is kept in memory for as long as the file is open.
+ *
+ * While the file is being read sequentially, the data after each read is fetched into the buffer cache in the
+ * background, in a window that doubles each time it is topped up, so that later reads find it already there.  Advice
+ * overrides the guess: a file advised sequential reads ahead with the largest window from its first read, wherever
+ * each read starts, and one advised random never reads ahead.
+ */
 class fat_file : public file {
 public:
-	fat_file(fat_filesystem &fs, u64 first_cluster, u64 file_size)
-		: file(file_size)
-		, fs_(fs)
-		, clusters_(nullptr)
-		, nr_clusters_(0)
-	{
-		read_cluster_list(first_cluster, file_size);
-	}
+	fat_file(fat_node &node);
+	virtual ~fat_file();
 
-	virtual ~fat_file() { delete[] clusters_; }
+	virtual u64 size() const override;
+	virtual bool can_grow() const override { return true; }
 
-	virtual size_t pread(void *buffer, size_t offset, size_t length);
-	virtual size_t pwrite(const void *buffer, size_t offset, size_t length);
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override;
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override;
+	virtual size_t preadv(const iovec *iov, size_t count, size_t offset) override;
+	virtual size_t pwritev(const iovec *iov, size_t count, size_t offset) override;
+
+	virtual bool sync() override;
+	virtual bool truncate(u64 size) override;
+	virtual void advise(u64 offset, u64 length, access_advice advice) override;
+
+	/**
+	 * @brief Registers the readahead window's tunables, which apply to every FAT file.
+	 */
+	static void add_tunables();
 
 private:
-	void read_cluster_list(u64 first_cluster, u64 file_size);
+	void readahead(u64 offset, u64 length);
+	void reset_readahead();
 
-	fat_filesystem &fs_;
-	u64 *clusters_;
-	u64 nr_clusters_;
+	// The readahead window starts at min_readahead bytes, and doubles up to max_readahead(), which is tuned through
+	// /dev/tune/blk/readahead_kb.
+	static const u64 min_readahead = KB(16);
+	static u64 max_readahead_kb;
+
+	static u64 max_readahead() { return KB(__atomic_load_n(&max_readahead_kb, __ATOMIC_RELAXED)); }
+
+	fat_node &node_;
+
+	// The last of normal, sequential or random that the file was advised.
+	access_advice pattern_;
+
+	// Where the next read starts if the file is being read sequentially, the size of the readahead window, and the
+	// end of what has been fetched so far.
+	u64 next_offset_;
+	u64 ra_window_, ra_end_;
 };
 
+/**
+ * @brief A file or directory on a FAT volume.  A file's cluster chain is read in when it is first opened, and kept as
+ * a list of extents, each a run of consecutive clusters, so that a read can ask for a whole extent at once.
+ *
+ * Writes within the clusters a file already has go to the buffer cache.  Writes past them are kept in memory, with
+ * no clusters allocated for them, until the file is synced, the data written back by the file system's write-back
+ * thread, or enough of it builds up, so that the clusters for all of it can be chosen at once, next to each other.
+ *
+ * A directory's children are read in when it is first looked in, and may be evicted again, all together, once nothing
+ * holds a reference to the directory or to any of them, to be read back in through the buffer cache when needed.
+ */
 class fat_node : public fs_node {
 	friend class fat_filesystem;
+	friend class fat_file;
+	DEFINE_KMEM_CACHE(fat_node)
 
 public:
-	fat_node(filesystem &fs, fs_node *parent, fs_node_kind kind, const string &name, u64 sector, u64 cluster, u64 data_size)
+	fat_node(filesystem &fs, fs_node *parent, fs_node_kind kind, const string &name, u64 cluster, u64 data_size, u64 dentry_sector,
+		u64 dentry_offset)
 		: fs_node(fs, parent, kind, name)
-		, sector_(sector)
+		, parent_(parent)
 		, cluster_(cluster)
 		, data_size_(data_size)
+		, dentry_sector_(dentry_sector)
+		, dentry_offset_(dentry_offset)
 		, loaded_(false)
+		, extents_loaded_(false)
+		, extents_(nullptr)
+		, nr_extents_(0)
+		, extents_capacity_(0)
+		, nr_clusters_(0)
+		, pending_(nullptr)
+		, pending_capacity_(0)
+		, dentry_dirty_(false)
+		, queued_(false)
+		, lru_link_ { nullptr, nullptr }
+		, children_bytes_(0)
 	{
 	}
 
-	virtual ~fat_node() { }
-
-	virtual shared_ptr<file> open() override { return shared_ptr<file>(new fat_file((fat_filesystem &)fs(), cluster_, data_size_)); }
-	virtual fs_node *mkdir(const char *name) override;
-
-	u64 size() const { return data_size_; } //Return the stored data size for this node (0 for directoriees).
+	virtual ~fat_node()
+	{
+		delete[] extents_;
+		delete[] pending_;
+	}
 
-	const list<fat_node *> &children() const { return children_; }
+	virtual shared_ptr<file> open() override { return shared_ptr<file>(new fat_file(*this)); }
+	virtual fs_node *mkdir(const char *name) override { return add_entry(name, true); }
+	virtual fs_node *create(const char *name) override { return add_entry(name, false); }
 
-	// Public method to ensure directory is loaded before accessing children
-	void ensure_loaded() { load(); }
+	virtual u64 size() const override { return data_size_; }
+	virtual fs_node *child_at(u64 index) override;
 
 protected:
-	virtual fs_node *resolve_child(const string &name) override;
+	virtual fs_node *resolve_child(const string_view &name) override;
 
 private:
+	struct extent {
+		u64 file_cluster; // The index of the extent's first cluster within the file.
+		u64 first_cluster;
+		u64 nr_clusters;
+	};
+
+	fat_filesystem &fatfs() const { return (fat_filesystem &)fs(); }
+
+	// The first cluster of a directory.  The root directory's entry, and any ".." entry that refers to it, has cluster
+	// zero, even on FAT32, where it does have a cluster chain.
+	u64 dir_cluster() const;
+
+	// Directories
 	void load();
+	void load_children();
+	fat_node *add_entry(const char *name, bool directory);
+	fat_node *create_entry(const char *name, bool directory);
+	bool find_free_dentry(u64 &sector, u64 &offset);
+	template <typename F> void for_each_dir_sector(F fn);
+
+	// File data, all called with the node's lock held.
+	void load_extents();
+	void add_clusters(u64 first_cluster, u64 count);
+	u64 cluster_size() const;
+	u64 allocated_bytes() const { return nr_clusters_ * cluster_size(); }
+	template <typename F> void for_each_run(u64 offset, u64 length, F fn);
+
+	size_t read_data(void *buffer, u64 offset, u64 length);
+	bool write_data(const void *buffer, u64 offset, u64 length);
+	void grow_pending(u64 length);
+	void resize(u64 size);
+	bool allocate_pending();
+	bool write_dentry();
+
+	/**
+	 * @brief Gives clusters to any data that has been written past the file's clusters, and writes the node's
+	 * directory entry.  With the lock not yet held.
+	 */
+	bool flush();
 
-	u64 sector_, cluster_;
+	// The most data that is kept in memory for a file, past its clusters, before clusters are allocated for it.
+	static const u64 max_pending = KB(512);
+
+	sched::mutex lock_;
+
+	fs_node *parent_;
+	u64 cluster_;
 	u64 data_size_;
+
+	// Where the node's directory entry is.  The root directory doesn't have one.
+	u64 dentry_sector_, dentry_offset_;
+
 	bool loaded_;
-	list<fat_node *> children_;
+	child_index<fat_node> children_;
+
+	bool extents_loaded_;
+	extent *extents_;
+	u64 nr_extents_, extents_capacity_;
+	u64 nr_clusters_;
+
+	// The data from the end of the file's clusters to the end of the file, which has nowhere on disk yet.
+	u8 *pending_;
+	u64 pending_capacity_;
+
+	bool dentry_dirty_;
+
+	// Whether the node is on its file system's list of nodes for the write-back thread, which holds a reference to it
+	// until it has been flushed.
+	bool queued_;
+
+	// A directory whose children are loaded is on its file system's list of them, least recently used first, and is
+	// charged for the memory they take up.
+	list_hook lru_link_;
+	u64 children_bytes_;
 };
 
 class fat_filesystem : public physical_filesystem {
@@ -85,12 +216,31 @@ class fat_filesystem : public physical_filesystem {
 public:
 	fat_filesystem(dev::storage::block_device &bdev)
 		: physical_filesystem(bdev)
-		, root_(*this, nullptr, fs_node_kind::directory, "", 0, 0, 0)
+		, root_(*this, nullptr, fs_node_kind::directory, "", 0, 0, 0, 0)
+		, fat_(nullptr)
+		, fat_dirty_(nullptr)
+		, fat32_(false)
+		, end_of_chain_(0xffff)
+		, active_fat_(0)
+		, mirrored_(true)
+		, alloc_hint_(2)
+		, nr_free_clusters_(0)
+		, root_cluster_(0)
+		, fsinfo_sector_(0)
+		, node_cache_bytes_(0)
+		, node_cache_budget_(0)
+		, node_cache_shrinker_(*this)
 	{
 		init();
 	}
 
-	virtual ~fat_filesystem() { }
+	virtual ~fat_filesystem()
+	{
+		mem::reclaimer::get().unregister_shrinker(node_cache_shrinker_);
+
+		delete[] fat_;
+		delete[] fat_dirty_;
+	}
 
 	virtual fs_node &root() override { return root_; }
 
@@ -99,13 +249,187 @@ private:
 
 	u64 compute_sector_for_cluster(u64 cluster) { return ((cluster - 2) * sectors_per_cluster) + first_data_sector; }
 
-	shared_ptr<u8> read_cluster(u64 cluster) { return read_cluster_from_sector(compute_sector_for_cluster(cluster)); }
-	shared_ptr<u8> read_cluster_from_sector(u64 sector);
+	/**
+	 * @brief Reads a number of bytes from a run of sectors, starting part way into the first one.  Returns false if
+	 * any of them couldn't be read.
+	 */
+	bool read_bytes(void *buffer, u64 sector, u64 offset, u64 length);
+
+	/**
+	 * @brief Writes a number of bytes to a run of sectors, through the buffer cache.  Returns false if a partial
+	 * sector at either end couldn't be read in first.
+	 */
+	bool write_bytes(const void *buffer, u64 sector, u64 offset, u64 length);
+
+	void zero_clusters(u64 first_cluster, u64 count);
+
+	u32 fat_entry(u64 cluster) const { return fat32_ ? ((const u32 *)fat_)[cluster] & 0x0fffffff : ((const u16 *)fat_)[cluster]; }
+	u64 fat_entries_per_sector() const { return fat32_ ? 128 : 256; }
+
+	u64 next_cluster(u64 this_cluster) const { return this_cluster < nr_fat_entries_ ? fat_entry(this_cluster) : end_of_chain_; }
+	void set_next_cluster(u64 this_cluster, u32 next);
+
+	bool cluster_free(u64 cluster) const { return free_map_.test(cluster); }
+	void set_cluster_free(u64 cluster, bool free);
+
+	/**
+	 * @brief The first free cluster at or after the given one, or nr_fat_entries_ if there isn't one.
+	 */
+	u64 next_free_cluster(u64 from) const;
+
+	/**
+	 * @brief The number of free clusters in a row, starting at the given one, which is free, up to at most max.
+	 */
+	u64 free_run_length(u64 from, u64 max) const;
+
+	/**
+	 * @brief Whether a FAT entry refers to a cluster, rather than marking the end of a chain, a bad cluster, or a free
+	 * one.
+	 */
+	bool in_chain(u64 cluster) const { return cluster >= 2 && cluster < nr_fat_entries_; }
+
+	/**
+	 * @brief Takes a run of free clusters, chained on to the end of an existing chain (if after isn't zero).  The run
+	 * starts straight after the end of the chain, if there is room, or else is the first run big enough, or else the
+	 * biggest there is.
+	 *
+	 * @param count The number of clusters wanted.
+	 * @param after The last cluster of the chain to extend, or zero.
+	 * @param length Receives the length of the run, which may be less than count.
+	 * @return u64 The first cluster of the run, or zero if the volume is full.
+	 */
+	u64 allocate_run(u64 count, u64 after, u64 &length);
+
+	/**
+	 * @brief Frees every cluster in a chain.
+	 */
+	void free_chain(u64 first_cluster);
+
+	/**
+	 * @brief Ends a chain at the given cluster, and frees the clusters that followed it.
+	 */
+	void truncate_chain(u64 last_cluster);
+	void free_from(u64 cluster); // With the FAT lock held.
+
+	/**
+	 * @brief Writes the sectors of the in-memory FAT that have changed back to every copy of the FAT on disk, and on
+	 * FAT32, the free cluster count and next free cluster hint back to the FSInfo sector.
+	 */
+	void write_back_fat();
+
+	void load_fat();
+
+	/**
+	 * @brief Reads the FAT32 FSInfo sector's hint of where to look for free clusters.
+	 */
+	void load_fsinfo();
+	void write_fsinfo();
 
-	u64 next_cluster(u64 this_cluster);
+	/**
+	 * @brief Puts a node on the list of nodes for the write-back thread to flush.
+	 */
+	void queue_for_writeback(fat_node &node);
+
+	/**
+	 * @brief Charges the memory taken up by a directory's children, which have just been loaded, or added to, to the
+	 * node cache.  With the directory's lock held.
+	 */
+	void charge_children(fat_node &dir, u64 bytes);
+
+	/**
+	 * @brief Makes a directory the most recently used.  With the directory's lock held.
+	 */
+	void directory_used(fat_node &dir);
+
+	/**
+	 * @brief Evicts the children of the least recently used directories, until the node cache is back within its
+	 * budget, or there is nothing left that can be evicted.  With no node locks held.
+	 */
+	void shrink_node_cache();
+
+	/**
+	 * @brief Evicts the children of the least recently used directories, until the node cache takes up no more than
+	 * the given number of bytes, or the given number of directories have been evicted, and returns how many were.
+	 * With no node locks held.
+	 */
+	u64 evict_directories(u64 target_bytes, u64 max_dirs);
+
+	/**
+	 * @brief Evicts directories when memory is short, whether or not the node cache is within its budget.
+	 */
+	class node_cache_shrinker : public mem::shrinker {
+	public:
+		node_cache_shrinker(fat_filesystem &fs)
+			: fs_(fs)
+		{
+		}
+
+		virtual u64 count_objects() override;
+		virtual u64 scan_objects(u64 nr_to_scan) override { return fs_.evict_directories(0, nr_to_scan); }
+
+	private:
+		fat_filesystem &fs_;
+	};
+
+	/**
+	 * @brief Evicts a directory's children, unless something still holds a reference to the directory or to any of
+	 * them, or any of them is itself a directory whose children are loaded.
+	 */
+	bool unload_children(fat_node &dir);
+
+	static void writeback_thread_proc(void *arg);
+
+	// The most sectors of the FAT read with one request when it is loaded.
+	static const u64 max_fat_read = 1024;
+
+	// How often the write-back thread flushes the nodes that have been written to.
+	static const u64 writeback_interval_ms = 5000;
 
 	fat_node root_;
 
+	// The whole FAT is kept in memory, as it is on disk, from when the volume is mounted: 16-bit entries for FAT16,
+	// which is at most 128 KiB, and 32-bit entries, of which the top four bits are reserved, for FAT32.  Each sector
+	// of it that has been changed is marked in the dirty bitmap, until it is written back.  The lock covers changes
+	// to the table, so that two allocations can't take the same cluster.
+	sched::mutex fat_lock_;
+	u8 *fat_;
+	u64 nr_fat_entries_;
+	u64 *fat_dirty_;
+
+	// A bit for each cluster, set if it is free, with summaries above it, so that looking for a free cluster, or the
+	// end of a free run, skips whole runs of clusters in use (or free) at once, and doesn't look at the FAT itself.
+	// It is kept up to date with the FAT, under its lock.
+	hierarchical_bitset free_map_;
+	u64 nr_fats;
+	bool fat32_;
+	u32 end_of_chain_;
+
+	// A FAT32 volume may keep only one of its FATs up to date, rather than mirroring every change into all of them.
+	u64 active_fat_;
+	bool mirrored_;
+
+	u64 alloc_hint_;
+	u64 nr_free_clusters_;
+
+	// The first cluster of the root directory, which only FAT32 keeps in a cluster chain, and the FSInfo sector, both
+	// zero for FAT16.
+	u64 root_cluster_;
+	u64 fsinfo_sector_;
+
+	spinlock_irq writeback_lock_;
+	list<fat_node *> writeback_nodes_;
+
+	// The directories whose children are loaded, and roughly how much memory the children take up altogether, which
+	// is kept within the fat-cache-size option (in KiB).  The lock covers the list and the count, and is taken with a
+	// directory's lock held.  Only one thread evicts at a time, so that a directory that it has picked can't be freed
+	// before it gets to it.
+	spinlock_irq node_cache_lock_;
+	intrusive_list<fat_node, &fat_node::lru_link_> loaded_dirs_;
+	u64 node_cache_bytes_;
+	u64 node_cache_budget_;
+	sched::mutex shrink_lock_;
+	node_cache_shrinker node_cache_shrinker_;
+
 	u64 total_sectors;
 	u64 fat_size;
 	u64 root_dir_sectors;
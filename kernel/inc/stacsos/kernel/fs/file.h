@@ -7,9 +7,22 @@
  */
 #pragma once
 
+#include <stacsos/iovec.h>
+#include <stacsos/memory.h>
+#include <stacsos/syscalls.h>
+
+namespace stacsos::kernel::sched {
+class wait_set;
+}
+
+namespace stacsos::kernel::mem {
+class address_space;
+class page;
+} // namespace stacsos::kernel::mem
+
 namespace stacsos::kernel::fs {
 class filesystem;
-class file {
+class file : public ref_counted<file> {
 public:
 	file(u64 size)
 		: size_(size)
@@ -19,16 +32,108 @@ public:
 
 	virtual ~file() { }
 
+	virtual u64 size() const { return size_; }
+
 	virtual u64 ioctl(u64 cmd, void *buffer, size_t length) { return 0; }
 
+	/**
+	 * @brief Whether a read would return without blocking.  If ws is given, the queues that are woken when that may
+	 * change are added to it.  Most files never block, and are always ready.
+	 */
+	virtual bool poll(sched::wait_set *ws) { return true; }
+
+	/**
+	 * @brief Whether the file keeps its own pages in memory, rather than going through the page cache, so that mapping
+	 * it maps them directly, wherever it was opened from.
+	 */
+	virtual bool has_own_pages() const { return false; }
+
+	/**
+	 * @brief For a file that keeps its own pages, the page at the given index, or null if there isn't one there.
+	 */
+	virtual mem::page *own_page(u64 index) { return nullptr; }
+
+	/**
+	 * @brief For a file that is a window onto device memory, the physical address of the frame at the given index,
+	 * which is mapped directly, or zero if there is none.  The frames aren't pages that the kernel manages, so they
+	 * are never pinned, copied or freed.  The frame behind an index may change, in which case the file has each
+	 * address space mapping it drop its mappings (with address_space::unmap_device_file), so that they are faulted in
+	 * again from the new frame.
+	 */
+	virtual u64 device_frame(u64 index) { return 0; }
+
+	/**
+	 * @brief Called when an address space maps the file as device memory, and again when that mapping goes away.
+	 */
+	virtual void device_mapped(mem::address_space &as) { }
+	virtual void device_unmapped(mem::address_space &as) { }
+
+	/**
+	 * @brief Whether writing past the end of the file makes it bigger, rather than being cut short.
+	 */
+	virtual bool can_grow() const { return false; }
+
+	/**
+	 * @brief Makes everything written to the file so far durable.
+	 */
+	virtual bool sync() { return true; }
+
+	/**
+	 * @brief Changes the size of the file, dropping anything past the new end, or filling the new part with zeros.
+	 */
+	virtual bool truncate(u64 size) { return false; }
+
+	/**
+	 * @brief Told how a range of the file is going to be used, so that it can read ahead, or not, accordingly.  The
+	 * advice is only a hint, which most files have no use for.
+	 */
+	virtual void advise(u64 offset, u64 length, access_advice advice) { }
+
 	virtual size_t pread(void *buffer, size_t offset, size_t length) = 0;
 	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) = 0;
 
+	/**
+	 * @brief Reads into each buffer of the list in turn, from the offset onwards, stopping at the first short read.
+	 * Files that lock around each transfer should override this, and take the lock once for the whole list.
+	 */
+	virtual size_t preadv(const iovec *iov, size_t count, size_t offset)
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < count; i++) {
+			size_t n = pread(iov[i].base, offset + total, iov[i].length);
+			total += n;
+
+			if (n < iov[i].length) {
+				break;
+			}
+		}
+
+		return total;
+	}
+
+	/**
+	 * @brief Writes each buffer of the list in turn, from the offset onwards, stopping at the first short write.
+	 */
+	virtual size_t pwritev(const iovec *iov, size_t count, size_t offset)
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < count; i++) {
+			size_t n = pwrite(iov[i].base, offset + total, iov[i].length);
+			total += n;
+
+			if (n < iov[i].length) {
+				break;
+			}
+		}
+
+		return total;
+	}
+
 	virtual size_t read(void *buffer, size_t length)
 	{
 		u64 read_length = length;
-		if ((cur_offset_ + read_length) > size_) {
-			read_length = size_ - cur_offset_;
+		if ((cur_offset_ + read_length) > size()) {
+			read_length = cur_offset_ < size() ? size() - cur_offset_ : 0;
 		}
 
 		size_t result = pread(buffer, cur_offset_, read_length);
@@ -40,8 +145,8 @@ public:
 	virtual size_t write(const void *buffer, size_t length)
 	{
 		u64 write_length = length;
-		if ((cur_offset_ + write_length) > size_) {
-			write_length = size_ - cur_offset_;
+		if (!can_grow() && (cur_offset_ + write_length) > size()) {
+			write_length = cur_offset_ < size() ? size() - cur_offset_ : 0;
 		}
 
 		size_t result = pwrite(buffer, cur_offset_, write_length);
@@ -50,6 +155,51 @@ public:
 		return result;
 	}
 
+	virtual size_t readv(const iovec *iov, size_t count)
+	{
+		// A list that runs past the end of the file is read a piece at a time, so that each piece is cut short.
+		if (cur_offset_ + iovec_length(iov, count) > size()) {
+			size_t total = 0;
+			for (size_t i = 0; i < count; i++) {
+				size_t n = read(iov[i].base, iov[i].length);
+				total += n;
+
+				if (n < iov[i].length) {
+					break;
+				}
+			}
+
+			return total;
+		}
+
+		size_t result = preadv(iov, count, cur_offset_);
+		cur_offset_ += result;
+
+		return result;
+	}
+
+	virtual size_t writev(const iovec *iov, size_t count)
+	{
+		if (!can_grow() && cur_offset_ + iovec_length(iov, count) > size()) {
+			size_t total = 0;
+			for (size_t i = 0; i < count; i++) {
+				size_t n = write(iov[i].base, iov[i].length);
+				total += n;
+
+				if (n < iov[i].length) {
+					break;
+				}
+			}
+
+			return total;
+		}
+
+		size_t result = pwritev(iov, count, cur_offset_);
+		cur_offset_ += result;
+
+		return result;
+	}
+
 private:
 	u64 size_;
 	u64 cur_offset_;
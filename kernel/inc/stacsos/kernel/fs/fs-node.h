@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/atomic.h>
 #include <stacsos/memory.h>
 #include <stacsos/string.h>
 
@@ -25,25 +26,84 @@ public:
 		, kind_(kind)
 		, mounted_fs_(nullptr)
 		, name_(name)
+		, refs_(0)
 	{
 	}
 
-	void mount(filesystem &fs) { mounted_fs_ = &fs; }
-	void umount() { mounted_fs_ = nullptr; }
+	virtual ~fs_node() { }
+
+	/**
+	 * @brief Mounts a file system on this node, which then stays in memory until it is unmounted.
+	 */
+	void mount(filesystem &fs);
+	void umount();
 
 	fs_node_kind kind() const { return kind_; }
 
+	/**
+	 * @brief Looks a path up, relative to this node, which the caller must hold a reference to (unless it is the root
+	 * of a file system, which is never evicted).
+	 *
+	 * @return fs_node* The node, with a reference taken for the caller, who must release it, or null if there isn't
+	 * one.
+	 */
 	fs_node *lookup(const char *path);
 
+	/**
+	 * @brief Takes a reference to the node.  A file system may evict a node that nothing holds a reference to, and
+	 * load it again from disk when it is next looked up, so a node pointer must not be kept without one.
+	 */
+	void acquire() { refs_.fetch_add(1); }
+	void release() { refs_.fetch_sub(1); }
+
+	/**
+	 * @brief Whether anything holds a reference to the node.
+	 */
+	bool referenced() const { return refs_.load() != 0; }
+
 	filesystem &fs() const { return fs_; }
 
+	/**
+	 * @brief The directory this node is in, or null for the root of a file system.
+	 */
+	fs_node *parent() const { return parent_node_; }
+
 	const string &name() const { return name_; }
 
+	/**
+	 * @brief The size of a file, in bytes, or zero for a directory.
+	 */
+	virtual u64 size() const { return 0; }
+
+	/**
+	 * @brief Returns a directory's index'th child, for listing it, or null once there are no more.
+	 */
+	virtual fs_node *child_at(u64 index) { return nullptr; }
+
 	virtual shared_ptr<file> open() = 0;
 	virtual fs_node *mkdir(const char *name) = 0;
 
+	/**
+	 * @brief Creates an empty file in this directory.
+	 *
+	 * @return fs_node* The new file, or null if files can't be created here, or one by that name already exists.
+	 */
+	virtual fs_node *create(const char *name) { return nullptr; }
+
 protected:
-	virtual fs_node *resolve_child(const string &name) { return nullptr; }
+	virtual fs_node *resolve_child(const string_view &name) { return nullptr; }
+
+	/**
+	 * @brief Whether what resolve_child returns may be kept in the dentry cache, which it can't be if the children
+	 * come and go without the file system knowing.
+	 */
+	virtual bool cache_children() const { return true; }
+
+	/**
+	 * @brief Must be called when a child is added to this directory, so that the dentry cache forgets that there
+	 * wasn't one by that name.
+	 */
+	void child_added(const string &name);
 
 private:
 	filesystem &fs_;
@@ -51,5 +111,6 @@ private:
 	fs_node_kind kind_;
 	filesystem *mounted_fs_;
 	string name_;
+	atomic<u64> refs_;
 };
 } // namespace stacsos::kernel::fs
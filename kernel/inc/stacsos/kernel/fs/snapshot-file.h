@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/memops.h>
+
+namespace stacsos::kernel::fs {
+/**
+ * @brief A read-only file of text that was rendered when it was opened, so that reading it a piece at a time sees one
+ * consistent snapshot of whatever it describes.  This is how the devices that report the kernel's counters and
+ * traces are read.
+ */
+class snapshot_file : public file {
+public:
+	// Handles the control requests made of the file, if it takes any, e.g. to reset what it describes.
+	typedef u64 (*ioctl_fn)(u64 cmd, void *buffer, size_t length);
+
+	/**
+	 * @brief Renders the file's text into a buffer of the given size, with render(buffer, size), which returns the
+	 * length of the text, and cuts it short if it doesn't fit.
+	 */
+	template <typename F> static shared_ptr<file> create(size_t size, F render, ioctl_fn ioctl = nullptr)
+	{
+		char *text = new char[size];
+
+		size_t length = render(text, size);
+		return shared_ptr<file>(new snapshot_file(text, length, ioctl));
+	}
+
+	virtual ~snapshot_file() { delete[] text_; }
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override
+	{
+		if (offset >= length_) {
+			return 0;
+		}
+
+		size_t n = min(length, length_ - offset);
+		memops::memcpy(buffer, text_ + offset, n);
+
+		return n;
+	}
+
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override { return 0; }
+
+	virtual u64 ioctl(u64 cmd, void *buffer, size_t length) override { return ioctl_ ? ioctl_(cmd, buffer, length) : 0; }
+
+private:
+	snapshot_file(char *text, size_t length, ioctl_fn ioctl)
+		: file(length)
+		, text_(text)
+		, length_(length)
+		, ioctl_(ioctl)
+	{
+	}
+
+	char *text_;
+	size_t length_;
+	ioctl_fn ioctl_;
+};
+} // namespace stacsos::kernel::fs
@@ -7,10 +7,11 @@
  */
 #pragma once
 
+#include <stacsos/kernel/fs/child-index.h>
 #include <stacsos/kernel/fs/file.h>
 #include <stacsos/kernel/fs/filesystem.h>
 #include <stacsos/kernel/fs/fs-node.h>
-#include <stacsos/list.h>
+#include <stacsos/kernel/sched/mutex.h>
 #include <stacsos/memory.h>
 
 namespace stacsos::kernel::fs {
@@ -30,6 +31,26 @@ struct tar_file_header {
 	char padding[255];
 } __packed;
 
+/*
+ * An archive may start with an index of everything in it, as a file called .tarfs-index, which tools/tarfs-index
+ * puts there.  It is a header, then a record for each entry of the archive, in the order they are in it, each
+ * followed by the entry's path, padded to a multiple of eight bytes.  Data starts are in blocks from the start of the
+ * archive, index and all.
+ */
+struct tarfs_index_header {
+	char magic[8]; // TARFSIX1
+	u64 nr_records;
+	u64 records_length;
+	u64 reserved;
+} __packed;
+
+struct tarfs_index_record {
+	u64 data_start;
+	u64 data_size;
+	u32 path_length;
+	u32 directory;
+} __packed;
+
 class tar_filesystem;
 class tarfs_file : public file {
 public:
@@ -47,9 +68,13 @@ private:
 	tar_filesystem &fs_;
 	u64 data_start_;
 
-	void read_file_blocks(void *buffer, u64 offset, u64 count);
+	bool read_file_blocks(void *buffer, u64 offset, u64 count);
 };
 
+/**
+ * @brief A file or directory in a tar archive.  A directory's children are only made when it is first looked in, from
+ * the run of the file system's sorted index that holds everything beneath it.
+ */
 class tarfs_node : public fs_node {
 	friend class tar_filesystem;
 
@@ -58,48 +83,118 @@ public:
 		: fs_node(fs, parent, kind, name)
 		, data_start_(data_start)
 		, data_size_(data_size)
+		, first_entry_(0)
+		, last_entry_(0)
+		, prefix_length_(0)
+		, expanded_(false)
 	{
 	}
 
 	virtual shared_ptr<file> open() override { return shared_ptr<file>(new tarfs_file((tar_filesystem &)fs(), data_start_, data_size_)); }
 	virtual fs_node *mkdir(const char *name) override;
 
+	virtual u64 size() const override { return kind() == fs_node_kind::file ? data_size_ : 0; }
+	virtual fs_node *child_at(u64 index) override;
+
 protected:
-	virtual fs_node *resolve_child(const string &name) override;
+	virtual fs_node *resolve_child(const string_view &name) override;
 
 private:
 	tarfs_node *add_child(const string &name, fs_node_kind kind, u64 data_start, u64 data_size)
 	{
 		auto *node = new tarfs_node(fs(), this, kind, name, data_start, data_size);
-		children_.append(node);
+		children_.insert(node);
+		child_added(name);
 		return node;
 	}
 
-	bool has_child(const string &name);
+	tar_filesystem &tarfs() const { return (tar_filesystem &)fs(); }
+
+	/**
+	 * @brief Makes the children of a directory from its run of the index, if that hasn't been done yet.  With the
+	 * file system's tree lock held.
+	 */
+	void expand();
 
-	list<tarfs_node *> children_;
+	child_index<tarfs_node> children_;
 	u64 data_start_, data_size_;
+
+	// The entries of the index for everything beneath this directory, and the length of the path that they all
+	// start with, including the slash after it.
+	u64 first_entry_, last_entry_;
+	u64 prefix_length_;
+	bool expanded_;
 };
 
+/**
+ * @brief A file system that reads a tar archive.  Mounting it only reads the archive's headers, a large chunk at a
+ * time, into a flat index of the paths in the archive, which is then sorted, so that everything beneath a directory
+ * is in one run of it.  Nodes are made from the index as the directories are looked in.
+ *
+ * If the archive starts with an index of itself (see tarfs_index_header), that is read instead, in one request,
+ * which saves reading a header from between the files' data for every file in the archive.
+ */
 class tar_filesystem : public physical_filesystem {
 	friend class tarfs_file;
+	friend class tarfs_node;
 
 public:
 	tar_filesystem(dev::storage::block_device &bdev)
 		: physical_filesystem(bdev)
 		, root_(*this, nullptr, fs_node_kind::directory, "", 0, 0)
+		, entries_(nullptr)
+		, nr_entries_(0)
+		, entries_capacity_(0)
+		, paths_(nullptr)
+		, paths_length_(0)
+		, paths_capacity_(0)
 	{
-		load_tree();
+		load_index();
 	}
 
-	virtual ~tar_filesystem() { }
+	virtual ~tar_filesystem()
+	{
+		delete[] entries_;
+		delete[] paths_;
+	}
 
 	virtual fs_node &root() override { return root_; }
 
 private:
-	void load_tree();
-	void register_file(const tar_file_header *header, u64 data_block_start, u64 data_size);
+	struct entry {
+		u64 path_offset, path_length;
+		u64 data_start, data_size;
+		bool directory;
+	};
+
+	// How many blocks of the archive are read at a time while its headers are indexed.
+	static const u64 index_chunk_blocks = 128;
+
+	static constexpr const char *stored_index_name = ".tarfs-index";
+
+	void load_index();
+
+	/**
+	 * @brief Fills the index from the one at the start of the archive, if there is one.
+	 *
+	 * @return bool false, with the index left empty, if there isn't one, or it isn't valid.
+	 */
+	bool load_stored_index();
+	void add_entry(const char *path, bool directory, u64 data_start, u64 data_size);
+	void sort_entries();
+
+	const char *entry_path(const entry &e) const { return &paths_[e.path_offset]; }
 
 	tarfs_node root_;
+
+	// The nodes of a directory are made with this held, so that two lookups don't both make them.
+	sched::mutex tree_lock_;
+
+	entry *entries_;
+	u64 nr_entries_, entries_capacity_;
+
+	// Every path in the archive, one after another, without terminators.
+	char *paths_;
+	u64 paths_length_, paths_capacity_;
 };
 } // namespace stacsos::kernel::fs
@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/fs/child-index.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/filesystem.h>
+#include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/mutex.h>
+
+namespace stacsos::kernel::mem {
+class page;
+}
+
+namespace stacsos::kernel::fs {
+class tmpfs;
+class tmpfs_node;
+
+/**
+ * @brief The pages of a tmpfs file, by index, in a radix tree with a page of 512 slots at each level.  The tree is only
+ * as tall as the highest index needs, and grows a level at a time, so a small file has a single level.  Missing pages
+ * are holes, which read as zeros.
+ */
+class tmpfs_page_tree {
+	DELETE_DEFAULT_COPY_AND_MOVE(tmpfs_page_tree)
+
+public:
+	tmpfs_page_tree()
+		: root_(nullptr)
+		, levels_(0)
+	{
+	}
+
+	mem::page *get(u64 index) const;
+
+	/**
+	 * @brief Puts the page in the slot for the index, which must be empty, returning false if there wasn't the
+	 * memory to grow the tree to reach it.
+	 */
+	bool set(u64 index, mem::page *pg);
+
+	/**
+	 * @brief Takes every page from the index onwards out of the tree, and hands each to fn.  The tree's own pages are
+	 * kept.
+	 */
+	template <typename F> void remove_from(u64 index, F fn) { remove_from(root_, levels_, 0, index, fn); }
+
+private:
+	static const unsigned int slot_bits = 9;
+	static const u64 nr_slots = 1ull << slot_bits;
+
+	struct level {
+		void *slots[nr_slots];
+	};
+
+	level *root_;
+	unsigned int levels_;
+
+	static level *allocate_level();
+
+	template <typename F> static void remove_from(level *lvl, unsigned int levels, u64 base, u64 index, F fn)
+	{
+		if (!lvl) {
+			return;
+		}
+
+		u64 span = 1ull << (slot_bits * (levels - 1));
+		for (u64 i = 0; i < nr_slots; i++) {
+			u64 slot_base = base + (i * span);
+			if (!lvl->slots[i] || slot_base + span <= index) {
+				continue;
+			}
+
+			if (levels == 1) {
+				fn((mem::page *)lvl->slots[i]);
+				lvl->slots[i] = nullptr;
+			} else {
+				remove_from((level *)lvl->slots[i], levels - 1, slot_base, index, fn);
+			}
+		}
+	}
+};
+
+/**
+ * @brief An open tmpfs file.  The data, and its size, belong to the node, which every open handle shares.  A tmpfs
+ * file keeps its own pages, so mapping it maps the pages themselves.
+ */
+class tmpfs_file : public file {
+public:
+	tmpfs_file(tmpfs_node &node);
+	virtual ~tmpfs_file();
+
+	virtual u64 size() const override;
+	virtual bool can_grow() const override { return true; }
+	virtual bool has_own_pages() const override { return true; }
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override;
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override;
+	virtual bool truncate(u64 size) override;
+
+	virtual mem::page *own_page(u64 index) override;
+
+private:
+	tmpfs_node &node_;
+};
+
+/**
+ * @brief A file or directory in a tmpfs.  A file's pages are allocated as they are first written (or mapped), up to
+ * the end of the file.  Shrinking a file zeroes what was cut off, but the pages it was in are only given back once the
+ * file isn't open anywhere, as, until then, they may still be mapped.
+ */
+class tmpfs_node : public fs_node {
+	friend class tmpfs_file;
+
+public:
+	tmpfs_node(filesystem &fs, fs_node *parent, fs_node_kind kind, const string &name)
+		: fs_node(fs, parent, kind, name)
+		, size_(0)
+		, open_files_(0)
+	{
+	}
+
+	virtual shared_ptr<file> open() override;
+	virtual fs_node *mkdir(const char *name) override { return add_child(name, fs_node_kind::directory); }
+	virtual fs_node *create(const char *name) override { return add_child(name, fs_node_kind::file); }
+
+	virtual u64 size() const override { return __atomic_load_n(&size_, __ATOMIC_RELAXED); }
+	virtual fs_node *child_at(u64 index) override;
+
+protected:
+	virtual fs_node *resolve_child(const string_view &name) override;
+
+private:
+	tmpfs &tmp() const;
+
+	tmpfs_node *add_child(const char *name, fs_node_kind kind);
+
+	/**
+	 * @brief The page at the index, allocating it if it is a hole and allocate is set.  Returns null for a hole that
+	 * isn't to be filled, or if the file system is full.
+	 */
+	mem::page *page_at(u64 index, bool allocate);
+
+	void zero_range(u64 offset, u64 length);
+
+	// Taken by writers and truncation, so that the size only changes once the data it covers is there.
+	sched::mutex lock_;
+
+	// Protects the page tree and the count of open files.  It is taken with the page tables of an address space
+	// locked, when one of the pages is faulted in, so nothing that might block is done while it is held.
+	spinlock_irq pages_lock_;
+
+	tmpfs_page_tree pages_;
+	u64 size_;
+	u64 open_files_;
+
+	// Protects the children, which are never removed.
+	sched::mutex children_lock_;
+	child_index<tmpfs_node> children_;
+};
+
+/**
+ * @brief A file system that keeps everything in memory, for scratch files that would be slow to write to a disk,
+ * e.g. those passed from one stage of a pipeline to the next.  Nothing survives a reboot.  The pages that file data
+ * is kept in come out of a fixed allowance, set (in MiB) by the tmpfs-size option.
+ */
+class tmpfs : public filesystem {
+	friend class tmpfs_file;
+	friend class tmpfs_node;
+
+public:
+	tmpfs(u64 max_pages)
+		: root_(*this, nullptr, fs_node_kind::directory, "")
+		, max_pages_(max_pages)
+		, used_pages_(0)
+	{
+	}
+
+	virtual ~tmpfs() { }
+
+	virtual fs_node &root() override { return root_; }
+
+	u64 max_pages() const { return max_pages_; }
+	u64 used_pages() const { return __atomic_load_n(&used_pages_, __ATOMIC_RELAXED); }
+
+private:
+	tmpfs_node root_;
+	u64 max_pages_;
+	u64 used_pages_;
+
+	bool charge_page();
+	void uncharge_page() { __atomic_fetch_sub(&used_pages_, 1, __ATOMIC_RELAXED); }
+};
+} // namespace stacsos::kernel::fs
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/fs/child-index.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/filesystem.h>
+#include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/tunables.h>
+
+namespace stacsos::kernel::fs {
+class tunefs_node;
+
+/**
+ * @brief The file system of runtime tunables, mounted on /dev/tune, with a file for each tunable, in directories that
+ * follow its path, e.g. /dev/tune/sched/quantum_ms.  Reading a file gives the tunable's value, in decimal, and writing
+ * a decimal number to it changes it, if the number is valid.  The nodes are made as the tunables are registered, and
+ * are never evicted.
+ */
+class tunefs : public filesystem, private tunable_listener {
+public:
+	tunefs();
+
+	virtual ~tunefs() { }
+	virtual fs_node &root() override { return *(fs_node *)root_; }
+
+private:
+	tunefs_node *root_;
+
+	virtual void tunable_added(tunable &t) override;
+};
+
+class tunefs_node : public fs_node {
+	friend class tunefs;
+
+public:
+	tunefs_node(filesystem &fs, fs_node *parent, fs_node_kind kind, const string &name, tunable *t)
+		: fs_node(fs, parent, kind, name)
+		, tunable_(t)
+	{
+	}
+
+	virtual shared_ptr<file> open() override;
+	virtual fs_node *mkdir(const char *name) override { return nullptr; }
+
+	virtual fs_node *child_at(u64 index) override;
+
+protected:
+	virtual fs_node *resolve_child(const string_view &name) override;
+
+private:
+	tunable *tunable_;
+
+	spinlock_irq children_lock_;
+	child_index<tunefs_node> children_;
+};
+} // namespace stacsos::kernel::fs
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel {
+struct irq_off_section {
+	static const unsigned int max_depth = 8;
+
+	u64 cycles;
+
+	// Where interrupts were enabled again, and the return addresses of the frames they were disabled in, innermost
+	// first.
+	u64 end;
+	u8 depth;
+	u64 stack[max_depth];
+};
+
+/**
+ * @brief Measures how long each core runs with interrupts disabled, by timing every section between irq_save (which
+ * spinlock_irq and unique_irq_lock go through, when tracing is built in) finding interrupts enabled, and irq_restore
+ * enabling them again.  Each core keeps its own worst sections, with the call stack they started in, so recording one
+ * takes no locks.  Interrupt handlers, which run with interrupts disabled from the start, aren't seen.
+ *
+ * The hooks are only compiled in with irq-trace=1, as they walk the stack every time interrupts are disabled.  Readers
+ * take an unsynchronised snapshot, which may catch a core in the middle of recording a section.
+ */
+class irq_tracer {
+	DEFINE_SINGLETON(irq_tracer)
+
+private:
+	irq_tracer()
+		: armed_(false)
+	{
+		for (auto &c : cores_) {
+			c.started_at = 0;
+			c.nr_sections = 0;
+		}
+	}
+
+public:
+	static const unsigned int max_worst = 8;
+
+	static constexpr bool built_in() { return STACSOS_IRQ_TRACE; }
+
+	/**
+	 * @brief Starts recording sections.  Until then, the hooks do nothing, as the per-core state can't be found
+	 * before every core has a task.
+	 */
+	void start() { __atomic_store_n(&armed_, true, __ATOMIC_RELEASE); }
+
+	/**
+	 * @brief Forgets the worst sections of every core.
+	 */
+	void reset();
+
+	/**
+	 * @brief Called (with interrupts disabled) when interrupts have just been disabled.
+	 */
+	void section_start();
+
+	/**
+	 * @brief Called (with interrupts still disabled) when interrupts are about to be enabled, from the given address.
+	 */
+	void section_end(u64 end);
+
+	/**
+	 * @brief Renders the worst sections of every core as text, one per line.  Returns the number of characters written.
+	 */
+	size_t render(char *buffer, size_t size);
+
+	/**
+	 * @brief Returns a buffer size that is large enough for render().
+	 */
+	size_t render_size_hint();
+
+private:
+	struct per_core_trace {
+		// When the current section started, or zero if interrupts weren't disabled through irq_save.
+		u64 started_at;
+		irq_off_section current;
+
+		u64 nr_sections;
+
+		// Sorted longest first.
+		irq_off_section worst[max_worst];
+	};
+
+	bool armed_;
+	arch::percpu<per_core_trace> cores_;
+
+	static void reset_core(void *arg);
+};
+} // namespace stacsos::kernel
@@ -7,6 +7,10 @@
  */
 #pragma once
 
+// Marks a function that is only ever run while the kernel is booting.  These are kept apart from the rest of the
+// kernel's code, and their pages are given back once boot is done, after which they must never be called.
+#define __init __attribute__((section(".init.text"), cold))
+
 static inline void *phys_to_virt(unsigned long phys_addr)
 {
     return (void *)(phys_addr + 0xffff'8000'0000'0000);
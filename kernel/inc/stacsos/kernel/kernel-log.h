@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+
+namespace stacsos::kernel {
+/**
+ * @brief Keeps the kernel's log messages in a ring buffer per core.  Each core only ever appends to its own ring, with
+ * interrupts disabled, so logging takes no locks, and can be done from anywhere.  Once a ring is full, the oldest
+ * messages in it are overwritten.
+ *
+ * Messages are numbered as they are logged, so that readers can put those from different cores back in order.  A
+ * reader copies a message out and then checks it wasn't overwritten while it was being copied, so reading takes no
+ * locks either.
+ */
+class kernel_log {
+	DEFINE_SINGLETON(kernel_log)
+
+private:
+	kernel_log()
+		: sequence_(0)
+	{
+	}
+
+public:
+	static const size_t ring_size = 16384;
+	static const size_t max_message_length = 512;
+
+	/**
+	 * @brief Where a reader has got to in each core's ring.
+	 */
+	struct cursor {
+		u64 positions[arch::core_manager::max_cores];
+	};
+
+	void append(const char *text, size_t length);
+
+	/**
+	 * @brief Starts a cursor at the oldest message still in the log, or just after the newest one.
+	 */
+	void start_cursor(cursor &c, bool at_end);
+
+	/**
+	 * @brief Copies the next message (in the order they were logged) into text, with a terminating NUL, and moves the
+	 * cursor past it.  Returns the message's length, or zero if there are no more.  A message that was overwritten
+	 * before the cursor got to it is skipped.
+	 */
+	size_t next(cursor &c, char *text, size_t size);
+
+	/**
+	 * @brief Renders every message still in the log, in order.  Returns the number of characters written.
+	 */
+	size_t render(char *buffer, size_t size);
+
+	static size_t render_size_hint() { return arch::core_manager::max_cores * ring_size; }
+
+private:
+	struct record_header {
+		u64 sequence;
+		u64 length;
+	};
+
+	// Each ring is only written to by its own core.  The records between tail and head are valid, and the tail is
+	// moved past the oldest ones to make room for new ones.
+	struct per_core_log {
+		u8 data[ring_size];
+		u64 head;
+		u64 tail;
+	};
+
+	per_core_log cores_[arch::core_manager::max_cores];
+	u64 sequence_;
+
+	static u64 record_size(u64 length) { return (sizeof(record_header) + length + 7) & ~7ull; }
+
+	void copy_in(per_core_log &l, u64 position, const void *src, size_t length);
+	void copy_out(const per_core_log &l, u64 position, void *dest, size_t length) const;
+
+	/**
+	 * @brief Reads the header of the record at the given position, moving the position up to the tail first if the
+	 * record has already been overwritten.  Returns false if there is no record there.
+	 */
+	bool peek(const per_core_log &l, u64 &position, record_header &header) const;
+};
+} // namespace stacsos::kernel
@@ -15,7 +15,116 @@ extern "C" void spinlock_release(spinlock_var_t *lv);
 extern "C" void spinlock_irq_acquire(spinlock_var_t *lv, u64 *flags);
 extern "C" void spinlock_irq_release(spinlock_var_t *lv, u64 flags);
 
+// Building the kernel with lock-stats=1 keeps statistics for the queued and reader-writer locks.
+#ifndef STACSOS_LOCK_STATS
+#define STACSOS_LOCK_STATS 0
+#endif
+
+// Building the kernel with irq-trace=1 times the sections that run with interrupts disabled (see irq-trace.h).
+#ifndef STACSOS_IRQ_TRACE
+#define STACSOS_IRQ_TRACE 0
+#endif
+
 namespace stacsos::kernel {
+#if STACSOS_IRQ_TRACE
+void irq_trace_disabled();
+void irq_trace_enabling();
+#endif
+
+/**
+ * @brief How often a lock has been taken, how often it had to be waited for, and for how long it has been held, in TSC
+ * cycles.  Only hold times of exclusive holders are counted.  When lock statistics aren't compiled in, this is empty,
+ * and recording does nothing.
+ */
+struct lock_stats {
+#if STACSOS_LOCK_STATS
+	u64 acquisitions;
+	u64 contentions;
+	u64 total_hold_cycles;
+	u64 max_hold_cycles;
+	u64 acquired_at;
+
+	void acquired_shared(bool contended)
+	{
+		__atomic_fetch_add(&acquisitions, 1, __ATOMIC_RELAXED);
+		if (contended) {
+			__atomic_fetch_add(&contentions, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	void acquired(bool contended)
+	{
+		acquired_shared(contended);
+		acquired_at = __builtin_ia32_rdtsc();
+	}
+
+	void released()
+	{
+		u64 held = __builtin_ia32_rdtsc() - acquired_at;
+
+		total_hold_cycles += held;
+		if (held > max_hold_cycles) {
+			max_hold_cycles = held;
+		}
+	}
+#else
+	void acquired_shared(bool contended) { }
+	void acquired(bool contended) { }
+	void released() { }
+#endif
+};
+
+// Where the preempt count is, in the TCB that %gs points to (see schedulable-entity.h).
+#define TCB_PREEMPT_COUNT_OFFSET 0x127
+
+/**
+ * @brief Counts a section that the current task mustn't be switched away from by cond_resched() in, because it holds
+ * a spinning lock, or has disabled interrupts.  The count is kept in the task's TCB, so that it follows the task if it
+ * blocks in the section.
+ */
+static inline void preempt_disable() { asm volatile("incl %%gs:%c0" ::"i"(TCB_PREEMPT_COUNT_OFFSET) : "memory"); }
+static inline void preempt_enable() { asm volatile("decl %%gs:%c0" ::"i"(TCB_PREEMPT_COUNT_OFFSET) : "memory"); }
+
+static inline u32 preempt_count()
+{
+	u32 count;
+	asm volatile("movl %%gs:%c1, %0" : "=r"(count) : "i"(TCB_PREEMPT_COUNT_OFFSET));
+	return count;
+}
+
+/**
+ * @brief Saves the interrupt flag and disables interrupts, returning the saved flags.
+ */
+static inline u64 irq_save()
+{
+	u64 flags;
+	asm volatile("pushfq; popq %0; cli" : "=r"(flags)::"memory");
+	preempt_disable();
+
+#if STACSOS_IRQ_TRACE
+	if (flags & 0x200) {
+		irq_trace_disabled();
+	}
+#endif
+
+	return flags;
+}
+
+/**
+ * @brief Enables interrupts again, if they were enabled in the given saved flags.
+ */
+static inline void irq_restore(u64 flags)
+{
+	preempt_enable();
+
+	if (flags & 0x200) {
+#if STACSOS_IRQ_TRACE
+		irq_trace_enabling();
+#endif
+		asm volatile("sti" ::: "memory");
+	}
+}
+
 class spinlock {
 public:
 	spinlock()
@@ -23,8 +132,17 @@ public:
 	{
 	}
 
-	void lock() { ::spinlock_acquire(&spin_lock_var_); }
-	void unlock() { ::spinlock_release(&spin_lock_var_); }
+	void lock()
+	{
+		stacsos::kernel::preempt_disable();
+		::spinlock_acquire(&spin_lock_var_);
+	}
+
+	void unlock()
+	{
+		::spinlock_release(&spin_lock_var_);
+		stacsos::kernel::preempt_enable();
+	}
 
 private:
 	DELETE_DEFAULT_COPY_AND_MOVE(spinlock);
@@ -39,8 +157,32 @@ public:
 	{
 	}
 
-	void lock(u64 *flags) { ::spinlock_irq_acquire(&spin_lock_var_, flags); }
-	void unlock(u64 flags) { ::spinlock_irq_release(&spin_lock_var_, flags); }
+#if STACSOS_IRQ_TRACE
+	// Interrupts are disabled and enabled through the traced helpers, rather than by the assembly versions.
+	void lock(u64 *flags)
+	{
+		*flags = stacsos::kernel::irq_save();
+		::spinlock_acquire(&spin_lock_var_);
+	}
+
+	void unlock(u64 flags)
+	{
+		::spinlock_release(&spin_lock_var_);
+		stacsos::kernel::irq_restore(flags);
+	}
+#else
+	void lock(u64 *flags)
+	{
+		::spinlock_irq_acquire(&spin_lock_var_, flags);
+		stacsos::kernel::preempt_disable();
+	}
+
+	void unlock(u64 flags)
+	{
+		stacsos::kernel::preempt_enable();
+		::spinlock_irq_release(&spin_lock_var_, flags);
+	}
+#endif
 
 private:
 	DELETE_DEFAULT_COPY_AND_MOVE(spinlock_irq);
@@ -127,4 +269,219 @@ private:
 	u64 flags_;
 };
 
+/**
+ * @brief A spinlock that is handed out in the order it was asked for.  Each waiter takes a ticket, and spins until the
+ * ticket being served is theirs, backing off for longer the further back in the queue it is.  Interrupts are disabled
+ * while it is held, as with spinlock_irq.
+ */
+class ticket_lock {
+	DELETE_DEFAULT_COPY_AND_MOVE(ticket_lock)
+
+public:
+	ticket_lock()
+		: next_(0)
+		, serving_(0)
+		, stats_({})
+	{
+	}
+
+	void lock(u64 *flags)
+	{
+		*flags = irq_save();
+
+		u32 ticket = __atomic_fetch_add(&next_, 1, __ATOMIC_RELAXED);
+		u32 serving = __atomic_load_n(&serving_, __ATOMIC_ACQUIRE);
+		bool contended = serving != ticket;
+
+		while (serving != ticket) {
+			for (u32 i = 0; i < ticket - serving; i++) {
+				__relax();
+			}
+
+			serving = __atomic_load_n(&serving_, __ATOMIC_ACQUIRE);
+		}
+
+		stats_.acquired(contended);
+	}
+
+	void unlock(u64 flags)
+	{
+		stats_.released();
+
+		// Only the holder changes the ticket being served.
+		__atomic_store_n(&serving_, serving_ + 1, __ATOMIC_RELEASE);
+		irq_restore(flags);
+	}
+
+	const lock_stats &stats() const { return stats_; }
+
+private:
+	u32 next_;
+	u32 serving_;
+	lock_stats stats_;
+};
+
+/**
+ * @brief A waiter's place in the queue of an mcs_lock.  Each core has a few of these, one for each MCS lock it may be
+ * holding or waiting for at once.
+ */
+struct alignas(64) mcs_node {
+	mcs_node *next;
+	u32 ready;
+	bool in_use;
+};
+
+/**
+ * @brief A queued spinlock, where each waiter spins on its own core's queue node rather than on the lock, and is handed
+ * the lock directly by the one in front of it.  Waiting doesn't bounce the lock's cache line between cores, and the
+ * lock is handed out in the order it was asked for.  Interrupts are disabled while it is held.
+ */
+class mcs_lock {
+	DELETE_DEFAULT_COPY_AND_MOVE(mcs_lock)
+
+public:
+	static const int max_nodes_per_core = 4;
+
+	mcs_lock()
+		: tail_(nullptr)
+		, holder_(nullptr)
+		, stats_({})
+	{
+	}
+
+	void lock(u64 *flags);
+	void unlock(u64 flags);
+
+	const lock_stats &stats() const { return stats_; }
+
+private:
+	mcs_node *tail_;
+
+	// The queue node of the core that holds the lock, which is only touched by that core.
+	mcs_node *holder_;
+
+	lock_stats stats_;
+};
+
+/**
+ * @brief A spinning reader-writer lock, for data that is read far more often than it is changed.  Any number of
+ * readers can hold it at once, or a single writer.  A writer waiting for it stops new readers from taking it, so that
+ * a steady stream of readers can't keep writers out.  Interrupts are disabled while it is held.
+ */
+class rwlock {
+	DELETE_DEFAULT_COPY_AND_MOVE(rwlock)
+
+public:
+	rwlock()
+		: state_(0)
+		, stats_({})
+	{
+	}
+
+	void lock_shared(u64 *flags)
+	{
+		*flags = irq_save();
+
+		bool contended = false;
+		while (true) {
+			u32 state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+			if (!(state & (writer | writer_waiting))
+				&& __atomic_compare_exchange_n(&state_, &state, state + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				break;
+			}
+
+			contended = true;
+			__relax();
+		}
+
+		stats_.acquired_shared(contended);
+	}
+
+	void unlock_shared(u64 flags)
+	{
+		__atomic_fetch_sub(&state_, 1, __ATOMIC_RELEASE);
+		irq_restore(flags);
+	}
+
+	void lock(u64 *flags)
+	{
+		*flags = irq_save();
+
+		bool contended = false;
+		while (true) {
+			u32 state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+			if (!(state & ~writer_waiting)) {
+				// Taking the lock clears the waiting flag.  Any other writer still waiting sets it again.
+				if (__atomic_compare_exchange_n(&state_, &state, writer, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					break;
+				}
+			} else if (!(state & writer_waiting)) {
+				__atomic_fetch_or(&state_, writer_waiting, __ATOMIC_RELAXED);
+			}
+
+			contended = true;
+			__relax();
+		}
+
+		stats_.acquired(contended);
+	}
+
+	void unlock(u64 flags)
+	{
+		stats_.released();
+
+		__atomic_fetch_and(&state_, ~writer, __ATOMIC_RELEASE);
+		irq_restore(flags);
+	}
+
+	const lock_stats &stats() const { return stats_; }
+
+private:
+	static const u32 writer = 1u << 31;
+	static const u32 writer_waiting = 1u << 30;
+
+	// The number of readers holding the lock, plus the writer flags.
+	u32 state_;
+	lock_stats stats_;
+};
+
+/**
+ * @brief Holds a ticket_lock, mcs_lock or rwlock (as its writer) for as long as it is in scope.
+ */
+template <class L> class scoped_irq_lock {
+	DELETE_DEFAULT_COPY_AND_MOVE(scoped_irq_lock)
+
+public:
+	explicit scoped_irq_lock(L &lock)
+		: lock_(lock)
+	{
+		lock_.lock(&flags_);
+	}
+
+	~scoped_irq_lock() { lock_.unlock(flags_); }
+
+private:
+	L &lock_;
+	u64 flags_;
+};
+
+/**
+ * @brief Holds an rwlock as a reader for as long as it is in scope.
+ */
+template <class L> class shared_irq_lock {
+	DELETE_DEFAULT_COPY_AND_MOVE(shared_irq_lock)
+
+public:
+	explicit shared_irq_lock(L &lock)
+		: lock_(lock)
+	{
+		lock_.lock_shared(&flags_);
+	}
+
+	~shared_irq_lock() { lock_.unlock_shared(flags_); }
+
+private:
+	L &lock_;
+	u64 flags_;
+};
 } // namespace stacsos::kernel
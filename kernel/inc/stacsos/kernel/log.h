@@ -7,11 +7,31 @@
  */
 #pragma once
 
+#include <stacsos/kernel/debug.h>
 #include <stacsos/printf.h>
 
+// Messages logged through the templated functions below this level are compiled out altogether.  The kernel Makefile
+// sets it from log-level, which defaults to info.
+#ifndef STACSOS_MIN_LOG_LEVEL
+#define STACSOS_MIN_LOG_LEVEL 2
+#endif
+
 namespace stacsos::kernel {
 enum class log_level { trace, debug, info, warning, error, panic };
 
+constexpr log_level min_compiled_log_level = (log_level)STACSOS_MIN_LOG_LEVEL;
+
+/**
+ * @brief Writes a message with dprintf, if the level is one that is compiled in.  Otherwise, neither the call nor its
+ * arguments cost anything.
+ */
+template <log_level L, typename... Args> inline void dlogf(const char *fmt, Args... args)
+{
+	if constexpr (L >= min_compiled_log_level) {
+		dprintf(fmt, args...);
+	}
+}
+
 class logger {
 public:
 	static logger root_logger;
@@ -26,7 +46,24 @@ public:
 
 	void log(log_level level, const char *message) { internal_log(log_source_, level, message); }
 
-	void logf(log_level level, const char *fmt, ...)
+	/**
+	 * @brief As log and logf, but compiled out altogether if the level is below the build's minimum.
+	 */
+	template <log_level L> void log(const char *message)
+	{
+		if constexpr (L >= min_compiled_log_level) {
+			log(L, message);
+		}
+	}
+
+	template <log_level L, typename... Args> void logf(const char *fmt, Args... args)
+	{
+		if constexpr (L >= min_compiled_log_level) {
+			logf(L, fmt, args...);
+		}
+	}
+
+	__printf_format(3, 4) void logf(log_level level, const char *fmt, ...)
 	{
 		char format_buffer[256];
 		va_list args;
@@ -7,17 +7,51 @@
  */
 #pragma once
 
-namespace stacsos::kernel::mem {
-class page;
+#include <stacsos/kernel/mem/kmem-cache.h>
+#include <stacsos/memory.h>
+#include <stacsos/rb-tree.h>
+#include <stacsos/syscalls.h>
+
+namespace stacsos::kernel::fs {
+class file;
+class fs_node;
+} // namespace stacsos::kernel::fs
 
+namespace stacsos::kernel::mem {
 enum class region_flags { inaccessible = 0, readable = 1, writable = 2, executable = 4, readwrite = 3, all = 7 };
 
 DEFINE_ENUM_FLAG_OPERATIONS(region_flags)
 
 class address_space_region {
+	DEFINE_KMEM_CACHE(address_space_region)
+
 public:
 	u64 base, size;
 	region_flags flags;
-	page *storage;
+
+	// Whether the region is backed by memory at all.  Backed regions are demand-zero: each page is only allocated,
+	// zeroed and mapped the first time it is touched.
+	bool backed;
+
+	// For a region that maps a file, the open file and the node that identifies it in the page cache, and the offset
+	// in the file that the region starts at.  The pages come from the page cache when they are first touched, and are
+	// copied when they are first written to, unless the mapping is shared.
+	shared_ptr<fs::file> file;
+	fs::fs_node *file_node;
+	u64 file_offset;
+	bool shared;
+
+	// Whether the file is a window onto device memory (see fs::file::device_frame), whose frames are mapped directly,
+	// and aren't pages that the kernel manages.
+	bool device;
+
+	// How the region is going to be used, from advise.  A file mapping advised sequential has the file read ahead of
+	// its faults, and anonymous memory advised hugepage has the compactor make large pages when there are none.
+	access_advice advice;
+
+	// The link in the address space's region tree, and the highest end address of any region in the subtree below
+	// (and including) this one.
+	rb_node node;
+	u64 max_end;
 };
 } // namespace stacsos::kernel::mem
@@ -7,13 +7,19 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/address-space-region.h>
 #include <stacsos/kernel/mem/page-table.h>
-#include <stacsos/list.h>
+#include <stacsos/rb-tree.h>
+
+namespace stacsos::kernel::sched {
+class resource_account;
+}
 
 namespace stacsos::kernel::mem {
 class page_table_allocator;
 class memory_manager;
+class page;
 
 class address_space {
 	friend class memory_manager;
@@ -22,43 +28,282 @@ public:
 	address_space(page_table_allocator &pta, u64 alloc_rgn_start)
 		: pta_(pta)
 		, pt_(page_table::create_empty(pta))
+		, pcid_(0)
+		, active_cores_(0)
+		, resident_pages_(0)
+		, shared_pages_(0)
+		, account_(nullptr)
+		, migrating_address_(0)
+		, last_hit_(nullptr)
 		, next_alloc_rgn_(alloc_rgn_start)
 	{
 	}
 
-	~address_space() { panic("free addrspace"); }
+	/**
+	 * @brief Frees every region's memory, and the page table.  Only address spaces made by create_linked are ever
+	 * destroyed, and they must no longer be active on any core.
+	 */
+	~address_space();
 
 	page_table &pgtable() const { return *pt_; }
 
-	address_space_region *alloc_region(u64 size, region_flags flags, bool allocate);
+	/**
+	 * @brief The value to load into CR3 to switch to this address space, which includes its PCID.
+	 */
+	u64 cr3() const { return pt_->effective_cr3() | pcid_; }
+
+	/**
+	 * @brief The mask of the cores that have run this address space, and so may hold translations for it.  Each core
+	 * adds itself when it switches to the address space.
+	 */
+	u64 *active_cores() { return &active_cores_; }
+
+	/**
+	 * @brief The number of pages mapped into the address space, of which shared_pages are shared from the page cache
+	 * (and so may be mapped by other address spaces too).
+	 */
+	u64 resident_pages() const { return resident_pages_; }
+	u64 shared_pages() const { return shared_pages_; }
+
+	/**
+	 * @brief Sets the account that the address space's private pages are charged to.  Once the account's page limit
+	 * has been reached, touching a new page (or copying a shared one) fails as if it were outside any region.
+	 */
+	void set_account(sched::resource_account *account) { account_ = account; }
+
+	/**
+	 * @brief Adds a region to the address space.  If allocate is true, the region is backed by memory, but no pages
+	 * are allocated until they are touched (or looked up with get_page).
+	 *
+	 * @param align The alignment of the region's base, which must be a power of two.
+	 * @param guard_size How much address space to leave unused after the region, so that running off its end faults
+	 * rather than landing in the next region.
+	 * @return The new region, or nullptr if there is no room left for it in the user half of the address space.
+	 */
+	address_space_region *alloc_region(u64 size, region_flags flags, bool allocate, u64 align = PAGE_SIZE, u64 guard_size = 0);
 	address_space_region *add_region(u64 base, u64 size, region_flags flags, bool allocate);
+
+	/**
+	 * @brief Maps part of a file into the address space, at an address of the address space's choosing.  Nothing is
+	 * read until each page is first touched, when it is mapped from the page cache.
+	 *
+	 * @param file The open file, which is kept open for as long as the region exists.
+	 * @param node The file's node, which identifies it in the page cache, or null for a file that keeps its own pages.
+	 * @param offset The (page aligned) offset in the file of the start of the mapping.
+	 * @param size The size of the mapping.  Anything past the end of the file reads as zero.
+	 * @param flags The access the region allows.
+	 * @param shared Whether writes go to the cached pages, rather than to a private copy of each one.
+	 */
+	address_space_region *map_file(shared_ptr<fs::file> file, fs::fs_node *node, u64 offset, u64 size, region_flags flags, bool shared);
+
+	/**
+	 * @brief Unmaps every page of the regions that map the given file as device memory, so that the next touch of
+	 * each one maps whichever frame the file has behind it by then.
+	 */
+	void unmap_device_file(const fs::file &file);
+
+	/**
+	 * @brief Writes every touched page of the shared file mappings in the given range back to their files.
+	 *
+	 * @return u64 The number of bytes that were written.
+	 */
+	u64 sync_file(u64 base, u64 size);
+
+	/**
+	 * @brief Removes every region that lies entirely within the given range, unmapping and freeing its pages.  Regions
+	 * that are only partly inside the range are left alone.
+	 */
 	void remove_region(u64 base, u64 size, region_flags flags);
 
+	/**
+	 * @brief Applies advice to the regions in the given range.  normal, sequential, random and hugepage are kept for
+	 * the whole of each region the range touches.  willneed populates anonymous memory now, and starts reading the
+	 * range of a mapped file in the background.  dontneed unmaps and frees the pages in the range, except for large
+	 * pages that are only partly inside it, so that anonymous memory reads as zero, and a private file mapping as the
+	 * file, when next touched.
+	 *
+	 * @return bool false if the advice isn't known, or there are no regions in the range.
+	 */
+	bool advise(u64 base, u64 size, access_advice advice);
+
+	/**
+	 * @brief Returns the page that backs the given address, allocating and mapping a zeroed one first if the address
+	 * is in a backed region that hasn't been touched there yet.
+	 *
+	 * @return page* The backing page, or null if the address isn't in a backed region.  This may be a page shared
+	 * from the page cache, which must not be written to.  The page is pinned, as the caller holds on to its physical
+	 * address, so it will never be moved by the compactor.
+	 */
+	page *get_page(u64 address);
+
+	/**
+	 * @brief Makes every page in the given range present, private and writable, and pins them, so that a device can
+	 * write to them by their physical addresses.  Pages shared from the page cache (in private mappings) are copied
+	 * first, as they would be on a write fault.
+	 *
+	 * @return bool false if some of the range isn't in a writable backed region, or couldn't be populated.  The pages
+	 * before it may have been pinned anyway.
+	 */
+	bool pin_for_write(u64 base, u64 size);
+
+	/**
+	 * @brief Allocates and maps every page of the given range that hasn't been touched yet, as if each had been
+	 * faulted on, so that the range can then be used without faulting.  Only regions of anonymous memory are populated.
+	 *
+	 * @return bool false if some of the range isn't in such a region, or the process ran out of memory, in which
+	 * case the pages before it stay populated.
+	 */
+	bool populate_range(u64 base, u64 size);
+
+	/**
+	 * @brief Maps a page from the page cache, read-only, at the given address.  If the region is writable, the first
+	 * write to the page gives the address space a private copy of it.
+	 *
+	 * @return bool false if the address isn't in a backed region, or something is already mapped there.
+	 */
+	bool map_shared(u64 address, page &pg);
+
+	/**
+	 * @brief Tries to resolve a page fault at the given address, by populating the page, or by copying a shared
+	 * page that is being written to.
+	 *
+	 * @return bool false if the address isn't in a backed region, or is already mapped (other than by a page that
+	 * can be copied on write), i.e. the fault was a real one.
+	 */
+	bool handle_fault(u64 address);
+
+	/**
+	 * @brief Moves the private page mapped at the given address to another page, for the compactor.  Until the move
+	 * is finished, any thread that touches the page waits for it.
+	 *
+	 * @param src The page that is expected to be mapped there.
+	 * @param dest The page to copy it to, and map in its place.
+	 * @return bool false if src isn't mapped there any more, or has been pinned, in which case dest is left alone.
+	 * Otherwise dest has been used (or freed, if the region went away in the meantime), and src is unmapped and may
+	 * be freed.
+	 */
+	bool migrate_page(u64 address, page &src, page &dest);
+
+	/**
+	 * @brief Checks that every byte of the given range lies in a backed region (or a run of adjacent ones) that
+	 * allows the given access, so that it can be touched on the process's behalf.
+	 */
+	bool range_accessible(u64 base, u64 size, region_flags access);
+
 	address_space_region *get_region_from_address(u64 address)
 	{
-		for (address_space_region *rgn : regions_) {
-			if (address >= rgn->base && address < (rgn->base + rgn->size)) {
-				return rgn;
-			}
-		}
-
-		return nullptr;
+		unique_irq_lock l(lock_);
+		return find_region(address);
 	}
 
 	address_space *create_linked(u64 alloc_rgn_start);
 
+	/**
+	 * @brief Copies every region into another address space, which must be new, and not yet in use, for a fork.  The
+	 * private pages are shared between the two, read-only, until either writes to one, when it gets a copy of its own.
+	 * Pages from the page cache are shared as they are, and device memory is mapped again as it is touched.  Pages
+	 * that have been pinned for a device are copied straight away, as the device may write to them at any time.
+	 *
+	 * @return bool false if the other address space's account didn't have room for the pages, in which case it must
+	 * be destroyed.
+	 */
+	bool clone_into(address_space &child);
+
 private:
-	address_space(page_table_allocator &pta, page_table *pt, u64 alloc_rgn_start)
+	address_space(page_table_allocator &pta, page_table *pt, u16 pcid, u64 alloc_rgn_start)
 		: pta_(pta)
 		, pt_(pt)
+		, pcid_(pcid)
+		, active_cores_(0)
+		, resident_pages_(0)
+		, shared_pages_(0)
+		, account_(nullptr)
+		, migrating_address_(0)
+		, last_hit_(nullptr)
 		, next_alloc_rgn_(alloc_rgn_start)
 	{
 	}
 
+	// How far ahead of a fault in a file mapping advised sequential the file is read.
+	static const u64 fault_ahead = KB(256);
+
+	struct region_base_less {
+		bool operator()(const address_space_region &a, const address_space_region &b) const { return a.base < b.base; }
+	};
+
+	struct region_max_end {
+		static void update(address_space_region &rgn, const address_space_region *left, const address_space_region *right)
+		{
+			u64 end = rgn.base + rgn.size;
+
+			if (left) {
+				end = max(end, left->max_end);
+			}
+
+			if (right) {
+				end = max(end, right->max_end);
+			}
+
+			rgn.max_end = end;
+		}
+	};
+
 	page_table_allocator &pta_;
 	page_table *pt_;
+	u16 pcid_;
+	u64 active_cores_;
+	u64 resident_pages_, shared_pages_;
+	sched::resource_account *account_;
+
+	// The address of the page being moved by migrate_page, if any, which is unmapped while it is copied.
+	u64 migrating_address_;
+
+	// Protects the list of regions, and populating pages in them.
+	spinlock_irq lock_;
+
+	// The regions, ordered by base address, as an interval tree.
+	rb_tree<address_space_region, &address_space_region::node, region_base_less, region_max_end> regions_;
+
+	// The region that the last lookup found, which is very likely to be the next one asked for too.
+	address_space_region *last_hit_;
 
-	list<address_space_region *> regions_;
 	u64 next_alloc_rgn_;
+
+	static bool contains(const address_space_region &rgn, u64 address) { return address >= rgn.base && address < (rgn.base + rgn.size); }
+
+	address_space_region *find_region(u64 address)
+	{
+		if (last_hit_ && contains(*last_hit_, address)) {
+			return last_hit_;
+		}
+
+		// If the left subtree has a region ending above the address, then either one of them holds the address, or
+		// they all start after it, and so does everything to the right.
+		address_space_region *rgn = regions_.root();
+		while (rgn) {
+			if (contains(*rgn, address)) {
+				last_hit_ = rgn;
+				return rgn;
+			}
+
+			address_space_region *left = regions_.left(*rgn);
+			rgn = (left && left->max_end > address) ? left : regions_.right(*rgn);
+		}
+
+		return nullptr;
+	}
+
+	bool charge_pages(u64 n);
+	void uncharge_pages(u64 n);
+	void free_pages(address_space_region &rgn, tlb_batch *batch);
+	void free_range(address_space_region &rgn, u64 start, u64 end, tlb_batch *batch);
+	page *populate(address_space_region &rgn, u64 address);
+	page *populate_file(unique_irq_lock &l, address_space_region &rgn, u64 address);
+	page *map_file_page(address_space_region &rgn, u64 address, page &pg);
+	bool map_device_frame(address_space_region &rgn, u64 address);
+	bool copy_on_write(u64 address, page &shared);
+	bool clone_pages(address_space_region &rgn, address_space &child, tlb_batch *batch);
+	bool break_cow(u64 address, page &shared, mapping_size size);
+	void wait_for_migration(unique_irq_lock &l, u64 address);
 };
 } // namespace stacsos::kernel::mem
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos::kernel::mem {
+
+/**
+ * @brief Makes room for blocks of pages that the page allocator couldn't find, by moving the private user pages out
+ * of an aligned region of movable memory, until the whole region is free.  A failed allocation only asks for this to
+ * happen, and the work is done a region at a time by the idle thread, so the allocation that asked for it still
+ * fails, but later ones of the same size are likely to succeed.
+ */
+class compactor {
+	DEFINE_SINGLETON(compactor)
+
+public:
+	struct stats {
+		u64 requests, regions, pages_moved, failures;
+	};
+
+	/**
+	 * @brief Asks for a free block of the given order to be made.  Only the largest order asked for is remembered.
+	 */
+	void request(int order);
+
+	/**
+	 * @brief Looks for a region to empty, and empties it.  This is an idle task.
+	 *
+	 * @return bool true if there was a request to work on.
+	 */
+	bool compact_one();
+
+	stats get_stats() const { return counters_; }
+
+private:
+	compactor()
+		: wanted_order_(-1)
+		, busy_(false)
+		, nr_wraps_(0)
+		, counters_ {}
+	{
+	}
+
+	// The most search passes over memory that a request gets, before it is given up on.
+	static const unsigned int max_passes = 2;
+
+	int wanted_order_;
+	bool busy_;
+	unsigned int nr_wraps_;
+	stats counters_;
+
+	bool compact(int order);
+	bool empty_region(u64 start_pfn, int order);
+	void finish_request(int order);
+};
+} // namespace stacsos::kernel::mem
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel-data.h>
+
+namespace stacsos::kernel::dev::misc {
+class rtc;
+}
+
+namespace stacsos::kernel::mem {
+class address_space;
+class page;
+
+/**
+ * @brief The page of timing and CPU information that is mapped, read-only, into every process, so that it can tell
+ * the time without entering the kernel.
+ */
+class kernel_data_page {
+	DEFINE_SINGLETON(kernel_data_page)
+
+private:
+	kernel_data_page()
+		: page_(nullptr)
+		, boot_tsc_(0)
+	{
+	}
+
+public:
+	/**
+	 * @brief Notes the timestamp counter at boot, which is time zero for the monotonic clock.
+	 */
+	void record_boot() { boot_tsc_ = __builtin_ia32_rdtsc(); }
+
+	u64 boot_tsc() const { return boot_tsc_; }
+
+	/**
+	 * @brief Fills in the page, once the cores have been brought up, and reads the wall clock time from the RTC.
+	 */
+	void init(dev::misc::rtc &rtc);
+
+	/**
+	 * @brief Maps the page, read-only, at KERNEL_DATA_ADDRESS.
+	 */
+	void map_into(address_space &as);
+
+private:
+	page *page_;
+	u64 boot_tsc_;
+};
+} // namespace stacsos::kernel::mem
@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/slab-cache.h>
+#include <stacsos/atomic.h>
+#include <stacsos/intrusive-list.h>
+
+namespace stacsos::kernel::mem {
+/**
+ * @brief The part of a typed object cache that doesn't depend on the type, so that every cache can be listed, e.g.
+ * in meminfo.
+ */
+class kmem_cache_base {
+public:
+	struct stats {
+		u64 allocations, frees, hits;
+		u64 objects, slabs, slab_size, capacity;
+	};
+
+	kmem_cache_base(const char *name, size_t object_size, size_t slot_size);
+
+	const char *name() const { return name_; }
+	size_t object_size() const { return object_size_; }
+	size_t slot_size() const { return slot_size_; }
+
+	virtual stats get_stats() = 0;
+
+	/**
+	 * @brief Calls fn with every cache that has been created.  Caches are never destroyed, so the list only grows.
+	 */
+	template <typename F> static void for_each(F fn)
+	{
+		auto &r = get_registry();
+		unique_irq_lock l(r.lock);
+
+		for (kmem_cache_base *c : r.caches) {
+			fn(*c);
+		}
+	}
+
+private:
+	const char *name_;
+	size_t object_size_, slot_size_;
+	list_hook registry_link_;
+
+	struct registry {
+		spinlock_irq lock;
+		intrusive_list<kmem_cache_base, &kmem_cache_base::registry_link_> caches;
+	};
+
+	// A cache can be created by the first allocation of its type, from anywhere, so the list is made on first use.
+	static registry &get_registry();
+};
+
+/**
+ * @brief A cache of objects of one type, with slabs of their own, rather than sharing a size class with everything
+ * else that happens to be about the same size.  Each object takes up a whole number of cache lines, so objects used
+ * by different cores (e.g. two threads' scheduling state) never share one.  Each core keeps a short chain of the
+ * objects it has freed, and hands the most recently freed back first, while it is still in the core's cache.
+ *
+ * A type is given a cache with DEFINE_KMEM_CACHE, which routes its new and delete here.
+ */
+template <class T> class kmem_cache : public kmem_cache_base {
+	static constexpr size_t slot_align = alignof(T) > cache_line_size ? alignof(T) : cache_line_size;
+	static constexpr size_t slot_size = (sizeof(T) + slot_align - 1) & ~(slot_align - 1);
+
+	// Slabs are made big enough for at least min_slab_objects objects, so that the header's slot is a small part of
+	// each one, up to the largest size the object allocator uses.
+	static const size_t min_slab_objects = 8;
+	static constexpr int slab_order = slot_size * min_slab_objects <= PAGE_SIZE ? 0
+		: slot_size * min_slab_objects <= 2 * PAGE_SIZE                          ? 1
+		: slot_size * min_slab_objects <= 4 * PAGE_SIZE                          ? 2
+		: slot_size * min_slab_objects <= 8 * PAGE_SIZE                          ? 3
+																				 : 4;
+
+	static_assert(slot_align <= PAGE_SIZE, "objects can't be aligned more strictly than a page");
+	static_assert(slot_size * 2 <= (PAGE_SIZE << slab_order), "objects are too big for a slab");
+
+	// The most freed objects a core keeps for itself, before they go back to the slabs.
+	static const unsigned int max_core_objects = 16;
+
+	struct per_core {
+		spinlock_irq lock;
+		void *head;
+		unsigned int nr_objects;
+		u64 allocations, frees, hits;
+	};
+
+public:
+	kmem_cache(const char *name)
+		: kmem_cache_base(name, sizeof(T), slot_size)
+	{
+		for (auto &cpu : cores_) {
+			cpu.head = nullptr;
+			cpu.nr_objects = 0;
+			cpu.allocations = cpu.frees = cpu.hits = 0;
+		}
+	}
+
+	void *allocate()
+	{
+		auto &cpu = cores_.get();
+
+		{
+			unique_irq_lock l(cpu.lock);
+
+			cpu.allocations++;
+			if (cpu.head) {
+				void *obj = cpu.head;
+				cpu.head = *(void **)obj;
+				cpu.nr_objects--;
+				cpu.hits++;
+
+				return obj;
+			}
+		}
+
+		unique_irq_lock l(slabs_lock_);
+		return slabs_.allocate();
+	}
+
+	void free(void *obj)
+	{
+		// The object is likely still in this core's cache, so the core keeps it for its next allocation, if it has room.
+		auto &cpu = cores_.get();
+
+		{
+			unique_irq_lock l(cpu.lock);
+
+			cpu.frees++;
+			if (cpu.nr_objects < max_core_objects) {
+				*(void **)obj = cpu.head;
+				cpu.head = obj;
+				cpu.nr_objects++;
+
+				return;
+			}
+		}
+
+		free_to_slab(obj);
+	}
+
+	virtual stats get_stats() override
+	{
+		stats s = {};
+
+		for (auto &cpu : cores_) {
+			unique_irq_lock l(cpu.lock);
+
+			s.allocations += cpu.allocations;
+			s.frees += cpu.frees;
+			s.hits += cpu.hits;
+		}
+
+		unique_irq_lock l(slabs_lock_);
+		slab_cache_base::stats ss = slabs_.get_stats();
+
+		// Objects that are waiting on a core to be reused are still allocated, as far as the slabs are concerned.
+		s.objects = s.allocations - s.frees;
+		s.slabs = ss.slabs;
+		s.slab_size = ss.slab_size;
+		s.capacity = ss.capacity;
+
+		return s;
+	}
+
+private:
+	arch::percpu<per_core> cores_;
+	spinlock_irq slabs_lock_;
+	slab_cache<slot_size, slab_order> slabs_;
+
+	void free_to_slab(void *obj)
+	{
+		page &pg = page::get_from_base_address_ptr(obj);
+
+		unique_irq_lock l(slabs_lock_);
+		slabs_.free_in_slab(pg.slab(), obj);
+	}
+};
+} // namespace stacsos::kernel::mem
+
+/**
+ * Gives a class its own typed object cache, which every object of the class is allocated from with new, and freed to
+ * with delete.  Objects of a class derived from it are a different size, and come from the kernel heap as usual.
+ */
+#define DEFINE_KMEM_CACHE(__class_typename)                                                                                                                    \
+public:                                                                                                                                                        \
+	static void *operator new(size_t size)                                                                                                                     \
+	{                                                                                                                                                          \
+		return size == sizeof(__class_typename) ? object_cache().allocate() : ::operator new(size);                                                            \
+	}                                                                                                                                                          \
+                                                                                                                                                               \
+	static void operator delete(void *ptr, size_t size)                                                                                                        \
+	{                                                                                                                                                          \
+		if (size == sizeof(__class_typename)) {                                                                                                                \
+			object_cache().free(ptr);                                                                                                                          \
+		} else {                                                                                                                                               \
+			::operator delete(ptr);                                                                                                                            \
+		}                                                                                                                                                      \
+	}                                                                                                                                                          \
+                                                                                                                                                               \
+	static stacsos::kernel::mem::kmem_cache<__class_typename> &object_cache()                                                                                  \
+	{                                                                                                                                                          \
+		static stacsos::kernel::mem::kmem_cache<__class_typename> cache(#__class_typename);                                                                    \
+		return cache;                                                                                                                                          \
+	}
@@ -9,6 +9,8 @@
 
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
+#include <stacsos/avl-tree.h>
+#include <stacsos/list.h>
 
 namespace stacsos::kernel::mem {
 struct object_header {
@@ -16,12 +18,22 @@ struct object_header {
 	u8 data[];
 };
 
+class page;
+
+/**
+ * @brief Allocates objects too big for a slab cache, by mapping blocks of pages into a dedicated virtual address
+ * region.  Each allocation is recorded in a tree by address, so that its pages can be unmapped and freed again.  The
+ * virtual address space that is given back is kept as a set of holes, which are merged with their neighbours, and
+ * reused by later allocations before the region is grown.  Allocations of 2 MiB or more are aligned so that their
+ * bigger physical blocks can be mapped with 2 MiB pages.
+ */
 class large_object_allocator {
 public:
 	large_object_allocator(void *region_base, size_t region_size)
 		: region_base_(region_base)
 		, base_(region_base)
 		, size_(region_size)
+		, mapped_pages_(0)
 	{
 	}
 
@@ -30,9 +42,39 @@ public:
 
 	bool ptr_in_region(void *ptr) const { return ((uintptr_t)ptr >= (uintptr_t)region_base_) && ((uintptr_t)ptr < ((uintptr_t)region_base_ + size_)); }
 
+	u64 mapped_pages() const { return mapped_pages_; }
+
 private:
+	struct block {
+		u64 address;
+		page *pg;
+		int order;
+	};
+
+	struct allocation {
+		u64 nr_pages;
+		list<block> blocks;
+	};
+
 	void *region_base_;
 	void *base_;
 	size_t size_;
+	u64 mapped_pages_;
+
+	// Live allocations, by address.
+	avl_tree<u64, allocation *> allocations_;
+
+	// Free holes below base_, both by start address (to the number of pages) and by end address (to the start
+	// address), so that a freed range can find the holes either side of it.
+	avl_tree<u64, u64> holes_by_start_;
+	avl_tree<u64, u64> holes_by_end_;
+
+	u64 reserve(u64 nr_pages, u64 align);
+	void unreserve(u64 address, u64 nr_pages);
+	void add_hole(u64 start, u64 nr_pages);
+	void remove_hole(u64 start, u64 nr_pages);
+
+	bool populate(allocation &a, u64 address);
+	void release(allocation &a);
 };
 } // namespace stacsos::kernel::mem
@@ -24,10 +24,21 @@ private:
 	}
 
 public:
+	// The areas of the upper half that the kernel maps memory into as it runs: one for large objects, and one for
+	// kernel stacks.  Each has a PML4 entry of its own.
+	static const u64 vmalloc_area = 0xfffff00000000000;
+	static const u64 kernel_stack_area = 0xfffff08000000000;
+
 	static void add_memory_block(u64 start, u64 length, bool avail);
 
 	void init();
 
+	/**
+	 * @brief Gives back the pages of the functions marked __init, once the kernel has finished booting.  Nothing may
+	 * call them after this.
+	 */
+	void release_init_text();
+
 	page_allocator &pgalloc() const { return *pgalloc_; }
 
 	page_table_allocator &ptalloc() { return ptalloc_; }
@@ -43,6 +54,7 @@ public:
 private:
 	void initialise_page_descriptors(u64 nr_page_descriptors);
 	void initialise_page_allocator(u64 nr_page_descriptors);
+	void initialise_page_frame_cache();
 	void initialise_object_allocator();
 	void activate_primary_mapping();
 
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+
+namespace stacsos::kernel::mem {
+/**
+ * @brief Which NUMA node each range of physical memory, and each core, belongs to, and how far apart the nodes are.
+ * This is filled in from the ACPI SRAT and SLIT as the memory manager starts, before any memory is handed out.
+ * Without an SRAT, everything is on node zero.
+ */
+class numa_topology {
+	DEFINE_SINGLETON(numa_topology)
+
+public:
+	static const unsigned int max_nodes = 8;
+	static const unsigned int max_ranges = 32;
+
+	// The distances the SLIT uses for a node to itself, and (when there is no SLIT) for a node to any other.
+	static const u8 local_distance = 10;
+	static const u8 remote_distance = 20;
+
+	/**
+	 * @brief Returns the node for an ACPI proximity domain, giving it the next free node number if it hasn't been seen
+	 * before, or -1 if there are already as many nodes as can be handled.
+	 */
+	int node_for_domain(u32 domain);
+
+	/**
+	 * @brief Returns the node that an ACPI proximity domain has been given, or -1 if it hasn't been seen.
+	 */
+	int find_domain(u32 domain) const;
+
+	void add_memory_range(unsigned int node, u64 start, u64 length);
+	void set_core_node(unsigned int apic_id, unsigned int node);
+	void set_distance(unsigned int from, unsigned int to, u8 distance) { distances_[from][to] = distance; }
+
+	/**
+	 * @brief Works out the order in which each node falls back to the others, nearest first.  Called once the tables
+	 * have been parsed.
+	 */
+	void finalise();
+
+	unsigned int nr_nodes() const { return nr_nodes_; }
+
+	/**
+	 * @brief Calls fn(start, end, node) for each range of physical memory in the SRAT.  Memory that the SRAT doesn't
+	 * mention is on node zero.
+	 */
+	template <typename F> void for_each_range(F fn) const
+	{
+		for (unsigned int i = 0; i < nr_ranges_; i++) {
+			fn(ranges_[i].start, ranges_[i].end, (unsigned int)ranges_[i].node);
+		}
+	}
+
+	unsigned int node_of_core(int core_id) const
+	{
+		return (core_id >= 0 && core_id < arch::core_manager::max_cores) ? core_nodes_[core_id] : 0;
+	}
+
+	/**
+	 * @brief Returns the node of the core this is running on.
+	 */
+	unsigned int current_node() const;
+
+	/**
+	 * @brief Returns the nth nearest node to the given one, where the 0th is the node itself.
+	 */
+	unsigned int fallback(unsigned int node, unsigned int n) const { return fallback_[node][n]; }
+
+	u8 distance(unsigned int from, unsigned int to) const { return distances_[from][to]; }
+
+	void dump() const;
+
+private:
+	numa_topology()
+		: nr_nodes_(1)
+		, nr_domains_(0)
+		, nr_ranges_(0)
+	{
+		for (unsigned int from = 0; from < max_nodes; from++) {
+			for (unsigned int to = 0; to < max_nodes; to++) {
+				distances_[from][to] = from == to ? local_distance : remote_distance;
+			}
+
+			fallback_[from][0] = from;
+		}
+
+		for (auto &node : core_nodes_) {
+			node = 0;
+		}
+	}
+
+	struct memory_range {
+		u64 start, end;
+		u8 node;
+	};
+
+	unsigned int nr_nodes_;
+
+	u32 domains_[max_nodes];
+	unsigned int nr_domains_;
+
+	memory_range ranges_[max_ranges];
+	unsigned int nr_ranges_;
+
+	u8 core_nodes_[arch::core_manager::max_cores];
+	u8 distances_[max_nodes][max_nodes];
+	u8 fallback_[max_nodes][max_nodes];
+};
+} // namespace stacsos::kernel::mem
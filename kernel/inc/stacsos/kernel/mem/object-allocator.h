@@ -7,6 +7,8 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/percpu.h>
 #include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/large-object-allocator.h>
 #include <stacsos/kernel/mem/slab-cache.h>
@@ -14,24 +16,170 @@
 namespace stacsos::kernel::mem {
 class memory_manager;
 
+/**
+ * @brief The kernel heap.  Small objects come from a slab cache per size class, fronted by per-core magazines, in the
+ * style of Bonwick's magazine allocator.  Each core has a loaded and a previous magazine for each size class, and
+ * most allocations and frees are a pop or push on one of them, under a lock that only that core normally takes.  A
+ * core only goes to the shared depot for its size class, which holds full magazines and the slab cache, when both of
+ * its magazines are exhausted (or both full).  Objects bigger than the largest size class come from the large object
+ * allocator.
+ */
 class object_allocator {
 public:
+	static const unsigned int nr_size_classes = 17;
+	static const unsigned int magazine_size = 16;
+
+	// Powers of two, with one class half way between each pair from 32 bytes up, so that no more than a third of an
+	// object is wasted.  Every size is a multiple of 16, so that objects stay 16-byte aligned.
+	static constexpr size_t class_sizes[nr_size_classes] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144 };
+	static constexpr size_t max_small_size = class_sizes[nr_size_classes - 1];
+
+	// The number of full magazines a depot keeps, before objects are given back to the slab cache.
+	static const unsigned int depot_limit = 8;
+
+	struct stats {
+		u64 hits, misses;
+	};
+
+	struct depot_stats {
+		u64 acquisitions, hold_cycles, max_hold_cycles;
+		u64 slab_allocations, slab_frees;
+	};
+
 	object_allocator();
 
 	void *alloc(size_t size);
 	void *realloc(void *obj, size_t size);
 	void free(void *obj);
 
+	static size_t class_object_size(unsigned int size_class) { return class_sizes[size_class]; }
+
+	/**
+	 * @brief The size to allocate for an object that has to be aligned more strictly than 16 bytes, up to a page.
+	 * Slabs start on a page boundary, with their objects laid out one after the other, so an object whose size class
+	 * is a multiple of the alignment is aligned, as is anything big enough to come from the large object allocator.
+	 */
+	static size_t aligned_size(size_t size, size_t alignment)
+	{
+		for (unsigned int i = 0; i < nr_size_classes; i++) {
+			if (class_sizes[i] >= size && !(class_sizes[i] % alignment)) {
+				return class_sizes[i];
+			}
+		}
+
+		return max(size, max_small_size + 1);
+	}
+
+	stats get_stats(int core_id, unsigned int size_class) const { return cores_[core_id].classes[size_class].counters; }
+	depot_stats get_depot_stats(unsigned int size_class) const { return depots_[size_class].counters; }
+
+	/**
+	 * @brief Returns the state of a size class's slab cache.  Objects that are sitting in magazines count as
+	 * allocated, as far as the slab cache is concerned.
+	 */
+	slab_cache_base::stats get_slab_stats(unsigned int size_class);
+
+	/**
+	 * @brief Returns the number of bytes the large object allocator has mapped.
+	 */
+	u64 large_object_bytes();
+
+	void dump() const;
+
 private:
-	spinlock_irq object_allocator_lock_;
+	// A magazine is a chain of free objects, linked through their first word.
+	struct magazine {
+		void *head;
+		unsigned int rounds;
+
+		void push(void *obj)
+		{
+			*(void **)obj = head;
+			head = obj;
+			rounds++;
+		}
 
+		void *pop()
+		{
+			void *obj = head;
+			head = *(void **)obj;
+			rounds--;
+
+			return obj;
+		}
+	};
+
+	struct per_core_class {
+		magazine loaded, previous; // The previous magazine is always either full or empty.
+		stats counters;
+	};
+
+	struct per_core_magazines {
+		spinlock_irq lock;
+		per_core_class classes[nr_size_classes];
+	};
+
+	// The full magazines in a depot are linked through the second word of the first object in each.
+	struct depot {
+		spinlock_irq lock;
+		void *full;
+		unsigned int nr_full;
+		depot_stats counters;
+	};
+
+	arch::percpu<per_core_magazines> cores_;
+	depot depots_[nr_size_classes];
+
+	// The slabs of the bigger classes span several pages, so that the object reserved for the slab header is a
+	// small fraction of each one.
 	slab_cache<16, 0> cache16_;
 	slab_cache<32, 0> cache32_;
+	slab_cache<48, 0> cache48_;
 	slab_cache<64, 0> cache64_;
+	slab_cache<96, 0> cache96_;
 	slab_cache<128, 0> cache128_;
+	slab_cache<192, 0> cache192_;
 	slab_cache<256, 0> cache256_;
+	slab_cache<384, 0> cache384_;
 	slab_cache<512, 0> cache512_;
-	slab_cache<1024, 0> cache1024_;
+	slab_cache<768, 1> cache768_;
+	slab_cache<1024, 1> cache1024_;
+	slab_cache<1536, 2> cache1536_;
+	slab_cache<2048, 2> cache2048_;
+	slab_cache<3072, 3> cache3072_;
+	slab_cache<4096, 3> cache4096_;
+	slab_cache<6144, 4> cache6144_;
+	slab_cache_base *caches_[nr_size_classes];
+
+	spinlock_irq loa_lock_;
 	large_object_allocator loa_;
+
+	// Maps a size, in 16-byte units rounded up, to the smallest class that holds it.
+	struct size_class_table {
+		u8 classes[(max_small_size / 16) + 1];
+
+		constexpr size_class_table()
+			: classes()
+		{
+			unsigned int c = 0;
+
+			for (size_t i = 0; i <= max_small_size / 16; i++) {
+				while (class_sizes[c] < i * 16) {
+					c++;
+				}
+
+				classes[i] = c;
+			}
+		}
+	};
+
+	static const size_class_table size_class_lookup;
+
+	static unsigned int size_class_of(size_t size) { return size_class_lookup.classes[(size + 15) / 16]; }
+
+	void *alloc_from_depot(unsigned int size_class, per_core_class &pcc);
+	void free_to_depot(unsigned int size_class, per_core_class &pcc);
+	void free_to_slab(void *obj);
+	static void account_hold(depot &d, u64 acquired);
 };
 } // namespace stacsos::kernel::mem
@@ -7,38 +7,130 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 
 namespace stacsos::kernel::mem {
+/**
+ * @brief The buddy page allocator.  Each order has a doubly linked free list, threaded through the page descriptors
+ * of the first page in each free block, and a bitmap with a bit for every block-aligned position in that order, set
+ * when a free block starts there.  Finding out whether a block's buddy is free, and inserting or removing a block,
+ * are therefore constant time.
+ *
+ * To stop memory that can never be moved from being scattered everywhere, memory is divided into pageblocks of 2 MiB,
+ * each of which is either for movable or unmovable pages, and each order has a free list for each.  An allocation
+ * that finds nothing of its own type steals the biggest block of the other type, and (if the block is big, or the
+ * allocation is unmovable) claims the whole of its pageblock, so that later allocations of the same type go there
+ * too.
+ *
+ * Free memory has three watermarks, set from the amount of memory the allocator manages.  Once it falls below the low
+ * watermark, the reclaimer is woken, to free cached pages until it is back above the high one.  Below the minimum
+ * watermark, only reserve allocations are satisfied, so that the allocations that can't wait for memory to be
+ * reclaimed still can be while the reclaimer catches up.
+ */
 class page_allocator_buddy : public page_allocator {
 public:
 	page_allocator_buddy(memory_manager &mm)
 		: page_allocator(mm)
+		, pageblock_types_(nullptr)
+		, nr_pages_(0)
+		, total_free_(0)
+		, managed_pages_(0)
+		, min_watermark_(0)
+		, low_watermark_(0)
+		, high_watermark_(0)
+		, compaction_cursor_(0)
+		, grouping_counters_ {}
 	{
 		for (int i = 0; i <= LastOrder; i++) {
-			free_list_[i] = nullptr;
+			for (int type = 0; type < nr_block_types; type++) {
+				free_list_[type][i] = nullptr;
+			}
+
+			free_bitmap_[i] = nullptr;
+			nr_free_blocks_[i] = 0;
 		}
 	}
 
+	virtual u64 metadata_size(u64 nr_page_descriptors) const override;
+	virtual void init_metadata(void *metadata, u64 nr_page_descriptors) override;
+
 	virtual void insert_free_pages(page &range_start, u64 page_count) override;
 
 	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
 	virtual void free_pages(page &base, int order) override;
 
+	virtual u64 free_blocks(int order) const override { return nr_free_blocks_[order]; }
+	virtual int last_order() const override { return LastOrder; }
+	virtual u64 free_page_count() const override { return total_free_; }
+	virtual u64 reclaim_target() const override;
+
+	virtual grouping_stats get_grouping_stats() const override;
+	virtual bool find_compaction_region(int order, u64 &start_pfn, bool &wrapped) override;
+
 	virtual void dump() const override;
 
 private:
 	static const int LastOrder = 16;
+	static const int PageblockOrder = 9;
+
+	// The minimum watermark is this fraction of the memory the allocator manages, and the low and high watermarks are a
+	// quarter and a half above it.
+	static const u64 min_watermark_divisor = 512;
+
+	// The number of regions a single compaction search looks at.
+	static const unsigned int compaction_scan_regions = 64;
 
-	page *free_list_[LastOrder + 1];
+	// Zeroed metadata leaves every pageblock movable, so that the first unmovable allocations claim pageblocks for
+	// themselves.
+	enum block_type : u8 { movable = 0, unmovable = 1, nr_block_types };
+
+	page *free_list_[nr_block_types][LastOrder + 1];
+	u64 nr_free_blocks_[LastOrder + 1];
+	u64 *free_bitmap_[LastOrder + 1];
+	u8 *pageblock_types_;
+	u64 nr_pages_;
 	u64 total_free_;
+	u64 managed_pages_;
+	u64 min_watermark_, low_watermark_, high_watermark_;
+	u64 compaction_cursor_;
+	grouping_stats grouping_counters_;
+	spinlock_irq lock_;
 
 	constexpr u64 pages_per_block(int order) const { return 1 << order; }
 
 	constexpr bool block_aligned(int order, u64 pfn) { return !(pfn & (pages_per_block(order) - 1)); }
 
+	static u64 bitmap_words(int order, u64 nr_page_descriptors) { return ((nr_page_descriptors >> order) / 64) + 2; }
+
+	bool is_free_block(int order, u64 pfn) const
+	{
+		u64 index = pfn >> order;
+		return !!(free_bitmap_[order][index / 64] & (1ull << (index % 64)));
+	}
+
+	void set_free_block(int order, u64 pfn, bool free)
+	{
+		u64 index = pfn >> order;
+		u64 bit = 1ull << (index % 64);
+
+		if (free) {
+			free_bitmap_[order][index / 64] |= bit;
+		} else {
+			free_bitmap_[order][index / 64] &= ~bit;
+		}
+	}
+
+	block_type pageblock_type(u64 pfn) const { return (block_type)pageblock_types_[pfn >> PageblockOrder]; }
+	void set_pageblock_type(u64 pfn, block_type type) { pageblock_types_[pfn >> PageblockOrder] = type; }
+
+	page *take_fallback_block(int order, block_type type, int &source_order);
+	void claim_pageblock(u64 pfn, block_type type);
+	bool region_compactable(u64 start_pfn, int order);
+
 	void insert_free_block(int order, page &block_start);
 	void remove_free_block(int order, page &block_start);
+	void free_block(int order, page &block_start);
 
 	void split_block(int order, page &block_start);
 	void merge_buddies(int order, page &buddy);
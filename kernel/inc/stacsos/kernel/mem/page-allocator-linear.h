@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 
 namespace stacsos::kernel::mem {
@@ -28,5 +29,8 @@ public:
 
 private:
 	page *free_list_;
+	spinlock_irq lock_;
+
+	void insert_free_block(page &block_start, u64 page_count);
 };
 } // namespace stacsos::kernel::mem
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/mem/numa.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+
+namespace stacsos::kernel::mem {
+/**
+ * @brief A page allocator for each NUMA node, each only ever holding the node's own memory.  An allocation comes from
+ * the node of the core that asks for it, and, only if that node has nothing suitable, from the others in order of
+ * distance.  Pages always go back to the allocator of the node they are on, so a node's allocator never merges its
+ * blocks with another's.
+ */
+class page_allocator_numa : public page_allocator {
+public:
+	page_allocator_numa(memory_manager &mm, page_allocator **node_allocators, unsigned int nr_nodes)
+		: page_allocator(mm)
+		, nr_nodes_(nr_nodes)
+		, compaction_node_(0)
+	{
+		for (unsigned int node = 0; node < nr_nodes; node++) {
+			nodes_[node] = node_allocators[node];
+		}
+	}
+
+	virtual u64 metadata_size(u64 nr_page_descriptors) const override;
+	virtual void init_metadata(void *metadata, u64 nr_page_descriptors) override;
+
+	virtual void insert_free_pages(page &range_start, u64 page_count) override;
+
+	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_pages(page &base, int order) override;
+	virtual void free_pages_direct(page &base, int order) override;
+
+	virtual u64 free_blocks(int order) const override;
+	virtual int last_order() const override { return nodes_[0]->last_order(); }
+	virtual u64 free_page_count() const override;
+	virtual u64 reclaim_target() const override;
+
+	virtual grouping_stats get_grouping_stats() const override;
+	virtual bool find_compaction_region(int order, u64 &start_pfn, bool &wrapped) override;
+
+	virtual void dump() const override;
+
+	/**
+	 * @brief Returns the number of free pages on one node.
+	 */
+	u64 node_free_page_count(unsigned int node) const { return nodes_[node]->free_page_count(); }
+
+private:
+	page_allocator *nodes_[numa_topology::max_nodes];
+	unsigned int nr_nodes_;
+	unsigned int compaction_node_;
+
+	static u64 align_metadata(u64 size) { return (size + 7) & ~7ull; }
+};
+} // namespace stacsos::kernel::mem
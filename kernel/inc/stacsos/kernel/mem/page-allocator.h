@@ -14,7 +14,12 @@ namespace stacsos::kernel::mem {
 class page;
 class memory_manager;
 
-enum class page_allocation_flags { none = 0, zero = 1 };
+// A cold allocation is for a page that isn't about to be touched, so can be given one that isn't in the cache.  A
+// movable allocation is for a page that can be moved elsewhere later (such as a private user page), which is kept
+// apart from the rest, so that moving them can make room for large blocks.  A reserve allocation may use the last of
+// free memory, below the minimum watermark, and is for allocations that can't wait for memory to be reclaimed (such as
+// new slabs, which are allocated with locks held).
+enum class page_allocation_flags { none = 0, zero = 1, cold = 2, movable = 4, reserve = 8 };
 
 DEFINE_ENUM_FLAG_OPERATIONS(page_allocation_flags)
 
@@ -25,16 +30,73 @@ public:
 	{
 	}
 
+	/**
+	 * @brief Returns the number of bytes of bookkeeping the allocator needs to manage the given number of page
+	 * descriptors.  The memory manager sets this aside next to the page descriptors, and hands it to
+	 * init_metadata (zeroed) before any pages are inserted.
+	 */
+	virtual u64 metadata_size(u64 nr_page_descriptors) const { return 0; }
+	virtual void init_metadata(void *metadata, u64 nr_page_descriptors) { }
+
 	virtual void insert_free_pages(page &range_start, u64 page_count) = 0;
 
 	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) = 0;
 	virtual void free_pages(page &base, int order) = 0;
 
+	/**
+	 * @brief Frees pages straight to the underlying allocator, bypassing any caches in front of it, so that they can be
+	 * merged with their free buddies right away.
+	 */
+	virtual void free_pages_direct(page &base, int order) { free_pages(base, order); }
+
 	page_alloc_ref allocate_pages_ref(int order, page_allocation_flags flags = page_allocation_flags::none)
 	{
 		return page_alloc_ref(allocate_pages(order, flags), order);
 	}
 
+	/**
+	 * @brief Returns the number of free blocks of the given order, for reporting.  Orders go from zero up to and
+	 * including last_order, which is -1 for an allocator that doesn't keep its free memory by order.
+	 */
+	virtual u64 free_blocks(int order) const { return 0; }
+	virtual int last_order() const { return -1; }
+
+	/**
+	 * @brief Returns the total number of free pages, including any held in caches in front of the allocator.
+	 */
+	virtual u64 free_page_count() const { return 0; }
+
+	/**
+	 * @brief Returns the number of pages that would have to be freed to bring free memory back up to the high
+	 * watermark, which the reclaimer works towards once free memory has fallen below the low one.  An allocator
+	 * without watermarks never asks for anything to be reclaimed.
+	 */
+	virtual u64 reclaim_target() const { return 0; }
+
+	struct grouping_stats {
+		u64 movable_blocks, unmovable_blocks;
+		u64 steals, claims;
+	};
+
+	/**
+	 * @brief Returns how memory is divided between movable and unmovable pageblocks, for reporting.
+	 */
+	virtual grouping_stats get_grouping_stats() const { return {}; }
+
+	/**
+	 * @brief Looks for an aligned region of the given order, in which every page that isn't free can be moved by the
+	 * compactor.  Each call only looks at some of memory, carrying on from where the last one stopped.
+	 *
+	 * @param start_pfn Set to the first page of the region, if one is found.
+	 * @param wrapped Set if the search reached the end of memory.
+	 * @return bool true if a region was found.
+	 */
+	virtual bool find_compaction_region(int order, u64 &start_pfn, bool &wrapped)
+	{
+		wrapped = true;
+		return false;
+	}
+
 	virtual void dump() const = 0;
 
 	void perform_selftest();
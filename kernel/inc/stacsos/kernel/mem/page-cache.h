@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/hash-map.h>
+#include <stacsos/intrusive-list.h>
+#include <stacsos/radix-tree.h>
+
+namespace stacsos::kernel::fs {
+class file;
+class fs_node;
+} // namespace stacsos::kernel::fs
+
+namespace stacsos::kernel::mem {
+class page;
+
+/**
+ * @brief Keeps the pages of files that have been read in, so that every address space mapping the same page of the
+ * same file shares a single copy of it.  The pages are marked as cached, and must only ever be mapped read-only --
+ * an address space that needs to write to one takes a private copy first -- unless the mapping is shared.
+ *
+ * Each page is on one of two LRU lists.  A page starts on the inactive list, and is moved to the active list if it
+ * is looked up again while its referenced bit is still set from the last time.  Reclaim takes pages from the old end
+ * of the inactive list, topping it up from the old end of the active list (clearing their referenced bits) whenever
+ * the active list is the bigger of the two, so that a page has to keep being used to stay in the cache.  Only clean
+ * pages that nothing holds a reference to (see page::refcount) are reclaimed: a page that has been mapped writable
+ * may hold data that hasn't been written back, so it stays.
+ */
+class page_cache {
+	DEFINE_SINGLETON(page_cache)
+
+public:
+	struct stats {
+		u64 hits, misses;
+		u64 active, inactive;
+		u64 activations, reclaimed;
+	};
+
+	/**
+	 * @brief Returns the page holding the given page of a file, reading it in first if it isn't cached yet.  Anything
+	 * past the end of the file reads as zero.  The page is returned with a reference taken, which the caller must
+	 * release once it has mapped it (which takes a reference of its own) or no longer needs it.
+	 *
+	 * @param node The file system node of the file, which identifies it in the cache.
+	 * @param file An open handle to the file, for reading it in.
+	 * @param page_index The index of the page in the file, i.e. the file offset divided by the page size.
+	 * @param writable Whether the page is about to be mapped writable, after which it is never reclaimed.
+	 * @return page* The cached page, or null if the page couldn't be allocated.
+	 */
+	page *get_page(fs::fs_node &node, fs::file &file, u64 page_index, bool writable = false);
+
+	/**
+	 * @brief Frees up to the given number of clean, unreferenced pages from the inactive list, and returns the number
+	 * that were freed.  May block.
+	 */
+	u64 reclaim(u64 nr_pages);
+
+	/**
+	 * @brief Frees the pages of a file from first to last inclusive that reclaim could take, i.e. those that are clean
+	 * and unreferenced, however recently they were used.  Returns the number that were freed.
+	 */
+	u64 drop(fs::fs_node &node, u64 first, u64 last);
+
+	stats get_stats();
+
+private:
+	page_cache()
+		: counters_({})
+	{
+	}
+
+	struct cached_page {
+		cached_page(fs::fs_node &node, u64 index, page &pg)
+			: node(node)
+			, index(index)
+			, pg(pg)
+			, active(false)
+			, referenced(false)
+			, lru_link { nullptr, nullptr }
+		{
+		}
+
+		fs::fs_node &node;
+		u64 index;
+		page &pg;
+
+		bool active, referenced;
+		list_hook lru_link;
+	};
+
+	using lru_list = intrusive_list<cached_page, &cached_page::lru_link>;
+
+	// Each file's pages are kept in a radix tree on their index, where the pages that have been mapped writable are
+	// tagged as dirty.
+	using page_tree = radix_tree<cached_page>;
+	static const unsigned int tag_dirty = 0;
+
+	// How many pages of the inactive list a reclaim looks at for each page it is asked for, at most.
+	static const u64 scan_factor = 4;
+
+	// Covers the maps, both lists, and every cached page's flags.
+	spinlock_irq lock_;
+	hash_map<fs::fs_node *, page_tree *> files_;
+
+	// Oldest first.
+	lru_list active_, inactive_;
+
+	stats counters_;
+
+	page_tree *pages_of(fs::fs_node &node);
+	cached_page *lookup(fs::fs_node &node, u64 page_index);
+	void mark_accessed(cached_page &cp);
+	void age_active();
+};
+} // namespace stacsos::kernel::mem
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+
+namespace stacsos::kernel::mem {
+
+/**
+ * @brief Per-core lists of single pages, in front of the page allocator, so that most single-page allocations and
+ * frees don't take the page allocator's lock.  Each list is ordered from hot (most recently freed, so most likely
+ * to still be in the cache) to cold.  An empty list is refilled with a batch of pages from the page allocator, and
+ * once a list grows past its high mark, a batch of its coldest pages is given back.  Larger allocations go straight
+ * to the page allocator.  Movable and unmovable pages are kept on separate lists, so that a page is always given back
+ * to the part of memory it came from.
+ */
+class page_frame_cache : public page_allocator {
+public:
+	struct stats {
+		u64 hits, misses, refills, drains;
+	};
+
+	page_frame_cache(memory_manager &mm, page_allocator &backing, unsigned int batch, unsigned int high)
+		: page_allocator(mm)
+		, backing_(backing)
+		, batch_(batch)
+		, high_(high)
+	{
+		for (auto &cache : caches_) {
+			for (auto &list : cache.lists) {
+				list.hot = nullptr;
+				list.cold = nullptr;
+				list.count = 0;
+			}
+
+			cache.counters = {};
+		}
+	}
+
+	virtual void insert_free_pages(page &range_start, u64 page_count) override { backing_.insert_free_pages(range_start, page_count); }
+
+	virtual page *allocate_pages(int order, page_allocation_flags flags = page_allocation_flags::none) override;
+	virtual void free_pages(page &base, int order) override;
+	virtual void free_pages_direct(page &base, int order) override { backing_.free_pages_direct(base, order); }
+
+	virtual u64 free_blocks(int order) const override { return backing_.free_blocks(order); }
+	virtual int last_order() const override { return backing_.last_order(); }
+
+	virtual u64 free_page_count() const override
+	{
+		u64 count = backing_.free_page_count();
+		for (const auto &cache : caches_) {
+			for (const auto &list : cache.lists) {
+				count += list.count;
+			}
+		}
+
+		return count;
+	}
+
+	virtual u64 reclaim_target() const override { return backing_.reclaim_target(); }
+
+	virtual grouping_stats get_grouping_stats() const override { return backing_.get_grouping_stats(); }
+
+	virtual bool find_compaction_region(int order, u64 &start_pfn, bool &wrapped) override
+	{
+		return backing_.find_compaction_region(order, start_pfn, wrapped);
+	}
+
+	virtual void dump() const override;
+
+	stats get_stats(int core_id) const { return caches_[core_id].counters; }
+
+private:
+	struct page_list {
+		page *hot, *cold; // The two ends of the list
+		unsigned int count;
+	};
+
+	// One list for unmovable pages, and one for movable.
+	struct per_core_cache {
+		spinlock_irq lock;
+		page_list lists[2];
+		stats counters;
+	};
+
+	page_allocator &backing_;
+	unsigned int batch_, high_;
+	arch::percpu<per_core_cache> caches_;
+
+	void push_hot(page_list &list, page &pg);
+	void push_cold(page_list &list, page &pg);
+	page *pop_hot(page_list &list);
+	page *pop_cold(page_list &list);
+
+	void refill(per_core_cache &cache, bool movable, bool reserve);
+	void drain(per_core_cache &cache, bool movable);
+};
+} // namespace stacsos::kernel::mem
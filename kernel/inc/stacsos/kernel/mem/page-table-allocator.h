@@ -7,14 +7,66 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/lock.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page.h>
 
 namespace stacsos::kernel::mem {
 
+/**
+ * @brief Allocates the pages that page tables are made of.  Each core keeps a small stack of zeroed pages, so that
+ * building an address space doesn't go to the page allocator for every level of every table.  An empty stack is
+ * refilled with a batch of pages, cleared together, and tables that are freed already empty (and so still zeroed) go
+ * straight back on the stack, up to its capacity.
+ */
 class page_table_allocator {
 public:
+	static const unsigned int cache_capacity = 16;
+	static const int refill_order = 3;
+
+	struct stats {
+		u64 hits, misses, refills;
+	};
+
+	page_table_allocator()
+		: nr_pages_(0)
+	{
+		for (auto &cache : caches_) {
+			cache.count = 0;
+			cache.counters = {};
+		}
+	}
+
 	page *allocate();
-	void free(page *pg);
+
+	/**
+	 * @brief Frees a page table.
+	 *
+	 * @param pg The page the table is in.
+	 * @param zeroed Whether every entry in the table is known to be clear, so that it can be reused as it is.
+	 */
+	void free(page *pg, bool zeroed = false);
+
+	/**
+	 * @brief Returns the number of pages currently in use as page tables.
+	 */
+	u64 nr_pages() const { return __atomic_load_n(&nr_pages_, __ATOMIC_RELAXED); }
+
+	stats get_stats(int core_id) const { return caches_[core_id].counters; }
+
+private:
+	struct per_core_cache {
+		spinlock_irq lock;
+		page *pages[cache_capacity];
+		unsigned int count;
+		stats counters;
+	};
+
+	u64 nr_pages_;
+	arch::percpu<per_core_cache> caches_;
+
+	page *refill(per_core_cache &cache);
 };
 } // namespace stacsos::kernel::mem
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/x86/tlb.h>
 #include <stacsos/kernel/arch/x86/x86-page-table.h>
 
 namespace stacsos::kernel::mem {
@@ -15,4 +16,5 @@ using mapping_flags = arch::x86::mapping_flags;
 using mapping_size = arch::x86::mapping_size;
 using mapping_result = arch::x86::mapping_result;
 using mapping = arch::x86::mapping;
+using tlb_batch = arch::x86::tlb_batch;
 } // namespace stacsos::kernel::mem
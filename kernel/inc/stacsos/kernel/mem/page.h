@@ -7,36 +7,136 @@
  */
 #pragma once
 
-extern "C" void *_DYNAMIC_DATA_START;
+// The start of the memory after the kernel image, which the page descriptors are laid out in.  It is declared as an
+// array of unknown size, so that the compiler doesn't take it to be a single object, and the descriptors to be out of
+// its bounds.
+extern "C" char _DYNAMIC_DATA_START[];
 
 namespace stacsos::kernel::mem {
 enum class page_type : u32 { none, reserved, system, allocable };
 enum class page_state : u32 { free, allocated };
 
+class address_space;
 class memory_manager;
 class page_allocator_buddy;
 class page_allocator_linear;
+class page_allocator_numa;
+class page_frame_cache;
+class slab_cache_base;
 
 class page {
 	friend class memory_manager;
+	friend class page_allocator_buddy;
+	friend class page_allocator_numa;
+	friend class page_frame_cache;
 
 public:
 	static page &get_from_pfn(u64 pfn) { return get_pagearray()[pfn]; }
 	static page &get_from_base_address(u64 base_addr) { return get_pagearray()[base_addr >> PAGE_BITS]; }
+	static page &get_from_base_address_ptr(const void *ptr) { return get_from_base_address((u64)ptr - 0xffff'8000'0000'0000ull); }
 
 	u64 pfn() const { return ((u64)this - (u64)get_pagearray()) / sizeof(page); }
 	u64 base_address() const { return pfn() << PAGE_BITS; }
 	void *base_address_ptr() const { return (void *)(base_address() + 0xffff'8000'0000'0000ull); }
 
-	u64 refcount() const { return refcount_; }
-	void acquire() { refcount_++; }
-	bool release() { return !(refcount_--); }
+	/**
+	 * @brief The number of references to a cached page: one for each address space mapping it, and one for anything
+	 * else holding on to it (such as an executable image).  The page cache only reclaims a page with none.
+	 */
+	u64 refcount() const { return __atomic_load_n(&refcount_, __ATOMIC_ACQUIRE); }
+	void acquire() { __atomic_fetch_add(&refcount_, 1, __ATOMIC_ACQ_REL); }
+	bool release() { return __atomic_sub_fetch(&refcount_, 1, __ATOMIC_ACQ_REL) == 0; }
+
+	/**
+	 * @brief The slab cache, and the slab within it, that this page belongs to, or null if it is not part of a slab.
+	 * These are set on every page of a slab, so that the slab owning any object can be found in constant time.
+	 */
+	slab_cache_base *slab_owner() const { return slab_owner_; }
+	void *slab() const { return slab_; }
+
+	void set_slab(slab_cache_base *owner, void *slab)
+	{
+		slab_owner_ = owner;
+		slab_ = slab;
+	}
+
+	/**
+	 * @brief Whether the page belongs to the page cache, which may share it between any number of address spaces.  A
+	 * cached page is never freed when it is unmapped, and must never be written to.
+	 */
+	bool cached() const { return cached_; }
+	void set_cached(bool cached) { cached_ = cached; }
+
+	/**
+	 * @brief Whether the page is a private page that a fork has shared, read-only, between address spaces, each of
+	 * which copies it the first time it writes to it.  The reference count is the number of address spaces mapping
+	 * it, and the last of them to unmap it frees it.  For a 2 MiB block, this is only set on its first page.
+	 */
+	bool cow() const { return cow_; }
+	void set_cow(bool cow) { cow_ = cow; }
+
+	/**
+	 * @brief The number of present entries, when the page holds a page table, so that a table that has been emptied
+	 * can be found without scanning it.
+	 */
+	unsigned int table_entries() const { return table_entries_; }
+	void set_table_entries(unsigned int nr_entries) { table_entries_ = nr_entries; }
+
+	/**
+	 * @brief Whether the page was allocated as movable, i.e. from the part of memory set aside for pages that the
+	 * compactor can move elsewhere.
+	 */
+	bool movable() const { return movable_; }
+
+	/**
+	 * @brief The NUMA node that the page is on, which is always zero on a machine without an SRAT.
+	 */
+	unsigned int node() const { return node_; }
+
+	/**
+	 * @brief The user address space that maps the page privately, and the address it is mapped at, or null if the
+	 * page isn't a private user page.  Only these pages can be moved by the compactor, and only until they are pinned,
+	 * i.e. their physical address has been handed to the rest of the kernel.
+	 */
+	address_space *mapper() const { return mapper_; }
+	u64 mapped_at() const { return mapped_at_; }
+	bool pinned() const { return pinned_; }
+
+	void set_mapping(address_space *mapper, u64 address)
+	{
+		mapper_ = mapper;
+		mapped_at_ = address;
+		pinned_ = false;
+	}
+
+	void clear_mapping() { mapper_ = nullptr; }
+	void pin() { pinned_ = true; }
 
 private:
-	static page *get_pagearray() { return reinterpret_cast<page *>(&_DYNAMIC_DATA_START); }
+	static page *get_pagearray() { return reinterpret_cast<page *>(_DYNAMIC_DATA_START); }
 
 	page_type type_;
 	page_state state_;
 	u64 refcount_;
+
+	// Links in the buddy allocator's free list, when this is the first page of a free block, or in a per-core page
+	// frame cache list.
+	page *next_free_, *prev_free_;
+
+	slab_cache_base *slab_owner_;
+	void *slab_;
+
+	bool cached_;
+	bool cow_;
+	u16 table_entries_;
+
+	// Which of the buddy allocator's lists the page is on, when it is the first page of a free block.
+	u8 free_type_;
+	bool movable_;
+	u8 node_;
+
+	address_space *mapper_;
+	u64 mapped_at_;
+	bool pinned_;
 };
 } // namespace stacsos::kernel::mem
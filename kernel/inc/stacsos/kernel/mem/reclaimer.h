@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/sched/event.h>
+#include <stacsos/kernel/sched/mutex.h>
+#include <stacsos/intrusive-list.h>
+
+namespace stacsos::kernel::mem {
+/**
+ * @brief A cache of objects that can give some of them back when memory is short, e.g. the dentry cache, or a file
+ * system's cache of nodes.  The objects live in slabs, so freeing them doesn't give whole pages back straight away,
+ * but it lets slabs empty, and drops what they hold on to (such as the nodes a directory entry points at).
+ */
+class shrinker {
+	friend class reclaimer;
+
+public:
+	shrinker()
+		: shrinker_link_ { nullptr, nullptr }
+	{
+	}
+
+	virtual ~shrinker() { }
+
+	/**
+	 * @brief Returns roughly how many objects could be freed.
+	 */
+	virtual u64 count_objects() = 0;
+
+	/**
+	 * @brief Tries to free up to the given number of objects, least recently used first, and returns the number that
+	 * were.  This is called from the reclaim thread, so may block.
+	 */
+	virtual u64 scan_objects(u64 nr_to_scan) = 0;
+
+private:
+	list_hook shrinker_link_;
+};
+
+/**
+ * @brief Frees memory that is only being used to cache things, once the page allocator's free memory falls below its
+ * low watermark, until it is back above the high one.  Clean pages are reclaimed from the inactive end of the page
+ * cache, and then the shrinkers are asked to free some of their objects.
+ *
+ * The work is done by a kernel thread, which the page allocator wakes from wherever the watermark is crossed, so
+ * nothing that frees memory has to be done with the allocator's callers' locks held.
+ */
+class reclaimer {
+	DEFINE_SINGLETON(reclaimer)
+
+public:
+	struct stats {
+		u64 wakeups, passes;
+		u64 pages_reclaimed, objects_shrunk;
+	};
+
+	/**
+	 * @brief Starts the reclaim thread.  Until then, waking the reclaimer does nothing.
+	 */
+	void start();
+
+	/**
+	 * @brief Wakes the reclaim thread, if it isn't already awake.  This can be called from anywhere, including with
+	 * interrupts disabled.
+	 */
+	void wake();
+
+	void register_shrinker(shrinker &s);
+	void unregister_shrinker(shrinker &s);
+
+	/**
+	 * @brief Tries to free the given number of pages, returning the number of pages and objects that were freed.
+	 * May block.
+	 */
+	u64 reclaim(u64 nr_pages);
+
+	stats get_stats() const { return counters_; }
+
+private:
+	reclaimer()
+		: started_(false)
+		, pending_(false)
+		, counters_ {}
+	{
+	}
+
+	// The most pages one pass tries to reclaim, and the most passes one wakeup makes, so that a cache that keeps
+	// saying it has freed something can't keep the thread going forever.
+	static const u64 pages_per_pass = 256;
+	static const unsigned int max_passes = 64;
+
+	// Each pass asks a shrinker to scan this fraction of its objects, or a minimum number, if it has fewer.
+	static const u64 shrink_divisor = 8;
+	static const u64 min_shrink_scan = 64;
+
+	bool started_;
+	bool pending_;
+	sched::auto_reset_event wakeup_;
+
+	sched::mutex shrinkers_lock_;
+	intrusive_list<shrinker, &shrinker::shrinker_link_> shrinkers_;
+
+	stats counters_;
+
+	static void thread_proc(void *arg);
+};
+} // namespace stacsos::kernel::mem
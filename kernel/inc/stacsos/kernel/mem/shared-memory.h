@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/memory.h>
+
+namespace stacsos::kernel::mem {
+class page;
+
+/**
+ * @brief Memory that any number of processes can map at once, and so share without copying.  It is a file that keeps
+ * its own pages, rather than going through the page cache, so it is mapped in the same way as a file.  Every mapping
+ * holds a reference, so the pages stay until the last mapping, and the last handle, have gone.
+ */
+class shared_memory : public fs::file {
+public:
+	/**
+	 * @brief Allocates (zeroed) pages for size bytes, returning null if there isn't enough memory.
+	 */
+	static shared_ptr<shared_memory> create(u64 size);
+
+	virtual ~shared_memory();
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override;
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override;
+
+	virtual bool has_own_pages() const override { return true; }
+	virtual page *own_page(u64 index) override { return index < nr_pages_ ? pages_[index] : nullptr; }
+
+private:
+	shared_memory(u64 size, page **pages, u64 nr_pages)
+		: fs::file(size)
+		, pages_(pages)
+		, nr_pages_(nr_pages)
+	{
+	}
+
+	page **pages_;
+	u64 nr_pages_;
+
+	static void free_pages(page **pages, u64 count);
+};
+} // namespace stacsos::kernel::mem
@@ -7,34 +7,80 @@
  */
 #pragma once
 
-#include <stacsos/bitset.h>
-
 namespace stacsos::kernel::mem {
 enum class slab_state { empty, partial, full };
 
-template <size_t object_size, int slab_page_order> class slab_cache {
+/**
+ * @brief The part of a slab cache that doesn't depend on the object size, so that an object can be returned to the
+ * cache recorded in the descriptor of the page it lives in.
+ */
+class slab_cache_base {
+public:
+	struct stats {
+		u64 slabs, slab_size;
+		u64 objects, capacity;
+	};
+
+	slab_cache_base(size_t slot_size)
+		: slot_size_(slot_size)
+	{
+	}
+
+	size_t slot_size() const { return slot_size_; }
+
+	virtual void *allocate() = 0;
+	virtual void free_in_slab(void *slab, void *ptr) = 0;
+
+	virtual stats get_stats() const = 0;
+
+protected:
+	/**
+	 * @brief Allocates the pages for a slab, and records in each of them that it belongs to this cache.
+	 */
+	void *allocate_slab_pages(int order);
+
+	/**
+	 * @brief Gives a slab's pages back to the page allocator.
+	 */
+	void free_slab_pages(void *slab, int order);
+
+private:
+	size_t slot_size_;
+};
+
+/**
+ * @brief A cache of fixed-size objects, carved out of slabs of pages.  Each slab threads a list through its free
+ * objects, and the cache keeps its slabs on separate lists by state, so that allocating is a pop from the first
+ * partial (or empty) slab.  Slabs that become empty are given back to the page allocator, apart from a few that are
+ * kept to avoid thrashing when objects are repeatedly allocated and freed on the boundary of a slab.  The pages of a
+ * slab point back at it and its cache, so freeing an object doesn't need to search for the slab holding it.
+ */
+template <size_t object_size, int slab_page_order> class slab_cache : public slab_cache_base {
 private:
 	static const size_t slab_memory_size = ((1u << slab_page_order) * PAGE_SIZE);
 	static const size_t slab_object_capacity = slab_memory_size / object_size;
+	static const unsigned int max_empty_slabs = 1;
+
+	static_assert(object_size >= sizeof(void *), "free objects must be able to hold the free list link");
 
 	class slab {
 		friend class slab_cache;
 
-		static const size_t header_size = sizeof(slab);
-		static const size_t reserved_objects = (header_size + (object_size - 1)) / object_size;
-
-		friend class cache;
-
-		using object_index_type = u64;
+		static const size_t header_size;
+		static const size_t reserved_objects;
 
 	public:
 		slab()
 			: next_(nullptr)
+			, prev_(nullptr)
 			, used_count_(0)
+			, free_list_(nullptr)
 		{
-			for (u64 i = 0; i < reserved_objects; i++) {
-				used_[i] = true;
-				used_count_++;
+			// Thread the free list through every object after the header, lowest address first.
+			for (size_t i = slab_object_capacity; i > reserved_objects; i--) {
+				void **obj = (void **)object_ptr(i - 1);
+				*obj = free_list_;
+				free_list_ = obj;
 			}
 		}
 
@@ -43,7 +89,7 @@ private:
 			return (used_objects() == 0) ? slab_state::empty : ((used_objects() == capacity()) ? slab_state::full : slab_state::partial);
 		}
 
-		size_t capacity() const { return slab_object_capacity; }
+		size_t capacity() const { return slab_object_capacity - reserved_objects; }
 
 		size_t used_objects() const { return used_count_; }
 
@@ -51,103 +97,142 @@ private:
 		{
 			assert(state() != slab_state::full);
 
-			object_index_type free_object = used_.find_first_zero();
-
-			if (free_object == ~0ull) {
-				panic("slab is full!");
-			}
-
-			used_[free_object] = true;
+			void **obj = (void **)free_list_;
+			free_list_ = *obj;
 			used_count_++;
 
-			return object_ptr(free_object);
+			return obj;
 		}
 
 		void free(void *ptr)
 		{
-			u64 used_object = index_of(ptr);
-
-			used_[used_object] = false;
+			*(void **)ptr = free_list_;
+			free_list_ = ptr;
 			used_count_--;
 		}
 
 		bool contains_object(void *ptr) { return ((uintptr_t)ptr >= (uintptr_t)this) && ((uintptr_t)ptr < (uintptr_t)this + slab_memory_size); }
 
-		void *object_ptr(object_index_type object_index) { return (void *)((uintptr_t)this + (object_index * object_size)); }
-
-		object_index_type index_of(void *object_ptr) { return ((uintptr_t)object_ptr - (uintptr_t)this) / object_size; }
+		void *object_ptr(size_t object_index) { return (void *)((uintptr_t)this + (object_index * object_size)); }
 
 	private:
-		slab *next_;
+		slab *next_, *prev_;
 		size_t used_count_;
-		stacsos::bitset<slab_object_capacity> used_;
+		void *free_list_;
+	};
+
+	/**
+	 * @brief An intrusive, doubly linked list of slabs.
+	 */
+	struct slab_list {
+		slab *head;
+		unsigned int count;
+
+		void push(slab *s)
+		{
+			s->prev_ = nullptr;
+			s->next_ = head;
+
+			if (head) {
+				head->prev_ = s;
+			}
+
+			head = s;
+			count++;
+		}
+
+		void remove(slab *s)
+		{
+			if (s->prev_) {
+				s->prev_->next_ = s->next_;
+			} else {
+				head = s->next_;
+			}
+
+			if (s->next_) {
+				s->next_->prev_ = s->prev_;
+			}
+
+			s->next_ = nullptr;
+			s->prev_ = nullptr;
+			count--;
+		}
 	};
 
 public:
 	slab_cache()
-		: slabs_(nullptr)
+		: slab_cache_base(object_size)
+		, full_ { nullptr, 0 }
+		, partial_ { nullptr, 0 }
+		, empty_ { nullptr, 0 }
+		, nr_objects_(0)
 	{
 	}
 
-	void *allocate()
+	virtual void *allocate() override
 	{
-		// Find a free slab
-		slab *s = slabs_;
-		while (s && s->state() == slab_state::full) {
-			s = s->next_;
-		}
+		slab *s = partial_.head;
 
-		if (!s) {
+		if (s) {
+			partial_.remove(s);
+		} else if ((s = empty_.head)) {
+			empty_.remove(s);
+		} else {
 			// Allocate a new slab
-			void *slab_base = allocate_slab();
-			if (!slab_base) {
-				panic("out of memory");
-			}
-
-			s = new (slab_base) slab();
-			s->next_ = slabs_;
-			slabs_ = s;
+			s = new (allocate_slab_pages(slab_page_order)) slab();
 		}
 
 		void *ptr = s->allocate();
+		list_for(s->state()).push(s);
+		nr_objects_++;
+
 		// dprintf("malloc: cache-size=%u, slab=%p, ptr=%p\n", object_size, s, ptr);
 		return ptr;
 	}
 
-	bool try_free(void *ptr)
+	virtual void free_in_slab(void *slab_ptr, void *ptr) override
 	{
-		// Find containing slab
-		slab *s = slabs_;
-		while (s) {
-			if (s->contains_object(ptr)) {
-				break;
-			}
-
-			s = s->next_;
-		}
-
-		if (!s) {
-			return false;
-		}
+		slab *s = (slab *)slab_ptr;
+		assert(s->contains_object(ptr));
 
+		list_for(s->state()).remove(s);
 		s->free(ptr);
+		nr_objects_--;
 		// dprintf("free: ptr=%p\n", ptr);
 
-		// TODO: Free slabs?
-
-		return true;
+		if (s->state() == slab_state::empty && empty_.count >= max_empty_slabs) {
+			free_slab_pages(s, slab_page_order);
+		} else {
+			list_for(s->state()).push(s);
+		}
 	}
 
-	void free(void *ptr)
+	virtual stats get_stats() const override
 	{
-		if (!try_free(ptr)) {
-			panic("object not in cache\n");
-		}
+		u64 slabs = full_.count + partial_.count + empty_.count;
+		return { slabs, slab_memory_size, nr_objects_, slabs * (slab_object_capacity - slab::reserved_objects) };
 	}
 
 private:
-	slab *slabs_;
+	slab_list full_, partial_, empty_;
+	u64 nr_objects_;
 
-	void *allocate_slab();
+	slab_list &list_for(slab_state state)
+	{
+		switch (state) {
+		case slab_state::full:
+			return full_;
+		case slab_state::partial:
+			return partial_;
+		default:
+			return empty_;
+		}
+	}
 };
+
+template <size_t object_size, int slab_page_order>
+const size_t slab_cache<object_size, slab_page_order>::slab::header_size = sizeof(typename slab_cache<object_size, slab_page_order>::slab);
+
+template <size_t object_size, int slab_page_order>
+const size_t slab_cache<object_size, slab_page_order>::slab::reserved_objects = (header_size + (object_size - 1)) / object_size;
 } // namespace stacsos::kernel::mem
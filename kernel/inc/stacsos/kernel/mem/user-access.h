@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/mem/address-space-region.h>
+
+namespace stacsos::kernel::mem {
+/**
+ * @brief Reaches into the memory of the current thread's process, on its behalf.
+ *
+ * A range is checked against the process's regions once, as a whole, before it is used.  The copies themselves are
+ * string moves, and if one faults anyway (say because another thread unmapped the memory in the meantime), the fault
+ * is fixed up by the exception table, and the copy fails, rather than taking the thread down.
+ */
+class user_access {
+public:
+	// The first address past the user half of the address space.
+	static const u64 user_limit = 0x0000'8000'0000'0000ull;
+
+	/**
+	 * @brief Whether the range lies in memory the process may access in the given way.  An empty range always does.
+	 */
+	static bool range_ok(const void *user_ptr, size_t size, region_flags access);
+
+	static bool readable(const void *user_ptr, size_t size) { return range_ok(user_ptr, size, region_flags::readable); }
+	static bool writable(const void *user_ptr, size_t size) { return range_ok(user_ptr, size, region_flags::writable); }
+
+	/**
+	 * @brief Checks the source range, and copies it into a kernel buffer.
+	 */
+	static bool copy_from_user(void *dest, const void *user_src, size_t size);
+
+	/**
+	 * @brief Checks the destination range, and copies a kernel buffer into it.
+	 */
+	static bool copy_to_user(void *user_dest, const void *src, size_t size);
+
+	/**
+	 * @brief Copies to or from a range that has already been checked, for callers that check a whole buffer once and
+	 * then fill it in a piece at a time.  Only a fault is caught.
+	 */
+	static bool copy_checked(void *dest, const void *src, size_t size);
+
+	/**
+	 * @brief Copies a null-terminated string of at most size - 1 characters from the process, returning its length,
+	 * or -1 if it is too long or can't be read.
+	 */
+	static s64 copy_string_from_user(char *dest, const char *user_src, size_t size);
+};
+} // namespace stacsos::kernel::mem
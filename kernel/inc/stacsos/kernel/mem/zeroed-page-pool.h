@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/list.h>
+
+namespace stacsos::kernel::mem {
+class page;
+
+/**
+ * @brief A per-core supply of single pages that have already been cleared by the idle thread, for the allocations
+ * that need a zeroed page -- such as page tables, stacks and single-page regions -- so that the clearing is usually
+ * done while the core has nothing better to do, rather than on the allocating path.  Movable pages (for user memory)
+ * are pooled apart from the rest.
+ */
+class zeroed_page_pool {
+	DEFINE_SINGLETON(zeroed_page_pool)
+
+public:
+	static const unsigned int max_pages = 32;
+
+	struct stats {
+		u64 hits, misses, refills;
+	};
+
+	/**
+	 * @brief Returns a zeroed page, from this core's pool if there is one, or else straight from the page allocator,
+	 * cleared on the spot.
+	 *
+	 * @param flags page_allocation_flags::movable, if the page will only be mapped into user memory.
+	 */
+	page *allocate(page_allocation_flags flags = page_allocation_flags::none);
+
+	/**
+	 * @brief Clears a page and adds it to this core's pool, returning false if the pool is already full.
+	 */
+	bool refill_one();
+
+	stats get_stats(int core_id) const { return pools_[core_id].counters; }
+
+	void dump() const;
+
+private:
+	zeroed_page_pool()
+	{
+		for (auto &pool : pools_) {
+			pool.counters = {};
+		}
+	}
+
+	// One list for unmovable pages, and one for movable.
+	struct per_core_pool {
+		spinlock_irq lock;
+		list<page *> pages[2];
+		stats counters;
+	};
+
+	arch::percpu<per_core_pool> pools_;
+};
+} // namespace stacsos::kernel::mem
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/io-ring.h>
+#include <stacsos/kernel/obj/object.h>
+#include <stacsos/kernel/sched/mutex.h>
+
+namespace stacsos::kernel::obj {
+/**
+ * @brief A pair of submission and completion queues, shared with a process, through which it can ask for many object
+ * operations with one system call.  In polled mode, a helper thread in the process picks up submissions as they
+ * arrive, and only needs a system call to wake it once it has gone idle.  In async mode, submissions are carried out
+ * by a few worker threads in the process, so that a single thread can keep several reads waiting for the disk.
+ */
+class io_ring_object : public object {
+public:
+	io_ring_object(u64 id, sched::process &owner, io_ring_header *ring, u32 entries, io_ring_flags flags);
+	virtual ~io_ring_object();
+
+	/**
+	 * @brief Carries out every queued submission, or wakes the polling thread, and then waits until at least
+	 * min_complete completions are waiting to be collected.  Returns the number of submissions carried out.
+	 */
+	virtual operation_result enter(u64 min_complete) override;
+
+	/**
+	 * @brief A ring is ready when there are completions waiting to be collected.
+	 */
+	virtual bool poll(sched::wait_set *ws) override;
+
+private:
+	sched::process &owner_;
+	io_ring_header *ring_;
+	io_ring_sqe *sqes_;
+	io_ring_cqe *cqes_;
+
+	// The kernel's own copies of the ring's size, and of the counters it owns, since the process can scribble over
+	// the shared ones.
+	u32 entries_;
+	u32 sq_head_;
+	u32 cq_tail_;
+
+	sched::mutex submit_lock_;
+
+	shared_ptr<sched::thread> poller_;
+	bool stopping_;
+	bool wakeup_;
+	sched::wait_queue poller_wait_;
+	sched::wait_queue completions_;
+
+	static const unsigned int nr_async_workers = 4;
+
+	// Submissions waiting for a worker, in a queue as long as the ring, as no more than that can be outstanding.
+	// The queue and in_flight_ (taken but not yet completed) are only changed with the worker queue's lock held.
+	bool async_;
+	io_ring_sqe *dispatched_;
+	u32 dispatch_head_;
+	u32 dispatch_tail_;
+	u32 in_flight_;
+	shared_ptr<sched::thread> workers_[nr_async_workers];
+	sched::wait_queue worker_wait_;
+	sched::mutex complete_lock_;
+
+	u64 submit();
+	io_ring_cqe execute(const io_ring_sqe &sqe);
+	void complete(const io_ring_cqe &cqe);
+	u32 pending_completions() const;
+	void stop_helper(shared_ptr<sched::thread> &helper, sched::wait_queue &wq);
+
+	static void poller_thread_proc(void *arg);
+	void poll();
+
+	static void worker_thread_proc(void *arg);
+	void work();
+};
+} // namespace stacsos::kernel::obj
@@ -7,74 +7,167 @@
  */
 #pragma once
 
-#include <stacsos/atomic.h>
+#include <stacsos/kernel/obj/io-ring.h>
 #include <stacsos/kernel/obj/object.h>
-#include <stacsos/map.h>
-
-namespace stacsos::kernel::sched {
-class process;
-} // namespace stacsos::kernel::sched
+#include <stacsos/kernel/obj/pipe.h>
+#include <stacsos/kernel/obj/timer.h>
+#include <stacsos/kernel/sched/process.h>
 
 namespace stacsos::kernel::obj {
+/**
+ * @brief Creates the objects that processes refer to by handle, and finds them again.  Each process keeps its own
+ * handles, in its object table.  Every open handle is charged to its process's account, so creating an object fails
+ * (returning null) once the process, or its group, has reached its handle limit.
+ */
 class object_manager {
 	DEFINE_SINGLETON(object_manager);
 
 private:
-	object_manager()
-		: next_id_(1)
+	object_manager() { }
+
+public:
+	shared_ptr<object> get_object(sched::process &owner, u64 id) { return owner.objects().get(id); }
+
+	void free_object(sched::process &owner, u64 id)
 	{
+		if (owner.objects().free(id)) {
+			owner.account().uncharge(resource_type::handles, 1);
+		}
 	}
 
-public:
-	shared_ptr<object> get_object(sched::process &owner, u64 id)
+	/**
+	 * @brief Drops every object belonging to a process that has terminated.
+	 */
+	void free_objects(sched::process &owner)
 	{
-		map<u64, shared_ptr<object>> *process_object_map;
-		if (!objects_.try_get_value(&owner, process_object_map)) {
+		owner.objects().clear();
+
+		// Nothing else charges handles to a process's own account, so what is left on it is what was just closed.
+		owner.account().uncharge(resource_type::handles, owner.account().usage(resource_type::handles));
+	}
+
+	shared_ptr<object> create_file_object(sched::process &owner, shared_ptr<fs::file> file, fs::fs_node *node)
+	{
+		u64 id = reserve(owner);
+		if (!id) {
 			return nullptr;
 		}
 
-		shared_ptr<object> optr;
-		if (!process_object_map->try_get_value(id, optr)) {
+		return install(owner, new file_object(id, file, node));
+	}
+
+	shared_ptr<object> create_directory_object(sched::process &owner, fs::fs_node *node)
+	{
+		u64 id = reserve(owner);
+		if (!id) {
 			return nullptr;
 		}
 
-		return optr;
+		return install(owner, new directory_object(id, node));
 	}
 
-	void free_object(sched::process &owner, u64 id) { }
+	shared_ptr<object> create_process_object(sched::process &owner, shared_ptr<sched::process> proc)
+	{
+		u64 id = reserve(owner);
+		if (!id) {
+			return nullptr;
+		}
 
-	shared_ptr<object> create_file_object(sched::process &owner, shared_ptr<fs::file> file)
+		return install(owner, new process_object(id, proc));
+	}
+
+	shared_ptr<object> create_thread_object(sched::process &owner, shared_ptr<sched::thread> thread)
 	{
-		return register_object(owner, new file_object(allocate_id(owner), file));
+		u64 id = reserve(owner);
+		if (!id) {
+			return nullptr;
+		}
+
+		return install(owner, new thread_object(id, thread));
 	}
 
-	shared_ptr<object> create_process_object(sched::process &owner, shared_ptr<sched::process> proc)
+	shared_ptr<object> create_io_ring_object(sched::process &owner, io_ring_header *ring, u32 entries, io_ring_flags flags)
+	{
+		u64 id = reserve(owner);
+		if (!id) {
+			return nullptr;
+		}
+
+		return install(owner, new io_ring_object(id, owner, ring, entries, flags));
+	}
+
+	shared_ptr<object> create_pipe_object(sched::process &owner, shared_ptr<pipe> p, bool write_end)
 	{
-		return register_object(owner, new process_object(allocate_id(owner), proc));
+		u64 id = reserve(owner);
+		if (!id) {
+			return nullptr;
+		}
+
+		return install(owner, new pipe_object(id, p, write_end));
 	}
 
-	shared_ptr<object> create_thread_object(sched::process &owner, shared_ptr<sched::thread> thread)
+	shared_ptr<object> create_timer_object(sched::process &owner, u64 deadline, u64 period)
 	{
-		return register_object(owner, new thread_object(allocate_id(owner), thread));
+		u64 id = reserve(owner);
+		if (!id) {
+			return nullptr;
+		}
+
+		return install(owner, new timer_object(id, deadline, period));
 	}
 
-private:
-	atomic_u64 next_id_;
-	map<sched::process *, map<u64, shared_ptr<object>> *> objects_;
+	/**
+	 * @brief Gives another process its own handle to the same thing as a shareable object.
+	 */
+	shared_ptr<object> duplicate_object(sched::process &new_owner, object &o)
+	{
+		u64 id = reserve(new_owner);
+		if (!id) {
+			return nullptr;
+		}
 
-	u64 allocate_id(sched::process &owner) { return next_id_++; }
+		return install(new_owner, o.clone(id));
+	}
 
-	shared_ptr<object> register_object(sched::process &owner, object *o)
+	/**
+	 * @brief Gives a process that has just been forked its own handle to each shareable object of the process it was
+	 * forked from, under the same handle.  The objects that can't be shared are left out.
+	 *
+	 * @return bool false if the new process ran out of handles.
+	 */
+	bool copy_objects(sched::process &from, sched::process &to)
 	{
-		map<u64, shared_ptr<object>> *process_object_map;
-		if (!objects_.try_get_value(&owner, process_object_map)) {
-			process_object_map = new map<u64, shared_ptr<object>>();
-			objects_.add(&owner, process_object_map);
+		for (auto &o : from.objects().snapshot()) {
+			if (!o->shareable()) {
+				continue;
+			}
+
+			if (!to.account().charge(resource_type::handles, 1)) {
+				return false;
+			}
+
+			to.objects().reserve_at(o->id());
+			install(to, o->clone(o->id()));
 		}
 
+		return true;
+	}
+
+private:
+	u64 reserve(sched::process &owner)
+	{
+		if (!owner.account().charge(resource_type::handles, 1)) {
+			return 0;
+		}
+
+		return owner.objects().reserve();
+	}
+
+	shared_ptr<object> install(sched::process &owner, object *o)
+	{
 		auto object_ptr = shared_ptr(o);
 
-		process_object_map->add(o->id(), object_ptr);
+		owner.objects().install(o->id(), object_ptr);
 		return object_ptr;
 	}
 };
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/rcu.h>
+#include <stacsos/list.h>
+#include <stacsos/memory.h>
+
+namespace stacsos::kernel::obj {
+class object;
+
+/**
+ * @brief A process's open objects, in a dense array indexed by handle, so that finding the object for a syscall is a
+ * bounds check and an index.  Handles are small integers, starting at one.  The free slots are kept in a list
+ * threaded through the array, so the most recently closed handle is the next to be reused.
+ *
+ * Every syscall on a handle looks it up, so lookups take no lock.  The array is published with RCU, and each slot
+ * publishes a plain pointer to its object alongside the reference the table holds.  A lookup takes its own reference
+ * to whatever it finds, unless the object is already being destroyed, and an array that has been grown out of is only
+ * freed after a grace period.  Changes to the table are still made under its lock.
+ */
+class object_table {
+	DELETE_DEFAULT_COPY_AND_MOVE(object_table)
+
+public:
+	object_table()
+		: slots_(nullptr)
+		, free_head_(no_slot)
+	{
+	}
+
+	~object_table();
+
+	/**
+	 * @brief Returns the object with the given handle, or null if the handle isn't open.
+	 */
+	shared_ptr<object> get(u64 handle);
+
+	/**
+	 * @brief Takes a free handle, for an object that is about to be created.  Looking it up returns null until the
+	 * object is installed.
+	 */
+	u64 reserve();
+
+	/**
+	 * @brief Takes a particular handle, as reserve does, so that a copy of another process's table can keep its
+	 * handles.
+	 *
+	 * @return bool false if the handle is already taken.
+	 */
+	bool reserve_at(u64 handle);
+
+	void install(u64 handle, shared_ptr<object> obj);
+
+	/**
+	 * @brief Returns a reference to every open object, so that they can be looked at without the table's lock held.
+	 */
+	list<shared_ptr<object>> snapshot();
+
+	/**
+	 * @brief Closes a handle, dropping the table's reference to its object, and freeing the handle for reuse.
+	 *
+	 * @return bool false if the handle wasn't open.
+	 */
+	bool free(u64 handle);
+
+	/**
+	 * @brief Closes every handle.
+	 */
+	void clear();
+
+private:
+	static const u64 no_slot = ~0ull;
+	static const u64 initial_capacity = 16;
+
+	struct slot {
+		shared_ptr<object> obj;
+
+		// What lookups see: the same object as obj, once it has been installed.
+		object *published;
+
+		// The next free slot, if this one is free, or no_slot if it is in use (or reserved).
+		u64 next_free;
+		bool free;
+	};
+
+	struct slot_array : sched::rcu_head {
+		u64 capacity;
+		slot *slots;
+	};
+
+	spinlock_irq lock_;
+	slot_array *slots_;
+	u64 free_head_;
+
+	void grow();
+
+	static void retire(slot_array *array);
+};
+} // namespace stacsos::kernel::obj
@@ -7,9 +7,14 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/fs-node.h>
 #include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/rcu.h>
+#include <stacsos/kernel/sched/scheduler.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/kernel/sched/wait-set.h>
 #include <stacsos/memory.h>
 
 namespace stacsos::kernel::obj {
@@ -21,21 +26,73 @@ struct operation_result {
 
 	static operation_result ok(u64 data = 0) { return operation_result { operation_result_code::ok, data }; }
 	static operation_result not_supported() { return operation_result { operation_result_code::not_supported, 0 }; }
+
+	syscall_result_code syscall_code() const
+	{
+		// The two sets of codes don't share values, so they must be translated rather than cast.
+		switch (code) {
+		case operation_result_code::ok:
+			return syscall_result_code::ok;
+		case operation_result_code::not_found:
+			return syscall_result_code::not_found;
+		default:
+			return syscall_result_code::not_supported;
+		}
+	}
 };
 
-class object {
+/**
+ * @brief Something a process has a handle to.  Handles are looked up without taking a lock (see object_table), so
+ * although an object is destroyed as soon as its last reference goes, its memory is only freed after an RCU grace
+ * period, as a lookup may still be looking at its reference count.
+ */
+class object : public ref_counted<object>, public sched::rcu_head {
 public:
 	virtual ~object() { }
 
+	static void operator delete(void *ptr);
+
 	u64 id() const { return id_; }
 
 	virtual operation_result read(void *buffer, size_t length) { return operation_result::not_supported(); }
 	virtual operation_result pread(void *buffer, size_t length, size_t offset) { return operation_result::not_supported(); }
 	virtual operation_result write(const void *buffer, size_t length) { return operation_result::not_supported(); }
 	virtual operation_result pwrite(const void *buffer, size_t length, size_t offset) { return operation_result::not_supported(); }
+	virtual operation_result readv(const iovec *iov, size_t count) { return operation_result::not_supported(); }
+	virtual operation_result preadv(const iovec *iov, size_t count, size_t offset) { return operation_result::not_supported(); }
+	virtual operation_result writev(const iovec *iov, size_t count) { return operation_result::not_supported(); }
+	virtual operation_result pwritev(const iovec *iov, size_t count, size_t offset) { return operation_result::not_supported(); }
 	virtual operation_result ioctl(u64 cmd, void *buffer, size_t length) { return operation_result::not_supported(); }
 	virtual operation_result wait_for_status_change() { return operation_result::not_supported(); }
 	virtual operation_result join() { return operation_result::not_supported(); }
+	virtual operation_result set_affinity(u64 mask) { return operation_result::not_supported(); }
+	virtual operation_result set_priority(sched_policy policy, int priority) { return operation_result::not_supported(); }
+	virtual operation_result set_reservation(u64 runtime_us, u64 period_us) { return operation_result::not_supported(); }
+	virtual operation_result mmap(u64 offset, u64 length, mmap_flags flags) { return operation_result::not_supported(); }
+	virtual operation_result fsync() { return operation_result::not_supported(); }
+	virtual operation_result truncate(u64 size) { return operation_result::not_supported(); }
+	virtual operation_result advise(u64 offset, u64 length, access_advice advice) { return operation_result::not_supported(); }
+	virtual operation_result size() { return operation_result::not_supported(); }
+	virtual operation_result readdir(void *buffer, size_t length) { return operation_result::not_supported(); }
+	virtual operation_result enter(u64 min_complete) { return operation_result::not_supported(); }
+
+	/**
+	 * @brief Whether the object is ready: for a file, that a read won't block, and for a process or thread, that it
+	 * has finished.  If ws is given, the queues that are woken when that may change are added to it, so a thread can
+	 * wait for any of several objects to become ready.  An object that never blocks is always ready.
+	 */
+	virtual bool poll(sched::wait_set *ws) { return true; }
+
+	/**
+	 * @brief Whether another process can be given its own handle to the object, as one of its streams.
+	 */
+	virtual bool shareable() const { return false; }
+
+	/**
+	 * @brief Makes a new object, with the given id, that refers to the same thing as this one.  Only called if the
+	 * object is shareable.
+	 */
+	virtual object *clone(u64 id) { return nullptr; }
 
 protected:
 	object(u64 id)
@@ -49,20 +106,91 @@ private:
 
 class file_object : public object {
 public:
-	file_object(u64 id, shared_ptr<fs::file> file)
+	file_object(u64 id, shared_ptr<fs::file> file, fs::fs_node *node)
 		: object(id)
 		, file_(file)
+		, node_(node)
 	{
+		if (node_) {
+			node_->acquire();
+		}
+	}
+
+	virtual ~file_object()
+	{
+		if (node_) {
+			node_->release();
+		}
 	}
 
 	virtual operation_result read(void *buffer, size_t length) { return operation_result::ok(file_->read(buffer, length)); }
 	virtual operation_result pread(void *buffer, size_t length, size_t offset) { return operation_result::ok(file_->pread(buffer, offset, length)); }
 	virtual operation_result write(const void *buffer, size_t length) { return operation_result::ok(file_->write(buffer, length)); }
 	virtual operation_result pwrite(const void *buffer, size_t length, size_t offset) { return operation_result::ok(file_->pwrite(buffer, offset, length)); }
+	virtual operation_result readv(const iovec *iov, size_t count) override { return operation_result::ok(file_->readv(iov, count)); }
+	virtual operation_result preadv(const iovec *iov, size_t count, size_t offset) override { return operation_result::ok(file_->preadv(iov, count, offset)); }
+	virtual operation_result writev(const iovec *iov, size_t count) override { return operation_result::ok(file_->writev(iov, count)); }
+	virtual operation_result pwritev(const iovec *iov, size_t count, size_t offset) override { return operation_result::ok(file_->pwritev(iov, count, offset)); }
 	virtual operation_result ioctl(u64 cmd, void *buffer, size_t length) { return operation_result::ok(file_->ioctl(cmd, buffer, length)); }
+	virtual operation_result fsync() override { return file_->sync() ? operation_result::ok() : operation_result::not_supported(); }
+	virtual operation_result truncate(u64 size) override { return file_->truncate(size) ? operation_result::ok() : operation_result::not_supported(); }
+	virtual operation_result advise(u64 offset, u64 length, access_advice advice) override;
+	virtual operation_result size() override { return operation_result::ok(file_->size()); }
+	virtual bool poll(sched::wait_set *ws) override { return file_->poll(ws); }
+
+	// A clone shares the open file, and so its position, in the same way that a process's streams do on Unix.
+	virtual bool shareable() const override { return true; }
+	virtual object *clone(u64 id) override { return new file_object(id, file_, node_); }
+
+	virtual operation_result mmap(u64 offset, u64 length, mmap_flags flags) override
+	{
+		// Only files that live in a file system can go through the page cache, and otherwise the file has to keep its
+		// own pages, as shared memory does, or be a window onto device memory, as a virtual console is.  Those are
+		// mapped directly even if they were opened through a node (as devices are, in devfs, and files are, in tmpfs),
+		// as they have nothing in the page cache.
+		bool direct = file_->has_own_pages() || file_->device_frame(offset >> PAGE_BITS);
+		if ((!node_ && !direct) || !length || (offset & ~PAGE_MASK)) {
+			return operation_result::not_supported();
+		}
+
+		mem::region_flags rflags = mem::region_flags::readable;
+		if ((flags & mmap_flags::writable) == mmap_flags::writable) {
+			rflags |= mem::region_flags::writable;
+		}
+
+		auto rgn = sched::thread::current().owner().addrspace().map_file(
+			file_, direct ? nullptr : node_, offset, length, rflags, (flags & mmap_flags::shared) == mmap_flags::shared);
+
+		return operation_result::ok(rgn->base);
+	}
 
 private:
 	shared_ptr<fs::file> file_;
+	fs::fs_node *node_;
+};
+
+/**
+ * @brief An open directory.  Each readdir carries on listing it from where the last one stopped.
+ */
+class directory_object : public object {
+public:
+	directory_object(u64 id, fs::fs_node *node)
+		: object(id)
+		, node_(node)
+		, cursor_(0)
+	{
+		node_->acquire();
+	}
+
+	virtual ~directory_object() { node_->release(); }
+
+	virtual operation_result readdir(void *buffer, size_t length) override;
+
+private:
+	fs::fs_node *node_;
+
+	// The index of the next child to be listed.
+	u64 cursor_;
 };
 
 class process_object : public object {
@@ -76,14 +204,22 @@ public:
 	virtual operation_result wait_for_status_change() override
 	{
 		sched::process_state initial = proc_->state();
+		proc_->state_changed().wait_until([&] { return proc_->state() != initial; });
+
+		return operation_result::ok(0);
+	}
 
-		while (proc_->state() == initial) {
-			proc_->state_changed_event().wait();
+	virtual bool poll(sched::wait_set *ws) override
+	{
+		if (ws) {
+			ws->add(proc_->state_changed());
 		}
 
-		return operation_result::ok(0);
+		return proc_->state() == sched::process_state::terminated;
 	}
 
+	virtual operation_result ioctl(u64 cmd, void *buffer, size_t length) override;
+
 private:
 	shared_ptr<sched::process> proc_;
 };
@@ -98,8 +234,47 @@ public:
 
 	virtual operation_result join() override
 	{
-		while (thread_->state() != sched::thread_states::terminated) {
-			thread_->state_changed_event().wait();
+		thread_->state_changed().wait_until([this] { return thread_->state() == sched::thread_states::terminated; });
+
+		return operation_result::ok(0);
+	}
+
+	virtual bool poll(sched::wait_set *ws) override
+	{
+		if (ws) {
+			ws->add(thread_->state_changed());
+		}
+
+		return thread_->state() == sched::thread_states::terminated;
+	}
+
+	virtual operation_result set_affinity(u64 mask) override
+	{
+		if (!sched::scheduler::get().set_affinity(*thread_, mask)) {
+			return operation_result::not_supported();
+		}
+
+		// A thread pinning itself away from this core should move straight away.
+		if (thread_.get() == &sched::thread::current() && !sched::can_run_on(*thread_->get_tcb(), arch::core::this_core_id())) {
+			arch::core::this_core().reschedule();
+		}
+
+		return operation_result::ok(0);
+	}
+
+	virtual operation_result set_priority(sched_policy policy, int priority) override
+	{
+		if (!sched::scheduler::get().set_priority(*thread_, policy, priority)) {
+			return operation_result::not_supported();
+		}
+
+		return operation_result::ok(0);
+	}
+
+	virtual operation_result set_reservation(u64 runtime_us, u64 period_us) override
+	{
+		if (!sched::scheduler::get().set_reservation(*thread_, runtime_us, period_us)) {
+			return operation_result::not_supported();
 		}
 
 		return operation_result::ok(0);
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/obj/object.h>
+#include <stacsos/kernel/sched/mutex.h>
+
+namespace stacsos::kernel::mem {
+class page;
+}
+
+namespace stacsos::kernel::obj {
+/**
+ * @brief A one-way stream of bytes between processes, through a page-sized ring.
+ *
+ * Readers are serialised by one mutex, and writers by another, so the ring itself only ever has a single producer
+ * and a single consumer, and the two sides hand data over through the head and tail counters alone.  The wait queues
+ * are only for blocking when the ring is empty or full, and for noticing when the other side has gone.
+ */
+class pipe {
+	DELETE_DEFAULT_COPY_AND_MOVE(pipe)
+
+public:
+	static const size_t capacity = PAGE_SIZE;
+
+	pipe();
+	~pipe();
+
+	/**
+	 * @brief Reads whatever is in the ring, up to length bytes, waiting until there is something.  Returns zero once
+	 * the ring is empty and every write end has been closed.
+	 */
+	size_t read(void *buffer, size_t length);
+
+	/**
+	 * @brief Writes the whole buffer, waiting for room as the reader drains the ring.  The write is cut short if
+	 * every read end is closed, as nothing would ever read the rest.
+	 */
+	size_t write(const void *buffer, size_t length);
+
+	bool poll_readable(sched::wait_set *ws);
+	bool poll_writable(sched::wait_set *ws);
+
+	void open_end(bool write_end);
+	void close_end(bool write_end);
+
+private:
+	mem::page *page_;
+	u8 *buffer_;
+
+	// Free-running counts of the bytes read and written.  The ring holds tail_ - head_ bytes, at their counts modulo
+	// the capacity.  Only the reader moves head_, and only the writer moves tail_.
+	u64 head_;
+	u64 tail_;
+
+	u32 readers_;
+	u32 writers_;
+
+	sched::mutex read_lock_;
+	sched::mutex write_lock_;
+
+	// Woken when there is something new to read (or no writers left), and when there is more room (or no readers).
+	sched::wait_queue readable_;
+	sched::wait_queue writable_;
+
+	u64 load_head() const { return __atomic_load_n(&head_, __ATOMIC_ACQUIRE); }
+	u64 load_tail() const { return __atomic_load_n(&tail_, __ATOMIC_ACQUIRE); }
+	u32 load_readers() const { return __atomic_load_n(&readers_, __ATOMIC_ACQUIRE); }
+	u32 load_writers() const { return __atomic_load_n(&writers_, __ATOMIC_ACQUIRE); }
+};
+
+/**
+ * @brief One end of a pipe.  Each process holding an end has its own object, so the pipe only sees that an end has
+ * closed once every process has closed it.
+ */
+class pipe_object : public object {
+public:
+	pipe_object(u64 id, shared_ptr<pipe> p, bool write_end)
+		: object(id)
+		, pipe_(p)
+		, write_end_(write_end)
+	{
+		pipe_->open_end(write_end_);
+	}
+
+	virtual ~pipe_object() { pipe_->close_end(write_end_); }
+
+	virtual operation_result read(void *buffer, size_t length) override
+	{
+		return write_end_ ? operation_result::not_supported() : operation_result::ok(pipe_->read(buffer, length));
+	}
+
+	virtual operation_result write(const void *buffer, size_t length) override
+	{
+		return write_end_ ? operation_result::ok(pipe_->write(buffer, length)) : operation_result::not_supported();
+	}
+
+	virtual operation_result writev(const iovec *iov, size_t count) override
+	{
+		if (!write_end_) {
+			return operation_result::not_supported();
+		}
+
+		size_t total = 0;
+		for (size_t i = 0; i < count; i++) {
+			size_t n = pipe_->write(iov[i].base, iov[i].length);
+			total += n;
+
+			if (n < iov[i].length) {
+				break;
+			}
+		}
+
+		return operation_result::ok(total);
+	}
+
+	virtual bool poll(sched::wait_set *ws) override { return write_end_ ? pipe_->poll_writable(ws) : pipe_->poll_readable(ws); }
+
+	virtual bool shareable() const override { return true; }
+	virtual object *clone(u64 id) override { return new pipe_object(id, pipe_, write_end_); }
+
+private:
+	shared_ptr<pipe> pipe_;
+	bool write_end_;
+};
+} // namespace stacsos::kernel::obj
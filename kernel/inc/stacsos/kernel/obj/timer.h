@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/obj/object.h>
+#include <stacsos/kernel/sched/timer-queue.h>
+#include <stacsos/kernel/sched/wait-queue.h>
+
+namespace stacsos::kernel::obj {
+/**
+ * @brief A timer that expires at a deadline, and then, if it has a period, at every period after it.  Each deadline
+ * is the last one plus the period, rather than the time the timer fired plus the period, so a periodic timer never
+ * drifts, however late it is handled.
+ *
+ * Reading the timer waits until it has expired, and gives the number of times it has expired since it was last read,
+ * as a u64, so that a reader that falls behind can tell how many periods it missed.  It is ready, for wait_many, once
+ * it has expired.
+ */
+class timer_object : public object {
+public:
+	timer_object(u64 id, u64 deadline, u64 period);
+	virtual ~timer_object();
+
+	virtual operation_result read(void *buffer, size_t length) override;
+	virtual bool poll(sched::wait_set *ws) override;
+
+private:
+	sched::timer_event event_;
+	u64 period_;
+
+	// The expirations that haven't been read yet, which are protected by the queue's lock, as are stopping_ and the
+	// re-arming of the event.
+	u64 expirations_;
+	bool stopping_;
+	sched::wait_queue expired_;
+
+	// How many times the event has been armed, and how many of its callbacks have finished with the object.  Each arming
+	// that isn't cancelled runs the callback once, so the object can go once the two agree.
+	u64 armed_;
+	u64 completed_;
+
+	static void fired(void *arg);
+};
+} // namespace stacsos::kernel::obj
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/arch/x86/machine-context.h>
+
+namespace stacsos::kernel {
+enum class profile_source { none, pmu, tick };
+
+struct profile_sample {
+	static const unsigned int max_depth = 16;
+
+	u64 rip;
+	u64 thread_id;
+	u32 core;
+	bool user;
+	u8 depth;
+
+	// The return addresses of the kernel frames the sample was taken in, innermost first.
+	u64 stack[max_depth];
+};
+
+/**
+ * @brief A sampling profiler.  Each sample is the instruction pointer the core was interrupted at, the thread it was
+ * running, and (in the kernel) the chain of return addresses found by following the frame pointers, which are never
+ * omitted.  Samples go into a ring buffer per core, which is only written by its own core, so taking a sample takes no
+ * locks.  Readers take an unsynchronised snapshot, which may include a few samples that are being overwritten.
+ *
+ * If the core has an architectural PMU, samples are taken from an NMI raised every so many core cycles, so code that
+ * runs with interrupts disabled is sampled too.  Otherwise they are taken on the timer tick, which can't see it.
+ */
+class profiler {
+	DEFINE_SINGLETON(profiler)
+
+private:
+	profiler()
+		: source_(profile_source::none)
+		, frequency_(0)
+		, unclaimed_nmis_(0)
+	{
+		for (auto &c : cores_) {
+			c.samples = nullptr;
+			c.head = 0;
+		}
+	}
+
+public:
+	static const unsigned int samples_per_core = 4096;
+
+	/**
+	 * @brief Throws away any samples already taken, and starts sampling every online core, roughly frequency times a
+	 * second.
+	 */
+	void start(u64 frequency);
+
+	/**
+	 * @brief Stops sampling, keeping the samples that have been taken.
+	 */
+	void stop();
+
+	/**
+	 * @brief Called on every NMI, which may have been raised by the PMU to take a sample.  Anything else is counted,
+	 * and otherwise ignored.
+	 */
+	void handle_nmi(const arch::x86::machine_context &mc);
+
+	/**
+	 * @brief Called on every timer tick, with the context the tick interrupted.
+	 */
+	void tick(const arch::x86::machine_context &mc)
+	{
+		if (__atomic_load_n(&source_, __ATOMIC_RELAXED) == profile_source::tick) {
+			sample(mc);
+		}
+	}
+
+	/**
+	 * @brief Renders the samples of every core as text, one per line.  Returns the number of characters written.
+	 */
+	size_t render(char *buffer, size_t size);
+
+	/**
+	 * @brief Returns a buffer size that is large enough for render(), unless more samples are taken in between.
+	 */
+	size_t render_size_hint();
+
+private:
+	struct per_core_profile {
+		profile_sample *samples;
+		u64 head;
+	};
+
+	profile_source source_;
+	u64 frequency_;
+	u64 unclaimed_nmis_;
+
+	arch::percpu<per_core_profile> cores_;
+
+	void sample(const arch::x86::machine_context &mc);
+
+	static void start_core(void *arg);
+	static void stop_core(void *arg);
+};
+} // namespace stacsos::kernel
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/rb-tree.h>
+
+namespace stacsos::kernel::sched::alg {
+
+class completely_fair_scheduler : public scheduling_algorithm {
+public:
+	completely_fair_scheduler()
+		: min_vruntime_(0)
+		, selected_(nullptr)
+		, selected_run_time_(0)
+	{
+	}
+
+	virtual void add_to_runqueue(tcb &tcb) override;
+	virtual void remove_from_runqueue(tcb &tcb) override;
+	virtual tcb *select_next_task(tcb *current) override;
+	virtual tcb *select_gang_task(tcb *current, const void *gang) override;
+	virtual unsigned int nr_runnable() const override { return runqueue_.count(); }
+	virtual tcb *steal_task(tcb *running, int dest_core, u64 hot_since) override;
+	virtual u64 default_quantum_ms() const override { return 10; }
+	virtual const char *name() const { return "completely fair"; }
+
+private:
+	struct vruntime_less {
+		bool operator()(const tcb &a, const tcb &b) const { return a.vruntime < b.vruntime; }
+	};
+
+	rb_tree<tcb, &tcb::run_node, vruntime_less> runqueue_;
+
+	// Monotonically increasing lower bound of the vruntime of tasks on this run queue.
+	u64 min_vruntime_;
+
+	// The task last returned by select_next_task, and its run time at that point, so that the
+	// time it has spent running can be charged to its vruntime.
+	tcb *selected_;
+	u64 selected_run_time_;
+
+	void charge_selected(tcb *current);
+	void update_min_vruntime();
+};
+} // namespace stacsos::kernel::sched::alg
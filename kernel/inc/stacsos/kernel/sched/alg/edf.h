@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/kernel/sched/timer-queue.h>
+#include <stacsos/intrusive-list.h>
+#include <stacsos/rb-tree.h>
+
+namespace stacsos::kernel::sched::alg {
+
+/**
+ * @brief Earliest deadline first scheduling for periodic tasks.  A task with a reservation of (runtime, period) is
+ * given a job of up to runtime every period, due by the end of that period, and the ready job with the earliest
+ * deadline always runs.  A job that has used up its runtime is throttled until its next period starts.  Tasks
+ * without a reservation are run round-robin in the time left over.
+ */
+class earliest_deadline_first : public scheduling_algorithm {
+public:
+	// The share of a core that may be reserved, in parts per million.  The remainder is kept back for tasks without a
+	// reservation, so that they are never starved completely.
+	static const u64 max_utilisation = 950000;
+
+	earliest_deadline_first()
+		: utilisation_(0)
+		, selected_(nullptr)
+		, selected_run_time_(0)
+		, timer_(0, timer_fired, nullptr)
+	{
+	}
+
+	virtual void add_to_runqueue(tcb &tcb) override;
+	virtual void remove_from_runqueue(tcb &tcb) override;
+	virtual tcb *select_next_task(tcb *current) override;
+	virtual unsigned int nr_runnable() const override { return ready_.count() + throttled_.count() + background_.count(); }
+	virtual tcb *steal_task(tcb *running, int dest_core, u64 hot_since) override;
+	virtual u64 default_quantum_ms() const override { return 10; }
+	virtual const char *name() const { return "earliest deadline first"; }
+	virtual bool set_reservation(tcb &tcb, u64 runtime, u64 period) override;
+	virtual bool should_preempt(const tcb &running, const tcb &woken) const override;
+
+private:
+	struct deadline_less {
+		bool operator()(const tcb &a, const tcb &b) const { return a.edf_deadline < b.edf_deadline; }
+	};
+
+	static bool is_periodic(const tcb &tcb) { return tcb.edf_period != 0; }
+	static u64 utilisation_of(const tcb &tcb) { return tcb.edf_period ? (tcb.edf_runtime * 1000000) / tcb.edf_period : 0; }
+	static void timer_fired(void *arg);
+
+	void release_jobs(u64 now);
+	void arm_timer(u64 now);
+
+	// Periodic tasks with a job ready to run, ordered by deadline.
+	rb_tree<tcb, &tcb::run_node, deadline_less> ready_;
+
+	// Periodic tasks that have used up the runtime of their current job, waiting for the next period.
+	intrusive_list<tcb, &tcb::run_link> throttled_;
+
+	// Tasks without a reservation.
+	intrusive_list<tcb, &tcb::run_link> background_;
+
+	// The total utilisation of the periodic tasks owned by this core, in parts per million.
+	u64 utilisation_;
+
+	// The task last returned by select_next_task, and its run time at that point, so that a periodic task can be
+	// charged for the time it has used of its job.
+	tcb *selected_;
+	u64 selected_run_time_;
+
+	// Fires at the next job release, or when the selected job runs out of runtime, whichever is sooner.
+	timer_event timer_;
+};
+} // namespace stacsos::kernel::sched::alg
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/rb-tree.h>
+
+namespace stacsos::kernel::sched::alg {
+
+/**
+ * @brief Layers a strict real-time FIFO class over a fair scheduling algorithm.  Runnable FIFO tasks are always
+ * selected before any fair task, highest priority first, and in arrival order within a priority.  A FIFO task is
+ * not descheduled at the end of its time slice, only when it blocks or a higher priority task arrives.
+ */
+class priority_class_scheduler : public scheduling_algorithm {
+public:
+	priority_class_scheduler(scheduling_algorithm *fair)
+		: fair_(fair)
+	{
+	}
+
+	virtual void add_to_runqueue(tcb &tcb) override;
+	virtual void remove_from_runqueue(tcb &tcb) override;
+	virtual tcb *select_next_task(tcb *current) override;
+	virtual tcb *select_gang_task(tcb *current, const void *gang) override;
+	virtual unsigned int nr_runnable() const override { return fifo_runqueue_.count() + fair_->nr_runnable(); }
+	virtual tcb *steal_task(tcb *running, int dest_core, u64 hot_since) override;
+	virtual u64 default_quantum_ms() const override { return fair_->default_quantum_ms(); }
+	virtual const char *name() const { return fair_->name(); }
+	virtual void set_priority(tcb &tcb, sched_policy policy, int priority) override;
+	virtual bool set_reservation(tcb &tcb, u64 runtime, u64 period) override;
+	virtual bool should_preempt(const tcb &running, const tcb &woken) const override;
+
+private:
+	struct priority_greater {
+		bool operator()(const tcb &a, const tcb &b) const { return a.rt_priority > b.rt_priority; }
+	};
+
+	scheduling_algorithm *fair_;
+	rb_tree<tcb, &tcb::run_node, priority_greater> fifo_runqueue_;
+};
+} // namespace stacsos::kernel::sched::alg
@@ -19,6 +19,9 @@ public:
 	virtual void add_to_runqueue(tcb &tcb) override;
 	virtual void remove_from_runqueue(tcb &tcb) override;
 	virtual tcb *select_next_task(tcb *current) override;
+	virtual unsigned int nr_runnable() const override;
+	virtual tcb *steal_task(tcb *running, int dest_core, u64 hot_since) override;
+	virtual u64 default_quantum_ms() const override { return 50; }
 	virtual const char *name() const { return "round robin"; }
 };
 } // namespace stacsos::kernel::sched::alg
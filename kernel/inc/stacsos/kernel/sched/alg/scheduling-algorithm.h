@@ -7,6 +7,8 @@
  */
 #pragma once
 
+#include <stacsos/syscalls.h>
+
 namespace stacsos::kernel::sched {
 class tcb;
 }
@@ -17,6 +19,51 @@ public:
 	virtual void add_to_runqueue(tcb &tcb) = 0;
 	virtual void remove_from_runqueue(tcb &tcb) = 0;
 	virtual tcb *select_next_task(tcb *current) = 0;
+
+	/**
+	 * @brief Like select_next_task, but picks the task that would be run first out of those in the given gang, so
+	 * that a core can run it at the same time as the rest of the gang is running on other cores.  Returns null, and
+	 * leaves the choice to select_next_task, if none of the gang is on the run queue, or if the algorithm doesn't
+	 * support gang scheduling.
+	 */
+	virtual tcb *select_gang_task(tcb *current, const void *gang) { return nullptr; }
+
+	/**
+	 * @brief Returns the number of tasks on the run queue, which is used as the load of the core.
+	 */
+	virtual unsigned int nr_runnable() const = 0;
+
+	/**
+	 * @brief Removes a task from the run queue so that it can be migrated to another core.
+	 *
+	 * @param running The task currently running on the owning core, which must not be chosen.
+	 * @param dest_core The core the task is being moved to, which the task's affinity must allow.
+	 * @param hot_since Tasks that have run since this time are cache-hot (see is_cache_hot), and must not be chosen.
+	 * @return tcb* The task that was removed, or nullptr if there is nothing worth stealing.
+	 */
+	virtual tcb *steal_task(tcb *running, int dest_core, u64 hot_since) = 0;
+
+	/**
+	 * @brief Returns the length of the time slice given to a task, unless overridden with the "quantum" option.
+	 */
+	virtual u64 default_quantum_ms() const = 0;
 	virtual const char *name() const = 0;
+
+	/**
+	 * @brief Changes the scheduling class and priority of a task, which may currently be on the run queue.
+	 * Algorithms that don't keep tasks of different classes apart only need the fields updated.
+	 */
+	virtual void set_priority(tcb &tcb, sched_policy policy, int priority);
+
+	/**
+	 * @brief Gives a task a reservation of runtime out of every period (both in TSC cycles), or removes it if the
+	 * period is zero.  Returns false if the reservation can't be guaranteed, or if the algorithm has no notion of one.
+	 */
+	virtual bool set_reservation(tcb &tcb, u64 runtime, u64 period) { return false; }
+
+	/**
+	 * @brief Returns true if a task that has just become runnable should preempt the one that is running.
+	 */
+	virtual bool should_preempt(const tcb &running, const tcb &woken) const { return false; }
 };
 } // namespace stacsos::kernel::sched::alg
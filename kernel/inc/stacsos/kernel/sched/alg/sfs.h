@@ -8,18 +8,23 @@
 #pragma once
 
 #include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
-#include <stacsos/list.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/intrusive-list.h>
 
 namespace stacsos::kernel::sched::alg {
 
 class simple_fair_scheduler : public scheduling_algorithm {
 public:
-	virtual void add_to_runqueue(tcb &tcb) override { runqueue_.append(&tcb); }
-	virtual void remove_from_runqueue(tcb &tcb) override { runqueue_.remove(&tcb); }
+	virtual void add_to_runqueue(tcb &tcb) override { runqueue_.append(tcb); }
+	virtual void remove_from_runqueue(tcb &tcb) override { runqueue_.remove(tcb); }
 	virtual tcb *select_next_task(tcb *current) override;
+	virtual tcb *select_gang_task(tcb *current, const void *gang) override;
+	virtual unsigned int nr_runnable() const override { return runqueue_.count(); }
+	virtual tcb *steal_task(tcb *running, int dest_core, u64 hot_since) override;
+	virtual u64 default_quantum_ms() const override { return 10; }
 	virtual const char *name() const { return "simple fair"; }
 
 private:
-	list<tcb *> runqueue_;
+	intrusive_list<tcb, &tcb::run_link> runqueue_;
 };
 } // namespace stacsos::kernel::sched::alg
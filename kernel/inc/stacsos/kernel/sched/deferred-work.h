@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+
+namespace stacsos::kernel::sched {
+
+typedef void (*deferred_work_fn)(void *arg);
+
+/**
+ * @brief A piece of work to be done later by a core's idle thread.  The item must stay alive until it has run, so it
+ * is usually allocated by whoever queues it, and freed by its function.
+ */
+struct deferred_work_item {
+	deferred_work_item(deferred_work_fn fn, void *arg)
+		: fn(fn)
+		, arg(arg)
+		, next(nullptr)
+	{
+	}
+
+	deferred_work_fn fn;
+	void *arg;
+	deferred_work_item *next;
+};
+
+/**
+ * @brief Returns true if it did some work, or false if there was nothing for it to do.
+ */
+typedef bool (*idle_task_fn)();
+
+/**
+ * @brief Per-core queues of work that doesn't need doing straight away, which the idle thread gets through before it
+ * halts.  This keeps slow housekeeping off system call paths.  As well as queued work, there are idle tasks, which
+ * are polled for anything to do whenever a core's queue is empty.
+ */
+class deferred_work {
+	DEFINE_SINGLETON(deferred_work)
+
+public:
+	static const int max_idle_tasks = 8;
+
+	/**
+	 * @brief Queues work to be done by the calling core.
+	 */
+	void queue(deferred_work_item &item);
+
+	/**
+	 * @brief Queues work to be done by the given core.  It will be done the next time the core is idle, but the core
+	 * isn't woken up for it.
+	 */
+	void queue_on(int core_id, deferred_work_item &item);
+
+	void add_idle_task(idle_task_fn fn);
+
+	/**
+	 * @brief Does the calling core's queued work, or failing that, one step of an idle task.  Returns false if there
+	 * was nothing to do, in which case the core can halt.
+	 */
+	bool run_pending();
+
+private:
+	deferred_work()
+		: nr_idle_tasks_(0)
+	{
+		for (int i = 0; i < arch::core_manager::max_cores; i++) {
+			queues_[i] = nullptr;
+		}
+	}
+
+	// Most recently queued first.  Items are only ever removed all at once, by the owning core.
+	deferred_work_item *queues_[arch::core_manager::max_cores];
+
+	idle_task_fn idle_tasks_[max_idle_tasks];
+	int nr_idle_tasks_;
+};
+} // namespace stacsos::kernel::sched
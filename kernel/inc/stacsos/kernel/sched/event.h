@@ -7,11 +7,15 @@
  */
 #pragma once
 
-#include <stacsos/list.h>
+#include <stacsos/kernel/sched/wait-queue.h>
 
 namespace stacsos::kernel::sched {
 class thread;
 
+/**
+ * @brief An auto-reset event releases one waiter per trigger (staying signalled until a waiter arrives, if
+ * there are none), while a manual-reset event releases every current and future waiter.
+ */
 template <bool AUTO_RESET> class event {
 public:
 	event()
@@ -22,9 +26,14 @@ public:
 	void trigger();
 	void wait();
 
+	/**
+	 * @brief The queue that is woken when the event is triggered, for adding to a wait_set.
+	 */
+	wait_queue &waiters() { return waiters_; }
+
 private:
 	bool triggered_;
-	list<thread *> wait_list_;
+	wait_queue waiters_;
 };
 
 using auto_reset_event = event<true>;
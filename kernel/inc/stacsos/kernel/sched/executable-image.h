@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/mem/address-space-region.h>
+#include <stacsos/kernel/sched/mutex.h>
+#include <stacsos/list.h>
+#include <stacsos/hash-map.h>
+#include <stacsos/memory.h>
+#include <stacsos/process-start.h>
+
+namespace stacsos::kernel::fs {
+class fs_node;
+}
+
+namespace stacsos::kernel::mem {
+class address_space;
+class page;
+} // namespace stacsos::kernel::mem
+
+namespace stacsos::kernel::sched {
+/**
+ * @brief A loadable segment of a program, with the pages holding its file contents already read in.
+ */
+struct executable_segment {
+	u64 base;
+	u64 size;
+	mem::region_flags flags;
+
+	// One page for each page of the segment that has file contents, starting at its base.  Anything after them is
+	// zero-filled on demand.
+	u64 nr_pages;
+	mem::page **pages;
+};
+
+/**
+ * @brief A program binary that has been parsed and read in, ready to be mapped into any number of processes.
+ *
+ * Every page is marked as cached, and is mapped read-only into each process running the program, so the pages of
+ * writable segments are copied when they are first written to.  Pages holding nothing but file contents come from the
+ * page cache, and the rest (where a segment's zero-filled part starts, or where it isn't laid out in the file the
+ * same way as in memory) are built once, and kept with the image.
+ */
+class executable_image {
+	DELETE_DEFAULT_COPY_AND_MOVE(executable_image)
+
+public:
+	executable_image(u64 entry_point)
+		: entry_point_(entry_point)
+		, tls_({})
+	{
+	}
+
+	u64 entry_point() const { return entry_point_; }
+
+	/**
+	 * @brief The program's thread-local storage template, which each of its threads takes a copy of.
+	 */
+	const process_tls &tls() const { return tls_; }
+
+	/**
+	 * @brief Adds a region for each segment to the address space, and maps the segment's pages into it.
+	 *
+	 * @return bool false if a region couldn't be added, or a page couldn't be mapped.
+	 */
+	bool map_into(mem::address_space &as);
+
+	static shared_ptr<executable_image> load(fs::fs_node &node);
+
+private:
+	u64 entry_point_;
+	process_tls tls_;
+	list<executable_segment> segments_;
+};
+
+/**
+ * @brief Keeps the image of every program that has been started, so starting it again only has to map its pages.
+ *
+ * Like the page cache underneath it, nothing is evicted.
+ */
+class executable_cache {
+	DEFINE_SINGLETON(executable_cache)
+
+public:
+	/**
+	 * @brief Returns the image of the program in the given file, loading it first if it isn't cached yet.
+	 *
+	 * @return shared_ptr<executable_image> The image, or null if the file isn't a program that can be loaded.
+	 */
+	shared_ptr<executable_image> get_image(fs::fs_node &node);
+
+private:
+	executable_cache() { }
+
+	// Loading an image waits for the disk, so a mutex is used, which also stops two threads loading the same one.
+	mutex lock_;
+	hash_map<fs::fs_node *, shared_ptr<executable_image>> images_;
+};
+} // namespace stacsos::kernel::sched
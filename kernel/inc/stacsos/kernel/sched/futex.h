@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/pi-lock.h>
+#include <stacsos/list.h>
+#include <stacsos/syscalls.h>
+
+namespace stacsos::kernel::sched {
+class process;
+class thread;
+
+struct futex_bucket;
+
+struct futex_waiter {
+	u64 key;
+	thread *thr;
+	futex_bucket *bucket;
+	bool woken;
+	bool timed_out;
+	bool timer_done;
+};
+
+/**
+ * @brief The kernel's side of a priority-inheriting futex lock, which only exists while threads are waiting for it.
+ * The lock is handed over by writing the new owner's ID into the futex word.
+ */
+struct futex_pi_state : public pi_lock {
+	futex_pi_state(u64 key, volatile u32 *word)
+		: key(key)
+		, word(word)
+	{
+	}
+
+	u64 key;
+	volatile u32 *word;
+
+protected:
+	virtual void handed_over(thread *new_owner) override;
+};
+
+struct futex_bucket {
+	spinlock_irq lock;
+	list<futex_waiter *> waiters;
+	list<futex_pi_state *> pi_states;
+};
+
+/**
+ * @brief Kernel support for user-space synchronisation.  Threads block on a 32-bit word in user memory,
+ * keyed by the physical address behind it, so the same word is matched no matter which mapping is used.
+ */
+class futex_manager {
+	DEFINE_SINGLETON(futex_manager)
+
+private:
+	futex_manager() { }
+
+public:
+	/**
+	 * @brief Blocks the current thread if the word at addr still holds expected, until it is woken by
+	 * wake(), or, if timeout_ms is non-zero, until the timeout expires.
+	 */
+	syscall_result_code wait(process &owner, u64 addr, u32 expected, u64 timeout_ms);
+
+	/**
+	 * @brief Wakes up to count threads blocked on the word at addr, returning the number woken.
+	 */
+	syscall_result_code wake(process &owner, u64 addr, u32 count, u64 &woken);
+
+	/**
+	 * @brief Takes the priority-inheriting lock at addr, for a caller that couldn't take it from user space, blocking
+	 * until it is handed over if another thread of the process holds it, which inherits the caller's priority
+	 * meanwhile.  Returns the caller's futex thread ID, which user space can then take the lock with itself.
+	 */
+	syscall_result_code lock_pi(process &owner, u64 addr, u64 &tid);
+
+	/**
+	 * @brief Releases the priority-inheriting lock at addr, which the caller holds, handing it to the highest priority
+	 * waiter, if there is one.
+	 */
+	syscall_result_code unlock_pi(process &owner, u64 addr);
+
+	/**
+	 * @brief The ID a thread is known by in priority-inheriting futex words, which is never zero.
+	 */
+	static u32 pi_tid(const thread &t);
+
+private:
+	static const int nr_buckets = 64;
+	futex_bucket buckets_[nr_buckets];
+
+	futex_bucket &bucket_for(u64 key) { return buckets_[(key >> 2) % nr_buckets]; }
+
+	static bool resolve(process &owner, u64 addr, u64 &key, volatile u32 *&word, bool writable = false);
+	static thread *find_pi_owner(process &owner, u32 tid);
+	static futex_pi_state *find_pi_state(futex_bucket &b, u64 key);
+	static void timeout_expired(void *arg);
+};
+} // namespace stacsos::kernel::sched
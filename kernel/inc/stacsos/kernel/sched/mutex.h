@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/sched/pi-lock.h>
+
+namespace stacsos::kernel::sched {
+
+/**
+ * @brief A lock that puts the threads waiting for it to sleep, so it may be held across anything that blocks, such
+ * as waiting for the disk.  It must only be taken by threads, and never with interrupts disabled.
+ *
+ * Taking and releasing the lock without contention is a single compare-and-swap of the owner.  Once a thread has to
+ * wait, the owner inherits its priority until it releases the lock, which is then handed straight to the highest
+ * priority waiter.
+ */
+class mutex : private pi_lock {
+	DELETE_DEFAULT_COPY_AND_MOVE(mutex)
+
+public:
+	mutex()
+		: owner_word_(0)
+	{
+	}
+
+	void lock();
+	void unlock();
+
+private:
+	// The owning thread, with waiters_flag set while any thread is waiting, so that unlocking takes the slow path.
+	u64 owner_word_;
+
+	static const u64 waiters_flag = 1;
+	static const u64 anonymous_owner = 2;
+
+	static u64 current_owner();
+
+	void lock_slow(u64 self);
+	void unlock_slow();
+
+	virtual void handed_over(thread *new_owner) override;
+};
+
+/**
+ * @brief Holds a mutex for as long as it is in scope.
+ */
+class mutex_lock {
+	DELETE_DEFAULT_COPY_AND_MOVE(mutex_lock)
+
+public:
+	explicit mutex_lock(mutex &m)
+		: mutex_(m)
+	{
+		mutex_.lock();
+	}
+
+	~mutex_lock() { mutex_.unlock(); }
+
+private:
+	mutex &mutex_;
+};
+} // namespace stacsos::kernel::sched
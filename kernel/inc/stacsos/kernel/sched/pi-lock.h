@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/intrusive-list.h>
+#include <stacsos/syscalls.h>
+
+namespace stacsos::kernel::sched {
+class thread;
+class pi_lock;
+
+/**
+ * @brief A thread waiting for a priority-inheriting lock.  It lives on the waiting thread's stack, and is queued on the
+ * lock in order of the thread's priority.
+ */
+struct pi_waiter {
+	thread *thr;
+	pi_lock *lock;
+	u8 priority;
+	bool granted;
+	list_hook link;
+};
+
+/**
+ * @brief The part of a sleeping lock that lends the priority of the threads waiting for it to the thread holding it,
+ * so that a FIFO thread is never kept waiting by a lower priority thread that can't get the CPU to finish with the
+ * lock.  The lock is handed straight to its highest priority waiter when it is released.
+ *
+ * Everything here is protected by the pi_manager lock.
+ */
+class pi_lock {
+	friend class pi_manager;
+	friend class thread;
+
+public:
+	pi_lock()
+		: owner_(nullptr)
+	{
+	}
+
+	virtual ~pi_lock() { }
+
+	thread *owner() const { return owner_; }
+	bool has_waiters() const { return !waiters_.empty(); }
+
+protected:
+	/**
+	 * @brief Called when the lock is handed over to a waiter, or to no-one if there were none, for the lock to record
+	 * its new owner wherever its fast path looks for it.
+	 */
+	virtual void handed_over(thread *new_owner) { }
+
+private:
+	thread *owner_;
+	intrusive_list<pi_waiter, &pi_waiter::link> waiters_;
+	list_hook held_link_;
+};
+
+/**
+ * @brief Keeps track of who holds and who waits for each priority-inheriting lock, and raises the priority of a lock
+ * holder to that of the highest priority thread waiting for it, and so on along the chain, if the holder is itself
+ * waiting for another lock.  Only FIFO priorities are inherited, as fair threads already share the CPU with the holder.
+ *
+ * One lock protects all of this, which is only taken when a lock is contended.
+ */
+class pi_manager {
+	DEFINE_SINGLETON(pi_manager)
+
+private:
+	pi_manager() { }
+
+public:
+	spinlock_irq &lock() { return lock_; }
+
+	/**
+	 * @brief Records that the thread holds the lock, which had no owner.  Fails if the thread is stopping.  Must be
+	 * called with the lock held.
+	 */
+	bool set_owner(pi_lock &l, thread &t);
+
+	/**
+	 * @brief Records that the lock's owner no longer holds it, without handing it on, once it has no waiters.  Must be
+	 * called with the lock held.
+	 */
+	void disown(pi_lock &l);
+
+	/**
+	 * @brief Suspends the current thread, and queues it on the lock, lending its priority to the lock's owner.  Must be
+	 * called with the lock held, after which the caller drops it and calls wait().
+	 */
+	void block(pi_lock &l, pi_waiter &w);
+
+	/**
+	 * @brief Reschedules until the lock has been handed to the waiter.
+	 */
+	void wait(pi_waiter &w);
+
+	/**
+	 * @brief Hands the lock from its owner to its highest priority waiter, and gives back whatever priority the owner
+	 * inherited through it.  Returns the waiter's thread, which must be resumed once the lock has been dropped, or null
+	 * if there were no waiters.  Must be called with the lock held.
+	 */
+	thread *release(pi_lock &l);
+
+	/**
+	 * @brief Sets the priority the thread was given, which it runs at unless it has inherited a higher one.
+	 */
+	void set_base_priority(thread &t, sched_policy policy, int priority);
+
+	/**
+	 * @brief Called as a thread stops, to take it off any lock it is waiting for, and to hand on any that it holds,
+	 * so that nothing is left pointing at it.
+	 */
+	void thread_stopping(thread &t);
+
+private:
+	spinlock_irq lock_;
+
+	// Chains of locks longer than this (or that go round in a circle, i.e. a deadlock) are only followed this far.
+	static const unsigned int max_chain = 16;
+
+	void propagate(thread *t);
+	bool update_priority(thread &t);
+	static void insert_waiter(pi_lock &l, pi_waiter &w);
+};
+} // namespace stacsos::kernel::sched
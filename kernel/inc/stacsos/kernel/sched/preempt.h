@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+
+namespace stacsos::kernel::sched {
+/**
+ * @brief A point in a long-running kernel loop where the current task can be switched out, if another should be
+ * running instead.  System calls run with interrupts disabled, so without these, nothing else gets the core until
+ * the call returns or blocks.  Does nothing while the task holds a spinning lock, or has disabled interrupts itself
+ * (see preempt_disable()), so it must only be called where the task could just as well block.
+ */
+void cond_resched();
+
+/**
+ * @brief Stops cond_resched() switching away from the current task for as long as it is in scope.
+ */
+class preempt_guard {
+	DELETE_DEFAULT_COPY_AND_MOVE(preempt_guard)
+
+public:
+	preempt_guard() { preempt_disable(); }
+	~preempt_guard() { preempt_enable(); }
+};
+} // namespace stacsos::kernel::sched
@@ -10,6 +10,12 @@
 #include <stacsos/kernel/sched/process.h>
 #include <stacsos/list.h>
 #include <stacsos/memory.h>
+#include <stacsos/process-start.h>
+#include <stacsos/string.h>
+
+namespace stacsos::kernel::obj {
+class object;
+}
 
 namespace stacsos::kernel::sched {
 typedef void (*continuation_fn)(void);
@@ -25,12 +31,99 @@ public:
 	void init();
 
 	shared_ptr<process> create_kernel_process(continuation_fn ep);
-	shared_ptr<process> create_process(const char *path, const char *args);
+
+	/**
+	 * @brief Loads a program into a new process.  The process is given its own handles to the (shareable) input and
+	 * output objects, if there are any, and otherwise uses the console.  It is also given its own handle to each of
+	 * the inherited objects, which must be shareable too.  Everything is charged to the given account, or to a new
+	 * one without limits if it is null.
+	 *
+	 * If there is a template of the program that is ready, the process is a copy of it instead, which skips finding
+	 * and loading the program, and the start-up that the template has already done.
+	 *
+	 * @return shared_ptr<process> The process, or null if the program couldn't be loaded, or the account's limits
+	 * didn't leave room to start it.
+	 */
+	shared_ptr<process> create_process(const char *path, const char *args, obj::object *input = nullptr, obj::object *output = nullptr,
+		obj::object *const *inherited = nullptr, u64 nr_inherited = 0, shared_ptr<resource_account> account = nullptr);
+
+	/**
+	 * @brief Forks a process: makes a new one that shares its memory copy-on-write, and has its own handles to its
+	 * shareable objects, with one thread, that starts at the given entry point, on a new stack.  Everything is charged
+	 * to the given account.
+	 *
+	 * @return shared_ptr<process> The process, or null if the account's limits didn't leave room for it.
+	 */
+	shared_ptr<process> clone_process(process &parent, u64 entry_point, void *entry_arg, shared_ptr<resource_account> account);
+
+	/**
+	 * @brief Starts a template ("zygote") of each program in the zygotes option, a comma-separated list of paths.  Each
+	 * template sets itself up, as far as it can without its arguments, and then waits in zygote_ready to be copied
+	 * by create_process.  A program that is replaced on disk keeps its old template until the next boot.
+	 */
+	void start_zygotes();
+
+	/**
+	 * @brief Records the entry point that copies of the template start at, once it is ready.  Returns false if the
+	 * process isn't a template, or has already said it is ready.
+	 */
+	bool zygote_ready(process &p, u64 entry_point);
 
 	shared_ptr<process> kernel_process() const { return kernel_process_; }
 
+	/**
+	 * @brief Calls fn for each process.  The process list is locked throughout.
+	 */
+	template <typename FN> void for_each_process(FN fn)
+	{
+		unique_irq_lock l(lock_);
+
+		for (auto &p : active_processes_) {
+			fn(*p.get());
+		}
+	}
+
+	/**
+	 * @brief Returns a reference to every process, so that they can be looked at without holding the process list's
+	 * lock, and without any of them being destroyed in the meantime.
+	 */
+	list<shared_ptr<process>> snapshot()
+	{
+		list<shared_ptr<process>> processes;
+
+		unique_irq_lock l(lock_);
+		for (auto &p : active_processes_) {
+			processes.append(p);
+		}
+
+		return processes;
+	}
+
 private:
+	struct zygote {
+		string path;
+		shared_ptr<process> templ;
+
+		// Zero until the template is ready to be copied.
+		u64 entry_point;
+	};
+
 	shared_ptr<process> kernel_process_;
 	list<shared_ptr<process>> active_processes_;
+	list<zygote *> zygotes_;
+	spinlock_irq lock_;
+
+	shared_ptr<process> load_process(const char *path, const char *args, obj::object *input, obj::object *output, obj::object *const *inherited,
+		u64 nr_inherited, shared_ptr<resource_account> account, process_start_flags flags);
+	shared_ptr<process> copy_zygote(process &templ, u64 entry_point, const char *args, obj::object *input, obj::object *output,
+		obj::object *const *inherited, u64 nr_inherited, shared_ptr<resource_account> account);
+
+	void add_process(shared_ptr<process> p)
+	{
+		unique_irq_lock l(lock_);
+		active_processes_.append(p);
+	}
+
+	void remove_process(process &p);
 };
 } // namespace stacsos::kernel::sched
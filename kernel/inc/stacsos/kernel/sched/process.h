@@ -8,9 +8,13 @@
 #pragma once
 
 #include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
 #include <stacsos/kernel/mem/memory-manager.h>
-#include <stacsos/kernel/sched/event.h>
+#include <stacsos/kernel/obj/object-table.h>
+#include <stacsos/kernel/sched/deferred-work.h>
+#include <stacsos/kernel/sched/resource-account.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/kernel/sched/wait-queue.h>
 #include <stacsos/list.h>
 #include <stacsos/memory.h>
 
@@ -21,22 +25,81 @@ enum exec_privilege { kernel, user };
 
 enum class process_state { created, started, terminated };
 
-class process {
+class process : public ref_counted<process> {
 	friend class thread;
+	DEFINE_KMEM_CACHE(process)
 
 public:
-	process(exec_privilege priv)
-		: priv_(priv)
+	/**
+	 * @brief Creates a process, charged to the given account, or to a new one with no limits and no group if it is
+	 * null.
+	 */
+	process(exec_privilege priv, shared_ptr<resource_account> account = nullptr)
+		: id_(allocate_id())
+		, priv_(priv)
 		, state_(process_state::created)
+		, account_(account ? account : make_shared<resource_account>(nullptr))
 		, vma_(mem::memory_manager::get().root_address_space().create_linked(0x7fff'2000'0000))
 		, next_user_stack_(0x7fff'1000'0000)
+		, gang_scheduled_(false)
+		, exiting_(false)
+		, teardown_work_(teardown, this)
 	{
+		vma_->set_account(account_.get());
 	}
 
+	/**
+	 * @brief A process that was torn down has already freed its address space, but one that failed to be created
+	 * still has it.
+	 */
+	~process() { delete vma_; }
+
+	u64 id() const { return id_; }
 	exec_privilege privilege() const { return priv_; }
 
+	/**
+	 * @brief Creates a thread, charging it to the process's account.
+	 *
+	 * @return shared_ptr<thread> The new thread, or null if the process can't have any more.
+	 */
 	shared_ptr<thread> create_thread(u64 entry_point, void *entry_arg = nullptr);
 
+	/**
+	 * @brief Makes this process, which must be new, a copy of another, for a fork.  Its memory is shared with the other
+	 * process, copy-on-write, and it is given its own handle to each of the other's shareable objects, under the same
+	 * handle.  None of the other's threads are copied.
+	 *
+	 * @return bool false if the process's account didn't have room for the copy.
+	 */
+	bool copy_from(process &parent);
+
+	/**
+	 * @brief Creates a thread that runs a kernel function in this process's address space, so that it can work on
+	 * the process's memory.  Helper threads are stopped once every other thread in the process has stopped.
+	 */
+	shared_ptr<thread> create_helper_thread(u64 entry_point, void *entry_arg = nullptr);
+
+	/**
+	 * @brief Calls fn for each thread in the process.  The thread list is locked throughout.
+	 */
+	template <typename FN> void for_each_thread(FN fn)
+	{
+		unique_irq_lock l(threads_lock_);
+
+		for (auto &t : threads_) {
+			fn(*t.get());
+		}
+	}
+
+	/**
+	 * @brief Turns gang scheduling of the process's threads on or off.  When a gang scheduled thread is given a time
+	 * slice, the cores that have others of the process's threads waiting to run are asked to run them for the same
+	 * slice, so that threads that synchronise with each other (e.g. at a barrier) aren't left waiting for one that
+	 * isn't running.  Helper threads are never gang scheduled.
+	 */
+	void set_gang_scheduled(bool gang_scheduled);
+	bool gang_scheduled() const { return gang_scheduled_; }
+
 	process_state state() const { return state_; }
 
 	void start();
@@ -44,17 +107,40 @@ public:
 
 	mem::address_space &addrspace() const { return *vma_; }
 
-	auto_reset_event &state_changed_event() { return state_changed_event_; }
+	wait_queue &state_changed() { return state_changed_; }
+
+	obj::object_table &objects() { return objects_; }
+
+	/**
+	 * @brief The account that the process's pages, handles and threads are charged to.
+	 */
+	resource_account &account() { return *account_; }
 
 private:
+	u64 id_;
 	exec_privilege priv_;
 	process_state state_;
-	auto_reset_event state_changed_event_;
+	wait_queue state_changed_;
 
+	// Declared before anything that is charged to it, so that it outlives them.
+	shared_ptr<resource_account> account_;
 	mem::address_space *vma_;
+	obj::object_table objects_;
 	list<shared_ptr<thread>> threads_;
+	spinlock_irq threads_lock_;
 	u64 next_user_stack_;
+	list<u64> free_user_stacks_;
+	bool gang_scheduled_;
+
+	// Set once the last thread has stopped, when the process's resources are handed to the idle thread to free.
+	bool exiting_;
+	deferred_work_item teardown_work_;
 
 	void on_thread_stopped(thread &thread);
+	static void teardown(void *arg);
+	u64 reuse_user_stack();
+	void release_user_stack(u64 stack_top);
+
+	static u64 allocate_id();
 };
 } // namespace stacsos::kernel::sched
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/deferred-work.h>
+
+namespace stacsos::kernel::sched {
+/**
+ * @brief Embedded in something that is to be freed with call_rcu, to queue it until it is safe to.
+ */
+struct rcu_head {
+	rcu_head *next;
+	void (*fn)(rcu_head *head);
+};
+
+/**
+ * @brief Read-copy-update, for data that is read far more often than it is changed.  Readers take no locks, and write
+ * to no shared cache lines: they just disable interrupts on their own core.  A writer publishes a new version of the
+ * data, and only frees the old one after a grace period, by which time every reader that might have seen it is done.
+ *
+ * A core can't be in a read-side section when it takes an interrupt, or switches tasks, so both of these are
+ * quiescent states.  The scheduler reports them as it ticks and switches, and a grace period is over once every
+ * online core has reported one since it started.  A core that is slow to report one (such as an idle core, halted
+ * until its next event) is kicked, which is itself a quiescent state.
+ */
+class rcu {
+	DEFINE_SINGLETON(rcu)
+
+public:
+	void read_lock()
+	{
+		u64 flags = irq_save();
+
+		per_core &c = cores_.get();
+		if (c.nesting++ == 0) {
+			c.flags = flags;
+		}
+	}
+
+	void read_unlock()
+	{
+		per_core &c = cores_.get();
+		if (--c.nesting == 0) {
+			irq_restore(c.flags);
+		} else {
+			// Every read_lock disabled preemption once, but only the outermost one has its flags restored.
+			preempt_enable();
+		}
+	}
+
+	/**
+	 * @brief Records that the calling core is in a quiescent state.  It must be called with interrupts disabled,
+	 * outside of any read-side section.
+	 */
+	void note_quiescent()
+	{
+		// Only grace periods that started before now are satisfied.
+		__atomic_store_n(&cores_.get().quiescent_seq, __atomic_load_n(&gp_seq_, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	}
+
+	/**
+	 * @brief Waits for a grace period: every read-side section that was in progress when this was called has ended
+	 * by the time it returns.  It must be called with interrupts enabled, and with no spinlocks held.
+	 */
+	void synchronize();
+
+	/**
+	 * @brief Calls fn on head after a grace period, without waiting for it.  This can be called from anywhere.
+	 */
+	void call(rcu_head &head, void (*fn)(rcu_head *head));
+
+	/**
+	 * @brief Checks that nested read-side sections leave interrupts and the preempt count as they found them, and
+	 * panics if they don't.
+	 */
+	void perform_selftest();
+
+private:
+	rcu()
+		: gp_seq_(0)
+		, pending_(nullptr)
+		, callbacks_queued_(false)
+		, callbacks_work_(run_callbacks, this)
+	{
+		for (auto &c : cores_) {
+			c.quiescent_seq = 0;
+			c.nesting = 0;
+			c.flags = 0;
+		}
+	}
+
+	struct per_core {
+		u64 quiescent_seq;
+		unsigned int nesting;
+		u64 flags;
+	};
+
+	// The number of grace periods that have been started.
+	u64 gp_seq_;
+	arch::percpu<per_core> cores_;
+
+	spinlock_irq callbacks_lock_;
+	rcu_head *pending_;
+	bool callbacks_queued_;
+	deferred_work_item callbacks_work_;
+
+	static void run_callbacks(void *arg);
+};
+
+static inline void rcu_read_lock() { rcu::get().read_lock(); }
+static inline void rcu_read_unlock() { rcu::get().read_unlock(); }
+static inline void synchronize_rcu() { rcu::get().synchronize(); }
+static inline void call_rcu(rcu_head &head, void (*fn)(rcu_head *head)) { rcu::get().call(head, fn); }
+
+/**
+ * @brief Loads a pointer that is published with rcu_assign_pointer, inside a read-side section.
+ */
+template <class T> static inline T *rcu_dereference(T *const &p) { return __atomic_load_n(&p, __ATOMIC_ACQUIRE); }
+
+/**
+ * @brief Publishes a pointer to readers, once whatever it points to has been filled in.
+ */
+template <class T> static inline void rcu_assign_pointer(T *&p, T *v) { __atomic_store_n(&p, v, __ATOMIC_RELEASE); }
+
+/**
+ * @brief Holds a read-side section open for as long as it is in scope.
+ */
+class rcu_read_guard {
+	DELETE_DEFAULT_COPY_AND_MOVE(rcu_read_guard)
+
+public:
+	rcu_read_guard() { rcu_read_lock(); }
+	~rcu_read_guard() { rcu_read_unlock(); }
+};
+} // namespace stacsos::kernel::sched
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/memory.h>
+#include <stacsos/resource-limits.h>
+
+namespace stacsos::kernel::sched {
+/**
+ * @brief Counts how much of each resource a process (or a group of processes) is using, and holds the limits on them.
+ *
+ * Every process has an account of its own, whose parent is the account of its group, if it has one, and groups may
+ * themselves be nested in the group they were started from.  A charge is made against the account and every one of
+ * its parents, and fails without changing anything if it would take any of them over its limit.  The counters are
+ * only changed atomically, so charging takes no locks, and can be done from anywhere.
+ *
+ * A limit can only ever be lowered, so a process can't raise the limits it was started with, or those of its group.
+ */
+class resource_account {
+	DELETE_DEFAULT_COPY_AND_MOVE(resource_account)
+
+public:
+	resource_account(shared_ptr<resource_account> parent)
+		: parent_(parent)
+	{
+		for (u64 i = 0; i < NR_RESOURCE_TYPES; i++) {
+			limits_[i] = RESOURCE_UNLIMITED;
+			usage_[i] = 0;
+		}
+	}
+
+	shared_ptr<resource_account> parent() const { return parent_; }
+
+	u64 limit(resource_type type) const { return __atomic_load_n(&limits_[(u64)type], __ATOMIC_RELAXED); }
+	u64 usage(resource_type type) const { return __atomic_load_n(&usage_[(u64)type], __ATOMIC_RELAXED); }
+
+	/**
+	 * @brief Lowers the limit on a resource.  A limit below the current usage stops any more being charged, but
+	 * doesn't take anything back.
+	 *
+	 * @return bool false if the new limit is higher than the current one, which is left alone.
+	 */
+	bool set_limit(resource_type type, u64 limit);
+
+	/**
+	 * @brief Charges n of a resource to this account and each of its parents.
+	 *
+	 * @return bool false if that would take any of them over its limit, in which case nothing is charged.
+	 */
+	bool charge(resource_type type, u64 n);
+
+	/**
+	 * @brief Gives back n of a resource that was charged earlier.
+	 */
+	void uncharge(resource_type type, u64 n);
+
+	/**
+	 * @brief Creates the account for a process started by the owner of this one.  It starts with the same limits, and
+	 * is in the same group, or (with new_group) in a new group nested in this one's.
+	 */
+	shared_ptr<resource_account> create_child(bool new_group) const;
+
+private:
+	shared_ptr<resource_account> parent_;
+	u64 limits_[NR_RESOURCE_TYPES];
+	u64 usage_[NR_RESOURCE_TYPES];
+};
+} // namespace stacsos::kernel::sched
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+
+namespace stacsos::kernel::sched {
+struct tcb;
+
+enum class sched_trace_event_kind : u32 { switch_in, switch_out, wakeup };
+
+struct sched_trace_event {
+	u64 timestamp;
+	const tcb *task;
+	sched_trace_event_kind kind;
+	u32 core;
+};
+
+/**
+ * @brief Records scheduling events into a ring buffer per core, and keeps histograms of wake-up latency (the
+ * time from a task becoming runnable to it being switched in) and run queue depth.  Each core only ever writes
+ * to its own buffer, with interrupts disabled, so recording takes no locks.  Readers take an unsynchronised
+ * snapshot, which may include a few events that are being overwritten.
+ */
+class sched_trace {
+	DEFINE_SINGLETON(sched_trace)
+
+private:
+	sched_trace() { }
+
+public:
+	static const unsigned int events_per_core = 256;
+
+	// Latencies are bucketed by log2 of the number of TSC cycles.
+	static const unsigned int latency_buckets = 40;
+
+	// Run queue depths of this or more all go in the last bucket.
+	static const unsigned int depth_buckets = 33;
+
+	void record_wakeup(tcb &task);
+	void record_switch(tcb *prev, tcb &next);
+	void record_runqueue_depth(unsigned int depth);
+
+	/**
+	 * @brief Renders the histograms, followed by the buffered events of each core, as text.  Returns the number
+	 * of characters written.
+	 */
+	size_t render(char *buffer, size_t size);
+
+	/**
+	 * @brief Returns a buffer size that is always large enough for render().
+	 */
+	static size_t render_size_hint() { return 4096 + (arch::core_manager::max_cores * events_per_core * 64); }
+
+private:
+	struct per_core_trace {
+		sched_trace_event events[events_per_core];
+		u64 head;
+
+		u64 latency[latency_buckets];
+		u64 depth[depth_buckets];
+	};
+
+	per_core_trace cores_[arch::core_manager::max_cores];
+
+	void record(sched_trace_event_kind kind, const tcb *task, u64 timestamp);
+};
+} // namespace stacsos::kernel::sched
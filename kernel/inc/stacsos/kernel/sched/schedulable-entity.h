@@ -7,8 +7,13 @@
  */
 #pragma once
 
+#include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/arch/x86/machine-context.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/intrusive-list.h>
 #include <stacsos/memops.h>
+#include <stacsos/rb-tree.h>
+#include <stacsos/syscalls.h>
 
 namespace stacsos::kernel::arch {
 class core;
@@ -24,11 +29,75 @@ struct tcb {
 	u64 kernel_stack; // 18
 	u64 user_stack_save; // 20
 	u64 start_time;	// 28
-	u64 stop_time;	// 30
+	u64 stop_time;	// 30 -- when the task last stopped running
 	u64 run_time;	// 38
+	u64 vruntime;	// 40
+	rb_node run_node; // 48
+	u64 affinity; // 68
+	sched_policy policy; // 70
+	s8 nice; // 71
+	u8 rt_priority; // 72
+	bool queued; // 73
+	u64 switch_rsp; // 74
+	bool on_cpu; // 7c
+	tcb *switched_from; // 7d
+	u64 wakeup_time; // 85
+	u64 kernel_time; // 8d
+	u64 kernel_since; // 95
+	u64 nr_voluntary_switches; // 9d
+	u64 nr_preemptions; // a5
+	u32 last_core; // ad
+	u64 edf_runtime; // b1
+	u64 edf_period; // b9
+	u64 edf_deadline; // c1
+	u64 edf_budget; // c9
+	void *fpu_state; // d1
+	tcb *wake_next; // d9
+	u64 *active_cores; // e1
+	list_hook run_link; // e9
+	list_hook wait_link; // f9
+	u32 core_id; // 109 -- the core the task is running on, while it is the current task of one
+	void *perf_state; // 10d -- the performance counters the task is counting its own events with, if any
+	const void *gang; // 115 -- the process the task is co-scheduled with the other threads of, if it is gang scheduled
+	u64 nr_migrations; // 11d -- the number of times the task has been moved to another core
+	sched_policy base_policy; // 125 -- the policy the task was given, which it runs with unless it inherits a priority
+	s8 base_priority; // 126 -- the nice value or real-time priority that goes with it
+	u32 preempt_count; // 127 -- the number of spinning locks the task holds, and sections it has disabled interrupts in
 } __packed;
 
+// These are used by the context switching code (see irq-traps.S).
+static_assert(__builtin_offsetof(tcb, switch_rsp) == 0x74);
+static_assert(__builtin_offsetof(tcb, on_cpu) == 0x7c);
+static_assert(__builtin_offsetof(tcb, switched_from) == 0x7d);
+
+// This is used by preempt_disable() and preempt_enable() (see lock.h).
+static_assert(__builtin_offsetof(tcb, preempt_count) == TCB_PREEMPT_COUNT_OFFSET);
+
+/**
+ * @brief Returns true if the task may run on the given core.  An affinity mask of zero means any core.
+ */
+static inline bool can_run_on(const tcb &t, int core_id)
+{
+	u64 mask = __atomic_load_n(&t.affinity, __ATOMIC_RELAXED);
+	if (!mask) {
+		// Isolated cores only run the tasks that have been pinned to them.
+		return !arch::core_manager::get().is_isolated(core_id);
+	}
+
+	return mask & (1ull << core_id);
+}
+
+/**
+ * @brief Returns true if the task ran recently enough (at or after hot_since) that much of what it uses is probably
+ * still in the caches of the core it ran on, so that moving it would lose more than it gained.  A task that has never
+ * run is never hot.
+ */
+static inline bool is_cache_hot(const tcb &t, u64 hot_since) { return t.stop_time && t.stop_time >= hot_since; }
+
 class schedulable_entity {
+	friend class scheduler;
+	friend class arch::core;
+
 public:
 	schedulable_entity()
 		: owning_core_(nullptr)
@@ -7,17 +7,68 @@
  */
 #pragma once
 
+#include <stacsos/atomic.h>
+#include <stacsos/syscalls.h>
+
+namespace stacsos::kernel::arch {
+class core;
+}
+
 namespace stacsos::kernel::sched {
 class schedulable_entity;
+struct tcb;
 
 class scheduler {
 	DEFINE_SINGLETON(scheduler);
 
 private:
-	scheduler() { }
+	scheduler()
+		: next_core_(0)
+	{
+	}
 
 public:
 	void add_to_schedule(schedulable_entity &e);
 	void remove_from_schedule(schedulable_entity &e);
+
+	/**
+	 * @brief Restricts the entity to the cores in the mask (zero meaning any core), moving it off its current
+	 * core if that is no longer allowed.  Returns false if the mask contains no running core.
+	 */
+	bool set_affinity(schedulable_entity &e, u64 mask);
+
+	/**
+	 * @brief Changes the scheduling class of the entity, and its priority within that class -- a nice value for
+	 * fair entities and a real-time priority for FIFO entities.  Returns false if the priority is out of range.
+	 */
+	bool set_priority(schedulable_entity &e, sched_policy policy, int priority);
+
+	/**
+	 * @brief Changes the priority the entity is actually scheduled with, which is the one it was given with
+	 * set_priority, or one it has inherited, as decided by the pi_manager.
+	 */
+	void apply_priority(schedulable_entity &e, sched_policy policy, int priority);
+
+	/**
+	 * @brief Reserves runtime_us out of every period_us for the entity, which must already have been started, or
+	 * removes its reservation if runtime_us is zero.  Returns false if the scheduling algorithm doesn't support
+	 * reservations, or if the entity's core can't fit it in alongside those it has already admitted.  An entity with a
+	 * reservation stays on its core.
+	 */
+	bool set_reservation(schedulable_entity &e, u64 runtime_us, u64 period_us);
+
+	/**
+	 * @brief Asks every other core that has a runnable thread of the leader's gang queued to run it, until the given
+	 * time, which is when the leader's slice on its own core ends.
+	 */
+	void co_schedule(const tcb &leader, u64 until, arch::core &leader_core);
+
+	/**
+	 * @brief Returns the least loaded running core that a task with the given affinity mask may run on.
+	 */
+	arch::core &select_core(u64 affinity);
+
+private:
+	atomic_u32 next_core_;
 };
 } // namespace stacsos::kernel::sched
@@ -7,28 +7,35 @@
  */
 #pragma once
 
-#include <stacsos/list.h>
+#include <stacsos/kernel/lock.h>
 
 namespace stacsos::kernel::sched {
 class thread;
 
-struct sleeping_thread {
-	thread *thr;
-	u64 wakeup_deadline;
-};
-
 class sleeper {
 	DEFINE_SINGLETON(sleeper)
 
 public:
 	void sleep_ms(u64 duration_ms);
+
+	/**
+	 * @brief Sleeps until the timestamp counter reaches the deadline, returning straight away if it already has.  A
+	 * loop that sleeps until a deadline a fixed period on from the last one doesn't drift, however late it wakes up.
+	 */
+	void sleep_until(u64 deadline);
+
 	void check_wakeup();
 
+	/**
+	 * @brief Whether any timer has expired, so that check_wakeup has something to do.
+	 */
+	bool wakeup_due();
+
 private:
 	sleeper() { }
 
-	list<sleeping_thread *> sleeping_;
+	spinlock_irq sleeping_lock_;
 
-	void do_sleep(u64 wakeup_deadline);
+	static void wakeup(void *arg);
 };
 } // namespace stacsos::kernel::sched
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/sched/event.h>
+
+namespace stacsos::kernel::sched {
+enum class softirq_vector : u32 { timer = 0, tasklet = 1 };
+
+typedef void (*softirq_fn)();
+typedef void (*tasklet_fn)(void *arg);
+
+/**
+ * @brief A function that an interrupt handler wants run soon, but not in the handler.  Scheduling a tasklet that is
+ * already waiting to run does nothing, so it runs once however many times it was scheduled in the meantime.  The
+ * tasklet must stay alive until it has run.
+ */
+struct tasklet {
+	tasklet(tasklet_fn fn, void *arg)
+		: fn(fn)
+		, arg(arg)
+		, next(nullptr)
+		, queued(false)
+	{
+	}
+
+	tasklet_fn fn;
+	void *arg;
+	tasklet *next;
+	bool queued;
+};
+
+/**
+ * @brief Bottom halves: the work an interrupt handler hands off, so that it can return quickly.  A handler raises a
+ * vector, or schedules a tasklet, on the core it is running on, and that core's bottom-half thread -- which is pinned
+ * to the core, and runs at a real-time priority, so it is switched to as soon as the handler returns -- runs it with
+ * interrupts enabled.
+ *
+ * Interrupts in this kernel don't nest, so the bottom halves can't simply be run on the way out of the handler.
+ */
+class softirq {
+	DEFINE_SINGLETON(softirq)
+
+private:
+	softirq();
+
+public:
+	static const unsigned int nr_vectors = 2;
+
+	// Above the keyboard's bottom half, but leaving room for anything that has to pre-empt the bottom halves.
+	static const int thread_priority = 50;
+
+	void register_handler(softirq_vector vector, softirq_fn fn);
+
+	/**
+	 * @brief Marks the vector as pending on the calling core, and wakes the core's bottom-half thread to run it.  Until
+	 * the thread has been started, the handler is run straight away instead.  Must be called with interrupts disabled.
+	 */
+	void raise(softirq_vector vector);
+
+	/**
+	 * @brief Queues a tasklet to be run by the calling core's bottom-half thread.  Must be called with interrupts
+	 * disabled.
+	 */
+	void schedule(tasklet &t);
+
+	/**
+	 * @brief Whether the vector has been raised on the calling core, and not yet run.
+	 */
+	bool is_pending(softirq_vector vector) const;
+
+	/**
+	 * @brief Starts a bottom-half thread on every online core.
+	 */
+	void start_threads();
+
+	/**
+	 * @brief The number of times the vector's handler has been run by the core.
+	 */
+	u64 count(int core_id, softirq_vector vector) const { return __atomic_load_n(&cores_[core_id].counts[(u32)vector], __ATOMIC_RELAXED); }
+
+private:
+	struct per_core {
+		u32 pending;
+		bool started;
+
+		// Most recently scheduled first.
+		tasklet *tasklets;
+
+		auto_reset_event wakeup;
+		u64 counts[nr_vectors];
+	};
+
+	per_core cores_[arch::core_manager::max_cores];
+	softirq_fn handlers_[nr_vectors];
+
+	void run(per_core &c, u32 pending);
+	void run_tasklets();
+
+	static void thread_proc(void *arg);
+};
+} // namespace stacsos::kernel::sched
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/bitset.h>
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/list.h>
+
+namespace stacsos::kernel::sched {
+struct tcb;
+
+/**
+ * @brief Allocates kernel stacks in an area of their own, where each stack has a slot with the stack at the top and
+ * an unmapped guard below it, so that a stack overflowing faults, rather than running into whatever is next to it.
+ * Each stack is made of single pages, so no higher-order blocks are needed.
+ *
+ * Each core caches the stacks of threads that have terminated, so that creating a thread doesn't have to map and
+ * clear a new stack every time.  Recycled stacks are cleared by the idle thread, so that the cost is usually paid
+ * when the core has nothing better to do.
+ */
+class stack_pool {
+	DEFINE_SINGLETON(stack_pool)
+
+public:
+	// The number of stacks kept by each core -- any more are unmapped, and their pages returned to the page allocator.
+	static const unsigned int max_cached = 8;
+
+	// The number of slots in the kernel stack area, which bounds the number of threads.
+	static const unsigned int max_slots = 16384;
+
+	/**
+	 * @brief Returns a zeroed kernel stack, of thread::stack_size.
+	 *
+	 * @return void* The lowest address of the stack, or null if there was no memory (or no slot) for one.
+	 */
+	void *allocate();
+
+	/**
+	 * @brief Hands back the stack of a terminated thread, which may still be running on it.  The stack is only reused
+	 * once the thread has been switched out for the last time.
+	 */
+	void release(void *stack, const tcb *owner);
+
+	/**
+	 * @brief Called once a terminated thread is known to have been switched out for the last time, before its TCB is
+	 * freed, so that none of its released stacks are left referring to it.
+	 */
+	void forget(const tcb *owner);
+
+	/**
+	 * @brief Clears one recycled stack on this core, returning false if there were none to clear.
+	 */
+	bool zero_one();
+
+	/**
+	 * @brief Returns true if the address is in the guard below a kernel stack, i.e. a fault there is a stack overflow.
+	 */
+	static bool is_guard_address(u64 address);
+
+private:
+	stack_pool() { }
+
+	struct released_stack {
+		void *stack;
+		const tcb *owner;
+	};
+
+	struct per_core_pool {
+		spinlock_irq lock;
+		list<released_stack> released; // Stacks whose thread may still be switching out
+		list<void *> dirty; // Stacks that are free, but not yet cleared
+		list<void *> clean; // Stacks that are ready to use
+	};
+
+	per_core_pool pools_[arch::core_manager::max_cores];
+
+	// Protects the slots, and the page tables of the kernel stack area.
+	spinlock_irq area_lock_;
+	bitset<max_slots> used_slots_;
+
+	per_core_pool &this_core_pool();
+	void reap(per_core_pool &pool);
+	void recycle(per_core_pool &pool, void *stack);
+
+	void *map_stack();
+	void unmap_stack(void *stack);
+	static void free_slot(void *stack);
+};
+} // namespace stacsos::kernel::sched
@@ -8,8 +8,12 @@
 #pragma once
 
 #include <stacsos/kernel/arch/x86/machine-context.h>
-#include <stacsos/kernel/sched/event.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
+#include <stacsos/kernel/sched/pi-lock.h>
 #include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/kernel/sched/wait-queue.h>
+#include <stacsos/memory.h>
 
 namespace stacsos::kernel::mem {
 class page;
@@ -26,24 +30,62 @@ enum class thread_states { created, runnable, running, suspended, terminated };
 
 class process;
 
-class thread : public schedulable_entity {
+class thread : public schedulable_entity, public ref_counted<thread> {
+	friend class process;
+	friend class pi_manager;
+	DEFINE_KMEM_CACHE(thread)
+
 public:
 	static const int stack_size_order = 4;
 	static const size_t stack_size = (1 << stack_size_order) * PAGE_SIZE;
 
-	thread(process &owner, u64 ep = 0, void *ep_arg = nullptr, u64 user_stack = 0);
+	thread(process &owner, u64 ep = 0, void *ep_arg = nullptr, u64 user_stack = 0, bool kernel_mode = false);
 
 	thread_states state() const { return state_; }
-	auto_reset_event &state_changed_event() { return state_changed_event_; }
+	wait_queue &state_changed() { return state_changed_; }
 
 	void start();
 	void stop();
 	void suspend();
 	void resume();
 
+	/**
+	 * @brief Gives back the thread's kernel stack and extended register state, once it has terminated and been
+	 * switched out for the last time.
+	 */
+	void reclaim();
+
 	process &owner() const { return owner_; }
+	u64 id() const { return id_; }
+
+	/**
+	 * @brief Whether the thread runs kernel code.  This is true of every thread in the kernel process, and of helper
+	 * threads that the kernel starts in a user process, to work in its address space.
+	 */
+	bool kernel_mode() const { return kernel_mode_; }
+
+	/**
+	 * @brief The timestamp counter ticks the thread has run for, split into those spent in user mode and those spent
+	 * in the kernel.  All of a kernel thread's time is kernel time.
+	 */
+	void cpu_time(u64 &user, u64 &kernel) const
+	{
+		const tcb *t = get_tcb();
 
-	static thread &current();
+		kernel = kernel_mode_ ? t->run_time : min(t->kernel_time, t->run_time);
+		user = t->run_time - kernel;
+	}
+
+	/**
+	 * @brief The thread running this code.  In the kernel, GS points at the running thread's TCB, whose first word is
+	 * the thread itself, so this is a single load, rather than a trip through the core manager.
+	 */
+	static thread &current()
+	{
+		thread *t;
+		asm volatile("mov %%gs:0, %0" : "=r"(t));
+		return *t;
+	}
 
 private:
 	static __noreturn void task_entry_trampoline(thread *task);
@@ -52,11 +94,23 @@ private:
 	void change_state(thread_states new_state);
 
 	process &owner_;
+	u64 id_;
 	u64 ep_;
 	void *arg_;
 	thread_states state_;
-	mem::page *kernel_stack_;
+	spinlock_irq state_lock_;
+	void *kernel_stack_;
 	u64 user_stack_;
-	auto_reset_event state_changed_event_;
+	bool kernel_mode_;
+
+	// Whether the thread is still charged to its process's account, which it stops being when it first stops.
+	bool charged_;
+	wait_queue state_changed_;
+
+	// The priority-inheriting locks the thread holds, the one it is waiting for, if any, and whether it has stopped,
+	// and so mustn't be given any more.  These are protected by the pi_manager lock.
+	intrusive_list<pi_lock, &pi_lock::held_link_> pi_held_;
+	pi_waiter *pi_blocked_on_;
+	bool pi_exited_;
 };
 } // namespace stacsos::kernel::sched
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/vector.h>
+
+namespace stacsos::kernel::sched {
+typedef void (*timer_event_fn)(void *arg);
+
+/**
+ * @brief A one-shot timer.  The storage is owned by whoever registers it, and it must remain valid
+ * until it has fired, or has been cancelled.
+ */
+struct timer_event {
+	timer_event(u64 deadline, timer_event_fn fn, void *arg)
+		: deadline(deadline)
+		, fn(fn)
+		, arg(arg)
+		, heap_index(-1)
+	{
+	}
+
+	u64 deadline; // TSC value at which the timer fires
+	timer_event_fn fn;
+	void *arg;
+
+	int heap_index; // Position in the timer queue, or -1 if not queued
+};
+
+/**
+ * @brief Pending timers, kept in a binary min-heap ordered by deadline, so that the timer tick
+ * only has to look at the earliest one.
+ */
+class timer_queue {
+	DEFINE_SINGLETON(timer_queue)
+
+private:
+	timer_queue() { heap_.reserve(16); }
+
+public:
+	void add(timer_event &ev);
+	bool cancel(timer_event &ev);
+
+	/**
+	 * @brief Fires every timer whose deadline is at or before now.  Callbacks are run without the
+	 * queue lock held, so they may add new timers.
+	 */
+	void run_expired(u64 now);
+
+	/**
+	 * @brief Returns the deadline of the earliest timer, or zero if there are none.
+	 */
+	u64 next_deadline();
+
+private:
+	spinlock_irq lock_;
+	vector<timer_event *> heap_;
+
+	void place(size_t index, timer_event *ev)
+	{
+		heap_[index] = ev;
+		ev->heap_index = (int)index;
+	}
+
+	void sift_up(size_t index);
+	void sift_down(size_t index);
+	void remove_at(size_t index);
+};
+} // namespace stacsos::kernel::sched
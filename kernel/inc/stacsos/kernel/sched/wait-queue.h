@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/intrusive-list.h>
+#include <stacsos/vector.h>
+
+namespace stacsos::kernel::sched {
+class thread;
+class wait_set;
+struct wait_set_entry;
+
+/**
+ * @brief A queue of threads waiting for a condition to become true.  The condition is always checked
+ * with the queue lock held, and a waiter is suspended and queued before the lock is dropped, so a wake-up
+ * issued after the condition is made true can never be missed.
+ *
+ * Waiters are linked into the queue through their task control blocks, so waiting never allocates.  A thread can
+ * only wait on one queue at a time, and is taken off the queue before it is resumed.
+ */
+class wait_queue {
+	DELETE_DEFAULT_COPY_AND_MOVE(wait_queue)
+
+public:
+	wait_queue() { }
+
+	/**
+	 * @brief Blocks the current thread until the predicate returns true.  The predicate is evaluated with
+	 * the queue lock held, so it may also consume whatever it is waiting for.
+	 */
+	template <typename P> void wait_until(P predicate)
+	{
+		while (true) {
+			{
+				unique_irq_lock l(lock_);
+
+				if (predicate()) {
+					return;
+				}
+
+				enqueue_current();
+			}
+
+			reschedule();
+		}
+	}
+
+	/**
+	 * @brief Wakes the longest waiting thread, returning false if no threads were waiting.
+	 */
+	bool wake_one();
+
+	/**
+	 * @brief Wakes every waiting thread, returning the number that were woken.
+	 */
+	unsigned int wake_all();
+
+	/**
+	 * @brief Makes a change that waiters' predicates look at, and wakes the longest waiting thread, all under the
+	 * queue lock.  The queue isn't touched again once the lock is dropped, so a waiter that sees the change may
+	 * destroy the queue straight away.
+	 */
+	template <typename U> bool update_and_wake_one(U update)
+	{
+		tcb *waiter;
+		watcher_list watchers;
+
+		{
+			unique_irq_lock l(lock_);
+			update();
+
+			waiter = waiters_.dequeue();
+			signal_watchers(watchers);
+		}
+
+		if (waiter) {
+			resume(*waiter);
+		}
+
+		for (auto watcher : watchers) {
+			resume(watcher);
+		}
+
+		return waiter != nullptr;
+	}
+
+	/**
+	 * @brief As update_and_wake_one, but wakes every waiting thread.
+	 */
+	template <typename U> unsigned int update_and_wake_all(U update)
+	{
+		waiter_list woken;
+		watcher_list watchers;
+
+		{
+			unique_irq_lock l(lock_);
+			update();
+
+			woken.splice(waiters_);
+			signal_watchers(watchers);
+		}
+
+		unsigned int nr_woken = woken.count();
+		resume_all(woken);
+
+		for (auto watcher : watchers) {
+			resume(watcher);
+		}
+
+		return nr_woken;
+	}
+
+	/**
+	 * @brief The lock protecting the queue, which should also be held when changing state that a
+	 * waiter's predicate looks at.
+	 */
+	spinlock_irq &lock() { return lock_; }
+
+private:
+	friend class wait_set;
+
+	using waiter_list = intrusive_list<tcb, &tcb::wait_link>;
+
+	// The threads of the wait sets signalled by a wake-up, which are usually few.
+	using watcher_list = small_vector<thread *, 4>;
+
+	spinlock_irq lock_;
+	waiter_list waiters_;
+
+	// The wait sets watching the queue, which are all signalled by every wake-up, whether or not it wakes a waiter.
+	vector<wait_set_entry *> watchers_;
+
+	void enqueue_current();
+
+	/**
+	 * @brief Signals every watching wait set, with the lock held, and collects the threads to be resumed once it has
+	 * been dropped.
+	 */
+	void signal_watchers(vector<thread *> &to_resume)
+	{
+		if (!watchers_.empty()) {
+			signal_watchers_slow(to_resume);
+		}
+	}
+
+	void signal_watchers_slow(vector<thread *> &to_resume);
+	void add_watcher(wait_set_entry *e);
+	void remove_watcher(wait_set_entry *e);
+
+	static void reschedule();
+	static void resume(thread *waiter);
+	static void resume(tcb &waiter);
+	static void resume_all(waiter_list &woken);
+};
+} // namespace stacsos::kernel::sched
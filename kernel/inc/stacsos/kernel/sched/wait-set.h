@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/list.h>
+
+namespace stacsos::kernel::sched {
+class thread;
+class wait_queue;
+class wait_set;
+
+struct wait_set_entry {
+	wait_set *set;
+	wait_queue *queue;
+};
+
+/**
+ * @brief Lets one thread wait on many wait queues at once.  Once a queue has been added, every wake-up on it signals
+ * the set, and the thread waiting on the set then looks again at whatever it is waiting for.  Being signalled says
+ * nothing about which queue did it, or whether anything is actually ready, in the same way that a wait_queue
+ * predicate can be checked and found to still be false.
+ */
+class wait_set {
+	DELETE_DEFAULT_COPY_AND_MOVE(wait_set)
+
+public:
+	wait_set()
+		: sleeper_(nullptr)
+		, signalled_(false)
+		, timer_done_(false)
+	{
+	}
+
+	~wait_set();
+
+	/**
+	 * @brief Watches the queue until the set is destroyed.  The queue must outlive the set.
+	 */
+	void add(wait_queue &q);
+
+	/**
+	 * @brief Blocks until one of the queues has been woken since the last wait (or since it was added), or until
+	 * the deadline passes.  The deadline is a timestamp counter value, or zero to wait for as long as it takes.
+	 * Returns false if the deadline passed first.
+	 */
+	bool wait(u64 deadline);
+
+private:
+	friend class wait_queue;
+
+	spinlock_irq lock_;
+	list<wait_set_entry *> entries_;
+	thread *sleeper_;
+	bool signalled_;
+	bool timer_done_;
+
+	/**
+	 * @brief Called by a queue, with its lock held, when it is woken.  Returns the sleeping thread, if there is one,
+	 * which the queue must resume once it has dropped its lock.
+	 */
+	thread *signal();
+
+	static void timeout_expired(void *arg);
+};
+} // namespace stacsos::kernel::sched
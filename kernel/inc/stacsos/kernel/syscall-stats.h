@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/syscalls.h>
+
+namespace stacsos::kernel {
+/**
+ * @brief Counts the system calls made, by number, and keeps a histogram of how long each took, from entry to exit,
+ * so that the ones that dominate can be found.  Each core has its own counters, so recording doesn't contend with
+ * the other cores.  Calls that never return, such as exit, aren't counted.
+ *
+ * Counting can be limited to a single process, e.g. to see what one program does.
+ */
+class syscall_stats {
+	DEFINE_SINGLETON(syscall_stats)
+
+private:
+	syscall_stats()
+		: filter_process_(0)
+	{
+	}
+
+public:
+	// System call numbers at or above this are counted together, in the last slot.
+	static const unsigned int max_syscalls = 64;
+
+	// Latencies are bucketed by log2 of the number of TSC cycles.
+	static const unsigned int latency_buckets = 32;
+
+	/**
+	 * @brief Records a system call made by the given process, which took the given number of TSC cycles.
+	 */
+	void record(syscall_numbers index, u64 process_id, u64 cycles)
+	{
+		u64 filter = __atomic_load_n(&filter_process_, __ATOMIC_RELAXED);
+		if (filter && filter != process_id) {
+			return;
+		}
+
+		record_slow((unsigned int)index, cycles);
+	}
+
+	void reset();
+	void set_filter(u64 process_id) { __atomic_store_n(&filter_process_, process_id, __ATOMIC_RELAXED); }
+
+	/**
+	 * @brief Renders the counters of each system call that has been made, summed over the cores, as text.  Returns
+	 * the number of characters written.
+	 */
+	size_t render(char *buffer, size_t size);
+
+	static size_t render_size_hint() { return 256 + (max_syscalls * 160) + (max_syscalls * latency_buckets * 16); }
+
+private:
+	struct per_core_stats {
+		u64 calls[max_syscalls];
+		u64 cycles[max_syscalls];
+		u64 latency[max_syscalls][latency_buckets];
+	};
+
+	u64 filter_process_;
+	arch::percpu<per_core_stats> cores_;
+
+	void record_slow(unsigned int index, u64 cycles);
+};
+} // namespace stacsos::kernel
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/sched/mutex.h>
+#include <stacsos/tracepoints.h>
+
+namespace stacsos::kernel {
+/**
+ * @brief A fixed place in the kernel that records an event, with a few numeric arguments, when it is enabled.  Every
+ * tracepoint is put in the __tracepoints section, so they can all be found without registering them, and a
+ * tracepoint's ID is its position there.
+ */
+struct tracepoint {
+	const char *name;
+	const char *format;
+	bool enabled;
+};
+
+/**
+ * @brief Static tracepoints.  A disabled tracepoint costs a load and a not-taken branch.  An enabled one records its
+ * ID, its arguments and the timestamp counter into its core's ring, which is written without locks: the slot is
+ * claimed with an atomic increment, so tracepoints can be hit from anywhere (even NMIs), and the record is published
+ * by storing its sequence number last.
+ *
+ * The rings are drained by reading /dev/tracepoints, which hands over every record written since the last read, and
+ * counts any that were overwritten before they could be.
+ */
+class tracepoints {
+	DEFINE_SINGLETON(tracepoints)
+
+private:
+	tracepoints()
+		: lost_(0)
+	{
+		for (auto &c : cores_) {
+			c.records = nullptr;
+			c.head = 0;
+			c.tail = 0;
+		}
+	}
+
+public:
+	static const unsigned int records_per_core = 4096;
+
+	static tracepoint *begin();
+	static tracepoint *end();
+	static u32 count() { return end() - begin(); }
+
+	/**
+	 * @brief Returns the tracepoint with the given ID, or null if there isn't one.
+	 */
+	static tracepoint *get_by_id(u32 id) { return id < count() ? begin() + id : nullptr; }
+
+	/**
+	 * @brief Enables or disables a tracepoint, or every tracepoint if the ID is all_tracepoints.  The rings are
+	 * allocated the first time any tracepoint is enabled.  Returns false if there's no tracepoint with the ID.
+	 */
+	bool set_enabled(u32 id, bool enabled);
+
+	static const u32 all_tracepoints = ~0u;
+
+	template <typename... Args> void hit(const tracepoint &tp, Args... args)
+	{
+		static_assert(sizeof...(Args) <= tracepoint_max_args, "too many arguments for a tracepoint");
+
+		u64 values[tracepoint_max_args] = { (u64)args... };
+		record(tp, values, sizeof...(Args));
+	}
+
+	/**
+	 * @brief Moves the records written since the last drain, from every core, into the buffer, which holds up to
+	 * max_records.  Returns the number moved.
+	 */
+	size_t drain(tracepoint_record *buffer, size_t max_records);
+
+	/**
+	 * @brief The most records that the next drain could return.
+	 */
+	size_t pending() const;
+
+	/**
+	 * @brief The number of records that have been overwritten before they could be drained.
+	 */
+	u64 lost() const { return __atomic_load_n(&lost_, __ATOMIC_RELAXED); }
+
+private:
+	struct per_core_ring {
+		tracepoint_record *records;
+		u64 head;
+		u64 tail;
+	};
+
+	per_core_ring cores_[arch::core_manager::max_cores];
+
+	// Held while draining, and while the rings are allocated.
+	sched::mutex drain_lock_;
+	u64 lost_;
+
+	void record(const tracepoint &tp, const u64 *args, u32 nr_args);
+};
+} // namespace stacsos::kernel
+
+/**
+ * Defines a tracepoint, e.g. DEFINE_TRACEPOINT(page_fault, "address=%llx").  The arguments are all printed as 64-bit
+ * numbers, and the format must be a literal.  The alignment is given explicitly, as the compiler would otherwise pad
+ * the tracepoints out, and the section couldn't be walked as an array.
+ */
+#define DEFINE_TRACEPOINT(name, format)                                                                                                                        \
+	::stacsos::kernel::tracepoint __tracepoint_##name __attribute__((section("__tracepoints"), used, aligned(8))) = { #name, format, false }
+
+/**
+ * Hits a tracepoint defined with DEFINE_TRACEPOINT, e.g. TRACEPOINT(page_fault, address).
+ */
+#define TRACEPOINT(name, ...)                                                                                                                                  \
+	do {                                                                                                                                                       \
+		if (__builtin_expect(__atomic_load_n(&__tracepoint_##name.enabled, __ATOMIC_RELAXED), 0)) {                                                            \
+			::stacsos::kernel::tracepoints::get().hit(__tracepoint_##name __VA_OPT__(, ) __VA_ARGS__);                                                         \
+		}                                                                                                                                                      \
+	} while (0)
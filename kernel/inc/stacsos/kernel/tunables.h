@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel/lock.h>
+#include <stacsos/list.h>
+
+namespace stacsos::kernel {
+enum class tunable_type { number, boolean };
+
+typedef void (*tunable_changed_fn)(u64 value, void *arg);
+
+/**
+ * @brief A setting that can be changed while the kernel is running.  Its value lives in a u64 that belongs to whatever
+ * it tunes, which reads it with a relaxed atomic load (or is told of each change by its callback, which runs in the
+ * context of the thread that made the change).  A number must be between min and max, inclusive, and a boolean is 0
+ * or 1.
+ */
+struct tunable {
+	// Slash-separated, e.g. "sched/quantum_ms", which is where it appears under /dev/tune.
+	const char *path;
+	tunable_type type;
+	u64 *value;
+	u64 min, max;
+
+	tunable_changed_fn changed;
+	void *changed_arg;
+};
+
+class tunable_listener {
+public:
+	virtual ~tunable_listener() { }
+
+	/**
+	 * @brief Called with the registry's lock held, so must not block.
+	 */
+	virtual void tunable_added(tunable &t) = 0;
+};
+
+/**
+ * @brief The registry of runtime tunables, which tunefs shows as a tree of files, one for each tunable, that read as
+ * its value, and are written to change it.
+ */
+class tunables {
+	DEFINE_SINGLETON(tunables)
+
+private:
+	tunables()
+		: listener_(nullptr)
+	{
+	}
+
+public:
+	/**
+	 * @brief Registers a number between min and max.  The path must stay valid for as long as the kernel runs (e.g. be a
+	 * string literal).
+	 */
+	void add_number(const char *path, u64 *value, u64 min, u64 max, tunable_changed_fn changed = nullptr, void *arg = nullptr)
+	{
+		add(new tunable { path, tunable_type::number, value, min, max, changed, arg });
+	}
+
+	void add_boolean(const char *path, u64 *value, tunable_changed_fn changed = nullptr, void *arg = nullptr)
+	{
+		add(new tunable { path, tunable_type::boolean, value, 0, 1, changed, arg });
+	}
+
+	/**
+	 * @brief Checks a new value against the tunable's type, and if it is valid, stores it and calls the tunable's
+	 * callback.  Returns false, changing nothing, if it isn't.
+	 */
+	bool set(tunable &t, u64 value);
+
+	u64 get(const tunable &t) const { return __atomic_load_n(t.value, __ATOMIC_RELAXED); }
+
+	/**
+	 * @brief Calls the listener with every tunable registered so far, and every one registered from now on.  Only one
+	 * listener is supported.
+	 */
+	void set_listener(tunable_listener &listener);
+
+private:
+	spinlock_irq lock_;
+	list<tunable *> tunables_;
+	tunable_listener *listener_;
+
+	void add(tunable *t);
+};
+} // namespace stacsos::kernel
@@ -7,13 +7,64 @@
  */
 #include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
 
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::arch::x86;
 
-void core_manager::init() { }
+void core_manager::init()
+{
+	const char *isolcpus = config::get().get_option("isolcpus");
+	if (isolcpus && *isolcpus) {
+		parse_isolated_cores(isolcpus);
+	}
+}
+
+void core_manager::parse_isolated_cores(const char *list)
+{
+	const char *p = list;
+
+	while (*p) {
+		u64 first = 0, last;
+		while (*p >= '0' && *p <= '9') {
+			first = (first * 10) + (*p++ - '0');
+		}
+
+		last = first;
+		if (*p == '-') {
+			p++;
+
+			last = 0;
+			while (*p >= '0' && *p <= '9') {
+				last = (last * 10) + (*p++ - '0');
+			}
+		}
+
+		if (*p && *p != ',') {
+			dprintf("cores: ignoring malformed isolcpus list '%s'\n", list);
+			isolated_mask_ = 0;
+			return;
+		}
+
+		for (u64 id = first; id <= last && id < max_cores; id++) {
+			isolated_mask_ |= 1ull << id;
+		}
+
+		if (*p) {
+			p++;
+		}
+	}
+
+	// Something has to do the housekeeping.
+	if (isolated_mask_ & 1) {
+		dprintf("cores: the boot core can't be isolated\n");
+		isolated_mask_ &= ~1ull;
+	}
+
+	dprintf("cores: isolated cores %llx\n", isolated_mask_);
+}
 
 void core_manager::go()
 {
@@ -33,7 +84,11 @@ void core_manager::go()
 		}
 
 		dprintf("starting core %d...\n", cores_[i]->id_);
-		//cores_[i]->status_ = cores_[i]->remote_run() ? core_status::online : core_status::error;
+		cores_[i]->status_ = cores_[i]->remote_run() ? core_status::online : core_status::error;
+
+		if (cores_[i]->status_ == core_status::error) {
+			dprintf("core %d failed to start\n", cores_[i]->id_);
+		}
 	}
 
 	// Start this core running
@@ -9,11 +9,22 @@
 #include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/arch/timer.h>
 #include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/fpu.h>
 #include <stacsos/kernel/arch/x86/machine-context.h>
+#include <stacsos/kernel/arch/x86/pmu.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/deferred-work.h>
+#include <stacsos/kernel/sched/rcu.h>
 #include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/kernel/sched/sched-trace.h>
+#include <stacsos/kernel/sched/scheduler.h>
+#include <stacsos/kernel/sched/softirq.h>
+#include <stacsos/kernel/sched/timer-queue.h>
+#include <stacsos/kernel/tracepoints.h>
+#include <stacsos/kernel/tunables.h>
 
 using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::arch::x86;
@@ -31,8 +42,12 @@ core &core::this_core()
 
 static void idle_thread()
 {
+	// Get on with any deferred work, then wait for something else to do -- a timer event, or a kick from another
+	// core that has made something runnable here.
 	while (true) {
-		__relax();
+		if (!deferred_work::get().run_pending()) {
+			core::this_core().idle();
+		}
 	}
 }
 
@@ -47,7 +62,7 @@ void core::run()
 	}
 
 	// Initialise the IDLE thread, for doing nothing when there are no tasks to run.
-	void *idle_thread_stack = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::zero)->base_address_ptr();
+	void *idle_thread_stack = zeroed_page_pool::get().allocate()->base_address_ptr();
 
 	idle_thread_.mcontext = (machine_context *)idle_thread_stack;
 	idle_thread_.mcontext->cs = KERNEL_CODE_SEGMENT_SELECTOR;
@@ -56,33 +71,163 @@ void core::run()
 	idle_thread_.mcontext->rip = (u64)idle_thread;
 	idle_thread_.mcontext->rsp = (u64)idle_thread_stack + PAGE_SIZE;
 	idle_thread_.mcontext->gs = (u64)&idle_thread_;
-	idle_thread_.cr3 = memory_manager::get().root_address_space().pgtable().effective_cr3();
+	idle_thread_.cr3 = memory_manager::get().root_address_space().cr3();
 	idle_thread_.kernel_stack = (u64)idle_thread_stack + PAGE_SIZE;
+	idle_thread_.active_cores = nullptr;
 
+	idle_thread_.on_cpu = true;
+	idle_thread_.core_id = id_;
 	set_current_tcb(&idle_thread_);
 
-	dprintf("core [%d]: run\n", id());
-	local_timer().start(100); // 100 Hz
+	tickless_ = memops::strcmp(config::get().get_option_or_default("tickless", "no"), "yes") == 0;
+	if (tickless_ && !local_timer().supports_deadline()) {
+		dprintf("core [%d]: timer does not support deadline mode, using periodic ticks\n", id());
+		tickless_ = false;
+	}
+
+	isolated_ = core_manager::get().is_isolated(id_);
+
+	dprintf("core [%d]: run%s%s\n", id(), tickless_ ? " (tickless)" : "", isolated_ ? " (isolated)" : "");
+
+	// Time stolen before the core started running tasks isn't charged to any of them.
+	last_stolen_ = stolen_time();
+
+	// The slice is also kept in cycles with periodic ticks, as that is what the other cores running a gang are told.
+	quantum_tsc_ = (quantum_ms_ * timestamp_frequency()) / 1000;
+	migration_cost_tsc_ = (config::get().get_option_u64_or_default("migration-cost-us", 500) * timestamp_frequency()) / 1000000;
+
+	if (tickless_) {
+		local_timer().start_deadline();
+		program_next_event(__builtin_ia32_rdtsc());
+	} else {
+		local_timer().start(tick_frequency);
+	}
 
 	// This will also enable interrupts, because the IF flag is set in rflags.
 	x86_return_to_task();
 	__unreachable();
 }
 
-void core::schedule()
+void core::set_quantum(u64 ms)
+{
+	quantum_ms_ = ms;
+	quantum_ticks_ = max((ms * tick_frequency) / 1000, 1ull);
+
+	// A core that isn't running yet works this out from quantum_ms_ when it starts.
+	quantum_tsc_ = (ms * timestamp_frequency()) / 1000;
+}
+
+// What sched/quantum_ms was last set to.  Each core reads its own copy of the quantum, so a change is copied to all of
+// them.
+static u64 tuned_quantum_ms;
+
+static void quantum_changed(u64 value, void *)
+{
+	for (auto *c : core_manager::get().cores()) {
+		c->set_quantum(value);
+	}
+}
+
+void core::add_tunables()
+{
+	tuned_quantum_ms = this_core().quantum_ms_;
+	tunables::get().add_number("sched/quantum_ms", &tuned_quantum_ms, 1, 1000, quantum_changed);
+}
+
+tcb *core::pick_next_task(tcb *current)
 {
-	tcb *current = get_current_tcb();
 	u64 now = __builtin_ia32_rdtsc();
 
+	u64 stolen_total = stolen_time();
+	u64 stolen = stolen_total - last_stolen_;
+	last_stolen_ = stolen_total;
+
 	if (current) {
-		// Update the current task's runtime.
+		// Update the current task's runtime, leaving out the time the core wasn't really running it.
 		u64 delta = now - current->start_time;
+		delta -= min(delta, stolen);
 		current->run_time += delta;
+		current->stop_time = now;
+
+		// If the task is in a system call, the time since it entered the kernel (or was last switched in) was
+		// spent in the kernel.
+		if (current->kernel_since) {
+			current->kernel_time += now - current->kernel_since;
+		}
+	}
+
+	// A task taken off the run queue by the last schedule has been switched out since, so it can now be
+	// handed over to a core it is allowed to run on.
+	push_migrating(current);
+
+	// Select the next task for execution, which will get a full time slice, unless it is one of a gang that another
+	// core is already running, when its slice ends along with the other core's.
+	tcb *next;
+	bool gang_follower = false;
+	{
+		unique_irq_lock l(runqueue_lock_);
+		drain_wake_list();
+
+		sched_trace::get().record_runqueue_depth(sched_alg_->nr_runnable());
+
+		const void *gang = gang_;
+		gang_ = nullptr;
+
+		next = nullptr;
+		if (gang && now < gang_until_) {
+			next = sched_alg_->select_gang_task(current, gang);
+		}
+
+		if (!next) {
+			next = sched_alg_->select_next_task(current);
+		}
+
+		// If a task's affinity has changed since it was placed here, take it off the run queue.  Only one
+		// task is held back at a time -- any others are moved on by later calls.
+		while (next && !migrating_ && !can_run_on(*next, id_)) {
+			sched_alg_->remove_from_runqueue(*next);
+			migrating_ = next;
+
+			next = sched_alg_->select_next_task(current);
+		}
+
+		running_ = next;
+
+		slice_ticks_ = quantum_ticks_;
+		slice_end_ = now + quantum_tsc_;
+		need_resched_ = false;
+
+		gang_follower = gang && next && next->gang == gang;
+		if (gang_follower) {
+			slice_end_ = min(slice_end_, gang_until_);
+			slice_ticks_ = max(((slice_end_ - now) * tick_frequency) / timestamp_frequency(), 1ull);
+		}
+
+		// With nothing else runnable here, the task can run without interruption until something else is.
+		bool alone = isolated_ && next && sched_alg_->nr_runnable() == 1;
+		if (alone && !tick_stopped_) {
+			local_timer().stop();
+			tick_stopped_ = true;
+		} else if (!alone && tick_stopped_) {
+			restart_tick(now);
+		}
+	}
+
+	push_migrating(current);
+
+	// A gang task that has been given a slice of its own has the rest of its gang run alongside it.
+	if (next && next->gang && !gang_follower) {
+		sched::scheduler::get().co_schedule(*next, slice_end_, *this);
+	}
+
+	// If there is nothing to run here, try and take some work from a busier core.
+	if (!next) {
+		core *victim = find_busiest_core();
+		if (victim) {
+			next = steal_task(*victim, current);
+		}
 	}
 
-	// Select the next task for execution
-	// TODO: Check task quantum expiry
-	tcb *next = sched_alg_->select_next_task(current);
 	if (!next) {
 		next = &idle_thread_;
 	}
@@ -90,10 +235,471 @@ void core::schedule()
 	// Update the next task's start time
 	next->start_time = now;
 
-	// Activate the task.
+	if (next->kernel_since) {
+		next->kernel_since = now;
+	}
+
+	if (tickless_ && !tick_stopped_) {
+		program_next_event(now);
+	}
+
+	return next;
+}
+
+void core::activate(tcb *current, tcb *next)
+{
+	if (next != current) {
+		// The task may have only just been switched out by another core, which could still be using its stack.
+		while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) {
+			__relax();
+		}
+
+		// The extended register state is switched eagerly, rather than lazily on first use, because a task's state
+		// would otherwise be left behind in the registers of whichever core it last ran on.  Kernel tasks don't have
+		// any, and the restore can be skipped if the registers still hold the next task's state from when it last
+		// ran here.
+		if (current && current->fpu_state) {
+			fpu::save(current->fpu_state);
+		}
+
+		if (next->fpu_state && !(fpu_owner_ == next && next->last_core == (u32)id_)) {
+			fpu::restore(next->fpu_state);
+			fpu_owner_ = next;
+		}
+
+		// Performance counters are only switched for tasks that are counting their own events.
+		if ((current && current->perf_state) || next->perf_state) {
+			pmu::switch_thread_counters(current ? (pmu_thread_counters *)current->perf_state : nullptr, (pmu_thread_counters *)next->perf_state);
+		}
+
+		next->on_cpu = true;
+		next->last_core = id_;
+
+		// The current task is let go of by the switching code, once it's no longer using the task's stack.
+		next->switched_from = current;
+
+		sched_trace::get().record_switch(current, *next);
+	}
+
+	rcu::get().note_quiescent();
+
+	// From here on, this_core_id() reads the ID through the next task's TCB.
+	next->core_id = id_;
 	set_current_tcb(next);
 }
 
+DEFINE_TRACEPOINT(sched_switch, "prev=%llx next=%llx");
+
+void core::schedule()
+{
+	// Called from an interrupt handler, so the current task's state is already saved in its trap frame, and
+	// the next task is switched to on the way out of the handler.
+	tcb *current = get_current_tcb();
+	tcb *next = pick_next_task(current);
+
+	if (current && next != current) {
+		current->nr_preemptions++;
+	}
+
+	if (next != current) {
+		TRACEPOINT(sched_switch, current, next);
+	}
+
+	activate(current, next);
+}
+
+extern "C" void x86_switch_to(tcb *prev, tcb *next);
+
+void core::reschedule()
+{
+	u64 flags = irq_save();
+
+	tcb *current = get_current_tcb();
+	tcb *next = pick_next_task(current);
+
+	if (next != current) {
+		current->nr_voluntary_switches++;
+		activate(current, next);
+
+		// This returns when the current task is next switched back in -- possibly on a different core, so
+		// nothing belonging to this core may be used afterwards.
+		x86_switch_to(current, next);
+	}
+
+	irq_restore(flags);
+}
+
+void core::tick()
+{
+	rcu::get().note_quiescent();
+
+	if (tickless_) {
+		u64 now = __builtin_ia32_rdtsc();
+		bool keep_running;
+
+		{
+			unique_irq_lock l(runqueue_lock_);
+			keep_running = running_ && !need_resched_ && now < slice_end_;
+		}
+
+		// The timer may have fired for a timer event rather than the end of the slice.
+		if (keep_running) {
+			program_next_event(now);
+			return;
+		}
+	} else {
+		unique_irq_lock l(runqueue_lock_);
+
+		// Let the current task carry on until its time slice has expired.  The idle thread has no slice,
+		// so an idle core re-checks for work (including work to steal) on every tick.
+		if (running_ && !need_resched_ && --slice_ticks_ > 0) {
+			return;
+		}
+	}
+
+	schedule();
+}
+
+void core::program_next_event(u64 now)
+{
+	// A running task needs to be stopped at the end of its slice.  An idle core still wakes up every
+	// so often, to look for work to steal from other cores.
+	u64 deadline = running_ ? slice_end_ : now + ((tickless_idle_poll_ms * timestamp_frequency()) / 1000);
+
+	// Isolated cores leave timers to the others.
+	if (isolated_) {
+		local_timer().set_deadline(deadline);
+		return;
+	}
+
+	// A timer that has expired, and that this core's bottom half is about to fire, doesn't need the timer to go off
+	// again for it.
+	u64 next_timer = timer_queue::get().next_deadline();
+	if (next_timer && next_timer < deadline && !(next_timer <= now && softirq::get().is_pending(softirq_vector::timer))) {
+		deadline = next_timer;
+	}
+
+	local_timer().set_deadline(deadline);
+}
+
+void core::timer_added()
+{
+	// An isolated core doesn't look at the queue, so a housekeeping core has to.
+	if (isolated_) {
+		core_manager::get().get_boot_core().kick();
+	} else if (tickless_ && !tick_stopped_) {
+		program_next_event(__builtin_ia32_rdtsc());
+	}
+}
+
+void core::restart_tick(u64 now)
+{
+	tick_stopped_ = false;
+
+	if (tickless_) {
+		local_timer().start_deadline();
+		program_next_event(now);
+	} else {
+		local_timer().start(tick_frequency);
+	}
+}
+
+void core::co_schedule(const void *gang, u64 until)
+{
+	unique_irq_lock l(runqueue_lock_);
+
+	// A gang that already has the core keeps it for the rest of its slice, so that two gangs can't keep taking cores
+	// from each other.
+	if (running_ && (running_->gang || running_->policy == sched_policy::fifo)) {
+		return;
+	}
+
+	gang_ = gang;
+	gang_until_ = until;
+	need_resched_ = true;
+
+	if (this_core_id() != id_) {
+		kick();
+	}
+}
+
+void core::add_to_runqueue(tcb &tcb)
+{
+	if (this_core_id() == id_) {
+		unique_irq_lock l(runqueue_lock_);
+		enqueue_task(tcb);
+
+		// The caller may have been moved to another core before interrupts were disabled.
+		if (need_resched_ && this_core_id() != id_) {
+			kick();
+		}
+
+		return;
+	}
+
+	tcb.wake_next = __atomic_load_n(&wake_list_, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&wake_list_, &tcb.wake_next, &tcb, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) { }
+
+	// Only the first wake-up needs to interrupt the core, because it will pick up everything on the list at once.
+	if (!tcb.wake_next) {
+		kick();
+	}
+}
+
+void core::handle_kick()
+{
+	// This may be a kick to end a grace period, rather than to look at the wake list.
+	rcu::get().note_quiescent();
+
+	bool resched;
+	{
+		unique_irq_lock l(runqueue_lock_);
+		drain_wake_list();
+
+		resched = need_resched_;
+	}
+
+	if (resched) {
+		schedule();
+	} else if (tickless_ && !tick_stopped_) {
+		// The kick may have been for a timer added by another core, which is due before the timer goes off here.
+		program_next_event(__builtin_ia32_rdtsc());
+	}
+}
+
+void core::handle_idle_kick()
+{
+	bool resched;
+	{
+		unique_irq_lock l(runqueue_lock_);
+		rcu::get().note_quiescent();
+		drain_wake_list();
+
+		resched = need_resched_;
+
+		// As with an interrupting kick, it may have been for a timer due before the timer goes off here.
+		if (!resched && tickless_ && !tick_stopped_) {
+			program_next_event(__builtin_ia32_rdtsc());
+		}
+	}
+
+	// The idle thread isn't in an interrupt handler, so it switches to the next task itself.
+	if (resched) {
+		reschedule();
+	}
+}
+
+void core::enqueue_task(tcb &tcb)
+{
+	sched_alg_->add_to_runqueue(tcb);
+
+	// If this core is idle, or the new task takes priority over the running one, there's no point in
+	// waiting for a time slice to expire, or for the next tick.
+	if (!running_ || sched_alg_->should_preempt(*running_, tcb)) {
+		need_resched_ = true;
+	}
+
+	// The task now shares the core, so the tick is needed again, to give each a slice.  A core that is woken up by
+	// another one restarts it when it reschedules.
+	if (tick_stopped_) {
+		need_resched_ = true;
+
+		if (this_core_id() == id_) {
+			restart_tick(__builtin_ia32_rdtsc());
+		} else {
+			kick();
+		}
+	}
+}
+
+void core::drain_wake_list()
+{
+	// Must be called with the run queue lock held.  The list is taken in one go, so that this can't race with other
+	// cores adding to it.
+	tcb *list = __atomic_exchange_n(&wake_list_, nullptr, __ATOMIC_ACQUIRE);
+
+	// Put the tasks on the run queue in the order they were woken.
+	tcb *ordered = nullptr;
+	while (list) {
+		tcb *next = list->wake_next;
+		list->wake_next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	while (ordered) {
+		tcb *next = ordered->wake_next;
+		ordered->wake_next = nullptr;
+
+		enqueue_task(*ordered);
+		ordered = next;
+	}
+}
+
+bool core::remove_from_runqueue(tcb &tcb)
+{
+	unique_irq_lock l(runqueue_lock_);
+
+	// The task may have only just been woken by another core, and not be on the run queue yet.
+	drain_wake_list();
+
+	// The entity may have been migrated to another core before the lock was acquired.
+	if (tcb.entity->owning_core_ != this) {
+		return false;
+	}
+
+	// A task waiting to be migrated is already off the run queue.
+	if (&tcb == migrating_) {
+		migrating_ = nullptr;
+		return true;
+	}
+
+	sched_alg_->remove_from_runqueue(tcb);
+
+	// A task that is no longer runnable must not see out the rest of its time slice.
+	if (&tcb == running_) {
+		need_resched_ = true;
+	}
+
+	return true;
+}
+
+bool core::set_priority(tcb &tcb, sched_policy policy, int priority)
+{
+	unique_irq_lock l(runqueue_lock_);
+
+	if (tcb.entity->owning_core_ != this) {
+		return false;
+	}
+
+	sched_alg_->set_priority(tcb, policy, priority);
+
+	// Whatever the change, the best task to run may now be a different one.
+	need_resched_ = true;
+	if (this_core_id() != id_) {
+		kick();
+	}
+
+	return true;
+}
+
+bool core::set_reservation(tcb &tcb, u64 runtime, u64 period, bool &admitted)
+{
+	unique_irq_lock l(runqueue_lock_);
+
+	if (tcb.entity->owning_core_ != this) {
+		return false;
+	}
+
+	admitted = sched_alg_->set_reservation(tcb, runtime, period);
+
+	if (admitted) {
+		need_resched_ = true;
+		if (this_core_id() != id_) {
+			kick();
+		}
+	}
+
+	return true;
+}
+
+core *core::find_busiest_core()
+{
+	auto &cm = core_manager::get();
+
+	core *busiest = nullptr;
+	unsigned int busiest_load = 1; // A core with a single task has nothing to spare.
+
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		core *c = cm.try_get_core(i);
+		if (!c || c == this || (c->status() != core_status::online && c->status() != core_status::bootstrap)) {
+			continue;
+		}
+
+		// This is only a hint, so it's read without taking the lock.
+		unsigned int load = c->nr_runnable();
+		if (load > busiest_load) {
+			busiest = c;
+			busiest_load = load;
+		}
+	}
+
+	return busiest;
+}
+
+tcb *core::steal_task(core &victim, tcb *current)
+{
+	// Both run queues are locked for the migration, so that the task is never off a run queue while its
+	// owning core changes.  The locks are always taken in core id order, to avoid deadlocking with a
+	// core trying to steal in the other direction.
+	core &first = id_ < victim.id_ ? *this : victim;
+	core &second = id_ < victim.id_ ? victim : *this;
+
+	unique_irq_lock l1(first.runqueue_lock_);
+	unique_irq_lock l2(second.runqueue_lock_);
+
+	// Only tasks whose caches have gone cold are taken.  A task waiting behind another one goes cold as it waits, so
+	// the load still evens out, just without moving a task away from what it has only just used.
+	u64 hot_since = __builtin_ia32_rdtsc() - migration_cost_tsc_;
+
+	tcb *stolen = victim.sched_alg_->steal_task(victim.running_, id_, hot_since);
+	if (stolen) {
+		stolen->nr_migrations++;
+		stolen->entity->owning_core_ = this;
+		sched_alg_->add_to_runqueue(*stolen);
+	}
+
+	// Something may have been woken up here in the meantime, so let the algorithm make the decision.
+	running_ = sched_alg_->select_next_task(current);
+	return running_;
+}
+
+void core::push_migrating(tcb *current)
+{
+	// The task can't be handed over while it is still the one executing here.
+	tcb *t = __atomic_load_n(&migrating_, __ATOMIC_ACQUIRE);
+	if (!t || t == current) {
+		return;
+	}
+
+	core &target = scheduler::get().select_core(t->affinity);
+
+	// The affinity may have been changed back again, in which case the task just goes back on the run queue.
+	if (&target == this) {
+		unique_irq_lock l(runqueue_lock_);
+
+		if (migrating_ == t) {
+			migrating_ = nullptr;
+			enqueue_task(*t);
+		}
+
+		return;
+	}
+
+	// The same lock ordering as for stealing, since the task must be on exactly one run queue (or held
+	// in migrating_) whenever another core looks at its owning core.
+	core &first = id_ < target.id_ ? *this : target;
+	core &second = id_ < target.id_ ? target : *this;
+
+	unique_irq_lock l1(first.runqueue_lock_);
+	unique_irq_lock l2(second.runqueue_lock_);
+
+	// The task may have been removed from the schedule in the meantime.
+	if (migrating_ != t) {
+		return;
+	}
+
+	migrating_ = nullptr;
+	t->nr_migrations++;
+	t->entity->owning_core_ = &target;
+	target.enqueue_task(*t);
+
+	// The target is interrupted whenever the task should run there straight away, not only when it is idle.
+	if (target.need_resched_) {
+		target.kick();
+	}
+}
+
 void core::update_clock()
 {
 	// Update the internal clock
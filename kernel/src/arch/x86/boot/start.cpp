@@ -7,9 +7,12 @@
  */
 #include <stacsos/kernel/arch/x86/boot/multiboot.h>
 #include <stacsos/kernel/arch/x86/cpuid.h>
+#include <stacsos/kernel/arch/x86/cregs.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/storage/ramdisk.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos;
@@ -26,6 +29,10 @@ extern void (*__init_array_end[])(void);
 extern char _BSS_START[], _BSS_END;
 }
 
+// Where %gs points until the boot core is initialised, so that this_core_id() works from the start.  Being in the
+// BSS, it says core zero.
+static sched::tcb boot_tcb;
+
 /**
  * Zeros the BSS section.
  */
@@ -48,11 +55,68 @@ static void run_static_constructors()
 	}
 }
 
+#define MULTIBOOT_INFO_MODS (1u << 3)
+
+// Only the first 12 GiB of physical memory are mapped while booting.
+static const u64 boot_mapped_limit = GB(12);
+
+static bool usable_for_boot_module(const multiboot_mmap_entry *mmap)
+{
+	return mmap->type == multiboot_mmap_entry_type::MMAP_ENTRY_TYPE_AVAILABLE && mmap->addr + mmap->len <= boot_mapped_limit;
+}
+
+/**
+ * Moves the first boot module (the ramdisk image) to the top of the highest block of available memory.  The loader
+ * puts modules straight after the kernel image, which is where the page descriptors are about to go.
+ *
+ * @return The physical address the module was moved to, or zero if there isn't one.
+ */
+static u64 relocate_boot_module(const multiboot_info *mbi, u64 &length)
+{
+	if (!(mbi->flags & MULTIBOOT_INFO_MODS) || !mbi->mods_count) {
+		return 0;
+	}
+
+	const multiboot_module_entry *mod = (const multiboot_module_entry *)phys_to_virt(mbi->mods_addr);
+	length = mod->mod_end - mod->mod_start;
+
+	u64 mmap_start = (u64)phys_to_virt(mbi->mmap_addr);
+	u64 mmap_end = mmap_start + mbi->mmap_length;
+
+	u64 destination = 0;
+	for (u64 p = mmap_start; p < mmap_end; p += ((multiboot_mmap_entry *)p)->size + sizeof(u32)) {
+		const multiboot_mmap_entry *mmap = (const multiboot_mmap_entry *)p;
+		if (!usable_for_boot_module(mmap) || mmap->len < PAGE_ALIGN_UP(length)) {
+			continue;
+		}
+
+		destination = max(destination, (mmap->addr + mmap->len - PAGE_ALIGN_UP(length)) & ~(u64)(PAGE_SIZE - 1));
+	}
+
+	if (!destination) {
+		dprintf("boot: no room for the boot module\n");
+		return 0;
+	}
+
+	// The destination is above the module, so it is copied from the end, in case they overlap.
+	const u8 *src = (const u8 *)phys_to_virt(mod->mod_start);
+	u8 *dst = (u8 *)phys_to_virt(destination);
+	for (u64 i = length; i > 0; i--) {
+		dst[i - 1] = src[i - 1];
+	}
+
+	dprintf("boot: module of %llu bytes moved from %x to %llx\n", length, mod->mod_start, destination);
+	return destination;
+}
+
 /**
  * Initialises memory, by scanning the memory blocks that were provided to us by the multiboot loader.
  */
 static void initialise_memory(const multiboot_info *mbi)
 {
+	u64 module_length = 0;
+	u64 module_start = relocate_boot_module(mbi, module_length);
+
 	void *mmap_start = phys_to_virt(mbi->mmap_addr);
 	void *mmap_end = (void *)((uintptr_t)mmap_start + mbi->mmap_length);
 
@@ -60,11 +124,23 @@ static void initialise_memory(const multiboot_info *mbi)
 	multiboot_mmap_entry *mmap = (multiboot_mmap_entry *)mmap_start;
 	while ((uintptr_t)mmap < (uintptr_t)mmap_end) {
 		if (mmap->addr < 0xfd00000000) {
-			memory_manager::add_memory_block(mmap->addr, mmap->len, mmap->type == multiboot_mmap_entry_type::MMAP_ENTRY_TYPE_AVAILABLE);
+			bool avail = mmap->type == multiboot_mmap_entry_type::MMAP_ENTRY_TYPE_AVAILABLE;
+
+			// The boot module is at the top of its block, which is cut short, and the module's pages are reserved.
+			if (module_start && avail && module_start >= mmap->addr && module_start < mmap->addr + mmap->len) {
+				memory_manager::add_memory_block(mmap->addr, module_start - mmap->addr, true);
+				memory_manager::add_memory_block(module_start, mmap->addr + mmap->len - module_start, false);
+			} else {
+				memory_manager::add_memory_block(mmap->addr, mmap->len, avail);
+			}
 		}
 
 		mmap = (multiboot_mmap_entry *)((uintptr_t)mmap + mmap->size + sizeof(mmap->size));
 	}
+
+	if (module_start) {
+		dev::storage::ramdisk::set_boot_image(module_start, module_length);
+	}
 }
 
 /* Command-line Handling */
@@ -105,6 +181,9 @@ static void check_arch_support()
 		abort();
 	}
 #endif
+
+	// The kernel doesn't save its own vector registers when it switches threads, so AVX2 is never used in it.
+	native_memops::select_features(c.get_feature(cpuid_features::erms) ? memops_features::erms : memops_features::none);
 }
 
 /* Architecture-indepentent kernel entry point */
@@ -123,6 +202,8 @@ extern "C" __noreturn void x86_start(const multiboot_info *multiboot_info)
 	// Clear the BSS section.
 	zero_bss();
 
+	gsbase::write((u64)&boot_tcb);
+
 	// Run C++ static constructors.
 	run_static_constructors();
 
@@ -220,6 +220,17 @@ bool interrupt_descriptor_table<MAX_NR_IDT_ENTRIES>::register_trap_gate(int inde
 	return true;
 }
 
+/**
+ * Makes the gate at the given index switch to an interrupt stack.
+ * @param index The index of the gate in the IDT.
+ * @param ist The number of the interrupt stack in the TSS, or zero for none.
+ */
+template <int MAX_NR_IDT_ENTRIES> void interrupt_descriptor_table<MAX_NR_IDT_ENTRIES>::set_interrupt_stack(int index, u8 ist)
+{
+	// The IST field is the low three bits of the fifth byte of the gate.
+	idt_[index].low = (idt_[index].low & ~(7ull << 32)) | ((u64)(ist & 7) << 32);
+}
+
 /**
  * Initialises the TSS by loading the task register (TR) with the selector of
  * the TSS descriptor in the GDT.
@@ -247,5 +258,12 @@ void task_state_segment::set_kernel_stack(uintptr_t stack)
 	fields[0] = (u64)stack;
 }
 
+void task_state_segment::set_interrupt_stack(int ist, uintptr_t stack)
+{
+	// IST1 comes after RSP0-2 and a reserved field.
+	u64 *fields = (u64 *)((uintptr_t)tss_ + 4);
+	fields[3 + ist] = (u64)stack;
+}
+
 template class global_descriptor_table<16>;
 template class interrupt_descriptor_table<256>;
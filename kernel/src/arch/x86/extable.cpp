@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/extable.h>
+
+using namespace stacsos::kernel::arch::x86;
+
+extern "C" const extable_entry __ex_table_start[], __ex_table_end[];
+
+u64 extable::find_fixup(u64 fault_ip)
+{
+	// There are only a handful of entries, so they are simply searched in turn.
+	for (const extable_entry *e = __ex_table_start; e < __ex_table_end; e++) {
+		if (e->fault_ip == fault_ip) {
+			return e->fixup_ip;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/cpuid.h>
+#include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/fpu.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::arch::x86;
+
+fpu_save_mode fpu::mode_ = fpu_save_mode::fxsave;
+u64 fpu::xcr0_ = 0;
+u32 fpu::state_size_ = 0;
+void *fpu::initial_state_ = nullptr;
+
+// The state components that are switched: x87, SSE and the upper halves of the AVX registers.
+static const u64 xcr0_x87 = 1 << 0;
+static const u64 xcr0_sse = 1 << 1;
+static const u64 xcr0_avx = 1 << 2;
+
+void fpu::init_core()
+{
+	cpuid c;
+	c.initialise();
+
+	bool has_xsave = c.get_feature(cpuid_features::xsave);
+
+	if (has_xsave) {
+		cr4::write(cr4::read() | cr4_flags::OSXSAVE);
+
+		u32 eax = 0xd, ebx = 0, ecx = 0, edx = 0;
+		__cpuid(eax, ebx, ecx, edx);
+
+		u64 xcr0 = (eax | ((u64)edx << 32)) & (xcr0_x87 | xcr0_sse | xcr0_avx);
+		asm volatile("xsetbv" ::"c"(0), "a"((u32)xcr0), "d"((u32)(xcr0 >> 32)));
+
+		xcr0_ = xcr0;
+	}
+
+	// The rest only needs doing once, and every core is the same.
+	if (initial_state_) {
+		return;
+	}
+
+	if (has_xsave) {
+		// With the components enabled, EBX is the size of the area needed to save them.
+		u32 eax = 0xd, ebx = 0, ecx = 0, edx = 0;
+		__cpuid(eax, ebx, ecx, edx);
+
+		state_size_ = ebx;
+		mode_ = c.get_feature(cpuid_features::xsaveopt) ? fpu_save_mode::xsaveopt : fpu_save_mode::xsave;
+	} else {
+		state_size_ = 512;
+		mode_ = fpu_save_mode::fxsave;
+	}
+
+	// New threads start with the state of a freshly reset FPU, with all floating-point exceptions masked.
+	u32 mxcsr = 0x1f80;
+	asm volatile("fninit; ldmxcsr %0" ::"m"(mxcsr));
+
+	void *initial = create_state();
+	save(initial);
+	initial_state_ = initial;
+
+	benchmark();
+}
+
+void *fpu::create_state()
+{
+	// The XSAVE instructions need the area to be 64-byte aligned, which the object allocator doesn't promise.  The
+	// distance from the start of the allocation is kept in the byte before the area, so that it can be freed.
+	u8 *raw = new u8[state_size_ + 64];
+	u8 *state = (u8 *)(((uintptr_t)raw + 64) & ~63ull);
+	state[-1] = (u8)(state - raw);
+
+	if (initial_state_) {
+		memops::memcpy(state, initial_state_, state_size_);
+	} else {
+		memops::bzero(state, state_size_);
+	}
+
+	return state;
+}
+
+void fpu::destroy_state(void *state)
+{
+	u8 *area = (u8 *)state;
+	delete[] (area - area[-1]);
+}
+
+void fpu::benchmark()
+{
+	const int iterations = 1000;
+
+	void *state = create_state();
+	restore(state);
+
+	// With nothing changed since the restore, XSAVEOPT can skip writing almost everything, which is the common case
+	// when switching between threads that don't use floating-point at all.
+	u64 start = __builtin_ia32_rdtsc();
+	for (int i = 0; i < iterations; i++) {
+		save(state);
+		restore(state);
+	}
+	u64 clean = (__builtin_ia32_rdtsc() - start) / iterations;
+
+	// Touching the SSE registers forces them to be written out every time.
+	start = __builtin_ia32_rdtsc();
+	for (int i = 0; i < iterations; i++) {
+		asm volatile("pxor %%xmm0, %%xmm0" ::: "memory");
+		save(state);
+		restore(state);
+	}
+	u64 dirty = (__builtin_ia32_rdtsc() - start) / iterations;
+
+	restore(initial_state_);
+
+	const char *mode_name = mode_ == fpu_save_mode::xsaveopt ? "xsaveopt" : (mode_ == fpu_save_mode::xsave ? "xsave" : "fxsave");
+	dprintf("fpu: %s, xcr0=%llx, %u byte state, save+restore %llu cycles (unmodified), %llu cycles (modified)\n", mode_name, xcr0_,
+		state_size_, clean, dirty);
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/hpet.h>
+#include <stacsos/kernel/debug.h>
+
+using namespace stacsos::kernel::arch::x86;
+
+// The counter period is given in femtoseconds, and is at most 100 ns.
+static const u64 femtoseconds_per_second = 1000000000000000ull;
+static const u64 max_period_fs = 100000000ull;
+
+void hpet::init(u64 base_address)
+{
+	volatile u64 *regs = (volatile u64 *)phys_to_virt(base_address);
+
+	u64 period_fs = regs[capabilities_reg] >> 32;
+	if (period_fs == 0 || period_fs > max_period_fs) {
+		dprintf("hpet: invalid counter period %llu fs\n", period_fs);
+		return;
+	}
+
+	// Setting the enable bit starts the main counter.
+	regs[configuration_reg] = regs[configuration_reg] | 1;
+
+	regs_ = regs;
+	frequency_ = femtoseconds_per_second / period_fs;
+
+	dprintf("hpet: counter frequency=%llu\n", frequency_);
+}
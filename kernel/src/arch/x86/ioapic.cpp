@@ -6,6 +6,7 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/arch/x86/ioapic.h>
+#include <stacsos/kernel/arch/x86/irq/irq-affinity.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/memops.h>
@@ -43,10 +44,29 @@ void ioapic::store_redir_entry(u8 irq_index, const redirection_entry &e)
 	write(configuration_register + 1, e.high);
 }
 
-void ioapic::allocate_physical_irq(u32 phys_irq_nr, x86_core &target_core, irq_handler_fn handler_fn, void *handler_fn_arg)
+/*
+ * A physical interrupt, which is moved by rewriting its redirection entry.
+ */
+class ioapic_irq_source : public irq_source {
+public:
+	ioapic_irq_source(ioapic &owner, u32 phys_irq_nr, const char *name, irq_handler_fn handler, void *arg)
+		: irq_source(name, handler, arg)
+		, owner_(owner)
+		, phys_irq_nr_(phys_irq_nr)
+	{
+	}
+
+protected:
+	virtual void route(x86_core &target, u8 vector) override { owner_.map_physical_irq(phys_irq_nr_, target, vector); }
+
+private:
+	ioapic &owner_;
+	u32 phys_irq_nr_;
+};
+
+void ioapic::allocate_physical_irq(u32 phys_irq_nr, x86_core &target_core, irq_handler_fn handler_fn, void *handler_fn_arg, const char *name)
 {
-	u8 allocated_irq = target_core.irqmgr().allocate_irq(handler_fn, handler_fn_arg);
-	map_physical_irq(phys_irq_nr, target_core, allocated_irq);
+	irq_affinity::get().add(*new ioapic_irq_source(*this, phys_irq_nr, name, handler_fn, handler_fn_arg), target_core);
 }
 
 void ioapic::map_physical_irq(u32 phys_irq_nr, x86_core &target_core, u8 target_irq_nr)
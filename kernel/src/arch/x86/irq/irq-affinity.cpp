@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/irq/irq-affinity.h>
+#include <stacsos/kernel/arch/x86/smp-call.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/debug.h>
+
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::arch::x86::irq;
+using namespace stacsos::kernel::sched;
+
+bool irq_affinity::add(irq_source &source, x86_core &target)
+{
+	source.core_id_ = target.id();
+	source.vector_ = target.irqmgr().allocate_irq(source.handler_, source.arg_, source.name_);
+	source.route(target, source.vector_);
+
+	unique_irq_lock l(add_lock_);
+
+	// The interrupt is still delivered if there's no room for it, but it can't be moved.
+	if (nr_sources_ >= max_sources) {
+		return false;
+	}
+
+	source.id_ = nr_sources_;
+	sources_[nr_sources_] = &source;
+	__atomic_store_n(&nr_sources_, nr_sources_ + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+struct vector_release {
+	x86_core *owner;
+	u8 vector;
+};
+
+static void release_vector(void *arg)
+{
+	vector_release *r = (vector_release *)arg;
+
+	// An interrupt sent before the source was moved may still be waiting to be delivered here, in which case the
+	// vector is left allocated, so the handler still runs for it, rather than the interrupt being lost.
+	if (r->owner->lapic().is_pending(r->vector)) {
+		dprintf("irq: vector %u on core %u still pending, not released\n", r->vector, r->owner->id());
+		return;
+	}
+
+	r->owner->irqmgr().free_irq(r->vector);
+}
+
+bool irq_affinity::set_affinity(unsigned int source_id, int core_id)
+{
+	irq_source *s = source(source_id);
+	if (!s) {
+		return false;
+	}
+
+	core *c = core_manager::get().try_get_core(core_id);
+	if (!c || (c->status() != core_status::online && c->status() != core_status::bootstrap)) {
+		return false;
+	}
+
+	x86_core &target = (x86_core &)*c;
+
+	mutex_lock l(move_lock_);
+
+	if (s->core_id_ == core_id) {
+		return true;
+	}
+
+	vector_release old { (x86_core *)&core_manager::get().get_core(s->core_id_), s->vector_ };
+
+	// The same vector is used on the new core, if it is free there, so that an MSI that can't be masked only has its
+	// address changed, which is a single write.
+	u8 vector = old.vector;
+	if (!target.irqmgr().try_reserve_irq(vector, s->handler_, s->arg_, s->name_)) {
+		vector = target.irqmgr().allocate_irq(s->handler_, s->arg_, s->name_);
+	}
+
+	s->route(target, vector);
+
+	__atomic_store_n(&s->core_id_, core_id, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->vector_, vector, __ATOMIC_RELAXED);
+
+	dprintf("irq: %s moved from vector %u on core %u to vector %u on core %u\n", s->name_ ? s->name_ : "?", old.vector,
+		old.owner->id(), vector, core_id);
+
+	// The old vector is given back by its own core, as only that core can see whether it is still pending.
+	smp_call_function(1ull << old.owner->id(), release_vector, &old, true);
+
+	return true;
+}
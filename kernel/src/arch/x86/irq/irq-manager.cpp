@@ -55,12 +55,12 @@ static void unhandled_interrupt(u8 irq_number, void *mcontext, void *arg)
 {
 	machine_context *mc = (machine_context *)mcontext;
 	auto &thread = stacsos::kernel::sched::thread::current();
-	dprintf("[%u] unhandled irq %u RIP=%p TASK=%p\n", stacsos::kernel::arch::core::this_core_id(), irq_number, mc->rip, &thread);
+	dprintf("[%u] unhandled irq %u RIP=%p TASK=%p\n", stacsos::kernel::arch::core::this_core_id(), irq_number, (void *)mc->rip, &thread);
 	mc->dump();
 
 	u64 *ptr = (u64 *)mc->rbp;
 	while (*ptr) {
-		dprintf("Ret Addr=%p\n", ptr[1]);
+		dprintf("Ret Addr=%p\n", (void *)ptr[1]);
 		ptr = (u64 *)ptr[0];
 	}
 
@@ -80,36 +80,69 @@ template <int NR_IRQS> void irq_manager<NR_IRQS>::initialise()
 		idt_.register_interrupt_gate(i, (uintptr_t)irq_trap_functions[i], 8, descriptor_privilege_level::ring0);
 		handlers_[i] = unhandled_interrupt;
 		handler_args_[i] = nullptr;
+		names_[i] = nullptr;
+		counts_[i] = 0;
 	}
 
 	// Reload the IDT
 	idt_.reload();
 }
 
-template <int NR_IRQS> void irq_manager<NR_IRQS>::assign_irq(u8 irq_number, irq_handler_fn handler, void *arg)
+template <int NR_IRQS> void irq_manager<NR_IRQS>::assign_irq(u8 irq_number, irq_handler_fn handler, void *arg, const char *name)
 {
 	// Store the handler in the metadata structure.
 	handlers_[irq_number] = handler;
 	handler_args_[irq_number] = arg;
+	names_[irq_number] = name;
 }
 
-template <int NR_IRQS> void irq_manager<NR_IRQS>::reserve_irq(u8 irq_number, irq_handler_fn handler, void *arg)
+template <int NR_IRQS> void irq_manager<NR_IRQS>::reserve_irq(u8 irq_number, irq_handler_fn handler, void *arg, const char *name)
 {
+	unique_irq_lock l(lock_);
+
 	if (used_irq_[irq_number]) {
 		panic("IRQ # already reserved");
 	}
 
 	used_irq_[irq_number] = true;
-	assign_irq(irq_number, handler, arg);
+	assign_irq(irq_number, handler, arg, name);
+}
+
+template <int NR_IRQS> bool irq_manager<NR_IRQS>::try_reserve_irq(u8 irq_number, irq_handler_fn handler, void *arg, const char *name)
+{
+	unique_irq_lock l(lock_);
+
+	if (used_irq_[irq_number]) {
+		return false;
+	}
+
+	used_irq_[irq_number] = true;
+	assign_irq(irq_number, handler, arg, name);
+	return true;
+}
+
+template <int NR_IRQS> void irq_manager<NR_IRQS>::free_irq(u8 irq_number)
+{
+	unique_irq_lock l(lock_);
+
+	assign_irq(irq_number, unhandled_interrupt, nullptr);
+	used_irq_[irq_number] = false;
 }
 
-template <int NR_IRQS> u8 irq_manager<NR_IRQS>::allocate_irq(irq_handler_fn handler, void *arg)
+template <int NR_IRQS> u8 irq_manager<NR_IRQS>::allocate_irq(irq_handler_fn handler, void *arg, const char *name)
 {
-	// Find a free IRQ number, and reserve it.
-	u64 irq = used_irq_.find_first_zero();
-	reserve_irq(irq, handler, arg);
+	u64 irq;
+
+	{
+		unique_irq_lock l(lock_);
+
+		// Find a free IRQ number, and reserve it.
+		irq = used_irq_.find_first_zero();
+		used_irq_[irq] = true;
+		assign_irq(irq, handler, arg, name);
+	}
 
-	dprintf("irq: allocated %d\n", irq);
+	dprintf("irq: allocated %llu\n", irq);
 
 	// Return the IRQ number that was just allocated.
 	return (u8)irq;
@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/cpuid.h>
+#include <stacsos/kernel/arch/x86/kvm.h>
+#include <stacsos/kernel/arch/x86/msr.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::mem;
+
+u32 kvm::base_;
+u32 kvm::features_;
+u64 kvm::tsc_frequency_;
+kvm::core_areas *kvm::areas_[core_manager::max_cores];
+
+// KVM's signature ("KVMKVMKVM\0\0\0" in ebx, ecx and edx), which may be at any multiple of 0x100 into the hypervisor's
+// CPUID range, if another hypervisor's interface comes first.
+static const u32 cpuid_hypervisor_base = 0x40000000;
+static const u32 cpuid_hypervisor_end = 0x40010000;
+static const u32 kvm_signature_ebx = 0x4b4d564b;
+static const u32 kvm_signature_ecx = 0x564b4d56;
+static const u32 kvm_signature_edx = 0x4d;
+
+// The features leaf (at the base + 1) in eax.
+#define KVM_FEATURE_CLOCKSOURCE2 (1u << 3)
+#define KVM_FEATURE_STEAL_TIME (1u << 5)
+
+static const u32 msr_kvm_system_time_new = 0x4b564d01;
+static const u32 msr_kvm_steal_time = 0x4b564d03;
+static const u64 kvm_msr_enabled = 1;
+
+void kvm::detect()
+{
+	u32 features = 1, ebx = 0, ecx = 0, edx = 0;
+	__cpuid(features, ebx, ecx, edx);
+
+	// The hypervisor bit.
+	if (!(ecx & (1u << 31))) {
+		return;
+	}
+
+	for (u32 leaf = cpuid_hypervisor_base; leaf < cpuid_hypervisor_end; leaf += 0x100) {
+		u32 eax = leaf;
+		ebx = ecx = edx = 0;
+		__cpuid(eax, ebx, ecx, edx);
+
+		if (ebx == kvm_signature_ebx && ecx == kvm_signature_ecx && edx == kvm_signature_edx) {
+			base_ = leaf;
+
+			features_ = leaf + 1;
+			ebx = ecx = edx = 0;
+			__cpuid(features_, ebx, ecx, edx);
+
+			dprintf("kvm: cpuid base=%x features=%x\n", base_, features_);
+			return;
+		}
+	}
+}
+
+void kvm::init_core(int core)
+{
+	// The bootstrap core comes first, and finds out for every core.
+	if (!core) {
+		detect();
+	}
+
+	if (!(features_ & (KVM_FEATURE_CLOCKSOURCE2 | KVM_FEATURE_STEAL_TIME))) {
+		return;
+	}
+
+	page *pg = zeroed_page_pool::get().allocate();
+	if (!pg) {
+		return;
+	}
+
+	core_areas *areas = (core_areas *)pg->base_address_ptr();
+	u64 phys = pg->base_address();
+
+	if (features_ & KVM_FEATURE_CLOCKSOURCE2) {
+		msr::write((msr_indicies)msr_kvm_system_time_new, (phys + __builtin_offsetof(core_areas, clock)) | kvm_msr_enabled);
+
+		// The host fills the clock in as soon as it is registered.  A tick lasts mul / 2^(32 - shift) nanoseconds.
+		const volatile pvclock_time_info &clock = areas->clock;
+		if (!core && clock.tsc_to_system_mul) {
+			u64 frequency = (1'000'000'000ull << 32) / clock.tsc_to_system_mul;
+			tsc_frequency_ = clock.tsc_shift >= 0 ? frequency >> clock.tsc_shift : frequency << -clock.tsc_shift;
+		}
+	}
+
+	if (features_ & KVM_FEATURE_STEAL_TIME) {
+		msr::write((msr_indicies)msr_kvm_steal_time, (phys + __builtin_offsetof(core_areas, steal)) | kvm_msr_enabled);
+	}
+
+	__atomic_store_n(&areas_[core], areas, __ATOMIC_RELEASE);
+}
+
+u64 kvm::steal_ns(int core)
+{
+	if (!(features_ & KVM_FEATURE_STEAL_TIME) || !areas_[core]) {
+		return 0;
+	}
+
+	const volatile kvm_steal_time &st = areas_[core]->steal;
+
+	// The version is odd while the host is updating the count.
+	u32 version;
+	u64 steal;
+	do {
+		version = st.version;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		steal = st.steal;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((version & 1) || version != st.version);
+
+	return steal;
+}
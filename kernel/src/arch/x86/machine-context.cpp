@@ -16,16 +16,16 @@ static const char *FLAG_CODES[]
 void machine_context::dump() const
 {
 	dprintf("MACHINE CONTEXT %p\n", this);
-	dprintf("RAX=%016lx    RCX=%016lx\n", rax, rcx);
-	dprintf("RDX=%016lx    RBX=%016lx\n", rdx, rbx);
-	dprintf("RDI=%016lx    RSI=%016lx\n", rdi, rsi);
-	dprintf("RBP=%016lx    RSP=%016lx\n", rbp, rsp);
-	dprintf("R8 =%016lx    R9 =%016lx\n", r8, r9);
-	dprintf("R10=%016lx    R11=%016lx\n", r10, r11);
-	dprintf("R12=%016lx    R13=%016lx\n", r12, r13);
-	dprintf("R14=%016lx    R15=%016lx\n", r14, r15);
-	dprintf("FS =%016lx    GS =%016lx\n", fs, gs);
-	dprintf("RFLAGS=%08lx ", rflags);
+	dprintf("RAX=%016llx    RCX=%016llx\n", rax, rcx);
+	dprintf("RDX=%016llx    RBX=%016llx\n", rdx, rbx);
+	dprintf("RDI=%016llx    RSI=%016llx\n", rdi, rsi);
+	dprintf("RBP=%016llx    RSP=%016llx\n", rbp, rsp);
+	dprintf("R8 =%016llx    R9 =%016llx\n", r8, r9);
+	dprintf("R10=%016llx    R11=%016llx\n", r10, r11);
+	dprintf("R12=%016llx    R13=%016llx\n", r12, r13);
+	dprintf("R14=%016llx    R15=%016llx\n", r14, r15);
+	dprintf("FS =%016llx    GS =%016llx\n", fs, gs);
+	dprintf("RFLAGS=%08llx ", rflags);
 
 	for (unsigned int i = 0; i < sizeof(FLAG_CODES) / sizeof(FLAG_CODES[0]); i++) {
 		if (rflags & (1 << i)) {
@@ -35,6 +35,6 @@ void machine_context::dump() const
 
 	dprintf("\n");
 
-	dprintf("CS=%04lx  SS=%04lx\n", cs, ss);
-	dprintf("RIP=%016lx\n", rip);
+	dprintf("CS=%04llx  SS=%04llx\n", cs, ss);
+	dprintf("RIP=%016llx\n", rip);
 }
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/cpuid.h>
+#include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/pcid.h>
+#include <stacsos/kernel/debug.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+
+bool pcid::enabled_ = false;
+bool pcid::has_invpcid_ = false;
+spinlock_irq pcid::lock_;
+hierarchical_bitset pcid::allocated_;
+u64 pcid::allocated_storage_[hierarchical_bitset::storage_words(max_pcids)];
+u16 pcid::next_hint_ = 1;
+u64 pcid::stale_[core_manager::max_cores][max_pcids / 64];
+
+static const u64 cr3_no_flush = 1ull << 63;
+static const u64 cr3_pcid_mask = 0xfff;
+
+static void invpcid(u64 type, u16 id, u64 address)
+{
+	struct {
+		u64 pcid;
+		u64 address;
+	} desc = { id, address };
+
+	asm volatile("invpcid %0, %1" ::"m"(desc), "r"(type) : "memory");
+}
+
+void pcid::init_core()
+{
+	cpuid c;
+	c.initialise();
+
+	// Kernel mappings are marked global, so that they survive loading a different address space.
+	if (c.get_feature(cpuid_features::pge)) {
+		cr4::write(cr4::read() | cr4_flags::PGE);
+	}
+
+	bool supported = c.get_feature(cpuid_features::pcid);
+
+	// Every core is the same, so the first one decides.
+	static bool decided = false;
+	if (!decided) {
+		decided = true;
+		enabled_ = supported;
+		has_invpcid_ = supported && c.get_feature(cpuid_features::invpcid);
+
+		// PCID 0 is never handed out.
+		allocated_.init(max_pcids, allocated_storage_);
+		allocated_.set(0);
+
+		dprintf("pcid: %s%s\n", enabled_ ? "enabled" : "not supported", has_invpcid_ ? ", with invpcid" : "");
+	}
+
+	if (enabled_) {
+		cr4::write(cr4::read() | cr4_flags::PCIDE);
+	}
+}
+
+u16 pcid::allocate()
+{
+	if (!enabled_) {
+		return 0;
+	}
+
+	unique_irq_lock l(lock_);
+
+	u64 id = allocated_.find_first_zero(next_hint_);
+	if (id == hierarchical_bitset::npos) {
+		return 0;
+	}
+
+	allocated_.set(id);
+	next_hint_ = (id + 1) % max_pcids;
+
+	// Any core may still have entries from the last address space that had this PCID.
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		mark_stale_on(i, id);
+	}
+
+	return id;
+}
+
+void pcid::free(u16 id)
+{
+	if (!id) {
+		return;
+	}
+
+	unique_irq_lock l(lock_);
+	allocated_.clear(id);
+}
+
+u64 pcid::cr3_for(u64 cr3)
+{
+	u16 id = cr3 & cr3_pcid_mask;
+	if (!id) {
+		return cr3;
+	}
+
+	u64 &word = stale_[core::this_core_id()][id / 64];
+	u64 bit = 1ull << (id % 64);
+
+	if (__atomic_load_n(&word, __ATOMIC_ACQUIRE) & bit) {
+		__atomic_fetch_and(&word, ~bit, __ATOMIC_ACQ_REL);
+		return cr3;
+	}
+
+	return cr3 | cr3_no_flush;
+}
+
+void pcid::flush_local(u16 id)
+{
+	if (has_invpcid_) {
+		// Single-context invalidation.
+		invpcid(1, id, 0);
+	} else if ((cr3::read() & cr3_pcid_mask) == id) {
+		// Reloading CR3 without the no-flush bit drops every (non-global) entry for the PCID.
+		cr3::write(cr3::read() & ~cr3_no_flush);
+	} else {
+		mark_stale_on(core::this_core_id(), id);
+	}
+}
+
+void pcid::flush_local_page(u16 id, u64 address)
+{
+	if ((cr3::read() & cr3_pcid_mask) == id) {
+		asm volatile("invlpg (%0)" ::"r"(address) : "memory");
+	} else if (has_invpcid_) {
+		// Individual-address invalidation.
+		invpcid(0, id, address);
+	} else {
+		mark_stale_on(core::this_core_id(), id);
+	}
+}
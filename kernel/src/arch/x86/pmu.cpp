@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/cpuid.h>
+#include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/msr.h>
+#include <stacsos/kernel/arch/x86/pmu.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+
+u64 pmu::period_[core_manager::max_cores];
+bool pmu::user_rdpmc_[core_manager::max_cores];
+unsigned int pmu::version_;
+unsigned int pmu::width_;
+u32 pmu::events_;
+unsigned int pmu::thread_counters_;
+bool pmu::full_width_writes_;
+
+static const u32 cpuid_pmu_leaf = 0xa;
+
+// The architectural events, by their bit in CPUID leaf 0xa's EBX, and their event select and unit mask.
+struct architectural_event {
+	unsigned int bit;
+	u64 encoding;
+};
+
+// They are in the order of perf_event.
+static const architectural_event architectural_events[] = {
+	{ 0, 0x003c }, // Unhalted core cycles
+	{ 1, 0x00c0 }, // Instructions retired
+	{ 4, 0x412e }, // Last level cache misses
+	{ 6, 0x00c5 }, // Branch mispredicts retired
+};
+
+static const u64 evtsel_usr = 1ull << 16;
+static const u64 evtsel_os = 1ull << 17;
+static const u64 evtsel_int = 1ull << 20;
+static const u64 evtsel_enable = 1ull << 22;
+
+// The local APIC's performance counter entry: delivered as an NMI, or masked.
+static const u64 lvt_nmi = 0x400;
+static const u64 lvt_masked = 0x10000;
+
+// Writes to the legacy counter MSR only set the low 32 bits, and sign-extend them, so a period has to fit in 31.
+static const u64 max_period = 0x7fffffff;
+static const u64 min_period = 10000;
+
+// The bit of IA32_PERF_CAPABILITIES that says the counters have aliases that take a full-width write.
+static const u64 perf_capabilities_fw_write = 1ull << 13;
+
+static msr_indicies pmc(unsigned int n) { return (msr_indicies)((u32)msr_indicies::IA32_PMC0 + n); }
+static msr_indicies full_width_pmc(unsigned int n) { return (msr_indicies)((u32)msr_indicies::IA32_A_PMC0 + n); }
+static msr_indicies evtsel(unsigned int n) { return (msr_indicies)((u32)msr_indicies::IA32_PERFEVTSEL0 + n); }
+
+void pmu::init()
+{
+	u32 max_leaf = 0, ebx = 0, ecx = 0, edx = 0;
+	__cpuid(max_leaf, ebx, ecx, edx);
+
+	if (max_leaf < cpuid_pmu_leaf) {
+		return;
+	}
+
+	u32 eax = cpuid_pmu_leaf;
+	ebx = ecx = edx = 0;
+	__cpuid(eax, ebx, ecx, edx);
+
+	unsigned int version = eax & 0xff;
+	unsigned int counters = (eax >> 8) & 0xff;
+	unsigned int width = (eax >> 16) & 0xff;
+	unsigned int nr_events = (eax >> 24) & 0xff;
+
+	// EBX has a bit set for each architectural event that *isn't* available, and core cycles (needed for sampling) is
+	// the first.
+	u32 events = ~ebx & (nr_events >= 32 ? ~0u : (1u << nr_events) - 1);
+	if (!version || !counters || width < 32 || !(events & 1)) {
+		return;
+	}
+
+	cpuid c;
+	c.initialise();
+
+	version_ = version;
+	width_ = width;
+	events_ = events;
+	thread_counters_ = min(counters - 1, perf_max_events);
+	full_width_writes_ = c.get_feature(cpuid_features::pdcm) && (msr::read(msr_indicies::IA32_PERF_CAPABILITIES) & perf_capabilities_fw_write);
+
+	// From version 2, each counter also has to be enabled globally.  The threads' counters are left enabled, and are
+	// started and stopped by their event selects alone.
+	if (version_ >= 2 && thread_counters_) {
+		u64 mask = ((1ull << thread_counters_) - 1) << thread_counter_index(0);
+		msr::write(msr_indicies::IA32_PERF_GLOBAL_CTRL, msr::read(msr_indicies::IA32_PERF_GLOBAL_CTRL) | mask);
+	}
+}
+
+void pmu::arm(u64 period)
+{
+	msr::write(msr_indicies::IA32_PMC0, (u32)-period);
+
+	if (version_ >= 2) {
+		msr::write(msr_indicies::IA32_PERF_GLOBAL_OVF_CTRL, 1);
+	}
+
+	// Delivering the interrupt masks the entry on some processors, so it is rewritten every time.
+	msrs::x2apic_lvt_perfmon = lvt_nmi;
+}
+
+void pmu::start_sampling(u64 period)
+{
+	period = min(max(period, min_period), max_period);
+	period_[core::this_core_id()] = period;
+
+	msr::write(msr_indicies::IA32_PERFEVTSEL0, 0);
+	arm(period);
+	msr::write(msr_indicies::IA32_PERFEVTSEL0, evtsel_enable | evtsel_int | evtsel_os | evtsel_usr | architectural_events[0].encoding);
+
+	if (version_ >= 2) {
+		msr::write(msr_indicies::IA32_PERF_GLOBAL_CTRL, msr::read(msr_indicies::IA32_PERF_GLOBAL_CTRL) | 1);
+	}
+}
+
+void pmu::stop_sampling()
+{
+	msr::write(msr_indicies::IA32_PERFEVTSEL0, 0);
+
+	if (version_ >= 2) {
+		msr::write(msr_indicies::IA32_PERF_GLOBAL_CTRL, msr::read(msr_indicies::IA32_PERF_GLOBAL_CTRL) & ~1ull);
+	}
+
+	msrs::x2apic_lvt_perfmon = lvt_nmi | lvt_masked;
+	period_[core::this_core_id()] = 0;
+}
+
+bool pmu::handle_overflow()
+{
+	u64 period = period_[core::this_core_id()];
+	if (!period) {
+		return false;
+	}
+
+	// The counter counts up from minus the period, so until it wraps past zero its top bit is set.
+	if (msr::read(msr_indicies::IA32_PMC0) & (1ull << (width_ - 1))) {
+		return false;
+	}
+
+	arm(period);
+	return true;
+}
+
+u64 pmu::event_select(perf_event event, bool user_only)
+{
+	if ((u32)event >= ARRAY_SIZE(architectural_events)) {
+		return 0;
+	}
+
+	const architectural_event &e = architectural_events[(u32)event];
+	if (!(events_ & (1u << e.bit))) {
+		return 0;
+	}
+
+	return evtsel_enable | evtsel_usr | (user_only ? 0 : evtsel_os) | e.encoding;
+}
+
+void pmu::save_thread_counters(pmu_thread_counters &c)
+{
+	for (unsigned int i = 0; i < c.nr_counters; i++) {
+		unsigned int n = thread_counter_index(i);
+
+		msr::write(evtsel(n), 0);
+		u64 value = msr::read(pmc(n));
+
+		// A count that can't be written back in full is banked, and the counter starts again from zero.
+		if (full_width_writes_) {
+			c.saved[i] = value;
+		} else {
+			c.base[i] += value;
+			c.saved[i] = 0;
+		}
+	}
+}
+
+void pmu::load_thread_counters(const pmu_thread_counters &c)
+{
+	for (unsigned int i = 0; i < c.nr_counters; i++) {
+		unsigned int n = thread_counter_index(i);
+
+		msr::write(full_width_writes_ ? full_width_pmc(n) : pmc(n), c.saved[i]);
+		msr::write(evtsel(n), c.evtsel[i]);
+	}
+}
+
+void pmu::switch_thread_counters(pmu_thread_counters *prev, pmu_thread_counters *next)
+{
+	if (prev) {
+		save_thread_counters(*prev);
+	}
+
+	if (next) {
+		load_thread_counters(*next);
+	}
+
+	// Reading the counters from user mode is only allowed while a thread that asked for it is running.
+	int id = core::this_core_id();
+	bool user_rdpmc = next && next->user_rdpmc;
+
+	if (user_rdpmc != user_rdpmc_[id]) {
+		cr4::write(user_rdpmc ? (cr4::read() | cr4_flags::PCE) : (cr4::read() & ~cr4_flags::PCE));
+		user_rdpmc_[id] = user_rdpmc;
+	}
+}
+
+u64 pmu::read_thread_counter(const pmu_thread_counters &c, unsigned int n)
+{
+	return c.base[n] + msr::read(pmc(thread_counter_index(n)));
+}
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/smp-call.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/lock.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+
+smp_call *smp_call::queues_[core_manager::max_cores];
+
+void smp_call::call(u64 core_mask, smp_call_fn fn, void *arg, bool wait)
+{
+	// The calling core mustn't change between deciding whether it is a target, and running the function.
+	u64 flags = irq_save();
+
+	int this_core = core::this_core_id();
+	u64 targets = 0;
+
+	for (u64 m = core_mask & ~(1ull << this_core); m; m &= m - 1) {
+		int i = __builtin_ctzll(m);
+
+		core *c = core_manager::get().try_get_core(i);
+		if (c && c->status() == core_status::online) {
+			targets |= 1ull << i;
+		}
+	}
+
+	if (targets) {
+		// A call that is waited for can live on the stack, as it can't go away until every target is done with it.
+		smp_call local(fn, arg, false);
+		smp_call *c = wait ? &local : new smp_call(fn, arg, true);
+
+		c->pending_ = __builtin_popcountll(targets);
+
+		for (u64 m = targets; m; m &= m - 1) {
+			int i = __builtin_ctzll(m);
+
+			smp_call *head = __atomic_load_n(&queues_[i], __ATOMIC_RELAXED);
+			do {
+				c->next_[i] = head;
+			} while (!__atomic_compare_exchange_n(&queues_[i], &head, c, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		}
+
+		x86_core::this_core().lapic().send_ipi_many(targets, x86_core::call_vector);
+
+		if (core_mask & (1ull << this_core)) {
+			fn(arg);
+		}
+
+		if (wait) {
+			while (__atomic_load_n(&local.pending_, __ATOMIC_ACQUIRE)) {
+				handle_ipi();
+				__relax();
+			}
+		}
+	} else if (core_mask & (1ull << this_core)) {
+		fn(arg);
+	}
+
+	irq_restore(flags);
+}
+
+void smp_call::handle_ipi()
+{
+	int this_core = core::this_core_id();
+
+	smp_call *c = __atomic_exchange_n(&queues_[this_core], nullptr, __ATOMIC_ACQUIRE);
+	while (c) {
+		// The call may be gone as soon as it has been run here.
+		smp_call *next = c->next_[this_core];
+
+		c->run_here();
+
+		c = next;
+	}
+}
+
+void smp_call::run_here()
+{
+	fn_(arg_);
+
+	bool owned = owned_;
+	if (__atomic_sub_fetch(&pending_, 1, __ATOMIC_ACQ_REL) == 0 && owned) {
+		delete this;
+	}
+}
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/pcid.h>
+#include <stacsos/kernel/arch/x86/tlb.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page-table-allocator.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::mem;
+
+tlb_batch *tlb_batch::queues_[core_manager::max_cores];
+
+static const u64 cr3_pcid_mask = 0xfff;
+
+void tlb_batch::submit()
+{
+	int this_core = core::this_core_id();
+	u64 targets = 0;
+
+	if (kernel_) {
+		// Global mappings may be held by any core that is running.
+		for (int i = 0; i < core_manager::max_cores; i++) {
+			core *c = core_manager::get().try_get_core(i);
+			if (i != this_core && c && c->status() == core_status::online) {
+				targets |= 1ull << i;
+			}
+		}
+	} else {
+		u64 ran = __atomic_load_n(active_cores_, __ATOMIC_SEQ_CST) & ~(1ull << this_core);
+		u16 id = cr3_ & cr3_pcid_mask;
+
+		// Marking the PCID stale before looking at what each core has loaded means that a core switching to the
+		// address space at the same time either sees the mark, or is seen to have it loaded.
+		if (id) {
+			for (u64 m = ran; m; m &= m - 1) {
+				pcid::mark_stale_on(__builtin_ctzll(m), id);
+			}
+		}
+
+		for (u64 m = ran; m; m &= m - 1) {
+			int i = __builtin_ctzll(m);
+
+			x86_core *c = (x86_core *)core_manager::get().try_get_core(i);
+			if (c && c->loaded_cr3() == cr3_) {
+				targets |= 1ull << i;
+			}
+		}
+	}
+
+	pending_ = __builtin_popcountll(targets) + 1;
+
+	for (u64 m = targets; m; m &= m - 1) {
+		int i = __builtin_ctzll(m);
+
+		tlb_batch *head = __atomic_load_n(&queues_[i], __ATOMIC_RELAXED);
+		do {
+			next_[i] = head;
+		} while (!__atomic_compare_exchange_n(&queues_[i], &head, this, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	// Batches are only sent to cores that are online, which have all set up the interrupt.
+	x86_core::this_core().lapic().send_ipi_many(targets, x86_core::tlb_vector);
+
+	invalidate_here();
+	complete_one();
+}
+
+void tlb_batch::handle_ipi()
+{
+	int this_core = core::this_core_id();
+
+	tlb_batch *b = __atomic_exchange_n(&queues_[this_core], nullptr, __ATOMIC_ACQUIRE);
+	while (b) {
+		// The batch may be deleted as soon as it has been processed.
+		tlb_batch *next = b->next_[this_core];
+
+		b->invalidate_here();
+		b->complete_one();
+
+		b = next;
+	}
+}
+
+void tlb_batch::invalidate_here()
+{
+	bool flush_all = nr_addresses_ > max_addresses;
+
+	if (kernel_) {
+		if (!flush_all) {
+			for (unsigned int i = 0; i < nr_addresses_; i++) {
+				asm volatile("invlpg (%0)" ::"r"(addresses_[i]) : "memory");
+			}
+		} else {
+			// Toggling global pages off and on again is the only way to drop every global entry.
+			cr4_flags flags = cr4::read();
+			if ((flags & cr4_flags::PGE) == cr4_flags::PGE) {
+				cr4::write(flags & ~cr4_flags::PGE);
+				cr4::write(flags);
+			} else {
+				cr3::write(cr3::read());
+			}
+		}
+
+		return;
+	}
+
+	u16 id = cr3_ & cr3_pcid_mask;
+	if (id) {
+		if (flush_all) {
+			pcid::flush_local(id);
+		} else {
+			for (unsigned int i = 0; i < nr_addresses_; i++) {
+				pcid::flush_local_page(id, addresses_[i]);
+			}
+		}
+	} else if ((cr3::read() & ~cr3_pcid_mask) == (cr3_ & ~cr3_pcid_mask)) {
+		// Without a PCID, the address space only has entries in the TLB while it is loaded.
+		if (flush_all) {
+			cr3::write(cr3::read());
+		} else {
+			for (unsigned int i = 0; i < nr_addresses_; i++) {
+				asm volatile("invlpg (%0)" ::"r"(addresses_[i]) : "memory");
+			}
+		}
+	}
+}
+
+void tlb_batch::complete_one()
+{
+	if (__atomic_sub_fetch(&pending_, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	auto &pga = memory_manager::get().pgalloc();
+	auto &pta = memory_manager::get().ptalloc();
+	for (const deferred_free &f : pages_) {
+		switch (f.kind) {
+		case deferred_kind::pages:
+			pga.free_pages(*f.pg, f.order);
+			break;
+
+		case deferred_kind::table:
+			pta.free(f.pg, true);
+			break;
+
+		case deferred_kind::reference:
+			f.pg->release();
+			break;
+
+		case deferred_kind::shared:
+			if (f.pg->release()) {
+				f.pg->set_cow(false);
+				pga.free_pages(*f.pg, f.order);
+			}
+			break;
+		}
+	}
+
+	if (completion_fn_) {
+		completion_fn_(completion_arg_);
+	}
+
+	delete this;
+}
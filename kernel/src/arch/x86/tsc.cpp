@@ -5,17 +5,133 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/cpuid.h>
+#include <stacsos/kernel/arch/x86/hpet.h>
+#include <stacsos/kernel/arch/x86/kvm.h>
 #include <stacsos/kernel/arch/x86/pit.h>
 #include <stacsos/kernel/arch/x86/tsc.h>
 #include <stacsos/kernel/debug.h>
 
 using namespace stacsos::kernel::arch::x86;
 
+u64 tsc::boot_frequency_;
+u64 tsc::reported_apic_frequency_;
+
+// The CPUID leaves that describe the clocks: the TSC's ratio to the core crystal clock, the processor's nominal
+// frequency, and the timing leaf that hypervisors (KVM included) use to pass the host's frequencies on.
+static const u32 cpuid_tsc_leaf = 0x15;
+static const u32 cpuid_frequency_leaf = 0x16;
+static const u32 cpuid_hypervisor_base = 0x40000000;
+static const u32 cpuid_hypervisor_timing_leaf = 0x40000010;
+
 void tsc::calibrate()
 {
-	pit p;
+	if (!boot_frequency_) {
+		boot_frequency_ = frequency_from_cpuid();
+
+		// Under KVM, the host says exactly how it scales the TSC to nanoseconds, which saves measuring it.
+		if (!boot_frequency_ && kvm::tsc_frequency()) {
+			boot_frequency_ = kvm::tsc_frequency();
+			dprintf("tsc: frequency=%llu (kvmclock)\n", boot_frequency_);
+		}
+
+		if (!boot_frequency_) {
+			boot_frequency_ = measure_frequency();
+		}
+	}
+
+	timer_frequency_ = boot_frequency_;
+}
+
+u64 tsc::frequency_from_cpuid()
+{
+	u32 max_leaf = 0, ebx = 0, ecx = 0, edx = 0;
+	__cpuid(max_leaf, ebx, ecx, edx);
+
+	if (max_leaf >= cpuid_tsc_leaf) {
+		u32 denominator = cpuid_tsc_leaf, numerator = 0, crystal = 0;
+		edx = 0;
+		__cpuid(denominator, numerator, crystal, edx);
+
+		// Not every processor reports the crystal's frequency, but it can be worked back from the nominal frequency,
+		// which is the TSC's.
+		if (denominator && numerator && !crystal && max_leaf >= cpuid_frequency_leaf) {
+			u32 base_mhz = cpuid_frequency_leaf;
+			ebx = ecx = edx = 0;
+			__cpuid(base_mhz, ebx, ecx, edx);
+
+			crystal = (u32)(((u64)base_mhz * 1000000ull * denominator) / numerator);
+		}
+
+		if (denominator && numerator && crystal) {
+			// The APIC timer runs from the crystal.
+			reported_apic_frequency_ = crystal;
+
+			u64 frequency = ((u64)crystal * numerator) / denominator;
+			dprintf("tsc: frequency=%llu (cpuid leaf 0x15)\n", frequency);
+
+			return frequency;
+		}
+	}
+
+	u32 features = 1;
+	ebx = ecx = edx = 0;
+	__cpuid(features, ebx, ecx, edx);
+
+	// The hypervisor bit.
+	if (ecx & (1u << 31)) {
+		u32 max_hypervisor_leaf = cpuid_hypervisor_base;
+		ebx = ecx = edx = 0;
+		__cpuid(max_hypervisor_leaf, ebx, ecx, edx);
 
-	dprintf("tsc: calibrate...\n");
+		if (max_hypervisor_leaf >= cpuid_hypervisor_timing_leaf) {
+			u32 tsc_khz = cpuid_hypervisor_timing_leaf, apic_khz = 0;
+			ecx = edx = 0;
+			__cpuid(tsc_khz, apic_khz, ecx, edx);
+
+			if (tsc_khz) {
+				reported_apic_frequency_ = apic_khz * 1000ull;
+
+				u64 frequency = tsc_khz * 1000ull;
+				dprintf("tsc: frequency=%llu (hypervisor timing leaf)\n", frequency);
+
+				return frequency;
+			}
+		}
+	}
+
+	return 0;
+}
+
+u64 tsc::measure_frequency()
+{
+	// Measured over 10 ms, against the HPET if there is one, which is read far more precisely than the PIT.
+	if (hpet::get().present()) {
+		hpet &h = hpet::get();
+
+		// Reading the HPET is slow (and slower still in a virtual machine), so the TSC is read either side of it, and
+		// the midpoint is taken as the time of the read.
+		u64 before = read();
+		u64 start = h.read();
+		u64 start_tsc = before + (read() - before) / 2;
+
+		u64 target = start + h.frequency() / 100;
+
+		u64 now;
+		do {
+			before = read();
+			now = h.read();
+		} while (now < target);
+
+		u64 end_tsc = before + (read() - before) / 2;
+
+		u64 frequency = ((end_tsc - start_tsc) * h.frequency()) / (now - start);
+		dprintf("tsc: frequency=%llu (measured against the hpet)\n", frequency);
+
+		return frequency;
+	}
+
+	pit p;
 
 	// Some useful constants for the calibration
 #define FACTOR 1000
@@ -38,13 +154,9 @@ void tsc::calibrate()
 
 	u64 end = read();
 
-	dprintf("tsc: start=%lu, end=%lu, delta=%lu\n", start, end, end - start);
-
-	// Calculate the number of ticks per period
-	u64 ticks_per_period = end - start;
-
-	// Determine the TSC base frequency
-	timer_frequency_ = (ticks_per_period * (FACTOR / CALIBRATION_PERIOD));
+	// Calculate the number of ticks per period, and from that, the TSC base frequency
+	u64 frequency = (end - start) * (FACTOR / CALIBRATION_PERIOD);
+	dprintf("tsc: frequency=%llu (measured against the pit)\n", frequency);
 
-	dprintf("tsc: calibrated frequency=%lu\n", timer_frequency_);
+	return frequency;
 }
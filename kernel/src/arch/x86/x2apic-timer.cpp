@@ -5,12 +5,15 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/cpuid.h>
 #include <stacsos/kernel/arch/x86/machine-context.h>
 #include <stacsos/kernel/arch/x86/x2apic-timer.h>
 #include <stacsos/kernel/arch/x86/x2apic.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/profiler.h>
 #include <stacsos/kernel/sched/sleeper.h>
+#include <stacsos/kernel/sched/softirq.h>
 
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::arch::x86;
@@ -21,10 +24,24 @@ void x2apic_timer::timer_irq_handler(u8 irq, void *context, void *arg)
 	x2apic_timer *timer = (x2apic_timer *)arg;
 	timer->lapic_.owner().update_clock();
 
-	sleeper::get().check_wakeup();
+	profiler::get().tick(*(const machine_context *)context);
 
-	timer->lapic_.owner().schedule();
+	// Expired timers are fired by the bottom half, so all the handler does is look at the earliest deadline.  Isolated
+	// cores leave them to the others.
+	if (!timer->lapic_.owner().isolated() && sleeper::get().wakeup_due()) {
+		softirq::get().raise(softirq_vector::timer);
+	}
+
+	timer->lapic_.owner().tick();
 	timer->lapic_.eoi();
 }
 
-void x2apic_timer::init() { lapic_.set_timer_irq(lapic_.owner().irqmgr().allocate_irq(timer_irq_handler, this)); }
+void x2apic_timer::init()
+{
+	lapic_.set_timer_irq(lapic_.owner().irqmgr().allocate_irq(timer_irq_handler, this, "timer"));
+
+	cpuid c;
+	c.initialise();
+
+	supports_deadline_ = c.get_feature(cpuid_features::tscdeadline);
+}
@@ -7,7 +7,6 @@
  */
 #include <stacsos/kernel/arch/x86/cpuid.h>
 #include <stacsos/kernel/arch/x86/msr.h>
-#include <stacsos/kernel/arch/x86/pit.h>
 #include <stacsos/kernel/arch/x86/x2apic.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/debug.h>
@@ -65,48 +64,48 @@ void x2apic::init()
 	calibrate_timer();
 }
 
+u64 x2apic::boot_timer_frequency_;
+
 void x2apic::calibrate_timer()
 {
-	pit p;
-
-	// Initialise the APIC timer
-	set_timer_divide(3);
-	set_timer_initial_count(1);
-	set_timer_irq(32);
-	set_timer_one_shot();
-	unmask_interrupts(x2apic_lvts::timer);
-
-	dprintf("x2apic-timer: calibrate...\n");
-
-	// Some useful constants for the calibration
-#define FACTOR 1000
-#define PIT_FREQUENCY (1193180)
-#define CALIBRATION_PERIOD (10)
-#define CALIBRATION_TICKS (u16)((PIT_FREQUENCY * CALIBRATION_PERIOD) / FACTOR)
+	if (!boot_timer_frequency_) {
+		boot_timer_frequency_ = tsc::reported_apic_frequency();
+		if (boot_timer_frequency_) {
+			dprintf("x2apic-timer: frequency=%llu (cpuid)\n", boot_timer_frequency_);
+		} else {
+			boot_timer_frequency_ = measure_timer_frequency();
+		}
+	}
 
-	// Initialise the PIT for one-shot
-	p.init_oneshot(CALIBRATION_TICKS); // 10ms
+	timer_frequency_ = boot_timer_frequency_;
+}
 
-	// Start the PIT
-	p.go();
+u64 x2apic::measure_timer_frequency()
+{
+	// The TSC has been calibrated by now, so the timer is measured against it, over 10 ms.  The timer counts down even
+	// while it is masked, so it can't go off.
+	tsc &t = owner_.timestamp_counter();
 
-	// Start the APIC timer
+	set_timer_divide(3);
+	set_timer_one_shot();
 	set_timer_initial_count(0xffffffffu);
 
-	// Spin until the PIT expires
-	while (!p.expired()) {
-		asm volatile("");
+	u64 start = t.read();
+	u64 target = start + t.frequency() / 100;
+
+	while (t.read() < target) {
+		__relax();
 	}
 
-	// Stop the APIC timer
-	mask_interrupts(x2apic_lvts::timer);
+	u32 remaining = get_timer_current_count();
+	u64 end = t.read();
 
-	// Calculate the number of ticks per period (accounting for the LAPIC division)
-	u64 ticks_per_period = (0xffffffffu - get_timer_current_count());
-	ticks_per_period <<= 4;
+	set_timer_initial_count(0);
 
-	// Determine the LAPIC base frequency
-	timer_frequency_ = (ticks_per_period * (FACTOR / CALIBRATION_PERIOD));
+	// Calculate the number of ticks (accounting for the LAPIC division), scaled up to a second
+	u64 ticks = (u64)(0xffffffffu - remaining) << 4;
+	u64 frequency = (ticks * t.frequency()) / (end - start);
 
-	dprintf("x2apic-timer: calibrated frequency=%lu\n", timer_frequency_);
+	dprintf("x2apic-timer: frequency=%llu (measured against the tsc)\n", frequency);
+	return frequency;
 }
@@ -5,12 +5,28 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/cpuid.h>
 #include <stacsos/kernel/arch/x86/cregs.h>
+#include <stacsos/kernel/arch/x86/extable.h>
+#include <stacsos/kernel/arch/x86/fpu.h>
+#include <stacsos/kernel/arch/x86/irq/irq-traps.h>
+#include <stacsos/kernel/arch/x86/kvm.h>
 #include <stacsos/kernel/arch/x86/msr.h>
+#include <stacsos/kernel/arch/x86/pcid.h>
 #include <stacsos/kernel/arch/x86/pit.h>
+#include <stacsos/kernel/arch/x86/pmu.h>
+#include <stacsos/kernel/arch/x86/smp-call.h>
+#include <stacsos/kernel/arch/x86/tlb.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/profiler.h>
+#include <stacsos/kernel/sched/stack-pool.h>
 #include <stacsos/kernel/sched/thread.h>
 #include <stacsos/memops.h>
 
@@ -28,27 +44,38 @@ void x86_core::init()
 	// Populate the descriptor tables (GDT, IDT, TSS)
 	populate_dt();
 
-	// Initialise the local timestamp counter
+	// Register the paravirtual clock and steal time with the host, if there is one, and then initialise the local
+	// timestamp counter, whose frequency the paravirtual clock may give.
+	kvm::init_core(id());
 	tsc_.calibrate();
 
+	// Enable the extended register state, so that it can be switched between user threads.
+	fpu::init_core();
+
+	// Tag TLB entries with their address space, if possible.
+	pcid::init_core();
+
 	// Initialise the Local APIC, and the Local APIC timer.
 	lapic_.init();
 	timer_.init();
 
-	// Create a temporary TCB so we can take the first interrupt.  This is needed
-	// because the IRQ handling code needs somewhere to store a pointer to the saved
-	// context.
-	temporary_tcb.context_ptr = 0;
-	temporary_tcb.task_ptr = 0;
-	temporary_tcb.cr3 = 0;
-	temporary_tcb.kernel_stack = 0;
+	// Find out what the performance counters can do.
+	pmu::init();
+
+	// An idle core waits with MWAIT, if it can be ended by an interrupt while interrupts are disabled, so that other
+	// cores can wake it without one.  idle=hlt always halts instead.
+	cpuid c;
+	c.initialise();
 
-	// Pop a pointer to this temporary TCB into GS.  It's not a /real/ tcb structure,
-	// so we can't use set_current_tcb.
-	gsbase::write((u64)&temporary_tcb);
+	use_mwait_ = c.get_feature(cpuid_features::monitor) && c.get_feature(cpuid_features::mwait_ext) && c.get_feature(cpuid_features::mwait_irq_break)
+		&& memops::strcmp(config::get().get_option_or_default("idle", "mwait"), "hlt") != 0;
+
+	// The IRQ handling code needs somewhere to store a pointer to the saved context, so a temporary TCB is used
+	// until the core starts running tasks.
+	use_temporary_tcb();
 
 	for (int i = 0; i < 32; i++) {
-		irqs_.assign_irq(i, exception_handler, this);
+		irqs_.assign_irq(i, exception_handler, this, "exception");
 	}
 
 	// Activate the syscall instruction
@@ -57,6 +84,15 @@ void x86_core::init()
 	msrs::ia32_fmask = (u64)(1 << 9); // Disable interrupts on entry to system call
 }
 
+void x86_core::use_temporary_tcb()
+{
+	// It doesn't belong to a task, and there's no address space to switch to, so set_current_tcb can't be used.
+	memops::memset(&temporary_tcb_, 0, sizeof(temporary_tcb_));
+	temporary_tcb_.core_id = id();
+
+	gsbase::write((u64)&temporary_tcb_);
+}
+
 void x86_core::set_current_tcb(const stacsos::kernel::sched::tcb *tcb)
 {
 	// TODO: Check if TCB is changing...
@@ -64,8 +100,15 @@ void x86_core::set_current_tcb(const stacsos::kernel::sched::tcb *tcb)
 	// A pointer to the current TCB is held in the GS register.
 	gsbase::write((u64)tcb);
 
-	// Update the CR3
-	cr3::write(tcb->cr3);
+	// Record the address space as loaded here, and as having run here, before checking whether its PCID has been
+	// marked stale, so that a TLB shootdown running at the same time on another core can't miss this one.
+	__atomic_store_n(&loaded_cr3_, tcb->cr3, __ATOMIC_SEQ_CST);
+	if (tcb->active_cores) {
+		__atomic_fetch_or(tcb->active_cores, 1ull << id(), __ATOMIC_SEQ_CST);
+	}
+
+	// Update the CR3, keeping whatever the TLB still holds for the address space, if it has a PCID.
+	cr3::write(pcid::cr3_for(tcb->cr3));
 
 	// Update the TSS
 	tss_.set_kernel_stack(tcb->kernel_stack);
@@ -73,12 +116,91 @@ void x86_core::set_current_tcb(const stacsos::kernel::sched::tcb *tcb)
 
 stacsos::kernel::sched::tcb *x86_core::get_current_tcb() { return (stacsos::kernel::sched::tcb *)gsbase::read(); }
 
+u64 x86_core::stolen_time()
+{
+	u64 ns = kvm::steal_ns(id());
+	if (!ns) {
+		return 0;
+	}
+
+	// The whole seconds are converted separately from the remainder, so that the multiplication can't overflow.
+	u64 freq = tsc_.frequency();
+	return ((ns / 1'000'000'000ull) * freq) + (((ns % 1'000'000'000ull) * freq) / 1'000'000'000ull);
+}
+
 static void yield_handler(u8 irq_nr, void *mcontext, void *arg)
 {
 	x86_core *c = (x86_core *)arg;
 	c->schedule();
 }
 
+static void resched_handler(u8 irq_nr, void *mcontext, void *arg)
+{
+	x86_core *c = (x86_core *)arg;
+	c->handle_kick();
+	c->lapic().eoi();
+}
+
+static void tlb_handler(u8 irq_nr, void *mcontext, void *arg)
+{
+	x86_core *c = (x86_core *)arg;
+	tlb_batch::handle_ipi();
+	c->lapic().eoi();
+}
+
+static void call_handler(u8 irq_nr, void *mcontext, void *arg)
+{
+	x86_core *c = (x86_core *)arg;
+	smp_call::handle_ipi();
+	c->lapic().eoi();
+}
+
+extern "C" void x86_handle_nmi(machine_context *mc) { profiler::get().handle_nmi(*mc); }
+
+void x86_core::kick()
+{
+	// A core waiting in MWAIT wakes up as soon as its idle state is written, and then does what the interrupt would
+	// have done.  The wake-up (or whatever else the kick is for) is visible before the write is.
+	u64 expected = idle_polling;
+	if (__atomic_compare_exchange_n(&idle_state_, &expected, idle_woken, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	// A core that hasn't been initialised yet has nowhere to take the interrupt, but it will pick up
+	// the task when it starts running anyway.
+	if (__atomic_load_n(&ipis_ready_, __ATOMIC_ACQUIRE)) {
+		this_core().lapic().send_ipi(id(), resched_vector);
+	}
+}
+
+void x86_core::idle()
+{
+	if (!use_mwait_) {
+		asm volatile("hlt");
+		return;
+	}
+
+	// The core waits with interrupts disabled, so that it can't be switched away while other cores think it is
+	// waiting, and skip the interrupt that it would then need.  An interrupt still ends the wait (ECX bit 0), and is
+	// taken once the state has been put back.
+	asm volatile("cli");
+
+	__atomic_store_n(&idle_state_, idle_polling, __ATOMIC_SEQ_CST);
+	asm volatile("monitor" : : "a"(&idle_state_), "c"(0), "d"(0) : "memory");
+
+	// A kick that came in before the monitor was armed has already changed the state, and wouldn't wake MWAIT.
+	if (__atomic_load_n(&idle_state_, __ATOMIC_SEQ_CST) == idle_polling) {
+		asm volatile("mwait" : : "a"(0), "c"(1) : "memory");
+	}
+
+	bool woken = __atomic_exchange_n(&idle_state_, idle_running, __ATOMIC_ACQUIRE) == idle_woken;
+	asm volatile("sti");
+
+	if (woken) {
+		handle_idle_kick();
+	}
+}
+
 void x86_core::populate_dt()
 {
 	// Populate the GDT, with a NULL entry, then CODE and DATA segments for KERNEL and USER mode respectively.
@@ -99,42 +221,89 @@ void x86_core::populate_dt()
 
 	// The IRQ manager takes care of the IDT
 	irqs_.initialise();
-	irqs_.reserve_irq(0xff, yield_handler, this);
+	irqs_.reserve_irq(yield_vector, yield_handler, this, "yield");
+
+	// Other cores send this interrupt when they make a task runnable here, or need this core to reschedule.
+	irqs_.reserve_irq(resched_vector, resched_handler, this, "resched");
+
+	// Other cores send this interrupt when they have removed mappings that this core may hold in its TLB.
+	irqs_.reserve_irq(tlb_vector, tlb_handler, this, "tlb");
+
+	// Other cores send this interrupt when they have queued a function for this core to run.
+	irqs_.reserve_irq(call_vector, call_handler, this, "call");
+
+	__atomic_store_n(&ipis_ready_, true, __ATOMIC_RELEASE);
+
+	// A double fault is taken on a stack of its own, as it is usually the result of a kernel stack overflowing into
+	// its guard page, where there is no room to push the exception frame.
+	allocate_interrupt_stack(double_fault_stack, "double fault");
+	idt_.set_interrupt_stack(0x08, double_fault_stack);
+
+	// NMIs have an entry point and a stack of their own too, as they can arrive at any instruction, even one where the
+	// stack pointer or GS isn't yet the kernel's.
+	allocate_interrupt_stack(nmi_stack, "NMI");
+	idt_.register_interrupt_gate(0x02, (uintptr_t)x86_nmi_entry, 8, descriptor_privilege_level::ring0);
+	idt_.set_interrupt_stack(0x02, nmi_stack);
+
+	// So can a machine check, which is then reported on a stack that is known to be good.
+	allocate_interrupt_stack(machine_check_stack, "machine check");
+	idt_.set_interrupt_stack(0x12, machine_check_stack);
 
 	// The TSS is needed for swapping stacks if we're going into USER mode.
 	tss_.set_kernel_stack(0);
 	tss_.reload(0x28);
 }
 
-bool x86_core::remote_run() { return false; }
+void x86_core::allocate_interrupt_stack(interrupt_stack ist, const char *name)
+{
+	// Each core allocates its own stacks as it starts up, so they come from memory the core is likely to be close to.
+	page *stack = memory_manager::get().pgalloc().allocate_pages(fault_stack_order);
+	if (!stack) {
+		panic("unable to allocate %s stack", name);
+	}
+
+	tss_.set_interrupt_stack(ist, (uintptr_t)stack->base_address_ptr() + (PAGE_SIZE << fault_stack_order));
+}
 
-#if 0
 struct mpstartup_data {
 	u64 mpready;
 	u64 mpcr3;
+	u64 mpcr4;
 	x86_core *core_obj;
 	void *mpstack;
-	void (stacsos::kernel::arch::x86::x86_core::*trampoline)(void);
+	void (*trampoline)(x86_core *);
 } __packed;
 
-extern "C" char _MPSTARTUP_START, _MPSTARTUP_END, _MPSTARTUP_SIZE;
-extern "C" mpstartup_data _MPSTARTUP_DATA;
+extern "C" char _MPSTARTUP_START, _MPSTARTUP_END, _MPSTARTUP_DATA, _MPSTARTUP_BASE;
+
+// The temporary PML4 used by the AP while it transitions into long mode.  It lives
+// in the page after the start-up code, which is below 1MB and so never handed out
+// by the page allocator.
+static const u64 mpstartup_pml4 = 0x9000;
+
+static volatile mpstartup_data *get_mpstartup_data()
+{
+	u64 data_offset = (u64)&_MPSTARTUP_DATA - (u64)&_MPSTARTUP_START;
+	return (volatile mpstartup_data *)phys_to_virt((u64)&_MPSTARTUP_BASE + data_offset);
+}
 
 bool x86_core::remote_run()
 {
 	auto &me = this_core();
 
-	pfn_t mpstart_pfn = prepare_mpstartup_code();
+	u64 mpstart_pfn = prepare_mpstartup_code();
 
 	// Acquire a pointer to the mp startup data structure, which we need to fill in.  It should
 	// be volatile, so that we can check the mpready flag without worrying that the compiler
 	// optimises "redundant checks" away.
-	volatile mpstartup_data *d = (volatile mpstartup_data *)&_MPSTARTUP_DATA;
+	volatile mpstartup_data *d = get_mpstartup_data();
 	d->mpready = 0; // Is the core ready?
-	d->mpcr3 = __read_cr3(); // The pages tables to provide the core with (just the same as this core's)
+	d->mpcr3 = mpstartup_pml4; // The temporary page tables, which identity map low memory
+	d->mpcr4 = (u64)cr4::read(); // The same CR4 settings as this core
 	d->core_obj = this; // A pointer to the core object that is coming online
-	d->mpstack = (void *)(((u64) new char[0x1000]) + 0x1000); // A temporary stack (which we need to remember to free at some point)
-	d->trampoline = &exegol::arch::x86::x86_core::complete_remote_init; // The function to call once we've gotten into 64-bit mode
+	d->mpstack = (void *)((u64)zeroed_page_pool::get().allocate()->base_address_ptr()
+		+ PAGE_SIZE); // The start-up stack, which stays with the core until it enters its idle thread
+	d->trampoline = mpstartup_entry; // The function to call once we've gotten into 64-bit mode
 
 	// Stick in a full memory fence, just to be safe.
 	asm volatile("mfence" ::: "memory");
@@ -149,46 +318,76 @@ bool x86_core::remote_run()
 	me.lapic_.send_remote_sipi(id(), mpstart_pfn);
 	me.tsc_.spin(1); // Wait for 1ms...
 
-	// If the core didn't come online, send another SIPI and give it a second
+	// If the core didn't come online, send another SIPI.
 	if (!d->mpready) {
 		me.lapic_.send_remote_sipi(id(), mpstart_pfn);
-		me.tsc_.spin(1000); // 1s
+	}
+
+	// Give the core up to a second to finish initialising.  The cores are brought up one at a time, because
+	// the start-up code and data are shared (and each core calibrates its timers against the PIT).
+	u64 deadline = me.tsc_.read() + me.tsc_.frequency();
+	while (!d->mpready && me.tsc_.read() < deadline) {
+		__relax();
 	}
 
 	// Return whether or not the core came online.
 	return !!d->mpready;
 }
 
-pfn_t x86_core::prepare_mpstartup_code()
+u64 x86_core::prepare_mpstartup_code()
 {
-	// This function is a total hack.  It just brutally copies the mp startup code and data into an arbitrary page,
-	// because we can only access PFNs < 0x100 when initialising other processors.
-
-	pfn_t target_pfn = 0; // Let's go for page 0.  The mp startup assembly is written to
-						  // work in page 0 -- there is one place where a relative address
-						  // computation is made, which assumes we're running in page zero.
-
-	// Copy the mp startup assembly into the right place.  Technically, we only need the 16-bit
-	// code, because once we jump into 32-bit mode, we're actually executing at normal addresses.
-	void *target_addr = (void *)(target_pfn << PAGE_BITS);
-	memops::memcpy(target_addr, (void *)&_MPSTARTUP_START, (size_t)&_MPSTARTUP_SIZE);
-
-	// We really need to remember to unmap page zero later...
-	return target_pfn;
+	// The SIPI vector is a page number, so the start-up code must live in a page below 1MB.  Copy
+	// the start-up code and data into place -- the assembly is written to run at _MPSTARTUP_BASE.
+	u64 target_addr = (u64)&_MPSTARTUP_BASE;
+	memops::memcpy(phys_to_virt(target_addr), (void *)&_MPSTARTUP_START, (size_t)(&_MPSTARTUP_END - &_MPSTARTUP_START));
+
+	// Build a temporary PML4 for the core to enable paging with.  This is a copy of the root page table
+	// (so the kernel is mapped), with the first entry aliasing the direct map, so that the start-up code
+	// keeps running at its physical address once paging is switched on.
+	u64 *pml4 = (u64 *)phys_to_virt(mpstartup_pml4);
+	memops::memcpy(pml4, &memory_manager::get().root_address_space().pgtable(), PAGE_SIZE);
+	pml4[0] = pml4[256];
+
+	return target_addr >> PAGE_BITS;
 }
 
+void x86_core::mpstartup_entry(x86_core *core) { core->complete_remote_init(); }
+
 void x86_core::complete_remote_init()
 {
-	// Update the TSC aux MSR with the core ID, so that the rdpid instruction works.
-	msr::write(msr_indicies::IA32_TSC_AUX, id());
+	// Switch away from the temporary start-up page tables.
+	cr3::write(memory_manager::get().root_address_space().pgtable().effective_cr3());
+
+	// Point %gs at a TCB stamped with the core ID, so that this_core_id() works.  The TSC aux MSR is given it too,
+	// for RDTSCP.
+	use_temporary_tcb();
+	msrs::ia32_tsc_aux = id();
 
 	dprintf("core [%d] online\n", id());
 
-	// Initialise and run this new core.
+	// Initialise this new core, tell the bootstrap core we're alive, and start running.
 	init();
+
+	get_mpstartup_data()->mpready = 1;
+
 	run();
 }
-#endif
+
+void x86_core::handle_double_fault(machine_context *mc)
+{
+	u64 address = cr2::read();
+
+	dprintf("CORE %d - DOUBLE FAULT\n", id());
+	mc->dump();
+
+	dump_regs();
+
+	if (stack_pool::is_guard_address(address)) {
+		panic_with_ctx(mc, "Kernel stack overflow");
+	}
+
+	panic_with_ctx(mc, "Double Fault");
+}
 
 void x86_core::handle_gpf(machine_context *mc)
 {
@@ -197,15 +396,32 @@ void x86_core::handle_gpf(machine_context *mc)
 
 	dump_regs();
 
-	panic("General Protection Fault", mc);
+	panic_with_ctx(mc, "General Protection Fault");
 }
 
 void x86_core::handle_page_fault(machine_context *mc)
 {
-	if (memory_manager::get().try_handle_page_fault(cr2::read())) {
+	u64 address = cr2::read();
+
+	if (memory_manager::get().try_handle_page_fault(address)) {
 		return;
 	}
 
+	// The kernel copying to or from user memory carries on at the copy's fixup, which makes the copy fail.
+	if (!(mc->cs & 3) && address < user_access::user_limit) {
+		if (u64 fixup = extable::find_fixup(mc->rip)) {
+			mc->rip = fixup;
+			return;
+		}
+	}
+
+	if (stack_pool::is_guard_address(address)) {
+		dprintf("CORE %d - KERNEL STACK OVERFLOW\n", id());
+		mc->dump();
+
+		panic_with_ctx(mc, "Kernel stack overflow");
+	}
+
 	thread::current().stop();
 
 	dprintf("CORE %d - UNHANDLED PAGE FAULT\n", id());
@@ -223,7 +439,7 @@ void x86_core::dump_regs()
 
 	u64 fs = fsbase::read();
 	u64 gs = gsbase::read();
-	dprintf("   FS=%016lx   GS=%016lx\n", fs, gs);
+	dprintf("   FS=%016llx   GS=%016llx\n", fs, gs);
 
 	u64 cr0, cr2, cr3, cr4;
 	cr0 = (u64)cr0::read();
@@ -231,8 +447,8 @@ void x86_core::dump_regs()
 	cr3 = (u64)cr3::read();
 	cr4 = (u64)cr4::read();
 
-	dprintf("  CR0=%016lx  CR2=%016lx\n", cr0, cr2);
-	dprintf("  CR3=%016lx  CR4=%016lx\n", cr3, cr4);
+	dprintf("  CR0=%016llx  CR2=%016llx\n", cr0, cr2);
+	dprintf("  CR3=%016llx  CR4=%016llx\n", cr3, cr4);
 
 	struct {
 		u16 size;
@@ -240,8 +456,8 @@ void x86_core::dump_regs()
 	} __packed dtp;
 
 	asm volatile("sgdt %0" : "=m"(dtp));
-	dprintf("  GDT=%016lx %04x\n", dtp.ptr, dtp.size);
+	dprintf("  GDT=%016llx %04x\n", dtp.ptr, dtp.size);
 
 	asm volatile("sidt %0" : "=m"(dtp));
-	dprintf("  IDT=%016lx %04x\n", dtp.ptr, dtp.size);
+	dprintf("  IDT=%016llx %04x\n", dtp.ptr, dtp.size);
 }
@@ -22,6 +22,15 @@ static u64 l1_pg_off(u64 address) { return address & 0xfff; } // 4K
 static u64 l2_pg_off(u64 address) { return address & 0x1fffff; } // 2M
 static u64 l3_pg_off(u64 address) { return address & 0x3fffffff; } // 1G
 
+// Below the PML4, each table counts its present entries in its page descriptor.
+static void add_entry(page &table) { table.set_table_entries(table.table_entries() + 1); }
+
+static bool remove_entry(page &table)
+{
+	table.set_table_entries(table.table_entries() - 1);
+	return !table.table_entries();
+}
+
 x86_page_table *x86_page_table::create_empty(page_table_allocator &pta)
 {
 	page *pml4 = pta.allocate();
@@ -42,12 +51,50 @@ x86_page_table *x86_page_table::create_linked_copy(page_table_allocator &pta)
 	return (x86_page_table *)new_pml4_entries;
 }
 
+void x86_page_table::destroy_linked_copy(page_table_allocator &pta)
+{
+	for (int i = 0; i < 0x100; i++) {
+		if (!pml4_[i].present()) {
+			continue;
+		}
+
+		page &pdpt_page = page::get_from_base_address(pml4_[i].base_address());
+		pdp &pdpt = *(pdp *)pdpt_page.base_address_ptr();
+
+		for (int j = 0; j < 0x200; j++) {
+			if (!pdpt[j].present() || pdpt[j].size()) {
+				continue;
+			}
+
+			page &pdt_page = page::get_from_base_address(pdpt[j].base_address());
+			pd &pdt = *(pd *)pdt_page.base_address_ptr();
+
+			for (int k = 0; k < 0x200; k++) {
+				if (!pdt[k].present() || pdt[k].size()) {
+					continue;
+				}
+
+				pta.free(&page::get_from_base_address(pdt[k].base_address()));
+			}
+
+			pta.free(&pdt_page);
+		}
+
+		pta.free(&pdpt_page);
+	}
+
+	pta.free(&page::get_from_base_address(effective_cr3()));
+}
+
 void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 physical_address, mapping_flags flags, mapping_size size)
 {
 	// TODO: assert VA canonical
 	bool rw = (flags & mapping_flags::writable) == mapping_flags::writable;
 	bool user = (flags & mapping_flags::user_accessable) == mapping_flags::user_accessable;
+	bool global = (flags & mapping_flags::global) == mapping_flags::global;
 
+	// The tables are always writable, as they are shared by every mapping under them, and the first of those may well
+	// be a read-only one.  Whether a page can be written to is left to its own entry.
 	pml4e &l4 = pml4_[pml4_index(virtual_address)];
 	if (!l4.present()) {
 		l4.reset();
@@ -55,21 +102,27 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 		page *l3page = pta.allocate();
 		l4.base_address(l3page->base_address());
 		l4.present(true);
-		l4.rw(rw);
+		l4.rw(true);
 		l4.us(user);
 	}
 
-	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
+	page &l3_page = page::get_from_base_address(l4.base_address());
+	pdpe &l3 = (*(pdp *)l3_page.base_address_ptr())[pdp_index(virtual_address)];
 	if (size == mapping_size::m1g) {
 		if (l3.present() && !l3.size()) {
 			panic("overlapping mapping");
 		} else {
+			if (!l3.present()) {
+				add_entry(l3_page);
+			}
+
 			l3.reset();
 			l3.base_address(physical_address);
 			l3.size(true);
 			l3.present(true);
 			l3.rw(rw);
 			l3.us(user);
+			l3.g(global);
 			return;
 		}
 	} else {
@@ -79,25 +132,33 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 			}
 		} else {
 			page *l2page = pta.allocate();
+			add_entry(l3_page);
+
 			l3.reset();
 			l3.base_address(l2page->base_address());
 			l3.present(true);
-			l3.rw(rw);
+			l3.rw(true);
 			l3.us(user);
 		}
 	}
 
-	pde &l2 = (*(pd *)page::get_from_base_address(l3.base_address()).base_address_ptr())[pd_index(virtual_address)];
+	page &l2_page = page::get_from_base_address(l3.base_address());
+	pde &l2 = (*(pd *)l2_page.base_address_ptr())[pd_index(virtual_address)];
 	if (size == mapping_size::m2m) {
 		if (l2.present() && !l2.size()) {
 			panic("overlapping mapping");
 		} else {
+			if (!l2.present()) {
+				add_entry(l2_page);
+			}
+
 			l2.reset();
 			l2.base_address(physical_address);
 			l2.size(true);
 			l2.present(true);
 			l2.rw(rw);
 			l2.us(user);
+			l2.g(global);
 			return;
 		}
 	} else {
@@ -107,53 +168,232 @@ void x86_page_table::map(page_table_allocator &pta, u64 virtual_address, u64 phy
 			}
 		} else {
 			page *l1page = pta.allocate();
+			add_entry(l2_page);
+
 			l2.reset();
 			l2.base_address(l1page->base_address());
 			l2.present(true);
-			l2.rw(rw);
+			l2.rw(true);
 			l2.us(user);
 		}
 	}
 
-	pte &l1 = (*(pt *)page::get_from_base_address(l2.base_address()).base_address_ptr())[pt_index(virtual_address)];
+	page &l1_page = page::get_from_base_address(l2.base_address());
+	pte &l1 = (*(pt *)l1_page.base_address_ptr())[pt_index(virtual_address)];
+	if (!l1.present()) {
+		add_entry(l1_page);
+	}
+
 	l1.reset();
 	l1.base_address(physical_address);
 	l1.present(true);
 	l1.rw(rw);
 	l1.us(user);
+	l1.g(global);
+}
+
+void x86_page_table::unmap(page_table_allocator &pta, u64 virtual_address, tlb_batch *batch)
+{
+	pml4e &l4 = pml4_[pml4_index(virtual_address)];
+	if (!l4.present()) {
+		return;
+	}
+
+	page &l3_page = page::get_from_base_address(l4.base_address());
+	pdpe &l3 = (*(pdp *)l3_page.base_address_ptr())[pdp_index(virtual_address)];
+	if (!l3.present()) {
+		return;
+	}
+
+	// With a batch, a table that has been left empty is freed along with the mapping, once no core can still be
+	// walking it.  This is only done in the lower (user) half: the kernel's tables are reachable from every address
+	// space, and entries for them may be cached under any PCID, which a batch doesn't invalidate.
+	bool free_tables = batch && pml4_index(virtual_address) < 0x100;
+
+	// Whether an entry has been cleared from the table at each level.
+	bool l3_cleared = false;
+
+	if (l3.size()) {
+		l3.reset();
+		l3_cleared = true;
+	} else {
+		page &l2_page = page::get_from_base_address(l3.base_address());
+		pde &l2 = (*(pd *)l2_page.base_address_ptr())[pd_index(virtual_address)];
+		if (!l2.present()) {
+			return;
+		}
+
+		bool l2_cleared = false;
+
+		if (l2.size()) {
+			l2.reset();
+			l2_cleared = true;
+		} else {
+			page &l1_page = page::get_from_base_address(l2.base_address());
+			pte &l1 = (*(pt *)l1_page.base_address_ptr())[pt_index(virtual_address)];
+			if (!l1.present()) {
+				return;
+			}
+
+			l1.reset();
+
+			if (remove_entry(l1_page) && free_tables) {
+				l2.reset();
+				batch->free_table_after(l1_page);
+				l2_cleared = true;
+			}
+		}
+
+		if (l2_cleared && remove_entry(l2_page) && free_tables) {
+			l3.reset();
+			batch->free_table_after(l2_page);
+			l3_cleared = true;
+		}
+	}
+
+	if (l3_cleared && remove_entry(l3_page) && free_tables) {
+		l4.reset();
+		batch->free_table_after(l3_page);
+	}
+
+	if (batch) {
+		batch->add(virtual_address);
+	} else {
+		// This only invalidates the translation on the calling core.
+		asm volatile("invlpg (%0)" ::"r"(virtual_address) : "memory");
+	}
+}
+
+static u64 mapping_size_bytes(mapping_size size)
+{
+	switch (size) {
+	case mapping_size::m1g:
+		return GB(1);
+	case mapping_size::m2m:
+		return MB(2);
+	default:
+		return PAGE_SIZE;
+	}
+}
+
+void x86_page_table::map_range(page_table_allocator &pta, u64 virtual_address, u64 physical_address, u64 length, mapping_flags flags)
+{
+	u64 offset = 0;
+
+	while (offset < length) {
+		u64 va = virtual_address + offset;
+		u64 pa = physical_address + offset;
+		mapping_size size = mapping_size::m4k;
+
+		static const mapping_size large_sizes[] = { mapping_size::m1g, mapping_size::m2m };
+
+		for (mapping_size candidate : large_sizes) {
+			u64 bytes = mapping_size_bytes(candidate);
+
+			if (!(va & (bytes - 1)) && !(pa & (bytes - 1)) && length - offset >= bytes && is_unmapped(va, candidate)) {
+				size = candidate;
+				break;
+			}
+		}
+
+		map(pta, va, pa, flags, size);
+		offset += mapping_size_bytes(size);
+	}
+}
+
+void x86_page_table::unmap_range(page_table_allocator &pta, u64 virtual_address, u64 length, tlb_batch *batch)
+{
+	u64 end = virtual_address + length;
+	u64 va = virtual_address;
+
+	while (va < end) {
+		mapping m = get_mapping(va);
+		u64 bytes = m.result == mapping_result::ok ? mapping_size_bytes(m.size) : PAGE_SIZE;
+
+		if (m.result == mapping_result::ok) {
+			unmap(pta, va, batch);
+		}
+
+		// Carry on from the end of whatever page was there.
+		va = (va & ~(bytes - 1)) + bytes;
+	}
+}
+
+void x86_page_table::reserve_pml4_entry(page_table_allocator &pta, u64 virtual_address)
+{
+	pml4e &l4 = pml4_[pml4_index(virtual_address)];
+	if (l4.present()) {
+		return;
+	}
+
+	// The entry is only ever used for kernel mappings, whose own entries decide the access allowed.
+	page *l3page = pta.allocate();
+	l4.reset();
+	l4.base_address(l3page->base_address());
+	l4.present(true);
+	l4.rw(true);
+	l4.us(false);
+}
+
+bool x86_page_table::is_unmapped(u64 virtual_address, mapping_size size)
+{
+	pml4e &l4 = pml4_[pml4_index(virtual_address)];
+	if (!l4.present()) {
+		return true;
+	}
+
+	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
+	if (!l3.present()) {
+		return true;
+	}
+
+	if (size == mapping_size::m1g || l3.size()) {
+		return false;
+	}
+
+	pde &l2 = (*(pd *)page::get_from_base_address(l3.base_address()).base_address_ptr())[pd_index(virtual_address)];
+	if (!l2.present()) {
+		return true;
+	}
+
+	if (size == mapping_size::m2m || l2.size()) {
+		return false;
+	}
+
+	return !(*(pt *)page::get_from_base_address(l2.base_address()).base_address_ptr())[pt_index(virtual_address)].present();
 }
 
 mapping x86_page_table::get_mapping(u64 virtual_address)
 {
 	pml4e &l4 = pml4_[pml4_index(virtual_address)];
 	if (!l4.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_size::m4k };
 	}
 
 	pdpe &l3 = (*(pdp *)page::get_from_base_address(l4.base_address()).base_address_ptr())[pdp_index(virtual_address)];
 	if (!l3.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_size::m4k };
 	}
 
 	if (l3.size()) {
-		return { mapping_result::ok, l3.base_address() + l3_pg_off(virtual_address) };
+		return { mapping_result::ok, l3.base_address() + l3_pg_off(virtual_address), mapping_size::m1g };
 	}
 
 	pde &l2 = (*(pd *)page::get_from_base_address(l3.base_address()).base_address_ptr())[pd_index(virtual_address)];
 	if (!l2.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_size::m4k };
 	}
 
 	if (l2.size()) {
-		return { mapping_result::ok, l2.base_address() + l2_pg_off(virtual_address) };
+		return { mapping_result::ok, l2.base_address() + l2_pg_off(virtual_address), mapping_size::m2m };
 	}
 
 	pte &l1 = (*(pt *)page::get_from_base_address(l2.base_address()).base_address_ptr())[pt_index(virtual_address)];
 	if (!l1.present()) {
-		return { mapping_result::unmapped, 0 };
+		return { mapping_result::unmapped, 0, mapping_size::m4k };
 	}
 
-	return { mapping_result::ok, l1.base_address() + l1_pg_off(virtual_address) };
+	return { mapping_result::ok, l1.base_address() + l1_pg_off(virtual_address), mapping_size::m4k };
 }
 
 void x86_page_table::dump() const
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/benchmarks.h>
+#include <stacsos/kernel/debug.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+
+extern "C" benchmark __benchmarks_start[], __benchmarks_end[];
+
+benchmark *benchmarks::begin() { return __benchmarks_start; }
+benchmark *benchmarks::end() { return __benchmarks_end; }
+
+/**
+ * Matches a name against one element of a pattern, which ends at the end of the string, or at a comma.
+ */
+static bool glob_matches(const char *pattern, const char *name)
+{
+	while (*pattern && *pattern != ',') {
+		if (*pattern == '*') {
+			// A star matches the shortest run that lets the rest of the pattern match.
+			for (const char *rest = name;; rest++) {
+				if (glob_matches(pattern + 1, rest)) {
+					return true;
+				}
+
+				if (!*rest) {
+					return false;
+				}
+			}
+		}
+
+		if (!*name || (*pattern != '?' && *pattern != *name)) {
+			return false;
+		}
+
+		pattern++;
+		name++;
+	}
+
+	return !*name;
+}
+
+bool benchmarks::matches(const char *pattern, const char *name)
+{
+	while (true) {
+		if (glob_matches(pattern, name)) {
+			return true;
+		}
+
+		while (*pattern && *pattern != ',') {
+			pattern++;
+		}
+
+		if (!*pattern) {
+			return false;
+		}
+
+		pattern++;
+	}
+}
+
+static void sift_down(u64 *values, u64 root, u64 count)
+{
+	while (root * 2 + 1 < count) {
+		u64 child = root * 2 + 1;
+		if (child + 1 < count && values[child + 1] > values[child]) {
+			child++;
+		}
+
+		if (values[root] >= values[child]) {
+			return;
+		}
+
+		u64 tmp = values[root];
+		values[root] = values[child];
+		values[child] = tmp;
+
+		root = child;
+	}
+}
+
+/**
+ * Sorts the samples in place, with heapsort, so that there can be as many as will fit in memory.
+ */
+static void sort_samples(u64 *values, u64 count)
+{
+	for (u64 i = count / 2; i > 0; i--) {
+		sift_down(values, i - 1, count);
+	}
+
+	for (u64 end = count; end > 1; end--) {
+		u64 tmp = values[0];
+		values[0] = values[end - 1];
+		values[end - 1] = tmp;
+
+		sift_down(values, 0, end - 1);
+	}
+}
+
+static u64 time_batch(const benchmark &b, u64 iterations)
+{
+	u64 start = __builtin_ia32_rdtsc();
+	b.fn(iterations);
+	return __builtin_ia32_rdtsc() - start;
+}
+
+unsigned int benchmarks::run(const char *pattern, u64 nr_samples)
+{
+	if (!nr_samples) {
+		nr_samples = 1;
+	}
+
+	dprintf("bench: running benchmarks matching '%s', %llu samples each\n", pattern, nr_samples);
+
+	unsigned int nr_run = 0;
+	for (benchmark *b = begin(); b < end(); b++) {
+		if (matches(pattern, b->name)) {
+			run_one(*b, nr_samples);
+			nr_run++;
+		}
+	}
+
+	dprintf("bench: ran %u of %u benchmarks\n", nr_run, count());
+	return nr_run;
+}
+
+void benchmarks::run_one(const benchmark &b, u64 nr_samples)
+{
+	// The first run sets up anything the benchmark keeps for later, and brings its code and data into the caches.
+	b.fn(1);
+
+	u64 batch = 1;
+	while (batch < max_batch && time_batch(b, batch) < min_sample_cycles) {
+		batch *= 2;
+	}
+
+	u64 *samples = new u64[nr_samples];
+	for (u64 i = 0; i < nr_samples; i++) {
+		samples[i] = time_batch(b, batch) / batch;
+	}
+
+	sort_samples(samples, nr_samples);
+
+	u64 p99 = samples[min((nr_samples * 99) / 100, nr_samples - 1)];
+	dprintf("bench: %s: min=%llu median=%llu p99=%llu cycles/iteration (%llu samples of %llu)\n", b.name, samples[0], samples[nr_samples / 2], p99,
+		nr_samples, batch);
+
+	delete[] samples;
+}
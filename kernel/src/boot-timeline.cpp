@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/boot-timeline.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/kernel-data-page.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::sched;
+
+void boot_timeline::record(const char *name, u64 start_tsc, u64 end_tsc) { add_entry(name, start_tsc, start_tsc, end_tsc); }
+
+void boot_timeline::add_entry(const char *name, u64 ready_tsc, u64 start_tsc, u64 end_tsc)
+{
+	unique_irq_lock l(lock_);
+
+	if (nr_entries_ >= max_entries) {
+		return;
+	}
+
+	entries_[nr_entries_++] = entry { name, start_tsc, end_tsc, ready_tsc, core::this_core_id() };
+}
+
+void boot_timeline::run_stages(const boot_stage *stages, unsigned int count)
+{
+	if (count > max_stages) {
+		panic("too many boot stages");
+	}
+
+	u64 start_tsc = __builtin_ia32_rdtsc();
+	stage_context contexts[max_stages];
+
+	stage_done_.update_and_wake_all([this, start_tsc] {
+		done_ = 0;
+		stages_start_tsc_ = start_tsc;
+	});
+
+	for (unsigned int i = 0; i < count; i++) {
+		// Only depending on earlier stages rules out cycles.
+		if (stages[i].after >> i) {
+			panic("boot stage depends on a later stage");
+		}
+
+		contexts[i] = stage_context { &stages[i], i };
+
+		auto t = process_manager::get().kernel_process()->create_thread((u64)stage_thread, &contexts[i]);
+		t->start();
+	}
+
+	u32 all = count == 32 ? ~0u : (1u << count) - 1;
+	stage_done_.wait_until([this, all] { return (done_ & all) == all; });
+}
+
+void boot_timeline::stage_thread(void *arg)
+{
+	// The context lives on the stack of the thread running the stages, which waits for this one to finish, so it is
+	// copied before then.
+	stage_context ctx = *(stage_context *)arg;
+	boot_timeline &tl = boot_timeline::get();
+
+	u64 ready_tsc = 0;
+	tl.stage_done_.wait_until([&tl, &ctx, &ready_tsc] {
+		if ((tl.done_ & ctx.stage->after) != ctx.stage->after) {
+			return false;
+		}
+
+		ready_tsc = tl.stages_start_tsc_;
+		for (unsigned int i = 0; i < ctx.index; i++) {
+			if (ctx.stage->after & (1u << i)) {
+				ready_tsc = max(ready_tsc, tl.done_tsc_[i]);
+			}
+		}
+
+		return true;
+	});
+
+	u64 start_tsc = __builtin_ia32_rdtsc();
+	ctx.stage->fn();
+	u64 end_tsc = __builtin_ia32_rdtsc();
+
+	// The entry is added first, so that the timeline is complete once the last stage is seen to be done.
+	tl.add_entry(ctx.stage->name, ready_tsc, start_tsc, end_tsc);
+
+	tl.stage_done_.update_and_wake_all([&tl, &ctx, end_tsc] {
+		tl.done_ |= 1u << ctx.index;
+		tl.done_tsc_[ctx.index] = end_tsc;
+	});
+}
+
+size_t boot_timeline::render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	entry snapshot[max_entries];
+	unsigned int count;
+
+	{
+		unique_irq_lock l(lock_);
+
+		count = nr_entries_;
+		for (unsigned int i = 0; i < count; i++) {
+			snapshot[i] = entries_[i];
+		}
+	}
+
+	u64 boot_tsc = mem::kernel_data_page::get().boot_tsc();
+	u64 ticks_per_us = max(core::this_core().timestamp_frequency() / 1'000'000, 1ull);
+
+	auto us_since_boot = [boot_tsc, ticks_per_us](u64 tsc) { return (tsc > boot_tsc ? tsc - boot_tsc : 0) / ticks_per_us; };
+
+	u64 last_end = boot_tsc;
+	for (unsigned int i = 0; i < count; i++) {
+		last_end = max(last_end, snapshot[i].end_tsc);
+	}
+
+	EMIT("# boot took %llu us; times in us since boot\n", us_since_boot(last_end));
+	EMIT("#    READY    START   DURATION  CORE  STEP\n");
+
+	for (unsigned int i = 0; i < count; i++) {
+		const entry &e = snapshot[i];
+		EMIT("%10llu %8llu %10llu  %4d  %s\n", us_since_boot(e.ready_tsc), us_since_boot(e.start_tsc), (e.end_tsc - e.start_tsc) / ticks_per_us,
+			e.core, e.name);
+	}
+
+#undef EMIT
+
+	return n;
+}
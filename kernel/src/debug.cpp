@@ -10,12 +10,18 @@
 #include <stacsos/kernel/arch/x86/pio.h>
 #include <stacsos/kernel/arch/x86/text-console.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/kernel-log.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/sleeper.h>
+#include <stacsos/memops.h>
 #include <stacsos/printf.h>
 
 using namespace stacsos;
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::sched;
 
 extern "C" char _IMAGE_START[], _IMAGE_END[];
 
@@ -28,20 +34,70 @@ void stacsos::kernel::dprintf_init()
 	dprintf_set_console(&x86_text_console);
 }
 
+// Only used when panicking, when nothing else is running.
 static char dprint_buffer[512];
 
+// Until the log drain thread is running, messages are written to the console as soon as they are logged, under the
+// lock.  After that, only the drain thread writes them out.
+static spinlock_irq dprint_lock;
+static bool dprint_async;
+
+// How often the drain thread looks for new messages.  Nothing is woken when a message is logged, as dprintf may be
+// called from the scheduler itself.
+static const u64 log_drain_interval_ms = 10;
+
 void stacsos::kernel::dprintf(const char *fmt, ...)
 {
+	char text[kernel_log::max_message_length];
+
 	va_list args;
 	va_start(args, fmt);
-	vsnprintf(dprint_buffer, sizeof(dprint_buffer), fmt, args);
+	vsnprintf(text, sizeof(text), fmt, args);
 	va_end(args);
 
-	console->write(dprint_buffer);
+	kernel_log::get().append(text, memops::strlen(text));
+
+	if (!__atomic_load_n(&dprint_async, __ATOMIC_ACQUIRE)) {
+		unique_irq_lock l(dprint_lock);
+		console->write(text);
+		console->flush();
+	}
 }
 
 void stacsos::kernel::dprintf_set_console(console_interface *iface) { console = iface; }
 
+static void log_drain_thread_proc(void *arg)
+{
+	kernel_log::cursor *c = (kernel_log::cursor *)arg;
+	char text[kernel_log::max_message_length + 1];
+
+	while (true) {
+		// Everything logged since the last look goes out together, which a console that writes in batches can send
+		// on in one go.
+		while (kernel_log::get().next(*c, text, sizeof(text))) {
+			console->write(text);
+		}
+
+		console->flush();
+
+		sleeper::get().sleep_ms(log_drain_interval_ms);
+	}
+}
+
+void stacsos::kernel::dprintf_start_async()
+{
+	// Everything logged so far has already been written out.  Something logged between here and the switch over may
+	// come out twice, but nothing is missed.
+	auto *c = new kernel_log::cursor;
+	kernel_log::get().start_cursor(*c, true);
+
+	auto drain = process_manager::get().kernel_process()->create_thread((u64)log_drain_thread_proc, c);
+	drain->start();
+
+	unique_irq_lock l(dprint_lock);
+	__atomic_store_n(&dprint_async, true, __ATOMIC_RELEASE);
+}
+
 void stacsos::kernel::dprint_data(const void *data, size_t length)
 {
 	for (size_t i = 0; i < length; i++) {
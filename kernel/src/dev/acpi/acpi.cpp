@@ -6,6 +6,7 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/x86/hpet.h>
 #include <stacsos/kernel/arch/x86/ioapic.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/arch/x86/x86-platform.h>
@@ -14,6 +15,7 @@
 #include <stacsos/kernel/dev/acpi/descriptors.h>
 #include <stacsos/kernel/dev/device-manager.h>
 #include <stacsos/kernel/dev/pci/pci-express-bus.h>
+#include <stacsos/kernel/mem/numa.h>
 
 #define SIG32(__d, __c, __b, __a) ((u32)(__d) | ((u32)__c << 8) | ((u32)__b << 16) | ((u32)__a << 24))
 #define RSDP_SIGNATURE 0x2052545020445352
@@ -23,6 +25,8 @@
 #define DSDT_SIGNATURE SIG32('D', 'S', 'D', 'T')
 #define HPET_SIGNATURE SIG32('H', 'P', 'E', 'T')
 #define MCFG_SIGNATURE SIG32('M', 'C', 'F', 'G')
+#define SRAT_SIGNATURE SIG32('S', 'R', 'A', 'T')
+#define SLIT_SIGNATURE SIG32('S', 'L', 'I', 'T')
 
 using namespace stacsos;
 using namespace stacsos::kernel;
@@ -31,6 +35,7 @@ using namespace stacsos::kernel::dev::acpi;
 using namespace stacsos::kernel::dev::pci;
 using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::mem;
 
 /**
  * Scans memory for the RSDP by looking for the RSDP signature.  Returns a
@@ -103,7 +108,7 @@ bool ACPI::parse_madt_lapic(const madt_record_lapic *lapic_record)
  */
 bool ACPI::parse_madt_ioapic(const madt_record_ioapic *ioapicr)
 {
-	dprintf("madt: ioapic: id=%u, addr=%p, gsi-base=%u\n", ioapicr->ioapic_id, ioapicr->ioapic_address, ioapicr->gsi_base);
+	dprintf("madt: ioapic: id=%u, addr=%p, gsi-base=%u\n", ioapicr->ioapic_id, (void *)(uintptr_t)ioapicr->ioapic_address, ioapicr->gsi_base);
 
 	x86_platform::get().set_ioapic(new ioapic((void *)phys_to_virt(ioapicr->ioapic_address)));
 	x86_platform::get().get_ioapic()->initialise();
@@ -128,6 +133,12 @@ bool ACPI::parse_madt_iso(const madt_record_interrupt_source_override *iso)
 bool ACPI::parse_hpet(const hpet *hpet)
 {
 	dprintf("acpi: found hpet\n");
+
+	// The timer is only any use for calibration if its registers are memory mapped.
+	if (hpet->address.address_space == 0) {
+		arch::x86::hpet::get().init(hpet->address.address);
+	}
+
 	return true;
 }
 
@@ -141,7 +152,7 @@ bool ACPI::parse_mcfg(const mcfg *mcfg)
 	const configuration_space_base_address_allocation *ba = mcfg->base_addresses;
 
 	while ((uintptr_t)ba < ((uintptr_t)mcfg + mcfg->header.length)) {
-		dprintf("mcfg: base=%p, seg=%u, st=%u\n", ba->base_address, ba->segment_group_nr, ba->starting_pci_bus);
+		dprintf("mcfg: base=%p, seg=%u, st=%u\n", (void *)ba->base_address, ba->segment_group_nr, ba->starting_pci_bus);
 
 		device_manager::get().register_bus(*new pci_express_bus(platform_bus_, phys_to_virt(ba->base_address), ba->starting_pci_bus, ba->ending_pci_bus));
 		ba++;
@@ -150,6 +161,128 @@ bool ACPI::parse_mcfg(const mcfg *mcfg)
 	return true;
 }
 
+/**
+ * Parses the SRAT, recording the node of each processor and each enabled range of memory.  Proximity domains are
+ * numbered as nodes in the order they are first seen.
+ */
+void ACPI::parse_srat(const srat *srat)
+{
+	auto &topology = numa_topology::get();
+
+	const srat_record_header *rhs = &srat->records;
+	const srat_record_header *rhe = (const srat_record_header *)((uintptr_t)srat + srat->header.length);
+
+	while (rhs < rhe && rhs->length) {
+		switch (rhs->type) {
+		case 0: {
+			const srat_record_lapic *lapic = (const srat_record_lapic *)rhs;
+			if (lapic->flags & 1) {
+				u32 domain = lapic->proximity_domain_lo | ((u32)lapic->proximity_domain_hi[0] << 8) | ((u32)lapic->proximity_domain_hi[1] << 16)
+					| ((u32)lapic->proximity_domain_hi[2] << 24);
+
+				int node = topology.node_for_domain(domain);
+				if (node >= 0) {
+					dprintf("srat: lapic: apic-id=%u, domain=%u, node=%d\n", lapic->apic_id, domain, node);
+					topology.set_core_node(lapic->apic_id, node);
+				}
+			}
+			break;
+		}
+
+		case 1: {
+			const srat_record_memory *mem = (const srat_record_memory *)rhs;
+			if (mem->flags & 1) {
+				int node = topology.node_for_domain(mem->proximity_domain);
+				if (node >= 0) {
+					dprintf("srat: memory: %016llx -- %016llx, domain=%u, node=%d\n", mem->base_address, mem->base_address + mem->length,
+						mem->proximity_domain, node);
+					topology.add_memory_range(node, mem->base_address, mem->length);
+				}
+			}
+			break;
+		}
+
+		case 2: {
+			const srat_record_x2apic *x2apic = (const srat_record_x2apic *)rhs;
+			if (x2apic->flags & 1) {
+				int node = topology.node_for_domain(x2apic->proximity_domain);
+				if (node >= 0) {
+					dprintf("srat: x2apic: id=%u, domain=%u, node=%d\n", x2apic->x2apic_id, x2apic->proximity_domain, node);
+					topology.set_core_node(x2apic->x2apic_id, node);
+				}
+			}
+			break;
+		}
+
+		default:
+			break;
+		}
+
+		rhs = (const srat_record_header *)((uintptr_t)rhs + rhs->length);
+	}
+}
+
+/**
+ * Parses the SLIT, recording the distance between every pair of nodes found in the SRAT.
+ */
+void ACPI::parse_slit(const slit *slit)
+{
+	auto &topology = numa_topology::get();
+
+	for (u64 from = 0; from < slit->nr_localities; from++) {
+		int from_node = topology.find_domain(from);
+		if (from_node < 0) {
+			continue;
+		}
+
+		for (u64 to = 0; to < slit->nr_localities; to++) {
+			int to_node = topology.find_domain(to);
+			if (to_node >= 0) {
+				topology.set_distance(from_node, to_node, slit->distances[(from * slit->nr_localities) + to]);
+			}
+		}
+	}
+}
+
+bool ACPI::probe_numa()
+{
+	const rsdp_descriptor *rsdp = locate_rsdp();
+	if (!rsdp || !is_structure_valid(rsdp, sizeof(*rsdp))) {
+		return false;
+	}
+
+	const rsdt_table *rsdt = (const rsdt_table *)phys_to_virt(rsdp->rsdt_address);
+	if (!is_structure_valid(rsdt, rsdt->header.length)) {
+		return false;
+	}
+
+	// The SLIT is numbered by proximity domain, so the SRAT has to have been parsed first, to know which node each
+	// domain is.
+	const slit *slit_table = nullptr;
+	bool found_srat = false;
+
+	for (unsigned int i = 0; i < (rsdt->header.length - sizeof(rsdt->header)) / sizeof(u32); i++) {
+		const sdt_header *hdr = (const sdt_header *)phys_to_virt(rsdt->sdt_pointers[i]);
+
+		if (!is_structure_valid(hdr, hdr->length)) {
+			continue;
+		}
+
+		if (hdr->signature == SRAT_SIGNATURE) {
+			parse_srat((const srat *)hdr);
+			found_srat = true;
+		} else if (hdr->signature == SLIT_SIGNATURE) {
+			slit_table = (const slit *)hdr;
+		}
+	}
+
+	if (found_srat && slit_table) {
+		parse_slit(slit_table);
+	}
+
+	return found_srat;
+}
+
 /**
  * Parses the DSDT
  */
@@ -179,7 +312,7 @@ bool ACPI::parse_fadt(const fadt *fadt)
 		return false;
 	}
 
-	dprintf("acpi: fadt: dsdt=%p\n", fadt->dsdt);
+	dprintf("acpi: fadt: dsdt=%p\n", (void *)(uintptr_t)fadt->dsdt);
 	return parse_dsdt((const dsdt *)phys_to_virt(fadt->dsdt));
 }
 
@@ -242,7 +375,7 @@ void ACPI::initialise()
 	char oemid[7] = { 0 };
 	memops::memcpy(oemid, rsdp_->oem_id, 6);
 
-	dprintf("acpi version=%u oemid=%s rsdt=%p\n", rsdp_->revision, oemid, rsdp_->rsdt_address);
+	dprintf("acpi version=%u oemid=%s rsdt=%p\n", rsdp_->revision, oemid, (void *)(uintptr_t)rsdp_->rsdt_address);
 
 	if (rsdp_->revision > 2) {
 		panic("unsupported acpi revision");
@@ -298,6 +431,11 @@ bool ACPI::probe()
 
 			break;
 
+		case SRAT_SIGNATURE:
+		case SLIT_SIGNATURE:
+			// These have already been read by the memory manager.
+			break;
+
 		default:
 			dprintf("acpi: unsupported table: %08x\n", hdr->signature);
 			break;
@@ -11,11 +11,14 @@
 #include <stacsos/kernel/dev/device-manager.h>
 #include <stacsos/kernel/dev/gfx/graphics.h>
 #include <stacsos/kernel/dev/input/keyboard.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/sleeper.h>
 
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::dev;
 using namespace stacsos::kernel::dev::console;
 using namespace stacsos::kernel::dev::input;
+using namespace stacsos::kernel::sched;
 
 device_class physical_console::physical_console_device_class(device_class::root, "physcon");
 
@@ -23,39 +26,141 @@ void physical_console::configure()
 {
 	auto &kbd = device_manager::get().get_device_by_class<keyboard>(keyboard::keyboard_device_class);
 	kbd.set_listener(*this);
+
+	auto compositor = process_manager::get().kernel_process()->create_thread((u64)compositor_thread_proc, this);
+	compositor->start();
+
+	compositor_ = compositor;
 }
 
 void physical_console::on_vc_changed(virtual_console *prev_vc, virtual_console *next_vc)
 {
+	unique_irq_lock l(display_lock_);
+
+	// A text console's buffer is moved with set_buffer, so that any process that has mapped it follows it.  Graphics
+	// consoles keep their own buffers, and just stop being drawn.
 	if (prev_vc) {
-		auto tmp = prev_vc->internal_buffer_;
-		prev_vc->internal_buffer_ = saved_vc_buffer_;
-		memops::memcpy(prev_vc->internal_buffer_, tmp, saved_vc_buffer_size_);
+		if (prev_vc->mode() == virtual_console_mode::text) {
+			auto tmp = prev_vc->internal_buffer_;
+			prev_vc->set_buffer(saved_vc_buffer_);
+			memops::memcpy(prev_vc->internal_buffer_, tmp, saved_vc_buffer_size_);
+		} else {
+			prev_vc->set_flush_event(nullptr);
+		}
 
 		prev_vc->deactivate();
 	}
 
 	assert(next_vc);
 
-	saved_vc_buffer_ = next_vc->internal_buffer_;
-	saved_vc_buffer_size_ = next_vc->internal_buffer_size_;
-
 	switch (next_vc->mode()) {
 	case virtual_console_mode::text:
+		shown_vc_ = nullptr;
+
+		saved_vc_buffer_ = next_vc->internal_buffer_;
+		saved_vc_buffer_size_ = next_vc->internal_buffer_size_;
+
 		gdev_.reset();
-		next_vc->internal_buffer_ = (u8 *)(0xffff'8000'000b'8000ull);
+		next_vc->set_buffer((u8 *)(0xffff'8000'000b'8000ull));
+		memops::memcpy(next_vc->internal_buffer_, saved_vc_buffer_, saved_vc_buffer_size_);
 		break;
 
 	case virtual_console_mode::gfx:
-		gdev_.set_mode(640, 480, 32);
-		next_vc->internal_buffer_ = (u8 *)gdev_.fb();
+		if (!prev_vc || prev_vc->mode() != virtual_console_mode::gfx) {
+			gdev_.set_mode(virtual_console::GFX_MODE_WIDTH, virtual_console::GFX_MODE_HEIGHT, 32);
+			fb_lines_ = gdev_.set_virtual_height(virtual_console::GFX_MODE_HEIGHT * 4);
+		}
+
+		// The new console is drawn in full, at the top of the framebuffer, the next time the compositor runs.
+		fb_origin_ = 0;
+		gdev_.set_y_offset(0);
+		shown_vc_ = next_vc;
+
+		next_vc->set_flush_event(&flush_event_);
+		next_vc->add_damage_lines(0, virtual_console::GFX_MODE_HEIGHT);
 		break;
 	}
 
-	memops::memcpy(next_vc->internal_buffer_, saved_vc_buffer_, saved_vc_buffer_size_);
 	next_vc->activate();
 }
 
+void physical_console::compositor_thread_proc(void *arg) { ((physical_console *)arg)->composite(); }
+
+void physical_console::composite()
+{
+	// Damage arriving while the compositor sleeps between frames leaves the event triggered, so it is drawn in the
+	// next frame, and a burst of writes is drawn all at once.
+	static const u64 frame_interval_ms = 16;
+
+	while (true) {
+		flush_event_.wait();
+
+		bool again;
+		do {
+			again = flush();
+			sleeper::get().sleep_ms(frame_interval_ms);
+		} while (again);
+	}
+}
+
+bool physical_console::flush()
+{
+	const int screen_lines = virtual_console::GFX_MODE_HEIGHT;
+	const size_t pitch = virtual_console::GFX_MODE_WIDTH * 4;
+
+	// The framebuffer is copied to a band of lines at a time, so that the display lock (which keeps the console from
+	// being switched away mid-copy) isn't held for long.
+	const int band_lines = 16;
+
+	unique_irq_lock l(display_lock_);
+
+	virtual_console *vc = shown_vc_;
+	if (!vc) {
+		return false;
+	}
+
+	virtual_console::damage d = vc->take_damage();
+
+	// A scroll is followed by moving the screen down the framebuffer, so only what is new needs copying.  Once the
+	// screen reaches the bottom of the framebuffer, it goes back to the top, and is drawn in full.
+	int origin = fb_origin_;
+	if (d.scrolled) {
+		if (d.scrolled < screen_lines && origin + screen_lines + d.scrolled <= fb_lines_) {
+			origin += d.scrolled;
+		} else {
+			origin = 0;
+			d = virtual_console::damage { 0, 0, virtual_console::GFX_MODE_WIDTH, screen_lines, d.scrolled };
+		}
+	}
+
+	for (int y = d.y0; y < d.y1 && !d.empty(); y += band_lines) {
+		int lines = min(band_lines, d.y1 - y);
+		gdev_.blit_rect(vc->internal_buffer_, pitch, d.x0, y, d.x1 - d.x0, lines, origin);
+
+		l.unlock();
+		l.lock();
+
+		if (shown_vc_ != vc) {
+			return false;
+		}
+	}
+
+	if (origin != fb_origin_) {
+		fb_origin_ = origin;
+		gdev_.set_y_offset(origin);
+	}
+
+	l.unlock();
+
+	// If the console scrolled while it was being copied, the lines copied after that came from the wrong place, so it
+	// is drawn again in full next frame.
+	if (!d.empty() && vc->has_scrolled()) {
+		vc->add_damage_lines(0, screen_lines);
+	}
+
+	return vc->is_mapped();
+}
+
 void physical_console::on_key_down(keys key)
 {
 	switch (key) {
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/console/virtio-console-device.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::console;
+using namespace stacsos::kernel::dev::virtio;
+using namespace stacsos::kernel::mem;
+
+device_class virtio_console_device::virtio_console_device_class(device_class::root, "hvc");
+
+bool virtio_console_device::bring_up()
+{
+	if (!transport_.probe()) {
+		return false;
+	}
+
+	// None of the console's own features (its size, more ports, or emergency writes) are any use for a log.
+	u64 features;
+	if (!transport_.negotiate_features(VIRTIO_F_RING_EVENT_IDX, features)) {
+		transport_.fail();
+		return false;
+	}
+
+	if (!tx_.setup(max_buffers, VIRTIO_MSI_NO_VECTOR, !!(features & VIRTIO_F_RING_EVENT_IDX))) {
+		transport_.fail();
+		return false;
+	}
+
+	page *buffers = memory_manager::get().pgalloc().allocate_pages(buffers_order, page_allocation_flags::none);
+	if (!buffers) {
+		panic("virtio-console: out of memory");
+	}
+
+	buffers_phys_ = buffers->base_address();
+	buffers_ = (u8 *)phys_to_virt(buffers_phys_);
+
+	nr_buffers_ = min((unsigned int)tx_.size(), max_buffers);
+	for (unsigned int i = 0; i < nr_buffers_; i++) {
+		tx_.desc(i).addr = buffers_phys_ + (i * PAGE_SIZE);
+		tx_.desc(i).flags = 0;
+		tx_.desc(i).next = 0;
+
+		free_buffers_[nr_free_buffers_++] = (u16)(nr_buffers_ - 1 - i);
+	}
+
+	transport_.driver_ok();
+
+	dprintf("virtio-console: %u buffers of %u bytes, event-idx=%d\n", nr_buffers_, (unsigned int)PAGE_SIZE, !!(features & VIRTIO_F_RING_EVENT_IDX));
+
+	unique_irq_lock l(lock_);
+	ready_ = true;
+
+	return true;
+}
+
+void virtio_console_device::write_char(unsigned char c, u8 attr)
+{
+	unique_irq_lock l(lock_);
+
+	if (!ready_ || !c) {
+		return;
+	}
+
+	// If every buffer is with the device, this waits for it to finish with one.
+	while (current_ < 0) {
+		reclaim();
+
+		if (nr_free_buffers_) {
+			current_ = free_buffers_[--nr_free_buffers_];
+			fill_ = 0;
+		} else {
+			tx_.kick();
+			__relax();
+		}
+	}
+
+	buffers_[(current_ * PAGE_SIZE) + fill_++] = c;
+
+	if (fill_ == PAGE_SIZE) {
+		submit_current();
+		tx_.kick();
+	}
+}
+
+void virtio_console_device::flush()
+{
+	unique_irq_lock l(lock_);
+
+	if (!ready_) {
+		return;
+	}
+
+	submit_current();
+	tx_.kick();
+}
+
+void virtio_console_device::submit_current()
+{
+	// Called with the lock held.
+	if (current_ < 0 || !fill_) {
+		return;
+	}
+
+	tx_.desc((u16)current_).len = fill_;
+	tx_.add((u16)current_);
+
+	current_ = -1;
+	fill_ = 0;
+}
+
+void virtio_console_device::reclaim()
+{
+	// Called with the lock held.
+	u16 head;
+	u32 length;
+
+	while (tx_.next_used(head, length)) {
+		free_buffers_[nr_free_buffers_++] = head;
+	}
+}
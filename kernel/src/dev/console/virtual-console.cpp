@@ -10,14 +10,20 @@
 #include <stacsos/kernel/dev/console/console-font.h>
 #include <stacsos/kernel/dev/console/virtual-console.h>
 #include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page.h>
 #include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/scheduler.h>
 #include <stacsos/kernel/sched/sleeper.h>
+#include <stacsos/kernel/sched/wait-set.h>
 
 using namespace stacsos::kernel::arch::x86;
 using namespace stacsos::kernel::dev;
 using namespace stacsos::kernel::dev::console;
 using namespace stacsos::kernel::dev::input;
 using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::mem;
 using namespace stacsos::kernel::sched;
 using namespace stacsos;
 
@@ -37,10 +43,72 @@ void virtual_console::configure()
 		active_font->parse();
 		rows_ = GFX_MODE_HEIGHT / active_font->char_dims().height();
 		cols_ = GFX_MODE_WIDTH / active_font->char_dims().width();
+
+		palettes_ = new glyph_palette[nr_palettes];
+		for (int i = 0; i < nr_palettes; i++) {
+			palettes_[i].attr = -1;
+		}
 		break;
 	}
 }
 
+int virtual_console::buffer_order() const
+{
+	int order = 0;
+	while ((PAGE_SIZE << order) < internal_buffer_size_) {
+		order++;
+	}
+
+	return order;
+}
+
+u8 *virtual_console::allocate_buffer()
+{
+	page *pg = memory_manager::get().pgalloc().allocate_pages(buffer_order(), page_allocation_flags::zero);
+	if (!pg) {
+		panic("unable to allocate virtual console buffer");
+	}
+
+	return (u8 *)pg->base_address_ptr();
+}
+
+void virtual_console::free_buffer(u8 *buffer) { memory_manager::get().pgalloc().free_pages(page::get_from_base_address_ptr(buffer), buffer_order()); }
+
+void virtual_console::set_buffer(u8 *buffer)
+{
+	unique_irq_lock l(mappings_lock_);
+
+	// Anything faulting in a page of the buffer from here on gets the new one, and the mappings of the old one are
+	// dropped afterwards.  The buffer is read without the lock, as faults come in with the address space locked.
+	__atomic_store_n(&internal_buffer_, buffer, __ATOMIC_SEQ_CST);
+
+	for (auto &m : mappings_) {
+		m.as->unmap_device_file(*m.file);
+	}
+}
+
+u64 virtual_console::buffer_frame(u64 index) const
+{
+	if (index >= (internal_buffer_size_ + PAGE_SIZE - 1) >> PAGE_BITS) {
+		return 0;
+	}
+
+	u8 *buffer = __atomic_load_n(&internal_buffer_, __ATOMIC_SEQ_CST);
+	return ((u64)buffer - 0xffff'8000'0000'0000ull) + (index << PAGE_BITS);
+}
+
+void virtual_console::add_mapping(address_space &as, const file &f)
+{
+	unique_irq_lock l(mappings_lock_);
+	mappings_.append(buffer_mapping { &as, &f });
+}
+
+void virtual_console::remove_mapping(address_space &as, const file &f)
+{
+	unique_irq_lock l(mappings_lock_);
+	mappings_.remove(buffer_mapping { &as, &f });
+}
+
 void virtual_console::on_key_up(keys key)
 {
 	// TODO: buggy if two shift/ctrl keys held down
@@ -158,31 +226,127 @@ static u32 vga_colour_map[] = {
 	/* HI */ 0x404040, 0x0000ff, 0x00ff00, 0x00ffff, 0xff0000, 0xff00ff, 0xffff00, 0xffffff
 };
 
+const virtual_console::glyph_palette &virtual_console::palette_for(u8 attr)
+{
+	for (int i = 0; i < nr_palettes; i++) {
+		if (palettes_[i].attr == attr) {
+			return palettes_[i];
+		}
+	}
+
+	glyph_palette &p = palettes_[next_palette_];
+	next_palette_ = (next_palette_ + 1) % nr_palettes;
+
+	u32 fg_colour = vga_colour_map[attr & 0xf];
+	u32 bg_colour = vga_colour_map[(attr >> 4) & 0xf];
+
+	for (int bits = 0; bits < 256; bits++) {
+		for (int cx = 0; cx < 8; cx++) {
+			p.rows[bits][cx] = (bits & (1 << (7 - cx))) ? fg_colour : bg_colour;
+		}
+	}
+
+	p.attr = attr;
+	return p;
+}
+
 void virtual_console::render_char(int x, int y, unsigned char ch, u8 attr)
 {
 	if (mode_ == virtual_console_mode::text) {
 		u16 *text_buffer = (u16 *)internal_buffer_;
 		text_buffer[x + (y * cols_)] = ((u16)attr << 8) | (u16)ch;
 	} else if (mode_ == virtual_console_mode::gfx) {
-		u32 fg_colour = vga_colour_map[attr & 0xf];
-		u32 bg_colour = vga_colour_map[(attr >> 4) & 0xf];
-
-		u32 *frame_buffer = (u32 *)internal_buffer_;
+		const glyph_palette &palette = palette_for(attr);
 
+		// Glyphs are eight pixels wide (as get_pixel assumes too), so each row of one is a single byte, and is drawn by
+		// copying the palette's row for it.
 		console_font_char font_char = active_font->get_char(ch);
-		unsigned int pixel_offset = (x * font_char.dims().width()) + (y * GFX_MODE_WIDTH * font_char.dims().height());
-		// const char *char_data = &console_font_data[(int)ch * console_char_height];
+		const u8 *glyph_rows = font_char.rows();
+		int height = font_char.dims().height();
+
+		u64 *dest = (u64 *)((u32 *)internal_buffer_ + (x * 8) + (y * GFX_MODE_WIDTH * height));
+		for (int cy = 0; cy < height; cy++) {
+			const u64 *src = (const u64 *)palette.rows[glyph_rows[cy]];
+			dest[0] = src[0];
+			dest[1] = src[1];
+			dest[2] = src[2];
+			dest[3] = src[3];
+
+			dest += GFX_MODE_WIDTH / 2;
+		}
 
-		for (int cy = 0; cy < font_char.dims().height(); cy++) {
-			for (int cx = 0; cx < font_char.dims().width(); cx++) {
-				// frame_buffer[pixel_offset + cx + (GFX_MODE_WIDTH * cy)] = ((*char_data) & (1 << (7 - cx))) ? fg_colour : bg_colour;
-				frame_buffer[pixel_offset + cx + (GFX_MODE_WIDTH * cy)] = font_char.get_pixel(cx, cy) ? fg_colour : bg_colour;
-			}
+		add_damage(x * 8, y * height, (x + 1) * 8, (y + 1) * height);
+	}
+}
+
+void virtual_console::add_damage(int x0, int y0, int x1, int y1)
+{
+	sched::auto_reset_event *flush_event;
+
+	{
+		unique_irq_lock l(damage_lock_);
+
+		bool was_empty = damage_.empty();
+		if (was_empty) {
+			damage_.x0 = x0;
+			damage_.y0 = y0;
+			damage_.x1 = x1;
+			damage_.y1 = y1;
+		} else {
+			damage_.x0 = min(damage_.x0, x0);
+			damage_.y0 = min(damage_.y0, y0);
+			damage_.x1 = max(damage_.x1, x1);
+			damage_.y1 = max(damage_.y1, y1);
 		}
+
+		// Only the first damage since the last flush needs to wake the physical console up.
+		flush_event = was_empty ? flush_event_ : nullptr;
+	}
+
+	if (flush_event) {
+		flush_event->trigger();
+	}
+}
+
+virtual_console::damage virtual_console::take_damage()
+{
+	bool mapped = is_mapped();
+
+	unique_irq_lock l(damage_lock_);
+
+	damage d = damage_;
+	if (mapped) {
+		d.x0 = d.y0 = 0;
+		d.x1 = GFX_MODE_WIDTH;
+		d.y1 = GFX_MODE_HEIGHT;
 	}
+
+	damage_ = damage { 0, 0, 0, 0, 0 };
+	return d;
+}
+
+void virtual_console::set_flush_event(sched::auto_reset_event *flush_event)
+{
+	unique_irq_lock l(damage_lock_);
+	flush_event_ = flush_event;
 }
 
 void virtual_console::write_char(unsigned char ch, u8 attr)
+{
+	put_char(ch, attr);
+	update_cursor();
+}
+
+void virtual_console::write(const u8 *chars, size_t count, u8 attr)
+{
+	for (size_t i = 0; i < count; i++) {
+		put_char(chars[i], attr);
+	}
+
+	update_cursor();
+}
+
+void virtual_console::put_char(unsigned char ch, u8 attr)
 {
 	switch (ch) {
 	case '\n':
@@ -224,17 +388,45 @@ void virtual_console::write_char(unsigned char ch, u8 attr)
 				text_buffer[i] = 0x0720;
 			}
 		} else {
-			u32 *frame_buffer = (u32 *)internal_buffer_;
-
-			memops::memcpy(frame_buffer, &frame_buffer[GFX_MODE_WIDTH * active_font->char_dims().height()],
-				((GFX_MODE_WIDTH * GFX_MODE_HEIGHT) - (GFX_MODE_WIDTH * active_font->char_dims().height())) * 4);
-			memops::memset(&frame_buffer[((GFX_MODE_WIDTH * GFX_MODE_HEIGHT) - (GFX_MODE_WIDTH * active_font->char_dims().height()))], 0,
-				(GFX_MODE_WIDTH * active_font->char_dims().height()) * 4);
+			scroll_gfx();
 		}
 		y_ = rows_ - 1;
 	}
+}
+
+void virtual_console::scroll_gfx()
+{
+	const int line_bytes = GFX_MODE_WIDTH * 4;
+	const int row_lines = active_font->char_dims().height();
+
+	unique_irq_lock l(damage_lock_);
+
+	// The buffer is in ordinary memory, so moving it up is cheap.  The screen is only told how far it has scrolled,
+	// so that it can pan down the framebuffer rather than draw everything again.
+	memops::memcpy(internal_buffer_, internal_buffer_ + row_lines * line_bytes, (GFX_MODE_HEIGHT - row_lines) * line_bytes);
+	memops::memset(internal_buffer_ + (GFX_MODE_HEIGHT - row_lines) * line_bytes, 0, row_lines * line_bytes);
+
+	// Whatever was damaged has moved up with everything else, and the new row at the bottom needs drawing.
+	bool was_empty = damage_.empty();
+	if (was_empty) {
+		damage_.x0 = 0;
+		damage_.x1 = GFX_MODE_WIDTH;
+		damage_.y0 = GFX_MODE_HEIGHT - row_lines;
+	} else {
+		damage_.x0 = 0;
+		damage_.x1 = GFX_MODE_WIDTH;
+		damage_.y0 = max(damage_.y0 - row_lines, 0);
+	}
 
-	update_cursor();
+	damage_.y1 = GFX_MODE_HEIGHT;
+	damage_.scrolled = min(damage_.scrolled + row_lines, GFX_MODE_HEIGHT);
+
+	sched::auto_reset_event *flush_event = was_empty ? flush_event_ : nullptr;
+	l.unlock();
+
+	if (flush_event) {
+		flush_event->trigger();
+	}
 }
 
 void virtual_console::activate()
@@ -243,6 +435,9 @@ void virtual_console::activate()
 
 	if (mode_ == virtual_console_mode::gfx) {
 		auto cft = process_manager::get().kernel_process()->create_thread((u64)cursor_flasher_thread_proc, this);
+
+		// The cursor should keep flashing, however busy the system is.  It only runs briefly, twice a second.
+		scheduler::get().set_priority(*cft, sched_policy::fifo, 1);
 		cft->start();
 
 		cursor_flasher_ = cft;
@@ -267,6 +462,8 @@ void virtual_console::clear()
 		for (int i = 0; i < GFX_MODE_PIXELS; i++) {
 			frame_buffer[i] = 0;
 		}
+
+		add_damage_lines(0, GFX_MODE_HEIGHT);
 	}
 
 	update_cursor();
@@ -275,10 +472,11 @@ void virtual_console::clear()
 void virtual_console::cursor_flasher_thread_proc(void *arg)
 {
 	virtual_console *vc = (virtual_console *)arg;
-	u32 *frame_buffer = (u32 *)vc->internal_buffer_;
 
 	while (1) {
-		unsigned int pixel_offset = (vc->x_ * 8) + (vc->y_ * GFX_MODE_WIDTH * 15);
+		u32 *frame_buffer = (u32 *)vc->internal_buffer_;
+		int x = vc->x_, y = vc->y_;
+		unsigned int pixel_offset = (x * 8) + (y * GFX_MODE_WIDTH * 15);
 
 		for (int cy = 14; cy < 15; cy++) {
 			for (int cx = 0; cx < 8; cx++) {
@@ -286,6 +484,7 @@ void virtual_console::cursor_flasher_thread_proc(void *arg)
 			}
 		}
 
+		vc->add_damage(x * 8, y * 15 + 14, (x + 1) * 8, (y + 1) * 15);
 		sleeper::get().sleep_ms(500);
 
 		for (int cy = 14; cy < 15; cy++) {
@@ -294,6 +493,8 @@ void virtual_console::cursor_flasher_thread_proc(void *arg)
 			}
 		}
 
+		vc->add_damage(x * 8, y * 15 + 14, (x + 1) * 8, (y + 1) * 15);
+
 		sleeper::get().sleep_ms(500);
 	}
 }
@@ -339,6 +540,15 @@ u8 virtual_console::read_char()
 	return elem;
 }
 
+bool virtual_console::input_ready(wait_set *ws)
+{
+	if (ws) {
+		ws->add(read_buffer_event_.waiters());
+	}
+
+	return read_buffer_head_ != read_buffer_tail_;
+}
+
 namespace stacsos::kernel::dev::console {
 
 class virtual_console_file : public file {
@@ -368,6 +578,11 @@ public:
 
 		if (vc_.mode() == virtual_console_mode::gfx) {
 			memops::memcpy(&((u32 *)vc_.internal_buffer_)[offset], buffer, clamped_length);
+
+			const int width = virtual_console::GFX_MODE_WIDTH;
+			int first_line = offset / width;
+			int last_line = (offset + (clamped_length + 3) / 4 + width - 1) / width;
+			vc_.add_damage_lines(first_line, min(last_line, virtual_console::GFX_MODE_HEIGHT));
 		} else {
 			memops::memcpy(&((u16 *)vc_.internal_buffer_)[offset], buffer, clamped_length);
 		}
@@ -375,6 +590,14 @@ public:
 		return clamped_length;
 	}
 
+	/**
+	 * @brief The console's buffer can be mapped, so that a process can draw straight onto the screen, or onto the
+	 * console's own buffer while it is in the background.
+	 */
+	virtual u64 device_frame(u64 index) override { return vc_.buffer_frame(index); }
+	virtual void device_mapped(mem::address_space &as) override { vc_.add_mapping(as, *this); }
+	virtual void device_unmapped(mem::address_space &as) override { vc_.remove_mapping(as, *this); }
+
 	virtual u64 ioctl(u64 cmd, void *buffer, size_t length) override
 	{
 		switch (cmd) {
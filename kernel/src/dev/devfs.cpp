@@ -16,20 +16,55 @@ using namespace stacsos::kernel::fs;
 devfs::devfs()
 	: root_(new devfs_node(*this, nullptr, fs_node_kind::directory, "", nullptr))
 {
+	device_manager::get().add_name_listener(*this);
 }
 
-fs_node *devfs_node::resolve_child(const string &name)
+void devfs::device_named(const string &name, device &dev)
 {
-	if (dev_ != nullptr) {
-		return nullptr;
+	{
+		unique_irq_lock l(root_->children_lock_);
+		if (root_->children_.find(name)) {
+			return;
+		}
+
+		root_->children_.insert(new devfs_node(*this, root_, fs_node_kind::file, name, &dev));
 	}
 
-	dprintf("devfs: resolve %s\n", name.c_str());
+	// A lookup may have found nothing by this name before, and had that remembered.
+	root_->child_added(name);
+}
 
-	device *dp;
-	if (!device_manager::get().try_get_device_by_name(name, dp)) {
+fs_node *devfs_node::mkdir(const char *name)
+{
+	if (parent()) {
 		return nullptr;
 	}
 
-	return new devfs_node(fs(), this, fs_node_kind::file, name, dp);
+	string dir_name(name);
+	devfs_node *dir;
+
+	{
+		unique_irq_lock l(children_lock_);
+		if (children_.find(dir_name)) {
+			return nullptr;
+		}
+
+		dir = new devfs_node(fs(), this, fs_node_kind::directory, dir_name, nullptr);
+		children_.insert(dir);
+	}
+
+	child_added(dir_name);
+	return dir;
+}
+
+fs_node *devfs_node::resolve_child(const string_view &name)
+{
+	unique_irq_lock l(children_lock_);
+	return children_.find(name);
+}
+
+fs_node *devfs_node::child_at(u64 index)
+{
+	unique_irq_lock l(children_lock_);
+	return children_.at(index);
 }
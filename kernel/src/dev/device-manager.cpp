@@ -19,6 +19,10 @@ void device_manager::probe_buses()
 	for (auto *bus : buses_) {
 		bus->probe();
 	}
+
+	while (!late_buses_.empty()) {
+		late_buses_.dequeue()->finish_probe();
+	}
 }
 
 string device_manager::register_device(device &device)
@@ -27,17 +31,72 @@ string device_manager::register_device(device &device)
 
 	dprintf("device-manager: registering device '%s'\n", devname.c_str());
 
+	// A disk registers its partitions as it is configured, which then come after it in the list.
+	device.name_ = devname;
+
+	{
+		unique_irq_lock l(devices_lock_);
+		registered_devices_.append(&device);
+	}
+
 	device.configure();
-	devices_.add(devname.get_hash(), &device);
+	add_name(devname, device);
 
 	return devname;
 }
 
-void device_manager::add_device_alias(device &device, const string &name) { devices_.add(name.get_hash(), &device); }
+void device_manager::add_device_alias(device &device, const string &name) { add_name(name, device); }
+
+void device_manager::add_name(const string &name, device &device)
+{
+	unique_irq_lock l(names_lock_);
+
+	device_names *old_names = names_;
+	device_names *new_names = new device_names();
+
+	if (old_names) {
+		new_names->devices.reserve(old_names->devices.count() + 1);
+		for (const auto &d : old_names->devices) {
+			new_names->devices.add(d.key, d.value);
+		}
+	}
+
+	new_names->devices.add(name, &device);
+	sched::rcu_assign_pointer(names_, new_names);
+
+	// Readers may still be looking at the old version, so it is freed once they're done.
+	if (old_names) {
+		sched::call_rcu(*old_names, [](sched::rcu_head *head) { delete static_cast<device_names *>(head); });
+	}
+
+	for (auto *listener : name_listeners_) {
+		listener->device_named(name, device);
+	}
+}
+
+void device_manager::add_name_listener(device_name_listener &listener)
+{
+	// The lock is held throughout, so that the listener hears about every name exactly once.
+	unique_irq_lock l(names_lock_);
+	name_listeners_.append(&listener);
+
+	if (names_) {
+		for (const auto &d : names_->devices) {
+			listener.device_named(d.key, *d.value);
+		}
+	}
+}
 
 bool device_manager::try_get_device_by_class(const device_class &dc, device *&dp)
 {
-	for (const auto &d : devices_) {
+	sched::rcu_read_guard g;
+
+	device_names *names = sched::rcu_dereference(names_);
+	if (!names) {
+		return false;
+	}
+
+	for (const auto &d : names->devices) {
 		if (d.value->devclass().is_a(dc)) {
 			dp = d.value;
 			return true;
@@ -47,4 +106,10 @@ bool device_manager::try_get_device_by_class(const device_class &dc, device *&dp
 	return false;
 }
 
-bool device_manager::try_get_device_by_name(const string &name, device *&dp) { return devices_.try_get_value(name.get_hash(), dp); }
+bool device_manager::try_get_device_by_name(const string &name, device *&dp)
+{
+	sched::rcu_read_guard g;
+
+	device_names *names = sched::rcu_dereference(names_);
+	return names && names->devices.try_get_value(name, dp);
+}
@@ -6,6 +6,7 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/dev/gfx/qemu-stdvga.h>
+#include <stacsos/kernel/sched/preempt.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos::kernel::dev;
@@ -54,6 +55,11 @@ void qemu_stdvga::configure()
 
 void qemu_stdvga::set_mode(int width, int height, int bpp)
 {
+	// Switching between consoles in the same mode leaves the device as it is.
+	if (enabled_ && width == width_ && height == height_) {
+		return;
+	}
+
 	hw_blank(false);
 
 	dispi_write(VBE_DISPI_INDEX_ENABLE, 0);
@@ -65,17 +71,43 @@ void qemu_stdvga::set_mode(int width, int height, int bpp)
 	dispi_write(VBE_DISPI_INDEX_VIRT_HEIGHT, height);
 	dispi_write(VBE_DISPI_INDEX_X_OFFSET, 0);
 	dispi_write(VBE_DISPI_INDEX_Y_OFFSET, 0);
-	dispi_write(VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
+	dispi_write(VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED | VBE_DISPI_NOCLEARMEM);
+
+	width_ = width;
+	height_ = height;
+	enabled_ = true;
 
-	for (int i = 0; i < (width * height * 4); i++) {
-		((u8 *)fb_)[i] = 0;
+	// The device is told not to clear its memory, as it can be done a page at a time here, with stores that go
+	// straight to the framebuffer rather than through the cache.  The framebuffer is page aligned.  It is cleared in
+	// chunks, giving way to other tasks in between, when the caller can.
+	u64 nr_pages = ((u64)width * height * 4 + PAGE_SIZE - 1) >> PAGE_BITS;
+	for (u64 page = 0; page < nr_pages; page += clear_chunk_pages) {
+		memops::pzero_nt((u8 *)fb_ + (page << PAGE_BITS), min(clear_chunk_pages, nr_pages - page));
+		sched::cond_resched();
 	}
 }
 
+int qemu_stdvga::set_virtual_height(int lines)
+{
+	u64 memory = (u64)dispi_read(VBE_DISPI_INDEX_VIDEO_MEMORY_64K) * 64 * 1024;
+	lines = (int)min((u64)lines, memory / (width_ * 4));
+
+	// Bochs takes the height that is written, but QEMU works it out from the memory it has, and ignores the write, so
+	// it is read back either way.
+	dispi_write(VBE_DISPI_INDEX_VIRT_HEIGHT, lines);
+	int actual = min((int)dispi_read(VBE_DISPI_INDEX_VIRT_HEIGHT), lines);
+
+	return max(actual, height_);
+}
+
+void qemu_stdvga::set_y_offset(int line) { dispi_write(VBE_DISPI_INDEX_Y_OFFSET, line); }
+
 void qemu_stdvga::reset()
 {
 	hw_blank(false);
 	dispi_write(VBE_DISPI_INDEX_ENABLE, 0);
+
+	enabled_ = false;
 }
 
 void qemu_stdvga::blit(const void *src, size_t size)
@@ -86,3 +118,20 @@ void qemu_stdvga::blit(const void *src, size_t size)
 		hw_blank(false);
 	}
 }
+
+void qemu_stdvga::blit_rect(const void *src, size_t src_pitch, int x, int y, int width, int height, int y_offset)
+{
+	if (!fb_) {
+		return;
+	}
+
+	const u8 *from = (const u8 *)src + (y * src_pitch) + (x * 4);
+	u8 *to = (u8 *)fb_ + ((y + y_offset) * width_ * 4) + (x * 4);
+
+	for (int i = 0; i < height; i++) {
+		memops::memcpy(to, from, width * 4);
+
+		from += src_pitch;
+		to += width_ * 4;
+	}
+}
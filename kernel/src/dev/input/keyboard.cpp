@@ -14,11 +14,14 @@
 #include <stacsos/kernel/arch/x86/x86-platform.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/dev/input/keyboard.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/scheduler.h>
 
 using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::arch::x86;
 using namespace stacsos::kernel::dev;
 using namespace stacsos::kernel::dev::input;
+using namespace stacsos::kernel::sched;
 
 device_class keyboard::keyboard_device_class(device_class::root, "kbd");
 
@@ -29,7 +32,14 @@ void keyboard::configure()
 
 	// we've requested an irq from the boot core, to handle the keyboard interrupt
 	// now we need to map it to the physical irq
-	x86_platform::get().get_ioapic()->allocate_physical_irq(1, (x86_core &)core_manager::get().get_boot_core(), keyboard_irq_handler, this);
+	x86_platform::get().get_ioapic()->allocate_physical_irq(1, (x86_core &)core_manager::get().get_boot_core(), keyboard_irq_handler, this, "kbd");
+
+	// Typing should feel immediate, however busy the system is.
+	auto bh = process_manager::get().kernel_process()->create_thread((u64)bottom_half_thread_proc, this);
+	scheduler::get().set_priority(*bh, sched_policy::fifo, 1);
+	bh->start();
+
+	bottom_half_ = bh;
 }
 
 void keyboard::keyboard_irq_handler(u8 irq, void *ctx, void *arg)
@@ -38,11 +48,28 @@ void keyboard::keyboard_irq_handler(u8 irq, void *ctx, void *arg)
 
 	u8 key_event_data = ioports::keyboard_controller::read8();
 
-	device->handle_key_event(key_event_data);
+	device->fifo_.push(key_event_data);
+	device->fifo_event_.trigger();
 
 	((x86_core &)core::this_core()).lapic().eoi();
 }
 
+void keyboard::bottom_half_thread_proc(void *arg) { ((keyboard *)arg)->process_scancodes(); }
+
+void keyboard::process_scancodes()
+{
+	while (true) {
+		fifo_event_.wait();
+
+		// Everything that has arrived is handled before waiting again.  Anything arriving after the last look leaves
+		// the event triggered, so it isn't missed.
+		u8 data;
+		while (fifo_.pop(data)) {
+			handle_key_event(data);
+		}
+	}
+}
+
 void keyboard::handle_key_event(u8 key_event_data)
 {
 	if (listener_) {
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/boot-timeline.h>
+#include <stacsos/kernel/dev/misc/boot-timeline-device.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+
+device_class boot_timeline_device::boot_timeline_device_class(device_class::root, "boottime");
+
+shared_ptr<file> boot_timeline_device::open_as_file()
+{
+	return snapshot_file::create(boot_timeline::get().render_size_hint(), [](char *buffer, size_t size) { return boot_timeline::get().render(buffer, size); });
+}
@@ -1,8 +1,74 @@
+#include <stacsos/kernel/arch/x86/pio.h>
 #include <stacsos/kernel/dev/misc/cmos-rtc.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos;
 using namespace stacsos::kernel::dev;
 using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::arch::x86;
 
 device_class cmos_rtc::cmos_rtc_device_class(rtc::rtc_device_class, "cmos-rtc");
 
-rtc_timepoint cmos_rtc::read_timepoint() { panic("NOT IMPLEMENTED"); }
+static u8 read_register(u8 reg)
+{
+	ioports::cmos_select::write8(reg);
+	return ioports::cmos_data::read8();
+}
+
+static u16 from_bcd(u8 v) { return ((v >> 4) * 10) + (v & 0xf); }
+
+static rtc_timepoint read_raw()
+{
+	// Wait for any update in progress to finish, so that the registers are consistent.
+	while (read_register(0x0a) & 0x80) { }
+
+	rtc_timepoint tp;
+	tp.seconds = read_register(0x00);
+	tp.minutes = read_register(0x02);
+	tp.hours = read_register(0x04);
+	tp.day_of_month = read_register(0x07);
+	tp.month = read_register(0x08);
+	tp.year = read_register(0x09);
+
+	return tp;
+}
+
+rtc_timepoint cmos_rtc::read_timepoint()
+{
+	// An update can still start between the check and the reads, so read until two readings agree.
+	rtc_timepoint tp = read_raw();
+	while (true) {
+		rtc_timepoint again = read_raw();
+		if (memops::memcmp(&tp, &again, sizeof(tp)) == 0) {
+			break;
+		}
+
+		tp = again;
+	}
+
+	u8 status_b = read_register(0x0b);
+
+	// In 12 hour mode, the top bit of the hours marks PM.
+	bool pm = !(status_b & 0x02) && (tp.hours & 0x80);
+	tp.hours &= 0x7f;
+
+	if (!(status_b & 0x04)) {
+		tp.seconds = from_bcd(tp.seconds);
+		tp.minutes = from_bcd(tp.minutes);
+		tp.hours = from_bcd(tp.hours);
+		tp.day_of_month = from_bcd(tp.day_of_month);
+		tp.month = from_bcd(tp.month);
+		tp.year = from_bcd(tp.year);
+	}
+
+	if (pm) {
+		tp.hours = (tp.hours % 12) + 12;
+	} else if (!(status_b & 0x02) && tp.hours == 12) {
+		tp.hours = 0;
+	}
+
+	// The RTC only keeps the last two digits of the year.
+	tp.year += 2000;
+
+	return tp;
+}
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/interrupts.h>
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/x86/irq/irq-affinity.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/dev/misc/interrupts-device.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/sched/softirq.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::arch::x86::irq;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::sched;
+
+device_class interrupts_device::interrupts_device_class(device_class::root, "interrupts");
+
+static const unsigned int nr_vectors = 256;
+
+// The most that a line of each part of the listing takes.
+static const size_t max_header_line = 96;
+static const size_t max_source_line = 96;
+static const size_t max_vector_line = 64;
+
+static bool is_running(core *c) { return c->status() == core_status::online || c->status() == core_status::bootstrap; }
+
+static size_t render_size_hint()
+{
+	size_t size = 4 * max_header_line + (irq_affinity::get().nr_sources() * max_source_line);
+
+	for (auto *c : core_manager::get().cores()) {
+		if (!is_running(c)) {
+			continue;
+		}
+
+		const auto &irqs = ((x86_core *)c)->irqmgr();
+		size += 2 * max_header_line;
+
+		for (unsigned int v = 0; v < nr_vectors; v++) {
+			if (irqs.count(v)) {
+				size += max_vector_line;
+			}
+		}
+	}
+
+	return size;
+}
+
+static size_t render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	auto &affinity = irq_affinity::get();
+
+	EMIT("# device interrupts\n");
+	EMIT("  IRQ  CORE  VECTOR  NAME\n");
+	for (unsigned int i = 0; i < affinity.nr_sources(); i++) {
+		irq_source *s = affinity.source(i);
+		EMIT("%5u  %4d  %6u  %s\n", s->id(), s->core_id(), s->vector(), s->name() ? s->name() : "-");
+	}
+
+	EMIT("\n# bottom halves run\n");
+	EMIT(" CORE         TIMER       TASKLET\n");
+	for (auto *c : core_manager::get().cores()) {
+		if (is_running(c)) {
+			EMIT("%5d  %12llu  %12llu\n", c->id(), softirq::get().count(c->id(), softirq_vector::timer),
+				softirq::get().count(c->id(), softirq_vector::tasklet));
+		}
+	}
+
+	for (auto *c : core_manager::get().cores()) {
+		if (!is_running(c)) {
+			continue;
+		}
+
+		// Vectors are allocated by each core separately, so the same vector may be used for different things on
+		// different cores.
+		const auto &irqs = ((x86_core *)c)->irqmgr();
+
+		EMIT("\n# vectors raised on core %d\n", c->id());
+		EMIT(" VECTOR         COUNT  NAME\n");
+		for (unsigned int v = 0; v < nr_vectors; v++) {
+			u64 count = irqs.count(v);
+			if (count) {
+				EMIT("%7u  %12llu  %s\n", v, count, irqs.name(v) ? irqs.name(v) : "-");
+			}
+		}
+	}
+
+#undef EMIT
+
+	return n;
+}
+
+static u64 handle_ioctl(u64 cmd, void *buffer, size_t length)
+{
+	switch ((interrupts_ioctl)cmd) {
+	case interrupts_ioctl::set_affinity: {
+		irq_affinity_request request;
+		if (length < sizeof(request) || !mem::user_access::copy_from_user(&request, buffer, sizeof(request))) {
+			return 0;
+		}
+
+		return irq_affinity::get().set_affinity(request.source, (int)request.core) ? 1 : 0;
+	}
+
+	default:
+		return 0;
+	}
+}
+
+shared_ptr<file> interrupts_device::open_as_file()
+{
+	size_t size = render_size_hint();
+	return snapshot_file::create(size, render, handle_ioctl);
+}
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/dev/device-manager.h>
+#include <stacsos/kernel/dev/misc/iostat-device.h>
+#include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::dev::storage;
+
+device_class iostat_device::iostat_device_class(device_class::root, "iostat");
+
+// Room for the buffer cache, and then room for each block device, with both of its histograms full.
+static const size_t fixed_render_size = 256;
+static const size_t per_device_render_size = 4096;
+
+static size_t render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	buffer_cache::stats bcs = buffer_cache::get().get_stats();
+	u64 lookups = bcs.hits + bcs.misses;
+
+	EMIT("buffer cache: hits=%llu misses=%llu hit rate=%llu%% writebacks=%llu\n", bcs.hits, bcs.misses, lookups ? (bcs.hits * 100) / lookups : 0,
+		bcs.writebacks);
+
+	// Service times are measured in TSC cycles, and shown in microseconds too.
+	u64 cycles_per_us = max(core::this_core().timestamp_frequency() / 1'000'000, (u64)1);
+	EMIT("tsc: %llu cycles per us\n", cycles_per_us);
+
+	auto emit_histogram = [&](const char *title, const u64 *latency) {
+		EMIT("  %s latency (cycles from: requests):\n", title);
+
+		for (unsigned int i = 0; i < block_io_stats::nr_latency_buckets; i++) {
+			if (latency[i]) {
+				EMIT("    2^%2u (%llu us): %llu\n", i, (1ull << i) / cycles_per_us, latency[i]);
+			}
+		}
+	};
+
+	device_manager::get().for_each_device([&](device &dev) {
+		if (!dev.devclass().is_a(block_device::block_device_class)) {
+			return;
+		}
+
+		block_io_stats s;
+		((block_device &)dev).get_io_stats(s);
+
+		EMIT("%s:\n", dev.name().c_str());
+		EMIT("  reads=%llu (%llu blocks) writes=%llu (%llu blocks) flushes=%llu merges=%llu\n", s.reads, s.blocks_read, s.writes, s.blocks_written, s.flushes,
+			s.merges);
+		EMIT("  outstanding=%llu max=%llu\n", s.outstanding, s.max_outstanding);
+
+		// A request that is still outstanding has been counted, but hasn't added to the total time yet, so the averages
+		// are a little low while the device is busy.
+		if (s.reads) {
+			EMIT("  read service time: avg %llu us\n", s.read_cycles / s.reads / cycles_per_us);
+			emit_histogram("read", s.read_latency);
+		}
+
+		if (s.writes) {
+			EMIT("  write service time: avg %llu us\n", s.write_cycles / s.writes / cycles_per_us);
+			emit_histogram("write", s.write_latency);
+		}
+	});
+
+#undef EMIT
+
+	return n;
+}
+
+shared_ptr<file> iostat_device::open_as_file()
+{
+	size_t nr_devices = 0;
+	device_manager::get().for_each_device([&](device &) { nr_devices++; });
+
+	size_t size = fixed_render_size + (nr_devices * per_device_render_size);
+	return snapshot_file::create(size, render);
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/irq-trace.h>
+#include <stacsos/kernel/dev/misc/irq-trace-device.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/kernel/irq-trace.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+
+device_class irq_trace_device::irq_trace_device_class(device_class::root, "irqoff");
+
+static u64 handle_ioctl(u64 cmd, void *buffer, size_t length)
+{
+	switch ((irq_trace_ioctl)cmd) {
+	case irq_trace_ioctl::reset:
+		irq_tracer::get().reset();
+		return 0;
+
+	default:
+		return 0;
+	}
+}
+
+shared_ptr<file> irq_trace_device::open_as_file()
+{
+	return snapshot_file::create(irq_tracer::get().render_size_hint(), [](char *buffer, size_t size) { return irq_tracer::get().render(buffer, size); },
+		handle_ioctl);
+}
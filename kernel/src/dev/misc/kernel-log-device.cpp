@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/misc/kernel-log-device.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/kernel/kernel-log.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+
+device_class kernel_log_device::kernel_log_device_class(device_class::root, "klog");
+
+shared_ptr<file> kernel_log_device::open_as_file()
+{
+	return snapshot_file::create(kernel_log::render_size_hint(), [](char *buffer, size_t size) { return kernel_log::get().render(buffer, size); });
+}
@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/misc/meminfo-device.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/compactor.h>
+#include <stacsos/kernel/mem/kmem-cache.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-cache.h>
+#include <stacsos/kernel/mem/reclaimer.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::sched;
+
+device_class meminfo_device::meminfo_device_class(device_class::root, "meminfo");
+
+// Room for everything but the process list, and then room for each process.
+static const size_t fixed_render_size = 8192;
+static const size_t per_process_render_size = 64;
+
+static size_t render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	auto &mm = memory_manager::get();
+	auto &pga = mm.pgalloc();
+
+	// The free lists are read without the allocator's lock, so the counts may be a little out of step with each other
+	// if pages are being allocated at the same time.
+	u64 buddy_free = 0;
+	for (int order = 0; order <= pga.last_order(); order++) {
+		buddy_free += pga.free_blocks(order) << order;
+	}
+
+	EMIT("free pages: %llu (%llu in the buddy allocator)\n", pga.free_page_count(), buddy_free);
+
+	// The unusable free space index of an order is the fraction of the free memory that is in blocks too small to
+	// satisfy an allocation of that order: zero means none of it is, and 1000 means all of it is.
+	EMIT("buddy free blocks (order: blocks, unusable index per mille):\n");
+
+	u64 free_below = 0;
+	for (int order = 0; order <= pga.last_order(); order++) {
+		u64 blocks = pga.free_blocks(order);
+
+		EMIT("  %2d: %llu, %llu\n", order, blocks, buddy_free ? (free_below * 1000) / buddy_free : 0);
+		free_below += blocks << order;
+	}
+
+	page_allocator::grouping_stats gs = pga.get_grouping_stats();
+	EMIT("pageblocks: %llu movable, %llu unmovable, steals=%llu claims=%llu\n", gs.movable_blocks, gs.unmovable_blocks, gs.steals, gs.claims);
+
+	compactor::stats cps = compactor::get().get_stats();
+	EMIT("compaction: requests=%llu regions=%llu pages moved=%llu failures=%llu\n", cps.requests, cps.regions, cps.pages_moved, cps.failures);
+
+	auto &oa = mm.objalloc();
+
+	EMIT("slab caches (object size: slabs x slab size, objects / capacity, utilisation):\n");
+	for (unsigned int c = 0; c < object_allocator::nr_size_classes; c++) {
+		slab_cache_base::stats s = oa.get_slab_stats(c);
+
+		EMIT("  %4lu: %llu x %llu, %llu / %llu, %llu%%\n", object_allocator::class_object_size(c), s.slabs, s.slab_size, s.objects, s.capacity,
+			s.capacity ? (s.objects * 100) / s.capacity : 0);
+	}
+
+	EMIT("object caches (name: object size / slot size, slabs x slab size, objects / capacity, allocations, core hits):\n");
+	kmem_cache_base::for_each([&](kmem_cache_base &c) {
+		kmem_cache_base::stats s = c.get_stats();
+
+		EMIT("  %s: %lu / %lu, %llu x %llu, %llu / %llu, %llu, %llu\n", c.name(), c.object_size(), c.slot_size(), s.slabs, s.slab_size, s.objects,
+			s.capacity, s.allocations, s.hits);
+	});
+
+	EMIT("large objects: %llu bytes mapped\n", oa.large_object_bytes());
+	page_table_allocator::stats pts = {};
+	for (int c = 0; c < core_manager::max_cores; c++) {
+		page_table_allocator::stats cs = mm.ptalloc().get_stats(c);
+
+		pts.hits += cs.hits;
+		pts.misses += cs.misses;
+		pts.refills += cs.refills;
+	}
+
+	EMIT("page tables: %llu pages, cache hits=%llu misses=%llu refills=%llu\n", mm.ptalloc().nr_pages(), pts.hits, pts.misses, pts.refills);
+
+	page_cache::stats pcs = page_cache::get().get_stats();
+	EMIT("page cache: active=%llu inactive=%llu, hits=%llu misses=%llu activations=%llu reclaimed=%llu\n", pcs.active, pcs.inactive, pcs.hits,
+		pcs.misses, pcs.activations, pcs.reclaimed);
+
+	reclaimer::stats rs = reclaimer::get().get_stats();
+	EMIT("reclaim: wakeups=%llu passes=%llu pages=%llu objects=%llu, target=%llu pages\n", rs.wakeups, rs.passes, rs.pages_reclaimed,
+		rs.objects_shrunk, pga.reclaim_target());
+
+	storage::buffer_cache::stats bcs = storage::buffer_cache::get().get_stats();
+	EMIT("buffer cache: %llu / %llu buffers, hits=%llu misses=%llu evictions=%llu writebacks=%llu\n", bcs.buffers, bcs.capacity, bcs.hits, bcs.misses,
+		bcs.evictions, bcs.writebacks);
+
+	EMIT("processes (id: resident pages, shared from the page cache):\n");
+	process_manager::get().for_each_process([&](process &p) {
+		address_space &as = p.addrspace();
+		EMIT("  %llu: %llu, %llu\n", p.id(), as.resident_pages(), as.shared_pages());
+	});
+
+#undef EMIT
+
+	return n;
+}
+
+shared_ptr<file> meminfo_device::open_as_file()
+{
+	size_t nr_processes = 0;
+	process_manager::get().for_each_process([&](process &) { nr_processes++; });
+
+	// Processes may be created between counting them and rendering, in which case the last few are cut off.
+	size_t size = fixed_render_size + (nr_processes * per_process_render_size);
+	return snapshot_file::create(size, render);
+}
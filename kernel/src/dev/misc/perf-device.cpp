@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/pmu.h>
+#include <stacsos/kernel/dev/misc/perf-device.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/memops.h>
+#include <stacsos/perf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::sched;
+
+device_class perf_device::perf_device_class(device_class::root, "perf");
+
+/*
+ * Replaces the counters of the calling thread, returning the old ones.  The counters are only touched by the switching
+ * code while the thread is being switched in or out, so with interrupts disabled here, nothing else is using them.
+ */
+static pmu_thread_counters *replace_thread_counters(pmu_thread_counters *counters)
+{
+	tcb *t = thread::current().get_tcb();
+
+	u64 flags = irq_save();
+
+	pmu_thread_counters *old = (pmu_thread_counters *)t->perf_state;
+	pmu::switch_thread_counters(old, counters);
+	t->perf_state = counters;
+
+	irq_restore(flags);
+
+	return old;
+}
+
+static u64 configure(void *buffer, size_t length)
+{
+	perf_config config;
+	if (length < sizeof(config) || !user_access::copy_from_user(&config, buffer, sizeof(config))) {
+		return 0;
+	}
+
+	if (!config.nr_events || config.nr_events > pmu::thread_counters()) {
+		return 0;
+	}
+
+	auto *counters = new pmu_thread_counters;
+	memops::bzero(counters, sizeof(*counters));
+
+	counters->nr_counters = config.nr_events;
+	counters->user_rdpmc = (config.flags & perf_flags::user_rdpmc) == perf_flags::user_rdpmc;
+
+	for (unsigned int i = 0; i < config.nr_events; i++) {
+		counters->evtsel[i] = pmu::event_select(config.events[i], (config.flags & perf_flags::user_only) == perf_flags::user_only);
+		if (!counters->evtsel[i]) {
+			delete counters;
+			return 0;
+		}
+
+		config.rdpmc_index[i] = pmu::thread_counter_index(i);
+	}
+
+	config.width = pmu::width();
+	config.rdpmc_exact = pmu::full_width_writes();
+
+	if (!user_access::copy_to_user(buffer, &config, sizeof(config))) {
+		delete counters;
+		return 0;
+	}
+
+	delete replace_thread_counters(counters);
+	return 1;
+}
+
+static u64 read_counts(void *buffer, size_t length)
+{
+	u64 values[perf_max_events];
+	unsigned int count = 0;
+
+	{
+		u64 flags = irq_save();
+
+		auto *counters = (pmu_thread_counters *)thread::current().get_tcb()->perf_state;
+		if (counters) {
+			count = min(counters->nr_counters, (unsigned int)(length / sizeof(u64)));
+			for (unsigned int i = 0; i < count; i++) {
+				values[i] = pmu::read_thread_counter(*counters, i);
+			}
+		}
+
+		irq_restore(flags);
+	}
+
+	if (!count || !user_access::copy_to_user(buffer, values, count * sizeof(u64))) {
+		return 0;
+	}
+
+	return count;
+}
+
+static u64 reset_counts()
+{
+	pmu_thread_counters *counters = replace_thread_counters(nullptr);
+	if (!counters) {
+		return 0;
+	}
+
+	memops::bzero(counters->saved, sizeof(counters->saved));
+	memops::bzero(counters->base, sizeof(counters->base));
+
+	replace_thread_counters(counters);
+	return 1;
+}
+
+/*
+ * A handle on the calling thread's counters, which has no contents of its own.
+ */
+class perf_file : public file {
+public:
+	perf_file()
+		: file(0)
+	{
+	}
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override { return 0; }
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override { return 0; }
+
+	virtual u64 ioctl(u64 cmd, void *buffer, size_t length) override
+	{
+		if (!pmu::thread_counters()) {
+			return 0;
+		}
+
+		switch ((perf_ioctl)cmd) {
+		case perf_ioctl::configure:
+			return configure(buffer, length);
+
+		case perf_ioctl::read:
+			return read_counts(buffer, length);
+
+		case perf_ioctl::reset:
+			return reset_counts();
+
+		case perf_ioctl::disable: {
+			pmu_thread_counters *counters = replace_thread_counters(nullptr);
+			delete counters;
+			return counters ? 1 : 0;
+		}
+
+		default:
+			return 0;
+		}
+	}
+};
+
+shared_ptr<file> perf_device::open_as_file() { return shared_ptr<file>(new perf_file()); }
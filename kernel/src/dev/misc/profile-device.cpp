@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/misc/profile-device.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/profiler.h>
+#include <stacsos/profile.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+
+device_class profile_device::profile_device_class(device_class::root, "profile");
+
+static u64 handle_ioctl(u64 cmd, void *buffer, size_t length)
+{
+	switch ((profile_ioctl)cmd) {
+	case profile_ioctl::start: {
+		u64 frequency;
+		if (length < sizeof(frequency) || !mem::user_access::copy_from_user(&frequency, buffer, sizeof(frequency)) || !frequency) {
+			return 0;
+		}
+
+		profiler::get().start(frequency);
+		return 1;
+	}
+
+	case profile_ioctl::stop:
+		profiler::get().stop();
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+shared_ptr<file> profile_device::open_as_file()
+{
+	return snapshot_file::create(profiler::get().render_size_hint(), [](char *buffer, size_t size) { return profiler::get().render(buffer, size); },
+		handle_ioctl);
+}
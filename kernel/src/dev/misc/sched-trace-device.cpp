@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/misc/sched-trace-device.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/kernel/sched/sched-trace.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+using namespace stacsos::kernel::sched;
+
+device_class sched_trace_device::sched_trace_device_class(device_class::root, "schedtrace");
+
+shared_ptr<file> sched_trace_device::open_as_file()
+{
+	return snapshot_file::create(sched_trace::render_size_hint(), [](char *buffer, size_t size) { return sched_trace::get().render(buffer, size); });
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/misc/syscall-stats-device.h>
+#include <stacsos/kernel/fs/snapshot-file.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/syscall-stats.h>
+#include <stacsos/syscall-stats.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+
+device_class syscall_stats_device::syscall_stats_device_class(device_class::root, "syscalls");
+
+static u64 handle_ioctl(u64 cmd, void *buffer, size_t length)
+{
+	switch ((syscall_stats_ioctl)cmd) {
+	case syscall_stats_ioctl::reset:
+		syscall_stats::get().reset();
+		return 0;
+
+	case syscall_stats_ioctl::set_filter: {
+		u64 process_id;
+		if (length < sizeof(process_id) || !mem::user_access::copy_from_user(&process_id, buffer, sizeof(process_id))) {
+			return 0;
+		}
+
+		syscall_stats::get().set_filter(process_id);
+		return 1;
+	}
+
+	default:
+		return 0;
+	}
+}
+
+shared_ptr<file> syscall_stats_device::open_as_file()
+{
+	return snapshot_file::create(syscall_stats::render_size_hint(), [](char *buffer, size_t size) { return syscall_stats::get().render(buffer, size); },
+		handle_ioctl);
+}
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/misc/tracepoints-device.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/tracepoints.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::misc;
+
+device_class tracepoints_device::tracepoints_device_class(device_class::root, "tracepoints");
+
+static void copy_string(char *dest, const char *src, size_t size)
+{
+	size_t n = min((size_t)memops::strlen(src), size - 1);
+	memops::memcpy(dest, src, n);
+	dest[n] = 0;
+}
+
+/*
+ * A read-only file containing the records taken by the last drain ioctl, if any.
+ */
+class tracepoints_file : public file {
+public:
+	tracepoints_file()
+		: file(0)
+		, records_(nullptr)
+		, length_(0)
+	{
+	}
+
+	virtual ~tracepoints_file() { delete[] records_; }
+
+	virtual u64 size() const override { return length_; }
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override
+	{
+		if (offset >= length_) {
+			return 0;
+		}
+
+		size_t n = min(length, length_ - offset);
+		memops::memcpy(buffer, (const u8 *)records_ + offset, n);
+
+		return n;
+	}
+
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override { return 0; }
+
+	virtual u64 ioctl(u64 cmd, void *buffer, size_t length) override
+	{
+		switch ((tracepoints_ioctl)cmd) {
+		case tracepoints_ioctl::enable:
+		case tracepoints_ioctl::disable: {
+			u32 id;
+			if (length < sizeof(id) || !mem::user_access::copy_from_user(&id, buffer, sizeof(id))) {
+				return 0;
+			}
+
+			return tracepoints::get().set_enabled(id, (tracepoints_ioctl)cmd == tracepoints_ioctl::enable);
+		}
+
+		case tracepoints_ioctl::info: {
+			tracepoint_info info;
+			if (length < sizeof(info) || !mem::user_access::copy_from_user(&info, buffer, sizeof(info))) {
+				return 0;
+			}
+
+			const tracepoint *tp = tracepoints::get_by_id(info.id);
+			if (!tp) {
+				return 0;
+			}
+
+			info.enabled = __atomic_load_n(&tp->enabled, __ATOMIC_RELAXED);
+			copy_string(info.name, tp->name, sizeof(info.name));
+			copy_string(info.format, tp->format, sizeof(info.format));
+
+			return mem::user_access::copy_to_user(buffer, &info, sizeof(info));
+		}
+
+		case tracepoints_ioctl::lost:
+			return tracepoints::get().lost();
+
+		case tracepoints_ioctl::drain: {
+			delete[] records_;
+
+			size_t max_records = tracepoints::get().pending();
+			records_ = new tracepoint_record[max(max_records, (size_t)1)];
+
+			size_t count = tracepoints::get().drain(records_, max_records);
+			length_ = count * sizeof(tracepoint_record);
+
+			return count;
+		}
+
+		default:
+			return 0;
+		}
+	}
+
+private:
+	tracepoint_record *records_;
+	size_t length_;
+};
+
+shared_ptr<file> tracepoints_device::open_as_file() { return shared_ptr<file>(new tracepoints_file()); }
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/device-manager.h>
+#include <stacsos/kernel/dev/net/net-device.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/sched/wait-set.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::net;
+
+device_class net_device::net_device_class(device_class::root, "net");
+
+/*
+ * A claimed queue pair.  The file is the pair's packet ring, and only gives the pair back when the last handle to it,
+ * and the last mapping of it, have gone.
+ */
+class packet_ring_file : public file {
+public:
+	packet_ring_file(net_device &dev, unsigned int queue)
+		: file(dev.ring(queue).size())
+		, dev_(dev)
+		, queue_(queue)
+	{
+	}
+
+	virtual ~packet_ring_file() { dev_.release_queue(queue_); }
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override { return 0; }
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override { return 0; }
+
+	virtual bool has_own_pages() const override { return true; }
+	virtual mem::page *own_page(u64 index) override { return dev_.ring(queue_).own_page(index); }
+
+	virtual u64 ioctl(u64 cmd, void *buffer, size_t length) override
+	{
+		switch (cmd) {
+		case net_ioctl_info: {
+			if (length < sizeof(net_ring_info)) {
+				return 0;
+			}
+
+			net_ring_info info;
+			memops::bzero(&info, sizeof(info));
+			dev_.get_info(queue_, info);
+
+			return mem::user_access::copy_to_user(buffer, &info, sizeof(info)) ? sizeof(info) : 0;
+		}
+
+		case net_ioctl_enter: {
+			u32 min_received = 0;
+			if (length >= sizeof(u32) && !mem::user_access::copy_from_user(&min_received, buffer, sizeof(u32))) {
+				return 0;
+			}
+
+			dev_.enter(queue_, min_received);
+			return dev_.ring(queue_).rx_pending();
+		}
+
+		default:
+			return 0;
+		}
+	}
+
+	// Ready when there are received packets waiting.
+	virtual bool poll(sched::wait_set *ws) override
+	{
+		packet_ring &ring = dev_.ring(queue_);
+
+		if (ws) {
+			ws->add(ring.events());
+		}
+
+		return ring.rx_pending() > 0;
+	}
+
+private:
+	net_device &dev_;
+	unsigned int queue_;
+};
+
+void net_device::configure() { device_manager::get().add_device_alias(*this, string("net") + string::to_string(net_device_class.get_next_index())); }
+
+shared_ptr<file> net_device::open_as_file()
+{
+	int queue = claim_queue();
+	if (queue < 0) {
+		return nullptr;
+	}
+
+	return shared_ptr<file>(new packet_ring_file(*this, (unsigned int)queue));
+}
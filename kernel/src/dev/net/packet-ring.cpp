@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/net/packet-ring.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::dev::net;
+using namespace stacsos::kernel::mem;
+
+static int order_for(u64 size)
+{
+	int order = 0;
+	while ((PAGE_SIZE << order) < size) {
+		order++;
+	}
+
+	return order;
+}
+
+// The pages are mapped into processes as a file's own pages, which address spaces treat as shared: they never free
+// them when they unmap them.
+static page *allocate_area(int order)
+{
+	page *pages = memory_manager::get().pgalloc().allocate_pages(order, page_allocation_flags::zero);
+	if (!pages) {
+		return nullptr;
+	}
+
+	for (u64 i = 0; i < (1ull << order); i++) {
+		pages[i].set_cached(true);
+	}
+
+	return pages;
+}
+
+bool packet_ring::allocate(u32 rx_entries, u32 tx_entries)
+{
+	rx_entries_ = rx_entries;
+	tx_entries_ = tx_entries;
+
+	// The header and both rings share the first page, and each area is physically contiguous, so that every packet is
+	// a single descriptor.
+	rx_area_offset_ = PAGE_SIZE;
+	u64 rx_area_size = (u64)rx_entries * rx_buffer_size;
+	int rx_order = order_for(rx_area_size);
+
+	// The transmit area is as big as the receive buffers together, which leaves room for a few large (TSO) packets.
+	tx_area_offset_ = rx_area_offset_ + (PAGE_SIZE << rx_order);
+	tx_area_size_ = PAGE_SIZE << rx_order;
+	size_ = tx_area_offset_ + tx_area_size_;
+
+	header_page_ = zeroed_page_pool::get().allocate();
+	rx_pages_ = allocate_area(rx_order);
+	tx_pages_ = allocate_area(rx_order);
+
+	if (!header_page_ || !rx_pages_ || !tx_pages_) {
+		return false;
+	}
+
+	header_page_->set_cached(true);
+	header_ = (net_ring_header *)header_page_->base_address_ptr();
+
+	rx_phys_ = rx_pages_->base_address();
+	tx_phys_ = tx_pages_->base_address();
+
+	rx_buffers_ = new u32[rx_entries];
+	tx_finished_ = new bool[tx_entries];
+
+	for (u32 i = 0; i < tx_entries; i++) {
+		tx_finished_[i] = false;
+	}
+
+	return true;
+}
+
+void packet_ring::fill_info(net_ring_info &info) const
+{
+	info.rx_entries = rx_entries_;
+	info.tx_entries = tx_entries_;
+	info.rx_buffer_size = rx_buffer_size;
+	info.rx_area_offset = rx_area_offset_;
+	info.tx_area_offset = tx_area_offset_;
+	info.tx_area_size = tx_area_size_;
+	info.size = size_;
+}
+
+page *packet_ring::own_page(u64 index) const
+{
+	if (!index) {
+		return header_page_;
+	}
+
+	u64 offset = index << PAGE_BITS;
+	if (offset < tx_area_offset_) {
+		return &page::get_from_pfn(rx_pages_->pfn() + ((offset - rx_area_offset_) >> PAGE_BITS));
+	}
+
+	if (offset < size_) {
+		return &page::get_from_pfn(tx_pages_->pfn() + ((offset - tx_area_offset_) >> PAGE_BITS));
+	}
+
+	return nullptr;
+}
+
+void packet_ring::attach()
+{
+	rx_tail_ = rx_returned_ = 0;
+	tx_head_ = tx_done_ = 0;
+
+	header_->rx_head = header_->rx_tail = 0;
+	header_->tx_head = header_->tx_done = header_->tx_tail = 0;
+	header_->rx_dropped = 0;
+
+	__atomic_store_n(&attached_, true, __ATOMIC_RELEASE);
+}
+
+bool packet_ring::deliver(u32 buffer, u32 length)
+{
+	if (!attached_) {
+		return false;
+	}
+
+	if (rx_tail_ - rx_returned_ >= rx_entries_) {
+		header_->rx_dropped++;
+		return false;
+	}
+
+	u32 slot = rx_tail_ & (rx_entries_ - 1);
+	rx_buffers_[slot] = buffer;
+
+	net_ring_entry &entry = net_ring_rx_entries(header_)[slot];
+	entry.offset = (u32)(rx_area_offset_ + ((u64)buffer * rx_buffer_size));
+	entry.length = length;
+
+	__atomic_store_n(&rx_tail_, rx_tail_ + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&header_->rx_tail, rx_tail_, __ATOMIC_RELEASE);
+	return true;
+}
+
+void packet_ring::advance_tx_done()
+{
+	u32 done = tx_done_;
+	while (done != tx_head_ && tx_finished_[done & (tx_entries_ - 1)]) {
+		tx_finished_[done & (tx_entries_ - 1)] = false;
+		done++;
+	}
+
+	if (done != tx_done_) {
+		__atomic_store_n(&tx_done_, done, __ATOMIC_RELEASE);
+		__atomic_store_n(&header_->tx_done, done, __ATOMIC_RELEASE);
+	}
+}
@@ -0,0 +1,404 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/net/virtio-net-device.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/sleeper.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::net;
+using namespace stacsos::kernel::dev::virtio;
+using namespace stacsos::kernel::mem;
+
+device_class virtio_net_device::virtio_net_device_class(net_device::net_device_class, "vnet");
+
+// The Ethernet header, which the MTU doesn't count, but which has to fit into a receive buffer along with the packet.
+static const u32 ethernet_header_size = 14;
+
+bool virtio_net_device::bring_up()
+{
+	dprintf("virtio-net: probing...\n");
+
+	if (!transport_.probe()) {
+		return false;
+	}
+
+	u64 wanted = VIRTIO_F_RING_EVENT_IDX | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MTU | VIRTIO_NET_F_MAC | VIRTIO_NET_F_HOST_TSO4
+		| VIRTIO_NET_F_HOST_TSO6 | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+	u64 features;
+
+	if (!transport_.negotiate_features(wanted, features)) {
+		transport_.fail();
+		return false;
+	}
+
+	volatile virtio_net_config *config = (volatile virtio_net_config *)transport_.device_config();
+
+	if (features & VIRTIO_NET_F_MAC) {
+		for (unsigned int i = 0; i < sizeof(mac_); i++) {
+			mac_[i] = config->mac[i];
+		}
+	}
+
+	// Receive buffers are never merged, so a packet must fit into one, header and all.
+	u16 max_mtu = (u16)(packet_ring::rx_buffer_size - sizeof(net_packet_header) - ethernet_header_size);
+	mtu_ = min((features & VIRTIO_NET_F_MTU) ? (u16)config->mtu : (u16)1500, max_mtu);
+
+	// The device only segments packets whose checksums it is also filling in.
+	if (features & VIRTIO_NET_F_CSUM) {
+		offloads_ |= NET_OFFLOAD_TX_CSUM;
+
+		if (features & VIRTIO_NET_F_HOST_TSO4) {
+			offloads_ |= NET_OFFLOAD_TSO4;
+		}
+
+		if (features & VIRTIO_NET_F_HOST_TSO6) {
+			offloads_ |= NET_OFFLOAD_TSO6;
+		}
+	}
+
+	if (features & VIRTIO_NET_F_GUEST_CSUM) {
+		offloads_ |= NET_OFFLOAD_RX_CSUM;
+	}
+
+	// A pair for each core, but no more than the device has.  The control queue comes after all of the device's pairs,
+	// however many are used.
+	bool multiqueue = (features & VIRTIO_NET_F_MQ) && (features & VIRTIO_NET_F_CTRL_VQ);
+	unsigned int max_pairs = multiqueue ? max((unsigned int)config->max_virtqueue_pairs, 1u) : 1;
+
+	unsigned int nr_online = 0;
+	for (auto *c : core_manager::get().cores()) {
+		if (c->status() == core_status::online || c->status() == core_status::bootstrap) {
+			nr_online++;
+		}
+	}
+
+	nr_pairs_ = min(max_pairs, nr_online);
+
+	void *args[core_manager::max_cores];
+	for (unsigned int i = 0; i < nr_pairs_; i++) {
+		pairs_[i] = new queue_pair(transport_, i, *this);
+		args[i] = pairs_[i];
+	}
+
+	// Pair i interrupts on MSI-X vector i, which request_queue_irqs sends to the ith online core.  A single MSI is no
+	// use, as virtio only signals queues through MSI-X vectors.
+	auto &pcidev = transport_.pcidev();
+	bool msix = false;
+
+	if (pcidev.msix_vector_count() >= nr_pairs_) {
+		if (nr_pairs_ > 1) {
+			msix = pcidev.request_queue_irqs(nr_pairs_, virtio_net_irq_handler, args, "virtio-net") == nr_pairs_;
+		} else {
+			msix = pcidev.enable_msix() && pcidev.assign_msix_vector(0, x86_core::this_core(), virtio_net_irq_handler, args[0], "virtio-net");
+		}
+	}
+
+	if (!msix) {
+		dprintf("virtio-net: no msi-x, polling for packets\n");
+		polled_ = true;
+	}
+
+	bool event_idx = !!(features & VIRTIO_F_RING_EVENT_IDX);
+
+	for (unsigned int i = 0; i < nr_pairs_; i++) {
+		if (!setup_pair(*pairs_[i], polled_ ? VIRTIO_MSI_NO_VECTOR : (u16)i, event_idx)) {
+			transport_.fail();
+			return false;
+		}
+	}
+
+	if (features & VIRTIO_NET_F_CTRL_VQ) {
+		ctrl_ = new virtqueue(transport_, (u16)(2 * max_pairs));
+		if (!ctrl_->setup(4, VIRTIO_MSI_NO_VECTOR, event_idx)) {
+			transport_.fail();
+			return false;
+		}
+	}
+
+	transport_.driver_ok();
+
+	for (unsigned int i = 0; i < nr_pairs_; i++) {
+		pairs_[i]->rx.kick();
+	}
+
+	// The device only uses the first pair until it is told otherwise.
+	if (nr_pairs_ > 1 && !set_nr_pairs(nr_pairs_)) {
+		dprintf("virtio-net: device refused %u queue pairs\n", nr_pairs_);
+		nr_pairs_ = 1;
+	}
+
+	// Each core opens the pair whose interrupts it takes, in the order request_queue_irqs handed them out.
+	unsigned int index = 0;
+	for (auto *c : core_manager::get().cores()) {
+		if (c->status() == core_status::online || c->status() == core_status::bootstrap) {
+			core_pairs_[c->id()] = index++ % nr_pairs_;
+		}
+	}
+
+	dprintf("virtio-net: mac=%02x:%02x:%02x:%02x:%02x:%02x, %u queue pairs of %u/%u, mtu=%u, offloads=%x\n", mac_[0], mac_[1], mac_[2], mac_[3],
+		mac_[4], mac_[5], nr_pairs_, pairs_[0]->ring.rx_entries(), pairs_[0]->ring.tx_entries(), mtu_, offloads_);
+
+	return true;
+}
+
+bool virtio_net_device::setup_pair(queue_pair &pair, u16 vector, bool event_idx)
+{
+	if (!pair.rx.setup(packet_ring::max_entries, vector, event_idx) || !pair.tx.setup(packet_ring::max_entries, vector, event_idx)) {
+		return false;
+	}
+
+	if (!pair.ring.allocate(pair.rx.size(), pair.tx.size())) {
+		panic("virtio-net: out of memory");
+	}
+
+	// Every receive buffer starts off with the device, which it keeps until a process has it.
+	for (u32 buffer = 0; buffer < pair.ring.rx_entries(); buffer++) {
+		post_rx(pair, buffer);
+	}
+
+	return true;
+}
+
+bool virtio_net_device::set_nr_pairs(unsigned int nr_pairs)
+{
+	// The command's header, its argument, and the status the device writes back, each in their own part of a page.
+	u64 phys = zeroed_page_pool::get().allocate()->base_address();
+	u8 *cmd = (u8 *)phys_to_virt(phys);
+
+	virtio_net_ctrl_header *header = (virtio_net_ctrl_header *)cmd;
+	header->cls = VIRTIO_NET_CTRL_MQ;
+	header->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+	*(u16 *)(cmd + 16) = (u16)nr_pairs;
+
+	volatile u8 *ack = cmd + 32;
+	*ack = 0xff;
+
+	ctrl_->desc(0).addr = phys;
+	ctrl_->desc(0).len = sizeof(virtio_net_ctrl_header);
+	ctrl_->desc(0).flags = VIRTQ_DESC_F_NEXT;
+	ctrl_->desc(0).next = 1;
+
+	ctrl_->desc(1).addr = phys + 16;
+	ctrl_->desc(1).len = sizeof(u16);
+	ctrl_->desc(1).flags = VIRTQ_DESC_F_NEXT;
+	ctrl_->desc(1).next = 2;
+
+	ctrl_->desc(2).addr = phys + 32;
+	ctrl_->desc(2).len = 1;
+	ctrl_->desc(2).flags = VIRTQ_DESC_F_WRITE;
+	ctrl_->desc(2).next = 0;
+
+	ctrl_->add(0);
+	ctrl_->kick();
+
+	// The control queue is only used while the device is brought up, so the command is just polled for.
+	for (unsigned int i = 0; i < 1000; i++) {
+		u16 head;
+		u32 length;
+
+		if (ctrl_->next_used(head, length)) {
+			return *ack == VIRTIO_NET_OK;
+		}
+
+		if (core::this_core().get_current_tcb()) {
+			sched::sleeper::get().sleep_ms(1);
+		} else {
+			__relax();
+		}
+	}
+
+	return false;
+}
+
+void virtio_net_device::post_rx(queue_pair &pair, u32 buffer)
+{
+	volatile virtq_desc &desc = pair.rx.desc((u16)buffer);
+	desc.addr = pair.ring.rx_buffer_phys(buffer);
+	desc.len = packet_ring::rx_buffer_size;
+	desc.flags = VIRTQ_DESC_F_WRITE;
+	desc.next = 0;
+
+	pair.rx.add((u16)buffer);
+}
+
+bool virtio_net_device::collect(queue_pair &pair)
+{
+	// Called with the pair's lock held.  As for virtio-blk, the interrupts are re-armed once the queues look empty, and
+	// anything that finished in the meantime is collected now.
+	bool progress = false;
+	u16 head;
+	u32 length;
+
+	do {
+		while (pair.rx.next_used(head, length)) {
+			// While nothing has the pair open, or its ring is full, the packet is dropped, and its buffer goes back.
+			if (!pair.ring.deliver(head, length)) {
+				post_rx(pair, head);
+			}
+
+			progress = true;
+		}
+
+		while (pair.tx.next_used(head, length)) {
+			pair.ring.sent(head);
+			progress = true;
+		}
+	} while (pair.rx.arm_interrupt() | pair.tx.arm_interrupt());
+
+	pair.ring.reclaim([&](u32 buffer) { post_rx(pair, buffer); });
+	pair.rx.kick();
+
+	return progress;
+}
+
+int virtio_net_device::claim_queue()
+{
+	unique_irq_lock l(claim_lock_);
+
+	int queue = -1;
+	unsigned int preferred = core_pairs_[current_core_id()];
+
+	if (!pairs_[preferred]->claimed) {
+		queue = (int)preferred;
+	} else {
+		for (unsigned int i = 0; i < nr_pairs_; i++) {
+			if (!pairs_[i]->claimed) {
+				queue = (int)i;
+				break;
+			}
+		}
+	}
+
+	if (queue < 0) {
+		return -1;
+	}
+
+	queue_pair &pair = *pairs_[queue];
+	pair.claimed = true;
+
+	unique_irq_lock pl(pair.lock);
+	pair.ring.attach();
+
+	return queue;
+}
+
+void virtio_net_device::release_queue(unsigned int queue)
+{
+	queue_pair &pair = *pairs_[queue];
+
+	// The device may still be reading packets from the transmit area, so the pair isn't given to anything else until
+	// they have all gone.
+	if (polled_) {
+		while (pair.ring.tx_in_flight()) {
+			{
+				unique_irq_lock l(pair.lock);
+				collect(pair);
+			}
+
+			core::this_core().reschedule();
+		}
+	} else {
+		pair.ring.events().wait_until([&] { return pair.ring.tx_in_flight() == 0; });
+	}
+
+	{
+		unique_irq_lock l(pair.lock);
+		pair.ring.detach([&](u32 buffer) { post_rx(pair, buffer); });
+		pair.rx.kick();
+	}
+
+	unique_irq_lock l(claim_lock_);
+	pair.claimed = false;
+}
+
+void virtio_net_device::get_info(unsigned int queue, net_ring_info &info)
+{
+	for (unsigned int i = 0; i < sizeof(mac_); i++) {
+		info.mac[i] = mac_[i];
+	}
+
+	info.mtu = mtu_;
+	info.offloads = offloads_;
+	info.queue = queue;
+
+	pairs_[queue]->ring.fill_info(info);
+}
+
+void virtio_net_device::enter(unsigned int queue, u32 min_received)
+{
+	queue_pair &pair = *pairs_[queue];
+	bool progress = false;
+
+	{
+		unique_irq_lock l(pair.lock);
+
+		pair.ring.reclaim([&](u32 buffer) { post_rx(pair, buffer); });
+		pair.rx.kick();
+
+		// Everything queued to send goes with at most one notification.
+		pair.ring.take([&](u32 slot, u64 phys, u32 length) {
+			volatile virtq_desc &desc = pair.tx.desc((u16)slot);
+			desc.addr = phys;
+			desc.len = length;
+			desc.flags = 0;
+			desc.next = 0;
+
+			pair.tx.add((u16)slot);
+		});
+		pair.tx.kick();
+
+		if (polled_) {
+			progress = collect(pair);
+		}
+	}
+
+	if (progress) {
+		pair.ring.events().wake_all();
+	}
+
+	min_received = min(min_received, pair.ring.rx_entries());
+	if (!min_received) {
+		return;
+	}
+
+	if (polled_) {
+		while (pair.ring.rx_pending() < min_received) {
+			core::this_core().reschedule();
+
+			unique_irq_lock l(pair.lock);
+			collect(pair);
+		}
+	} else {
+		pair.ring.events().wait_until([&] { return pair.ring.rx_pending() >= min_received; });
+	}
+}
+
+void virtio_net_device::virtio_net_irq_handler(u8 irq, void *ctx, void *arg)
+{
+	queue_pair &pair = *(queue_pair *)arg;
+	bool progress;
+
+	{
+		unique_irq_lock l(pair.lock);
+		progress = pair.owner.collect(pair);
+	}
+
+	if (progress) {
+		pair.ring.events().wake_all();
+	}
+
+	((x86_core &)core::this_core()).lapic().eoi();
+}
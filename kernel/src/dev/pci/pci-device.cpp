@@ -5,16 +5,25 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/x86/irq/irq-affinity.h>
 #include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/console/virtio-console-device.h>
 #include <stacsos/kernel/dev/device-manager.h>
 #include <stacsos/kernel/dev/gfx/qemu-stdvga.h>
+#include <stacsos/kernel/dev/net/virtio-net-device.h>
 #include <stacsos/kernel/dev/pci/pci-device.h>
 #include <stacsos/kernel/dev/storage/ahci-controller.h>
+#include <stacsos/kernel/dev/storage/nvme-storage-device.h>
+#include <stacsos/kernel/dev/storage/virtio-block-device.h>
 
+using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::console;
 using namespace stacsos::kernel::dev::storage;
 using namespace stacsos::kernel::dev::gfx;
+using namespace stacsos::kernel::dev::net;
 using namespace stacsos::kernel::dev::pci;
 using namespace stacsos::kernel::arch::x86;
 using namespace stacsos::kernel::arch::x86::irq;
@@ -24,6 +33,8 @@ device_class pci_device::pci_device_class(device_class::root, "pci");
 pci_device::pci_device(bus &bus, pci_device_configuration &config)
 	: device(pci_device_class, bus)
 	, config_(config)
+	, msix_table_(nullptr)
+	, msix_size_(0)
 {
 }
 
@@ -33,6 +44,24 @@ void pci_device::configure()
 {
 	dprintf("pci: vendor=%x, device=%x\n", config().vendor_id(), config().device_id());
 
+	// Every AHCI controller works the same way, whoever made it, so they are recognised by their class.
+	if (config().class_code() == pci_native_device_class::MASS_STORAGE && config().subclass() == 0x06 && config().prog_if() == 0x01) {
+		auto *ahci = new ahci_controller(parent_bus(), *this);
+		ahci->probe();
+		return;
+	}
+
+	// Likewise NVMe controllers.
+	if (config().class_code() == pci_native_device_class::MASS_STORAGE && config().subclass() == 0x08 && config().prog_if() == 0x02) {
+		auto *dev = new nvme_storage_device(parent_bus(), *this);
+
+		// As for virtio, a controller that couldn't be brought up may have its interrupts pointed at it, so it is kept.
+		if (dev->bring_up()) {
+			device_manager::get().register_device(*dev);
+		}
+		return;
+	}
+
 	switch (config().vendor_id()) {
 	case 0x1234:
 		switch (config().device_id()) {
@@ -49,36 +78,44 @@ void pci_device::configure()
 		break;
 
 	case 0x1af4:
-		/*switch (config().device_id()) {
-		case 0x1000: {
-			auto *tpt = new virtio_pci_transport(*this);
-			auto *dev = new virtio_network_device(manager(), parent_bus(), *tpt);
-			dev->activate();
+		switch (config().device_id()) {
+		// The transitional and the modern-only virtio block devices.  Both have the modern interface, which is the
+		// only one driven.
+		case 0x1001:
+		case 0x1042: {
+			auto *dev = new virtio_block_device(parent_bus(), *this);
+
+			// A device that couldn't be brought up may still have its interrupt pointed at it, so it is kept.
+			if (dev->bring_up()) {
+				device_manager::get().register_device(*dev);
+			}
 			break;
 		}
-		case 0x1001: {
-			auto *tpt = new virtio_pci_transport(*this);
-			auto *dev = new virtio_block_device(manager(), parent_bus(), *tpt);
-			dev->activate();
+
+		// Likewise the network devices.
+		case 0x1000:
+		case 0x1041: {
+			auto *dev = new virtio_net_device(parent_bus(), *this);
+
+			if (dev->bring_up()) {
+				device_manager::get().register_device(*dev);
+			}
 			break;
 		}
-		default:
-			dprintf("pci: unknown device\n");
-			break;
-		}*/
 
-		break;
+		// And the consoles.
+		case 0x1003:
+		case 0x1043: {
+			auto *dev = new virtio_console_device(parent_bus(), *this);
 
-	case 0x8086:
-		switch (config().device_id()) {
-		case 0x2922: {
-			auto *ahci = new ahci_controller(parent_bus(), *this);
-			ahci->probe();
+			if (dev->bring_up()) {
+				device_manager::get().register_device(*dev);
+			}
 			break;
 		}
 
 		default:
-			dprintf("pci: unknown device\n");
+			dprintf("pci: unknown virtio device\n");
 			break;
 		}
 		break;
@@ -89,35 +126,252 @@ void pci_device::configure()
 	}
 }
 
-void pci_device::register_msi(irq_handler_fn handler, void *arg)
+// An MSI is a write of the vector to the local APIC address range, at an address that picks the core.  Delivery is
+// fixed and edge triggered.
+static u32 msi_address(x86_core &target) { return 0xfee00000u | ((u32)target.id() << 12); }
+static u32 msi_data(u8 vector) { return vector; }
+
+// The MSI message control word's 64-bit address and per-vector masking bits.
+static const u16 msi_control_64bit = 1u << 7;
+static const u16 msi_control_per_vector_mask = 1u << 8;
+
+// Each MSI-X table entry is four dwords: the address (low, then high), the data, and the vector control, whose bottom
+// bit masks the vector.
+static const unsigned int msix_entry_dwords = 4;
+static const u32 msix_vector_masked = 1;
+
+// The MSI-X message control word's enable and function mask bits, and the mask for its table size (minus one).
+static const u16 msix_control_enable = 1u << 15;
+static const u16 msix_control_function_mask = 1u << 14;
+static const u16 msix_control_table_size = 0x7ff;
+
+// The command register's memory space, bus master and legacy interrupt disable bits.
+static const u16 pci_command_memory = 1u << 1;
+static const u16 pci_command_bus_master = 1u << 2;
+static const u16 pci_command_intx_disable = 1u << 10;
+
+u8 pci_device::find_capability(u8 id)
 {
 	for (auto cap : capabilities()) {
-		if (cap.vendor == 0x05) {
-			dprintf("pci: found msi capability\n");
+		if (cap.vendor == id) {
+			return cap.offset;
+		}
+	}
 
-			u8 irqnr = x86_core::this_core().irqmgr().allocate_irq(handler, arg);
+	return 0;
+}
 
-			u16 msi_ctrl = config_.read_config_value<u16>(cap.offset + 2);
-			if (!msi_ctrl & 0x80) {
-				panic("32-bit MSI address");
-			}
+void pci_device::prepare_for_msi()
+{
+	config_.write_config_value<u16>(4, config_.command() | pci_command_bus_master | pci_command_intx_disable);
+}
 
-			// Activate MSI target address
-			u64 msi_address = 0xFEE00000;
-			config_.write_config_value<u32>(cap.offset + 4, (u32)msi_address); // low
-			config_.write_config_value<u32>(cap.offset + 8, (u32)(msi_address >> 32)); // high
+namespace stacsos::kernel::dev::pci {
+/*
+ * A device's single MSI, which is moved by rewriting its address and data.
+ */
+class pci_msi_source : public irq_source {
+public:
+	pci_msi_source(pci_device &device, u8 cap, const char *name, irq_handler_fn handler, void *arg)
+		: irq_source(name, handler, arg)
+		, device_(device)
+		, cap_(cap)
+	{
+	}
 
-			// Activate MSI data payload
-			u32 data = 0x4000 | irqnr;
-			config_.write_config_value<u32>(cap.offset + 12, data);
+protected:
+	virtual void route(x86_core &target, u8 vector) override { device_.route_msi(cap_, target, vector); }
 
-			// Activate MSI
-			msi_ctrl |= 1;
-			config_.write_config_value<u16>(cap.offset + 2, msi_ctrl);
+private:
+	pci_device &device_;
+	u8 cap_;
+};
 
-			// config_.command
+/*
+ * One of the vectors in a device's MSI-X table.
+ */
+class pci_msix_source : public irq_source {
+public:
+	pci_msix_source(pci_device &device, unsigned int index, const char *name, irq_handler_fn handler, void *arg)
+		: irq_source(name, handler, arg)
+		, device_(device)
+		, index_(index)
+	{
+	}
 
-			break;
+protected:
+	virtual void route(x86_core &target, u8 vector) override { device_.route_msix(index_, target, vector); }
+
+private:
+	pci_device &device_;
+	unsigned int index_;
+};
+} // namespace stacsos::kernel::dev::pci
+
+void pci_device::route_msi(u8 cap, x86_core &target, u8 vector)
+{
+	u16 msi_ctrl = config_.read_config_value<u16>(cap + 2);
+	bool addr64 = !!(msi_ctrl & msi_control_64bit);
+	bool maskable = !!(msi_ctrl & msi_control_per_vector_mask);
+
+	// The mask bits follow the data, and so move with the address size too.
+	u8 mask_offset = cap + (addr64 ? 16 : 12);
+	if (maskable) {
+		config_.write_config_value<u32>(mask_offset, 1);
+	}
+
+	config_.write_config_value<u32>(cap + 4, msi_address(target));
+	if (addr64) {
+		config_.write_config_value<u32>(cap + 8, 0);
+	}
+
+	// The data follows the address, and so moves with its size.
+	config_.write_config_value<u16>(cap + (addr64 ? 12 : 8), (u16)msi_data(vector));
+
+	if (maskable) {
+		config_.write_config_value<u32>(mask_offset, 0);
+	}
+}
+
+bool pci_device::enable_msi(x86_core &target, irq_handler_fn handler, void *arg, const char *name)
+{
+	u8 cap = find_capability(capability_msi);
+	if (!cap) {
+		return false;
+	}
+
+	auto *source = new pci_msi_source(*this, cap, name, handler, arg);
+	irq_affinity::get().add(*source, target);
+
+	prepare_for_msi();
+
+	// Only one message is asked for (by clearing the multiple message enable field), and MSI is turned on.
+	u16 msi_ctrl = config_.read_config_value<u16>(cap + 2);
+	msi_ctrl &= ~0x70;
+	msi_ctrl |= 1;
+	config_.write_config_value<u16>(cap + 2, msi_ctrl);
+
+	dprintf("pci: msi enabled, vector %u on core %u\n", source->vector(), target.id());
+	return true;
+}
+
+void pci_device::register_msi(irq_handler_fn handler, void *arg, const char *name)
+{
+	if (!enable_msi(x86_core::this_core(), handler, arg, name)) {
+		dprintf("pci: device has no msi capability\n");
+	}
+}
+
+unsigned int pci_device::msix_vector_count()
+{
+	u8 cap = find_capability(capability_msix);
+	if (!cap) {
+		return 0;
+	}
+
+	return (config_.read_config_value<u16>(cap + 2) & msix_control_table_size) + 1;
+}
+
+bool pci_device::enable_msix()
+{
+	if (msix_table_) {
+		return true;
+	}
+
+	u8 cap = find_capability(capability_msix);
+	if (!cap) {
+		return false;
+	}
+
+	// The table is in one of the device's memory BARs, at an offset given alongside the BAR's index.
+	u32 table_location = config_.read_config_value<u32>(cap + 4);
+	int bir = table_location & 7;
+
+	u32 bar = config_.bar_by_index(bir);
+	if (bar & 1) {
+		dprintf("pci: msi-x table is in an i/o bar\n");
+		return false;
+	}
+
+	u64 base = bar & ~0xfull;
+	if (((bar >> 1) & 3) == 2) {
+		base |= (u64)config_.bar_by_index(bir + 1) << 32;
+	}
+
+	msix_table_ = (volatile u32 *)phys_to_virt(base + (table_location & ~7u));
+	msix_size_ = msix_vector_count();
+
+	prepare_for_msi();
+	config_.write_config_value<u16>(4, config_.command() | pci_command_memory);
+
+	// Every vector starts masked, and the function as a whole is masked while they are, so that nothing is raised
+	// half set up.
+	u16 ctrl = config_.read_config_value<u16>(cap + 2);
+	config_.write_config_value<u16>(cap + 2, ctrl | msix_control_enable | msix_control_function_mask);
+
+	for (unsigned int i = 0; i < msix_size_; i++) {
+		msix_table_[i * msix_entry_dwords + 3] = msix_vector_masked;
+	}
+
+	config_.write_config_value<u16>(cap + 2, (ctrl | msix_control_enable) & ~msix_control_function_mask);
+
+	dprintf("pci: msi-x enabled, %u vectors\n", msix_size_);
+	return true;
+}
+
+void pci_device::route_msix(unsigned int index, x86_core &target, u8 vector)
+{
+	volatile u32 *entry = &msix_table_[index * msix_entry_dwords];
+	u32 control = entry[3];
+
+	// A message raised while the entry is masked is held by the device, and sent once it is unmasked.
+	entry[3] = control | msix_vector_masked;
+	entry[0] = msi_address(target);
+	entry[1] = 0;
+	entry[2] = msi_data(vector);
+	entry[3] = control;
+}
+
+bool pci_device::assign_msix_vector(unsigned int index, x86_core &target, irq_handler_fn handler, void *arg, const char *name)
+{
+	if (!msix_table_ || index >= msix_size_) {
+		return false;
+	}
+
+	irq_affinity::get().add(*new pci_msix_source(*this, index, name, handler, arg), target);
+	mask_msix_vector(index, false);
+
+	return true;
+}
+
+void pci_device::mask_msix_vector(unsigned int index, bool masked)
+{
+	if (!msix_table_ || index >= msix_size_) {
+		return;
+	}
+
+	msix_table_[index * msix_entry_dwords + 3] = masked ? msix_vector_masked : 0;
+}
+
+unsigned int pci_device::request_queue_irqs(unsigned int count, irq_handler_fn handler, void *const *args, const char *name)
+{
+	if (count > 1 && msix_vector_count() >= count && enable_msix()) {
+		x86_core *online[core_manager::max_cores];
+		unsigned int nr_online = 0;
+
+		for (auto *c : core_manager::get().cores()) {
+			if (c->status() == core_status::online || c->status() == core_status::bootstrap) {
+				online[nr_online++] = (x86_core *)c;
+			}
+		}
+
+		for (unsigned int i = 0; i < count; i++) {
+			assign_msix_vector(i, *online[i % nr_online], handler, args[i], name);
 		}
+
+		return count;
 	}
+
+	// With a single MSI, every queue's completions arrive on the same core.
+	return count && enable_msi(x86_core::this_core(), handler, args[0], name) ? 1 : 0;
 }
@@ -18,13 +18,39 @@ using namespace stacsos;
 void pci_express_bus::probe()
 {
 	dprintf("pcie: probing @ %p\n", base_);
-	for (int i = first_; i <= last_; i++) {
-		probe_bus(i);
+
+	pci_config_header host;
+	if (!read_header(first_, 0, 0, host)) {
+		return;
 	}
+
+	// A multi-function host bridge has a root bus for each of its functions, numbered from the first bus.
+	if (!host.is_multifunction()) {
+		probe_bus(first_);
+		return;
+	}
+
+	for (int func = 0; func < 8 && first_ + func <= last_; func++) {
+		if (func == 0 || read_header(first_, 0, func, host)) {
+			probe_bus(first_ + func);
+		}
+	}
+}
+
+bool pci_express_bus::read_header(unsigned int bus, unsigned int slot, unsigned int func, pci_config_header &header)
+{
+	pcie_transport transport(compute_base(bus, slot, func));
+	return header.read(transport);
 }
 
 void pci_express_bus::probe_bus(unsigned int bus)
 {
+	if (bus < (unsigned int)first_ || bus > (unsigned int)last_ || scanned_[bus]) {
+		return;
+	}
+
+	scanned_[bus] = true;
+
 	for (int slot = 0; slot < 32; slot++) {
 		probe_slot(bus, slot);
 	}
@@ -32,13 +58,20 @@ void pci_express_bus::probe_bus(unsigned int bus)
 
 void pci_express_bus::probe_slot(unsigned int bus, unsigned int slot)
 {
-	probe_func(bus, slot, 0);
+	// A slot without function 0 is empty, and its other functions aren't looked at.
+	pci_config_header header;
+	if (!read_header(bus, slot, 0, header)) {
+		return;
+	}
+
+	bool multifunction = header.is_multifunction();
+	probe_func(bus, slot, 0, header);
 
-	pcie_transport transport(compute_base(0, slot, 0));
-	pci_device_configuration config(transport);
-	if (config.header_type() & 0x80) {
+	if (multifunction) {
 		for (int func = 1; func < 8; func++) {
-			probe_func(bus, slot, func);
+			if (read_header(bus, slot, func, header)) {
+				probe_func(bus, slot, func, header);
+			}
 		}
 	}
 }
@@ -46,19 +79,20 @@ void pci_express_bus::probe_slot(unsigned int bus, unsigned int slot)
 static const char *pci_device_class_names[] = { "none", "mass storage", "network", "display", "multimedia", "memory", "bridge", "simple comm",
 	"base system peripherals", "input", "docking station", "processor", "serial bus", "wireless", "iio", "satellite", "crypto", "signal processing" };
 
-void pci_express_bus::probe_func(unsigned int bus, unsigned int slot, unsigned int func)
+void pci_express_bus::probe_func(unsigned int bus, unsigned int slot, unsigned int func, const pci_config_header &header)
 {
+	u8 class_code = (u8)header.class_code();
+	dprintf("pcie: %s device @ %u:%u:%u (%04x:%04x)\n", class_code < ARRAY_SIZE(pci_device_class_names) ? pci_device_class_names[class_code] : "other", bus,
+		slot, func, header.vendor_id(), header.device_id());
+
 	pcie_transport *transport = new pcie_transport(compute_base(bus, slot, func));
 	pci_device_configuration *config = new pci_device_configuration(*transport);
 
-	// A missing device is not an error.
-	if (config->vendor_id() == 0xffff) {
-		return;
-	}
-
-	dprintf("pcie: %s device @ %u:%u:%u (%04x:%04x)\n", pci_device_class_names[(int)config->class_code()], bus, slot, func, config->vendor_id(),
-		config->device_id());
-
-	auto dev = new pci_device( *this, *config);
+	auto dev = new pci_device(*this, *config);
 	device_manager::get().register_device(*dev);
+
+	// The bridge's secondary bus is scanned straight away, so devices are registered in the order they are reached.
+	if (header.is_bridge()) {
+		probe_bus(header.secondary_bus_number());
+	}
 }
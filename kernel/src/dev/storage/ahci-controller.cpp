@@ -5,19 +5,27 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/dev/device-manager.h>
 #include <stacsos/kernel/dev/storage/ahci-controller.h>
 #include <stacsos/kernel/dev/storage/ahci-storage-device.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/process.h>
 #include <stacsos/list.h>
 
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
 using namespace stacsos::kernel::dev;
 using namespace stacsos::kernel::dev::storage;
 using namespace stacsos::kernel::dev::pci;
 using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::sched;
 
-void ahci_controller::probe()
+void __init ahci_controller::probe()
 {
 	dprintf("ahci: probing...\n");
 
@@ -27,6 +35,13 @@ void ahci_controller::probe()
 		return;
 	}
 
+	abar_ = abar;
+
+	u32 capabilities = abar->generic_host_cntrol.host_capabilities;
+	if (!(capabilities & HBA_CAP_S64A)) {
+		dprintf("ahci: warning: controller only has 32-bit dma addressing\n");
+	}
+
 	list<volatile hba_port *> usable_ports;
 
 	u32 available_ports = abar->generic_host_cntrol.ports_implemented;
@@ -38,37 +53,110 @@ void ahci_controller::probe()
 		}
 	}
 
-	// Allocate storage for command list, command table, and FIS.
-	u64 cl_size = 0x400 * usable_ports.count();
-	u64 ctbl_size = 0x100 * 32 * usable_ports.count();
-	u64 fis_size = 0x100 * usable_ports.count();
-
-	u64 clb = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::zero)->base_address();
-	u64 ctbl = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::zero)->base_address();
-	u64 fis = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::zero)->base_address();
+	// Commands complete by interrupt, so that nothing has to spin while the disk is busy.
+	pcidev_.register_msi(ahci_irq_handler, this, "ahci");
+	abar->generic_host_cntrol.global_host_control = abar->generic_host_cntrol.global_host_control | HBA_GHC_IE;
 
-	int port_index = 0;
 	for (volatile hba_port *port : usable_ports) {
-		u64 clb_offset = clb + (0x400 * port_index);
-		u64 ctbl_offset = ctbl + (0x100 * 32 * port_index);
-		u64 fis_offset = fis + (0x100 * port_index);
+		// Each port's command list (1 KiB) and received FIS area (256 bytes) share a page, and each of its command
+		// tables has one of its own, so that a command can have as many PRDT entries as fit in it.
+		u64 clb = zeroed_page_pool::get().allocate()->base_address();
+		u64 fis = clb + 0x400;
 
 		// Initialise command headers in the CLB for this port.
 		for (int cmd_idx = 0; cmd_idx < 32; cmd_idx++) {
-			u64 ctbl_cmd_offset = ctbl_offset + (0x100 * cmd_idx);
+			u64 ctbl = zeroed_page_pool::get().allocate()->base_address();
 
-			volatile hba_cmd_header *hdr = &((hba_cmd_header *)phys_to_virt(clb_offset))[cmd_idx];
-			hdr->prdtl = 8;
-			hdr->ctba = (u32)ctbl_cmd_offset;
-			hdr->ctbau = (u32)(ctbl_cmd_offset >> 32);
+			volatile hba_cmd_header *hdr = &((hba_cmd_header *)phys_to_virt(clb))[cmd_idx];
+			hdr->prdtl = 0;
+			hdr->ctba = (u32)ctbl;
+			hdr->ctbau = (u32)(ctbl >> 32);
 		}
 
-		activate_port(port, clb_offset, fis_offset);
-		port_index++;
+		activate_port((int)(port - &abar->ports[0]), port, clb, fis);
+	}
+
+	device_manager::get().finish_probe_later(*this);
+}
+
+void ahci_controller::finish_probe()
+{
+	probe_waiters_.wait_until([this] { return nr_probing_ == 0; });
+
+	setup_coalescing();
+
+	for (auto *dev : port_devices_) {
+		if (dev) {
+			device_manager::get().register_device(*dev);
+		}
 	}
 }
 
-ahci_port_type ahci_controller::detect_port(volatile hba_port *port)
+void ahci_controller::port_probe_thread_proc(void *arg)
+{
+	ahci_storage_device *dev = (ahci_storage_device *)arg;
+	ahci_controller &controller = (ahci_controller &)dev->parent_bus();
+
+	dev->bring_up();
+
+	controller.probe_waiters_.update_and_wake_all([&controller] { controller.nr_probing_--; });
+}
+
+void ahci_controller::setup_coalescing()
+{
+	if (!(abar_->generic_host_cntrol.host_capabilities & HBA_CAP_CCCS)) {
+		return;
+	}
+
+	// A disk only joins once it has twice the threshold outstanding, so the threshold is kept to half of the
+	// shallowest queue that could join, and there's no point to it for disks that only take one command at a time.
+	unsigned int min_depth = 0;
+	for (auto *dev : port_devices_) {
+		if (dev && dev->queue_depth() > 1 && (!min_depth || dev->queue_depth() < min_depth)) {
+			min_depth = dev->queue_depth();
+		}
+	}
+
+	u64 count = min(config::get().get_option_u64_or_default("ahci-ccc-count", 8), (u64)min_depth / 2);
+	u64 timeout_ms = config::get().get_option_u64_or_default("ahci-ccc-timeout-ms", 1);
+	if (count < 2 || !timeout_ms) {
+		return;
+	}
+
+	count = min(count, (u64)0xff);
+	timeout_ms = min(timeout_ms, (u64)0xffff);
+
+	// The threshold and timeout may only be changed while coalescing is disabled.  The controller picks the interrupt
+	// (i.e. the bit in the interrupt status) that it raises for coalesced completions.
+	auto &ghc = abar_->generic_host_cntrol;
+	ghc.ccc_ports = 0;
+	ghc.ccc_ctl = ghc.ccc_ctl & ~HBA_CCC_CTL_EN;
+	ghc.ccc_ctl = HBA_CCC_CTL_CC(count) | HBA_CCC_CTL_TV(timeout_ms);
+	ccc_irq_mask_ = 1u << HBA_CCC_CTL_INT(ghc.ccc_ctl);
+	ghc.ccc_ctl = ghc.ccc_ctl | HBA_CCC_CTL_EN;
+
+	dprintf("ahci: coalescing completions: count=%llu, timeout=%llums\n", count, timeout_ms);
+
+	for (auto *dev : port_devices_) {
+		if (dev && dev->queue_depth() > 1) {
+			dev->enable_coalescing((unsigned int)count);
+		}
+	}
+}
+
+void ahci_controller::set_port_coalesced(volatile hba_port *port, bool coalesced)
+{
+	u32 bit = 1u << (port - &abar_->ports[0]);
+
+	unique_irq_lock l(ccc_lock_);
+
+	u32 ports = coalesced ? (ccc_ports_ | bit) : (ccc_ports_ & ~bit);
+	__atomic_store_n(&ccc_ports_, ports, __ATOMIC_RELAXED);
+
+	abar_->generic_host_cntrol.ccc_ports = ports;
+}
+
+ahci_port_type __init ahci_controller::detect_port(volatile hba_port *port)
 {
 	u32 ssts = port->sata_status;
 	u8 det = ssts & 0xf;
@@ -90,9 +178,9 @@ ahci_port_type ahci_controller::detect_port(volatile hba_port *port)
 	}
 }
 
-void ahci_controller::activate_port(volatile hba_port *port, u64 clb, u64 fis)
+void __init ahci_controller::activate_port(int port_index, volatile hba_port *port, u64 clb, u64 fis)
 {
-	dprintf("ahci: activating port clb=%p, fis=%p\n", clb, fis);
+	dprintf("ahci: activating port clb=%p, fis=%p\n", (void *)clb, (void *)fis);
 
 	port->cmd &= ~HBA_PxCMD_ST;
 	port->cmd &= ~HBA_PxCMD_FRE;
@@ -106,6 +194,43 @@ void ahci_controller::activate_port(volatile hba_port *port, u64 clb, u64 fis)
 	port->fis_base_addr = (u32)fis;
 	port->fis_base_addr_hi = (u32)(fis >> 32);
 
-	auto *dev = new ahci_storage_device(*this, port);
-	device_manager::get().register_device(*dev);
+	auto *dev = new ahci_storage_device(*this, port, abar_->generic_host_cntrol.host_capabilities);
+	port_devices_[port_index] = dev;
+
+	// Any stale interrupt status is cleared before the port's interrupts are turned on.
+	port->interrupt_status = port->interrupt_status;
+	port->interrupt_enable = HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_TFES;
+
+	{
+		unique_irq_lock l(probe_waiters_.lock());
+		nr_probing_++;
+	}
+
+	process_manager::get().kernel_process()->create_thread((u64)port_probe_thread_proc, dev)->start();
+}
+
+void ahci_controller::ahci_irq_handler(u8 irq, void *ctx, void *arg)
+{
+	ahci_controller *controller = (ahci_controller *)arg;
+
+	u32 pending = controller->abar_->generic_host_cntrol.interrupt_status;
+
+	// The coalescing interrupt doesn't say which ports it is for, so every port that is in it is looked at.  (Its bit
+	// is never that of an implemented port, so it has no device of its own below.)
+	u32 ports = pending;
+	if (pending & controller->ccc_irq_mask_) {
+		ports |= __atomic_load_n(&controller->ccc_ports_, __ATOMIC_RELAXED);
+	}
+
+	for (u32 m = ports; m; m &= m - 1) {
+		ahci_storage_device *dev = controller->port_devices_[__builtin_ctz(m)];
+		if (dev) {
+			dev->handle_interrupt();
+		}
+	}
+
+	// Each port's status has been cleared, so its bit in the controller's status can be too.
+	controller->abar_->generic_host_cntrol.interrupt_status = pending;
+
+	((x86_core &)core::this_core()).lapic().eoi();
 }
@@ -5,21 +5,31 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/config.h>
+#include <stacsos/kernel/dev/storage/ahci-controller.h>
 #include <stacsos/kernel/dev/storage/ahci-storage-device.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
+#include <stacsos/kernel/dev/storage/io-scheduler.h>
 #include <stacsos/kernel/dev/storage/mbr.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/sleeper.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos;
 using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::dev;
 using namespace stacsos::kernel::dev::storage;
 using namespace stacsos::kernel::mem;
 
 device_class ahci_storage_device::ahci_storage_device_class(block_device::block_device_class, "ahci");
 
-void ahci_storage_device::configure()
+void ahci_storage_device::bring_up()
 {
 	dprintf("ahci: start port\n");
 
@@ -32,9 +42,20 @@ void ahci_storage_device::configure()
 	port_->cmd |= HBA_PxCMD_ST;
 
 	identify();
-	detect_partitions();
+
+	// Seeking costs nothing on a solid state disk, so requests are only sorted for spinning ones.
+	const char *sched = config::get().get_option_or_default("iosched", rotational_ ? "elevator" : "noop");
+	set_scheduler(io_scheduler::create(sched, max_merge_blocks, max_merge_segments), queue_depth());
+
+	dprintf("ahci: using %s i/o scheduler\n", scheduler_name());
+
+	// The partition table is scanned when the disk is registered, which happens for one disk at a time, so it is read
+	// in now, while the other disks are being brought up too.
+	buffer_cache::get().prefetch(*this, 0, 1);
 }
 
+void ahci_storage_device::configure() { detect_partitions(); }
+
 void ahci_storage_device::identify()
 {
 	int slot_index;
@@ -52,19 +73,19 @@ void ahci_storage_device::identify()
 		panic("too many prdtls");
 	}
 
-	volatile hba_cmd_table *cmdtbl = (hba_cmd_table *)phys_to_virt((u64)cmd->ctba);
+	volatile hba_cmd_table *cmdtbl = (hba_cmd_table *)phys_to_virt((u64)cmd->ctba | ((u64)cmd->ctbau << 32));
 	memops::bzero((void *)cmdtbl, sizeof(hba_cmd_table) + sizeof(hba_prdt_entry) * cmd->prdtl);
 
-	u8 *buffer = new u8[512];
+	// The disk is given the buffer's physical address, all 64 bits of it.
+	page *buffer_page = zeroed_page_pool::get().allocate();
+	u8 *buffer = (u8 *)phys_to_virt(buffer_page->base_address());
 
-	// TODO: FIXME: This memory address truncating is unsafe.
-	cmdtbl->prdt_entry[0].dba = (u32)(u64)buffer;
-	cmdtbl->prdt_entry[0].dbc = 512;
+	set_prdt_entry(cmdtbl, 0, buffer_page->base_address(), 512);
 	cmdtbl->prdt_entry[0].i = 1;
 
 	// Prepare command
 	volatile fis_reg_host2device *cmdfis = (fis_reg_host2device *)(&cmdtbl->cfis);
-	memops::bzero((void *)cmdfis, sizeof(fis_reg_host2device));
+	memops::zero<sizeof(fis_reg_host2device)>((void *)cmdfis);
 
 	cmdfis->type = fis_type::FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
@@ -77,6 +98,7 @@ void ahci_storage_device::identify()
 
 	port_->command_issue = 1 << slot_index; // Issue command
 
+	// The disk can take a while to answer, so a thread sleeps between polls, leaving the core to the other disks.
 	while (true) {
 		if (!(port_->command_issue & (1 << slot_index))) {
 			break;
@@ -86,6 +108,12 @@ void ahci_storage_device::identify()
 		{
 			panic("identify error");
 		}
+
+		if (core::this_core().get_current_tcb()) {
+			sched::sleeper::get().sleep_ms(1);
+		} else {
+			__relax();
+		}
 	}
 
 	if (port_->interrupt_status & HBA_PxIS_TFES) {
@@ -93,7 +121,20 @@ void ahci_storage_device::identify()
 	}
 
 	nr_blocks_ = *(u32 *)(buffer + 120);
-	delete[] buffer;
+
+	// Word 75 holds the disk's queue depth (minus one), and bit 8 of word 76 says whether it supports NCQ at all.
+	const u16 *words = (const u16 *)buffer;
+	if ((host_capabilities_ & HBA_CAP_SNCQ) && (words[76] & (1 << 8))) {
+		ncq_ = true;
+		nr_slots_ = min(nr_slots_, (unsigned int)(words[75] & 0x1f) + 1);
+	}
+
+	// Word 217 is the nominal rotation rate, which is 1 for a disk that doesn't spin.
+	rotational_ = words[217] != 1;
+
+	dprintf("ahci: %llu blocks, ncq=%d, queue depth=%u, rotational=%d\n", nr_blocks_, ncq_, queue_depth(), rotational_);
+
+	memory_manager::get().pgalloc().free_pages(*buffer_page, 0);
 }
 
 void ahci_storage_device::detect_partitions()
@@ -104,65 +145,64 @@ void ahci_storage_device::detect_partitions()
 
 void ahci_storage_device::submit_real_io_request(block_io_request &request)
 {
-	if (request.direction == block_io_request_direction::read) {
-		do_read_block_sync(request.buffer, request.start_block, request.block_count);
-		request.callback(&request, request.cb_state);
-	} else {
-		panic("UNIMPLEMENTED BLOCK IO WRITE REQUEST");
+	{
+		unique_irq_lock l(lock_);
+
+		if (!waiting_requests_.issue_or_wait(request, [this](block_io_request &r) { return try_issue(r); })) {
+			return;
+		}
+
+		update_coalescing();
+	}
+
+	// Before the scheduler is running, nothing can sleep waiting for the interrupt (which may not even be delivered
+	// yet), so the command is polled for.
+	if (!core::this_core().get_current_tcb()) {
+		while (__atomic_load_n(&busy_slots_, __ATOMIC_ACQUIRE)) {
+			complete_finished();
+			__relax();
+		}
 	}
 }
 
-void ahci_storage_device::do_read_block_sync(void *buffer, u64 start, u64 count)
+bool ahci_storage_device::try_issue(block_io_request &request)
 {
-	// dprintf("ahci: read into %p %lu %lu\n", buffer, start, count);
-
+	// Called with the lock held.
 	int slot_index;
-	volatile hba_cmd_header *cmd = get_free_cmd_slot(slot_index);
-	if (cmd == nullptr) {
-		panic("no free cmd slots");
+	if (!can_issue(request) || !get_free_cmd_slot(slot_index)) {
+		return false;
 	}
 
-	cmd->cfl = sizeof(fis_reg_host2device) / sizeof(u32);
-	cmd->w = 0;
-	cmd->prdtl = (u16)((count - 1) >> 4) + 1;
-	cmd->p = 0;
-
-	if (cmd->prdtl > 8) {
-		panic("too many prdtls");
-	}
+	issue_request(request, slot_index);
+	return true;
+}
 
-	// Prepare buffers
-	volatile hba_cmd_table *cmdtbl = (hba_cmd_table *)phys_to_virt((u64)cmd->ctba);
-	memops::bzero((void *)cmdtbl, sizeof(hba_cmd_table) + sizeof(hba_prdt_entry) * cmd->prdtl);
+void ahci_storage_device::issue_request(block_io_request &request, int slot_index)
+{
+	// Called with the lock held.
+	u64 start = request.start_block;
+	u64 count = request.total_blocks();
+	bool write = request.direction == block_io_request_direction::write;
+	bool flush = request.direction == block_io_request_direction::flush;
 
-	auto buffer_mapping = page_table::current()->get_mapping((u64)buffer);
-	if (buffer_mapping.result == mapping_result::unmapped) {
-		panic("destination buffer not mapped");
-	}
+	volatile hba_cmd_header *cmd = &((hba_cmd_header *)phys_to_virt(port_->command_list_base_addr))[slot_index];
 
-	u64 buffer_chunk = buffer_mapping.address;
-	for (int prdt_idx = 0; prdt_idx < cmd->prdtl - 1; prdt_idx++) {
-		cmdtbl->prdt_entry[prdt_idx].dba = (u32)buffer_chunk;
-		cmdtbl->prdt_entry[prdt_idx].dbau = (u32)((u64)buffer_chunk >> 32);
-		cmdtbl->prdt_entry[prdt_idx].dbc = (8 * 1024) - 1;
-		cmdtbl->prdt_entry[prdt_idx].i = 1;
+	cmd->cfl = sizeof(fis_reg_host2device) / sizeof(u32);
+	cmd->w = write;
+	cmd->p = 0;
 
-		buffer_chunk += 8 * 1024;
-		count -= 16;
-	}
+	// Prepare buffers
+	volatile hba_cmd_table *cmdtbl = (hba_cmd_table *)phys_to_virt((u64)cmd->ctba | ((u64)cmd->ctbau << 32));
+	memops::zero<sizeof(hba_cmd_table)>((void *)cmdtbl);
 
-	cmdtbl->prdt_entry[cmd->prdtl - 1].dba = (u32)buffer_chunk;
-	cmdtbl->prdt_entry[cmd->prdtl - 1].dbau = (u32)((u64)buffer_chunk >> 32);
-	cmdtbl->prdt_entry[cmd->prdtl - 1].dbc = (count << 9) - 1;
-	cmdtbl->prdt_entry[cmd->prdtl - 1].i = 1;
+	cmd->prdtl = flush ? 0 : build_prdt(cmdtbl, request);
 
 	// Prepare command
 	volatile fis_reg_host2device *cmdfis = (fis_reg_host2device *)(&cmdtbl->cfis);
-	memops::bzero((void *)cmdfis, sizeof(fis_reg_host2device));
+	memops::zero<sizeof(fis_reg_host2device)>((void *)cmdfis);
 
 	cmdfis->type = fis_type::FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
-	cmdfis->command = ATA_CMD_READ_DMA_EX;
 
 	cmdfis->lba0 = (u8)start;
 	cmdfis->lba1 = (u8)(start >> 8);
@@ -172,35 +212,186 @@ void ahci_storage_device::do_read_block_sync(void *buffer, u64 start, u64 count)
 	cmdfis->lba5 = (u8)(start >> 40);
 	cmdfis->device = 1 << 6;
 
-	cmdfis->countl = (u8)count;
-	cmdfis->counth = (u8)(count >> 8);
+	// A queued command carries its count in the features register, and its tag (which is the slot number) in the
+	// count register.
+	if (flush) {
+		cmdfis->command = ATA_CMD_FLUSH_CACHE_EX;
 
-	// Wait for port
-	while ((port_->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ))) {
-		__relax();
+		// Wait for port
+		while ((port_->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ))) {
+			__relax();
+		}
+	} else if (ncq_) {
+		cmdfis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+		cmdfis->featurel = (u8)count;
+		cmdfis->featureh = (u8)(count >> 8);
+		cmdfis->countl = (u8)(slot_index << 3);
+	} else {
+		cmdfis->command = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
+		cmdfis->countl = (u8)count;
+		cmdfis->counth = (u8)(count >> 8);
+
+		// Wait for port
+		while ((port_->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ))) {
+			__relax();
+		}
+	}
+
+	slot_requests_[slot_index] = &request;
+	__atomic_or_fetch(&busy_slots_, 1u << slot_index, __ATOMIC_RELEASE);
+
+	// A queued command's bit in SActive must be set before it is issued, and stays set until the disk has finished it.
+	if (queued(request)) {
+		port_->sata_active = 1 << slot_index;
+	} else {
+		exclusive_slot_ = slot_index;
 	}
 
 	port_->command_issue = 1 << slot_index; // Issue command
+}
 
-	while (true) {
-		if (!(port_->command_issue & (1 << slot_index))) {
-			break;
+u16 ahci_storage_device::build_prdt(volatile hba_cmd_table *cmdtbl, const block_io_request &request)
+{
+	// Each buffer is only contiguous in virtual memory, so each page is translated on its own, and runs of pages that
+	// turn out to be next to each other physically share an entry.  The buffers of requests merged into this one
+	// follow on, in order.
+	int nr_entries = 0;
+	u64 entry_start = 0, entry_size = 0;
+
+	for (const block_io_request *r = &request; r; r = r->next_merged) {
+		u64 va = (u64)r->buffer;
+		u64 end = va + (r->block_count << 9);
+
+		while (va < end) {
+			auto chunk_mapping = r->pgtable->get_mapping(va);
+			if (chunk_mapping.result == mapping_result::unmapped) {
+				panic("request buffer not mapped");
+			}
+
+			u64 chunk_size = min(end - va, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+
+			if (entry_size && chunk_mapping.address == entry_start + entry_size && entry_size + chunk_size <= HBA_PRDT_MAX_BYTES) {
+				entry_size += chunk_size;
+			} else {
+				if (entry_size) {
+					set_prdt_entry(cmdtbl, nr_entries++, entry_start, entry_size);
+				}
+
+				if (nr_entries == HBA_MAX_PRDT_ENTRIES) {
+					panic("request buffer too fragmented for one command");
+				}
+
+				entry_start = chunk_mapping.address;
+				entry_size = chunk_size;
+			}
+
+			va += chunk_size;
 		}
+	}
 
-		if (port_->interrupt_status & HBA_PxIS_TFES) // Task file error
-		{
-			panic("read error");
+	set_prdt_entry(cmdtbl, nr_entries++, entry_start, entry_size);
+
+	// Only the last entry interrupts, when the whole transfer is done.
+	cmdtbl->prdt_entry[nr_entries - 1].i = 1;
+
+	return (u16)nr_entries;
+}
+
+void ahci_storage_device::set_prdt_entry(volatile hba_cmd_table *cmdtbl, int index, u64 address, u64 size)
+{
+	volatile hba_prdt_entry *entry = &cmdtbl->prdt_entry[index];
+
+	entry->dba = (u32)address;
+	entry->dbau = (u32)(address >> 32);
+	entry->rsv0 = 0;
+	entry->dbc = size - 1;
+	entry->i = 0;
+}
+
+void ahci_storage_device::complete_finished()
+{
+	block_io_request *finished[32];
+	int nr_finished = 0;
+
+	{
+		unique_irq_lock l(lock_);
+
+		// The status is cleared before looking at which commands are done, so that a command finishing in between
+		// raises the interrupt again, rather than being missed.
+		u32 status = port_->interrupt_status;
+		port_->interrupt_status = status;
+
+		if (status & HBA_PxIS_TFES) {
+			panic("disk i/o error");
 		}
+
+		// A queued command leaves CI as soon as the disk has accepted it, but stays in SActive until it is done.
+		u32 done = busy_slots_ & ~(port_->command_issue | port_->sata_active);
+		for (u32 m = done; m; m &= m - 1) {
+			int slot_index = __builtin_ctz(m);
+
+			finished[nr_finished++] = slot_requests_[slot_index];
+			slot_requests_[slot_index] = nullptr;
+		}
+
+		if (exclusive_slot_ >= 0 && (done & (1u << exclusive_slot_))) {
+			exclusive_slot_ = -1;
+		}
+
+		__atomic_and_fetch(&busy_slots_, ~done, __ATOMIC_RELEASE);
+
+		// Slots are free again, so as many waiting requests as will fit can go.
+		waiting_requests_.issue_waiting([this](block_io_request &r) { return try_issue(r); });
+
+		update_coalescing();
 	}
 
-	if (port_->interrupt_status & HBA_PxIS_TFES) {
-		panic("read error");
+	// The callbacks are run without the lock, as they may submit another request straight away.  The request may be
+	// gone as soon as its callback returns.
+	for (int i = 0; i < nr_finished; i++) {
+		complete_request(*finished[i]);
+	}
+}
+
+void ahci_storage_device::enable_coalescing(unsigned int count)
+{
+	unique_irq_lock l(lock_);
+	coalesce_count_ = count;
+}
+
+void ahci_storage_device::update_coalescing()
+{
+	// Called with the lock held.  The threshold is crossed a different way to join and to leave, so that a queue
+	// hovering around it doesn't flip the port back and forth.
+	if (!coalesce_count_) {
+		return;
+	}
+
+	unsigned int outstanding = __builtin_popcount(busy_slots_);
+	ahci_controller &controller = (ahci_controller &)parent_bus();
+
+	if (!coalesced_ && outstanding >= coalesce_count_ * 2) {
+		coalesced_ = true;
+
+		// The port joins before its own interrupts go off, and they come back on before it leaves, so that a
+		// completion in between raises one interrupt too many, rather than none at all.
+		controller.set_port_coalesced(port_, true);
+		port_->interrupt_enable = HBA_PxIS_TFES;
+	} else if (coalesced_ && outstanding < coalesce_count_) {
+		coalesced_ = false;
+
+		port_->interrupt_enable = HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_TFES;
+		controller.set_port_coalesced(port_, false);
 	}
 }
 
 volatile hba_cmd_header *ahci_storage_device::get_free_cmd_slot(int &slot_index)
 {
-	u32 candidate_slots = port_->sata_ctl | port_->command_issue;
+	u32 candidate_slots = port_->sata_active | port_->command_issue | busy_slots_;
+	if (nr_slots_ < 32) {
+		candidate_slots |= ~((1u << nr_slots_) - 1);
+	}
+
 	if (~candidate_slots == 0) {
 		return nullptr;
 	}
@@ -7,31 +7,320 @@
  */
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/dev/storage/io-scheduler.h>
 #include <stacsos/kernel/sched/event.h>
+#include <stacsos/kernel/tracepoints.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos;
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::dev;
 using namespace stacsos::kernel::dev::storage;
+using namespace stacsos::kernel::fs;
 using namespace stacsos::kernel::sched;
 
 device_class block_device::block_device_class(device_class::root, "blk");
 
-void block_device::submit_io_request(block_io_request &request) { submit_real_io_request(request); }
+/*
+ * The raw contents of a block device.  Accesses needn't be whole blocks: the buffer cache deals with the parts of
+ * blocks at either end.
+ */
+class block_device_file : public file {
+public:
+	block_device_file(block_device &dev)
+		: file(dev.nr_blocks() * buffer_cache::block_size)
+		, dev_(dev)
+	{
+	}
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override
+	{
+		if (offset >= size()) {
+			return 0;
+		}
+
+		length = min(length, (size_t)(size() - offset));
+		if (!buffer_cache::get().read_bytes(dev_, buffer, offset / buffer_cache::block_size, offset % buffer_cache::block_size, length)) {
+			return 0;
+		}
+
+		return length;
+	}
+
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override
+	{
+		if (offset >= size() || dev_.read_only()) {
+			return 0;
+		}
+
+		length = min(length, (size_t)(size() - offset));
+		if (!buffer_cache::get().write_bytes(dev_, buffer, offset / buffer_cache::block_size, offset % buffer_cache::block_size, length)) {
+			return 0;
+		}
+
+		return length;
+	}
+
+	virtual bool sync() override { return buffer_cache::get().sync(dev_); }
+
+private:
+	block_device &dev_;
+};
+
+shared_ptr<file> block_device::open_as_file() { return shared_ptr<file>(new block_device_file(*this)); }
+
+DEFINE_TRACEPOINT(block_submit, "dev=%llx dir=%llu block=%llu count=%llu");
+
+void block_device::submit_io_request(block_io_request &request)
+{
+	TRACEPOINT(block_submit, this, request.direction, request.start_block, request.block_count);
+
+	request.status = block_io_status::ok;
+
+	// A write to a read-only device fails straight away, and never counts as having been submitted.
+	if (request.direction == block_io_request_direction::write && read_only()) {
+		request.status = block_io_status::read_only;
+
+		if (request.callback) {
+			request.callback(&request, request.cb_state);
+		}
+
+		return;
+	}
+
+	if (!request.pgtable) {
+		request.pgtable = mem::page_table::current();
+	}
+
+	account_submission(request);
+
+	if (!scheduler_) {
+		submit_real_io_request(request);
+		return;
+	}
+
+	request.next_merged = nullptr;
+	request.queue_next = nullptr;
+
+	unique_irq_lock l(queue_lock_);
+
+	if (barriers_head_ || request.direction == block_io_request_direction::flush) {
+		if (barriers_tail_) {
+			barriers_tail_->queue_next = &request;
+		} else {
+			barriers_head_ = &request;
+		}
+
+		barriers_tail_ = &request;
+	} else {
+		scheduler_->add(request);
+	}
+
+	if (!plug_count_) {
+		dispatch(l);
+	}
+}
+
+void block_device::set_scheduler(io_scheduler *scheduler, unsigned int max_in_flight)
+{
+	scheduler_ = scheduler;
+	max_in_flight_ = max_in_flight;
+}
+
+const char *block_device::scheduler_name() const { return scheduler_ ? scheduler_->name() : "none"; }
+
+void block_device::plug()
+{
+	if (!scheduler_) {
+		return;
+	}
+
+	unique_irq_lock l(queue_lock_);
+	plug_count_++;
+}
+
+void block_device::unplug()
+{
+	if (!scheduler_) {
+		return;
+	}
+
+	unique_irq_lock l(queue_lock_);
+
+	if (plug_count_ && !--plug_count_) {
+		dispatch(l);
+	}
+}
+
+void block_device::dispatch(unique_irq_lock &l)
+{
+	while (nr_in_flight_ < max_in_flight_) {
+		block_io_request *request = scheduler_->next();
 
-void block_device::read_blocks_sync(void *buffer, u64 start, u64 count) { submit_sync_request(block_io_request_direction::read, buffer, start, count); }
+		if (!request && barriers_head_) {
+			// Everything before the flush has gone, so the flush can follow it, and then whatever came after it can be
+			// sorted, up to the next flush.  The driver won't start on any of those until the flush is done.
+			request = barriers_head_;
+			barriers_head_ = request->queue_next;
+			request->queue_next = nullptr;
 
-void block_device::write_blocks_sync(const void *buffer, u64 start, u64 count)
+			while (barriers_head_ && barriers_head_->direction != block_io_request_direction::flush) {
+				block_io_request *after = barriers_head_;
+				barriers_head_ = after->queue_next;
+				after->queue_next = nullptr;
+
+				scheduler_->add(*after);
+			}
+
+			if (!barriers_head_) {
+				barriers_tail_ = nullptr;
+			}
+		}
+
+		if (!request) {
+			break;
+		}
+
+		nr_in_flight_++;
+
+		if (request->next_merged) {
+			__atomic_fetch_add(&stats_.get().merges, request->nr_segments() - 1, __ATOMIC_RELAXED);
+		}
+
+		// The driver may complete the request before returning (e.g. while polling), which dispatches again.
+		l.unlock();
+		submit_real_io_request(*request);
+		l.lock();
+	}
+}
+
+void block_device::complete_request(block_io_request &request, block_io_status status)
+{
+	// A request may be gone as soon as its callback returns.  The requests merged into one succeed or fail with it.
+	block_io_request *r = &request;
+	while (r) {
+		block_io_request *next = r->next_merged;
+
+		r->next_merged = nullptr;
+		r->status = status;
+		account_completion(*r);
+
+		if (r->callback) {
+			r->callback(r, r->cb_state);
+		}
+
+		r = next;
+	}
+
+	if (!scheduler_) {
+		return;
+	}
+
+	unique_irq_lock l(queue_lock_);
+	nr_in_flight_--;
+
+	if (!plug_count_) {
+		dispatch(l);
+	}
+}
+
+void block_device::get_io_stats(block_io_stats &stats)
+{
+	memops::bzero(&stats, sizeof(stats));
+
+	for (const auto &s : stats_) {
+		stats.reads += s.reads;
+		stats.writes += s.writes;
+		stats.flushes += s.flushes;
+		stats.blocks_read += s.blocks_read;
+		stats.blocks_written += s.blocks_written;
+		stats.merges += s.merges;
+		stats.read_cycles += s.read_cycles;
+		stats.write_cycles += s.write_cycles;
+
+		for (unsigned int i = 0; i < block_io_stats::nr_latency_buckets; i++) {
+			stats.read_latency[i] += s.read_latency[i];
+			stats.write_latency[i] += s.write_latency[i];
+		}
+	}
+
+	stats.outstanding = __atomic_load_n(&outstanding_, __ATOMIC_RELAXED);
+	stats.max_outstanding = __atomic_load_n(&max_outstanding_, __ATOMIC_RELAXED);
+}
+
+// As with the system call statistics, the submitting thread may be preempted by another using the same core's
+// counters, so the updates are atomic, but as no other core touches them, they are uncontended.
+void block_device::account_submission(block_io_request &request)
 {
-	submit_sync_request(block_io_request_direction::write, (void *)buffer, start, count);
+	block_io_stats &s = stats_.get();
+
+	switch (request.direction) {
+	case block_io_request_direction::read:
+		__atomic_fetch_add(&s.reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s.blocks_read, request.block_count, __ATOMIC_RELAXED);
+		break;
+
+	case block_io_request_direction::write:
+		__atomic_fetch_add(&s.writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s.blocks_written, request.block_count, __ATOMIC_RELAXED);
+		break;
+
+	case block_io_request_direction::flush:
+		__atomic_fetch_add(&s.flushes, 1, __ATOMIC_RELAXED);
+		break;
+	}
+
+	u64 outstanding = __atomic_add_fetch(&outstanding_, 1, __ATOMIC_RELAXED);
+	u64 max_outstanding = __atomic_load_n(&max_outstanding_, __ATOMIC_RELAXED);
+	while (outstanding > max_outstanding && !__atomic_compare_exchange_n(&max_outstanding_, &max_outstanding, outstanding, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	// Taken last, so that the time spent counting isn't part of the service time.
+	request.submit_time = __builtin_ia32_rdtsc();
 }
 
+void block_device::account_completion(const block_io_request &request)
+{
+	u64 cycles = __builtin_ia32_rdtsc() - request.submit_time;
+	unsigned int bucket = min(cycles ? 63 - __builtin_clzll(cycles) : 0, (int)block_io_stats::nr_latency_buckets - 1);
+
+	block_io_stats &s = stats_.get();
+	__atomic_fetch_sub(&outstanding_, 1, __ATOMIC_RELAXED);
+
+	switch (request.direction) {
+	case block_io_request_direction::read:
+		__atomic_fetch_add(&s.read_cycles, cycles, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s.read_latency[bucket], 1, __ATOMIC_RELAXED);
+		break;
+
+	case block_io_request_direction::write:
+		__atomic_fetch_add(&s.write_cycles, cycles, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s.write_latency[bucket], 1, __ATOMIC_RELAXED);
+		break;
+
+	default:
+		break;
+	}
+}
+
+bool block_device::read_blocks_sync(void *buffer, u64 start, u64 count) { return submit_sync_request(block_io_request_direction::read, buffer, start, count); }
+
+bool block_device::write_blocks_sync(const void *buffer, u64 start, u64 count)
+{
+	return submit_sync_request(block_io_request_direction::write, (void *)buffer, start, count);
+}
+
+bool block_device::flush_sync() { return submit_sync_request(block_io_request_direction::flush, nullptr, 0, 0); }
+
 struct sync_state {
 	manual_reset_event e;
 };
 
 static void request_cb(block_io_request *request, void *state) { ((sync_state *)state)->e.trigger(); }
 
-void block_device::submit_sync_request(block_io_request_direction direction, void *buffer, u64 start, u64 count)
+bool block_device::submit_sync_request(block_io_request_direction direction, void *buffer, u64 start, u64 count)
 {
 	block_io_request io_req;
 	io_req.direction = direction;
@@ -46,5 +335,14 @@ void block_device::submit_sync_request(block_io_request_direction direction, voi
 
 	submit_io_request(io_req);
 
+	// Nothing else is going to unplug the queue while this thread sleeps, so the request (and anything queued with
+	// it) is sent on its way now.
+	if (scheduler_) {
+		unique_irq_lock l(queue_lock_);
+		dispatch(l);
+	}
+
 	state.e.wait();
+
+	return io_req.status == block_io_status::ok;
 }
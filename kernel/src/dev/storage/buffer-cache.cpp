@@ -0,0 +1,692 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/sched/preempt.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::dev::storage;
+
+// The cache is given a thirty-second of the memory that is free when it starts, within these limits.
+static const u64 min_buffers = 256;
+static const u64 max_buffers = 65536;
+
+buffer_cache::buffer_cache()
+	: nr_buffers_(0)
+	, hand_(0)
+	, nr_dirty_(0)
+	, free_(nullptr)
+	, counters_({})
+{
+	u64 free_bytes = mem::memory_manager::get().pgalloc().free_page_count() << PAGE_BITS;
+	capacity_ = max(min_buffers, min(max_buffers, free_bytes / 32 / block_size));
+
+	u64 nr_buckets = 1;
+	while (nr_buckets < capacity_) {
+		nr_buckets <<= 1;
+	}
+
+	buckets_ = new block_buffer *[nr_buckets];
+	for (u64 i = 0; i < nr_buckets; i++) {
+		buckets_[i] = nullptr;
+	}
+
+	bucket_mask_ = nr_buckets - 1;
+
+	slots_ = (capacity_ + buffers_per_page - 1) & ~(buffers_per_page - 1);
+	buffers_ = new block_buffer *[slots_];
+
+	dprintf("bcache: %llu buffers of %llu bytes\n", capacity_, block_size);
+}
+
+block_buffer *buffer_cache::get(block_device &dev, u64 block)
+{
+	block_device &backing = dev.backing_device(block);
+
+	bool created;
+	block_buffer *buffer;
+
+	{
+		unique_irq_lock l(lock_);
+		buffer = acquire(backing, block, created);
+	}
+
+	if (created) {
+		start_io(&buffer, 1, block_io_request_direction::read);
+	}
+
+	wait_for(buffer);
+
+	if (!buffer->valid) {
+		release(buffer);
+		return nullptr;
+	}
+
+	return buffer;
+}
+
+void buffer_cache::release(block_buffer *buffer)
+{
+	unique_irq_lock l(lock_);
+	buffer->refcount--;
+}
+
+void buffer_cache::mark_dirty(block_buffer *buffer)
+{
+	if (buffer->dev->read_only()) {
+		return;
+	}
+
+	unique_irq_lock l(lock_);
+
+	if (!buffer->dirty) {
+		buffer->dirty = true;
+		nr_dirty_++;
+	}
+}
+
+bool buffer_cache::read(block_device &dev, void *buffer, u64 start, u64 count)
+{
+	block_device &backing = dev.backing_device(start);
+	u8 *out = (u8 *)buffer;
+	bool ok = true;
+
+	while (count > 0) {
+		unsigned int batch_size = min(count, (u64)max_batch);
+		block_buffer *batch[max_batch];
+		block_buffer *missing[max_batch];
+		unsigned int nr_missing = 0;
+
+		{
+			unique_irq_lock l(lock_);
+
+			for (unsigned int i = 0; i < batch_size; i++) {
+				bool created;
+				batch[i] = acquire(backing, start + i, created);
+
+				if (created) {
+					missing[nr_missing++] = batch[i];
+				}
+			}
+		}
+
+		// Every missing block is submitted before any of them are waited for, so that runs of them can be merged.
+		start_io(missing, nr_missing, block_io_request_direction::read);
+
+		for (unsigned int i = 0; i < batch_size; i++) {
+			wait_for(batch[i]);
+			if (batch[i]->valid) {
+				memops::memcpy(out, batch[i]->data, block_size);
+			} else {
+				ok = false;
+			}
+
+			release(batch[i]);
+
+			out += block_size;
+		}
+
+		start += batch_size;
+		count -= batch_size;
+
+		// A large read of blocks that are already cached is all copying, without ever blocking.
+		sched::cond_resched();
+	}
+
+	return ok;
+}
+
+void buffer_cache::prefetch(block_device &dev, u64 start, u64 count)
+{
+	block_device &backing = dev.backing_device(start);
+
+	while (count > 0) {
+		unsigned int batch_size = min(count, (u64)max_batch);
+		block_buffer *missing[max_batch];
+		unsigned int nr_missing = 0;
+
+		{
+			unique_irq_lock l(lock_);
+
+			for (unsigned int i = 0; i < batch_size; i++) {
+				// A block that couldn't be read before is tried again.
+				block_buffer *b = lookup(backing, start + i);
+				if (b && (b->valid || b->busy)) {
+					continue;
+				}
+
+				bool created;
+				missing[nr_missing++] = acquire(backing, start + i, created);
+			}
+		}
+
+		start_io(missing, nr_missing, block_io_request_direction::read);
+
+		// Nobody is waiting for these, and a busy buffer is never evicted, so they can be let go of straight away.
+		for (unsigned int i = 0; i < nr_missing; i++) {
+			release(missing[i]);
+		}
+
+		start += batch_size;
+		count -= batch_size;
+	}
+}
+
+u64 buffer_cache::discard(block_device &dev, u64 start, u64 count)
+{
+	block_device &backing = dev.backing_device(start);
+
+	unique_irq_lock l(lock_);
+
+	// The clock hand only looks for a victim once the free list is empty, so it never finds these.
+	u64 nr_dropped = 0;
+	for (u64 i = 0; i < count; i++) {
+		block_buffer *b = lookup(backing, start + i);
+		if (!b || b->refcount || b->dirty || b->busy) {
+			continue;
+		}
+
+		hash_remove(b);
+		b->valid = false;
+
+		b->hash_next = free_;
+		free_ = b;
+
+		nr_dropped++;
+	}
+
+	counters_.evictions += nr_dropped;
+	return nr_dropped;
+}
+
+bool buffer_cache::read_direct(block_device &dev, void *buffer, u64 start, u64 count)
+{
+	block_device &backing = dev.backing_device(start);
+
+	// The device may not be able to transfer to any address (e.g. AHCI needs an even one, and NVMe a multiple of four).
+	if ((u64)buffer & (backing.dma_alignment() - 1)) {
+		return false;
+	}
+
+	if (range_cached(backing, start, count)) {
+		return false;
+	}
+
+	// Kernel memory is never moved, but user pages may not be there yet, may be shared from the page cache, and may
+	// be moved by the compactor.
+	if ((u64)buffer < 0xffff'8000'0000'0000) {
+		if (!sched::thread::current().owner().addrspace().pin_for_write((u64)buffer, count * block_size)) {
+			return false;
+		}
+	}
+
+	u8 *out = (u8 *)buffer;
+	while (count > 0) {
+		u64 chunk = min(count, max_direct_blocks);
+		if (!backing.read_blocks_sync(out, start, chunk)) {
+			dprintf("bcache: unable to read blocks %llu-%llu\n", start, start + chunk - 1);
+			return false;
+		}
+
+		out += chunk * block_size;
+		start += chunk;
+		count -= chunk;
+	}
+
+	return true;
+}
+
+bool buffer_cache::write(block_device &dev, const void *buffer, u64 start, u64 count)
+{
+	block_device &backing = dev.backing_device(start);
+	if (backing.read_only()) {
+		return false;
+	}
+
+	const u8 *in = (const u8 *)buffer;
+
+	for (u64 i = 0; i < count; i++) {
+		bool created;
+		block_buffer *b;
+
+		{
+			unique_irq_lock l(lock_);
+			b = acquire(backing, start + i, created);
+		}
+
+		// The whole block is overwritten, so a new buffer needn't be read in, but an existing one may still be.
+		if (!created) {
+			wait_for(b);
+		}
+
+		memops::memcpy(b->data, in, block_size);
+		in += block_size;
+
+		{
+			unique_irq_lock l(lock_);
+
+			b->valid = true;
+			b->busy = false;
+			if (!b->dirty) {
+				b->dirty = true;
+				nr_dirty_++;
+			}
+
+			b->refcount--;
+		}
+
+		if (created) {
+			io_waiters_.wake_all();
+		}
+	}
+
+	return true;
+}
+
+bool buffer_cache::read_bytes(block_device &dev, void *buffer, u64 start, u64 offset, u64 length)
+{
+	u8 *out = (u8 *)buffer;
+
+	if (offset) {
+		u64 chunk = min(length, block_size - offset);
+
+		block_buffer *b = get(dev, start++);
+		if (!b) {
+			return false;
+		}
+
+		memops::memcpy(out, b->data + offset, chunk);
+		release(b);
+
+		out += chunk;
+		length -= chunk;
+	}
+
+	u64 whole_blocks = length / block_size;
+	if (whole_blocks) {
+		if (!read_direct(dev, out, start, whole_blocks) && !read(dev, out, start, whole_blocks)) {
+			return false;
+		}
+
+		out += whole_blocks * block_size;
+		length -= whole_blocks * block_size;
+		start += whole_blocks;
+	}
+
+	if (length) {
+		block_buffer *b = get(dev, start);
+		if (!b) {
+			return false;
+		}
+
+		memops::memcpy(out, b->data, length);
+		release(b);
+	}
+
+	return true;
+}
+
+bool buffer_cache::write_bytes(block_device &dev, const void *buffer, u64 start, u64 offset, u64 length)
+{
+	if (dev.read_only()) {
+		return false;
+	}
+
+	const u8 *in = (const u8 *)buffer;
+
+	// Partial blocks have to be read in first, but whole blocks are simply overwritten.
+	if (offset) {
+		u64 chunk = min(length, block_size - offset);
+
+		block_buffer *b = get(dev, start++);
+		if (!b) {
+			return false;
+		}
+
+		memops::memcpy(b->data + offset, in, chunk);
+		mark_dirty(b);
+		release(b);
+
+		in += chunk;
+		length -= chunk;
+	}
+
+	u64 whole_blocks = length / block_size;
+	if (whole_blocks) {
+		write(dev, in, start, whole_blocks);
+
+		in += whole_blocks * block_size;
+		length -= whole_blocks * block_size;
+		start += whole_blocks;
+	}
+
+	if (length) {
+		block_buffer *b = get(dev, start);
+		if (!b) {
+			return false;
+		}
+
+		memops::memcpy(b->data, in, length);
+		mark_dirty(b);
+		release(b);
+	}
+
+	return true;
+}
+
+bool buffer_cache::sync(block_device &dev)
+{
+	u64 block = 0;
+	block_device &backing = dev.backing_device(block);
+
+	// A buffer that fails is dirty again, and would be collected again, so the first failure ends the sync.
+	bool ok = true;
+	while (ok) {
+		block_buffer *batch[max_batch];
+		unsigned int count = collect_dirty(&backing, batch, true, true);
+		if (!count) {
+			break;
+		}
+
+		start_io(batch, count, block_io_request_direction::write);
+
+		for (unsigned int i = 0; i < count; i++) {
+			wait_for(batch[i]);
+			if (__atomic_load_n(&batch[i]->write_failed, __ATOMIC_RELAXED)) {
+				ok = false;
+			}
+
+			release(batch[i]);
+		}
+	}
+
+	return backing.flush_sync() && ok;
+}
+
+bool buffer_cache::write_back_some()
+{
+	if (!__atomic_load_n(&nr_dirty_, __ATOMIC_RELAXED)) {
+		return false;
+	}
+
+	block_buffer *batch[max_batch];
+	unsigned int count = collect_dirty(nullptr, batch, false, false);
+
+	start_io(batch, count, block_io_request_direction::write);
+	return count > 0;
+}
+
+buffer_cache::stats buffer_cache::get_stats()
+{
+	unique_irq_lock l(lock_);
+
+	stats s = counters_;
+	s.buffers = nr_buffers_;
+	s.capacity = capacity_;
+
+	return s;
+}
+
+block_buffer *buffer_cache::acquire(block_device &dev, u64 block, bool &created)
+{
+	block_buffer *b = lookup(dev, block);
+	if (b && (b->valid || b->busy)) {
+		b->refcount++;
+		b->referenced = true;
+		counters_.hits++;
+
+		created = false;
+		return b;
+	}
+
+	counters_.misses++;
+
+	// A block that couldn't be read before is given to the caller to read again, as if it had just been created.
+	if (b) {
+		b->refcount++;
+		b->referenced = true;
+		b->busy = true;
+
+		created = true;
+		return b;
+	}
+
+	b = free_ ? nullptr : evict_one();
+	if (!b) {
+		// The cache only grows past its capacity when every buffer in it is held or dirty.
+		if (!free_) {
+			grow();
+		}
+
+		b = free_;
+		free_ = b->hash_next;
+	}
+
+	// The buffer is busy until whoever created it has filled it in.
+	b->dev = &dev;
+	b->block = block;
+	b->refcount = 1;
+	b->valid = false;
+	b->dirty = false;
+	b->write_failed = false;
+	b->referenced = true;
+	b->busy = true;
+
+	hash_insert(b);
+
+	created = true;
+	return b;
+}
+
+void buffer_cache::grow()
+{
+	// The cache only grows when every buffer is held or dirty, and writing the dirty ones back is what lets memory be
+	// freed, so the page may come out of the reserve.
+	mem::page *pg = mem::memory_manager::get().pgalloc().allocate_pages(0, mem::page_allocation_flags::reserve);
+	if (!pg) {
+		panic("bcache: out of memory");
+	}
+
+	if (nr_buffers_ + buffers_per_page > slots_) {
+		block_buffer **buffers = new block_buffer *[slots_ * 2];
+		memops::memcpy(buffers, buffers_, slots_ * sizeof(block_buffer *));
+
+		delete[] buffers_;
+		buffers_ = buffers;
+		slots_ *= 2;
+	}
+
+	block_buffer *chunk = new block_buffer[buffers_per_page]();
+	u8 *data = (u8 *)pg->base_address_ptr();
+
+	for (u64 i = 0; i < buffers_per_page; i++) {
+		block_buffer *b = &chunk[i];
+
+		b->data = data + (i * block_size);
+
+		b->hash_next = free_;
+		free_ = b;
+
+		buffers_[nr_buffers_++] = b;
+	}
+}
+
+block_buffer *buffer_cache::evict_one()
+{
+	if (nr_buffers_ < capacity_) {
+		return nullptr;
+	}
+
+	// Each buffer that is passed over loses its referenced bit, so two trips round find a victim, if there is one.
+	for (u64 i = 0; i < nr_buffers_ * 2; i++) {
+		block_buffer *b = buffers_[hand_];
+		hand_ = (hand_ + 1) % nr_buffers_;
+
+		if (b->refcount || b->dirty || b->busy) {
+			continue;
+		}
+
+		if (b->referenced) {
+			b->referenced = false;
+			continue;
+		}
+
+		hash_remove(b);
+		counters_.evictions++;
+
+		return b;
+	}
+
+	return nullptr;
+}
+
+bool buffer_cache::range_cached(block_device &dev, u64 start, u64 count)
+{
+	unique_irq_lock l(lock_);
+
+	for (u64 i = 0; i < count; i++) {
+		if (lookup(dev, start + i)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+unsigned int buffer_cache::collect_dirty(block_device *dev, block_buffer **batch, bool hold, bool retry_failed)
+{
+	unique_irq_lock l(lock_);
+
+	unsigned int count = 0;
+	for (u64 i = 0; i < nr_buffers_ && count < max_batch; i++) {
+		block_buffer *b = buffers_[i];
+
+		if (!b->dirty || b->busy || (dev && b->dev != dev) || (b->write_failed && !retry_failed)) {
+			continue;
+		}
+
+		// The write holds a reference of its own, which it drops when it completes.  Anything written to the buffer
+		// from now on dirties it again.
+		b->refcount += hold ? 2 : 1;
+		b->dirty = false;
+		b->busy = true;
+		nr_dirty_--;
+
+		batch[count++] = b;
+	}
+
+	return count;
+}
+
+void buffer_cache::start_io(block_buffer **batch, unsigned int count, block_io_request_direction direction)
+{
+	if (!count) {
+		return;
+	}
+
+	block_device &dev = *batch[0]->dev;
+	dev.plug();
+
+	for (unsigned int i = 0; i < count; i++) {
+		block_buffer *b = batch[i];
+
+		b->io = {};
+		b->io.direction = direction;
+		b->io.start_block = b->block;
+		b->io.block_count = 1;
+		b->io.buffer = b->data;
+		b->io.callback = io_done;
+		b->io.cb_state = b;
+
+		b->dev->submit_io_request(b->io);
+	}
+
+	dev.unplug();
+}
+
+void buffer_cache::wait_for(block_buffer *buffer)
+{
+	io_waiters_.wait_until([buffer] { return !__atomic_load_n(&buffer->busy, __ATOMIC_ACQUIRE); });
+}
+
+void buffer_cache::io_done(block_io_request *request, void *state)
+{
+	buffer_cache &cache = buffer_cache::get();
+	block_buffer *b = (block_buffer *)state;
+
+	{
+		unique_irq_lock l(cache.lock_);
+
+		bool ok = request->status == block_io_status::ok;
+		if (!ok) {
+			dprintf("bcache: unable to %s block %llu\n", request->direction == block_io_request_direction::read ? "read" : "write back", b->block);
+		}
+
+		if (request->direction == block_io_request_direction::read) {
+			// A buffer that wasn't read in stays not valid, so that nobody takes its contents for the block's.
+			b->valid = ok;
+		} else {
+			// The data was only ever in the buffer, so a buffer that wasn't written back is dirty again, unless it has
+			// been written to since.
+			if (!ok && !b->dirty) {
+				b->dirty = true;
+				cache.nr_dirty_++;
+			}
+
+			b->write_failed = !ok;
+			cache.counters_.writebacks++;
+			b->refcount--;
+		}
+
+		__atomic_store_n(&b->busy, false, __ATOMIC_RELEASE);
+	}
+
+	cache.io_waiters_.wake_all();
+}
+
+block_buffer *buffer_cache::lookup(block_device &dev, u64 block)
+{
+	for (block_buffer *b = buckets_[hash(dev, block)]; b; b = b->hash_next) {
+		if (b->dev == &dev && b->block == block) {
+			return b;
+		}
+	}
+
+	return nullptr;
+}
+
+void buffer_cache::hash_insert(block_buffer *buffer)
+{
+	block_buffer **bucket = &buckets_[hash(*buffer->dev, buffer->block)];
+
+	buffer->hash_next = *bucket;
+	*bucket = buffer;
+}
+
+void buffer_cache::hash_remove(block_buffer *buffer)
+{
+	block_buffer **link = &buckets_[hash(*buffer->dev, buffer->block)];
+	while (*link != buffer) {
+		link = &(*link)->hash_next;
+	}
+
+	*link = buffer->hash_next;
+}
+
+u64 buffer_cache::hash(block_device &dev, u64 block) const
+{
+	u64 h = (block * 0x9e3779b97f4a7c15ull) ^ ((u64)&dev >> 4);
+	return (h ^ (h >> 29)) & bucket_mask_;
+}
@@ -0,0 +1,181 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/dev/storage/io-scheduler.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::dev::storage;
+
+io_scheduler *io_scheduler::create(const char *name, u64 max_merge_blocks, unsigned int max_merge_segments)
+{
+	if (memops::strcmp(name, "noop") == 0) {
+		return new noop_scheduler(max_merge_blocks, max_merge_segments);
+	}
+
+	return new elevator_scheduler(max_merge_blocks, max_merge_segments);
+}
+
+/**
+ * @brief Merges a request into a queued one, if they are for adjacent blocks in the same direction, and the result
+ * isn't too big for the driver.
+ *
+ * @return block_io_request* The new head of the merged chain (which is the request itself, if it went in front), or
+ * nullptr if the two can't be merged.
+ */
+block_io_request *io_scheduler::try_merge(block_io_request &queued, block_io_request &request)
+{
+	if (queued.direction != request.direction) {
+		return nullptr;
+	}
+
+	u64 blocks = queued.total_blocks() + request.block_count;
+	unsigned int segments = queued.nr_segments() + 1;
+
+	if (blocks > max_merge_blocks_ || segments > max_merge_segments_) {
+		return nullptr;
+	}
+
+	if (queued.start_block + queued.total_blocks() == request.start_block) {
+		block_io_request *tail = &queued;
+		while (tail->next_merged) {
+			tail = tail->next_merged;
+		}
+
+		tail->next_merged = &request;
+		return &queued;
+	}
+
+	if (request.start_block + request.block_count == queued.start_block) {
+		request.next_merged = &queued;
+		request.queue_next = queued.queue_next;
+		queued.queue_next = nullptr;
+
+		return &request;
+	}
+
+	return nullptr;
+}
+
+void noop_scheduler::add(block_io_request &request)
+{
+	request.queue_next = nullptr;
+
+	if (tail_) {
+		block_io_request *merged = try_merge(*tail_, request);
+		if (merged) {
+			// A front merge puts the new request in the old one's place.
+			if (head_ == tail_) {
+				head_ = merged;
+			} else if (merged != tail_) {
+				block_io_request *prev = head_;
+				while (prev->queue_next != tail_) {
+					prev = prev->queue_next;
+				}
+
+				prev->queue_next = merged;
+			}
+
+			tail_ = merged;
+			return;
+		}
+
+		tail_->queue_next = &request;
+	} else {
+		head_ = &request;
+	}
+
+	tail_ = &request;
+}
+
+block_io_request *noop_scheduler::next()
+{
+	block_io_request *request = head_;
+	if (!request) {
+		return nullptr;
+	}
+
+	head_ = request->queue_next;
+	if (!head_) {
+		tail_ = nullptr;
+	}
+
+	request->queue_next = nullptr;
+	return request;
+}
+
+void elevator_scheduler::add(block_io_request &request)
+{
+	request.queue_next = nullptr;
+
+	// Find the last request that starts before this one.
+	block_io_request *prev = nullptr;
+	block_io_request *cur = head_;
+	while (cur && cur->start_block < request.start_block) {
+		prev = cur;
+		cur = cur->queue_next;
+	}
+
+	// The request may carry on from the one before it, or lead into the one after it.  A front merge takes the
+	// place of the request it merged with, so the links are fixed up from prev.
+	if (prev && try_merge(*prev, request)) {
+		// Having grown, prev may now also lead into the next request, but those are left as two.
+		return;
+	}
+
+	if (cur) {
+		block_io_request *merged = try_merge(*cur, request);
+		if (merged) {
+			if (prev) {
+				prev->queue_next = merged;
+			} else {
+				head_ = merged;
+			}
+
+			return;
+		}
+	}
+
+	request.queue_next = cur;
+	if (prev) {
+		prev->queue_next = &request;
+	} else {
+		head_ = &request;
+	}
+}
+
+block_io_request *elevator_scheduler::next()
+{
+	if (!head_) {
+		return nullptr;
+	}
+
+	// Carry on upwards from the last position, or go back to the start if there's nothing left above it.
+	block_io_request *prev = nullptr;
+	block_io_request *cur = head_;
+	while (cur && cur->start_block < position_) {
+		prev = cur;
+		cur = cur->queue_next;
+	}
+
+	if (!cur) {
+		prev = nullptr;
+		cur = head_;
+	}
+
+	if (prev) {
+		prev->queue_next = cur->queue_next;
+	} else {
+		head_ = cur->queue_next;
+	}
+
+	cur->queue_next = nullptr;
+	position_ = cur->start_block + cur->total_blocks();
+
+	return cur;
+}
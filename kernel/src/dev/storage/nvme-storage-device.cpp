@@ -0,0 +1,561 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/storage/mbr.h>
+#include <stacsos/kernel/dev/storage/nvme-storage-device.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/sleeper.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::storage;
+using namespace stacsos::kernel::mem;
+
+device_class nvme_storage_device::nvme_storage_device_class(block_device::block_device_class, "nvme");
+
+// The command register's memory space and bus master bits.
+static const u16 pci_command_memory = 1u << 1;
+static const u16 pci_command_bus_master = 1u << 2;
+
+// The direct map only covers the first 12 GiB of the physical address space (see memory_manager).
+static const u64 direct_map_limit = GB(12);
+
+// Every slot's PRP list (512 bytes each) is allocated together: eight pages for 63 slots.
+static const int prp_lists_order = 3;
+
+bool nvme_storage_device::bring_up()
+{
+	dprintf("nvme: probing...\n");
+
+	auto &config = pcidev_.config();
+
+	u32 bar = config.bar_by_index(0);
+	if (bar & 1) {
+		dprintf("nvme: registers are in an i/o bar\n");
+		return false;
+	}
+
+	u64 base = bar & ~0xfull;
+	if (((bar >> 1) & 3) == 2) {
+		base |= (u64)config.bar_by_index(1) << 32;
+	}
+
+	if (base >= direct_map_limit) {
+		dprintf("nvme: bar at %llx is outside the direct map\n", base);
+		return false;
+	}
+
+	config.write_config_value<u16>(4, config.command() | pci_command_memory | pci_command_bus_master);
+	regs_ = (volatile u8 *)phys_to_virt(base);
+
+	u64 cap = read_reg64(NVME_REG_CAP);
+
+	// Memory pages are 4 KiB (CC.MPS is zero), which the controller must support.
+	if (NVME_CAP_MPSMIN(cap) != 0) {
+		dprintf("nvme: controller doesn't support 4 KiB pages\n");
+		return false;
+	}
+
+	if (NVME_CAP_MQES(cap) + 1 < queue_entries) {
+		dprintf("nvme: controller's queues are too small\n");
+		return false;
+	}
+
+	doorbell_stride_ = 4u << NVME_CAP_DSTRD(cap);
+	u64 timeout_ms = max(NVME_CAP_TO(cap), (u8)1) * 500ull;
+
+	// The controller is reset by disabling it, which must be seen to finish before the admin queue is changed.
+	write_reg32(NVME_REG_CC, 0);
+	if (!wait_ready(false, timeout_ms)) {
+		dprintf("nvme: controller didn't reset\n");
+		return false;
+	}
+
+	// Pin-based interrupts are never used: completions arrive by MSI-X, MSI, or are polled for.
+	write_reg32(NVME_REG_INTMS, 0xffffffff);
+
+	admin_ = allocate_queue(0);
+	write_reg32(NVME_REG_AQA, ((queue_entries - 1) << 16) | (queue_entries - 1));
+	write_reg64(NVME_REG_ASQ, admin_->sq_phys);
+	write_reg64(NVME_REG_ACQ, admin_->cq_phys);
+
+	write_reg32(NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+	if (!wait_ready(true, timeout_ms)) {
+		dprintf("nvme: controller didn't become ready\n");
+		return false;
+	}
+
+	u64 id_phys = zeroed_page_pool::get().allocate()->base_address();
+	const u8 *id = (const u8 *)phys_to_virt(id_phys);
+
+	if (!identify(NVME_IDENTIFY_CONTROLLER, 0, id_phys)) {
+		return false;
+	}
+
+	// MDTS is a power of two of the minimum page size, with zero meaning there is no limit.
+	u8 mdts = id[NVME_ID_CTRL_MDTS];
+	max_command_bytes_ = max_prp_command_bytes;
+	if (mdts && mdts < 32) {
+		max_command_bytes_ = min(max_command_bytes_, (u64)PAGE_SIZE << mdts);
+	}
+
+	can_flush_ = !!(id[NVME_ID_CTRL_VWC] & 1);
+
+	if (!identify(NVME_IDENTIFY_NAMESPACE, 1, id_phys)) {
+		return false;
+	}
+
+	nr_blocks_ = *(const u64 *)&id[NVME_ID_NS_NSZE];
+
+	u8 format = id[NVME_ID_NS_FLBAS] & 0xf;
+	u8 lba_shift = id[NVME_ID_NS_LBAF + (format * 4) + 2];
+
+	if (!nr_blocks_ || lba_shift != 9) {
+		dprintf("nvme: namespace 1 is missing, or doesn't have 512-byte blocks\n");
+		return false;
+	}
+
+	// One queue for each core, but no more than the controller will give, or there are MSI-X vectors for.
+	unsigned int nr_wanted = 0;
+	for (auto *c : core_manager::get().cores()) {
+		if (c->status() == core_status::online || c->status() == core_status::bootstrap) {
+			nr_wanted++;
+		}
+	}
+
+	nr_wanted = min(nr_wanted, max(pcidev_.msix_vector_count(), 1u));
+
+	nvme_command cmd;
+	memops::zero<sizeof(cmd)>(&cmd);
+	cmd.opcode = NVME_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVME_FEATURE_NUMBER_OF_QUEUES;
+	cmd.cdw11 = ((nr_wanted - 1) << 16) | (nr_wanted - 1);
+
+	u32 granted;
+	if (!admin_command(cmd, granted)) {
+		dprintf("nvme: controller refused i/o queues\n");
+		return false;
+	}
+
+	nr_queues_ = min(nr_wanted, min((granted & 0xffff) + 1, (granted >> 16) + 1));
+
+	void *args[core_manager::max_cores];
+	for (unsigned int i = 0; i < nr_queues_; i++) {
+		queues_[i] = allocate_queue(i + 1);
+		args[i] = queues_[i];
+	}
+
+	// Queue i completes on MSI-X vector i, on the ith online core.  With only a single MSI, there is only one queue,
+	// and without either, it is polled.
+	unsigned int nr_irqs = pcidev_.request_queue_irqs(nr_queues_, nvme_irq_handler, args, "nvme");
+	if (!nr_irqs) {
+		dprintf("nvme: no msi-x or msi, polling for completions\n");
+		polled_ = true;
+		nr_queues_ = 1;
+	} else {
+		nr_queues_ = nr_irqs;
+	}
+
+	for (unsigned int i = 0; i < nr_queues_; i++) {
+		if (!create_io_queue(*queues_[i], (u16)i)) {
+			dprintf("nvme: unable to create i/o queue %u\n", i + 1);
+			return false;
+		}
+	}
+
+	// Each core submits to the queue whose interrupt it takes, in the order request_queue_irqs handed them out.
+	unsigned int index = 0;
+	for (auto *c : core_manager::get().cores()) {
+		if (c->status() == core_status::online || c->status() == core_status::bootstrap) {
+			core_queues_[c->id()] = index++ % nr_queues_;
+		}
+	}
+
+	dprintf("nvme: %llu blocks, %u i/o queues of %u, max command=%llu KiB, flush=%d\n", nr_blocks_, nr_queues_, nr_slots,
+		max_command_bytes_ >> 10, can_flush_);
+
+	return true;
+}
+
+bool nvme_storage_device::wait_ready(bool ready, u64 timeout_ms)
+{
+	for (u64 i = 0; i < timeout_ms; i++) {
+		u32 status = read_reg32(NVME_REG_CSTS);
+
+		if (ready && (status & NVME_CSTS_CFS)) {
+			dprintf("nvme: controller fatal status\n");
+			return false;
+		}
+
+		if (!!(status & NVME_CSTS_RDY) == ready) {
+			return true;
+		}
+
+		if (core::this_core().get_current_tcb()) {
+			sched::sleeper::get().sleep_ms(1);
+		} else {
+			__relax();
+		}
+	}
+
+	return false;
+}
+
+nvme_storage_device::queue *nvme_storage_device::allocate_queue(u16 id)
+{
+	queue *q = new queue(id);
+	q->owner = this;
+
+	// Submission queue entries are 64 bytes, and completion queue entries 16, so each queue fits in a page.
+	q->sq_phys = zeroed_page_pool::get().allocate()->base_address();
+	q->sq = (volatile nvme_command *)phys_to_virt(q->sq_phys);
+	q->cq_phys = zeroed_page_pool::get().allocate()->base_address();
+	q->cq = (volatile nvme_completion *)phys_to_virt(q->cq_phys);
+
+	q->sq_doorbell = (volatile u32 *)(regs_ + NVME_REG_DOORBELLS + (2 * id * doorbell_stride_));
+	q->cq_doorbell = (volatile u32 *)(regs_ + NVME_REG_DOORBELLS + ((2 * id + 1) * doorbell_stride_));
+
+	// The admin queue only ever has one command outstanding, and it has no data beyond a page.
+	if (id) {
+		page *lists = memory_manager::get().pgalloc().allocate_pages(prp_lists_order, page_allocation_flags::zero);
+		if (!lists) {
+			panic("nvme: out of memory");
+		}
+
+		q->prp_lists_phys = lists->base_address();
+		q->prp_lists = (u64 *)phys_to_virt(q->prp_lists_phys);
+
+		for (unsigned int i = 0; i < nr_slots; i++) {
+			q->slot_requests[i] = nullptr;
+			q->failed[i] = false;
+			q->free_slots[q->nr_free_slots++] = (u16)(nr_slots - 1 - i);
+		}
+	}
+
+	return q;
+}
+
+bool nvme_storage_device::admin_command(nvme_command &cmd, u32 &result)
+{
+	queue &q = *admin_;
+
+	cmd.cid = q.sq_tail;
+	memops::copy<sizeof(cmd)>((void *)&q.sq[q.sq_tail], &cmd);
+	q.sq_tail = (q.sq_tail + 1) % queue_entries;
+	ring_sq(q);
+
+	// Only the admin commands that bring the controller up are issued, one at a time, so they are just polled for.
+	for (u64 i = 0; i < 1000; i++) {
+		volatile nvme_completion &completion = q.cq[q.cq_head];
+
+		if ((completion.status & 1) == q.phase) {
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			u16 status = completion.status >> 1;
+			result = completion.result;
+
+			if (++q.cq_head == queue_entries) {
+				q.cq_head = 0;
+				q.phase ^= 1;
+			}
+
+			*q.cq_doorbell = q.cq_head;
+
+			if (status) {
+				dprintf("nvme: admin command %x failed, status %x\n", cmd.opcode, status);
+				return false;
+			}
+
+			return true;
+		}
+
+		if (core::this_core().get_current_tcb()) {
+			sched::sleeper::get().sleep_ms(1);
+		} else {
+			__relax();
+		}
+	}
+
+	dprintf("nvme: admin command %x timed out\n", cmd.opcode);
+	return false;
+}
+
+bool nvme_storage_device::identify(u32 cns, u32 nsid, u64 buffer)
+{
+	nvme_command cmd;
+	memops::zero<sizeof(cmd)>(&cmd);
+	cmd.opcode = NVME_ADMIN_IDENTIFY;
+	cmd.nsid = nsid;
+	cmd.prp1 = buffer;
+	cmd.cdw10 = cns;
+
+	u32 result;
+	return admin_command(cmd, result);
+}
+
+bool nvme_storage_device::create_io_queue(queue &q, u16 vector)
+{
+	// The completion queue must exist before the submission queue that completes to it.
+	nvme_command cmd;
+	memops::zero<sizeof(cmd)>(&cmd);
+	cmd.opcode = NVME_ADMIN_CREATE_CQ;
+	cmd.prp1 = q.cq_phys;
+	cmd.cdw10 = ((queue_entries - 1) << 16) | q.id;
+	cmd.cdw11 = ((u32)vector << 16) | (polled_ ? 0 : NVME_CQ_IRQ_ENABLED) | NVME_QUEUE_PHYS_CONTIG;
+
+	u32 result;
+	if (!admin_command(cmd, result)) {
+		return false;
+	}
+
+	memops::zero<sizeof(cmd)>(&cmd);
+	cmd.opcode = NVME_ADMIN_CREATE_SQ;
+	cmd.prp1 = q.sq_phys;
+	cmd.cdw10 = ((queue_entries - 1) << 16) | q.id;
+	cmd.cdw11 = ((u32)q.id << 16) | NVME_QUEUE_PHYS_CONTIG;
+
+	return admin_command(cmd, result);
+}
+
+void nvme_storage_device::configure() { detect_partitions(); }
+
+void nvme_storage_device::detect_partitions()
+{
+	mbr m(*this);
+	m.scan();
+}
+
+void nvme_storage_device::submit_real_io_request(block_io_request &request)
+{
+	// Without a volatile write cache, a write is durable as soon as it completes, so there's nothing for a flush to do.
+	if (request.direction == block_io_request_direction::flush && !can_flush_) {
+		complete_request(request);
+		return;
+	}
+
+	// Which core this is on only picks the queue: if the thread has since moved, it just uses another core's.
+	queue &q = *queues_[core_queues_[current_core_id()]];
+
+	{
+		unique_irq_lock l(q.lock);
+
+		q.waiting.issue_or_wait(request, [this, &q](block_io_request &r) { return issue_commands(q, r); });
+		ring_sq(q);
+	}
+
+	// Before the scheduler is running, nothing can sleep waiting for the interrupt, so the queue is polled until it is
+	// empty, and so this request is done.
+	if (polled_ || !core::this_core().get_current_tcb()) {
+		while (true) {
+			complete_finished(q);
+
+			{
+				unique_irq_lock l(q.lock);
+				if (q.waiting.empty() && q.nr_free_slots == nr_slots) {
+					break;
+				}
+			}
+
+			__relax();
+		}
+	}
+}
+
+bool nvme_storage_device::issue_commands(queue &q, block_io_request &request)
+{
+	// Called with the queue's lock held.  There is no scheduler, so requests are never merged, and each is issued on
+	// its own, in as many commands as it takes.  Returns true once the last of them has been issued.
+	u64 length = request.direction == block_io_request_direction::flush ? 0 : request.block_count << 9;
+
+	while (q.nr_free_slots) {
+		u16 slot = q.free_slots[--q.nr_free_slots];
+
+		// Until the last command is issued, the request holds a count of its own, so that it can't finish early.
+		if (q.head_leader == no_slot) {
+			q.head_leader = slot;
+			q.slot_requests[slot] = &request;
+			q.pending[slot] = 1;
+			q.failed[slot] = false;
+		}
+
+		q.leaders[slot] = q.head_leader;
+		q.pending[q.head_leader]++;
+
+		u64 command_length = min(length - q.head_offset, max_command_bytes_);
+		build_command(q, slot, request, q.head_offset, command_length);
+		q.head_offset += command_length;
+
+		if (q.head_offset == length) {
+			q.pending[q.head_leader]--;
+			q.head_leader = no_slot;
+			q.head_offset = 0;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void nvme_storage_device::build_command(queue &q, u16 slot, const block_io_request &request, u64 offset, u64 length)
+{
+	volatile nvme_command &cmd = q.sq[q.sq_tail];
+	q.sq_tail = (q.sq_tail + 1) % queue_entries;
+
+	cmd.flags = 0;
+	cmd.cid = slot;
+	cmd.nsid = 1;
+	cmd.reserved = 0;
+	cmd.mptr = 0;
+	cmd.prp1 = 0;
+	cmd.prp2 = 0;
+	cmd.cdw10 = 0;
+	cmd.cdw11 = 0;
+	cmd.cdw12 = 0;
+	cmd.cdw13 = 0;
+	cmd.cdw14 = 0;
+	cmd.cdw15 = 0;
+
+	if (request.direction == block_io_request_direction::flush) {
+		cmd.opcode = NVME_CMD_FLUSH;
+		return;
+	}
+
+	cmd.opcode = request.direction == block_io_request_direction::read ? NVME_CMD_READ : NVME_CMD_WRITE;
+
+	u64 start_block = request.start_block + (offset >> 9);
+	cmd.cdw10 = (u32)start_block;
+	cmd.cdw11 = (u32)(start_block >> 32);
+	cmd.cdw12 = (u32)((length >> 9) - 1);
+
+	// The first PRP entry may start anywhere in a page, and every other one is a whole page.  If there are two pages,
+	// the second PRP entry is the second page, and if there are more, it points at a list of them.  As for AHCI, the
+	// buffer is only contiguous in virtual memory, so each page is translated on its own.
+	u64 va = (u64)request.buffer + offset;
+	u64 end = va + length;
+
+	auto mapping = request.pgtable->get_mapping(va);
+	if (mapping.result == mapping_result::unmapped) {
+		panic("request buffer not mapped");
+	}
+
+	cmd.prp1 = mapping.address;
+	va += min(length, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+
+	unsigned int nr_entries = 0;
+	u64 *list = &q.prp_lists[slot * prp_list_entries];
+
+	for (; va < end; va += PAGE_SIZE) {
+		mapping = request.pgtable->get_mapping(va);
+		if (mapping.result == mapping_result::unmapped) {
+			panic("request buffer not mapped");
+		}
+
+		list[nr_entries++] = mapping.address;
+	}
+
+	if (nr_entries == 1) {
+		cmd.prp2 = list[0];
+	} else if (nr_entries > 1) {
+		cmd.prp2 = q.prp_lists_phys + (slot * prp_list_entries * sizeof(u64));
+	}
+}
+
+void nvme_storage_device::ring_sq(queue &q)
+{
+	if (q.sq_tail == q.sq_rung) {
+		return;
+	}
+
+	// The commands must be visible before the doorbell that hands them over.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	*q.sq_doorbell = q.sq_tail;
+	q.sq_rung = q.sq_tail;
+}
+
+void nvme_storage_device::complete_finished(queue &q)
+{
+	block_io_request *finished[nr_slots];
+	block_io_status finished_status[nr_slots];
+	unsigned int nr_finished = 0;
+
+	{
+		unique_irq_lock l(q.lock);
+
+		bool consumed = false;
+
+		while (true) {
+			volatile nvme_completion &completion = q.cq[q.cq_head];
+
+			if ((completion.status & 1) != q.phase) {
+				break;
+			}
+
+			// The entry mustn't be read before the phase that says it is there.
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			u16 slot = completion.cid;
+			u16 status = completion.status >> 1;
+
+			u16 leader = q.leaders[slot];
+			if (slot != leader) {
+				q.free_slots[q.nr_free_slots++] = slot;
+			}
+
+			// The request fails if any of its commands do, but only completes once they all have.
+			if (status) {
+				dprintf("nvme: i/o error, status %x\n", status);
+				q.failed[leader] = true;
+			}
+
+			if (--q.pending[leader] == 0) {
+				finished_status[nr_finished] = q.failed[leader] ? block_io_status::error : block_io_status::ok;
+				finished[nr_finished++] = q.slot_requests[leader];
+				q.slot_requests[leader] = nullptr;
+				q.free_slots[q.nr_free_slots++] = leader;
+			}
+
+			if (++q.cq_head == queue_entries) {
+				q.cq_head = 0;
+				q.phase ^= 1;
+			}
+
+			consumed = true;
+		}
+
+		if (consumed) {
+			*q.cq_doorbell = q.cq_head;
+		}
+
+		// Slots are free again, so as many waiting requests as will fit can go, with one doorbell write between them.
+		q.waiting.issue_waiting([this, &q](block_io_request &r) { return issue_commands(q, r); });
+		ring_sq(q);
+	}
+
+	// The callbacks are run without the lock, as they may submit another request straight away.
+	for (unsigned int i = 0; i < nr_finished; i++) {
+		complete_request(*finished[i], finished_status[i]);
+	}
+}
+
+void nvme_storage_device::nvme_irq_handler(u8 irq, void *ctx, void *arg)
+{
+	queue *q = (queue *)arg;
+	q->owner->complete_finished(*q);
+	((x86_core &)core::this_core()).lapic().eoi();
+}
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/config.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/storage/ramdisk.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::storage;
+using namespace stacsos::kernel::mem;
+
+device_class ramdisk::ramdisk_device_class(block_device::block_device_class, "ram");
+
+u64 ramdisk::boot_image_start_;
+u64 ramdisk::boot_image_length_;
+
+ramdisk::ramdisk(bus &parent, u64 phys_start, u64 nr_blocks)
+	: block_device(ramdisk_device_class, parent)
+	, nr_chunks_((nr_blocks + blocks_per_chunk - 1) / blocks_per_chunk)
+	, nr_blocks_(nr_blocks)
+{
+	chunks_ = new u8 *[nr_chunks_];
+	for (u64 i = 0; i < nr_chunks_; i++) {
+		chunks_[i] = (u8 *)phys_to_virt(phys_start + (i * chunk_size));
+	}
+}
+
+ramdisk::ramdisk(bus &parent, u64 nr_blocks)
+	: block_device(ramdisk_device_class, parent)
+	, nr_chunks_((nr_blocks + blocks_per_chunk - 1) / blocks_per_chunk)
+	, nr_blocks_(nr_blocks)
+{
+	chunks_ = new u8 *[nr_chunks_];
+	for (u64 i = 0; i < nr_chunks_; i++) {
+		page *p = memory_manager::get().pgalloc().allocate_pages(chunk_order, page_allocation_flags::zero);
+		if (!p) {
+			panic("ramdisk: out of memory");
+		}
+
+		chunks_[i] = (u8 *)p->base_address_ptr();
+	}
+}
+
+ramdisk *ramdisk::create_boot_ramdisk(bus &parent)
+{
+	if (boot_image_length_) {
+		dprintf("ramdisk: boot image at %llx, %llu bytes\n", boot_image_start_, boot_image_length_);
+		return new ramdisk(parent, boot_image_start_, (boot_image_length_ + 511) / 512);
+	}
+
+	u64 size_mb = config::get().get_option_u64_or_default("ramdisk", 0);
+	if (size_mb) {
+		dprintf("ramdisk: empty, %llu MiB\n", size_mb);
+		return new ramdisk(parent, MB(size_mb) / 512);
+	}
+
+	return nullptr;
+}
+
+void ramdisk::submit_real_io_request(block_io_request &request)
+{
+	// There's no queue, so the request is being submitted by the thread that wants it, and the buffer is mapped in
+	// the current address space.
+	if (request.direction != block_io_request_direction::flush) {
+		if (request.start_block + request.block_count > nr_blocks_) {
+			panic("ramdisk: request for blocks %llu-%llu past the end", request.start_block, request.start_block + request.block_count);
+		}
+
+		u8 *buffer = (u8 *)request.buffer;
+		u64 block = request.start_block;
+		u64 remaining = request.block_count;
+
+		while (remaining) {
+			u64 in_chunk = block % blocks_per_chunk;
+			u64 count = min(remaining, blocks_per_chunk - in_chunk);
+			u8 *data = chunks_[block / blocks_per_chunk] + (in_chunk * 512);
+
+			if (request.direction == block_io_request_direction::read) {
+				memops::memcpy(buffer, data, count * 512);
+			} else {
+				memops::memcpy(data, buffer, count * 512);
+			}
+
+			buffer += count * 512;
+			block += count;
+			remaining -= count;
+		}
+	}
+
+	complete_request(request);
+}
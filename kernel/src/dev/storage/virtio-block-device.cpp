@@ -0,0 +1,357 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/config.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/storage/io-scheduler.h>
+#include <stacsos/kernel/dev/storage/mbr.h>
+#include <stacsos/kernel/dev/storage/virtio-block-device.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::storage;
+using namespace stacsos::kernel::dev::virtio;
+using namespace stacsos::kernel::mem;
+
+device_class virtio_block_device::virtio_block_device_class(block_device::block_device_class, "vd");
+
+// The tables of every slot, which are 2 KiB each, are allocated together: 64 pages for 128 slots.
+static const int tables_order = 6;
+
+bool virtio_block_device::bring_up()
+{
+	dprintf("virtio-blk: probing...\n");
+
+	if (!transport_.probe()) {
+		return false;
+	}
+
+	u64 wanted = VIRTIO_F_RING_INDIRECT_DESC | VIRTIO_F_RING_EVENT_IDX | VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH;
+	u64 features;
+
+	if (!transport_.negotiate_features(wanted, features)) {
+		transport_.fail();
+		return false;
+	}
+
+	// Every request is a single indirect descriptor, so a device without them isn't driven at all.
+	if (!(features & VIRTIO_F_RING_INDIRECT_DESC)) {
+		dprintf("virtio-blk: device has no indirect descriptors\n");
+		transport_.fail();
+		return false;
+	}
+
+	volatile virtio_blk_config *config = (volatile virtio_blk_config *)transport_.device_config();
+
+	nr_blocks_ = config->capacity;
+	read_only_ = !!(features & VIRTIO_BLK_F_RO);
+	can_flush_ = !!(features & VIRTIO_BLK_F_FLUSH);
+
+	if (features & VIRTIO_BLK_F_SEG_MAX) {
+		max_segments_ = min(max_segments_, (unsigned int)config->seg_max);
+	}
+
+	if (features & VIRTIO_BLK_F_SIZE_MAX) {
+		max_segment_size_ = config->size_max;
+	}
+
+	// Completions are signalled on the first MSI-X vector, delivered to this core.  Without MSI-X, every request is
+	// polled for.
+	auto &pcidev = transport_.pcidev();
+	u16 vector = VIRTIO_MSI_NO_VECTOR;
+
+	if (pcidev.enable_msix() && pcidev.assign_msix_vector(0, x86_core::this_core(), virtio_irq_handler, this, "virtio-blk")) {
+		vector = 0;
+	} else {
+		dprintf("virtio-blk: no msi-x, polling for completions\n");
+		polled_ = true;
+	}
+
+	if (!queue_.setup(max_slots, vector, !!(features & VIRTIO_F_RING_EVENT_IDX))) {
+		transport_.fail();
+		return false;
+	}
+
+	nr_slots_ = min((unsigned int)queue_.size(), max_slots);
+	for (unsigned int i = 0; i < nr_slots_; i++) {
+		free_slots_[nr_free_slots_++] = (u16)(nr_slots_ - 1 - i);
+	}
+
+	page *tables = memory_manager::get().pgalloc().allocate_pages(tables_order, page_allocation_flags::zero);
+	if (!tables) {
+		panic("virtio-blk: out of memory");
+	}
+
+	tables_phys_ = tables->base_address();
+	tables_ = (volatile virtq_desc *)phys_to_virt(tables_phys_);
+
+	// The headers (16 bytes each) fill the first half of their page, and the status bytes follow.
+	headers_phys_ = zeroed_page_pool::get().allocate()->base_address();
+	headers_ = (volatile virtio_blk_req_header *)phys_to_virt(headers_phys_);
+	statuses_ = (volatile u8 *)phys_to_virt(headers_phys_ + (max_slots * sizeof(virtio_blk_req_header)));
+
+	transport_.driver_ok();
+
+	// There's no seeking to avoid, so requests are only merged, and not sorted.
+	const char *sched = kernel::config::get().get_option_or_default("iosched", "noop");
+	set_scheduler(io_scheduler::create(sched, max_merge_blocks, max_merge_segments), nr_slots_);
+
+	dprintf("virtio-blk: %llu blocks, queue depth=%u, segments=%u, event-idx=%d, flush=%d, ro=%d, using %s i/o scheduler\n", nr_blocks_, nr_slots_,
+		max_segments_, !!(features & VIRTIO_F_RING_EVENT_IDX), can_flush_, read_only_, scheduler_name());
+
+	return true;
+}
+
+void virtio_block_device::configure() { detect_partitions(); }
+
+void virtio_block_device::detect_partitions()
+{
+	mbr m(*this);
+	m.scan();
+}
+
+void virtio_block_device::submit_real_io_request(block_io_request &request)
+{
+	// Without a write cache, a write is durable as soon as it completes, so there's nothing for a flush to do.
+	if (request.direction == block_io_request_direction::flush && !can_flush_) {
+		complete_request(request);
+		return;
+	}
+
+	block_io_request *failed = nullptr;
+
+	{
+		unique_irq_lock l(lock_);
+		waiting_requests_.issue_or_wait(request, [this, &failed](block_io_request &r) { return try_issue(r, failed); });
+	}
+
+	fail_requests(failed);
+
+	// Before the scheduler is running, nothing can sleep waiting for the interrupt, so the queue is polled until it is
+	// empty, and so this request is done.
+	if (polled_ || !core::this_core().get_current_tcb()) {
+		while (true) {
+			complete_finished();
+
+			{
+				unique_irq_lock l(lock_);
+				if (waiting_requests_.empty() && nr_free_slots_ == nr_slots_) {
+					break;
+				}
+			}
+
+			__relax();
+		}
+	}
+}
+
+bool virtio_block_device::try_issue(block_io_request &request, block_io_request *&failed)
+{
+	// Called with the lock held.  A request that can't be issued at all is taken off the queue anyway, and added to
+	// the failed ones, linked through queue_next (which the block layer is done with), to complete without the lock.
+	if (!nr_free_slots_) {
+		return false;
+	}
+
+	u16 slot = free_slots_[--nr_free_slots_];
+	if (!issue_request(request, slot)) {
+		free_slots_[nr_free_slots_++] = slot;
+
+		request.queue_next = failed;
+		failed = &request;
+	}
+
+	return true;
+}
+
+void virtio_block_device::fail_requests(block_io_request *failed)
+{
+	while (failed) {
+		block_io_request *next = failed->queue_next;
+		failed->queue_next = nullptr;
+
+		complete_request(*failed, block_io_status::error);
+		failed = next;
+	}
+}
+
+bool virtio_block_device::issue_request(block_io_request &request, u16 slot)
+{
+	// Called with the lock held.  Returns false, having issued nothing, if the request can't be described by one
+	// table.
+	volatile virtq_desc *table = &tables_[slot * table_entries];
+	u64 table_phys = tables_phys_ + (slot * table_entries * sizeof(virtq_desc));
+
+	volatile virtio_blk_req_header &header = headers_[slot];
+	switch (request.direction) {
+	case block_io_request_direction::read:
+		header.type = VIRTIO_BLK_T_IN;
+		break;
+	case block_io_request_direction::write:
+		header.type = VIRTIO_BLK_T_OUT;
+		break;
+	case block_io_request_direction::flush:
+		header.type = VIRTIO_BLK_T_FLUSH;
+		break;
+	}
+
+	header.reserved = 0;
+	header.sector = request.direction == block_io_request_direction::flush ? 0 : request.start_block;
+
+	// The device writes the status when it is done, so anything else means it hasn't.
+	statuses_[slot] = 0xff;
+
+	// The header, then the data, then the status byte, which the device writes.
+	unsigned int n = 0;
+
+	table[n].addr = headers_phys_ + (slot * sizeof(virtio_blk_req_header));
+	table[n].len = sizeof(virtio_blk_req_header);
+	table[n].flags = 0;
+	n++;
+
+	if (request.direction != block_io_request_direction::flush) {
+		unsigned int nr_segments = build_table(slot, request);
+		if (!nr_segments) {
+			return false;
+		}
+
+		n += nr_segments;
+	}
+
+	table[n].addr = headers_phys_ + (max_slots * sizeof(virtio_blk_req_header)) + slot;
+	table[n].len = 1;
+	table[n].flags = VIRTQ_DESC_F_WRITE;
+	n++;
+
+	for (unsigned int i = 0; i < n - 1; i++) {
+		table[i].flags = table[i].flags | VIRTQ_DESC_F_NEXT;
+		table[i].next = (u16)(i + 1);
+	}
+
+	volatile virtq_desc &desc = queue_.desc(slot);
+	desc.addr = table_phys;
+	desc.len = n * sizeof(virtq_desc);
+	desc.flags = VIRTQ_DESC_F_INDIRECT;
+	desc.next = 0;
+
+	slot_requests_[slot] = &request;
+
+	queue_.add(slot);
+	queue_.kick();
+
+	return true;
+}
+
+unsigned int virtio_block_device::build_table(u16 slot, const block_io_request &request)
+{
+	// As for AHCI, each buffer is only contiguous in virtual memory, so each page is translated on its own, and runs of
+	// pages that turn out to be next to each other physically share a descriptor.  The buffers of requests merged into
+	// this one follow on, in order.  The data descriptors start after the header's.  Returns the number of them, or
+	// zero if there are too many for the table.
+	volatile virtq_desc *table = &tables_[(slot * table_entries) + 1];
+	u16 flags = request.direction == block_io_request_direction::read ? VIRTQ_DESC_F_WRITE : 0;
+
+	unsigned int nr_segments = 0;
+	u64 segment_start = 0, segment_size = 0;
+
+	for (const block_io_request *r = &request; r; r = r->next_merged) {
+		u64 va = (u64)r->buffer;
+		u64 end = va + (r->block_count << 9);
+
+		while (va < end) {
+			auto chunk_mapping = r->pgtable->get_mapping(va);
+			if (chunk_mapping.result == mapping_result::unmapped) {
+				panic("request buffer not mapped");
+			}
+
+			u64 chunk_size = min(end - va, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+
+			if (segment_size && chunk_mapping.address == segment_start + segment_size && segment_size + chunk_size <= max_segment_size_) {
+				segment_size += chunk_size;
+			} else {
+				if (segment_size) {
+					table[nr_segments].addr = segment_start;
+					table[nr_segments].len = (u32)segment_size;
+					table[nr_segments].flags = flags;
+					nr_segments++;
+				}
+
+				if (nr_segments == max_segments_) {
+					dprintf("virtio-blk: request buffer too fragmented for one request\n");
+					return 0;
+				}
+
+				segment_start = chunk_mapping.address;
+				segment_size = chunk_size;
+			}
+
+			va += chunk_size;
+		}
+	}
+
+	table[nr_segments].addr = segment_start;
+	table[nr_segments].len = (u32)segment_size;
+	table[nr_segments].flags = flags;
+
+	return nr_segments + 1;
+}
+
+void virtio_block_device::complete_finished()
+{
+	block_io_request *finished[max_slots];
+	block_io_status finished_status[max_slots];
+	unsigned int nr_finished = 0;
+	block_io_request *failed = nullptr;
+
+	{
+		unique_irq_lock l(lock_);
+
+		// The interrupt is re-armed once the queue looks empty, and if anything finished in the meantime, it is
+		// collected now, as the device may not interrupt for it.
+		do {
+			u16 slot;
+			u32 length;
+
+			while (queue_.next_used(slot, length)) {
+				finished_status[nr_finished] = block_io_status::ok;
+				if (statuses_[slot] != VIRTIO_BLK_S_OK) {
+					dprintf("virtio-blk: i/o error, status %u\n", statuses_[slot]);
+					finished_status[nr_finished] = block_io_status::error;
+				}
+
+				finished[nr_finished++] = slot_requests_[slot];
+				__atomic_store_n(&slot_requests_[slot], nullptr, __ATOMIC_RELEASE);
+				free_slots_[nr_free_slots_++] = slot;
+			}
+		} while (queue_.arm_interrupt());
+
+		// Slots are free again, so as many waiting requests as will fit can go.
+		waiting_requests_.issue_waiting([this, &failed](block_io_request &r) { return try_issue(r, failed); });
+	}
+
+	// The callbacks are run without the lock, as they may submit another request straight away.
+	for (unsigned int i = 0; i < nr_finished; i++) {
+		complete_request(*finished[i], finished_status[i]);
+	}
+
+	fail_requests(failed);
+}
+
+void virtio_block_device::virtio_irq_handler(u8 irq, void *ctx, void *arg)
+{
+	((virtio_block_device *)arg)->complete_finished();
+	((x86_core &)core::this_core()).lapic().eoi();
+}
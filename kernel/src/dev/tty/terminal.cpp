@@ -17,6 +17,7 @@ using namespace stacsos::kernel::dev::tty;
 using namespace stacsos::kernel::dev::console;
 using namespace stacsos::kernel::arch::x86;
 using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::sched;
 
 device_class terminal::terminal_device_class(device_class::root, "tty");
 
@@ -37,16 +38,48 @@ void terminal::write_char(unsigned char ch, u8 attr)
 
 void terminal::write(const void *buffer, size_t size)
 {
-	const u8 *cur = (const u8 *)buffer;
-	const u8 *end = cur + size;
+	iovec iov { (void *)buffer, size };
+	writev(&iov, 1);
+}
+
+void terminal::write_run(const u8 *run, size_t length)
+{
+	ioports::qemu_debug_out::write8s(run, length);
 
-	while (cur < end) {
-		if (*cur == '\e') {
-			cur++;
+	if (attached_vc_) {
+		attached_vc_->write(run, length, current_attr_);
+	}
+}
 
-			current_attr_ = *cur++;
-		} else {
-			write_char(*cur++, current_attr_);
+void terminal::writev(const iovec *iov, size_t count)
+{
+	// Set when the last byte seen was an escape, so that the next one is taken as the new attribute.
+	bool in_escape = false;
+
+	for (size_t i = 0; i < count; i++) {
+		const u8 *cur = (const u8 *)iov[i].base;
+		const u8 *end = cur + iov[i].length;
+
+		while (cur < end) {
+			if (in_escape) {
+				current_attr_ = *cur++;
+				in_escape = false;
+				continue;
+			}
+
+			if (*cur == '\e' || !*cur) {
+				in_escape = *cur++ == '\e';
+				continue;
+			}
+
+			// Everything up to the next escape (or NUL, which is dropped) is in the same attribute, and is written out
+			// in one go.
+			const u8 *run = cur;
+			while (cur < end && *cur != '\e' && *cur) {
+				cur++;
+			}
+
+			write_run(run, cur - run);
 		}
 	}
 }
@@ -64,8 +97,37 @@ void terminal::read(void *raw_buffer, size_t size)
 	}
 }
 
+size_t terminal::read_line(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+	while (n < size) {
+		u8 ch = attached_vc_->read_char();
+
+		if (ch == '\b') {
+			if (n > 0) {
+				n--;
+				write_char('\b', current_attr_);
+			}
+
+			continue;
+		}
+
+		write_char(ch, current_attr_);
+		buffer[n++] = ch;
+
+		if (ch == '\n') {
+			break;
+		}
+	}
+
+	return n;
+}
+
 void terminal::clear() { attached_vc_->clear(); }
 
+bool terminal::input_ready(wait_set *ws) { return attached_vc_->input_ready(ws); }
+
 class terminal_file : public file {
 public:
 	terminal_file(terminal &t)
@@ -86,13 +148,27 @@ public:
 		return length;
 	}
 
+	virtual size_t pwritev(const iovec *iov, size_t count, size_t offset) override
+	{
+		t_.writev(iov, count);
+		return iovec_length(iov, count);
+	}
+
+	virtual bool poll(wait_set *ws) override { return t_.input_ready(ws); }
+
 	virtual u64 ioctl(u64 cmd, void *buffer, size_t length)
 	{
-		if (cmd == 2) {
+		switch (cmd) {
+		case 2:
 			t_.clear();
-		}
+			return 0;
+
+		case 3:
+			return t_.read_line((char *)buffer, length);
 
-		return 0;
+		default:
+			return 0;
+		}
 	}
 
 private:
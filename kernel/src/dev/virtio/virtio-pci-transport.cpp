@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/virtio/virtio-pci-transport.h>
+
+using namespace stacsos::kernel::dev;
+using namespace stacsos::kernel::dev::pci;
+using namespace stacsos::kernel::dev::virtio;
+
+// Virtio's capabilities are all vendor-specific ones, told apart by their cfg_type.
+static const u8 capability_vendor = 0x09;
+
+// The command register's memory space and bus master bits: the device's structures are in its memory BARs, and it
+// reads and writes the queues itself.
+static const u16 pci_command_memory = 1u << 1;
+static const u16 pci_command_bus_master = 1u << 2;
+
+// The direct map only covers the first 12 GiB of the physical address space (see memory_manager).
+static const u64 direct_map_limit = GB(12);
+
+volatile void *virtio_pci_transport::map_capability(u8 offset)
+{
+	auto &config = pcidev_.config();
+
+	u8 bir = config.read_config_value<u8>(offset + __builtin_offsetof(virtio_pci_cap, bar));
+	u32 bar_offset = config.read_config_value<u32>(offset + __builtin_offsetof(virtio_pci_cap, offset));
+
+	if (bir > 5) {
+		return nullptr;
+	}
+
+	u32 bar = config.bar_by_index(bir);
+	if (bar & 1) {
+		dprintf("virtio: structure is in an i/o bar\n");
+		return nullptr;
+	}
+
+	u64 base = bar & ~0xfull;
+	if (((bar >> 1) & 3) == 2) {
+		base |= (u64)config.bar_by_index(bir + 1) << 32;
+	}
+
+	if (base + bar_offset >= direct_map_limit) {
+		dprintf("virtio: bar at %llx is outside the direct map\n", base);
+		return nullptr;
+	}
+
+	return phys_to_virt(base + bar_offset);
+}
+
+bool virtio_pci_transport::probe()
+{
+	auto &config = pcidev_.config();
+
+	for (auto cap : pcidev_.capabilities()) {
+		if (cap.vendor != capability_vendor) {
+			continue;
+		}
+
+		// A device may offer a structure more than once (e.g. through an I/O BAR as well), and the first is preferred.
+		switch (config.read_config_value<u8>(cap.offset + __builtin_offsetof(virtio_pci_cap, cfg_type))) {
+		case VIRTIO_PCI_CAP_COMMON_CFG:
+			if (!common_) {
+				common_ = (volatile virtio_pci_common_cfg *)map_capability(cap.offset);
+			}
+			break;
+
+		case VIRTIO_PCI_CAP_NOTIFY_CFG:
+			if (!notify_base_) {
+				notify_base_ = (volatile u8 *)map_capability(cap.offset);
+				notify_multiplier_ = config.read_config_value<u32>(cap.offset + sizeof(virtio_pci_cap));
+			}
+			break;
+
+		case VIRTIO_PCI_CAP_DEVICE_CFG:
+			if (!device_cfg_) {
+				device_cfg_ = map_capability(cap.offset);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (!common_ || !notify_base_ || !device_cfg_) {
+		dprintf("virtio: device has no modern interface\n");
+		return false;
+	}
+
+	config.write_config_value<u16>(4, config.command() | pci_command_memory | pci_command_bus_master);
+
+	// Writing zero resets the device, which is done once it reads back as zero.
+	common_->device_status = 0;
+	while (common_->device_status) {
+		__relax();
+	}
+
+	add_status(VIRTIO_STATUS_ACKNOWLEDGE);
+	add_status(VIRTIO_STATUS_DRIVER);
+
+	// Configuration changes aren't signalled, as nothing here would act on them.
+	common_->msix_config = VIRTIO_MSI_NO_VECTOR;
+
+	return true;
+}
+
+bool virtio_pci_transport::negotiate_features(u64 wanted, u64 &accepted)
+{
+	common_->device_feature_select = 0;
+	u64 offered = common_->device_feature;
+	common_->device_feature_select = 1;
+	offered |= (u64)common_->device_feature << 32;
+
+	if (!(offered & VIRTIO_F_VERSION_1)) {
+		dprintf("virtio: device is legacy only\n");
+		return false;
+	}
+
+	accepted = offered & (wanted | VIRTIO_F_VERSION_1);
+
+	common_->driver_feature_select = 0;
+	common_->driver_feature = (u32)accepted;
+	common_->driver_feature_select = 1;
+	common_->driver_feature = (u32)(accepted >> 32);
+
+	// The device clears FEATURES_OK again if it can't work with what was accepted.
+	add_status(VIRTIO_STATUS_FEATURES_OK);
+	if (!(common_->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+		dprintf("virtio: device refused features %llx\n", accepted);
+		return false;
+	}
+
+	return true;
+}
+
+u16 virtio_pci_transport::queue_size(u16 index)
+{
+	if (index >= common_->num_queues) {
+		return 0;
+	}
+
+	common_->queue_select = index;
+	return common_->queue_size;
+}
+
+volatile u16 *virtio_pci_transport::setup_queue(u16 index, u16 size, u64 desc, u64 avail, u64 used, u16 msix_vector)
+{
+	common_->queue_select = index;
+	common_->queue_size = size;
+
+	common_->queue_desc_lo = (u32)desc;
+	common_->queue_desc_hi = (u32)(desc >> 32);
+	common_->queue_driver_lo = (u32)avail;
+	common_->queue_driver_hi = (u32)(avail >> 32);
+	common_->queue_device_lo = (u32)used;
+	common_->queue_device_hi = (u32)(used >> 32);
+
+	// The device reads back NO_VECTOR if it couldn't take the vector.
+	common_->queue_msix_vector = msix_vector;
+	if (msix_vector != VIRTIO_MSI_NO_VECTOR && common_->queue_msix_vector != msix_vector) {
+		return nullptr;
+	}
+
+	u16 notify_off = common_->queue_notify_off;
+	common_->queue_enable = 1;
+
+	return (volatile u16 *)(notify_base_ + ((u32)notify_off * notify_multiplier_));
+}
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/virtio/virtqueue.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+
+using namespace stacsos::kernel::dev::virtio;
+using namespace stacsos::kernel::mem;
+
+// The rings are kept to a page each: the descriptor table is 16 bytes an entry, and the available and used rings
+// share the other page, with the used ring (8 bytes an entry) in its upper three quarters.
+static const u16 max_queue_size = PAGE_SIZE / sizeof(virtq_desc);
+static const u64 used_ring_offset = PAGE_SIZE / 4;
+
+bool virtqueue::setup(u16 max_size, u16 msix_vector, bool event_idx)
+{
+	event_idx_ = event_idx;
+
+	u16 device_size = transport_.queue_size(index_);
+	if (!device_size) {
+		return false;
+	}
+
+	// A split queue's size is a power of two, and it can be made smaller than the device's, but no bigger.
+	size_ = min(min(device_size, max_size), max_queue_size);
+	while (size_ & (size_ - 1)) {
+		size_ &= size_ - 1;
+	}
+
+	u64 desc = zeroed_page_pool::get().allocate()->base_address();
+	u64 avail = zeroed_page_pool::get().allocate()->base_address();
+	u64 used = avail + used_ring_offset;
+
+	desc_ = (volatile virtq_desc *)phys_to_virt(desc);
+	avail_ = (volatile virtq_avail *)phys_to_virt(avail);
+	used_ = (volatile virtq_used *)phys_to_virt(used);
+
+	notify_ = transport_.setup_queue(index_, size_, desc, avail, used, msix_vector);
+	if (!notify_) {
+		dprintf("virtio: queue %u refused msi-x vector %u\n", index_, msix_vector);
+		return false;
+	}
+
+	return true;
+}
+
+// Whether the other side asked to hear about the ring moving from old to new, having set event to the index it wants
+// to hear about reaching.
+static bool need_event(u16 event, u16 new_idx, u16 old_idx) { return (u16)(new_idx - event - 1) < (u16)(new_idx - old_idx); }
+
+void virtqueue::kick()
+{
+	if (!nr_added_) {
+		return;
+	}
+
+	// The ring entries must be visible before the index that hands them over.
+	u16 new_idx = avail_->idx + nr_added_;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	avail_->idx = new_idx;
+	nr_added_ = 0;
+
+	// The index must be visible before the device's event index is read, or the device may have gone to sleep having
+	// not seen the new entries, just as its event index is read as not needing a notification.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	bool notify = event_idx_ ? need_event(avail_event(), new_idx, last_kicked_) : !(used_->flags & 1);
+	last_kicked_ = new_idx;
+
+	if (notify) {
+		*notify_ = index_;
+	}
+}
+
+bool virtqueue::next_used(u16 &head, u32 &length)
+{
+	if (last_used_ == used_->idx) {
+		return false;
+	}
+
+	// The entry mustn't be read before the index that says it is there.
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	volatile virtq_used_elem &elem = used_->ring[last_used_ & (size_ - 1)];
+	head = (u16)elem.id;
+	length = elem.len;
+
+	last_used_++;
+	return true;
+}
+
+bool virtqueue::arm_interrupt()
+{
+	// Without event indices, the device interrupts for every chain anyway.
+	if (event_idx_) {
+		used_event() = last_used_;
+	}
+
+	// As in kick, the device may have finished another chain before it could see the new event index.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return used_->idx != last_used_;
+}
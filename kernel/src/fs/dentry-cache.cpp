@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/fs/dentry-cache.h>
+#include <stacsos/kernel/fs/fs-node.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+
+dentry_cache::dentry_cache()
+	: next_entry_(0)
+	, nr_in_use_(0)
+{
+	entries_ = new entry[nr_entries];
+	for (u64 i = 0; i < nr_entries; i++) {
+		entries_[i].in_use = false;
+	}
+
+	buckets_ = new entry *[nr_buckets];
+	for (u64 i = 0; i < nr_buckets; i++) {
+		buckets_[i] = nullptr;
+	}
+
+	mem::reclaimer::get().register_shrinker(*this);
+}
+
+bool dentry_cache::lookup(fs_node *parent, const string_view &name, fs_node *&child)
+{
+	shared_irq_lock l(lock_);
+
+	entry *e = find(parent, name);
+	if (!e) {
+		return false;
+	}
+
+	child = e->child;
+	return true;
+}
+
+void dentry_cache::insert(fs_node *parent, const string_view &name, fs_node *child)
+{
+	scoped_irq_lock l(lock_);
+
+	// The name may have been looked up by someone else in the meantime.
+	entry *e = find(parent, name);
+	if (e) {
+		e->child = child;
+		return;
+	}
+
+	e = &entries_[next_entry_];
+	next_entry_ = (next_entry_ + 1) % nr_entries;
+
+	if (e->in_use) {
+		unlink(e);
+	} else {
+		nr_in_use_++;
+	}
+
+	e->parent = parent;
+	e->name = string(name);
+	e->child = child;
+	e->in_use = true;
+
+	u64 bucket = bucket_of(parent, name);
+	e->hash_next = buckets_[bucket];
+	buckets_[bucket] = e;
+}
+
+void dentry_cache::invalidate(fs_node *parent, const string_view &name)
+{
+	scoped_irq_lock l(lock_);
+
+	entry *e = find(parent, name);
+	if (e) {
+		drop(e);
+	}
+}
+
+void dentry_cache::invalidate_beneath(fs_node *dir)
+{
+	scoped_irq_lock l(lock_);
+
+	// Every entry is for a node that is still in memory, so each entry's directory can be asked for its parent.
+	for (u64 i = 0; i < nr_entries; i++) {
+		entry *e = &entries_[i];
+		if (e->in_use && (e->parent == dir || e->parent->parent() == dir)) {
+			drop(e);
+		}
+	}
+}
+
+void dentry_cache::invalidate_all()
+{
+	scoped_irq_lock l(lock_);
+
+	for (u64 i = 0; i < nr_buckets; i++) {
+		buckets_[i] = nullptr;
+	}
+
+	for (u64 i = 0; i < nr_entries; i++) {
+		entries_[i].in_use = false;
+	}
+
+	nr_in_use_ = 0;
+}
+
+u64 dentry_cache::count_objects() { return __atomic_load_n(&nr_in_use_, __ATOMIC_RELAXED); }
+
+u64 dentry_cache::scan_objects(u64 nr_to_scan)
+{
+	scoped_irq_lock l(lock_);
+
+	// Entries are reused in turn, so the oldest are the ones from the next to be reused onwards.
+	u64 nr_dropped = 0;
+	for (u64 i = 0; i < nr_entries && nr_dropped < nr_to_scan; i++) {
+		entry *e = &entries_[(next_entry_ + i) % nr_entries];
+		if (e->in_use) {
+			drop(e);
+			nr_dropped++;
+		}
+	}
+
+	return nr_dropped;
+}
+
+dentry_cache::entry *dentry_cache::find(fs_node *parent, const string_view &name)
+{
+	for (entry *e = buckets_[bucket_of(parent, name)]; e; e = e->hash_next) {
+		if (e->parent == parent && e->name == name) {
+			return e;
+		}
+	}
+
+	return nullptr;
+}
+
+void dentry_cache::unlink(entry *e)
+{
+	entry **link = &buckets_[bucket_of(e->parent, e->name)];
+	while (*link != e) {
+		link = &(*link)->hash_next;
+	}
+
+	*link = e->hash_next;
+}
+
+void dentry_cache::drop(entry *e)
+{
+	unlink(e);
+
+	e->in_use = false;
+	e->name = string();
+	nr_in_use_--;
+}
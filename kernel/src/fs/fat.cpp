@@ -5,12 +5,22 @@
  * Copyright (c) University of St Andrews 2025
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
+#include <stacsos/kernel/fs/dentry-cache.h>
 #include <stacsos/kernel/fs/fat.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/preempt.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/sleeper.h>
+#include <stacsos/kernel/tunables.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::dev::storage;
 using namespace stacsos::kernel::fs;
 
 struct bios_parameter_block {
@@ -61,12 +71,13 @@ struct fat32_ebr {
 
 void fat_filesystem::init()
 {
-	auto mbuffer = shared_ptr((u8 *)new u8[512]);
-	auto buffer = mbuffer.get();
+	u8 buffer[512];
 
 	dprintf("fat: init\n");
 
-	bdev_.read_blocks_sync(buffer, 0, 1);
+	if (!buffer_cache::get().read(bdev_, buffer, 0, 1)) {
+		panic("fat: unable to read the boot sector");
+	}
 
 	dprintf("fat: magic: %02x %02x\n", buffer[510], buffer[511]);
 	if (buffer[510] != 0x55 || buffer[511] != 0xaa) {
@@ -76,24 +87,27 @@ void fat_filesystem::init()
 
 	const bios_parameter_block *bpb = (const bios_parameter_block *)&buffer[0];
 
-	// FAT metric computation
+	const fat32_ebr *ebr32 = (const fat32_ebr *)&buffer[0x24];
+
+	// FAT metric computation.  FAT32 volumes have no sectors per FAT, or root directory entries, in the BPB.
 	total_sectors = bpb->total_sectors == 0 ? bpb->nr_large_sectors : bpb->total_sectors;
-	fat_size = bpb->sectors_per_fat;
+	fat_size = bpb->sectors_per_fat ? bpb->sectors_per_fat : ebr32->sectors_per_fat;
 	root_dir_sectors = ((bpb->nr_root_dentries * 32) + (bpb->bytes_per_sector - 1)) / bpb->bytes_per_sector;
 	first_fat_sector = bpb->nr_reserved_sectors;
 	first_data_sector = first_fat_sector + (bpb->nr_fats * fat_size) + root_dir_sectors;
 	data_sectors = total_sectors - first_data_sector;
 	sectors_per_cluster = bpb->sectors_per_cluster;
+	nr_fats = bpb->nr_fats;
 	total_clusters = data_sectors / sectors_per_cluster;
 
-	dprintf("fat: total-sectors=%lu\n", total_sectors);
-	dprintf("fat: fat-size=%lu\n", fat_size);
-	dprintf("fat: root-dir-sectors=%lu\n", root_dir_sectors);
-	dprintf("fat: first-fat-sector=%lu\n", first_fat_sector);
-	dprintf("fat: first-data-sector=%lu\n", first_data_sector);
-	dprintf("fat: data-sectors=%lu\n", data_sectors);
-	dprintf("fat: sectors-per-cluster=%lu\n", sectors_per_cluster);
-	dprintf("fat: total-clusters=%lu\n", total_clusters);
+	dprintf("fat: total-sectors=%llu\n", total_sectors);
+	dprintf("fat: fat-size=%llu\n", fat_size);
+	dprintf("fat: root-dir-sectors=%llu\n", root_dir_sectors);
+	dprintf("fat: first-fat-sector=%llu\n", first_fat_sector);
+	dprintf("fat: first-data-sector=%llu\n", first_data_sector);
+	dprintf("fat: data-sectors=%llu\n", data_sectors);
+	dprintf("fat: sectors-per-cluster=%llu\n", sectors_per_cluster);
+	dprintf("fat: total-clusters=%llu\n", total_clusters);
 
 	// FAT type identification
 	if (total_clusters < 4085) {
@@ -101,224 +115,1498 @@ void fat_filesystem::init()
 	} else if (total_clusters < 65525) {
 		dprintf("fat: fat16\n");
 	} else {
-		panic("FAT32 not supported");
+		dprintf("fat: fat32\n");
+
+		fat32_ = true;
+		end_of_chain_ = 0x0fffffff;
 	}
 
 	const fat12_ebr *ebr = (const fat12_ebr *)&buffer[0x24];
+	u8 signature = fat32_ ? ebr32->signature : ebr->signature;
 
-	if (ebr->signature != 0x29) {
+	if (signature != 0x29) {
 		panic("fat: invalid FAT signature");
 	}
 
-	dprintf("fat: signature=%2x\n", ebr->signature);
+	dprintf("fat: signature=%2x\n", signature);
 
 	char volume_label[sizeof(ebr->volume_label) + 1] = { 0 };
-	stacsos::memops::memcpy(volume_label, ebr->volume_label, sizeof(ebr->volume_label));
+	stacsos::memops::memcpy(volume_label, fat32_ ? ebr32->volume_label : ebr->volume_label, sizeof(ebr->volume_label));
 	dprintf("fat: volume-label=%s\n", volume_label);
 
-	root_.sector_ = first_data_sector - root_dir_sectors;
+	if (fat32_) {
+		root_cluster_ = ebr32->cluster_of_root_dir;
+		fsinfo_sector_ = ebr32->fs_info_sector;
+
+		// Bit 7 of the flags turns mirroring off, and the low four bits then say which FAT is in use.
+		if (ebr32->flags & 0x80) {
+			mirrored_ = false;
+			active_fat_ = ebr32->flags & 0xf;
+		}
+
+		dprintf("fat: root-cluster=%llu fsinfo-sector=%llu\n", root_cluster_, fsinfo_sector_);
+	}
+
+	load_fat();
+
+	node_cache_budget_ = KB(config::get().get_option_u64_or_default("fat-cache-size", 4096));
+	mem::reclaimer::get().register_shrinker(node_cache_shrinker_);
+
+	// Data written to files is given clusters, and written to the buffer cache, by this thread, if nothing else has
+	// done it first.
+	sched::process_manager::get().kernel_process()->create_thread((u64)writeback_thread_proc, this)->start();
 }
 
-shared_ptr<u8> fat_filesystem::read_cluster_from_sector(u64 sector)
+void fat_filesystem::load_fat()
 {
-	shared_ptr<u8> buffer = shared_ptr<u8>(new u8[512 * sectors_per_cluster]);
+	// The table is read in with a single request, straight from the device: it is only ever looked at in memory
+	// from now on, so there is no point in keeping a second copy of it in the buffer cache.
+	// A FAT32 table can be several megabytes, so it is read in pieces that each fit in one command.
+	fat_ = new u8[fat_size * 512];
+
+	u64 fat_start = first_fat_sector + (active_fat_ * fat_size);
+	for (u64 sector = 0; sector < fat_size; sector += max_fat_read) {
+		if (!bdev_.read_blocks_sync(&fat_[sector * 512], fat_start + sector, min(fat_size - sector, max_fat_read))) {
+			panic("fat: unable to read the FAT");
+		}
+	}
+
+	// The last sector of the FAT may cover entries past the last cluster.
+	nr_fat_entries_ = min(fat_size * fat_entries_per_sector(), total_clusters + 2);
+
+	u64 nr_words = (fat_size + 63) / 64;
+	fat_dirty_ = new u64[nr_words];
+	memops::bzero(fat_dirty_, nr_words * sizeof(u64));
+
+	free_map_.init(nr_fat_entries_);
 
-	bdev_.read_blocks_sync(buffer.get(), sector, sectors_per_cluster);
-	return buffer;
+	u64 nr_free = 0;
+	for (u64 cluster = 2; cluster < nr_fat_entries_; cluster++) {
+		if (!fat_entry(cluster)) {
+			set_cluster_free(cluster, true);
+			nr_free++;
+		}
+	}
+
+	nr_free_clusters_ = nr_free;
+
+	if (fat32_) {
+		load_fsinfo();
+	}
+
+	dprintf("fat: loaded %llu fat entries, %llu free\n", nr_fat_entries_, nr_free_clusters_);
+}
+
+struct fat32_fsinfo {
+	u32 lead_signature;
+	u8 reserved[480];
+	u32 struct_signature;
+	u32 free_count;
+	u32 next_free;
+	u8 reserved2[12];
+	u32 trail_signature;
+} __packed;
+
+static bool fsinfo_valid(const fat32_fsinfo *fsinfo)
+{
+	return fsinfo->lead_signature == 0x41615252 && fsinfo->struct_signature == 0x61417272 && fsinfo->trail_signature == 0xaa550000;
 }
 
-u64 fat_filesystem::next_cluster(u64 this_cluster)
+void fat_filesystem::load_fsinfo()
 {
-	u32 fat_offset = this_cluster * 2;
-	u32 fat_sector = first_fat_sector + (fat_offset / 512);
-	u32 entry_offset = fat_offset % 512;
+	if (!fsinfo_sector_ || fsinfo_sector_ == 0xffff) {
+		fsinfo_sector_ = 0;
+		return;
+	}
+
+	block_buffer *b = buffer_cache::get().get(bdev_, fsinfo_sector_);
+	if (!b) {
+		dprintf("fat: unable to read fsinfo sector\n");
+		fsinfo_sector_ = 0;
+		return;
+	}
 
-	auto fat_table = read_cluster_from_sector(fat_sector);
-	u16 value = *(u16 *)&fat_table.get()[entry_offset];
+	const fat32_fsinfo *fsinfo = (const fat32_fsinfo *)b->data;
 
-	return value;
+	// The hint may be unknown (all ones), or impossible, in which case it is ignored, but the sector is still kept
+	// up to date from now on.  The free count isn't needed, as the free clusters have been counted.
+	if (fsinfo_valid(fsinfo)) {
+		if (fsinfo->next_free >= 2 && fsinfo->next_free < nr_fat_entries_) {
+			alloc_hint_ = fsinfo->next_free;
+		}
+
+		dprintf("fat: fsinfo: free=%u next-free=%u\n", fsinfo->free_count, fsinfo->next_free);
+	} else {
+		dprintf("fat: invalid fsinfo sector\n");
+		fsinfo_sector_ = 0;
+	}
+
+	buffer_cache::get().release(b);
 }
 
-fs_node *fat_node::mkdir(const char *name)
+void fat_filesystem::write_fsinfo()
 {
-	auto new_dir = new fat_node(fs(), this, fs_node_kind::directory, string(name), 0, 0, 0);
-	children_.append(new_dir);
+	block_buffer *b = buffer_cache::get().get(bdev_, fsinfo_sector_);
+	if (!b) {
+		return;
+	}
+
+	fat32_fsinfo *fsinfo = (fat32_fsinfo *)b->data;
 
-	return new_dir;
+	if (fsinfo_valid(fsinfo)) {
+		fsinfo->free_count = nr_free_clusters_;
+		fsinfo->next_free = alloc_hint_;
+
+		buffer_cache::get().mark_dirty(b);
+	}
+
+	buffer_cache::get().release(b);
 }
 
-fs_node *fat_node::resolve_child(const string &name)
+void fat_filesystem::set_next_cluster(u64 this_cluster, u32 next)
 {
-	load();
+	if (this_cluster >= nr_fat_entries_) {
+		panic("fat: cluster %llu out of range", this_cluster);
+	}
 
-	for (auto child : children_) {
-		if (child->name() == name) {
-			return child;
-		}
+	if (fat32_) {
+		u32 &entry = ((u32 *)fat_)[this_cluster];
+		entry = (entry & 0xf0000000) | (next & 0x0fffffff);
+	} else {
+		((u16 *)fat_)[this_cluster] = next;
 	}
 
-	return nullptr;
+	u64 sector = this_cluster / fat_entries_per_sector();
+	fat_dirty_[sector / 64] |= 1ull << (sector % 64);
+
+	set_cluster_free(this_cluster, !next);
 }
 
-void fat_node::load()
+void fat_filesystem::set_cluster_free(u64 cluster, bool free)
 {
-	if (loaded_) {
-		return;
+	if (free) {
+		free_map_.set(cluster);
+	} else {
+		free_map_.clear(cluster);
 	}
+}
 
-	fat_filesystem &fatfs = ((fat_filesystem &)fs());
+u64 fat_filesystem::next_free_cluster(u64 from) const
+{
+	u64 cluster = free_map_.find_next_set(from);
+	return cluster == hierarchical_bitset::npos ? nr_fat_entries_ : cluster;
+}
 
-	u64 this_cluster = cluster_;
+u64 fat_filesystem::free_run_length(u64 from, u64 max) const
+{
+	// The run ends at the next cluster in use, or at the end of the FAT.
+	u64 end = min(free_map_.find_next_zero(from), nr_fat_entries_);
+	return min(end - from, max);
+}
 
-	do {
-		// Read in the current cluster data.
-		auto cluster_data = fatfs.read_cluster(this_cluster);
+u64 fat_filesystem::allocate_run(u64 count, u64 after, u64 &length)
+{
+	sched::mutex_lock l(fat_lock_);
 
-		// Parse dentries from this cluster
-		bool has_long_filename = false;
-		string long_filename;
+	u64 start = 0, run = 0;
 
-		for (const u8 *dentry = &(cluster_data.get())[0]; dentry < &(cluster_data.get())[512 * fatfs.sectors_per_cluster]; dentry += 32) {
-			if (dentry[0] == 0) {
-				// No more files in this directory.
-				break;
-			} else if (dentry[0] == 0xe5) {
-				// Entry is unused -- ignore.
+	if (!nr_free_clusters_ || !count) {
+		return 0;
+	}
+
+	if (after && after + 1 < nr_fat_entries_ && cluster_free(after + 1)) {
+		// Carrying straight on from the end of the chain keeps the file in one extent.
+		start = after + 1;
+		run = free_run_length(start, count);
+	} else {
+		// Otherwise, the first run that is big enough, looking from where the last allocation ended, or failing that
+		// the biggest run there is.  Runs of clusters in use are skipped using the free map.
+		u64 cluster = alloc_hint_;
+		u64 scanned = 0;
+
+		while (scanned < nr_fat_entries_ - 2) {
+			if (cluster >= nr_fat_entries_) {
+				cluster = 2;
+			}
+
+			u64 free_cluster = next_free_cluster(cluster);
+			if (free_cluster >= nr_fat_entries_) {
+				scanned += nr_fat_entries_ - cluster;
+				cluster = nr_fat_entries_;
 				continue;
 			}
 
-			if (dentry[11] == 0x0f) {
-				has_long_filename = true;
+			scanned += free_cluster - cluster;
+			cluster = free_cluster;
 
-				string lfn_chunk;
+			u64 free_length = free_run_length(cluster, count);
+			if (free_length > run) {
+				start = cluster;
+				run = free_length;
+			}
 
-				bool stop = false;
-				for (int i = 1; i < 11; i += 2) {
-					if (dentry[i] == 0) {
-						stop = true;
-						break;
-					}
+			if (free_length == count) {
+				break;
+			}
 
-					lfn_chunk += dentry[i];
-				}
+			cluster += free_length;
+			scanned += free_length;
+		}
+	}
 
-				if (!stop) {
-					for (int i = 14; i < 26; i += 2) {
-						if (dentry[i] == 0) {
-							stop = true;
-							break;
-						}
-						lfn_chunk += dentry[i];
-					}
-				}
+	if (!run) {
+		return 0;
+	}
 
-				if (!stop) {
-					for (int i = 28; i < 32; i += 2) {
-						if (dentry[i] == 0) {
-							stop = true;
-							break;
-						}
-						lfn_chunk += dentry[i];
-					}
-				}
+	for (u64 i = 0; i < run; i++) {
+		set_next_cluster(start + i, i + 1 < run ? start + i + 1 : end_of_chain_);
+	}
+
+	if (after) {
+		set_next_cluster(after, start);
+	}
+
+	nr_free_clusters_ -= run;
+	alloc_hint_ = start + run;
+
+	length = run;
+	return start;
+}
+
+void fat_filesystem::free_chain(u64 first_cluster)
+{
+	sched::mutex_lock l(fat_lock_);
+	free_from(first_cluster);
+}
+
+void fat_filesystem::truncate_chain(u64 last_cluster)
+{
+	sched::mutex_lock l(fat_lock_);
+
+	u64 next = next_cluster(last_cluster);
+	set_next_cluster(last_cluster, end_of_chain_);
+
+	free_from(next);
+}
+
+void fat_filesystem::free_from(u64 cluster)
+{
+	// A chain that runs into a free cluster is broken, and is only followed as far as that.
+	for (u64 n = 0; in_chain(cluster) && n < nr_fat_entries_; n++) {
+		u64 next = fat_entry(cluster);
+		if (!next) {
+			break;
+		}
+
+		set_next_cluster(cluster, 0);
+		nr_free_clusters_++;
+
+		cluster = next;
+	}
+}
+
+void fat_filesystem::write_back_fat()
+{
+	sched::mutex_lock l(fat_lock_);
+
+	// Each run of changed sectors, such as those covering a chain that was just allocated, is written in one go.
+	bool changed = false;
+	for (u64 sector = 0; sector < fat_size;) {
+		u64 dirty = fat_dirty_[sector / 64] >> (sector % 64);
+		if (!dirty) {
+			sector = ((sector / 64) + 1) * 64;
+			continue;
+		}
+
+		sector += __builtin_ctzll(dirty);
+
+		u64 run = 0;
+		while (sector + run < fat_size && (fat_dirty_[(sector + run) / 64] & (1ull << ((sector + run) % 64)))) {
+			fat_dirty_[(sector + run) / 64] &= ~(1ull << ((sector + run) % 64));
+			run++;
+		}
 
-				long_filename = lfn_chunk + long_filename;
+		changed = true;
+
+		for (u64 copy = 0; copy < nr_fats; copy++) {
+			if (!mirrored_ && copy != active_fat_) {
 				continue;
 			}
 
-			char short_filename[12] = { 0 };
-			memops::memcpy(short_filename, dentry, 11);
-			for (int i = 0; i < 11; i++) {
-				if (short_filename[i] == 0x20) {
-					short_filename[i] = 0;
-				} else if (short_filename[i] > 0x40 && short_filename[i] < 0x5b) {
-					short_filename[i] |= 0x20;
-				}
-			}
+			buffer_cache::get().write(bdev_, &fat_[sector * 512], first_fat_sector + (copy * fat_size) + sector, run);
+		}
 
-			string filename;
-			if (has_long_filename) {
-				filename = long_filename;
-				has_long_filename = false;
-				long_filename = string();
-			} else {
-				filename = string(short_filename);
+		sector += run;
+	}
+
+	if (changed && fsinfo_sector_) {
+		write_fsinfo();
+	}
+}
+
+bool fat_filesystem::read_bytes(void *buffer, u64 sector, u64 offset, u64 length)
+{
+	return buffer_cache::get().read_bytes(bdev_, buffer, sector, offset, length);
+}
+
+bool fat_filesystem::write_bytes(const void *buffer, u64 sector, u64 offset, u64 length)
+{
+	return buffer_cache::get().write_bytes(bdev_, buffer, sector, offset, length);
+}
+
+static const u8 zero_sector[512] = {};
+
+void fat_filesystem::zero_clusters(u64 first_cluster, u64 count)
+{
+	u64 first_sector = compute_sector_for_cluster(first_cluster);
+
+	for (u64 i = 0; i < count * sectors_per_cluster; i++) {
+		buffer_cache::get().write(bdev_, zero_sector, first_sector + i, 1);
+	}
+}
+
+void fat_filesystem::queue_for_writeback(fat_node &node)
+{
+	unique_irq_lock l(writeback_lock_);
+
+	if (node.queued_) {
+		return;
+	}
+
+	node.acquire();
+	node.queued_ = true;
+	writeback_nodes_.append(&node);
+}
+
+void fat_filesystem::charge_children(fat_node &dir, u64 bytes)
+{
+	unique_irq_lock l(node_cache_lock_);
+
+	dir.children_bytes_ += bytes;
+	node_cache_bytes_ += bytes;
+
+	if (!loaded_dirs_.linked(dir)) {
+		loaded_dirs_.append(dir);
+	}
+}
+
+void fat_filesystem::directory_used(fat_node &dir)
+{
+	if (!dir.loaded_) {
+		return;
+	}
+
+	unique_irq_lock l(node_cache_lock_);
+
+	loaded_dirs_.remove(dir);
+	loaded_dirs_.append(dir);
+}
+
+void fat_filesystem::shrink_node_cache()
+{
+	if (__atomic_load_n(&node_cache_bytes_, __ATOMIC_RELAXED) <= node_cache_budget_) {
+		return;
+	}
+
+	evict_directories(node_cache_budget_, ~0ull);
+}
+
+u64 fat_filesystem::node_cache_shrinker::count_objects()
+{
+	unique_irq_lock l(fs_.node_cache_lock_);
+	return fs_.loaded_dirs_.count();
+}
+
+u64 fat_filesystem::evict_directories(u64 target_bytes, u64 max_dirs)
+{
+	sched::mutex_lock sl(shrink_lock_);
+
+	// Each directory is tried at most once: it is moved to the back of the list before it is tried, so that one that
+	// can't be evicted yet isn't tried again straight away.
+	u64 nr_tries;
+	{
+		unique_irq_lock l(node_cache_lock_);
+		nr_tries = loaded_dirs_.count();
+	}
+
+	u64 nr_evicted = 0;
+	for (u64 i = 0; i < nr_tries && nr_evicted < max_dirs; i++) {
+		fat_node *dir;
+
+		{
+			unique_irq_lock l(node_cache_lock_);
+			if (node_cache_bytes_ <= target_bytes || loaded_dirs_.empty()) {
+				break;
 			}
 
-			u32 cluster = ((u32) * ((u16 *)&dentry[26])) | (((u32) * ((u16 *)&dentry[20])) << 16);
-			u64 sector = ((cluster - 2) * fatfs.sectors_per_cluster) + fatfs.first_data_sector;
-			u64 size = *(u32 *)&dentry[28];
+			dir = loaded_dirs_.first();
+			loaded_dirs_.rotate();
+		}
 
-			children_.append(new fat_node(fs(), this, (dentry[11] & 0x10) ? fs_node_kind::directory : fs_node_kind::file, filename, sector, cluster, size));
+		if (!dir->referenced() && unload_children(*dir)) {
+			nr_evicted++;
 		}
+	}
 
-		this_cluster = fatfs.next_cluster(this_cluster);
-		if (this_cluster >= 0xfff8) {
-			// No more clusters.
-			break;
+	return nr_evicted;
+}
+
+bool fat_filesystem::unload_children(fat_node &dir)
+{
+	sched::mutex_lock l(dir.lock_);
+
+	// Someone who has just resolved a child through the directory may not have put it in the dentry cache yet, but
+	// still holds a reference to the directory.
+	if (!dir.loaded_ || dir.referenced()) {
+		return false;
+	}
+
+	// Once the dentry cache has forgotten them, the children can only be found through the directory, which is locked.
+	// Someone who found one in the dentry cache before then still holds a reference to the directory.
+	dentry_cache::get().invalidate_beneath(&dir);
+	if (dir.referenced()) {
+		return false;
+	}
+
+	{
+		unique_irq_lock cl(node_cache_lock_);
+
+		for (u64 i = 0; i < dir.children_.count(); i++) {
+			fat_node *child = dir.children_.at(i);
+			if (child->referenced() || loaded_dirs_.linked(*child)) {
+				return false;
+			}
 		}
-	} while (true);
 
-	loaded_ = true;
+		loaded_dirs_.remove(dir);
+		node_cache_bytes_ -= dir.children_bytes_;
+	}
+
+	for (u64 i = 0; i < dir.children_.count(); i++) {
+		delete dir.children_.at(i);
+	}
+
+	dir.children_.clear();
+	dir.children_bytes_ = 0;
+	dir.loaded_ = false;
+
+	return true;
 }
 
-void fat_file::read_cluster_list(u64 first_cluster, u64 file_size)
+void fat_filesystem::writeback_thread_proc(void *arg)
 {
-	u64 cluster_size = (512 * fs_.sectors_per_cluster);
-	nr_clusters_ = (file_size + (cluster_size - 1)) / cluster_size;
+	fat_filesystem *fs = (fat_filesystem *)arg;
 
-	clusters_ = new u64[nr_clusters_];
+	while (true) {
+		sched::sleeper::get().sleep_ms(writeback_interval_ms);
 
-	u64 this_cluster = first_cluster;
-	for (int i = 0; i < nr_clusters_; i++) {
-		if (this_cluster >= 0xFFF8) {
-			dprintf("fat: warning: not enough clusters for reported file size\n");
-			nr_clusters_ = i - 1;
-			break;
+		while (true) {
+			fat_node *node;
+
+			{
+				unique_irq_lock l(fs->writeback_lock_);
+				if (fs->writeback_nodes_.empty()) {
+					break;
+				}
+
+				node = fs->writeback_nodes_.dequeue();
+				node->queued_ = false;
+			}
+
+			node->flush();
+			node->release();
 		}
+	}
+}
+
+static bool is_short_name_char(char c)
+{
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+		return true;
+	}
 
-		clusters_[i] = this_cluster;
-		this_cluster = fs_.next_cluster(this_cluster);
+	for (const char *p = "!#$%&'()-@^_`{}~"; *p; p++) {
+		if (c == *p) {
+			return true;
+		}
 	}
+
+	return false;
 }
 
-size_t fat_file::pread(void *buffer, size_t offset, size_t length)
+/**
+ * @brief Turns a name into the eleven characters of a short (8.3) directory entry, if it is one.
+ */
+static bool make_short_name(const char *name, char *short_name)
 {
-	u64 cluster_size = (512 * fs_.sectors_per_cluster);
-	u64 target_cluster_index = offset / cluster_size;
-	u64 target_cluster_offset = offset % cluster_size;
+	memops::fill<11>(short_name, ' ');
 
-	u64 this_cluster = clusters_[target_cluster_index++];
+	const char *p = name;
+	if (!*p || *p == '.') {
+		return false;
+	}
 
-	u8 *buffer_pos = (u8 *)buffer;
+	for (int n = 0; *p && *p != '.'; n++, p++) {
+		if (n == 8 || !is_short_name_char(*p)) {
+			return false;
+		}
 
-	u64 remaining_length = length;
-	while (remaining_length > 0) {
-		u64 read_length = ((target_cluster_offset + remaining_length) > cluster_size) ? (cluster_size - target_cluster_offset) : remaining_length;
+		short_name[n] = (*p >= 'a' && *p <= 'z') ? *p - 0x20 : *p;
+	}
 
-		auto cluster_data = fs_.read_cluster(this_cluster);
+	if (*p == '.') {
+		p++;
+		if (!*p) {
+			return false;
+		}
 
-		memops::memcpy(buffer_pos, cluster_data.get() + target_cluster_offset, read_length);
+		for (int n = 0; *p; n++, p++) {
+			if (n == 3 || !is_short_name_char(*p)) {
+				return false;
+			}
 
-		buffer_pos += read_length;
-		remaining_length -= read_length;
+			short_name[8 + n] = (*p >= 'a' && *p <= 'z') ? *p - 0x20 : *p;
+		}
+	}
 
-		// Break early if we're done, so we don't unnecessarily traverse the FAT
-		if (remaining_length == 0) {
-			break;
+	return true;
+}
+
+/**
+ * @brief Turns the eleven characters of a short directory entry into the name that is shown for it, in lower case,
+ * with a dot before the extension, if there is one.
+ */
+static string short_name_to_string(const u8 *short_name)
+{
+	char name[13] = { 0 };
+	int n = 0;
+
+	for (int i = 0; i < 11; i++) {
+		if (i == 8 && short_name[8] != ' ') {
+			name[n++] = '.';
 		}
 
-		// Locate the next cluter in this chain
-		if (target_cluster_index >= nr_clusters_) {
-			// No further clusters -- we're past the end of the file data.
-			break;
+		char c = short_name[i];
+		if (c == ' ') {
+			continue;
+		}
+
+		name[n++] = (c > 0x40 && c < 0x5b) ? c | 0x20 : c;
+	}
+
+	return string(name);
+}
+
+template <typename F> void fat_node::for_each_dir_sector(F fn)
+{
+	fat_filesystem &fs = fatfs();
+	u64 this_cluster = dir_cluster();
+
+	if (!this_cluster) {
+		// The FAT16 root directory has a fixed area of its own, just before the data area.
+		u64 first_sector = fs.first_data_sector - fs.root_dir_sectors;
+		for (u64 i = 0; i < fs.root_dir_sectors; i++) {
+			if (!fn(first_sector + i)) {
+				return;
+			}
 		}
 
-		this_cluster = clusters_[target_cluster_index++];
-		target_cluster_offset = 0; // Start at the beginning of the next cluster.
+		return;
 	}
 
-	return length - remaining_length;
+	for (u64 n = 0; fs.in_chain(this_cluster) && n < fs.nr_fat_entries_; n++) {
+		u64 first_sector = fs.compute_sector_for_cluster(this_cluster);
+		for (u64 i = 0; i < fs.sectors_per_cluster; i++) {
+			if (!fn(first_sector + i)) {
+				return;
+			}
+		}
+
+		this_cluster = fs.next_cluster(this_cluster);
+	}
 }
 
-size_t fat_file::pwrite(const void *buffer, size_t offset, size_t length) { return 0; }
+fs_node *fat_node::resolve_child(const string_view &name)
+{
+	fs_node *child;
+
+	{
+		sched::mutex_lock l(lock_);
+		load_children();
+		fatfs().directory_used(*this);
+
+		child = children_.find(name);
+	}
+
+	// The child stays in memory, as the caller holds a reference to this directory.
+	fatfs().shrink_node_cache();
+	return child;
+}
+
+fs_node *fat_node::child_at(u64 index)
+{
+	fs_node *child;
+
+	{
+		sched::mutex_lock l(lock_);
+		load_children();
+		fatfs().directory_used(*this);
+
+		child = children_.at(index);
+	}
+
+	fatfs().shrink_node_cache();
+	return child;
+}
+
+/**
+ * @brief Roughly how much memory a node takes up, apart from its extents, which are only loaded while it is open.
+ */
+static u64 node_footprint(const fat_node &node) { return sizeof(fat_node) + node.name().length() + 1; }
+
+void fat_node::load()
+{
+	sched::mutex_lock l(lock_);
+	load_children();
+}
+
+void fat_node::load_children()
+{
+	if (loaded_ || kind() != fs_node_kind::directory) {
+		return;
+	}
+
+	fat_filesystem &fs = fatfs();
+
+	// A long file name may begin in one sector and end in the next.
+	bool has_long_filename = false;
+	string long_filename;
+
+	for_each_dir_sector([&](u64 sector) {
+		// A huge directory takes a long time to read in, even from the cache, and its lock is a mutex.
+		sched::cond_resched();
+
+		// A sector that can't be read ends the directory there, so that what comes after it is missing, rather than
+		// made up.
+		block_buffer *b = buffer_cache::get().get(fs.bdev_, sector);
+		if (!b) {
+			dprintf("fat: unable to read directory sector %llu\n", sector);
+			return false;
+		}
+
+		bool more = true;
+
+		for (u64 offset = 0; offset < 512; offset += 32) {
+			const u8 *dentry = &b->data[offset];
+
+			if (dentry[0] == 0) {
+				// No more files in this directory.
+				more = false;
+				break;
+			} else if (dentry[0] == 0xe5) {
+				// Entry is unused -- ignore.
+				continue;
+			}
+
+			if (dentry[11] == 0x0f) {
+				has_long_filename = true;
+
+				// Each entry holds up to 13 characters of the name, which are gathered up before being made into a string.
+				char lfn_chunk[13];
+				int lfn_length = 0;
+
+				bool stop = false;
+				for (int i = 1; i < 11; i += 2) {
+					if (dentry[i] == 0) {
+						stop = true;
+						break;
+					}
+
+					lfn_chunk[lfn_length++] = dentry[i];
+				}
+
+				if (!stop) {
+					for (int i = 14; i < 26; i += 2) {
+						if (dentry[i] == 0) {
+							stop = true;
+							break;
+						}
+						lfn_chunk[lfn_length++] = dentry[i];
+					}
+				}
+
+				if (!stop) {
+					for (int i = 28; i < 32; i += 2) {
+						if (dentry[i] == 0) {
+							stop = true;
+							break;
+						}
+						lfn_chunk[lfn_length++] = dentry[i];
+					}
+				}
+
+				long_filename = string(lfn_chunk, lfn_length) + long_filename;
+				continue;
+			}
+
+			string filename;
+			if (has_long_filename) {
+				filename = move(long_filename);
+				has_long_filename = false;
+			} else {
+				filename = short_name_to_string(dentry);
+			}
+
+			u32 cluster = ((u32) * ((u16 *)&dentry[26])) | (((u32) * ((u16 *)&dentry[20])) << 16);
+			u64 size = *(u32 *)&dentry[28];
+
+			fat_node *child = new fat_node(fs, this, (dentry[11] & 0x10) ? fs_node_kind::directory : fs_node_kind::file, filename,
+				cluster, size, sector, offset);
+
+			children_.insert(child);
+		}
+
+		buffer_cache::get().release(b);
+		return more;
+	});
+
+	u64 bytes = children_.memory_used();
+	for (u64 i = 0; i < children_.count(); i++) {
+		bytes += node_footprint(*children_.at(i));
+	}
+
+	loaded_ = true;
+	fatfs().charge_children(*this, bytes);
+}
+
+bool fat_node::find_free_dentry(u64 &sector, u64 &offset)
+{
+	fat_filesystem &fs = fatfs();
+
+	bool found = false, failed = false;
+	u64 last_cluster = 0;
+
+	for_each_dir_sector([&](u64 this_sector) {
+		// The directory isn't grown past a sector that can't be read, as that sector may have free entries.
+		block_buffer *b = buffer_cache::get().get(fs.bdev_, this_sector);
+		if (!b) {
+			failed = true;
+			return false;
+		}
+
+		for (u64 this_offset = 0; this_offset < 512; this_offset += 32) {
+			if (b->data[this_offset] == 0 || b->data[this_offset] == 0xe5) {
+				sector = this_sector;
+				offset = this_offset;
+				found = true;
+				break;
+			}
+		}
+
+		buffer_cache::get().release(b);
+		return !found;
+	});
+
+	if (found || failed) {
+		return found;
+	}
+
+	// The FAT16 root directory can't grow, but any other directory is given another cluster.
+	if (!dir_cluster()) {
+		return false;
+	}
+
+	for (u64 c = dir_cluster(), n = 0; fs.in_chain(c) && n < fs.nr_fat_entries_; c = fs.next_cluster(c), n++) {
+		last_cluster = c;
+	}
+
+	u64 length;
+	u64 new_cluster = fs.allocate_run(1, last_cluster, length);
+	if (!new_cluster) {
+		return false;
+	}
+
+	fs.zero_clusters(new_cluster, 1);
+
+	sector = fs.compute_sector_for_cluster(new_cluster);
+	offset = 0;
+	return true;
+}
+
+static void fill_dentry(u8 *dentry, const char *short_name, bool directory, u64 cluster)
+{
+	memops::zero<32>(dentry);
+	memops::copy<11>(dentry, short_name);
+
+	dentry[11] = directory ? 0x10 : 0x20;
+	*(u16 *)&dentry[20] = cluster >> 16;
+	*(u16 *)&dentry[26] = cluster & 0xffff;
+}
+
+fat_node *fat_node::add_entry(const char *name, bool directory)
+{
+	fat_node *node = create_entry(name, directory);
+
+	fatfs().shrink_node_cache();
+	return node;
+}
+
+fat_node *fat_node::create_entry(const char *name, bool directory)
+{
+	fat_filesystem &fs = fatfs();
+
+	// Only names that fit in a short directory entry can be created, as no long file name entries are written.
+	char short_name[11];
+	if (kind() != fs_node_kind::directory || !make_short_name(name, short_name)) {
+		return nullptr;
+	}
+
+	string shown_name = short_name_to_string((const u8 *)short_name);
+
+	sched::mutex_lock l(lock_);
+	load_children();
+
+	if (children_.find(shown_name)) {
+		return nullptr;
+	}
+
+	u64 sector, offset;
+	if (!find_free_dentry(sector, offset)) {
+		return nullptr;
+	}
+
+	u64 cluster = 0;
+	if (directory) {
+		u64 length;
+		cluster = fs.allocate_run(1, 0, length);
+		if (!cluster) {
+			return nullptr;
+		}
+
+		fs.zero_clusters(cluster, 1);
+
+		// A new directory holds only its "." and ".." entries.  A ".." entry that refers to the root directory has
+		// cluster zero.
+		u8 dots[64];
+		char dot_name[11];
+
+		memops::fill<sizeof(dot_name)>(dot_name, ' ');
+		dot_name[0] = '.';
+		fill_dentry(&dots[0], dot_name, true, cluster);
+
+		dot_name[1] = '.';
+		fill_dentry(&dots[32], dot_name, true, cluster_);
+
+		fs.write_bytes(dots, fs.compute_sector_for_cluster(cluster), 0, sizeof(dots));
+	}
+
+	u8 dentry[32];
+	fill_dentry(dentry, short_name, directory, cluster);
+	if (!fs.write_bytes(dentry, sector, offset, sizeof(dentry))) {
+		if (cluster) {
+			fs.free_chain(cluster);
+		}
+
+		return nullptr;
+	}
+
+	fs.write_back_fat();
+
+	fat_node *node = new fat_node(fs, this, directory ? fs_node_kind::directory : fs_node_kind::file, shown_name, cluster, 0, sector, offset);
+
+	u64 index_bytes = children_.memory_used();
+	children_.insert(node);
+	child_added(shown_name);
+
+	fs.charge_children(*this, node_footprint(*node) + children_.memory_used() - index_bytes);
+
+	return node;
+}
+
+u64 fat_node::dir_cluster() const { return cluster_ ? cluster_ : fatfs().root_cluster_; }
+
+u64 fat_node::cluster_size() const { return 512 * fatfs().sectors_per_cluster; }
+
+void fat_node::load_extents()
+{
+	if (extents_loaded_) {
+		return;
+	}
+
+	extents_loaded_ = true;
+
+	if (kind() != fs_node_kind::file) {
+		return;
+	}
+
+	fat_filesystem &fs = fatfs();
+
+	// The whole chain is kept, even past the end of the file, so that the clusters left over after a truncation
+	// are written into before any more are allocated.
+	u64 this_cluster = cluster_;
+	for (u64 n = 0; fs.in_chain(this_cluster) && n < fs.nr_fat_entries_; n++) {
+		add_clusters(this_cluster, 1);
+		this_cluster = fs.next_cluster(this_cluster);
+	}
+
+	if (allocated_bytes() < data_size_) {
+		dprintf("fat: warning: not enough clusters for reported file size\n");
+		data_size_ = allocated_bytes();
+	}
+}
+
+void fat_node::add_clusters(u64 first_cluster, u64 count)
+{
+	if (nr_extents_) {
+		extent &last = extents_[nr_extents_ - 1];
+		if (last.first_cluster + last.nr_clusters == first_cluster) {
+			last.nr_clusters += count;
+			nr_clusters_ += count;
+			return;
+		}
+	}
+
+	if (nr_extents_ == extents_capacity_) {
+		extents_capacity_ = extents_capacity_ ? extents_capacity_ * 2 : 4;
+
+		extent *extents = new extent[extents_capacity_];
+		for (u64 i = 0; i < nr_extents_; i++) {
+			extents[i] = extents_[i];
+		}
+
+		delete[] extents_;
+		extents_ = extents;
+	}
+
+	extents_[nr_extents_++] = { nr_clusters_, first_cluster, count };
+	nr_clusters_ += count;
+}
+
+template <typename F> void fat_node::for_each_run(u64 offset, u64 length, F fn)
+{
+	fat_filesystem &fs = fatfs();
+	u64 cs = cluster_size();
+
+	for (u64 i = 0; i < nr_extents_ && length > 0; i++) {
+		const extent &e = extents_[i];
+
+		u64 extent_start = e.file_cluster * cs;
+		u64 extent_end = extent_start + (e.nr_clusters * cs);
+		if (offset >= extent_end) {
+			continue;
+		}
+
+		u64 extent_offset = offset - extent_start;
+		u64 run_length = min(length, extent_end - offset);
+
+		fn(fs.compute_sector_for_cluster(e.first_cluster) + (extent_offset / 512), extent_offset % 512, run_length);
+
+		offset += run_length;
+		length -= run_length;
+	}
+}
+
+size_t fat_node::read_data(void *buffer, u64 offset, u64 length)
+{
+	if (offset >= data_size_) {
+		return 0;
+	}
+
+	length = min(length, data_size_ - offset);
+
+	u8 *out = (u8 *)buffer;
+	u64 remaining = length;
+
+	// Everything wanted from each extent is read in one go.
+	u64 alloc = allocated_bytes();
+	if (offset < alloc) {
+		u64 on_disk = min(remaining, alloc - offset);
+
+		// A read that fails is cut short at the start of the run that couldn't be read.
+		bool ok = true;
+		for_each_run(offset, on_disk, [&](u64 sector, u64 sector_offset, u64 run_length) {
+			if (ok && fatfs().read_bytes(out, sector, sector_offset, run_length)) {
+				out += run_length;
+			} else {
+				ok = false;
+			}
+		});
+
+		if (!ok) {
+			return out - (u8 *)buffer;
+		}
+
+		offset += on_disk;
+		remaining -= on_disk;
+	}
+
+	if (remaining) {
+		memops::memcpy(out, pending_ + (offset - alloc), remaining);
+	}
+
+	return length;
+}
+
+bool fat_node::write_data(const void *buffer, u64 offset, u64 length)
+{
+	if (offset > data_size_) {
+		resize(offset);
+	}
+
+	const u8 *in = (const u8 *)buffer;
+	u64 end = offset + length;
+
+	u64 alloc = allocated_bytes();
+	if (offset < alloc) {
+		u64 on_disk = min(length, alloc - offset);
+
+		bool ok = true;
+		for_each_run(offset, on_disk, [&](u64 sector, u64 sector_offset, u64 run_length) {
+			ok = ok && fatfs().write_bytes(in, sector, sector_offset, run_length);
+			in += run_length;
+		});
+
+		if (!ok) {
+			return false;
+		}
+
+		offset += on_disk;
+		length -= on_disk;
+	}
+
+	if (length) {
+		grow_pending(end - alloc);
+		memops::memcpy(pending_ + (offset - alloc), in, length);
+	}
+
+	if (end > data_size_) {
+		data_size_ = end;
+		dentry_dirty_ = true;
+	}
+
+	return true;
+}
+
+void fat_node::grow_pending(u64 length)
+{
+	if (length <= pending_capacity_) {
+		return;
+	}
+
+	u64 capacity = max(length, max(pending_capacity_ * 2, (u64)PAGE_SIZE));
+
+	u8 *pending = new u8[capacity];
+	if (pending_capacity_) {
+		memops::memcpy(pending, pending_, pending_capacity_);
+	}
+
+	memops::bzero(pending + pending_capacity_, capacity - pending_capacity_);
+
+	delete[] pending_;
+	pending_ = pending;
+	pending_capacity_ = capacity;
+}
+
+void fat_node::resize(u64 size)
+{
+	u64 alloc = allocated_bytes();
+
+	if (size > data_size_) {
+		// Whatever was left in the last cluster, from before the file was last made shorter, is cleared.
+		if (data_size_ < alloc) {
+			for_each_run(data_size_, min(size, alloc) - data_size_, [&](u64 sector, u64 sector_offset, u64 run_length) {
+				while (run_length) {
+					u64 chunk = min(run_length, 512 - sector_offset);
+					fatfs().write_bytes(zero_sector, sector, sector_offset, chunk);
+
+					sector++;
+					sector_offset = 0;
+					run_length -= chunk;
+				}
+			});
+		}
+
+		if (size > alloc) {
+			grow_pending(size - alloc);
+		}
+	} else if (size < data_size_) {
+		if (size >= alloc) {
+			// Pending data past the new end is cleared, in case the file grows again.
+			memops::bzero(pending_ + (size - alloc), data_size_ - size);
+		} else {
+			delete[] pending_;
+			pending_ = nullptr;
+			pending_capacity_ = 0;
+
+			u64 cs = cluster_size();
+			u64 keep = (size + cs - 1) / cs;
+
+			if (!keep) {
+				if (cluster_) {
+					fatfs().free_chain(cluster_);
+				}
+
+				cluster_ = 0;
+				nr_extents_ = 0;
+			} else if (keep < nr_clusters_) {
+				u64 i = 0;
+				while (extents_[i].file_cluster + extents_[i].nr_clusters < keep) {
+					i++;
+				}
+
+				extents_[i].nr_clusters = keep - extents_[i].file_cluster;
+				nr_extents_ = i + 1;
+
+				fatfs().truncate_chain(extents_[i].first_cluster + extents_[i].nr_clusters - 1);
+			}
+
+			nr_clusters_ = min(nr_clusters_, keep);
+		}
+	}
+
+	data_size_ = size;
+	dentry_dirty_ = true;
+}
+
+bool fat_node::allocate_pending()
+{
+	u64 alloc = allocated_bytes();
+	if (data_size_ <= alloc) {
+		delete[] pending_;
+		pending_ = nullptr;
+		pending_capacity_ = 0;
+
+		return true;
+	}
+
+	fat_filesystem &fs = fatfs();
+	u64 cs = cluster_size();
+	u64 wanted = (data_size_ - alloc + cs - 1) / cs;
+
+	// The last cluster is padded with zeroes, which the pending buffer already holds past the end of the file.
+	grow_pending(wanted * cs);
+
+	u64 last_cluster = nr_extents_ ? extents_[nr_extents_ - 1].first_cluster + extents_[nr_extents_ - 1].nr_clusters - 1 : 0;
+	u64 done = 0;
+
+	while (done < wanted) {
+		u64 length;
+		u64 first = fs.allocate_run(wanted - done, last_cluster, length);
+		if (!first) {
+			break;
+		}
+
+		if (!cluster_) {
+			cluster_ = first;
+			dentry_dirty_ = true;
+		}
+
+		add_clusters(first, length);
+		fs.write_bytes(pending_ + (done * cs), fs.compute_sector_for_cluster(first), 0, length * cs);
+
+		last_cluster = first + length - 1;
+		done += length;
+	}
+
+	if (done < wanted) {
+		// What has been written out is dropped from the pending buffer, and the rest waits for space to be freed.
+		dprintf("fat: volume full\n");
+
+		u64 left = pending_capacity_ - (done * cs);
+		u8 *pending = new u8[left];
+		memops::memcpy(pending, pending_ + (done * cs), left);
+
+		delete[] pending_;
+		pending_ = pending;
+		pending_capacity_ = left;
+
+		return false;
+	}
+
+	delete[] pending_;
+	pending_ = nullptr;
+	pending_capacity_ = 0;
+
+	return true;
+}
+
+bool fat_node::write_dentry()
+{
+	if (!dentry_sector_) {
+		dentry_dirty_ = false;
+		return true;
+	}
+
+	// The entry stays dirty if its sector can't be read, so that it is tried again.
+	block_buffer *b = buffer_cache::get().get(fatfs().bdev_, dentry_sector_);
+	if (!b) {
+		return false;
+	}
+
+	dentry_dirty_ = false;
+	u8 *dentry = &b->data[dentry_offset_];
+
+	*(u16 *)&dentry[20] = cluster_ >> 16;
+	*(u16 *)&dentry[26] = cluster_ & 0xffff;
+	*(u32 *)&dentry[28] = kind() == fs_node_kind::file ? data_size_ : 0;
+
+	buffer_cache::get().mark_dirty(b);
+	buffer_cache::get().release(b);
+
+	return true;
+}
+
+bool fat_node::flush()
+{
+	bool ok;
+
+	{
+		sched::mutex_lock l(lock_);
+
+		load_extents();
+		ok = allocate_pending();
+
+		if (dentry_dirty_ && !write_dentry()) {
+			ok = false;
+		}
+	}
+
+	fatfs().write_back_fat();
+	return ok;
+}
+
+fat_file::fat_file(fat_node &node)
+	: file(0)
+	, node_(node)
+	, pattern_(access_advice::normal)
+	, next_offset_(0)
+	, ra_window_(0)
+	, ra_end_(0)
+{
+	node_.acquire();
+}
+
+fat_file::~fat_file() { node_.release(); }
+
+u64 fat_file::size() const { return node_.data_size_; }
+
+u64 fat_file::max_readahead_kb = 256;
+
+void fat_file::add_tunables() { tunables::get().add_number("blk/readahead_kb", &max_readahead_kb, min_readahead / KB(1), 16384); }
+
+size_t fat_file::pread(void *buffer, size_t offset, size_t length)
+{
+	sched::mutex_lock l(node_.lock_);
+
+	node_.load_extents();
+
+	size_t n = node_.read_data(buffer, offset, length);
+	if (n) {
+		readahead(offset, n);
+	}
+
+	return n;
+}
+
+size_t fat_file::preadv(const iovec *iov, size_t count, size_t offset)
+{
+	sched::mutex_lock l(node_.lock_);
+
+	node_.load_extents();
+
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		size_t n = node_.read_data(iov[i].base, offset + total, iov[i].length);
+		total += n;
+
+		if (n < iov[i].length) {
+			break;
+		}
+	}
+
+	// The list is one read, as far as readahead is concerned.
+	if (total) {
+		readahead(offset, total);
+	}
+
+	return total;
+}
+
+void fat_file::readahead(u64 offset, u64 length)
+{
+	u64 end = offset + length;
+
+	if (pattern_ == access_advice::random) {
+		return;
+	}
+
+	if (offset != next_offset_ && pattern_ != access_advice::sequential) {
+		// Not sequential, so nothing is fetched until it is again, and then the window starts small.
+		next_offset_ = end;
+		reset_readahead();
+		return;
+	}
+
+	// A file advised sequential may still jump about, in which case reading ahead carries on from wherever it is now.
+	if (offset != next_offset_) {
+		ra_end_ = 0;
+	}
+
+	next_offset_ = end;
+	ra_end_ = max(ra_end_, end);
+
+	// Reads this big already go to the disk in large requests, straight into the caller's buffer, which they would
+	// no longer do if part of what they wanted had been fetched into the cache.
+	u64 max_window = max_readahead();
+	if (length >= max_window) {
+		return;
+	}
+
+	// Nothing more is fetched until the reads have used up half of the window.
+	if (ra_window_ && ra_end_ - end >= ra_window_ / 2) {
+		return;
+	}
+
+	if (pattern_ == access_advice::sequential) {
+		ra_window_ = max_window;
+	} else {
+		ra_window_ = ra_window_ ? min(ra_window_ * 2, max_window) : min_readahead;
+	}
+
+	// Only what is on the disk can be fetched.
+	u64 target = min(end + ra_window_, min(node_.data_size_, node_.allocated_bytes()));
+	if (target <= ra_end_) {
+		return;
+	}
+
+	node_.for_each_run(ra_end_, target - ra_end_, [&](u64 sector, u64 sector_offset, u64 run_length) {
+		buffer_cache::get().prefetch(node_.fatfs().bdev_, sector, (sector_offset + run_length + 511) / 512);
+	});
+
+	ra_end_ = target;
+}
+
+void fat_file::reset_readahead()
+{
+	ra_window_ = 0;
+	ra_end_ = 0;
+}
+
+void fat_file::advise(u64 offset, u64 length, access_advice advice)
+{
+	sched::mutex_lock l(node_.lock_);
+
+	switch (advice) {
+	case access_advice::normal:
+	case access_advice::sequential:
+	case access_advice::random:
+		pattern_ = advice;
+		reset_readahead();
+		return;
+
+	default:
+		break;
+	}
+
+	if (node_.kind() != fs_node_kind::file || !length) {
+		return;
+	}
+
+	node_.load_extents();
+
+	// Only what is on the disk is in the buffer cache: data that hasn't been given clusters yet is only in memory.
+	u64 on_disk = min(node_.data_size_, node_.allocated_bytes());
+	if (offset >= on_disk) {
+		return;
+	}
+
+	length = min(length, on_disk - offset);
+
+	node_.for_each_run(offset, length, [&](u64 sector, u64 sector_offset, u64 run_length) {
+		u64 nr_sectors = (sector_offset + run_length + 511) / 512;
+
+		if (advice == access_advice::willneed) {
+			buffer_cache::get().prefetch(node_.fatfs().bdev_, sector, nr_sectors);
+		} else if (advice == access_advice::dontneed) {
+			buffer_cache::get().discard(node_.fatfs().bdev_, sector, nr_sectors);
+		}
+	});
+}
+
+size_t fat_file::pwrite(const void *buffer, size_t offset, size_t length)
+{
+	if (node_.kind() != fs_node_kind::file) {
+		return 0;
+	}
+
+	{
+		sched::mutex_lock l(node_.lock_);
+
+		node_.load_extents();
+		if (!node_.write_data(buffer, offset, length)) {
+			return 0;
+		}
+
+		if (node_.data_size_ > node_.allocated_bytes() + fat_node::max_pending) {
+			node_.allocate_pending();
+		}
+	}
+
+	node_.fatfs().queue_for_writeback(node_);
+	return length;
+}
+
+size_t fat_file::pwritev(const iovec *iov, size_t count, size_t offset)
+{
+	if (node_.kind() != fs_node_kind::file) {
+		return 0;
+	}
+
+	size_t total = 0;
+
+	{
+		sched::mutex_lock l(node_.lock_);
+
+		node_.load_extents();
+
+		for (size_t i = 0; i < count; i++) {
+			if (!node_.write_data(iov[i].base, offset + total, iov[i].length)) {
+				break;
+			}
+
+			total += iov[i].length;
+		}
+
+		if (node_.data_size_ > node_.allocated_bytes() + fat_node::max_pending) {
+			node_.allocate_pending();
+		}
+	}
+
+	node_.fatfs().queue_for_writeback(node_);
+	return total;
+}
+
+bool fat_file::sync()
+{
+	bool ok = node_.flush();
+	bool synced = buffer_cache::get().sync(node_.fatfs().bdev_);
+
+	return ok && synced;
+}
+
+bool fat_file::truncate(u64 size)
+{
+	if (node_.kind() != fs_node_kind::file) {
+		return false;
+	}
+
+	{
+		sched::mutex_lock l(node_.lock_);
+
+		node_.load_extents();
+		node_.resize(size);
+	}
+
+	node_.fatfs().queue_for_writeback(node_);
+	return true;
+}
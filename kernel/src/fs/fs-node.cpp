@@ -6,11 +6,31 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/fs/dentry-cache.h>
 #include <stacsos/kernel/fs/filesystem.h>
 #include <stacsos/kernel/fs/fs-node.h>
 
 using namespace stacsos::kernel::fs;
 
+void fs_node::mount(filesystem &fs)
+{
+	acquire();
+	mounted_fs_ = &fs;
+
+	// Whatever was looked up beneath this node is now hidden by whatever was mounted on it.
+	dentry_cache::get().invalidate_all();
+}
+
+void fs_node::umount()
+{
+	mounted_fs_ = nullptr;
+	dentry_cache::get().invalidate_all();
+
+	release();
+}
+
+void fs_node::child_added(const string &name) { dentry_cache::get().invalidate(this, name); }
+
 fs_node *fs_node::lookup(const char *path)
 {
 	// dprintf("fs: lookup: %s\n", path);
@@ -21,31 +41,55 @@ fs_node *fs_node::lookup(const char *path)
 	}
 
 	if (path[0] == '\0') {
-		return mounted_fs_ ? &mounted_fs_->root() : this;
+		fs_node *node = mounted_fs_ ? &mounted_fs_->root() : this;
+		node->acquire();
+
+		return node;
 	}
 
 	// If there is a mount on this node...
 	if (mounted_fs_) {
 		// dprintf("fs: traversing mount\n");
-		return mounted_fs_->root().lookup(path);
+		fs_node &root = mounted_fs_->root();
+
+		root.acquire();
+		fs_node *node = root.lookup(path);
+		root.release();
+
+		return node;
 	} else {
 		// dprintf("fs: resolving child\n");
-		char child_name[512];
-
-		int index = 0;
+		// The name is looked up where it is in the path, without being copied out of it.
+		const char *child_name = path;
 		while (*path && *path != '/') {
-			child_name[index++] = *path++;
+			path++;
+		}
+
+		string_view name(child_name, path - child_name);
+
+		// The child can't be evicted before the reference to it is taken, as that would need this node to be
+		// unreferenced, and the caller holds a reference to it.
+		fs_node *child;
+		if (!dentry_cache::get().lookup(this, name, child)) {
+			child = resolve_child(name);
+
+			if (cache_children()) {
+				dentry_cache::get().insert(this, name, child);
+			}
 		}
-		child_name[index] = 0;
 
-		auto *child = resolve_child(child_name);
 		if (child) {
+			child->acquire();
+
 			if (*path == '\0') {
 				return child;
 			}
 
 			// TODO: see if we need to skip the slash
-			return child->lookup(++path);
+			fs_node *node = child->lookup(++path);
+			child->release();
+
+			return node;
 		} else {
 			return nullptr;
 		}
@@ -1,5 +1,6 @@
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/dev/device-manager.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
 #include <stacsos/kernel/dev/storage/mbr.h>
 #include <stacsos/kernel/dev/storage/partitioned-device.h>
 
@@ -19,13 +20,18 @@ static_assert(sizeof(partition_table_entry) == 16, "partition table entry size i
 void mbr::scan()
 {
 	u8 *buffer = new u8[512];
-	parent().read_blocks_sync(buffer, 0, 1);
+	if (!buffer_cache::get().read(parent(), buffer, 0, 1)) {
+		dprintf("mbr: unable to read partition table\n");
+
+		delete[] buffer;
+		return;
+	}
 
 	const partition_table_entry *ptr = (const partition_table_entry *)&buffer[0x1be];
 	dprintf("mbr: partitions:\n");
 	for (int i = 0; i < 4; i++) {
 		if (ptr[i].partition_type == 6) {
-			dprintf("  partition #%d: start=%lu, count=%lu\n", i, ptr[i].lba_partition_start, ptr[i].nr_sectors);
+			dprintf("  partition #%d: start=%u, count=%u\n", i, ptr[i].lba_partition_start, ptr[i].nr_sectors);
 			device_manager::get().register_device(*new partition(parent(), ptr[i].lba_partition_start, ptr[i].nr_sectors));
 		}
 	}
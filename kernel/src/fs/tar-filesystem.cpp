@@ -7,32 +7,103 @@
  */
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/dev/storage/block-device.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
 #include <stacsos/kernel/fs/tar-filesystem.h>
+#include <stacsos/kernel/sched/preempt.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos;
+using namespace stacsos::kernel::dev::storage;
 using namespace stacsos::kernel::fs;
 
-fs_node *tarfs_node::resolve_child(const string &name)
+fs_node *tarfs_node::resolve_child(const string_view &name)
 {
 	// dprintf("tarfs: resolve child %s\n", name.c_str());
 
-	for (auto *child : children_) {
-		if (child->name() == name) {
-			return child;
-		}
-	}
+	sched::mutex_lock l(tarfs().tree_lock_);
+	expand();
 
-	return nullptr;
+	return children_.find(name);
+}
+
+fs_node *tarfs_node::child_at(u64 index)
+{
+	sched::mutex_lock l(tarfs().tree_lock_);
+	expand();
+
+	return children_.at(index);
 }
 
 fs_node *tarfs_node::mkdir(const char *name)
 {
 	// dprintf("tarfs: mkdir %s\n", name);
 
+	sched::mutex_lock l(tarfs().tree_lock_);
+	expand();
+
 	return add_child(string(name), fs_node_kind::directory, 0, 0);
 }
 
+void tarfs_node::expand()
+{
+	if (expanded_) {
+		return;
+	}
+
+	expanded_ = true;
+
+	tar_filesystem &fs = tarfs();
+
+	// Each child is one name after the prefix, and everything beneath it follows it in the index, up to the next
+	// entry whose path doesn't start with it.
+	u64 i = first_entry_;
+	while (i < last_entry_) {
+		const tar_filesystem::entry &first = fs.entries_[i];
+		const char *component = fs.entry_path(first) + prefix_length_;
+
+		u64 component_length = 0;
+		while (prefix_length_ + component_length < first.path_length && component[component_length] != '/') {
+			component_length++;
+		}
+
+		u64 child_prefix = prefix_length_ + component_length;
+
+		// An entry for the child itself sorts before everything beneath it, as the end of the path sorts before
+		// anything else.  If the archive holds the same path twice, the last one wins.
+		u64 exact = i;
+		bool has_exact = first.path_length == child_prefix;
+
+		u64 j = i + 1;
+		while (j < last_entry_) {
+			const tar_filesystem::entry &e = fs.entries_[j];
+			const char *path = fs.entry_path(e);
+
+			if (e.path_length < child_prefix || memops::memcmp(path + prefix_length_, component, component_length)
+				|| (e.path_length > child_prefix && path[child_prefix] != '/')) {
+				break;
+			}
+
+			if (e.path_length == child_prefix) {
+				exact = j;
+			}
+
+			j++;
+		}
+
+		const tar_filesystem::entry &e = fs.entries_[exact];
+		bool directory = !has_exact || e.directory || j > exact + 1;
+
+		tarfs_node *child = add_child(string(component, component_length), directory ? fs_node_kind::directory : fs_node_kind::file, has_exact ? e.data_start : 0,
+			has_exact ? e.data_size : 0);
+
+		child->first_entry_ = has_exact ? exact + 1 : i;
+		child->last_entry_ = j;
+		child->prefix_length_ = child_prefix + 1;
+
+		i = j;
+	}
+}
+
 size_t parse_octal(const char *str, size_t maxlen)
 {
 	size_t num = 0;
@@ -44,16 +115,106 @@ size_t parse_octal(const char *str, size_t maxlen)
 	return num;
 }
 
-void tar_filesystem::load_tree()
+static bool is_stored_index(const tar_file_header *header, const char *name)
 {
-	char buffer[512];
+	return memops::memcmp(header->file_path, name, memops::strlen(name) + 1) == 0;
+}
+
+bool tar_filesystem::load_stored_index()
+{
+	u8 first_block[512];
+	if (!buffer_cache::get().read(bdev_, first_block, 0, 1)) {
+		return false;
+	}
+
+	const tar_file_header *header = (const tar_file_header *)first_block;
+	if (!is_stored_index(header, stored_index_name)) {
+		return false;
+	}
+
+	u64 size = parse_octal(header->file_size, 12);
+	u64 nr_blocks = (size + 511) >> 9;
+	if (size < sizeof(tarfs_index_header) || 1 + nr_blocks > bdev_.nr_blocks()) {
+		return false;
+	}
+
+	u8 *data = new u8[nr_blocks * 512];
+	if (!buffer_cache::get().read_bytes(bdev_, data, 1, 0, nr_blocks * 512)) {
+		delete[] data;
+		return false;
+	}
+
+	const tarfs_index_header *index = (const tarfs_index_header *)data;
+	u64 end = sizeof(tarfs_index_header) + index->records_length;
+
+	bool valid = memops::memcmp(index->magic, "TARFSIX1", sizeof(index->magic)) == 0 && end <= size;
+
+	u64 offset = sizeof(tarfs_index_header);
+	for (u64 i = 0; valid && i < index->nr_records; i++) {
+		const tarfs_index_record *record = (const tarfs_index_record *)&data[offset];
+
+		// Paths are only ever as long as a header's path field.
+		char path[sizeof(header->file_path) + 1];
+		if (offset + sizeof(tarfs_index_record) > end || record->path_length >= sizeof(path)
+			|| offset + sizeof(tarfs_index_record) + record->path_length > end || record->data_start >= bdev_.nr_blocks()) {
+			valid = false;
+			break;
+		}
+
+		memops::memcpy(path, &data[offset + sizeof(tarfs_index_record)], record->path_length);
+		path[record->path_length] = 0;
+
+		add_entry(path, record->directory != 0, record->data_start, record->data_size);
+
+		offset += (sizeof(tarfs_index_record) + record->path_length + 7) & ~7ull;
+
+		sched::cond_resched();
+	}
+
+	delete[] data;
+
+	if (!valid) {
+		dprintf("tarfs: ignoring invalid stored index\n");
+
+		nr_entries_ = 0;
+		paths_length_ = 0;
+		return false;
+	}
+
+	return true;
+}
+
+void tar_filesystem::load_index()
+{
+	if (load_stored_index()) {
+		sort_entries();
+
+		root_.first_entry_ = 0;
+		root_.last_entry_ = nr_entries_;
+
+		dprintf("tarfs: read stored index of %llu entries\n", nr_entries_);
+		return;
+	}
+
+	u8 *chunk = new u8[index_chunk_blocks * 512];
+	u64 chunk_start = 0, chunk_length = 0;
 
 	u64 current_block = 0;
 	u64 last_block = bdev_.nr_blocks();
 	while (current_block < last_block) {
-		bdev_.read_blocks_sync(buffer, current_block, 1);
+		// Headers are read a chunk at a time, starting afresh at the next header once it is past the end of the
+		// chunk, which skips the data of any big file in between.
+		if (current_block >= chunk_start + chunk_length) {
+			chunk_start = current_block;
+			chunk_length = min(index_chunk_blocks, last_block - current_block);
+
+			if (!buffer_cache::get().read(bdev_, chunk, chunk_start, chunk_length)) {
+				dprintf("tarfs: unable to read blocks %llu-%llu, so indexing stops there\n", chunk_start, chunk_start + chunk_length - 1);
+				break;
+			}
+		}
 
-		const tar_file_header *header = (const tar_file_header *)buffer;
+		const tar_file_header *header = (const tar_file_header *)&chunk[(current_block - chunk_start) * 512];
 		if (header->file_path[0] == 0) {
 			break;
 		}
@@ -62,49 +223,139 @@ void tar_filesystem::load_tree()
 		current_block++;
 
 		u64 size = parse_octal(header->file_size, 12);
-		register_file(header, current_block, size);
+
+		// Headers that describe the next entry, rather than being one, such as GNU long names, and pax headers, are
+		// skipped, as is a stored index that wasn't used.
+		char type = header->file_type;
+		if (type != 'L' && type != 'K' && type != 'x' && type != 'g' && !is_stored_index(header, stored_index_name)) {
+			char path[sizeof(header->file_path) + 1];
+			memops::memcpy(path, header->file_path, sizeof(header->file_path));
+			path[sizeof(header->file_path)] = 0;
+
+			add_entry(path, type == '5', current_block, size);
+		}
 
 		// Skip the file data blocks
 		current_block += (((size + 511) >> 9));
+
+		sched::cond_resched();
 	}
+
+	delete[] chunk;
+
+	sort_entries();
+
+	root_.first_entry_ = 0;
+	root_.last_entry_ = nr_entries_;
+
+	dprintf("tarfs: indexed %llu entries\n", nr_entries_);
 }
 
-void tar_filesystem::register_file(const tar_file_header *header, u64 data_block_start, u64 data_size)
+void tar_filesystem::add_entry(const char *path, bool directory, u64 data_start, u64 data_size)
 {
-	const char *root_relative_name = &header->file_path[2];
-	if (*root_relative_name == 0) {
+	// Paths are relative to the root, with any leading "./" or "/", and any trailing slash, taken off.
+	if (path[0] == '.' && path[1] == '/') {
+		path += 2;
+	}
+
+	while (*path == '/') {
+		path++;
+	}
+
+	u64 length = memops::strlen(path);
+	while (length && path[length - 1] == '/') {
+		length--;
+	}
+
+	if (!length) {
 		return;
 	}
 
-	list<string> path_components = string(root_relative_name).split('/', false);
+	if (nr_entries_ == entries_capacity_) {
+		entries_capacity_ = entries_capacity_ ? entries_capacity_ * 2 : 64;
 
-	// dprintf("processing: %s\n", root_relative_name);
+		entry *entries = new entry[entries_capacity_];
+		memops::memcpy(entries, entries_, nr_entries_ * sizeof(entry));
 
-	tarfs_node *current_node = &root_;
-	while (!path_components.empty()) {
-		auto component = path_components.dequeue();
+		delete[] entries_;
+		entries_ = entries;
+	}
 
-		// dprintf("  component: %s\n", component.c_str());
+	if (paths_length_ + length > paths_capacity_) {
+		paths_capacity_ = max(paths_length_ + length, paths_capacity_ ? paths_capacity_ * 2 : 4096);
+
+		char *paths = new char[paths_capacity_];
+		memops::memcpy(paths, paths_, paths_length_);
+
+		delete[] paths_;
+		paths_ = paths;
+	}
+
+	memops::memcpy(&paths_[paths_length_], path, length);
+	entries_[nr_entries_++] = { paths_length_, length, data_start, data_size, directory };
+
+	paths_length_ += length;
+}
+
+/**
+ * @brief Compares two paths so that everything beneath a directory sorts straight after it: the end of a path comes
+ * before anything else, and a slash before any other character.
+ */
+static int compare_paths(const char *a, u64 a_length, const char *b, u64 b_length)
+{
+	for (u64 i = 0; i < a_length && i < b_length; i++) {
+		unsigned int ca = a[i] == '/' ? 0 : (u8)a[i];
+		unsigned int cb = b[i] == '/' ? 0 : (u8)b[i];
 
-		if (path_components.empty()) {
-			// This is the last component, i.e. the final file.
-			tarfs_node *existing_child = (tarfs_node *)current_node->resolve_child(component);
-			if (existing_child != nullptr) {
-				panic("file already exists");
+		if (ca != cb) {
+			return ca < cb ? -1 : 1;
+		}
+	}
+
+	return a_length == b_length ? 0 : (a_length < b_length ? -1 : 1);
+}
+
+void tar_filesystem::sort_entries()
+{
+	// A bottom-up merge sort, which is stable, so that where a path appears twice, the later one stays later.
+	entry *from = entries_;
+	entry *to = new entry[entries_capacity_];
+
+	for (u64 width = 1; width < nr_entries_; width *= 2) {
+		for (u64 start = 0; start < nr_entries_; start += width * 2) {
+			u64 mid = min(start + width, nr_entries_);
+			u64 end = min(start + (width * 2), nr_entries_);
+
+			u64 l = start, r = mid, out = start;
+			while (l < mid && r < end) {
+				const entry &a = from[l];
+				const entry &b = from[r];
+
+				if (compare_paths(entry_path(b), b.path_length, entry_path(a), a.path_length) < 0) {
+					to[out++] = from[r++];
+				} else {
+					to[out++] = from[l++];
+				}
 			}
 
-			current_node->add_child(component, fs_node_kind::file, data_block_start, data_size);
-			break;
-		} else {
-			// This is part of the path.
-			tarfs_node *existing_child = (tarfs_node *)current_node->resolve_child(component);
-			if (existing_child == nullptr) {
-				existing_child = current_node->add_child(component, fs_node_kind::directory, 0, 0);
+			while (l < mid) {
+				to[out++] = from[l++];
+			}
+
+			while (r < end) {
+				to[out++] = from[r++];
 			}
 
-			current_node = existing_child;
+			sched::cond_resched();
 		}
+
+		entry *tmp = from;
+		from = to;
+		to = tmp;
 	}
+
+	entries_ = from;
+	delete[] to;
 }
 
 size_t tarfs_file::pread(void *buffer, size_t offset, size_t length)
@@ -120,7 +371,9 @@ size_t tarfs_file::pread(void *buffer, size_t offset, size_t length)
 		// dprintf("tarfs: pread: block=%d len=%d\n", current_file_block, length);
 		//   Need to read into a buffer, in case length < buffer size
 		char block_buffer[512];
-		read_file_blocks(block_buffer, current_file_block, 1);
+		if (!read_file_blocks(block_buffer, current_file_block, 1)) {
+			return orig_length - length;
+		}
 
 		u64 amount_to_copy = min(length, (size_t)(sizeof(block_buffer) - start_block_offset));
 		// dprintf("tarfs: atc: %lu, sbo: %lu\n", amount_to_copy, start_block_offset);
@@ -138,4 +391,4 @@ size_t tarfs_file::pread(void *buffer, size_t offset, size_t length)
 
 size_t tarfs_file::pwrite(const void *buffer, size_t offset, size_t length) { return 0; }
 
-void tarfs_file::read_file_blocks(void *buffer, u64 offset, u64 count) { fs_.bdev_.read_blocks_sync(buffer, data_start_ + offset, count); }
+bool tarfs_file::read_file_blocks(void *buffer, u64 offset, u64 count) { return buffer_cache::get().read(fs_.bdev_, buffer, data_start_ + offset, count); }
@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/fs/tmpfs.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::mem;
+
+tmpfs_page_tree::level *tmpfs_page_tree::allocate_level()
+{
+	static_assert(sizeof(level) == PAGE_SIZE);
+
+	page *pg = zeroed_page_pool::get().allocate();
+	return pg ? (level *)pg->base_address_ptr() : nullptr;
+}
+
+page *tmpfs_page_tree::get(u64 index) const
+{
+	if (!root_ || (index >> (slot_bits * levels_))) {
+		return nullptr;
+	}
+
+	level *lvl = root_;
+	for (unsigned int l = levels_ - 1; l > 0; l--) {
+		lvl = (level *)lvl->slots[(index >> (slot_bits * l)) & (nr_slots - 1)];
+		if (!lvl) {
+			return nullptr;
+		}
+	}
+
+	return (page *)lvl->slots[index & (nr_slots - 1)];
+}
+
+bool tmpfs_page_tree::set(u64 index, page *pg)
+{
+	if (!root_) {
+		root_ = allocate_level();
+		if (!root_) {
+			return false;
+		}
+
+		levels_ = 1;
+	}
+
+	// A new level goes on top, with the old tree as its first slot.
+	while (index >> (slot_bits * levels_)) {
+		level *top = allocate_level();
+		if (!top) {
+			return false;
+		}
+
+		top->slots[0] = root_;
+		root_ = top;
+		levels_++;
+	}
+
+	level *lvl = root_;
+	for (unsigned int l = levels_ - 1; l > 0; l--) {
+		void *&slot = lvl->slots[(index >> (slot_bits * l)) & (nr_slots - 1)];
+		if (!slot) {
+			slot = allocate_level();
+			if (!slot) {
+				return false;
+			}
+		}
+
+		lvl = (level *)slot;
+	}
+
+	lvl->slots[index & (nr_slots - 1)] = pg;
+	return true;
+}
+
+tmpfs_file::tmpfs_file(tmpfs_node &node)
+	: file(0)
+	, node_(node)
+{
+	unique_irq_lock l(node_.pages_lock_);
+	node_.open_files_++;
+}
+
+tmpfs_file::~tmpfs_file()
+{
+	unique_irq_lock l(node_.pages_lock_);
+	if (--node_.open_files_) {
+		return;
+	}
+
+	// Nothing can have the file mapped now, as every mapping holds an open file, so the pages past the end can go.
+	tmpfs &fs = node_.tmp();
+	node_.pages_.remove_from(PAGE_ALIGN_UP(node_.size_) >> PAGE_BITS, [&fs](page *pg) {
+		pg->set_cached(false);
+		memory_manager::get().pgalloc().free_pages(*pg, 0);
+		fs.uncharge_page();
+	});
+}
+
+u64 tmpfs_file::size() const { return node_.size(); }
+
+size_t tmpfs_file::pread(void *buffer, size_t offset, size_t length)
+{
+	u64 size = node_.size();
+	if (offset >= size) {
+		return 0;
+	}
+
+	length = min(length, (size_t)(size - offset));
+
+	// The pages can't be freed while the file is open, so they are copied from without the lock.
+	size_t done = 0;
+	while (done < length) {
+		u64 pos = offset + done;
+		size_t chunk = min(length - done, (size_t)(PAGE_SIZE - (pos & ~PAGE_MASK)));
+
+		page *pg = node_.page_at(pos >> PAGE_BITS, false);
+		if (pg) {
+			memops::memcpy((u8 *)buffer + done, (u8 *)pg->base_address_ptr() + (pos & ~PAGE_MASK), chunk);
+		} else {
+			memops::bzero((u8 *)buffer + done, chunk);
+		}
+
+		done += chunk;
+	}
+
+	return done;
+}
+
+size_t tmpfs_file::pwrite(const void *buffer, size_t offset, size_t length)
+{
+	// Nothing can be written past what the file system could hold, which also keeps the page tree a sensible height.
+	u64 limit = node_.tmp().max_pages() << PAGE_BITS;
+	if (offset >= limit) {
+		return 0;
+	}
+
+	length = min(length, (size_t)(limit - offset));
+
+	sched::mutex_lock l(node_.lock_);
+
+	size_t done = 0;
+	while (done < length) {
+		u64 pos = offset + done;
+		size_t chunk = min(length - done, (size_t)(PAGE_SIZE - (pos & ~PAGE_MASK)));
+
+		// The file system is full.
+		page *pg = node_.page_at(pos >> PAGE_BITS, true);
+		if (!pg) {
+			break;
+		}
+
+		memops::memcpy((u8 *)pg->base_address_ptr() + (pos & ~PAGE_MASK), (const u8 *)buffer + done, chunk);
+		done += chunk;
+	}
+
+	if (offset + done > node_.size_) {
+		__atomic_store_n(&node_.size_, offset + done, __ATOMIC_RELEASE);
+	}
+
+	return done;
+}
+
+bool tmpfs_file::truncate(u64 size)
+{
+	if (size > (node_.tmp().max_pages() << PAGE_BITS)) {
+		return false;
+	}
+
+	sched::mutex_lock l(node_.lock_);
+
+	// Whatever is cut off is zeroed, so that it reads as zeros if the file grows again.  Growing the file only leaves
+	// a hole.
+	if (size < node_.size_) {
+		node_.zero_range(size, node_.size_ - size);
+	}
+
+	__atomic_store_n(&node_.size_, size, __ATOMIC_RELEASE);
+	return true;
+}
+
+page *tmpfs_file::own_page(u64 index)
+{
+	if (index >= (PAGE_ALIGN_UP(node_.size()) >> PAGE_BITS)) {
+		return nullptr;
+	}
+
+	// A hole is filled in, so that writes through the mapping land in the file.
+	return node_.page_at(index, true);
+}
+
+tmpfs &tmpfs_node::tmp() const { return (tmpfs &)fs(); }
+
+shared_ptr<file> tmpfs_node::open()
+{
+	if (kind() != fs_node_kind::file) {
+		return nullptr;
+	}
+
+	return shared_ptr<file>(new tmpfs_file(*this));
+}
+
+tmpfs_node *tmpfs_node::add_child(const char *name, fs_node_kind kind)
+{
+	if (this->kind() != fs_node_kind::directory || !*name) {
+		return nullptr;
+	}
+
+	for (const char *p = name; *p; p++) {
+		if (*p == '/') {
+			return nullptr;
+		}
+	}
+
+	string child_name(name);
+	tmpfs_node *node;
+
+	{
+		sched::mutex_lock l(children_lock_);
+		if (children_.find(child_name)) {
+			return nullptr;
+		}
+
+		node = new tmpfs_node(tmp(), this, kind, child_name);
+		children_.insert(node);
+	}
+
+	child_added(child_name);
+	return node;
+}
+
+fs_node *tmpfs_node::resolve_child(const string_view &name)
+{
+	sched::mutex_lock l(children_lock_);
+	return children_.find(name);
+}
+
+fs_node *tmpfs_node::child_at(u64 index)
+{
+	sched::mutex_lock l(children_lock_);
+	return children_.at(index);
+}
+
+page *tmpfs_node::page_at(u64 index, bool allocate)
+{
+	unique_irq_lock l(pages_lock_);
+
+	page *pg = pages_.get(index);
+	if (pg || !allocate) {
+		return pg;
+	}
+
+	if (!tmp().charge_page()) {
+		return nullptr;
+	}
+
+	pg = zeroed_page_pool::get().allocate();
+	if (!pg) {
+		tmp().uncharge_page();
+		return nullptr;
+	}
+
+	if (!pages_.set(index, pg)) {
+		memory_manager::get().pgalloc().free_pages(*pg, 0);
+		tmp().uncharge_page();
+		return nullptr;
+	}
+
+	// Address spaces treat a cached page as shared: they never free it when they unmap it.
+	pg->set_cached(true);
+	return pg;
+}
+
+void tmpfs_node::zero_range(u64 offset, u64 length)
+{
+	u64 done = 0;
+	while (done < length) {
+		u64 pos = offset + done;
+		u64 chunk = min(length - done, (u64)(PAGE_SIZE - (pos & ~PAGE_MASK)));
+
+		page *pg = page_at(pos >> PAGE_BITS, false);
+		if (pg) {
+			memops::bzero((u8 *)pg->base_address_ptr() + (pos & ~PAGE_MASK), chunk);
+		}
+
+		done += chunk;
+	}
+}
+
+bool tmpfs::charge_page()
+{
+	u64 used = __atomic_load_n(&used_pages_, __ATOMIC_RELAXED);
+	do {
+		if (used >= max_pages_) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&used_pages_, &used, used + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return true;
+}
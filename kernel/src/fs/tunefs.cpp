@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/fs/tunefs.h>
+#include <stacsos/memops.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+
+tunefs::tunefs()
+	: root_(new tunefs_node(*this, nullptr, fs_node_kind::directory, "", nullptr))
+{
+	tunables::get().set_listener(*this);
+}
+
+void tunefs::tunable_added(tunable &t)
+{
+	tunefs_node *dir = root_;
+	const char *component = t.path;
+
+	while (*component) {
+		const char *end = component;
+		while (*end && *end != '/') {
+			end++;
+		}
+
+		string name(component, end - component);
+		bool last = !*end;
+
+		tunefs_node *child;
+		{
+			unique_irq_lock l(dir->children_lock_);
+
+			child = dir->children_.find(name);
+			if (!child) {
+				child = new tunefs_node(*this, dir, last ? fs_node_kind::file : fs_node_kind::directory, name, last ? &t : nullptr);
+				dir->children_.insert(child);
+			}
+		}
+
+		dir->child_added(name);
+
+		if (last || child->kind() != fs_node_kind::directory) {
+			return;
+		}
+
+		dir = child;
+		component = end + 1;
+	}
+}
+
+fs_node *tunefs_node::resolve_child(const string_view &name)
+{
+	unique_irq_lock l(children_lock_);
+	return children_.find(name);
+}
+
+fs_node *tunefs_node::child_at(u64 index)
+{
+	unique_irq_lock l(children_lock_);
+	return children_.at(index);
+}
+
+/*
+ * An open tunable.  Each read renders the value as it is at the time, and each write is one whole new value.
+ */
+class tunable_file : public file {
+public:
+	tunable_file(tunable &t)
+		: file(0)
+		, tunable_(t)
+	{
+	}
+
+	virtual u64 size() const override
+	{
+		char text[24];
+		return render(text);
+	}
+
+	virtual size_t pread(void *buffer, size_t offset, size_t length) override
+	{
+		char text[24];
+		size_t text_length = render(text);
+
+		if (offset >= text_length) {
+			return 0;
+		}
+
+		size_t n = min(length, text_length - offset);
+		memops::memcpy(buffer, text + offset, n);
+
+		return n;
+	}
+
+	virtual size_t pwrite(const void *buffer, size_t offset, size_t length) override
+	{
+		char text[24];
+		if (offset || !length || length >= sizeof(text)) {
+			return 0;
+		}
+
+		memops::memcpy(text, buffer, length);
+		text[length] = 0;
+
+		// A decimal number, optionally followed by a newline (as echo writes).
+		u64 value = 0;
+		size_t i = 0;
+		while (text[i] >= '0' && text[i] <= '9') {
+			u64 digit = text[i] - '0';
+			if (value > (~0ull - digit) / 10) {
+				return 0;
+			}
+
+			value = (value * 10) + digit;
+			i++;
+		}
+
+		if (!i || (text[i] && !(text[i] == '\n' && !text[i + 1]))) {
+			return 0;
+		}
+
+		return tunables::get().set(tunable_, value) ? length : 0;
+	}
+
+private:
+	tunable &tunable_;
+
+	size_t render(char (&text)[24]) const
+	{
+		int r = snprintf(text, sizeof(text), "%llu\n", tunables::get().get(tunable_));
+		return r > 0 ? min((size_t)r, sizeof(text) - 1) : 0;
+	}
+};
+
+shared_ptr<file> tunefs_node::open()
+{
+	if (!tunable_) {
+		return nullptr;
+	}
+
+	return shared_ptr<file>(new tunable_file(*tunable_));
+}
@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/smp-call.h>
+#include <stacsos/kernel/irq-trace.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+
+#if STACSOS_IRQ_TRACE
+void stacsos::kernel::irq_trace_disabled() { irq_tracer::get().section_start(); }
+void stacsos::kernel::irq_trace_enabling() { irq_tracer::get().section_end((u64)__builtin_return_address(0)); }
+#endif
+
+void irq_tracer::section_start()
+{
+	if (!__atomic_load_n(&armed_, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	per_core_trace &t = cores_.get();
+	irq_off_section &s = t.current;
+	s.depth = 0;
+
+	// As with the profiler, only frames between here and the top of the thread's kernel stack are followed.
+	u64 stack_top;
+	asm volatile("mov %%gs:0x18, %0" : "=r"(stack_top));
+
+	if (stack_top) {
+		u64 fp = (u64)__builtin_frame_address(0);
+		u64 lowest = fp;
+
+		while (s.depth < irq_off_section::max_depth && fp >= lowest && fp + 16 <= stack_top && !(fp & 7)) {
+			const u64 *frame = (const u64 *)fp;
+			if (!frame[1]) {
+				break;
+			}
+
+			s.stack[s.depth++] = frame[1];
+
+			lowest = fp + 16;
+			fp = frame[0];
+		}
+	}
+
+	// The section is timed from after the stack walk, so that the tracer's own cost isn't counted.
+	t.started_at = __builtin_ia32_rdtsc();
+}
+
+void irq_tracer::section_end(u64 end)
+{
+	if (!__atomic_load_n(&armed_, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	u64 now = __builtin_ia32_rdtsc();
+
+	per_core_trace &t = cores_.get();
+	if (!t.started_at) {
+		return;
+	}
+
+	u64 cycles = now - t.started_at;
+	t.started_at = 0;
+	t.nr_sections++;
+
+	if (cycles <= t.worst[max_worst - 1].cycles) {
+		return;
+	}
+
+	unsigned int i = max_worst - 1;
+	while (i > 0 && t.worst[i - 1].cycles < cycles) {
+		t.worst[i] = t.worst[i - 1];
+		i--;
+	}
+
+	t.worst[i] = t.current;
+	t.worst[i].cycles = cycles;
+	t.worst[i].end = end;
+}
+
+void irq_tracer::reset()
+{
+	// Each core's sections are only ever written by that core, so each core forgets its own.
+	smp_call_function(~0ull, reset_core, this, true);
+}
+
+void irq_tracer::reset_core(void *arg)
+{
+	per_core_trace &t = ((irq_tracer *)arg)->cores_.get();
+
+	t.nr_sections = 0;
+	for (auto &s : t.worst) {
+		s.cycles = 0;
+		s.depth = 0;
+	}
+}
+
+// The most a section's line takes: the core, cycles, microseconds and end address, and a return address for each frame.
+static const size_t max_line_prefix = 80;
+static const size_t max_line_frame = 17;
+
+size_t irq_tracer::render_size_hint()
+{
+	return 256 + (core_manager::max_cores * (64 + (max_worst * (max_line_prefix + (irq_off_section::max_depth * max_line_frame)))));
+}
+
+size_t irq_tracer::render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	if (!built_in()) {
+		EMIT("# interrupts-disabled tracing isn't built in (build with irq-trace=1)\n");
+		return n;
+	}
+
+	u64 cycles_per_us = max(core::this_core().timestamp_frequency() / 1000000, 1ull);
+
+	EMIT("# core cycles us end [start return addresses...]\n");
+
+	for (int c = 0; c < core_manager::max_cores; c++) {
+		const per_core_trace &t = cores_[c];
+		if (!t.nr_sections) {
+			continue;
+		}
+
+		EMIT("# core %d: %llu sections\n", c, t.nr_sections);
+
+		for (const auto &s : t.worst) {
+			if (!s.cycles) {
+				break;
+			}
+
+			EMIT("%d %llu %llu %llx", c, s.cycles, s.cycles / cycles_per_us, s.end);
+			for (unsigned int d = 0; d < min((unsigned int)s.depth, irq_off_section::max_depth); d++) {
+				EMIT(" %llx", s.stack[d]);
+			}
+			EMIT("\n");
+		}
+	}
+
+#undef EMIT
+
+	return n;
+}
@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/kernel-log.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+
+void kernel_log::copy_in(per_core_log &l, u64 position, const void *src, size_t length)
+{
+	u64 offset = position % ring_size;
+	size_t first = min(length, (size_t)(ring_size - offset));
+
+	memops::memcpy(&l.data[offset], src, first);
+	memops::memcpy(&l.data[0], (const u8 *)src + first, length - first);
+}
+
+void kernel_log::copy_out(const per_core_log &l, u64 position, void *dest, size_t length) const
+{
+	u64 offset = position % ring_size;
+	size_t first = min(length, (size_t)(ring_size - offset));
+
+	memops::memcpy(dest, &l.data[offset], first);
+	memops::memcpy((u8 *)dest + first, &l.data[0], length - first);
+}
+
+void kernel_log::append(const char *text, size_t length)
+{
+	length = min(length, max_message_length);
+	if (!length) {
+		return;
+	}
+
+	// With interrupts disabled, nothing else can append to this core's ring until the message is in.
+	u64 flags = irq_save();
+
+	per_core_log &l = cores_[core::this_core_id()];
+	u64 size = record_size(length);
+
+	// The oldest records are let go of before they are overwritten, so that a reader copying one of them out can tell
+	// that it has been.
+	while (l.head + size - l.tail > ring_size) {
+		record_header oldest;
+		copy_out(l, l.tail, &oldest, sizeof(oldest));
+
+		__atomic_store_n(&l.tail, l.tail + record_size(oldest.length), __ATOMIC_RELEASE);
+	}
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record_header header { __atomic_fetch_add(&sequence_, 1, __ATOMIC_RELAXED), length };
+	copy_in(l, l.head, &header, sizeof(header));
+	copy_in(l, l.head + sizeof(header), text, length);
+
+	// The record is published once it is all there.
+	__atomic_store_n(&l.head, l.head + size, __ATOMIC_RELEASE);
+
+	irq_restore(flags);
+}
+
+void kernel_log::start_cursor(cursor &c, bool at_end)
+{
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		c.positions[i] = __atomic_load_n(at_end ? &cores_[i].head : &cores_[i].tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+bool kernel_log::peek(const per_core_log &l, u64 &position, record_header &header) const
+{
+	while (true) {
+		u64 tail = __atomic_load_n(&l.tail, __ATOMIC_ACQUIRE);
+		if (position < tail) {
+			position = tail;
+		}
+
+		if (position == __atomic_load_n(&l.head, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+
+		copy_out(l, position, &header, sizeof(header));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&l.tail, __ATOMIC_ACQUIRE) <= position) {
+			return true;
+		}
+	}
+}
+
+size_t kernel_log::next(cursor &c, char *text, size_t size)
+{
+	while (true) {
+		// The oldest message at the front of any core's ring comes next.  One logged at the same moment on another
+		// core may not have been published yet, and comes out after it.
+		int best = -1;
+		record_header best_header;
+
+		for (int i = 0; i < core_manager::max_cores; i++) {
+			record_header header;
+			if (peek(cores_[i], c.positions[i], header) && (best < 0 || header.sequence < best_header.sequence)) {
+				best = i;
+				best_header = header;
+			}
+		}
+
+		if (best < 0) {
+			return 0;
+		}
+
+		const per_core_log &l = cores_[best];
+		u64 position = c.positions[best];
+
+		size_t length = min(best_header.length, (u64)size - 1);
+		copy_out(l, position + sizeof(record_header), text, length);
+
+		// If the message was overwritten while it was being copied, the cursor is moved on to what replaced it.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&l.tail, __ATOMIC_ACQUIRE) > position) {
+			continue;
+		}
+
+		c.positions[best] = position + record_size(best_header.length);
+
+		text[length] = 0;
+		return length;
+	}
+}
+
+size_t kernel_log::render(char *buffer, size_t size)
+{
+	cursor c;
+	start_cursor(c, false);
+
+	size_t n = 0;
+	char text[max_message_length + 1];
+
+	while (size_t length = next(c, text, sizeof(text))) {
+		length = min(length, size - n);
+		memops::memcpy(buffer + n, text, length);
+		n += length;
+
+		if (n == size) {
+			break;
+		}
+	}
+
+	return n;
+}
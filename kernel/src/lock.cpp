@@ -5,4 +5,79 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/lock.h>
+
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+
+// The queue nodes of each core.  A core only ever uses its own, with interrupts disabled, so they need no locking.
+static mcs_node mcs_nodes[core_manager::max_cores][mcs_lock::max_nodes_per_core];
+
+/**
+ * @brief Finds a free queue node of this core.  Locks need not be released in the order they were taken, so nodes
+ * are searched for, rather than kept as a stack.
+ */
+static mcs_node *get_mcs_node()
+{
+	mcs_node *nodes = mcs_nodes[core::this_core_id()];
+	for (int i = 0; i < mcs_lock::max_nodes_per_core; i++) {
+		if (!nodes[i].in_use) {
+			nodes[i].in_use = true;
+			return &nodes[i];
+		}
+	}
+
+	panic("too many mcs locks held at once");
+}
+
+void mcs_lock::lock(u64 *flags)
+{
+	*flags = irq_save();
+
+	mcs_node *node = get_mcs_node();
+	node->next = nullptr;
+	node->ready = 0;
+
+	mcs_node *prev = __atomic_exchange_n(&tail_, node, __ATOMIC_ACQ_REL);
+	if (prev) {
+		// Join the queue, then wait for the core in front to hand the lock over.
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+		while (!__atomic_load_n(&node->ready, __ATOMIC_ACQUIRE)) {
+			__relax();
+		}
+	}
+
+	holder_ = node;
+	stats_.acquired(prev != nullptr);
+}
+
+void mcs_lock::unlock(u64 flags)
+{
+	stats_.released();
+
+	mcs_node *node = holder_;
+	mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if (!next) {
+		// If nobody has queued up, the lock is simply left free.
+		mcs_node *expected = node;
+		if (__atomic_compare_exchange_n(&tail_, &expected, nullptr, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			node->in_use = false;
+			irq_restore(flags);
+			return;
+		}
+
+		// Someone has, but they haven't linked themselves in behind this node yet.
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+			__relax();
+		}
+	}
+
+	__atomic_store_n(&next->ready, 1, __ATOMIC_RELEASE);
+
+	node->in_use = false;
+	irq_restore(flags);
+}
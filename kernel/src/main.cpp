@@ -6,24 +6,54 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/arch/x86/x86-platform.h>
+#include <stacsos/kernel/benchmarks.h>
+#include <stacsos/kernel/boot-timeline.h>
 #include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/dev/console/physical-console.h>
+#include <stacsos/kernel/dev/console/virtio-console-device.h>
 #include <stacsos/kernel/dev/console/virtual-console.h>
 #include <stacsos/kernel/dev/devfs.h>
 #include <stacsos/kernel/dev/device-manager.h>
 #include <stacsos/kernel/dev/gfx/qemu-stdvga.h>
 #include <stacsos/kernel/dev/input/keyboard.h>
+#include <stacsos/kernel/dev/misc/boot-timeline-device.h>
 #include <stacsos/kernel/dev/misc/cmos-rtc.h>
+#include <stacsos/kernel/dev/misc/interrupts-device.h>
+#include <stacsos/kernel/dev/misc/iostat-device.h>
+#include <stacsos/kernel/dev/misc/irq-trace-device.h>
+#include <stacsos/kernel/dev/misc/kernel-log-device.h>
+#include <stacsos/kernel/dev/misc/meminfo-device.h>
+#include <stacsos/kernel/dev/misc/perf-device.h>
+#include <stacsos/kernel/dev/misc/profile-device.h>
+#include <stacsos/kernel/dev/misc/sched-trace-device.h>
+#include <stacsos/kernel/dev/misc/syscall-stats-device.h>
+#include <stacsos/kernel/dev/misc/tracepoints-device.h>
 #include <stacsos/kernel/dev/storage/ahci-storage-device.h>
+#include <stacsos/kernel/dev/storage/buffer-cache.h>
+#include <stacsos/kernel/dev/storage/ramdisk.h>
 #include <stacsos/kernel/dev/storage/partitioned-device.h>
 #include <stacsos/kernel/dev/tty/terminal.h>
+#include <stacsos/kernel/fs/fat.h>
 #include <stacsos/kernel/fs/filesystem.h>
+#include <stacsos/kernel/fs/tmpfs.h>
+#include <stacsos/kernel/fs/tunefs.h>
 #include <stacsos/kernel/fs/vfs.h>
+#include <stacsos/kernel/irq-trace.h>
 #include <stacsos/kernel/log.h>
+#include <stacsos/kernel/mem/compactor.h>
+#include <stacsos/kernel/mem/kernel-data-page.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/reclaimer.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/deferred-work.h>
 #include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/rcu.h>
+#include <stacsos/kernel/sched/sleeper.h>
+#include <stacsos/kernel/sched/softirq.h>
+#include <stacsos/kernel/sched/stack-pool.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos::kernel;
@@ -39,15 +69,77 @@ using namespace stacsos::kernel::sched;
 
 logger main_logger(logger::root_logger, "main");
 
-static void init_console()
+static void __init probe_buses() { device_manager::get().probe_buses(); }
+
+static void __init load_ramdisk()
+{
+	auto *rd = ramdisk::create_boot_ramdisk(device_manager::get().sysbus());
+	if (rd) {
+		device_manager::get().register_device(*rd);
+	}
+}
+
+static void __init register_misc_devices()
 {
 	auto &dm = device_manager::get();
 
 	auto rtc = new cmos_rtc(dm.sysbus());
 	dm.register_device(*rtc);
 
+	// Processes tell the time from the kernel data page, which starts from the RTC's wall clock time.
+	stacsos::kernel::mem::kernel_data_page::get().init(*rtc);
+
+	auto schedtrace = new sched_trace_device(dm.sysbus());
+	dm.register_device(*schedtrace);
+	dm.add_device_alias(*schedtrace, "schedtrace");
+
+	auto meminfo = new meminfo_device(dm.sysbus());
+	dm.register_device(*meminfo);
+	dm.add_device_alias(*meminfo, "meminfo");
+
+	auto iostat = new iostat_device(dm.sysbus());
+	dm.register_device(*iostat);
+	dm.add_device_alias(*iostat, "iostat");
+
+	auto klog = new kernel_log_device(dm.sysbus());
+	dm.register_device(*klog);
+	dm.add_device_alias(*klog, "klog");
+
+	auto tracepoints = new tracepoints_device(dm.sysbus());
+	dm.register_device(*tracepoints);
+	dm.add_device_alias(*tracepoints, "tracepoints");
+
+	auto syscallstats = new syscall_stats_device(dm.sysbus());
+	dm.register_device(*syscallstats);
+	dm.add_device_alias(*syscallstats, "syscalls");
+
+	auto profile = new profile_device(dm.sysbus());
+	dm.register_device(*profile);
+	dm.add_device_alias(*profile, "profile");
+
+	auto perf = new perf_device(dm.sysbus());
+	dm.register_device(*perf);
+	dm.add_device_alias(*perf, "perf");
+
+	auto interrupts = new interrupts_device(dm.sysbus());
+	dm.register_device(*interrupts);
+	dm.add_device_alias(*interrupts, "interrupts");
+
+	auto irqoff = new irq_trace_device(dm.sysbus());
+	dm.register_device(*irqoff);
+	dm.add_device_alias(*irqoff, "irqoff");
+
+	auto boottime = new boot_timeline_device(dm.sysbus());
+	dm.register_device(*boottime);
+	dm.add_device_alias(*boottime, "boottime");
+
 	auto kbd = new keyboard(dm.sysbus());
 	dm.register_device(*kbd);
+}
+
+static void __init init_console()
+{
+	auto &dm = device_manager::get();
 
 	auto phys_console = new physical_console(dm.sysbus(), dm.get_device_by_class<qemu_stdvga>(qemu_stdvga::qemu_stdvga_device_class));
 
@@ -74,10 +166,21 @@ static void init_console()
 	tty1->attach(*vc1);
 	dm.register_device(*tty1);
 
-	tty1->write_line("This is virtual console #2.  The debug logs are here!");
+	// The logs can go to a virtio console instead, which takes them a page at a time, rather than a byte at a time
+	// through the debug port.
+	device *hvc;
+	if (stacsos::memops::strcmp(config::get().get_option_or_default("log-console", "tty"), "virtio") == 0
+		&& dm.try_get_device_by_class(virtio_console_device::virtio_console_device_class, hvc)) {
+		tty1->write_line("This is virtual console #2.  The debug logs are on the virtio console.");
 
-	dprintf_set_console(tty1);
-	dprintf("dbg: switched to tty1\n");
+		dprintf_set_console((virtio_console_device *)hvc);
+		dprintf("dbg: switched to %s\n", hvc->name().c_str());
+	} else {
+		tty1->write_line("This is virtual console #2.  The debug logs are here!");
+
+		dprintf_set_console(tty1);
+		dprintf("dbg: switched to tty1\n");
+	}
 
 	phys_console->add_virtual_console(*vc0);
 	phys_console->add_virtual_console(*vc1);
@@ -90,40 +193,167 @@ static void init_console()
 	}
 
 	// abort();
+
+	dprintf_start_async();
 }
 
-static void continue_main()
+static void __init mount_root()
 {
-	main_logger.log(log_level::info, "now in kernel process");
-
-	device_manager::get().probe_buses();
-	init_console();
-
-	// Mount the root filesystem
+	// Mount the root filesystem, which is the first partition of the first disk, unless another device (such as the
+	// ramdisk, ram0) is given.
 	auto *root = vfs::get().lookup("/");
 	if (!root) {
 		panic("unable to acquire fs root");
 	}
 
-	auto &dev = device_manager::get().get_device_by_name<partition>("part0");
-	auto *fs = filesystem::create_from_bdev(dev, fs_type_hint::fat);
+	const char *root_name = config::get().get_option_or_default("root", "part0");
+	fs_type_hint root_type = stacsos::memops::strcmp(config::get().get_option_or_default("rootfs", "fat"), "tarfs") == 0 ? fs_type_hint::tarfs : fs_type_hint::fat;
+
+	auto &dev = device_manager::get().get_device_by_name<block_device>(root_name);
+	auto *fs = filesystem::create_from_bdev(dev, root_type);
 	if (!fs) {
 		panic("unable to create filesystem");
 	}
 
 	root->mount(*fs);
+	root->release();
+}
 
-	auto *devfs_dir = vfs::get().lookup("/")->mkdir("dev");
+static void __init mount_devfs()
+{
+	// The new directory is only kept in memory by the root directory until something is mounted on it.
+	auto *root = vfs::get().lookup("/");
+	auto *devfs_dir = root->mkdir("dev");
 	if (!devfs_dir) {
 		panic("unable to create directory for devfs");
 	}
 
 	devfs_dir->mount(*new devfs());
+	root->release();
+}
 
-	// Launch the init process
-	auto init_proc = process_manager::get().create_process("/usr/init", "");
+static void __init mount_tunefs()
+{
+	// Tunables appear in /dev/tune as they are registered, whether that is before or after it is mounted.
+	arch::core::add_tunables();
+	fat_file::add_tunables();
+
+	auto *dev_dir = vfs::get().lookup("/dev");
+	if (!dev_dir) {
+		panic("unable to acquire /dev");
+	}
+
+	auto *tune_dir = dev_dir->mkdir("tune");
+	if (!tune_dir) {
+		main_logger.log(log_level::warning, "unable to create directory for tunefs");
+	} else {
+		tune_dir->mount(*new tunefs());
+	}
+
+	dev_dir->release();
+}
+
+static void __init mount_tmpfs()
+{
+	// Scratch files go in /tmp, which is kept in memory, up to tmpfs-size MiB of file data.  A size of zero leaves it
+	// out.
+	u64 size_mb = config::get().get_option_u64_or_default("tmpfs-size", 256);
+	if (!size_mb) {
+		return;
+	}
+
+	auto *tmp_dir = vfs::get().lookup("/tmp");
+	if (!tmp_dir) {
+		auto *root = vfs::get().lookup("/");
+
+		tmp_dir = root->mkdir("tmp");
+		if (tmp_dir) {
+			tmp_dir->acquire();
+		}
+
+		root->release();
+	}
+
+	if (!tmp_dir || tmp_dir->kind() != fs_node_kind::directory) {
+		main_logger.log(log_level::warning, "unable to create directory for tmpfs");
+		if (tmp_dir) {
+			tmp_dir->release();
+		}
+
+		return;
+	}
+
+	tmp_dir->mount(*new tmpfs(MB(size_mb) >> PAGE_BITS));
+	tmp_dir->release();
+}
+
+/**
+ * Adds a step that started at the given timestamp, and has just finished, to the boot timeline.  Returns the time it
+ * finished, which is when the next step starts.
+ */
+static u64 record_step(const char *name, u64 start_tsc)
+{
+	u64 end_tsc = __builtin_ia32_rdtsc();
+	boot_timeline::get().record(name, start_tsc, end_tsc);
+
+	return end_tsc;
+}
+
+enum boot_stage_index { stage_buses, stage_ramdisk, stage_misc_devices, stage_console, stage_root, stage_devfs, stage_tunefs, stage_tmpfs };
+
+// Each stage runs on a thread of its own as soon as the ones it comes after have finished.  The console is drawn on
+// the display found on the PCI bus, and the root filesystem may be on a disk found there or on the ramdisk.
+static const boot_stage boot_stages[] = {
+	{ "buses", probe_buses, 0 },
+	{ "ramdisk", load_ramdisk, 0 },
+	{ "misc-devices", register_misc_devices, 0 },
+	{ "console", init_console, (1u << stage_buses) | (1u << stage_misc_devices) },
+	{ "root", mount_root, (1u << stage_buses) | (1u << stage_ramdisk) },
+	{ "devfs", mount_devfs, 1u << stage_root },
+	{ "tunefs", mount_tunefs, 1u << stage_devfs },
+	{ "tmpfs", mount_tmpfs, 1u << stage_root },
+};
+
+static void continue_main()
+{
+	main_logger.log(log_level::info, "now in kernel process");
+
+	// The interrupts-disabled tracer finds each core's state through the task it is running, which every core has now.
+	irq_tracer::get().start();
+
+	// Every core is online by now, so each can be given a thread to run the bottom halves of its interrupts.
+	softirq::get().start_threads();
+
+	// Memory that is only being used as a cache is given back from now on, when free memory runs low.
+	mem::reclaimer::get().start();
+
+	// Determine whether or not the RCU read-side sections are to be checked, before anything else relies on them.
+	if (stacsos::memops::strcmp(config::get().get_option_or_default("rcu-selftest", "no"), "yes") == 0) {
+		sched::rcu::get().perform_selftest();
+	}
+
+	// Microbenchmarks of the kernel's hot paths are run with bench=<pattern>, before anything else is started, so that
+	// there is as little else going on as possible.
+	const char *bench_pattern = config::get().get_option("bench");
+	if (bench_pattern && *bench_pattern) {
+		benchmarks::get().run(bench_pattern, config::get().get_option_u64_or_default("bench-samples", 1000));
+	}
+
+	boot_timeline::get().run_stages(boot_stages, ARRAY_SIZE(boot_stages));
+
+	// Every stage has finished, so nothing will run the boot-only code again.
+	mem::memory_manager::get().release_init_text();
+
+	// Templates of the programs in zygotes=<paths> are started before init, so that they are ready (or nearly) by the
+	// time it starts them.
+	process_manager::get().start_zygotes();
+
+	// Launch the init process, which can be replaced with another program (e.g. init=/usr/kbench), given the
+	// arguments in init-args.
+	const char *init_path = config::get().get_option_or_default("init", "/usr/init");
+	auto init_proc = process_manager::get().create_process(init_path, config::get().get_option_or_default("init-args", ""));
 	if (!init_proc) {
-		panic("unable to create init process");
+		panic("unable to create init process %s", init_path);
 	}
 
 	main_logger.log(log_level::info, "starting init process");
@@ -132,15 +362,36 @@ static void continue_main()
 
 __noreturn void main(const char *cmdline)
 {
+	stacsos::kernel::mem::kernel_data_page::get().record_boot();
+
 	debug_helper::get().parse_image();
 	stacsos::kernel::config::get().init(cmdline);
 
 	// Initialise the memory manager first, so we can allocate memory.
 	main_logger.log(log_level::info, "starting main kernel initialisation");
+
+	u64 tsc = __builtin_ia32_rdtsc();
 	stacsos::kernel::mem::memory_manager::get().init();
+	tsc = record_step("memory", tsc);
+
+	// Give the idle thread some housekeeping to do, while there's nothing else to run.
+	deferred_work::get().add_idle_task([] { return stack_pool::get().zero_one(); });
+	deferred_work::get().add_idle_task([] { return stacsos::kernel::mem::zeroed_page_pool::get().refill_one(); });
+	deferred_work::get().add_idle_task([] { return stacsos::kernel::mem::compactor::get().compact_one(); });
+	deferred_work::get().add_idle_task([] { return stacsos::kernel::dev::storage::buffer_cache::get().write_back_some(); });
+
+	// Timer callbacks expect to be run with interrupts disabled, as they were when the tick ran them, and anything
+	// waiting for one that has been taken off the queue spins until it has finished.
+	softirq::get().register_handler(softirq_vector::timer, [] {
+		u64 flags = irq_save();
+		sleeper::get().check_wakeup();
+		irq_restore(flags);
+	});
 
 	// Now, initialise the core manager, which looks after CPU resources.
+	tsc = __builtin_ia32_rdtsc();
 	stacsos::kernel::arch::core_manager::get().init();
+	tsc = record_step("cores", tsc);
 
 	// Next, initialise the VFS.
 	stacsos::kernel::fs::vfs::get().init();
@@ -148,9 +399,11 @@ __noreturn void main(const char *cmdline)
 	// Initialise the device manager, and probe the platform.
 	stacsos::kernel::dev::device_manager::get().init();
 	stacsos::kernel::arch::x86::x86_platform::get().probe();
+	tsc = record_step("platform", tsc);
 
 	// Initialise the process manager, so we can start running threads.
 	stacsos::kernel::sched::process_manager::get().init();
+	record_step("processes", tsc);
 
 	// Create the kernel process, and start it.
 	auto kp = stacsos::kernel::sched::process_manager::get().create_kernel_process(continue_main);
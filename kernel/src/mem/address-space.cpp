@@ -5,27 +5,91 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/x86/pcid.h>
 #include <stacsos/kernel/mem/address-space-region.h>
+#include <stacsos/kernel/fs/file.h>
 #include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/compactor.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-cache.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
 #include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/resource-account.h>
+#include <stacsos/kernel/tracepoints.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos;
 using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::arch::x86;
+
+/**
+ * @brief The page that a mapping points at, or the first page of the block, for a 2 MiB mapping.
+ */
+static page &mapped_block(const mapping &m)
+{
+	return page::get_from_base_address(m.size == mapping_size::m2m ? m.address & ~(MB(2) - 1) : m.address & PAGE_MASK);
+}
 
 address_space *address_space::create_linked(u64 alloc_rgn_start)
 {
 	auto linked_pt = pt_->create_linked_copy(pta_);
-	return new address_space(pta_, linked_pt, alloc_rgn_start);
+	return new address_space(pta_, linked_pt, pcid::allocate(), alloc_rgn_start);
 }
 
-address_space_region *address_space::alloc_region(u64 size, region_flags flags, bool allocate)
+address_space::~address_space()
+{
+	// Files that are windows onto device memory are told first, so that they stop asking for the mappings to be
+	// dropped while the page table is being destroyed.
+	for (address_space_region *rgn = regions_.first(); rgn; rgn = regions_.next(*rgn)) {
+		if (rgn->device) {
+			rgn->file->device_unmapped(*this);
+		}
+	}
+
+	address_space_region *rgn = regions_.first();
+	while (rgn) {
+		address_space_region *next = regions_.next(*rgn);
+
+		// The page table is about to go, so there's no need to unmap anything.
+		free_pages(*rgn, nullptr);
+		delete rgn;
+
+		rgn = next;
+	}
+
+	// The page table was linked to the root address space's, whose kernel mappings it still shares.
+	pt_->destroy_linked_copy(pta_);
+	pcid::free(pcid_);
+}
+
+address_space_region *address_space::alloc_region(u64 size, region_flags flags, bool allocate, u64 align, u64 guard_size)
 {
 	u64 aligned_size = PAGE_ALIGN_UP(size);
-	u64 base = next_alloc_rgn_;
-	next_alloc_rgn_ += aligned_size;
+	u64 aligned_guard_size = PAGE_ALIGN_UP(guard_size);
+
+	// The threads of a process may be allocating on several cores at once, so the base is claimed under the lock, as
+	// in map_file.
+	unique_irq_lock l(lock_);
+
+	u64 base = (next_alloc_rgn_ + align - 1) & ~(align - 1);
+	if (base >= user_access::user_limit || aligned_size > user_access::user_limit - base
+		|| aligned_guard_size > user_access::user_limit - base - aligned_size) {
+		return nullptr;
+	}
+
+	next_alloc_rgn_ = base + aligned_size + aligned_guard_size;
+
+	auto rgn = new address_space_region();
+	rgn->base = base;
+	rgn->size = size;
+	rgn->flags = flags;
+	rgn->backed = allocate;
 
-	return add_region(base, size, flags, allocate);
+	regions_.insert(*rgn);
+
+	return rgn;
 }
 
 address_space_region *address_space::add_region(u64 base, u64 size, region_flags flags, bool allocate)
@@ -34,32 +98,933 @@ address_space_region *address_space::add_region(u64 base, u64 size, region_flags
 	rgn->base = base;
 	rgn->size = size;
 	rgn->flags = flags;
+	rgn->backed = allocate;
 
 	//dprintf("as: add-region base=%lx size=%lx flags=%d alloc=%d\n", base, size, flags, allocate);
 
-	if (allocate) {
-		u64 pages = (size + (PAGE_SIZE - 1)) / PAGE_SIZE;
-		rgn->storage = memory_manager::get().pgalloc().allocate_pages(log2_ceil(pages), page_allocation_flags::zero);
+	unique_irq_lock l(lock_);
+	regions_.insert(*rgn);
 
-		u64 cur_virt = base;
-		u64 cur_phys = rgn->storage->base_address();
+	return rgn;
+}
 
-		for (u64 i = 0; i < pages; i++) {
-			//dprintf("map virt=%p phys=%p\n", cur_virt, cur_phys);
-			pt_->map(pta_, cur_virt, cur_phys, mapping_flags::present | mapping_flags::writable | mapping_flags::user_accessable, mapping_size::m4k);
-			cur_virt += PAGE_SIZE;
-			cur_phys += PAGE_SIZE;
-		}
+page *address_space::get_page(u64 address)
+{
+	unique_irq_lock l(lock_);
+
+	// Device memory has no pages to hand out.
+	address_space_region *rgn = find_region(address);
+	if (!rgn || !rgn->backed || rgn->device) {
+		return nullptr;
+	}
+
+	wait_for_migration(l, address);
+
+	// The region may have gone while waiting.
+	rgn = find_region(address);
+	if (!rgn || !rgn->backed || rgn->device) {
+		return nullptr;
+	}
+
+	page *pg;
+
+	mapping m = pt_->get_mapping(address);
+	if (m.result == mapping_result::ok) {
+		pg = &page::get_from_base_address(m.address & PAGE_MASK);
 	} else {
-		rgn->storage = nullptr;
+		pg = rgn->file ? populate_file(l, *rgn, address) : populate(*rgn, address);
+	}
+
+	if (pg) {
+		pg->pin();
 	}
 
-	regions_.append(rgn);
+	return pg;
+}
+
+bool address_space::pin_for_write(u64 base, u64 size)
+{
+	unique_irq_lock l(lock_);
+
+	for (u64 address = base & PAGE_MASK; address < base + size; address += PAGE_SIZE) {
+		// Populating a page from a file drops the lock, so each page is looked at again after anything is changed.
+		while (true) {
+			wait_for_migration(l, address);
+
+			address_space_region *rgn = find_region(address);
+			if (!rgn || !rgn->backed || rgn->device || (rgn->flags & region_flags::writable) != region_flags::writable) {
+				return false;
+			}
+
+			mapping m = pt_->get_mapping(address);
+			if (m.result != mapping_result::ok) {
+				if (!(rgn->file ? populate_file(l, *rgn, address) : populate(*rgn, address))) {
+					return false;
+				}
+
+				continue;
+			}
+
+			if (mapped_block(m).cow()) {
+				if (!break_cow(address, mapped_block(m), m.size)) {
+					return false;
+				}
+
+				continue;
+			}
+
+			page &pg = page::get_from_base_address(m.address & PAGE_MASK);
+			if (pg.cached() && !rgn->shared) {
+				if (!copy_on_write(address, pg)) {
+					return false;
+				}
+
+				continue;
+			}
+
+			pg.pin();
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool address_space::populate_range(u64 base, u64 size)
+{
+	unique_irq_lock l(lock_);
+
+	u64 address = base & PAGE_MASK;
+	while (address < base + size) {
+		wait_for_migration(l, address);
+
+		address_space_region *rgn = find_region(address);
+		if (!rgn || !rgn->backed || rgn->file || rgn->device) {
+			return false;
+		}
+
+		// Populating may map a large page, which covers the rest of its 2 MiB.
+		mapping m = pt_->get_mapping(address);
+		if (m.result != mapping_result::ok) {
+			if (!populate(*rgn, address)) {
+				return false;
+			}
+
+			m = pt_->get_mapping(address);
+		}
+
+		address = m.size == mapping_size::m2m ? (address & ~(MB(2) - 1)) + MB(2) : address + PAGE_SIZE;
+	}
+
+	return true;
+}
+
+void address_space::wait_for_migration(unique_irq_lock &l, u64 address)
+{
+	// The compactor waits for every core that has the address space loaded to drop the old translation, which this
+	// core would never do while spinning with interrupts disabled, so the shootdown is dealt with here by hand.
+	while (migrating_address_ && migrating_address_ == (address & PAGE_MASK)) {
+		l.unlock();
+		tlb_batch::handle_ipi();
+		asm volatile("pause");
+		l.lock();
+	}
+}
+
+bool address_space::range_accessible(u64 base, u64 size, region_flags access)
+{
+	unique_irq_lock l(lock_);
+
+	u64 end = base + size;
+	while (base < end) {
+		address_space_region *rgn = find_region(base);
+		if (!rgn || !rgn->backed || (rgn->flags & access) != access) {
+			return false;
+		}
+
+		base = rgn->base + rgn->size;
+	}
+
+	return true;
+}
+
+DEFINE_TRACEPOINT(page_fault, "as=%llx address=%llx");
+
+bool address_space::handle_fault(u64 address)
+{
+	TRACEPOINT(page_fault, this, address);
+
+	unique_irq_lock l(lock_);
+
+	address_space_region *rgn = find_region(address);
+	if (!rgn || !rgn->backed) {
+		return false;
+	}
+
+	// A page that is being moved is mapped again soon, so the faulting access is simply tried again.
+	if (migrating_address_ && migrating_address_ == (address & PAGE_MASK)) {
+		return true;
+	}
+
+	// If the page is already there, this must have been a protection fault, which can only be fixed up if it was a
+	// write to a page shared from the page cache, or by a fork, in a region that may be written to.
+	mapping m = pt_->get_mapping(address);
+	if (m.result == mapping_result::ok) {
+		if (rgn->device || (rgn->flags & region_flags::writable) != region_flags::writable) {
+			return false;
+		}
+
+		page &block = mapped_block(m);
+		if (block.cow()) {
+			return break_cow(address, block, m.size);
+		}
+
+		// Another thread may have copied the page while this one waited for the lock, in which case the write just
+		// has to be tried again.  Private pages are always mapped writable.
+		page &pg = page::get_from_base_address(m.address & PAGE_MASK);
+		if (!pg.cached()) {
+			return true;
+		}
+
+		if (m.size != mapping_size::m4k || rgn->shared) {
+			return false;
+		}
+
+		return copy_on_write(address & PAGE_MASK, pg);
+	}
+
+	if (rgn->device) {
+		return map_device_frame(*rgn, address);
+	}
+
+	return (rgn->file ? populate_file(l, *rgn, address) : populate(*rgn, address)) != nullptr;
+}
+
+bool address_space::map_device_frame(address_space_region &rgn, u64 address)
+{
+	u64 frame = rgn.file->device_frame((rgn.file_offset + ((address & PAGE_MASK) - rgn.base)) >> PAGE_BITS);
+	if (!frame) {
+		return false;
+	}
+
+	// Device memory is always shared, so the mapping is writable if the region is.
+	mapping_flags flags = mapping_flags::present | mapping_flags::user_accessable;
+	if ((rgn.flags & region_flags::writable) == region_flags::writable) {
+		flags |= mapping_flags::writable;
+	}
+
+	pt_->map(pta_, address & PAGE_MASK, frame, flags, mapping_size::m4k);
+	resident_pages_++;
+	shared_pages_++;
+
+	return true;
+}
+
+void address_space::unmap_device_file(const fs::file &file)
+{
+	unique_irq_lock l(lock_);
+
+	tlb_batch *batch = tlb_batch::create_user(cr3(), &active_cores_);
+
+	for (address_space_region *rgn = regions_.first(); rgn; rgn = regions_.next(*rgn)) {
+		if (rgn->device && rgn->file.get() == &file) {
+			free_pages(*rgn, batch);
+		}
+	}
+
+	batch->submit();
+}
+
+page *address_space::populate(address_space_region &rgn, u64 address)
+{
+	const mapping_flags flags = mapping_flags::present | mapping_flags::writable | mapping_flags::user_accessable;
+
+	// If the whole of the 2 MiB page around the address is in the region, and none of it has been touched yet, it is
+	// populated in one go with a large page, which saves page tables and TLB entries for big regions.
+	u64 large_base = address & ~(MB(2) - 1);
+	// If the block would take the process over its limit, a single page may still fit.
+	if (large_base >= rgn.base && large_base + MB(2) <= rgn.base + rgn.size && pt_->is_unmapped(large_base, mapping_size::m2m)
+		&& charge_pages(512)) {
+		page *block = memory_manager::get().pgalloc().allocate_pages(9, page_allocation_flags::zero | page_allocation_flags::movable);
+
+		if (block) {
+			pt_->map(pta_, large_base, block->base_address(), flags, mapping_size::m2m);
+			resident_pages_ += 512;
+			return &page::get_from_pfn(block->pfn() + ((address - large_base) >> PAGE_BITS));
+		}
+
+		uncharge_pages(512);
+
+		// Memory advised hugepage has a large page made for next time, at the cost of moving other pages.
+		if (rgn.advice == access_advice::hugepage) {
+			compactor::get().request(9);
+		}
+	}
+
+	if (!charge_pages(1)) {
+		return nullptr;
+	}
+
+	page *pg = zeroed_page_pool::get().allocate(page_allocation_flags::movable);
+	if (!pg) {
+		uncharge_pages(1);
+		return nullptr;
+	}
+
+	//dprintf("as: populate virt=%p phys=%p\n", address & PAGE_MASK, pg->base_address());
+	pt_->map(pta_, address & PAGE_MASK, pg->base_address(), flags, mapping_size::m4k);
+	pg->set_mapping(this, address & PAGE_MASK);
+	resident_pages_++;
+
+	return pg;
+}
+
+page *address_space::populate_file(unique_irq_lock &l, address_space_region &rgn, u64 address)
+{
+	shared_ptr<fs::file> file = rgn.file;
+	fs::fs_node *node = rgn.file_node;
+	u64 page_index = (rgn.file_offset + ((address & PAGE_MASK) - rgn.base)) >> PAGE_BITS;
+
+	// A file without a node keeps its own pages, which are always there.
+	if (!node) {
+		page *pg = file->own_page(page_index);
+		if (!pg) {
+			return nullptr;
+		}
+
+		return map_file_page(rgn, address, *pg);
+	}
+
+	// Reading the page in may have to wait for the disk, so the lock is dropped in the meantime.  The region may have
+	// gone, or the page been populated by another thread, by the time it is taken again.
+	bool writable = rgn.shared && (rgn.flags & region_flags::writable) == region_flags::writable;
+
+	// In a region advised sequential, the file is read ahead of the faults, every half a window.
+	const u64 pages_ahead = fault_ahead >> PAGE_BITS;
+	bool read_ahead = rgn.advice == access_advice::sequential && !(page_index % (pages_ahead / 2));
+
+	l.unlock();
+	page *pg = page_cache::get().get_page(*node, *file, page_index, writable);
+
+	if (read_ahead) {
+		file->advise((page_index + 1) << PAGE_BITS, fault_ahead, access_advice::willneed);
+	}
+
+	l.lock();
+
+	if (!pg) {
+		return nullptr;
+	}
+
+	// The mapping takes a reference of its own, so the one the cache handed out is dropped either way.
+	address_space_region *current = find_region(address);
+	page *mapped = (current == &rgn && current->file == file) ? map_file_page(rgn, address, *pg) : nullptr;
+	pg->release();
+
+	return mapped;
+}
+
+page *address_space::map_file_page(address_space_region &rgn, u64 address, page &pg)
+{
+	if (pt_->get_mapping(address).result == mapping_result::ok) {
+		return &pg;
+	}
+
+	// Only a shared mapping may write to the cached page.  A private one maps it read-only, and copies it on the first
+	// write.
+	mapping_flags flags = mapping_flags::present | mapping_flags::user_accessable;
+	if (rgn.shared && (rgn.flags & region_flags::writable) == region_flags::writable) {
+		flags |= mapping_flags::writable;
+	}
+
+	pt_->map(pta_, address & PAGE_MASK, pg.base_address(), flags, mapping_size::m4k);
+	pg.acquire();
+	resident_pages_++;
+	shared_pages_++;
+
+	return &pg;
+}
+
+address_space_region *address_space::map_file(shared_ptr<fs::file> file, fs::fs_node *node, u64 offset, u64 size, region_flags flags, bool shared)
+{
+	u64 aligned_size = PAGE_ALIGN_UP(size);
+
+	auto rgn = new address_space_region();
+	rgn->size = aligned_size;
+	rgn->flags = flags;
+	rgn->backed = true;
+	rgn->file = file;
+	rgn->file_node = node;
+	rgn->file_offset = offset;
+	rgn->shared = shared;
+	rgn->device = !node && file->device_frame(offset >> PAGE_BITS) != 0;
+
+	{
+		unique_irq_lock l(lock_);
+
+		rgn->base = next_alloc_rgn_;
+		next_alloc_rgn_ += aligned_size;
+
+		regions_.insert(*rgn);
+	}
+
+	// The file is told with the lock released, as it may need to drop the mappings straight away.
+	if (rgn->device) {
+		file->device_mapped(*this);
+	}
 
 	return rgn;
 }
 
+u64 address_space::sync_file(u64 base, u64 size)
+{
+	struct pending_write {
+		shared_ptr<fs::file> file;
+		page *pg;
+		u64 offset;
+	};
+
+	list<pending_write> writes;
+
+	{
+		unique_irq_lock l(lock_);
+
+		// Only the pages that have been touched can have been written to, and they stay in the page cache, so they can
+		// be written out after the lock has been dropped.
+		for (address_space_region *rgn = regions_.first(); rgn; rgn = regions_.next(*rgn)) {
+			// A file without a node keeps its own pages, so there is nowhere to write them back to.
+			if (!rgn->file || !rgn->file_node || !rgn->shared || rgn->base + rgn->size <= base || rgn->base >= base + size) {
+				continue;
+			}
+
+			u64 start = max(rgn->base, base & PAGE_MASK);
+			u64 end = min(rgn->base + rgn->size, base + size);
+
+			for (u64 addr = start; addr < end; addr += PAGE_SIZE) {
+				mapping m = pt_->get_mapping(addr);
+				if (m.result == mapping_result::ok) {
+					writes.append({ rgn->file, &page::get_from_base_address(m.address & PAGE_MASK), rgn->file_offset + (addr - rgn->base) });
+				}
+			}
+		}
+	}
+
+	u64 written = 0;
+	for (const pending_write &w : writes) {
+		if (w.offset < w.file->size()) {
+			written += w.file->pwrite(w.pg->base_address_ptr(), w.offset, min((u64)PAGE_SIZE, w.file->size() - w.offset));
+		}
+	}
+
+	return written;
+}
+
+bool address_space::map_shared(u64 address, page &pg)
+{
+	unique_irq_lock l(lock_);
+
+	address_space_region *rgn = find_region(address);
+	if (!rgn || !rgn->backed || migrating_address_ == (address & PAGE_MASK) || pt_->get_mapping(address).result == mapping_result::ok) {
+		return false;
+	}
+
+	pt_->map(pta_, address & PAGE_MASK, pg.base_address(), mapping_flags::present | mapping_flags::user_accessable, mapping_size::m4k);
+	pg.acquire();
+	resident_pages_++;
+	shared_pages_++;
+
+	return true;
+}
+
+bool address_space::copy_on_write(u64 address, page &shared)
+{
+	if (!charge_pages(1)) {
+		return false;
+	}
+
+	page *pg = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::movable);
+	if (!pg) {
+		uncharge_pages(1);
+		return false;
+	}
+
+	memops::memcpy(pg->base_address_ptr(), shared.base_address_ptr(), PAGE_SIZE);
+	pg->set_mapping(this, address);
+
+	// Other threads of the process may have the shared page in their TLBs, and must stop using it, as they'd
+	// otherwise not see what is about to be written to the copy.  The shared page belongs to the cache, so there is
+	// nothing to free, but the mapping's reference to it is only dropped once they have.
+	tlb_batch *batch = tlb_batch::create_user(cr3(), &active_cores_);
+	pt_->unmap(pta_, address, batch);
+	pt_->map(pta_, address, pg->base_address(), mapping_flags::present | mapping_flags::writable | mapping_flags::user_accessable,
+		mapping_size::m4k);
+	batch->release_after(shared);
+	batch->submit();
+
+	shared_pages_--;
+
+	return true;
+}
+
+bool address_space::break_cow(u64 address, page &shared, mapping_size size)
+{
+	const mapping_flags flags = mapping_flags::present | mapping_flags::writable | mapping_flags::user_accessable;
+
+	int order = size == mapping_size::m2m ? 9 : 0;
+	u64 base = order ? address & ~(MB(2) - 1) : address & PAGE_MASK;
+
+	// Once every other address space has let go of the page, the last one can have it back to itself.  None of them can
+	// take it again, as they no longer map it.  Nothing can hold a writable translation for it, so there's nothing to
+	// flush.
+	if (shared.refcount() == 1) {
+		shared.release();
+		shared.set_cow(false);
+
+		if (!order) {
+			shared.set_mapping(this, base);
+		}
+
+		pt_->map(pta_, base, shared.base_address(), flags, size);
+		return true;
+	}
+
+	// The copy was already charged for, when the shared page was mapped.
+	page *pg = memory_manager::get().pgalloc().allocate_pages(order, page_allocation_flags::movable);
+	if (!pg) {
+		return false;
+	}
+
+	memops::memcpy(pg->base_address_ptr(), shared.base_address_ptr(), PAGE_SIZE << order);
+
+	if (!order) {
+		pg->set_mapping(this, base);
+	}
+
+	tlb_batch *batch = tlb_batch::create_user(cr3(), &active_cores_);
+	pt_->unmap(pta_, base, batch);
+	pt_->map(pta_, base, pg->base_address(), flags, size);
+	batch->unshare_after(shared, order);
+	batch->submit();
+
+	return true;
+}
+
+bool address_space::clone_into(address_space &child)
+{
+	unique_irq_lock l(lock_);
+
+	// A page being moved by the compactor is unmapped until it has been copied, so it would be missed.  No other move
+	// can start while the lock is held.
+	while (migrating_address_) {
+		wait_for_migration(l, migrating_address_);
+	}
+
+	// The private pages that become shared are made read-only here, which the other cores running the address space
+	// have to see before the child can rely on the pages not changing.
+	tlb_batch *batch = tlb_batch::create_user(cr3(), &active_cores_);
+	list<shared_ptr<fs::file>> device_files;
+	bool ok = true;
+
+	for (address_space_region *rgn = regions_.first(); rgn && ok; rgn = regions_.next(*rgn)) {
+		auto copy = new address_space_region();
+		copy->base = rgn->base;
+		copy->size = rgn->size;
+		copy->flags = rgn->flags;
+		copy->backed = rgn->backed;
+		copy->file = rgn->file;
+		copy->file_node = rgn->file_node;
+		copy->file_offset = rgn->file_offset;
+		copy->shared = rgn->shared;
+		copy->device = rgn->device;
+		copy->advice = rgn->advice;
+
+		child.regions_.insert(*copy);
+
+		if (rgn->device) {
+			device_files.append(rgn->file);
+		} else if (rgn->backed) {
+			ok = clone_pages(*rgn, child, batch);
+		}
+	}
+
+	child.next_alloc_rgn_ = next_alloc_rgn_;
+
+	// The pages must stop changing before the child can run.  The lock is dropped first, as the other cores may be
+	// waiting for it with interrupts disabled, and so not answering the shootdown.
+	volatile bool flushed = false;
+	batch->call_after([](void *arg) { *(volatile bool *)arg = true; }, (void *)&flushed);
+
+	l.unlock();
+
+	batch->submit();
+	while (!flushed) {
+		asm volatile("pause");
+	}
+
+	// The child's destructor tells the files that it has gone, whether or not it was copied in full.
+	for (auto &file : device_files) {
+		file->device_mapped(child);
+	}
+
+	return ok;
+}
+
+bool address_space::clone_pages(address_space_region &rgn, address_space &child, tlb_batch *batch)
+{
+	const mapping_flags read_only = mapping_flags::present | mapping_flags::user_accessable;
+
+	u64 addr = rgn.base;
+	while (addr < rgn.base + rgn.size) {
+		mapping m = pt_->get_mapping(addr);
+		if (m.result != mapping_result::ok) {
+			addr += PAGE_SIZE;
+			continue;
+		}
+
+		int order = m.size == mapping_size::m2m ? 9 : 0;
+		u64 base = order ? addr & ~(MB(2) - 1) : addr;
+		page &pg = mapped_block(m);
+
+		addr = base + (PAGE_SIZE << order);
+
+		// Pages from the page cache are mapped just as they are here, and copied on write (or not) in the same way.
+		if (pg.cached()) {
+			mapping_flags flags = read_only;
+			if (rgn.shared && (rgn.flags & region_flags::writable) == region_flags::writable) {
+				flags |= mapping_flags::writable;
+			}
+
+			child.pt_->map(child.pta_, base, pg.base_address(), flags, m.size);
+			pg.acquire();
+			child.resident_pages_++;
+			child.shared_pages_++;
+			continue;
+		}
+
+		// Each address space is charged for the private pages it maps, whether or not they are still shared, so that
+		// writing to them never fails for want of memory that was never charged.
+		if (!child.charge_pages(1ull << order)) {
+			return false;
+		}
+
+		bool pinned = false;
+		for (u64 i = 0; i < (1ull << order); i++) {
+			pinned |= page::get_from_pfn(pg.pfn() + i).pinned();
+		}
+
+		if (pinned) {
+			page *copy = memory_manager::get().pgalloc().allocate_pages(order, page_allocation_flags::movable);
+			if (!copy) {
+				child.uncharge_pages(1ull << order);
+				return false;
+			}
+
+			memops::memcpy(copy->base_address_ptr(), pg.base_address_ptr(), PAGE_SIZE << order);
+			child.pt_->map(child.pta_, base, copy->base_address(), read_only | mapping_flags::writable, m.size);
+			child.resident_pages_ += 1ull << order;
+
+			if (!order) {
+				copy->set_mapping(&child, base);
+			}
+
+			continue;
+		}
+
+		// A private page becomes shared: it can no longer be moved by the compactor, as it has more than one mapping,
+		// and its owner can no longer write to it without copying it first.
+		if (!pg.cow()) {
+			pg.set_cow(true);
+			pg.clear_mapping();
+			pg.acquire();
+
+			pt_->map(pta_, base, pg.base_address(), read_only, m.size);
+			batch->add(base);
+		}
+
+		pg.acquire();
+		child.pt_->map(child.pta_, base, pg.base_address(), read_only, m.size);
+		child.resident_pages_ += 1ull << order;
+	}
+
+	return true;
+}
+
 void address_space::remove_region(u64 base, u64 size, region_flags flags)
 {
-	//
+	unique_irq_lock l(lock_);
+
+	// Find the first region that starts inside the range.
+	address_space_region *rgn = nullptr;
+	for (address_space_region *n = regions_.root(); n;) {
+		if (n->base >= base) {
+			rgn = n;
+			n = regions_.left(*n);
+		} else {
+			n = regions_.right(*n);
+		}
+	}
+
+	// Every unmapping is gathered into one batch, so that the other cores running this address space are only
+	// interrupted once, and the pages are only freed once none of them can reach them any more.
+	tlb_batch *batch = tlb_batch::create_user(cr3(), &active_cores_);
+
+	// Files that are windows onto device memory are told that their mappings have gone once the lock is released.
+	list<shared_ptr<fs::file>> device_files;
+
+	while (rgn && rgn->base < base + size) {
+		address_space_region *next = regions_.next(*rgn);
+
+		if (rgn->base + rgn->size <= base + size) {
+			free_pages(*rgn, batch);
+			regions_.remove(*rgn);
+
+			if (last_hit_ == rgn) {
+				last_hit_ = nullptr;
+			}
+
+			if (rgn->device) {
+				device_files.append(rgn->file);
+			}
+
+			delete rgn;
+		}
+
+		rgn = next;
+	}
+
+	batch->submit();
+	l.unlock();
+
+	for (auto &file : device_files) {
+		file->device_unmapped(*this);
+	}
+}
+
+bool address_space::advise(u64 base, u64 size, access_advice advice)
+{
+	if (advice > access_advice::hugepage) {
+		return false;
+	}
+
+	// The start is an address, or for a file, an offset in it.
+	struct pending_advice {
+		shared_ptr<fs::file> file;
+		u64 start, length;
+	};
+
+	// Populating and reading files are done once the lock has been dropped.
+	list<pending_advice> file_ranges;
+	list<pending_advice> anon_ranges;
+	bool found = false;
+
+	{
+		unique_irq_lock l(lock_);
+
+		tlb_batch *batch = advice == access_advice::dontneed ? tlb_batch::create_user(cr3(), &active_cores_) : nullptr;
+
+		for (address_space_region *rgn = regions_.first(); rgn; rgn = regions_.next(*rgn)) {
+			if (!rgn->backed || rgn->device || rgn->base + rgn->size <= base || rgn->base >= base + size) {
+				continue;
+			}
+
+			found = true;
+
+			u64 start = max(rgn->base, base & PAGE_MASK);
+			u64 end = min(rgn->base + rgn->size, PAGE_ALIGN_UP(base + size));
+
+			switch (advice) {
+			case access_advice::willneed:
+				if (!rgn->file) {
+					anon_ranges.append({ nullptr, start, end - start });
+				} else if (rgn->file_node) {
+					file_ranges.append({ rgn->file, rgn->file_offset + (start - rgn->base), end - start });
+				}
+				break;
+
+			case access_advice::dontneed:
+				// Only the pages that are wholly inside the range are dropped.
+				free_range(*rgn, max(start, PAGE_ALIGN_UP(base)), min(end, (base + size) & PAGE_MASK), batch);
+				break;
+
+			default:
+				rgn->advice = advice;
+				break;
+			}
+		}
+
+		if (batch) {
+			batch->submit();
+		}
+	}
+
+	for (const pending_advice &a : anon_ranges) {
+		populate_range(a.start, a.length);
+	}
+
+	for (const pending_advice &a : file_ranges) {
+		a.file->advise(a.start, a.length, access_advice::willneed);
+	}
+
+	return found;
+}
+
+bool address_space::charge_pages(u64 n) { return !account_ || account_->charge(resource_type::pages, n); }
+
+void address_space::uncharge_pages(u64 n)
+{
+	if (account_) {
+		account_->uncharge(resource_type::pages, n);
+	}
+}
+
+void address_space::free_pages(address_space_region &rgn, tlb_batch *batch)
+{
+	if (!rgn.backed) {
+		return;
+	}
+
+	// Device memory belongs to the device, so it is only unmapped.
+	if (rgn.device) {
+		for (u64 addr = rgn.base; addr < rgn.base + rgn.size; addr += PAGE_SIZE) {
+			if (pt_->get_mapping(addr).result != mapping_result::ok) {
+				continue;
+			}
+
+			if (batch) {
+				pt_->unmap(pta_, addr, batch);
+			}
+
+			resident_pages_--;
+			shared_pages_--;
+		}
+
+		return;
+	}
+
+	free_range(rgn, rgn.base, rgn.base + rgn.size, batch);
+}
+
+void address_space::free_range(address_space_region &rgn, u64 start, u64 end, tlb_batch *batch)
+{
+	// Only the pages that were touched were ever allocated, and each one is either a single page or a 2 MiB block.
+	u64 addr = start;
+	while (addr < end) {
+		mapping m = pt_->get_mapping(addr);
+		if (m.result != mapping_result::ok) {
+			addr += PAGE_SIZE;
+			continue;
+		}
+
+		u64 pa = m.address & PAGE_MASK;
+		int order = 0;
+
+		if (m.size == mapping_size::m2m) {
+			// A block can't be split, so it is only freed if all of it is in the range.
+			u64 block_base = addr & ~(MB(2) - 1);
+			if (block_base < start || block_base + MB(2) > end) {
+				addr = block_base + MB(2);
+				continue;
+			}
+
+			pa = m.address & ~(MB(2) - 1);
+			order = 9;
+		}
+
+		// Without a batch, the page table is about to be destroyed, so nothing can reach the pages.  Pages shared from
+		// the page cache stay there.
+		page &pg = page::get_from_base_address(pa);
+
+		resident_pages_ -= 1ull << order;
+		if (pg.cached()) {
+			shared_pages_--;
+		} else {
+			uncharge_pages(1ull << order);
+		}
+
+		pg.clear_mapping();
+
+		// A cached page's mapping is only given up once no core can still reach it through a TLB.  A page shared by a
+		// fork is only freed by the last address space to give it up.
+		if (batch) {
+			pt_->unmap(pta_, addr, batch);
+
+			if (pg.cached()) {
+				batch->release_after(pg);
+			} else if (pg.cow()) {
+				batch->unshare_after(pg, order);
+			} else {
+				batch->free_after(pg, order);
+			}
+		} else if (pg.cached()) {
+			pg.release();
+		} else if (pg.cow()) {
+			if (pg.release()) {
+				pg.set_cow(false);
+				memory_manager::get().pgalloc().free_pages(pg, order);
+			}
+		} else {
+			memory_manager::get().pgalloc().free_pages(pg, order);
+		}
+
+		if (order) {
+			addr = (addr & ~(MB(2) - 1)) + MB(2);
+		} else {
+			addr += PAGE_SIZE;
+		}
+	}
+}
+
+bool address_space::migrate_page(u64 address, page &src, page &dest)
+{
+	const mapping_flags flags = mapping_flags::present | mapping_flags::writable | mapping_flags::user_accessable;
+
+	unique_irq_lock l(lock_);
+
+	address_space_region *rgn = find_region(address);
+	if (!rgn || !rgn->backed || migrating_address_) {
+		return false;
+	}
+
+	mapping m = pt_->get_mapping(address);
+	if (m.result != mapping_result::ok || m.size != mapping_size::m4k || (m.address & PAGE_MASK) != src.base_address() || src.mapper() != this
+		|| src.pinned()) {
+		return false;
+	}
+
+	// The page is unmapped while it is copied, so that nothing can write to it in the meantime, and no other page can
+	// be populated in its place.
+	migrating_address_ = address;
+
+	volatile bool flushed = false;
+	tlb_batch *batch = tlb_batch::create_user(cr3(), &active_cores_);
+	pt_->unmap(pta_, address, batch);
+	batch->call_after([](void *arg) { *(volatile bool *)arg = true; }, (void *)&flushed);
+
+	l.unlock();
+
+	batch->submit();
+	while (!flushed) {
+		asm volatile("pause");
+	}
+
+	memops::memcpy(dest.base_address_ptr(), src.base_address_ptr(), PAGE_SIZE);
+
+	l.lock();
+
+	// The region may have been removed while the page was being copied, without seeing the page, which was unmapped
+	// at the time.
+	src.clear_mapping();
+
+	rgn = find_region(address);
+	if (rgn && rgn->backed && pt_->get_mapping(address).result != mapping_result::ok) {
+		pt_->map(pta_, address, dest.base_address(), flags, mapping_size::m4k);
+		dest.set_mapping(this, address);
+	} else {
+		resident_pages_--;
+		uncharge_pages(1);
+		memory_manager::get().pgalloc().free_pages(dest, 0);
+	}
+
+	migrating_address_ = 0;
+	return true;
 }
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/compactor.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/sched/process-manager.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::sched;
+
+void compactor::request(int order)
+{
+	int wanted = __atomic_load_n(&wanted_order_, __ATOMIC_RELAXED);
+
+	while (order > wanted) {
+		if (__atomic_compare_exchange_n(&wanted_order_, &wanted, order, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_add_fetch(&counters_.requests, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+}
+
+bool compactor::compact_one()
+{
+	int order = __atomic_load_n(&wanted_order_, __ATOMIC_RELAXED);
+	if (order < 0) {
+		return false;
+	}
+
+	// Only one core compacts at a time, as two would only fight over the same regions.
+	if (__atomic_exchange_n(&busy_, true, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	bool did_work = compact(order);
+
+	__atomic_store_n(&busy_, false, __ATOMIC_RELEASE);
+	return did_work;
+}
+
+bool compactor::compact(int order)
+{
+	auto &pga = memory_manager::get().pgalloc();
+
+	// Memory may have been freed since the request was made.
+	for (int o = order; o <= pga.last_order(); o++) {
+		if (pga.free_blocks(o)) {
+			finish_request(order);
+			return false;
+		}
+	}
+
+	u64 start_pfn;
+	bool wrapped;
+
+	if (!pga.find_compaction_region(order, start_pfn, wrapped)) {
+		if (wrapped && ++nr_wraps_ >= max_passes) {
+			// There's nowhere that can be emptied, so there's no point looking again until something else asks.
+			counters_.failures++;
+			finish_request(order);
+			return false;
+		}
+
+		return true;
+	}
+
+	if (empty_region(start_pfn, order)) {
+		counters_.regions++;
+		finish_request(order);
+	}
+
+	return true;
+}
+
+bool compactor::empty_region(u64 start_pfn, int order)
+{
+	auto &pga = memory_manager::get().pgalloc();
+	u64 end_pfn = start_pfn + (1ull << order);
+
+	// The processes are held on to, so that no address space can be destroyed while its pages are being moved.  A page
+	// that claims to belong to an address space that isn't among them is left alone.
+	list<shared_ptr<process>> processes = process_manager::get().snapshot();
+
+	// Free pages inside the region that happen to be handed out as destinations are kept out of the way, and given
+	// back once the region is empty.
+	list<page *> held;
+	bool emptied = true;
+
+	for (u64 pfn = start_pfn; pfn < end_pfn && emptied; pfn++) {
+		page &src = page::get_from_pfn(pfn);
+
+		address_space *as = src.mapper();
+		if (!as) {
+			continue;
+		}
+
+		bool known = false;
+		for (const auto &p : processes) {
+			if (&p->addrspace() == as) {
+				known = true;
+				break;
+			}
+		}
+
+		if (!known) {
+			emptied = false;
+			break;
+		}
+
+		page *dest;
+		while ((dest = pga.allocate_pages(0, page_allocation_flags::movable)) && dest->pfn() >= start_pfn && dest->pfn() < end_pfn) {
+			held.append(dest);
+		}
+
+		if (!dest) {
+			emptied = false;
+			break;
+		}
+
+		if (as->migrate_page(src.mapped_at(), src, *dest)) {
+			pga.free_pages_direct(src, 0);
+			counters_.pages_moved++;
+		} else {
+			pga.free_pages(*dest, 0);
+			emptied = false;
+		}
+	}
+
+	for (page *pg : held) {
+		pga.free_pages_direct(*pg, 0);
+	}
+
+	if (!emptied) {
+		counters_.failures++;
+	}
+
+	return emptied;
+}
+
+void compactor::finish_request(int order)
+{
+	nr_wraps_ = 0;
+
+	// A bigger request may have come in meanwhile, which is left for next time.
+	__atomic_compare_exchange_n(&wanted_order_, &order, -1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/dev/misc/rtc.h>
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/kernel-data-page.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::dev::misc;
+
+// The number of days from the Unix epoch to the given date, in the proleptic Gregorian calendar.
+static u64 days_since_epoch(u64 year, u64 month, u64 day)
+{
+	// Counting years from March puts the leap day at the end of the year.
+	if (month <= 2) {
+		year--;
+	}
+
+	u64 era = year / 400;
+	u64 year_of_era = year - (era * 400);
+	u64 day_of_year = ((153 * (month > 2 ? month - 3 : month + 9)) + 2) / 5 + day - 1;
+	u64 day_of_era = (year_of_era * 365) + (year_of_era / 4) - (year_of_era / 100) + day_of_year;
+
+	return (era * 146097) + day_of_era - 719468;
+}
+
+void kernel_data_page::init(rtc &rtc)
+{
+	page_ = zeroed_page_pool::get().allocate();
+
+	// Address spaces treat a cached page as shared: they never write to it, and never free it when they unmap it.
+	page_->set_cached(true);
+
+	core &c = core::this_core();
+	u64 freq = c.timestamp_frequency();
+
+	rtc_timepoint tp = rtc.read_timepoint();
+	u64 now = __builtin_ia32_rdtsc();
+
+	u64 wall_s = (days_since_epoch(tp.year, tp.month, tp.day_of_month) * 86400) + (tp.hours * 3600) + (tp.minutes * 60) + tp.seconds;
+
+	u64 since_boot_ns = c.timestamp_to_ns(now - boot_tsc_);
+
+	kernel_data *data = (kernel_data *)page_->base_address_ptr();
+	data->tsc_frequency = freq;
+	data->boot_tsc = boot_tsc_;
+	data->wall_clock_base_ns = (wall_s * 1'000'000'000ull) - since_boot_ns;
+	data->nr_cores = core_manager::get().nr_cores();
+}
+
+void kernel_data_page::map_into(address_space &as)
+{
+	if (!page_) {
+		return;
+	}
+
+	as.add_region(KERNEL_DATA_ADDRESS, PAGE_SIZE, region_flags::readable, true);
+	as.map_shared(KERNEL_DATA_ADDRESS, *page_);
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/mem/kmem-cache.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::mem;
+
+kmem_cache_base::kmem_cache_base(const char *name, size_t object_size, size_t slot_size)
+	: name_(name)
+	, object_size_(object_size)
+	, slot_size_(slot_size)
+	, registry_link_ { nullptr, nullptr }
+{
+	auto &r = get_registry();
+
+	unique_irq_lock l(r.lock);
+	r.caches.append(*this);
+}
+
+kmem_cache_base::registry &kmem_cache_base::get_registry()
+{
+	static registry r;
+	return r;
+}
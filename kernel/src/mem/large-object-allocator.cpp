@@ -23,69 +23,222 @@ using namespace stacsos::kernel::mem;
  */
 void *large_object_allocator::allocate(size_t size)
 {
-	auto &pga = memory_manager::get().pgalloc();
-	auto &pta = memory_manager::get().ptalloc();
-
-	// This is technically locked by the "object allocator" spin lock.
+	// This is locked by the object allocator's large object lock.
 
 	u64 nr_pages = (size + PAGE_SIZE - 1) >> PAGE_BITS;
-	u64 target = (u64)base_;
 
-	page_table &v = memory_manager::get().root_address_space().pgtable();
+	// Only an allocation that can contain a 2 MiB block needs to be aligned for one.
+	u64 address = reserve(nr_pages, nr_pages >= 512 ? MB(2) : PAGE_SIZE);
+	if (!address) {
+		return nullptr;
+	}
 
-	// We've computed the maximum number of pages needed to hold the allocation,
-	// so for each bit in the number of pages required, allocate that order.
-	// This works because, e.g. 3 pages = 0011 = order 1 (2) + order 0 (1)
-	// And, e.g. 13 pages = 1101 = order 3 (8) + order 2 (4) + order 0 (1)
+	auto *a = new allocation();
+	a->nr_pages = nr_pages;
 
-	// What we're doing is allocating physical pages for each order, then
-	// "glueing" them together in the large object address space by inserting
-	// appropriate mappings into the page table.
+	if (!populate(*a, address)) {
+		release(*a);
+		unreserve(address, nr_pages);
+		delete a;
 
-	// TODO: not sure how "free" is going to work... maybe some kind of
-	// balanced tree holding the allocations?  Also, what if a page
-	// allocation fails halfway through!?
+		return nullptr;
+	}
 
-	int pgi = 0; // The current monotonic page counter
-	for (int i = 0; i < 32; i++) {
-		// Only allocate when the bit is set
-		if (nr_pages & (1 << i)) {
-			page *pg = pga.allocate_pages(i); // Allocate a block of pages
+	allocations_.add(address, a);
+	return (void *)address;
+}
 
-			if (!pg) {
-				panic("unable to allocate pages for object");
-			}
+/**
+ * @brief Frees a block of memory allocated with the corresponding allocate function.
+ *
+ * @param p A pointer to the block of memory (allocated by allocated), which is to be freed.
+ */
+bool large_object_allocator::free(void *p)
+{
+	if (!ptr_in_region(p)) {
+		return false;
+	}
 
-			// For each page in the block...
-			for (int j = 0; j < (1 << i); j++) {
-				// Map the pages in this block into the virtual address space.
-				v.map(pta, target + (PAGE_SIZE * pgi), pg->base_address() + (PAGE_SIZE * j), mapping_flags::writable);
+	allocation *a;
+	if (!allocations_.try_get_value((u64)p, a)) {
+		return false;
+	}
 
-				// Increase the current page counter.
-				pgi++;
-			}
+	allocations_.remove((u64)p);
+
+	release(*a);
+	unreserve((u64)p, a->nr_pages);
+	delete a;
+
+	return true;
+}
+
+/**
+ * @brief Finds room for an allocation in the region, preferring the lowest suitable hole, and otherwise growing the
+ * used part of the region.
+ *
+ * @return u64 The address of the reserved range, or zero if there was no room.
+ */
+u64 large_object_allocator::reserve(u64 nr_pages, u64 align)
+{
+	u64 size = nr_pages << PAGE_BITS;
+	u64 hole_start = 0, hole_pages = 0, address = 0;
+
+	for (auto h : holes_by_start_) {
+		u64 candidate = (h.key + align - 1) & ~(align - 1);
+
+		if (candidate + size <= h.key + (h.value << PAGE_BITS) && (!address || candidate < address)) {
+			hole_start = h.key;
+			hole_pages = h.value;
+			address = candidate;
+		}
+	}
+
+	if (address) {
+		// Give back whatever is left of the hole on either side.
+		u64 hole_end = hole_start + (hole_pages << PAGE_BITS);
+		remove_hole(hole_start, hole_pages);
+
+		if (address > hole_start) {
+			add_hole(hole_start, (address - hole_start) >> PAGE_BITS);
 		}
+
+		if (address + size < hole_end) {
+			add_hole(address + size, (hole_end - (address + size)) >> PAGE_BITS);
+		}
+
+		return address;
 	}
 
-	// HMM: vma_.activate();
+	address = ((u64)base_ + align - 1) & ~(align - 1);
+	if (address + size > (u64)region_base_ + size_) {
+		return 0;
+	}
+
+	// Any space skipped for alignment becomes a hole.  There is never a hole ending at base_, so there is nothing
+	// for it to merge with.
+	if (address > (u64)base_) {
+		add_hole((u64)base_, (address - (u64)base_) >> PAGE_BITS);
+	}
 
-	// Advance the base pointer by the number of pages we've just allocated (and mapped)
-	base_ = (void *)((uintptr_t)base_ + (nr_pages * PAGE_SIZE));
-	return (void *)target;
+	base_ = (void *)(address + size);
+	return address;
 }
 
 /**
- * @brief Frees a block of memory allocated with the corresponding allocate function.
+ * @brief Returns a range to the region, merging it with the holes either side of it, or shrinking the used part of
+ * the region if the range is at the end of it.
+ */
+void large_object_allocator::unreserve(u64 address, u64 nr_pages)
+{
+	u64 start = address;
+	u64 end = address + (nr_pages << PAGE_BITS);
+
+	u64 prev_start;
+	if (holes_by_end_.try_get_value(start, prev_start)) {
+		remove_hole(prev_start, (start - prev_start) >> PAGE_BITS);
+		start = prev_start;
+	}
+
+	u64 next_pages;
+	if (holes_by_start_.try_get_value(end, next_pages)) {
+		remove_hole(end, next_pages);
+		end += next_pages << PAGE_BITS;
+	}
+
+	if (end == (u64)base_) {
+		base_ = (void *)start;
+	} else {
+		add_hole(start, (end - start) >> PAGE_BITS);
+	}
+}
+
+void large_object_allocator::add_hole(u64 start, u64 nr_pages)
+{
+	holes_by_start_.add(start, nr_pages);
+	holes_by_end_.add(start + (nr_pages << PAGE_BITS), start);
+}
+
+void large_object_allocator::remove_hole(u64 start, u64 nr_pages)
+{
+	holes_by_start_.remove(start);
+	holes_by_end_.remove(start + (nr_pages << PAGE_BITS));
+}
+
+/**
+ * @brief Allocates physical pages for an allocation, and maps them in at the given address.
  *
- * @param p A pointer to the block of memory (allocated by allocated), which is to be freed.
+ * @return bool false if there weren't enough pages, in which case the blocks that were mapped are left in the
+ * allocation to be released.
  */
-bool large_object_allocator::free(void *p)
+bool large_object_allocator::populate(allocation &a, u64 address)
 {
-	if (!ptr_in_region(p)) {
-		return false;
+	auto &pga = memory_manager::get().pgalloc();
+	auto &pta = memory_manager::get().ptalloc();
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	// Each set bit in the number of pages is a block of that order, e.g. 13 pages = 1101 = order 3 (8) + order 2 (4)
+	// + order 0 (1).  The blocks are laid out biggest first, so that each one starts at a multiple of its own size
+	// from the (aligned) start of the allocation.
+	u64 pending[32];
+	for (int order = 0; order < 32; order++) {
+		pending[order] = (a.nr_pages >> order) & 1;
 	}
 
-	// TODO
+	u64 offset = 0;
+	for (int order = 31; order >= 0; order--) {
+		while (pending[order]) {
+			// Large objects are allocated with the allocator's lock held, so they dip into the reserve, as slabs do.
+			page *pg = pga.allocate_pages(order, page_allocation_flags::reserve);
+
+			if (!pg) {
+				// There's no block this big, so try for two of the next size down instead, which keeps the rest of the
+				// blocks aligned.
+				if (order == 0) {
+					return false;
+				}
+
+				pending[order - 1] += pending[order] * 2;
+				pending[order] = 0;
+				break;
+			}
+
+			pending[order]--;
+
+			u64 block_address = address + offset;
+			u64 block_size = PAGE_SIZE << order;
+
+			a.blocks.push({ block_address, pg, order });
+			mapped_pages_ += 1ull << order;
+
+			// Blocks of 2 MiB or more are mapped with large pages.
+			v.map_range(pta, block_address, pg->base_address(), block_size, mapping_flags::writable | mapping_flags::global);
+
+			offset += block_size;
+		}
+	}
 
 	return true;
 }
+
+/**
+ * @brief Unmaps and frees every block of an allocation.
+ */
+void large_object_allocator::release(allocation &a)
+{
+	auto &pta = memory_manager::get().ptalloc();
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	// The mappings are global, so any core may hold them, but every core is only interrupted once for the whole
+	// allocation, and the pages go back to the page allocator once they have all dropped them.
+	tlb_batch *batch = tlb_batch::create_kernel();
+
+	for (const block &b : a.blocks) {
+		v.unmap_range(pta, b.address, PAGE_SIZE << b.order, batch);
+		batch->free_after(*b.pg, b.order);
+		mapped_pages_ -= 1ull << b.order;
+	}
+
+	batch->submit();
+	a.blocks.clear();
+}
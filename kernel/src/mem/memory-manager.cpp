@@ -7,14 +7,22 @@
  */
 #include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/dev/acpi/acpi.h>
 #include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/numa.h>
 #include <stacsos/kernel/mem/page-allocator-buddy.h>
 #include <stacsos/kernel/mem/page-allocator-linear.h>
+#include <stacsos/kernel/mem/page-allocator-numa.h>
+#include <stacsos/kernel/mem/page-frame-cache.h>
 #include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/thread.h>
 
 extern "C" const char *_IMAGE_START;
 extern "C" const char *_IMAGE_END;
+extern "C" char _INIT_TEXT_START[], _INIT_TEXT_END[];
 
+using namespace stacsos;
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::mem;
 
@@ -27,28 +35,51 @@ static memory_block memory_blocks[16];
 static int nr_memory_blocks;
 
 static char page_allocator_structure[0x1000];
+static char page_frame_cache_structure[0x1000];
+static char node_page_allocator_structures[numa_topology::max_nodes][0x1000];
 
-void memory_manager::init()
+static page_allocator *create_page_allocator(memory_manager &mm, const char *algorithm_name, void *page_allocator_object)
+{
+	if (memops::strcmp(algorithm_name, "buddy") == 0) {
+		return new (page_allocator_object) page_allocator_buddy(mm);
+	} else if (memops::strcmp(algorithm_name, "linear") == 0) {
+		return new (page_allocator_object) page_allocator_linear(mm);
+	} else {
+		panic("Invalid page allocator algoritm: %s", algorithm_name);
+	}
+}
+
+void __init memory_manager::init()
 {
 	dprintf("mem: init\n");
 
 	const char *pgalloc_algorithm_name = config::get().get_option_or_default("pgalloc", "linear");
 	dprintf("\e\x04mem: *** using the '%s' page allocator\e\x07\n", pgalloc_algorithm_name);
 
-	void *page_allocator_object = (void *)page_allocator_structure;
-	if (memops::strcmp(pgalloc_algorithm_name, "buddy") == 0) {
-		pgalloc_ = new (page_allocator_object) page_allocator_buddy(*this);
-	} else if (memops::strcmp(pgalloc_algorithm_name, "linear") == 0) {
-		pgalloc_ = new (page_allocator_object) page_allocator_linear(*this);
+	// The NUMA topology has to be known before any memory is handed out, so that every page goes to its own node's
+	// allocator.  The numa=no option treats all of memory as one node, as if there were no SRAT.
+	auto &topology = numa_topology::get();
+	if (memops::strcmp(config::get().get_option_or_default("numa", "yes"), "no") != 0 && dev::acpi::ACPI::probe_numa()) {
+		topology.finalise();
+		topology.dump();
+	}
+
+	if (topology.nr_nodes() > 1) {
+		page_allocator *node_allocators[numa_topology::max_nodes];
+		for (unsigned int node = 0; node < topology.nr_nodes(); node++) {
+			node_allocators[node] = create_page_allocator(*this, pgalloc_algorithm_name, (void *)node_page_allocator_structures[node]);
+		}
+
+		pgalloc_ = new ((void *)page_allocator_structure) page_allocator_numa(*this, node_allocators, topology.nr_nodes());
 	} else {
-		panic("Invalid page allocator algoritm: %s", pgalloc_algorithm_name);
+		pgalloc_ = create_page_allocator(*this, pgalloc_algorithm_name, (void *)page_allocator_structure);
 	}
 
 	dprintf("memory:\n");
 	u64 last_addr = 0;
 	for (int i = 0; i < nr_memory_blocks; i++) {
 		const memory_block *mb = &memory_blocks[i];
-		dprintf("  %016lx -- %016lx (%S) %%c\n", memory_blocks[i].start, memory_blocks[i].start + memory_blocks[i].length, memory_blocks[i].length,
+		dprintf("  %016llx -- %016llx (%llu) %c\n", memory_blocks[i].start, memory_blocks[i].start + memory_blocks[i].length, memory_blocks[i].length,
 			mb->avail ? 'A' : 'X');
 
 		u64 block_last_addr = mb->start + mb->length - 1;
@@ -60,6 +91,7 @@ void memory_manager::init()
 	u64 nr_page_descriptors = (last_addr + 1) >> PAGE_BITS;
 	initialise_page_descriptors(nr_page_descriptors);
 	initialise_page_allocator(nr_page_descriptors);
+	initialise_page_frame_cache();
 	initialise_object_allocator();
 
 	dprintf("switching to primary page table mapping...\n");
@@ -76,21 +108,36 @@ void memory_manager::add_memory_block(u64 start, u64 length, bool avail)
 	nr_memory_blocks++;
 }
 
-void memory_manager::initialise_page_descriptors(u64 nr_page_descriptors)
+void __init memory_manager::initialise_page_descriptors(u64 nr_page_descriptors)
 {
 	// Indicate to the user how many page descriptors have been detected.
-	dprintf("%lu pages (%lu Mb)\n", nr_page_descriptors, (nr_page_descriptors << PAGE_BITS) / 1048576);
+	dprintf("%llu pages (%llu Mb)\n", nr_page_descriptors, (nr_page_descriptors << PAGE_BITS) / 1048576);
 
 	// Initialise all page descriptors to zero.
 	memops::bzero(page::get_pagearray(), sizeof(page) * nr_page_descriptors);
+
+	// Which leaves every page on node zero, until the SRAT says otherwise.
+	numa_topology::get().for_each_range([nr_page_descriptors](u64 start, u64 end, unsigned int node) {
+		for (u64 pfn = start >> PAGE_BITS; pfn < (end >> PAGE_BITS) && pfn < nr_page_descriptors; pfn++) {
+			page::get_from_pfn(pfn).node_ = node;
+		}
+	});
 }
 
 struct exclusion {
 	u64 start, length;
 };
 
-void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
+void __init memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
 {
+	// The page allocator's own bookkeeping goes straight after the page descriptors.
+	u64 page_descriptors_size = sizeof(page) * nr_page_descriptors;
+	u64 allocator_metadata_size = pgalloc_->metadata_size(nr_page_descriptors);
+
+	void *allocator_metadata = (void *)((uintptr_t)page::get_pagearray() + page_descriptors_size);
+	memops::bzero(allocator_metadata, allocator_metadata_size);
+	pgalloc_->init_metadata(allocator_metadata, nr_page_descriptors);
+
 	// Determine whether or not we're running in self-test mode for the page allocator.
 	if (memops::strcmp(config::get().get_option_or_default("pgalloc-selftest", "no"), "yes") == 0) {
 		// Do the self-test, which should hang the system.
@@ -108,13 +155,13 @@ void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
 		{ 0, MB(1) }, // Early BIOS data, and the ZERO page.
 		{ 0x100000, KB(24) }, // 24 kB (6 pages) of early page tables -- we should probably put these back later.
 		{ (u64)&_IMAGE_START, PAGE_ALIGN_UP((u64)&_IMAGE_END) - ((u64)&_IMAGE_START) }, // The loaded kernel image,
-		{ (u64)&_DYNAMIC_DATA_START - 0xffff'ffff'8000'0000,
-			PAGE_ALIGN_UP(sizeof(page) * nr_page_descriptors) } // Dynamic data, containing the page descriptors.
+		{ (u64)_DYNAMIC_DATA_START - 0xffff'ffff'8000'0000,
+			PAGE_ALIGN_UP(page_descriptors_size + allocator_metadata_size) } // Dynamic data, containing the page descriptors.
 	};
 
 	dprintf("excluion range:\n");
 	for (int i = 0; i < ARRAY_SIZE(exclusions); i++) {
-		dprintf("  %016lx -- %016lx\n", exclusions[i].start, exclusions[i].start + exclusions[i].length);
+		dprintf("  %016llx -- %016llx\n", exclusions[i].start, exclusions[i].start + exclusions[i].length);
 	}
 
 	dprintf("registering free memory blocks...\n");
@@ -129,17 +176,17 @@ void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
 			auto free_range_length = (mb->length & ~PAGE_BITS); // Make sure we align down
 			auto free_range_end = free_range_base + free_range_length;
 
-			dprintf("candidate memory block: %016lx -- %016lx\n", free_range_base, free_range_end);
+			dprintf("candidate memory block: %016llx -- %016llx\n", free_range_base, free_range_end);
 
 			auto max_end = free_range_end;
 			while (free_range_base < free_range_end) {
-				dprintf("  considering %016lx -- %016lx\n", free_range_base, free_range_end);
+				dprintf("  considering %016llx -- %016llx\n", free_range_base, free_range_end);
 
 				// Find any exclusions that this candidate free range intersects
 				bool retry = false;
 				for (int i = 0; i < ARRAY_SIZE(exclusions); i++) {
 					if (free_range_base >= exclusions[i].start && free_range_base < (exclusions[i].start + exclusions[i].length)) {
-						dprintf("  range start intersects exclusion %016lx -- %016lx\n", exclusions[i].start, exclusions[i].start + exclusions[i].length);
+						dprintf("  range start intersects exclusion %016llx -- %016llx\n", exclusions[i].start, exclusions[i].start + exclusions[i].length);
 						free_range_base = exclusions[i].start + exclusions[i].length;
 						retry = true;
 						break;
@@ -157,13 +204,13 @@ void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
 					if (exclusions[i].start >= free_range_base && exclusions[i].start < max_end) {
 						// We've found an exclusion that is within this free range
 						dprintf(
-							"  exclusion intersects candidate free range %016lx -- %016lx\n", exclusions[i].start, exclusions[i].start + exclusions[i].length);
+							"  exclusion intersects candidate free range %016llx -- %016llx\n", exclusions[i].start, exclusions[i].start + exclusions[i].length);
 						max_end = exclusions[i].start;
 						break;
 					}
 				}
 
-				dprintf("  free range chunk %016lx -- %016lx\n", free_range_base, max_end);
+				dprintf("  free range chunk %016llx -- %016llx\n", free_range_base, max_end);
 
 				// Add these pages to the page allocator
 				pgalloc_->insert_free_pages(page::get_from_base_address(free_range_base), (max_end - free_range_base) >> PAGE_BITS);
@@ -180,12 +227,43 @@ void memory_manager::initialise_page_allocator(u64 nr_page_descriptors)
 	}
 }
 
-void memory_manager::initialise_object_allocator()
+void memory_manager::release_init_text()
+{
+	u64 start = (u64)_INIT_TEXT_START - 0xffff'ffff'8000'0000;
+	u64 nr_pages = (u64)(_INIT_TEXT_END - _INIT_TEXT_START) >> PAGE_BITS;
+
+	if (nr_pages) {
+		pgalloc_->insert_free_pages(page::get_from_base_address(start), nr_pages);
+	}
+
+	dprintf("mem: released %llu pages of boot-only code\n", nr_pages);
+}
+
+void __init memory_manager::initialise_page_frame_cache()
+{
+	// Single pages are handed out in batches from per-core lists in front of the page allocator.  A batch size of zero
+	// turns the lists off.
+	u64 batch = config::get().get_option_u64_or_default("pgalloc-pcp-batch", 16);
+	u64 high = config::get().get_option_u64_or_default("pgalloc-pcp-high", batch * 6);
+
+	if (!batch) {
+		dprintf("mem: per-core page frame caches disabled\n");
+		return;
+	}
+
+	// There must be room for a whole batch to be freed back onto a list after it has been refilled.
+	high = max(high, batch);
+
+	dprintf("mem: per-core page frame caches, batch=%llu high=%llu\n", batch, high);
+	pgalloc_ = new ((void *)page_frame_cache_structure) page_frame_cache(*this, *pgalloc_, batch, high);
+}
+
+void __init memory_manager::initialise_object_allocator()
 {
 	// Nothing to do to initialise the object allocator!
 }
 
-void memory_manager::activate_primary_mapping()
+void __init memory_manager::activate_primary_mapping()
 {
 	root_address_space_ = new address_space(ptalloc_, (u64)0);
 
@@ -196,17 +274,33 @@ void memory_manager::activate_primary_mapping()
 	// TODO: Should do this up until the last physical memory block.
 	for (int i = 0; i < 12; i++) {
 		root_address_space_->pgtable().map(
-			ptalloc_, 0xffff'8000'0000'0000 + phys_base, phys_base, mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
+			ptalloc_, 0xffff'8000'0000'0000 + phys_base, phys_base, mapping_flags::present | mapping_flags::writable | mapping_flags::global, mapping_size::m1g);
 		phys_base += GB(1);
 	}
 
 	// This mapping is for the kernel high address space.  It's used mainly for executing kernel code, and is how gcc compiles
-	// the kernel code with -mcmodel=kernel
-	root_address_space_->pgtable().map(ptalloc_, 0xffff'ffff'8000'0000, GB(0), mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
-	root_address_space_->pgtable().map(ptalloc_, 0xffff'ffff'c000'0000, GB(1), mapping_flags::present | mapping_flags::writable, mapping_size::m1g);
+	// the kernel code with -mcmodel=kernel.  Kernel mappings are the same in every address space, so they are global, and
+	// survive switching between them.
+	const mapping_flags kernel_flags = mapping_flags::present | mapping_flags::writable | mapping_flags::global;
+	root_address_space_->pgtable().map(ptalloc_, 0xffff'ffff'8000'0000, GB(0), kernel_flags, mapping_size::m1g);
+	root_address_space_->pgtable().map(ptalloc_, 0xffff'ffff'c000'0000, GB(1), kernel_flags, mapping_size::m1g);
+
+	// Every other address space copies the upper half of the PML4 when it is created, so the entries for the areas
+	// that are mapped into later have to exist before then, for the mappings to be seen everywhere.
+	root_address_space_->pgtable().reserve_pml4_entry(ptalloc_, vmalloc_area);
+	root_address_space_->pgtable().reserve_pml4_entry(ptalloc_, kernel_stack_area);
 
 	// Activate the mapping (flushing the TLB along the way)
 	root_address_space_->pgtable().activate();
 }
 
-bool memory_manager::try_handle_page_fault(u64 faulting_address) { return false; }
+bool memory_manager::try_handle_page_fault(u64 faulting_address)
+{
+	// Only user addresses are demand-paged, and they belong to the address space of whatever was running, which includes
+	// the kernel touching user memory on a thread's behalf.
+	if (faulting_address >= 0x0000'8000'0000'0000ull) {
+		return false;
+	}
+
+	return sched::thread::current().owner().addrspace().handle_fault(faulting_address);
+}
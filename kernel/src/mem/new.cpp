@@ -5,6 +5,10 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+// This must be declared before anything with a static local that needs destroying, or the compiler declares it
+// implicitly with C++ linkage.
+extern "C" void *__dso_handle;
+
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/object-allocator.h>
@@ -12,6 +16,10 @@
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::mem;
 
+namespace std {
+enum class align_val_t : size_t {};
+}
+
 extern "C" {
 void *__dso_handle = &__dso_handle;
 int __cxa_atexit(void (*destructor)(void *), void *arg, void *dso) { return 0; }
@@ -28,3 +36,24 @@ void operator delete[](void *p) { memory_manager::get().objalloc().free(p); }
 void operator delete[](void *p, size_t sz) { memory_manager::get().objalloc().free(p); }
 
 void operator delete(void *p, size_t sz) { memory_manager::get().objalloc().free(p); }
+
+// Used for types declared with alignas, such as those laid out to keep what different cores write on different cache
+// lines.
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	if ((size_t)alignment > PAGE_SIZE) {
+		panic("unsupported object alignment");
+	}
+
+	return memory_manager::get().objalloc().alloc(object_allocator::aligned_size(size, (size_t)alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+
+void operator delete(void *p, std::align_val_t alignment) { memory_manager::get().objalloc().free(p); }
+
+void operator delete[](void *p, std::align_val_t alignment) { memory_manager::get().objalloc().free(p); }
+
+void operator delete(void *p, size_t sz, std::align_val_t alignment) { memory_manager::get().objalloc().free(p); }
+
+void operator delete[](void *p, size_t sz, std::align_val_t alignment) { memory_manager::get().objalloc().free(p); }
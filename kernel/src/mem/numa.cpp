@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/percpu.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/numa.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::arch;
+
+int numa_topology::find_domain(u32 domain) const
+{
+	for (unsigned int i = 0; i < nr_domains_; i++) {
+		if (domains_[i] == domain) {
+			return (int)i;
+		}
+	}
+
+	return -1;
+}
+
+int numa_topology::node_for_domain(u32 domain)
+{
+	int node = find_domain(domain);
+	if (node >= 0) {
+		return node;
+	}
+
+	if (nr_domains_ == max_nodes) {
+		dprintf("numa: too many proximity domains, ignoring domain %u\n", domain);
+		return -1;
+	}
+
+	domains_[nr_domains_] = domain;
+	nr_nodes_ = max(nr_nodes_, nr_domains_ + 1);
+
+	return (int)nr_domains_++;
+}
+
+void numa_topology::add_memory_range(unsigned int node, u64 start, u64 length)
+{
+	if (nr_ranges_ == max_ranges) {
+		dprintf("numa: too many memory ranges, ignoring %016llx -- %016llx\n", start, start + length);
+		return;
+	}
+
+	ranges_[nr_ranges_++] = { start, start + length, (u8)node };
+}
+
+void numa_topology::set_core_node(unsigned int apic_id, unsigned int node)
+{
+	if (apic_id < (unsigned int)core_manager::max_cores) {
+		core_nodes_[apic_id] = node;
+	}
+}
+
+void numa_topology::finalise()
+{
+	// Each node's fallback list is every node, sorted on distance (ties going to the lower node), which puts the node
+	// itself first.
+	for (unsigned int from = 0; from < nr_nodes_; from++) {
+		for (unsigned int i = 0; i < nr_nodes_; i++) {
+			u8 candidate = i;
+			unsigned int j = i;
+
+			while (j > 0 && distances_[from][fallback_[from][j - 1]] > distances_[from][candidate]) {
+				fallback_[from][j] = fallback_[from][j - 1];
+				j--;
+			}
+
+			fallback_[from][j] = candidate;
+		}
+	}
+}
+
+unsigned int numa_topology::current_node() const { return nr_nodes_ > 1 ? node_of_core(current_core_id()) : 0; }
+
+void numa_topology::dump() const
+{
+	dprintf("numa: %u node(s)\n", nr_nodes_);
+
+	for (unsigned int i = 0; i < nr_ranges_; i++) {
+		dprintf("  node %u: %016llx -- %016llx\n", ranges_[i].node, ranges_[i].start, ranges_[i].end);
+	}
+
+	for (unsigned int from = 0; from < nr_nodes_; from++) {
+		dprintf("  node %u distances:", from);
+		for (unsigned int to = 0; to < nr_nodes_; to++) {
+			dprintf(" %u", distances_[from][to]);
+		}
+
+		dprintf("\n");
+	}
+}
@@ -5,68 +5,212 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/object-allocator.h>
 #include <stacsos/kernel/mem/page-allocator.h>
 #include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/tracepoints.h>
 
 using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::arch;
 
-#define VMALLOC_AREA 0xfffff00000000000
+constexpr object_allocator::size_class_table object_allocator::size_class_lookup {};
 
 object_allocator::object_allocator()
-	: loa_((void *)VMALLOC_AREA, GB(1))
+	: caches_ { &cache16_, &cache32_, &cache48_, &cache64_, &cache96_, &cache128_, &cache192_, &cache256_, &cache384_, &cache512_, &cache768_,
+		&cache1024_, &cache1536_, &cache2048_, &cache3072_, &cache4096_, &cache6144_ }
+	, loa_((void *)memory_manager::vmalloc_area, GB(1))
 {
+	for (auto &cpu : cores_) {
+		for (auto &pcc : cpu.classes) {
+			pcc.loaded = { nullptr, 0 };
+			pcc.previous = { nullptr, 0 };
+			pcc.counters = {};
+		}
+	}
+
+	for (auto &d : depots_) {
+		d.full = nullptr;
+		d.nr_full = 0;
+		d.counters = {};
+	}
 }
 
+DEFINE_TRACEPOINT(object_alloc, "size=%llu caller=%llx");
+
 void *object_allocator::alloc(size_t size)
 {
-	unique_irq_lock l(object_allocator_lock_);
-
-	if (size <= 16) {
-		return cache16_.allocate();
-	} else if (size <= 32) {
-		return cache32_.allocate();
-	} else if (size <= 64) {
-		return cache64_.allocate();
-	} else if (size <= 128) {
-		return cache128_.allocate();
-	} else if (size <= 256) {
-		return cache256_.allocate();
-	} else if (size <= 512) {
-		return cache512_.allocate();
-	} else if (size <= 1024) {
-		return cache1024_.allocate();
+	TRACEPOINT(object_alloc, size, __builtin_return_address(0));
+
+	if (size > max_small_size) {
+		unique_irq_lock l(loa_lock_);
+		return loa_.allocate(size);
+	}
+
+	unsigned int size_class = size_class_of(size);
+	auto &cpu = cores_.get();
+
+	unique_irq_lock l(cpu.lock);
+	auto &pcc = cpu.classes[size_class];
+
+	if (!pcc.loaded.rounds && pcc.previous.rounds) {
+		magazine m = pcc.loaded;
+		pcc.loaded = pcc.previous;
+		pcc.previous = m;
+	}
+
+	if (pcc.loaded.rounds) {
+		pcc.counters.hits++;
+		return pcc.loaded.pop();
 	}
 
-	return loa_.allocate(size);
+	pcc.counters.misses++;
+	return alloc_from_depot(size_class, pcc);
 }
 
 void object_allocator::free(void *ptr)
 {
-	unique_irq_lock l(object_allocator_lock_);
-
 	if (loa_.ptr_in_region(ptr)) {
+		unique_irq_lock l(loa_lock_);
+
 		if (!loa_.free(ptr)) {
 			panic("unable to free large object");
 		}
-	} else {
-		if (cache16_.try_free(ptr))
-			return;
-		if (cache32_.try_free(ptr))
-			return;
-		if (cache64_.try_free(ptr))
-			return;
-		if (cache128_.try_free(ptr))
-			return;
-		if (cache256_.try_free(ptr))
-			return;
-		if (cache512_.try_free(ptr))
-			return;
-		if (cache1024_.try_free(ptr))
-			return;
 
+		return;
+	}
+
+	// Every page of a slab records the slab and the cache that own it.
+	page &pg = page::get_from_base_address_ptr(ptr);
+	if (!pg.slab_owner()) {
 		panic("unable to free object");
 	}
+
+	unsigned int size_class = size_class_of(pg.slab_owner()->slot_size());
+	auto &cpu = cores_.get();
+
+	unique_irq_lock l(cpu.lock);
+	auto &pcc = cpu.classes[size_class];
+
+	if (pcc.loaded.rounds == magazine_size && !pcc.previous.rounds) {
+		magazine m = pcc.loaded;
+		pcc.loaded = pcc.previous;
+		pcc.previous = m;
+	}
+
+	if (pcc.loaded.rounds < magazine_size) {
+		pcc.counters.hits++;
+	} else {
+		pcc.counters.misses++;
+		free_to_depot(size_class, pcc);
+	}
+
+	pcc.loaded.push(ptr);
+}
+
+void *object_allocator::alloc_from_depot(unsigned int size_class, per_core_class &pcc)
+{
+	auto &d = depots_[size_class];
+	void *obj;
+
+	unique_irq_lock l(d.lock);
+	u64 acquired = __builtin_ia32_rdtsc();
+
+	if (d.full) {
+		// Both of the core's magazines are empty, so one of them is exchanged for a full one.
+		void *next = ((void **)d.full)[1];
+
+		pcc.loaded = { d.full, magazine_size };
+		d.full = next;
+		d.nr_full--;
+
+		obj = pcc.loaded.pop();
+	} else {
+		d.counters.slab_allocations++;
+		obj = caches_[size_class]->allocate();
+	}
+
+	account_hold(d, acquired);
+	return obj;
+}
+
+void object_allocator::free_to_depot(unsigned int size_class, per_core_class &pcc)
+{
+	auto &d = depots_[size_class];
+
+	unique_irq_lock l(d.lock);
+	u64 acquired = __builtin_ia32_rdtsc();
+
+	// Both of the core's magazines are full, so the previous one is handed over, and the loaded one takes its place.
+	if (d.nr_full < depot_limit) {
+		((void **)pcc.previous.head)[1] = d.full;
+		d.full = pcc.previous.head;
+		d.nr_full++;
+	} else {
+		d.counters.slab_frees += pcc.previous.rounds;
+
+		while (pcc.previous.rounds) {
+			free_to_slab(pcc.previous.pop());
+		}
+	}
+
+	pcc.previous = pcc.loaded;
+	pcc.loaded = { nullptr, 0 };
+
+	account_hold(d, acquired);
+}
+
+void object_allocator::free_to_slab(void *obj)
+{
+	page &pg = page::get_from_base_address_ptr(obj);
+	pg.slab_owner()->free_in_slab(pg.slab(), obj);
+}
+
+void object_allocator::account_hold(depot &d, u64 acquired)
+{
+	u64 held = __builtin_ia32_rdtsc() - acquired;
+
+	d.counters.acquisitions++;
+	d.counters.hold_cycles += held;
+	d.counters.max_hold_cycles = max(d.counters.max_hold_cycles, held);
+}
+
+slab_cache_base::stats object_allocator::get_slab_stats(unsigned int size_class)
+{
+	// The depot lock is what protects the slab cache.
+	unique_irq_lock l(depots_[size_class].lock);
+	return caches_[size_class]->get_stats();
+}
+
+u64 object_allocator::large_object_bytes()
+{
+	unique_irq_lock l(loa_lock_);
+	return loa_.mapped_pages() << PAGE_BITS;
+}
+
+void object_allocator::dump() const
+{
+	dprintf("*** object allocator (magazine size=%u, depot limit=%u) ***\n", magazine_size, depot_limit);
+
+	for (unsigned int c = 0; c < nr_size_classes; c++) {
+		const auto &d = depots_[c];
+		u64 hits = 0, misses = 0;
+
+		for (const auto &cpu : cores_) {
+			hits += cpu.classes[c].counters.hits;
+			misses += cpu.classes[c].counters.misses;
+		}
+
+		if (!(hits + misses)) {
+			continue;
+		}
+
+		dprintf("  %4lu bytes: hits=%llu misses=%llu (%llu%% hit rate), depot: %u full, acquisitions=%llu mean hold=%llu max hold=%llu cycles, "
+				"slab allocs=%llu frees=%llu\n",
+			class_object_size(c), hits, misses, (hits * 100) / (hits + misses), d.nr_full, d.counters.acquisitions,
+			d.counters.acquisitions ? d.counters.hold_cycles / d.counters.acquisitions : 0, d.counters.max_hold_cycles, d.counters.slab_allocations,
+			d.counters.slab_frees);
+	}
 }
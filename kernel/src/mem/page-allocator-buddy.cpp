@@ -6,28 +6,50 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/compactor.h>
 #include <stacsos/kernel/mem/page-allocator-buddy.h>
 #include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/reclaimer.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos;
 using namespace stacsos::kernel;
 using namespace stacsos::kernel::mem;
 
-// Represents the contents of a free page, that can hold useful metadata.
-struct page_metadata {
-	page *next_free;
-};
+/**
+ * @brief Returns the number of bytes needed for the free block bitmaps of every order, followed by the type of every
+ * pageblock.
+ *
+ * @param nr_page_descriptors The number of page descriptors, i.e. the highest PFN that may be inserted, plus one.
+ * @return u64 The size of the bitmaps, in bytes.
+ */
+u64 page_allocator_buddy::metadata_size(u64 nr_page_descriptors) const
+{
+	u64 words = 0;
+	for (int order = 0; order <= LastOrder; order++) {
+		words += bitmap_words(order, nr_page_descriptors);
+	}
+
+	return (words * sizeof(u64)) + (nr_page_descriptors >> PageblockOrder) + 1;
+}
 
 /**
- * @brief Returns a pointer to the metadata structure that is held within a free page.  This CANNOT be used on
- * pages that have been allocated, as they are owned by the requesting code.  Once pages have been freed, or
- * are being returned to the allocator, this metadata can be used.
+ * @brief Lays out the (zeroed) free block bitmaps of every order, one after the other, and then the pageblock types.
  *
- * @param page The page on which to retrieve the metadata struct.
- * @return page_metadata* The metadata structure.
+ * @param metadata The memory set aside for the bitmaps, of metadata_size bytes.
+ * @param nr_page_descriptors The number of page descriptors.
  */
-static inline page_metadata *metadata(page *page) { return (page_metadata *)page->base_address_ptr(); }
+void page_allocator_buddy::init_metadata(void *metadata, u64 nr_page_descriptors)
+{
+	u64 *next_bitmap = (u64 *)metadata;
+	for (int order = 0; order <= LastOrder; order++) {
+		free_bitmap_[order] = next_bitmap;
+		next_bitmap += bitmap_words(order, nr_page_descriptors);
+	}
+
+	pageblock_types_ = (u8 *)next_bitmap;
+	nr_pages_ = nr_page_descriptors;
+}
 
 /**
  * @brief Dumps out (via the debugging routines) the current state of the buddy page allocator's free lists
@@ -35,7 +57,7 @@ static inline page_metadata *metadata(page *page) { return (page_metadata *)page
 void page_allocator_buddy::dump() const
 {
 	// Print out a header, so we can quickly identify this output in the debug stream.
-	dprintf("*** buddy page allocator - free list ***\n");
+	dprintf("*** buddy page allocator - free list (%llu pages free) ***\n", total_free_);
 
 	// Loop over each order that our allocator is responsible for, from zero up to *and
 	// including* LastOrder.
@@ -43,18 +65,21 @@ void page_allocator_buddy::dump() const
 		// Print out the order number (with a leading zero, so that it's nicely aligned)
 		dprintf("[%02u] ", order);
 
-		// Get the pointer to the first free page in the free list.
-		page *current_free_page = free_list_[order];
+		// Print out every list for the order, movable first.
+		for (int type = 0; type < nr_block_types; type++) {
+			// Get the pointer to the first free page in the free list.
+			page *current_free_page = free_list_[type][order];
 
-		// While there /is/ currently a free page in the list...
-		while (current_free_page) {
-			// Print out the extents of this page, i.e. its base address (at byte granularity), up to and including the last
-			// valid address.  Remember: these are PHYSICAL addresses.
-			dprintf("%lx--%lx ", current_free_page->base_address(), (current_free_page->base_address() + ((1 << order) << PAGE_BITS)) - 1);
+			// While there /is/ currently a free page in the list...
+			while (current_free_page) {
+				// Print out the extents of this page, i.e. its base address (at byte granularity), up to and including the
+				// last valid address.  Remember: these are PHYSICAL addresses.
+				dprintf("%c%llx--%llx ", type == movable ? 'M' : 'U', current_free_page->base_address(),
+					(current_free_page->base_address() + ((1 << order) << PAGE_BITS)) - 1);
 
-			// Advance to the next page, by interpreting the free page as holding metadata, and reading
-			// the appropriate field.
-			current_free_page = metadata(current_free_page)->next_free;
+				// Advance to the next page, by following the link in the page descriptor.
+				current_free_page = current_free_page->next_free_;
+			}
 		}
 
 		// New line for the next order.
@@ -65,12 +90,39 @@ void page_allocator_buddy::dump() const
 /**
  * @brief Inserts pages that are known to be free into the buddy allocator.
  *
- * ** You are required to implement this function **
- *
  * @param range_start The first page in the range.
  * @param page_count The number of pages in the range.
  */
-void page_allocator_buddy::insert_free_pages(page &range_start, u64 page_count) { panic("TODO"); }
+void page_allocator_buddy::insert_free_pages(page &range_start, u64 page_count)
+{
+	unique_irq_lock l(lock_);
+
+	u64 pfn = range_start.pfn();
+	u64 end_pfn = pfn + page_count;
+
+	// Break the range up into the largest aligned blocks that fit, freeing each one, so that it is merged with any
+	// free buddies that are already in the allocator.
+	while (pfn < end_pfn) {
+		int order = LastOrder;
+		while (order > 0 && (!block_aligned(order, pfn) || pfn + pages_per_block(order) > end_pfn)) {
+			order--;
+		}
+
+		free_block(order, page::get_from_pfn(pfn));
+		pfn += pages_per_block(order);
+	}
+
+	managed_pages_ += page_count;
+	min_watermark_ = managed_pages_ / min_watermark_divisor;
+	low_watermark_ = min_watermark_ + (min_watermark_ / 4);
+	high_watermark_ = min_watermark_ + (min_watermark_ / 2);
+}
+
+u64 page_allocator_buddy::reclaim_target() const
+{
+	u64 free = __atomic_load_n(&total_free_, __ATOMIC_RELAXED);
+	return free < high_watermark_ ? high_watermark_ - free : 0;
+}
 
 /**
  * @brief Inserts a block of pages into the free list for the given order.
@@ -86,25 +138,25 @@ void page_allocator_buddy::insert_free_block(int order, page &block_start)
 	// Assert that the starting page in the block is aligned to the requested order.
 	assert(block_aligned(order, block_start.pfn()));
 
-	// Iterate through the free list, until we get to the position where the
-	// block should be inserted, i.e. ordered by page base address.
-	// The comparison in the while loop is valid, because page descriptors (which we
-	// are dealing with) are contiguous in memory -- just like the pages they represent.
-	page *target = &block_start;
-	page **slot = &free_list_[order];
-	while (*slot && *slot < target) {
-		slot = &(metadata(*slot)->next_free);
-	}
-
 	// Make sure the block wasn't already in the free list.
-	assert(*slot != target);
+	assert(!is_free_block(order, block_start.pfn()));
+
+	// The block goes on the list for the type of its pageblock (or of the first one, if it spans several).
+	block_type type = pageblock_type(block_start.pfn());
+	block_start.free_type_ = type;
+
+	// The block goes at the head of the list, so that the most recently freed memory (which is the most likely to
+	// still be in the cache) is the first to be allocated again.
+	block_start.prev_free_ = nullptr;
+	block_start.next_free_ = free_list_[type][order];
 
-	// Update the target block (i.e. the block we're inserting) to point to
-	// the candidate slot -- which is the next pointer.  Then, update the
-	// candidate slot to point to this block; thus inserting the block into the
-	// linked-list.
-	metadata(target)->next_free = *slot;
-	*slot = target;
+	if (free_list_[type][order]) {
+		free_list_[type][order]->prev_free_ = &block_start;
+	}
+
+	free_list_[type][order] = &block_start;
+	nr_free_blocks_[order]++;
+	set_free_block(order, block_start.pfn(), true);
 }
 
 /**
@@ -121,60 +173,329 @@ void page_allocator_buddy::remove_free_block(int order, page &block_start)
 	// Assert that the starting page in the block is aligned to the requested order.
 	assert(block_aligned(order, block_start.pfn()));
 
-	// Loop through the free list for the given order, until we find the
-	// block to remove.
-	page *target = &block_start;
-	page **candidate_slot = &free_list_[order];
-	while (*candidate_slot && *candidate_slot != target) {
-		candidate_slot = &(metadata(*candidate_slot)->next_free);
-	}
+	// Assert that the block actually exists, i.e. the requested block really was in the free list for the order.
+	assert(is_free_block(order, block_start.pfn()));
 
-	// Assert that the candidate block actually exists, i.e. the requested
-	// block really was in the free list for the order.
-	assert(*candidate_slot == target);
+	// Unlink the block from its neighbours in the list.
+	if (block_start.prev_free_) {
+		block_start.prev_free_->next_free_ = block_start.next_free_;
+	} else {
+		free_list_[block_start.free_type_][order] = block_start.next_free_;
+	}
 
-	// The candidate slot is the "next" pointer of the target's previous block.
-	// So, update that to point that to the target block's next pointer, thus
-	// removing the requested block from the linked-list.
-	*candidate_slot = metadata(target)->next_free;
+	if (block_start.next_free_) {
+		block_start.next_free_->prev_free_ = block_start.prev_free_;
+	}
 
-	// Clear the next_free pointer of the target block.
-	metadata(target)->next_free = nullptr;
+	block_start.next_free_ = nullptr;
+	block_start.prev_free_ = nullptr;
+	nr_free_blocks_[order]--;
+	set_free_block(order, block_start.pfn(), false);
 }
 
 /**
  * @brief Splits a free block of pages from a given order, into two halves into a lower order.
  *
- * ** You are required to implement this function **
  * @param order The order in which the free block current exists.
  * @param block_start The starting page of the block to be split.
  */
-void page_allocator_buddy::split_block(int order, page &block_start) { panic("TODO"); }
+void page_allocator_buddy::split_block(int order, page &block_start)
+{
+	assert(order > 0);
+
+	remove_free_block(order, block_start);
+
+	// The upper half is inserted first, so that the lower half ends up at the head of the list.
+	insert_free_block(order - 1, page::get_from_pfn(block_start.pfn() + pages_per_block(order - 1)));
+	insert_free_block(order - 1, block_start);
+}
 
 /**
  * @brief Merges two buddy-adjacent free blocks in one order, into a block in the next higher order.
  *
- * ** You are required to implement this function **
  * @param order The order in which to merge buddies.
  * @param buddy Either buddy page in the free block.
  */
-void page_allocator_buddy::merge_buddies(int order, page &buddy) { panic("TODO"); }
+void page_allocator_buddy::merge_buddies(int order, page &buddy)
+{
+	assert(order < LastOrder);
+
+	u64 lower_pfn = buddy.pfn() & ~pages_per_block(order);
+
+	remove_free_block(order, page::get_from_pfn(lower_pfn));
+	remove_free_block(order, page::get_from_pfn(lower_pfn + pages_per_block(order)));
+
+	insert_free_block(order + 1, page::get_from_pfn(lower_pfn));
+}
+
+/**
+ * @brief Inserts a block into the free lists, merging it with its buddy for as long as the buddy is free too.  Must
+ * be called with the lock held.
+ *
+ * @param order The order of the block being freed.
+ * @param block_start The starting page of the block.
+ */
+void page_allocator_buddy::free_block(int order, page &block_start)
+{
+	u64 pfn = block_start.pfn();
+
+	insert_free_block(order, block_start);
+	total_free_ += pages_per_block(order);
+
+	while (order < LastOrder && is_free_block(order, pfn ^ pages_per_block(order))) {
+		merge_buddies(order, page::get_from_pfn(pfn));
+
+		pfn &= ~pages_per_block(order);
+		order++;
+	}
+}
 
 /**
  * @brief Allocates pages, using the buddy algorithm.
  *
- * ** You are required to implement this function **
  * @param order The order of pages to allocate (i.e. 2^order number of pages)
  * @param flags Any allocation flags to take into account.
  * @return page* The starting page of the block that was allocated, or nullptr if the allocation cannot be satisfied.
  */
-page *page_allocator_buddy::allocate_pages(int order, page_allocation_flags flags) { panic("TODO"); }
+page *page_allocator_buddy::allocate_pages(int order, page_allocation_flags flags)
+{
+	if (order < 0 || order > LastOrder) {
+		return nullptr;
+	}
+
+	bool want_movable = (flags & page_allocation_flags::movable) == page_allocation_flags::movable;
+	block_type type = want_movable ? movable : unmovable;
+	page *block;
+	bool below_low;
+
+	{
+		unique_irq_lock l(lock_);
+
+		// What is left below the minimum watermark is kept for reserve allocations.
+		if ((flags & page_allocation_flags::reserve) != page_allocation_flags::reserve && total_free_ < min_watermark_ + pages_per_block(order)) {
+			l.unlock();
+
+			reclaimer::get().wake();
+			return nullptr;
+		}
+
+		// Find the smallest order with a free block of the right type that is big enough.
+		int source_order = order;
+		while (source_order <= LastOrder && !free_list_[type][source_order]) {
+			source_order++;
+		}
+
+		if (source_order <= LastOrder) {
+			block = free_list_[type][source_order];
+		} else {
+			block = take_fallback_block(order, type, source_order);
+		}
+
+		if (!block) {
+			l.unlock();
+
+			// Blocks up to a pageblock may be made by moving pages out of the way.
+			if (order > 0 && order <= PageblockOrder) {
+				compactor::get().request(order);
+			}
+
+			return nullptr;
+		}
+
+		// Split it down to the requested order, keeping the lower half each time.
+		while (source_order > order) {
+			split_block(source_order, *block);
+			source_order--;
+		}
+
+		remove_free_block(order, *block);
+		total_free_ -= pages_per_block(order);
+		below_low = total_free_ < low_watermark_;
+	}
+
+	if (below_low) {
+		reclaimer::get().wake();
+	}
+
+	block->movable_ = want_movable;
+
+	if ((flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
+		memops::pzero(block->base_address_ptr(), pages_per_block(order));
+	}
+
+	return block;
+}
 
 /**
  * @brief Frees previously allocated pages, using the buddy algorithm.
  *
- * ** You are required to implement this function **
  * @param block_start The starting page of the block to be freed.
  * @param order The order of the block being freed.
  */
-void page_allocator_buddy::free_pages(page &block_start, int order) { panic("TODO"); }
+void page_allocator_buddy::free_pages(page &block_start, int order)
+{
+	unique_irq_lock l(lock_);
+	free_block(order, block_start);
+}
+
+/**
+ * @brief Takes a free block from the lists of the other type, when there is nothing of the right type.  The biggest
+ * block is taken, and if it is big enough to be worth it (or the allocation is unmovable, as spreading those out is
+ * what makes memory impossible to compact), the whole of its pageblock is claimed for the new type.  Must be called
+ * with the lock held.
+ *
+ * @param order The order being allocated.
+ * @param type The type being allocated.
+ * @param source_order Set to the order of the block that was taken.
+ * @return page* The block, which is still on a free list, or nullptr if there is no block big enough.
+ */
+page *page_allocator_buddy::take_fallback_block(int order, block_type type, int &source_order)
+{
+	block_type other = type == movable ? unmovable : movable;
+
+	for (int o = LastOrder; o >= order; o--) {
+		page *block = free_list_[other][o];
+		if (!block) {
+			continue;
+		}
+
+		grouping_counters_.steals++;
+
+		if (o >= PageblockOrder) {
+			// Only one pageblock is taken over, and the rest of the block is left for the other type.
+			while (o > PageblockOrder) {
+				split_block(o, *block);
+				o--;
+			}
+
+			set_pageblock_type(block->pfn(), type);
+			remove_free_block(o, *block);
+			insert_free_block(o, *block);
+
+			grouping_counters_.claims++;
+		} else if (type == unmovable || o >= 4) {
+			claim_pageblock(block->pfn(), type);
+			grouping_counters_.claims++;
+		}
+
+		source_order = o;
+		return block;
+	}
+
+	return nullptr;
+}
+
+/**
+ * @brief Changes the type of the pageblock holding a page, moving the free blocks inside it to the lists for the new
+ * type.  Must be called with the lock held.
+ */
+void page_allocator_buddy::claim_pageblock(u64 pfn, block_type type)
+{
+	u64 start = pfn & ~(pages_per_block(PageblockOrder) - 1);
+	u64 end = start + pages_per_block(PageblockOrder);
+
+	set_pageblock_type(start, type);
+
+	for (pfn = start; pfn < end && pfn < nr_pages_;) {
+		int order = PageblockOrder - 1;
+		while (order >= 0 && !(block_aligned(order, pfn) && is_free_block(order, pfn))) {
+			order--;
+		}
+
+		if (order < 0) {
+			pfn++;
+			continue;
+		}
+
+		page &block = page::get_from_pfn(pfn);
+		remove_free_block(order, block);
+		insert_free_block(order, block);
+
+		pfn += pages_per_block(order);
+	}
+}
+
+/**
+ * @brief Returns the number of movable and unmovable pageblocks, and how often one type has had to take memory from
+ * the other.
+ */
+page_allocator::grouping_stats page_allocator_buddy::get_grouping_stats() const
+{
+	unique_irq_lock l(const_cast<spinlock_irq &>(lock_));
+
+	grouping_stats stats = grouping_counters_;
+	stats.movable_blocks = stats.unmovable_blocks = 0;
+
+	for (u64 pfn = 0; pfn < nr_pages_; pfn += pages_per_block(PageblockOrder)) {
+		if (pageblock_type(pfn) == movable) {
+			stats.movable_blocks++;
+		} else {
+			stats.unmovable_blocks++;
+		}
+	}
+
+	return stats;
+}
+
+/**
+ * @brief Looks through some of the movable pageblocks for a region of the given order that could be emptied, by
+ * moving every page in it that is in use.
+ */
+bool page_allocator_buddy::find_compaction_region(int order, u64 &start_pfn, bool &wrapped)
+{
+	unique_irq_lock l(lock_);
+
+	u64 region_pages = pages_per_block(order);
+	wrapped = false;
+
+	for (unsigned int i = 0; i < compaction_scan_regions; i++) {
+		u64 pfn = (compaction_cursor_ + region_pages - 1) & ~(region_pages - 1);
+
+		if (pfn + region_pages > nr_pages_) {
+			compaction_cursor_ = 0;
+			wrapped = true;
+			return false;
+		}
+
+		compaction_cursor_ = pfn + region_pages;
+
+		if (pageblock_type(pfn) == movable && region_compactable(pfn, order)) {
+			start_pfn = pfn;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Checks whether every page in a region is either free, or a private user page that can be moved.  Must be
+ * called with the lock held.
+ */
+bool page_allocator_buddy::region_compactable(u64 start_pfn, int order)
+{
+	u64 end = start_pfn + pages_per_block(order);
+	u64 nr_used = 0;
+
+	for (u64 pfn = start_pfn; pfn < end;) {
+		int free_order = order - 1;
+		while (free_order >= 0 && !(block_aligned(free_order, pfn) && is_free_block(free_order, pfn))) {
+			free_order--;
+		}
+
+		if (free_order >= 0) {
+			pfn += pages_per_block(free_order);
+			continue;
+		}
+
+		const page &pg = page::get_from_pfn(pfn);
+		if (pg.type_ != page_type::allocable || !pg.mapper_ || pg.pinned_) {
+			return false;
+		}
+
+		nr_used++;
+		pfn++;
+	}
+
+	return nr_used > 0;
+}
@@ -20,34 +20,35 @@ static inline page_metadata *metadata(page *page) { return (page_metadata *)page
 
 void page_allocator_linear::insert_free_pages(page &range_start, u64 page_count)
 {
-	page **slot = &free_list_;
-
-	while (*slot) {
-		slot = &(metadata(*slot)->next_free);
-	}
-
-	*slot = &range_start;
-	metadata(&range_start)->next_free = nullptr;
-	metadata(&range_start)->free_block_size = page_count;
+	unique_irq_lock l(lock_);
+	insert_free_block(range_start, page_count);
 }
 
 page *page_allocator_linear::allocate_pages(int order, page_allocation_flags flags)
 {
 	u64 page_count = 1 << order;
 
+	unique_irq_lock l(lock_);
+
 	// find a free block with enough pages
 	// take from the end, so we can just reduce the free block size
 
-	page *free_block = free_list_;
+	page **slot = &free_list_;
 
-	while (free_block) {
-		// TODO: Little hack here -- we subtract one so that we don't have to remove the free
-		// block from the list when it's fully used up, since metadata is stored at the start
-		// of the free block.
-		if ((metadata(free_block)->free_block_size - 1) >= page_count) {
-			metadata(free_block)->free_block_size -= page_count;
+	while (*slot) {
+		page *free_block = *slot;
+		u64 free_block_size = metadata(free_block)->free_block_size;
+
+		if (free_block_size >= page_count) {
+			// The metadata is stored at the start of the free block, so the block can only be taken off the list
+			// once all of it has been used.
+			if (free_block_size == page_count) {
+				*slot = metadata(free_block)->next_free;
+			} else {
+				metadata(free_block)->free_block_size -= page_count;
+			}
 
-			u64 start_pfn = free_block->pfn() + metadata(free_block)->free_block_size;
+			u64 start_pfn = free_block->pfn() + free_block_size - page_count;
 			if ((flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
 				memops::pzero(page::get_from_pfn(start_pfn).base_address_ptr(), page_count);
 			}
@@ -55,7 +56,7 @@ page *page_allocator_linear::allocate_pages(int order, page_allocation_flags fla
 			return &page::get_from_pfn(start_pfn);
 		}
 
-		free_block = metadata(free_block)->next_free;
+		slot = &(metadata(free_block)->next_free);
 	}
 
 	return nullptr;
@@ -63,7 +64,36 @@ page *page_allocator_linear::allocate_pages(int order, page_allocation_flags fla
 
 void page_allocator_linear::free_pages(page &base, int order)
 {
-	// TODO
+	unique_irq_lock l(lock_);
+	insert_free_block(base, 1 << order);
+}
+
+void page_allocator_linear::insert_free_block(page &block_start, u64 page_count)
+{
+	// The free list is kept in address order, so that a block can be merged with the free blocks either side of it.
+	page *prev = nullptr;
+	page **slot = &free_list_;
+
+	while (*slot && (*slot)->pfn() < block_start.pfn()) {
+		prev = *slot;
+		slot = &(metadata(*slot)->next_free);
+	}
+
+	page *next = *slot;
+
+	metadata(&block_start)->next_free = next;
+	metadata(&block_start)->free_block_size = page_count;
+	*slot = &block_start;
+
+	if (next && block_start.pfn() + page_count == next->pfn()) {
+		metadata(&block_start)->free_block_size += metadata(next)->free_block_size;
+		metadata(&block_start)->next_free = metadata(next)->next_free;
+	}
+
+	if (prev && prev->pfn() + metadata(prev)->free_block_size == block_start.pfn()) {
+		metadata(prev)->free_block_size += metadata(&block_start)->free_block_size;
+		metadata(prev)->next_free = metadata(&block_start)->next_free;
+	}
 }
 
 void page_allocator_linear::dump() const
@@ -80,7 +110,7 @@ void page_allocator_linear::dump() const
 	while (free_block) {
 		u64 free_block_start = free_block->pfn();
 		u64 free_block_end = free_block_start + metadata(free_block)->free_block_size;
-		dprintf("  block start=0x%lx, end=0x%lx, size=0x%x\n", free_block_start, free_block_end, free_block_end - free_block_start);
+		dprintf("  block start=0x%llx, end=0x%llx, size=0x%llx\n", free_block_start, free_block_end, free_block_end - free_block_start);
 
 		free_block = metadata(free_block)->next_free;
 	}
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/page-allocator-numa.h>
+#include <stacsos/kernel/mem/page.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::mem;
+
+u64 page_allocator_numa::metadata_size(u64 nr_page_descriptors) const
+{
+	// Every node's allocator covers every page descriptor, as its memory could be anywhere in the physical address
+	// space.
+	u64 size = 0;
+	for (unsigned int node = 0; node < nr_nodes_; node++) {
+		size += align_metadata(nodes_[node]->metadata_size(nr_page_descriptors));
+	}
+
+	return size;
+}
+
+void page_allocator_numa::init_metadata(void *metadata, u64 nr_page_descriptors)
+{
+	uintptr_t next = (uintptr_t)metadata;
+	for (unsigned int node = 0; node < nr_nodes_; node++) {
+		nodes_[node]->init_metadata((void *)next, nr_page_descriptors);
+		next += align_metadata(nodes_[node]->metadata_size(nr_page_descriptors));
+	}
+}
+
+void page_allocator_numa::insert_free_pages(page &range_start, u64 page_count)
+{
+	// The range is split wherever the node changes, and each part given to its own node.
+	u64 pfn = range_start.pfn();
+	u64 end_pfn = pfn + page_count;
+
+	while (pfn < end_pfn) {
+		unsigned int node = page::get_from_pfn(pfn).node_;
+
+		u64 run_end = pfn + 1;
+		while (run_end < end_pfn && page::get_from_pfn(run_end).node_ == node) {
+			run_end++;
+		}
+
+		nodes_[node]->insert_free_pages(page::get_from_pfn(pfn), run_end - pfn);
+		pfn = run_end;
+	}
+}
+
+page *page_allocator_numa::allocate_pages(int order, page_allocation_flags flags)
+{
+	auto &topology = numa_topology::get();
+	unsigned int local = topology.current_node();
+
+	for (unsigned int i = 0; i < nr_nodes_; i++) {
+		page *pg = nodes_[topology.fallback(local, i)]->allocate_pages(order, flags);
+		if (pg) {
+			return pg;
+		}
+	}
+
+	return nullptr;
+}
+
+void page_allocator_numa::free_pages(page &base, int order) { nodes_[base.node_]->free_pages(base, order); }
+
+void page_allocator_numa::free_pages_direct(page &base, int order) { nodes_[base.node_]->free_pages_direct(base, order); }
+
+u64 page_allocator_numa::free_blocks(int order) const
+{
+	u64 count = 0;
+	for (unsigned int node = 0; node < nr_nodes_; node++) {
+		count += nodes_[node]->free_blocks(order);
+	}
+
+	return count;
+}
+
+u64 page_allocator_numa::free_page_count() const
+{
+	u64 count = 0;
+	for (unsigned int node = 0; node < nr_nodes_; node++) {
+		count += nodes_[node]->free_page_count();
+	}
+
+	return count;
+}
+
+u64 page_allocator_numa::reclaim_target() const
+{
+	u64 target = 0;
+	for (unsigned int node = 0; node < nr_nodes_; node++) {
+		target += nodes_[node]->reclaim_target();
+	}
+
+	return target;
+}
+
+page_allocator::grouping_stats page_allocator_numa::get_grouping_stats() const
+{
+	grouping_stats total = {};
+	for (unsigned int node = 0; node < nr_nodes_; node++) {
+		grouping_stats stats = nodes_[node]->get_grouping_stats();
+
+		total.movable_blocks += stats.movable_blocks;
+		total.unmovable_blocks += stats.unmovable_blocks;
+		total.steals += stats.steals;
+		total.claims += stats.claims;
+	}
+
+	return total;
+}
+
+bool page_allocator_numa::find_compaction_region(int order, u64 &start_pfn, bool &wrapped)
+{
+	// Each node is searched in turn, and the search has only wrapped once the last node has.  A node's allocator
+	// searches all of memory, so only regions that start on the node itself are taken.
+	unsigned int node = __atomic_load_n(&compaction_node_, __ATOMIC_RELAXED);
+	bool node_wrapped;
+
+	wrapped = false;
+	if (nodes_[node]->find_compaction_region(order, start_pfn, node_wrapped)) {
+		return page::get_from_pfn(start_pfn).node_ == node;
+	}
+
+	if (node_wrapped) {
+		unsigned int next = (node + 1) % nr_nodes_;
+		__atomic_store_n(&compaction_node_, next, __ATOMIC_RELAXED);
+
+		wrapped = next == 0;
+	}
+
+	return false;
+}
+
+void page_allocator_numa::dump() const
+{
+	dprintf("*** numa page allocator - %u nodes (%llu pages free) ***\n", nr_nodes_, free_page_count());
+
+	for (unsigned int node = 0; node < nr_nodes_; node++) {
+		dprintf("--- node %u (%llu pages free) ---\n", node, nodes_[node]->free_page_count());
+		nodes_[node]->dump();
+	}
+}
@@ -37,10 +37,10 @@ void page_allocator::perform_selftest()
 		panic("page allocation failed during self-test");
 	}
 
-	dprintf("  allocated pfn=%lx, base=%lx\n", test5page->pfn(), test5page->base_address());
+	dprintf("  allocated pfn=%llx, base=%llx\n", test5page->pfn(), test5page->base_address());
 	dump();
 
-	dprintf("(6) Free page (PFN=%lx, ORDER=0)\n", test5page->pfn());
+	dprintf("(6) Free page (PFN=%llx, ORDER=0)\n", test5page->pfn());
 	free_pages(*test5page, 0);
 	dump();
 
@@ -54,10 +54,10 @@ void page_allocator::perform_selftest()
 		panic("page allocation failed during self-test");
 	}
 
-	dprintf("  allocated pfn=%lx, base=%lx\n", test8page->pfn(), test8page->base_address());
+	dprintf("  allocated pfn=%llx, base=%llx\n", test8page->pfn(), test8page->base_address());
 	dump();
 
-	dprintf("(9) Free page (PFN=%lx, ORDER=1)\n", test8page->pfn());
+	dprintf("(9) Free page (PFN=%llx, ORDER=1)\n", test8page->pfn());
 	free_pages(*test8page, 1);
 	dump();
 
@@ -71,16 +71,16 @@ void page_allocator::perform_selftest()
 		panic("page allocation failed during self-test");
 	}
 
-	dprintf("  allocated pfn=%lx, base=%lx\n", test11page->pfn(), test11page->base_address());
+	dprintf("  allocated pfn=%llx, base=%llx\n", test11page->pfn(), test11page->base_address());
 	dump();
 
 	auto test12page = test11page + 1;
 
-	dprintf("(12) Free one page in middle of allocation (PFN=%lx, ORDER=0)\n", test12page->pfn());
+	dprintf("(12) Free one page in middle of allocation (PFN=%llx, ORDER=0)\n", test12page->pfn());
 	free_pages(*test12page, 0);
 	dump();
 
-	dprintf("(13) Free one page at start of allocation (PFN=%lx, ORDER=0)\n", test11page->pfn());
+	dprintf("(13) Free one page at start of allocation (PFN=%llx, ORDER=0)\n", test11page->pfn());
 	free_pages(*test11page, 0);
 	dump();
 
@@ -93,7 +93,7 @@ void page_allocator::perform_selftest()
 	if (!test15page) {
 		dprintf("good!! allocation failed\n");
 	} else {
-		dprintf("bad!! allocated pfn=%lx, base=%lx\n", test11page->pfn(), test11page->base_address());
+		dprintf("bad!! allocated pfn=%llx, base=%llx\n", test11page->pfn(), test11page->base_address());
 	}
 
 	dump();
@@ -0,0 +1,275 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page-cache.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/list.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::fs;
+using namespace stacsos::kernel::mem;
+
+page *page_cache::get_page(fs_node &node, file &f, u64 page_index, bool writable)
+{
+	{
+		unique_irq_lock l(lock_);
+
+		cached_page *cp = lookup(node, page_index);
+		if (cp) {
+			counters_.hits++;
+			mark_accessed(*cp);
+
+			if (writable) {
+				pages_of(node)->set_tag(page_index, tag_dirty);
+			}
+
+			cp->pg.acquire();
+			return &cp->pg;
+		}
+
+		counters_.misses++;
+	}
+
+	// Reading the file may have to wait for the disk, so it is done without the lock held.  Starting from a zeroed
+	// page means that the part past the end of the file is already cleared.
+	page *pg = zeroed_page_pool::get().allocate();
+	if (!pg) {
+		return nullptr;
+	}
+
+	u64 offset = page_index << PAGE_BITS;
+	if (offset < f.size()) {
+		f.pread(pg->base_address_ptr(), offset, min((u64)PAGE_SIZE, f.size() - offset));
+	}
+
+	unique_irq_lock l(lock_);
+
+	// Someone else may have read the same page in the meantime, in which case theirs is the one that is kept.
+	cached_page *existing = lookup(node, page_index);
+	if (existing) {
+		memory_manager::get().pgalloc().free_pages(*pg, 0);
+
+		if (writable) {
+			pages_of(node)->set_tag(page_index, tag_dirty);
+		}
+
+		existing->pg.acquire();
+		return &existing->pg;
+	}
+
+	page_tree *pages = pages_of(node);
+	if (!pages) {
+		// The node is kept in memory for as long as any of its pages are cached.
+		node.acquire();
+
+		pages = new page_tree();
+		files_.add(&node, pages);
+	}
+
+	cached_page *cp = new cached_page(node, page_index, *pg);
+
+	pg->set_cached(true);
+	pg->acquire();
+
+	pages->insert(page_index, cp);
+	if (writable) {
+		pages->set_tag(page_index, tag_dirty);
+	}
+
+	inactive_.append(*cp);
+
+	return pg;
+}
+
+u64 page_cache::reclaim(u64 nr_pages)
+{
+	lru_list victims;
+	list<page_tree *> emptied;
+	list<fs_node *> released;
+
+	{
+		unique_irq_lock l(lock_);
+
+		u64 nr_scan = nr_pages * scan_factor;
+		while (victims.count() < nr_pages && nr_scan-- && !(active_.empty() && inactive_.empty())) {
+			if (inactive_.empty() || active_.count() > inactive_.count()) {
+				age_active();
+			}
+
+			cached_page *cp = inactive_.first();
+
+			// A page that is mapped somewhere is in use, however long ago it was looked up.
+			if (cp->pg.refcount()) {
+				inactive_.remove(*cp);
+				cp->active = true;
+				cp->referenced = false;
+				active_.append(*cp);
+
+				counters_.activations++;
+				continue;
+			}
+
+			page_tree *pages = pages_of(cp->node);
+
+			// A page that has been looked up since it was last looked at gets a second chance.
+			if (cp->referenced || pages->get_tag(cp->index, tag_dirty)) {
+				cp->referenced = false;
+				inactive_.rotate();
+				continue;
+			}
+
+			inactive_.remove(*cp);
+			victims.append(*cp);
+
+			pages->remove(cp->index);
+
+			if (!pages->count()) {
+				files_.remove(&cp->node);
+				emptied.append(pages);
+				released.append(&cp->node);
+			}
+		}
+
+		counters_.reclaimed += victims.count();
+	}
+
+	u64 nr_freed = victims.count();
+
+	while (cached_page *cp = victims.dequeue()) {
+		cp->pg.set_cached(false);
+		memory_manager::get().pgalloc().free_pages(cp->pg, 0);
+		delete cp;
+	}
+
+	for (auto *pages : emptied) {
+		delete pages;
+	}
+
+	for (fs_node *node : released) {
+		node->release();
+	}
+
+	return nr_freed;
+}
+
+u64 page_cache::drop(fs_node &node, u64 first, u64 last)
+{
+	lru_list victims;
+	page_tree *emptied = nullptr;
+
+	{
+		unique_irq_lock l(lock_);
+
+		page_tree *pages = pages_of(node);
+		if (!pages) {
+			return 0;
+		}
+
+		pages->for_each_range(first, last, [&](u64 index, cached_page *cp) {
+			if (cp->pg.refcount() || pages->get_tag(index, tag_dirty)) {
+				return;
+			}
+
+			(cp->active ? active_ : inactive_).remove(*cp);
+			victims.append(*cp);
+
+			pages->remove(index);
+		});
+
+		if (!pages->count()) {
+			files_.remove(&node);
+			emptied = pages;
+		}
+
+		counters_.reclaimed += victims.count();
+	}
+
+	u64 nr_freed = victims.count();
+
+	while (cached_page *cp = victims.dequeue()) {
+		cp->pg.set_cached(false);
+		memory_manager::get().pgalloc().free_pages(cp->pg, 0);
+		delete cp;
+	}
+
+	if (emptied) {
+		delete emptied;
+		node.release();
+	}
+
+	return nr_freed;
+}
+
+page_cache::stats page_cache::get_stats()
+{
+	unique_irq_lock l(lock_);
+
+	stats s = counters_;
+	s.active = active_.count();
+	s.inactive = inactive_.count();
+
+	return s;
+}
+
+/**
+ * @brief Notes that a page has been looked up.  The first time since it was last aged sets its referenced bit, and
+ * the second moves it to the active list.  With the lock held.
+ */
+void page_cache::mark_accessed(cached_page &cp)
+{
+	if (!cp.referenced) {
+		cp.referenced = true;
+		return;
+	}
+
+	if (!cp.active) {
+		inactive_.remove(cp);
+		cp.active = true;
+		cp.referenced = false;
+		active_.append(cp);
+
+		counters_.activations++;
+	}
+}
+
+/**
+ * @brief Moves the oldest page on the active list to the inactive list, where it has to be looked up again before it
+ * is reclaimed to get back.  With the lock held.
+ */
+void page_cache::age_active()
+{
+	cached_page *cp = active_.dequeue();
+	if (!cp) {
+		return;
+	}
+
+	cp->active = false;
+	cp->referenced = false;
+	inactive_.append(*cp);
+}
+
+page_cache::page_tree *page_cache::pages_of(fs_node &node)
+{
+	page_tree *pages;
+	if (!files_.try_get_value(&node, pages)) {
+		return nullptr;
+	}
+
+	return pages;
+}
+
+page_cache::cached_page *page_cache::lookup(fs_node &node, u64 page_index)
+{
+	page_tree *pages = pages_of(node);
+	return pages ? pages->lookup(page_index) : nullptr;
+}
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/numa.h>
+#include <stacsos/kernel/mem/page-frame-cache.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::arch;
+
+page *page_frame_cache::allocate_pages(int order, page_allocation_flags flags)
+{
+	if (order != 0) {
+		return backing_.allocate_pages(order, flags);
+	}
+
+	bool movable = (flags & page_allocation_flags::movable) == page_allocation_flags::movable;
+	auto &cache = caches_.get();
+	auto &list = cache.lists[movable];
+	page *pg;
+
+	{
+		unique_irq_lock l(cache.lock);
+
+		if (list.count) {
+			cache.counters.hits++;
+		} else {
+			cache.counters.misses++;
+			refill(cache, movable, (flags & page_allocation_flags::reserve) == page_allocation_flags::reserve);
+		}
+
+		pg = (flags & page_allocation_flags::cold) == page_allocation_flags::cold ? pop_cold(list) : pop_hot(list);
+	}
+
+	if (pg && (flags & page_allocation_flags::zero) == page_allocation_flags::zero) {
+		memops::pzero(pg->base_address_ptr(), 1);
+	}
+
+	return pg;
+}
+
+void page_frame_cache::free_pages(page &base, int order)
+{
+	// A page from another node goes straight back to its own node, so that the lists only ever hold local pages.
+	if (order != 0 || base.node_ != numa_topology::get().current_node()) {
+		backing_.free_pages(base, order);
+		return;
+	}
+
+	bool movable = base.movable_;
+	auto &cache = caches_.get();
+
+	unique_irq_lock l(cache.lock);
+	push_hot(cache.lists[movable], base);
+
+	if (cache.lists[movable].count > high_) {
+		drain(cache, movable);
+	}
+}
+
+void page_frame_cache::refill(per_core_cache &cache, bool movable, bool reserve)
+{
+	cache.counters.refills++;
+
+	page_allocation_flags flags = movable ? page_allocation_flags::movable : page_allocation_flags::none;
+	if (reserve) {
+		flags |= page_allocation_flags::reserve;
+	}
+
+	// Pages straight from the page allocator haven't been touched recently, so go on the cold end.  A reserve
+	// allocation only takes the one page it needs, so as not to use up the reserve filling the list.
+	for (unsigned int i = 0; i < (reserve ? 1 : batch_); i++) {
+		page *pg = backing_.allocate_pages(0, flags);
+		if (!pg) {
+			break;
+		}
+
+		push_cold(cache.lists[movable], *pg);
+	}
+}
+
+void page_frame_cache::drain(per_core_cache &cache, bool movable)
+{
+	cache.counters.drains++;
+
+	auto &list = cache.lists[movable];
+	for (unsigned int i = 0; i < batch_ && list.count; i++) {
+		backing_.free_pages(*pop_cold(list), 0);
+	}
+}
+
+void page_frame_cache::push_hot(page_list &list, page &pg)
+{
+	pg.prev_free_ = nullptr;
+	pg.next_free_ = list.hot;
+
+	if (list.hot) {
+		list.hot->prev_free_ = &pg;
+	} else {
+		list.cold = &pg;
+	}
+
+	list.hot = &pg;
+	list.count++;
+}
+
+void page_frame_cache::push_cold(page_list &list, page &pg)
+{
+	pg.next_free_ = nullptr;
+	pg.prev_free_ = list.cold;
+
+	if (list.cold) {
+		list.cold->next_free_ = &pg;
+	} else {
+		list.hot = &pg;
+	}
+
+	list.cold = &pg;
+	list.count++;
+}
+
+page *page_frame_cache::pop_hot(page_list &list)
+{
+	page *pg = list.hot;
+	if (!pg) {
+		return nullptr;
+	}
+
+	list.hot = pg->next_free_;
+	if (list.hot) {
+		list.hot->prev_free_ = nullptr;
+	} else {
+		list.cold = nullptr;
+	}
+
+	list.count--;
+	return pg;
+}
+
+page *page_frame_cache::pop_cold(page_list &list)
+{
+	page *pg = list.cold;
+	if (!pg) {
+		return nullptr;
+	}
+
+	list.cold = pg->prev_free_;
+	if (list.cold) {
+		list.cold->next_free_ = nullptr;
+	} else {
+		list.hot = nullptr;
+	}
+
+	list.count--;
+	return pg;
+}
+
+void page_frame_cache::dump() const
+{
+	dprintf("*** per-core page frame caches (batch=%u, high=%u) ***\n", batch_, high_);
+
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		const auto &cache = caches_[i];
+		u64 total = cache.counters.hits + cache.counters.misses;
+
+		if (!total) {
+			continue;
+		}
+
+		dprintf("  core %d: %u pages (%u movable), hits=%llu misses=%llu (%llu%% hit rate), refills=%llu drains=%llu\n", i,
+			cache.lists[0].count + cache.lists[1].count, cache.lists[1].count, cache.counters.hits,
+			cache.counters.misses, (cache.counters.hits * 100) / total, cache.counters.refills, cache.counters.drains);
+	}
+
+	backing_.dump();
+}
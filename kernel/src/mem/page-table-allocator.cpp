@@ -1,16 +1,96 @@
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page-table-allocator.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos;
+using namespace stacsos::kernel::arch;
 using namespace stacsos::kernel::mem;
 
 page *page_table_allocator::allocate()
 {
-	page *p = memory_manager::get().pgalloc().allocate_pages(0, page_allocation_flags::zero);
+	auto &cache = caches_.get();
+	page *p = nullptr;
+
+	{
+		unique_irq_lock l(cache.lock);
+
+		if (cache.count) {
+			cache.counters.hits++;
+			p = cache.pages[--cache.count];
+		} else {
+			cache.counters.misses++;
+		}
+	}
+
+	if (!p) {
+		p = refill(cache);
+	}
+
 	if (p == nullptr) {
 		panic("unable to allocate page table");
 	}
 
+	__atomic_add_fetch(&nr_pages_, 1, __ATOMIC_RELAXED);
+	p->set_table_entries(0);
+
 	return p;
 }
 
-void page_table_allocator::free(page *pg) { memory_manager::get().pgalloc().free_pages(*pg, 0); }
+void page_table_allocator::free(page *pg, bool zeroed)
+{
+	__atomic_sub_fetch(&nr_pages_, 1, __ATOMIC_RELAXED);
+
+	if (zeroed) {
+		auto &cache = caches_.get();
+		unique_irq_lock l(cache.lock);
+
+		if (cache.count < cache_capacity) {
+			cache.pages[cache.count++] = pg;
+			return;
+		}
+	}
+
+	memory_manager::get().pgalloc().free_pages(*pg, 0);
+}
+
+/**
+ * @brief Takes a block of pages from the page allocator, clears them all in one go, and keeps all but one of them in
+ * the cache.  If there's no block that big, a single zeroed page is taken instead.
+ *
+ * @return page* The page that wasn't kept, or null if there were no pages at all.
+ */
+page *page_table_allocator::refill(per_core_cache &cache)
+{
+	const unsigned int nr_block_pages = 1u << refill_order;
+
+	// Page tables are allocated with an address space locked, so a single page can come out of the reserve, rather
+	// than a mapping failing for want of one.
+	page *block = memory_manager::get().pgalloc().allocate_pages(refill_order);
+	if (!block) {
+		return zeroed_page_pool::get().allocate(page_allocation_flags::reserve);
+	}
+
+	memops::pzero(block->base_address_ptr(), nr_block_pages);
+
+	// The pages are kept (and later freed) one at a time, which the page allocator allows, as it merges buddies again
+	// as they come back.
+	unsigned int i = 1;
+
+	{
+		unique_irq_lock l(cache.lock);
+
+		cache.counters.refills++;
+		while (i < nr_block_pages && cache.count < cache_capacity) {
+			cache.pages[cache.count++] = &page::get_from_pfn(block->pfn() + i++);
+		}
+	}
+
+	// Another allocation on this core may have filled the cache in the meantime.
+	for (; i < nr_block_pages; i++) {
+		memory_manager::get().pgalloc().free_pages(page::get_from_pfn(block->pfn() + i), 0);
+	}
+
+	return block;
+}
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page-cache.h>
+#include <stacsos/kernel/mem/reclaimer.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/thread.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::mem;
+
+void reclaimer::start()
+{
+	sched::process_manager::get().kernel_process()->create_thread((u64)thread_proc, this)->start();
+	__atomic_store_n(&started_, true, __ATOMIC_RELEASE);
+
+	// Memory may already have fallen below the watermark while nobody was listening.
+	wake();
+}
+
+void reclaimer::wake()
+{
+	if (!__atomic_load_n(&started_, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	// The thread clears the flag before it starts work, so it only needs waking by the first call since then.
+	if (!__atomic_exchange_n(&pending_, true, __ATOMIC_ACQ_REL)) {
+		wakeup_.trigger();
+	}
+}
+
+void reclaimer::register_shrinker(shrinker &s)
+{
+	sched::mutex_lock l(shrinkers_lock_);
+	shrinkers_.append(s);
+}
+
+void reclaimer::unregister_shrinker(shrinker &s)
+{
+	sched::mutex_lock l(shrinkers_lock_);
+	shrinkers_.remove(s);
+}
+
+u64 reclaimer::reclaim(u64 nr_pages)
+{
+	__atomic_add_fetch(&counters_.passes, 1, __ATOMIC_RELAXED);
+
+	// Cached pages are the cheapest to get back, as they can simply be read in again.
+	u64 pages = page_cache::get().reclaim(nr_pages);
+	__atomic_add_fetch(&counters_.pages_reclaimed, pages, __ATOMIC_RELAXED);
+
+	if (pages >= nr_pages) {
+		return pages;
+	}
+
+	u64 objects = 0;
+
+	{
+		sched::mutex_lock l(shrinkers_lock_);
+
+		for (shrinker *s : shrinkers_) {
+			u64 count = s->count_objects();
+			if (count) {
+				objects += s->scan_objects(max(count / shrink_divisor, min(count, min_shrink_scan)));
+			}
+		}
+	}
+
+	__atomic_add_fetch(&counters_.objects_shrunk, objects, __ATOMIC_RELAXED);
+	return pages + objects;
+}
+
+void reclaimer::thread_proc(void *arg)
+{
+	reclaimer *r = (reclaimer *)arg;
+	auto &pga = memory_manager::get().pgalloc();
+
+	while (true) {
+		r->wakeup_.wait();
+
+		__atomic_store_n(&r->pending_, false, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&r->counters_.wakeups, 1, __ATOMIC_RELAXED);
+
+		// Work stops once free memory is back above the high watermark, or when there is nothing left to free.
+		for (unsigned int pass = 0; pass < max_passes; pass++) {
+			u64 target = pga.reclaim_target();
+			if (!target || !r->reclaim(min(target, pages_per_pass))) {
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/shared-memory.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::mem;
+
+// No more than this can be asked for at once, which also keeps the page array's size sensible.
+static const u64 max_size = GB(1);
+
+shared_ptr<shared_memory> shared_memory::create(u64 size)
+{
+	if (!size || size > max_size) {
+		return nullptr;
+	}
+
+	u64 nr_pages = PAGE_ALIGN_UP(size) >> PAGE_BITS;
+
+	page **pages = new page *[nr_pages];
+	for (u64 i = 0; i < nr_pages; i++) {
+		pages[i] = zeroed_page_pool::get().allocate();
+		if (!pages[i]) {
+			free_pages(pages, i);
+			return nullptr;
+		}
+
+		// Address spaces treat a cached page as shared: they never free it when they unmap it.
+		pages[i]->set_cached(true);
+	}
+
+	return shared_ptr<shared_memory>(new shared_memory(size, pages, nr_pages));
+}
+
+shared_memory::~shared_memory() { free_pages(pages_, nr_pages_); }
+
+void shared_memory::free_pages(page **pages, u64 count)
+{
+	for (u64 i = 0; i < count; i++) {
+		pages[i]->set_cached(false);
+		memory_manager::get().pgalloc().free_pages(*pages[i], 0);
+	}
+
+	delete[] pages;
+}
+
+size_t shared_memory::pread(void *buffer, size_t offset, size_t length)
+{
+	if (offset >= size()) {
+		return 0;
+	}
+
+	length = min(length, (size_t)(size() - offset));
+
+	size_t done = 0;
+	while (done < length) {
+		u64 pos = offset + done;
+		size_t chunk = min(length - done, (size_t)(PAGE_SIZE - (pos & ~PAGE_MASK)));
+
+		memops::memcpy((u8 *)buffer + done, (u8 *)pages_[pos >> PAGE_BITS]->base_address_ptr() + (pos & ~PAGE_MASK), chunk);
+		done += chunk;
+	}
+
+	return done;
+}
+
+size_t shared_memory::pwrite(const void *buffer, size_t offset, size_t length)
+{
+	if (offset >= size()) {
+		return 0;
+	}
+
+	length = min(length, (size_t)(size() - offset));
+
+	size_t done = 0;
+	while (done < length) {
+		u64 pos = offset + done;
+		size_t chunk = min(length - done, (size_t)(PAGE_SIZE - (pos & ~PAGE_MASK)));
+
+		memops::memcpy((u8 *)pages_[pos >> PAGE_BITS]->base_address_ptr() + (pos & ~PAGE_MASK), (const u8 *)buffer + done, chunk);
+		done += chunk;
+	}
+
+	return done;
+}
@@ -12,20 +12,30 @@
 
 using namespace stacsos::kernel::mem;
 
-template <size_t object_size, int slab_page_order> void *slab_cache<object_size, slab_page_order>::allocate_slab()
+void *slab_cache_base::allocate_slab_pages(int order)
 {
-	page *slab_page = (memory_manager::get().pgalloc().allocate_pages(slab_page_order));
+	// Slabs are allocated with the object allocator's locks held, so can't wait for memory to be reclaimed, and dip into
+	// the reserve instead.
+	page *slab_page = (memory_manager::get().pgalloc().allocate_pages(order, page_allocation_flags::reserve));
 	if (!slab_page) {
 		panic("unable to allocate slab");
 	}
 
+	// The slab starts at the beginning of its first page.
+	for (u64 i = 0; i < (1ull << order); i++) {
+		page::get_from_pfn(slab_page->pfn() + i).set_slab(this, slab_page->base_address_ptr());
+	}
+
 	return slab_page->base_address_ptr();
 }
 
-template class slab_cache<16, 0>;
-template class slab_cache<32, 0>;
-template class slab_cache<64, 0>;
-template class slab_cache<128, 0>;
-template class slab_cache<256, 0>;
-template class slab_cache<512, 0>;
-template class slab_cache<1024, 0>;
+void slab_cache_base::free_slab_pages(void *slab, int order)
+{
+	page &first = page::get_from_base_address_ptr(slab);
+
+	for (u64 i = 0; i < (1ull << order); i++) {
+		page::get_from_pfn(first.pfn() + i).set_slab(nullptr, nullptr);
+	}
+
+	memory_manager::get().pgalloc().free_pages(first, order);
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/thread.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::sched;
+
+extern "C" u64 __x86_copy_user(void *dest, const void *src, size_t size);
+extern "C" s64 __x86_copy_string_user(char *dest, const char *src, size_t size);
+
+bool user_access::range_ok(const void *user_ptr, size_t size, region_flags access)
+{
+	if (!size) {
+		return true;
+	}
+
+	u64 base = (u64)user_ptr;
+	if (base >= user_limit || size > user_limit - base) {
+		return false;
+	}
+
+	return thread::current().owner().addrspace().range_accessible(base, size, access);
+}
+
+bool user_access::copy_from_user(void *dest, const void *user_src, size_t size)
+{
+	if (!readable(user_src, size)) {
+		return false;
+	}
+
+	return __x86_copy_user(dest, user_src, size) == 0;
+}
+
+bool user_access::copy_to_user(void *user_dest, const void *src, size_t size)
+{
+	if (!writable(user_dest, size)) {
+		return false;
+	}
+
+	return __x86_copy_user(user_dest, src, size) == 0;
+}
+
+bool user_access::copy_checked(void *dest, const void *src, size_t size) { return __x86_copy_user(dest, src, size) == 0; }
+
+s64 user_access::copy_string_from_user(char *dest, const char *user_src, size_t size)
+{
+	// The string's length isn't known until it has been copied, so only its start is checked.  Running off the end
+	// of its region is caught as a fault, and the copy never goes past the user half of the address space.
+	u64 base = (u64)user_src;
+	if (!size || !readable(user_src, 1)) {
+		return -1;
+	}
+
+	size = min(size, (size_t)(user_limit - base));
+
+	s64 length = __x86_copy_string_user(dest, user_src, size);
+	if (length < 0 || (u64)length >= size) {
+		return -1;
+	}
+
+	return length;
+}
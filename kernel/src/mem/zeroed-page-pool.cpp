@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::arch;
+
+page *zeroed_page_pool::allocate(page_allocation_flags flags)
+{
+	bool movable = (flags & page_allocation_flags::movable) == page_allocation_flags::movable;
+	auto &pool = pools_.get();
+
+	{
+		unique_irq_lock l(pool.lock);
+
+		if (!pool.pages[movable].empty()) {
+			pool.counters.hits++;
+			return pool.pages[movable].dequeue();
+		}
+
+		pool.counters.misses++;
+	}
+
+	// The idle thread hasn't kept up, so the page has to be cleared now.
+	return memory_manager::get().pgalloc().allocate_pages(0, flags | page_allocation_flags::zero);
+}
+
+bool zeroed_page_pool::refill_one()
+{
+	auto &pool = pools_.get();
+	bool movable;
+
+	{
+		unique_irq_lock l(pool.lock);
+
+		// Whichever list is emptier is filled first.
+		movable = pool.pages[1].count() < pool.pages[0].count();
+		if (pool.pages[movable].count() >= max_pages) {
+			return false;
+		}
+	}
+
+	// The page won't be used until later, so there's no point taking one that's still in the cache.
+	page_allocation_flags flags = page_allocation_flags::cold;
+	if (movable) {
+		flags |= page_allocation_flags::movable;
+	}
+
+	page *p = memory_manager::get().pgalloc().allocate_pages(0, flags);
+	if (!p) {
+		return false;
+	}
+
+	// The page may sit in the pool for a while, so it is cleared without taking up room in the cache.
+	memops::pzero_nt(p->base_address_ptr(), 1);
+
+	unique_irq_lock l(pool.lock);
+	pool.pages[movable].append(p);
+	pool.counters.refills++;
+
+	return true;
+}
+
+void zeroed_page_pool::dump() const
+{
+	dprintf("*** zeroed page pools ***\n");
+
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		const auto &pool = pools_[i];
+		u64 total = pool.counters.hits + pool.counters.misses;
+
+		if (!total && !pool.counters.refills) {
+			continue;
+		}
+
+		dprintf("  core %d: %u pages, hits=%llu misses=%llu (%llu%% hit rate), refills=%llu\n", i, pool.pages[0].count() + pool.pages[1].count(), pool.counters.hits,
+			pool.counters.misses, total ? (pool.counters.hits * 100) / total : 0, pool.counters.refills);
+	}
+}
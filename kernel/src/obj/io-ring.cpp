@@ -0,0 +1,302 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/obj/io-ring.h>
+#include <stacsos/kernel/obj/object-manager.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::obj;
+using namespace stacsos::kernel::sched;
+
+// How long a polling thread keeps looking for submissions after the last one, before it goes to sleep.
+static const u64 poll_idle_ms = 2;
+
+io_ring_object::io_ring_object(u64 id, process &owner, io_ring_header *ring, u32 entries, io_ring_flags flags)
+	: object(id)
+	, owner_(owner)
+	, ring_(ring)
+	, sqes_((io_ring_sqe *)(ring + 1))
+	, cqes_((io_ring_cqe *)(sqes_ + entries))
+	, entries_(entries)
+	, sq_head_(0)
+	, cq_tail_(0)
+	, poller_((flags & io_ring_flags::polled) == io_ring_flags::polled ? owner.create_helper_thread((u64)poller_thread_proc, this) : nullptr)
+	, stopping_(false)
+	, wakeup_(false)
+	, async_((flags & io_ring_flags::async) == io_ring_flags::async)
+	, dispatched_(async_ ? new io_ring_sqe[entries] : nullptr)
+	, dispatch_head_(0)
+	, dispatch_tail_(0)
+	, in_flight_(0)
+{
+	ring_->sq_head = ring_->sq_tail = 0;
+	ring_->cq_head = ring_->cq_tail = 0;
+	ring_->entries = entries;
+	ring_->sq_flags = 0;
+
+	if (poller_) {
+		poller_->start();
+	}
+
+	if (async_) {
+		for (auto &worker : workers_) {
+			shared_ptr<thread> t = owner.create_helper_thread((u64)worker_thread_proc, this);
+			worker = t;
+			worker->start();
+		}
+	}
+}
+
+io_ring_object::~io_ring_object()
+{
+	stop_helper(poller_, poller_wait_);
+
+	for (auto &worker : workers_) {
+		stop_helper(worker, worker_wait_);
+	}
+
+	delete[] dispatched_;
+}
+
+void io_ring_object::stop_helper(shared_ptr<thread> &helper, wait_queue &wq)
+{
+	if (!helper) {
+		return;
+	}
+
+	// The helper has already been stopped if the whole process is going away, in which case it can't be woken.
+	if (helper->state() != thread_states::terminated) {
+		wq.update_and_wake_all([this] { stopping_ = true; });
+	}
+
+	helper->state_changed().wait_until([&] { return helper->state() == thread_states::terminated; });
+}
+
+operation_result io_ring_object::enter(u64 min_complete)
+{
+	u64 submitted = 0;
+
+	if (poller_) {
+		poller_wait_.update_and_wake_one([this] { wakeup_ = true; });
+	} else {
+		mutex_lock l(submit_lock_);
+		submitted = submit();
+	}
+
+	if (min_complete) {
+		min_complete = min(min_complete, (u64)entries_);
+		completions_.wait_until([&] { return pending_completions() >= min_complete; });
+	}
+
+	return operation_result::ok(submitted);
+}
+
+bool io_ring_object::poll(wait_set *ws)
+{
+	if (ws) {
+		ws->add(completions_);
+	}
+
+	return pending_completions() > 0;
+}
+
+u32 io_ring_object::pending_completions() const
+{
+	return __atomic_load_n(&cq_tail_, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring_->cq_head, __ATOMIC_ACQUIRE);
+}
+
+u64 io_ring_object::submit()
+{
+	u32 tail = __atomic_load_n(&ring_->sq_tail, __ATOMIC_ACQUIRE);
+
+	// A tail further ahead than the ring is long can only be garbage, so no more than a ring's worth is taken.
+	if (tail - sq_head_ > entries_) {
+		tail = sq_head_ + entries_;
+	}
+
+	u64 submitted = 0;
+	while (sq_head_ != tail) {
+		// Submissions are left queued while there is nowhere to put their completions, counting those that the workers
+		// have yet to finish.
+		if (pending_completions() + __atomic_load_n(&in_flight_, __ATOMIC_ACQUIRE) >= entries_) {
+			break;
+		}
+
+		// The entry is copied out first, so that its slot can be handed back before the operation is carried out.
+		io_ring_sqe sqe = sqes_[sq_head_ & (entries_ - 1)];
+		__atomic_store_n(&ring_->sq_head, ++sq_head_, __ATOMIC_RELEASE);
+
+		if (async_) {
+			worker_wait_.update_and_wake_one([&] {
+				dispatched_[dispatch_tail_++ & (entries_ - 1)] = sqe;
+				__atomic_add_fetch(&in_flight_, 1, __ATOMIC_RELEASE);
+			});
+		} else {
+			cqes_[cq_tail_ & (entries_ - 1)] = execute(sqe);
+			__atomic_store_n(&cq_tail_, cq_tail_ + 1, __ATOMIC_RELEASE);
+			__atomic_store_n(&ring_->cq_tail, cq_tail_, __ATOMIC_RELEASE);
+		}
+
+		submitted++;
+	}
+
+	if (submitted && !async_) {
+		completions_.wake_all();
+	}
+
+	return submitted;
+}
+
+io_ring_cqe io_ring_object::execute(const io_ring_sqe &sqe)
+{
+	io_ring_cqe cqe { sqe.user_data, syscall_result_code::not_supported, 0, 0 };
+
+	if (sqe.op == io_ring_op::nop) {
+		cqe.code = syscall_result_code::ok;
+		return cqe;
+	}
+
+	// An operation on the ring itself could end up holding the last reference to it, and destroying it from inside.
+	if (sqe.object == id()) {
+		return cqe;
+	}
+
+	// Reads fill the buffer in, and everything else only looks at it, apart from ioctls, which may do either.
+	mem::region_flags access = mem::region_flags::readable;
+	if (sqe.op == io_ring_op::read || sqe.op == io_ring_op::pread) {
+		access = mem::region_flags::writable;
+	} else if (sqe.op == io_ring_op::ioctl) {
+		access = mem::region_flags::readwrite;
+	}
+
+	if (!mem::user_access::range_ok((const void *)sqe.buffer, sqe.length, access)) {
+		cqe.code = syscall_result_code::bad_address;
+		return cqe;
+	}
+
+	auto o = object_manager::get().get_object(owner_, sqe.object);
+	if (!o) {
+		cqe.code = syscall_result_code::not_found;
+		return cqe;
+	}
+
+	operation_result r = operation_result::not_supported();
+
+	switch (sqe.op) {
+	case io_ring_op::read:
+		r = o->read((void *)sqe.buffer, sqe.length);
+		break;
+	case io_ring_op::write:
+		r = o->write((const void *)sqe.buffer, sqe.length);
+		break;
+	case io_ring_op::pread:
+		r = o->pread((void *)sqe.buffer, sqe.length, sqe.offset);
+		break;
+	case io_ring_op::pwrite:
+		r = o->pwrite((const void *)sqe.buffer, sqe.length, sqe.offset);
+		break;
+	case io_ring_op::ioctl:
+		r = o->ioctl(sqe.offset, (void *)sqe.buffer, sqe.length);
+		break;
+	default:
+		break;
+	}
+
+	cqe.code = r.syscall_code();
+	cqe.result = r.data;
+	return cqe;
+}
+
+void io_ring_object::complete(const io_ring_cqe &cqe)
+{
+	{
+		mutex_lock l(complete_lock_);
+
+		cqes_[cq_tail_ & (entries_ - 1)] = cqe;
+		__atomic_store_n(&cq_tail_, cq_tail_ + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&ring_->cq_tail, cq_tail_, __ATOMIC_RELEASE);
+
+		// The completion is counted before the operation stops being in flight, so submit never overfills the queue.
+		__atomic_sub_fetch(&in_flight_, 1, __ATOMIC_RELEASE);
+	}
+
+	completions_.wake_all();
+}
+
+void io_ring_object::worker_thread_proc(void *arg) { ((io_ring_object *)arg)->work(); }
+
+void io_ring_object::work()
+{
+	while (true) {
+		io_ring_sqe sqe;
+		bool stop = false;
+
+		worker_wait_.wait_until([&] {
+			if (stopping_) {
+				stop = true;
+				return true;
+			}
+
+			if (dispatch_head_ == dispatch_tail_) {
+				return false;
+			}
+
+			sqe = dispatched_[dispatch_head_++ & (entries_ - 1)];
+			return true;
+		});
+
+		if (stop) {
+			return;
+		}
+
+		complete(execute(sqe));
+	}
+}
+
+void io_ring_object::poller_thread_proc(void *arg) { ((io_ring_object *)arg)->poll(); }
+
+void io_ring_object::poll()
+{
+	u64 idle_cycles = (arch::core::this_core().timestamp_frequency() / 1000) * poll_idle_ms;
+	u64 last_work = __builtin_ia32_rdtsc();
+
+	while (!__atomic_load_n(&stopping_, __ATOMIC_ACQUIRE)) {
+		if (submit()) {
+			last_work = __builtin_ia32_rdtsc();
+			continue;
+		}
+
+		// Keep polling for a little while, but let anything else on this core run in between.
+		if (__builtin_ia32_rdtsc() - last_work < idle_cycles) {
+			arch::core::this_core().reschedule();
+			continue;
+		}
+
+		// The flag is raised before looking at the queue one last time.  A process queueing a submission after that
+		// sees the flag, and calls io_ring_enter, so the submission can't be left behind while the poller sleeps.
+		__atomic_fetch_or(&ring_->sq_flags, IO_RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+
+		bool can_submit = __atomic_load_n(&ring_->sq_tail, __ATOMIC_SEQ_CST) != sq_head_ && pending_completions() < entries_;
+		if (!can_submit) {
+			poller_wait_.wait_until([this] {
+				if (stopping_) {
+					return true;
+				}
+
+				bool woken = wakeup_;
+				wakeup_ = false;
+				return woken;
+			});
+		}
+
+		__atomic_fetch_and(&ring_->sq_flags, ~IO_RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+		last_work = __builtin_ia32_rdtsc();
+	}
+}
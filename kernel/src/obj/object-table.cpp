@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/obj/object-table.h>
+#include <stacsos/kernel/obj/object.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::obj;
+
+object_table::~object_table() { clear(); }
+
+shared_ptr<object> object_table::get(u64 handle)
+{
+	sched::rcu_read_guard g;
+
+	slot_array *array = sched::rcu_dereference(slots_);
+
+	// Handle zero is never given out, and wraps round to fail the bounds check.
+	u64 index = handle - 1;
+	if (!array || index >= array->capacity) {
+		return nullptr;
+	}
+
+	// The handle may be closed at the same time, in which case the object may already be on its way out.  Its memory
+	// can't go until the read-side section is over, though, so its count is safe to look at.
+	object *o = sched::rcu_dereference(array->slots[index].published);
+	if (!o || !o->try_acquire()) {
+		return nullptr;
+	}
+
+	shared_ptr<object> result(o);
+	o->release();
+
+	return result;
+}
+
+u64 object_table::reserve()
+{
+	unique_irq_lock l(lock_);
+
+	if (free_head_ == no_slot) {
+		grow();
+	}
+
+	slot *slots = slots_->slots;
+
+	u64 index = free_head_;
+	free_head_ = slots[index].next_free;
+
+	slots[index].next_free = no_slot;
+	slots[index].free = false;
+
+	return index + 1;
+}
+
+bool object_table::reserve_at(u64 handle)
+{
+	unique_irq_lock l(lock_);
+
+	u64 index = handle - 1;
+	while (!slots_ || index >= slots_->capacity) {
+		grow();
+	}
+
+	slot *slots = slots_->slots;
+	if (!slots[index].free) {
+		return false;
+	}
+
+	// The free list is only linked forwards, so the slot's predecessor has to be found, which is fine for the few
+	// handles a process has.
+	u64 *link = &free_head_;
+	while (*link != index) {
+		link = &slots[*link].next_free;
+	}
+
+	*link = slots[index].next_free;
+
+	slots[index].next_free = no_slot;
+	slots[index].free = false;
+
+	return true;
+}
+
+void object_table::install(u64 handle, shared_ptr<object> obj)
+{
+	unique_irq_lock l(lock_);
+
+	slot &s = slots_->slots[handle - 1];
+	swap(s.obj, obj);
+	sched::rcu_assign_pointer(s.published, s.obj.get());
+}
+
+list<shared_ptr<object>> object_table::snapshot()
+{
+	list<shared_ptr<object>> objects;
+
+	unique_irq_lock l(lock_);
+	if (!slots_) {
+		return objects;
+	}
+
+	for (u64 i = 0; i < slots_->capacity; i++) {
+		if (slots_->slots[i].obj) {
+			objects.append(slots_->slots[i].obj);
+		}
+	}
+
+	return objects;
+}
+
+bool object_table::free(u64 handle)
+{
+	// Declared before the lock is taken, so that if this is the last reference, the object is freed after the lock has
+	// been released.
+	shared_ptr<object> obj;
+
+	unique_irq_lock l(lock_);
+
+	u64 index = handle - 1;
+	if (!slots_ || index >= slots_->capacity) {
+		return false;
+	}
+
+	slot &s = slots_->slots[index];
+	if (s.free || !s.obj) {
+		return false;
+	}
+
+	// Lookups stop finding the object before the table lets go of it.
+	sched::rcu_assign_pointer(s.published, (object *)nullptr);
+	swap(obj, s.obj);
+
+	s.free = true;
+	s.next_free = free_head_;
+	free_head_ = index;
+
+	return true;
+}
+
+void object_table::clear()
+{
+	slot_array *array;
+
+	{
+		unique_irq_lock l(lock_);
+
+		array = slots_;
+		sched::rcu_assign_pointer(slots_, (slot_array *)nullptr);
+		free_head_ = no_slot;
+	}
+
+	if (!array) {
+		return;
+	}
+
+	// The objects are freed with the lock released.  Lookups can't reach them any more, but may still be looking at
+	// the array itself.
+	for (u64 i = 0; i < array->capacity; i++) {
+		array->slots[i].obj = nullptr;
+	}
+
+	retire(array);
+}
+
+void object_table::grow()
+{
+	u64 old_capacity = slots_ ? slots_->capacity : 0;
+
+	slot_array *array = new slot_array();
+	array->capacity = old_capacity ? old_capacity * 2 : initial_capacity;
+	array->slots = new slot[array->capacity];
+
+	for (u64 i = 0; i < old_capacity; i++) {
+		slot &from = slots_->slots[i];
+		slot &to = array->slots[i];
+
+		swap(to.obj, from.obj);
+		to.published = from.published;
+		to.next_free = from.next_free;
+		to.free = from.free;
+	}
+
+	// The new slots are put on the free list in order, so that handles are handed out lowest first.
+	for (u64 i = old_capacity; i < array->capacity; i++) {
+		array->slots[i].published = nullptr;
+		array->slots[i].next_free = i + 1 < array->capacity ? i + 1 : free_head_;
+		array->slots[i].free = true;
+	}
+
+	free_head_ = old_capacity;
+
+	slot_array *old = slots_;
+	sched::rcu_assign_pointer(slots_, array);
+
+	if (old) {
+		retire(old);
+	}
+}
+
+/**
+ * @brief Frees an array that lookups can no longer find, once none of them can still be using it.  Its slots must
+ * hold no references by now.
+ */
+void object_table::retire(slot_array *array)
+{
+	sched::call_rcu(*array, [](sched::rcu_head *head) {
+		slot_array *array = static_cast<slot_array *>(head);
+
+		delete[] array->slots;
+		delete array;
+	});
+}
@@ -5,6 +5,94 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/cpu-stats.h>
+#include <stacsos/dirent.h>
+#include <stacsos/kernel/mem/page-cache.h>
+#include <stacsos/kernel/mem/user-access.h>
 #include <stacsos/kernel/obj/object.h>
+#include <stacsos/memops.h>
 
+using namespace stacsos;
+using namespace stacsos::kernel;
 using namespace stacsos::kernel::obj;
+
+void object::operator delete(void *ptr)
+{
+	// Objects only ever inherit from one another singly, so ptr points at this object, and so at its rcu_head.
+	sched::call_rcu(*(object *)ptr, [](sched::rcu_head *head) { ::operator delete((void *)static_cast<object *>(head)); });
+}
+
+operation_result file_object::advise(u64 offset, u64 length, access_advice advice)
+{
+	// Large pages are only for memory.
+	if (advice >= access_advice::hugepage) {
+		return operation_result::not_supported();
+	}
+
+	// The page cache is shared by everything that maps the file, and doesn't belong to the open file, so its pages are
+	// dropped here.  Those that are mapped somewhere stay.
+	if (advice == access_advice::dontneed && node_ && length && !file_->has_own_pages()) {
+		mem::page_cache::get().drop(*node_, offset >> PAGE_BITS, (offset + length - 1) >> PAGE_BITS);
+	}
+
+	file_->advise(offset, length, advice);
+	return operation_result::ok();
+}
+
+operation_result directory_object::readdir(void *buffer, size_t length)
+{
+	// The whole buffer has been checked by the system call, so the entries are written straight into it.
+	u8 *out = (u8 *)buffer;
+	size_t used = 0;
+
+	while (fs::fs_node *child = node_->child_at(cursor_)) {
+		const string &name = child->name();
+
+		size_t record_length = dirent_record_length(name.length());
+		if (used + record_length > length) {
+			// A buffer that can't hold even one entry would never get anywhere.
+			if (!used) {
+				return operation_result::not_supported();
+			}
+
+			break;
+		}
+
+		dirent *ent = (dirent *)(out + used);
+		ent->record_length = record_length;
+		ent->name_length = name.length();
+		ent->type = child->kind() == fs::fs_node_kind::directory ? 'd' : 'f';
+		memops::zero<sizeof(ent->reserved)>(ent->reserved);
+		ent->size = child->size();
+		memops::memcpy(ent->name, name.c_str(), name.length() + 1);
+
+		used += record_length;
+		cursor_++;
+	}
+
+	return operation_result::ok(used);
+}
+
+operation_result process_object::ioctl(u64 cmd, void *buffer, size_t length)
+{
+	if ((process_ioctl)cmd != process_ioctl::cpu_times || length < sizeof(process_cpu_times)) {
+		return operation_result::not_supported();
+	}
+
+	u64 user_cycles = 0, kernel_cycles = 0;
+	proc_->for_each_thread([&](sched::thread &t) {
+		u64 user, kernel;
+		t.cpu_time(user, kernel);
+
+		user_cycles += user;
+		kernel_cycles += kernel;
+	});
+
+	arch::core &c = arch::core::this_core();
+	process_cpu_times times { c.timestamp_to_ns(user_cycles), c.timestamp_to_ns(kernel_cycles) };
+	if (!mem::user_access::copy_to_user(buffer, &times, sizeof(times))) {
+		return operation_result::not_supported();
+	}
+
+	return operation_result::ok(sizeof(times));
+}
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/obj/pipe.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::obj;
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::mem;
+
+pipe::pipe()
+	: page_(memory_manager::get().pgalloc().allocate_pages(0))
+	, buffer_(page_ ? (u8 *)page_->base_address_ptr() : nullptr)
+	, head_(0)
+	, tail_(0)
+	, readers_(0)
+	, writers_(0)
+{
+	if (!page_) {
+		panic("unable to allocate pipe buffer");
+	}
+}
+
+pipe::~pipe() { memory_manager::get().pgalloc().free_pages(*page_, 0); }
+
+size_t pipe::read(void *buffer, size_t length)
+{
+	if (!length) {
+		return 0;
+	}
+
+	mutex_lock l(read_lock_);
+
+	readable_.wait_until([this] { return load_tail() != head_ || !load_writers(); });
+
+	// At most two copies: up to the end of the ring, and then on from its start.
+	size_t n = min(length, (size_t)(load_tail() - head_));
+	size_t start = head_ % capacity;
+	size_t first = min(n, capacity - start);
+
+	memops::memcpy(buffer, buffer_ + start, first);
+	memops::memcpy((u8 *)buffer + first, buffer_, n - first);
+
+	__atomic_store_n(&head_, head_ + n, __ATOMIC_RELEASE);
+
+	if (n) {
+		writable_.wake_one();
+	}
+
+	return n;
+}
+
+size_t pipe::write(const void *buffer, size_t length)
+{
+	mutex_lock l(write_lock_);
+
+	size_t written = 0;
+	while (written < length) {
+		writable_.wait_until([this] { return tail_ - load_head() < capacity || !load_readers(); });
+
+		if (!load_readers()) {
+			break;
+		}
+
+		size_t n = min(length - written, (size_t)(capacity - (tail_ - load_head())));
+		size_t start = tail_ % capacity;
+		size_t first = min(n, capacity - start);
+
+		memops::memcpy(buffer_ + start, (const u8 *)buffer + written, first);
+		memops::memcpy(buffer_, (const u8 *)buffer + written + first, n - first);
+
+		// The reader only looks at the bytes once the tail has moved past them.
+		__atomic_store_n(&tail_, tail_ + n, __ATOMIC_RELEASE);
+		written += n;
+
+		readable_.wake_one();
+	}
+
+	return written;
+}
+
+bool pipe::poll_readable(wait_set *ws)
+{
+	if (ws) {
+		ws->add(readable_);
+	}
+
+	return load_tail() != load_head() || !load_writers();
+}
+
+bool pipe::poll_writable(wait_set *ws)
+{
+	if (ws) {
+		ws->add(writable_);
+	}
+
+	return load_tail() - load_head() < capacity || !load_readers();
+}
+
+void pipe::open_end(bool write_end) { __atomic_fetch_add(write_end ? &writers_ : &readers_, 1, __ATOMIC_RELEASE); }
+
+void pipe::close_end(bool write_end)
+{
+	// The count is changed under the lock of the queue that the other side waits on, so a waiter can't miss it.
+	if (write_end) {
+		readable_.update_and_wake_all([this] { __atomic_fetch_sub(&writers_, 1, __ATOMIC_RELEASE); });
+	} else {
+		writable_.update_and_wake_all([this] { __atomic_fetch_sub(&readers_, 1, __ATOMIC_RELEASE); });
+	}
+}
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/obj/timer.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::obj;
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::arch::x86;
+
+timer_object::timer_object(u64 id, u64 deadline, u64 period)
+	: object(id)
+	, event_(deadline, fired, this)
+	, period_(period)
+	, expirations_(0)
+	, stopping_(false)
+	, armed_(1)
+	, completed_(0)
+{
+	timer_queue::get().add(event_);
+}
+
+timer_object::~timer_object()
+{
+	u64 armed;
+
+	{
+		unique_irq_lock l(expired_.lock());
+		stopping_ = true;
+		armed = armed_;
+	}
+
+	if (timer_queue::get().cancel(event_)) {
+		armed--;
+	}
+
+	// The callback may still be running on another core, if the event was taken off the queue to fire (or re-armed
+	// just before it was cancelled).
+	while (__atomic_load_n(&completed_, __ATOMIC_ACQUIRE) != armed) {
+		__relax();
+	}
+}
+
+operation_result timer_object::read(void *buffer, size_t length)
+{
+	if (length < sizeof(u64)) {
+		return operation_result::not_supported();
+	}
+
+	u64 count;
+	expired_.wait_until([this, &count] {
+		count = expirations_;
+		expirations_ = 0;
+
+		return count != 0;
+	});
+
+	memops::memcpy(buffer, &count, sizeof(count));
+	return operation_result::ok(sizeof(count));
+}
+
+bool timer_object::poll(wait_set *ws)
+{
+	if (ws) {
+		ws->add(expired_);
+	}
+
+	return __atomic_load_n(&expirations_, __ATOMIC_RELAXED) != 0;
+}
+
+void timer_object::fired(void *arg)
+{
+	timer_object *t = (timer_object *)arg;
+	u64 now = x86_core::this_core().local_tsc().read();
+
+	t->expired_.update_and_wake_all([t, now] {
+		if (t->stopping_) {
+			return;
+		}
+
+		if (!t->period_) {
+			t->expirations_++;
+			return;
+		}
+
+		// The next deadline is a whole number of periods on from this one, skipping (but counting) any that were
+		// missed, so that a late tick doesn't shift the ones after it.
+		u64 missed = now > t->event_.deadline ? (now - t->event_.deadline) / t->period_ : 0;
+
+		t->expirations_ += missed + 1;
+		t->event_.deadline += (missed + 1) * t->period_;
+
+		t->armed_++;
+		timer_queue::get().add(t->event_);
+	});
+
+	// After this, the object may be destroyed.
+	__atomic_fetch_add(&t->completed_, 1, __ATOMIC_RELEASE);
+}
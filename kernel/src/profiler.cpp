@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/pmu.h>
+#include <stacsos/kernel/arch/x86/smp-call.h>
+#include <stacsos/kernel/profiler.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+using namespace stacsos::kernel::sched;
+
+void profiler::start(u64 frequency)
+{
+	stop();
+
+	for (auto *c : core_manager::get().cores()) {
+		per_core_profile &p = cores_[c->id()];
+		if (!p.samples) {
+			p.samples = new profile_sample[samples_per_core];
+		}
+
+		p.head = 0;
+	}
+
+	frequency_ = max(frequency, 1ull);
+	__atomic_store_n(&unclaimed_nmis_, 0, __ATOMIC_RELAXED);
+
+	// The profiler is started from a thread, which may well be on a core with the same PMU as all the others.
+	__atomic_store_n(&source_, pmu::supported() ? profile_source::pmu : profile_source::tick, __ATOMIC_RELEASE);
+
+	if (source_ == profile_source::pmu) {
+		smp_call_function(~0ull, start_core, this, true);
+	}
+}
+
+void profiler::stop()
+{
+	if (source_ == profile_source::pmu) {
+		smp_call_function(~0ull, stop_core, this, true);
+	}
+
+	__atomic_store_n(&source_, profile_source::none, __ATOMIC_RELEASE);
+}
+
+void profiler::start_core(void *arg)
+{
+	profiler *self = (profiler *)arg;
+
+	// Core cycles run at about the rate of the TSC, which is known, unlike the rate the core is actually clocked at.
+	pmu::start_sampling(core::this_core().timestamp_frequency() / self->frequency_);
+}
+
+void profiler::stop_core(void *arg) { pmu::stop_sampling(); }
+
+void profiler::handle_nmi(const machine_context &mc)
+{
+	if (pmu::handle_overflow()) {
+		sample(mc);
+	} else {
+		__atomic_fetch_add(&unclaimed_nmis_, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void profiler::sample(const machine_context &mc)
+{
+	per_core_profile &p = cores_.get();
+	if (!p.samples) {
+		return;
+	}
+
+	profile_sample &s = p.samples[p.head % samples_per_core];
+	s.rip = mc.rip;
+	s.core = current_core_id();
+	s.user = (mc.cs & 3) != 0;
+	s.depth = 0;
+
+	// The idle task has no thread.
+	schedulable_entity *entity;
+	asm volatile("mov %%gs:0, %0" : "=r"(entity));
+	s.thread_id = entity ? static_cast<thread *>(entity)->id() : 0;
+
+	// The sample may have been taken in an NMI, where a fault can't be taken, so only frames that lie between the
+	// interrupted stack pointer and the top of the thread's kernel stack are followed.  User stacks aren't walked at
+	// all, as they may not be mapped.
+	u64 stack_top;
+	asm volatile("mov %%gs:0x18, %0" : "=r"(stack_top));
+
+	if (!s.user && stack_top) {
+		u64 fp = mc.rbp;
+		u64 lowest = mc.rsp;
+
+		while (s.depth < profile_sample::max_depth && fp >= lowest && fp + 16 <= stack_top && !(fp & 7)) {
+			const u64 *frame = (const u64 *)fp;
+			if (!frame[1]) {
+				break;
+			}
+
+			s.stack[s.depth++] = frame[1];
+
+			// Frames are always further up the stack than the ones they called.
+			lowest = fp + 16;
+			fp = frame[0];
+		}
+	}
+
+	// Publish the sample after it has been filled in.
+	__atomic_store_n(&p.head, p.head + 1, __ATOMIC_RELEASE);
+}
+
+// The most a sample's line takes: the core, thread, ring and RIP, and a return address for each frame.
+static const size_t max_line_prefix = 64;
+static const size_t max_line_frame = 17;
+
+size_t profiler::render_size_hint()
+{
+	size_t size = 256;
+
+	for (auto &p : cores_) {
+		u64 head = __atomic_load_n(&p.head, __ATOMIC_ACQUIRE);
+		size += min(head, (u64)samples_per_core) * (max_line_prefix + (profile_sample::max_depth * max_line_frame));
+	}
+
+	return size;
+}
+
+static const char *source_name(profile_source source)
+{
+	switch (source) {
+	case profile_source::pmu:
+		return "pmu";
+	case profile_source::tick:
+		return "tick";
+	default:
+		return "none";
+	}
+}
+
+size_t profiler::render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	EMIT("# source %s, %llu Hz, %llu unclaimed NMIs\n", source_name(__atomic_load_n(&source_, __ATOMIC_ACQUIRE)), frequency_,
+		__atomic_load_n(&unclaimed_nmis_, __ATOMIC_RELAXED));
+	EMIT("# core thread ring rip [return addresses...]\n");
+
+	for (auto &p : cores_) {
+		u64 head = __atomic_load_n(&p.head, __ATOMIC_ACQUIRE);
+		if (!p.samples || !head) {
+			continue;
+		}
+
+		u64 first = head > samples_per_core ? head - samples_per_core : 0;
+
+		for (u64 i = first; i < head; i++) {
+			const profile_sample &s = p.samples[i % samples_per_core];
+
+			EMIT("%u %llu %c %llx", s.core, s.thread_id, s.user ? 'u' : 'k', s.rip);
+			for (unsigned int d = 0; d < min((unsigned int)s.depth, profile_sample::max_depth); d++) {
+				EMIT(" %llx", s.stack[d]);
+			}
+			EMIT("\n");
+		}
+	}
+
+#undef EMIT
+
+	return n;
+}
@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/alg/cfs.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::sched::alg;
+using namespace stacsos::kernel::arch::x86;
+
+// The furthest behind the run queue's minimum vruntime that a newly woken task may be placed.  Without
+// this, a thread that has slept for a long time would monopolise the core until it caught up.
+static u64 wakeup_credit() { return x86_core::this_core().local_tsc().frequency() / 100; } // 10ms
+
+// The weight of each nice value from -20 to 19, relative to 1024 at nice 0.  Each step is roughly 1.25x, so that a
+// task one nice level lower than another gets about 10% more of the CPU.
+static const u32 nice_to_weight[40] = {
+	88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45, 36, 29, 23, 18, 15,
+};
+
+// Virtual runtime advances more slowly for heavier (lower nice) tasks, so they are picked more often.
+static u64 scale_by_weight(u64 delta, s8 nice)
+{
+	int index = max(min((int)nice, 19), -20) + 20;
+	return (delta * 1024) / nice_to_weight[index];
+}
+
+void completely_fair_scheduler::add_to_runqueue(tcb &tcb)
+{
+	u64 credit = wakeup_credit();
+	u64 floor = min_vruntime_ > credit ? min_vruntime_ - credit : 0;
+
+	if (tcb.vruntime < floor) {
+		tcb.vruntime = floor;
+	}
+
+	runqueue_.insert(tcb);
+	update_min_vruntime();
+}
+
+void completely_fair_scheduler::remove_from_runqueue(tcb &tcb)
+{
+	if (!runqueue_.contains(tcb)) {
+		return;
+	}
+
+	runqueue_.remove(tcb);
+	update_min_vruntime();
+}
+
+void completely_fair_scheduler::charge_selected(tcb *current)
+{
+	// Charge the task that has just been running for the time it used, and re-position it in the tree.  The time is
+	// only charged once, as the gang and normal selections may both be made on the same switch.
+	if (current && current == selected_ && runqueue_.contains(*current)) {
+		runqueue_.remove(*current);
+		current->vruntime += scale_by_weight(current->run_time - selected_run_time_, current->nice);
+		runqueue_.insert(*current);
+
+		selected_run_time_ = current->run_time;
+	}
+}
+
+tcb *completely_fair_scheduler::select_next_task(tcb *current)
+{
+	charge_selected(current);
+
+	tcb *next = runqueue_.first();
+
+	selected_ = next;
+	selected_run_time_ = next ? next->run_time : 0;
+
+	update_min_vruntime();
+	return next;
+}
+
+tcb *completely_fair_scheduler::select_gang_task(tcb *current, const void *gang)
+{
+	charge_selected(current);
+
+	// The gang member that is furthest behind goes first.
+	tcb *next = runqueue_.first();
+	while (next && next->gang != gang) {
+		next = runqueue_.next(*next);
+	}
+
+	if (next) {
+		selected_ = next;
+		selected_run_time_ = next->run_time;
+	}
+
+	update_min_vruntime();
+	return next;
+}
+
+tcb *completely_fair_scheduler::steal_task(tcb *running, int dest_core, u64 hot_since)
+{
+	if (runqueue_.count() < 2) {
+		return nullptr;
+	}
+
+	// Take the task furthest from running here, i.e. the one with the largest vruntime, that isn't cache-hot.
+	tcb *candidate = runqueue_.last();
+	while (candidate && (candidate == running || !can_run_on(*candidate, dest_core) || is_cache_hot(*candidate, hot_since))) {
+		candidate = runqueue_.prev(*candidate);
+	}
+
+	if (!candidate) {
+		return nullptr;
+	}
+
+	runqueue_.remove(*candidate);
+	update_min_vruntime();
+
+	// vruntime is only meaningful relative to this run queue, so make it relative before the task moves.
+	// The destination queue will then place it with the same wake-up credit as any other new arrival.
+	candidate->vruntime -= min(candidate->vruntime, min_vruntime_);
+
+	return candidate;
+}
+
+void completely_fair_scheduler::update_min_vruntime()
+{
+	tcb *leftmost = runqueue_.first();
+
+	if (leftmost && leftmost->vruntime > min_vruntime_) {
+		min_vruntime_ = leftmost->vruntime;
+	}
+}
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/alg/edf.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::sched::alg;
+
+void earliest_deadline_first::add_to_runqueue(tcb &tcb)
+{
+	if (!is_periodic(tcb)) {
+		background_.append(tcb);
+		return;
+	}
+
+	u64 now = __builtin_ia32_rdtsc();
+
+	// A task waking up may only carry on with its current job if the runtime it has left fits in its reserved share
+	// of the time until the deadline.  Otherwise, it is given a new job from now, so that a task that blocks and wakes
+	// up at just the right moment can't take more than its reservation from everything else.
+	if (now >= tcb.edf_deadline || (tcb.edf_budget * 1000000) / (tcb.edf_deadline - now) > utilisation_of(tcb)) {
+		tcb.edf_deadline = now + tcb.edf_period;
+		tcb.edf_budget = tcb.edf_runtime;
+	}
+
+	if (tcb.edf_budget) {
+		ready_.insert(tcb);
+	} else {
+		throttled_.append(tcb);
+	}
+}
+
+void earliest_deadline_first::remove_from_runqueue(tcb &tcb)
+{
+	if (ready_.contains(tcb)) {
+		ready_.remove(tcb);
+	} else if (throttled_.linked(tcb)) {
+		// The reservation can't change while the task is queued, so it is still on the list it was added to.
+		if (is_periodic(tcb)) {
+			throttled_.remove(tcb);
+		} else {
+			background_.remove(tcb);
+		}
+	}
+}
+
+tcb *earliest_deadline_first::select_next_task(tcb *current)
+{
+	u64 now = __builtin_ia32_rdtsc();
+
+	if (current && current == selected_) {
+		if (is_periodic(*current)) {
+			// Charge the job for the time it has just run, even if the task has since blocked, so that the rest of the
+			// job can't be used to run for longer than was reserved.
+			u64 used = current->run_time - selected_run_time_;
+			current->edf_budget -= min(used, current->edf_budget);
+
+			if (!current->edf_budget && ready_.contains(*current)) {
+				ready_.remove(*current);
+				throttled_.append(*current);
+			}
+		} else if (!background_.empty() && background_.first() == current) {
+			background_.rotate();
+		}
+	}
+
+	release_jobs(now);
+
+	tcb *next = ready_.first();
+	if (!next && !background_.empty()) {
+		next = background_.first();
+	}
+
+	selected_ = next;
+	selected_run_time_ = next ? next->run_time : 0;
+
+	arm_timer(now);
+	return next;
+}
+
+tcb *earliest_deadline_first::steal_task(tcb *running, int dest_core, u64 hot_since)
+{
+	// A periodic task was admitted against this core's utilisation, so only tasks without a reservation can be moved.
+	if (background_.count() < 2) {
+		return nullptr;
+	}
+
+	// Take the task that would be the last to run here.
+	tcb *candidate = nullptr;
+	for (tcb *t : background_) {
+		if (t != running && can_run_on(*t, dest_core) && !is_cache_hot(*t, hot_since)) {
+			candidate = t;
+		}
+	}
+
+	if (candidate) {
+		background_.remove(*candidate);
+	}
+
+	return candidate;
+}
+
+bool earliest_deadline_first::set_reservation(tcb &tcb, u64 runtime, u64 period)
+{
+	u64 current = utilisation_of(tcb);
+	u64 requested = period ? (runtime * 1000000) / period : 0;
+
+	// Admission control: the deadlines of every task on this core can only be met if their total utilisation doesn't
+	// exceed the whole core.
+	if (utilisation_ - current + requested > max_utilisation) {
+		return false;
+	}
+
+	utilisation_ = utilisation_ - current + requested;
+
+	tcb.edf_runtime = runtime;
+	tcb.edf_period = period;
+
+	// The first job starts the next time the task is put on the run queue.
+	tcb.edf_deadline = 0;
+	tcb.edf_budget = 0;
+
+	return true;
+}
+
+bool earliest_deadline_first::should_preempt(const tcb &running, const tcb &woken) const
+{
+	if (!is_periodic(woken) || !woken.edf_budget) {
+		return false;
+	}
+
+	return !is_periodic(running) || woken.edf_deadline < running.edf_deadline;
+}
+
+void earliest_deadline_first::timer_fired(void *arg) { ((arch::core *)arg)->request_resched(); }
+
+void earliest_deadline_first::release_jobs(u64 now)
+{
+	// Each throttled task gets its next job at the start of its next period, which is the deadline of the last one.
+	tcb *next;
+	for (tcb *t = throttled_.first(); t; t = next) {
+		next = throttled_.next(*t);
+
+		if (now < t->edf_deadline) {
+			continue;
+		}
+
+		throttled_.remove(*t);
+
+		t->edf_deadline += t->edf_period;
+		if (t->edf_deadline <= now) {
+			t->edf_deadline = now + t->edf_period;
+		}
+
+		t->edf_budget = t->edf_runtime;
+		ready_.insert(*t);
+	}
+}
+
+void earliest_deadline_first::arm_timer(u64 now)
+{
+	u64 deadline = 0;
+
+	for (tcb *t : throttled_) {
+		if (!deadline || t->edf_deadline < deadline) {
+			deadline = t->edf_deadline;
+		}
+	}
+
+	// The selected job must also be stopped as soon as it has used its runtime, rather than at the end of the slice.
+	if (selected_ && is_periodic(*selected_)) {
+		u64 exhausted = now + selected_->edf_budget;
+		if (!deadline || exhausted < deadline) {
+			deadline = exhausted;
+		}
+	}
+
+	if (timer_.heap_index >= 0 && timer_.deadline == deadline) {
+		return;
+	}
+
+	timer_queue::get().cancel(timer_);
+
+	if (deadline) {
+		// This is only ever called by the core that owns the run queue.
+		timer_.deadline = deadline;
+		timer_.arg = &arch::core::this_core();
+		timer_queue::get().add(timer_);
+	}
+}
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/alg/pcs.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::sched::alg;
+
+void priority_class_scheduler::add_to_runqueue(tcb &tcb)
+{
+	if (tcb.policy == sched_policy::fifo) {
+		fifo_runqueue_.insert(tcb);
+	} else {
+		fair_->add_to_runqueue(tcb);
+	}
+
+	tcb.queued = true;
+}
+
+void priority_class_scheduler::remove_from_runqueue(tcb &tcb)
+{
+	if (!tcb.queued) {
+		return;
+	}
+
+	if (tcb.policy == sched_policy::fifo) {
+		fifo_runqueue_.remove(tcb);
+	} else {
+		fair_->remove_from_runqueue(tcb);
+	}
+
+	tcb.queued = false;
+}
+
+tcb *priority_class_scheduler::select_next_task(tcb *current)
+{
+	// The fair class always gets to see the switch, so that it can charge a preempted task for the time it ran.
+	tcb *next = fair_->select_next_task(current);
+
+	if (!fifo_runqueue_.empty()) {
+		return fifo_runqueue_.first();
+	}
+
+	return next;
+}
+
+tcb *priority_class_scheduler::select_gang_task(tcb *current, const void *gang)
+{
+	// Real-time tasks still come first, so a gang only gets the core if there are none waiting.
+	if (!fifo_runqueue_.empty()) {
+		return nullptr;
+	}
+
+	return fair_->select_gang_task(current, gang);
+}
+
+tcb *priority_class_scheduler::steal_task(tcb *running, int dest_core, u64 hot_since)
+{
+	// A FIFO task waiting behind another one here would run straight away on an idle core, so prefer those, taking the
+	// lowest priority one.
+	if (fifo_runqueue_.count() > 1) {
+		tcb *candidate = fifo_runqueue_.last();
+		while (candidate && (candidate == running || !can_run_on(*candidate, dest_core) || is_cache_hot(*candidate, hot_since))) {
+			candidate = fifo_runqueue_.prev(*candidate);
+		}
+
+		if (candidate) {
+			fifo_runqueue_.remove(*candidate);
+			candidate->queued = false;
+
+			return candidate;
+		}
+	}
+
+	tcb *stolen = fair_->steal_task(running, dest_core, hot_since);
+	if (stolen) {
+		stolen->queued = false;
+	}
+
+	return stolen;
+}
+
+void priority_class_scheduler::set_priority(tcb &tcb, sched_policy policy, int priority)
+{
+	// The task must move to the queue for its new class, and a FIFO task to its new position within the class.
+	bool was_queued = tcb.queued;
+	remove_from_runqueue(tcb);
+
+	fair_->set_priority(tcb, policy, priority);
+
+	if (was_queued) {
+		add_to_runqueue(tcb);
+	}
+}
+
+bool priority_class_scheduler::set_reservation(tcb &tcb, u64 runtime, u64 period)
+{
+	// As above, the task may be queued in a position that depends on its reservation.
+	bool was_queued = tcb.queued;
+	remove_from_runqueue(tcb);
+
+	bool admitted = fair_->set_reservation(tcb, runtime, period);
+
+	if (was_queued) {
+		add_to_runqueue(tcb);
+	}
+
+	return admitted;
+}
+
+bool priority_class_scheduler::should_preempt(const tcb &running, const tcb &woken) const
+{
+	if (woken.policy != sched_policy::fifo) {
+		return running.policy != sched_policy::fifo && fair_->should_preempt(running, woken);
+	}
+
+	return running.policy != sched_policy::fifo || woken.rt_priority > running.rt_priority;
+}
@@ -20,3 +20,7 @@ void round_robin::add_to_runqueue(tcb &tcb) { panic("TODO"); }
 void round_robin::remove_from_runqueue(tcb &tcb) { panic("TODO"); }
 
 tcb *round_robin::select_next_task(tcb *current) { panic("TODO"); }
+
+unsigned int round_robin::nr_runnable() const { panic("TODO"); }
+
+tcb *round_robin::steal_task(tcb *running, int dest_core, u64 hot_since) { panic("TODO"); }
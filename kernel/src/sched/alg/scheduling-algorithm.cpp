@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/sched/alg/scheduling-algorithm.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::sched::alg;
+
+void scheduling_algorithm::set_priority(tcb &tcb, sched_policy policy, int priority)
+{
+	tcb.policy = policy;
+
+	if (policy == sched_policy::fifo) {
+		tcb.rt_priority = (u8)priority;
+		tcb.nice = 0;
+	} else {
+		tcb.rt_priority = 0;
+		tcb.nice = (s8)priority;
+	}
+}
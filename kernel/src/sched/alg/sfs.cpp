@@ -34,3 +34,45 @@ tcb *simple_fair_scheduler::select_next_task(tcb *current)
 
 	return candidate;
 }
+
+tcb *simple_fair_scheduler::select_gang_task(tcb *current, const void *gang)
+{
+	u64 min_runtime = 0;
+	tcb *candidate = nullptr;
+
+	for (auto *thread : runqueue_) {
+		if (thread->gang == gang && (candidate == nullptr || thread->run_time < min_runtime)) {
+			min_runtime = thread->run_time;
+			candidate = thread;
+		}
+	}
+
+	return candidate;
+}
+
+tcb *simple_fair_scheduler::steal_task(tcb *running, int dest_core, u64 hot_since)
+{
+	// Take the task that has had the most run time, since it is the one that would be
+	// selected last here.  Leave the core with at least one task.
+	if (runqueue_.count() < 2) {
+		return nullptr;
+	}
+
+	tcb *candidate = nullptr;
+
+	for (auto *thread : runqueue_) {
+		if (thread == running || !can_run_on(*thread, dest_core) || is_cache_hot(*thread, hot_since)) {
+			continue;
+		}
+
+		if (candidate == nullptr || (thread->run_time > candidate->run_time)) {
+			candidate = thread;
+		}
+	}
+
+	if (candidate) {
+		runqueue_.remove(*candidate);
+	}
+
+	return candidate;
+}
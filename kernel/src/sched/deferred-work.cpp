@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/deferred-work.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::arch;
+
+void deferred_work::queue(deferred_work_item &item)
+{
+	// Isolated cores don't do housekeeping, so their work is done by the boot core instead.
+	int id = core::this_core_id();
+	queue_on(core_manager::get().is_isolated(id) ? 0 : id, item);
+}
+
+void deferred_work::queue_on(int core_id, deferred_work_item &item)
+{
+	item.next = __atomic_load_n(&queues_[core_id], __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&queues_[core_id], &item.next, &item, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) { }
+}
+
+void deferred_work::add_idle_task(idle_task_fn fn)
+{
+	if (nr_idle_tasks_ >= max_idle_tasks) {
+		panic("too many idle tasks");
+	}
+
+	idle_tasks_[nr_idle_tasks_++] = fn;
+}
+
+bool deferred_work::run_pending()
+{
+	deferred_work_item *items = __atomic_exchange_n(&queues_[core::this_core_id()], nullptr, __ATOMIC_ACQUIRE);
+
+	if (items) {
+		// Do the work in the order it was queued.
+		deferred_work_item *ordered = nullptr;
+		while (items) {
+			deferred_work_item *next = items->next;
+			items->next = ordered;
+			ordered = items;
+			items = next;
+		}
+
+		while (ordered) {
+			// The function may free the item.
+			deferred_work_item *next = ordered->next;
+			ordered->fn(ordered->arg);
+			ordered = next;
+		}
+
+		return true;
+	}
+
+	// Idle tasks are housekeeping too, e.g. zeroing pages, which would only pollute an isolated core's caches.
+	if (core::this_core().isolated()) {
+		return false;
+	}
+
+	for (int i = 0; i < nr_idle_tasks_; i++) {
+		if (idle_tasks_[i]()) {
+			return true;
+		}
+	}
+
+	return false;
+}
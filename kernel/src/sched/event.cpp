@@ -13,33 +13,29 @@ using namespace stacsos::kernel::sched;
 
 template <bool AUTO_RESET> void event<AUTO_RESET>::wait()
 {
-	if (!AUTO_RESET && triggered_) {
-		return;
-	}
-
-	// TODO: Race Condition!
-
-	thread *ct = &thread::current();
-
-	wait_list_.append(ct);
-	ct->suspend();
-
-	asm volatile("int $0xff");
+	waiters_.wait_until([this] {
+		if (!triggered_) {
+			return false;
+		}
+
+		// An auto-reset event is consumed by the waiter that observes it.
+		if (AUTO_RESET) {
+			triggered_ = false;
+		}
+
+		return true;
+	});
 }
 
 template <bool AUTO_RESET> void event<AUTO_RESET>::trigger()
 {
-	if (!AUTO_RESET) {
-		triggered_ = true;
-	}
-
-	// TODO: This should only release ONE thread if it's an auto reset event.
-	// Probably need some kind of mutex too.
-	for (auto thread : wait_list_) {
-		thread->resume();
+	// A waiter may destroy the event as soon as it sees it triggered, e.g. when it lives on the waiter's stack and is
+	// triggered from an interrupt, so nothing is touched after the trigger is visible.
+	if (AUTO_RESET) {
+		waiters_.update_and_wake_one([this] { triggered_ = true; });
+	} else {
+		waiters_.update_and_wake_all([this] { triggered_ = true; });
 	}
-
-	wait_list_.clear();
 }
 
 template class event<true>;
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/elf.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/fs/file.h>
+#include <stacsos/kernel/fs/fs-node.h>
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/page-cache.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/mem/zeroed-page-pool.h>
+#include <stacsos/kernel/sched/executable-image.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::fs;
+
+static region_flags segment_flags(elf_program_header_flags pflags)
+{
+	region_flags flags = region_flags::inaccessible;
+	if ((pflags & elf_program_header_flags::pf_r) == elf_program_header_flags::pf_r) {
+		flags |= region_flags::readable;
+	}
+	if ((pflags & elf_program_header_flags::pf_w) == elf_program_header_flags::pf_w) {
+		flags |= region_flags::writable;
+	}
+	if ((pflags & elf_program_header_flags::pf_x) == elf_program_header_flags::pf_x) {
+		flags |= region_flags::executable;
+	}
+
+	return flags;
+}
+
+/**
+ * @brief Reads the part of a segment's file contents that falls in the page at page_vaddr into a page of its own,
+ * with everything else in the page left as zero.
+ */
+static page *build_private_page(file &f, const elf_programheader<64> &phdr, u64 page_vaddr)
+{
+	page *pg = zeroed_page_pool::get().allocate();
+	if (!pg) {
+		return nullptr;
+	}
+
+	u64 start = max(page_vaddr, phdr.p_vaddr);
+	u64 end = min(page_vaddr + PAGE_SIZE, phdr.p_vaddr + phdr.p_filesz);
+	f.pread((char *)pg->base_address_ptr() + (start - page_vaddr), phdr.p_offset + (start - phdr.p_vaddr), end - start);
+
+	// The image keeps the page for as long as the kernel runs, and it is only ever mapped read-only.
+	pg->set_cached(true);
+	return pg;
+}
+
+shared_ptr<executable_image> executable_image::load(fs_node &node)
+{
+	auto f = node.open();
+	if (!f) {
+		dprintf("exec: unable to open binary\n");
+		return nullptr;
+	}
+
+	char header_buffer[0x40];
+	if (f->pread(header_buffer, 0, sizeof(header_buffer)) != sizeof(header_buffer)) {
+		dprintf("exec: incorrect file size\n");
+		return nullptr;
+	}
+
+	if (((const elf_ident_header *)header_buffer)->ei_class != elf_ident_classes::ei_class_64bit) {
+		dprintf("exec: invalid elf class\n");
+		return nullptr;
+	}
+
+	const elf_header<64> *ehdr = (const elf_header<64> *)header_buffer;
+
+	u64 headers_size = ehdr->e_phnum * ehdr->e_phentsize;
+	char *program_headers = new char[headers_size];
+	if (f->pread(program_headers, ehdr->e_phoff, headers_size) != headers_size) {
+		dprintf("exec: unable to read program headers\n");
+		delete[] program_headers;
+		return nullptr;
+	}
+
+	shared_ptr<executable_image> image(new executable_image(ehdr->e_entry));
+
+	for (int seg_idx = 0; seg_idx < ehdr->e_phnum; seg_idx++) {
+		const elf_programheader<64> *phdr = ((const elf_programheader<64> *)(program_headers + (seg_idx * ehdr->e_phentsize)));
+
+		// The TLS template lies within one of the loadable segments, so only where it is needs to be remembered.
+		if (phdr->p_type == elf_program_header_type::pt_tls) {
+			image->tls_ = process_tls { phdr->p_vaddr, phdr->p_filesz, phdr->p_memsz, max(phdr->p_align, 1ull) };
+			continue;
+		}
+
+		if (phdr->p_type != elf_program_header_type::pt_load) {
+			continue;
+		}
+
+		u64 vaddr_page = phdr->p_vaddr & PAGE_MASK;
+		u64 vaddr_page_offset = phdr->p_vaddr & ~PAGE_MASK;
+		u64 file_end = phdr->p_vaddr + phdr->p_filesz;
+
+		executable_segment segment;
+		segment.base = vaddr_page;
+		segment.size = (phdr->p_memsz + vaddr_page_offset + (PAGE_SIZE - 1)) & PAGE_MASK;
+		segment.flags = segment_flags(phdr->p_flags);
+		segment.nr_pages = phdr->p_filesz ? (((file_end + (PAGE_SIZE - 1)) & PAGE_MASK) - vaddr_page) >> PAGE_BITS : 0;
+		segment.pages = new page *[segment.nr_pages];
+
+		// Pages with nothing but file contents in them come from the page cache, so they are shared with anything else
+		// mapping the binary.  The page where the zero-filled part of a segment starts can't be, as can't any page if
+		// the segment isn't laid out in the file the same way as in memory.
+		bool shareable = (phdr->p_offset & ~PAGE_MASK) == vaddr_page_offset;
+
+		for (u64 i = 0; i < segment.nr_pages; i++) {
+			u64 page_vaddr = vaddr_page + (i << PAGE_BITS);
+
+			page *pg = nullptr;
+			if (shareable && (page_vaddr + PAGE_SIZE <= file_end || phdr->p_memsz == phdr->p_filesz)) {
+				u64 file_page = ((phdr->p_offset & PAGE_MASK) + (page_vaddr - vaddr_page)) >> PAGE_BITS;
+				pg = page_cache::get().get_page(node, *f, file_page);
+			}
+
+			if (!pg) {
+				pg = build_private_page(*f, *phdr, page_vaddr);
+			}
+
+			if (!pg) {
+				panic("unable to read in executable segment");
+			}
+
+			segment.pages[i] = pg;
+		}
+
+		image->segments_.append(segment);
+	}
+
+	delete[] program_headers;
+	return image;
+}
+
+bool executable_image::map_into(address_space &as)
+{
+	for (const auto &segment : segments_) {
+		if (!as.add_region(segment.base, segment.size, segment.flags, true)) {
+			return false;
+		}
+
+		for (u64 i = 0; i < segment.nr_pages; i++) {
+			if (!as.map_shared(segment.base + (i << PAGE_BITS), *segment.pages[i])) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+shared_ptr<executable_image> executable_cache::get_image(fs_node &node)
+{
+	mutex_lock l(lock_);
+
+	shared_ptr<executable_image> cached;
+	if (images_.try_get_value(&node, cached)) {
+		return cached;
+	}
+
+	// Images are never dropped, so neither is the node, which would otherwise be a dangling key once the file system
+	// evicted it.
+	auto image = executable_image::load(node);
+	if (image) {
+		node.acquire();
+		images_.add(&node, image);
+	}
+
+	return image;
+}
@@ -0,0 +1,343 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/sched/futex.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/kernel/sched/timer-queue.h>
+#include <stacsos/vector.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::arch::x86;
+
+bool futex_manager::resolve(process &owner, u64 addr, u64 &key, volatile u32 *&word, bool writable)
+{
+	// A futex word is a naturally aligned u32, in a region the process can read (and write, if the kernel is going to
+	// write to it).
+	if (addr & 3) {
+		return false;
+	}
+
+	auto *rgn = owner.addrspace().get_region_from_address(addr);
+	if (!rgn || !rgn->backed || (rgn->flags & region_flags::readable) == (region_flags)0) {
+		return false;
+	}
+
+	if (writable && (rgn->flags & region_flags::writable) == (region_flags)0) {
+		return false;
+	}
+
+	if (addr + sizeof(u32) > rgn->base + rgn->size) {
+		return false;
+	}
+
+	// The key is the physical address of the word, so a page shared with a forked process, which either of them may
+	// copy at any time, is made this process's own first.
+	if ((rgn->flags & region_flags::writable) == region_flags::writable && !owner.addrspace().pin_for_write(addr, sizeof(u32))) {
+		return false;
+	}
+
+	// Waiting on a page that hasn't been touched yet populates it.
+	page *pg = owner.addrspace().get_page(addr);
+	if (!pg) {
+		return false;
+	}
+
+	u64 offset = addr & ~PAGE_MASK;
+
+	key = pg->base_address() + offset;
+	word = (volatile u32 *)((uintptr_t)pg->base_address_ptr() + offset);
+
+	return true;
+}
+
+syscall_result_code futex_manager::wait(process &owner, u64 addr, u32 expected, u64 timeout_ms)
+{
+	u64 key;
+	volatile u32 *word;
+
+	if (!resolve(owner, addr, key, word)) {
+		return syscall_result_code::not_supported;
+	}
+
+	thread *ct = &thread::current();
+	futex_bucket &b = bucket_for(key);
+
+	futex_waiter w { key, ct, &b, false, false, false };
+
+	auto &tsc = x86_core::this_core().local_tsc();
+	timer_event timeout(tsc.read() + ((timeout_ms * tsc.frequency()) / 1000), timeout_expired, &w);
+
+	{
+		unique_irq_lock l(b.lock);
+
+		// The value is checked with the bucket locked, so a waker that changes it and then calls wake()
+		// cannot slip in between the check and this thread going to sleep.
+		if (*word != expected) {
+			return syscall_result_code::would_block;
+		}
+
+		ct->suspend();
+		b.waiters.append(&w);
+
+		if (timeout_ms) {
+			timer_queue::get().add(timeout);
+		}
+	}
+
+	x86_core::this_core().reschedule();
+
+	// If the timer can't be cancelled, it has already been taken off the queue to fire, so its callback may
+	// still be using the waiter record, which lives on this stack.
+	if (timeout_ms && !timer_queue::get().cancel(timeout)) {
+		while (!__atomic_load_n(&w.timer_done, __ATOMIC_ACQUIRE)) {
+			__relax();
+		}
+	}
+
+	return w.timed_out ? syscall_result_code::timed_out : syscall_result_code::ok;
+}
+
+void futex_manager::timeout_expired(void *arg)
+{
+	futex_waiter *w = (futex_waiter *)arg;
+	thread *t = nullptr;
+
+	{
+		unique_irq_lock l(w->bucket->lock);
+
+		if (!w->woken) {
+			w->bucket->waiters.remove(w);
+			w->woken = true;
+			w->timed_out = true;
+			t = w->thr;
+		}
+	}
+
+	// After this, the waiter may return and its record may disappear.
+	__atomic_store_n(&w->timer_done, true, __ATOMIC_RELEASE);
+
+	if (t) {
+		t->resume();
+	}
+}
+
+syscall_result_code futex_manager::wake(process &owner, u64 addr, u32 count, u64 &woken)
+{
+	u64 key;
+	volatile u32 *word;
+
+	woken = 0;
+
+	if (!resolve(owner, addr, key, word)) {
+		return syscall_result_code::not_supported;
+	}
+
+	futex_bucket &b = bucket_for(key);
+	small_vector<thread *, 8> to_wake;
+
+	{
+		unique_irq_lock l(b.lock);
+
+		small_vector<futex_waiter *, 8> matched;
+		for (auto w : b.waiters) {
+			if (matched.size() == count) {
+				break;
+			}
+
+			if (w->key == key) {
+				matched.push_back(w);
+			}
+		}
+
+		for (auto w : matched) {
+			b.waiters.remove(w);
+			w->woken = true;
+			to_wake.push_back(w->thr);
+		}
+	}
+
+	// Each thread was suspended before it was queued, so it can be resumed without the bucket lock.
+	for (auto t : to_wake) {
+		t->resume();
+	}
+
+	woken = to_wake.size();
+	return syscall_result_code::ok;
+}
+
+u32 futex_manager::pi_tid(const thread &t) { return (u32)(t.id() % FUTEX_PI_TID_MASK) + 1; }
+
+thread *futex_manager::find_pi_owner(process &owner, u32 tid)
+{
+	thread *found = nullptr;
+
+	owner.for_each_thread([&](thread &t) {
+		if (!found && !t.kernel_mode() && pi_tid(t) == tid) {
+			found = &t;
+		}
+	});
+
+	return found;
+}
+
+futex_pi_state *futex_manager::find_pi_state(futex_bucket &b, u64 key)
+{
+	for (auto state : b.pi_states) {
+		if (state->key == key) {
+			return state;
+		}
+	}
+
+	return nullptr;
+}
+
+void futex_pi_state::handed_over(thread *new_owner)
+{
+	// Called with the priority inheritance lock held, so no waiter can be added in between.
+	u32 value = 0;
+	if (new_owner) {
+		value = futex_manager::pi_tid(*new_owner) | (has_waiters() ? FUTEX_PI_WAITERS : 0);
+	}
+
+	__atomic_store_n(word, value, __ATOMIC_RELEASE);
+}
+
+syscall_result_code futex_manager::lock_pi(process &owner, u64 addr, u64 &tid)
+{
+	u64 key;
+	volatile u32 *word;
+
+	if (!resolve(owner, addr, key, word, true)) {
+		return syscall_result_code::not_supported;
+	}
+
+	u32 self = pi_tid(thread::current());
+	tid = self;
+
+	futex_bucket &b = bucket_for(key);
+	auto &pim = pi_manager::get();
+	pi_waiter w;
+
+	while (true) {
+		unique_irq_lock bl(b.lock);
+
+		u32 value = __atomic_load_n(word, __ATOMIC_RELAXED);
+		if (!value) {
+			if (__atomic_compare_exchange_n(word, &value, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				return syscall_result_code::ok;
+			}
+
+			continue;
+		}
+
+		// The caller already holds it, so waiting would never end.
+		if ((value & FUTEX_PI_TID_MASK) == self) {
+			return syscall_result_code::would_block;
+		}
+
+		// The state is made by the first waiter, which finds the holder from the ID in the word.  It may also have been
+		// left behind by a holder that stopped without unlocking.
+		futex_pi_state *state = find_pi_state(b, key);
+
+		thread *holder = nullptr;
+		if (!state || !state->owner()) {
+			holder = find_pi_owner(owner, value & FUTEX_PI_TID_MASK);
+			if (!holder) {
+				return syscall_result_code::not_found;
+			}
+		}
+
+		unique_irq_lock pl(pim.lock());
+
+		// Until the waiters bit is set, the holder can still release the lock from user space.
+		if (!(value & FUTEX_PI_WAITERS)
+			&& !__atomic_compare_exchange_n(word, &value, value | FUTEX_PI_WAITERS, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		if (!state) {
+			state = new futex_pi_state(key, word);
+			b.pi_states.append(state);
+		}
+
+		if (holder && !pim.set_owner(*state, *holder)) {
+			// The holder is stopping, and will never release the lock.
+			__atomic_and_fetch(word, ~FUTEX_PI_WAITERS, __ATOMIC_RELAXED);
+			return syscall_result_code::not_found;
+		}
+
+		pim.block(*state, w);
+		break;
+	}
+
+	pim.wait(w);
+
+	// Once no one else is waiting, the lock is left to user space again.
+	unique_irq_lock bl(b.lock);
+	unique_irq_lock pl(pim.lock());
+
+	futex_pi_state *state = (futex_pi_state *)w.lock;
+	if (!state->has_waiters()) {
+		b.pi_states.remove(state);
+		pim.disown(*state);
+
+		delete state;
+	}
+
+	return syscall_result_code::ok;
+}
+
+syscall_result_code futex_manager::unlock_pi(process &owner, u64 addr)
+{
+	u64 key;
+	volatile u32 *word;
+
+	if (!resolve(owner, addr, key, word, true)) {
+		return syscall_result_code::not_supported;
+	}
+
+	futex_bucket &b = bucket_for(key);
+	auto &pim = pi_manager::get();
+	thread *next;
+
+	{
+		unique_irq_lock bl(b.lock);
+		unique_irq_lock pl(pim.lock());
+
+		u32 value = __atomic_load_n(word, __ATOMIC_RELAXED);
+		if ((value & FUTEX_PI_TID_MASK) != pi_tid(thread::current())) {
+			return syscall_result_code::not_supported;
+		}
+
+		futex_pi_state *state = find_pi_state(b, key);
+		if (!state) {
+			__atomic_store_n(word, 0, __ATOMIC_RELEASE);
+			return syscall_result_code::ok;
+		}
+
+		next = pim.release(*state);
+
+		// Otherwise, the waiter the lock was handed to frees the state, once it has woken up.
+		if (!next) {
+			b.pi_states.remove(state);
+			delete state;
+		}
+	}
+
+	if (next) {
+		next->resume();
+	}
+
+	return syscall_result_code::ok;
+}
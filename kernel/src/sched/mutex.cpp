@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/mutex.h>
+#include <stacsos/kernel/sched/thread.h>
+
+using namespace stacsos::kernel::sched;
+
+u64 mutex::current_owner()
+{
+	// The idle threads (and the boot code, before there are any threads) have no thread object, but still have to be
+	// told apart from no owner at all.  They must never have to wait for a mutex, though.
+	u64 t;
+	asm volatile("mov %%gs:0, %0" : "=r"(t));
+
+	return t ? t : anonymous_owner;
+}
+
+void mutex::lock()
+{
+	u64 self = current_owner();
+	u64 expected = 0;
+
+	if (!__atomic_compare_exchange_n(&owner_word_, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		lock_slow(self);
+	}
+}
+
+void mutex::unlock()
+{
+	u64 expected = current_owner();
+
+	if (!__atomic_compare_exchange_n(&owner_word_, &expected, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		unlock_slow();
+	}
+}
+
+void mutex::lock_slow(u64 self)
+{
+	auto &pim = pi_manager::get();
+	pi_waiter w;
+
+	{
+		unique_irq_lock l(pim.lock());
+
+		// Waiters only come and go with the lock held, but the owner may release the mutex on its fast path until the
+		// waiters flag is set.
+		u64 word = __atomic_load_n(&owner_word_, __ATOMIC_RELAXED);
+		while (true) {
+			if (!word) {
+				if (__atomic_compare_exchange_n(&owner_word_, &word, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					return;
+				}
+			} else if ((word & waiters_flag)
+				|| __atomic_compare_exchange_n(&owner_word_, &word, word | waiters_flag, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+
+		u64 holder = word & ~waiters_flag;
+		if (holder == self) {
+			panic("mutex: recursive lock");
+		}
+
+		// The first waiter tells the priority inheritance code who the owner is, as it took the mutex on the fast path.
+		if (!owner() && holder != anonymous_owner) {
+			pim.set_owner(*this, *(thread *)holder);
+		}
+
+		pim.block(*this, w);
+	}
+
+	// The mutex is handed over by unlock, so it is held once this returns.
+	pim.wait(w);
+}
+
+void mutex::unlock_slow()
+{
+	auto &pim = pi_manager::get();
+	thread *next;
+
+	{
+		unique_irq_lock l(pim.lock());
+		next = pim.release(*this);
+	}
+
+	if (next) {
+		next->resume();
+	}
+}
+
+void mutex::handed_over(thread *new_owner)
+{
+	// Called with the priority inheritance lock held, so no waiter can be added in between.
+	u64 word = (u64)new_owner;
+	if (new_owner && has_waiters()) {
+		word |= waiters_flag;
+	}
+
+	__atomic_store_n(&owner_word_, word, __ATOMIC_RELEASE);
+}
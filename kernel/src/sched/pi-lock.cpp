@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/pi-lock.h>
+#include <stacsos/kernel/sched/scheduler.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/vector.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::sched;
+
+/**
+ * The priority a thread lends to the owner of a lock it waits for, which is zero for fair threads.
+ */
+static u8 pi_priority(const tcb &t) { return t.policy == sched_policy::fifo ? t.rt_priority : 0; }
+
+void pi_manager::insert_waiter(pi_lock &l, pi_waiter &w)
+{
+	// Highest priority first, and in the order they arrived within a priority.
+	pi_waiter *pos = l.waiters_.first();
+	while (pos && pos->priority >= w.priority) {
+		pos = l.waiters_.next(*pos);
+	}
+
+	l.waiters_.insert_before(pos, w);
+}
+
+bool pi_manager::set_owner(pi_lock &l, thread &t)
+{
+	if (t.pi_exited_) {
+		return false;
+	}
+
+	l.owner_ = &t;
+	t.pi_held_.append(l);
+
+	// The lock may already have waiters, if it has just been handed over.
+	propagate(&t);
+	return true;
+}
+
+void pi_manager::disown(pi_lock &l)
+{
+	thread *owner = l.owner_;
+	if (!owner) {
+		return;
+	}
+
+	owner->pi_held_.remove(l);
+	l.owner_ = nullptr;
+
+	propagate(owner);
+}
+
+void pi_manager::block(pi_lock &l, pi_waiter &w)
+{
+	thread &ct = thread::current();
+
+	w.thr = &ct;
+	w.lock = &l;
+	w.priority = pi_priority(*ct.get_tcb());
+	w.granted = false;
+
+	ct.suspend();
+	insert_waiter(l, w);
+	ct.pi_blocked_on_ = &w;
+
+	if (l.owner_) {
+		propagate(l.owner_);
+	}
+}
+
+void pi_manager::wait(pi_waiter &w)
+{
+	while (true) {
+		arch::core::this_core().reschedule();
+
+		unique_irq_lock l(lock_);
+		if (w.granted) {
+			return;
+		}
+
+		// Resumed by something other than the lock being handed over, so go back to sleep.
+		thread::current().suspend();
+	}
+}
+
+thread *pi_manager::release(pi_lock &l)
+{
+	thread *old_owner = l.owner_;
+	if (old_owner) {
+		old_owner->pi_held_.remove(l);
+		l.owner_ = nullptr;
+	}
+
+	thread *next = nullptr;
+
+	pi_waiter *w = l.waiters_.dequeue();
+	if (w) {
+		next = w->thr;
+		next->pi_blocked_on_ = nullptr;
+
+		// The waiter may return as soon as the lock is dropped, taking the record with it.
+		w->granted = true;
+
+		l.owner_ = next;
+		next->pi_held_.append(l);
+		propagate(next);
+	}
+
+	l.handed_over(next);
+
+	if (old_owner && !old_owner->pi_exited_) {
+		propagate(old_owner);
+	}
+
+	return next;
+}
+
+void pi_manager::set_base_priority(thread &t, sched_policy policy, int priority)
+{
+	unique_irq_lock l(lock_);
+
+	t.get_tcb()->base_policy = policy;
+	t.get_tcb()->base_priority = (s8)priority;
+
+	propagate(&t);
+}
+
+void pi_manager::thread_stopping(thread &t)
+{
+	small_vector<thread *, 4> to_resume;
+
+	{
+		unique_irq_lock l(lock_);
+		t.pi_exited_ = true;
+
+		pi_waiter *w = t.pi_blocked_on_;
+		if (w) {
+			w->lock->waiters_.remove(*w);
+			t.pi_blocked_on_ = nullptr;
+
+			if (w->lock->owner_) {
+				propagate(w->lock->owner_);
+			}
+		}
+
+		while (pi_lock *held = t.pi_held_.first()) {
+			thread *next = release(*held);
+			if (next) {
+				to_resume.push_back(next);
+			}
+		}
+	}
+
+	for (auto next : to_resume) {
+		next->resume();
+	}
+}
+
+bool pi_manager::update_priority(thread &t)
+{
+	tcb &tcb = *t.get_tcb();
+
+	u8 inherited = 0;
+	for (pi_lock *l : t.pi_held_) {
+		pi_waiter *top = l->waiters_.first();
+		if (top) {
+			inherited = max(inherited, top->priority);
+		}
+	}
+
+	sched_policy policy = tcb.base_policy;
+	int priority = tcb.base_priority;
+
+	if (inherited && (policy != sched_policy::fifo || inherited > priority)) {
+		policy = sched_policy::fifo;
+		priority = inherited;
+	}
+
+	if (tcb.policy == policy && (policy == sched_policy::fifo ? tcb.rt_priority == priority : tcb.nice == priority)) {
+		return false;
+	}
+
+	scheduler::get().apply_priority(t, policy, priority);
+	return true;
+}
+
+void pi_manager::propagate(thread *t)
+{
+	for (unsigned int depth = 0; t && depth < max_chain; depth++) {
+		if (!update_priority(*t)) {
+			return;
+		}
+
+		pi_waiter *w = t->pi_blocked_on_;
+		if (!w) {
+			return;
+		}
+
+		// The thread's new priority moves it up (or down) the queue of the lock it is waiting for, and on to that lock's
+		// owner.
+		pi_lock &l = *w->lock;
+
+		l.waiters_.remove(*w);
+		w->priority = pi_priority(*t->get_tcb());
+		insert_waiter(l, *w);
+
+		t = l.owner_;
+	}
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/sched/preempt.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::sched;
+
+void stacsos::kernel::sched::cond_resched()
+{
+	if (preempt_count()) {
+		return;
+	}
+
+	// Until the core is running tasks, and in its idle thread, there is nothing to give way to.
+	auto &c = core::this_core();
+	tcb *current = c.get_current_tcb();
+	if (!current->entity) {
+		return;
+	}
+
+	// The task stays runnable, so it is switched back in when it is next picked, like a task preempted by the tick.
+	if (c.resched_due()) {
+		c.reschedule();
+	}
+}
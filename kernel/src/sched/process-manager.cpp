@@ -5,15 +5,20 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
-#include <stacsos/elf.h>
 #include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/config.h>
 #include <stacsos/kernel/debug.h>
-#include <stacsos/kernel/fs/file.h>
 #include <stacsos/kernel/fs/vfs.h>
+#include <stacsos/kernel/log.h>
 #include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/kernel-data-page.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/obj/object-manager.h>
+#include <stacsos/kernel/sched/executable-image.h>
 #include <stacsos/kernel/sched/process-manager.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/process-start.h>
 
 using namespace stacsos;
 using namespace stacsos::kernel::sched;
@@ -32,87 +37,273 @@ shared_ptr<process> process_manager::create_kernel_process(continuation_fn cfn)
 	kernel_process->create_thread((u64)cfn);
 
 	auto kernel_process_ptr = shared_ptr(kernel_process);
-	active_processes_.append(kernel_process_ptr);
+	add_process(kernel_process_ptr);
 
 	kernel_process_ = kernel_process_ptr;
 	return kernel_process_ptr;
 }
 
-shared_ptr<process> process_manager::create_process(const char *path, const char *args)
+/**
+ * @brief Gives the process its own handle to the same thing as o, returning the handle, or zero if it has run out.
+ */
+static u64 duplicate_handle(process &proc, kernel::obj::object &o)
+{
+	auto dup = kernel::obj::object_manager::get().duplicate_object(proc, o);
+	return dup ? dup->id() : 0;
+}
+
+/**
+ * @brief Fills in the start-up information of a new process, giving it its own handles to the objects it is passed.
+ * Returns false if the process's account doesn't have room for them.
+ */
+static bool fill_start_info(process &proc, process_start_info *info, const char *args, kernel::obj::object *input,
+	kernel::obj::object *output, kernel::obj::object *const *inherited, u64 nr_inherited)
+{
+	info->streams.input = input ? duplicate_handle(proc, *input) : 0;
+	info->streams.output = output ? duplicate_handle(proc, *output) : 0;
+	if ((input && !info->streams.input) || (output && !info->streams.output)) {
+		return false;
+	}
+
+	info->nr_handles = min(nr_inherited, SPAWN_MAX_HANDLES);
+	for (u64 i = 0; i < info->nr_handles; i++) {
+		info->handles[i] = duplicate_handle(proc, *inherited[i]);
+		if (!info->handles[i]) {
+			return false;
+		}
+	}
+
+	memops::strncpy(info->args, args, min((size_t)memops::strlen(args) + 1, sizeof(info->args)));
+	info->args[sizeof(info->args) - 1] = 0;
+
+	return true;
+}
+
+shared_ptr<process> process_manager::create_process(const char *path, const char *args, obj::object *input, obj::object *output,
+	obj::object *const *inherited, u64 nr_inherited, shared_ptr<resource_account> account)
+{
+	shared_ptr<process> templ;
+	u64 entry_point = 0;
+
+	{
+		unique_irq_lock l(lock_);
+
+		for (auto *z : zygotes_) {
+			if (z->entry_point && memops::strcmp(z->path.c_str(), path) == 0) {
+				templ = z->templ;
+				entry_point = z->entry_point;
+				break;
+			}
+		}
+	}
+
+	if (templ) {
+		dlogf<log_level::trace>("pm: copying template of '%s'\n", path);
+		return copy_zygote(*templ, entry_point, args, input, output, inherited, nr_inherited, account);
+	}
+
+	return load_process(path, args, input, output, inherited, nr_inherited, account, process_start_flags::none);
+}
+
+shared_ptr<process> process_manager::load_process(const char *path, const char *args, obj::object *input, obj::object *output,
+	obj::object *const *inherited, u64 nr_inherited, shared_ptr<resource_account> account, process_start_flags flags)
 {
 	auto *binary = stacsos::kernel::fs::vfs::get().lookup(path);
 	if (!binary) {
-		dprintf("pm: binary '%s' not found\n", path);
+		dlogf<log_level::debug>("pm: binary '%s' not found\n", path);
 		return nullptr;
 	}
 
-	dprintf("pm: found binary '%s'\n", path);
+	dlogf<log_level::trace>("pm: found binary '%s'\n", path);
+
+	// The binary is only read and parsed the first time it is started.  After that, loading it is a matter of mapping
+	// the pages its image already holds.
+	auto image = executable_cache::get().get_image(*binary);
+	binary->release();
 
-	auto file = binary->open();
-	if (!file) {
-		dprintf("pm: unable to open binary\n");
+	if (!image) {
 		return nullptr;
 	}
 
-	char header_buffer[0x40];
-	if (file->pread(header_buffer, 0, sizeof(header_buffer)) != sizeof(header_buffer)) {
-		dprintf("pm: incorrect file size\n");
-		return nullptr;
+	auto proc = new process(exec_privilege::user, account);
+	kernel_data_page::get().map_into(proc->addrspace());
+
+	if (!image->map_into(proc->addrspace())) {
+		panic("unable to map executable image");
 	}
 
-	if (((const elf_ident_header *)header_buffer)->ei_class != elf_ident_classes::ei_class_64bit) {
-		dprintf("pm: invalid elf class\n");
-		return nullptr;
+	auto data_page = proc->addrspace().alloc_region(0x1000, region_flags::readable, true);
+	if (!data_page) {
+		panic("unable to allocate data page");
 	}
 
-	const elf_header<64> *ehdr = (const elf_header<64> *)header_buffer;
+	// From here on, the process's account may turn out not to have room for it, in which case everything it has been
+	// given so far is handed back.  Nothing else has seen the process yet, so it can simply be deleted.
+	auto discard = [proc] {
+		obj::object_manager::get().free_objects(*proc);
+		delete proc;
+		return nullptr;
+	};
+
+	page *data_storage = proc->addrspace().get_page(data_page->base);
+	if (!data_storage) {
+		return discard();
+	}
 
-	// parse elf file
-	// create process
-	// load address space
-	// create main thread
+	process_start_info *info = (process_start_info *)data_storage->base_address_ptr();
+	if (!fill_start_info(*proc, info, args, input, output, inherited, nr_inherited)) {
+		return discard();
+	}
 
-	auto proc = new process(exec_privilege::user);
+	info->tls = image->tls();
+	info->flags = flags;
 
-	char *program_headers = new char[ehdr->e_phnum * ehdr->e_phentsize];
-	file->pread(program_headers, ehdr->e_phoff, ehdr->e_phnum * ehdr->e_phentsize);
+	if (!proc->create_thread(image->entry_point(), (void *)data_page->base)) {
+		return discard();
+	}
 
-	for (int seg_idx = 0; seg_idx < ehdr->e_phnum; seg_idx++) {
-		const elf_programheader<64> *phdr = ((const elf_programheader<64> *)(program_headers + (seg_idx * ehdr->e_phentsize)));
+	auto pp = shared_ptr(proc);
+	add_process(pp);
 
-		// dprintf("hdr %d: type=%d flags=%x off=%lx vaddr=%lx paddr=%lx memsz=%lx filesz=%lx\n", seg_idx, phdr->p_type, phdr->p_flags, phdr->p_offset,
-		// phdr->p_vaddr, phdr->p_paddr, phdr->p_memsz, phdr->p_filesz);
+	return pp;
+}
 
-		if (phdr->p_type == elf_program_header_type::pt_load) {
-			u64 vaddr_page = phdr->p_vaddr & PAGE_MASK;
-			u64 vaddr_page_offset = phdr->p_vaddr & ~PAGE_MASK;
-			u64 size = (phdr->p_memsz + vaddr_page_offset + (PAGE_SIZE - 1)) & PAGE_MASK;
+shared_ptr<process> process_manager::copy_zygote(process &templ, u64 entry_point, const char *args, obj::object *input,
+	obj::object *output, obj::object *const *inherited, u64 nr_inherited, shared_ptr<resource_account> account)
+{
+	auto proc = new process(exec_privilege::user, account);
 
-			auto rgn = proc->addrspace().add_region(vaddr_page, size, region_flags::all, true);
-			if (!rgn) {
-				panic("unable to add region for segment");
-			}
+	auto discard = [proc] {
+		obj::object_manager::get().free_objects(*proc);
+		delete proc;
+		return nullptr;
+	};
 
-			// rgn->storage
-			void *target = (char *)rgn->storage->base_address_ptr() + vaddr_page_offset;
-			// dprintf("copy to %p\n", target);
-			file->pread(target, phdr->p_offset, phdr->p_filesz);
-		}
+	// The template's memory (with the program, and everything it set up before it was ready) is shared copy-on-write,
+	// as is the kernel data page, so all that is new is the copy's start-up information.
+	if (!proc->copy_from(templ)) {
+		return discard();
 	}
 
-	delete[] program_headers;
-
 	auto data_page = proc->addrspace().alloc_region(0x1000, region_flags::readable, true);
 	if (!data_page) {
-		panic("unable to allocate data page");
+		return discard();
 	}
 
-	memops::strncpy((char *)data_page->storage->base_address_ptr(), args, memops::strlen(args) + 1);
+	page *data_storage = proc->addrspace().get_page(data_page->base);
+	if (!data_storage) {
+		return discard();
+	}
 
-	proc->create_thread(ehdr->e_entry, (void *)data_page->base);
+	// The template has already set up its thread-local storage, which the copy's first thread inherits, so there is no
+	// layout to pass on.
+	process_start_info *info = (process_start_info *)data_storage->base_address_ptr();
+	if (!fill_start_info(*proc, info, args, input, output, inherited, nr_inherited)) {
+		return discard();
+	}
+
+	info->tls = {};
+	info->flags = process_start_flags::none;
+
+	if (!proc->create_thread(entry_point, (void *)data_page->base)) {
+		return discard();
+	}
+
+	auto pp = shared_ptr(proc);
+	add_process(pp);
+
+	return pp;
+}
+
+shared_ptr<process> process_manager::clone_process(process &parent, u64 entry_point, void *entry_arg, shared_ptr<resource_account> account)
+{
+	auto proc = new process(exec_privilege::user, account);
+
+	// As with a new program, a process that doesn't fit in its account has been seen by nothing else, so it is simply
+	// deleted.
+	if (!proc->copy_from(parent) || !proc->create_thread(entry_point, entry_arg)) {
+		obj::object_manager::get().free_objects(*proc);
+		delete proc;
+		return nullptr;
+	}
 
 	auto pp = shared_ptr(proc);
-	active_processes_.append(pp);
+	add_process(pp);
 
 	return pp;
 }
+
+void process_manager::remove_process(process &p)
+{
+	// This may be the last reference to the process, so it is only dropped once the lock has been released.
+	shared_ptr<process> removed;
+
+	unique_irq_lock l(lock_);
+
+	for (auto &ap : active_processes_) {
+		if (ap.get() == &p) {
+			removed = ap;
+			break;
+		}
+	}
+
+	active_processes_.remove(removed);
+}
+
+void process_manager::start_zygotes()
+{
+	const char *option = kernel::config::get().get_option("zygotes");
+	if (!option) {
+		return;
+	}
+
+	while (*option) {
+		const char *end = option;
+		while (*end && *end != ',') {
+			end++;
+		}
+
+		string path(option, end - option);
+		option = *end ? end + 1 : end;
+
+		if (path.length() == 0) {
+			continue;
+		}
+
+		auto templ = load_process(path.c_str(), "", nullptr, nullptr, nullptr, 0, nullptr, process_start_flags::zygote);
+		if (!templ) {
+			dprintf("pm: unable to start template of '%s'\n", path.c_str());
+			continue;
+		}
+
+		{
+			unique_irq_lock l(lock_);
+			zygotes_.append(new zygote { path, templ, 0 });
+		}
+
+		dlogf<log_level::debug>("pm: started template of '%s'\n", path.c_str());
+		templ->start();
+	}
+}
+
+bool process_manager::zygote_ready(process &p, u64 entry_point)
+{
+	if (!entry_point) {
+		return false;
+	}
+
+	unique_irq_lock l(lock_);
+
+	for (auto *z : zygotes_) {
+		if (z->templ.get() == &p) {
+			if (z->entry_point) {
+				return false;
+			}
+
+			z->entry_point = entry_point;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -6,17 +6,37 @@
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
 #include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/obj/object-manager.h>
+#include <stacsos/kernel/sched/deferred-work.h>
+#include <stacsos/kernel/sched/process-manager.h>
 #include <stacsos/kernel/sched/process.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/atomic.h>
 
 using namespace stacsos;
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::obj;
+
+u64 process::allocate_id()
+{
+	static atomic_u64 next_id(0);
+	return next_id++;
+}
 
 shared_ptr<thread> process::create_thread(u64 entry_point, void *entry_arg)
 {
+	// Only user threads count towards the limit, as helper threads and the kernel's own are started by the kernel.
+	if (priv_ == exec_privilege::user && !account_->charge(resource_type::threads, 1)) {
+		return nullptr;
+	}
+
 	u64 user_stack = 0;
 	if (priv_ == exec_privilege::user) {
+		user_stack = reuse_user_stack();
+	}
+
+	if (priv_ == exec_privilege::user && !user_stack) {
 		u64 stack_base = next_user_stack_;
 		u64 stack_size = 0x4000;
 
@@ -27,11 +47,75 @@ shared_ptr<thread> process::create_thread(u64 entry_point, void *entry_arg)
 	}
 
 	shared_ptr<thread> t = shared_ptr(new thread(*this, entry_point, entry_arg, user_stack));
-	threads_.append(t);
+	t->charged_ = priv_ == exec_privilege::user;
+
+	{
+		unique_irq_lock l(threads_lock_);
+
+		// The flag is changed with the list locked, so a new thread can't miss a change.
+		t->get_tcb()->gang = gang_scheduled_ ? this : nullptr;
+		threads_.append(t);
+	}
 
 	return t;
 }
 
+bool process::copy_from(process &parent)
+{
+	if (!parent.addrspace().clone_into(addrspace())) {
+		return false;
+	}
+
+	// The parent's thread stacks are part of the copy, so new ones have to go after them.
+	next_user_stack_ = parent.next_user_stack_;
+
+	return object_manager::get().copy_objects(parent, *this);
+}
+
+void process::set_gang_scheduled(bool gang_scheduled)
+{
+	unique_irq_lock l(threads_lock_);
+	gang_scheduled_ = gang_scheduled;
+
+	// A thread that is running, or queued, picks the change up the next time it is scheduled.
+	for (auto &t : threads_) {
+		if (!t->kernel_mode()) {
+			t->get_tcb()->gang = gang_scheduled ? this : nullptr;
+		}
+	}
+}
+
+shared_ptr<thread> process::create_helper_thread(u64 entry_point, void *entry_arg)
+{
+	shared_ptr<thread> t = shared_ptr(new thread(*this, entry_point, entry_arg, 0, true));
+
+	{
+		unique_irq_lock l(threads_lock_);
+		threads_.append(t);
+	}
+
+	return t;
+}
+
+u64 process::reuse_user_stack()
+{
+	unique_irq_lock l(threads_lock_);
+
+	if (free_user_stacks_.empty()) {
+		return 0;
+	}
+
+	return free_user_stacks_.dequeue();
+}
+
+void process::release_user_stack(u64 stack_top)
+{
+	// The stack stays mapped, for the next thread created in this process.  It isn't cleared, because any thread that
+	// gets it could already read it anyway.
+	unique_irq_lock l(threads_lock_);
+	free_user_stacks_.append(stack_top);
+}
+
 void process::start()
 {
 	for (auto &t : threads_) {
@@ -39,7 +123,7 @@ void process::start()
 	}
 
 	state_ = process_state::started;
-	state_changed_event_.trigger();
+	state_changed_.wake_all();
 }
 
 void process::stop()
@@ -49,25 +133,84 @@ void process::stop()
 	}
 
 	state_ = process_state::terminated;
-	state_changed_event_.trigger();
+	state_changed_.wake_all();
 }
 
 void process::on_thread_stopped(thread &thread)
 {
 	dprintf("proc: thread stopped\n");
 
+	// A thread can be stopped more than once (say by another thread, and then by the process stopping), but its
+	// charge is only given back the first time.
+	if (__atomic_exchange_n(&thread.charged_, false, __ATOMIC_ACQ_REL)) {
+		account_->uncharge(resource_type::threads, 1);
+	}
+
 	// Don't do anything further for the kernel process.
 	if (priv_ == exec_privilege::kernel) {
 		return;
 	}
 
+	sched::thread *running_helper = nullptr;
 	for (auto &t : threads_) {
 		if (t->state() != thread_states::terminated) {
-			return;
+			if (!t->kernel_mode()) {
+				return;
+			}
+
+			running_helper = t.get();
 		}
 	}
 
+	// Helpers only work for the rest of the process, so they are stopped along with its last thread.  Each of them
+	// stopping comes back through here, and the last one tears the process down.
+	if (running_helper) {
+		running_helper->stop();
+		return;
+	}
+
+	// Threads on different cores can stop at the same time, but only one of them gets to tear the process down.
+	if (__atomic_exchange_n(&exiting_, true, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
 	dprintf("proc: terminated\n");
 	state_ = process_state::terminated;
-	state_changed_event_.trigger();
+	state_changed_.wake_all();
+
+	// Freeing everything the process had takes a while, so it is left to the idle thread, rather than slowing down
+	// the thread that is exiting.
+	deferred_work::get().queue(teardown_work_);
+}
+
+void process::teardown(void *arg)
+{
+	process *p = (process *)arg;
+
+	{
+		unique_irq_lock l(p->threads_lock_);
+
+		// Threads stopped by another thread may still be running on some other core, and so still be using the
+		// address space.  They are switched out by their next tick at the latest, so check again the next time this core is idle.
+		for (auto &t : p->threads_) {
+			if (__atomic_load_n(&t->get_tcb()->on_cpu, __ATOMIC_ACQUIRE)) {
+				deferred_work::get().queue(p->teardown_work_);
+				return;
+			}
+		}
+	}
+
+	object_manager::get().free_objects(*p);
+
+	for (auto &t : p->threads_) {
+		t->reclaim();
+	}
+
+	p->free_user_stacks_.clear();
+
+	delete p->vma_;
+	p->vma_ = nullptr;
+
+	// The process (and its threads) are freed once nothing else holds a reference, which may be straight away.
+	process_manager::get().remove_process(*p);
 }
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core-manager.h>
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/rcu.h>
+
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::sched;
+
+void rcu::synchronize()
+{
+	u64 target = __atomic_add_fetch(&gp_seq_, 1, __ATOMIC_SEQ_CST);
+
+	// The caller isn't in a read-side section, so its own core is quiescent already.
+	u64 flags = irq_save();
+	note_quiescent();
+	int self = current_core_id();
+	irq_restore(flags);
+
+	for (auto *c : core_manager::get().cores()) {
+		if (c->id() == self || (c->status() != core_status::online && c->status() != core_status::bootstrap)) {
+			continue;
+		}
+
+		bool kicked = false;
+		while (__atomic_load_n(&cores_[c->id()].quiescent_seq, __ATOMIC_ACQUIRE) < target) {
+			if (!kicked) {
+				c->kick();
+				kicked = true;
+			}
+
+			__relax();
+		}
+	}
+}
+
+void rcu::perform_selftest()
+{
+	dprintf("rcu: self test: nested read-side sections\n");
+
+	u32 start_count = preempt_count();
+
+	read_lock();
+	read_lock();
+	read_lock();
+
+	if (preempt_count() != start_count + 3) {
+		panic("rcu self-test: preempt count %u inside three read-side sections, expected %u", preempt_count(), start_count + 3);
+	}
+
+	read_unlock();
+	read_unlock();
+
+	u64 flags;
+	asm volatile("pushfq; popq %0" : "=r"(flags));
+	if (flags & 0x200) {
+		panic("rcu self-test: interrupts enabled inside an outer read-side section");
+	}
+
+	read_unlock();
+
+	if (preempt_count() != start_count) {
+		panic("rcu self-test: preempt count %u after the read-side sections, expected %u", preempt_count(), start_count);
+	}
+
+	dprintf("rcu: self test passed\n");
+}
+
+void rcu::call(rcu_head &head, void (*fn)(rcu_head *head))
+{
+	head.fn = fn;
+
+	bool queue_work;
+	{
+		unique_irq_lock l(callbacks_lock_);
+
+		head.next = pending_;
+		pending_ = &head;
+
+		queue_work = !callbacks_queued_;
+		callbacks_queued_ = true;
+	}
+
+	// The callbacks are run by an idle thread, which is free to wait for the grace period.
+	if (queue_work) {
+		deferred_work::get().queue(callbacks_work_);
+	}
+}
+
+void rcu::run_callbacks(void *arg)
+{
+	rcu *self = (rcu *)arg;
+
+	rcu_head *heads;
+	{
+		unique_irq_lock l(self->callbacks_lock_);
+
+		heads = self->pending_;
+		self->pending_ = nullptr;
+		self->callbacks_queued_ = false;
+	}
+
+	self->synchronize();
+
+	while (heads) {
+		rcu_head *next = heads->next;
+		heads->fn(heads);
+		heads = next;
+	}
+}
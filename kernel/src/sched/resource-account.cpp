@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/sched/resource-account.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::sched;
+
+bool resource_account::set_limit(resource_type type, u64 limit)
+{
+	u64 current = __atomic_load_n(&limits_[(u64)type], __ATOMIC_RELAXED);
+
+	do {
+		if (limit > current) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&limits_[(u64)type], &current, limit, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return true;
+}
+
+bool resource_account::charge(resource_type type, u64 n)
+{
+	for (resource_account *a = this; a; a = a->parent_.get()) {
+		u64 used = __atomic_add_fetch(&a->usage_[(u64)type], n, __ATOMIC_RELAXED);
+
+		// Anything racing with this charge sees the usage over the limit for a moment, and may fail when it would have
+		// fitted, but two charges can never both succeed and take the account over.
+		if (used > a->limit(type)) {
+			__atomic_sub_fetch(&a->usage_[(u64)type], n, __ATOMIC_RELAXED);
+
+			for (resource_account *b = this; b != a; b = b->parent_.get()) {
+				__atomic_sub_fetch(&b->usage_[(u64)type], n, __ATOMIC_RELAXED);
+			}
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void resource_account::uncharge(resource_type type, u64 n)
+{
+	for (resource_account *a = this; a; a = a->parent_.get()) {
+		__atomic_sub_fetch(&a->usage_[(u64)type], n, __ATOMIC_RELAXED);
+	}
+}
+
+shared_ptr<resource_account> resource_account::create_child(bool new_group) const
+{
+	shared_ptr<resource_account> group = parent_;
+	if (new_group) {
+		group = make_shared<resource_account>(parent_);
+	}
+
+	auto child = make_shared<resource_account>(group);
+	for (u64 i = 0; i < NR_RESOURCE_TYPES; i++) {
+		child->limits_[i] = limits_[i];
+	}
+
+	return child;
+}
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/kernel/sched/sched-trace.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::arch;
+
+void sched_trace::record(sched_trace_event_kind kind, const tcb *task, u64 timestamp)
+{
+	int id = core::this_core_id();
+	per_core_trace &t = cores_[id];
+
+	sched_trace_event &e = t.events[t.head % events_per_core];
+	e.timestamp = timestamp;
+	e.task = task;
+	e.kind = kind;
+	e.core = id;
+
+	// Publish the event after it has been filled in.
+	__atomic_store_n(&t.head, t.head + 1, __ATOMIC_RELEASE);
+}
+
+void sched_trace::record_wakeup(tcb &task)
+{
+	u64 now = __builtin_ia32_rdtsc();
+
+	task.wakeup_time = now;
+	record(sched_trace_event_kind::wakeup, &task, now);
+}
+
+void sched_trace::record_switch(tcb *prev, tcb &next)
+{
+	u64 now = __builtin_ia32_rdtsc();
+
+	if (prev) {
+		record(sched_trace_event_kind::switch_out, prev, now);
+	}
+
+	record(sched_trace_event_kind::switch_in, &next, now);
+
+	if (next.wakeup_time) {
+		u64 latency = now > next.wakeup_time ? now - next.wakeup_time : 0;
+		unsigned int bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+
+		cores_[core::this_core_id()].latency[min(bucket, latency_buckets - 1)]++;
+		next.wakeup_time = 0;
+	}
+}
+
+void sched_trace::record_runqueue_depth(unsigned int depth) { cores_[core::this_core_id()].depth[min(depth, depth_buckets - 1)]++; }
+
+static const char *event_kind_name(sched_trace_event_kind kind)
+{
+	switch (kind) {
+	case sched_trace_event_kind::switch_in:
+		return "in";
+	case sched_trace_event_kind::switch_out:
+		return "out";
+	case sched_trace_event_kind::wakeup:
+		return "wake";
+	default:
+		return "?";
+	}
+}
+
+size_t sched_trace::render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	u64 cycles_per_us = max(core::this_core().timestamp_frequency() / 1000000, 1ull);
+
+	EMIT("wakeup latency (2^n tsc cycles, tsc at %llu MHz):\n", cycles_per_us);
+	for (unsigned int b = 0; b < latency_buckets; b++) {
+		u64 total = 0;
+		for (int c = 0; c < core_manager::max_cores; c++) {
+			total += cores_[c].latency[b];
+		}
+
+		if (total) {
+			EMIT("  %2u (< %llu us): %llu\n", b, ((2ull << b) + cycles_per_us - 1) / cycles_per_us, total);
+		}
+	}
+
+	EMIT("run queue depth at schedule:\n");
+	for (unsigned int d = 0; d < depth_buckets; d++) {
+		u64 total = 0;
+		for (int c = 0; c < core_manager::max_cores; c++) {
+			total += cores_[c].depth[d];
+		}
+
+		if (total) {
+			EMIT("  %2u%s: %llu\n", d, d == depth_buckets - 1 ? "+" : "", total);
+		}
+	}
+
+	for (int c = 0; c < core_manager::max_cores; c++) {
+		per_core_trace &t = cores_[c];
+
+		u64 head = __atomic_load_n(&t.head, __ATOMIC_ACQUIRE);
+		if (!head) {
+			continue;
+		}
+
+		u64 first = head > events_per_core ? head - events_per_core : 0;
+
+		EMIT("core %d events:\n", c);
+		for (u64 i = first; i < head; i++) {
+			const sched_trace_event &e = t.events[i % events_per_core];
+			EMIT("  %llu %s %p\n", e.timestamp, event_kind_name(e.kind), e.task);
+		}
+	}
+
+#undef EMIT
+
+	return n;
+}
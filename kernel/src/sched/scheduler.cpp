@@ -7,14 +7,205 @@
  */
 #include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/sched/pi-lock.h>
+#include <stacsos/kernel/sched/process.h>
 #include <stacsos/kernel/sched/schedulable-entity.h>
 #include <stacsos/kernel/sched/scheduler.h>
+#include <stacsos/kernel/sched/thread.h>
 
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::arch;
 
-// TODO: support multicore.
+void scheduler::add_to_schedule(schedulable_entity &e)
+{
+	// An entity stays on the core it is first placed on, so that it can never be
+	// picked up by one core while it is still executing on another.
+	if (!e.owning_core_) {
+		e.owning_core_ = &select_core(e.get_tcb()->affinity);
+	}
 
-void scheduler::add_to_schedule(schedulable_entity &e) { core_manager::get().get_core(0).add_to_runqueue(*e.get_tcb()); }
+	e.owning_core_->add_to_runqueue(*e.get_tcb());
+}
 
-void scheduler::remove_from_schedule(schedulable_entity &e) { core_manager::get().get_core(0).remove_from_runqueue(*e.get_tcb()); }
+void scheduler::remove_from_schedule(schedulable_entity &e)
+{
+	// The entity may be migrated by a work-stealing core while we're trying to remove it, in which
+	// case try again on its new core.
+	while (true) {
+		core *c = __atomic_load_n(&e.owning_core_, __ATOMIC_ACQUIRE);
+		if (!c || c->remove_from_runqueue(*e.get_tcb())) {
+			return;
+		}
+	}
+}
+
+static bool is_running(core *c) { return c && (c->status() == core_status::online || c->status() == core_status::bootstrap); }
+
+bool scheduler::set_affinity(schedulable_entity &e, u64 mask)
+{
+	auto &cm = core_manager::get();
+
+	// A reservation was admitted against the utilisation of the core the entity is on, so it has to stay there.
+	if (e.get_tcb()->edf_period) {
+		return false;
+	}
+
+	if (mask) {
+		bool any = false;
+		for (int i = 0; i < core_manager::max_cores; i++) {
+			if ((mask & (1ull << i)) && is_running(cm.try_get_core(i))) {
+				any = true;
+				break;
+			}
+		}
+
+		if (!any) {
+			return false;
+		}
+	}
+
+	__atomic_store_n(&e.get_tcb()->affinity, mask, __ATOMIC_RELAXED);
+
+	// The entity can't be moved from here, because it may be running.  Instead, its owning core moves it
+	// the next time it schedules, when it is guaranteed not to be running.
+	core *c = __atomic_load_n(&e.owning_core_, __ATOMIC_ACQUIRE);
+	if (c && !can_run_on(*e.get_tcb(), c->id())) {
+		c->request_resched();
+	}
+
+	return true;
+}
+
+bool scheduler::set_priority(schedulable_entity &e, sched_policy policy, int priority)
+{
+	switch (policy) {
+	case sched_policy::fair:
+		if (priority < -20 || priority > 19) {
+			return false;
+		}
+		break;
+
+	case sched_policy::fifo:
+		if (priority < 1 || priority > 99) {
+			return false;
+		}
+		break;
+
+	default:
+		return false;
+	}
+
+	// The priority only takes effect once it is higher than any the entity is inheriting through a lock it holds.
+	pi_manager::get().set_base_priority(static_cast<thread &>(e), policy, priority);
+	return true;
+}
+
+void scheduler::apply_priority(schedulable_entity &e, sched_policy policy, int priority)
+{
+	// As with removal, the entity may be migrated while this is going on.
+	while (true) {
+		core *c = __atomic_load_n(&e.owning_core_, __ATOMIC_ACQUIRE);
+		if (!c) {
+			// Not yet scheduled, so nothing else can be looking at the priority.
+			e.get_tcb()->policy = policy;
+			e.get_tcb()->rt_priority = policy == sched_policy::fifo ? priority : 0;
+			e.get_tcb()->nice = policy == sched_policy::fair ? priority : 0;
+			return;
+		}
+
+		if (c->set_priority(*e.get_tcb(), policy, priority)) {
+			return;
+		}
+	}
+}
+
+bool scheduler::set_reservation(schedulable_entity &e, u64 runtime_us, u64 period_us)
+{
+	if (runtime_us > period_us) {
+		return false;
+	}
+
+	// A zero runtime removes the reservation.
+	if (!runtime_us) {
+		period_us = 0;
+	}
+
+	while (true) {
+		core *c = __atomic_load_n(&e.owning_core_, __ATOMIC_ACQUIRE);
+		if (!c) {
+			// Admission is against the core the entity runs on, so it must have been started first.
+			return false;
+		}
+
+		u64 freq = c->timestamp_frequency();
+		bool admitted;
+
+		if (c->set_reservation(*e.get_tcb(), (runtime_us * freq) / 1000000, (period_us * freq) / 1000000, admitted)) {
+			return admitted;
+		}
+	}
+}
+
+void scheduler::co_schedule(const tcb &leader, u64 until, core &leader_core)
+{
+	// A gang is the process that its threads belong to.  The leader is running, so its process can't go away.
+	process *gang = (process *)leader.gang;
+	u64 cores = 0;
+
+	// Only the cores are noted while the thread list is locked, so that no run queue lock is ever taken inside it.
+	gang->for_each_thread([&](thread &t) {
+		if (t.get_tcb() == &leader || t.state() != thread_states::runnable) {
+			return;
+		}
+
+		schedulable_entity &e = t;
+		core *c = __atomic_load_n(&e.owning_core_, __ATOMIC_ACQUIRE);
+		if (c && c != &leader_core) {
+			cores |= 1ull << c->id();
+		}
+	});
+
+	auto &cm = core_manager::get();
+	while (cores) {
+		int id = __builtin_ctzll(cores);
+		cores &= cores - 1;
+
+		core *c = cm.try_get_core(id);
+		if (c) {
+			c->co_schedule(leader.gang, until);
+		}
+	}
+}
+
+core &scheduler::select_core(u64 affinity)
+{
+	auto &cm = core_manager::get();
+
+	// Place new entities on the least loaded running core.  The scan starts from a different core each
+	// time, so that ties are spread out rather than all landing on the lowest numbered core.  Before the
+	// application processors have been started, everything lands on the boot core.
+	int start = (int)(next_core_++ % core_manager::max_cores);
+
+	core *least_loaded = nullptr;
+	unsigned int least_load = 0;
+
+	for (int i = 0; i < core_manager::max_cores; i++) {
+		int id = (start + i) % core_manager::max_cores;
+		if (affinity ? !(affinity & (1ull << id)) : cm.is_isolated(id)) {
+			continue;
+		}
+
+		core *c = cm.try_get_core(id);
+		if (!is_running(c)) {
+			continue;
+		}
+
+		unsigned int load = c->nr_runnable();
+		if (!least_loaded || load < least_load) {
+			least_loaded = c;
+			least_load = load;
+		}
+	}
+
+	return least_loaded ? *least_loaded : cm.get_boot_core();
+}
@@ -10,6 +10,7 @@
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/sched/sleeper.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/kernel/sched/timer-queue.h>
 
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::arch::x86;
@@ -19,37 +20,44 @@ void sleeper::sleep_ms(u64 duration_ms)
 	auto &tsc = x86_core::this_core().local_tsc();
 	u64 ref_time = tsc.read();
 
-	do_sleep(ref_time + ((duration_ms * tsc.frequency()) / 1000));
+	sleep_until(ref_time + ((duration_ms * tsc.frequency()) / 1000));
 }
 
-void sleeper::do_sleep(u64 wakeup_deadline)
+void sleeper::sleep_until(u64 wakeup_deadline)
 {
+	if (wakeup_deadline <= x86_core::this_core().local_tsc().read()) {
+		return;
+	}
+
 	thread *ct = &thread::current();
-	ct->suspend();
 
-	sleeping_thread *st = new sleeping_thread { ct, wakeup_deadline };
-	sleeping_.append(st);
+	// The timer lives on this thread's stack, which stays put while the thread is asleep.
+	timer_event wakeup_timer(wakeup_deadline, wakeup, ct);
+
+	{
+		// Interrupts must stay off between suspending the thread and arming the timer.  Otherwise, a tick
+		// could switch away from this thread before the timer exists, and it would never be woken.
+		unique_irq_lock l(sleeping_lock_);
+
+		ct->suspend();
+		timer_queue::get().add(wakeup_timer);
+	}
 
 	// dprintf("sleeper: sleeping %p deadline=%lu\n", ct, wakeup_deadline);
 
-	asm volatile("int $0xff");
+	x86_core::this_core().reschedule();
 }
 
-void sleeper::check_wakeup()
+void sleeper::wakeup(void *arg)
 {
-	u64 ref_time = x86_core::this_core().local_tsc().read();
-
-	// TODO: some kind of priority queue
-	list<sleeping_thread *> resumed;
-	for (auto sleeping : sleeping_) {
-		if (ref_time > sleeping->wakeup_deadline) {
-			// dprintf("sleeper: waking %p\n", sleeping->thr);
-			sleeping->thr->resume();
-			resumed.append(sleeping);
-		}
-	}
+	// dprintf("sleeper: waking %p\n", arg);
+	((thread *)arg)->resume();
+}
 
-	for (auto resume : resumed) {
-		sleeping_.remove(resume);
-	}
+void sleeper::check_wakeup() { timer_queue::get().run_expired(x86_core::this_core().local_tsc().read()); }
+
+bool sleeper::wakeup_due()
+{
+	u64 deadline = timer_queue::get().next_deadline();
+	return deadline && deadline <= x86_core::this_core().local_tsc().read();
 }
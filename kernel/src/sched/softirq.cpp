@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/process-manager.h>
+#include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/scheduler.h>
+#include <stacsos/kernel/sched/softirq.h>
+#include <stacsos/kernel/sched/thread.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::arch;
+
+softirq::softirq()
+{
+	for (auto &c : cores_) {
+		c.pending = 0;
+		c.started = false;
+		c.tasklets = nullptr;
+
+		for (auto &count : c.counts) {
+			count = 0;
+		}
+	}
+
+	for (auto &handler : handlers_) {
+		handler = nullptr;
+	}
+
+	handlers_[(u32)softirq_vector::tasklet] = [] { softirq::get().run_tasklets(); };
+}
+
+void softirq::register_handler(softirq_vector vector, softirq_fn fn) { handlers_[(u32)vector] = fn; }
+
+void softirq::raise(softirq_vector vector)
+{
+	per_core &c = cores_[core::this_core_id()];
+	u32 bit = 1u << (u32)vector;
+
+	if (!__atomic_load_n(&c.started, __ATOMIC_ACQUIRE)) {
+		run(c, bit);
+		return;
+	}
+
+	// The thread takes everything that is pending at once, so it only needs waking by the first raise since then.
+	if (!__atomic_fetch_or(&c.pending, bit, __ATOMIC_RELEASE)) {
+		c.wakeup.trigger();
+	}
+}
+
+bool softirq::is_pending(softirq_vector vector) const
+{
+	return __atomic_load_n(&cores_[core::this_core_id()].pending, __ATOMIC_RELAXED) & (1u << (u32)vector);
+}
+
+void softirq::schedule(tasklet &t)
+{
+	if (__atomic_exchange_n(&t.queued, true, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	// Each core's list is only added to by the core itself, with interrupts disabled, so the bottom-half thread (which
+	// takes the whole list at once) can't see it half done.
+	per_core &c = cores_[core::this_core_id()];
+	t.next = c.tasklets;
+	__atomic_store_n(&c.tasklets, &t, __ATOMIC_RELEASE);
+
+	raise(softirq_vector::tasklet);
+}
+
+void softirq::run(per_core &c, u32 pending)
+{
+	for (u32 vector = 0; vector < nr_vectors; vector++) {
+		if (!(pending & (1u << vector))) {
+			continue;
+		}
+
+		__atomic_store_n(&c.counts[vector], c.counts[vector] + 1, __ATOMIC_RELAXED);
+
+		if (handlers_[vector]) {
+			handlers_[vector]();
+		}
+	}
+}
+
+void softirq::run_tasklets()
+{
+	tasklet *list = __atomic_exchange_n(&cores_[core::this_core_id()].tasklets, nullptr, __ATOMIC_ACQUIRE);
+
+	// Run them in the order they were scheduled.
+	tasklet *ordered = nullptr;
+	while (list) {
+		tasklet *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	while (ordered) {
+		tasklet *t = ordered;
+		ordered = t->next;
+
+		// The tasklet may be scheduled again as soon as it starts running, or freed by its function.
+		__atomic_store_n(&t->queued, false, __ATOMIC_RELEASE);
+		t->fn(t->arg);
+	}
+}
+
+void softirq::thread_proc(void *arg)
+{
+	per_core &c = *(per_core *)arg;
+
+	// The thread is pinned to its core, and the core only raises with interrupts disabled, so from here on every
+	// raise on this core is left to this thread.
+	__atomic_store_n(&c.started, true, __ATOMIC_RELEASE);
+
+	while (true) {
+		c.wakeup.wait();
+
+		u32 pending;
+		while ((pending = __atomic_exchange_n(&c.pending, 0, __ATOMIC_ACQUIRE)) != 0) {
+			softirq::get().run(c, pending);
+		}
+	}
+}
+
+void softirq::start_threads()
+{
+	for (auto *c : core_manager::get().cores()) {
+		if (c->status() != core_status::online && c->status() != core_status::bootstrap) {
+			continue;
+		}
+
+		auto t = process_manager::get().kernel_process()->create_thread((u64)thread_proc, &cores_[c->id()]);
+		scheduler::get().set_affinity(*t, 1ull << c->id());
+		scheduler::get().set_priority(*t, sched_policy::fifo, thread_priority);
+		t->start();
+	}
+}
@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/tlb.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page.h>
+#include <stacsos/kernel/sched/schedulable-entity.h>
+#include <stacsos/kernel/sched/stack-pool.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::mem;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::arch::x86;
+
+// Each slot is twice the size of a stack, so everything below the stack is a guard.
+static const u64 slot_size = thread::stack_size * 2;
+static const u64 nr_stack_pages = thread::stack_size >> PAGE_BITS;
+
+static u64 slot_address(u64 slot) { return memory_manager::kernel_stack_area + (slot * slot_size); }
+static u64 slot_of(void *stack) { return ((u64)stack - memory_manager::kernel_stack_area) / slot_size; }
+
+bool stack_pool::is_guard_address(u64 address)
+{
+	if (address < memory_manager::kernel_stack_area || address >= slot_address(max_slots)) {
+		return false;
+	}
+
+	return ((address - memory_manager::kernel_stack_area) % slot_size) < slot_size - thread::stack_size;
+}
+
+stack_pool::per_core_pool &stack_pool::this_core_pool() { return pools_[core::this_core_id()]; }
+
+void *stack_pool::allocate()
+{
+	auto &pool = this_core_pool();
+
+	void *stack = nullptr;
+	bool needs_zeroing = false;
+
+	{
+		unique_irq_lock l(pool.lock);
+		reap(pool);
+
+		if (!pool.clean.empty()) {
+			stack = pool.clean.dequeue();
+		} else if (!pool.dirty.empty()) {
+			stack = pool.dirty.dequeue();
+			needs_zeroing = true;
+		}
+	}
+
+	if (!stack) {
+		return map_stack();
+	}
+
+	// The idle thread hasn't got to this one yet, so it has to be cleared now.
+	if (needs_zeroing) {
+		memops::bzero(stack, thread::stack_size);
+	}
+
+	return stack;
+}
+
+void stack_pool::release(void *stack, const tcb *owner)
+{
+	auto &pool = this_core_pool();
+
+	unique_irq_lock l(pool.lock);
+	pool.released.append({ stack, owner });
+}
+
+void stack_pool::forget(const tcb *owner)
+{
+	// The thread may have released its stack on any core.
+	for (auto &pool : pools_) {
+		unique_irq_lock l(pool.lock);
+
+		unsigned int count = pool.released.count();
+		for (unsigned int i = 0; i < count; i++) {
+			released_stack r = pool.released.dequeue();
+
+			if (r.owner == owner) {
+				recycle(pool, r.stack);
+			} else {
+				pool.released.append(r);
+			}
+		}
+	}
+}
+
+bool stack_pool::zero_one()
+{
+	auto &pool = this_core_pool();
+	void *stack;
+
+	{
+		unique_irq_lock l(pool.lock);
+		reap(pool);
+
+		if (pool.dirty.empty()) {
+			return false;
+		}
+
+		stack = pool.dirty.dequeue();
+	}
+
+	// The stack belongs to no one while it's being cleared, so the lock isn't needed.
+	memops::bzero(stack, thread::stack_size);
+
+	unique_irq_lock l(pool.lock);
+	pool.clean.append(stack);
+
+	return true;
+}
+
+void stack_pool::reap(per_core_pool &pool)
+{
+	// A thread's stack is in use until it has been switched out, which is when its on_cpu flag is cleared.  Since the
+	// thread has terminated, it is never switched back in again.
+	unsigned int count = pool.released.count();
+	for (unsigned int i = 0; i < count; i++) {
+		released_stack r = pool.released.dequeue();
+
+		if (__atomic_load_n(&r.owner->on_cpu, __ATOMIC_ACQUIRE)) {
+			pool.released.append(r);
+		} else {
+			recycle(pool, r.stack);
+		}
+	}
+}
+
+void stack_pool::recycle(per_core_pool &pool, void *stack)
+{
+	if (pool.dirty.count() + pool.clean.count() < max_cached) {
+		pool.dirty.append(stack);
+	} else {
+		unmap_stack(stack);
+	}
+}
+
+/**
+ * @brief Finds a free slot, and maps zeroed pages at the top of it.
+ */
+void *stack_pool::map_stack()
+{
+	auto &pga = memory_manager::get().pgalloc();
+	page *pages[nr_stack_pages];
+
+	for (u64 i = 0; i < nr_stack_pages; i++) {
+		pages[i] = pga.allocate_pages(0, page_allocation_flags::zero);
+
+		if (!pages[i]) {
+			while (i) {
+				pga.free_pages(*pages[--i], 0);
+			}
+
+			return nullptr;
+		}
+	}
+
+	unique_irq_lock l(area_lock_);
+
+	u64 slot = used_slots_.find_first_zero();
+	if (slot >= max_slots) {
+		l.unlock();
+
+		for (page *pg : pages) {
+			pga.free_pages(*pg, 0);
+		}
+
+		return nullptr;
+	}
+
+	used_slots_[slot] = true;
+
+	// The stack is only ever reached through these mappings, which are global, as kernel stacks are used in every
+	// address space.
+	auto &pta = memory_manager::get().ptalloc();
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	u64 stack = slot_address(slot) + (slot_size - thread::stack_size);
+	for (u64 i = 0; i < nr_stack_pages; i++) {
+		v.map(pta, stack + (i << PAGE_BITS), pages[i]->base_address(), mapping_flags::present | mapping_flags::writable | mapping_flags::global);
+	}
+
+	return (void *)stack;
+}
+
+/**
+ * @brief Unmaps a stack, and gives its pages back to the page allocator.  The slot is only reused once no core can
+ * still hold a translation for it.
+ */
+void stack_pool::unmap_stack(void *stack)
+{
+	auto &pta = memory_manager::get().ptalloc();
+	page_table &v = memory_manager::get().root_address_space().pgtable();
+
+	tlb_batch *batch = tlb_batch::create_kernel();
+
+	{
+		unique_irq_lock l(area_lock_);
+
+		for (u64 i = 0; i < nr_stack_pages; i++) {
+			u64 va = (u64)stack + (i << PAGE_BITS);
+
+			batch->free_after(page::get_from_base_address(v.get_mapping(va).address), 0);
+			v.unmap(pta, va, batch);
+		}
+	}
+
+	// The batch may complete (and free the slot) as soon as it is submitted, so the lock must not be held.
+	batch->call_after(free_slot, stack);
+	batch->submit();
+}
+
+void stack_pool::free_slot(void *stack)
+{
+	auto &pool = stack_pool::get();
+
+	unique_irq_lock l(pool.area_lock_);
+	pool.used_slots_[slot_of(stack)] = false;
+}
@@ -5,49 +5,92 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core-manager.h>
 #include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/arch/x86/fpu.h>
+#include <stacsos/kernel/arch/x86/pmu.h>
 #include <stacsos/kernel/mem/memory-manager.h>
 #include <stacsos/kernel/mem/page.h>
 #include <stacsos/kernel/sched/process.h>
+#include <stacsos/kernel/sched/sched-trace.h>
 #include <stacsos/kernel/sched/scheduler.h>
+#include <stacsos/kernel/sched/stack-pool.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/atomic.h>
 #include <stacsos/memops.h>
 
 using namespace stacsos::kernel::sched;
 using namespace stacsos::kernel::mem;
 using stacsos::kernel::arch::x86::machine_context;
 
-thread::thread(process &owner, u64 ep, void *ep_arg, u64 user_stack)
+static stacsos::atomic_u64 next_thread_id(0);
+
+thread::thread(process &owner, u64 ep, void *ep_arg, u64 user_stack, bool kernel_mode)
 	: owner_(owner)
+	, id_(next_thread_id++)
 	, ep_(ep)
 	, arg_(ep_arg)
 	, state_(thread_states::created)
 	, kernel_stack_(nullptr)
 	, user_stack_(user_stack)
+	, kernel_mode_(kernel_mode || owner.privilege() == exec_privilege::kernel)
+	, charged_(false)
+	, pi_blocked_on_(nullptr)
+	, pi_exited_(false)
 {
 	init_tcb();
 	change_state(thread_states::created);
 }
 
-thread &thread::current()
-{
-	auto current_tcb = stacsos::kernel::arch::core::this_core().get_current_tcb();
-	assert(current_tcb != nullptr);
-
-	return *(thread *)(current_tcb->entity);
-}
-
 bool thread::is_self() const { return &thread::current() == this; }
 
 void thread::start() { change_state(thread_states::runnable); }
 void thread::stop()
 {
+	bool self = is_self();
+
+	pi_manager::get().thread_stopping(*this);
 	change_state(thread_states::terminated);
+
+	// A thread stopping itself is never scheduled again once it has switched out, so its stacks can be reused.  A
+	// thread stopped by another could still be running on some other core for a moment, so its stacks are kept.
+	if (self) {
+		stack_pool::get().release(kernel_stack_, &tcb_);
+		kernel_stack_ = nullptr;
+
+		if (user_stack_) {
+			owner_.release_user_stack(user_stack_);
+			user_stack_ = 0;
+		}
+	}
+
 	owner_.on_thread_stopped(*this);
 }
 void thread::suspend() { change_state(thread_states::suspended); }
 void thread::resume() { change_state(thread_states::runnable); }
 
+void thread::reclaim()
+{
+	if (kernel_stack_) {
+		stack_pool::get().release(kernel_stack_, &tcb_);
+		kernel_stack_ = nullptr;
+	}
+
+	stack_pool::get().forget(&tcb_);
+
+	for (auto *c : core_manager::get().cores()) {
+		c->forget_task(tcb_);
+	}
+
+	if (tcb_.fpu_state) {
+		arch::x86::fpu::destroy_state(tcb_.fpu_state);
+		tcb_.fpu_state = nullptr;
+	}
+
+	delete (arch::x86::pmu_thread_counters *)tcb_.perf_state;
+	tcb_.perf_state = nullptr;
+}
+
 void thread::task_entry_trampoline(thread *thread)
 {
 	// If there is an entry point, then run it and stop the task once it has completed.
@@ -55,6 +98,9 @@ void thread::task_entry_trampoline(thread *thread)
 		auto epfn = (void (*)(void *))thread->ep_;
 		epfn(thread->arg_);
 		thread->stop();
+
+		// The thread is no longer on a run queue, so this never returns.
+		stacsos::kernel::arch::core::this_core().reschedule();
 	}
 
 	// If there is no entry point (i.e. this is an IDLE task), or the task has signalled
@@ -64,20 +110,21 @@ void thread::task_entry_trampoline(thread *thread)
 
 void thread::init_tcb()
 {
-	// Allocate an 8k stack.
-	kernel_stack_ = memory_manager::get().pgalloc().allocate_pages(stack_size_order, page_allocation_flags::zero);
+	// Take a stack from this core's pool of recycled ones, if there are any.
+	kernel_stack_ = stack_pool::get().allocate();
 
 	// Set the pointer to the task object in the task control block, and pop the initial
 	// machine context into the stack.
 	tcb_.entity = this;
-	tcb_.mcontext = (machine_context *)(((uintptr_t)kernel_stack_->base_address_ptr() + stack_size) - sizeof(machine_context));
-	tcb_.cr3 = owner_.addrspace().pgtable().effective_cr3();
-	tcb_.kernel_stack = (u64)kernel_stack_->base_address_ptr() + stack_size;
+	tcb_.mcontext = (machine_context *)(((uintptr_t)kernel_stack_ + stack_size) - sizeof(machine_context));
+	tcb_.cr3 = owner_.addrspace().cr3();
+	tcb_.active_cores = owner_.addrspace().active_cores();
+	tcb_.kernel_stack = (u64)kernel_stack_ + stack_size;
 	tcb_.user_stack_save = 0;
 
 	// Fill in the required values for starting this task in the initial context.
 
-	if (owner_.privilege() == exec_privilege::kernel) {
+	if (kernel_mode_) {
 		tcb_.mcontext->cs = KERNEL_CODE_SEGMENT_SELECTOR;
 		tcb_.mcontext->ss = KERNEL_DATA_SEGMENT_SELECTOR;
 	} else {
@@ -87,7 +134,7 @@ void thread::init_tcb()
 
 	tcb_.mcontext->rflags = 0x202; // RSVD | IF
 
-	if (owner_.privilege() == exec_privilege::kernel) {
+	if (kernel_mode_) {
 		tcb_.mcontext->rip = (u64)task_entry_trampoline; // The actual entry point for a kernel task is the
 														 // trampoline.  This is so that tasks entry points can return, and
 														 // they won't return into "nothing", instead we'll take control back
@@ -96,7 +143,7 @@ void thread::init_tcb()
 		tcb_.mcontext->rdi = (u64)this; // The first argument to the trampoline is a pointer to this task object.
 
 		// The stack pointer needs to point to the allocated stack.
-		tcb_.mcontext->rsp = (u64)((uintptr_t)kernel_stack_->base_address_ptr() + stack_size);
+		tcb_.mcontext->rsp = (u64)((uintptr_t)kernel_stack_ + stack_size);
 
 		// The GS register needs to point to the TCB, so that the kernel thread can manipulate itself.
 		tcb_.mcontext->gs = (u64)&tcb_;
@@ -104,84 +151,110 @@ void thread::init_tcb()
 		tcb_.mcontext->rip = ep_;
 		tcb_.mcontext->rdi = (u64)arg_;
 		tcb_.mcontext->rsp = user_stack_;
+
+		// Only user threads can use floating-point and SIMD registers.
+		tcb_.fpu_state = arch::x86::fpu::create_state();
 	}
 }
 
 void thread::change_state(thread_states new_state)
 {
-	// Ignore threads whose state isn't actually changing (unless the state
-	// is "created")
-	if (state_ == new_state && state_ != thread_states::created) {
-		return;
-	}
+	{
+		// Threads can be woken up from any core, so the state transition (and the
+		// corresponding run queue update) must happen atomically.
+		unique_irq_lock l(state_lock_);
 
-	switch (new_state) {
-	case thread_states::created: // thread is newly created
-		switch (state_) {
-		case thread_states::created:
-			state_ = new_state;
+		// Ignore threads whose state isn't actually changing (unless the state
+		// is "created")
+		if (state_ == new_state && state_ != thread_states::created) {
+			return;
+		}
+
+		switch (new_state) {
+		case thread_states::created: // thread is newly created
+			switch (state_) {
+			case thread_states::created:
+				state_ = new_state;
+				break;
+
+			default:
+				panic("illegal thread state change");
+			}
 			break;
 
-		default:
-			panic("illegal thread state change");
-		}
-		break;
-
-	case thread_states::runnable: // thread is becoming runnable
-		switch (state_) {
-		case thread_states::created:
-		case thread_states::running:
-		case thread_states::suspended:
-			state_ = new_state;
-			scheduler::get().add_to_schedule(*this);
+		case thread_states::runnable: // thread is becoming runnable
+			switch (state_) {
+			case thread_states::created:
+			case thread_states::running:
+			case thread_states::suspended:
+				state_ = new_state;
+				sched_trace::get().record_wakeup(tcb_);
+				scheduler::get().add_to_schedule(*this);
+				break;
+
+			default:
+				panic("illegal thread state change");
+			}
 			break;
 
-		default:
-			panic("illegal thread state change");
-		}
-		break;
+		case thread_states::running: // thread is running on a core
+			switch (state_) {
+			case thread_states::runnable:
+				state_ = new_state;
+				break;
 
-	case thread_states::running: // thread is running on a core
-		switch (state_) {
-		case thread_states::runnable:
-			state_ = new_state;
+			default:
+				panic("illegal thread state change");
+			}
 			break;
 
-		default:
-			panic("illegal thread state change");
-		}
-		break;
-
-	case thread_states::suspended: // thread is going to sleep
-		switch (state_) {
-		case thread_states::runnable:
-		case thread_states::running:
-			state_ = new_state;
-			scheduler::get().remove_from_schedule(*this);
+		case thread_states::suspended: // thread is going to sleep
+			switch (state_) {
+			case thread_states::runnable:
+			case thread_states::running:
+				state_ = new_state;
+				scheduler::get().remove_from_schedule(*this);
+				break;
+
+			default:
+				panic("illegal thread state change");
+			}
 			break;
 
-		default:
-			panic("illegal thread state change");
-		}
-		break;
-
-	case thread_states::terminated: // thread has been terminated
-		switch (state_) {
-		case thread_states::runnable:
-		case thread_states::running:
-		case thread_states::suspended:
-			state_ = new_state;
-			scheduler::get().remove_from_schedule(*this);
+		case thread_states::terminated: // thread has been terminated
+			switch (state_) {
+			case thread_states::created:
+				// The thread never ran (say because its process couldn't be started after all), so it was never
+				// scheduled.
+				state_ = new_state;
+				break;
+
+			case thread_states::runnable:
+			case thread_states::running:
+			case thread_states::suspended:
+				state_ = new_state;
+
+				// Give back any reserved share of the core for other threads to use.
+				if (tcb_.edf_period) {
+					scheduler::get().set_reservation(*this, 0, 0);
+				}
+
+				scheduler::get().remove_from_schedule(*this);
+				break;
+
+			default:
+				panic("illegal thread state change");
+			}
 			break;
 
 		default:
 			panic("illegal thread state change");
 		}
-		break;
-
-	default:
-		panic("illegal thread state change");
 	}
 
-	state_changed_event_.trigger();
+	// Nothing waits for a thread to be suspended, and skipping the wake-up means that suspending never
+	// takes another wait queue's lock (a waiter suspends itself with its wait queue locked).
+	if (new_state != thread_states::suspended) {
+		state_changed_.wake_all();
+	}
 }
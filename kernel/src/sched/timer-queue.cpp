@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/timer-queue.h>
+
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::arch;
+
+void timer_queue::add(timer_event &ev)
+{
+	bool earliest;
+
+	{
+		unique_irq_lock l(lock_);
+
+		if (ev.heap_index >= 0) {
+			panic("timer event already queued");
+		}
+
+		heap_.push_back(&ev);
+		place(heap_.size() - 1, &ev);
+		sift_up(heap_.size() - 1);
+
+		earliest = ev.heap_index == 0;
+	}
+
+	// A core only looks at the queue when it programs its timer, which it may not do again until after the new
+	// deadline.
+	if (earliest) {
+		u64 flags = irq_save();
+		core::this_core().timer_added();
+		irq_restore(flags);
+	}
+}
+
+bool timer_queue::cancel(timer_event &ev)
+{
+	unique_irq_lock l(lock_);
+
+	if (ev.heap_index < 0) {
+		return false;
+	}
+
+	remove_at(ev.heap_index);
+	return true;
+}
+
+void timer_queue::run_expired(u64 now)
+{
+	while (true) {
+		timer_event *ev;
+
+		{
+			unique_irq_lock l(lock_);
+
+			if (heap_.empty() || heap_[0]->deadline > now) {
+				return;
+			}
+
+			ev = heap_[0];
+			remove_at(0);
+		}
+
+		ev->fn(ev->arg);
+	}
+}
+
+u64 timer_queue::next_deadline()
+{
+	unique_irq_lock l(lock_);
+	return heap_.empty() ? 0 : heap_[0]->deadline;
+}
+
+void timer_queue::sift_up(size_t index)
+{
+	timer_event *ev = heap_[index];
+
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (heap_[parent]->deadline <= ev->deadline) {
+			break;
+		}
+
+		place(index, heap_[parent]);
+		index = parent;
+	}
+
+	place(index, ev);
+}
+
+void timer_queue::sift_down(size_t index)
+{
+	timer_event *ev = heap_[index];
+
+	while (true) {
+		size_t child = (index * 2) + 1;
+		if (child >= heap_.size()) {
+			break;
+		}
+
+		if (child + 1 < heap_.size() && heap_[child + 1]->deadline < heap_[child]->deadline) {
+			child++;
+		}
+
+		if (ev->deadline <= heap_[child]->deadline) {
+			break;
+		}
+
+		place(index, heap_[child]);
+		index = child;
+	}
+
+	place(index, ev);
+}
+
+void timer_queue::remove_at(size_t index)
+{
+	timer_event *ev = heap_[index];
+	ev->heap_index = -1;
+
+	timer_event *last = heap_.back();
+	heap_.pop_back();
+
+	if (index == heap_.size()) {
+		return;
+	}
+
+	// Move the last timer into the hole, and restore the heap property in whichever direction is needed.
+	place(index, last);
+
+	if (index > 0 && heap_[(index - 1) / 2]->deadline > heap_[index]->deadline) {
+		sift_up(index);
+	} else {
+		sift_down(index);
+	}
+}
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/debug.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/kernel/sched/wait-queue.h>
+#include <stacsos/kernel/sched/wait-set.h>
+
+using namespace stacsos::kernel::sched;
+
+void wait_queue::enqueue_current()
+{
+	// Called with the lock held.
+	thread *ct = &thread::current();
+
+	ct->suspend();
+	waiters_.append(*ct->get_tcb());
+}
+
+void wait_queue::reschedule() { stacsos::kernel::arch::core::this_core().reschedule(); }
+
+void wait_queue::resume(thread *waiter) { waiter->resume(); }
+
+void wait_queue::resume(tcb &waiter) { static_cast<thread *>(waiter.entity)->resume(); }
+
+void wait_queue::resume_all(waiter_list &woken)
+{
+	// Each waiter is unlinked before it is resumed, as it may wait on another queue as soon as it runs.
+	while (tcb *waiter = woken.dequeue()) {
+		resume(*waiter);
+	}
+}
+
+bool wait_queue::wake_one()
+{
+	tcb *waiter;
+	watcher_list watchers;
+
+	{
+		unique_irq_lock l(lock_);
+
+		waiter = waiters_.dequeue();
+		signal_watchers(watchers);
+	}
+
+	// The waiter was suspended before it was queued, so it is safe to resume it without the lock.  Doing so
+	// means the queue lock is never held while another thread's state is being changed.
+	if (waiter) {
+		resume(*waiter);
+	}
+
+	for (auto watcher : watchers) {
+		watcher->resume();
+	}
+
+	return waiter != nullptr;
+}
+
+unsigned int wait_queue::wake_all()
+{
+	waiter_list woken;
+	watcher_list watchers;
+
+	{
+		unique_irq_lock l(lock_);
+
+		woken.splice(waiters_);
+		signal_watchers(watchers);
+	}
+
+	unsigned int nr_woken = woken.count();
+	resume_all(woken);
+
+	for (auto watcher : watchers) {
+		watcher->resume();
+	}
+
+	return nr_woken;
+}
+
+void wait_queue::signal_watchers_slow(vector<thread *> &to_resume)
+{
+	// A set only hands back its thread once, so a thread watching several queues is never resumed twice.
+	for (auto e : watchers_) {
+		thread *t = e->set->signal();
+		if (t) {
+			to_resume.push_back(t);
+		}
+	}
+}
+
+void wait_queue::add_watcher(wait_set_entry *e)
+{
+	unique_irq_lock l(lock_);
+	watchers_.push_back(e);
+}
+
+void wait_queue::remove_watcher(wait_set_entry *e)
+{
+	unique_irq_lock l(lock_);
+
+	// The order of the watchers doesn't matter, so the last one is moved into the gap.
+	for (size_t i = 0; i < watchers_.size(); i++) {
+		if (watchers_[i] == e) {
+			watchers_[i] = watchers_.back();
+			watchers_.pop_back();
+			break;
+		}
+	}
+}
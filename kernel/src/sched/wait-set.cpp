@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/x86/x86-core.h>
+#include <stacsos/kernel/sched/thread.h>
+#include <stacsos/kernel/sched/timer-queue.h>
+#include <stacsos/kernel/sched/wait-queue.h>
+#include <stacsos/kernel/sched/wait-set.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel::sched;
+using namespace stacsos::kernel::arch::x86;
+
+wait_set::~wait_set()
+{
+	// Once an entry is off its queue, no waker can reach the set through it.
+	while (!entries_.empty()) {
+		wait_set_entry *e = entries_.dequeue();
+		e->queue->remove_watcher(e);
+
+		delete e;
+	}
+}
+
+void wait_set::add(wait_queue &q)
+{
+	wait_set_entry *e = new wait_set_entry { this, &q };
+
+	entries_.append(e);
+	q.add_watcher(e);
+}
+
+thread *wait_set::signal()
+{
+	unique_irq_lock l(lock_);
+
+	signalled_ = true;
+
+	thread *t = sleeper_;
+	sleeper_ = nullptr;
+
+	return t;
+}
+
+bool wait_set::wait(u64 deadline)
+{
+	timer_event timeout(deadline, timeout_expired, this);
+
+	{
+		unique_irq_lock l(lock_);
+
+		if (signalled_) {
+			signalled_ = false;
+			return true;
+		}
+
+		if (deadline && x86_core::this_core().local_tsc().read() >= deadline) {
+			return false;
+		}
+
+		// As with a wait queue, the thread is suspended before the lock is dropped, so a signal that arrives
+		// before it has actually stopped running still resumes it.
+		thread *ct = &thread::current();
+		ct->suspend();
+		sleeper_ = ct;
+
+		if (deadline) {
+			timer_done_ = false;
+			timer_queue::get().add(timeout);
+		}
+	}
+
+	x86_core::this_core().reschedule();
+
+	// If the timer can't be cancelled, it has already been taken off the queue to fire, and its callback may still
+	// be using the set.
+	if (deadline && !timer_queue::get().cancel(timeout)) {
+		while (!__atomic_load_n(&timer_done_, __ATOMIC_ACQUIRE)) {
+			__relax();
+		}
+	}
+
+	unique_irq_lock l(lock_);
+
+	bool signalled = signalled_;
+	signalled_ = false;
+
+	return signalled;
+}
+
+void wait_set::timeout_expired(void *arg)
+{
+	wait_set *ws = (wait_set *)arg;
+	thread *t;
+
+	{
+		unique_irq_lock l(ws->lock_);
+
+		t = ws->sleeper_;
+		ws->sleeper_ = nullptr;
+	}
+
+	// After this, the waiter may return, and the set may disappear.
+	__atomic_store_n(&ws->timer_done_, true, __ATOMIC_RELEASE);
+
+	if (t) {
+		t->resume();
+	}
+}
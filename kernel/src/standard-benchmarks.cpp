@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/benchmarks.h>
+#include <stacsos/kernel/lock.h>
+#include <stacsos/kernel/mem/memory-manager.h>
+#include <stacsos/kernel/mem/page-allocator.h>
+#include <stacsos/kernel/mem/page-table-allocator.h>
+#include <stacsos/kernel/mem/page-table.h>
+#include <stacsos/avl-tree.h>
+#include <stacsos/intrusive-list.h>
+#include <stacsos/list.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::mem;
+
+// The benchmarks of the kernel's own hot paths.  Each is named after what it measures, so that a group of them can be
+// picked out with a wildcard, e.g. bench=pgalloc_*.
+
+KERNEL_BENCHMARK(pgalloc_order0)
+{
+	auto &pga = memory_manager::get().pgalloc();
+
+	for (u64 i = 0; i < iterations; i++) {
+		page *pg = pga.allocate_pages(0);
+		benchmarks::keep(pg);
+		pga.free_pages(*pg, 0);
+	}
+}
+
+KERNEL_BENCHMARK(pgalloc_order3)
+{
+	auto &pga = memory_manager::get().pgalloc();
+
+	for (u64 i = 0; i < iterations; i++) {
+		page *pg = pga.allocate_pages(3);
+		benchmarks::keep(pg);
+		pga.free_pages(*pg, 3);
+	}
+}
+
+KERNEL_BENCHMARK(objalloc_64)
+{
+	for (u64 i = 0; i < iterations; i++) {
+		void *obj = ::operator new(64);
+		benchmarks::keep(obj);
+		::operator delete(obj);
+	}
+}
+
+KERNEL_BENCHMARK(objalloc_512)
+{
+	for (u64 i = 0; i < iterations; i++) {
+		void *obj = ::operator new(512);
+		benchmarks::keep(obj);
+		::operator delete(obj);
+	}
+}
+
+KERNEL_BENCHMARK(page_table_map)
+{
+	auto &pta = memory_manager::get().ptalloc();
+
+	// The mappings go into the user half of a copy of the current page table, which is never made active, so nothing
+	// needs invalidating.  The tables the first mapping needs are kept, so that only setting and clearing the entry
+	// is timed.
+	static page_table *scratch = page_table::current()->create_linked_copy(pta);
+	const u64 address = 0x100000000;
+
+	for (u64 i = 0; i < iterations; i++) {
+		scratch->map(pta, address, 0, arch::x86::mapping_flags::present | arch::x86::mapping_flags::writable);
+		scratch->unmap(pta, address);
+	}
+}
+
+KERNEL_BENCHMARK(list_push_pop)
+{
+	list<u64> l;
+
+	for (u64 i = 0; i < iterations; i++) {
+		l.push(i);
+		benchmarks::keep(l.pop());
+	}
+}
+
+namespace {
+struct benchmark_item {
+	list_hook link;
+};
+} // namespace
+
+KERNEL_BENCHMARK(intrusive_list_append_remove)
+{
+	intrusive_list<benchmark_item, &benchmark_item::link> l;
+	benchmark_item item;
+
+	for (u64 i = 0; i < iterations; i++) {
+		l.append(item);
+		l.remove(item);
+	}
+}
+
+KERNEL_BENCHMARK(avl_add_remove)
+{
+	// Keys are added to and removed from a tree that already holds the even keys below 2048, so that every operation
+	// goes ten levels or so down.
+	static avl_tree<u64, u64> *tree = [] {
+		auto *t = new avl_tree<u64, u64>();
+		for (u64 key = 0; key < 2048; key += 2) {
+			t->add(key, key);
+		}
+
+		return t;
+	}();
+
+	for (u64 i = 0; i < iterations; i++) {
+		u64 key = ((i * 2) + 1) & 2047;
+
+		tree->add(key, key);
+		tree->remove(key);
+	}
+}
+
+KERNEL_BENCHMARK(spinlock)
+{
+	static spinlock lock;
+
+	for (u64 i = 0; i < iterations; i++) {
+		lock.lock();
+		lock.unlock();
+	}
+}
+
+KERNEL_BENCHMARK(spinlock_irq)
+{
+	static spinlock_irq lock;
+
+	for (u64 i = 0; i < iterations; i++) {
+		unique_irq_lock l(lock);
+	}
+}
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/syscall-stats.h>
+#include <stacsos/memops.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+
+// Indexed by system call number, so this has to be kept in step with syscall_numbers.
+static const char *syscall_names[] = { "exit", "open", "close", "read", "pread", "write", "pwrite", "set_fs", "set_gs", "alloc_mem",
+	"start_process", "wait_for_process", "start_thread", "stop_current_thread", "join_thread", "sleep", "poweroff", "ioctl", "readdir",
+	"yield", "futex_wait", "futex_wake", "set_affinity", "set_priority", "get_cpu_stats", "set_reservation", "start_threads", "mmap",
+	"munmap", "msync", "fsync", "truncate", "io_ring_setup", "io_ring_enter", "readv", "preadv", "writev", "pwritev", "wait_many",
+	"create_pipe", "shm_create", "copy_object", "spawn", "set_resource_limit", "get_size", "set_gang_scheduling",
+	"futex_lock_pi", "futex_unlock_pi", "sleep_until", "create_timer", "clone_process", "zygote_ready", "advise",
+	"advise_memory" };
+
+static const unsigned int nr_syscall_names = sizeof(syscall_names) / sizeof(syscall_names[0]);
+
+void syscall_stats::record_slow(unsigned int index, u64 cycles)
+{
+	// The thread may be preempted by another making a system call on the same core, so the updates are atomic, but
+	// as nothing else touches this core's counters, they are uncontended.
+	per_core_stats &s = cores_.get();
+	unsigned int slot = min(index, max_syscalls - 1);
+	unsigned int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+
+	__atomic_fetch_add(&s.calls[slot], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s.cycles[slot], cycles, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s.latency[slot][min(bucket, latency_buckets - 1)], 1, __ATOMIC_RELAXED);
+}
+
+void syscall_stats::reset()
+{
+	// A call that is being recorded at the same time may survive the reset, which doesn't matter.
+	memops::memset(&cores_, 0, sizeof(cores_));
+}
+
+size_t syscall_stats::render(char *buffer, size_t size)
+{
+	size_t n = 0;
+
+#define EMIT(...)                                                                                                                                              \
+	do {                                                                                                                                                       \
+		if (n < size) {                                                                                                                                        \
+			int r = snprintf(buffer + n, (int)(size - n), __VA_ARGS__);                                                                                        \
+			n = min(n + (r > 0 ? (size_t)r : 0), size);                                                                                                        \
+		}                                                                                                                                                      \
+	} while (0)
+
+	u64 cycles_per_us = max(core::this_core().timestamp_frequency() / 1000000, 1ull);
+	u64 filter = __atomic_load_n(&filter_process_, __ATOMIC_RELAXED);
+
+	if (filter) {
+		EMIT("process %llu, tsc at %llu MHz\n", filter, cycles_per_us);
+	} else {
+		EMIT("all processes, tsc at %llu MHz\n", cycles_per_us);
+	}
+
+	EMIT("%10s %12s %10s  %s\n", "calls", "total us", "avg ns", "syscall");
+
+	for (unsigned int i = 0; i < max_syscalls; i++) {
+		u64 calls = 0, cycles = 0;
+		for (int c = 0; c < core_manager::max_cores; c++) {
+			calls += cores_[c].calls[i];
+			cycles += cores_[c].cycles[i];
+		}
+
+		if (!calls) {
+			continue;
+		}
+
+		EMIT("%10llu %12llu %10llu  ", calls, cycles / cycles_per_us, ((cycles / calls) * 1000) / cycles_per_us);
+		if (i < nr_syscall_names) {
+			EMIT("%s\n", syscall_names[i]);
+		} else {
+			EMIT("%u\n", i);
+		}
+
+		// The latency histogram follows on one line, as bucket:count pairs.
+		EMIT("  2^n cycles:");
+		for (unsigned int b = 0; b < latency_buckets; b++) {
+			u64 total = 0;
+			for (int c = 0; c < core_manager::max_cores; c++) {
+				total += cores_[c].latency[i][b];
+			}
+
+			if (total) {
+				EMIT(" %u:%llu", b, total);
+			}
+		}
+		EMIT("\n");
+	}
+
+#undef EMIT
+
+	return n;
+}
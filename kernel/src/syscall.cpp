@@ -5,20 +5,32 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/kernel/arch/core.h>
 #include <stacsos/kernel/arch/x86/cregs.h>
 #include <stacsos/kernel/arch/x86/pio.h>
+#include <stacsos/kernel/arch/x86/x86-core.h>
 #include <stacsos/kernel/debug.h>
 #include <stacsos/kernel/fs/vfs.h>
 #include <stacsos/kernel/mem/address-space.h>
+#include <stacsos/kernel/mem/shared-memory.h>
+#include <stacsos/kernel/mem/user-access.h>
+#include <stacsos/kernel/obj/io-ring.h>
 #include <stacsos/kernel/obj/object-manager.h>
 #include <stacsos/kernel/obj/object.h>
+#include <stacsos/kernel/sched/futex.h>
 #include <stacsos/kernel/sched/process-manager.h>
 #include <stacsos/kernel/sched/process.h>
 #include <stacsos/kernel/sched/sleeper.h>
 #include <stacsos/kernel/sched/thread.h>
+#include <stacsos/kernel/sched/wait-set.h>
+#include <stacsos/kernel/syscall-stats.h>
+#include <stacsos/kernel/tracepoints.h>
+#include <stacsos/memops.h>
+#include <stacsos/process-start.h>
+#include <stacsos/resource-limits.h>
 #include <stacsos/syscalls.h>
-#include <stacsos/kernel/fs/fat.h>
-#include <stacsos/dirent.h>
+#include <stacsos/wait.h>
+#include <stacsos/cpu-stats.h>
 
 using namespace stacsos;
 using namespace stacsos::kernel;
@@ -28,11 +40,76 @@ using namespace stacsos::kernel::fs;
 using namespace stacsos::kernel::mem;
 using namespace stacsos::kernel::arch::x86;
 
-static syscall_result do_open(process &owner, const char *path)
+/**
+ * @brief The result of a call that creates an object: its handle, or limit_exceeded if the process had no more.
+ */
+static syscall_result object_result(shared_ptr<object> o)
 {
-	auto node = vfs::get().lookup(path);
-	if (node == nullptr) {
-		return syscall_result { syscall_result_code::not_found, 0 };
+	if (!o) {
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	return syscall_result { syscall_result_code::ok, o->id() };
+}
+
+static fs_node *create_file(const char *path)
+{
+	// The parent directory is everything up to the last slash.
+	int last_slash = -1;
+	for (int i = 0; path[i]; i++) {
+		if (path[i] == '/') {
+			last_slash = i;
+		}
+	}
+
+	if (last_slash < 0 || !path[last_slash + 1]) {
+		return nullptr;
+	}
+
+	char parent_path[512];
+	if (last_slash >= (int)sizeof(parent_path)) {
+		return nullptr;
+	}
+
+	memops::memcpy(parent_path, path, last_slash ? last_slash : 1);
+	parent_path[last_slash ? last_slash : 1] = 0;
+
+	fs_node *parent = vfs::get().lookup(parent_path);
+	if (!parent) {
+		return nullptr;
+	}
+
+	if (parent->kind() != fs_node_kind::directory) {
+		parent->release();
+		return nullptr;
+	}
+
+	// The new file is referenced before the directory is let go of, as, until then, the directory keeps it in memory.
+	fs_node *dir = parent->lookup("");
+	parent->release();
+
+	fs_node *node = dir->create(&path[last_slash + 1]);
+	if (node) {
+		node->acquire();
+	}
+
+	dir->release();
+	return node;
+}
+
+static syscall_result open_node(process &owner, fs_node *node, open_flags flags)
+{
+	// A directory is listed, rather than read, and what it lists is whatever is mounted on it.
+	if (node->kind() == fs_node_kind::directory) {
+		if ((flags & open_flags::truncate) == open_flags::truncate) {
+			return syscall_result { syscall_result_code::not_supported, 0 };
+		}
+
+		fs_node *dir = node->lookup("");
+		auto result = object_result(object_manager::get().create_directory_object(owner, dir));
+		dir->release();
+
+		return result;
 	}
 
 	auto file = node->open();
@@ -40,120 +117,424 @@ static syscall_result do_open(process &owner, const char *path)
 		return syscall_result { syscall_result_code::not_supported, 0 };
 	}
 
-	auto file_object = object_manager::get().create_file_object(owner, file);
-	return syscall_result { syscall_result_code::ok, file_object->id() };
+	if ((flags & open_flags::truncate) == open_flags::truncate && !file->truncate(0)) {
+		return syscall_result { syscall_result_code::not_supported, 0 };
+	}
+
+	return object_result(object_manager::get().create_file_object(owner, file, node));
 }
 
-static syscall_result operation_result_to_syscall_result(operation_result &&o)
+static syscall_result do_open(process &owner, const char *path, open_flags flags)
 {
-	syscall_result_code rc = (syscall_result_code)o.code;
-	return syscall_result { rc, o.data };
+	auto node = vfs::get().lookup(path);
+	if (node == nullptr && (flags & open_flags::create) == open_flags::create) {
+		node = create_file(path);
+	}
+
+	if (node == nullptr) {
+		return syscall_result { syscall_result_code::not_found, 0 };
+	}
+
+	// The handle takes a reference of its own to the node.
+	syscall_result result = open_node(owner, node, flags);
+	node->release();
+
+	return result;
 }
 
-/*
-* do_readdir 
-*
-* Given an absolute path do_readdir looks up the corresponding
-* directory node in the VFS, loops over its children and copies directory
-* entry information (dirent information), name, type, size, into a buffer 
-* provided by the function caller.
-*
-* Only accepts absolute paths, an empty path is treated as "/".
-* Returns the number of entries copied or an error code (not found or not supported)
-*/
-static syscall_result do_readdir(const char *path, void *user_buf, u64 max_entries)
+static syscall_result do_io_ring_setup(process &owner, io_ring_params *user_params)
 {
-	auto &caller = thread::current().owner();
-	fs_node *node = nullptr;
-
-	// Handling path, if empty its taken as the root, if an absolute path then its looked up
-	if (!path || path[0] == '\0') {
-		node = vfs::get().lookup("/");
-	} 
-	else if (path[0] == '/') {
-		node = vfs::get().lookup(path);
+	io_ring_params params;
+	if (!user_access::copy_from_user(&params, user_params, sizeof(params))) {
+		return syscall_result { syscall_result_code::bad_address, 0 };
 	}
-	else {
+
+	// The queues are indexed by masking the counters, so their length must be a power of two.
+	u32 entries = params.entries;
+	if (!entries || entries > 4096 || (entries & (entries - 1))) {
 		return syscall_result { syscall_result_code::not_supported, 0 };
 	}
 
-	if (!node) {
-		return syscall_result { syscall_result_code::not_found, 0 };
+	auto rgn = owner.addrspace().alloc_region(PAGE_ALIGN_UP(io_ring_size(entries)), region_flags::readwrite, true);
+	if (!rgn) {
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
 	}
 
-	// Node must be a directory.
-	if (node->kind() != fs_node_kind::directory) {
-		return syscall_result { syscall_result_code::not_supported, 0 };
+	params.ring_address = rgn->base;
+
+	if (!user_access::copy_to_user(user_params, &params, sizeof(params))) {
+		return syscall_result { syscall_result_code::bad_address, 0 };
 	}
 
-	auto fatnode = static_cast<fat_node*>(node);
-	if (!fatnode) {
+	auto ring_object = object_manager::get().create_io_ring_object(owner, (io_ring_header *)rgn->base, entries, params.flags);
+	if (!ring_object) {
+		owner.addrspace().remove_region(rgn->base, rgn->size, rgn->flags);
+	}
+
+	return object_result(ring_object);
+}
+
+static syscall_result do_vectored(object &o, syscall_numbers index, const iovec *user_iov, u64 count, u64 offset)
+{
+	if (count > IOV_MAX) {
 		return syscall_result { syscall_result_code::not_supported, 0 };
 	}
 
-	// Ensure directory children are loaded from disk before accessing them.
-	fatnode->ensure_loaded();
+	iovec *iov = new iovec[count];
+	if (!user_access::copy_from_user(iov, user_iov, count * sizeof(iovec))) {
+		delete[] iov;
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
 
-	u64 counter = 0; //Used to track number of entries copied so far.
+	// Reads fill the buffers in, and writes only look at them.
+	bool reading = index == syscall_numbers::readv || index == syscall_numbers::preadv;
+	for (u64 i = 0; i < count; i++) {
+		if (!(reading ? user_access::writable(iov[i].base, iov[i].length) : user_access::readable(iov[i].base, iov[i].length))) {
+			delete[] iov;
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+	}
 
-	// Iterates through directory children up to the max entries limit.
-	for (auto child : fatnode -> children()) {
-		if (counter >= max_entries) {
-			break;
+	operation_result r = operation_result::not_supported();
+
+	switch (index) {
+	case syscall_numbers::readv:
+		r = o.readv(iov, count);
+		break;
+	case syscall_numbers::preadv:
+		r = o.preadv(iov, count, offset);
+		break;
+	case syscall_numbers::writev:
+		r = o.writev(iov, count);
+		break;
+	default:
+		r = o.pwritev(iov, count, offset);
+		break;
+	}
+
+	delete[] iov;
+	return syscall_result { r.syscall_code(), r.data };
+}
+
+static syscall_result do_wait_many(process &owner, wait_entry *user_entries, u64 count, u64 timeout_ms)
+{
+	if (count > WAIT_MANY_MAX) {
+		return syscall_result { syscall_result_code::not_supported, 0 };
+	}
+
+	wait_entry *entries = new wait_entry[count];
+	if (!user_access::copy_from_user(entries, user_entries, count * sizeof(wait_entry))) {
+		delete[] entries;
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
+
+	// The objects are held until the wait is over, since the queues being watched belong to them.
+	shared_ptr<object> *objects = new shared_ptr<object>[count];
+	for (u64 i = 0; i < count; i++) {
+		shared_ptr<object> o = object_manager::get().get_object(owner, entries[i].object);
+		if (!o) {
+			delete[] objects;
+			delete[] entries;
+			return syscall_result { syscall_result_code::not_found, i };
 		}
 
-		dirent ent = {};
-		const auto &nm = child->name();
+		objects[i] = o;
+	}
+
+	u64 deadline = 0;
+	if (timeout_ms != WAIT_FOREVER) {
+		auto &tsc = x86_core::this_core().local_tsc();
+		deadline = tsc.read() + ((timeout_ms * tsc.frequency()) / 1000);
+	}
+
+	u64 ready = 0;
+
+	{
+		wait_set ws;
 
-		size_t length = nm.length();
+		// The queues are added on the first pass, before anything is looked at, so that an object that becomes ready
+		// after being found not to be still signals the set.  Any wake-up after that sends every object round again.
+		for (bool first = true;; first = false) {
+			for (u64 i = 0; i < count; i++) {
+				entries[i].ready = objects[i]->poll(first ? &ws : nullptr);
+				ready += entries[i].ready;
+			}
 
-		// Checking the length of the file name is below max file name length, and if not truncating it.
-		if (length >= MAX_FILE_NAME_LENGTH) {
-			length = MAX_FILE_NAME_LENGTH - 1; //Leaves space for a null terminating character.
+			if (ready || !ws.wait(deadline)) {
+				break;
+			}
 		}
+	}
+
+	delete[] objects;
 
-		// Copy directory name into the buffer and adds a null terminator
-		memops::memcpy(ent.name, nm.c_str(), length);
-		ent.name[length] = 0;
+	bool copied = user_access::copy_to_user(user_entries, entries, count * sizeof(wait_entry));
+	delete[] entries;
 
-		// Get file type and size
-		ent.type = (child -> kind() == fs_node_kind::directory) ? 'd' : 'f';
-		ent.size = (child -> kind() == fs_node_kind::file) ? (unsigned int)child -> size() : 0;
+	if (!copied) {
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
 
-		/* The user space address where the directory entrty should be written
-		*	Calculated by indexing into the callers buffer which has one entry per file.
-		*/
-		auto *dst = (dirent*)user_buf + counter;
-		u64 dst_address = (u64)dst;
+	return syscall_result { ready ? syscall_result_code::ok : syscall_result_code::timed_out, ready };
+}
 
+static syscall_result do_spawn(process &owner, const char *user_path, const char *user_args, const spawn_params &params)
+{
+	// The arguments are handed to the new process in a single page, after its handles.
+	char path[512];
+	char args[sizeof(process_start_info::args)];
+	if (user_access::copy_string_from_user(path, user_path, sizeof(path)) < 0 || user_access::copy_string_from_user(args, user_args, sizeof(args)) < 0) {
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
 
-		/*Before writing to destination address, confirming that the address actuallly
-		* belongs to the calling process and is in writable memory region.
-		*/
-		auto *rgn = caller.addrspace().get_region_from_address(dst_address);
-		if (!rgn) {
-			return syscall_result { syscall_result_code::not_supported, 0 };
+	if (params.nr_handles > SPAWN_MAX_HANDLES) {
+		return syscall_result { syscall_result_code::not_supported, 0 };
+	}
+
+	// Every handle is looked up before anything is created, so that a bad one doesn't leave a process behind.  The
+	// streams come first, and a zero stream is left out.
+	u64 ids[SPAWN_MAX_HANDLES + 2];
+	ids[0] = params.streams.input;
+	ids[1] = params.streams.output;
+	memops::memcpy(&ids[2], params.handles, params.nr_handles * sizeof(u64));
+
+	shared_ptr<object> objects[SPAWN_MAX_HANDLES + 2];
+	for (u64 i = 0; i < params.nr_handles + 2; i++) {
+		if (!ids[i]) {
+			if (i >= 2) {
+				return syscall_result { syscall_result_code::not_found, 0 };
+			}
+
+			continue;
 		}
 
-		if (dst_address + sizeof(dirent) > rgn -> base + rgn -> size) {
-			return syscall_result { syscall_result_code::not_supported, 0};
+		shared_ptr<object> o = object_manager::get().get_object(owner, ids[i]);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
 		}
 
-		if ((rgn -> flags & region_flags::writable) == (region_flags)0) {
+		if (!o->shareable()) {
 			return syscall_result { syscall_result_code::not_supported, 0 };
 		}
 
-		u64 offset = dst_address - rgn->base;
-		void *kdst = (char *)rgn->storage->base_address_ptr() + offset;
-		memops::memcpy(kdst, &ent, sizeof(ent));
+		objects[i] = o;
+	}
 
-		++counter; //One entry is written, now advance to the next.
+	object *inherited[SPAWN_MAX_HANDLES];
+	for (u64 i = 0; i < params.nr_handles; i++) {
+		inherited[i] = objects[i + 2].get();
+	}
+
+	dprintf("start process: %s %s\n", path, args);
+
+	// The new process has the same limits as its parent, and is charged to the same group, unless it starts its own.
+	auto account = owner.account().create_child((params.flags & spawn_flags::new_group) == spawn_flags::new_group);
+
+	auto new_proc = process_manager::get().create_process(path, args, objects[0].get(), objects[1].get(), inherited, params.nr_handles, account);
+	if (!new_proc) {
+		return syscall_result { syscall_result_code::not_found, 0 };
 	}
 
-	return syscall_result { syscall_result_code::ok, counter };
+	// Waiting here saves the caller from creating a process object, only to wait on it and close it straight away.
+	if ((params.flags & spawn_flags::wait) == spawn_flags::wait) {
+		new_proc->start();
+		new_proc->state_changed().wait_until([&] { return new_proc->state() == process_state::terminated; });
+		return syscall_result { syscall_result_code::ok, 0 };
+	}
+
+	// The handle is created before the process is started, so that if the caller has run out of them, the process is
+	// stopped without ever having run.
+	auto process_object = object_manager::get().create_process_object(owner, new_proc);
+	if (!process_object) {
+		new_proc->stop();
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	new_proc->start();
+	return syscall_result { syscall_result_code::ok, process_object->id() };
 }
 
-extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 arg1, u64 arg2, u64 arg3)
+static syscall_result do_start_process(process &owner, const char *user_path, const char *user_args, const process_streams *user_streams)
+{
+	spawn_params params {};
+	if (user_streams && !user_access::copy_from_user(&params.streams, user_streams, sizeof(params.streams))) {
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
+
+	return do_spawn(owner, user_path, user_args, params);
+}
+
+static syscall_result do_clone_process(process &owner, u64 entry_point, void *entry_arg)
+{
+	// The copy has the same limits as its parent, and is charged to the same group.
+	auto account = owner.account().create_child(false);
+
+	auto new_proc = process_manager::get().clone_process(owner, entry_point, entry_arg, account);
+	if (!new_proc) {
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	auto process_object = object_manager::get().create_process_object(owner, new_proc);
+	if (!process_object) {
+		new_proc->stop();
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	new_proc->start();
+	return syscall_result { syscall_result_code::ok, process_object->id() };
+}
+
+static syscall_result do_alloc_mem(process &owner, u64 size, alloc_mem_flags flags)
+{
+	auto &as = owner.addrspace();
+
+	bool huge = (flags & alloc_mem_flags::huge) == alloc_mem_flags::huge;
+	u64 align = huge ? MB(2) : PAGE_SIZE;
+	u64 guard_size = (flags & alloc_mem_flags::guard) == alloc_mem_flags::guard ? PAGE_SIZE : 0;
+
+	// A size that would wrap when rounded up, or that couldn't fit in the user half, is refused before it can move the
+	// allocation pointer.
+	if (size > user_access::user_limit) {
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	size = (size + align - 1) & ~(align - 1);
+
+	auto rgn = as.alloc_region(size, region_flags::readwrite, true, align, guard_size);
+	if (!rgn) {
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	if ((flags & alloc_mem_flags::populate) == alloc_mem_flags::populate && !as.populate_range(rgn->base, rgn->size)) {
+		as.remove_region(rgn->base, rgn->size, region_flags::inaccessible);
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	return syscall_result { syscall_result_code::ok, rgn->base };
+}
+
+static syscall_result do_create_pipe(process &owner, u64 *user_handles)
+{
+	if (!user_access::writable(user_handles, 2 * sizeof(u64))) {
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
+
+	auto p = shared_ptr(new pipe());
+
+	auto read_end = object_manager::get().create_pipe_object(owner, p, false);
+	auto write_end = object_manager::get().create_pipe_object(owner, p, true);
+	if (!read_end || !write_end) {
+		if (read_end) {
+			object_manager::get().free_object(owner, read_end->id());
+		}
+
+		return syscall_result { syscall_result_code::limit_exceeded, 0 };
+	}
+
+	u64 handles[2] = { read_end->id(), write_end->id() };
+	if (!user_access::copy_checked(user_handles, handles, sizeof(handles))) {
+		object_manager::get().free_object(owner, handles[0]);
+		object_manager::get().free_object(owner, handles[1]);
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
+
+	return syscall_result { syscall_result_code::ok, 0 };
+}
+
+static syscall_result operation_result_to_syscall_result(operation_result &&o) { return syscall_result { o.syscall_code(), o.data }; }
+
+static syscall_result do_get_cpu_stats(thread_cpu_stats *buffer, u64 max_entries)
+{
+	// The whole buffer is checked once, and then each entry is copied into it as it is filled in.
+	if (max_entries > user_access::user_limit / sizeof(thread_cpu_stats) || !user_access::writable(buffer, max_entries * sizeof(thread_cpu_stats))) {
+		return syscall_result { syscall_result_code::bad_address, 0 };
+	}
+
+	auto &c = stacsos::kernel::arch::core::this_core();
+	u64 count = 0;
+
+	process_manager::get().for_each_process([&](process &p) {
+		p.for_each_thread([&](thread &t) {
+			if (count < max_entries) {
+				const tcb *tcb = t.get_tcb();
+				thread_cpu_stats s;
+
+				u64 user_time, kernel_time;
+				t.cpu_time(user_time, kernel_time);
+
+				s.process_id = p.id();
+				s.thread_id = t.id();
+				s.user_ns = c.timestamp_to_ns(user_time);
+				s.kernel_ns = c.timestamp_to_ns(kernel_time);
+				s.voluntary_switches = tcb->nr_voluntary_switches;
+				s.preemptions = tcb->nr_preemptions;
+				s.migrations = tcb->nr_migrations;
+				s.last_core = tcb->last_core;
+				s.state = (u32)t.state();
+
+				user_access::copy_checked(&buffer[count], &s, sizeof(s));
+			}
+
+			count++;
+		});
+	});
+
+	// The total is returned, so that the caller can tell if the buffer was too small.
+	return syscall_result { syscall_result_code::ok, count };
+}
+
+// A copy between objects goes through a kernel buffer of this size, a read and a write at a time.
+static const u64 copy_chunk_size = 0x4000;
+
+static syscall_result do_copy_object(process &owner, u64 src_id, u64 dst_id, u64 offset, u64 length)
+{
+	auto src = object_manager::get().get_object(owner, src_id);
+	auto dst = object_manager::get().get_object(owner, dst_id);
+	if (!src || !dst) {
+		return syscall_result { syscall_result_code::not_found, 0 };
+	}
+
+	if (!length) {
+		return syscall_result { syscall_result_code::ok, 0 };
+	}
+
+	// The data never goes near the process, so neither object's buffers have to be checked, and a copy of any size
+	// is only one system call.  It stops early at the end of the source, or if the destination takes less than it
+	// is given -- in which case, a source read from its current position has had the rest consumed already.
+	char *buffer = new char[min(length, copy_chunk_size)];
+	syscall_result_code code = syscall_result_code::ok;
+	u64 copied = 0;
+
+	while (copied < length) {
+		u64 chunk = min(length - copied, copy_chunk_size);
+
+		operation_result r = offset == COPY_CURRENT_POSITION ? src->read(buffer, chunk) : src->pread(buffer, chunk, offset + copied);
+		if (r.code != operation_result_code::ok || !r.data) {
+			if (!copied) {
+				code = r.syscall_code();
+			}
+			break;
+		}
+
+		operation_result w = dst->write(buffer, r.data);
+		if (w.code != operation_result_code::ok) {
+			if (!copied) {
+				code = w.syscall_code();
+			}
+			break;
+		}
+
+		copied += w.data;
+		if (w.data < r.data) {
+			break;
+		}
+	}
+
+	delete[] buffer;
+	return syscall_result { code, copied };
+}
+
+static syscall_result do_syscall(syscall_numbers index, u64 arg0, u64 arg1, u64 arg2, u64 arg3)
 {
 	auto &current_thread = thread::current();
 	auto &current_process = current_thread.owner();
@@ -173,14 +554,24 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 		stacsos::kernel::arch::x86::gsbase::write(arg0);
 		return syscall_result { syscall_result_code::ok, 0 };
 
-	case syscall_numbers::open:
-		return do_open(current_process, (const char *)arg0);
+	case syscall_numbers::open: {
+		char path[512];
+		if (user_access::copy_string_from_user(path, (const char *)arg0, sizeof(path)) < 0) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
+		return do_open(current_process, path, (open_flags)arg1);
+	}
 
 	case syscall_numbers::close:
 		object_manager::get().free_object(current_process, arg0);
 		return syscall_result { syscall_result_code::ok, 0 };
 
 	case syscall_numbers::write: {
+		if (!user_access::readable((const void *)arg1, arg2)) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
 		auto o = object_manager::get().get_object(current_process, arg0);
 		if (!o) {
 			return syscall_result { syscall_result_code::not_found, 0 };
@@ -190,6 +581,10 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 	}
 
 	case syscall_numbers::pwrite: {
+		if (!user_access::readable((const void *)arg1, arg2)) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
 		auto o = object_manager::get().get_object(current_process, arg0);
 		if (!o) {
 			return syscall_result { syscall_result_code::not_found, 0 };
@@ -199,6 +594,10 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 	}
 
 	case syscall_numbers::read: {
+		if (!user_access::writable((const void *)arg1, arg2)) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
 		auto o = object_manager::get().get_object(current_process, arg0);
 		if (!o) {
 			return syscall_result { syscall_result_code::not_found, 0 };
@@ -208,6 +607,10 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 	}
 
 	case syscall_numbers::pread: {
+		if (!user_access::writable((const void *)arg1, arg2)) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
 		auto o = object_manager::get().get_object(current_process, arg0);
 		if (!o) {
 			return syscall_result { syscall_result_code::not_found, 0 };
@@ -216,7 +619,24 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 		return operation_result_to_syscall_result(o->pread((void *)arg1, arg2, arg3));
 	}
 
+	case syscall_numbers::readv:
+	case syscall_numbers::preadv:
+	case syscall_numbers::writev:
+	case syscall_numbers::pwritev: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return do_vectored(*o, index, (const iovec *)arg1, arg2, arg3);
+	}
+
 	case syscall_numbers::ioctl: {
+		// An ioctl may read its buffer, write it, or both.
+		if (!user_access::range_ok((const void *)arg2, arg3, region_flags::readwrite)) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
 		auto o = object_manager::get().get_object(current_process, arg0);
 		if (!o) {
 			return syscall_result { syscall_result_code::not_found, 0 };
@@ -225,22 +645,108 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 		return operation_result_to_syscall_result(o->ioctl(arg1, (void *)arg2, arg3));
 	}
 
-	case syscall_numbers::alloc_mem: {
-		auto rgn = current_thread.owner().addrspace().alloc_region(PAGE_ALIGN_UP(arg0), region_flags::readwrite, true);
+	case syscall_numbers::alloc_mem:
+		return do_alloc_mem(current_process, arg0, (alloc_mem_flags)arg1);
 
-		return syscall_result { syscall_result_code::ok, rgn->base };
+	case syscall_numbers::mmap: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->mmap(arg1, arg2, (mmap_flags)arg3));
 	}
 
-	case syscall_numbers::start_process: {
-		dprintf("start process: %s %s\n", arg0, arg1);
+	case syscall_numbers::munmap:
+		current_process.addrspace().remove_region(arg0 & PAGE_MASK, PAGE_ALIGN_UP(arg1), region_flags::inaccessible);
+		return syscall_result { syscall_result_code::ok, 0 };
 
-		auto new_proc = process_manager::get().create_process((const char *)arg0, (const char *)arg1);
-		if (!new_proc) {
+	case syscall_numbers::fsync: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
 			return syscall_result { syscall_result_code::not_found, 0 };
 		}
 
-		new_proc->start();
-		return syscall_result { syscall_result_code::ok, object_manager::get().create_process_object(current_process, new_proc)->id() };
+		return operation_result_to_syscall_result(o->fsync());
+	}
+
+	case syscall_numbers::truncate: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->truncate(arg1));
+	}
+
+	case syscall_numbers::get_size: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->size());
+	}
+
+	case syscall_numbers::msync:
+		return syscall_result { syscall_result_code::ok, current_process.addrspace().sync_file(arg0, arg1) };
+
+	case syscall_numbers::start_process:
+		return do_start_process(current_process, (const char *)arg0, (const char *)arg1, (const process_streams *)arg2);
+
+	case syscall_numbers::create_pipe:
+		return do_create_pipe(current_process, (u64 *)arg0);
+
+	case syscall_numbers::clone_process:
+		return do_clone_process(current_process, arg0, (void *)arg1);
+
+	case syscall_numbers::copy_object:
+		return do_copy_object(current_process, arg0, arg1, arg2, arg3);
+
+	case syscall_numbers::spawn: {
+		spawn_params params;
+		if (!user_access::copy_from_user(&params, (const spawn_params *)arg2, sizeof(params))) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
+		return do_spawn(current_process, (const char *)arg0, (const char *)arg1, params);
+	}
+
+	case syscall_numbers::set_resource_limit: {
+		if (arg0 >= NR_RESOURCE_TYPES) {
+			return syscall_result { syscall_result_code::not_supported, 0 };
+		}
+
+		// A process that was started without a group of its own is in no group at all.
+		resource_account *account = &current_process.account();
+		if ((resource_scope)arg1 == resource_scope::group) {
+			account = account->parent().get();
+			if (!account) {
+				return syscall_result { syscall_result_code::not_found, 0 };
+			}
+		}
+
+		// Asking for no limit never raises one, so it can be used to find out how much is in use.
+		resource_type type = (resource_type)arg0;
+		if (arg2 != RESOURCE_UNLIMITED && !account->set_limit(type, arg2)) {
+			return syscall_result { syscall_result_code::not_supported, 0 };
+		}
+
+		return syscall_result { syscall_result_code::ok, account->usage(type) };
+	}
+
+	case syscall_numbers::set_gang_scheduling:
+		current_process.set_gang_scheduled(arg0 != 0);
+		return syscall_result { syscall_result_code::ok, 0 };
+
+	case syscall_numbers::shm_create: {
+		// Shared memory is a file that keeps its own pages, so its object is an ordinary file object, without a node.
+		auto shm = shared_memory::create(arg0);
+		if (!shm) {
+			return syscall_result { syscall_result_code::not_supported, 0 };
+		}
+
+		return object_result(object_manager::get().create_file_object(current_process, shm, nullptr));
 	}
 
 	case syscall_numbers::wait_for_process: {
@@ -256,14 +762,58 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 
 	case syscall_numbers::start_thread: {
 		auto new_thread = current_thread.owner().create_thread((u64)arg0, (void *)arg1);
+		if (!new_thread) {
+			return syscall_result { syscall_result_code::limit_exceeded, 0 };
+		}
+
 		new_thread->start();
 
-		return syscall_result { syscall_result_code::ok, object_manager::get().create_thread_object(current_process, new_thread)->id() };
+		return object_result(object_manager::get().create_thread_object(current_process, new_thread));
+	}
+
+	case syscall_numbers::start_threads: {
+		// Starts count threads at the same entry point, each with its own argument, returning the thread objects'
+		// ids in the ids array.
+		void **args = (void **)arg2;
+		u64 *ids = (u64 *)arg3;
+
+		// Both arrays are checked up front, so that no threads are started for a call that can't succeed.
+		if (arg0 > user_access::user_limit / sizeof(u64) || !user_access::readable(args, arg0 * sizeof(void *))
+			|| !user_access::writable(ids, arg0 * sizeof(u64))) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
+		for (u64 i = 0; i < arg0; i++) {
+			void *arg;
+			if (!user_access::copy_checked(&arg, &args[i], sizeof(arg))) {
+				return syscall_result { syscall_result_code::bad_address, i };
+			}
+
+			// Running out of threads part way leaves the ones already started running, so the caller is told how many.
+			auto new_thread = current_thread.owner().create_thread((u64)arg1, arg);
+			if (!new_thread) {
+				return syscall_result { syscall_result_code::limit_exceeded, i };
+			}
+
+			new_thread->start();
+
+			auto thread_object = object_manager::get().create_thread_object(current_process, new_thread);
+			if (!thread_object) {
+				return syscall_result { syscall_result_code::limit_exceeded, i + 1 };
+			}
+
+			u64 id = thread_object->id();
+			if (!user_access::copy_checked(&ids[i], &id, sizeof(id))) {
+				return syscall_result { syscall_result_code::bad_address, i + 1 };
+			}
+		}
+
+		return syscall_result { syscall_result_code::ok, arg0 };
 	}
 
 	case syscall_numbers::stop_current_thread: {
 		current_thread.stop();
-		asm volatile("int $0xff");
+		stacsos::kernel::arch::core::this_core().reschedule();
 
 		return syscall_result { syscall_result_code::ok, 0 };
 	}
@@ -277,22 +827,171 @@ extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 ar
 		return operation_result_to_syscall_result(thread_object->join());
 	}
 
+	case syscall_numbers::set_affinity: {
+		auto thread_object = object_manager::get().get_object(current_process, arg0);
+		if (!thread_object) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(thread_object->set_affinity(arg1));
+	}
+
+	case syscall_numbers::set_priority: {
+		auto thread_object = object_manager::get().get_object(current_process, arg0);
+		if (!thread_object) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(thread_object->set_priority((sched_policy)arg1, (int)arg2));
+	}
+
+	case syscall_numbers::set_reservation: {
+		auto thread_object = object_manager::get().get_object(current_process, arg0);
+		if (!thread_object) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(thread_object->set_reservation(arg1, arg2));
+	}
+
+	case syscall_numbers::get_cpu_stats:
+		return do_get_cpu_stats((thread_cpu_stats *)arg0, arg1);
+
 	case syscall_numbers::sleep: {
 		sleeper::get().sleep_ms(arg0);
 		return syscall_result { syscall_result_code::ok, 0 };
 	}
 
+	case syscall_numbers::sleep_until: {
+		sleeper::get().sleep_until(arg0);
+		return syscall_result { syscall_result_code::ok, 0 };
+	}
+
+	case syscall_numbers::create_timer: {
+		auto o = object_manager::get().create_timer_object(current_process, arg0, arg1);
+		if (!o) {
+			return syscall_result { syscall_result_code::limit_exceeded, 0 };
+		}
+
+		return syscall_result { syscall_result_code::ok, o->id() };
+	}
+
+	case syscall_numbers::yield: {
+		// Give up the rest of the time slice.  The thread stays runnable, so the scheduler may well pick it again.
+		stacsos::kernel::arch::core::this_core().reschedule();
+		return syscall_result { syscall_result_code::ok, 0 };
+	}
+
+	case syscall_numbers::futex_wait: {
+		return syscall_result { futex_manager::get().wait(current_process, arg0, (u32)arg1, arg2), 0 };
+	}
+
+	case syscall_numbers::futex_wake: {
+		u64 woken;
+		auto rc = futex_manager::get().wake(current_process, arg0, (u32)arg1, woken);
+
+		return syscall_result { rc, woken };
+	}
+
+	case syscall_numbers::futex_lock_pi: {
+		u64 tid = 0;
+		auto rc = futex_manager::get().lock_pi(current_process, arg0, tid);
+
+		return syscall_result { rc, tid };
+	}
+
+	case syscall_numbers::futex_unlock_pi: {
+		return syscall_result { futex_manager::get().unlock_pi(current_process, arg0), 0 };
+	}
+
 	case syscall_numbers::poweroff: {
 		pio::outw(0x604, 0x2000);
 		return syscall_result { syscall_result_code::ok, 0 };
 	}
 
 	case syscall_numbers::readdir: {
-    	return do_readdir((const char*)arg0, (void*)arg1, arg2);
+		if (!user_access::writable((const void *)arg1, arg2)) {
+			return syscall_result { syscall_result_code::bad_address, 0 };
+		}
+
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->readdir((void *)arg1, arg2));
+	}
+
+	case syscall_numbers::io_ring_setup:
+		return do_io_ring_setup(current_process, (io_ring_params *)arg0);
+
+	case syscall_numbers::io_ring_enter: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->enter(arg1));
+	}
+
+	case syscall_numbers::wait_many:
+		return do_wait_many(current_process, (wait_entry *)arg0, arg1, arg2);
+
+	case syscall_numbers::advise: {
+		auto o = object_manager::get().get_object(current_process, arg0);
+		if (!o) {
+			return syscall_result { syscall_result_code::not_found, 0 };
+		}
+
+		return operation_result_to_syscall_result(o->advise(arg1, arg2, (access_advice)arg3));
+	}
+
+	case syscall_numbers::advise_memory:
+		if (!current_process.addrspace().advise(arg0, arg1, (access_advice)arg2)) {
+			return syscall_result { syscall_result_code::not_supported, 0 };
+		}
+
+		return syscall_result { syscall_result_code::ok, 0 };
+
+	case syscall_numbers::zygote_ready: {
+		if (!process_manager::get().zygote_ready(current_process, arg0)) {
+			return syscall_result { syscall_result_code::not_supported, 0 };
+		}
+
+		// The template is only there to be copied, so its thread never runs again, but the process stays alive.
+		current_thread.suspend();
+		stacsos::kernel::arch::core::this_core().reschedule();
+
+		return syscall_result { syscall_result_code::ok, 0 };
 	}
 
 	default:
-		dprintf("ERROR: unsupported syscall: %lx\n", index);
+		dprintf("ERROR: unsupported syscall: %llx\n", (u64)index);
 		return syscall_result { syscall_result_code::not_supported, 0 };
 	}
 }
+
+DEFINE_TRACEPOINT(syscall_enter, "nr=%llu arg0=%llx arg1=%llx arg2=%llx");
+DEFINE_TRACEPOINT(syscall_exit, "nr=%llu code=%llu data=%llx cycles=%llu");
+
+extern "C" syscall_result handle_syscall(syscall_numbers index, u64 arg0, u64 arg1, u64 arg2, u64 arg3)
+{
+	// Time spent in the system call is accounted as kernel time.  The TCB is per-thread, so it's fine if the
+	// thread is moved to a different core while it's in here.
+	thread &current = thread::current();
+	tcb *t = current.get_tcb();
+	u64 entry = __builtin_ia32_rdtsc();
+	t->kernel_since = entry;
+
+	TRACEPOINT(syscall_enter, index, arg0, arg1, arg2);
+	syscall_result r = do_syscall(index, arg0, arg1, arg2, arg3);
+
+	u64 now = __builtin_ia32_rdtsc();
+	t->kernel_time += now - t->kernel_since;
+	t->kernel_since = 0;
+
+	syscall_stats::get().record(index, current.owner().id(), now - entry);
+	TRACEPOINT(syscall_exit, index, r.code, r.data, now - entry);
+
+	return r;
+}
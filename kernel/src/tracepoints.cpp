@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/arch/core.h>
+#include <stacsos/kernel/tracepoints.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+using namespace stacsos::kernel::arch;
+using namespace stacsos::kernel::sched;
+
+extern "C" tracepoint __tracepoints_start[], __tracepoints_end[];
+
+tracepoint *tracepoints::begin() { return __tracepoints_start; }
+tracepoint *tracepoints::end() { return __tracepoints_end; }
+
+bool tracepoints::set_enabled(u32 id, bool enabled)
+{
+	if (id != all_tracepoints && !get_by_id(id)) {
+		return false;
+	}
+
+	if (enabled) {
+		mutex_lock l(drain_lock_);
+
+		for (auto *c : core_manager::get().cores()) {
+			per_core_ring &r = cores_[c->id()];
+			if (!r.records) {
+				tracepoint_record *records = new tracepoint_record[records_per_core];
+				for (unsigned int i = 0; i < records_per_core; i++) {
+					records[i].seq = 0;
+				}
+
+				__atomic_store_n(&r.records, records, __ATOMIC_RELEASE);
+			}
+		}
+	}
+
+	for (u32 i = (id == all_tracepoints ? 0 : id); i < (id == all_tracepoints ? count() : id + 1); i++) {
+		__atomic_store_n(&begin()[i].enabled, enabled, __ATOMIC_RELAXED);
+	}
+
+	return true;
+}
+
+void tracepoints::record(const tracepoint &tp, const u64 *args, u32 nr_args)
+{
+	int id = core::this_core_id();
+	per_core_ring &c = cores_[id];
+
+	tracepoint_record *records = __atomic_load_n(&c.records, __ATOMIC_ACQUIRE);
+	if (!records) {
+		return;
+	}
+
+	u64 slot = __atomic_fetch_add(&c.head, 1, __ATOMIC_RELAXED);
+	tracepoint_record &r = records[slot % records_per_core];
+
+	// The slot is marked as being written first, so that a reader copying it at the same time throws its copy away.
+	__atomic_store_n(&r.seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r.timestamp = __builtin_ia32_rdtsc();
+	r.id = &tp - begin();
+	r.core = id;
+	r.nr_args = nr_args;
+
+	for (u32 i = 0; i < nr_args; i++) {
+		r.args[i] = args[i];
+	}
+
+	__atomic_store_n(&r.seq, slot + 1, __ATOMIC_RELEASE);
+}
+
+size_t tracepoints::pending() const
+{
+	size_t n = 0;
+
+	for (const auto &c : cores_) {
+		n += min(__atomic_load_n(&c.head, __ATOMIC_ACQUIRE) - c.tail, (u64)records_per_core);
+	}
+
+	return n;
+}
+
+size_t tracepoints::drain(tracepoint_record *buffer, size_t max_records)
+{
+	mutex_lock l(drain_lock_);
+	size_t n = 0;
+
+	for (auto &c : cores_) {
+		if (!c.records) {
+			continue;
+		}
+
+		u64 head = __atomic_load_n(&c.head, __ATOMIC_ACQUIRE);
+		u64 tail = c.tail;
+
+		if (head - tail > records_per_core) {
+			__atomic_fetch_add(&lost_, head - tail - records_per_core, __ATOMIC_RELAXED);
+			tail = head - records_per_core;
+		}
+
+		while (tail < head && n < max_records) {
+			const tracepoint_record &r = c.records[tail % records_per_core];
+
+			u64 seq = __atomic_load_n(&r.seq, __ATOMIC_ACQUIRE);
+			if (seq > tail + 1) {
+				// Overwritten by a later record.
+				__atomic_fetch_add(&lost_, 1, __ATOMIC_RELAXED);
+				tail++;
+				continue;
+			}
+
+			if (seq != tail + 1) {
+				// Still being written, so it's left for the next drain.
+				break;
+			}
+
+			buffer[n] = r;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			if (__atomic_load_n(&r.seq, __ATOMIC_RELAXED) == seq) {
+				n++;
+			} else {
+				__atomic_fetch_add(&lost_, 1, __ATOMIC_RELAXED);
+			}
+
+			tail++;
+		}
+
+		c.tail = tail;
+	}
+
+	return n;
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Kernel
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/kernel/log.h>
+#include <stacsos/kernel/tunables.h>
+
+using namespace stacsos;
+using namespace stacsos::kernel;
+
+void tunables::add(tunable *t)
+{
+	unique_irq_lock l(lock_);
+
+	tunables_.append(t);
+	if (listener_) {
+		listener_->tunable_added(*t);
+	}
+}
+
+void tunables::set_listener(tunable_listener &listener)
+{
+	unique_irq_lock l(lock_);
+
+	listener_ = &listener;
+	for (auto *t : tunables_) {
+		listener.tunable_added(*t);
+	}
+}
+
+bool tunables::set(tunable &t, u64 value)
+{
+	if (value < t.min || value > t.max) {
+		return false;
+	}
+
+	__atomic_store_n(t.value, value, __ATOMIC_RELAXED);
+	dlogf<log_level::debug>("tune: %s = %llu\n", t.path, value);
+
+	if (t.changed) {
+		t.changed(value, t.changed_arg);
+	}
+
+	return true;
+}
@@ -63,6 +63,7 @@ typedef __gnuc_va_list va_list;
 #define __visibility(__n) __attribute__((visibility(__n)))
 #define __unreachable() __builtin_unreachable()
 #define __constexpr constexpr
+#define __printf_format(__fmt, __args) __attribute__((format(printf, __fmt, __args)))
 
 /*
  * Code flow analysis
@@ -168,8 +169,8 @@ static inline __noreturn void hang_loop()
 	__unreachable();
 }
 
-extern __noreturn void panic(const char *fmt, ...);
-extern __noreturn void panic_with_ctx(const void *mctx, const char *fmt, ...);
+extern __noreturn __printf_format(1, 2) void panic(const char *fmt, ...);
+extern __noreturn __printf_format(2, 3) void panic_with_ctx(const void *mctx, const char *fmt, ...);
 
 /* Assertions */
 static inline void __assert(bool cond, const char *str)
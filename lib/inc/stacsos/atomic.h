@@ -8,30 +8,81 @@
 #pragma once
 
 namespace stacsos {
+enum class memory_order : int {
+	relaxed = __ATOMIC_RELAXED,
+	acquire = __ATOMIC_ACQUIRE,
+	release = __ATOMIC_RELEASE,
+	acq_rel = __ATOMIC_ACQ_REL,
+	seq_cst = __ATOMIC_SEQ_CST,
+};
+
+/**
+ * @brief The order a failed compare-and-swap has, given the order it would have had if it had succeeded: a failure
+ * stores nothing, so it can't have release semantics.
+ */
+static inline constexpr memory_order failure_order(memory_order success)
+{
+	switch (success) {
+	case memory_order::release:
+		return memory_order::relaxed;
+	case memory_order::acq_rel:
+		return memory_order::acquire;
+	default:
+		return success;
+	}
+}
+
+static inline void atomic_thread_fence(memory_order order) { __atomic_thread_fence((int)order); }
+
+/**
+ * @brief An integer or pointer that is only accessed atomically, with sequentially consistent ordering unless another
+ * order is asked for.
+ */
 template <class T> class atomic {
 public:
 	using self = atomic<T>;
 
+	atomic()
+		: v_()
+	{
+	}
+
 	atomic(T v)
 		: v_(v)
 	{
 	}
 
-	T fetch_and_add(T value)
+	T load(memory_order order = memory_order::seq_cst) const { return __atomic_load_n(&v_, (int)order); }
+	void store(T value, memory_order order = memory_order::seq_cst) { __atomic_store_n(&v_, value, (int)order); }
+	T exchange(T value, memory_order order = memory_order::seq_cst) { return __atomic_exchange_n(&v_, value, (int)order); }
+
+	/**
+	 * @brief Replaces the value with desired if it is expected, and returns true, or returns false having loaded the
+	 * value into expected.  The weak form may fail even when the value matches, so it belongs in a loop.
+	 */
+	bool compare_exchange_weak(T &expected, T desired, memory_order order = memory_order::seq_cst)
 	{
-		asm volatile("lock; xadd %0, %1"
-					 : "+r"(value), "+m"(v_) // input + output
-					 : // No input-only
-					 : "memory");
+		return __atomic_compare_exchange_n(&v_, &expected, desired, true, (int)order, (int)failure_order(order));
+	}
 
-		return value;
+	bool compare_exchange_strong(T &expected, T desired, memory_order order = memory_order::seq_cst)
+	{
+		return __atomic_compare_exchange_n(&v_, &expected, desired, false, (int)order, (int)failure_order(order));
 	}
 
-	T operator++(int) { return fetch_and_add(1); }
+	// These return the value from before the operation.  They are only meaningful for integers.
+	T fetch_add(T value, memory_order order = memory_order::seq_cst) { return __atomic_fetch_add(&v_, value, (int)order); }
+	T fetch_sub(T value, memory_order order = memory_order::seq_cst) { return __atomic_fetch_sub(&v_, value, (int)order); }
+	T fetch_and(T value, memory_order order = memory_order::seq_cst) { return __atomic_fetch_and(&v_, value, (int)order); }
+	T fetch_or(T value, memory_order order = memory_order::seq_cst) { return __atomic_fetch_or(&v_, value, (int)order); }
+
+	T fetch_and_add(T value) { return fetch_add(value); }
+
+	T operator++(int) { return fetch_add(1); }
 
 	self &operator=(T value)
 	{
-		v_ = value;
+		store(value);
 		return *this;
 	}
 
@@ -41,4 +92,28 @@ private:
 
 using atomic_u32 = atomic<u32>;
 using atomic_u64 = atomic<u64>;
+
+static const size_t cache_line_size = 64;
+
+/**
+ * @brief A value followed by enough padding that nothing placed after it can share a cache line with it, so that
+ * fields written by different cores don't bounce a line between them.  Padding is used rather than alignment, so that
+ * it works in memory from allocators that only guarantee a smaller alignment.
+ */
+template <class T> struct cache_padded {
+	cache_padded()
+		: value()
+	{
+	}
+
+	cache_padded(const T &v)
+		: value(v)
+	{
+	}
+
+	T value;
+
+private:
+	u8 pad_[cache_line_size - (sizeof(T) % cache_line_size)];
+};
 } // namespace stacsos
@@ -129,8 +129,27 @@ public:
 	{
 	}
 
+	~avl_tree() { clear(); }
+
 	void add(const K &key, const D &data) { root_ = do_insert(root_, key, data); }
 
+	/**
+	 * @brief Removes the entry with the given key, returning false if there wasn't one.
+	 */
+	bool remove(const K &key)
+	{
+		bool removed = false;
+		root_ = do_remove(root_, key, removed);
+
+		return removed;
+	}
+
+	void clear()
+	{
+		do_clear(root_);
+		root_ = nullptr;
+	}
+
 	bool try_get_value(const K &key, D &data)
 	{
 		node *ref = root_;
@@ -221,5 +240,61 @@ private:
 			return balance(ref);
 		}
 	}
+
+	node *do_remove(node *ref, const K &key, bool &removed)
+	{
+		if (ref == nullptr) {
+			return nullptr;
+		} else if (ref->key() == key) {
+			node *replacement;
+
+			if (ref->left() == nullptr) {
+				replacement = ref->right();
+			} else if (ref->right() == nullptr) {
+				replacement = ref->left();
+			} else {
+				// The node's in-order successor takes its place.
+				node *successor;
+				node *right = remove_min(ref->right(), successor);
+
+				successor->left(ref->left());
+				successor->right(right);
+				replacement = balance(successor);
+			}
+
+			delete ref;
+			removed = true;
+
+			return replacement;
+		} else if (key < ref->key()) {
+			ref->left(do_remove(ref->left(), key, removed));
+			return balance(ref);
+		} else {
+			ref->right(do_remove(ref->right(), key, removed));
+			return balance(ref);
+		}
+	}
+
+	node *remove_min(node *ref, node *&min)
+	{
+		if (ref->left() == nullptr) {
+			min = ref;
+			return ref->right();
+		}
+
+		ref->left(remove_min(ref->left(), min));
+		return balance(ref);
+	}
+
+	void do_clear(node *ref)
+	{
+		if (ref == nullptr) {
+			return;
+		}
+
+		do_clear(ref->left());
+		do_clear(ref->right());
+		delete ref;
+	}
 };
 } // namespace stacsos
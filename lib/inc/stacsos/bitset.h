@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <stacsos/helpers.h>
 #include <stacsos/memops.h>
 
 namespace stacsos {
@@ -50,4 +51,267 @@ public:
 private:
 	bit_word words_[nr_words];
 };
+
+/**
+ * @brief A bitmap of any size, with summary levels above it, so that finding a set or a clear bit never looks at more
+ * than a handful of words, however big the map is.  Above each word of the bitmap, a bit in a "full" summary says the
+ * word is all ones, and a bit in an "any" summary says it isn't all zeros, and each summary level has the same two
+ * summaries of its own words above it, until the top level is a single word.  A search looks at the word it starts
+ * in, climbs the summaries only until it finds a word with a candidate in it, then follows the lowest candidate at
+ * each level back down, with a tzcnt at each step.
+ *
+ * The storage can be given, for a map that has to exist before the heap does, or is allocated and owned by the map.
+ */
+class hierarchical_bitset {
+	DELETE_DEFAULT_COPY_AND_MOVE(hierarchical_bitset)
+
+	static const unsigned int max_levels = 6;
+
+public:
+	static const u64 npos = ~0ull;
+
+	/**
+	 * @brief The number of words of storage that a map with the given number of bits needs.
+	 */
+	static constexpr size_t storage_words(size_t nr_bits)
+	{
+		size_t words = (nr_bits + 63) / 64;
+		size_t total = words;
+
+		while (words > 1) {
+			words = (words + 63) / 64;
+			total += words * 2;
+		}
+
+		return total;
+	}
+
+	hierarchical_bitset()
+		: nr_bits_(0)
+		, nr_levels_(0)
+		, storage_(nullptr)
+		, owns_storage_(false)
+	{
+	}
+
+	~hierarchical_bitset()
+	{
+		if (owns_storage_) {
+			delete[] storage_;
+		}
+	}
+
+	/**
+	 * @brief Sets the map up with every bit clear.
+	 *
+	 * @param storage At least storage_words(nr_bits) words, or null to allocate them.
+	 */
+	void init(size_t nr_bits, u64 *storage = nullptr)
+	{
+		nr_bits_ = nr_bits;
+		owns_storage_ = !storage;
+		storage_ = storage ? storage : new u64[storage_words(nr_bits)];
+
+		size_t words = (nr_bits + 63) / 64;
+		u64 *next = storage_;
+
+		bits_ = next;
+		nr_words_[0] = words;
+		next += words;
+		nr_levels_ = 1;
+
+		while (words > 1) {
+			words = (words + 63) / 64;
+
+			full_[nr_levels_] = next;
+			any_[nr_levels_] = next + words;
+			nr_words_[nr_levels_] = words;
+			next += words * 2;
+			nr_levels_++;
+		}
+
+		memops::bzero(storage_, storage_words(nr_bits) * sizeof(u64));
+
+		// The bits past the end are set, so they are never found to be clear, and the summary bits for words past the
+		// end of each level are marked full and empty, so that they are never followed.
+		if (nr_bits % 64) {
+			for (size_t i = nr_bits; i % 64; i++) {
+				set(i);
+			}
+		}
+
+		for (unsigned int level = 1; level < nr_levels_; level++) {
+			size_t lower_words = nr_words_[level - 1];
+			if (lower_words % 64) {
+				full_[level][lower_words / 64] |= ~0ull << (lower_words % 64);
+			}
+		}
+	}
+
+	size_t size() const { return nr_bits_; }
+
+	bool test(u64 index) const { return bits_[index / 64] & (1ull << (index % 64)); }
+
+	void set(u64 index)
+	{
+		u64 word = index / 64;
+		u64 old = bits_[word];
+		u64 now = old | (1ull << (index % 64));
+
+		bits_[word] = now;
+
+		if (!old) {
+			propagate_set(any_, word);
+		}
+
+		if (!~now) {
+			propagate_set(full_, word);
+		}
+	}
+
+	void clear(u64 index)
+	{
+		u64 word = index / 64;
+		u64 old = bits_[word];
+		u64 now = old & ~(1ull << (index % 64));
+
+		bits_[word] = now;
+
+		if (!~old && ~now) {
+			propagate_clear(full_, word);
+		}
+
+		if (old && !now) {
+			propagate_clear(any_, word);
+		}
+	}
+
+	/**
+	 * @brief Returns the first set bit at or after the given index, or npos if there isn't one.
+	 */
+	u64 find_next_set(u64 from) const
+	{
+		u64 index = search(from, true);
+		return index < nr_bits_ ? index : npos;
+	}
+
+	/**
+	 * @brief Returns the first clear bit at or after the given index, or npos if there isn't one.
+	 */
+	u64 find_next_zero(u64 from) const { return search(from, false); }
+
+	/**
+	 * @brief Returns the first set bit at or after the hint, wrapping around to the start, or npos if there isn't
+	 * one.
+	 */
+	u64 find_first_set(u64 hint = 0) const
+	{
+		u64 index = find_next_set(hint);
+		return index == npos && hint ? find_next_set(0) : index;
+	}
+
+	/**
+	 * @brief Returns the first clear bit at or after the hint, wrapping around to the start, or npos if there isn't
+	 * one.
+	 */
+	u64 find_first_zero(u64 hint = 0) const
+	{
+		u64 index = find_next_zero(hint);
+		return index == npos && hint ? find_next_zero(0) : index;
+	}
+
+private:
+	size_t nr_bits_;
+	unsigned int nr_levels_;
+	u64 *storage_;
+	bool owns_storage_;
+
+	u64 *bits_;
+	u64 *full_[max_levels], *any_[max_levels];
+	size_t nr_words_[max_levels];
+
+	/**
+	 * @brief Sets the summary bit for a word at each level, for as long as the word holding it has just become all
+	 * ones (for full) or non-zero (for any).
+	 */
+	void propagate_set(u64 **summary, u64 word)
+	{
+		for (unsigned int level = 1; level < nr_levels_; level++) {
+			u64 &w = summary[level][word / 64];
+			u64 old = w;
+
+			w |= 1ull << (word % 64);
+			if (summary == full_ ? !!~w : !!old) {
+				break;
+			}
+
+			word /= 64;
+		}
+	}
+
+	void propagate_clear(u64 **summary, u64 word)
+	{
+		for (unsigned int level = 1; level < nr_levels_; level++) {
+			u64 &w = summary[level][word / 64];
+			u64 old = w;
+
+			w &= ~(1ull << (word % 64));
+			if (summary == full_ ? !!~old : !!w) {
+				break;
+			}
+
+			word /= 64;
+		}
+	}
+
+	/**
+	 * @brief The candidates in a word at a level: bits that are set, or for a search for a clear bit, words with a
+	 * clear bit in them.
+	 */
+	u64 candidates(unsigned int level, u64 word, bool set) const
+	{
+		if (!level) {
+			return set ? bits_[word] : ~bits_[word];
+		}
+
+		return set ? any_[level][word] : ~full_[level][word];
+	}
+
+	u64 search(u64 from, bool set) const
+	{
+		if (from >= nr_bits_) {
+			return npos;
+		}
+
+		u64 word = from / 64;
+		u64 bits = candidates(0, word, set) & (~0ull << (from % 64));
+		if (bits) {
+			return (word * 64) + __builtin_ctzll(bits);
+		}
+
+		// Climb until a later word at some level has a candidate in it...
+		unsigned int level = 1;
+		for (; level < nr_levels_; level++) {
+			u64 offset = word % 64;
+
+			word /= 64;
+			bits = offset == 63 ? 0 : candidates(level, word, set) & (~0ull << (offset + 1));
+			if (bits) {
+				break;
+			}
+		}
+
+		if (level == nr_levels_) {
+			return npos;
+		}
+
+		// ... then follow the first candidate down.
+		word = (word * 64) + __builtin_ctzll(bits);
+		while (--level) {
+			word = (word * 64) + __builtin_ctzll(candidates(level, word, set));
+		}
+
+		return (word * 64) + __builtin_ctzll(candidates(0, word, set));
+	}
+};
 } // namespace stacsos
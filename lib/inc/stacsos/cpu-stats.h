@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/*
+ * CPU usage of a single thread, as returned by the get_cpu_stats system call.  Per-process figures are the
+ * sum over the threads with the same process id.
+ */
+struct thread_cpu_stats {
+	u64 process_id;
+	u64 thread_id;
+	u64 user_ns;
+	u64 kernel_ns;
+	u64 voluntary_switches; // Times the thread blocked or yielded
+	u64 preemptions; // Times the thread was switched out while still runnable
+	u64 migrations; // Times the thread was moved to another core
+	u32 last_core;
+	u32 state; // 0 = created, 1 = runnable, 2 = running, 3 = suspended, 4 = terminated
+};
+
+enum class process_ioctl : u64 { cpu_times = 1 };
+
+/*
+ * The CPU time used by every thread of a process, as filled in by the cpu_times ioctl on a handle to it.  The figures
+ * are still there once the process has exited, for as long as the handle is open.
+ */
+struct process_cpu_times {
+	u64 user_ns;
+	u64 kernel_ns;
+};
+} // namespace stacsos
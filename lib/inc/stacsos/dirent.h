@@ -1,9 +1,24 @@
 #pragma once
 
-#define MAX_FILE_NAME_LENGTH 64
-
+/*
+ * A directory entry, as returned by readdir.  Entries are packed one after another, each taking record_length bytes,
+ * which is the size of the header and the name (with its null terminator), rounded up to a multiple of eight.
+ */
 struct dirent {
-    char name[MAX_FILE_NAME_LENGTH];
+    unsigned short record_length;
+    unsigned short name_length; // Not counting the null terminator.
     char type; // 'd' for directory or 'f' for file.
-    unsigned int size; //Size of the file in bytes. (0 for directories).
-};
\ No newline at end of file
+    char reserved[3];
+    unsigned long size; //Size of the file in bytes. (0 for directories).
+    char name[];
+};
+
+static inline unsigned long dirent_record_length(unsigned long name_length)
+{
+    return (sizeof(dirent) + name_length + 1 + 7) & ~7ul;
+}
+
+static inline const dirent *dirent_next(const dirent *ent)
+{
+    return (const dirent *)((const char *)ent + ent->record_length);
+}
@@ -0,0 +1,366 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/helpers.h>
+#include <stacsos/memops.h>
+#include <stacsos/string.h>
+
+namespace stacsos {
+/**
+ * @brief The default hasher for a hash_map.  Integers hash to themselves, as the map mixes every hash before using it.
+ */
+template <class K> struct hash {
+	u64 operator()(const K &key) const { return (u64)key; }
+};
+
+template <class K> struct hash<K *> {
+	u64 operator()(const K *key) const { return (u64)(uintptr_t)key; }
+};
+
+template <> struct hash<string> {
+	string::hash_type operator()(const string &key) const { return key.get_hash(); }
+};
+
+template <> struct hash<string_view> {
+	string_view::hash_type operator()(const string_view &key) const { return key.get_hash(); }
+};
+
+template <class K, class V> struct hash_map_iterator_pair {
+	const K &key;
+	V &value;
+};
+
+/**
+ * @brief A map from K to V, kept in an open-addressed hash table, so looking an entry up is O(1) and doesn't chase any
+ * pointers.  Keys are hashed with H, which can be swapped for anything that turns a K into a u64.
+ *
+ * The slots are split into groups of eight, and each slot has a control byte saying whether it is empty, deleted, or
+ * full -- in which case it holds seven bits of the key's hash.  A lookup loads a whole group of control bytes as one
+ * word and compares all eight at once, so only slots whose hash bits match have their keys compared, and it stops at
+ * the first group with an empty slot in it.  The table is kept at most 7/8 full.
+ */
+template <class K, class V, class H = hash<K>> class hash_map {
+	DELETE_DEFAULT_COPY_AND_MOVE(hash_map)
+
+public:
+	using iterator_pair = hash_map_iterator_pair<K, V>;
+
+	hash_map()
+		: ctrl_(nullptr)
+		, slots_(nullptr)
+		, capacity_(0)
+		, count_(0)
+		, growth_left_(0)
+	{
+	}
+
+	~hash_map()
+	{
+		clear();
+
+		delete[] ctrl_;
+		delete[] (u8 *)slots_;
+	}
+
+	/**
+	 * @brief Adds an entry, replacing the value of the one with the same key if there is one.
+	 */
+	void add(const K &key, const V &value)
+	{
+		u64 h = hash_of(key);
+
+		size_t index = find(key, h);
+		if (index != npos) {
+			slots_[index].value = value;
+			return;
+		}
+
+		if (growth_left_ == 0) {
+			// Rehashing in place is enough if most of what is using up the table is deleted slots.
+			rehash(count_ * 2 < capacity_ - capacity_ / 8 ? capacity_ : (capacity_ ? capacity_ * 2 : group_size));
+		}
+
+		index = find_free(h);
+		if (control(index) == ctrl_empty) {
+			growth_left_--;
+		}
+
+		set_control(index, tag_of(h));
+		new (&slots_[index]) slot { key, value };
+		count_++;
+	}
+
+	/**
+	 * @brief Removes the entry with the given key, returning false if there wasn't one.
+	 */
+	bool remove(const K &key)
+	{
+		size_t index = find(key, hash_of(key));
+		if (index == npos) {
+			return false;
+		}
+
+		slots_[index].~slot();
+		count_--;
+
+		// A lookup stops at the first group with an empty slot, so no entry can be found by probing past this group if
+		// it has one already, and the slot can be made empty too.  Otherwise it has to be left marked as deleted.
+		if (match_empty(group_at(index / group_size))) {
+			set_control(index, ctrl_empty);
+			growth_left_++;
+		} else {
+			set_control(index, ctrl_deleted);
+		}
+
+		return true;
+	}
+
+	/**
+	 * @brief Removes every entry, but keeps the table for reuse.
+	 */
+	void clear()
+	{
+		for (size_t i = 0; i < capacity_; i++) {
+			if (is_full(control(i))) {
+				slots_[i].~slot();
+			}
+		}
+
+		if (capacity_) {
+			memops::memset(ctrl_, ctrl_empty, capacity_);
+		}
+
+		count_ = 0;
+		growth_left_ = max_load(capacity_);
+	}
+
+	bool try_get_value(const K &key, V &value) const
+	{
+		size_t index = find(key, hash_of(key));
+		if (index == npos) {
+			return false;
+		}
+
+		value = slots_[index].value;
+		return true;
+	}
+
+	/**
+	 * @brief Returns the value of the entry with the given key, or null if there isn't one.  The pointer is only good
+	 * until the map is next added to.
+	 */
+	V *get(const K &key)
+	{
+		size_t index = find(key, hash_of(key));
+		return index == npos ? nullptr : &slots_[index].value;
+	}
+
+	bool contains(const K &key) const { return find(key, hash_of(key)) != npos; }
+
+	size_t count() const { return count_; }
+	bool empty() const { return count_ == 0; }
+
+	/**
+	 * @brief Makes sure that at least n entries fit without the table growing.
+	 */
+	void reserve(size_t n)
+	{
+		if (n > count_ + growth_left_) {
+			size_t new_capacity = group_size;
+			while (max_load(new_capacity) < n) {
+				new_capacity *= 2;
+			}
+
+			rehash(new_capacity);
+		}
+	}
+
+	class iterator {
+	public:
+		iterator(const hash_map *map, size_t index)
+			: map_(map)
+			, index_(index)
+		{
+			skip_free();
+		}
+
+		iterator_pair operator*() const { return iterator_pair { map_->slots_[index_].key, map_->slots_[index_].value }; }
+
+		void operator++()
+		{
+			index_++;
+			skip_free();
+		}
+
+		bool operator==(const iterator &other) const { return index_ == other.index_; }
+		bool operator!=(const iterator &other) const { return index_ != other.index_; }
+
+	private:
+		const hash_map *map_;
+		size_t index_;
+
+		void skip_free()
+		{
+			while (index_ < map_->capacity_ && !is_full(map_->control(index_))) {
+				index_++;
+			}
+		}
+	};
+
+	/**
+	 * @brief Iterates over the entries, in no particular order.  The map must not be added to or removed from while
+	 * it is being iterated over.
+	 */
+	iterator begin() const { return iterator(this, 0); }
+	iterator end() const { return iterator(this, capacity_); }
+
+private:
+	struct slot {
+		K key;
+		V value;
+	};
+
+	static const size_t group_size = 8;
+	static const size_t npos = ~0ull;
+
+	static const u8 ctrl_empty = 0x80;
+	static const u8 ctrl_deleted = 0xfe;
+
+	static const u64 lsbs = 0x0101010101010101ull;
+	static const u64 msbs = 0x8080808080808080ull;
+
+	// There are capacity_ control bytes, which are read a group (i.e. a u64) at a time.
+	u64 *ctrl_;
+	slot *slots_;
+	size_t capacity_;
+	size_t count_;
+
+	// How many more entries can go into empty slots before the table has to be rehashed.
+	size_t growth_left_;
+
+	H hasher_;
+
+	static size_t max_load(size_t capacity) { return capacity - capacity / 8; }
+
+	/**
+	 * @brief Mixes the hash of a key, so that the low bits (which pick the group) and the high bits (which are kept in
+	 * the control byte) both depend on all of it.
+	 */
+	u64 hash_of(const K &key) const
+	{
+		u64 h = (u64)hasher_(key) * 0x9e3779b97f4a7c15ull;
+		return h ^ (h >> 32);
+	}
+
+	static u8 tag_of(u64 h) { return h >> 57; }
+
+	static bool is_full(u8 c) { return (c & 0x80) == 0; }
+
+	u8 control(size_t index) const { return ((const u8 *)ctrl_)[index]; }
+	void set_control(size_t index, u8 c) { ((u8 *)ctrl_)[index] = c; }
+
+	u64 group_at(size_t group) const { return ctrl_[group]; }
+
+	/**
+	 * @brief Returns a mask with the top bit set in every byte of the group that might hold the given tag.  There can
+	 * be false positives, but only on full slots, whose keys are compared anyway.
+	 */
+	static u64 match(u64 group, u8 tag)
+	{
+		u64 x = group ^ (lsbs * tag);
+		return (x - lsbs) & ~x & msbs;
+	}
+
+	static u64 match_empty(u64 group) { return group & (~group << 6) & msbs; }
+	static u64 match_empty_or_deleted(u64 group) { return group & (~group << 7) & msbs; }
+
+	static size_t first_in(u64 mask) { return __builtin_ctzll(mask) / 8; }
+
+	/**
+	 * @brief Returns the index of the slot holding the given key, or npos.  The groups are probed at triangular
+	 * offsets from the one the hash picks, which visits every group, as there is a power of two of them.
+	 */
+	size_t find(const K &key, u64 h) const
+	{
+		if (!capacity_) {
+			return npos;
+		}
+
+		size_t mask = capacity_ / group_size - 1;
+		size_t group = h & mask;
+		u8 tag = tag_of(h);
+
+		for (size_t step = 1;; step++) {
+			u64 g = group_at(group);
+
+			for (u64 m = match(g, tag); m; m &= m - 1) {
+				size_t index = group * group_size + first_in(m);
+				if (slots_[index].key == key) {
+					return index;
+				}
+			}
+
+			if (match_empty(g)) {
+				return npos;
+			}
+
+			group = (group + step) & mask;
+		}
+	}
+
+	/**
+	 * @brief Returns the index of the first empty or deleted slot along the probe sequence of the given hash.
+	 */
+	size_t find_free(u64 h) const
+	{
+		size_t mask = capacity_ / group_size - 1;
+		size_t group = h & mask;
+
+		for (size_t step = 1;; step++) {
+			u64 m = match_empty_or_deleted(group_at(group));
+			if (m) {
+				return group * group_size + first_in(m);
+			}
+
+			group = (group + step) & mask;
+		}
+	}
+
+	/**
+	 * @brief Moves every entry into a new table with the given capacity, which drops any deleted slots.
+	 */
+	void rehash(size_t new_capacity)
+	{
+		u64 *old_ctrl = ctrl_;
+		slot *old_slots = slots_;
+		size_t old_capacity = capacity_;
+
+		ctrl_ = new u64[new_capacity / group_size];
+		slots_ = (slot *)new u8[new_capacity * sizeof(slot)];
+		capacity_ = new_capacity;
+
+		memops::memset(ctrl_, ctrl_empty, new_capacity);
+		growth_left_ = max_load(new_capacity) - count_;
+
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (is_full(((const u8 *)old_ctrl)[i])) {
+				u64 h = hash_of(old_slots[i].key);
+				size_t index = find_free(h);
+
+				set_control(index, tag_of(h));
+				new (&slots_[index]) slot { move(old_slots[i].key), move(old_slots[i].value) };
+				old_slots[i].~slot();
+			}
+		}
+
+		delete[] old_ctrl;
+		delete[] (u8 *)old_slots;
+	}
+};
+} // namespace stacsos
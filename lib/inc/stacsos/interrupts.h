@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/**
+ * @brief Given to the set_affinity ioctl of /dev/interrupts: the device interrupt to move, by its number in the
+ * listing, and the core to move it to.
+ */
+struct irq_affinity_request {
+	u32 source;
+	u32 core;
+};
+
+// The ioctls understood by /dev/interrupts.  set_affinity takes an irq_affinity_request, and returns one if the
+// interrupt was moved.
+enum class interrupts_ioctl : u64 { set_affinity = 1 };
+} // namespace stacsos
@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/**
+ * @brief The link embedded in an object that is stored in an intrusive_list.  It must start out zeroed, which is how
+ * an object that isn't in a list is told apart from one that is.
+ */
+struct list_hook {
+	list_hook *prev;
+	list_hook *next;
+};
+
+/**
+ * @brief An intrusive doubly linked list of T, where each T embeds a list_hook at LINK.  Inserting and removing an
+ * element is O(1), and the list never allocates memory, so it can be used in places where calling the allocator is
+ * not allowed (e.g. with a scheduler lock held).  An element can be in at most one list through each of its hooks.
+ */
+template <class T, list_hook T::*LINK> class intrusive_list {
+	DELETE_DEFAULT_COPY_AND_MOVE(intrusive_list)
+
+public:
+	intrusive_list()
+		: count_(0)
+	{
+		head_.prev = &head_;
+		head_.next = &head_;
+	}
+
+	/**
+	 * @brief Whether an element is in a list through this hook, which may not be this list.
+	 */
+	static bool linked(const T &elem) { return (elem.*LINK).next != nullptr; }
+
+	void append(T &elem) { insert_before(&head_, &(elem.*LINK)); }
+	void push(T &elem) { insert_before(head_.next, &(elem.*LINK)); }
+
+	/**
+	 * @brief Inserts an element in front of another that is in this list, or at the end if that is null, e.g. to keep
+	 * the list sorted.
+	 */
+	void insert_before(T *pos, T &elem) { insert_before(pos ? &(pos->*LINK) : &head_, &(elem.*LINK)); }
+
+	void enqueue(T &elem) { append(elem); }
+
+	/**
+	 * @brief Removes an element, which must be in this list.
+	 */
+	void remove(T &elem)
+	{
+		list_hook *h = &(elem.*LINK);
+
+		h->prev->next = h->next;
+		h->next->prev = h->prev;
+		h->prev = nullptr;
+		h->next = nullptr;
+
+		count_--;
+	}
+
+	/**
+	 * @brief Removes and returns the first element, or null if the list is empty.
+	 */
+	T *dequeue()
+	{
+		T *elem = first();
+		if (elem) {
+			remove(*elem);
+		}
+
+		return elem;
+	}
+
+	T *pop() { return dequeue(); }
+
+	/**
+	 * @brief Moves the first element to the end of the list.
+	 */
+	void rotate()
+	{
+		if (count_ > 1) {
+			T *elem = first();
+			remove(*elem);
+			append(*elem);
+		}
+	}
+
+	/**
+	 * @brief Moves every element of another list on to the end of this one.
+	 */
+	void splice(intrusive_list &other)
+	{
+		if (other.empty()) {
+			return;
+		}
+
+		list_hook *first = other.head_.next;
+		list_hook *last = other.head_.prev;
+
+		first->prev = head_.prev;
+		head_.prev->next = first;
+		last->next = &head_;
+		head_.prev = last;
+
+		count_ += other.count_;
+
+		other.head_.prev = &other.head_;
+		other.head_.next = &other.head_;
+		other.count_ = 0;
+	}
+
+	T *first() const { return entry(head_.next); }
+	T *last() const { return entry(head_.prev); }
+
+	T *next(const T &elem) const { return entry((elem.*LINK).next); }
+	T *prev(const T &elem) const { return entry((elem.*LINK).prev); }
+
+	unsigned int count() const { return count_; }
+	bool empty() const { return count_ == 0; }
+
+	class iterator {
+	public:
+		iterator(const list_hook *current)
+			: current_(current)
+		{
+		}
+
+		T *operator*() const { return entry_of(current_); }
+
+		void operator++() { current_ = current_->next; }
+
+		bool operator==(const iterator &other) const { return current_ == other.current_; }
+		bool operator!=(const iterator &other) const { return current_ != other.current_; }
+
+	private:
+		const list_hook *current_;
+	};
+
+	/**
+	 * @brief Iterates over the elements in order.  The element the iterator is at must not be removed, so loops that
+	 * remove elements should walk the list with first() and next() instead.
+	 */
+	iterator begin() const { return iterator(head_.next); }
+	iterator end() const { return iterator(&head_); }
+
+private:
+	list_hook head_;
+	unsigned int count_;
+
+	void insert_before(list_hook *pos, list_hook *h)
+	{
+		h->prev = pos->prev;
+		h->next = pos;
+		pos->prev->next = h;
+		pos->prev = h;
+
+		count_++;
+	}
+
+	static T *entry_of(const list_hook *h)
+	{
+		const uintptr_t offset = (uintptr_t) & (((T *)0)->*LINK);
+		return (T *)((uintptr_t)h - offset);
+	}
+
+	T *entry(const list_hook *h) const { return h == &head_ ? nullptr : entry_of(h); }
+};
+} // namespace stacsos
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/syscalls.h>
+
+namespace stacsos {
+/*
+ * The layout of an I/O ring, which a process shares with the kernel.  The ring starts with an io_ring_header, which
+ * is followed by the submission queue entries and then the completion queue entries.  Both queues have the same
+ * number of entries, which is a power of two.
+ *
+ * The head and tail counters run freely, and are masked with entries - 1 to find a slot.  The process owns the
+ * submission tail and the completion head, and the kernel owns the other two.  Whoever writes a counter does so with
+ * release ordering, after filling in (or finishing with) the entries it covers.
+ */
+enum class io_ring_op : u32 { nop = 0, read = 1, write = 2, pread = 3, pwrite = 4, ioctl = 5 };
+
+// With polled, a kernel thread keeps picking up submissions as they are queued, so no system call is needed.  With
+// async, submissions are handed to kernel worker threads, so io_ring_enter doesn't wait for them to be carried out,
+// several can be waiting for the disk at once, and their completions may arrive in any order.
+enum class io_ring_flags : u64 { none = 0, polled = 1, async = 2 };
+
+DEFINE_ENUM_FLAG_OPERATIONS(io_ring_flags)
+
+// Set in sq_flags by a polled ring's kernel thread when it has gone to sleep, and needs io_ring_enter to wake it.
+static const u32 IO_RING_SQ_NEED_WAKEUP = 1;
+
+struct io_ring_sqe {
+	io_ring_op op;
+	u32 reserved;
+	u64 object;
+	u64 buffer;
+	u64 length;
+	u64 offset; // The file offset for pread and pwrite, or the command for ioctl.
+	u64 user_data; // Copied into the completion, untouched.
+};
+
+struct io_ring_cqe {
+	u64 user_data;
+	syscall_result_code code;
+	u64 result;
+	u64 reserved;
+};
+
+struct io_ring_header {
+	u32 sq_head;
+	u32 sq_tail;
+	u32 cq_head;
+	u32 cq_tail;
+	u32 entries;
+	u32 sq_flags;
+	u64 reserved[5];
+};
+
+/*
+ * Passed to io_ring_setup.  The kernel fills in the address that the ring has been mapped at.
+ */
+struct io_ring_params {
+	u32 entries;
+	u32 reserved;
+	io_ring_flags flags;
+	u64 ring_address;
+};
+
+static inline u64 io_ring_size(u32 entries) { return sizeof(io_ring_header) + (entries * (sizeof(io_ring_sqe) + sizeof(io_ring_cqe))); }
+static inline io_ring_sqe *io_ring_sqes(io_ring_header *hdr) { return (io_ring_sqe *)(hdr + 1); }
+static inline io_ring_cqe *io_ring_cqes(io_ring_header *hdr) { return (io_ring_cqe *)(io_ring_sqes(hdr) + hdr->entries); }
+} // namespace stacsos
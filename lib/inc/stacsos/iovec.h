@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/*
+ * One piece of a scatter/gather list, as passed to the vectored read and write system calls.  The pieces are
+ * transferred in order, as if they were one contiguous buffer.
+ */
+struct iovec {
+	void *base;
+	u64 length;
+};
+
+// The longest list that a single vectored call accepts.
+static const u64 IOV_MAX = 1024;
+
+static inline u64 iovec_length(const iovec *iov, u64 count)
+{
+	u64 total = 0;
+	for (u64 i = 0; i < count; i++) {
+		total += iov[i].length;
+	}
+
+	return total;
+}
+} // namespace stacsos
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+// The ioctls understood by /dev/irqoff.  reset forgets the worst interrupts-disabled sections of every core.
+enum class irq_trace_ioctl : u64 { reset = 1 };
+} // namespace stacsos
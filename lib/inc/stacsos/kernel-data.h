@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/*
+ * A page of information that the kernel maps, read-only, at the same address in every process, so that it can be
+ * read without a system call.  None of it changes once the first process has started.
+ *
+ * The current core's ID isn't here, since it differs between cores: the kernel puts it in TSC_AUX instead, where
+ * rdtscp (or rdpid) can read it.
+ */
+static const u64 KERNEL_DATA_ADDRESS = 0x7fff'0000'0000ull;
+
+struct kernel_data {
+	u64 tsc_frequency; // Ticks per second.
+	u64 boot_tsc; // The timestamp counter at boot, i.e. time zero for the monotonic clock.
+	u64 wall_clock_base_ns; // The wall clock time at boot, in nanoseconds since the Unix epoch, from the RTC.
+	u32 nr_cores;
+	u32 reserved;
+};
+} // namespace stacsos
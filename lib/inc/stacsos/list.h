@@ -68,6 +68,7 @@ public:
 
 	list()
 		: elems_(nullptr)
+		, tail_(nullptr)
 		, count_(0)
 	{
 	}
@@ -76,6 +77,7 @@ public:
 
 	list(const self &r)
 		: elems_(nullptr)
+		, tail_(nullptr)
 		, count_(0)
 	{
 		for (const auto &elem : r) {
@@ -87,9 +89,11 @@ public:
 
 	list(self &&r)
 		: elems_(r.elems_)
+		, tail_(r.tail_)
 		, count_(r.count_)
 	{
 		r.elems_ = nullptr;
+		r.tail_ = nullptr;
 		r.count_ = 0;
 	}
 
@@ -105,23 +109,26 @@ public:
 
 	void append(elem const &elem)
 	{
-		node **slot = &elems_;
+		node *slot = new node(elem);
+		slot->next = nullptr;
 
-		while (*slot != nullptr) {
-			slot = &(*slot)->next;
+		if (tail_) {
+			tail_->next = slot;
+		} else {
+			elems_ = slot;
 		}
 
-		*slot = new node(elem);
-		(*slot)->next = nullptr;
-
+		tail_ = slot;
 		count_++;
 	}
 
 	void remove(elem const &elem)
 	{
 		node **slot = &elems_;
+		node *prev = nullptr;
 
 		while (*slot && (*slot)->data != elem) {
+			prev = *slot;
 			slot = &(*slot)->next;
 		}
 
@@ -129,6 +136,9 @@ public:
 			node *candidate = *slot;
 
 			*slot = candidate->next;
+			if (tail_ == candidate) {
+				tail_ = prev;
+			}
 
 			delete candidate;
 			count_--;
@@ -141,6 +151,9 @@ public:
 
 		elem ret = front->data;
 		elems_ = front->next;
+		if (!elems_) {
+			tail_ = nullptr;
+		}
 		delete front;
 		count_--;
 
@@ -154,6 +167,9 @@ public:
 		node *slot = new node(elem);
 		slot->next = elems_;
 		elems_ = slot;
+		if (!tail_) {
+			tail_ = slot;
+		}
 
 		count_++;
 	}
@@ -163,30 +179,19 @@ public:
 	elem rotate()
 	{
 		node *front = elems_;
-		elems_ = front->next;
-
-		node **slot = &elems_;
-		while (*slot != nullptr) {
-			slot = &(*slot)->next;
+		if (front != tail_) {
+			elems_ = front->next;
+			tail_->next = front;
+			tail_ = front;
+			front->next = nullptr;
 		}
 
-		*slot = front;
-		(*slot)->next = nullptr;
-
 		return front->data;
 	}
 
 	elem const &first() const { return elems_->data; }
 
-	elem const &last() const
-	{
-		node *last = elems_;
-		while (last->next) {
-			last = last->next;
-		}
-
-		return last->data;
-	}
+	elem const &last() const { return tail_->data; }
 
 	elem const &at(int index) const
 	{
@@ -223,6 +228,7 @@ public:
 		}
 
 		elems_ = nullptr;
+		tail_ = nullptr;
 		count_ = 0;
 	}
 
@@ -231,6 +237,7 @@ public:
 
 private:
 	node *elems_;
+	node *tail_; // The last node, so that appending doesn't have to walk the list.
 	int count_;
 };
 } // namespace stacsos
@@ -13,6 +13,7 @@ public:
 	static void bzero(void *ptr, size_t size) { memset(ptr, 0, size); }
 
 	static void pzero(void *ptr, size_t count) { bzero(ptr, count << PAGE_BITS); }
+	static void pzero_nt(void *ptr, size_t count) { pzero(ptr, count); }
 
 	static void *memset(void *dest, int c, size_t size)
 	{
@@ -40,7 +41,7 @@ public:
 	{
 		for (size_t i = 0; i < size; i++) {
 			if (((const u8 *)a)[i] != ((const u8 *)b)[i]) {
-				return -1;
+				return (int)((const u8 *)a)[i] - (int)((const u8 *)b)[i];
 			}
 		}
 
@@ -58,10 +59,37 @@ public:
 	}
 
 	static void *strncpy(char *dest, const char *src, size_t length) { return memcpy(dest, src, strlen(src)); }
+
+	static int strcmp(const char *str1, const char *str2)
+	{
+		while (*str1 && *str1 == *str2) {
+			str1++;
+			str2++;
+		}
+
+		return (int)(u8)*str1 - (int)(u8)*str2;
+	}
+};
+
+/**
+ * @brief The CPU features that the native memops can make use of.  Until some are selected, only those that every
+ * x86-64 CPU has are used.
+ */
+enum class memops_features : u32 {
+	none = 0,
+	// Enhanced REP MOVSB/STOSB, for medium-sized copies and clears.
+	erms = 1,
+	// AVX2, for small copies and comparisons.  Only for code whose vector registers are saved when it is switched out.
+	avx2 = 2,
 };
 
+static inline memops_features operator|(memops_features a, memops_features b) { return (memops_features)((u32)a | (u32)b); }
+
+extern "C" u32 __x86_memops_features;
+
 extern "C" void __x86_bzero(void *, size_t);
 extern "C" void __x86_pzero(void *, size_t);
+extern "C" void __x86_pzero_nt(void *, size_t);
 extern "C" void *__x86_memset(void *, int, size_t);
 extern "C" void *__x86_memcpy(void *, const void *, size_t);
 extern "C" int __x86_memcmp(const void *, const void *, size_t);
@@ -72,10 +100,15 @@ extern "C" int __x86_strcmp(const char *, const char *);
 class native_memops {
 
 public:
+	static void select_features(memops_features features) { __x86_memops_features = (u32)features; }
+
 	static void bzero(void *ptr, size_t size) { __x86_bzero(ptr, size); }
 
 	static void pzero(void *ptr, size_t count) { return __x86_pzero(ptr, count); }
 
+	// Clears pages without filling the cache with them, for memory that won't be used straight away.
+	static void pzero_nt(void *ptr, size_t count) { return __x86_pzero_nt(ptr, count); }
+
 	static void *memset(void *dest, int c, size_t size) { return __x86_memset(dest, c, size); }
 
 	static void *memcpy(void *dest, const void *src, size_t size) { return __x86_memcpy(dest, src, size); }
@@ -90,9 +123,107 @@ public:
 };
 
 template <class Impl> class memops_carrier {
+	// The biggest copy or fill that is expanded inline, as at most sixteen moves.
+	static const size_t max_inline_size = 128;
+
+	template <class W> static void move(u8 *dest, const u8 *src)
+	{
+		W w;
+		__builtin_memcpy(&w, src, sizeof(W));
+		__builtin_memcpy(dest, &w, sizeof(W));
+	}
+
+	template <class W> static void store(u8 *dest, W w) { __builtin_memcpy(dest, &w, sizeof(W)); }
+
+	/**
+	 * @brief Copies size bytes with the widest moves that fit, where a size that isn't a multiple of the width is
+	 * finished with one more move that overlaps the one before, rather than with narrower ones.
+	 */
+	template <size_t size> static void copy_inline(u8 *dest, const u8 *src)
+	{
+		if constexpr (size >= 8) {
+#pragma GCC unroll 16
+			for (size_t i = 0; i + 8 <= size; i += 8) {
+				move<u64>(dest + i, src + i);
+			}
+
+			if constexpr (size % 8) {
+				move<u64>(dest + size - 8, src + size - 8);
+			}
+		} else if constexpr (size >= 4) {
+			move<u32>(dest, src);
+			if constexpr (size > 4) {
+				move<u32>(dest + size - 4, src + size - 4);
+			}
+		} else if constexpr (size >= 2) {
+			move<u16>(dest, src);
+			if constexpr (size > 2) {
+				move<u16>(dest + size - 2, src + size - 2);
+			}
+		} else if constexpr (size == 1) {
+			*dest = *src;
+		}
+	}
+
+	template <size_t size> static void fill_inline(u8 *dest, u8 c)
+	{
+		u64 pattern = 0x0101010101010101ull * c;
+
+		if constexpr (size >= 8) {
+#pragma GCC unroll 16
+			for (size_t i = 0; i + 8 <= size; i += 8) {
+				store<u64>(dest + i, pattern);
+			}
+
+			if constexpr (size % 8) {
+				store<u64>(dest + size - 8, pattern);
+			}
+		} else if constexpr (size >= 4) {
+			store<u32>(dest, pattern);
+			if constexpr (size > 4) {
+				store<u32>(dest + size - 4, pattern);
+			}
+		} else if constexpr (size >= 2) {
+			store<u16>(dest, pattern);
+			if constexpr (size > 2) {
+				store<u16>(dest + size - 2, pattern);
+			}
+		} else if constexpr (size == 1) {
+			*dest = c;
+		}
+	}
+
 public:
+	/**
+	 * @brief Copies a number of bytes known at compile time.  Small copies are expanded inline into a few (possibly
+	 * unaligned) moves, rather than calling memcpy, which has to work out what to do with the size first.
+	 */
+	template <size_t size> static void copy(void *dest, const void *src)
+	{
+		if constexpr (size > max_inline_size) {
+			Impl::memcpy(dest, src, size);
+		} else {
+			copy_inline<size>((u8 *)dest, (const u8 *)src);
+		}
+	}
+
+	/**
+	 * @brief Sets a number of bytes known at compile time to a value, in the same way as copy.
+	 */
+	template <size_t size> static void fill(void *dest, int c)
+	{
+		if constexpr (size > max_inline_size) {
+			Impl::memset(dest, c, size);
+		} else {
+			fill_inline<size>((u8 *)dest, (u8)c);
+		}
+	}
+
+	template <size_t size> static void zero(void *dest) { fill<size>(dest, 0); }
+
 	static void bzero(void *ptr, size_t size) { Impl::bzero(ptr, size); }
 	static void pzero(void *ptr, size_t count) { Impl::pzero(ptr, count); }
+	static void pzero_nt(void *ptr, size_t count) { Impl::pzero_nt(ptr, count); }
 
 	static void *memcpy(void *dest, const void *src, size_t size) { return Impl::memcpy(dest, src, size); }
 	static void *memset(void *dest, int c, size_t size) { return Impl::memset(dest, c, size); }
@@ -68,41 +68,136 @@ private:
 
 template <class T, class... U> unique_ptr<T> make_unique(U &&...u) { return unique_ptr<T>(new T(forward<U>(u)...)); }
 
+/**
+ * @brief The reference count of an object owned by shared_ptrs, and how to get rid of the object once the last of them
+ * lets go.  The count is updated atomically, so shared_ptrs to the same object can be copied and dropped on different
+ * cores at once.
+ */
+struct shared_ptr_control {
+	u64 refs;
+	void (*dispose)(shared_ptr_control *control);
+
+	// Taking a reference needs no ordering, as whoever takes it already has one.  Dropping one has to make everything
+	// done through it visible to whoever disposes of the object.
+	void acquire() { __atomic_fetch_add(&refs, 1, __ATOMIC_RELAXED); }
+
+	/**
+	 * @brief Takes a reference to an object found without holding one, unless its count has already dropped to zero,
+	 * i.e. it is on its way to being disposed of.
+	 */
+	bool try_acquire()
+	{
+		u64 current = __atomic_load_n(&refs, __ATOMIC_RELAXED);
+
+		do {
+			if (!current) {
+				return false;
+			}
+		} while (!__atomic_compare_exchange_n(&refs, &current, current + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+		return true;
+	}
+
+	void release()
+	{
+		if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) {
+			dispose(this);
+		}
+	}
+
+	u64 use_count() const { return __atomic_load_n(&refs, __ATOMIC_RELAXED); }
+};
+
+/**
+ * @brief A base class for objects that keep their own reference count, so that a shared_ptr to one needs no separate
+ * control block, and a new shared_ptr can be made from a plain pointer to it at any time.  The object is deleted as a T
+ * when the last shared_ptr to it goes.
+ */
+template <class T> class ref_counted : public shared_ptr_control {
+protected:
+	ref_counted()
+		: shared_ptr_control { 0, [](shared_ptr_control *control) { delete static_cast<T *>(static_cast<ref_counted *>(control)); } }
+	{
+	}
+
+	// A copy of an object is a different object, with no references to it yet.
+	ref_counted(const ref_counted &)
+		: ref_counted()
+	{
+	}
+
+	ref_counted &operator=(const ref_counted &) { return *this; }
+};
+
+/**
+ * @brief The control block for an object that was allocated on its own, and is deleted through the pointer it was
+ * given as.
+ */
+template <class T> struct shared_ptr_pointer_control : shared_ptr_control {
+	shared_ptr_pointer_control(T *ptr)
+		: shared_ptr_control { 0,
+			[](shared_ptr_control *control) {
+				auto *self = static_cast<shared_ptr_pointer_control *>(control);
+				delete self->ptr;
+				delete self;
+			} }
+		, ptr(ptr)
+	{
+	}
+
+	T *ptr;
+};
+
+/**
+ * @brief The control block made by make_shared, with the object itself straight after it, in the same allocation.
+ */
+template <class T> struct shared_ptr_inplace_control : shared_ptr_control {
+	shared_ptr_inplace_control()
+		: shared_ptr_control { 0,
+			[](shared_ptr_control *control) {
+				auto *self = static_cast<shared_ptr_inplace_control *>(control);
+				self->object()->~T();
+				delete self;
+			} }
+	{
+	}
+
+	T *object() { return (T *)storage; }
+
+	alignas(T) u8 storage[sizeof(T)];
+};
+
 template <class T> class shared_ptr {
 public:
 	using element_type = T;
 
 	explicit shared_ptr()
 		: ptr_(nullptr)
-		, refcount_(nullptr)
+		, control_(nullptr)
 	{
 	}
 
 	shared_ptr(decltype(nullptr))
 		: ptr_(nullptr)
-		, refcount_(nullptr)
+		, control_(nullptr)
 	{
 	}
 
 	// Construct from pointer
 	explicit shared_ptr(T *ptr)
 		: ptr_(ptr)
-		, refcount_(nullptr)
+		, control_(ptr ? control_for(ptr) : nullptr)
 	{
-		if (ptr) {
-			acquire();
-		}
+		acquire();
 	}
 
 	// Construct from casted pointer
 	template <class U>
 	explicit shared_ptr(U *ptr)
 		: ptr_((T *)ptr)
-		, refcount_(nullptr)
+		, control_(ptr ? control_for(ptr) : nullptr)
 	{
-		if (ptr) {
-			acquire();
-		}
+		acquire();
 	}
 
 	// Destroy
@@ -112,7 +207,7 @@ public:
 	template <class U>
 	shared_ptr(const shared_ptr<U> &other)
 		: ptr_(other.ptr_)
-		, refcount_(other.refcount_)
+		, control_(other.control_)
 	{
 		acquire();
 	}
@@ -120,7 +215,7 @@ public:
 	// Copy constructor
 	shared_ptr(const shared_ptr<T> &other)
 		: ptr_(other.ptr_)
-		, refcount_(other.refcount_)
+		, control_(other.control_)
 	{
 		acquire();
 	}
@@ -134,21 +229,14 @@ public:
 
 	shared_ptr<T> &operator=(shared_ptr<T> other)
 	{
-		swap(*this, other);
-
-		acquire();
-		return *this;
-	}
-
-	shared_ptr<T> &operator=(shared_ptr<T> &&other)
-	{
+		// The argument was copied or moved into, so it already holds a reference, which is now this one's.
 		swap(*this, other);
 		return *this;
 	}
 
-	operator bool() const { return use_count() > 0; }
+	operator bool() const { return control_ != nullptr; }
 	bool unique() const { return use_count() == 1; }
-	u64 use_count() const { return refcount_ == nullptr ? 0 : *refcount_; }
+	u64 use_count() const { return control_ == nullptr ? 0 : control_->use_count(); }
 
 	T &operator*() { return *ptr_; }
 
@@ -161,44 +249,70 @@ public:
 
 	T *get(void) const { return ptr_; }
 
+	bool operator==(const shared_ptr<T> &other) const { return ptr_ == other.ptr_; }
+	bool operator!=(const shared_ptr<T> &other) const { return ptr_ != other.ptr_; }
+
 	friend void swap(shared_ptr &a, shared_ptr &b) noexcept
 	{
 		swap(a.ptr_, b.ptr_);
-		swap(a.refcount_, b.refcount_);
+		swap(a.control_, b.control_);
 	}
 
 private:
-	void acquire()
+	shared_ptr(T *ptr, shared_ptr_control *control)
+		: ptr_(ptr)
+		, control_(control)
+	{
+		acquire();
+	}
+
+	/**
+	 * @brief Returns the control block for a newly shared object, which is the object itself if it keeps its own
+	 * reference count.
+	 */
+	template <class U> static shared_ptr_control *control_for(U *ptr)
 	{
-		if (refcount_ == nullptr) {
-			refcount_ = new u64(1);
+		if constexpr (__is_base_of(shared_ptr_control, U)) {
+			return static_cast<shared_ptr_control *>(ptr);
 		} else {
-			(*refcount_)++;
+			return new shared_ptr_pointer_control<U>(ptr);
+		}
+	}
+
+	void acquire()
+	{
+		if (control_ != nullptr) {
+			control_->acquire();
 		}
 	}
 
 	void release()
 	{
-		if (refcount_ != nullptr) {
-			(*refcount_)--;
-			if (*refcount_ == 0) {
-				if (ptr_ != nullptr) {
-					(void)sizeof(T);
-					delete ptr_;
-					ptr_ = nullptr;
-				}
-
-				delete refcount_;
-				refcount_ = nullptr;
-			}
+		if (control_ != nullptr) {
+			control_->release();
+			control_ = nullptr;
+			ptr_ = nullptr;
 		}
 	}
 
 	template <class U> friend class shared_ptr;
+	template <class U, class... A> friend shared_ptr<U> make_shared(A &&...a);
 
 	T *ptr_;
-	u64 *refcount_;
+	shared_ptr_control *control_;
 };
 
-template <class T, class... U> shared_ptr<T> make_shared(U &&...u) { return shared_ptr<T>(new T(forward<U>(u)...)); }
+/**
+ * @brief Creates an object owned by a shared_ptr.  Unless the object keeps its own reference count, it is allocated
+ * together with its control block, so this is a single allocation rather than two.
+ */
+template <class T, class... U> shared_ptr<T> make_shared(U &&...u)
+{
+	if constexpr (__is_base_of(shared_ptr_control, T)) {
+		return shared_ptr<T>(new T(forward<U>(u)...));
+	} else {
+		auto *control = new shared_ptr_inplace_control<T>();
+		return shared_ptr<T>(new (control->storage) T(forward<U>(u)...), control);
+	}
+}
 } // namespace stacsos
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/atomic.h>
+
+namespace stacsos {
+/**
+ * @brief A fixed-size first-in first-out queue that any number of threads can push to and pop from at once, without
+ * locks (Dmitry Vyukov's bounded MPMC queue).  Each slot has a sequence number that says whose turn it is: a producer
+ * claims the slot at the tail when its sequence matches the tail, and a consumer claims the slot at the head when its
+ * sequence is one past the head.  Claiming a slot is a single compare-and-swap, and producers and consumers only
+ * contend with each other when the queue is nearly empty or nearly full.
+ */
+template <class T, u32 Capacity> class mpmc_queue {
+	static_assert(Capacity >= 2 && !(Capacity & (Capacity - 1)), "the capacity of a queue must be a power of two");
+
+public:
+	static const u32 capacity = Capacity;
+
+	mpmc_queue()
+	{
+		for (u32 i = 0; i < Capacity; i++) {
+			slots_[i].seq.store(i, memory_order::relaxed);
+		}
+	}
+
+	/**
+	 * @brief Adds a value to the tail.  Returns false if the queue is full.
+	 */
+	bool try_push(const T &value)
+	{
+		u64 pos = tail_.value.load(memory_order::relaxed);
+		slot *s;
+
+		while (true) {
+			s = &slots_[pos & (Capacity - 1)];
+			s64 diff = (s64)s->seq.load(memory_order::acquire) - (s64)pos;
+
+			if (diff == 0) {
+				if (tail_.value.compare_exchange_weak(pos, pos + 1, memory_order::relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// The slot still holds the value from a lap ago.
+				return false;
+			} else {
+				pos = tail_.value.load(memory_order::relaxed);
+			}
+		}
+
+		s->value = value;
+		s->seq.store(pos + 1, memory_order::release);
+		return true;
+	}
+
+	/**
+	 * @brief Takes the value at the head.  Returns false if the queue is empty.
+	 */
+	bool try_pop(T &value)
+	{
+		u64 pos = head_.value.load(memory_order::relaxed);
+		slot *s;
+
+		while (true) {
+			s = &slots_[pos & (Capacity - 1)];
+			s64 diff = (s64)s->seq.load(memory_order::acquire) - (s64)(pos + 1);
+
+			if (diff == 0) {
+				if (head_.value.compare_exchange_weak(pos, pos + 1, memory_order::relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// The slot hasn't been filled yet.
+				return false;
+			} else {
+				pos = head_.value.load(memory_order::relaxed);
+			}
+		}
+
+		value = s->value;
+
+		// The slot is handed to the producer that will fill it on the next lap.
+		s->seq.store(pos + Capacity, memory_order::release);
+		return true;
+	}
+
+private:
+	struct slot {
+		atomic<u64> seq;
+		T value;
+	};
+
+	cache_padded<atomic<u64>> tail_;
+	cache_padded<atomic<u64>> head_;
+	slot slots_[Capacity];
+};
+} // namespace stacsos
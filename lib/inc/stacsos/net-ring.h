@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/syscalls.h>
+
+namespace stacsos {
+/*
+ * The layout of a network device's packet ring, which a process maps (from offset zero of an open network device,
+ * e.g. /dev/net0) to send and receive packets without a system call for each one.  The packets are received into, and
+ * sent from, the mapped buffers themselves, so they are never copied.
+ *
+ * The mapping starts with a net_ring_header, followed by the receive ring and then the transmit ring.  The receive
+ * buffers and the transmit area follow, each starting on a page boundary, at the offsets given by net_ring_info.
+ *
+ * As with an I/O ring, the counters run freely, and are masked with the ring's entries - 1 to find a slot, and whoever
+ * writes a counter does so with release ordering, after filling in (or finishing with) the entries it covers.
+ *
+ * Receiving: the kernel fills in an entry for each packet, with the offset of its receive buffer in the mapping, and
+ * advances rx_tail.  The process advances rx_head once it has finished with the packets, which hands their buffers
+ * back to the device.
+ *
+ * Sending: the process writes each packet somewhere in the transmit area, fills in an entry with its offset and
+ * length, and advances tx_tail.  The kernel takes the entries (advancing tx_head) when the ring is entered, and
+ * advances tx_done once the device has sent them, after which the process may reuse the entries and their memory.
+ *
+ * Every packet, in either direction, starts with a net_packet_header.
+ */
+
+// The commands that may be issued (with ioctl) on an open network device.  net_ioctl_info fills in a net_ring_info.
+// net_ioctl_enter hands the packets to be sent, and the finished receive buffers, to the device, and then waits until
+// at least as many received packets are waiting as the u32 in its buffer says, returning how many there are.
+static const u64 net_ioctl_info = 1;
+static const u64 net_ioctl_enter = 2;
+
+// The offloads the device has agreed to, in net_ring_info::offloads.
+static const u32 NET_OFFLOAD_TX_CSUM = 1; // Packets sent may leave a checksum to the device (NET_HDR_F_NEEDS_CSUM).
+static const u32 NET_OFFLOAD_RX_CSUM = 2; // Packets received may have been checked by the device (NET_HDR_F_DATA_VALID).
+static const u32 NET_OFFLOAD_TSO4 = 4; // TCP over IPv4 may be sent in segments of up to 64 KiB.
+static const u32 NET_OFFLOAD_TSO6 = 8; // As for TSO4, over IPv6.
+
+// The header in front of every packet, which is laid out as virtio-net's, as that is the only device there is.  For a
+// packet that is sent, it asks for a checksum to be filled in, from csum_start to the end of the packet, and stored at
+// csum_start + csum_offset, and for a large TCP segment to be cut into pieces of gso_size.
+#define NET_HDR_F_NEEDS_CSUM 1
+#define NET_HDR_F_DATA_VALID 2
+
+#define NET_HDR_GSO_NONE 0
+#define NET_HDR_GSO_TCPV4 1
+#define NET_HDR_GSO_TCPV6 4
+
+struct net_packet_header {
+	u8 flags;
+	u8 gso_type;
+	u16 hdr_len;
+	u16 gso_size;
+	u16 csum_start;
+	u16 csum_offset;
+	u16 num_buffers;
+} __packed;
+
+struct net_ring_entry {
+	u32 offset; // Of the packet's header, from the start of the mapping.
+	u32 length; // Including the header.
+};
+
+struct net_ring_header {
+	u32 rx_head;
+	u32 rx_tail;
+	u32 tx_head;
+	u32 tx_done;
+	u32 tx_tail;
+	u32 reserved;
+	u64 rx_dropped; // Packets that arrived while the receive ring was full.
+	u64 reserved2[4];
+};
+
+struct net_ring_info {
+	u8 mac[6];
+	u16 mtu;
+	u32 offloads;
+	u32 queue; // The queue pair the device was opened on.
+	u32 rx_entries;
+	u32 tx_entries;
+	u32 rx_buffer_size; // The size of each receive buffer, including the header.
+	u32 reserved;
+	u64 rx_area_offset;
+	u64 tx_area_offset;
+	u64 tx_area_size;
+	u64 size; // Of the whole mapping.
+};
+
+static inline net_ring_entry *net_ring_rx_entries(net_ring_header *hdr) { return (net_ring_entry *)(hdr + 1); }
+static inline net_ring_entry *net_ring_tx_entries(net_ring_header *hdr, u32 rx_entries) { return net_ring_rx_entries(hdr) + rx_entries; }
+} // namespace stacsos
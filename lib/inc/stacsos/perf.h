@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+enum class perf_event : u32 { cycles = 0, instructions = 1, cache_misses = 2, branch_misses = 3 };
+
+enum class perf_flags : u32 {
+	none = 0,
+
+	// Only count events in user mode, and not in the system calls the thread makes.
+	user_only = 1,
+
+	// Let the thread read its counters itself, with rdpmc, while it is running.
+	user_rdpmc = 2,
+};
+
+DEFINE_ENUM_FLAG_OPERATIONS(perf_flags)
+
+static const unsigned int perf_max_events = 4;
+
+/**
+ * @brief Given to the configure ioctl of /dev/perf, which fills in the second half.
+ */
+struct perf_config {
+	u32 nr_events;
+	perf_flags flags;
+	perf_event events[perf_max_events];
+
+	// The counter to give rdpmc for each event, and how many bits wide the counters are.
+	u32 rdpmc_index[perf_max_events];
+	u32 width;
+
+	// Whether a counter keeps its full value across context switches, so that rdpmc can be used to time a region that
+	// the thread is switched out in the middle of.  Otherwise, only the read ioctl gives the right count.
+	u32 rdpmc_exact;
+};
+
+// The ioctls understood by /dev/perf, which all act on the calling thread's counters.  configure takes a perf_config,
+// and starts counting its events from zero.  read fills its buffer with a u64 count for each event.  reset sets the
+// counts back to zero, and disable stops counting.
+enum class perf_ioctl : u64 { configure = 1, read = 2, reset = 3, disable = 4 };
+} // namespace stacsos
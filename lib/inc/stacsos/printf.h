@@ -8,7 +8,7 @@
 #pragma once
 
 namespace stacsos {
-extern int sprintf(char *buffer, const char *fmt, ...);
-extern int snprintf(char *buffer, int size, const char *fmt, ...);
-extern int vsnprintf(char *buffer, int size, const char *fmt, va_list args);
+extern int sprintf(char *buffer, const char *fmt, ...) __printf_format(2, 3);
+extern int snprintf(char *buffer, int size, const char *fmt, ...) __printf_format(3, 4);
+extern int vsnprintf(char *buffer, int size, const char *fmt, va_list args) __printf_format(3, 0);
 } // namespace stacsos
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/*
+ * The handles a process reads its input from, and writes its output to.  A handle of zero means the console.
+ */
+struct process_streams {
+	u64 input;
+	u64 output;
+};
+
+// The most handles, other than its streams, that a process can be given when it is started.
+static const u64 SPAWN_MAX_HANDLES = 16;
+
+// With wait, spawn only returns once the new process has finished, and gives back no handle to it.  With new_group, the
+// new process starts a resource group of its own, nested in the caller's, which the processes it starts then join.
+enum class spawn_flags : u64 { none = 0, wait = 1, new_group = 2 };
+
+DEFINE_ENUM_FLAG_OPERATIONS(spawn_flags)
+
+/*
+ * How spawn starts a process: its streams, and the other handles it inherits, which must all be shareable.  The new
+ * process gets its own copy of each handle, and finds them in its start info, in the same order.
+ */
+struct spawn_params {
+	process_streams streams;
+	spawn_flags flags;
+	u64 nr_handles;
+	u64 handles[SPAWN_MAX_HANDLES];
+};
+
+/*
+ * Where a program's thread-local variables are laid out, from its PT_TLS segment.  Each thread gets its own copy of the
+ * image, followed by size - image_size bytes of zeroes.  A size of zero means the program has none.
+ */
+struct process_tls {
+	u64 image;
+	u64 image_size;
+	u64 size;
+	u64 align;
+};
+
+// With zygote, the process is a template for starting its program quickly: it sets itself up as far as it can without
+// its arguments, and then hands the kernel the entry point that its copies start at, rather than running main.
+enum class process_start_flags : u64 { none = 0, zygote = 1 };
+
+DEFINE_ENUM_FLAG_OPERATIONS(process_start_flags)
+
+/*
+ * What a new process is started with, in a read-only page: its streams and inherited handles, as handles in its own
+ * object table, where its thread-local variables are, and its (null-terminated) arguments.
+ */
+struct process_start_info {
+	process_streams streams;
+	u64 nr_handles;
+	u64 handles[SPAWN_MAX_HANDLES];
+	process_tls tls;
+	process_start_flags flags;
+	char args[PAGE_SIZE - sizeof(process_streams) - ((SPAWN_MAX_HANDLES + 2) * sizeof(u64)) - sizeof(process_tls)];
+};
+} // namespace stacsos
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+// The ioctls understood by /dev/profile.  start takes a u64 sampling rate in Hz in its buffer, throws away any samples
+// already taken, and starts sampling every core at that rate.  stop stops sampling, keeping the samples to be read.
+enum class profile_ioctl : u64 { start = 1, stop = 2 };
+} // namespace stacsos
@@ -0,0 +1,429 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/helpers.h>
+#include <stacsos/memops.h>
+
+namespace stacsos {
+/**
+ * @brief A sparse map from 64-bit indices to pointers, kept in a tree of 64-way nodes, each level of which takes six
+ * bits of the index, in the style of Linux's radix tree.  Looking an entry up is one load per level, and the tree is
+ * only as tall as the biggest index in it needs.  Null can't be stored, as it means there is no entry.
+ *
+ * Each entry can be given any of nr_tags tags (e.g. dirty, or under writeback), and every node keeps a bitmap of the
+ * entries it holds, and one of those below it with each tag, so that the tagged entries can be found without looking
+ * at any others.
+ *
+ * Changes must be serialised by the caller, but lookups and searches only ever load what the tree publishes with
+ * release stores, so they can run at the same time as a change, e.g. under RCU.  A tree made with deferred_free keeps
+ * the nodes that changes leave empty until free_retired is called, which must be once no search can still be in them.
+ */
+template <class T, unsigned int nr_tags = 2> class radix_tree {
+	DELETE_DEFAULT_COPY_AND_MOVE(radix_tree)
+
+	static const unsigned int bits_per_level = 6;
+	static const unsigned int fanout = 1u << bits_per_level;
+
+	struct node {
+		node(node *parent, unsigned int shift, unsigned int offset)
+			: parent(parent)
+			, shift(shift)
+			, offset(offset)
+			, present(0)
+			, retired_next(nullptr)
+		{
+			memops::bzero(slots, sizeof(slots));
+			memops::bzero(tags, sizeof(tags));
+		}
+
+		node *parent;
+		unsigned int shift, offset;
+
+		// Bit n of present is set if slot n holds an entry (or, above the bottom level, a node), and of tags[t] if the
+		// entry, or any entry beneath the node, has tag t.
+		u64 present;
+		u64 tags[nr_tags];
+		void *slots[fanout];
+
+		node *retired_next;
+	};
+
+public:
+	radix_tree(bool deferred_free = false)
+		: root_(nullptr)
+		, count_(0)
+		, deferred_free_(deferred_free)
+		, retired_(nullptr)
+	{
+	}
+
+	~radix_tree()
+	{
+		clear();
+		free_retired();
+	}
+
+	/**
+	 * @brief Returns the entry at the given index, or null if there isn't one.
+	 */
+	T *lookup(u64 index) const
+	{
+		node *n = load(root_);
+		if (!n || index > max_index(n->shift)) {
+			return nullptr;
+		}
+
+		while (true) {
+			void *slot = load(n->slots[slot_of(n, index)]);
+			if (!slot || n->shift == 0) {
+				return (T *)slot;
+			}
+
+			n = (node *)slot;
+		}
+	}
+
+	/**
+	 * @brief Adds an entry, returning false if there already is one at the index.
+	 */
+	bool insert(u64 index, T *item)
+	{
+		if (!root_) {
+			unsigned int shift = 0;
+			while (index > max_index(shift)) {
+				shift += bits_per_level;
+			}
+
+			store(root_, new node(nullptr, shift, 0));
+		}
+
+		// The tree grows upwards, with the old root becoming the first child of the new one.
+		while (index > max_index(root_->shift)) {
+			node *old_root = root_;
+			node *new_root = new node(nullptr, old_root->shift + bits_per_level, 0);
+
+			new_root->slots[0] = old_root;
+			new_root->present = 1;
+			for (unsigned int t = 0; t < nr_tags; t++) {
+				new_root->tags[t] = old_root->tags[t] ? 1 : 0;
+			}
+
+			old_root->parent = new_root;
+			store(root_, new_root);
+		}
+
+		node *n = root_;
+		while (n->shift) {
+			unsigned int offset = slot_of(n, index);
+
+			if (!n->slots[offset]) {
+				store(n->slots[offset], (void *)new node(n, n->shift - bits_per_level, offset));
+				store(n->present, n->present | (1ull << offset));
+			}
+
+			n = (node *)n->slots[offset];
+		}
+
+		unsigned int offset = slot_of(n, index);
+		if (n->slots[offset]) {
+			return false;
+		}
+
+		store(n->slots[offset], (void *)item);
+		store(n->present, n->present | (1ull << offset));
+		count_++;
+
+		return true;
+	}
+
+	/**
+	 * @brief Removes the entry at the given index, and returns it, or null if there wasn't one.  Any nodes left empty
+	 * are freed, or retired, with deferred_free.
+	 */
+	T *remove(u64 index)
+	{
+		node *n = leaf_of(index);
+		if (!n) {
+			return nullptr;
+		}
+
+		unsigned int offset = slot_of(n, index);
+		T *item = (T *)n->slots[offset];
+		if (!item) {
+			return nullptr;
+		}
+
+		for (unsigned int t = 0; t < nr_tags; t++) {
+			clear_tag_in(n, offset, t);
+		}
+
+		store(n->slots[offset], nullptr);
+		store(n->present, n->present & ~(1ull << offset));
+		count_--;
+
+		// Empty nodes are unlinked from the bottom up, and the root goes once the tree is empty.
+		while (n && !n->present) {
+			node *parent = n->parent;
+
+			if (parent) {
+				store(parent->slots[n->offset], nullptr);
+				store(parent->present, parent->present & ~(1ull << n->offset));
+			} else {
+				store(root_, nullptr);
+			}
+
+			retire(n);
+			n = parent;
+		}
+
+		return item;
+	}
+
+	/**
+	 * @brief Gives the entry at the given index a tag, returning false if there is no entry.
+	 */
+	bool set_tag(u64 index, unsigned int tag)
+	{
+		node *n = leaf_of(index);
+		if (!n || !n->slots[slot_of(n, index)]) {
+			return false;
+		}
+
+		unsigned int offset = slot_of(n, index);
+		while (n) {
+			if (n->tags[tag] & (1ull << offset)) {
+				break;
+			}
+
+			store(n->tags[tag], n->tags[tag] | (1ull << offset));
+
+			offset = n->offset;
+			n = n->parent;
+		}
+
+		return true;
+	}
+
+	void clear_tag(u64 index, unsigned int tag)
+	{
+		node *n = leaf_of(index);
+		if (n) {
+			clear_tag_in(n, slot_of(n, index), tag);
+		}
+	}
+
+	bool get_tag(u64 index, unsigned int tag) const
+	{
+		node *n = leaf_of(index);
+		return n && (load(n->tags[tag]) & (1ull << slot_of(n, index)));
+	}
+
+	/**
+	 * @brief Returns whether any entry has the given tag.
+	 */
+	bool tagged(unsigned int tag) const
+	{
+		node *n = load(root_);
+		return n && load(n->tags[tag]);
+	}
+
+	/**
+	 * @brief Returns the first entry at or after the given index, and its index, or null if there are none.
+	 */
+	T *find_next(u64 start, u64 &index) const { return search(start, index, nr_tags); }
+
+	/**
+	 * @brief Returns the first entry at or after the given index with the given tag, and its index, or null if there
+	 * are none.
+	 */
+	T *find_next_tagged(u64 start, unsigned int tag, u64 &index) const { return search(start, index, tag); }
+
+	/**
+	 * @brief Calls fn(index, item) with every entry from first to last inclusive, in order of index.
+	 */
+	template <typename F> void for_each_range(u64 first, u64 last, F fn) const
+	{
+		u64 index;
+		for (T *item = find_next(first, index); item && index <= last; item = index == ~0ull ? nullptr : find_next(index + 1, index)) {
+			fn(index, item);
+		}
+	}
+
+	/**
+	 * @brief Calls fn(index, item) with every entry from first to last inclusive with the given tag, in order of
+	 * index.
+	 */
+	template <typename F> void for_each_tagged(u64 first, u64 last, unsigned int tag, F fn) const
+	{
+		u64 index;
+		for (T *item = find_next_tagged(first, tag, index); item && index <= last;
+			 item = index == ~0ull ? nullptr : find_next_tagged(index + 1, tag, index)) {
+			fn(index, item);
+		}
+	}
+
+	u64 count() const { return count_; }
+	bool empty() const { return count_ == 0; }
+
+	/**
+	 * @brief Removes every entry, without freeing them.
+	 */
+	void clear()
+	{
+		node *n = root_;
+		store(root_, nullptr);
+
+		if (n) {
+			clear_node(n);
+		}
+
+		count_ = 0;
+	}
+
+	/**
+	 * @brief Frees the nodes that have been retired since the last call.
+	 */
+	void free_retired()
+	{
+		while (retired_) {
+			node *n = retired_;
+			retired_ = n->retired_next;
+
+			delete n;
+		}
+	}
+
+private:
+	node *root_;
+	u64 count_;
+	bool deferred_free_;
+	node *retired_;
+
+	template <class V> static V load(const V &v) { return __atomic_load_n(&v, __ATOMIC_ACQUIRE); }
+	template <class V, class W> static void store(V &dst, W v) { __atomic_store_n(&dst, (V)v, __ATOMIC_RELEASE); }
+
+	static u64 max_index(unsigned int shift) { return shift + bits_per_level >= 64 ? ~0ull : (1ull << (shift + bits_per_level)) - 1; }
+	static unsigned int slot_of(const node *n, u64 index) { return (index >> n->shift) & (fanout - 1); }
+
+	/**
+	 * @brief Returns the first index after the slot at the given level that holds the index, or zero if there isn't
+	 * one.
+	 */
+	static u64 next_slot(u64 index, unsigned int shift)
+	{
+		if (shift >= 64) {
+			return 0;
+		}
+
+		u64 step = 1ull << shift;
+		return (index & ~(step - 1)) + step;
+	}
+
+	node *leaf_of(u64 index) const
+	{
+		node *n = load(root_);
+		if (!n || index > max_index(n->shift)) {
+			return nullptr;
+		}
+
+		while (n && n->shift) {
+			n = (node *)load(n->slots[slot_of(n, index)]);
+		}
+
+		return n;
+	}
+
+	void clear_tag_in(node *n, unsigned int offset, unsigned int tag)
+	{
+		// A node's bit for a child only goes once nothing beneath the child has the tag.
+		while (n && (n->tags[tag] & (1ull << offset))) {
+			store(n->tags[tag], n->tags[tag] & ~(1ull << offset));
+			if (n->tags[tag]) {
+				break;
+			}
+
+			offset = n->offset;
+			n = n->parent;
+		}
+	}
+
+	/**
+	 * @brief Finds the first entry at or after start that has the given tag, or that is there at all, if the tag is
+	 * nr_tags.  Each time a node turns out to have nothing more, the search starts again from the root at the first
+	 * index past the node, so it never has to follow a parent pointer, which a change may be updating.
+	 */
+	T *search(u64 start, u64 &index, unsigned int tag) const
+	{
+		u64 i = start;
+
+		while (true) {
+			node *n = load(root_);
+			if (!n || i > max_index(n->shift)) {
+				return nullptr;
+			}
+
+			while (true) {
+				unsigned int offset = slot_of(n, i);
+				u64 bits = load(tag == nr_tags ? n->present : n->tags[tag]) & (~0ull << offset);
+
+				if (!bits) {
+					i = next_slot(i, n->shift + bits_per_level);
+					break;
+				}
+
+				unsigned int found = __builtin_ctzll(bits);
+				if (found != offset) {
+					i = (i & ~((1ull << n->shift) - 1) & ~((u64)(fanout - 1) << n->shift)) | ((u64)found << n->shift);
+				}
+
+				void *slot = load(n->slots[found]);
+				if (slot && n->shift == 0) {
+					index = i;
+					return (T *)slot;
+				}
+
+				if (!slot) {
+					// Removed while the search was looking at it.
+					i = next_slot(i, n->shift);
+					break;
+				}
+
+				n = (node *)slot;
+			}
+
+			if (!i) {
+				return nullptr;
+			}
+		}
+	}
+
+	void retire(node *n)
+	{
+		if (deferred_free_) {
+			n->retired_next = retired_;
+			retired_ = n;
+		} else {
+			delete n;
+		}
+	}
+
+	void clear_node(node *n)
+	{
+		if (n->shift) {
+			for (unsigned int i = 0; i < fanout; i++) {
+				if (n->slots[i]) {
+					clear_node((node *)n->slots[i]);
+				}
+			}
+		}
+
+		retire(n);
+	}
+};
+} // namespace stacsos
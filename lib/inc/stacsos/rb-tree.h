@@ -0,0 +1,431 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/**
+ * @brief The link embedded in an object that is stored in an intrusive red-black tree.  The tree never
+ * allocates memory, so it can be used in places where calling the allocator is not allowed (e.g. with
+ * a scheduler lock held).
+ */
+struct rb_node {
+	rb_node *parent;
+	rb_node *left;
+	rb_node *right;
+	bool red;
+};
+
+/**
+ * @brief The default augmentation for an rb_tree, which keeps nothing extra in each element.
+ */
+struct rb_no_augment {
+	template <class T> static void update(T &elem, const T *left, const T *right) { }
+};
+
+/**
+ * @brief An intrusive red-black tree of T, where each T embeds an rb_node at LINK.  Elements are ordered
+ * by LESS, and equal elements are kept in insertion order.  The leftmost (smallest) element is cached,
+ * so first() is O(1).
+ *
+ * AUGMENT::update(elem, left, right) is called whenever the subtree below an element changes, with its
+ * children in the tree (or null), so that each element can keep a summary of its subtree, e.g. the
+ * maximum end of the intervals in an interval tree.
+ */
+template <class T, rb_node T::*LINK, class LESS, class AUGMENT = rb_no_augment> class rb_tree {
+	DELETE_DEFAULT_COPY_AND_MOVE(rb_tree)
+
+public:
+	rb_tree()
+		: root_(nullptr)
+		, leftmost_(nullptr)
+		, count_(0)
+	{
+	}
+
+	void insert(T &elem)
+	{
+		rb_node *n = &(elem.*LINK);
+		rb_node *parent = nullptr;
+		rb_node **link = &root_;
+		bool leftmost = true;
+
+		while (*link) {
+			parent = *link;
+
+			if (LESS()(elem, *entry(parent))) {
+				link = &parent->left;
+			} else {
+				link = &parent->right;
+				leftmost = false;
+			}
+		}
+
+		n->parent = parent;
+		n->left = nullptr;
+		n->right = nullptr;
+		n->red = true;
+		*link = n;
+
+		if (leftmost) {
+			leftmost_ = n;
+		}
+
+		propagate(n);
+		insert_fixup(n);
+		count_++;
+	}
+
+	void remove(T &elem)
+	{
+		rb_node *z = &(elem.*LINK);
+
+		if (leftmost_ == z) {
+			leftmost_ = next_node(z);
+		}
+
+		rb_node *y = z;
+		bool removed_red = y->red;
+		rb_node *x, *x_parent;
+
+		if (!z->left) {
+			x = z->right;
+			x_parent = z->parent;
+			transplant(z, z->right);
+		} else if (!z->right) {
+			x = z->left;
+			x_parent = z->parent;
+			transplant(z, z->left);
+		} else {
+			y = minimum(z->right);
+			removed_red = y->red;
+			x = y->right;
+
+			if (y->parent == z) {
+				x_parent = y;
+			} else {
+				x_parent = y->parent;
+				transplant(y, y->right);
+				y->right = z->right;
+				y->right->parent = y;
+			}
+
+			transplant(z, y);
+			y->left = z->left;
+			y->left->parent = y;
+			y->red = z->red;
+		}
+
+		propagate(x_parent);
+
+		if (!removed_red) {
+			remove_fixup(x, x_parent);
+		}
+
+		z->parent = nullptr;
+		z->left = nullptr;
+		z->right = nullptr;
+
+		count_--;
+	}
+
+	/**
+	 * @brief Returns true if the element is linked into this tree.
+	 */
+	bool contains(const T &elem) const
+	{
+		const rb_node *n = &(elem.*LINK);
+		while (n->parent) {
+			n = n->parent;
+		}
+
+		return n == root_;
+	}
+
+	T *first() const { return leftmost_ ? entry(leftmost_) : nullptr; }
+
+	/**
+	 * @brief The root of the tree, and the children of an element, for searches that need to be guided by the
+	 * augmented data.
+	 */
+	T *root() const { return root_ ? entry(root_) : nullptr; }
+	T *left(const T &elem) const { return child((elem.*LINK).left); }
+	T *right(const T &elem) const { return child((elem.*LINK).right); }
+
+	T *last() const { return root_ ? entry(maximum(root_)) : nullptr; }
+
+	T *next(const T &elem) const
+	{
+		rb_node *n = next_node(&(elem.*LINK));
+		return n ? entry(n) : nullptr;
+	}
+
+	T *prev(const T &elem) const
+	{
+		rb_node *n = prev_node(&(elem.*LINK));
+		return n ? entry(n) : nullptr;
+	}
+
+	unsigned int count() const { return count_; }
+	bool empty() const { return count_ == 0; }
+
+private:
+	rb_node *root_;
+	rb_node *leftmost_;
+	unsigned int count_;
+
+	static T *entry(const rb_node *n)
+	{
+		const uintptr_t offset = (uintptr_t) & (((T *)0)->*LINK);
+		return (T *)((uintptr_t)n - offset);
+	}
+
+	static T *child(rb_node *n) { return n ? entry(n) : nullptr; }
+
+	static void augment(rb_node *n) { AUGMENT::update(*entry(n), child(n->left), child(n->right)); }
+
+	/**
+	 * @brief Updates the augmented data of an element, and every element above it.
+	 */
+	static void propagate(rb_node *n)
+	{
+		while (n) {
+			augment(n);
+			n = n->parent;
+		}
+	}
+
+	static rb_node *minimum(rb_node *n)
+	{
+		while (n->left) {
+			n = n->left;
+		}
+
+		return n;
+	}
+
+	static rb_node *maximum(rb_node *n)
+	{
+		while (n->right) {
+			n = n->right;
+		}
+
+		return n;
+	}
+
+	static rb_node *next_node(const rb_node *n)
+	{
+		if (n->right) {
+			return minimum(n->right);
+		}
+
+		rb_node *p = n->parent;
+		while (p && n == p->right) {
+			n = p;
+			p = p->parent;
+		}
+
+		return p;
+	}
+
+	static rb_node *prev_node(const rb_node *n)
+	{
+		if (n->left) {
+			return maximum(n->left);
+		}
+
+		rb_node *p = n->parent;
+		while (p && n == p->left) {
+			n = p;
+			p = p->parent;
+		}
+
+		return p;
+	}
+
+	static bool is_red(const rb_node *n) { return n && n->red; }
+
+	void replace_child(rb_node *parent, rb_node *old_child, rb_node *new_child)
+	{
+		if (!parent) {
+			root_ = new_child;
+		} else if (parent->left == old_child) {
+			parent->left = new_child;
+		} else {
+			parent->right = new_child;
+		}
+	}
+
+	void transplant(rb_node *u, rb_node *v)
+	{
+		replace_child(u->parent, u, v);
+
+		if (v) {
+			v->parent = u->parent;
+		}
+	}
+
+	void rotate_left(rb_node *x)
+	{
+		rb_node *y = x->right;
+
+		x->right = y->left;
+		if (y->left) {
+			y->left->parent = x;
+		}
+
+		y->parent = x->parent;
+		replace_child(x->parent, x, y);
+
+		y->left = x;
+		x->parent = y;
+
+		augment(x);
+		augment(y);
+	}
+
+	void rotate_right(rb_node *x)
+	{
+		rb_node *y = x->left;
+
+		x->left = y->right;
+		if (y->right) {
+			y->right->parent = x;
+		}
+
+		y->parent = x->parent;
+		replace_child(x->parent, x, y);
+
+		y->right = x;
+		x->parent = y;
+
+		augment(x);
+		augment(y);
+	}
+
+	void insert_fixup(rb_node *n)
+	{
+		while (n != root_ && n->parent->red) {
+			rb_node *p = n->parent;
+			rb_node *g = p->parent;
+
+			if (p == g->left) {
+				rb_node *u = g->right;
+
+				if (is_red(u)) {
+					p->red = false;
+					u->red = false;
+					g->red = true;
+					n = g;
+				} else {
+					if (n == p->right) {
+						rotate_left(p);
+						n = p;
+						p = n->parent;
+					}
+
+					p->red = false;
+					g->red = true;
+					rotate_right(g);
+				}
+			} else {
+				rb_node *u = g->left;
+
+				if (is_red(u)) {
+					p->red = false;
+					u->red = false;
+					g->red = true;
+					n = g;
+				} else {
+					if (n == p->left) {
+						rotate_right(p);
+						n = p;
+						p = n->parent;
+					}
+
+					p->red = false;
+					g->red = true;
+					rotate_left(g);
+				}
+			}
+		}
+
+		root_->red = false;
+	}
+
+	void remove_fixup(rb_node *x, rb_node *parent)
+	{
+		while (x != root_ && !is_red(x)) {
+			if (x == parent->left) {
+				rb_node *w = parent->right;
+
+				if (is_red(w)) {
+					w->red = false;
+					parent->red = true;
+					rotate_left(parent);
+					w = parent->right;
+				}
+
+				if (!is_red(w->left) && !is_red(w->right)) {
+					w->red = true;
+					x = parent;
+					parent = x->parent;
+				} else {
+					if (!is_red(w->right)) {
+						w->left->red = false;
+						w->red = true;
+						rotate_right(w);
+						w = parent->right;
+					}
+
+					w->red = parent->red;
+					parent->red = false;
+					w->right->red = false;
+					rotate_left(parent);
+
+					x = root_;
+					parent = nullptr;
+				}
+			} else {
+				rb_node *w = parent->left;
+
+				if (is_red(w)) {
+					w->red = false;
+					parent->red = true;
+					rotate_right(parent);
+					w = parent->left;
+				}
+
+				if (!is_red(w->left) && !is_red(w->right)) {
+					w->red = true;
+					x = parent;
+					parent = x->parent;
+				} else {
+					if (!is_red(w->left)) {
+						w->right->red = false;
+						w->red = true;
+						rotate_left(w);
+						w = parent->left;
+					}
+
+					w->red = parent->red;
+					parent->red = false;
+					w->left->red = false;
+					rotate_right(parent);
+
+					x = root_;
+					parent = nullptr;
+				}
+			}
+		}
+
+		if (x) {
+			x->red = false;
+		}
+	}
+};
+} // namespace stacsos
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+// The resources a process is charged for: the private pages resident in its address space (pages shared from the page
+// cache aren't counted), its open handles, and its threads.
+enum class resource_type : u64 { pages = 0, handles = 1, threads = 2 };
+
+static const u64 NR_RESOURCE_TYPES = 3;
+
+static const u64 RESOURCE_UNLIMITED = ~0ull;
+
+// Which limit set_resource_limit changes: the calling process's own, or that of the group it belongs to, which every
+// process in the group is charged to as well.
+enum class resource_scope : u64 { process = 0, group = 1 };
+} // namespace stacsos
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/atomic.h>
+
+namespace stacsos {
+/**
+ * @brief A fixed-size ring for passing values from exactly one producer to exactly one consumer, without locks (so,
+ * for example, from an interrupt handler to the thread that handles its data).  Each side keeps its own copy of the
+ * other side's index, and only reloads it when the ring looks full (or empty), so most operations touch nothing the
+ * other side writes.
+ */
+template <class T, u32 Capacity> class spsc_ring {
+	static_assert(Capacity && !(Capacity & (Capacity - 1)), "the capacity of a ring must be a power of two");
+
+public:
+	static const u32 capacity = Capacity;
+
+	/**
+	 * @brief Adds a value.  Only the producer may call this.  Returns false, dropping the value, if the ring is full.
+	 */
+	bool push(const T &value)
+	{
+		producer_state &p = producer_.value;
+
+		u32 head = p.head.load(memory_order::relaxed);
+		if (head - p.cached_tail >= Capacity) {
+			p.cached_tail = consumer_.value.tail.load(memory_order::acquire);
+			if (head - p.cached_tail >= Capacity) {
+				return false;
+			}
+		}
+
+		slots_[head & (Capacity - 1)] = value;
+
+		// The value has to be visible before the index that hands it over.
+		p.head.store(head + 1, memory_order::release);
+		return true;
+	}
+
+	/**
+	 * @brief Takes the oldest value.  Only the consumer may call this.  Returns false if the ring is empty.
+	 */
+	bool pop(T &value)
+	{
+		consumer_state &c = consumer_.value;
+
+		u32 tail = c.tail.load(memory_order::relaxed);
+		if (tail == c.cached_head) {
+			c.cached_head = producer_.value.head.load(memory_order::acquire);
+			if (tail == c.cached_head) {
+				return false;
+			}
+		}
+
+		value = slots_[tail & (Capacity - 1)];
+
+		// The value has to be read before its slot is given back.
+		c.tail.store(tail + 1, memory_order::release);
+		return true;
+	}
+
+	/**
+	 * @brief The number of values in the ring, which is only exact when called by one of its two sides while the
+	 * other is idle.
+	 */
+	u32 size() const { return producer_.value.head.load(memory_order::acquire) - consumer_.value.tail.load(memory_order::acquire); }
+
+	bool empty() const { return size() == 0; }
+
+private:
+	struct producer_state {
+		atomic<u32> head;
+		u32 cached_tail;
+	};
+
+	struct consumer_state {
+		atomic<u32> tail;
+		u32 cached_head;
+	};
+
+	cache_padded<producer_state> producer_;
+	cache_padded<consumer_state> consumer_;
+	T slots_[Capacity];
+};
+} // namespace stacsos
@@ -13,6 +13,71 @@
 namespace stacsos {
 enum class pad_side { LEFT, RIGHT };
 
+/**
+ * @brief The FNV-1a hash of some characters, which is what strings are hashed with.  Hashing more characters on to the
+ * end of a hash gives the same result as hashing them all at once.
+ */
+static inline u64 hash_chars(const char *data, size_t length, u64 hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+
+		// FNV Prime for 64-bit hash
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+class string;
+
+/**
+ * @brief Refers to characters held somewhere else, such as part of a path, so that they can be looked up without
+ * being copied into a string first.  The characters are not necessarily followed by a NUL, and must outlive the
+ * view.
+ */
+class string_view {
+public:
+	using char_type = char;
+	using hash_type = u64;
+
+	string_view(const char_type *str)
+		: data_(str)
+		, size_(memops::strlen(str))
+		, hash_(hash_chars(data_, size_))
+	{
+	}
+
+	string_view(const char_type *str, size_t length)
+		: data_(str)
+		, size_(length)
+		, hash_(hash_chars(data_, size_))
+	{
+	}
+
+	inline string_view(const string &str);
+
+	size_t length() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	const char_type *data() const { return data_; }
+	hash_type get_hash() const { return hash_; }
+
+	friend bool operator==(const string_view &l, const string_view &r)
+	{
+		return l.size_ == r.size_ && l.hash_ == r.hash_ && !memops::memcmp(l.data_, r.data_, l.size_);
+	}
+
+private:
+	const char_type *data_;
+	size_t size_;
+	hash_type hash_;
+};
+
+/**
+ * @brief A string of characters, always followed by a NUL.  Strings of up to inline_capacity characters are kept in
+ * the string itself, and only longer ones are allocated on the heap.  The hash of the characters is kept up to date
+ * as the string is built, so strings that differ can nearly always be told apart without comparing them.
+ */
 class string {
 public:
 	using char_type = char;
@@ -20,56 +85,58 @@ public:
 
 	using const_iterator = const char_type *;
 
+	static const size_t inline_capacity = 23;
+
 	string()
 		: size_(0)
-		, data_(new char_type[1])
-		, has_hash_(false)
-		, hash_(0)
+		, hash_(hash_chars(nullptr, 0))
 	{
-		data_[0] = 0;
+		inline_[0] = 0;
 	}
 
 	string(const char_type *str)
-		: size_(memops::strlen(str))
-		, data_(nullptr)
-		, has_hash_(false)
-		, hash_(0)
+		: string(str, memops::strlen(str))
+	{
+	}
+
+	string(const char_type *str, size_t length)
+		: size_(length)
+		, hash_(hash_chars(str, length))
 	{
-		data_ = new char_type[size_ + 1];
+		char_type *data = allocate();
 
-		memops::memcpy(data_, str, size_);
-		data_[size_] = 0;
+		memops::memcpy(data, str, size_);
+		data[size_] = 0;
+	}
+
+	explicit string(const string_view &str)
+		: string(str.data(), str.length())
+	{
 	}
 
 	// Copy Constructor
 
 	string(const string &str)
 		: size_(str.size_)
-		, data_(nullptr)
-		, has_hash_(str.has_hash_)
 		, hash_(str.hash_)
 	{
-		data_ = new char_type[size_ + 1];
+		char_type *data = allocate();
 
-		memops::memcpy(data_, str.data_, size_);
-		data_[size_] = 0;
+		memops::memcpy(data, str.c_str(), size_ + 1);
 	}
 
 	// Move Constructor
 
 	string(string &&str)
 		: size_(str.size_)
-		, data_(str.data_)
-		, has_hash_(str.has_hash_)
-		, hash_(str.has_hash_)
+		, hash_(str.hash_)
 	{
-		str.data_ = nullptr;
-		str.size_ = 0;
+		take(str);
 	}
 
 	// Destructor
 
-	~string() { delete[] data_; }
+	~string() { release(); }
 
 	static string format(const string &fmt, ...);
 
@@ -88,24 +155,14 @@ public:
 	 * Returns the C-representation of the string.
 	 * @return Returns the C-representation of the string.
 	 */
-	const char_type *c_str() const { return data_; }
+	const char_type *c_str() const { return is_inline() ? inline_ : heap_; }
 
 	/**
-	 * Retrieves the hash of this string, lazily computing it
-	 * if necessary.
+	 * Retrieves the hash of this string, which is always up to date.
 	 *
 	 * @return Returns a 64-bit hash of the string.
 	 */
-	hash_type get_hash() const
-	{
-		if (has_hash_)
-			return hash_;
-
-		hash_ = compute_hash();
-		has_hash_ = true;
-
-		return hash_;
-	}
+	hash_type get_hash() const { return hash_; }
 
 	/**
 	 * Pads the string out to the specified width, using the specified padding
@@ -117,64 +174,36 @@ public:
 	 */
 	string pad(int width, char ch, pad_side side);
 
-	const_iterator begin() const { return &data_[0]; }
-	const_iterator end() const { return &data_[size_ + 1]; }
-
-	friend string &operator+=(string &s, const char_type &ch)
-	{
-		size_t new_size = s.size_ + 1;
-		char_type *new_data = new char_type[new_size + 1];
-		memops::memcpy(new_data, s.data_, s.size_);
-		new_data[new_size - 1] = ch;
-		new_data[new_size] = 0;
-
-		delete s.data_;
-		s.data_ = new_data;
-		s.size_ = new_size;
-		s.has_hash_ = false;
-
-		return s;
-	}
-
-	friend string &operator+=(string &l, const string &r)
-	{
-		size_t new_size = l.size_ + r.size_;
-		char_type *new_data = new char_type[new_size + 1];
-
-		memops::memcpy(new_data, l.data_, l.size_);
-		memops::memcpy(new_data + l.size_, r.data_, r.size_);
-
-		new_data[new_size] = 0;
+	const_iterator begin() const { return c_str(); }
+	const_iterator end() const { return c_str() + size_ + 1; }
 
-		delete l.data_;
-		l.data_ = new_data;
-		l.size_ = new_size;
-		l.has_hash_ = false;
+	friend string &operator+=(string &s, const char_type &ch) { return s.append(&ch, 1); }
 
-		return l;
-	}
+	friend string &operator+=(string &l, const string &r) { return l.append(r.c_str(), r.size_); }
 
 	friend string operator+(const string &l, const string &r)
 	{
 		string n(l.size_ + r.size_);
+		char_type *data = n.data();
 
-		memops::memcpy(n.data_, l.data_, l.size_);
-		memops::memcpy(n.data_ + l.size_, r.data_, r.size_);
-
-		n.data_[n.size_] = 0;
+		memops::memcpy(data, l.c_str(), l.size_);
+		memops::memcpy(data + l.size_, r.c_str(), r.size_);
+		data[n.size_] = 0;
 
+		n.hash_ = hash_chars(r.c_str(), r.size_, l.hash_);
 		return n;
 	}
 
 	friend string operator+(const string &l, const char_type &r)
 	{
 		string n(l.size_ + 1);
+		char_type *data = n.data();
 
-		memops::memcpy(n.data_, l.data_, l.size_);
-
-		n.data_[n.size_ - 1] = r;
-		n.data_[n.size_] = 0;
+		memops::memcpy(data, l.c_str(), l.size_);
+		data[n.size_ - 1] = r;
+		data[n.size_] = 0;
 
+		n.hash_ = hash_chars(&r, 1, l.hash_);
 		return n;
 	}
 
@@ -184,17 +213,13 @@ public:
 	string &operator=(const string &s)
 	{
 		if (this != &s) {
-			delete data_;
+			release();
 
 			size_ = s.size_;
-			data_ = new char_type[size_ + 1];
-
-			memops::memcpy(data_, s.data_, size_);
-
-			data_[size_] = 0;
-
-			has_hash_ = s.has_hash_;
 			hash_ = s.hash_;
+
+			char_type *data = allocate();
+			memops::memcpy(data, s.c_str(), size_ + 1);
 		}
 
 		return *this;
@@ -204,15 +229,11 @@ public:
 	string &operator=(string &&s)
 	{
 		if (this != &s) {
-			delete data_;
+			release();
 
 			size_ = s.size_;
-			data_ = s.data_;
-			has_hash_ = s.has_hash_;
 			hash_ = s.hash_;
-
-			s.data_ = nullptr;
-			s.size_ = 0;
+			take(s);
 		}
 
 		return *this;
@@ -222,20 +243,16 @@ public:
 	{
 		if (idx >= size_)
 			return 0;
-		return data_[idx];
+		return c_str()[idx];
 	}
 
 	friend bool operator==(const string &l, const string &r)
 	{
-		if (l.size_ != r.size_)
+		// Strings with different hashes can't be equal, so most that aren't are told apart here.
+		if (l.size_ != r.size_ || l.hash_ != r.hash_)
 			return false;
 
-		for (unsigned int i = 0; i < l.size_; i++) {
-			if (l.data_[i] != r.data_[i])
-				return false;
-		}
-
-		return true;
+		return !memops::memcmp(l.c_str(), r.c_str(), l.size_);
 	}
 
 	list<string> split(char delim, bool remove_empty);
@@ -248,42 +265,97 @@ public:
 	static string to_string(u64 i, int base);
 
 private:
+	// Creates a string of the given length, whose characters (and hash) are left to the caller.
 	string(unsigned int new_size)
 		: size_(new_size)
-		, data_(new char_type[new_size + 1])
-		, has_hash_(false)
 		, hash_(0)
 	{
-		data_[size_] = 0;
+		char_type *data = allocate();
+		data[size_] = 0;
 	}
 
-	/*
-	 * Computes the FNV-1a hash
+	bool is_inline() const { return size_ <= inline_capacity; }
+
+	char_type *data() { return is_inline() ? inline_ : heap_; }
+
+	/**
+	 * @brief Makes room for size_ characters and a NUL, replacing whatever was there.
+	 */
+	char_type *allocate()
+	{
+		if (is_inline()) {
+			return inline_;
+		}
+
+		heap_ = new char_type[size_ + 1];
+		return heap_;
+	}
+
+	void release()
+	{
+		if (!is_inline()) {
+			delete[] heap_;
+		}
+	}
+
+	/**
+	 * @brief Takes the characters of a string being moved from, which is left empty.  size_ must already be set.
 	 */
-	hash_type compute_hash() const
+	void take(string &s)
 	{
-		// Offset basis for 64-bit hash
-		u64 hash = 14695981039346656037ULL;
+		if (is_inline()) {
+			memops::memcpy(inline_, s.inline_, size_ + 1);
+		} else {
+			heap_ = s.heap_;
+		}
 
-		for (unsigned int i = 0; i < size_; i++) {
-			hash ^= data_[i];
+		s.size_ = 0;
+		s.hash_ = hash_chars(nullptr, 0);
+		s.inline_[0] = 0;
+	}
 
-			// FNV Prime for 64-bit hash
-			hash *= 1099511628211ULL;
+	string &append(const char_type *str, size_t length)
+	{
+		size_t new_size = size_ + length;
+
+		if (new_size <= inline_capacity) {
+			// Still fits in the string itself, so nothing needs to move.
+			memops::memcpy(inline_ + size_, str, length);
+			inline_[new_size] = 0;
+		} else {
+			char_type *new_data = new char_type[new_size + 1];
+			memops::memcpy(new_data, c_str(), size_);
+			memops::memcpy(new_data + size_, str, length);
+			new_data[new_size] = 0;
+
+			release();
+			heap_ = new_data;
 		}
 
-		return (hash_type)hash;
+		size_ = new_size;
+		hash_ = hash_chars(str, length, hash_);
+
+		return *this;
 	}
 
 	// Holds the number of characters in the string.
 	size_t size_;
 
-	// Holds the string data + null byte.  This array is
-	// always (size_ + 1) in length.
-	char_type *data_;
+	// The hash of the characters in the string.
+	hash_type hash_;
 
-	// Lazy hash computation.
-	mutable bool has_hash_;
-	mutable hash_type hash_;
+	// Holds the string data + null byte, in the string itself if there are few enough characters, or otherwise in an
+	// array on the heap of (size_ + 1) characters.
+	union {
+		char_type *heap_;
+		char_type inline_[inline_capacity + 1];
+	};
 };
+
+inline string_view::string_view(const string &str)
+	: data_(str.c_str())
+	, size_(str.length())
+	, hash_(str.get_hash())
+{
+}
 } // namespace stacsos
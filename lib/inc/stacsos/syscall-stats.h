@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+// The ioctls understood by /dev/syscalls.  reset clears every counter.  set_filter takes a u64 process id in its
+// buffer, and from then on only counts the system calls made by that process, or by every process if it is zero.
+enum class syscall_stats_ioctl : u64 { reset = 1, set_filter = 2 };
+} // namespace stacsos
@@ -8,7 +8,22 @@
 #pragma once
 
 namespace stacsos {
-enum class syscall_result_code : u64 { ok = 0, not_found = 1, not_supported = 2 };
+// bad_address means that a buffer or string passed to the call isn't in memory the process may access.
+// limit_exceeded means that the process, or its group, has run out of handles or threads (see resource-limits.h).
+enum class syscall_result_code : u64 {
+	ok = 0,
+	not_found = 1,
+	not_supported = 2,
+	would_block = 3,
+	timed_out = 4,
+	bad_address = 5,
+	limit_exceeded = 6,
+};
+
+// The scheduling class of a thread.  Fair threads share the CPU according to their nice value (-20 to 19, lower
+// getting more time).  FIFO threads have a real-time priority (1 to 99, higher winning), always preempt fair threads,
+// and run until they block.
+enum class sched_policy : u8 { fair = 0, fifo = 1 };
 
 enum class syscall_numbers {
 	exit = 0,
@@ -29,9 +44,80 @@ enum class syscall_numbers {
 	sleep = 15,
 	poweroff = 16,
 	ioctl = 17,
-	readdir = 18, //System call to list directory entries.
+	readdir = 18, // Lists the next entries of an open directory, as packed dirent records.
+	yield = 19,
+	futex_wait = 20,
+	futex_wake = 21,
+	set_affinity = 22,
+	set_priority = 23,
+	get_cpu_stats = 24,
+	set_reservation = 25,
+	start_threads = 26,
+	mmap = 27,
+	munmap = 28,
+	msync = 29,
+	fsync = 30,
+	truncate = 31,
+	io_ring_setup = 32, // Creates an I/O ring shared with the kernel, returning its handle.
+	io_ring_enter = 33, // Submits an I/O ring's queued operations, or wakes its polling thread.
+	readv = 34, // The vectored calls take an array of iovecs, and transfer them in order, as one buffer.
+	preadv = 35,
+	writev = 36,
+	pwritev = 37,
+	wait_many = 38, // Waits until at least one of several objects is ready, or a timeout passes.
+	create_pipe = 39, // Creates a pipe, returning the handles of its read and write ends.
+	shm_create = 40, // Creates shared memory of the given size, returning its handle, which can then be mapped.
+	copy_object = 41, // Copies data from one object to another, inside the kernel, returning the number of bytes copied.
+	spawn = 42, // Starts a process with inherited handles, and optionally waits for it to finish.
+	set_resource_limit = 43, // Lowers a limit of the process, or of its group, returning how much is in use.
+	get_size = 44, // Returns the size of an open file, in bytes.
+	set_gang_scheduling = 45, // Turns co-scheduling of the calling process's threads on or off.
+	futex_lock_pi = 46, // Takes a priority-inheriting futex lock, returning the caller's futex thread ID.
+	futex_unlock_pi = 47, // Releases a priority-inheriting futex lock, handing it to the highest priority waiter.
+	sleep_until = 48, // Sleeps until the TSC reaches an absolute deadline.
+	create_timer = 49, // Creates a timer object from a TSC deadline and a period in TSC ticks (0 for one-shot).
+	clone_process = 50, // Forks the calling process, starting the copy at an entry point, and returns its process object.
+	zygote_ready = 51, // Called by a template process once it is set up, with the entry point its copies start at.
+	advise = 52, // Tells the kernel how a range of an open file is going to be used.
+	advise_memory = 53, // Tells the kernel how a range of memory is going to be used.
 };
 
+// A priority-inheriting futex word holds the futex thread ID of the thread holding the lock, or zero when it is free.
+// While any thread is waiting, the waiters bit is set too, so that the holder unlocks through the kernel.
+static const u32 FUTEX_PI_TID_MASK = 0x3fffffff;
+static const u32 FUTEX_PI_WAITERS = 0x80000000;
+
+// Passed as copy_object's offset, to read the source from its current position (e.g. a pipe), rather than an offset.
+static const u64 COPY_CURRENT_POSITION = ~0ull;
+
+// How open treats a path.  With create, a file that doesn't exist is created (empty) in its parent directory.  With
+// truncate, the file is emptied.
+enum class open_flags : u64 { none = 0, create = 1, truncate = 2 };
+
+DEFINE_ENUM_FLAG_OPERATIONS(open_flags)
+
+// How a file is mapped into memory.  Without writable, the mapping is read-only.  A shared mapping writes to the
+// file's cached pages, which msync then writes back to the file.  Otherwise, writes go to a private copy of each
+// page, and are never seen by anything else.
+enum class mmap_flags : u64 { none = 0, writable = 1, shared = 2 };
+
+DEFINE_ENUM_FLAG_OPERATIONS(mmap_flags)
+
+// How memory from alloc_mem is provided.  By default, each page is allocated and zeroed when it is first touched.
+// populate allocates every page straight away, so that using the memory never faults.  huge aligns the memory to
+// 2 MiB, and rounds its size up to match, so that it is backed by large pages.  guard leaves an unmapped page after
+// the memory, so that running off its end faults.
+enum class alloc_mem_flags : u64 { none = 0, populate = 1, huge = 2, guard = 4 };
+
+DEFINE_ENUM_FLAG_OPERATIONS(alloc_mem_flags)
+
+// How a range of a file, or of memory, is going to be used, given to advise and advise_memory.  normal goes back to
+// the kernel's own guesses.  sequential reads ahead as far as possible from the start, and random never reads ahead.
+// willneed starts reading the range in (or, for anonymous memory, populates it) straight away.  dontneed drops the
+// range's clean cached data (or, for memory, its pages, so that anonymous memory reads as zero again).  hugepage
+// only applies to memory, and has the kernel work harder to back it with large pages.
+enum class access_advice : u64 { normal = 0, sequential = 1, random = 2, willneed = 3, dontneed = 4, hugepage = 5 };
+
 struct syscall_result {
 	syscall_result_code code;
 	u64 data;
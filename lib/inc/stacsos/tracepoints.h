@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+static const unsigned int tracepoint_max_args = 4;
+
+/**
+ * @brief A tracepoint that was hit, as it is read from /dev/tracepoints.
+ */
+struct tracepoint_record {
+	// One more than the record's position in its core's ring, written last, so a record that is still being written
+	// can be told apart.
+	u64 seq;
+
+	u64 timestamp;
+	u32 id;
+	u16 core;
+	u16 nr_args;
+	u64 args[tracepoint_max_args];
+};
+
+/**
+ * @brief Describes a tracepoint.  Given to the info ioctl of /dev/tracepoints with the ID filled in.
+ */
+struct tracepoint_info {
+	u32 id;
+	u32 enabled;
+	char name[32];
+	char format[64];
+};
+
+// The ioctls understood by /dev/tracepoints.  enable and disable take a u32 ID in their buffer, or ~0 for every
+// tracepoint.  info fills in a tracepoint_info, and returns zero if there's no tracepoint with its ID.  lost returns
+// the number of records that have been overwritten before they could be read.  drain takes the records written since
+// the last drain, and returns how many there are; they are then read from the start of the file, as an array of
+// tracepoint_records, until the next drain.
+enum class tracepoints_ioctl : u64 { enable = 1, disable = 2, info = 3, lost = 4, drain = 5 };
+} // namespace stacsos
@@ -1,70 +1,318 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
 #pragma once
 
+#include <stacsos/helpers.h>
+#include <stacsos/memops.h>
+
 namespace stacsos {
+/**
+ * @brief A growable array of T.  The storage has room for capacity() elements, of which the first size() have been
+ * constructed, and grows geometrically, so appending is amortised O(1).  When the elements move to new storage they
+ * are move-constructed there, or just copied byte for byte if T is trivially copyable.
+ */
 template <class T> class vector {
 public:
 	vector()
-		: storage_(new T[0])
+		: storage_(nullptr)
 		, size_(0)
+		, capacity_(0)
+		, inline_storage_(nullptr)
+		, inline_capacity_(0)
+	{
+	}
+
+	/**
+	 * @brief Creates a vector of size default-constructed elements.
+	 */
+	explicit vector(u32 size)
+		: vector()
 	{
+		resize(size);
 	}
 
-	explicit vector(u32 capacity)
-		: storage_(new T[capacity])
-		, size_(capacity)
+	/**
+	 * @brief Creates a vector holding copies of the given elements.
+	 */
+	vector(const T *data, size_t size)
+		: vector()
 	{
+		reserve(size);
+		for (size_t i = 0; i < size; i++) {
+			new (&storage_[i]) T(data[i]);
+		}
+
+		size_ = size;
 	}
 
 	vector(vector &&o)
-		: storage_(o.storage_)
-		, size_(o.size_)
+		: vector()
 	{
-		o.storage_ = nullptr;
-		o.size_ = 0;
+		take(o);
 	}
 
 	vector(const vector &o)
-		: storage_(new T[o.size_])
-		, size_(o.size_)
+		: vector(o.storage_, o.size_)
 	{
-		for (unsigned long i = 0; i < size_; i++) {
-			storage_[i] = o.storage_[i];
-		}
 	}
 
-	~vector() { delete[] storage_; }
+	~vector()
+	{
+		clear();
+		release(storage_);
+	}
 
-	vector(T *data, size_t size)
-		: storage_(data)
-		, size_(size)
+	vector &operator=(const vector &o)
 	{
+		if (this != &o) {
+			clear();
+			reserve(o.size_);
+
+			for (size_t i = 0; i < o.size_; i++) {
+				new (&storage_[i]) T(o.storage_[i]);
+			}
+
+			size_ = o.size_;
+		}
+
+		return *this;
 	}
 
-	vector &operator=(vector v) = delete;
+	vector &operator=(vector &&o)
+	{
+		if (this != &o) {
+			clear();
+			take(o);
+		}
+
+		return *this;
+	}
 
 	const T *data() const { return storage_; }
 	T *data() { return storage_; }
 
 	size_t size() const { return size_; }
+	size_t capacity() const { return capacity_; }
+	bool empty() const { return size_ == 0; }
+
+	T &operator[](size_t index) { return storage_[index]; }
+	const T &operator[](size_t index) const { return storage_[index]; }
+
+	T &back() { return storage_[size_ - 1]; }
+	const T &back() const { return storage_[size_ - 1]; }
+
+	T *begin() { return storage_; }
+	T *end() { return storage_ + size_; }
+	const T *begin() const { return storage_; }
+	const T *end() const { return storage_ + size_; }
+
+	/**
+	 * @brief Makes sure there is room for at least new_capacity elements, without changing the size.
+	 */
+	void reserve(size_t new_capacity)
+	{
+		if (new_capacity > capacity_) {
+			reallocate(new_capacity);
+		}
+	}
 
+	/**
+	 * @brief Changes the number of elements, default-constructing new ones at the end, or destroying those past the
+	 * new size.
+	 */
 	void resize(size_t new_size)
 	{
-		T *new_storage_ = new T[new_size];
-		for (unsigned long i = 0; i < size_; i++) {
-			new_storage_[i] = storage_[i];
+		if (new_size > capacity_) {
+			reallocate(grown_capacity(new_size));
 		}
 
-		T *tmp = storage_;
-		storage_ = new_storage_;
-		delete tmp;
+		for (size_t i = size_; i < new_size; i++) {
+			new (&storage_[i]) T();
+		}
+
+		for (size_t i = new_size; i < size_; i++) {
+			storage_[i].~T();
+		}
 
 		size_ = new_size;
 	}
 
-	T &operator[](size_t index) { return storage_[index]; }
+	void push_back(const T &elem) { emplace_back(elem); }
+	void push_back(T &&elem) { emplace_back(move(elem)); }
+
+	/**
+	 * @brief Constructs a new element at the end, from the given arguments.
+	 */
+	template <class... Args> T &emplace_back(Args &&...args)
+	{
+		if (size_ == capacity_) {
+			reallocate(grown_capacity(size_ + 1));
+		}
+
+		T *elem = new (&storage_[size_]) T(forward<Args>(args)...);
+		size_++;
+
+		return *elem;
+	}
+
+	void pop_back() { storage_[--size_].~T(); }
+
+	/**
+	 * @brief Destroys every element, but keeps the storage for reuse.
+	 */
+	void clear()
+	{
+		for (size_t i = 0; i < size_; i++) {
+			storage_[i].~T();
+		}
+
+		size_ = 0;
+	}
+
+	/**
+	 * @brief Gives back any storage that isn't being used.
+	 */
+	void shrink_to_fit()
+	{
+		if (size_ < capacity_ && storage_ != inline_storage_) {
+			reallocate(size_);
+		}
+	}
+
+protected:
+	/**
+	 * @brief Creates an empty vector whose elements are kept in the given storage, which belongs to the caller, until
+	 * there are more than capacity of them.
+	 */
+	vector(size_t capacity, T *inline_storage)
+		: storage_(inline_storage)
+		, size_(0)
+		, capacity_(capacity)
+		, inline_storage_(inline_storage)
+		, inline_capacity_(capacity)
+	{
+	}
+
+	/**
+	 * @brief Takes the elements of another vector, which is left empty.  This vector must be empty.
+	 */
+	void take(vector &o)
+	{
+		if (o.storage_ == o.inline_storage_ && o.storage_) {
+			// The other vector's elements are in its own inline storage, so they have to be moved one by one.
+			reserve(o.size_);
+			relocate(storage_, o.storage_, o.size_);
+			size_ = o.size_;
+			o.size_ = 0;
+			return;
+		}
+
+		release(storage_);
+
+		storage_ = o.storage_;
+		size_ = o.size_;
+		capacity_ = o.capacity_;
+
+		o.storage_ = o.inline_storage_;
+		o.size_ = 0;
+		o.capacity_ = o.inline_capacity_;
+	}
 
 private:
 	T *storage_;
 	size_t size_;
+	size_t capacity_;
+
+	// The storage a small_vector starts out with, which isn't freed, or null.
+	T *inline_storage_;
+	size_t inline_capacity_;
+
+	size_t grown_capacity(size_t needed) const
+	{
+		size_t grown = capacity_ ? capacity_ * 2 : 4;
+		return grown > needed ? grown : needed;
+	}
+
+	static void relocate(T *dest, T *src, size_t count)
+	{
+		if constexpr (__is_trivially_copyable(T)) {
+			memops::memcpy(dest, src, count * sizeof(T));
+		} else {
+			for (size_t i = 0; i < count; i++) {
+				new (&dest[i]) T(move(src[i]));
+				src[i].~T();
+			}
+		}
+	}
+
+	void reallocate(size_t new_capacity)
+	{
+		T *new_storage = nullptr;
+		if (new_capacity) {
+			new_storage = (T *)new u8[new_capacity * sizeof(T)];
+		}
+
+		relocate(new_storage, storage_, size_);
+		release(storage_);
+
+		storage_ = new_storage;
+		capacity_ = new_capacity;
+	}
+
+	void release(T *storage)
+	{
+		if (storage != inline_storage_) {
+			delete[] (u8 *)storage;
+		}
+	}
+};
+
+/**
+ * @brief Somewhere for a small_vector to keep its first N elements.  It is a base class of small_vector, so that it is
+ * there before the vector is constructed, and after it has been destroyed.
+ */
+template <class T, size_t N> struct small_vector_storage {
+	alignas(T) u8 inline_elements[N * sizeof(T)];
+};
+
+/**
+ * @brief A vector that keeps up to N elements inside itself, and only allocates once it grows past that, for short-lived
+ * collections that are usually small.
+ */
+template <class T, size_t N> class small_vector : private small_vector_storage<T, N>, public vector<T> {
+public:
+	small_vector()
+		: vector<T>(N, (T *)this->inline_elements)
+	{
+	}
+
+	small_vector(small_vector &&o)
+		: small_vector()
+	{
+		this->take(o);
+	}
+
+	small_vector(const small_vector &o)
+		: small_vector()
+	{
+		vector<T>::operator=(o);
+	}
+
+	small_vector &operator=(const small_vector &o)
+	{
+		vector<T>::operator=(o);
+		return *this;
+	}
+
+	small_vector &operator=(small_vector &&o)
+	{
+		vector<T>::operator=(move(o));
+		return *this;
+	}
 };
 } // namespace stacsos
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+// Passed as wait_many's timeout, to wait for as long as it takes.  A timeout of zero only looks, and never blocks.
+static const u64 WAIT_FOREVER = ~0ull;
+
+// The most objects that one wait_many call can wait on.
+static const u64 WAIT_MANY_MAX = 4096;
+
+/*
+ * One of the objects passed to wait_many.  A file is ready when a read won't block, a process or thread when it has
+ * finished, and an I/O ring when it has completions to collect.
+ */
+struct wait_entry {
+	u64 object; // The object's handle.
+	u64 ready; // Filled in by the kernel: non-zero if the object is ready.
+};
+} // namespace stacsos
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Utility Library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/atomic.h>
+
+namespace stacsos {
+/**
+ * @brief A Chase-Lev work-stealing deque with a fixed capacity.  The thread that owns it pushes and pops at the
+ * bottom, without contention unless there is only one value left, and any other thread can steal from the top with a
+ * single compare-and-swap.
+ *
+ * A thief can read a slot while the owner is refilling it (it then fails to claim it, and throws the value away), so
+ * the values are copied with atomic accesses, and must be pointers or integers of at most 64 bits.
+ */
+template <class T, u32 Capacity> class chase_lev_deque {
+	static_assert(Capacity && !(Capacity & (Capacity - 1)), "the capacity of a deque must be a power of two");
+	static_assert(sizeof(T) <= sizeof(u64), "deque values must fit in a single atomic access");
+
+public:
+	static const u32 capacity = Capacity;
+
+	/**
+	 * @brief Pushes a value onto the bottom.  Only the owner may call this.  Returns false if the deque is full.
+	 */
+	bool push(const T &value)
+	{
+		s64 b = bottom_.value.load(memory_order::relaxed);
+		s64 t = top_.value.load(memory_order::acquire);
+
+		if (b - t >= (s64)Capacity) {
+			return false;
+		}
+
+		__atomic_store_n(&slots_[b & (Capacity - 1)], value, __ATOMIC_RELAXED);
+
+		// The value must be visible before the bottom that makes it stealable.
+		bottom_.value.store(b + 1, memory_order::release);
+		return true;
+	}
+
+	/**
+	 * @brief Pops the most recently pushed value.  Only the owner may call this.  Returns false if the deque is empty,
+	 * or its last value was stolen first.
+	 */
+	bool pop(T &value)
+	{
+		s64 b = bottom_.value.load(memory_order::relaxed) - 1;
+		bottom_.value.store(b, memory_order::relaxed);
+
+		// Taking the bottom has to be ordered before looking at the top, or a thief and the owner could both take the
+		// last value.
+		atomic_thread_fence(memory_order::seq_cst);
+		s64 t = top_.value.load(memory_order::relaxed);
+
+		if (t > b) {
+			bottom_.value.store(b + 1, memory_order::relaxed);
+			return false;
+		}
+
+		value = __atomic_load_n(&slots_[b & (Capacity - 1)], __ATOMIC_RELAXED);
+
+		if (t == b) {
+			// The last value is raced for with thieves, by taking it from the top instead.
+			bool won = top_.value.compare_exchange_strong(t, t + 1, memory_order::seq_cst);
+			bottom_.value.store(b + 1, memory_order::relaxed);
+			return won;
+		}
+
+		return true;
+	}
+
+	/**
+	 * @brief Steals the oldest value.  Returns false if the deque is empty, or another thread got there first.
+	 */
+	bool steal(T &value)
+	{
+		s64 t = top_.value.load(memory_order::acquire);
+		atomic_thread_fence(memory_order::seq_cst);
+		s64 b = bottom_.value.load(memory_order::acquire);
+
+		if (t >= b) {
+			return false;
+		}
+
+		T v = __atomic_load_n(&slots_[t & (Capacity - 1)], __ATOMIC_RELAXED);
+		if (!top_.value.compare_exchange_strong(t, t + 1, memory_order::seq_cst)) {
+			return false;
+		}
+
+		value = v;
+		return true;
+	}
+
+	bool empty() const { return top_.value.load() >= bottom_.value.load(); }
+
+private:
+	// The top is written by thieves, and the bottom only by the owner.
+	cache_padded<atomic<s64>> top_;
+	cache_padded<atomic<s64>> bottom_;
+	T slots_[Capacity];
+};
+} // namespace stacsos
@@ -33,261 +33,304 @@ int stacsos::sprintf(char *buffer, const char *fmt, ...)
 	return rc;
 }
 
-static void prepend_to_buffer(char c, char *buffer, int size)
+// Every pair of decimal digits, so that numbers can be converted two digits per division.
+static const char digit_pairs[201] = "00010203040506070809"
+									 "10111213141516171819"
+									 "20212223242526272829"
+									 "30313233343536373839"
+									 "40414243444546474849"
+									 "50515253545556575859"
+									 "60616263646566676869"
+									 "70717273747576777879"
+									 "80818283848586878889"
+									 "90919293949596979899";
+
+static const char hex_digits[17] = "0123456789abcdef";
+
+static const u64 powers_of_ten[20] = { 1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+	1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull, 1000000000000000ull,
+	10000000000000000ull, 100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull };
+
+/**
+ * @brief The number of decimal digits in value.  The number of bits gives an estimate (1233/4096 is just over
+ * log10(2)), which is at most one too many.  Zero is treated as one, so that it has a digit.
+ */
+static int decimal_digits(u64 value)
 {
-	for (int i = size; i > 0; i--) {
-		buffer[i] = buffer[i - 1];
-	}
+	value |= 1;
 
-	*buffer = c;
+	int estimate = ((64 - __builtin_clzll(value)) * 1233) >> 12;
+	return estimate + 1 - (value < powers_of_ten[estimate]);
 }
 
-static int append_num(char *buffer, int size, u64 value, int base, bool sgn, int pad, char pad_char)
+/**
+ * @brief Writes value into out, which must have room for all of its digits, and returns how many there were.
+ */
+static int format_decimal(char *out, u64 value)
 {
-	int n = 0;
+	int length = decimal_digits(value);
+	char *p = out + length;
+
+	while (value >= 100) {
+		const char *pair = &digit_pairs[(value % 100) * 2];
+		value /= 100;
 
-	if (pad >= size) {
-		pad = size - 1;
+		*--p = pair[1];
+		*--p = pair[0];
 	}
 
-	if (sgn && (s64)value < 0) {
-		prepend_to_buffer('-', buffer, n++);
-		value = -value;
+	if (value >= 10) {
+		*--p = digit_pairs[value * 2 + 1];
+		*--p = digit_pairs[value * 2];
+	} else {
+		*--p = '0' + value;
 	}
 
-	if (value > 0) {
-		while (value > 0 && n < size) {
-			int digit_value = value % base;
+	return length;
+}
+
+/**
+ * @brief Writes value into out in a power-of-two base, with each digit being bits wide.
+ */
+static int format_pow2(char *out, u64 value, int bits)
+{
+	int length = (64 - __builtin_clzll(value | 1) + bits - 1) / bits;
+	u64 mask = (1u << bits) - 1;
 
-			switch (digit_value) {
-			case 0 ... 9:
-				prepend_to_buffer('0' + digit_value, buffer, n++);
-				break;
+	for (int i = length - 1; i >= 0; i--) {
+		out[i] = hex_digits[value & mask];
+		value >>= bits;
+	}
 
-			case 10 ... 35:
-				prepend_to_buffer('a' + digit_value - 10, buffer, n++);
-				break;
-			}
+	return length;
+}
 
-			value /= base;
+/**
+ * @brief The part of the buffer being printed into that is left.  Anything that doesn't fit is dropped.
+ */
+struct output {
+	char *buffer;
+	int space;
+	int count;
+
+	void put(char c)
+	{
+		if (count < space) {
+			buffer[count++] = c;
 		}
-	} else if (n < size) {
-		prepend_to_buffer('0', buffer, n++);
-		*buffer = '0';
 	}
-	pad -= n;
-	while (pad > 0 && n < size) {
-		prepend_to_buffer(pad_char, buffer, n++);
-		pad--;
+
+	void put(const char *text, int length)
+	{
+		if (length > space - count) {
+			length = space - count;
+		}
+
+		for (int i = 0; i < length; i++) {
+			buffer[count + i] = text[i];
+		}
+
+		count += length;
 	}
 
-	return n;
-}
+	void fill(char c, int length)
+	{
+		while (length-- > 0) {
+			put(c);
+		}
+	}
+};
 
-static int append_str(char *buffer, int size, const char *text, int pad, char pad_char)
+static void append_num(output &out, u64 value, int base, bool sgn, int pad, char pad_char)
 {
-	int n = 0;
+	// Enough for 64 binary digits.
+	char digits[64];
 
-	while (*text && n < size) {
-		*buffer = *text;
+	bool negative = sgn && (s64)value < 0;
+	if (negative) {
+		value = -value;
+	}
+
+	int length;
+	switch (base) {
+	case 10:
+		length = format_decimal(digits, value);
+		break;
+	case 16:
+		length = format_pow2(digits, value, 4);
+		break;
+	default:
+		length = format_pow2(digits, value, 1);
+		break;
+	}
 
-		buffer++;
-		text++;
+	pad -= length + negative;
 
-		n++;
+	// Zeroes go between the sign and the digits, but spaces go before the sign.
+	if (pad_char != '0') {
+		out.fill(pad_char, pad);
 	}
 
-	while (n < size && n < pad) {
-		*buffer++ = pad_char;
-		n++;
+	if (negative) {
+		out.put('-');
 	}
 
-	return n;
+	if (pad_char == '0') {
+		out.fill(pad_char, pad);
+	}
+
+	out.put(digits, length);
 }
 
-static int append_guid(char *buffer, int size, const unsigned char *guid)
+static void append_str(output &out, const char *text, int pad, char pad_char)
 {
-	int count = 0;
+	if (!text) {
+		text = "(null)";
+	}
 
+	int length = 0;
+	while (text[length] && out.count + length < out.space) {
+		length++;
+	}
+
+	out.put(text, length);
+	out.fill(pad_char, pad - length);
+}
+
+static void append_guid(output &out, const unsigned char *guid)
+{
 	u32 p0 = *(u32 *)(guid);
 	u16 p1 = *(u16 *)(guid + 4);
 	u16 p2 = *(u16 *)(guid + 6);
 	u16 p3 = byte_swap(*(u16 *)(guid + 8));
 	u64 p4 = byte_swap((u64) * (u32 *)(guid + 10) | (u64)(*(u16 *)(guid + 14)) << 32) >> 16;
 
-	int rc = append_num(buffer, size, p0, 16, false, 8, '0');
-	count += rc;
-	buffer += rc;
-	size -= rc;
-
-	*buffer++ = '-';
-	count++;
-	size--;
-
-	rc = append_num(buffer, size, p1, 16, false, 4, '0');
-	count += rc;
-	buffer += rc;
-	size -= rc;
-
-	*buffer++ = '-';
-	count++;
-	size--;
-
-	rc = append_num(buffer, size, p2, 16, false, 4, '0');
-	count += rc;
-	buffer += rc;
-	size -= rc;
-
-	*buffer++ = '-';
-	count++;
-	size--;
-	rc = append_num(buffer, size, p3, 16, false, 4, '0');
-	count += rc;
-	buffer += rc;
-	size -= rc;
-
-	*buffer++ = '-';
-	count++;
-	size--;
-
-	rc = append_num(buffer, size, p4, 16, false, 12, '0');
-	count += rc;
-	buffer += rc;
-	size -= rc;
-
-	return count;
-
-	// return append_str(buffer, size, "GUID", 0, '0');
+	append_num(out, p0, 16, false, 8, '0');
+	out.put('-');
+	append_num(out, p1, 16, false, 4, '0');
+	out.put('-');
+	append_num(out, p2, 16, false, 4, '0');
+	out.put('-');
+	append_num(out, p3, 16, false, 4, '0');
+	out.put('-');
+	append_num(out, p4, 16, false, 12, '0');
 }
 
 int stacsos::vsnprintf(char *buffer_base, int size, const char *fmt_base, va_list args)
 {
 	const char *fmt = fmt_base;
-	char *buffer = buffer_base;
 
 	// Handle a zero-sized buffer.
 	if (size == 0) {
 		return 0;
 	}
 
-	// Do the printing, while we are still consuming format characters, and
-	// haven't exceeded 'size'.
-	int count = 0;
-	while (*fmt != 0 && count < (size - 1)) {
-		if (*fmt == '%') {
-			int pad_size = 0, rc;
-			char pad_char = ' ';
-			int number_size = 4;
-
-		retry_format:
-			fmt++;
-
-			switch (*fmt) {
-			case 0:
-				continue;
-
-			case '0':
-				if (pad_size > 0) {
-					pad_size *= 10;
-				} else {
-					pad_char = '0';
-				}
-				goto retry_format;
+	// Do the printing, while we are still consuming format characters, and haven't filled the buffer (leaving room
+	// for the terminator).
+	output out { buffer_base, size - 1, 0 };
+	while (*fmt != 0 && out.count < out.space) {
+		if (*fmt != '%') {
+			// Copy everything up to the next conversion in one go.
+			const char *run = fmt;
+			while (*fmt && *fmt != '%') {
+				fmt++;
+			}
 
-			case '1' ... '9':
-				pad_size *= 10;
-				pad_size += *fmt - '0';
-				goto retry_format;
-
-			case 'd':
-			case 'u': {
-				u64 v;
-
-				if (number_size == 8) {
-					if (*fmt == 'u') {
-						v = (u64)va_arg(args, u64);
-					} else {
-						v = (u64)va_arg(args, s64);
-					}
-				} else {
-					if (*fmt == 'u') {
-						v = (u64)(u32)va_arg(args, u32);
-					} else {
-						v = (u64)(s64)(s32)va_arg(args, s32);
-					}
-				}
+			out.put(run, fmt - run);
+			continue;
+		}
+
+		int pad_size = 0;
+		char pad_char = ' ';
+		int number_size = 4;
+
+	retry_format:
+		fmt++;
 
-				rc = append_num(buffer, size - 1 - count, v, 10, *fmt == 'd', pad_size, pad_char);
-				count += rc;
-				buffer += rc;
-				break;
+		switch (*fmt) {
+		case 0:
+			continue;
+
+		case '0':
+			if (pad_size > 0) {
+				pad_size *= 10;
+			} else {
+				pad_char = '0';
 			}
+			goto retry_format;
 
-			case 'b':
-			case 'x':
-			case 'p': {
-				unsigned long long int v;
+		case '1' ... '9':
+			pad_size *= 10;
+			pad_size += *fmt - '0';
+			goto retry_format;
 
-				if (number_size == 8 || *fmt == 'p') {
-					v = va_arg(args, unsigned long long int);
+		case 'd':
+		case 'u': {
+			u64 v;
+
+			if (number_size == 8) {
+				if (*fmt == 'u') {
+					v = (u64)va_arg(args, u64);
 				} else {
-					v = (unsigned long long int)va_arg(args, unsigned int);
+					v = (u64)va_arg(args, s64);
 				}
-
-				if (*fmt == 'p') {
-					rc = append_str(buffer, size - 1 - count, "0x", 0, ' ');
-					count += rc;
-					buffer += rc;
+			} else {
+				if (*fmt == 'u') {
+					v = (u64)(u32)va_arg(args, u32);
+				} else {
+					v = (u64)(s64)(s32)va_arg(args, s32);
 				}
-
-				rc = append_num(buffer, size - 1 - count, v, (*fmt == 'b' ? 2 : 16), false, pad_size, pad_char);
-				count += rc;
-				buffer += rc;
-				break;
 			}
 
-			case 'l':
-				number_size = 8;
-				goto retry_format;
+			append_num(out, v, 10, *fmt == 'd', pad_size, pad_char);
+			break;
+		}
 
-			case 's':
-				rc = append_str(buffer, size - 1 - count, va_arg(args, const char *), pad_size, pad_char);
-				count += rc;
-				buffer += rc;
-				break;
+		case 'b':
+		case 'x':
+		case 'p': {
+			unsigned long long int v;
 
-			case 'c':
-				*buffer = va_arg(args, int);
+			if (number_size == 8 || *fmt == 'p') {
+				v = va_arg(args, unsigned long long int);
+			} else {
+				v = (unsigned long long int)va_arg(args, unsigned int);
+			}
+
+			if (*fmt == 'p') {
+				out.put("0x", 2);
+			}
 
-				buffer++;
-				count++;
-				break;
+			append_num(out, v, (*fmt == 'b' ? 2 : 16), false, pad_size, pad_char);
+			break;
+		}
 
-			case 'G':
-				rc = append_guid(buffer, size - 1 - count, va_arg(args, const unsigned char *));
-				count += rc;
-				buffer += rc;
-				break;
+		case 'l':
+		case 'z':
+			number_size = 8;
+			goto retry_format;
 
-			default:
-				*buffer = *fmt;
+		case 's':
+			append_str(out, va_arg(args, const char *), pad_size, pad_char);
+			break;
 
-				buffer++;
-				count++;
-				break;
-			}
+		case 'c':
+			out.put(va_arg(args, int));
+			break;
 
-			fmt++;
-		} else {
-			*buffer = *fmt;
+		case 'G':
+			append_guid(out, va_arg(args, const unsigned char *));
+			break;
 
-			buffer++;
-			fmt++;
-			count++;
+		default:
+			out.put(*fmt);
+			break;
 		}
+
+		fmt++;
 	}
 
 	// Null-terminate the buffer
-	*buffer = 0;
-	return count;
+	buffer_base[out.count] = 0;
+	return out.count;
 }
@@ -42,7 +42,7 @@ string string::format(const string &fmt, ...)
 	char pad_char = ' ';
 	int pad_width = 0;
 
-	const char *fmt_data = fmt.data_;
+	const char *fmt_data = fmt.c_str();
 	while (*fmt_data) {
 		switch (*fmt_data) {
 		case '%':
@@ -171,27 +171,21 @@ list<string> string::split(char delim, bool remove_empty)
 {
 	list<string> result;
 
-	const char *start = data_;
-	const char *end = (data_ + size_);
-	string current_part;
+	const char *data = c_str();
+	const char *end = data + size_;
+	const char *part = data;
 
-	while (start < end) {
-		if (*start == delim) {
-			if (current_part.length() == 0 && remove_empty) {
-				continue;
-			}
-
-			result.append(current_part);
-			current_part = "";
-		} else {
-			current_part += *start;
+	// Each part is copied out in one go, once its end has been found.
+	for (const char *p = data; p <= end; p++) {
+		if (p < end && *p != delim) {
+			continue;
 		}
 
-		start++;
-	}
+		if (p > part || !remove_empty) {
+			result.append(string(part, p - part));
+		}
 
-	if (current_part.length() > 0 || !remove_empty) {
-		result.append(current_part);
+		part = p + 1;
 	}
 
 	return result;
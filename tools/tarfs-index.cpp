@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Host Tools
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+
+/*
+ * Puts an index of a tar archive at the start of it, as a file called .tarfs-index, so that tarfs can read every
+ * path in the archive in one request when it is mounted, rather than a header from between the data of each file.
+ * The archive is still an ordinary tar archive.  Running it again on an archive that already has an index (e.g.
+ * after appending to it) replaces the index.
+ *
+ * The layout of the index must match tarfs_index_header and tarfs_index_record, in the kernel's tar-filesystem.h.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+static const char *index_name = ".tarfs-index";
+
+struct index_header {
+	char magic[8];
+	uint64_t nr_records;
+	uint64_t records_length;
+	uint64_t reserved;
+} __attribute__((packed));
+
+struct index_record {
+	uint64_t data_start;
+	uint64_t data_size;
+	uint32_t path_length;
+	uint32_t directory;
+} __attribute__((packed));
+
+struct entry {
+	std::string path;
+	bool directory;
+	uint64_t data_start, data_size;
+};
+
+static uint64_t parse_octal(const char *str, size_t maxlen)
+{
+	uint64_t num = 0;
+	for (size_t i = 0; i < maxlen && str[i] >= '0' && str[i] <= '7'; ++i) {
+		num = (num * 8) + (str[i] - '0');
+	}
+
+	return num;
+}
+
+static bool is_index(const uint8_t *header) { return memcmp(header, index_name, strlen(index_name) + 1) == 0; }
+
+/*
+ * Finds the entries of the archive in the same way that tarfs does when there is no index, with their data starts
+ * relative to the start of the archive.
+ */
+static std::vector<entry> scan(const std::vector<uint8_t> &archive)
+{
+	std::vector<entry> entries;
+
+	uint64_t nr_blocks = archive.size() / 512;
+	for (uint64_t block = 0; block < nr_blocks;) {
+		const uint8_t *header = &archive[block * 512];
+		if (!header[0]) {
+			break;
+		}
+
+		block++;
+
+		uint64_t size = parse_octal((const char *)&header[124], 12);
+		char type = header[156];
+
+		if (type != 'L' && type != 'K' && type != 'x' && type != 'g') {
+			entries.push_back({ std::string((const char *)header, strnlen((const char *)header, 100)), type == '5', block, size });
+		}
+
+		block += (size + 511) / 512;
+	}
+
+	return entries;
+}
+
+static void write_header(uint8_t *header, uint64_t size)
+{
+	memset(header, 0, 512);
+
+	strcpy((char *)&header[0], index_name);
+	strcpy((char *)&header[100], "0000444");
+	strcpy((char *)&header[108], "0000000");
+	strcpy((char *)&header[116], "0000000");
+	snprintf((char *)&header[124], 12, "%011llo", (unsigned long long)size);
+	strcpy((char *)&header[136], "00000000000");
+	header[156] = '0';
+	memcpy(&header[257], "ustar", 6);
+	memcpy(&header[263], "00", 2);
+
+	// The checksum is worked out with its own field as spaces.
+	memset(&header[148], ' ', 8);
+
+	unsigned int sum = 0;
+	for (int i = 0; i < 512; i++) {
+		sum += header[i];
+	}
+
+	snprintf((char *)&header[148], 7, "%06o", sum);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <archive.tar>\n", argv[0]);
+		return 1;
+	}
+
+	std::ifstream in(argv[1], std::ios::binary);
+	if (!in) {
+		fprintf(stderr, "tarfs-index: unable to open %s\n", argv[1]);
+		return 1;
+	}
+
+	std::vector<uint8_t> archive((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	in.close();
+
+	// An index that is already there is dropped, along with its data.
+	if (archive.size() >= 512 && is_index(&archive[0])) {
+		uint64_t size = parse_octal((const char *)&archive[124], 12);
+		archive.erase(archive.begin(), archive.begin() + std::min<size_t>(archive.size(), 512 + (((size + 511) / 512) * 512)));
+	}
+
+	std::vector<entry> entries = scan(archive);
+
+	std::vector<uint8_t> records;
+	for (const entry &e : entries) {
+		index_record r = { e.data_start, e.data_size, (uint32_t)e.path.size(), e.directory ? 1u : 0u };
+
+		records.insert(records.end(), (const uint8_t *)&r, (const uint8_t *)(&r + 1));
+		records.insert(records.end(), e.path.begin(), e.path.end());
+		records.resize((records.size() + 7) & ~7ull);
+	}
+
+	index_header ih = {};
+	memcpy(ih.magic, "TARFSIX1", sizeof(ih.magic));
+	ih.nr_records = entries.size();
+	ih.records_length = records.size();
+
+	uint64_t index_size = sizeof(ih) + records.size();
+	uint64_t index_blocks = 1 + ((index_size + 511) / 512);
+
+	// Every data start moves along by the size of the index, which doesn't depend on them, as records are of a fixed
+	// size.
+	for (size_t i = 0, offset = 0; i < entries.size(); i++) {
+		index_record *r = (index_record *)&records[offset];
+		r->data_start += index_blocks;
+
+		offset += (sizeof(index_record) + r->path_length + 7) & ~7ull;
+	}
+
+	uint8_t header[512];
+	write_header(header, index_size);
+
+	std::vector<uint8_t> out(index_blocks * 512, 0);
+	memcpy(&out[0], header, sizeof(header));
+	memcpy(&out[512], &ih, sizeof(ih));
+	memcpy(&out[512 + sizeof(ih)], records.data(), records.size());
+	out.insert(out.end(), archive.begin(), archive.end());
+
+	std::string tmp_path = std::string(argv[1]) + ".tmp";
+	std::ofstream of(tmp_path, std::ios::binary);
+	of.write((const char *)out.data(), out.size());
+	of.close();
+
+	if (!of || rename(tmp_path.c_str(), argv[1])) {
+		fprintf(stderr, "tarfs-index: unable to write %s\n", argv[1]);
+		return 1;
+	}
+
+	printf("tarfs-index: indexed %zu entries in %llu blocks\n", entries.size(), (unsigned long long)index_blocks);
+	return 0;
+}
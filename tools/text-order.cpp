@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - Host Tools
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+
+/*
+ * Turns a kernel profile into the order to lay out the kernel's functions in, hottest first, so that the functions
+ * that run all the time share as few cache lines and pages as they can.  The profile is the folded stacks that prof
+ * writes out (one stack a line, from the outermost function in, separated by semicolons, then the number of samples
+ * taken in it), and the order is the functions' mangled names, one a line, which the kernel's Makefile turns into a
+ * linker script.
+ *
+ * A function is as hot as the number of samples taken while it was anywhere on the stack, so that the functions on
+ * the way to a hot leaf (e.g. the system call entry) sit near it.  Time in user mode, and addresses that weren't in
+ * any function, are left out.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <folded stacks> <text order>\n", argv[0]);
+		return 1;
+	}
+
+	std::ifstream input(argv[1]);
+	if (!input) {
+		fprintf(stderr, "error: unable to open %s\n", argv[1]);
+		return 1;
+	}
+
+	std::map<std::string, uint64_t> samples;
+	std::string line;
+
+	while (std::getline(input, line)) {
+		size_t space = line.rfind(' ');
+		if (space == std::string::npos) {
+			continue;
+		}
+
+		uint64_t count = strtoull(line.c_str() + space + 1, nullptr, 10);
+
+		// A recursive function is only counted once for each stack it is on.
+		std::set<std::string> seen;
+		size_t start = 0;
+
+		while (start < space) {
+			size_t end = std::min(line.find(';', start), space);
+			std::string name = line.substr(start, end - start);
+
+			if (!name.empty() && name[0] != '[' && name.compare(0, 2, "0x") != 0 && seen.insert(name).second) {
+				samples[name] += count;
+			}
+
+			start = end + 1;
+		}
+	}
+
+	std::vector<std::pair<std::string, uint64_t>> order(samples.begin(), samples.end());
+	std::stable_sort(order.begin(), order.end(), [](const auto &l, const auto &r) { return l.second > r.second; });
+
+	std::ofstream output(argv[2]);
+	if (!output) {
+		fprintf(stderr, "error: unable to create %s\n", argv[2]);
+		return 1;
+	}
+
+	for (const auto &[name, count] : order) {
+		output << name << '\n';
+	}
+
+	printf("%zu functions\n", order.size());
+	return 0;
+}
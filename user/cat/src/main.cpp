@@ -5,17 +5,18 @@
  * Copyright (c) University of St Andrews 2024, 2025
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/buffered-io.h>
 #include <stacsos/console.h>
 #include <stacsos/memops.h>
 #include <stacsos/objects.h>
 
 using namespace stacsos;
 
+// With no filename, cat copies its input instead, so that it can be put at the end of a pipe.
 int main(const char *cmdline)
 {
-	if (!cmdline || memops::strlen(cmdline) == 0) {
-		console::get().write("error: usage: cat [-f] <filename>\n");
-		return 1;
+	if (!cmdline) {
+		cmdline = "";
 	}
 
 	bool formatting_mode = false;
@@ -26,7 +27,7 @@ int main(const char *cmdline)
 			if (*cmdline++ == 'f') {
 				formatting_mode = true;
 			} else {
-				console::get().write("error: usage: cat [-f] <filename>\n");
+				console::get().write("error: usage: cat [-f] [filename]\n");
 				return 1;
 			}
 		} else {
@@ -38,43 +39,60 @@ int main(const char *cmdline)
 		cmdline++;
 	};
 
-	object *file = object::open(cmdline);
-	if (!file) {
+	object *file = *cmdline ? object::open(cmdline) : nullptr;
+	if (*cmdline && !file) {
 		console::get().writef("error: unable to open file '%s' for reading\n", cmdline);
 		return 1;
 	}
 
-	char buffer[64];
-	int bytes_read;
+	// Without formatting, the input goes straight to the output inside the kernel, with a single system call.
+	if (!formatting_mode) {
+		object *input = file ? file : console::get().input();
+		console::get().flush();
+		input->copy_to(console::get().output(), COPY_CURRENT_POSITION, ~0ull);
 
-	bool coloured = false;
+		delete file;
+		return 0;
+	}
+
+	// In formatting mode, the input is read a line at a time, and the output (with the colour escapes between runs of
+	// text) is built up and written out a buffer at a time.
+	buffered_reader in(file ? file : console::get().input());
+	buffered_writer out(console::get().output());
+	console::get().flush();
+
+	static const char colour_on[] = "\e\x0e";
+	static const char colour_off[] = "\e\x07";
 
-	do {
-		bytes_read = file->read(buffer, sizeof(buffer) - 1);
-		buffer[bytes_read] = 0;
+	char line[256];
+	size_t length;
+	bool coloured = false;
 
-		if (formatting_mode) {
-			char *ch = &buffer[0];
-			while (*ch) {
-				if (*ch == '`') {
-					coloured = !coloured;
-					if (coloured) {
-						console::get().write("\e\x0e");
-					}
+	while ((length = in.read_line(line, sizeof(line))) > 0) {
+		char *run = &line[0];
+		char *end = &line[length];
 
-					console::get().writef("%c", *ch++);
+		// The backticks themselves are shown in colour.
+		for (char *ch = run; ch < end; ch++) {
+			if (*ch == '`') {
+				coloured = !coloured;
 
-					if (!coloured) {
-						console::get().write("\e\x07");
-					}
+				if (coloured) {
+					out.write(run, ch - run);
+					out.write(colour_on, sizeof(colour_on) - 1);
+					run = ch;
 				} else {
-					console::get().writef("%c", *ch++);
+					out.write(run, ch + 1 - run);
+					out.write(colour_off, sizeof(colour_off) - 1);
+					run = ch + 1;
 				}
 			}
-		} else {
-			console::get().writef("%s", buffer);
 		}
-	} while (bytes_read > 0);
+
+		out.write(run, end - run);
+	}
+
+	out.flush();
 
 	delete file;
 	return 0;
@@ -0,0 +1,170 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - fiber runtime benchmark utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/fibers.h>
+#include <stacsos/objects.h>
+#include <stacsos/parse.h>
+#include <stacsos/threads.h>
+
+using namespace stacsos;
+
+static const u64 yield_fibers = 64;
+static const u64 yields_per_fiber = 10000;
+static const u64 spawn_fibers = 20000;
+static const u64 io_fibers = 2048;
+static const u64 io_block_size = KB(4);
+
+static const char *io_file = "/boot/stacsos.sym";
+
+static void bench_yield(u32 nr_workers)
+{
+	fiber_runtime rt(nr_workers);
+
+	for (u64 i = 0; i < yield_fibers; i++) {
+		rt.spawn([] {
+			for (u64 j = 0; j < yields_per_fiber; j++) {
+				fiber_runtime::yield();
+			}
+		});
+	}
+
+	u64 start = clock_now_ns();
+	rt.run();
+	u64 total = clock_now_ns() - start;
+
+	u64 switches = yield_fibers * yields_per_fiber;
+	bench_result("fiber-yield", "workers=%u fibers=%llu switches=%llu total_ns=%llu ns_per_switch=%llu", rt.nr_workers(), yield_fibers, switches,
+		total, total / switches);
+}
+
+static void bench_spawn(u32 nr_workers)
+{
+	fiber_runtime rt(nr_workers);
+	u64 done = 0;
+
+	// The fibers are spawned from a fiber, so that their stacks come from the ones that have already finished.
+	u64 start = clock_now_ns();
+
+	rt.spawn([&rt, &done] {
+		for (u64 i = 0; i < spawn_fibers; i++) {
+			rt.spawn([&done] { __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED); });
+		}
+	});
+
+	rt.run();
+	u64 total = clock_now_ns() - start;
+
+	bench_result("fiber-spawn", "workers=%u fibers=%llu completed=%llu total_ns=%llu ns_per_fiber=%llu", rt.nr_workers(), spawn_fibers, done, total,
+		total / spawn_fibers);
+}
+
+static void bench_io(u32 nr_workers)
+{
+	object *file = object::open(io_file);
+	u64 size;
+
+	if (!file || !file->size(size) || size < io_block_size) {
+		bench_result("fiber-pread", "skipped=%s", io_file);
+		delete file;
+		return;
+	}
+
+	fiber_runtime rt(nr_workers);
+	u64 blocks = size / io_block_size;
+	u64 bytes = 0;
+	u64 errors = 0;
+
+	// Each fiber reads one block into a buffer on its own stack, so thousands of reads are in flight at once.
+	for (u64 i = 0; i < io_fibers; i++) {
+		rt.spawn([file, i, blocks, &bytes, &errors] {
+			char buffer[io_block_size];
+
+			size_t n = fiber_runtime::pread(file, buffer, io_block_size, (i % blocks) * io_block_size);
+			if (n != io_block_size) {
+				__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+			}
+
+			__atomic_add_fetch(&bytes, n, __ATOMIC_RELAXED);
+		});
+	}
+
+	u64 start = clock_now_ns();
+	rt.run();
+	u64 total = clock_now_ns() - start;
+
+	// Bytes per microsecond is (near enough) megabytes per second.
+	bench_result("fiber-pread", "workers=%u fibers=%llu bytes=%llu errors=%llu total_ns=%llu mb_per_s=%llu", rt.nr_workers(), io_fibers, bytes, errors,
+		total, (bytes * 1000) / max(total, 1ull));
+
+	delete file;
+}
+
+static void bench_wait(u32 nr_workers)
+{
+	const u64 rounds = 1000;
+
+	// Two fibers pass a byte back and forth through a pair of pipes, each waiting (via the reactor) for the other.
+	object *a_read, *a_write, *b_read, *b_write;
+	if (!object::create_pipe(a_read, a_write) || !object::create_pipe(b_read, b_write)) {
+		console::get().write("fiber-wait skipped=pipes\n");
+		return;
+	}
+
+	fiber_runtime rt(nr_workers);
+
+	rt.spawn([a_read, b_write] {
+		char ch;
+		for (u64 i = 0; i < rounds; i++) {
+			fiber_runtime::wait(a_read);
+			a_read->read(&ch, 1);
+			b_write->write(&ch, 1);
+		}
+	});
+
+	rt.spawn([a_write, b_read] {
+		char ch = 'x';
+		for (u64 i = 0; i < rounds; i++) {
+			a_write->write(&ch, 1);
+			fiber_runtime::wait(b_read);
+			b_read->read(&ch, 1);
+		}
+	});
+
+	u64 start = clock_now_ns();
+	rt.run();
+	u64 total = clock_now_ns() - start;
+
+	bench_result("fiber-wait", "workers=%u round_trips=%llu total_ns=%llu ns_per_round_trip=%llu", rt.nr_workers(), rounds, total, total / rounds);
+
+	delete a_read;
+	delete a_write;
+	delete b_read;
+	delete b_write;
+}
+
+/*
+ * fiber-bench [workers]
+ *
+ * Measures the fiber runtime: switching between fibers that yield, spawning fibers that do nothing, thousands of
+ * fibers each reading a block of a file at once, and two fibers waiting on each other through pipes.  By default there
+ * is one worker per core.
+ */
+int main(const char *cmdline)
+{
+	u64 nr_workers;
+	parse_u64(cmdline, nr_workers);
+
+	bench_yield(nr_workers);
+	bench_spawn(nr_workers);
+	bench_io(nr_workers);
+	bench_wait(nr_workers);
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - grep utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/objects.h>
+
+using namespace stacsos;
+
+// Lines longer than this are split, and each part is matched on its own.
+static const size_t max_line = 256;
+
+static bool contains(const char *line, size_t length, const char *pattern, size_t pattern_length)
+{
+	for (size_t i = 0; i + pattern_length <= length; i++) {
+		if (memops::memcmp(&line[i], pattern, pattern_length) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * grep <pattern> [filename]
+ *
+ * Shows each line of the file, or of the input if there is no file, that contains the pattern.
+ */
+int main(const char *cmdline)
+{
+	if (!cmdline || !*cmdline) {
+		console::get().write("error: usage: grep <pattern> [filename]\n");
+		return 1;
+	}
+
+	char pattern[64];
+	size_t pattern_length = 0;
+	while (*cmdline && *cmdline != ' ' && pattern_length < sizeof(pattern) - 1) {
+		pattern[pattern_length++] = *cmdline++;
+	}
+	pattern[pattern_length] = 0;
+
+	while (*cmdline == ' ') {
+		cmdline++;
+	}
+
+	object *file = nullptr;
+	if (*cmdline) {
+		file = object::open(cmdline);
+		if (!file) {
+			console::get().writef("error: unable to open file '%s' for reading\n", cmdline);
+			return 1;
+		}
+	}
+
+	char buffer[512];
+	char line[max_line + 1];
+	size_t line_length = 0;
+
+	auto end_line = [&] {
+		if (contains(line, line_length, pattern, pattern_length)) {
+			line[line_length] = 0;
+			console::get().writef("%s\n", line);
+		}
+
+		line_length = 0;
+	};
+
+	size_t n;
+	while ((n = file ? file->read(buffer, sizeof(buffer)) : console::get().read(buffer, sizeof(buffer))) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (buffer[i] == '\n') {
+				end_line();
+				continue;
+			}
+
+			line[line_length++] = buffer[i];
+			if (line_length == max_line) {
+				end_line();
+			}
+		}
+	}
+
+	// The last line may not end with a newline.
+	if (line_length) {
+		end_line();
+	}
+
+	delete file;
+	return 0;
+}
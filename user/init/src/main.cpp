@@ -5,7 +5,10 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/buffered-io.h>
+#include <stacsos/clock.h>
 #include <stacsos/console.h>
+#include <stacsos/memops.h>
 #include <stacsos/objects.h>
 #include <stacsos/process.h>
 #include <stacsos/user-syscall.h>
@@ -79,27 +82,397 @@ static void logo()
 	}
 }
 
-int main(const char *cmdline)
+// The services to start, one per line: a name, a type, the services it must start after (separated by commas, or "-"
+// for none), the program, and its arguments.
+//
+//   oneshot  runs to completion, and the services after it start once it has finished.
+//   daemon   the services after it start as soon as it has been started, and it is started again if it exits.
+//   console  as a daemon, but once it exits, it is only started again when Enter is pressed (i.e. the shell).
+static const char *manifest_path = "/etc/services";
+
+// Used if there is no manifest.
+static const char *default_manifest = "shell console - /usr/shell\n";
+
+static const u32 max_services = 32;
+static const u32 max_deps = 8;
+static const u32 max_restarts = 5;
+
+enum class service_type { oneshot, daemon, console };
+
+// A service waits in pending until everything it starts after is up.  A daemon (or console) is up once it is running,
+// and a oneshot once it has finished.
+enum class service_state { pending, running, finished, held, failed };
+
+struct service {
+	char name[32];
+	char path[64];
+	char args[128];
+	service_type type;
+
+	char dep_names[max_deps][32];
+	u32 deps[max_deps];
+	u32 nr_deps;
+
+	service_state state;
+	bool up;
+	u32 restarts;
+
+	process *proc;
+	u64 start_ns;
+};
+
+static service services[max_services];
+static u32 nr_services;
+
+static u64 boot_ns;
+static u32 nr_up;
+
+static const char *skip_spaces(const char *p)
 {
-	logo();
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
 
-	console::get().write("\e\x07\nSwitch virtual consoles by pressing Alt+F{1,2}\n\n");
-	console::get().write("\e\x0cStarting the shell...\e\x07\n\n");
+	return p;
+}
+
+// Copies the next word into the buffer (cutting it short if it doesn't fit), and returns what follows it.
+static const char *next_word(const char *p, char *word, size_t size)
+{
+	p = skip_spaces(p);
+
+	size_t n = 0;
+	while (*p && *p != ' ' && *p != '\t' && *p != '\n') {
+		if (n + 1 < size) {
+			word[n++] = *p;
+		}
+
+		p++;
+	}
+
+	word[n] = 0;
+	return p;
+}
+
+static void parse_service(const char *line)
+{
+	const char *p = skip_spaces(line);
+	if (!*p || *p == '\n' || *p == '#') {
+		return;
+	}
+
+	if (nr_services == max_services) {
+		console::get().write("init: too many services\n");
+		return;
+	}
+
+	service &s = services[nr_services];
+	char type[16], deps[128];
+
+	p = next_word(p, s.name, sizeof(s.name));
+	p = next_word(p, type, sizeof(type));
+	p = next_word(p, deps, sizeof(deps));
+	p = next_word(p, s.path, sizeof(s.path));
+
+	if (!s.path[0]) {
+		console::get().writef("init: malformed service: %s", line);
+		return;
+	}
+
+	if (memops::strcmp(type, "oneshot") == 0) {
+		s.type = service_type::oneshot;
+	} else if (memops::strcmp(type, "daemon") == 0) {
+		s.type = service_type::daemon;
+	} else if (memops::strcmp(type, "console") == 0) {
+		s.type = service_type::console;
+	} else {
+		console::get().writef("init: %s: unknown type '%s'\n", s.name, type);
+		return;
+	}
+
+	// Whatever is left of the line (without the newline) is the program's arguments.
+	p = skip_spaces(p);
+	size_t n = 0;
+	while (p[n] && p[n] != '\n' && n + 1 < sizeof(s.args)) {
+		s.args[n] = p[n];
+		n++;
+	}
+
+	s.args[n] = 0;
+
+	s.nr_deps = 0;
+	if (memops::strcmp(deps, "-") != 0) {
+		const char *d = deps;
+
+		while (*d && s.nr_deps < max_deps) {
+			char *name = s.dep_names[s.nr_deps++];
+
+			size_t len = 0;
+			while (*d && *d != ',') {
+				if (len + 1 < sizeof(s.dep_names[0])) {
+					name[len++] = *d;
+				}
+
+				d++;
+			}
+
+			name[len] = 0;
+
+			if (*d == ',') {
+				d++;
+			}
+		}
+	}
+
+	s.state = service_state::pending;
+	s.up = false;
+	s.restarts = 0;
+	s.proc = nullptr;
+
+	nr_services++;
+}
+
+static void load_manifest()
+{
+	object *file = object::open(manifest_path);
+
+	if (!file) {
+		parse_service(default_manifest);
+		return;
+	}
+
+	buffered_reader reader(file);
+	char line[256];
 
 	while (true) {
-		auto shell_proc = process::create("/usr/shell", "");
-		if (shell_proc == nullptr) {
-			console::get().write("ERROR: Unable to launch shell.\n");
-			return 1;
+		size_t n = reader.read_line(line, sizeof(line) - 1);
+		if (!n) {
+			break;
+		}
+
+		line[n] = 0;
+		parse_service(line);
+	}
+
+	delete file;
+}
+
+// Replaces the names of the services that each one starts after with their indices.  A service that starts after one
+// that doesn't exist can never start.
+static void resolve_deps()
+{
+	for (u32 i = 0; i < nr_services; i++) {
+		service &s = services[i];
+
+		for (u32 d = 0; d < s.nr_deps; d++) {
+			u32 j = 0;
+			while (j < nr_services && memops::strcmp(services[j].name, s.dep_names[d]) != 0) {
+				j++;
+			}
+
+			if (j == nr_services) {
+				console::get().writef("init: %s: no such service '%s'\n", s.name, s.dep_names[d]);
+				s.state = service_state::failed;
+				break;
+			}
+
+			s.deps[d] = j;
 		}
+	}
+}
+
+static void mark_up(service &s)
+{
+	if (s.up) {
+		return;
+	}
 
-		shell_proc->wait_for_exit();
-		delete shell_proc;
+	s.up = true;
+	nr_up++;
 
-		console::get().write("Shell has \e\x04terminated\e\x07.  PRESS ENTER TO RESTART...\n");
-		while (console::get().read_char() != '\n')
+	u64 now = clock_now_ns();
+	console::get().writef("init: %s up in %llu us, %llu us after boot\n", s.name, (now - s.start_ns) / 1000, (now - boot_ns) / 1000);
+
+	if (nr_up == nr_services) {
+		console::get().writef("init: all %u services up in %llu us\n", nr_services, (now - boot_ns) / 1000);
+	}
+}
+
+static void launch(service &s)
+{
+	s.start_ns = clock_now_ns();
+	s.proc = process::create(s.path, s.args);
+
+	if (!s.proc) {
+		console::get().writef("init: %s: unable to start %s\n", s.name, s.path);
+		s.state = service_state::failed;
+		return;
+	}
+
+	s.state = service_state::running;
+
+	if (s.type != service_type::oneshot) {
+		mark_up(s);
+	}
+}
+
+// Starts every pending service whose dependencies are all up, and gives up on those whose dependencies have failed.
+// Returns true if anything changed, since a failure can cause others.
+static bool start_ready_services()
+{
+	bool changed = false;
+
+	for (u32 i = 0; i < nr_services; i++) {
+		service &s = services[i];
+		if (s.state != service_state::pending) {
+			continue;
+		}
+
+		bool ready = true, failed = false;
+		for (u32 d = 0; d < s.nr_deps; d++) {
+			const service &dep = services[s.deps[d]];
+
+			if (dep.state == service_state::failed && !dep.up) {
+				failed = true;
+			} else if (!dep.up) {
+				ready = false;
+			}
+		}
+
+		if (failed) {
+			console::get().writef("init: %s: not started, because a service it needs failed\n", s.name);
+			s.state = service_state::failed;
+			changed = true;
+		} else if (ready) {
+			launch(s);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+static void service_exited(service &s)
+{
+	delete s.proc;
+	s.proc = nullptr;
+
+	switch (s.type) {
+	case service_type::oneshot:
+		s.state = service_state::finished;
+		mark_up(s);
+		break;
+
+	case service_type::daemon:
+		if (++s.restarts > max_restarts) {
+			console::get().writef("init: %s exited too many times, and won't be restarted\n", s.name);
+			s.state = service_state::failed;
+		} else {
+			console::get().writef("init: %s exited, restarting\n", s.name);
+			launch(s);
+		}
+		break;
+
+	case service_type::console:
+		console::get().writef("%s has \e\x04terminated\e\x07.  PRESS ENTER TO RESTART...\n", s.name);
+		s.state = service_state::held;
+		break;
+	}
+}
+
+// Console services that are held are restarted once a line (i.e. Enter) has been read.
+static void console_input()
+{
+	char buffer[64];
+	size_t n = console::get().read(buffer, sizeof(buffer));
+
+	bool enter = false;
+	for (size_t i = 0; i < n; i++) {
+		enter |= buffer[i] == '\n';
+	}
+
+	if (!enter) {
+		return;
+	}
+
+	for (u32 i = 0; i < nr_services; i++) {
+		if (services[i].state == service_state::held) {
+			launch(services[i]);
+		}
+	}
+}
+
+static void supervise()
+{
+	wait_entry entries[max_services + 1];
+	service *waiting[max_services];
+
+	while (true) {
+		while (start_ready_services())
 			;
+
+		// Every running service is waited for at once, along with the console, if a service is waiting for Enter.
+		u32 n = 0;
+		bool held = false;
+
+		for (u32 i = 0; i < nr_services; i++) {
+			service &s = services[i];
+
+			if (s.state == service_state::running) {
+				waiting[n] = &s;
+				entries[n++] = wait_entry { s.proc->handle(), 0 };
+			} else if (s.state == service_state::held) {
+				held = true;
+			}
+		}
+
+		u32 nr_procs = n;
+		if (held) {
+			entries[n++] = wait_entry { console::get().input()->handle(), 0 };
+		}
+
+		if (!n) {
+			// Anything still pending is waiting for a service that will never be up, i.e. there is a cycle.
+			for (u32 i = 0; i < nr_services; i++) {
+				if (services[i].state == service_state::pending) {
+					console::get().writef("init: %s: not started, because of a dependency cycle\n", services[i].name);
+				}
+			}
+
+			console::get().write("init: no services left to supervise\n");
+			return;
+		}
+
+		syscalls::wait_many(entries, n, WAIT_FOREVER);
+
+		for (u32 i = 0; i < nr_procs; i++) {
+			if (entries[i].ready) {
+				service_exited(*waiting[i]);
+			}
+		}
+
+		if (held && entries[nr_procs].ready) {
+			console_input();
+		}
 	}
+}
+
+/*
+ * Draws the logo, then starts the services listed in /etc/services, running each as soon as the ones it depends on
+ * are up (rather than one after another), and supervises them from then on.
+ */
+int main(const char *cmdline)
+{
+	logo();
+
+	console::get().write("\e\x07\nSwitch virtual consoles by pressing Alt+F{1,2}\n\n");
+	console::get().write("\e\x0cStarting services...\e\x07\n\n");
+
+	boot_ns = clock_now_ns();
+
+	load_manifest();
+	resolve_deps();
+	supervise();
 
-	return 0;
+	return 1;
 }
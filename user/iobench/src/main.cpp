@@ -0,0 +1,392 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - block I/O benchmark utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/async-io.h>
+#include <stacsos/bench.h>
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/objects.h>
+#include <stacsos/parse.h>
+#include <stacsos/threads.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+static const u64 max_threads = 16;
+static const u64 max_depth = 4096;
+static const u64 default_block_size = KB(4);
+static const u64 default_size = MB(16);
+static const u64 default_random_ops = 1024;
+
+static u64 tsc_hz;
+
+static u64 cycles_to_us(u64 cycles) { return cycles / (tsc_hz / 1'000'000); }
+
+static u64 next_random(u64 &state)
+{
+	// xorshift64
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+enum class test_kind { seqread, randread, seqwrite, randwrite };
+
+static const char *test_name(test_kind kind)
+{
+	switch (kind) {
+	case test_kind::seqread:
+		return "seqread";
+	case test_kind::randread:
+		return "randread";
+	case test_kind::seqwrite:
+		return "seqwrite";
+	default:
+		return "randwrite";
+	}
+}
+
+struct worker {
+	object *target;
+	test_kind kind;
+	u64 block_size;
+
+	// A sequential worker covers [start, start + length) in order.  A random one does nr_ops accesses anywhere in
+	// [0, length), at multiples of the block size.
+	u64 start, length;
+	u64 nr_ops;
+	u64 seed;
+
+	// The time each access took, and the number of bytes moved altogether.
+	u64 *latencies;
+	u64 nr_latencies;
+	u64 bytes;
+};
+
+static void *worker_proc(void *arg)
+{
+	worker *w = (worker *)arg;
+	char *buffer = new char[w->block_size];
+	memops::memset(buffer, 0x5a, w->block_size);
+
+	bool writing = w->kind == test_kind::seqwrite || w->kind == test_kind::randwrite;
+	bool random = w->kind == test_kind::randread || w->kind == test_kind::randwrite;
+
+	u64 state = w->seed;
+	u64 nr_blocks = w->length / w->block_size;
+
+	for (u64 i = 0; i < w->nr_ops; i++) {
+		u64 offset = random ? (next_random(state) % nr_blocks) * w->block_size : w->start + (i * w->block_size);
+
+		u64 start = bench_rdtsc();
+		size_t n = writing ? w->target->pwrite(buffer, w->block_size, offset) : w->target->pread(buffer, w->block_size, offset);
+		w->latencies[w->nr_latencies++] = bench_rdtsc() - start;
+
+		w->bytes += n;
+		if (n < w->block_size) {
+			break;
+		}
+	}
+
+	delete[] buffer;
+	return nullptr;
+}
+
+static void sort(u64 *values, u64 count)
+{
+	// Shell sort, with Ciura's gaps (extended by 2.25x), which is quick enough for a few hundred thousand samples.
+	static const u64 gaps[] = { 1, 4, 10, 23, 57, 132, 301, 701, 1577, 3548, 7983, 17961, 40412, 90927, 204585 };
+
+	for (int g = sizeof(gaps) / sizeof(gaps[0]) - 1; g >= 0; g--) {
+		u64 gap = gaps[g];
+
+		for (u64 i = gap; i < count; i++) {
+			u64 v = values[i];
+			u64 j = i;
+
+			while (j >= gap && values[j - gap] > v) {
+				values[j] = values[j - gap];
+				j -= gap;
+			}
+
+			values[j] = v;
+		}
+	}
+}
+
+static void report(const char *name, u64 block_size, const char *parallelism, u64 amount, u64 *latencies, u64 nr_ops, u64 bytes, u64 elapsed)
+{
+	sort(latencies, nr_ops);
+
+	auto percentile = [&](u64 p) { return nr_ops ? cycles_to_us(latencies[min((nr_ops * p) / 100, nr_ops - 1)]) : 0; };
+
+	u64 elapsed_us = max(cycles_to_us(elapsed), (u64)1);
+
+	bench_result(name, "bs=%llu %s=%llu ops=%llu bytes=%llu us=%llu mb_per_s=%llu iops=%llu p50_us=%llu p90_us=%llu p99_us=%llu max_us=%llu", block_size,
+		parallelism, amount, nr_ops, bytes, elapsed_us, bytes / elapsed_us, (nr_ops * 1'000'000) / elapsed_us, percentile(50),
+		percentile(90), percentile(99), nr_ops ? cycles_to_us(latencies[nr_ops - 1]) : 0);
+}
+
+static void run_test(object *target, test_kind kind, u64 block_size, u64 nr_threads, u64 size, u64 random_ops)
+{
+	bool random = kind == test_kind::randread || kind == test_kind::randwrite;
+
+	// Each sequential worker gets an equal share of the range, and each random worker an equal share of the accesses.
+	u64 share = ((size / nr_threads) / block_size) * block_size;
+	u64 ops_per_thread = random ? max(random_ops / nr_threads, (u64)1) : share / block_size;
+
+	if (!ops_per_thread) {
+		bench_result(test_name(kind), "error=range-too-small");
+		return;
+	}
+
+	worker workers[max_threads];
+	thread *threads[max_threads];
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		workers[i] = { target, kind, block_size, random ? 0 : i * share, random ? size : share, ops_per_thread, 0x9e3779b97f4a7c15ull * (i + 1),
+			new u64[ops_per_thread], 0, 0 };
+	}
+
+	u64 start = bench_rdtsc();
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		threads[i] = thread::start(worker_proc, &workers[i]);
+	}
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+
+	// Writes only count once they are durable.
+	if (kind == test_kind::seqwrite || kind == test_kind::randwrite) {
+		target->fsync();
+	}
+
+	u64 elapsed = max(bench_rdtsc() - start, (u64)1);
+
+	u64 bytes = 0, nr_ops = 0;
+	for (u64 i = 0; i < nr_threads; i++) {
+		bytes += workers[i].bytes;
+		nr_ops += workers[i].nr_latencies;
+	}
+
+	u64 *latencies = new u64[max(nr_ops, (u64)1)];
+	u64 n = 0;
+	for (u64 i = 0; i < nr_threads; i++) {
+		memops::memcpy(&latencies[n], workers[i].latencies, workers[i].nr_latencies * sizeof(u64));
+		n += workers[i].nr_latencies;
+
+		delete[] workers[i].latencies;
+	}
+
+	report(test_name(kind), block_size, "threads", nr_threads, latencies, nr_ops, bytes, elapsed);
+	delete[] latencies;
+}
+
+/*
+ * Reads at random from a single thread, through an asynchronous I/O ring, keeping up to depth reads in flight.
+ */
+static void run_async_test(object *target, u64 block_size, u64 depth, u64 size, u64 nr_ops)
+{
+	u32 entries = 1;
+	while (entries < depth) {
+		entries <<= 1;
+	}
+
+	io_ring *ring = io_ring::create(entries, io_ring_flags::async);
+	if (!ring) {
+		bench_result("asyncread", "error=ring");
+		return;
+	}
+
+	// Each read in flight has a buffer slot of its own, which its completion gives back.
+	char *buffers = new char[depth * block_size];
+	u64 *slot_start = new u64[depth];
+	u64 *free_slots = new u64[depth];
+	u64 *latencies = new u64[max(nr_ops, (u64)1)];
+
+	for (u64 i = 0; i < depth; i++) {
+		free_slots[i] = i;
+	}
+
+	u64 nr_free = depth, queued = 0, completed = 0, bytes = 0;
+	u64 state = 0x9e3779b97f4a7c15ull;
+	u64 nr_blocks = size / block_size;
+
+	u64 start = bench_rdtsc();
+
+	while (completed < nr_ops) {
+		while (queued < nr_ops && nr_free) {
+			u64 slot = free_slots[--nr_free];
+			u64 offset = (next_random(state) % nr_blocks) * block_size;
+
+			slot_start[slot] = bench_rdtsc();
+			ring->queue_pread(target, &buffers[slot * block_size], block_size, offset, slot);
+			queued++;
+		}
+
+		ring->submit(1);
+
+		io_ring_cqe cqe;
+		while (ring->next_completion(cqe)) {
+			latencies[completed++] = bench_rdtsc() - slot_start[cqe.user_data];
+			bytes += cqe.result;
+			free_slots[nr_free++] = cqe.user_data;
+		}
+	}
+
+	u64 elapsed = max(bench_rdtsc() - start, (u64)1);
+
+	report("asyncread", block_size, "depth", depth, latencies, nr_ops, bytes, elapsed);
+
+	delete[] latencies;
+	delete[] free_slots;
+	delete[] slot_start;
+	delete[] buffers;
+	delete ring;
+}
+
+static u64 find_size(object *target, u64 limit)
+{
+	// Nothing says how big an object is, so find the end by reading single bytes, a binary search below the limit.
+	char byte;
+	if (target->pread(&byte, 1, limit - 1) == 1) {
+		return limit;
+	}
+
+	u64 low = 0, high = limit - 1;
+	while (low < high) {
+		u64 mid = low + (high - low + 1) / 2;
+
+		if (target->pread(&byte, 1, mid - 1) == 1) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	return low;
+}
+
+// A size may be given in kilobytes or megabytes, with a k or m after the number.
+static const char *parse_size(const char *p, u64 &value)
+{
+	parse_u64(p, value);
+
+	if (*p == 'k' || *p == 'K') {
+		value = KB(value);
+		p++;
+	} else if (*p == 'm' || *p == 'M') {
+		value = MB(value);
+		p++;
+	}
+
+	return p;
+}
+
+static void usage() { console::get().write("error: usage: iobench [-w] [-b <block size>] [-t <threads>] [-s <size>] [-n <random ops>] [-q <depth>] <path>\n"); }
+
+/*
+ * iobench [-w] [-b <block size>] [-t <threads>] [-s <size>] [-n <random ops>] [-q <depth>] <path>
+ *
+ * Reads the first <size> bytes of a file or block device (e.g. /dev/part0) in order, and then at random, with
+ * blocks of <block size> bytes, from <threads> threads at once.  Sizes may end in k or m.  With -q, the random reads
+ * are then repeated from one thread, through an asynchronous I/O ring that keeps up to <depth> of them in flight.
+ * With -w, the same range is then written in order and at random, which destroys whatever was there.
+ */
+int main(const char *cmdline)
+{
+	u64 block_size = default_block_size, nr_threads = 1, size = default_size, random_ops = default_random_ops, depth = 0;
+	bool writes = false;
+
+	const char *p = cmdline ? cmdline : "";
+	while (true) {
+		while (*p == ' ') {
+			p++;
+		}
+
+		if (*p != '-') {
+			break;
+		}
+
+		char option = p[1];
+		p += 2;
+
+		if (option == 'w') {
+			writes = true;
+			continue;
+		}
+
+		while (*p == ' ') {
+			p++;
+		}
+
+		u64 value;
+		p = parse_size(p, value);
+
+		switch (option) {
+		case 'b':
+			block_size = value;
+			break;
+		case 't':
+			nr_threads = value;
+			break;
+		case 's':
+			size = value;
+			break;
+		case 'n':
+			random_ops = value;
+			break;
+		case 'q':
+			depth = value;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!*p || !block_size || !nr_threads || nr_threads > max_threads || !size || depth > max_depth) {
+		usage();
+		return 1;
+	}
+
+	object *target = object::open(p);
+	if (!target) {
+		console::get().writef("error: unable to open '%s'\n", p);
+		return 1;
+	}
+
+	size = find_size(target, size);
+	if (size < block_size) {
+		console::get().writef("error: '%s' is smaller than one block\n", p);
+		delete target;
+		return 1;
+	}
+
+	tsc_hz = bench_calibrate();
+	bench_result("target", "path=%s size=%llu", p, size);
+
+	run_test(target, test_kind::seqread, block_size, nr_threads, size, random_ops);
+	run_test(target, test_kind::randread, block_size, nr_threads, size, random_ops);
+
+	if (depth) {
+		run_async_test(target, block_size, depth, size, random_ops);
+	}
+
+	if (writes) {
+		run_test(target, test_kind::seqwrite, block_size, nr_threads, size, random_ops);
+		run_test(target, test_kind::randwrite, block_size, nr_threads, size, random_ops);
+	}
+
+	delete target;
+	return 0;
+}
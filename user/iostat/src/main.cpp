@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - iostat utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/objects.h>
+#include <stacsos/parse.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+static const u64 interval_ms = 1000;
+
+static bool show()
+{
+	// The device renders a snapshot when it is opened, so it is opened afresh each time.
+	object *stats = object::open("/dev/iostat");
+	if (!stats) {
+		console::get().write("error: unable to open /dev/iostat\n");
+		return false;
+	}
+
+	char buffer[256];
+	int bytes_read;
+
+	while ((bytes_read = stats->read(buffer, sizeof(buffer) - 1)) > 0) {
+		buffer[bytes_read] = 0;
+		console::get().writef("%s", buffer);
+	}
+
+	delete stats;
+	return true;
+}
+
+/*
+ * iostat [iterations]
+ *
+ * Shows the buffer cache's hit rate, and how many requests each block device has been given and how long they took
+ * to complete.  With a number of iterations, the statistics are shown again once per second, that many times.
+ */
+int main(const char *cmdline)
+{
+	u64 iterations;
+	parse_u64(cmdline, iterations);
+
+	if (!iterations) {
+		return show() ? 0 : 1;
+	}
+
+	for (u64 i = 0; i < iterations; i++) {
+		console::get().clear();
+		if (!show()) {
+			return 1;
+		}
+
+		syscalls::sleep(interval_ms);
+	}
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - irq utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/console.h>
+#include <stacsos/interrupts.h>
+#include <stacsos/objects.h>
+#include <stacsos/parse.h>
+
+using namespace stacsos;
+
+static const char *interrupts_path = "/dev/interrupts";
+
+/*
+ * irq [source core]
+ *
+ * Lists the device interrupts and the cores they are delivered to, how often each core has run its bottom halves, and
+ * how many times each vector has been raised on each core.  Given the number of a device interrupt from the listing
+ * and a core, the interrupt is moved to that core.
+ */
+int main(const char *cmdline)
+{
+	object *interrupts = object::open(interrupts_path);
+	if (!interrupts) {
+		console::get().writef("error: unable to open %s\n", interrupts_path);
+		return 1;
+	}
+
+	u64 source, core;
+	bool have_source = false, have_core = false;
+
+	if (cmdline && *cmdline) {
+		have_source = parse_u64(cmdline, source);
+		have_core = parse_u64(cmdline, core);
+	}
+
+	if (have_source) {
+		if (!have_core) {
+			console::get().write("usage: irq [source core]\n");
+			delete interrupts;
+			return 1;
+		}
+
+		irq_affinity_request request { (u32)source, (u32)core };
+		if (!interrupts->ioctl((u64)interrupts_ioctl::set_affinity, &request, sizeof(request))) {
+			console::get().writef("error: unable to move interrupt %llu to core %llu\n", source, core);
+			delete interrupts;
+			return 1;
+		}
+
+		delete interrupts;
+		return 0;
+	}
+
+	char buffer[256];
+	int bytes_read;
+
+	while ((bytes_read = interrupts->read(buffer, sizeof(buffer) - 1)) > 0) {
+		buffer[bytes_read] = 0;
+		console::get().writef("%s", buffer);
+	}
+
+	delete interrupts;
+	return 0;
+}
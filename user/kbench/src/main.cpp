@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - kernel microbenchmark suite
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/objects.h>
+#include <stacsos/process.h>
+#include <stacsos/threads.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+// Every result is a single line, "kbench <test> key=value...", with the same keys in the same order from one run to
+// the next, so that the results of two kernel revisions can be compared with diff.  Anything else on the debug
+// console (e.g. the kernel log) can be dropped by keeping only the lines that start with "kbench ".
+
+static const u64 block_size = KB(4);
+
+// Read once after boot, so that its blocks come from the disk, rather than the page cache.
+static const char *cold_file = "/boot/stacsos.sym";
+
+static void report(const char *test, u64 iterations, u64 total_ns)
+{
+	bench_result("kbench", "%s iterations=%llu total_ns=%llu ns_per_op=%llu", test, iterations, total_ns, total_ns / max(iterations, 1ull));
+}
+
+static void report_throughput(const char *test, u64 iterations, u64 bytes, u64 total_ns)
+{
+	// Bytes per microsecond is (near enough) megabytes per second.
+	bench_result("kbench", "%s iterations=%llu total_ns=%llu ns_per_op=%llu bytes=%llu mb_per_s=%llu", test, iterations, total_ns,
+		total_ns / max(iterations, 1ull), bytes, (bytes * 1000) / max(total_ns, 1ull));
+}
+
+static void bench_null_syscall()
+{
+	const u64 iterations = 100000;
+
+	// Asking for the number of handles in use does nothing but read a counter, so this is the cost of getting into
+	// the kernel and back.
+	u64 start = clock_now_ns();
+	for (u64 i = 0; i < iterations; i++) {
+		syscalls::set_resource_limit(resource_type::handles, resource_scope::process, RESOURCE_UNLIMITED);
+	}
+
+	report("null_syscall", iterations, clock_now_ns() - start);
+}
+
+static void bench_open_close()
+{
+	const u64 iterations = 2000;
+
+	u64 start = clock_now_ns();
+	for (u64 i = 0; i < iterations; i++) {
+		auto r = syscalls::open("/usr/kbench");
+		if (r.code == syscall_result_code::ok) {
+			syscalls::close(r.id);
+		}
+	}
+
+	report("open_close", iterations, clock_now_ns() - start);
+}
+
+static void bench_pread(char *buffer)
+{
+	object *file = object::open(cold_file);
+	u64 size;
+
+	if (!file || !file->size(size)) {
+		bench_result("kbench", "pread skipped=%s", cold_file);
+		delete file;
+		return;
+	}
+
+	// The first pass over the file is the one that has to go to the disk for each block.
+	u64 blocks = size / block_size;
+
+	u64 start = clock_now_ns();
+	for (u64 i = 0; i < blocks; i++) {
+		file->pread(buffer, block_size, i * block_size);
+	}
+
+	report_throughput("pread_4k_uncached", blocks, blocks * block_size, clock_now_ns() - start);
+
+	const u64 iterations = 20000;
+
+	start = clock_now_ns();
+	for (u64 i = 0; i < iterations; i++) {
+		file->pread(buffer, block_size, 0);
+	}
+
+	report_throughput("pread_4k_cached", iterations, iterations * block_size, clock_now_ns() - start);
+
+	delete file;
+}
+
+static void bench_alloc_mem()
+{
+	const u64 iterations = 2000;
+	const u64 size = KB(64);
+
+	u64 start = clock_now_ns();
+	for (u64 i = 0; i < iterations; i++) {
+		auto r = syscalls::alloc_mem(size);
+		if (r.code == syscall_result_code::ok) {
+			syscalls::munmap(r.ptr, size);
+		}
+	}
+
+	report("alloc_mem_64k", iterations, clock_now_ns() - start);
+}
+
+static void *empty_thread(void *arg) { return nullptr; }
+
+static void bench_thread_create_join()
+{
+	const u64 iterations = 500;
+
+	u64 start = clock_now_ns();
+	for (u64 i = 0; i < iterations; i++) {
+		thread *t = thread::start(empty_thread, nullptr);
+		t->join();
+		delete t;
+	}
+
+	report("thread_create_join", iterations, clock_now_ns() - start);
+}
+
+static void bench_process_spawn_exit()
+{
+	const u64 iterations = 100;
+
+	// This program is started again, and told (with -x) to exit straight away.
+	u64 start = clock_now_ns();
+	for (u64 i = 0; i < iterations; i++) {
+		process::run("/usr/kbench", "-x");
+	}
+
+	report("process_spawn_exit", iterations, clock_now_ns() - start);
+}
+
+static void bench_console_write(char *buffer)
+{
+	const u64 total = KB(256);
+
+	// Blank lines, so that they are dropped along with everything else that doesn't start with "kbench ".
+	for (u64 i = 0; i < block_size; i++) {
+		buffer[i] = (i % 80) == 79 ? '\n' : ' ';
+	}
+
+	console::get().flush();
+	object *out = console::get().output();
+
+	u64 start = clock_now_ns();
+	for (u64 done = 0; done < total; done += block_size) {
+		out->write(buffer, block_size);
+	}
+
+	report_throughput("console_write_4k", total / block_size, total, clock_now_ns() - start);
+}
+
+/*
+ * kbench [-p]
+ *
+ * Measures the cost of the kernel's basic operations, one after another: a system call that does nothing, opening
+ * and closing a file, reading a 4 KiB block from the disk and from the page cache, allocating memory, creating and
+ * joining a thread, starting a process that exits straight away, and writing to the console.
+ *
+ * With -p, the machine is powered off at the end, which is how "make bench" runs it in place of init.
+ */
+int main(const char *cmdline)
+{
+	bool poweroff = false;
+
+	while (cmdline && *cmdline) {
+		if (*cmdline == '-' && cmdline[1] == 'x') {
+			return 0;
+		} else if (*cmdline == '-' && cmdline[1] == 'p') {
+			poweroff = true;
+			cmdline += 2;
+		} else if (*cmdline == ' ') {
+			cmdline++;
+		} else {
+			console::get().write("usage: kbench [-p]\n");
+			return 1;
+		}
+	}
+
+	bench_result("kbench", "begin version=1 cores=%u tsc_hz=%llu", clock_nr_cores(), clock_tsc_frequency());
+
+	char *buffer = new char[block_size];
+
+	bench_null_syscall();
+	bench_open_close();
+	bench_pread(buffer);
+	bench_alloc_mem();
+	bench_thread_create_join();
+	bench_process_spawn_exit();
+	bench_console_write(buffer);
+
+	delete[] buffer;
+
+	console::get().write("kbench end\n");
+	console::get().flush();
+
+	if (poweroff) {
+		syscalls::poweroff();
+	}
+
+	return 0;
+}
@@ -0,0 +1,254 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - wakeup latency benchmark
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/parse.h>
+#include <stacsos/printf.h>
+#include <stacsos/threads.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+static const u64 max_threads = 16;
+static const u64 max_hogs = 16;
+
+static const u64 default_threads = 4;
+static const u64 default_interval_us = 1000;
+static const u64 default_loops = 1000;
+
+// The measuring threads are given real-time priorities counting down from this one, so that each has its own.
+static const int top_priority = 90;
+
+// The upper bound, in microseconds, of each histogram bucket.  Wakeups later than the last bound are counted in one
+// more bucket of their own.
+static const u64 bucket_bounds_us[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000 };
+static const u64 nr_buckets = (sizeof(bucket_bounds_us) / sizeof(bucket_bounds_us[0])) + 1;
+
+struct latency_thread {
+	semaphore *go;
+
+	u64 interval;
+	u64 loops;
+	int priority;
+
+	u64 min_cycles, max_cycles, total_cycles;
+
+	// How many deadlines had already passed by the time the thread woke from the one before, and were skipped.
+	u64 overruns;
+
+	u64 buckets[nr_buckets];
+} __aligned(64);
+
+struct hog_thread {
+	bool *stop;
+	u64 count;
+} __aligned(64);
+
+static void record(latency_thread *t, u64 late)
+{
+	t->min_cycles = min(t->min_cycles, late);
+	t->max_cycles = max(t->max_cycles, late);
+	t->total_cycles += late;
+
+	u64 late_us = clock_ticks_to_ns(late) / 1000;
+
+	u64 b = 0;
+	while (b < nr_buckets - 1 && late_us >= bucket_bounds_us[b]) {
+		b++;
+	}
+
+	t->buckets[b]++;
+}
+
+static void *measure(void *arg)
+{
+	auto *t = (latency_thread *)arg;
+	t->go->acquire();
+
+	// The deadlines are absolute, and each is one interval after the last, so that the time spent recording a wakeup
+	// isn't added to the next sleep.
+	u64 deadline = bench_rdtsc() + t->interval;
+
+	for (u64 i = 0; i < t->loops; i++) {
+		syscalls::sleep_until(deadline);
+		u64 now = bench_rdtsc();
+
+		record(t, now > deadline ? now - deadline : 0);
+
+		deadline += t->interval;
+		while (deadline <= now) {
+			deadline += t->interval;
+			t->overruns++;
+		}
+	}
+
+	return nullptr;
+}
+
+static void *hog(void *arg)
+{
+	auto *h = (hog_thread *)arg;
+
+	while (!__atomic_load_n(h->stop, __ATOMIC_RELAXED)) {
+		h->count++;
+	}
+
+	return nullptr;
+}
+
+static void print_results(u64 index, const latency_thread &t)
+{
+	bench_result("latency", "thread=%llu priority=%d loops=%llu min_ns=%llu avg_ns=%llu max_ns=%llu overruns=%llu", index, t.priority, t.loops,
+		clock_ticks_to_ns(t.min_cycles), clock_ticks_to_ns(t.total_cycles / t.loops), clock_ticks_to_ns(t.max_cycles), t.overruns);
+
+	char buckets[512];
+	int n = 0;
+	for (u64 b = 0; b < nr_buckets - 1; b++) {
+		n += snprintf(buckets + n, (int)sizeof(buckets) - n, " lt_%lluus=%llu", bucket_bounds_us[b], t.buckets[b]);
+	}
+	snprintf(buckets + n, (int)sizeof(buckets) - n, " ge_%lluus=%llu", bucket_bounds_us[nr_buckets - 2], t.buckets[nr_buckets - 1]);
+
+	bench_result("histogram", "thread=%llu%s", index, buckets);
+}
+
+static void usage() { console::get().write("error: usage: latbench [-t <threads>] [-i <interval us>] [-l <loops>] [-h <hogs>] [-c <core>]\n"); }
+
+/*
+ * latbench [-t <threads>] [-i <interval us>] [-l <loops>] [-h <hogs>] [-c <core>]
+ *
+ * Starts <threads> real-time threads, each at a different priority, that sleep until an absolute deadline every
+ * <interval us> microseconds, <loops> times, and measures how late each wakeup is.  With -h, <hogs> fair threads spin
+ * on the CPU for the whole run.  With -c, every thread is kept on core <core>, so that the hogs compete with the
+ * measuring threads, rather than running beside them.
+ */
+int main(const char *cmdline)
+{
+	u64 nr_threads = default_threads, interval_us = default_interval_us, loops = default_loops, nr_hogs = 0, core = 0;
+	bool pinned = false;
+
+	const char *p = cmdline ? cmdline : "";
+	while (true) {
+		while (*p == ' ') {
+			p++;
+		}
+
+		if (*p != '-') {
+			break;
+		}
+
+		char option = p[1];
+		p += 2;
+
+		while (*p == ' ') {
+			p++;
+		}
+
+		u64 value;
+		parse_u64(p, value);
+
+		switch (option) {
+		case 't':
+			nr_threads = value;
+			break;
+		case 'i':
+			interval_us = value;
+			break;
+		case 'l':
+			loops = value;
+			break;
+		case 'h':
+			nr_hogs = value;
+			break;
+		case 'c':
+			core = value;
+			pinned = true;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (*p || !nr_threads || nr_threads > max_threads || !interval_us || !loops || nr_hogs > max_hogs || core >= 64) {
+		usage();
+		return 1;
+	}
+
+	bench_calibrate();
+	bench_result("config", "threads=%llu interval_us=%llu loops=%llu hogs=%llu core=%ld", nr_threads, interval_us, loops, nr_hogs,
+		pinned ? (s64)core : -1l);
+
+	u64 core_mask = pinned ? 1ull << core : 0;
+
+	bool stop = false;
+	hog_thread hogs[max_hogs];
+	thread *hog_threads[max_hogs];
+
+	for (u64 i = 0; i < nr_hogs; i++) {
+		hogs[i].stop = &stop;
+		hogs[i].count = 0;
+
+		hog_threads[i] = thread::start(hog, &hogs[i]);
+		if (pinned) {
+			hog_threads[i]->set_affinity(core_mask);
+		}
+	}
+
+	semaphore go;
+	latency_thread threads[max_threads];
+	thread *measure_threads[max_threads];
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		latency_thread &t = threads[i];
+		t.go = &go;
+		t.interval = clock_ns_to_ticks(interval_us * 1000);
+		t.loops = loops;
+		t.priority = top_priority - (int)i;
+		t.min_cycles = ~0ull;
+		t.max_cycles = 0;
+		t.total_cycles = 0;
+		t.overruns = 0;
+		for (auto &b : t.buckets) {
+			b = 0;
+		}
+
+		measure_threads[i] = thread::start(measure, &t);
+
+		if (pinned && !measure_threads[i]->set_affinity(core_mask)) {
+			console::get().writef("error: unable to run thread %llu on core %llu\n", i, core);
+		}
+
+		if (!measure_threads[i]->set_priority(sched_policy::fifo, t.priority)) {
+			console::get().writef("error: unable to give thread %llu priority %d\n", i, t.priority);
+		}
+	}
+
+	// The threads only start measuring once they all have their priorities.
+	for (u64 i = 0; i < nr_threads; i++) {
+		go.release();
+	}
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		measure_threads[i]->join();
+		delete measure_threads[i];
+	}
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+	for (u64 i = 0; i < nr_hogs; i++) {
+		hog_threads[i]->join();
+		delete hog_threads[i];
+	}
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		print_results(i, threads[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - limit utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/parse.h>
+#include <stacsos/process.h>
+
+using namespace stacsos;
+
+static const char *skip_spaces(const char *p)
+{
+	while (*p == ' ') {
+		p++;
+	}
+
+	return p;
+}
+
+static void usage()
+{
+	console::get().write("usage: limit [-g] [-p pages] [-h handles] [-t threads] program [args]\n");
+}
+
+/*
+ * limit [-g] [-p pages] [-h handles] [-t threads] program [args]
+ *
+ * Runs a program with at most the given number of private resident pages, open handles and threads, which the
+ * programs it starts inherit.  With -g, the limits are on the program and everything it starts, taken together, rather
+ * than on each process.  A group can only be limited from inside it, so limit starts itself again in a new group
+ * (with -G), which then sets the limits and runs the program.
+ */
+int main(const char *cmdline)
+{
+	if (!cmdline) {
+		usage();
+		return 1;
+	}
+
+	const char *options = cmdline;
+	u64 limits[NR_RESOURCE_TYPES] = { RESOURCE_UNLIMITED, RESOURCE_UNLIMITED, RESOURCE_UNLIMITED };
+	bool group = false, in_group = false;
+
+	const char *p = skip_spaces(cmdline);
+	while (*p == '-') {
+		switch (p[1]) {
+		case 'g':
+			group = true;
+			p += 2;
+			break;
+		case 'G':
+			in_group = true;
+			p += 2;
+			break;
+		case 'p':
+			p += 2;
+			parse_u64(p, limits[(u64)resource_type::pages]);
+			break;
+		case 'h':
+			p += 2;
+			parse_u64(p, limits[(u64)resource_type::handles]);
+			break;
+		case 't':
+			p += 2;
+			parse_u64(p, limits[(u64)resource_type::threads]);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+
+		p = skip_spaces(p);
+	}
+
+	if (!*p) {
+		usage();
+		return 1;
+	}
+
+	if (group && !in_group) {
+		// The same command line is passed on, with -G in front, which is parsed after -g has been.
+		char args[256];
+		memops::strncpy(args, "-G ", sizeof(args));
+		memops::strncpy(args + 3, options, sizeof(args) - 3);
+		args[sizeof(args) - 1] = 0;
+
+		return process::run("/usr/limit", args, nullptr, nullptr, true) ? 0 : 1;
+	}
+
+	for (u64 i = 0; i < NR_RESOURCE_TYPES; i++) {
+		if (limits[i] != RESOURCE_UNLIMITED && !process::set_limit((resource_type)i, limits[i], in_group ? resource_scope::group : resource_scope::process)) {
+			console::get().write("error: a limit can only be lowered\n");
+			return 1;
+		}
+	}
+
+	// The program name runs up to the first space, and everything after it is its arguments.
+	char path[64] = "/usr/";
+	const char *name = p;
+	while (*p && *p != ' ') {
+		p++;
+	}
+
+	// Names that aren't absolute are looked for in /usr, as the shell does.
+	u64 prefix_length = *name == '/' ? 0 : 5;
+	u64 name_length = min((u64)(p - name), (u64)sizeof(path) - prefix_length - 1);
+	memops::memcpy(path + prefix_length, name, name_length);
+	path[prefix_length + name_length] = 0;
+
+	if (!process::run(path, skip_spaces(p))) {
+		console::get().writef("error: unable to run '%s'\n", path);
+		return 1;
+	}
+
+	return 0;
+}
@@ -3,150 +3,361 @@
 #include <stacsos/console.h>
 #include <stacsos/string.h>
 #include <stacsos/memops.h>
+#include <stacsos/printf.h>
 
 using namespace stacsos;
 
 /*
-*  bubble sort for directory entries, sorts lexicographically so output is in order.
+*  The listing is built up here, and written out a whole buffer at a time, which is far fewer
+*   system calls than one per entry (or one per console buffer, which is much smaller).
 */
-static void sort_entries(dirent* entries, u64 count)
+struct output_buffer {
+    static const u64 SIZE = 65536;
+
+    char *data;
+    u64 length;
+
+    output_buffer() : data(new char[SIZE]), length(0) { }
+    ~output_buffer() { flush(); delete[] data; }
+
+    void append(const char *s, u64 n)
+    {
+        if (length + n > SIZE) {
+            flush();
+        }
+
+        if (n > SIZE) {
+            iovec v = { (void *)s, n };
+            console::get().writev(&v, 1);
+            return;
+        }
+
+        memops::memcpy(data + length, s, n);
+        length += n;
+    }
+
+    void append_number(u64 value)
+    {
+        char digits[20];
+        int n = 0;
+
+        do {
+            digits[sizeof(digits) - 1 - n++] = '0' + (value % 10);
+            value /= 10;
+        } while (value);
+
+        append(&digits[sizeof(digits) - n], n);
+    }
+
+    void flush()
+    {
+        if (length) {
+            // Anything the console itself has buffered goes first, so the output stays in order.
+            iovec v = { data, length };
+            console::get().writev(&v, 1);
+            length = 0;
+        }
+    }
+};
+
+static void print_entry(output_buffer &out, int long_flag, const dirent *ent)
+{
+    if (long_flag) {
+        // Printing type + name, and size for files.
+        bool dir = ent->type == 'd';
+
+        out.append(dir ? "[D] " : "[F] ", 4);
+        out.append(ent->name, ent->name_length);
+
+        if (!dir) {
+            out.append(" ", 1);
+            out.append_number(ent->size);
+        }
+    } else {
+        out.append(ent->name, ent->name_length);
+    }
+
+    out.append("\n", 1);
+}
+
+static bool name_less(const dirent *a, const dirent *b) { return memops::strcmp(a->name, b->name) < 0; }
+
+static void swap_entries(const dirent **entries, u64 a, u64 b)
+{
+    const dirent *t = entries[a];
+    entries[a] = entries[b];
+    entries[b] = t;
+}
+
+static void insertion_sort(const dirent **entries, u64 count)
+{
+    for (u64 i = 1; i < count; i++) {
+        const dirent *e = entries[i];
+        u64 j = i;
+
+        while (j > 0 && name_less(e, entries[j - 1])) {
+            entries[j] = entries[j - 1];
+            j--;
+        }
+
+        entries[j] = e;
+    }
+}
+
+static void sift_down(const dirent **entries, u64 root, u64 count)
+{
+    while (true) {
+        u64 child = (root * 2) + 1;
+        if (child >= count) {
+            return;
+        }
+
+        if (child + 1 < count && name_less(entries[child], entries[child + 1])) {
+            child++;
+        }
+
+        if (!name_less(entries[root], entries[child])) {
+            return;
+        }
+
+        swap_entries(entries, root, child);
+        root = child;
+    }
+}
+
+static void heap_sort(const dirent **entries, u64 count)
+{
+    for (u64 i = count / 2; i > 0; i--) {
+        sift_down(entries, i - 1, count);
+    }
+
+    for (u64 end = count - 1; end > 0; end--) {
+        swap_entries(entries, 0, end);
+        sift_down(entries, 0, end);
+    }
+}
+
+/*
+*  Introsort for directory entries, sorts lexicographically so output is in order.
+*
+*  Quicksort (with a median-of-three pivot) does most of the work, falling back to heapsort if
+*   the partitions keep coming out lopsided, so it is O(n log n) whatever order the names are in.
+*   Small partitions are left for insertion sort, which is quickest on only a few entries.
+*/
+static void introsort(const dirent **entries, u64 count, int depth)
 {
-    for (u64 i = 0; i < count - 1; i++) {
+    while (count > 16) {
+        if (depth-- == 0) {
+            heap_sort(entries, count);
+            return;
+        }
+
+        u64 mid = count / 2;
+        if (name_less(entries[mid], entries[0])) swap_entries(entries, mid, 0);
+        if (name_less(entries[count - 1], entries[0])) swap_entries(entries, count - 1, 0);
+        if (name_less(entries[count - 1], entries[mid])) swap_entries(entries, count - 1, mid);
 
-        for (u64 j = 0; j < count - i - 1; j++) {
+        const dirent *pivot = entries[mid];
 
-            if (memops::strcmp(entries[j].name, entries[j + 1].name) > 0) {
-                dirent temp = entries[j];
-                entries[j] = entries[j + 1];
-                entries[j + 1] = temp;
+        // Hoare partitioning: everything up to j is no greater than the pivot, and everything after it no less.
+        s64 i = -1, j = count;
+        while (true) {
+            do { i++; } while (name_less(entries[i], pivot));
+            do { j--; } while (name_less(pivot, entries[j]));
+
+            if (i >= j) {
+                break;
             }
 
+            swap_entries(entries, i, j);
         }
 
+        // Recursing into the smaller side, and looping on the larger, keeps the stack shallow.
+        u64 left = j + 1;
+        if (left < count - left) {
+            introsort(entries, left, depth);
+            entries += left;
+            count -= left;
+        } else {
+            introsort(entries + left, count - left, depth);
+            count = left;
+        }
     }
+
+    insertion_sort(entries, count);
+}
+
+static void sort_entries(const dirent **entries, u64 count)
+{
+    int depth = 0;
+    for (u64 n = count; n > 1; n >>= 1) {
+        depth += 2;
+    }
+
+    introsort(entries, count, depth);
 }
 
+/*
+*  Each readdir fills a chunk with as many packed directory entry records as fit, and the
+*   chunks are kept for as long as the listing needs their entries, so the names are never
+*   copied.
+*/
+struct chunk {
+    static const u64 SIZE = 65536;
+
+    chunk *next;
+    char data[SIZE];
+};
+
 /*
 *  ls
 *
-*  Calls the readdir system call with a user provided path and prints
-*   either a normal listing or a 'long' listing i.e. ls -l.
+*  Opens the directory at a user provided path, and reads its entries with the readdir
+*   system call until there are none left, then prints either a normal listing or a
+*   'long' listing i.e. ls -l.
 *
-*   The system call fills an array of directory entry structures,
-*   These are iterated through and the results are formatted then displayed.
+*   Each readdir carries on from where the last one stopped, so every entry is listed however
+*   big the directory is.  With -U, the entries are printed in the order the directory gives
+*   them, as each chunk arrives, so nothing has to be held onto at all.
 */
-static void ls(int long_flag, const char *path)
+static void ls(int long_flag, int unsorted_flag, const char *path)
 {
-    const int MAX_ENTRIES = 256;
-    dirent* entries = new dirent[MAX_ENTRIES]; //Heap allocation of user buffer.
-
-    auto res = syscalls::read_dir(path, entries, MAX_ENTRIES);
-    if (res.code != syscall_result_code::ok) {
-        if (res.code == syscall_result_code::not_found) {
-            console::get().write("ls: directory not found\n");
-        } else if (res.code == syscall_result_code::not_supported) {
-            console::get().write("ls: not a directory\n");
-        } else {
-            console::get().write("ls: failed to read directory\n");
-        }
-        delete[] entries;
+    auto dir = syscalls::open(path[0] ? path : "/");
+    if (dir.code != syscall_result_code::ok) {
+        console::get().write("ls: directory not found\n");
         return;
     }
 
-    //Sorting the entries before displaying them
-    if (res.length > 1) {
-        sort_entries(entries, res.length);
-    }
+    output_buffer out;
+
+    chunk *chunks = nullptr;
+    chunk *spare = nullptr;
+
+    u64 capacity = 1024;
+    u64 count = 0;
+    const dirent **entries = unsorted_flag ? nullptr : new const dirent *[capacity];
 
-    for (u64 i = 0; i < res.length; i++) {
+    while (true) {
+        // Unsorted, the same chunk is used again and again.
+        chunk *c = spare ? spare : new chunk;
+        spare = nullptr;
 
-        if (long_flag) {
-            // Printing type + name, and size for files.
-            char type = entries[i].type == 'd' ? 'D' : 'F';
+        auto res = syscalls::readdir(dir.id, c->data, chunk::SIZE);
+        if (res.code != syscall_result_code::ok || res.length == 0) {
+            if (res.code != syscall_result_code::ok) {
+                console::get().write("ls: not a directory\n");
+            }
+
+            delete c;
+            break;
+        }
 
-            console::get().writef("[%c] %s", type, entries[i].name);
+        const char *end = c->data + res.length;
 
-            if (type == 'F') {
-                console::get().writef(" %u", (unsigned)entries[i].size);
+        if (unsorted_flag) {
+            for (const dirent *ent = (const dirent *)c->data; (const char *)ent < end; ent = dirent_next(ent)) {
+                print_entry(out, long_flag, ent);
             }
 
-            console::get().write("\n");
+            spare = c;
+            continue;
         }
-        else {
-            console::get().writef("%s\n", entries[i].name);
+
+        c->next = chunks;
+        chunks = c;
+
+        for (const dirent *ent = (const dirent *)c->data; (const char *)ent < end; ent = dirent_next(ent)) {
+            // Making room for more entries if needed.
+            if (count == capacity) {
+                const dirent **bigger = new const dirent *[capacity * 2];
+                memops::memcpy(bigger, entries, capacity * sizeof(*entries));
+                delete[] entries;
+
+                entries = bigger;
+                capacity *= 2;
+            }
+
+            entries[count++] = ent;
         }
     }
 
-    //Warn if directory might have more entries than can be displayed
-    if (res.length == MAX_ENTRIES) {
-        console::get().write("Some entries may not be displayed!\n");
+    syscalls::close(dir.id);
+    delete spare;
+
+    //Sorting the entries before displaying them
+    if (count > 1) {
+        sort_entries(entries, count);
     }
-    
+
+    for (u64 i = 0; i < count; i++) {
+        print_entry(out, long_flag, entries[i]);
+    }
+
+    out.flush();
+
     delete[] entries;
+
+    while (chunks) {
+        chunk *next = chunks->next;
+        delete chunks;
+        chunks = next;
+    }
 }
 
 /*
 *   main
 *
-*   Parsing the command line input into two tokens (maximum),
-*   the ls command and an optional -l flag.
+*   Parsing the command line input into flags (-l for a long listing, -U for an unsorted
+*   one, which may be combined, e.g. -lU) and an optional directory path.
 *
 */
 int main(const char *cmdline)
 {
-    // If no flag is provided, default to listing the root directory.
-    if (!cmdline || memops::strlen(cmdline) == 0) {
-        ls(0, "");
-        return 0;
-    }
-
-    char arg1[128] = {0}; // Either '-l' or a directory path.
-    char arg2[128] = {0}; // Directory path if '-l' is used.
+    // The listing is written out in as few system calls as possible, once it is all done.
+    console::get().set_buffering(console_buffering::full);
 
-    size_t len = memops::strlen(cmdline);
-    size_t pos = 0;
+    int long_flag = 0, unsorted_flag = 0;
+    char path[128] = {0};
 
-    /*
-    *   Extracting characters from command line input until a space is reached,
-    *   the end of the string is reached, or until the buffer is full.
-    */
-    size_t j = 0;
-    while (pos < len && cmdline[pos] != ' ' && j < sizeof(arg1)-1) {
-        arg1[j++] = cmdline[pos++];
-    }
+    const char *p = cmdline ? cmdline : "";
+    while (*p) {
+        // Skips whitespace before each argument
+        while (*p == ' ') p++;
 
-    // Skips whitespace before second argument (if present)
-    while (pos < len && cmdline[pos] == ' ') pos++;
+        if (!*p) {
+            break;
+        }
 
-    /* Extract second input word, if '-l' was the first argument,
-    *   This will be the directory path.
-    */
-    j = 0;
-    while (pos < len && cmdline[pos] != ' ' && j < sizeof(arg2)-1) {
-        arg2[j++] = cmdline[pos++];
-    }
+        if (*p == '-') {
+            for (p++; *p && *p != ' '; p++) {
+                if (*p == 'l') {
+                    long_flag = 1;
+                } else if (*p == 'U') {
+                    unsorted_flag = 1;
+                } else {
+                    console::get().write("usage: ls [-l] [-U] <directory>\n");
+                    return 1;
+                }
+            }
 
-    /*
-    * Only one argument present, ls -l or ls <directory>
-    */
-    if (arg2[0] == 0) {
-        if (memops::strcmp(arg1, "-l") == 0) {
-            ls(1, "");
-        } else {
-            ls(0, arg1);
+            continue;
         }
-    }
-    else {
-        /*
-        * Two arguments present so, ls -l <directory>
-        */
-        if (memops::strcmp(arg1, "-l") == 0) {
-            ls(1, arg2);
-        } else {
-            console::get().write("usage: ls [-l] <directory>\n");
+
+        if (path[0]) {
+            console::get().write("usage: ls [-l] [-U] <directory>\n");
             return 1;
         }
+
+        size_t j = 0;
+        while (*p && *p != ' ') {
+            if (j < sizeof(path) - 1) {
+                path[j++] = *p;
+            }
+            p++;
+        }
     }
 
+    // If no path is provided, default to listing the root directory.
+    ls(long_flag, unsorted_flag, path);
     return 0;
 }
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - heap allocator benchmark utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/console.h>
+#include <stacsos/heap.h>
+#include <stacsos/parse.h>
+#include <stacsos/threads.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+static const u64 churn_iterations = 100000;
+static const u64 batch_size = 1000;
+static const u64 batch_rounds = 50;
+static const u64 large_iterations = 2000;
+static const u64 max_threads = 8;
+
+static u64 next_random(u64 &state)
+{
+	// xorshift64
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static void bench_churn(u64 size)
+{
+	// The same object is allocated and freed over and over, which should never leave the thread's cache.
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < churn_iterations; i++) {
+		char *p = new char[size];
+		p[0] = 1;
+		delete[] p;
+	}
+	u64 per_op = (bench_rdtsc() - start) / churn_iterations;
+
+	bench_result("churn", "size=%llu iterations=%llu cycles_per_op=%llu", size, churn_iterations, per_op);
+}
+
+static void bench_batch()
+{
+	// Many objects of mixed small sizes are live at once, so the caches have to be refilled and flushed.
+	char **ptrs = new char *[batch_size];
+	u64 state = 0x12345678;
+
+	u64 start = bench_rdtsc();
+	for (u64 round = 0; round < batch_rounds; round++) {
+		for (u64 i = 0; i < batch_size; i++) {
+			u64 size = 8 + (next_random(state) % 1024);
+			ptrs[i] = new char[size];
+			ptrs[i][0] = 1;
+		}
+
+		for (u64 i = 0; i < batch_size; i++) {
+			delete[] ptrs[i];
+		}
+	}
+	u64 per_op = (bench_rdtsc() - start) / (batch_rounds * batch_size);
+
+	delete[] ptrs;
+
+	bench_result("batch", "objects=%llu rounds=%llu cycles_per_op=%llu", batch_size, batch_rounds, per_op);
+}
+
+static void bench_large()
+{
+	// Blocks between 4 KiB and 132 KiB, freed in a different order to the one they were allocated in, so that freed
+	// blocks have to be merged to be reused.
+	const u64 live = 16;
+	char *ptrs[live] = {};
+	u64 state = 0x87654321;
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < large_iterations; i++) {
+		u64 slot = next_random(state) % live;
+		delete[] ptrs[slot];
+
+		ptrs[slot] = new char[KB(4) + (next_random(state) % KB(128))];
+		ptrs[slot][0] = 1;
+	}
+	u64 per_op = (bench_rdtsc() - start) / large_iterations;
+
+	for (u64 i = 0; i < live; i++) {
+		delete[] ptrs[i];
+	}
+
+	bench_result("large", "iterations=%llu cycles_per_op=%llu", large_iterations, per_op);
+}
+
+static void *churn_thread(void *arg)
+{
+	u64 state = (u64)arg;
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < churn_iterations; i++) {
+		char *p = new char[16 + (next_random(state) % 256)];
+		p[0] = 1;
+		delete[] p;
+	}
+
+	return (void *)((bench_rdtsc() - start) / churn_iterations);
+}
+
+static void bench_threads(u64 nr_threads)
+{
+	// Each thread allocates and frees on its own, so with per-thread caches they shouldn't slow each other down.
+	thread *threads[max_threads];
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		threads[i] = thread::start(churn_thread, (void *)(i + 1));
+	}
+
+	u64 total = 0;
+	for (u64 i = 0; i < nr_threads; i++) {
+		total += (u64)threads[i]->join();
+		delete threads[i];
+	}
+
+	bench_result("threads", "threads=%llu iterations=%llu cycles_per_op=%llu", nr_threads, churn_iterations, total / nr_threads);
+}
+
+int main(const char *cmdline)
+{
+	// The only argument is the number of threads in the threaded test.
+	u64 nr_threads;
+	parse_u64(cmdline, nr_threads);
+
+	if (nr_threads == 0) {
+		nr_threads = 4;
+	}
+
+	nr_threads = min(nr_threads, max_threads);
+
+	bench_churn(16);
+	bench_churn(256);
+	bench_churn(2048);
+	bench_batch();
+	bench_large();
+	bench_threads(nr_threads);
+
+	heap::stats s = heap::get_stats();
+	bench_result("heap", "kernel_allocations=%llu kernel_bytes=%llu spans=%llu refills=%llu flushes=%llu large=%llu direct=%llu", s.kernel_allocations,
+		s.kernel_bytes, s.spans, s.cache_refills, s.cache_flushes, s.large_allocations, s.direct_allocations);
+
+	return 0;
+}
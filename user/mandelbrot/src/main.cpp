@@ -12,12 +12,17 @@
  */
 
 /*
- * A program that prints a rather crude version of the Mandelbrot fractal to the StACSOS terminal.
+ * A program that prints a rather crude version of the Mandelbrot fractal to the StACSOS terminal, and times how long
+ * it takes, so that it can be used to see how well work is spread between cores.
  */
 
-#include <stacsos/atomic.h>
+#include <stacsos/clock.h>
 #include <stacsos/console.h>
+#include <stacsos/memops.h>
 #include <stacsos/objects.h>
+#include <stacsos/parse.h>
+#include <stacsos/perf.h>
+#include <stacsos/process.h>
 #include <stacsos/threads.h>
 
 using namespace stacsos;
@@ -49,31 +54,93 @@ s64 deltaReal, deltaImag;
 
 const u32 WIDTH = 80; // frame is 80x25
 const u32 HEIGHT = 25;
-const u32 LAST_PIXEL = WIDTH * HEIGHT;
 
-//#define WORKLIST
+// The frame is divided into tiles for the dynamic and work-stealing modes, small enough that there are plenty more of
+// them than there are threads.
+const u32 TILE_WIDTH = 8;
+const u32 TILE_HEIGHT = 5;
+const u32 TILES_ACROSS = WIDTH / TILE_WIDTH;
+const u32 NR_TILES = TILES_ACROSS * (HEIGHT / TILE_HEIGHT);
 
-#ifdef WORKLIST
-atomic<u32> next_pixel = 0;
-#endif
+const u32 MAX_THREADS = 64;
+
+enum class schedule_mode {
+	// Each thread draws a band of rows, fixed before it starts.
+	rows,
+
+	// Each thread takes the next tile that nobody has drawn yet, from a counter shared by all of them.
+	tiles,
+
+	// Each thread starts with a run of tiles of its own, and once it has drawn them, takes half of what another
+	// thread has left.
+	steal,
+};
+
+static const char *mode_names[] = { "rows", "tiles", "steal" };
+
+schedule_mode mode = schedule_mode::tiles;
+u32 nr_threads = 8;
+u32 max_iterations = MAXITERATE;
+
+// Whether four points are iterated at once with AVX2, and whether each of them is then checked against the scalar
+// version.
+bool use_avx2;
+bool verify;
 
 object *fb;
 
+// The text-mode screen, mapped straight into memory, if the console allows it.  Otherwise the image is drawn into a
+// frame of its own, which is written to the console with one system call once every thread has finished.
+volatile u16 *screen;
+u16 frame[WIDTH * HEIGHT];
+
+u32 next_tile;
+
+// A thread's remaining tiles in the work-stealing mode: the next tile in the low half, and the end of the run in the
+// high half, so that the owner and thieves can both claim tiles with a single compare-and-swap.  A tile is only ever
+// in one run at a time, and runs only shrink, so a run that has been seen can't come back and fool a thief.
+struct tile_run {
+	u64 range;
+} __aligned(64);
+
+tile_run runs[MAX_THREADS];
+
+static u64 make_range(u32 start, u32 end) { return ((u64)end << 32) | start; }
+
+struct thread_stats {
+	u32 index;
+	u32 core;
+	u64 pixels;
+	u64 iterations;
+	u64 busy_cycles;
+	u64 tiles;
+	u64 steals;
+	u64 mismatches;
+} __aligned(64);
+
+thread_stats stats[MAX_THREADS];
+
 static void drawchar(int x, int y, int attr, unsigned char c)
 {
 	u16 u = (attr << 8) | c;
-	fb->pwrite((const char *)&u, sizeof(u), x + (y * 80));
+
+	if (screen) {
+		screen[x + (y * WIDTH)] = u;
+	} else {
+		frame[x + (y * WIDTH)] = u;
+	}
 }
 
-void output(int value, int i, int j)
+void output(u32 value, int i, int j)
 {
-	if (value == 10000000) {
+	// The brightest colours are kept for points that took most of the limit to escape, whatever the limit is.
+	if (value == max_iterations) {
 		drawchar(j, i, BLACK, ' ');
-	} else if (value > 9000000) {
+	} else if (value > max_iterations / 10 * 9) {
 		drawchar(j, i, RED, '*');
-	} else if (value > 5000000) {
+	} else if (value > max_iterations / 2) {
 		drawchar(j, i, L_RED, '*');
-	} else if (value > 1000000) {
+	} else if (value > max_iterations / 10) {
 		drawchar(j, i, ORANGE, '*');
 	} else if (value > 500) {
 		drawchar(j, i, YELLOW, '*');
@@ -96,61 +163,484 @@ void output(int value, int i, int j)
 	}
 }
 
-#ifndef WORKLIST
-struct thread_data {
-	u32 start_pixel, end_pixel;
+// With -p, each thread counts the events spent on every row of pixels it draws, which are
+// printed once the image has been drawn.
+const perf_event ROW_EVENTS[] = { perf_event::cycles, perf_event::instructions, perf_event::branch_misses };
+const u32 NR_ROW_EVENTS = sizeof(ROW_EVENTS) / sizeof(ROW_EVENTS[0]);
+
+bool count_rows;
+u64 row_counts[HEIGHT][NR_ROW_EVENTS];
+
+struct row_counter {
+	object *perf;
+	perf_config config;
+	bool use_rdpmc;
+
+	bool start()
+	{
+		perf = object::open("/dev/perf");
+		if (!perf) {
+			return false;
+		}
+
+		config.nr_events = NR_ROW_EVENTS;
+		config.flags = perf_flags::user_only | perf_flags::user_rdpmc;
+		for (u32 i = 0; i < NR_ROW_EVENTS; i++) {
+			config.events[i] = ROW_EVENTS[i];
+		}
+
+		if (!perf->ioctl((u64)perf_ioctl::configure, &config, sizeof(config))) {
+			delete perf;
+			perf = nullptr;
+			return false;
+		}
+
+		// rdpmc only gives the thread's own count if the counters keep their full value when it is switched out.
+		use_rdpmc = config.rdpmc_exact;
+		return true;
+	}
+
+	void read(u64 *values)
+	{
+		if (!use_rdpmc) {
+			perf->ioctl((u64)perf_ioctl::read, values, NR_ROW_EVENTS * sizeof(u64));
+			return;
+		}
+
+		for (u32 i = 0; i < NR_ROW_EVENTS; i++) {
+			u32 lo, hi;
+			asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(config.rdpmc_index[i]));
+			values[i] = ((u64)hi << 32) | lo;
+		}
+	}
+
+	void stop()
+	{
+		perf->ioctl((u64)perf_ioctl::disable, nullptr, 0);
+		delete perf;
+	}
 };
-#endif
 
-static void *mandelbrot(void *arg)
+static void print_row_counts()
 {
-#ifndef WORKLIST
-	thread_data *data = (thread_data *)arg;
-	u32 my_pixel = data->start_pixel;
+	console::get().write("ROW       CYCLES  INSTRUCTIONS  BRANCH-MISSES   IPC\n");
 
-	while (my_pixel < data->end_pixel) {
-#else
-	u32 my_pixel = next_pixel++;
+	for (u32 y = 0; y < HEIGHT; y++) {
+		u64 cycles = row_counts[y][0], instructions = row_counts[y][1];
+		u64 ipc100 = cycles ? (instructions * 100) / cycles : 0;
 
-	while (my_pixel < LAST_PIXEL) {
-#endif
+		console::get().writef("%3u %12llu  %12llu  %13llu  %u.%02u\n", y, cycles, instructions, row_counts[y][2],
+			(u32)(ipc100 / 100), (u32)(ipc100 % 100));
+	}
+}
 
-		int x = my_pixel % WIDTH;
-		int y = my_pixel / WIDTH;
+struct worker_context {
+	thread_stats *stats;
+	row_counter counter;
+	bool counting;
+	u64 row_start[NR_ROW_EVENTS];
+};
 
-		s64 real0, imag0, realq, imagq, real, imag;
-		int count;
+/**
+ * Counts the iterations it takes the point to escape, up to the limit, one point at a time.
+ */
+static u32 iterate_scalar(s64 real0, s64 imag0)
+{
+	s64 realq, imagq, real, imag;
+	u32 count;
 
-		real0 = realMin + x * deltaReal; // current real value
-		imag0 = imagMax - y * deltaImag;
+	real = real0;
+	imag = imag0;
+	for (count = 0; count < max_iterations; count++) {
+		realq = (real * real) >> NORM_BITS;
+		imagq = (imag * imag) >> NORM_BITS;
 
-		real = real0;
-		imag = imag0;
-		for (count = 0; count < MAXITERATE; count++) {
-			realq = (real * real) >> NORM_BITS;
-			imagq = (imag * imag) >> NORM_BITS;
+		if ((realq + imagq) > ((s64)4 * NORM_FACT))
+			break;
 
-			if ((realq + imagq) > ((s64)4 * NORM_FACT))
-				break;
+		imag = ((real * imag) >> (NORM_BITS - 1)) + imag0;
+		real = realq - imagq + real0;
+	}
 
-			imag = ((real * imag) >> (NORM_BITS - 1)) + imag0;
-			real = realq - imagq + real0;
+	return count;
+}
+
+typedef s64 v4i64 __attribute__((vector_size(32)));
+typedef int v8i32 __attribute__((vector_size(32)));
+typedef double v4f64 __attribute__((vector_size(32)));
+
+const u32 LANES = 4;
+
+/**
+ * Counts the iterations for four points on the same row at once, giving the same counts as iterate_scalar.  Until a
+ * point escapes, its real and imaginary parts stay below 2^29 in magnitude, so every product can be taken from the low
+ * 32 bits of each lane with vpmuldq (AVX2 has no full 64-bit multiply).  Once a lane has escaped, it keeps its last
+ * values, so that it can't overflow while the others carry on.
+ */
+__attribute__((target("avx2"))) static void iterate_avx2(const s64 *real0s, s64 imag0, u32 *counts)
+{
+	v4i64 real0 = { real0s[0], real0s[1], real0s[2], real0s[3] };
+	v4i64 imag0v = { imag0, imag0, imag0, imag0 };
+	v4i64 limit = { (s64)4 * NORM_FACT, (s64)4 * NORM_FACT, (s64)4 * NORM_FACT, (s64)4 * NORM_FACT };
+
+	v4i64 real = real0, imag = imag0v;
+	v4i64 active = { -1, -1, -1, -1 };
+	v4i64 count = {};
+
+	for (u32 i = 0; i < max_iterations; i++) {
+		v4i64 realq = (v4i64)__builtin_ia32_pmuldq256((v8i32)real, (v8i32)real) >> NORM_BITS;
+		v4i64 imagq = (v4i64)__builtin_ia32_pmuldq256((v8i32)imag, (v8i32)imag) >> NORM_BITS;
+
+		active &= (v4i64)((realq + imagq) <= limit);
+		if (!__builtin_ia32_movmskpd256((v4f64)active)) {
+			break;
+		}
+
+		v4i64 next_imag = ((v4i64)__builtin_ia32_pmuldq256((v8i32)real, (v8i32)imag) >> (NORM_BITS - 1)) + imag0v;
+		v4i64 next_real = realq - imagq + real0;
+
+		real = active ? next_real : real;
+		imag = active ? next_imag : imag;
+
+		// The mask is all ones (minus one) in the lanes that haven't escaped.
+		count -= active;
+	}
+
+	for (u32 i = 0; i < LANES; i++) {
+		counts[i] = count[i];
+	}
+}
+
+/**
+ * Whether the processor has AVX2, and the kernel saves the AVX registers when threads are switched.
+ */
+static bool avx2_usable()
+{
+	u32 eax, ebx, ecx, edx;
+
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+	if (eax < 7) {
+		return false;
+	}
+
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+	bool osxsave = ecx & (1 << 27);
+
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+	if (!(ebx & (1 << 5)) || !osxsave) {
+		return false;
+	}
+
+	// The SSE and AVX state must both be enabled in XCR0.
+	u32 xcr0_lo, xcr0_hi;
+	asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+	return (xcr0_lo & 6) == 6;
+}
+
+/**
+ * Draws the pixels from x0 up to (but not including) x1 on row y.
+ */
+static void draw_span(worker_context &ctx, u32 x0, u32 x1, u32 y)
+{
+	s64 imag0 = imagMax - y * deltaImag;
+	u32 x = x0;
+
+	if (use_avx2) {
+		for (; x + LANES <= x1; x += LANES) {
+			s64 real0s[LANES];
+			u32 counts[LANES];
+
+			for (u32 i = 0; i < LANES; i++) {
+				real0s[i] = realMin + (x + i) * deltaReal;
+			}
+
+			iterate_avx2(real0s, imag0, counts);
+
+			for (u32 i = 0; i < LANES; i++) {
+				if (verify && counts[i] != iterate_scalar(real0s[i], imag0)) {
+					ctx.stats->mismatches++;
+				}
+
+				output(counts[i], y, x + i);
+				ctx.stats->iterations += counts[i];
+			}
 		}
+	}
+
+	for (; x < x1; x++) {
+		u32 count = iterate_scalar(realMin + x * deltaReal, imag0);
 
 		output(count, y, x);
+		ctx.stats->iterations += count;
+	}
 
-#ifdef WORKLIST
-		my_pixel = next_pixel++;
-#else
-		my_pixel++;
-#endif
+	ctx.stats->pixels += x1 - x0;
+
+	if (ctx.counting) {
+		// Unless the rows are drawn by one thread each, a row's count is made up of pixels drawn by several threads.
+		u64 now[NR_ROW_EVENTS];
+		ctx.counter.read(now);
+
+		for (u32 i = 0; i < NR_ROW_EVENTS; i++) {
+			__atomic_fetch_add(&row_counts[y][i], now[i] - ctx.row_start[i], __ATOMIC_RELAXED);
+			ctx.row_start[i] = now[i];
+		}
+	}
+}
+
+static void draw_tile(worker_context &ctx, u32 tile)
+{
+	u32 x0 = (tile % TILES_ACROSS) * TILE_WIDTH;
+	u32 y0 = (tile / TILES_ACROSS) * TILE_HEIGHT;
+
+	for (u32 y = y0; y < y0 + TILE_HEIGHT; y++) {
+		draw_span(ctx, x0, x0 + TILE_WIDTH, y);
+	}
+
+	ctx.stats->tiles++;
+}
+
+/**
+ * Takes the next tile from the thread's own run, and returns false once it is empty.
+ */
+static bool take_own_tile(u32 index, u32 &tile)
+{
+	u64 range = __atomic_load_n(&runs[index].range, __ATOMIC_ACQUIRE);
+
+	while (true) {
+		u32 start = (u32)range, end = range >> 32;
+		if (start >= end) {
+			return false;
+		}
+
+		if (__atomic_compare_exchange_n(&runs[index].range, &range, make_range(start + 1, end), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			tile = start;
+			return true;
+		}
+	}
+}
+
+/**
+ * Takes the second half of another thread's run (going round from the next thread, so that thieves spread out), and
+ * makes it the thread's own.  Returns false once no thread has anything left.
+ */
+static bool steal_tiles(u32 index, thread_stats &s)
+{
+	for (u32 i = 1; i < nr_threads; i++) {
+		u32 victim = (index + i) % nr_threads;
+		u64 range = __atomic_load_n(&runs[victim].range, __ATOMIC_ACQUIRE);
+
+		while (true) {
+			u32 start = (u32)range, end = range >> 32;
+			if (start >= end) {
+				break;
+			}
+
+			u32 split = end - ((end - start + 1) / 2);
+			if (__atomic_compare_exchange_n(&runs[victim].range, &range, make_range(start, split), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				// Nobody steals from an empty run, so the thread's own can be replaced without a compare-and-swap.
+				__atomic_store_n(&runs[index].range, make_range(split, end), __ATOMIC_RELEASE);
+				s.steals++;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static void *mandelbrot(void *arg)
+{
+	worker_context ctx;
+	ctx.stats = (thread_stats *)arg;
+	ctx.counting = count_rows && ctx.counter.start();
+	if (ctx.counting) {
+		ctx.counter.read(ctx.row_start);
+	}
+
+	u32 index = ctx.stats->index;
+	u64 start = __builtin_ia32_rdtsc();
+
+	switch (mode) {
+	case schedule_mode::rows:
+		for (u32 y = (index * HEIGHT) / nr_threads; y < ((index + 1) * HEIGHT) / nr_threads; y++) {
+			draw_span(ctx, 0, WIDTH, y);
+		}
+		break;
+
+	case schedule_mode::tiles:
+		for (u32 tile = __atomic_fetch_add(&next_tile, 1, __ATOMIC_RELAXED); tile < NR_TILES; tile = __atomic_fetch_add(&next_tile, 1, __ATOMIC_RELAXED)) {
+			draw_tile(ctx, tile);
+		}
+		break;
+
+	case schedule_mode::steal: {
+		u32 tile;
+		do {
+			while (take_own_tile(index, tile)) {
+				draw_tile(ctx, tile);
+			}
+		} while (steal_tiles(index, *ctx.stats));
+		break;
+	}
+	}
+
+	ctx.stats->busy_cycles = __builtin_ia32_rdtsc() - start;
+	ctx.stats->core = clock_current_cpu();
+
+	if (ctx.counting) {
+		ctx.counter.stop();
 	}
 
 	return nullptr;
 }
 
+static void print_stats(u64 wall_cycles)
+{
+	u64 total_pixels = 0, total_iterations = 0, total_mismatches = 0, max_busy = 0, min_busy = ~0ull;
+
+	console::get().write("THREAD  CORE  PIXELS  TILES  STEALS    ITERATIONS     BUSY-US\n");
+	for (u32 i = 0; i < nr_threads; i++) {
+		const thread_stats &s = stats[i];
+		console::get().writef("%6u  %4u  %6llu  %5llu  %6llu  %12llu  %10llu\n", i, s.core, s.pixels, s.tiles, s.steals, s.iterations,
+			clock_ticks_to_ns(s.busy_cycles) / 1000);
+
+		total_pixels += s.pixels;
+		total_iterations += s.iterations;
+		total_mismatches += s.mismatches;
+		max_busy = max(max_busy, s.busy_cycles);
+		min_busy = min(min_busy, s.busy_cycles);
+	}
+
+	// The imbalance is how much longer the busiest thread worked than the idlest, as a percentage of the busiest.
+	u64 imbalance = max_busy ? ((max_busy - min_busy) * 100) / max_busy : 0;
+
+	console::get().writef("mandelbrot mode=%s kernel=%s threads=%u cores=%u max_iterations=%u pixels=%llu iterations=%llu wall_us=%llu imbalance_pct=%llu",
+		mode_names[(int)mode], use_avx2 ? "avx2" : "scalar", nr_threads, clock_nr_cores(), max_iterations, total_pixels, total_iterations,
+		clock_ticks_to_ns(wall_cycles) / 1000, imbalance);
+
+	if (verify) {
+		console::get().writef(" mismatches=%llu", total_mismatches);
+	}
+
+	console::get().write("\n");
+}
+
+static void usage() { console::get().write("error: usage: mandelbrot [-t <threads>] [-m rows|tiles|steal] [-i <iterations>] [-s] [-v] [-p] [-n] [-g]\n"); }
+
+/*
+ * mandelbrot [-t <threads>] [-m rows|tiles|steal] [-i <iterations>] [-s] [-v] [-p] [-n] [-g]
+ *
+ * Draws the Mandelbrot set with <threads> threads (8 by default), giving up on a point after <iterations> (ten million
+ * by default).  The work is divided into fixed bands of rows, handed out a tile at a time from a shared counter (the
+ * default), or shared out as runs of tiles that idle threads steal from.  Once the image has been drawn, and a key has
+ * been pressed (unless -n is given), the time taken and each thread's share of the work are printed.  With -p, each
+ * row's hardware event counts are printed too.
+ *
+ * Four points at a time are iterated with AVX2, if the processor has it, unless -s asks for one at a time.  With -v,
+ * every point iterated with AVX2 is iterated again one at a time, and any count that differs is reported.  With -g,
+ * the threads are gang scheduled, so that they get time slices on different cores at the same time.
+ */
 int main(const char *cmdline)
 {
+	bool wait_for_key = true;
+	bool scalar_only = false;
+	bool gang = false;
+
+	const char *p = cmdline ? cmdline : "";
+	while (true) {
+		while (*p == ' ') {
+			p++;
+		}
+
+		if (!*p) {
+			break;
+		}
+
+		if (*p != '-') {
+			usage();
+			return 1;
+		}
+
+		char option = p[1];
+		p += 2;
+
+		if (option == 'p') {
+			count_rows = true;
+			continue;
+		} else if (option == 'n') {
+			wait_for_key = false;
+			continue;
+		} else if (option == 's') {
+			scalar_only = true;
+			continue;
+		} else if (option == 'v') {
+			verify = true;
+			continue;
+		} else if (option == 'g') {
+			gang = true;
+			continue;
+		}
+
+		while (*p == ' ') {
+			p++;
+		}
+
+		u64 value;
+
+		switch (option) {
+		case 't':
+			parse_u64(p, value);
+			nr_threads = value;
+			break;
+		case 'i':
+			parse_u64(p, value);
+			max_iterations = value;
+			break;
+		case 'm': {
+			char name[8];
+			size_t n = 0;
+			while (*p && *p != ' ') {
+				if (n < sizeof(name) - 1) {
+					name[n++] = *p;
+				}
+				p++;
+			}
+			name[n] = 0;
+
+			bool found = false;
+			for (int m = 0; m < (int)ARRAY_SIZE(mode_names); m++) {
+				if (memops::strcmp(name, mode_names[m]) == 0) {
+					mode = (schedule_mode)m;
+					found = true;
+					break;
+				}
+			}
+
+			if (!found) {
+				usage();
+				return 1;
+			}
+			break;
+		}
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!nr_threads || nr_threads > MAX_THREADS || !max_iterations) {
+		usage();
+		return 1;
+	}
+
+	use_avx2 = !scalar_only && avx2_usable();
+
+	if (gang && !process::set_gang_scheduling(true)) {
+		console::get().write("error: unable to turn on gang scheduling\n");
+		return 1;
+	}
+
 	fb = object::open("/dev/virtcon0");
 
 	if (!fb) {
@@ -158,13 +648,12 @@ int main(const char *cmdline)
 		return 1;
 	}
 
-	const int NUM_THREADS = 8;
-
-	thread *threads[NUM_THREADS];
+	// The console's mode is asked for with ioctl 1, and text mode (zero) is the only one laid out in cells.
+	if (fb->ioctl(1, nullptr, 0) == 0) {
+		screen = (volatile u16 *)fb->mmap(0, WIDTH * HEIGHT * sizeof(u16), mmap_flags::writable | mmap_flags::shared);
+	}
 
-#ifndef WORKLIST
-	thread_data thread_data[NUM_THREADS];
-#endif
+	thread *threads[MAX_THREADS];
 
 	realMin = -2 * NORM_FACT;
 	realMax = 1 * NORM_FACT;
@@ -174,29 +663,41 @@ int main(const char *cmdline)
 	deltaReal = (realMax - realMin) / (WIDTH - 1);
 	deltaImag = (imagMax - imagMin) / (HEIGHT - 1);
 
-	const u32 CHUNK_SIZE = LAST_PIXEL / NUM_THREADS;
+	for (u32 i = 0; i < nr_threads; i++) {
+		stats[i] = thread_stats {};
+		stats[i].index = i;
 
-	for (int thread_index = 0; thread_index < NUM_THREADS; thread_index++) {
-#ifndef WORKLIST
-		thread_data[thread_index].start_pixel = thread_index * CHUNK_SIZE;
-		thread_data[thread_index].end_pixel = thread_data[thread_index].start_pixel + CHUNK_SIZE;
-		if (thread_data[thread_index].end_pixel > LAST_PIXEL) {
-			thread_data[thread_index].end_pixel = LAST_PIXEL;
-		}
+		runs[i].range = make_range((i * NR_TILES) / nr_threads, ((i + 1) * NR_TILES) / nr_threads);
+	}
+
+	// The wall time covers starting and joining the threads, as well as drawing.
+	u64 start = __builtin_ia32_rdtsc();
+
+	for (u32 i = 0; i < nr_threads; i++) {
+		threads[i] = thread::start(mandelbrot, &stats[i]);
+	}
 
-		threads[thread_index] = thread::start(mandelbrot, &thread_data[thread_index]);
-#else
-		threads[thread_index] = thread::start(mandelbrot, nullptr);
-#endif
+	for (u32 i = 0; i < nr_threads; i++) {
+		threads[i]->join();
+		delete threads[i];
 	}
 
-	for (int k = 0; k < NUM_THREADS; k++) {
-		threads[k]->join();
+	u64 wall_cycles = __builtin_ia32_rdtsc() - start;
+
+	if (!screen) {
+		fb->pwrite(frame, sizeof(frame), 0);
 	}
 
 	// wait for input so the prompt doesn't ruin the lovely image
-	// remove this when timing!
-	console::get().read_char();
+	if (wait_for_key) {
+		console::get().read_char();
+	}
+
+	print_stats(wall_cycles);
+
+	if (count_rows) {
+		print_row_counts();
+	}
 
 	delete fb;
 
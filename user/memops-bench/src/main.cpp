@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - memory operation benchmark utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+
+using namespace stacsos;
+
+static const u64 buffer_size = MB(4);
+static const u64 bytes_per_size = MB(64);
+
+// One size from each of the classes that the native memops treat differently: small enough for a few general-purpose
+// loads, small enough for a few AVX2 loads, medium copies done with string instructions, and large ones that are
+// streamed past the cache.
+static const u64 sizes[] = { 7, 24, 64, 200, 1024, KB(16), KB(128), MB(1), MB(4) };
+
+static u64 iterations_for(u64 size) { return max(bytes_per_size / size, 16ull); }
+
+static void report(const char *name, u64 size, u64 iterations, u64 cycles)
+{
+	u64 per_op = cycles / iterations;
+	bench_result(name, "size=%llu iterations=%llu cycles_per_op=%llu bytes_per_kcycle=%llu", size, iterations, per_op,
+		per_op ? (size * 1000) / per_op : 0);
+}
+
+static void bench_memcpy(u8 *dest, const u8 *src, u64 size)
+{
+	u64 iterations = iterations_for(size);
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < iterations; i++) {
+		memops::memcpy(dest, src, size);
+	}
+
+	report("memcpy", size, iterations, bench_rdtsc() - start);
+}
+
+static void bench_memset(u8 *dest, u64 size)
+{
+	u64 iterations = iterations_for(size);
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < iterations; i++) {
+		memops::memset(dest, (int)i, size);
+	}
+
+	report("memset", size, iterations, bench_rdtsc() - start);
+}
+
+static void bench_memcmp(const u8 *a, const u8 *b, u64 size)
+{
+	u64 iterations = iterations_for(size);
+	int result = 0;
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < iterations; i++) {
+		result |= memops::memcmp(a, b, size);
+	}
+
+	report("memcmp", size, iterations, bench_rdtsc() - start);
+
+	if (result) {
+		console::get().write("memcmp: equal buffers compared as different\n");
+	}
+}
+
+static void bench_strings(char *str, u64 size)
+{
+	// A string of the given length, with a copy straight after it, so both can be compared.
+	memops::memset(str, 'a', size);
+	str[size] = 0;
+
+	char *copy = str + size + 1;
+	memops::memcpy(copy, str, size + 1);
+
+	u64 iterations = iterations_for(size);
+	u64 total = 0;
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < iterations; i++) {
+		total += memops::strlen(str);
+	}
+	report("strlen", size, iterations, bench_rdtsc() - start);
+
+	start = bench_rdtsc();
+	for (u64 i = 0; i < iterations; i++) {
+		total += memops::strcmp(str, copy);
+	}
+	report("strcmp", size, iterations, bench_rdtsc() - start);
+
+	if (total != iterations * size) {
+		console::get().write("strings: wrong length or comparison\n");
+	}
+}
+
+static int sign(int v) { return v < 0 ? -1 : (v > 0 ? 1 : 0); }
+
+static bool check(u8 *a, u8 *b)
+{
+	// Every size up to a little past the largest unrolled copy, at every alignment within a word, is checked against
+	// the plain C versions.
+	for (u64 size = 0; size < 300; size++) {
+		for (u64 offset = 0; offset < 8; offset++) {
+			for (u64 i = 0; i < 512; i++) {
+				a[i] = (u8)(i * 7);
+				b[i] = 0xff;
+			}
+
+			memops::memcpy(b + offset, a + (7 - offset), size);
+			if (software_based_memops::memcmp(b + offset, a + (7 - offset), size) || b[offset + size] != 0xff || (offset && b[offset - 1] != 0xff)) {
+				bench_result("check", "memcpy size=%llu offset=%llu FAILED", size, offset);
+				return false;
+			}
+
+			if (size) {
+				b[offset + size - 1] ^= 0x80;
+			}
+
+			if (sign(memops::memcmp(b + offset, a + (7 - offset), size))
+				!= sign(software_based_memops::memcmp(b + offset, a + (7 - offset), size))) {
+				bench_result("check", "memcmp size=%llu offset=%llu FAILED", size, offset);
+				return false;
+			}
+
+			memops::memset(b + offset, 0x5a, size);
+			for (u64 i = 0; i < size; i++) {
+				if (b[offset + i] != 0x5a) {
+					bench_result("check", "memset size=%llu offset=%llu FAILED", size, offset);
+					return false;
+				}
+			}
+
+			char *s = (char *)a + offset;
+			memops::memset(s, 'x', size);
+			s[size] = 0;
+			memops::memcpy(b, s, size + 1);
+
+			if ((u64)memops::strlen(s) != size || memops::strcmp(s, (char *)b) != 0) {
+				bench_result("check", "strings size=%llu offset=%llu FAILED", size, offset);
+				return false;
+			}
+
+			if (size) {
+				b[size - 1] = 'y';
+				if (sign(memops::strcmp(s, (char *)b)) != sign(software_based_memops::strcmp(s, (char *)b))) {
+					bench_result("check", "strcmp size=%llu offset=%llu FAILED", size, offset);
+					return false;
+				}
+			}
+		}
+	}
+
+	console::get().write("check ok\n");
+	return true;
+}
+
+int main(const char *cmdline)
+{
+	u32 features = __x86_memops_features;
+	bench_result("features", "erms=%u avx2=%u", (features & (u32)memops_features::erms) ? 1 : 0,
+		(features & (u32)memops_features::avx2) ? 1 : 0);
+
+	u8 *a = new u8[buffer_size];
+	u8 *b = new u8[buffer_size];
+
+	if (!check(a, b)) {
+		return 1;
+	}
+
+	for (u64 size : sizes) {
+		memops::memset(a, 1, size);
+		bench_memcpy(b, a, size);
+	}
+
+	for (u64 size : sizes) {
+		bench_memset(b, size);
+	}
+
+	for (u64 size : sizes) {
+		memops::memset(a, 1, size);
+		memops::memset(b, 1, size);
+		bench_memcmp(a, b, size);
+	}
+
+	for (u64 size : sizes) {
+		if (size * 2 + 2 <= buffer_size) {
+			bench_strings((char *)a, size);
+		}
+	}
+
+	delete[] a;
+	delete[] b;
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - net-echo utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/net-port.h>
+#include <stacsos/parse.h>
+
+using namespace stacsos;
+
+static const char *default_device = "/dev/net0";
+
+// An Ethernet frame starts with its destination and then its source address.
+static const u32 mac_length = 6;
+
+static void swap_macs(u8 *frame)
+{
+	for (u32 i = 0; i < mac_length; i++) {
+		u8 b = frame[i];
+		frame[i] = frame[mac_length + i];
+		frame[mac_length + i] = b;
+	}
+}
+
+/*
+ * net-echo [count [device]]
+ *
+ * Sends every Ethernet frame that arrives on a network device (/dev/net0 by default) straight back to where it came
+ * from, until count frames have been echoed (or forever, if there is no count).  Each time round, every frame that has
+ * arrived is echoed, and then they are all sent, and their receive buffers handed back, with a single system call.
+ */
+int main(const char *cmdline)
+{
+	u64 count;
+	parse_u64(cmdline, count);
+
+	while (cmdline && *cmdline == ' ') {
+		cmdline++;
+	}
+
+	const char *device = (cmdline && *cmdline) ? cmdline : default_device;
+
+	net_port *port = net_port::open(device);
+	if (!port) {
+		console::get().writef("error: unable to open %s\n", device);
+		return 1;
+	}
+
+	const net_ring_info &info = port->info();
+	console::get().writef("net-echo: %s queue=%u mac=%02x:%02x:%02x:%02x:%02x:%02x mtu=%u offloads=%x rx=%u tx=%u\n", device, info.queue,
+		info.mac[0], info.mac[1], info.mac[2], info.mac[3], info.mac[4], info.mac[5], info.mtu, info.offloads, info.rx_entries, info.tx_entries);
+
+	u64 echoed = 0, skipped = 0, batches = 0, bytes = 0;
+	u64 start = clock_now_ns();
+
+	while (!count || echoed < count) {
+		port->enter(1);
+		batches++;
+
+		net_packet_header *packet;
+		u32 length;
+
+		while (port->next_received(packet, length)) {
+			net_packet_header *reply = port->send_buffer();
+			if (!reply || length > port->send_buffer_size() || length < sizeof(net_packet_header) + (2 * mac_length)) {
+				skipped++;
+				continue;
+			}
+
+			memops::memcpy(reply, packet, length);
+
+			// The checksums (if any) are already right, and nothing is to be segmented.
+			reply->flags = 0;
+			reply->gso_type = NET_HDR_GSO_NONE;
+			reply->num_buffers = 0;
+
+			swap_macs((u8 *)(reply + 1));
+			port->queue_send(length);
+
+			echoed++;
+			bytes += length - sizeof(net_packet_header);
+		}
+
+		port->release_received();
+	}
+
+	// Sends the last batch.
+	port->enter();
+
+	u64 total = clock_now_ns() - start;
+	console::get().writef("net-echo echoed=%llu skipped=%llu dropped=%llu batches=%llu bytes=%llu total_ns=%llu\n", echoed, skipped,
+		port->received_dropped(), batches, bytes, total);
+
+	delete port;
+	return 0;
+}
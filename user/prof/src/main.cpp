@@ -0,0 +1,395 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - prof utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/console.h>
+#include <stacsos/elf.h>
+#include <stacsos/hash-map.h>
+#include <stacsos/memops.h>
+#include <stacsos/objects.h>
+#include <stacsos/parse.h>
+#include <stacsos/profile.h>
+#include <stacsos/string.h>
+#include <stacsos/user-syscall.h>
+#include <stacsos/vector.h>
+
+using namespace stacsos;
+
+static const char *profile_path = "/dev/profile";
+static const char *symbols_path = "/boot/stacsos.sym";
+
+static const u64 default_seconds = 5;
+
+// Just off a round number, so that sampling doesn't fall into step with anything that runs on the timer tick.
+static const u64 default_hz = 997;
+
+static const u64 max_hot_functions = 25;
+
+static const u8 stt_func = 2;
+
+static const char *parse_hex(const char *p, u64 &value)
+{
+	while (*p == ' ') {
+		p++;
+	}
+
+	value = 0;
+	while (true) {
+		char c = *p;
+		if (c >= '0' && c <= '9') {
+			value = (value << 4) | (c - '0');
+		} else if (c >= 'a' && c <= 'f') {
+			value = (value << 4) | (c - 'a' + 10);
+		} else {
+			break;
+		}
+
+		p++;
+	}
+
+	return p;
+}
+
+template <class T, class LessThan> static void sort(T *values, u64 count, LessThan less_than)
+{
+	// Shell sort, with Ciura's gaps (extended by 2.25x), as in iobench.
+	static const u64 gaps[] = { 1, 4, 10, 23, 57, 132, 301, 701, 1577, 3548, 7983, 17961, 40412, 90927, 204585 };
+
+	for (int g = sizeof(gaps) / sizeof(gaps[0]) - 1; g >= 0; g--) {
+		u64 gap = gaps[g];
+
+		for (u64 i = gap; i < count; i++) {
+			T v = values[i];
+			u64 j = i;
+
+			while (j >= gap && less_than(v, values[j - gap])) {
+				values[j] = values[j - gap];
+				j -= gap;
+			}
+
+			values[j] = v;
+		}
+	}
+}
+
+static bool pread_fully(object *o, void *buffer, size_t length, size_t offset)
+{
+	while (length) {
+		size_t n = o->pread(buffer, length, offset);
+		if (!n) {
+			return false;
+		}
+
+		buffer = (u8 *)buffer + n;
+		length -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+/*
+ * The kernel's functions, sorted by address, from the symbol table of its ELF image.
+ */
+class symbol_table {
+public:
+	struct symbol {
+		u64 address;
+		u64 size;
+		const char *name;
+	};
+
+	~symbol_table() { delete[] strings_; }
+
+	bool load(const char *path)
+	{
+		object *image = object::open(path);
+		if (!image) {
+			return false;
+		}
+
+		bool ok = load_from(image);
+		delete image;
+
+		return ok;
+	}
+
+	/**
+	 * Returns the function containing the address, or null if it isn't in one.
+	 */
+	const symbol *find(u64 address) const
+	{
+		u64 lo = 0, hi = symbols_.size();
+		while (lo < hi) {
+			u64 mid = lo + (hi - lo) / 2;
+			if (symbols_[mid].address <= address) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		if (!lo) {
+			return nullptr;
+		}
+
+		const symbol &s = symbols_[lo - 1];
+		return (address < s.address + max(s.size, 1ull)) ? &s : nullptr;
+	}
+
+private:
+	vector<symbol> symbols_;
+	char *strings_ = nullptr;
+
+	bool load_from(object *image)
+	{
+		elf_header<64> header;
+		if (!pread_fully(image, &header, sizeof(header), 0) || memops::memcmp(header.e_ident.ei_magic, "\x7f" "ELF", 4)
+			|| header.e_ident.ei_class != elf_ident_classes::ei_class_64bit || header.e_shentsize != sizeof(elf_sectionheader<64>)) {
+			return false;
+		}
+
+		vector<elf_sectionheader<64>> sections(header.e_shnum);
+		if (!pread_fully(image, sections.data(), header.e_shnum * sizeof(elf_sectionheader<64>), header.e_shoff)) {
+			return false;
+		}
+
+		for (const auto &symtab : sections) {
+			if (symtab.sh_type != SHT_SYMTAB || symtab.sh_link >= sections.size()) {
+				continue;
+			}
+
+			const auto &strtab = sections[symtab.sh_link];
+
+			strings_ = new char[strtab.sh_size + 1];
+			strings_[strtab.sh_size] = 0;
+			if (!pread_fully(image, strings_, strtab.sh_size, strtab.sh_offset)) {
+				return false;
+			}
+
+			u64 count = symtab.sh_size / sizeof(elf_sym<64>);
+			vector<elf_sym<64>> syms(count);
+			if (!pread_fully(image, syms.data(), count * sizeof(elf_sym<64>), symtab.sh_offset)) {
+				return false;
+			}
+
+			for (const auto &sym : syms) {
+				if ((sym.st_info & 0xf) == stt_func && sym.st_value && sym.st_name < strtab.sh_size) {
+					symbols_.push_back(symbol { sym.st_value, sym.st_size, strings_ + sym.st_name });
+				}
+			}
+
+			sort(symbols_.data(), symbols_.size(), [](const symbol &l, const symbol &r) { return l.address < r.address; });
+			return true;
+		}
+
+		return false;
+	}
+};
+
+static char *read_profile(size_t &length)
+{
+	// The device renders a snapshot when it is opened.
+	object *profile = object::open(profile_path);
+	if (!profile) {
+		return nullptr;
+	}
+
+	vector<char> text;
+	char buffer[4096];
+	size_t n;
+
+	while ((n = profile->read(buffer, sizeof(buffer))) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			text.push_back(buffer[i]);
+		}
+	}
+
+	delete profile;
+
+	length = text.size();
+
+	char *result = new char[length + 1];
+	memops::memcpy(result, text.data(), length);
+	result[length] = 0;
+
+	return result;
+}
+
+static string frame_name(const symbol_table &symbols, u64 address)
+{
+	const symbol_table::symbol *s = symbols.find(address);
+	return s ? string(s->name) : string("0x") + string::to_string(address, 16);
+}
+
+struct hot_function {
+	string name;
+	u64 samples;
+};
+
+static void report(const char *text, const symbol_table &symbols, object *folded_output)
+{
+	hash_map<string, u64> self_counts;
+	hash_map<string, u64> stacks;
+	u64 total = 0;
+
+	const char *p = text;
+	while (*p) {
+		const char *line_end = p;
+		while (*line_end && *line_end != '\n') {
+			line_end++;
+		}
+
+		if (*p != '#' && p != line_end) {
+			u64 core, thread, rip;
+			parse_u64(p, core);
+			parse_u64(p, thread);
+			while (*p == ' ') {
+				p++;
+			}
+
+			bool user = *p++ == 'u';
+			p = parse_hex(p, rip);
+
+			u64 frames[32];
+			unsigned int depth = 0;
+			while (p < line_end && depth < sizeof(frames) / sizeof(frames[0])) {
+				p = parse_hex(p, frames[depth++]);
+			}
+
+			string leaf = user ? string("[user]") : frame_name(symbols, rip);
+
+			// Folded stacks go from the outermost frame in, separated by semicolons.
+			string stack;
+			for (unsigned int d = depth; d > 0; d--) {
+				stack += frame_name(symbols, frames[d - 1]);
+				stack += ';';
+			}
+			stack += leaf;
+
+			if (u64 *count = self_counts.get(leaf)) {
+				(*count)++;
+			} else {
+				self_counts.add(leaf, 1);
+			}
+
+			if (u64 *count = stacks.get(stack)) {
+				(*count)++;
+			} else {
+				stacks.add(stack, 1);
+			}
+
+			total++;
+		}
+
+		p = *line_end ? line_end + 1 : line_end;
+	}
+
+	if (!total) {
+		console::get().write("no samples\n");
+		return;
+	}
+
+	vector<hot_function> hot;
+	for (auto entry : self_counts) {
+		hot.push_back(hot_function { entry.key, entry.value });
+	}
+
+	sort(hot.data(), hot.size(), [](const hot_function &l, const hot_function &r) { return l.samples > r.samples; });
+
+	console::get().writef("%llu samples\n\n  SAMPLES      %%  FUNCTION\n", total);
+	for (u64 i = 0; i < min((u64)hot.size(), max_hot_functions); i++) {
+		u64 permille = (hot[i].samples * 1000) / total;
+		console::get().writef("  %7llu %3llu.%llu  %s\n", hot[i].samples, permille / 10, permille % 10, hot[i].name.c_str());
+	}
+
+	if (!folded_output) {
+		console::get().write("\n");
+	}
+
+	for (auto entry : stacks) {
+		string line = entry.key + ' ' + string::to_string(entry.value) + '\n';
+
+		if (folded_output) {
+			folded_output->write(line.c_str(), line.length());
+		} else {
+			console::get().write(line.c_str());
+		}
+	}
+}
+
+/*
+ * prof [seconds [hz [file]]]
+ *
+ * Samples what every core is doing for a number of seconds (five by default), at the given rate (997 Hz by default),
+ * and lists the kernel functions that the most samples were taken in.  Time spent in user mode is counted as [user].
+ * Then each distinct stack is printed on a line of its own, from the outermost function in, with the number of samples
+ * taken in it -- the folded format that flame graph tools take -- or written to the file, if one is given.  With zero
+ * seconds, the samples that have already been taken are shown.
+ */
+int main(const char *cmdline)
+{
+	u64 seconds = default_seconds, hz = default_hz;
+	const char *output_path = nullptr;
+
+	if (cmdline && *cmdline) {
+		parse_u64(cmdline, seconds);
+		parse_u64(cmdline, hz);
+
+		while (*cmdline == ' ') {
+			cmdline++;
+		}
+
+		if (*cmdline) {
+			output_path = cmdline;
+		}
+
+		hz = hz ? hz : default_hz;
+	}
+
+	symbol_table symbols;
+	if (!symbols.load(symbols_path)) {
+		console::get().writef("warning: unable to load kernel symbols from %s\n", symbols_path);
+	}
+
+	if (seconds) {
+		object *control = object::open(profile_path);
+		if (!control) {
+			console::get().writef("error: unable to open %s\n", profile_path);
+			return 1;
+		}
+
+		control->ioctl((u64)profile_ioctl::start, &hz, sizeof(hz));
+		syscalls::sleep(seconds * 1000);
+		control->ioctl((u64)profile_ioctl::stop, nullptr, 0);
+
+		delete control;
+	}
+
+	size_t length;
+	char *text = read_profile(length);
+	if (!text) {
+		console::get().writef("error: unable to open %s\n", profile_path);
+		return 1;
+	}
+
+	object *folded_output = nullptr;
+	if (output_path) {
+		folded_output = object::open(output_path, open_flags::create | open_flags::truncate);
+		if (!folded_output) {
+			console::get().writef("error: unable to create %s\n", output_path);
+			delete[] text;
+			return 1;
+		}
+	}
+
+	report(text, symbols, folded_output);
+
+	delete folded_output;
+	delete[] text;
+
+	return 0;
+}
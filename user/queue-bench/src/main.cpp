@@ -0,0 +1,312 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - lock-free queue benchmark utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/console.h>
+#include <stacsos/mpmc-queue.h>
+#include <stacsos/parse.h>
+#include <stacsos/spsc-ring.h>
+#include <stacsos/threads.h>
+#include <stacsos/work-stealing-deque.h>
+
+using namespace stacsos;
+
+// Each benchmark checks that every value came out exactly once (and, where the structure promises it, in order),
+// and reports the number that didn't as errors, which should always be zero.
+
+static const u64 spsc_ops = 1000000;
+static const u64 mpmc_ops_per_producer = 200000;
+static const u64 deque_ops = 500000;
+static const u64 max_threads = 16;
+
+struct spsc_state {
+	spsc_ring<u64, 1024> ring;
+	u64 errors;
+};
+
+static void *spsc_producer(void *arg)
+{
+	auto *s = (spsc_state *)arg;
+
+	for (u64 i = 1; i <= spsc_ops; i++) {
+		while (!s->ring.push(i)) {
+			__relax();
+		}
+	}
+
+	return nullptr;
+}
+
+static void *spsc_consumer(void *arg)
+{
+	auto *s = (spsc_state *)arg;
+
+	for (u64 expected = 1; expected <= spsc_ops; expected++) {
+		u64 v;
+		while (!s->ring.pop(v)) {
+			__relax();
+		}
+
+		if (v != expected) {
+			s->errors++;
+		}
+	}
+
+	return nullptr;
+}
+
+static void bench_spsc()
+{
+	auto *s = new spsc_state;
+	s->errors = 0;
+
+	u64 start = bench_rdtsc();
+
+	thread *producer = thread::start(spsc_producer, s);
+	thread *consumer = thread::start(spsc_consumer, s);
+
+	producer->join();
+	consumer->join();
+
+	u64 per_op = (bench_rdtsc() - start) / spsc_ops;
+
+	bench_result("spsc", "ops=%llu capacity=%u cycles_per_op=%llu errors=%llu", spsc_ops, s->ring.capacity, per_op, s->errors);
+
+	delete producer;
+	delete consumer;
+	delete s;
+}
+
+// Each value pushed to the MPMC queue is its producer in the top bits, and a sequence number in the rest, so that a
+// consumer can check that it sees each producer's values in the order they were pushed.
+static const u64 producer_shift = 40;
+
+struct mpmc_state {
+	mpmc_queue<u64, 1024> queue;
+	u64 nr_producers;
+	u64 nr_consumers;
+	u64 consumed;
+	u64 sum;
+	u64 errors;
+};
+
+struct mpmc_thread {
+	mpmc_state *state;
+	u64 index;
+};
+
+static void *mpmc_producer(void *arg)
+{
+	auto *t = (mpmc_thread *)arg;
+
+	for (u64 i = 1; i <= mpmc_ops_per_producer; i++) {
+		while (!t->state->queue.try_push((t->index << producer_shift) | i)) {
+			__relax();
+		}
+	}
+
+	return nullptr;
+}
+
+static void *mpmc_consumer(void *arg)
+{
+	auto *t = (mpmc_thread *)arg;
+	mpmc_state *s = t->state;
+
+	u64 last[max_threads] = {};
+	u64 sum = 0, errors = 0;
+	u64 total = s->nr_producers * mpmc_ops_per_producer;
+
+	// The consumers share out the values between them, so each takes them until every value has been taken.
+	while (__atomic_load_n(&s->consumed, __ATOMIC_RELAXED) < total) {
+		u64 v;
+		if (!s->queue.try_pop(v)) {
+			__relax();
+			continue;
+		}
+
+		__atomic_add_fetch(&s->consumed, 1, __ATOMIC_RELAXED);
+
+		u64 producer = v >> producer_shift;
+		u64 seq = v & ((1ull << producer_shift) - 1);
+
+		if (producer >= s->nr_producers || seq <= last[producer]) {
+			errors++;
+		} else {
+			last[producer] = seq;
+		}
+
+		sum += seq;
+	}
+
+	__atomic_add_fetch(&s->sum, sum, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->errors, errors, __ATOMIC_RELAXED);
+
+	return nullptr;
+}
+
+static void bench_mpmc(u64 nr_threads)
+{
+	auto *s = new mpmc_state;
+	s->nr_producers = max(nr_threads / 2, 1ull);
+	s->nr_consumers = max(nr_threads - s->nr_producers, 1ull);
+	s->consumed = 0;
+	s->sum = 0;
+	s->errors = 0;
+
+	mpmc_thread args[max_threads];
+	thread *threads[max_threads];
+	u64 n = 0;
+
+	u64 start = bench_rdtsc();
+
+	for (u64 i = 0; i < s->nr_producers; i++, n++) {
+		args[n] = mpmc_thread { s, i };
+		threads[n] = thread::start(mpmc_producer, &args[n]);
+	}
+
+	for (u64 i = 0; i < s->nr_consumers; i++, n++) {
+		args[n] = mpmc_thread { s, i };
+		threads[n] = thread::start(mpmc_consumer, &args[n]);
+	}
+
+	for (u64 i = 0; i < n; i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+
+	u64 total = s->nr_producers * mpmc_ops_per_producer;
+	u64 per_op = (bench_rdtsc() - start) / total;
+
+	// Every producer pushes the sequence numbers 1 to N, so that is what the consumers should have added up between
+	// them.
+	u64 expected_sum = s->nr_producers * ((mpmc_ops_per_producer * (mpmc_ops_per_producer + 1)) / 2);
+	if (s->sum != expected_sum) {
+		s->errors++;
+	}
+
+	bench_result("mpmc", "producers=%llu consumers=%llu ops=%llu capacity=%u cycles_per_op=%llu errors=%llu", s->nr_producers,
+		s->nr_consumers, total, s->queue.capacity, per_op, s->errors);
+
+	delete s;
+}
+
+struct deque_state {
+	chase_lev_deque<u64, 1024> deque;
+	u8 *taken;
+	bool done;
+	u64 steals;
+};
+
+static void take(deque_state *s, u64 v) { __atomic_add_fetch(&s->taken[v], 1, __ATOMIC_RELAXED); }
+
+static void *deque_thief(void *arg)
+{
+	auto *s = (deque_state *)arg;
+	u64 steals = 0;
+
+	while (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE)) {
+		u64 v;
+		if (s->deque.steal(v)) {
+			take(s, v);
+			steals++;
+		} else {
+			__relax();
+		}
+	}
+
+	__atomic_add_fetch(&s->steals, steals, __ATOMIC_RELAXED);
+	return nullptr;
+}
+
+static void bench_deque(u64 nr_threads)
+{
+	auto *s = new deque_state;
+	s->taken = new u8[deque_ops];
+	s->done = false;
+	s->steals = 0;
+
+	for (u64 i = 0; i < deque_ops; i++) {
+		s->taken[i] = 0;
+	}
+
+	u64 nr_thieves = max(nr_threads, 2ull) - 1;
+	thread *thieves[max_threads];
+
+	for (u64 i = 0; i < nr_thieves; i++) {
+		thieves[i] = thread::start(deque_thief, s);
+	}
+
+	// The owner pushes values in small batches, and pops some of each back, so that it races the thieves for the
+	// last value in the deque as often as possible.
+	u64 start = bench_rdtsc();
+
+	for (u64 next = 0; next < deque_ops;) {
+		for (u64 i = 0; i < 4 && next < deque_ops; i++) {
+			if (s->deque.push(next)) {
+				next++;
+			}
+		}
+
+		u64 v;
+		for (u64 i = 0; i < 3 && s->deque.pop(v); i++) {
+			take(s, v);
+		}
+	}
+
+	u64 v;
+	while (s->deque.pop(v)) {
+		take(s, v);
+	}
+
+	// A thief that has claimed a value may not have recorded it yet, so they are stopped before anything is checked.
+	__atomic_store_n(&s->done, true, __ATOMIC_RELEASE);
+
+	for (u64 i = 0; i < nr_thieves; i++) {
+		thieves[i]->join();
+		delete thieves[i];
+	}
+
+	u64 per_op = (bench_rdtsc() - start) / deque_ops;
+
+	u64 errors = 0;
+	for (u64 i = 0; i < deque_ops; i++) {
+		if (s->taken[i] != 1) {
+			errors++;
+		}
+	}
+
+	bench_result("deque", "thieves=%llu ops=%llu steals=%llu cycles_per_op=%llu errors=%llu", nr_thieves, deque_ops, s->steals, per_op, errors);
+
+	delete[] s->taken;
+	delete s;
+}
+
+/*
+ * queue-bench [threads]
+ *
+ * Stresses the lock-free queues from lib, and measures how fast values pass through them: the SPSC ring between two
+ * threads, the MPMC queue between half the threads pushing and half popping, and the work-stealing deque between its
+ * owner and the rest of the threads stealing.  There are four threads by default.
+ */
+int main(const char *cmdline)
+{
+	u64 nr_threads;
+	parse_u64(cmdline, nr_threads);
+
+	if (nr_threads == 0) {
+		nr_threads = 4;
+	}
+
+	nr_threads = min(nr_threads, max_threads);
+
+	bench_spsc();
+	bench_mpmc(nr_threads);
+	bench_deque(nr_threads);
+
+	return 0;
+}
@@ -0,0 +1,253 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - scheduler benchmark utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/parse.h>
+#include <stacsos/threads.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+static const u64 null_syscall_iterations = 100000;
+static const u64 pingpong_iterations = 10000;
+static const u64 create_join_iterations = 200;
+static const u64 sleep_samples = 10;
+static const u64 fairness_duration_ms = 2000;
+static const u64 max_fairness_threads = 16;
+
+static u64 tsc_hz;
+
+static u64 cycles_to_ns(u64 cycles) { return (cycles * 1000) / (tsc_hz / 1'000'000); }
+
+struct pingpong_state {
+	semaphore go;
+	semaphore ping;
+	semaphore pong;
+	u64 cycles;
+};
+
+static void *pinger(void *arg)
+{
+	auto *s = (pingpong_state *)arg;
+	s->go.acquire();
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < pingpong_iterations; i++) {
+		s->ping.release();
+		s->pong.acquire();
+	}
+	s->cycles = bench_rdtsc() - start;
+
+	return nullptr;
+}
+
+static void *ponger(void *arg)
+{
+	auto *s = (pingpong_state *)arg;
+	s->go.acquire();
+
+	for (u64 i = 0; i < pingpong_iterations; i++) {
+		s->ping.acquire();
+		s->pong.release();
+	}
+
+	return nullptr;
+}
+
+static void bench_pingpong(const char *placement, u64 mask_a, u64 mask_b)
+{
+	pingpong_state s;
+	s.cycles = 0;
+
+	thread *a = thread::start(pinger, &s);
+	thread *b = thread::start(ponger, &s);
+
+	bool pinned = a->set_affinity(mask_a) && b->set_affinity(mask_b);
+
+	s.go.release();
+	s.go.release();
+
+	a->join();
+	b->join();
+
+	delete a;
+	delete b;
+
+	// Each iteration is two wake-ups, and two switches.
+	if (pinned) {
+		u64 per_switch = s.cycles / (pingpong_iterations * 2);
+		bench_result("pingpong", "placement=%s iterations=%llu cycles_per_switch=%llu ns_per_switch=%llu", placement, pingpong_iterations,
+			per_switch, cycles_to_ns(per_switch));
+	} else {
+		bench_result("pingpong", "placement=%s skipped=1", placement);
+	}
+}
+
+static void bench_null_syscall()
+{
+	// Setting FS to what it already is does nothing, so this is just the cost of getting into and out of the kernel.
+	u64 fs = (u64)thread_block::current();
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < null_syscall_iterations; i++) {
+		syscalls::set_fs(fs);
+	}
+	u64 per_op = (bench_rdtsc() - start) / null_syscall_iterations;
+
+	bench_result("null_syscall", "iterations=%llu cycles_per_op=%llu ns_per_op=%llu", null_syscall_iterations, per_op, cycles_to_ns(per_op));
+}
+
+static void *noop(void *arg) { return arg; }
+
+static void bench_create_join()
+{
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < create_join_iterations; i++) {
+		thread *t = thread::start(noop);
+		t->join();
+		delete t;
+	}
+	u64 per_op = (bench_rdtsc() - start) / create_join_iterations;
+
+	bench_result("create_join", "iterations=%llu cycles_per_op=%llu ns_per_op=%llu", create_join_iterations, per_op, cycles_to_ns(per_op));
+}
+
+static void bench_create_join_batch()
+{
+	const u64 batch = 8;
+	void *args[batch] = {};
+	thread *threads[batch];
+
+	u64 start = bench_rdtsc();
+	for (u64 i = 0; i < create_join_iterations; i += batch) {
+		u64 started = thread::start_many(noop, args, threads, batch);
+
+		for (u64 j = 0; j < started; j++) {
+			threads[j]->join();
+			delete threads[j];
+		}
+	}
+	u64 per_op = (bench_rdtsc() - start) / create_join_iterations;
+
+	bench_result("create_join_batch", "iterations=%llu batch=%llu cycles_per_op=%llu ns_per_op=%llu", create_join_iterations, batch, per_op,
+		cycles_to_ns(per_op));
+}
+
+static void bench_sleep(u64 requested_ms)
+{
+	s64 total_us = 0, min_us = 0, max_us = 0;
+
+	for (u64 i = 0; i < sleep_samples; i++) {
+		u64 start = bench_rdtsc();
+		syscalls::sleep(requested_ms);
+		s64 late_us = (s64)(cycles_to_ns(bench_rdtsc() - start) / 1000) - (s64)(requested_ms * 1000);
+
+		total_us += late_us;
+		if (i == 0 || late_us < min_us) {
+			min_us = late_us;
+		}
+		if (i == 0 || late_us > max_us) {
+			max_us = late_us;
+		}
+	}
+
+	bench_result("sleep", "requested_ms=%llu samples=%llu mean_late_us=%ld min_late_us=%ld max_late_us=%ld", requested_ms, sleep_samples,
+		total_us / (s64)sleep_samples, min_us, max_us);
+}
+
+struct fairness_counter {
+	u64 count;
+	bool *stop;
+} __aligned(64);
+
+static void *spinner(void *arg)
+{
+	auto *c = (fairness_counter *)arg;
+
+	while (!__atomic_load_n(c->stop, __ATOMIC_RELAXED)) {
+		c->count++;
+	}
+
+	return nullptr;
+}
+
+static void bench_fairness(u64 nr_threads)
+{
+	fairness_counter counters[max_fairness_threads];
+	thread *threads[max_fairness_threads];
+	bool stop = false;
+
+	// All the threads share one core, so that the result shows how fairly that core's scheduler divides its time,
+	// rather than how well the work is spread between cores.
+	for (u64 i = 0; i < nr_threads; i++) {
+		counters[i].count = 0;
+		counters[i].stop = &stop;
+
+		threads[i] = thread::start(spinner, &counters[i]);
+		threads[i]->set_affinity(1);
+	}
+
+	syscalls::sleep(fairness_duration_ms);
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+	for (u64 i = 0; i < nr_threads; i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+
+	// Jain's fairness index, (sum x)^2 / (n * sum x^2), which is 1 when every thread did the same amount of work.  The
+	// counts are scaled down first to keep the squares in range.
+	u64 min_count = counters[0].count, max_count = counters[0].count, sum = 0, sum_sq = 0;
+	for (u64 i = 0; i < nr_threads; i++) {
+		u64 x = counters[i].count / 1024;
+
+		min_count = min(min_count, counters[i].count);
+		max_count = max(max_count, counters[i].count);
+		sum += x;
+		sum_sq += x * x;
+	}
+
+	u64 jain_permille = sum_sq ? (((sum * sum) / nr_threads) * 1000) / sum_sq : 0;
+
+	bench_result("fairness", "threads=%llu duration_ms=%llu min_count=%llu max_count=%llu jain_permille=%llu", nr_threads, fairness_duration_ms,
+		min_count, max_count, jain_permille);
+}
+
+int main(const char *cmdline)
+{
+	// The only argument is the number of threads in the fairness test.
+	u64 nr_threads;
+	parse_u64(cmdline, nr_threads);
+
+	if (nr_threads == 0) {
+		nr_threads = 4;
+	}
+
+	nr_threads = min(nr_threads, max_fairness_threads);
+
+	tsc_hz = bench_calibrate();
+
+	bench_null_syscall();
+
+	bench_pingpong("same", 1, 1);
+	bench_pingpong("cross", 1, 2);
+
+	bench_create_join();
+	bench_create_join_batch();
+
+	bench_sleep(1);
+	bench_sleep(5);
+	bench_sleep(10);
+	bench_sleep(50);
+
+	bench_fairness(nr_threads);
+
+	return 0;
+}
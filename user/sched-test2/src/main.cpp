@@ -29,7 +29,7 @@ int main(const char *cmdline)
 	console::get().write("Running Scheduler Test 2...\n");
 
 	thread *threads[10];
-	console::get().writef("Using %d threads...\n", ARRAY_SIZE(threads));
+	console::get().writef("Using %lu threads...\n", ARRAY_SIZE(threads));
 	for (unsigned int i = 0; i < ARRAY_SIZE(threads); i++) {
 		threads[i] = thread::start(thread_proc, (void *)(unsigned long)i);
 	}
@@ -5,17 +5,175 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/buffered-io.h>
+#include <stacsos/clock.h>
 #include <stacsos/console.h>
+#include <stacsos/hash-map.h>
 #include <stacsos/memops.h>
+#include <stacsos/objects.h>
 #include <stacsos/process.h>
+#include <stacsos/string.h>
 
 using namespace stacsos;
 
-static void run_command(const char *cmd)
+// The most programs that can be joined together with pipes in one command.
+static const int max_stages = 8;
+
+// The most commands that can be running in the background at once.
+static const int max_jobs = 16;
+
+static const int max_path = 128;
+
+// The shell's current directory, which a relative path to a program is resolved against.  The kernel has no current
+// directory of its own, so the programs themselves don't see it: their arguments are passed on as they were typed.
+static char cwd[max_path] = "/";
+
+// Makes an absolute path from one that may be relative to base, dropping "." and resolving "..".  Returns false if
+// the result would be too long.
+static bool make_absolute(const char *base, const char *rel, char *out)
 {
-	// printf("Running Command: %s\n", cmd);
+	char joined[max_path * 2];
+	size_t n = 0;
+
+	if (rel[0] != '/') {
+		size_t base_length = memops::strlen(base);
+		if (base_length + 1 >= sizeof(joined)) {
+			return false;
+		}
+
+		memops::memcpy(joined, base, base_length);
+		n = base_length;
+		joined[n++] = '/';
+	}
+
+	size_t rel_length = memops::strlen(rel);
+	if (n + rel_length >= sizeof(joined)) {
+		return false;
+	}
+
+	memops::memcpy(joined + n, rel, rel_length + 1);
+
+	int length = 0;
+	out[length++] = '/';
+
+	const char *p = joined;
+	while (*p) {
+		while (*p == '/') {
+			p++;
+		}
+
+		const char *component = p;
+		while (*p && *p != '/') {
+			p++;
+		}
+
+		int component_length = p - component;
+		if (component_length == 0 || (component_length == 1 && component[0] == '.')) {
+			continue;
+		}
+
+		if (component_length == 2 && component[0] == '.' && component[1] == '.') {
+			// Going up from the root stays at the root.
+			while (length > 1 && out[length - 1] != '/') {
+				length--;
+			}
+
+			if (length > 1) {
+				length--;
+			}
+
+			continue;
+		}
+
+		if (length + component_length + 2 > max_path) {
+			return false;
+		}
+
+		if (length > 1) {
+			out[length++] = '/';
+		}
+
+		memops::memcpy(out + length, component, component_length);
+		length += component_length;
+	}
+
+	out[length] = 0;
+	return true;
+}
+
+// The directories searched, in order, for a program named without a path.
+static const char *search_path[] = { "/usr/" };
+
+// Where each program named without a path was found, so that it is only searched for once.  The cache only ever
+// grows, until it is cleared with "hash -r".
+struct cached_path {
+	string path;
+	u64 hits;
+};
+
+static hash_map<string, cached_path> &path_cache()
+{
+	static hash_map<string, cached_path> cache;
+	return cache;
+}
+
+static bool program_exists(const char *path)
+{
+	object *o = object::open(path);
+	if (!o) {
+		return false;
+	}
+
+	delete o;
+	return true;
+}
+
+// Works out the path of a program.  A name without a slash is looked for in each directory of the search path, and
+// anything else is a path, resolved against the current directory.
+static bool resolve_program(const char *prog, char *path)
+{
+	for (const char *c = prog; *c; c++) {
+		if (*c == '/') {
+			return make_absolute(cwd, prog, path);
+		}
+	}
+
+	string name(prog);
+
+	cached_path *cached = path_cache().get(name);
+	if (cached) {
+		memops::memcpy(path, cached->path.c_str(), cached->path.length() + 1);
+		cached->hits++;
+		return true;
+	}
+
+	size_t prog_length = name.length();
+
+	for (const char *dir : search_path) {
+		size_t dir_length = memops::strlen(dir);
+		if (dir_length + prog_length >= (size_t)max_path) {
+			continue;
+		}
+
+		memops::memcpy(path, dir, dir_length);
+		memops::memcpy(path + dir_length, prog, prog_length + 1);
+
+		if (program_exists(path)) {
+			path_cache().add(name, cached_path { string(path), 0 });
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Splits off the name of the program a stage of a command runs, returning the rest of the stage as its arguments.
+static const char *parse_stage(const char *cmd, char *prog)
+{
+	while (*cmd == ' ') {
+		cmd++;
+	}
 
-	char prog[64];
 	int n = 0;
 	while (*cmd && *cmd != ' ' && n < 63) {
 		prog[n++] = *cmd++;
@@ -25,77 +183,441 @@ static void run_command(const char *cmd)
 	if (*cmd)
 		cmd++;
 
-	//Add /usr/ prefix if needed.
-	char path[128];
-	if (prog[0] == '/') {
-		n = 0;
-		while (prog[n]) {
-			path[n] = prog[n];
-			n++;
+	return cmd;
+}
+
+// Starts one program of a command, reading from input and writing to output (the console, if they are null).
+static process *start_stage(const char *cmd, object *input, object *output)
+{
+	char prog[64], path[max_path];
+	const char *args = parse_stage(cmd, prog);
+
+	if (!resolve_program(prog, path)) {
+		console::get().writef("error: command not found: '%s'\n", prog);
+		return nullptr;
+	}
+
+	auto pcmd = process::create(path, args, input, output);
+	if (!pcmd) {
+		console::get().writef("error: unable to run program '%s'\n", prog);
+	}
+
+	return pcmd;
+}
+
+// Splits a command into the programs joined by pipes, returning how many there are, or zero if there are too many.
+static int split_stages(char *cmd, char **stages)
+{
+	int nr_stages = 0;
+
+	stages[nr_stages++] = cmd;
+	for (char *c = cmd; *c; c++) {
+		if (*c == '|') {
+			if (nr_stages == max_stages) {
+				console::get().writef("error: too many pipes\n");
+				return 0;
+			}
+
+			*c = 0;
+			stages[nr_stages++] = c + 1;
+		}
+	}
+
+	return nr_stages;
+}
+
+// Starts each program of a command, leaving a null process for any that couldn't be started.
+static void start_pipeline(char **stages, int nr_stages, process **procs)
+{
+	// Each program writes into a pipe that the next one reads from.  The shell lets go of its own ends as soon as
+	// they've been handed on, so that a reader sees the end of its input once the program before it exits.
+	object *input = nullptr;
+
+	for (int i = 0; i < nr_stages; i++) {
+		object *read_end = nullptr, *write_end = nullptr;
+		if (i + 1 < nr_stages && !object::create_pipe(read_end, write_end)) {
+			console::get().writef("error: unable to create pipe\n");
+			read_end = write_end = nullptr;
 		}
-		path[n] = 0;
 
+		procs[i] = start_stage(stages[i], input, write_end);
+
+		delete input;
+		delete write_end;
+		input = read_end;
+	}
+
+	delete input;
+}
+
+static void wait_pipeline(process **procs, int nr_stages)
+{
+	for (int i = 0; i < nr_stages; i++) {
+		if (procs[i]) {
+			procs[i]->wait_for_exit();
+			delete procs[i];
+		}
+	}
+}
+
+// A command running in the background, which the shell checks on before each prompt.
+struct job {
+	int id;
+	int nr_procs;
+	process *procs[max_stages];
+	char command[128];
+};
+
+static job *jobs[max_jobs];
+static int next_job_id = 1;
+
+static bool job_done(job *j)
+{
+	for (int i = 0; i < j->nr_procs; i++) {
+		if (j->procs[i] && !j->procs[i]->has_exited()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Lets go of every background job that has finished, saying so.
+static void reap_jobs()
+{
+	for (int i = 0; i < max_jobs; i++) {
+		job *j = jobs[i];
+		if (!j || !job_done(j)) {
+			continue;
+		}
+
+		console::get().writef("[%d] done  %s\n", j->id, j->command);
+
+		for (int p = 0; p < j->nr_procs; p++) {
+			delete j->procs[p];
+		}
+
+		delete j;
+		jobs[i] = nullptr;
+	}
+
+	bool any = false;
+	for (int i = 0; i < max_jobs; i++) {
+		any |= jobs[i] != nullptr;
+	}
+
+	// Numbering starts again once there is nothing left in the background.
+	if (!any) {
+		next_job_id = 1;
+	}
+}
+
+static void start_job(char *cmd)
+{
+	int slot = 0;
+	while (slot < max_jobs && jobs[slot]) {
+		slot++;
+	}
+
+	if (slot == max_jobs) {
+		console::get().writef("error: too many background jobs\n");
+		return;
+	}
+
+	job *j = new job;
+	j->id = next_job_id;
+
+	size_t length = min((size_t)memops::strlen(cmd), sizeof(j->command) - 1);
+	memops::memcpy(j->command, cmd, length);
+	j->command[length] = 0;
+
+	char *stages[max_stages];
+	j->nr_procs = split_stages(cmd, stages);
+	start_pipeline(stages, j->nr_procs, j->procs);
+
+	bool started = false;
+	for (int i = 0; i < j->nr_procs; i++) {
+		started |= j->procs[i] != nullptr;
+	}
+
+	if (!started) {
+		delete j;
+		return;
+	}
+
+	next_job_id++;
+	jobs[slot] = j;
+
+	console::get().writef("[%d] started\n", j->id);
+}
+
+static void builtin_cd(char *args)
+{
+	char path[max_path];
+	if (!make_absolute(cwd, *args ? args : "/", path)) {
+		console::get().writef("cd: path too long\n");
+		return;
+	}
+
+	// A directory can be opened, but has no size.
+	object *dir = object::open(path);
+	u64 size;
+
+	if (!dir) {
+		console::get().writef("cd: no such directory: %s\n", path);
+	} else if (dir->size(size)) {
+		console::get().writef("cd: not a directory: %s\n", path);
 	} else {
-		const char *prefix = "/usr/"; //Automatically add /usr/ as prefix to non-asbolute paths.
-		n = 0;
-		while (prefix[n]) {
-			path[n] = prefix[n];
-			n++;
+		memops::memcpy(cwd, path, sizeof(cwd));
+	}
+
+	delete dir;
+}
+
+static void builtin_pwd(char *args) { console::get().writef("%s\n", cwd); }
+
+static void builtin_echo(char *args) { console::get().writef("%s\n", args); }
+
+static void builtin_jobs(char *args)
+{
+	for (int i = 0; i < max_jobs; i++) {
+		if (jobs[i]) {
+			console::get().writef("[%d] %s  %s\n", jobs[i]->id, job_done(jobs[i]) ? "done   " : "running", jobs[i]->command);
 		}
-		int i = 0;
-		while (prog[i]) {
-			path[n++] = prog[i++];
+	}
+}
+
+static void builtin_wait(char *args)
+{
+	for (int i = 0; i < max_jobs; i++) {
+		if (jobs[i]) {
+			for (int p = 0; p < jobs[i]->nr_procs; p++) {
+				if (jobs[i]->procs[p]) {
+					jobs[i]->procs[p]->wait_for_exit();
+				}
+			}
 		}
-		path[n] = 0;
 	}
 
-	auto pcmd = process::create(path, cmd);
-	if (!pcmd) {
-		console::get().writef("error: unable to run program '%s'\n", prog);
+	reap_jobs();
+}
+
+static void builtin_hash(char *args)
+{
+	if (memops::strcmp(args, "-r") == 0) {
+		path_cache().clear();
+		return;
+	}
+
+	for (auto entry : path_cache()) {
+		console::get().writef("%llu\t%s\n", entry.value.hits, entry.value.path.c_str());
+	}
+}
+
+// Runs a command, and reports how long it took, and how much CPU time its programs used between them, as key=value
+// pairs, so that a benchmark script can pick them out.
+static void builtin_time(char *args)
+{
+	if (!*args) {
+		console::get().write("usage: time <command>\n");
+		return;
+	}
+
+	char *stages[max_stages];
+	int nr_stages = split_stages(args, stages);
+	if (!nr_stages) {
+		return;
+	}
+
+	process *procs[max_stages];
+	process_cpu_times total { 0, 0 };
+
+	u64 start = clock_now_ns();
+	start_pipeline(stages, nr_stages, procs);
+
+	for (int i = 0; i < nr_stages; i++) {
+		if (procs[i]) {
+			procs[i]->wait_for_exit();
+
+			// The times are still there after the program has exited, until its handle is closed.
+			process_cpu_times times;
+			if (procs[i]->cpu_times(times)) {
+				total.user_ns += times.user_ns;
+				total.kernel_ns += times.kernel_ns;
+			}
+
+			delete procs[i];
+		}
+	}
+
+	u64 real_ns = clock_now_ns() - start;
+
+	console::get().writef("time real_us=%llu user_us=%llu sys_us=%llu\n", real_ns / 1000, total.user_ns / 1000, total.kernel_ns / 1000);
+}
+
+// Commands that the shell carries out itself, rather than starting a program for.
+struct builtin {
+	const char *name;
+	void (*run)(char *args);
+};
+
+static const builtin builtins[] = {
+	{ "cd", builtin_cd },
+	{ "pwd", builtin_pwd },
+	{ "echo", builtin_echo },
+	{ "jobs", builtin_jobs },
+	{ "wait", builtin_wait },
+	{ "hash", builtin_hash },
+	{ "time", builtin_time },
+};
+
+static const builtin *find_builtin(char *cmd, char *&args)
+{
+	char name[64];
+	args = (char *)parse_stage(cmd, name);
+
+	for (const builtin &b : builtins) {
+		if (memops::strcmp(b.name, name) == 0) {
+			return &b;
+		}
+	}
+
+	return nullptr;
+}
+
+static void run_command(char *cmd)
+{
+	while (*cmd == ' ') {
+		cmd++;
+	}
+
+	size_t length = memops::strlen(cmd);
+	while (length && cmd[length - 1] == ' ') {
+		cmd[--length] = 0;
+	}
+
+	// A command ending in '&' is left running in the background.
+	bool background = length && cmd[length - 1] == '&';
+	if (background) {
+		cmd[--length] = 0;
+	}
+
+	char *args;
+	if (const builtin *b = find_builtin(cmd, args)) {
+		if (background) {
+			console::get().writef("error: '%s' can't run in the background\n", b->name);
+		} else {
+			b->run(args);
+		}
+
+		return;
+	}
+
+	if (background) {
+		start_job(cmd);
+		return;
+	}
+
+	char *stages[max_stages];
+	int nr_stages = split_stages(cmd, stages);
+
+	// A single program is started and waited for with one system call.
+	if (nr_stages == 1) {
+		char prog[64], path[max_path];
+		const char *args = parse_stage(cmd, prog);
+
+		if (!resolve_program(prog, path)) {
+			console::get().writef("error: command not found: '%s'\n", prog);
+		} else if (!process::run(path, args)) {
+			console::get().writef("error: unable to run program '%s'\n", prog);
+		}
+
+		return;
+	}
+
+	if (nr_stages > 1) {
+		process *procs[max_stages];
+		start_pipeline(stages, nr_stages, procs);
+		wait_pipeline(procs, nr_stages);
+	}
+}
+
+// Reads the next command into the buffer, without its newline, returning false once there are no more.
+static bool read_command(buffered_reader *script, char *buffer, size_t length)
+{
+	int n;
+
+	if (script) {
+		n = script->read_line(buffer, length - 1);
+		if (n == 0) {
+			return false;
+		}
 	} else {
-		pcmd->wait_for_exit();
+		console::get().write("> ");
+		n = console::get().read_line(buffer, length - 1);
+
+		// The terminal echoes the line as it is typed, newline and all.
+		if (n == 0 || buffer[n - 1] != '\n') {
+			console::get().write("\n");
+		}
 	}
+
+	if (n > 0 && buffer[n - 1] == '\n') {
+		n--;
+	}
+
+	buffer[n] = 0;
+	return true;
 }
 
-int main(void)
+/*
+ * shell [script]
+ *
+ * Runs commands typed at the console, or, given a script, each line of it in turn.  A script is read through a
+ * buffered reader, rather than a character at a time, which the console has to do for input that isn't a terminal, so
+ * as not to take input that belongs to the programs the shell runs.
+ */
+int main(const char *cmdline)
 {
-	console::get().write("This is the StACSOS shell.\n\n");
-	console::get().write("Use the cat program to view the README: cat /docs/README\n\n");
+	while (cmdline && *cmdline == ' ') {
+		cmdline++;
+	}
+
+	object *script_file = nullptr;
+	buffered_reader *script = nullptr;
+
+	if (cmdline && *cmdline) {
+		script_file = object::open(cmdline);
+		if (!script_file) {
+			console::get().writef("error: unable to open script '%s'\n", cmdline);
+			return 1;
+		}
+
+		script = new buffered_reader(script_file);
+	} else {
+		console::get().write("This is the StACSOS shell.\n\n");
+		console::get().write("Use the cat program to view the README: cat /docs/README\n\n");
+	}
 
+	char command_buffer[128];
 	while (true) {
-		console::get().write("> ");
+		reap_jobs();
 
-		char command_buffer[128];
-		int n = 0;
-
-		while (n < 127) {
-			char c = console::get().read_char();
-			if (c == 0)
-				continue;
-			if (c == '\n')
-				break;
-			if (c == '\b') {
-				if (n > 0) {
-					command_buffer[--n] = 0;
-					console::get().write("\b");
-				}
-			} else {
-				command_buffer[n++] = c;
-				console::get().writef("%c", c);
-			}
+		if (!read_command(script, command_buffer, sizeof(command_buffer))) {
+			break;
 		}
 
-		console::get().write("\n");
-		if (n == 0)
+		if (command_buffer[0] == 0)
 			continue;
 
-		command_buffer[n] = 0;
-
 		if (memops::strcmp("exit", command_buffer) == 0)
 			break;
 
 		run_command(command_buffer);
 	}
 
+	delete script;
+	delete script_file;
+
 	return 0;
 }
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - strace utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/console.h>
+#include <stacsos/objects.h>
+#include <stacsos/parse.h>
+#include <stacsos/syscall-stats.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+static bool show()
+{
+	// The device renders a snapshot when it is opened, so it is opened afresh each time.
+	object *stats = object::open("/dev/syscalls");
+	if (!stats) {
+		console::get().write("error: unable to open /dev/syscalls\n");
+		return false;
+	}
+
+	char buffer[256];
+	int bytes_read;
+
+	while ((bytes_read = stats->read(buffer, sizeof(buffer) - 1)) > 0) {
+		buffer[bytes_read] = 0;
+		console::get().writef("%s", buffer);
+	}
+
+	delete stats;
+	return true;
+}
+
+/*
+ * strace [seconds [pid]]
+ *
+ * Shows how many times each system call has been made, how long they took in total and on average, and a histogram
+ * of their latencies.  With a number of seconds, the counters are cleared, and the calls made in that time are shown,
+ * limited to the given process (as listed by top) if there is one.
+ */
+int main(const char *cmdline)
+{
+	u64 seconds = 0, pid = 0;
+
+	if (cmdline) {
+		parse_u64(cmdline, seconds);
+		parse_u64(cmdline, pid);
+	}
+
+	if (!seconds) {
+		return show() ? 0 : 1;
+	}
+
+	object *control = object::open("/dev/syscalls");
+	if (!control) {
+		console::get().write("error: unable to open /dev/syscalls\n");
+		return 1;
+	}
+
+	control->ioctl((u64)syscall_stats_ioctl::set_filter, &pid, sizeof(pid));
+	control->ioctl((u64)syscall_stats_ioctl::reset, nullptr, 0);
+
+	syscalls::sleep(seconds * 1000);
+
+	bool shown = show();
+
+	// Counting goes back to every process afterwards, so that the filter isn't left behind.
+	u64 everything = 0;
+	control->ioctl((u64)syscall_stats_ioctl::set_filter, &everything, sizeof(everything));
+	delete control;
+
+	return shown ? 0 : 1;
+}
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - top utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/parse.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+static const u64 max_threads = 128;
+static const u64 interval_ms = 1000;
+
+// Padded to the same width, since writef doesn't support left-aligned fields.
+static const char *state_name(u32 state)
+{
+	switch (state) {
+	case 0:
+		return "new  ";
+	case 1:
+		return "ready";
+	case 2:
+		return "run  ";
+	case 3:
+		return "sleep";
+	case 4:
+		return "dead ";
+	default:
+		return "?    ";
+	}
+}
+
+static const thread_cpu_stats *find_thread(const thread_cpu_stats *stats, u64 count, u64 thread_id)
+{
+	for (u64 i = 0; i < count; i++) {
+		if (stats[i].thread_id == thread_id) {
+			return &stats[i];
+		}
+	}
+
+	return nullptr;
+}
+
+// CPU usage over the interval, in tenths of a percent of one core.
+static u64 usage_permille(u64 delta_ns) { return (delta_ns * 1000) / (interval_ms * 1'000'000); }
+
+static void show(const thread_cpu_stats *prev, u64 prev_count, const thread_cpu_stats *cur, u64 cur_count)
+{
+	console::get().writef("  PID   TID  STATE   %%CPU    USER ms  KERNEL ms    VOL  PREEMPT  MIGR CORE\n");
+
+	for (u64 i = 0; i < cur_count; i++) {
+		const thread_cpu_stats &s = cur[i];
+		const thread_cpu_stats *p = find_thread(prev, prev_count, s.thread_id);
+
+		u64 total = s.user_ns + s.kernel_ns;
+		u64 delta = p ? total - (p->user_ns + p->kernel_ns) : total;
+		u64 pm = usage_permille(delta);
+
+		console::get().writef("%5llu %5llu  %s %4llu.%llu %10llu %10llu %6llu %8llu %5llu %4u\n", s.process_id, s.thread_id, state_name(s.state), pm / 10,
+			pm % 10, s.user_ns / 1'000'000, s.kernel_ns / 1'000'000, s.voluntary_switches, s.preemptions, s.migrations, s.last_core);
+	}
+
+	console::get().writef("\n  PID   %%CPU    USER ms  KERNEL ms\n");
+
+	for (u64 i = 0; i < cur_count; i++) {
+		u64 pid = cur[i].process_id;
+
+		// Only summarise each process once, at its first thread.
+		bool seen = false;
+		for (u64 j = 0; j < i; j++) {
+			if (cur[j].process_id == pid) {
+				seen = true;
+				break;
+			}
+		}
+
+		if (seen) {
+			continue;
+		}
+
+		u64 user = 0, kernel = 0, delta = 0;
+		for (u64 j = i; j < cur_count; j++) {
+			if (cur[j].process_id != pid) {
+				continue;
+			}
+
+			const thread_cpu_stats *p = find_thread(prev, prev_count, cur[j].thread_id);
+			u64 total = cur[j].user_ns + cur[j].kernel_ns;
+
+			user += cur[j].user_ns;
+			kernel += cur[j].kernel_ns;
+			delta += p ? total - (p->user_ns + p->kernel_ns) : total;
+		}
+
+		u64 pm = usage_permille(delta);
+		console::get().writef("%5llu %4llu.%llu %10llu %10llu\n", pid, pm / 10, pm % 10, user / 1'000'000, kernel / 1'000'000);
+	}
+}
+
+// Waits out the interval, returning false if q is pressed in the meantime.
+static bool wait_interval()
+{
+	u64 deadline = clock_now_ns() + (interval_ms * 1'000'000);
+
+	for (u64 now = clock_now_ns(); now < deadline; now = clock_now_ns()) {
+		if (console::get().wait_for_input(((deadline - now) / 1'000'000) + 1) && console::get().read_char() == 'q') {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * top [iterations]
+ *
+ * Samples the CPU usage of every thread once per second, and shows how much each thread and process used
+ * over the last second.  Pressing q stops it early.
+ */
+int main(const char *cmdline)
+{
+	u64 iterations = 5;
+
+	if (cmdline && *cmdline) {
+		parse_u64(cmdline, iterations);
+	}
+
+	thread_cpu_stats *prev = new thread_cpu_stats[max_threads];
+	thread_cpu_stats *cur = new thread_cpu_stats[max_threads];
+
+	u64 prev_count = min(syscalls::get_cpu_stats(prev, max_threads), max_threads);
+
+	for (u64 i = 0; i < iterations; i++) {
+		if (!wait_interval()) {
+			break;
+		}
+
+		u64 cur_count = min(syscalls::get_cpu_stats(cur, max_threads), max_threads);
+
+		console::get().clear();
+		show(prev, prev_count, cur, cur_count);
+
+		thread_cpu_stats *t = prev;
+		prev = cur;
+		cur = t;
+		prev_count = cur_count;
+	}
+
+	delete[] prev;
+	delete[] cur;
+
+	return 0;
+}
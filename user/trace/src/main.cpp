@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - trace utility
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/objects.h>
+#include <stacsos/parse.h>
+#include <stacsos/tracepoints.h>
+#include <stacsos/user-syscall.h>
+#include <stacsos/vector.h>
+
+using namespace stacsos;
+
+static const char *tracepoints_path = "/dev/tracepoints";
+
+static const u32 all_tracepoints = ~0u;
+
+static const char *skip_spaces(const char *p)
+{
+	while (*p == ' ') {
+		p++;
+	}
+
+	return p;
+}
+
+/**
+ * Copies the next word of the command line into the buffer, and returns what follows it.
+ */
+static const char *next_word(const char *p, char *word, size_t size)
+{
+	p = skip_spaces(p);
+
+	size_t n = 0;
+	while (*p && *p != ' ') {
+		if (n < size - 1) {
+			word[n++] = *p;
+		}
+
+		p++;
+	}
+
+	word[n] = 0;
+	return p;
+}
+
+static void load_tracepoints(object *tp, vector<tracepoint_info> &infos)
+{
+	for (u32 id = 0;; id++) {
+		tracepoint_info info;
+		info.id = id;
+
+		if (!tp->ioctl((u64)tracepoints_ioctl::info, &info, sizeof(info))) {
+			break;
+		}
+
+		infos.push_back(info);
+	}
+}
+
+/**
+ * Finds a tracepoint by name, or all of them for "all".  Returns false if there's no such tracepoint.
+ */
+static bool find_tracepoint(const vector<tracepoint_info> &infos, const char *name, u32 &id)
+{
+	if (memops::strcmp(name, "all") == 0) {
+		id = all_tracepoints;
+		return true;
+	}
+
+	for (const auto &info : infos) {
+		if (memops::strcmp(info.name, name) == 0) {
+			id = info.id;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void list(const vector<tracepoint_info> &infos)
+{
+	console::get().write("  ID  ON  NAME                FORMAT\n");
+	for (const auto &info : infos) {
+		console::get().writef("%4u  %2s  %-18s  %s\n", info.id, info.enabled ? "*" : "", info.name, info.format);
+	}
+}
+
+static void sort_by_timestamp(tracepoint_record *records, u64 count)
+{
+	// Shell sort, with Ciura's gaps (extended by 2.25x), as in iobench.
+	static const u64 gaps[] = { 1, 4, 10, 23, 57, 132, 301, 701, 1577, 3548, 7983, 17961, 40412, 90927, 204585 };
+
+	for (int g = sizeof(gaps) / sizeof(gaps[0]) - 1; g >= 0; g--) {
+		u64 gap = gaps[g];
+
+		for (u64 i = gap; i < count; i++) {
+			tracepoint_record v = records[i];
+			u64 j = i;
+
+			while (j >= gap && v.timestamp < records[j - gap].timestamp) {
+				records[j] = records[j - gap];
+				j -= gap;
+			}
+
+			records[j] = v;
+		}
+	}
+}
+
+/**
+ * Drains the records written since the last drain, and prints them in the order they were written, with their times
+ * since boot.
+ */
+static void dump(object *tp, const vector<tracepoint_info> &infos)
+{
+	u64 count = tp->ioctl((u64)tracepoints_ioctl::drain, nullptr, 0);
+
+	vector<tracepoint_record> records(count);
+	if (count) {
+		records.resize(tp->pread(records.data(), count * sizeof(tracepoint_record), 0) / sizeof(tracepoint_record));
+	}
+
+	u64 lost = tp->ioctl((u64)tracepoints_ioctl::lost, nullptr, 0);
+
+	sort_by_timestamp(records.data(), records.size());
+
+	u64 boot_tsc = kernel_data_page().boot_tsc;
+
+	for (const auto &r : records) {
+		u64 ns = clock_ticks_to_ns(r.timestamp - boot_tsc);
+		const char *name = r.id < infos.size() ? infos[r.id].name : "?";
+
+		console::get().writef("%6llu.%06llu [%u] %s: ", ns / 1'000'000'000ull, (ns / 1000) % 1'000'000ull, r.core, name);
+
+		if (r.id < infos.size()) {
+			// Every argument is recorded as 64 bits, so the unused ones are harmless.
+			console::get().writef(infos[r.id].format, r.args[0], r.args[1], r.args[2], r.args[3]);
+		}
+
+		console::get().write("\n");
+	}
+
+	console::get().writef("%llu records, %llu lost since boot\n", (u64)records.size(), lost);
+}
+
+static bool set_enabled(object *tp, const vector<tracepoint_info> &infos, const char *name, bool enabled)
+{
+	u32 id;
+	if (!find_tracepoint(infos, name, id)) {
+		console::get().writef("error: no tracepoint called %s\n", name);
+		return false;
+	}
+
+	return tp->ioctl((u64)(enabled ? tracepoints_ioctl::enable : tracepoints_ioctl::disable), &id, sizeof(id));
+}
+
+/*
+ * trace
+ * trace on|off name|all
+ * trace dump
+ * trace record seconds [name|all]
+ *
+ * Lists the kernel's tracepoints, enables or disables one (or all of them), or prints the records written since they
+ * were last read, in the order they were written.  record enables the tracepoint (all of them by default) for a
+ * number of seconds, then disables it and prints what it recorded.
+ */
+int main(const char *cmdline)
+{
+	object *tp = object::open(tracepoints_path);
+	if (!tp) {
+		console::get().writef("error: unable to open %s\n", tracepoints_path);
+		return 1;
+	}
+
+	vector<tracepoint_info> infos;
+	load_tracepoints(tp, infos);
+
+	char command[16], name[32];
+	const char *p = next_word(cmdline ? cmdline : "", command, sizeof(command));
+
+	int result = 0;
+
+	if (!command[0]) {
+		list(infos);
+	} else if (memops::strcmp(command, "on") == 0 || memops::strcmp(command, "off") == 0) {
+		next_word(p, name, sizeof(name));
+		result = set_enabled(tp, infos, name, command[1] == 'n') ? 0 : 1;
+	} else if (memops::strcmp(command, "dump") == 0) {
+		dump(tp, infos);
+	} else if (memops::strcmp(command, "record") == 0) {
+		char seconds[16];
+		p = next_word(p, seconds, sizeof(seconds));
+		next_word(p, name, sizeof(name));
+
+		u64 s;
+		const char *c = seconds;
+		parse_u64(c, s);
+
+		const char *which = name[0] ? name : "all";
+
+		// Whatever was already waiting is thrown away, so that only this recording is printed.
+		tp->ioctl((u64)tracepoints_ioctl::drain, nullptr, 0);
+
+		if (!set_enabled(tp, infos, which, true)) {
+			result = 1;
+		} else {
+			syscalls::sleep((s ? s : 1) * 1000);
+			set_enabled(tp, infos, which, false);
+
+			dump(tp, infos);
+		}
+	} else {
+		console::get().write("usage: trace [on|off name|all] [dump] [record seconds [name|all]]\n");
+		result = 1;
+	}
+
+	delete tp;
+	return result;
+}
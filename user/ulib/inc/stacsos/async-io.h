@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/io-ring.h>
+
+namespace stacsos {
+class object;
+
+/**
+ * @brief Queues object operations in a ring shared with the kernel, so that many of them can be submitted with one
+ * system call, or none at all if the ring is polled.  A ring must only be used by one thread at a time.
+ *
+ * An operation's buffer must stay valid until its completion has been collected.
+ */
+class io_ring {
+public:
+	static io_ring *create(u32 entries, io_ring_flags flags = io_ring_flags::none);
+
+	~io_ring();
+
+	/**
+	 * @brief Queues an operation, returning false if the submission queue is full.
+	 */
+	bool queue(io_ring_op op, object *o, void *buffer, u64 length, u64 offset, u64 user_data);
+
+	bool queue_read(object *o, void *buffer, u64 length, u64 user_data = 0) { return queue(io_ring_op::read, o, buffer, length, 0, user_data); }
+	bool queue_write(object *o, const void *buffer, u64 length, u64 user_data = 0) { return queue(io_ring_op::write, o, (void *)buffer, length, 0, user_data); }
+
+	bool queue_pread(object *o, void *buffer, u64 length, u64 offset, u64 user_data = 0)
+	{
+		return queue(io_ring_op::pread, o, buffer, length, offset, user_data);
+	}
+
+	bool queue_pwrite(object *o, const void *buffer, u64 length, u64 offset, u64 user_data = 0)
+	{
+		return queue(io_ring_op::pwrite, o, (void *)buffer, length, offset, user_data);
+	}
+
+	bool queue_ioctl(object *o, u64 cmd, void *buffer, u64 length, u64 user_data = 0) { return queue(io_ring_op::ioctl, o, buffer, length, cmd, user_data); }
+
+	/**
+	 * @brief Hands the queued operations to the kernel, and waits until at least min_complete completions can be
+	 * collected.  A polled ring only enters the kernel if its polling thread is asleep, or if it has to wait.
+	 */
+	void submit(u64 min_complete = 0);
+
+	/**
+	 * @brief Takes the oldest completion off the completion queue, returning false if there isn't one.
+	 */
+	bool next_completion(io_ring_cqe &cqe);
+
+	/**
+	 * @brief The ring's handle, e.g. to wait for completions along with other objects with wait_many.
+	 */
+	u64 handle() const { return handle_; }
+
+private:
+	io_ring(u64 handle, io_ring_header *ring, io_ring_flags flags)
+		: handle_(handle)
+		, ring_(ring)
+		, sqes_(io_ring_sqes(ring))
+		, cqes_(io_ring_cqes(ring))
+		, mask_(ring->entries - 1)
+		, flags_(flags)
+	{
+	}
+
+	u64 handle_;
+	io_ring_header *ring_;
+	io_ring_sqe *sqes_;
+	io_ring_cqe *cqes_;
+	u32 mask_;
+	io_ring_flags flags_;
+};
+} // namespace stacsos
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+/*
+ * Helpers for the benchmark programs.  Every result a benchmark prints is a single line of "key=value" pairs, starting
+ * with the name of what it is a result of, e.g. "churn size=64 iterations=100000 cycles_per_op=52", so that the output
+ * can be collected and compared between kernels with a script.
+ */
+namespace stacsos {
+/**
+ * @brief Reads the timestamp counter, for timing in cycles.
+ */
+static inline u64 bench_rdtsc() { return __builtin_ia32_rdtsc(); }
+
+/**
+ * @brief Prints the frequency of the timestamp counter, as "calibrate tsc_hz=<hz>", so that results given in cycles
+ * can be converted to time, and returns it.
+ */
+u64 bench_calibrate();
+
+/**
+ * @brief Prints one result: the name, and then the key=value pairs that the format gives, on a line of their own.
+ */
+void bench_result(const char *name, const char *fmt, ...) __printf_format(2, 3);
+} // namespace stacsos
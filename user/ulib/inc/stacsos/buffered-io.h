@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+class object;
+
+/**
+ * @brief Reads an object through a buffer, so that reading a few bytes (or a line) at a time doesn't cost a system
+ * call each time.  Only one thread may use a reader at a time.
+ *
+ * A file of at least mmap_threshold bytes is mapped instead, and read straight out of the page cache, without any
+ * system calls or copying into the buffer at all.  A mapped file is read from its start (rather than from the position
+ * of the object), so a reader should be given a file that has just been opened.
+ */
+class buffered_reader {
+public:
+	static const size_t default_buffer_size = 4096;
+	static const u64 mmap_threshold = 65536;
+
+	buffered_reader(object *source, size_t buffer_size = default_buffer_size);
+	~buffered_reader();
+
+	/**
+	 * @brief Reads up to length bytes, returning zero at the end of the object.  A read at least as big as the buffer
+	 * goes straight into the caller's memory, once what is already buffered has been used.
+	 */
+	size_t read(void *buffer, size_t length);
+
+	/**
+	 * @brief Reads a line, with its newline, into the buffer, returning its length, or zero at the end of the object.
+	 * A line that doesn't fit is returned a buffer's worth at a time, without a newline until its last part.
+	 */
+	size_t read_line(char *buffer, size_t length);
+
+	/**
+	 * @brief Returns the next byte without taking it, or -1 at the end of the object.
+	 */
+	int peek() { return (start_ < end_ || fill()) ? (u8)data_[start_] : -1; }
+
+	/**
+	 * @brief Takes the next byte, or returns -1 at the end of the object.
+	 */
+	int read_char() { return (start_ < end_ || fill()) ? (u8)data_[start_++] : -1; }
+
+	bool mapped() const { return mapping_ != nullptr; }
+
+private:
+	bool fill();
+
+	object *source_;
+
+	// Either the buffer, or the mapped file, holding the bytes from start_ to end_ that haven't been read yet.
+	const char *data_;
+	size_t start_, end_;
+
+	char *buffer_;
+	size_t buffer_size_;
+
+	void *mapping_;
+	u64 mapping_size_;
+};
+
+/**
+ * @brief Writes to an object through a buffer, which is only written out when it is full, or flushed (as it is when
+ * the writer is destroyed).  Only one thread may use a writer at a time.
+ */
+class buffered_writer {
+public:
+	static const size_t default_buffer_size = 4096;
+
+	buffered_writer(object *sink, size_t buffer_size = default_buffer_size);
+	~buffered_writer();
+
+	/**
+	 * @brief Writes length bytes, returning how many were taken.  Anything too big to fit in the buffer goes out
+	 * straight away, along with what was already buffered, in one system call.
+	 */
+	size_t write(const void *data, size_t length);
+	size_t write(const char *str);
+
+	bool put(char ch) { return (length_ < buffer_size_ || flush()) ? (buffer_[length_++] = ch, true) : false; }
+
+	/**
+	 * @brief Writes out everything buffered so far, returning false if the object didn't take all of it.
+	 */
+	bool flush();
+
+private:
+	object *sink_;
+
+	char *buffer_;
+	size_t buffer_size_;
+	size_t length_;
+};
+} // namespace stacsos
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/kernel-data.h>
+
+namespace stacsos {
+/**
+ * @brief The kernel data page, which is mapped, read-only, into every process.
+ */
+static inline const kernel_data &kernel_data_page() { return *(const kernel_data *)KERNEL_DATA_ADDRESS; }
+
+static inline u64 clock_tsc_frequency() { return kernel_data_page().tsc_frequency; }
+
+static inline u32 clock_nr_cores() { return kernel_data_page().nr_cores; }
+
+/**
+ * @brief Converts a number of timestamp counter ticks to nanoseconds.  The whole seconds are converted separately
+ * from the remainder, so that the multiplication can't overflow.
+ */
+static inline u64 clock_ticks_to_ns(u64 ticks)
+{
+	u64 freq = clock_tsc_frequency();
+	return ((ticks / freq) * 1'000'000'000ull) + (((ticks % freq) * 1'000'000'000ull) / freq);
+}
+
+/**
+ * @brief Converts a number of nanoseconds to timestamp counter ticks, for deadlines given to sleep_until and timers.
+ */
+static inline u64 clock_ns_to_ticks(u64 ns)
+{
+	u64 freq = clock_tsc_frequency();
+	return ((ns / 1'000'000'000ull) * freq) + (((ns % 1'000'000'000ull) * freq) / 1'000'000'000ull);
+}
+
+/**
+ * @brief The number of nanoseconds since boot, without a system call.
+ */
+static inline u64 clock_now_ns() { return clock_ticks_to_ns(__builtin_ia32_rdtsc() - kernel_data_page().boot_tsc); }
+
+/**
+ * @brief The wall clock time, in nanoseconds since the Unix epoch.
+ */
+static inline u64 clock_wall_ns() { return kernel_data_page().wall_clock_base_ns + clock_now_ns(); }
+
+/**
+ * @brief The ID of the core the calling thread is running on, which may well have changed by the time it is used.
+ */
+static inline u32 clock_current_cpu()
+{
+	unsigned int aux;
+	__builtin_ia32_rdtscp(&aux);
+	return aux;
+}
+} // namespace stacsos
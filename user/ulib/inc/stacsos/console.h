@@ -7,9 +7,17 @@
  */
 #pragma once
 
+#include <stacsos/iovec.h>
+#include <stacsos/process-start.h>
+
 namespace stacsos {
 class object;
 
+/**
+ * How output is held back before it is written: not at all, until the end of each line, or until the buffer is full.
+ */
+enum class console_buffering { none, line, full };
+
 class console {
 public:
 	static console &get()
@@ -18,19 +26,72 @@ public:
 		return c;
 	}
 
-	void init();
+	/**
+	 * Sets up the process's input and output, from the streams it was started with.  It is called again in a copy of
+	 * a template process, which keeps the template's console, if it opened one.
+	 */
+	void init(const process_streams &streams);
 
+	/**
+	 * Output goes into a buffer belonging to the thread, which is written out as the buffering mode says, and also
+	 * before anything is read, and when the thread or process finishes.
+	 */
 	void write(const char *msg);
-	void writef(const char *msg, ...);
+	void writef(const char *msg, ...) __printf_format(2, 3);
+
+	/**
+	 * Writes the pieces one after another, with one system call (or into the buffer, if they fit).
+	 */
+	void writev(const iovec *iov, size_t count);
+
+	/**
+	 * Writes out whatever the calling thread has buffered.
+	 */
+	void flush();
+
+	void set_buffering(console_buffering mode) { buffering_ = mode; }
+
 	char read_char();
+
+	/**
+	 * Reads up to length bytes of input, returning zero at the end of it.
+	 */
+	size_t read(void *buffer, size_t length);
+
+	/**
+	 * Reads a line of input, with the newline, into the buffer, returning its length.  A terminal lets the line be
+	 * edited as it is typed, and hands it over whole, with one system call.
+	 */
+	size_t read_line(char *buffer, size_t length);
+
+	/**
+	 * Waits until a key has been pressed, or the timeout passes, returning whether read_char would return straight
+	 * away.
+	 */
+	bool wait_for_input(u64 timeout_ms);
 	void clear();
 
+	/**
+	 * The objects behind the console, e.g. to copy a file straight to the output with object::copy_to.  Anything
+	 * buffered should be flushed first, so that it comes out in order.
+	 */
+	object *input() const { return input_; }
+	object *output() const { return output_; }
+
 private:
 	console()
-		: console_object_(nullptr)
+		: input_(nullptr)
+		, output_(nullptr)
+		, console_object_(nullptr)
+		, buffering_(console_buffering::line)
 	{
 	}
 
+	object *input_;
+	object *output_;
 	object *console_object_;
+	console_buffering buffering_;
+
+	void append(const char *data, size_t length);
 };
 } // namespace stacsos
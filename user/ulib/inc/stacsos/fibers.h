@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/io-ring.h>
+#include <stacsos/threads.h>
+
+namespace stacsos {
+class io_ring;
+class object;
+
+/**
+ * @brief Runs fibers (user-space threads, each with a small stack of its own) on a few kernel threads, so that a
+ * program can have thousands of operations in flight at once, without a kernel thread (and kernel stack) for each.
+ *
+ * Switching between fibers is a handful of instructions, with no system call.  A fiber that does I/O through the
+ * runtime is switched out until the I/O is done, and its worker runs another fiber meanwhile: reads and writes are
+ * queued on an asynchronous I/O ring, and waits for an object to become ready are handed to a reactor thread, which
+ * waits for all of them at once with wait_many.
+ *
+ * Workers share fibers out as a thread pool does its tasks: a worker runs the fibers it spawns itself, and steals from
+ * other workers when it has none.  Fibers that yield, or whose I/O has finished, go to the back of a queue that all the
+ * workers take from.
+ *
+ * A fiber may be moved to another kernel thread whenever it yields or does I/O, so it mustn't hold on to anything
+ * thread-local (including a mutex) across either.
+ */
+class fiber_runtime {
+public:
+	static const size_t default_stack_size = KB(32);
+
+	/**
+	 * @brief Creates a runtime with the given number of workers (one per core, if zero), and an I/O ring with room for
+	 * ring_entries operations at once.  More can be started than that: the rest are queued until there is room.
+	 */
+	fiber_runtime(u32 nr_workers = 0, u32 ring_entries = 256);
+
+	/**
+	 * @brief Every fiber must have finished, i.e. run must have returned.
+	 */
+	~fiber_runtime();
+
+	u32 nr_workers() const { return nr_workers_; }
+
+	/**
+	 * @brief Starts a fiber that calls fn().  The function is copied.  From outside the runtime, the fiber only starts
+	 * running once run is called.
+	 */
+	template <typename F> void spawn(const F &fn, size_t stack_size = default_stack_size) { spawn_fn(invoke<F>, new F(fn), stack_size); }
+
+	/**
+	 * @brief Runs fibers, on the calling thread and the other workers, until every fiber has finished.
+	 */
+	void run();
+
+	/**
+	 * @brief Lets the other runnable fibers run, before the calling fiber carries on.
+	 */
+	static void yield();
+
+	/**
+	 * @brief Switches the calling fiber out until the object is ready, as wait_many defines it (e.g. a pipe with
+	 * something to read, or a process that has exited).
+	 */
+	static void wait(object *o);
+
+	/**
+	 * @brief Carry out an operation on the I/O ring, switching the calling fiber out until it is done.  Each returns
+	 * what the operation does when called directly, or zero if it failed.
+	 */
+	static size_t read(object *o, void *buffer, size_t length);
+	static size_t pread(object *o, void *buffer, size_t length, size_t offset);
+	static size_t write(object *o, const void *buffer, size_t length);
+	static size_t pwrite(object *o, const void *buffer, size_t length, size_t offset);
+
+	struct fiber;
+	struct worker;
+
+private:
+	worker **workers_;
+	u32 nr_workers_;
+
+	// Fibers that any worker may run: those spawned from outside, and those that have yielded, or been woken.
+	mutex queue_lock_;
+	fiber *queue_head_, *queue_tail_;
+	u32 nr_queued_;
+
+	// The number of fibers that haven't finished yet.
+	u64 live_;
+
+	// As in thread_pool: bumped whenever a fiber becomes runnable, and slept on by idle workers.
+	u32 work_seq_;
+	u32 sleepers_;
+
+	// Stacks of the default size, kept from fibers that have finished, to be used again.
+	mutex free_lock_;
+	fiber *free_fibers_;
+
+	// Operations are only queued on the ring while there is room for their completions, and the rest wait in order.
+	io_ring *ring_;
+	mutex ring_lock_;
+	u32 ring_entries_;
+	u32 in_flight_;
+	fiber *ring_overflow_head_, *ring_overflow_tail_;
+
+	// Fibers waiting for an object, which the reactor waits for.
+	mutex waiters_lock_;
+	fiber *waiters_;
+
+	thread *reactor_;
+	object *reactor_wake_read_, *reactor_wake_write_;
+	bool reactor_poked_;
+	bool stopping_;
+
+	template <typename F> static void invoke(void *fn)
+	{
+		(*(F *)fn)();
+		delete (F *)fn;
+	}
+
+	void spawn_fn(void (*entry)(void *), void *arg, size_t stack_size);
+
+	fiber *find_fiber(worker *self);
+	bool has_work() const;
+	void make_runnable(fiber *f);
+	void notify();
+	void run_fiber(worker *self, fiber *f);
+	void worker_loop(worker *self);
+	void free_fiber(fiber *f);
+
+	void submit_io(fiber *f);
+	void add_waiter(fiber *f);
+	void poke_reactor();
+	void reap_completions();
+
+	static size_t do_io(io_ring_op op, object *o, void *buffer, size_t length, size_t offset);
+
+	static void *worker_main(void *arg);
+	static void *reactor_main(void *arg);
+};
+} // namespace stacsos
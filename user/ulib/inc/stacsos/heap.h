@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+
+/**
+ * @brief The allocator behind new and delete.  Small allocations are rounded up to one of a set of size classes, and
+ * come from spans of memory that each hold objects of a single class, through a cache kept by each thread, so that
+ * most allocations and frees touch nothing shared.  Larger allocations come from chunks of memory that are split and
+ * coalesced with boundary tags, and the very largest are mapped by the kernel on their own.
+ */
+class heap {
+public:
+	struct stats {
+		u64 kernel_allocations, kernel_bytes;
+		u64 spans, cache_refills, cache_flushes;
+		u64 large_allocations, direct_allocations;
+	};
+
+	static stats get_stats();
+
+	/**
+	 * @brief Gives everything in the calling thread's cache back to the shared bins.  This is called when a thread
+	 * exits.
+	 */
+	static void release_thread_cache();
+};
+} // namespace stacsos
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/net-ring.h>
+
+namespace stacsos {
+class object;
+
+/**
+ * @brief A queue pair of a network device, opened and mapped, through which packets are received and sent in batches,
+ * without a system call for each one.  A port must only be used by one thread at a time.
+ *
+ * The transmit area is split into a buffer for each transmit entry, so that a buffer is free again as soon as its
+ * entry is.
+ */
+class net_port {
+public:
+	/**
+	 * @brief Opens a network device (e.g. /dev/net0), claiming one of its queue pairs, and maps its packet ring.
+	 * Returns null if there is no such device, or every queue pair is in use.
+	 */
+	static net_port *open(const char *path);
+
+	~net_port();
+
+	const net_ring_info &info() const { return info_; }
+
+	/**
+	 * @brief How many received packets are waiting to be looked at with next_received.
+	 */
+	u32 received() const { return __atomic_load_n(&ring_->rx_tail, __ATOMIC_ACQUIRE) - rx_next_; }
+
+	/**
+	 * @brief How many packets arrived while every receive buffer was in use, and so were lost.
+	 */
+	u64 received_dropped() const { return __atomic_load_n(&ring_->rx_dropped, __ATOMIC_RELAXED); }
+
+	/**
+	 * @brief Takes the oldest received packet that hasn't been looked at yet, returning false if there isn't one.  The
+	 * packet (its header, and length bytes in all) stays where it is until it is released.
+	 */
+	bool next_received(net_packet_header *&packet, u32 &length);
+
+	/**
+	 * @brief Hands the buffers of every packet taken with next_received back to the device.
+	 */
+	void release_received() { __atomic_store_n(&ring_->rx_head, rx_next_, __ATOMIC_RELEASE); }
+
+	/**
+	 * @brief The buffer to write the next packet to send into (header first), or null if every transmit entry is in
+	 * use.  The packet is only queued by queue_send.
+	 */
+	net_packet_header *send_buffer();
+
+	/**
+	 * @brief The size of each buffer given by send_buffer.
+	 */
+	u32 send_buffer_size() const { return tx_buffer_size_; }
+
+	/**
+	 * @brief Queues the packet written into the buffer from send_buffer, which is length bytes, including the header.
+	 */
+	void queue_send(u32 length);
+
+	/**
+	 * @brief Sends the queued packets, hands the released receive buffers back to the device, and then waits until at
+	 * least min_received received packets are waiting.  Returns how many are.
+	 */
+	u32 enter(u32 min_received = 0);
+
+	/**
+	 * @brief The handle of the open device, e.g. to wait for packets along with other objects with wait_many.
+	 */
+	u64 handle() const;
+
+private:
+	net_port(object *o, net_ring_header *ring, const net_ring_info &info)
+		: o_(o)
+		, ring_(ring)
+		, info_(info)
+		, rx_(net_ring_rx_entries(ring))
+		, tx_(net_ring_tx_entries(ring, info.rx_entries))
+		, rx_next_(ring->rx_head)
+		, tx_buffer_size_((u32)(info.tx_area_size / info.tx_entries))
+	{
+	}
+
+	object *o_;
+	net_ring_header *ring_;
+	net_ring_info info_;
+	net_ring_entry *rx_, *tx_;
+
+	// The next received packet to be taken, which is ahead of rx_head until the packets are released.
+	u32 rx_next_;
+	u32 tx_buffer_size_;
+};
+} // namespace stacsos
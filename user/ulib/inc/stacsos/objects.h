@@ -7,10 +7,30 @@
  */
 #pragma once
 
+#include <stacsos/iovec.h>
+#include <stacsos/syscalls.h>
+
 namespace stacsos {
 class object {
 public:
-	static object *open(const char *path);
+	static object *open(const char *path, open_flags flags = open_flags::none);
+
+	/**
+	 * Wraps a handle that the process already has, such as one of the streams it was started with.
+	 */
+	static object *from_handle(u64 handle) { return new object(handle); }
+
+	/**
+	 * Creates a pipe, whose read end gives back whatever is written to its write end.  Reading returns zero once the
+	 * pipe is empty and every write end (in every process) has been closed.
+	 */
+	static bool create_pipe(object *&read_end, object *&write_end);
+
+	/**
+	 * Creates size bytes of zeroed memory, which every process with a handle to it can map (shared, to see each
+	 * other's writes) with mmap.  Returns null if there isn't enough memory.
+	 */
+	static object *create_shared_memory(u64 size);
 
 	virtual ~object();
 
@@ -20,8 +40,57 @@ public:
 	size_t read(void *buffer, size_t length);
 	size_t pread(void *buffer, size_t length, size_t offset);
 
+	/**
+	 * Reads into, or writes from, each buffer in the list in turn, with one system call.
+	 */
+	size_t readv(const iovec *iov, size_t count);
+	size_t preadv(const iovec *iov, size_t count, size_t offset);
+	size_t writev(const iovec *iov, size_t count);
+	size_t pwritev(const iovec *iov, size_t count, size_t offset);
+
 	u64 ioctl(u64 cmd, void *buffer, size_t length);
 
+	/**
+	 * Copies up to length bytes from this object to the end of dst, inside the kernel, reading from the offset, or from
+	 * the current position with COPY_CURRENT_POSITION.  Returns the number of bytes copied, which is short at the end
+	 * of this object.
+	 */
+	size_t copy_to(object *dst, size_t offset, size_t length);
+
+	/**
+	 * Makes everything written to the object so far durable.  Returns false if the object doesn't support it.
+	 */
+	bool fsync();
+
+	/**
+	 * Changes the size of a file.  Returns false if the object isn't a file that can be resized.
+	 */
+	bool truncate(u64 size);
+
+	/**
+	 * Tells the kernel how a range of a file is going to be used.  Returns false if the object isn't a file.
+	 */
+	bool advise(u64 offset, u64 length, access_advice advice);
+
+	/**
+	 * Finds the size of a file, in bytes.  Returns false if the object isn't a file.
+	 */
+	bool size(u64 &size);
+
+	/**
+	 * Fills the buffer with the next entries of an open directory, as packed dirent records, returning the number of
+	 * bytes used, which is zero at the end of the directory.
+	 */
+	size_t readdir(void *buffer, size_t length);
+
+	/**
+	 * Maps length bytes of the object, from the (page aligned) offset, into memory.  Anything past the end of a file
+	 * reads as zero.  Returns null if the object can't be mapped.
+	 */
+	void *mmap(size_t offset, size_t length, mmap_flags flags = mmap_flags::none);
+
+	u64 handle() const { return handle_; }
+
 private:
 	u64 handle_;
 
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+namespace stacsos {
+/**
+ * @brief Parses a decimal number, after any spaces, from the front of a command line, and moves p past it.  Returns
+ * false, with value zero, if there is no number there, or it is too big for a u64, in which case p is left at its
+ * first digit.  A null p holds no number.
+ */
+bool parse_u64(const char *&p, u64 &value);
+} // namespace stacsos
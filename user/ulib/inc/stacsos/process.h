@@ -7,13 +7,85 @@
  */
 #pragma once
 
+#include <stacsos/cpu-stats.h>
+#include <stacsos/resource-limits.h>
+
 namespace stacsos {
+class object;
+struct process_start_info;
+
 class process {
 public:
-	static process *create(const char *path, const char *args);
+	typedef int (*clone_fn)(void *arg);
+
+	/**
+	 * Starts a program.  If input or output are given, the new process reads from or writes to them, rather than
+	 * this process's own input and output.  The new process also inherits each of the given handles.
+	 */
+	static process *create(const char *path, const char *args, object *input = nullptr, object *output = nullptr, object *const *inherited = nullptr,
+		u64 nr_inherited = 0);
+
+	/**
+	 * Starts a program in the same way as create, and waits for it to finish, with a single system call.  Returns
+	 * false if the program couldn't be started.  With new_group, the program starts a resource group of its own.
+	 */
+	static bool run(const char *path, const char *args, object *input = nullptr, object *output = nullptr, bool new_group = false);
+
+	/**
+	 * Starts a copy of this process, which runs fn(arg) in a thread of its own, and exits with what it returns.  The
+	 * copy shares this process's memory until either of them writes to it, so that whatever has been set up
+	 * beforehand (e.g. by a server, before starting its workers) is there without being done again.  It has its own
+	 * handles to this process's files and pipes, under the same handles.  None of the other threads are copied, so
+	 * anything they hold locked at the time stays locked in the copy.
+	 */
+	static process *clone(clone_fn fn, void *arg);
+
+	/**
+	 * Lowers a limit of this process, or of its group.  The programs it starts afterwards get the same limits.
+	 * Returns false if the limit would be raised, or there is no group.
+	 */
+	static bool set_limit(resource_type type, u64 limit, resource_scope scope = resource_scope::process);
+
+	/**
+	 * How much of a resource this process, or its group, is using.
+	 */
+	static u64 usage(resource_type type, resource_scope scope = resource_scope::process);
+
+	/**
+	 * Turns gang scheduling of this process's threads on or off.  While it is on, the threads that are ready to run
+	 * are given time slices on different cores at the same time, which suits threads that wait for each other often,
+	 * e.g. at barriers.
+	 */
+	static bool set_gang_scheduling(bool enabled);
+
+	/**
+	 * The handles this process was started with, other than its streams, in the order they were given.
+	 */
+	static u64 nr_inherited_handles();
+	static object *inherited_handle(u64 index);
+
+	~process();
 
 	void wait_for_exit();
 
+	/**
+	 * Returns true if the process has finished, without waiting for it.
+	 */
+	bool has_exited();
+
+	/**
+	 * The CPU time the process's threads have used, which is still there once it has finished.  Returns false if the
+	 * times couldn't be read.
+	 */
+	bool cpu_times(process_cpu_times &times);
+
+	/**
+	 * The process's handle, e.g. to wait for it along with other objects, with wait_many.
+	 */
+	u64 handle() const { return handle_; }
+
+	static void init(const process_start_info *info) { start_info_ = info; }
+
 private:
 	process(u64 handle)
 		: handle_(handle)
@@ -21,5 +93,7 @@ private:
 	}
 
 	u64 handle_;
+
+	static const process_start_info *start_info_;
 };
 } // namespace stacsos
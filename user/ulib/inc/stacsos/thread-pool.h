@@ -0,0 +1,183 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#pragma once
+
+#include <stacsos/helpers.h>
+#include <stacsos/threads.h>
+#include <stacsos/work-stealing-deque.h>
+
+namespace stacsos {
+class task_group;
+
+/**
+ * @brief A unit of work for a thread pool: a function to run, and the group that is waiting for it.  The function is
+ * responsible for freeing the task.
+ */
+struct pool_task {
+	pool_task(void (*run)(pool_task *), task_group *group)
+		: run(run)
+		, group(group)
+		, next(nullptr)
+	{
+	}
+
+	void (*run)(pool_task *);
+	task_group *group;
+
+	// The next task submitted from outside the pool, while this one is waiting for a worker.
+	pool_task *next;
+};
+
+/**
+ * @brief A fixed set of worker threads that run tasks, so that a program can spread work over the cores without
+ * starting a thread for each piece of it.  Each worker keeps the tasks it creates in a deque of its own, runs the
+ * newest first, and steals the oldest from other workers when it runs out.  Tasks submitted by threads outside the
+ * pool are queued for the workers to take.  Workers with nothing to do spin for a short while, and then sleep on a
+ * futex until more work is submitted.
+ */
+class thread_pool {
+public:
+	/**
+	 * @brief Starts the workers: one per core, if nr_workers is zero.
+	 */
+	thread_pool(u32 nr_workers = 0);
+
+	/**
+	 * @brief Stops and joins the workers.  Every task group using the pool must have been waited for.
+	 */
+	~thread_pool();
+
+	u32 nr_workers() const { return nr_workers_; }
+
+	/**
+	 * @brief Calls fn(begin, end) for pieces of the range [begin, end) of at most grain elements each, in parallel,
+	 * and returns once every piece is done.  The range is split in half repeatedly, and one half left for other
+	 * workers to steal, so that big pieces of work are what move between threads.
+	 */
+	template <typename F> void parallel_for(u64 begin, u64 end, u64 grain, const F &fn);
+
+	/**
+	 * @brief Queues a task, on the calling worker's own deque, or, from outside the pool, for any worker.
+	 */
+	void submit(pool_task *task);
+
+	/**
+	 * @brief Runs one queued task on the calling thread, if there is one.  Threads waiting for a task group call this,
+	 * so that they help rather than sleep while there is work to do.
+	 */
+	bool run_one();
+
+	struct worker;
+
+private:
+	worker **workers_;
+	u32 nr_workers_;
+
+	// Tasks submitted from outside the pool.
+	mutex injected_lock_;
+	pool_task *injected_head_, *injected_tail_;
+	u32 nr_injected_;
+
+	// Bumped whenever work is submitted, and slept on by idle workers, which are counted so that submitting work only
+	// enters the kernel when one of them might need waking.
+	u32 work_seq_;
+	u32 sleepers_;
+	bool stopping_;
+
+	worker *current_worker() const;
+	pool_task *find_task(worker *self);
+	bool has_work() const;
+	void notify();
+	void execute(pool_task *task);
+
+	static void *worker_main(void *arg);
+
+	template <typename F> static void split_range(task_group &group, u64 begin, u64 end, u64 grain, const F &fn);
+};
+
+/**
+ * @brief A set of tasks run on a thread pool, that can be waited for together.  The thread that waits runs queued
+ * tasks itself while there are any, and only sleeps once there is nothing left for it to do.
+ */
+class task_group {
+public:
+	task_group(thread_pool &pool)
+		: pool_(pool)
+		, pending_(0)
+	{
+	}
+
+	~task_group() { wait(); }
+
+	/**
+	 * @brief Runs fn() on the pool.  The function is copied, so anything it captures by reference must last until the
+	 * group has been waited for.
+	 */
+	template <typename F> void run(const F &fn)
+	{
+		__atomic_add_fetch(&pending_, 1, __ATOMIC_SEQ_CST);
+		pool_.submit(new function_task<F>(this, fn));
+	}
+
+	/**
+	 * @brief Returns once every task run in the group (including those run by its tasks) has finished.
+	 */
+	void wait();
+
+	/**
+	 * @brief Called by the pool when one of the group's tasks has finished.
+	 */
+	void task_done();
+
+private:
+	template <typename F> struct function_task : pool_task {
+		function_task(task_group *group, const F &fn)
+			: pool_task(invoke, group)
+			, fn(fn)
+		{
+		}
+
+		F fn;
+
+		static void invoke(pool_task *task)
+		{
+			auto *self = (function_task *)task;
+			self->fn();
+			delete self;
+		}
+	};
+
+	// The top bit of the count of unfinished tasks is set while a thread is sleeping in wait().
+	static const u32 waiting = 1u << 31;
+
+	thread_pool &pool_;
+	u32 pending_;
+};
+
+template <typename F> void thread_pool::split_range(task_group &group, u64 begin, u64 end, u64 grain, const F &fn)
+{
+	while (end - begin > grain) {
+		u64 mid = begin + ((end - begin) / 2);
+		group.run([&group, mid, end, grain, &fn] { split_range(group, mid, end, grain, fn); });
+		end = mid;
+	}
+
+	fn(begin, end);
+}
+
+template <typename F> void thread_pool::parallel_for(u64 begin, u64 end, u64 grain, const F &fn)
+{
+	if (begin >= end) {
+		return;
+	}
+
+	task_group group(*this);
+	split_range(group, begin, end, max(grain, 1ull), fn);
+	group.wait();
+}
+} // namespace stacsos
@@ -7,9 +7,50 @@
  */
 #pragma once
 
+#include <stacsos/process-start.h>
+#include <stacsos/syscalls.h>
+
 namespace stacsos {
 typedef void *(*thread_entry_fn)(void *);
 
+/**
+ * @brief The block of per-thread data that FS points to.  As the x86-64 ABI expects, the first word points to the
+ * block itself, so that it can be found with a single load through FS.
+ */
+struct thread_block {
+	thread_block *self;
+
+	// The thread's cache of free heap objects, created by the heap when the thread first allocates.
+	void *heap_cache;
+
+	// The ID the kernel knows the thread by in priority-inheriting futex words, which is learnt from the first lock the
+	// thread takes through the kernel, and is zero until then.
+	u32 futex_tid;
+
+	static thread_block *current()
+	{
+		thread_block *tb;
+		asm("mov %%fs:0, %0" : "=r"(tb));
+		return tb;
+	}
+
+	/**
+	 * @brief Records where the program's thread-local variables are laid out, before any thread block is installed.
+	 */
+	static void init_tls(const process_tls &tls);
+
+	/**
+	 * @brief How much storage a thread needs for its block and its copy of the thread-local variables.
+	 */
+	static size_t storage_size();
+
+	/**
+	 * @brief Sets up the calling thread's block, and its thread-local variables, in the given storage (which must be
+	 * storage_size() bytes, and last as long as the thread does), and points FS at it.
+	 */
+	static thread_block *install(void *storage);
+};
+
 struct thread_context {
 	thread_entry_fn ep_;
 	void *arg_;
@@ -22,8 +63,30 @@ public:
 
 	static thread *start(thread_entry_fn ep, void *arg = nullptr);
 
+	/**
+	 * @brief Starts count threads at the same entry point, with one argument each, entering the kernel only once.
+	 * The new threads are stored in threads, and the number that were started is returned.
+	 */
+	static u64 start_many(thread_entry_fn ep, void **args, thread **threads, u64 count);
+
 	void *join();
 
+	/**
+	 * @brief Restricts the thread to the cores whose bits are set in core_mask.  A mask of zero lets it run anywhere.
+	 */
+	bool set_affinity(u64 core_mask);
+
+	/**
+	 * @brief Changes the thread's scheduling class, and its nice value (fair) or real-time priority (fifo).
+	 */
+	bool set_priority(sched_policy policy, int priority);
+
+	/**
+	 * @brief Reserves runtime_us of CPU time out of every period_us, when the kernel is using the EDF scheduler.  Fails
+	 * if the thread's core is already too heavily reserved.  A runtime of zero removes the reservation.
+	 */
+	bool set_reservation(u64 runtime_us, u64 period_us);
+
 private:
 	thread(u64 handle, thread_context *tc)
 		: handle_(handle)
@@ -34,4 +97,134 @@ private:
 	u64 handle_;
 	thread_context *tc_;
 };
+
+/**
+ * @brief A mutual exclusion lock.  The state word is 0 when unlocked, 1 when locked, and 2 when locked with
+ * (possibly) other threads waiting.  Locking and unlocking without contention never enters the kernel.
+ */
+class mutex {
+public:
+	mutex()
+		: state_(0)
+	{
+	}
+
+	void lock()
+	{
+		u32 expected = 0;
+		if (!__atomic_compare_exchange_n(&state_, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			lock_slow();
+		}
+	}
+
+	bool try_lock()
+	{
+		u32 expected = 0;
+		return __atomic_compare_exchange_n(&state_, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+	}
+
+	void unlock()
+	{
+		if (__atomic_exchange_n(&state_, 0, __ATOMIC_RELEASE) == 2) {
+			unlock_slow();
+		}
+	}
+
+private:
+	u32 state_;
+
+	void lock_slow();
+	void unlock_slow();
+};
+
+/**
+ * @brief A mutual exclusion lock whose holder inherits the priority of the highest priority thread waiting for it, so
+ * that a real-time thread isn't held up for long by a lower priority one that holds the lock.  The state word holds
+ * the holder's futex thread ID, and the kernel keeps track of the waiters.  Locking and unlocking without contention
+ * never enters the kernel, once the thread has learnt its ID.
+ */
+class pi_mutex {
+public:
+	pi_mutex()
+		: state_(0)
+	{
+	}
+
+	void lock()
+	{
+		u32 tid = thread_block::current()->futex_tid;
+		u32 expected = 0;
+
+		if (!tid || !__atomic_compare_exchange_n(&state_, &expected, tid, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			lock_slow();
+		}
+	}
+
+	void unlock()
+	{
+		u32 expected = thread_block::current()->futex_tid;
+		if (!__atomic_compare_exchange_n(&state_, &expected, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			unlock_slow();
+		}
+	}
+
+private:
+	u32 state_;
+
+	void lock_slow();
+	void unlock_slow();
+};
+
+/**
+ * @brief A condition variable, for use with a mutex.  Waiters sleep on a sequence number that is bumped on
+ * every notification, so a notification between unlocking the mutex and sleeping is never lost.
+ */
+class condvar {
+public:
+	condvar()
+		: seq_(0)
+		, waiters_(0)
+	{
+	}
+
+	void wait(mutex &mtx);
+	void notify_one();
+	void notify_all();
+
+private:
+	u32 seq_;
+	u32 waiters_;
+};
+
+/**
+ * @brief A counting semaphore.  The kernel is only entered to sleep when the count is zero, or to wake
+ * a thread when there are sleepers.
+ */
+class semaphore {
+public:
+	semaphore(u32 initial = 0)
+		: count_(initial)
+		, waiters_(0)
+	{
+	}
+
+	bool try_acquire()
+	{
+		u32 c = __atomic_load_n(&count_, __ATOMIC_RELAXED);
+		while (c > 0) {
+			if (__atomic_compare_exchange_n(&count_, &c, c - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void acquire();
+	void release();
+
+private:
+	u32 count_;
+	u32 waiters_;
+};
 } // namespace stacsos
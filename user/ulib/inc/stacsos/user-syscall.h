@@ -8,7 +8,12 @@
 #pragma once
 
 #include <stacsos/syscalls.h>
-#include <stacsos/dirent.h>
+#include <stacsos/cpu-stats.h>
+#include <stacsos/io-ring.h>
+#include <stacsos/iovec.h>
+#include <stacsos/process-start.h>
+#include <stacsos/resource-limits.h>
+#include <stacsos/wait.h>
 
 namespace stacsos {
 struct rw_result {
@@ -33,9 +38,9 @@ public:
 	static syscall_result_code set_fs(u64 value) { return syscall1(syscall_numbers::set_fs, value).code; }
 	static syscall_result_code set_gs(u64 value) { return syscall1(syscall_numbers::set_gs, value).code; }
 
-	static fa_result open(const char *path)
+	static fa_result open(const char *path, open_flags flags = open_flags::none)
 	{
-		auto r = syscall1(syscall_numbers::open, (u64)path);
+		auto r = syscall2(syscall_numbers::open, (u64)path, (u64)flags);
 		return fa_result { r.code, r.data };
 	}
 
@@ -65,33 +70,239 @@ public:
 		return rw_result { r.code, r.data };
 	}
 
+	/**
+	 * The vectored versions of read and write transfer each buffer in the list in turn, as if they were one.
+	 */
+	static rw_result readv(u64 object, const iovec *iov, u64 count)
+	{
+		auto r = syscall3(syscall_numbers::readv, object, (u64)iov, count);
+		return rw_result { r.code, r.data };
+	}
+
+	static rw_result preadv(u64 object, const iovec *iov, u64 count, size_t offset)
+	{
+		auto r = syscall4(syscall_numbers::preadv, object, (u64)iov, count, offset);
+		return rw_result { r.code, r.data };
+	}
+
+	static rw_result writev(u64 object, const iovec *iov, u64 count)
+	{
+		auto r = syscall3(syscall_numbers::writev, object, (u64)iov, count);
+		return rw_result { r.code, r.data };
+	}
+
+	static rw_result pwritev(u64 object, const iovec *iov, u64 count, size_t offset)
+	{
+		auto r = syscall4(syscall_numbers::pwritev, object, (u64)iov, count, offset);
+		return rw_result { r.code, r.data };
+	}
+
+	/**
+	 * Makes everything written to a file so far durable.
+	 */
+	static syscall_result_code fsync(u64 object) { return syscall1(syscall_numbers::fsync, object).code; }
+
+	static syscall_result_code truncate(u64 object, u64 size) { return syscall2(syscall_numbers::truncate, object, size).code; }
+
+	static syscall_result get_size(u64 object) { return syscall1(syscall_numbers::get_size, object); }
+
 	static rw_result ioctl(u64 object, u64 cmd, void *buffer, u64 length)
 	{
 		auto r = syscall4(syscall_numbers::ioctl, object, cmd, (u64)buffer, length);
 		return rw_result { r.code, r.data };
 	}
 
-	static alloc_result alloc_mem(u64 size)
+	static alloc_result alloc_mem(u64 size, alloc_mem_flags flags = alloc_mem_flags::none)
 	{
-		auto r = syscall1(syscall_numbers::alloc_mem, size);
+		auto r = syscall2(syscall_numbers::alloc_mem, size, (u64)flags);
 		return alloc_result { r.code, (void *)r.data };
 	}
 
-	static rw_result read_dir(const char *path, struct dirent *buffer, unsigned long max_entries)
+	/**
+	 * Gives memory from alloc_mem back to the kernel, which frees its pages.  The range must cover the whole of the
+	 * allocation (rounded up to 2 MiB, if it was huge), as allocations that are only partly inside it are left alone.
+	 */
+	static syscall_result_code free_mem(void *address, u64 length) { return munmap(address, length); }
+
+	static alloc_result mmap(u64 object, u64 offset, u64 length, mmap_flags flags)
 	{
-    	auto r = syscall3(syscall_numbers::readdir, (u64)path, (u64)buffer, max_entries);
-    	return rw_result { r.code, r.data };
+		auto r = syscall4(syscall_numbers::mmap, object, offset, length, (u64)flags);
+		return alloc_result { r.code, (void *)r.data };
+	}
+
+	static syscall_result_code munmap(void *address, u64 length) { return syscall2(syscall_numbers::munmap, (u64)address, length).code; }
+
+	/**
+	 * Writes the touched pages of any shared file mappings in the range back to their files, returning the number of
+	 * bytes written.
+	 */
+	static u64 msync(void *address, u64 length) { return syscall2(syscall_numbers::msync, (u64)address, length).data; }
+
+	/**
+	 * Tells the kernel how a range of an open file is going to be used.  The advice is only a hint, so a file that
+	 * has nothing to do about it still accepts it.
+	 */
+	static syscall_result_code advise(u64 object, u64 offset, u64 length, access_advice advice)
+	{
+		return syscall4(syscall_numbers::advise, object, offset, length, (u64)advice).code;
+	}
+
+	/**
+	 * Tells the kernel how a range of memory is going to be used.  Advice that changes how pages are brought in
+	 * applies to the whole of each allocation or mapping that the range touches.
+	 */
+	static syscall_result_code advise_memory(void *address, u64 length, access_advice advice)
+	{
+		return syscall3(syscall_numbers::advise_memory, (u64)address, length, (u64)advice).code;
+	}
+
+	/**
+	 * Fills the buffer with as many of an open directory's entries as fit, carrying on from where the last call left
+	 * off, and returns the number of bytes used, which is zero once every entry has been listed.
+	 */
+	static rw_result readdir(u64 object, void *buffer, u64 length)
+	{
+		auto r = syscall3(syscall_numbers::readdir, object, (u64)buffer, length);
+		return rw_result { r.code, r.data };
+	}
+
+	/**
+	 * Creates an I/O ring with params->entries entries, filling in the address it has been mapped at, and returns its
+	 * handle.
+	 */
+	static fa_result io_ring_setup(io_ring_params *params)
+	{
+		auto r = syscall1(syscall_numbers::io_ring_setup, (u64)params);
+		return fa_result { r.code, r.data };
+	}
+
+	/**
+	 * Carries out an I/O ring's queued submissions (or wakes its polling thread), then waits for at least min_complete
+	 * completions, and returns the number of submissions carried out.
+	 */
+	static rw_result io_ring_enter(u64 ring, u64 min_complete)
+	{
+		auto r = syscall2(syscall_numbers::io_ring_enter, ring, min_complete);
+		return rw_result { r.code, r.data };
 	}
 
-	static syscall_result start_process(const char *path, const char *args) { return syscall2(syscall_numbers::start_process, (u64)path, (u64)args); }
+	/**
+	 * Waits until at least one of the objects is ready, or the timeout passes, marking the ones that are, and returns
+	 * how many there are.  The code is timed_out if none are.
+	 */
+	static rw_result wait_many(wait_entry *entries, u64 count, u64 timeout_ms = WAIT_FOREVER)
+	{
+		auto r = syscall3(syscall_numbers::wait_many, (u64)entries, count, timeout_ms);
+		return rw_result { r.code, r.data };
+	}
+
+	/**
+	 * Starts a program.  The streams, if given, are handles that the new process gets its own copies of, to read its
+	 * input from and write its output to.
+	 */
+	static syscall_result start_process(const char *path, const char *args, const process_streams *streams = nullptr)
+	{
+		return syscall3(syscall_numbers::start_process, (u64)path, (u64)args, (u64)streams);
+	}
+
+	/**
+	 * Starts a program with the given streams and inherited handles.  Returns the new process's handle, or nothing if
+	 * the call waited for it to finish.
+	 */
+	static syscall_result spawn(const char *path, const char *args, const spawn_params *params)
+	{
+		return syscall3(syscall_numbers::spawn, (u64)path, (u64)args, (u64)params);
+	}
+
+	/**
+	 * Forks this process, starting the copy's only thread at the entry point, and returns the copy's process object.
+	 */
+	static syscall_result clone_process(void *entrypoint, void *arg) { return syscall2(syscall_numbers::clone_process, (u64)entrypoint, (u64)arg); }
+
+	/**
+	 * Called by a template process once it has set itself up, with the entry point its copies start at.  Doesn't
+	 * return, unless the process isn't a template.
+	 */
+	static syscall_result_code zygote_ready(void *entrypoint) { return syscall1(syscall_numbers::zygote_ready, (u64)entrypoint).code; }
+
+	/**
+	 * Lowers a limit of this process, or of its group, and returns how much of the resource is in use.  A limit of
+	 * RESOURCE_UNLIMITED leaves the limit alone, and only returns the usage.
+	 */
+	static syscall_result set_resource_limit(resource_type type, resource_scope scope, u64 limit)
+	{
+		return syscall3(syscall_numbers::set_resource_limit, (u64)type, (u64)scope, limit);
+	}
+
+	static syscall_result_code set_gang_scheduling(bool enabled) { return syscall1(syscall_numbers::set_gang_scheduling, enabled).code; }
+
+	static fa_result shm_create(u64 size)
+	{
+		auto r = syscall1(syscall_numbers::shm_create, size);
+		return fa_result { r.code, r.data };
+	}
+
+	static rw_result copy_object(u64 src, u64 dst, u64 offset, u64 length)
+	{
+		auto r = syscall4(syscall_numbers::copy_object, src, dst, offset, length);
+		return rw_result { r.code, r.data };
+	}
+
+	/**
+	 * Creates a pipe, filling in the handles of its read end and its write end, in that order.
+	 */
+	static syscall_result_code create_pipe(u64 handles[2]) { return syscall1(syscall_numbers::create_pipe, (u64)handles).code; }
 	static syscall_result wait_process(u64 id) { return syscall1(syscall_numbers::wait_for_process, id); }
 
 	static syscall_result start_thread(void *entrypoint, void *arg) { return syscall2(syscall_numbers::start_thread, (u64)entrypoint, (u64)arg); }
+	static syscall_result start_threads(u64 count, void *entrypoint, void **args, u64 *ids)
+	{
+		return syscall4(syscall_numbers::start_threads, count, (u64)entrypoint, (u64)args, (u64)ids);
+	}
 	static syscall_result join_thread(u64 id) { return syscall1(syscall_numbers::join_thread, id); }
+	static syscall_result_code set_affinity(u64 id, u64 core_mask) { return syscall2(syscall_numbers::set_affinity, id, core_mask).code; }
+
+	static syscall_result_code set_priority(u64 id, sched_policy policy, int priority)
+	{
+		return syscall3(syscall_numbers::set_priority, id, (u64)policy, (u64)(s64)priority).code;
+	}
+
+	static syscall_result_code set_reservation(u64 id, u64 runtime_us, u64 period_us)
+	{
+		return syscall3(syscall_numbers::set_reservation, id, runtime_us, period_us).code;
+	}
 	static syscall_result stop_current_thread() { return syscall0(syscall_numbers::stop_current_thread); }
 
 	static syscall_result sleep(u64 ms) { return syscall1(syscall_numbers::sleep, ms); }
 
+	/**
+	 * Sleeps until the TSC reaches the deadline, which is absolute, so a periodic loop that adds its period to the last
+	 * deadline doesn't drift.
+	 */
+	static syscall_result sleep_until(u64 tsc_deadline) { return syscall1(syscall_numbers::sleep_until, tsc_deadline); }
+
+	/**
+	 * Creates a timer that expires at the TSC deadline, and then every period TSC ticks after it, if period is not zero.
+	 * Reading the timer waits for it to expire, and gives the number of expirations since the last read, as a u64.
+	 */
+	static syscall_result create_timer(u64 tsc_deadline, u64 period) { return syscall2(syscall_numbers::create_timer, tsc_deadline, period); }
+	static syscall_result yield() { return syscall0(syscall_numbers::yield); }
+
+	/**
+	 * Fills in up to max_entries thread statistics, and returns the total number of threads (which may be larger).
+	 */
+	static u64 get_cpu_stats(thread_cpu_stats *buffer, u64 max_entries) { return syscall2(syscall_numbers::get_cpu_stats, (u64)buffer, max_entries).data; }
+
+	static syscall_result_code futex_wait(u32 *addr, u32 expected, u64 timeout_ms = 0)
+	{
+		return syscall3(syscall_numbers::futex_wait, (u64)addr, expected, timeout_ms).code;
+	}
+
+	static syscall_result futex_wake(u32 *addr, u32 count) { return syscall2(syscall_numbers::futex_wake, (u64)addr, count); }
+
+	static syscall_result futex_lock_pi(u32 *addr) { return syscall1(syscall_numbers::futex_lock_pi, (u64)addr); }
+	static syscall_result_code futex_unlock_pi(u32 *addr) { return syscall1(syscall_numbers::futex_unlock_pi, (u64)addr).code; }
+
 	static void poweroff() { syscall0(syscall_numbers::poweroff); }
 
 private:
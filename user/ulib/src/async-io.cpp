@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/async-io.h>
+#include <stacsos/objects.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+io_ring *io_ring::create(u32 entries, io_ring_flags flags)
+{
+	io_ring_params params { entries, 0, flags, 0 };
+
+	auto result = syscalls::io_ring_setup(&params);
+	if (result.code != syscall_result_code::ok) {
+		return nullptr;
+	}
+
+	return new io_ring(result.id, (io_ring_header *)params.ring_address, flags);
+}
+
+io_ring::~io_ring()
+{
+	// Closing the ring waits for a polling thread to finish, so the memory is only unmapped once nothing uses it.
+	syscalls::close(handle_);
+	syscalls::munmap(ring_, io_ring_size(mask_ + 1));
+}
+
+bool io_ring::queue(io_ring_op op, object *o, void *buffer, u64 length, u64 offset, u64 user_data)
+{
+	u32 tail = ring_->sq_tail;
+	if (tail - __atomic_load_n(&ring_->sq_head, __ATOMIC_ACQUIRE) > mask_) {
+		return false;
+	}
+
+	io_ring_sqe &sqe = sqes_[tail & mask_];
+	sqe.op = op;
+	sqe.reserved = 0;
+	sqe.object = o ? o->handle() : 0;
+	sqe.buffer = (u64)buffer;
+	sqe.length = length;
+	sqe.offset = offset;
+	sqe.user_data = user_data;
+
+	// This store has to be ordered before submit looks at the polling thread's flag, or the thread could go to sleep
+	// without seeing the entry.
+	__atomic_store_n(&ring_->sq_tail, tail + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+void io_ring::submit(u64 min_complete)
+{
+	if ((flags_ & io_ring_flags::polled) == io_ring_flags::polled && !min_complete
+		&& !(__atomic_load_n(&ring_->sq_flags, __ATOMIC_SEQ_CST) & IO_RING_SQ_NEED_WAKEUP)) {
+		return;
+	}
+
+	syscalls::io_ring_enter(handle_, min_complete);
+}
+
+bool io_ring::next_completion(io_ring_cqe &cqe)
+{
+	u32 head = ring_->cq_head;
+	if (head == __atomic_load_n(&ring_->cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	cqe = cqes_[head & mask_];
+	__atomic_store_n(&ring_->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/bench.h>
+#include <stacsos/clock.h>
+#include <stacsos/console.h>
+#include <stacsos/printf.h>
+
+using namespace stacsos;
+
+u64 stacsos::bench_calibrate()
+{
+	u64 tsc_hz = clock_tsc_frequency();
+	bench_result("calibrate", "tsc_hz=%llu", tsc_hz);
+
+	return tsc_hz;
+}
+
+void stacsos::bench_result(const char *name, const char *fmt, ...)
+{
+	// As for console::writef, each thread formats into its own buffer, and the line is written in one go, so that the
+	// results of threads finishing together don't get mixed up.
+	static thread_local char buffer[1024];
+
+	// The formatting stops short of the last byte but one, leaving room for the newline.
+	int n = snprintf(buffer, sizeof(buffer) - 1, "%s ", name);
+
+	va_list args;
+	va_start(args, fmt);
+	n += vsnprintf(buffer + n, (int)sizeof(buffer) - 1 - n, fmt, args);
+	va_end(args);
+
+	buffer[n++] = '\n';
+	buffer[n] = 0;
+
+	console::get().write(buffer);
+}
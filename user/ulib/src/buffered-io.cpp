@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/buffered-io.h>
+#include <stacsos/memops.h>
+#include <stacsos/objects.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+buffered_reader::buffered_reader(object *source, size_t buffer_size)
+	: source_(source)
+	, data_(nullptr)
+	, start_(0)
+	, end_(0)
+	, buffer_(nullptr)
+	, buffer_size_(buffer_size ? buffer_size : default_buffer_size)
+	, mapping_(nullptr)
+	, mapping_size_(0)
+{
+	// Only files have a size, so anything else (a pipe, or a terminal) is always buffered.
+	u64 size;
+	if (source_->size(size) && size >= mmap_threshold) {
+		mapping_ = source_->mmap(0, size);
+	}
+
+	if (mapping_) {
+		mapping_size_ = size;
+		data_ = (const char *)mapping_;
+		end_ = size;
+	} else {
+		buffer_ = new char[buffer_size_];
+		data_ = buffer_;
+	}
+}
+
+buffered_reader::~buffered_reader()
+{
+	if (mapping_) {
+		syscalls::munmap(mapping_, mapping_size_);
+	}
+
+	delete[] buffer_;
+}
+
+bool buffered_reader::fill()
+{
+	// A mapped file is all there already.
+	if (mapping_) {
+		return false;
+	}
+
+	start_ = 0;
+	end_ = source_->read(buffer_, buffer_size_);
+
+	return end_ > 0;
+}
+
+size_t buffered_reader::read(void *buffer, size_t length)
+{
+	size_t done = 0;
+
+	while (done < length) {
+		if (start_ == end_) {
+			if (!mapping_ && length - done >= buffer_size_) {
+				size_t n = source_->read((char *)buffer + done, length - done);
+				return done + n;
+			}
+
+			if (!fill()) {
+				break;
+			}
+		}
+
+		size_t n = min(length - done, end_ - start_);
+		memops::memcpy((char *)buffer + done, data_ + start_, n);
+
+		start_ += n;
+		done += n;
+	}
+
+	return done;
+}
+
+size_t buffered_reader::read_line(char *buffer, size_t length)
+{
+	size_t done = 0;
+
+	while (done < length) {
+		if (start_ == end_ && !fill()) {
+			break;
+		}
+
+		// Copying up to (and including) the newline, if it is in what is buffered.
+		size_t avail = min(length - done, end_ - start_);
+		const char *src = data_ + start_;
+
+		size_t n = 0;
+		bool eol = false;
+		while (n < avail) {
+			if (src[n++] == '\n') {
+				eol = true;
+				break;
+			}
+		}
+
+		memops::memcpy(buffer + done, src, n);
+		start_ += n;
+		done += n;
+
+		if (eol) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+buffered_writer::buffered_writer(object *sink, size_t buffer_size)
+	: sink_(sink)
+	, buffer_size_(buffer_size ? buffer_size : default_buffer_size)
+	, length_(0)
+{
+	buffer_ = new char[buffer_size_];
+}
+
+buffered_writer::~buffered_writer()
+{
+	flush();
+	delete[] buffer_;
+}
+
+size_t buffered_writer::write(const void *data, size_t length)
+{
+	if (length_ + length <= buffer_size_) {
+		memops::memcpy(buffer_ + length_, data, length);
+		length_ += length;
+		return length;
+	}
+
+	// The buffer and the new data go out together, rather than filling the buffer and writing it out piecemeal.
+	iovec v[2] = { { buffer_, length_ }, { (void *)data, length } };
+	size_t buffered = length_;
+	size_t written = sink_->writev(v, 2);
+
+	length_ = 0;
+	return written > buffered ? written - buffered : 0;
+}
+
+size_t buffered_writer::write(const char *str) { return write(str, memops::strlen(str)); }
+
+bool buffered_writer::flush()
+{
+	if (!length_) {
+		return true;
+	}
+
+	size_t buffered = length_;
+	length_ = 0;
+
+	return sink_->write(buffer_, buffered) == buffered;
+}
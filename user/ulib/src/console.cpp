@@ -13,22 +13,95 @@
 
 using namespace stacsos;
 
-void console::init()
+// Each thread buffers its own output, so that lines from different threads don't get mixed up.
+static const size_t output_buffer_size = 1024;
+
+struct output_buffer {
+	char data[output_buffer_size];
+	size_t length;
+};
+
+static thread_local output_buffer pending;
+
+static bool contains_newline(const char *data, size_t length)
+{
+	for (size_t i = 0; i < length; i++) {
+		if (data[i] == '\n') {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void console::init(const process_streams &streams)
+{
+	if ((!streams.input || !streams.output) && !console_object_) {
+		console_object_ = object::open("/dev/console");
+		if (console_object_ == nullptr) {
+			stacsos::syscalls::exit((u64)-1);
+			while (1) { }
+		}
+	}
+
+	input_ = streams.input ? object::from_handle(streams.input) : console_object_;
+	output_ = streams.output ? object::from_handle(streams.output) : console_object_;
+}
+
+void console::clear()
+{
+	flush();
+	output_->ioctl(2, nullptr, 0);
+}
+
+void console::flush()
 {
-	console_object_ = object::open("/dev/console");
-	if (console_object_ == nullptr) {
-		stacsos::syscalls::exit((u64)-1);
-		while (1) { }
+	if (pending.length) {
+		output_->write(pending.data, pending.length);
+		pending.length = 0;
 	}
 }
 
-void console::clear() { console_object_->ioctl(2, nullptr, 0); }
+void console::append(const char *data, size_t length)
+{
+	if (buffering_ == console_buffering::none || length > output_buffer_size - pending.length) {
+		flush();
+
+		// Anything too big for the buffer goes straight out.
+		if (buffering_ == console_buffering::none || length >= output_buffer_size) {
+			output_->write(data, length);
+			return;
+		}
+	}
+
+	memops::memcpy(pending.data + pending.length, data, length);
+	pending.length += length;
+
+	if (pending.length == output_buffer_size || (buffering_ == console_buffering::line && contains_newline(data, length))) {
+		flush();
+	}
+}
 
-void console::write(const char *msg) { console_object_->write(msg, memops::strlen(msg)); }
+void console::write(const char *msg) { append(msg, memops::strlen(msg)); }
+
+void console::writev(const iovec *iov, size_t count)
+{
+	size_t total = iovec_length(iov, count);
+	if (buffering_ == console_buffering::none || total >= output_buffer_size) {
+		flush();
+		output_->writev(iov, count);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		append((const char *)iov[i].base, iov[i].length);
+	}
+}
 
 void console::writef(const char *msg, ...)
 {
-	static char buffer[1024];
+	// Each thread formats into its own buffer, so threads can write at the same time.
+	static thread_local char buffer[1024];
 	va_list args;
 
 	va_start(args, msg);
@@ -40,8 +113,51 @@ void console::writef(const char *msg, ...)
 
 char console::read_char()
 {
+	flush();
+
 	char ch;
-	console_object_->read(&ch, 1);
+	if (!input_->read(&ch, 1)) {
+		return 0;
+	}
 
 	return ch;
 }
+
+size_t console::read(void *buffer, size_t length)
+{
+	flush();
+	return input_->read(buffer, length);
+}
+
+size_t console::read_line(char *buffer, size_t length)
+{
+	flush();
+
+	size_t n = input_->ioctl(3, buffer, length);
+	if (n) {
+		return n;
+	}
+
+	// Anything other than a terminal is read a character at a time, up to the end of the line.
+	while (n < length) {
+		char ch;
+		if (!input_->read(&ch, 1)) {
+			break;
+		}
+
+		buffer[n++] = ch;
+		if (ch == '\n') {
+			break;
+		}
+	}
+
+	return n;
+}
+
+bool console::wait_for_input(u64 timeout_ms)
+{
+	flush();
+
+	wait_entry e { input_->handle(), 0 };
+	return syscalls::wait_many(&e, 1, timeout_ms).code == syscall_result_code::ok;
+}
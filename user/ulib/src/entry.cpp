@@ -7,26 +7,82 @@
  */
 #include <stacsos/objects.h>
 #include <stacsos/console.h>
+#include <stacsos/memops.h>
+#include <stacsos/process.h>
+#include <stacsos/threads.h>
 #include <stacsos/user-syscall.h>
 
 using namespace stacsos;
 
 extern int main(const char *cmdline);
 
-static char tls[256];
+static void select_memops()
+{
+	u32 eax, ebx, ecx, edx;
 
-static void init_tls() { stacsos::syscalls::set_fs((u64)tls); }
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+	if (eax < 7) {
+		return;
+	}
 
-extern "C" void start_main(const char *cmdline)
-{
-	init_tls();
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+	bool osxsave = ecx & (1 << 27);
 
-	console::get().init();
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+	bool erms = ebx & (1 << 9);
+	bool avx2 = ebx & (1 << 5);
 
-	int rc = main(cmdline);
+	// AVX2 can only be used if the kernel saves the AVX registers, i.e. it has turned on the SSE and AVX state in XCR0.
+	if (avx2 && osxsave) {
+		u32 xcr0_lo, xcr0_hi;
+		asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		avx2 = (xcr0_lo & 6) == 6;
+	} else {
+		avx2 = false;
+	}
+
+	native_memops::select_features((erms ? memops_features::erms : memops_features::none) | (avx2 ? memops_features::avx2 : memops_features::none));
+}
+
+static __noreturn void run_main(const process_start_info *info)
+{
+	int rc = main(info->args);
+	console::get().flush();
 
 	stacsos::syscalls::exit((u64)rc);
 	while (1) { }
 
 	__unreachable();
 }
+
+static void zygote_entry_proc(const process_start_info *info)
+{
+	// Everything else was set up by the template this process is a copy of, but the template's main thread block was
+	// on its own stack, and this process has its own start info.
+	thread_block::install(__builtin_alloca(thread_block::storage_size()));
+
+	process::init(info);
+	console::get().init(info->streams);
+
+	run_main(info);
+}
+
+extern "C" void start_main(const process_start_info *info)
+{
+	// This never returns, so its stack frame is as good a home as any for the main thread's block.
+	thread_block::init_tls(info->tls);
+	thread_block::install(__builtin_alloca(thread_block::storage_size()));
+	select_memops();
+
+	process::init(info);
+	console::get().init(info->streams);
+
+	// A template stops here, and its copies carry on from the entry point it hands over, with their own arguments.
+	if ((info->flags & process_start_flags::zygote) == process_start_flags::zygote) {
+		stacsos::syscalls::zygote_ready((void *)zygote_entry_proc);
+		stacsos::syscalls::exit((u64)-1);
+		while (1) { }
+	}
+
+	run_main(info);
+}
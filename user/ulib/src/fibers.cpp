@@ -0,0 +1,644 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/async-io.h>
+#include <stacsos/clock.h>
+#include <stacsos/fibers.h>
+#include <stacsos/objects.h>
+#include <stacsos/user-syscall.h>
+#include <stacsos/work-stealing-deque.h>
+
+using namespace stacsos;
+
+// What a fiber has asked its worker to do with it, once it has switched out.
+enum class fiber_action : u32 { none, yield, wait, io, exit };
+
+struct fiber_runtime::fiber {
+	u64 saved_rsp;
+	char *stack;
+	size_t stack_size;
+
+	void (*entry)(void *);
+	void *arg;
+
+	// The worker running the fiber, which it switches back to when it stops.
+	worker *running_on;
+
+	// The fiber's place in whichever list it is on: the run queue, the free list, or those waiting for the ring or
+	// the reactor.
+	fiber *next, *prev;
+
+	fiber_action action;
+
+	// The operation (or, for a wait, the object) that the fiber is waiting for, and then the operation's result.
+	io_ring_op op;
+	object *obj;
+	void *buffer;
+	u64 length;
+	u64 offset;
+	u64 result;
+};
+
+struct fiber_runtime::worker {
+	fiber_runtime *runtime;
+	thread *thr;
+
+	// For choosing which worker to steal from first.
+	u64 rng;
+
+	// The worker's own stack pointer, while one of its fibers is running.
+	u64 saved_rsp;
+	fiber *current;
+
+	chase_lev_deque<fiber *, 256> deque;
+};
+
+extern "C" void fiber_switch(u64 *save_rsp, u64 new_rsp);
+extern "C" void fiber_start();
+
+static thread_local fiber_runtime::worker *this_worker;
+
+// How many times an idle worker looks for a fiber before it goes to sleep.
+static const u32 spin_limit = 128;
+
+// A fiber can carry on on another thread after switching out, so the worker is looked up afresh each time, without
+// the compiler being able to reuse the address of the thread-local variable from before the switch.
+static __attribute__((noipa)) fiber_runtime::worker *current_worker() { return this_worker; }
+
+static void switch_out(fiber_runtime::fiber *f, fiber_action action)
+{
+	f->action = action;
+	fiber_switch(&f->saved_rsp, f->running_on->saved_rsp);
+}
+
+extern "C" void fiber_main(fiber_runtime::fiber *f)
+{
+	f->entry(f->arg);
+	switch_out(f, fiber_action::exit);
+}
+
+fiber_runtime::fiber_runtime(u32 nr_workers, u32 ring_entries)
+	: nr_workers_(nr_workers ? nr_workers : max(clock_nr_cores(), 1u))
+	, queue_head_(nullptr)
+	, queue_tail_(nullptr)
+	, nr_queued_(0)
+	, live_(0)
+	, work_seq_(0)
+	, sleepers_(0)
+	, free_fibers_(nullptr)
+	, ring_(io_ring::create(ring_entries, io_ring_flags::async))
+	, ring_entries_(ring_entries)
+	, in_flight_(0)
+	, ring_overflow_head_(nullptr)
+	, ring_overflow_tail_(nullptr)
+	, waiters_(nullptr)
+	, reactor_(nullptr)
+	, reactor_wake_read_(nullptr)
+	, reactor_wake_write_(nullptr)
+	, reactor_poked_(false)
+	, stopping_(false)
+{
+	workers_ = new worker *[nr_workers_];
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		worker *w = new worker;
+		w->runtime = this;
+		w->thr = nullptr;
+		w->rng = ((u64)i * 0x9e3779b97f4a7c15ull) + 1;
+		w->saved_rsp = 0;
+		w->current = nullptr;
+
+		workers_[i] = w;
+	}
+
+	// The reactor sleeps in wait_many, so it is woken (to wait for something new) by writing to a pipe it waits on.
+	object::create_pipe(reactor_wake_read_, reactor_wake_write_);
+}
+
+fiber_runtime::~fiber_runtime()
+{
+	while (free_fibers_) {
+		fiber *f = free_fibers_;
+		free_fibers_ = f->next;
+
+		delete[] f->stack;
+		delete f;
+	}
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		delete workers_[i];
+	}
+
+	delete[] workers_;
+	delete ring_;
+	delete reactor_wake_read_;
+	delete reactor_wake_write_;
+}
+
+void fiber_runtime::spawn_fn(void (*entry)(void *), void *arg, size_t stack_size)
+{
+	fiber *f = nullptr;
+
+	if (stack_size == default_stack_size) {
+		free_lock_.lock();
+
+		f = free_fibers_;
+		if (f) {
+			free_fibers_ = f->next;
+		}
+
+		free_lock_.unlock();
+	}
+
+	if (!f) {
+		f = new fiber;
+		f->stack = new char[stack_size];
+		f->stack_size = stack_size;
+	}
+
+	f->entry = entry;
+	f->arg = arg;
+	f->running_on = nullptr;
+
+	// The stack starts out as fiber_switch would have left it, so that the first switch to the fiber "returns" to
+	// fiber_start, with the fiber in r12, the default SSE and x87 control words, and the stack aligned as a call
+	// would leave it.
+	u64 top = ((u64)f->stack + f->stack_size) & ~15ull;
+	u64 *frame = (u64 *)(top - (8 * sizeof(u64)));
+
+	frame[0] = (0x037full << 32) | 0x1f80; // MXCSR, then the x87 control word
+	frame[1] = 0; // r15
+	frame[2] = 0; // r14
+	frame[3] = 0; // r13
+	frame[4] = (u64)f; // r12
+	frame[5] = 0; // rbx
+	frame[6] = 0; // rbp
+	frame[7] = (u64)fiber_start;
+
+	f->saved_rsp = (u64)frame;
+
+	__atomic_add_fetch(&live_, 1, __ATOMIC_SEQ_CST);
+
+	// A fiber spawned by another is kept by the same worker, which others can steal it from.
+	worker *w = current_worker();
+	if (w && w->runtime == this && w->deque.push(f)) {
+		notify();
+		return;
+	}
+
+	make_runnable(f);
+}
+
+void fiber_runtime::free_fiber(fiber *f)
+{
+	if (f->stack_size != default_stack_size) {
+		delete[] f->stack;
+		delete f;
+		return;
+	}
+
+	free_lock_.lock();
+	f->next = free_fibers_;
+	free_fibers_ = f;
+	free_lock_.unlock();
+}
+
+void fiber_runtime::make_runnable(fiber *f)
+{
+	f->next = nullptr;
+
+	queue_lock_.lock();
+
+	if (queue_tail_) {
+		queue_tail_->next = f;
+	} else {
+		queue_head_ = f;
+	}
+
+	queue_tail_ = f;
+	__atomic_add_fetch(&nr_queued_, 1, __ATOMIC_SEQ_CST);
+
+	queue_lock_.unlock();
+
+	notify();
+}
+
+void fiber_runtime::notify()
+{
+	__atomic_add_fetch(&work_seq_, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST)) {
+		syscalls::futex_wake(&work_seq_, 1);
+	}
+}
+
+fiber_runtime::fiber *fiber_runtime::find_fiber(worker *self)
+{
+	fiber *f;
+
+	if (self->deque.pop(f)) {
+		return f;
+	}
+
+	if (__atomic_load_n(&nr_queued_, __ATOMIC_SEQ_CST)) {
+		queue_lock_.lock();
+
+		f = queue_head_;
+		if (f) {
+			queue_head_ = f->next;
+			if (!queue_head_) {
+				queue_tail_ = nullptr;
+			}
+
+			__atomic_sub_fetch(&nr_queued_, 1, __ATOMIC_SEQ_CST);
+		}
+
+		queue_lock_.unlock();
+
+		if (f) {
+			return f;
+		}
+	}
+
+	// Victims are tried from a random starting point, so that thieves don't all converge on the same worker.
+	self->rng ^= self->rng << 13;
+	self->rng ^= self->rng >> 7;
+	self->rng ^= self->rng << 17;
+	u32 start = self->rng % nr_workers_;
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		worker *victim = workers_[(start + i) % nr_workers_];
+		if (victim != self && victim->deque.steal(f)) {
+			return f;
+		}
+	}
+
+	return nullptr;
+}
+
+bool fiber_runtime::has_work() const
+{
+	if (__atomic_load_n(&nr_queued_, __ATOMIC_SEQ_CST)) {
+		return true;
+	}
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		if (!workers_[i]->deque.empty()) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void fiber_runtime::run_fiber(worker *self, fiber *f)
+{
+	self->current = f;
+	f->running_on = self;
+	f->action = fiber_action::none;
+
+	fiber_switch(&self->saved_rsp, f->saved_rsp);
+
+	self->current = nullptr;
+
+	// Only now that the fiber's registers have been saved can another thread pick it up (or its stack be reused).
+	switch (f->action) {
+	case fiber_action::yield:
+		make_runnable(f);
+		break;
+
+	case fiber_action::wait:
+		add_waiter(f);
+		break;
+
+	case fiber_action::io:
+		submit_io(f);
+		break;
+
+	case fiber_action::exit:
+		free_fiber(f);
+
+		// Once the last fiber has finished, every worker is woken to see that there is nothing left to do.
+		if (__atomic_sub_fetch(&live_, 1, __ATOMIC_SEQ_CST) == 0) {
+			__atomic_add_fetch(&work_seq_, 1, __ATOMIC_SEQ_CST);
+			syscalls::futex_wake(&work_seq_, 0xffffffff);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+void fiber_runtime::worker_loop(worker *self)
+{
+	u32 spins = 0;
+
+	while (true) {
+		fiber *f = find_fiber(self);
+		if (f) {
+			run_fiber(self, f);
+			spins = 0;
+			continue;
+		}
+
+		if (!__atomic_load_n(&live_, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+
+		if (++spins < spin_limit) {
+			__relax();
+			continue;
+		}
+
+		// As in thread_pool, the sequence number is read before looking for a fiber one last time, so that one made
+		// runnable after the look stops the futex from sleeping.
+		u32 seq = __atomic_load_n(&work_seq_, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&sleepers_, 1, __ATOMIC_SEQ_CST);
+
+		if (!has_work() && __atomic_load_n(&live_, __ATOMIC_SEQ_CST)) {
+			syscalls::futex_wait(&work_seq_, seq);
+		}
+
+		__atomic_sub_fetch(&sleepers_, 1, __ATOMIC_SEQ_CST);
+		spins = 0;
+	}
+}
+
+void *fiber_runtime::worker_main(void *arg)
+{
+	worker *self = (worker *)arg;
+
+	this_worker = self;
+	self->runtime->worker_loop(self);
+	this_worker = nullptr;
+
+	return nullptr;
+}
+
+void fiber_runtime::run()
+{
+	if (!__atomic_load_n(&live_, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	__atomic_store_n(&stopping_, false, __ATOMIC_SEQ_CST);
+	reactor_ = thread::start(reactor_main, this);
+
+	for (u32 i = 1; i < nr_workers_; i++) {
+		workers_[i]->thr = thread::start(worker_main, workers_[i]);
+	}
+
+	// The calling thread is the first worker.
+	this_worker = workers_[0];
+	worker_loop(workers_[0]);
+	this_worker = nullptr;
+
+	for (u32 i = 1; i < nr_workers_; i++) {
+		workers_[i]->thr->join();
+		delete workers_[i]->thr;
+		workers_[i]->thr = nullptr;
+	}
+
+	__atomic_store_n(&stopping_, true, __ATOMIC_SEQ_CST);
+	poke_reactor();
+
+	reactor_->join();
+	delete reactor_;
+	reactor_ = nullptr;
+}
+
+void fiber_runtime::submit_io(fiber *f)
+{
+	f->next = nullptr;
+
+	ring_lock_.lock();
+
+	// Operations wait in order behind any that are already waiting for room.
+	if (in_flight_ < ring_entries_ && !ring_overflow_head_ && ring_->queue(f->op, f->obj, f->buffer, f->length, f->offset, (u64)f)) {
+		in_flight_++;
+		ring_->submit();
+	} else if (ring_overflow_tail_) {
+		ring_overflow_tail_->next = f;
+		ring_overflow_tail_ = f;
+	} else {
+		ring_overflow_head_ = ring_overflow_tail_ = f;
+	}
+
+	ring_lock_.unlock();
+}
+
+void fiber_runtime::reap_completions()
+{
+	fiber *done = nullptr;
+
+	ring_lock_.lock();
+
+	io_ring_cqe cqe;
+	while (ring_->next_completion(cqe)) {
+		fiber *f = (fiber *)cqe.user_data;
+		f->result = cqe.code == syscall_result_code::ok ? cqe.result : 0;
+
+		f->next = done;
+		done = f;
+		in_flight_--;
+	}
+
+	// The completions have made room for operations that didn't fit before.
+	bool queued = false;
+	while (ring_overflow_head_ && in_flight_ < ring_entries_) {
+		fiber *f = ring_overflow_head_;
+		if (!ring_->queue(f->op, f->obj, f->buffer, f->length, f->offset, (u64)f)) {
+			break;
+		}
+
+		ring_overflow_head_ = f->next;
+		if (!ring_overflow_head_) {
+			ring_overflow_tail_ = nullptr;
+		}
+
+		in_flight_++;
+		queued = true;
+	}
+
+	if (queued) {
+		ring_->submit();
+	}
+
+	ring_lock_.unlock();
+
+	while (done) {
+		fiber *f = done;
+		done = f->next;
+		make_runnable(f);
+	}
+}
+
+void fiber_runtime::add_waiter(fiber *f)
+{
+	waiters_lock_.lock();
+
+	f->prev = nullptr;
+	f->next = waiters_;
+	if (waiters_) {
+		waiters_->prev = f;
+	}
+
+	waiters_ = f;
+
+	waiters_lock_.unlock();
+
+	poke_reactor();
+}
+
+void fiber_runtime::poke_reactor()
+{
+	// Only the first poke since the reactor last woke up needs to write to the pipe.
+	if (!__atomic_exchange_n(&reactor_poked_, true, __ATOMIC_SEQ_CST)) {
+		char ch = 0;
+		reactor_wake_write_->write(&ch, 1);
+	}
+}
+
+void *fiber_runtime::reactor_main(void *arg)
+{
+	fiber_runtime *rt = (fiber_runtime *)arg;
+
+	wait_entry *entries = new wait_entry[WAIT_MANY_MAX];
+	fiber **waiting = new fiber *[WAIT_MANY_MAX];
+
+	while (!__atomic_load_n(&rt->stopping_, __ATOMIC_SEQ_CST)) {
+		// The first two entries are the pipe that wakes the reactor up, and the ring.  The waiters follow, as many as
+		// fit, and any more are waited for once some of those have been woken.
+		u64 n = 0;
+		entries[n++] = wait_entry { rt->reactor_wake_read_->handle(), 0 };
+		entries[n++] = wait_entry { rt->ring_->handle(), 0 };
+
+		rt->waiters_lock_.lock();
+
+		for (fiber *f = rt->waiters_; f && n < WAIT_MANY_MAX; f = f->next) {
+			waiting[n] = f;
+			entries[n++] = wait_entry { f->obj->handle(), 0 };
+		}
+
+		rt->waiters_lock_.unlock();
+
+		auto r = syscalls::wait_many(entries, n, WAIT_FOREVER);
+
+		// A waiter whose object has gone away will never be ready, so it is woken, rather than waited for forever.
+		if (r.code == syscall_result_code::not_found && r.length >= 2 && r.length < n) {
+			entries[r.length].ready = 1;
+		}
+
+		if (entries[0].ready) {
+			__atomic_store_n(&rt->reactor_poked_, false, __ATOMIC_SEQ_CST);
+
+			char buffer[64];
+			rt->reactor_wake_read_->read(buffer, sizeof(buffer));
+		}
+
+		if (entries[1].ready) {
+			rt->reap_completions();
+		}
+
+		for (u64 i = 2; i < n; i++) {
+			if (!entries[i].ready) {
+				continue;
+			}
+
+			fiber *f = waiting[i];
+
+			rt->waiters_lock_.lock();
+
+			if (f->prev) {
+				f->prev->next = f->next;
+			} else {
+				rt->waiters_ = f->next;
+			}
+
+			if (f->next) {
+				f->next->prev = f->prev;
+			}
+
+			rt->waiters_lock_.unlock();
+
+			rt->make_runnable(f);
+		}
+	}
+
+	delete[] waiting;
+	delete[] entries;
+
+	return nullptr;
+}
+
+void fiber_runtime::yield()
+{
+	worker *w = current_worker();
+	if (!w || !w->current) {
+		syscalls::yield();
+		return;
+	}
+
+	switch_out(w->current, fiber_action::yield);
+}
+
+void fiber_runtime::wait(object *o)
+{
+	worker *w = current_worker();
+
+	// Off a fiber, the calling thread simply waits itself.
+	if (!w || !w->current) {
+		wait_entry e { o->handle(), 0 };
+		syscalls::wait_many(&e, 1, WAIT_FOREVER);
+		return;
+	}
+
+	fiber *f = w->current;
+	f->obj = o;
+
+	switch_out(f, fiber_action::wait);
+}
+
+size_t fiber_runtime::do_io(io_ring_op op, object *o, void *buffer, size_t length, size_t offset)
+{
+	worker *w = current_worker();
+
+	if (!w || !w->current) {
+		switch (op) {
+		case io_ring_op::read:
+			return o->read(buffer, length);
+		case io_ring_op::pread:
+			return o->pread(buffer, length, offset);
+		case io_ring_op::write:
+			return o->write(buffer, length);
+		default:
+			return o->pwrite(buffer, length, offset);
+		}
+	}
+
+	fiber *f = w->current;
+	f->op = op;
+	f->obj = o;
+	f->buffer = buffer;
+	f->length = length;
+	f->offset = offset;
+
+	switch_out(f, fiber_action::io);
+
+	// The fiber may have been woken on another worker, but the result is its own.
+	return f->result;
+}
+
+size_t fiber_runtime::read(object *o, void *buffer, size_t length) { return do_io(io_ring_op::read, o, buffer, length, 0); }
+size_t fiber_runtime::pread(object *o, void *buffer, size_t length, size_t offset) { return do_io(io_ring_op::pread, o, buffer, length, offset); }
+size_t fiber_runtime::write(object *o, const void *buffer, size_t length) { return do_io(io_ring_op::write, o, (void *)buffer, length, 0); }
+
+size_t fiber_runtime::pwrite(object *o, const void *buffer, size_t length, size_t offset)
+{
+	return do_io(io_ring_op::pwrite, o, (void *)buffer, length, offset);
+}
@@ -5,6 +5,9 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/heap.h>
+#include <stacsos/memops.h>
+#include <stacsos/threads.h>
 #include <stacsos/user-syscall.h>
 
 extern "C" {
@@ -12,90 +15,529 @@ void *__dso_handle = &__dso_handle;
 int __cxa_atexit(void (*destructor)(void *), void *arg, void *dso) { return 0; }
 }
 
-struct memory_block;
-static memory_block *free_list;
-struct memory_block {
-	memory_block *next, *prev;
-	size_t size;
+using namespace stacsos;
 
-	void remove()
-	{
-		memory_block **slot = &free_list;
-		while (*slot) {
-			if (*slot == this) {
-				*slot = this->next;
-				return;
-			}
+// Nothing here may rely on a constructor having run, as the library doesn't run any: everything starts out zeroed, or
+// is initialised as a constant.
+
+static heap::stats counters;
+
+static void count(u64 &counter, u64 amount = 1) { __atomic_add_fetch(&counter, amount, __ATOMIC_RELAXED); }
+
+static void *kernel_alloc(u64 size)
+{
+	auto r = syscalls::alloc_mem(size);
+	if (r.code != syscall_result_code::ok) {
+		return nullptr;
+	}
+
+	count(counters.kernel_allocations);
+	count(counters.kernel_bytes, size);
+
+	return r.ptr;
+}
+
+/*
+ * Large allocations: blocks carved from chunks of memory taken from the kernel, each with a header giving its size,
+ * and the size of the block before it, so that a freed block can be merged with free neighbours on both sides.  Free
+ * blocks are kept in bins by the power of two below their size.
+ */
+
+struct large_block {
+	u64 size; // Including the header.  The low bits are flags.
+	u64 prev_size; // Zero for the first block in a chunk.
+
+	// Only valid when the block is free.
+	large_block *next_free, *prev_free;
+};
+
+static const u64 large_header_size = 16;
+static const u64 min_large_block = sizeof(large_block);
+static const u64 block_in_use = 1;
+static const u64 block_direct = 2;
+static const u64 block_flags = 0xf;
+
+static const u64 large_chunk_size = MB(1);
+static const u64 direct_threshold = KB(256);
+static const int nr_large_bins = 64;
+
+static mutex large_lock;
+static large_block *large_bins[nr_large_bins];
+
+static u64 block_size(const large_block *b) { return b->size & ~block_flags; }
+static large_block *next_block(large_block *b) { return (large_block *)((u64)b + block_size(b)); }
+static int large_bin_for(u64 size) { return 63 - __builtin_clzll(size); }
+
+static void insert_free(large_block *b)
+{
+	int bin = large_bin_for(block_size(b));
+
+	b->prev_free = nullptr;
+	b->next_free = large_bins[bin];
+	if (b->next_free) {
+		b->next_free->prev_free = b;
+	}
+
+	large_bins[bin] = b;
+}
+
+static void remove_free(large_block *b)
+{
+	if (b->prev_free) {
+		b->prev_free->next_free = b->next_free;
+	} else {
+		large_bins[large_bin_for(block_size(b))] = b->next_free;
+	}
+
+	if (b->next_free) {
+		b->next_free->prev_free = b->prev_free;
+	}
+}
+
+static large_block *find_free(u64 size)
+{
+	// Every block in a higher bin is big enough, but only some of the ones in this bin are.
+	int bin = large_bin_for(size);
+	for (large_block *b = large_bins[bin]; b; b = b->next_free) {
+		if (block_size(b) >= size) {
+			return b;
 		}
 	}
 
-	void insert()
-	{
-		memory_block **slot = &free_list;
-		while (*slot) {
-			slot = &(*slot)->next;
+	for (bin++; bin < nr_large_bins; bin++) {
+		if (large_bins[bin]) {
+			return large_bins[bin];
 		}
+	}
 
-		*slot = this;
+	return nullptr;
+}
+
+static large_block *grow_large(u64 size)
+{
+	// Chunks are taken from the kernel in large pieces, so that most allocations don't need a system call.  The end
+	// of the chunk is marked with a header that is always in use, so that nothing tries to merge past it.
+	u64 chunk_size = max(large_chunk_size, PAGE_ALIGN_UP(size + large_header_size));
+
+	auto *b = (large_block *)kernel_alloc(chunk_size);
+	if (!b) {
+		return nullptr;
 	}
 
-	memory_block *split(size_t size)
+	b->size = chunk_size - large_header_size;
+	b->prev_size = 0;
+
+	large_block *end = next_block(b);
+	end->size = block_in_use;
+	end->prev_size = block_size(b);
+
+	return b;
+}
+
+static void *large_alloc(u64 size)
+{
+	u64 needed = max(min_large_block, (size + large_header_size + 15) & ~15ull);
+
+	// The biggest allocations get a region of their own, which goes straight back to the kernel when it is freed.
+	if (needed >= direct_threshold) {
+		u64 mapped = PAGE_ALIGN_UP(needed);
+
+		auto *b = (large_block *)kernel_alloc(mapped);
+		if (!b) {
+			return nullptr;
+		}
+
+		b->size = mapped | block_in_use | block_direct;
+		b->prev_size = 0;
+
+		count(counters.direct_allocations);
+		return (void *)((u64)b + large_header_size);
+	}
+
+	large_lock.lock();
+
+	large_block *b = find_free(needed);
+	if (b) {
+		remove_free(b);
+	} else {
+		b = grow_large(needed);
+		if (!b) {
+			large_lock.unlock();
+			return nullptr;
+		}
+	}
+
+	// Give back whatever isn't needed, if it is big enough to be a block of its own.
+	u64 size_of_b = block_size(b);
+	if (size_of_b - needed >= min_large_block) {
+		b->size = needed;
+
+		large_block *rest = next_block(b);
+		rest->size = size_of_b - needed;
+		rest->prev_size = needed;
+		next_block(rest)->prev_size = block_size(rest);
+
+		insert_free(rest);
+	}
+
+	b->size |= block_in_use;
+	large_lock.unlock();
+
+	count(counters.large_allocations);
+	return (void *)((u64)b + large_header_size);
+}
+
+static void large_free(void *ptr)
+{
+	auto *b = (large_block *)((u64)ptr - large_header_size);
+
+	if (b->size & block_direct) {
+		syscalls::free_mem(b, block_size(b));
+		return;
+	}
+
+	large_lock.lock();
+
+	b->size &= ~block_in_use;
+
+	large_block *next = next_block(b);
+	if (!(next->size & block_in_use)) {
+		remove_free(next);
+		b->size += block_size(next);
+	}
+
+	if (b->prev_size) {
+		large_block *prev = (large_block *)((u64)b - b->prev_size);
+
+		if (!(prev->size & block_in_use)) {
+			remove_free(prev);
+			prev->size += block_size(b);
+			b = prev;
+		}
+	}
+
+	next_block(b)->prev_size = block_size(b);
+	insert_free(b);
+
+	large_lock.unlock();
+}
+
+/*
+ * Small allocations: objects of a fixed set of sizes, carved from spans that each hold objects of only one size, so
+ * that the objects themselves need no header.  Spans are taken from arenas, which are only ever used for spans, so
+ * whether a pointer is to a small object can be told from its address.
+ */
+
+struct free_object {
+	free_object *next;
+};
+
+static const u64 class_sizes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+static const int nr_classes = sizeof(class_sizes) / sizeof(class_sizes[0]);
+static const u64 max_small_size = 2048;
+
+// Maps a size, in units of 16 bytes (rounded up), to the smallest class that holds it.
+struct size_class_table {
+	u8 index[(max_small_size / 16) + 1];
+
+	constexpr size_class_table()
+		: index()
 	{
-		size_t orig_size = this->size;
-		this->size = size;
+		int c = 0;
+		for (u64 i = 0; i <= max_small_size / 16; i++) {
+			while (class_sizes[c] < i * 16) {
+				c++;
+			}
+
+			index[i] = c;
+		}
+	}
+};
+
+static constexpr size_class_table size_classes;
+
+static const u64 span_size = KB(64);
+static const u64 arena_size = MB(16);
+static const u64 spans_per_arena = arena_size / span_size;
+static const int max_arenas = 64;
+
+struct arena {
+	u64 base;
+	u64 next_span;
+	u8 span_class[spans_per_arena];
+};
+
+static mutex arena_lock;
+static arena arenas[max_arenas];
+static int nr_arenas;
+
+// Returns the class of the span a small object is in, or -1 if the pointer isn't in any arena.
+static int class_of(const void *ptr)
+{
+	int n = __atomic_load_n(&nr_arenas, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < n; i++) {
+		u64 offset = (u64)ptr - arenas[i].base;
+		if (offset < arena_size) {
+			return arenas[i].span_class[offset / span_size];
+		}
+	}
+
+	return -1;
+}
+
+static void *new_span(int size_class)
+{
+	arena_lock.lock();
+
+	arena *a = nr_arenas ? &arenas[nr_arenas - 1] : nullptr;
+	if (!a || a->next_span == spans_per_arena) {
+		if (nr_arenas == max_arenas) {
+			arena_lock.unlock();
+			return nullptr;
+		}
+
+		// Spans are aligned to their size, so the arena is over-allocated to make room.  Only the pages that are
+		// touched are ever populated, so the extra costs nothing.
+		u64 raw = (u64)kernel_alloc(arena_size + span_size);
+		if (!raw) {
+			arena_lock.unlock();
+			return nullptr;
+		}
 
-		memory_block *new_block = (memory_block *)((u64)this + size + sizeof(memory_block));
-		new_block->next = nullptr;
-		new_block->prev = nullptr;
-		new_block->size = orig_size - size;
+		a = &arenas[nr_arenas];
+		a->base = (raw + span_size - 1) & ~(span_size - 1);
+		a->next_span = 0;
 
-		return new_block;
+		__atomic_store_n(&nr_arenas, nr_arenas + 1, __ATOMIC_RELEASE);
 	}
 
-	void *ptr() { return (void *)((u64)this + sizeof(this)); }
+	u64 index = a->next_span++;
+	a->span_class[index] = size_class;
+
+	arena_lock.unlock();
+
+	count(counters.spans);
+	return (void *)(a->base + (index * span_size));
+}
+
+/*
+ * Each class has a shared bin of free objects, and each thread has a cache of free objects of each class in front of
+ * it, which is filled and emptied in batches.
+ */
+
+static const u32 cache_limit = 64;
+static const u32 cache_batch = 32;
+
+struct central_bin {
+	mutex lock;
+	free_object *head;
 };
 
-static void *allocate(size_t size)
+static central_bin central_bins[nr_classes];
+
+struct thread_cache {
+	free_object *head[nr_classes];
+	u32 count[nr_classes];
+};
+
+static thread_cache *current_cache()
 {
-	memory_block *candidate_block = free_list;
+	thread_block *tb = thread_block::current();
+
+	if (!tb->heap_cache) {
+		auto *cache = (thread_cache *)large_alloc(sizeof(thread_cache));
+		if (cache) {
+			memops::bzero(cache, sizeof(thread_cache));
+		}
 
-	while (candidate_block) {
-		if (candidate_block->size >= size) {
-			candidate_block->remove();
+		tb->heap_cache = cache;
+	}
 
-			if (candidate_block->size > (size - sizeof(memory_block))) {
-				memory_block *new_block = candidate_block->split(size);
-				new_block->insert();
-			}
+	return (thread_cache *)tb->heap_cache;
+}
+
+static bool refill(thread_cache *cache, int size_class)
+{
+	count(counters.cache_refills);
 
-			return candidate_block->ptr();
+	central_bin &bin = central_bins[size_class];
+
+	bin.lock.lock();
+	while (bin.head && cache->count[size_class] < cache_batch) {
+		free_object *o = bin.head;
+		bin.head = o->next;
+
+		o->next = cache->head[size_class];
+		cache->head[size_class] = o;
+		cache->count[size_class]++;
+	}
+	bin.lock.unlock();
+
+	if (cache->count[size_class]) {
+		return true;
+	}
+
+	// Nothing is free anywhere, so carve up a new span: a batch goes to this thread's cache, and the rest to the bin.
+	u8 *span = (u8 *)new_span(size_class);
+	if (!span) {
+		return false;
+	}
+
+	u64 size = class_sizes[size_class];
+	u64 nr_objects = span_size / size;
+	u64 to_cache = min((u64)cache_batch, nr_objects);
+
+	for (u64 i = 0; i < to_cache; i++) {
+		auto *o = (free_object *)(span + (i * size));
+		o->next = cache->head[size_class];
+		cache->head[size_class] = o;
+	}
+
+	cache->count[size_class] = to_cache;
+
+	if (to_cache < nr_objects) {
+		for (u64 i = to_cache; i < nr_objects - 1; i++) {
+			((free_object *)(span + (i * size)))->next = (free_object *)(span + ((i + 1) * size));
 		}
 
-		candidate_block = candidate_block->next;
+		auto *first = (free_object *)(span + (to_cache * size));
+		auto *last = (free_object *)(span + ((nr_objects - 1) * size));
+
+		bin.lock.lock();
+		last->next = bin.head;
+		bin.head = first;
+		bin.lock.unlock();
 	}
 
-	size_t new_size = max(0x1000ul, (size + sizeof(memory_block) + 0xfff) & ~0xfff);
-	auto alloc_result = stacsos::syscalls::alloc_mem(new_size);
-	if (alloc_result.code != stacsos::syscall_result_code::ok) {
+	return true;
+}
+
+// Moves objects from a thread's cache back to the bin, until only keep are left.
+static void flush(thread_cache *cache, int size_class, u32 keep)
+{
+	if (cache->count[size_class] <= keep) {
+		return;
+	}
+
+	count(counters.cache_flushes);
+
+	// The objects to move are all at the front of the list, so they can be spliced on to the bin in one go.
+	free_object *first = cache->head[size_class];
+	free_object *last = first;
+	for (u32 i = cache->count[size_class] - keep; i > 1; i--) {
+		last = last->next;
+	}
+
+	cache->head[size_class] = last->next;
+	cache->count[size_class] = keep;
+
+	central_bin &bin = central_bins[size_class];
+
+	bin.lock.lock();
+	last->next = bin.head;
+	bin.head = first;
+	bin.lock.unlock();
+}
+
+static void *small_alloc(u64 size)
+{
+	int size_class = size_classes.index[(size + 15) / 16];
+
+	thread_cache *cache = current_cache();
+	if (!cache) {
+		return nullptr;
+	}
+
+	if (!cache->head[size_class] && !refill(cache, size_class)) {
 		return nullptr;
 	}
 
-	candidate_block = (memory_block *)alloc_result.ptr;
-	candidate_block->next = nullptr;
-	candidate_block->prev = nullptr;
-	candidate_block->size = new_size - sizeof(memory_block);
+	free_object *o = cache->head[size_class];
+	cache->head[size_class] = o->next;
+	cache->count[size_class]--;
+
+	return o;
+}
+
+static void small_free(void *ptr, int size_class)
+{
+	thread_cache *cache = current_cache();
+
+	auto *o = (free_object *)ptr;
+
+	// Without a cache, which can only happen if it couldn't be allocated, the object goes straight to the bin.
+	if (!cache) {
+		central_bin &bin = central_bins[size_class];
+
+		bin.lock.lock();
+		o->next = bin.head;
+		bin.head = o;
+		bin.lock.unlock();
+
+		return;
+	}
+
+	o->next = cache->head[size_class];
+	cache->head[size_class] = o;
+
+	if (++cache->count[size_class] > cache_limit) {
+		flush(cache, size_class, cache_limit / 2);
+	}
+}
 
-	if (new_size > size) {
-		memory_block *new_block = candidate_block->split(size);
-		new_block->insert();
+static void *allocate(size_t size)
+{
+	if (size <= max_small_size) {
+		return small_alloc(size);
 	}
 
-	return candidate_block->ptr();
+	return large_alloc(size);
 }
 
 void free(void *ptr)
 {
-	//
+	if (!ptr) {
+		return;
+	}
+
+	int size_class = class_of(ptr);
+	if (size_class >= 0) {
+		small_free(ptr, size_class);
+	} else {
+		large_free(ptr);
+	}
+}
+
+heap::stats heap::get_stats()
+{
+	stats s;
+	s.kernel_allocations = __atomic_load_n(&counters.kernel_allocations, __ATOMIC_RELAXED);
+	s.kernel_bytes = __atomic_load_n(&counters.kernel_bytes, __ATOMIC_RELAXED);
+	s.spans = __atomic_load_n(&counters.spans, __ATOMIC_RELAXED);
+	s.cache_refills = __atomic_load_n(&counters.cache_refills, __ATOMIC_RELAXED);
+	s.cache_flushes = __atomic_load_n(&counters.cache_flushes, __ATOMIC_RELAXED);
+	s.large_allocations = __atomic_load_n(&counters.large_allocations, __ATOMIC_RELAXED);
+	s.direct_allocations = __atomic_load_n(&counters.direct_allocations, __ATOMIC_RELAXED);
+
+	return s;
+}
+
+void heap::release_thread_cache()
+{
+	thread_block *tb = thread_block::current();
+
+	auto *cache = (thread_cache *)tb->heap_cache;
+	if (!cache) {
+		return;
+	}
+
+	for (int c = 0; c < nr_classes; c++) {
+		flush(cache, c, 0);
+	}
+
+	tb->heap_cache = nullptr;
+	large_free(cache);
 }
 
 void *operator new(size_t size) { return allocate(size); }
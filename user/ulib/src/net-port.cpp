@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/net-port.h>
+#include <stacsos/objects.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+net_port *net_port::open(const char *path)
+{
+	object *o = object::open(path);
+	if (!o) {
+		return nullptr;
+	}
+
+	net_ring_info info;
+	if (o->ioctl(net_ioctl_info, &info, sizeof(info)) != sizeof(info)) {
+		delete o;
+		return nullptr;
+	}
+
+	auto ring = (net_ring_header *)o->mmap(0, info.size, mmap_flags::writable | mmap_flags::shared);
+	if (!ring) {
+		delete o;
+		return nullptr;
+	}
+
+	return new net_port(o, ring, info);
+}
+
+net_port::~net_port()
+{
+	// The queue pair is only given back once both the handle and the mapping have gone.
+	syscalls::munmap(ring_, info_.size);
+	delete o_;
+}
+
+bool net_port::next_received(net_packet_header *&packet, u32 &length)
+{
+	if (rx_next_ == __atomic_load_n(&ring_->rx_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	const net_ring_entry &entry = rx_[rx_next_ & (info_.rx_entries - 1)];
+	packet = (net_packet_header *)((u8 *)ring_ + entry.offset);
+	length = entry.length;
+
+	rx_next_++;
+	return true;
+}
+
+net_packet_header *net_port::send_buffer()
+{
+	u32 tail = ring_->tx_tail;
+	if (tail - __atomic_load_n(&ring_->tx_done, __ATOMIC_ACQUIRE) >= info_.tx_entries) {
+		return nullptr;
+	}
+
+	return (net_packet_header *)((u8 *)ring_ + info_.tx_area_offset + ((u64)(tail & (info_.tx_entries - 1)) * tx_buffer_size_));
+}
+
+void net_port::queue_send(u32 length)
+{
+	u32 tail = ring_->tx_tail;
+	u32 slot = tail & (info_.tx_entries - 1);
+
+	net_ring_entry &entry = tx_[slot];
+	entry.offset = (u32)(info_.tx_area_offset + ((u64)slot * tx_buffer_size_));
+	entry.length = length;
+
+	__atomic_store_n(&ring_->tx_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+u32 net_port::enter(u32 min_received) { return (u32)o_->ioctl(net_ioctl_enter, &min_received, sizeof(min_received)); }
+
+u64 net_port::handle() const { return o_->handle(); }
@@ -10,9 +10,31 @@
 
 using namespace stacsos;
 
-object *object::open(const char *path)
+object *object::open(const char *path, open_flags flags)
 {
-	auto result = syscalls::open(path);
+	auto result = syscalls::open(path, flags);
+	if (result.code != syscall_result_code::ok) {
+		return nullptr;
+	}
+
+	return new object(result.id);
+}
+
+bool object::create_pipe(object *&read_end, object *&write_end)
+{
+	u64 handles[2];
+	if (syscalls::create_pipe(handles) != syscall_result_code::ok) {
+		return false;
+	}
+
+	read_end = new object(handles[0]);
+	write_end = new object(handles[1]);
+	return true;
+}
+
+object *object::create_shared_memory(u64 size)
+{
+	auto result = syscalls::shm_create(size);
 	if (result.code != syscall_result_code::ok) {
 		return nullptr;
 	}
@@ -26,4 +48,35 @@ size_t object::read(void *buffer, size_t length) { return syscalls::read(handle_
 size_t object::write(const void *buffer, size_t length) { return syscalls::write(handle_, buffer, length).length; }
 size_t object::pwrite(const void *buffer, size_t length, size_t offset) { return syscalls::pwrite(handle_, buffer, length, offset).length; }
 size_t object::pread(void *buffer, size_t length, size_t offset) { return syscalls::pread(handle_, buffer, length, offset).length; }
+size_t object::readv(const iovec *iov, size_t count) { return syscalls::readv(handle_, iov, count).length; }
+size_t object::preadv(const iovec *iov, size_t count, size_t offset) { return syscalls::preadv(handle_, iov, count, offset).length; }
+size_t object::writev(const iovec *iov, size_t count) { return syscalls::writev(handle_, iov, count).length; }
+size_t object::pwritev(const iovec *iov, size_t count, size_t offset) { return syscalls::pwritev(handle_, iov, count, offset).length; }
 u64 object::ioctl(u64 cmd, void *buffer, size_t length) { return syscalls::ioctl(handle_, cmd, buffer, length).length; }
+
+size_t object::copy_to(object *dst, size_t offset, size_t length) { return syscalls::copy_object(handle_, dst->handle_, offset, length).length; }
+bool object::fsync() { return syscalls::fsync(handle_) == syscall_result_code::ok; }
+bool object::truncate(u64 size) { return syscalls::truncate(handle_, size) == syscall_result_code::ok; }
+bool object::advise(u64 offset, u64 length, access_advice advice) { return syscalls::advise(handle_, offset, length, advice) == syscall_result_code::ok; }
+
+bool object::size(u64 &size)
+{
+	auto result = syscalls::get_size(handle_);
+	if (result.code != syscall_result_code::ok) {
+		return false;
+	}
+
+	size = result.data;
+	return true;
+}
+size_t object::readdir(void *buffer, size_t length) { return syscalls::readdir(handle_, buffer, length).length; }
+
+void *object::mmap(size_t offset, size_t length, mmap_flags flags)
+{
+	auto result = syscalls::mmap(handle_, offset, length, flags);
+	if (result.code != syscall_result_code::ok) {
+		return nullptr;
+	}
+
+	return result.ptr;
+}
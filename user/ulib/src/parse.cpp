@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/parse.h>
+
+using namespace stacsos;
+
+bool stacsos::parse_u64(const char *&p, u64 &value)
+{
+	value = 0;
+
+	if (!p) {
+		return false;
+	}
+
+	while (*p == ' ') {
+		p++;
+	}
+
+	const char *digits = p;
+	while (*p >= '0' && *p <= '9') {
+		u64 digit = *p - '0';
+		if (value > (~0ull - digit) / 10) {
+			value = 0;
+			p = digits;
+			return false;
+		}
+
+		value = (value * 10) + digit;
+		p++;
+	}
+
+	return p != digits;
+}
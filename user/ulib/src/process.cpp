@@ -5,20 +5,130 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/console.h>
+#include <stacsos/objects.h>
 #include <stacsos/process.h>
+#include <stacsos/threads.h>
 #include <stacsos/user-syscall.h>
 
 using namespace stacsos;
 
-process *process::create(const char *path, const char *args)
+const process_start_info *process::start_info_;
+
+static bool spawn(const char *path, const char *args, object *input, object *output, object *const *inherited, u64 nr_inherited, spawn_flags flags, u64 &handle)
 {
-	auto rc = syscalls::start_process(path, args);
+	if (nr_inherited > SPAWN_MAX_HANDLES) {
+		return false;
+	}
+
+	// The new process is given this one's streams, unless it is told otherwise, so it never has to open the console
+	// itself.
+	if (!input) {
+		input = console::get().input();
+	}
+
+	if (!output) {
+		output = console::get().output();
+	}
+
+	// Whatever has been written so far should come out before anything the new process writes.
+	console::get().flush();
 
+	spawn_params params { { input->handle(), output->handle() }, flags, nr_inherited, {} };
+	for (u64 i = 0; i < nr_inherited; i++) {
+		params.handles[i] = inherited[i]->handle();
+	}
+
+	auto rc = syscalls::spawn(path, args, &params);
 	if (rc.code != syscall_result_code::ok) {
+		return false;
+	}
+
+	handle = rc.data;
+	return true;
+}
+
+process *process::create(const char *path, const char *args, object *input, object *output, object *const *inherited, u64 nr_inherited)
+{
+	u64 handle;
+	if (!spawn(path, args, input, output, inherited, nr_inherited, spawn_flags::none, handle)) {
 		return nullptr;
 	}
 
-	return new process(rc.data);
+	return new process(handle);
+}
+
+bool process::run(const char *path, const char *args, object *input, object *output, bool new_group)
+{
+	u64 handle;
+	return spawn(path, args, input, output, nullptr, 0, new_group ? spawn_flags::wait | spawn_flags::new_group : spawn_flags::wait, handle);
 }
 
+struct clone_context {
+	process::clone_fn fn;
+	void *arg;
+};
+
+static void clone_entry_proc(const clone_context *cc)
+{
+	// The copy's memory was taken while the context was on the stack of the thread that made it, so it is still there.
+	thread_block::install(__builtin_alloca(thread_block::storage_size()));
+
+	int rc = cc->fn(cc->arg);
+	console::get().flush();
+
+	syscalls::exit((u64)rc);
+	while (1) { }
+
+	__unreachable();
+}
+
+process *process::clone(clone_fn fn, void *arg)
+{
+	// Anything still buffered would otherwise come out twice.
+	console::get().flush();
+
+	clone_context cc { fn, arg };
+
+	auto r = syscalls::clone_process((void *)clone_entry_proc, &cc);
+	if (r.code != syscall_result_code::ok) {
+		return nullptr;
+	}
+
+	return new process(r.data);
+}
+
+bool process::set_limit(resource_type type, u64 limit, resource_scope scope)
+{
+	return syscalls::set_resource_limit(type, scope, limit).code == syscall_result_code::ok;
+}
+
+u64 process::usage(resource_type type, resource_scope scope) { return syscalls::set_resource_limit(type, scope, RESOURCE_UNLIMITED).data; }
+
+bool process::set_gang_scheduling(bool enabled) { return syscalls::set_gang_scheduling(enabled) == syscall_result_code::ok; }
+
+u64 process::nr_inherited_handles() { return start_info_ ? start_info_->nr_handles : 0; }
+
+object *process::inherited_handle(u64 index)
+{
+	if (index >= nr_inherited_handles()) {
+		return nullptr;
+	}
+
+	return object::from_handle(start_info_->handles[index]);
+}
+
+process::~process() { syscalls::close(handle_); }
+
 void process::wait_for_exit() { syscalls::wait_process(handle_); }
+
+bool process::has_exited()
+{
+	wait_entry e { handle_, 0 };
+	return syscalls::wait_many(&e, 1, 0).code == syscall_result_code::ok;
+}
+
+bool process::cpu_times(process_cpu_times &times)
+{
+	return syscalls::ioctl(handle_, (u64)process_ioctl::cpu_times, &times, sizeof(times)).code == syscall_result_code::ok;
+}
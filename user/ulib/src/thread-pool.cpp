@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: MIT */
+
+/* StACSOS - userspace standard library
+ *
+ * Copyright (c) University of St Andrews 2024
+ * Tom Spink <tcs6@st-andrews.ac.uk>
+ */
+#include <stacsos/clock.h>
+#include <stacsos/thread-pool.h>
+#include <stacsos/user-syscall.h>
+
+using namespace stacsos;
+
+struct thread_pool::worker {
+	thread_pool *pool;
+	thread *thr;
+
+	// For choosing which worker to steal from first.
+	u64 rng;
+
+	chase_lev_deque<pool_task *, 1024> deque;
+};
+
+// The worker that the calling thread is, if it belongs to a pool.
+static thread_local thread_pool::worker *this_worker;
+
+// How many times an idle worker looks for work before it goes to sleep.
+static const u32 spin_limit = 128;
+
+thread_pool::thread_pool(u32 nr_workers)
+	: nr_workers_(nr_workers ? nr_workers : max(clock_nr_cores(), 1u))
+	, injected_head_(nullptr)
+	, injected_tail_(nullptr)
+	, nr_injected_(0)
+	, work_seq_(0)
+	, sleepers_(0)
+	, stopping_(false)
+{
+	workers_ = new worker *[nr_workers_];
+
+	// Every worker exists before any of them starts, as they steal from each other straight away.
+	for (u32 i = 0; i < nr_workers_; i++) {
+		workers_[i] = new worker { this, nullptr, (u64)i * 0x9e3779b97f4a7c15ull + 1 };
+	}
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		workers_[i]->thr = thread::start(worker_main, workers_[i]);
+	}
+}
+
+thread_pool::~thread_pool()
+{
+	__atomic_store_n(&stopping_, true, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&work_seq_, 1, __ATOMIC_SEQ_CST);
+	syscalls::futex_wake(&work_seq_, 0xffffffff);
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		if (workers_[i]->thr) {
+			workers_[i]->thr->join();
+			delete workers_[i]->thr;
+		}
+
+		delete workers_[i];
+	}
+
+	delete[] workers_;
+}
+
+thread_pool::worker *thread_pool::current_worker() const
+{
+	worker *w = this_worker;
+	return (w && w->pool == this) ? w : nullptr;
+}
+
+void thread_pool::submit(pool_task *task)
+{
+	worker *w = current_worker();
+
+	if (w) {
+		// A full deque means there is already plenty of work queued, so the task is just run now.
+		if (!w->deque.push(task)) {
+			execute(task);
+			return;
+		}
+	} else {
+		injected_lock_.lock();
+
+		if (injected_tail_) {
+			injected_tail_->next = task;
+		} else {
+			injected_head_ = task;
+		}
+
+		injected_tail_ = task;
+		__atomic_add_fetch(&nr_injected_, 1, __ATOMIC_SEQ_CST);
+
+		injected_lock_.unlock();
+	}
+
+	notify();
+}
+
+void thread_pool::notify()
+{
+	__atomic_add_fetch(&work_seq_, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST)) {
+		syscalls::futex_wake(&work_seq_, 1);
+	}
+}
+
+pool_task *thread_pool::find_task(worker *self)
+{
+	pool_task *task;
+
+	if (self && self->deque.pop(task)) {
+		return task;
+	}
+
+	if (__atomic_load_n(&nr_injected_, __ATOMIC_SEQ_CST)) {
+		injected_lock_.lock();
+
+		task = injected_head_;
+		if (task) {
+			injected_head_ = task->next;
+			if (!injected_head_) {
+				injected_tail_ = nullptr;
+			}
+
+			__atomic_sub_fetch(&nr_injected_, 1, __ATOMIC_SEQ_CST);
+		}
+
+		injected_lock_.unlock();
+
+		if (task) {
+			return task;
+		}
+	}
+
+	// Victims are tried from a random starting point, so that thieves don't all converge on the same worker.
+	u32 start = 0;
+	if (self) {
+		self->rng ^= self->rng << 13;
+		self->rng ^= self->rng >> 7;
+		self->rng ^= self->rng << 17;
+		start = self->rng % nr_workers_;
+	}
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		worker *victim = workers_[(start + i) % nr_workers_];
+		if (victim == self) {
+			continue;
+		}
+
+		if (victim->deque.steal(task)) {
+			return task;
+		}
+	}
+
+	return nullptr;
+}
+
+bool thread_pool::has_work() const
+{
+	if (__atomic_load_n(&nr_injected_, __ATOMIC_SEQ_CST)) {
+		return true;
+	}
+
+	for (u32 i = 0; i < nr_workers_; i++) {
+		if (!workers_[i]->deque.empty()) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void thread_pool::execute(pool_task *task)
+{
+	// The task frees itself, so its group is read first.
+	task_group *group = task->group;
+	task->run(task);
+	group->task_done();
+}
+
+bool thread_pool::run_one()
+{
+	pool_task *task = find_task(current_worker());
+	if (!task) {
+		return false;
+	}
+
+	execute(task);
+	return true;
+}
+
+void *thread_pool::worker_main(void *arg)
+{
+	worker *self = (worker *)arg;
+	thread_pool *pool = self->pool;
+
+	this_worker = self;
+
+	u32 spins = 0;
+	while (true) {
+		pool_task *task = pool->find_task(self);
+		if (task) {
+			pool->execute(task);
+			spins = 0;
+			continue;
+		}
+
+		if (__atomic_load_n(&pool->stopping_, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+
+		if (++spins < spin_limit) {
+			__relax();
+			continue;
+		}
+
+		// The sequence number is read before looking for work one last time, so that work submitted after the look
+		// changes it, and the futex doesn't sleep.
+		u32 seq = __atomic_load_n(&pool->work_seq_, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&pool->sleepers_, 1, __ATOMIC_SEQ_CST);
+
+		if (!pool->has_work() && !__atomic_load_n(&pool->stopping_, __ATOMIC_SEQ_CST)) {
+			syscalls::futex_wait(&pool->work_seq_, seq);
+		}
+
+		__atomic_sub_fetch(&pool->sleepers_, 1, __ATOMIC_SEQ_CST);
+		spins = 0;
+	}
+
+	this_worker = nullptr;
+	return nullptr;
+}
+
+void task_group::wait()
+{
+	u32 spins = 0;
+
+	while (true) {
+		u32 pending = __atomic_load_n(&pending_, __ATOMIC_SEQ_CST);
+		if (!(pending & ~waiting)) {
+			__atomic_and_fetch(&pending_, ~waiting, __ATOMIC_SEQ_CST);
+			return;
+		}
+
+		if (pool_.run_one()) {
+			spins = 0;
+			continue;
+		}
+
+		if (++spins < spin_limit) {
+			__relax();
+			continue;
+		}
+
+		// The last task to finish only wakes the group's waiter if it has said it is going to sleep, and the futex
+		// doesn't sleep if a task has finished in between.
+		if (!(pending & waiting)) {
+			if (!__atomic_compare_exchange_n(&pending_, &pending, pending | waiting, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				continue;
+			}
+
+			pending |= waiting;
+		}
+
+		syscalls::futex_wait(&pending_, pending);
+		spins = 0;
+	}
+}
+
+void task_group::task_done()
+{
+	// Once the count reaches zero, the waiter may return and the group may be gone, so nothing but the futex may be
+	// touched after the decrement.
+	if (__atomic_fetch_sub(&pending_, 1, __ATOMIC_SEQ_CST) == (waiting | 1)) {
+		syscalls::futex_wake(&pending_, 0xffffffff);
+	}
+}
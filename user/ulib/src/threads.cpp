@@ -5,14 +5,53 @@
  * Copyright (c) University of St Andrews 2024
  * Tom Spink <tcs6@st-andrews.ac.uk>
  */
+#include <stacsos/console.h>
+#include <stacsos/heap.h>
+#include <stacsos/memops.h>
 #include <stacsos/threads.h>
 #include <stacsos/user-syscall.h>
 
 using namespace stacsos;
 
+static process_tls tls_layout;
+
+void thread_block::init_tls(const process_tls &tls) { tls_layout = tls; }
+
+// The thread-local variables are rounded up to their alignment, which the block FS points to must also have.
+static u64 tls_align() { return max(tls_layout.align, (u64)alignof(thread_block)); }
+static u64 tls_size() { return (tls_layout.size + tls_align() - 1) & ~(tls_align() - 1); }
+
+size_t thread_block::storage_size() { return tls_size() + sizeof(thread_block) + tls_align(); }
+
+thread_block *thread_block::install(void *storage)
+{
+	// As the x86-64 ABI lays them out, a thread's variables come immediately before the block that FS points to, and
+	// the code reaches them at fixed negative offsets from FS.
+	u64 align = tls_align();
+	u8 *tp = (u8 *)(((u64)storage + tls_size() + align - 1) & ~(align - 1));
+	u8 *vars = tp - tls_size();
+
+	memops::memcpy(vars, (const void *)tls_layout.image, tls_layout.image_size);
+	memops::memset(vars + tls_layout.image_size, 0, tls_size() - tls_layout.image_size);
+
+	thread_block *tb = (thread_block *)tp;
+	tb->self = tb;
+	tb->heap_cache = nullptr;
+	tb->futex_tid = 0;
+
+	syscalls::set_fs((u64)tb);
+	return tb;
+}
+
 static void thread_entry_proc(thread_context *tc)
 {
+	// The thread block and variables live on the thread's own stack, which lasts as long as the thread does.
+	thread_block::install(__builtin_alloca(thread_block::storage_size()));
+
 	tc->result_ = tc->ep_(tc->arg_);
+	console::get().flush();
+
+	heap::release_thread_cache();
 	syscalls::stop_current_thread();
 }
 
@@ -28,8 +67,116 @@ thread *thread::start(thread_entry_fn ep, void *arg)
 	return new thread(r.data, tc);
 }
 
+u64 thread::start_many(thread_entry_fn ep, void **args, thread **threads, u64 count)
+{
+	auto tcs = new thread_context *[count];
+	auto ids = new u64[count];
+
+	for (u64 i = 0; i < count; i++) {
+		tcs[i] = new thread_context { ep, args[i], nullptr };
+	}
+
+	auto r = syscalls::start_threads(count, (void *)thread_entry_proc, (void **)tcs, ids);
+
+	u64 started = r.code == syscall_result_code::ok ? r.data : 0;
+	for (u64 i = 0; i < count; i++) {
+		if (i < started) {
+			threads[i] = new thread(ids[i], tcs[i]);
+		} else {
+			threads[i] = nullptr;
+			delete tcs[i];
+		}
+	}
+
+	delete[] tcs;
+	delete[] ids;
+
+	return started;
+}
+
 void *thread::join()
 {
 	auto r = syscalls::join_thread(handle_);
 	return tc_->result_;
 }
+
+bool thread::set_affinity(u64 core_mask) { return syscalls::set_affinity(handle_, core_mask) == syscall_result_code::ok; }
+
+bool thread::set_priority(sched_policy policy, int priority)
+{
+	return syscalls::set_priority(handle_, policy, priority) == syscall_result_code::ok;
+}
+
+bool thread::set_reservation(u64 runtime_us, u64 period_us)
+{
+	return syscalls::set_reservation(handle_, runtime_us, period_us) == syscall_result_code::ok;
+}
+
+void mutex::lock_slow()
+{
+	// Mark the mutex as contended before sleeping, so that the owner knows to wake us.
+	while (__atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE) != 0) {
+		syscalls::futex_wait(&state_, 2);
+	}
+}
+
+void mutex::unlock_slow() { syscalls::futex_wake(&state_, 1); }
+
+void pi_mutex::lock_slow()
+{
+	auto r = syscalls::futex_lock_pi(&state_);
+	if (r.code == syscall_result_code::ok) {
+		thread_block::current()->futex_tid = (u32)r.data;
+	}
+}
+
+void pi_mutex::unlock_slow() { syscalls::futex_unlock_pi(&state_); }
+
+void condvar::wait(mutex &mtx)
+{
+	u32 seq = __atomic_load_n(&seq_, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&waiters_, 1, __ATOMIC_SEQ_CST);
+	mtx.unlock();
+
+	syscalls::futex_wait(&seq_, seq);
+
+	__atomic_sub_fetch(&waiters_, 1, __ATOMIC_SEQ_CST);
+	mtx.lock();
+}
+
+void condvar::notify_one()
+{
+	__atomic_add_fetch(&seq_, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&waiters_, __ATOMIC_SEQ_CST)) {
+		syscalls::futex_wake(&seq_, 1);
+	}
+}
+
+void condvar::notify_all()
+{
+	__atomic_add_fetch(&seq_, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&waiters_, __ATOMIC_SEQ_CST)) {
+		syscalls::futex_wake(&seq_, 0xffffffff);
+	}
+}
+
+void semaphore::acquire()
+{
+	while (!try_acquire()) {
+		__atomic_add_fetch(&waiters_, 1, __ATOMIC_SEQ_CST);
+		syscalls::futex_wait(&count_, 0);
+		__atomic_sub_fetch(&waiters_, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void semaphore::release()
+{
+	__atomic_add_fetch(&count_, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&waiters_, __ATOMIC_SEQ_CST)) {
+		syscalls::futex_wake(&count_, 1);
+	}
+}